@@ -9,9 +9,25 @@
 #include "mcp_server.h"
 #include "assets.h"
 #include "settings.h"
+#include "json_arena.h"
+#include "transport_profile.h"
+#include "boot_sequence.h"
+#include "cpu_sampler.h"
+#include "power_policy.h"
+#include "network_power_policy.h"
+#include "performance_profile.h"
+#include "heap_accounting.h"
+#include "task_placement.h"
+#include "trace_recorder.h"
+#include "session_capture.h"
+#include "telemetry.h"
+#include "black_box.h"
 
 #include <cstring>
+#include <cctype>
+#include <algorithm>
 #include <esp_log.h>
+#include <freertos/semphr.h>
 #include <cJSON.h>
 #include <driver/gpio.h>
 #include <arpa/inet.h>
@@ -35,6 +51,13 @@ static const char* const STATE_STRINGS[] = {
     "invalid_state"
 };
 
+const char* Application::GetDeviceStateName(DeviceState state) {
+    if (state < kDeviceStateUnknown || state > kDeviceStateFatalError) {
+        return STATE_STRINGS[kDeviceStateFatalError + 1];
+    }
+    return STATE_STRINGS[state];
+}
+
 Application::Application() {
     event_group_ = xEventGroupCreate();
 
@@ -47,28 +70,20 @@ Application::Application() {
 #else
     aec_mode_ = kAecOff;
 #endif
-
-    esp_timer_create_args_t clock_timer_args = {
-        .callback = [](void* arg) {
-            Application* app = (Application*)arg;
-            xEventGroupSetBits(app->event_group_, MAIN_EVENT_CLOCK_TICK);
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "clock_timer",
-        .skip_unhandled_events = true
-    };
-    esp_timer_create(&clock_timer_args, &clock_timer_handle_);
 }
 
 Application::~Application() {
-    if (clock_timer_handle_ != nullptr) {
-        esp_timer_stop(clock_timer_handle_);
-        esp_timer_delete(clock_timer_handle_);
-    }
     vEventGroupDelete(event_group_);
 }
 
+bool Application::HasPendingAssetsDownload() {
+    if (!Assets::GetInstance().partition_valid()) {
+        return false;
+    }
+    Settings settings("assets", false);
+    return !settings.GetString("download_url").empty();
+}
+
 void Application::CheckAssetsVersion() {
     auto& board = Board::GetInstance();
     auto display = board.GetDisplay();
@@ -83,6 +98,16 @@ void Application::CheckAssetsVersion() {
     // Check if there is a new assets need to be downloaded
     std::string download_url = settings.GetString("download_url");
 
+    if (!download_url.empty() && assets.staging_available()) {
+        settings.EraseKey("download_url");
+        // The current bundle stays in use while the new one downloads into the other slot
+        assets.Apply();
+        display->PostChatMessage("system", "");
+        display->PostEmotion("microchip_ai");
+        DownloadStagedAssets(download_url);
+        return;
+    }
+
     if (!download_url.empty()) {
         settings.EraseKey("download_url");
 
@@ -93,18 +118,17 @@ void Application::CheckAssetsVersion() {
         // Wait for the audio service to be idle for 3 seconds
         vTaskDelay(pdMS_TO_TICKS(3000));
         SetDeviceState(kDeviceStateUpgrading);
-        board.SetPowerSaveMode(false);
-        display->SetChatMessage("system", Lang::Strings::PLEASE_WAIT);
+        NetworkPowerPolicy::GetInstance().SetTransferring(true);
+        display->PostChatMessage("system", Lang::Strings::PLEASE_WAIT);
 
         bool success = assets.Download(download_url, [display](int progress, size_t speed) -> void {
-            std::thread([display, progress, speed]() {
-                char buffer[32];
-                snprintf(buffer, sizeof(buffer), "%d%% %uKB/s", progress, speed / 1024);
-                display->SetChatMessage("system", buffer);
-            }).detach();
+            // Posted, the download does not wait for the display
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%d%% %uKB/s", progress, speed / 1024);
+            display->PostChatMessage("system", buffer);
         });
 
-        board.SetPowerSaveMode(true);
+        NetworkPowerPolicy::GetInstance().SetTransferring(false);
         vTaskDelay(pdMS_TO_TICKS(1000));
 
         if (!success) {
@@ -116,9 +140,91 @@ void Application::CheckAssetsVersion() {
 
     // Apply assets
     assets.Apply();
-    display->SetChatMessage("system", "");
-    display->SetEmotion("microchip_ai");
+    display->PostChatMessage("system", "");
+    display->PostEmotion("microchip_ai");
+}
+
+void Application::DownloadStagedAssets(std::string url) {
+    Assets::GetInstance().DownloadAsync(std::move(url), nullptr, [this](bool success) {
+        Schedule([this, success]() {
+            if (success) {
+                ApplyStagedAssets();
+            } else {
+                auto display = Board::GetInstance().GetDisplay();
+                display->PostNotification(Lang::Strings::DOWNLOAD_ASSETS_FAILED);
+            }
+        });
+    });
+}
+
+// Runs in the main loop, the switch waits for the device to be idle
+void Application::ApplyStagedAssets() {
+    auto& assets = Assets::GetInstance();
+    if (!assets.has_staged()) {
+        return;
+    }
+    if (device_state_ != kDeviceStateIdle) {
+        ScheduleAfter(5000, [this]() {
+            ApplyStagedAssets();
+        });
+        return;
+    }
+    ESP_LOGI(TAG, "Switching to the downloaded assets");
+    assets.Apply();
+}
+
+#if CONFIG_OTA_BACKGROUND_DOWNLOAD
+// Full speed while idle, the conversation gets the network and the flash otherwise
+static size_t BackgroundUpgradeRate(DeviceState state) {
+    return state == kDeviceStateIdle ? 0 : CONFIG_OTA_BACKGROUND_BUSY_RATE_KB * 1024;
+}
+
+bool Application::StartBackgroundUpgrade(Ota& ota) {
+    if (background_ota_) {
+        // The activation loop checks the version again
+        return true;
+    }
+    ESP_LOGI(TAG, "Downloading firmware %s in the background", ota.GetFirmwareVersion().c_str());
+    background_ota_ = ota.CloneUpgrade();
+    background_ota_->SetRateLimit(BackgroundUpgradeRate(device_state_));
+    NetworkPowerPolicy::GetInstance().SetTransferring(true);
+    bool started = background_ota_->StartBackgroundUpgrade([this](bool success) {
+        Schedule([this, success]() {
+            NetworkPowerPolicy::GetInstance().SetTransferring(false);
+            if (!success) {
+                // The next version check tries again
+                ESP_LOGE(TAG, "Background firmware download failed");
+                background_ota_.reset();
+                return;
+            }
+            ApplyBackgroundUpgrade();
+        });
+    });
+    if (!started) {
+        NetworkPowerPolicy::GetInstance().SetTransferring(false);
+        background_ota_.reset();
+    }
+    return started;
+}
+
+// Runs in the main loop, the switch waits for the device to be idle for a while
+void Application::ApplyBackgroundUpgrade() {
+    if (device_state_ != kDeviceStateIdle || clock_ticks_ < CONFIG_OTA_BACKGROUND_IDLE_SECONDS) {
+        ScheduleAfter(5000, [this]() {
+            ApplyBackgroundUpgrade();
+        });
+        return;
+    }
+    if (!background_ota_->ActivateUpgrade()) {
+        background_ota_.reset();
+        return;
+    }
+    ESP_LOGI(TAG, "Rebooting into the downloaded firmware");
+    auto display = Board::GetInstance().GetDisplay();
+    display->PostChatMessage("system", Lang::Strings::UPGRADING);
+    Reboot();
 }
+#endif
 
 void Application::CheckNewVersion(Ota& ota) {
     const int MAX_RETRY = 10;
@@ -129,7 +235,7 @@ void Application::CheckNewVersion(Ota& ota) {
     while (true) {
         SetDeviceState(kDeviceStateActivating);
         auto display = board.GetDisplay();
-        display->SetStatus(Lang::Strings::CHECKING_NEW_VERSION);
+        display->PostStatus(Lang::Strings::CHECKING_NEW_VERSION);
 
         if (!ota.CheckVersion()) {
             retry_count++;
@@ -156,21 +262,36 @@ void Application::CheckNewVersion(Ota& ota) {
         retry_delay = 10; // 重置重试延迟时间
 
         if (ota.HasNewVersion()) {
+#if CONFIG_OTA_BACKGROUND_DOWNLOAD
+            // The boot goes on, the device reboots into the new version at an idle moment
+            if (!StartBackgroundUpgrade(ota) && UpgradeFirmware(ota)) {
+                return;
+            }
+#else
             if (UpgradeFirmware(ota)) {
                 return; // This line will never be reached after reboot
             }
+#endif
             // If upgrade failed, continue to normal operation (don't break, just fall through)
         }
 
         // No new version, mark the current version as valid
+#if CONFIG_USE_OTA_PROBATION
+        // A new image has to pass its probation first
+        probation_due_ = ota.IsPendingVerify();
+        if (!probation_due_) {
+            ota.MarkCurrentVersionValid();
+        }
+#else
         ota.MarkCurrentVersionValid();
+#endif
         if (!ota.HasActivationCode() && !ota.HasActivationChallenge()) {
             xEventGroupSetBits(event_group_, MAIN_EVENT_CHECK_NEW_VERSION_DONE);
             // Exit the loop if done checking new version
             break;
         }
 
-        display->SetStatus(Lang::Strings::ACTIVATION);
+        display->PostStatus(Lang::Strings::ACTIVATION);
         // Activation code is shown to the user and waiting for the user to input
         if (ota.HasActivationCode()) {
             ShowActivationCode(ota.GetActivationCode(), ota.GetActivationMessage());
@@ -228,9 +349,9 @@ void Application::ShowActivationCode(const std::string& code, const std::string&
 void Application::Alert(const char* status, const char* message, const char* emotion, const std::string_view& sound) {
     ESP_LOGW(TAG, "Alert [%s] %s: %s", emotion, status, message);
     auto display = Board::GetInstance().GetDisplay();
-    display->SetStatus(status);
-    display->SetEmotion(emotion);
-    display->SetChatMessage("system", message);
+    display->PostStatus(status);
+    display->PostEmotion(emotion);
+    display->PostChatMessage("system", message);
     if (!sound.empty()) {
         audio_service_.PlaySound(sound);
     }
@@ -239,9 +360,9 @@ void Application::Alert(const char* status, const char* message, const char* emo
 void Application::DismissAlert() {
     if (device_state_ == kDeviceStateIdle) {
         auto display = Board::GetInstance().GetDisplay();
-        display->SetStatus(Lang::Strings::STANDBY);
-        display->SetEmotion("neutral");
-        display->SetChatMessage("system", "");
+        display->PostStatus(Lang::Strings::STANDBY);
+        display->PostEmotion("neutral");
+        display->PostChatMessage("system", "");
     }
 }
 
@@ -268,21 +389,21 @@ void Application::ToggleChatState() {
         Schedule([this]() {
             if (!protocol_->IsAudioChannelOpened()) {
                 SetDeviceState(kDeviceStateConnecting);
-                if (!protocol_->OpenAudioChannel()) {
+                if (!OpenAudioChannel()) {
                     return;
                 }
             }
 
             SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
-        });
+        }, kSchedulePriorityHigh);
     } else if (device_state_ == kDeviceStateSpeaking) {
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
-        });
+        }, kSchedulePriorityHigh);
     } else if (device_state_ == kDeviceStateListening) {
         Schedule([this]() {
             protocol_->CloseAudioChannel();
-        });
+        }, kSchedulePriorityHigh);
     }
 }
 
@@ -305,18 +426,18 @@ void Application::StartListening() {
         Schedule([this]() {
             if (!protocol_->IsAudioChannelOpened()) {
                 SetDeviceState(kDeviceStateConnecting);
-                if (!protocol_->OpenAudioChannel()) {
+                if (!OpenAudioChannel()) {
                     return;
                 }
             }
 
             SetListeningMode(kListeningModeManualStop);
-        });
+        }, kSchedulePriorityHigh);
     } else if (device_state_ == kDeviceStateSpeaking) {
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
             SetListeningMode(kListeningModeManualStop);
-        });
+        }, kSchedulePriorityHigh);
     }
 }
 
@@ -342,10 +463,15 @@ void Application::StopListening() {
             protocol_->SendStopListening();
             SetDeviceState(kDeviceStateIdle);
         }
-    });
+    }, kSchedulePriorityHigh);
 }
 
 void Application::Start() {
+    // Before any protocol or MCP message is parsed
+    JsonArena::Install();
+    // Saves the record of the previous boot before the first state change overwrites it
+    BlackBox::GetInstance().Start();
+
     auto& board = Board::GetInstance();
     SetDeviceState(kDeviceStateStarting);
 
@@ -353,10 +479,102 @@ void Application::Start() {
     auto display = board.GetDisplay();
 
     // Print board name/version info
-    display->SetChatMessage("system", SystemInfo::GetUserAgent().c_str());
+    display->PostChatMessage("system", SystemInfo::GetUserAgent().c_str());
 
+    // Start the main event loop task
+    TaskPlacements::Create(kTaskMainEventLoop, [](void* arg) {
+        ((Application*)arg)->MainEventLoop();
+        vTaskDelete(NULL);
+    }, this, &main_event_loop_task_handle_);
+    loop_profiler_.Start();
+    CpuSampler::GetInstance().Start();
+
+    /* Start the clock timer to update the status bar */
+    ScheduleEvery(1000, [this]() {
+        OnClockTick();
+    });
+
+    /*
+     * The network chain (network, OTA check, protocol) runs in this task. The local resources
+     * are prepared meanwhile by the boot worker: the MCP tools, the assets mapping and fonts
+     * while Wi-Fi associates, and the wake word model while the OTA check waits for the server.
+     * The assets wait for the audio service, which gets the wake word models from them.
+     * A pending assets download needs the network and shows its progress, so it runs in the
+     * network chain before the OTA check instead.
+     */
+    Ota ota;
+    bool protocol_started = false;
+    bool assets_download = HasPendingAssetsDownload();
+    BootSequence boot;
+    int audio = boot.AddStep("audio", kBootLaneMain, {}, [this, &board]() {
+        InitializeAudio(board.GetAudioCodec());
+    });
+    int mcp = boot.AddStep("mcp", kBootLaneWorker, {}, []() {
+        // Add MCP common tools before initializing the protocol
+        auto& mcp_server = McpServer::GetInstance();
+        mcp_server.AddCommonTools();
+        mcp_server.AddUserOnlyTools();
+    });
+    int network = boot.AddStep("network", kBootLaneMain, {}, [&board, display]() {
+        /* Wait for the network to be ready */
+        board.StartNetwork();
+        TraceRecorder::GetInstance().Start();
+        SessionCapture::GetInstance().Start();
+        // Update the status bar immediately to show the network state
+        display->UpdateStatusBar(true);
+    });
+    int assets = boot.AddStep("assets", assets_download ? kBootLaneMain : kBootLaneWorker,
+        assets_download ? std::vector<int>{audio, network} : std::vector<int>{audio}, [this]() {
+        // Check for new assets version
+        CheckAssetsVersion();
+    });
+    int models = -1;
+#if CONFIG_AUDIO_MODELS_PREFETCH
+    // Only once the network is up, the WiFi configuration mode never listens and never loads them
+    models = boot.AddStep("models", kBootLaneWorker, {audio, network, assets}, [this]() {
+        audio_service_.PrepareWakeWord();
+        audio_service_.PrepareVoiceProcessing();
+    });
+#endif
+    int version = boot.AddStep("ota", kBootLaneMain, {network}, [this, &ota]() {
+        // Check for new firmware version or get the MQTT broker address
+        CheckNewVersion(ota);
+        ota.ReleaseHttp();
+    });
+    boot.AddStep("protocol", kBootLaneMain, {version, mcp, models}, [this, &ota, &protocol_started]() {
+        protocol_started = StartProtocol(ota);
+    });
+    boot.Run();
+    boot.PrintTimeline();
+#if CONFIG_BOOT_TIME_BUDGET_MS > 0
+    if (boot.GetReadyTimeMs() > CONFIG_BOOT_TIME_BUDGET_MS) {
+        ESP_LOGW(TAG, "Boot took %lld ms, over the budget of %d ms", boot.GetReadyTimeMs(), CONFIG_BOOT_TIME_BUDGET_MS);
+    }
+#endif
+
+    SystemInfo::PrintHeapStats();
+    TaskPlacements::PrintStackUsage();
+    MemoryBudget::Check("boot");
+    SetDeviceState(kDeviceStateIdle);
+#if CONFIG_USE_OTA_PROBATION
+    if (probation_due_) {
+        // Before the success sound, the playback of it counts
+        upgrade_probation_.Start(boot.GetReadyTimeMs());
+    }
+#endif
+
+    has_server_time_ = ota.HasServerTime();
+    if (protocol_started) {
+        std::string message = std::string(Lang::Strings::VERSION) + ota.GetCurrentVersion();
+        display->PostNotification(message.c_str());
+        display->PostChatMessage("system", "");
+        // Play the success sound to indicate the device is ready
+        audio_service_.PlaySound(Lang::Sounds::OGG_SUCCESS);
+    }
+}
+
+void Application::InitializeAudio(AudioCodec* codec) {
     /* Setup the audio service */
-    auto codec = board.GetAudioCodec();
     audio_service_.Initialize(codec);
     audio_service_.Start();
 
@@ -367,40 +585,63 @@ void Application::Start() {
     callbacks.on_wake_word_detected = [this](const std::string& wake_word) {
         xEventGroupSetBits(event_group_, MAIN_EVENT_WAKE_WORD_DETECTED);
     };
+#if CONFIG_USE_AUDIO_CHANNEL_PREWARM
+    callbacks.on_wake_word_candidate = [this]() {
+        xEventGroupSetBits(event_group_, MAIN_EVENT_WAKE_WORD_CANDIDATE);
+    };
+#endif
+    // Runs the recognized command on the device, the conversation is not touched
+    callbacks.on_local_command = [this](const std::string& text, const std::string& tool, const std::string& arguments) {
+        Schedule([text, tool, arguments]() {
+            ESP_LOGI(TAG, "Local command: %s", text.c_str());
+            McpServer::GetInstance().CallLocalTool(tool, arguments, text);
+        }, kSchedulePriorityHigh);
+    };
     callbacks.on_vad_change = [this](bool speaking) {
         xEventGroupSetBits(event_group_, MAIN_EVENT_VAD_CHANGE);
     };
+    // The turn ends here instead of after the server VAD and a round trip
+    callbacks.on_endpoint = [this](float confidence) {
+        Schedule([this, confidence]() {
+            if (device_state_ != kDeviceStateListening || listening_mode_ != kListeningModeAutoStop) {
+                return;
+            }
+            ESP_LOGI(TAG, "End of utterance, confidence %.2f", confidence);
+            protocol_->SendEndpoint(confidence);
+            SetDeviceState(kDeviceStateIdle);
+        }, kSchedulePriorityHigh);
+    };
+#if CONFIG_USE_BARGE_IN
+    callbacks.on_barge_in = [this](int speech_ms) {
+        int64_t detected_us = esp_timer_get_time();
+        Schedule([this, speech_ms, detected_us]() {
+            if (device_state_ != kDeviceStateSpeaking || listening_mode_ == kListeningModeRealtime) {
+                return;
+            }
+            AbortSpeaking(kAbortReasonBargeIn);
+            protocol_->SendStartListening(kListeningModeAutoStop);
+            audio_service_.CommitBargeIn();
+            audio_service_.EnableWakeWordDetection(false);
+            barge_in_turn_ = true;
+            barge_in_heard_ = false;
+            barge_ins_++;
+            ESP_LOGI(TAG, "Barge-in: %d ms of speech, listening %d ms after the detection, %lu of %lu false",
+                speech_ms, (int)((esp_timer_get_time() - detected_us) / 1000),
+                (unsigned long)false_barge_ins_, (unsigned long)barge_ins_);
+            SetListeningMode(kListeningModeAutoStop);
+        }, kSchedulePriorityHigh);
+    };
+#endif
     audio_service_.SetCallbacks(callbacks);
+}
 
-    // Start the main event loop task with priority 3
-    xTaskCreate([](void* arg) {
-        ((Application*)arg)->MainEventLoop();
-        vTaskDelete(NULL);
-    }, "main_event_loop", 2048 * 4, this, 3, &main_event_loop_task_handle_);
-
-    /* Start the clock timer to update the status bar */
-    esp_timer_start_periodic(clock_timer_handle_, 1000000);
-
-    /* Wait for the network to be ready */
-    board.StartNetwork();
-
-    // Update the status bar immediately to show the network state
-    display->UpdateStatusBar(true);
-
-    // Check for new assets version
-    CheckAssetsVersion();
-
-    // Check for new firmware version or get the MQTT broker address
-    Ota ota;
-    CheckNewVersion(ota);
+bool Application::StartProtocol(Ota& ota) {
+    auto& board = Board::GetInstance();
+    auto display = board.GetDisplay();
+    auto codec = board.GetAudioCodec();
 
     // Initialize the protocol
-    display->SetStatus(Lang::Strings::LOADING_PROTOCOL);
-
-    // Add MCP common tools before initializing the protocol
-    auto& mcp_server = McpServer::GetInstance();
-    mcp_server.AddCommonTools();
-    mcp_server.AddUserOnlyTools();
+    display->PostStatus(Lang::Strings::LOADING_PROTOCOL);
 
     if (ota.HasMqttConfig()) {
         protocol_ = std::make_unique<MqttProtocol>();
@@ -419,25 +660,48 @@ void Application::Start() {
         last_error_message_ = message;
         xEventGroupSetBits(event_group_, MAIN_EVENT_ERROR);
     });
+    protocol_->OnAllocateAudioPacket([this]() {
+        return audio_service_.AcquirePacket();
+    });
     protocol_->OnIncomingAudio([this](std::unique_ptr<AudioStreamPacket> packet) {
-        if (device_state_ == kDeviceStateSpeaking) {
-            audio_service_.PushPacketToDecodeQueue(std::move(packet));
+        // After a local abort the rest of the reply is dropped until the next tts start
+        if (device_state_ == kDeviceStateSpeaking && !aborted_) {
+#if CONFIG_USE_TTS_CACHE
+            tts_cache_.Capture(*packet);
+#endif
+            audio_service_.PushPacketToJitterBuffer(std::move(packet));
         }
     });
-    protocol_->OnAudioChannelOpened([this, codec, &board]() {
-        board.SetPowerSaveMode(false);
+    protocol_->OnAudioChannelOpened([this, codec]() {
+        NetworkPowerPolicy::GetInstance().OnAudioChannel(true);
+        // Use the frame duration negotiated in the hello exchange for the uplink
+        audio_service_.SetFrameDuration(protocol_->server_frame_duration());
+        audio_service_.SetTransportProfile(GetTransportProfile());
+        ResetAudioSendStats();
+        Schedule([this]() {
+            FlushMcpNotifications();
+            MemoryBudget::Check("conversation");
+        });
         if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
             ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
                 protocol_->server_sample_rate(), codec->output_sample_rate());
         }
     });
-    protocol_->OnAudioChannelClosed([this, &board]() {
-        board.SetPowerSaveMode(true);
+    protocol_->OnAudioChannelClosed([this]() {
+        NetworkPowerPolicy::GetInstance().OnAudioChannel(false);
+        auto link = protocol_->GetLinkMetrics();
+        ESP_LOGI(TAG, "Link: rtt %d ms, jitter %d ms, loss up %lu down %lu per mille, sent %lu packets %lu bytes, received %lu packets %lu bytes",
+            link.rtt_ms, link.jitter_ms, link.uplink_loss_permille, link.downlink_loss_permille,
+            link.uplink_packets, link.uplink_bytes, link.downlink_packets, link.downlink_bytes);
+        auto send = GetAudioSendStats();
+        ESP_LOGI(TAG, "Send: %lu frames in %lu calls, %lu failed, %lu slow, average %lld us, max %lld us, dropped oldest %lu newest %lu",
+            send.frames, send.batches, send.failures, send.slow, send.average_us, send.max_us,
+            send.dropped.oldest, send.dropped.newest);
         Schedule([this]() {
             auto display = Board::GetInstance().GetDisplay();
-            display->SetChatMessage("system", "");
+            display->PostChatMessage("system", "");
             SetDeviceState(kDeviceStateIdle);
-        });
+        }, kSchedulePriorityHigh);
     });
     protocol_->OnIncomingJson([this, display](const cJSON* root) {
         // Parse JSON data
@@ -447,11 +711,16 @@ void Application::Start() {
             if (strcmp(state->valuestring, "start") == 0) {
                 Schedule([this]() {
                     aborted_ = false;
+                    chat_reply_open_ = false;
                     if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
                         SetDeviceState(kDeviceStateSpeaking);
                     }
-                });
+                }, kSchedulePriorityHigh);
             } else if (strcmp(state->valuestring, "stop") == 0) {
+#if CONFIG_USE_TTS_CACHE
+                // Here rather than on the main loop, the capture is in order with the audio packets
+                tts_cache_.CommitCapture();
+#endif
                 Schedule([this]() {
                     if (device_state_ == kDeviceStateSpeaking) {
                         if (listening_mode_ == kListeningModeManualStop) {
@@ -460,29 +729,50 @@ void Application::Start() {
                             SetDeviceState(kDeviceStateListening);
                         }
                     }
-                });
-            } else if (strcmp(state->valuestring, "sentence_start") == 0) {
+                }, kSchedulePriorityHigh);
+            } else if (strcmp(state->valuestring, "sentence_start") == 0 ||
+                       strcmp(state->valuestring, "sentence_cached") == 0) {
                 auto text = cJSON_GetObjectItem(root, "text");
                 if (cJSON_IsString(text)) {
                     ESP_LOGI(TAG, "<< %s", text->valuestring);
                     Schedule([this, display, message = std::string(text->valuestring)]() {
-                        display->SetChatMessage("assistant", message.c_str());
+                        ShowStreamedChatMessage("assistant", message);
                     });
                 }
+#if CONFIG_USE_TTS_CACHE
+                tts_cache_.CommitCapture();
+                auto hash = cJSON_GetObjectItem(root, "cache_hash");
+                if (cJSON_IsString(hash) && strcmp(state->valuestring, "sentence_start") == 0) {
+                    tts_cache_.StartCapture(hash->valuestring, protocol_->server_sample_rate());
+                } else if (cJSON_IsString(hash)) {
+                    Schedule([this, hash = std::string(hash->valuestring)]() {
+                        if (device_state_ != kDeviceStateSpeaking || aborted_) {
+                            return;
+                        }
+                        if (!tts_cache_.Play(hash, audio_service_)) {
+                            ESP_LOGI(TAG, "TTS cache miss: %s", hash.c_str());
+                            protocol_->SendTtsCacheMiss(hash);
+                        }
+                    }, kSchedulePriorityHigh);
+                }
+#endif
             }
         } else if (strcmp(type->valuestring, "stt") == 0) {
             auto text = cJSON_GetObjectItem(root, "text");
             if (cJSON_IsString(text)) {
                 ESP_LOGI(TAG, ">> %s", text->valuestring);
                 Schedule([this, display, message = std::string(text->valuestring)]() {
-                    display->SetChatMessage("user", message.c_str());
+#if CONFIG_USE_BARGE_IN
+                    barge_in_heard_ = barge_in_heard_ || !message.empty();
+#endif
+                    ShowStreamedChatMessage("user", message);
                 });
             }
         } else if (strcmp(type->valuestring, "llm") == 0) {
             auto emotion = cJSON_GetObjectItem(root, "emotion");
             if (cJSON_IsString(emotion)) {
                 Schedule([this, display, emotion_str = std::string(emotion->valuestring)]() {
-                    display->SetEmotion(emotion_str.c_str());
+                    display->PostEmotion(emotion_str.c_str());
                 });
             }
         } else if (strcmp(type->valuestring, "mcp") == 0) {
@@ -518,7 +808,7 @@ void Application::Start() {
             ESP_LOGI(TAG, "Received custom message: %s", cJSON_PrintUnformatted(root));
             if (cJSON_IsObject(payload)) {
                 Schedule([this, display, payload_str = std::string(cJSON_PrintUnformatted(payload))]() {
-                    display->SetChatMessage("system", payload_str.c_str());
+                    display->PostChatMessage("system", payload_str.c_str());
                 });
             } else {
                 ESP_LOGW(TAG, "Invalid custom message format: missing payload");
@@ -528,28 +818,85 @@ void Application::Start() {
             ESP_LOGW(TAG, "Unknown message type: %s", type->valuestring);
         }
     });
-    bool protocol_started = protocol_->Start();
 
-    SystemInfo::PrintHeapStats();
-    SetDeviceState(kDeviceStateIdle);
+    // The uplink is drained by its own task, so a slow socket never blocks the main event loop
+    TaskPlacements::Create(kTaskAudioSend, [](void* arg) {
+        ((Application*)arg)->AudioSendTask();
+        vTaskDelete(NULL);
+    }, this, &audio_send_task_handle_);
 
-    has_server_time_ = ota.HasServerTime();
-    if (protocol_started) {
-        std::string message = std::string(Lang::Strings::VERSION) + ota.GetCurrentVersion();
-        display->ShowNotification(message.c_str());
-        display->SetChatMessage("system", "");
-        // Play the success sound to indicate the device is ready
-        audio_service_.PlaySound(Lang::Sounds::OGG_SUCCESS);
-    }
+    return protocol_->Start();
+}
+
+void Application::NotifyNetworkUp() {
+    Schedule([this]() {
+        if (protocol_) {
+            protocol_->NotifyNetworkUp();
+        }
+    }, kSchedulePriorityHigh);
+}
+
+void Application::NotifyNetworkChanged() {
+    Schedule([this]() {
+        if (!protocol_) {
+            return;
+        }
+        if (protocol_->IsAudioChannelOpened()) {
+            protocol_->CloseAudioChannel();
+        }
+        protocol_->NotifyNetworkChanged();
+    }, kSchedulePriorityHigh);
 }
 
 // Add a async task to MainLoop
-void Application::Schedule(std::function<void()> callback) {
+/*
+ * A server may send the STT of an utterance in parts, each one the whole text so far, and the
+ * reply comes sentence by sentence. Both go into one message, updated in place, until the other
+ * role speaks or a new turn starts.
+ */
+void Application::ShowStreamedChatMessage(const char* role, const std::string& text) {
+    auto display = Board::GetInstance().GetDisplay();
+    bool user = role[0] == 'u';
+    bool& open = user ? chat_user_open_ : chat_reply_open_;
+    if (!open) {
+        display->PostChatMessage(role, text.c_str());
+    } else if (user) {
+        display->PostChatMessageUpdate(role, text.c_str(), false);
+    } else if (!text.empty()) {
+        // The sentences of a reply in another script than CJK need a space between them
+        std::string sentence = (uint8_t)text[0] < 0x80 && !isspace((uint8_t)text[0]) ? " " + text : text;
+        display->PostChatMessageUpdate(role, sentence.c_str(), true);
+    }
+    open = !text.empty();
+    (user ? chat_reply_open_ : chat_user_open_) = false;
+}
+
+void Application::Schedule(ScheduledTask&& callback, SchedulePriority priority) {
+    bool behind;
+    size_t depth;
     {
         std::lock_guard<std::mutex> lock(mutex_);
-        main_tasks_.push_back(std::move(callback));
+        behind = main_tasks_.Push(std::move(callback), priority);
+        depth = main_tasks_.Size();
     }
     xEventGroupSetBits(event_group_, MAIN_EVENT_SCHEDULE);
+    if (behind) {
+        ESP_LOGW(TAG, "Main loop falling behind, %u tasks queued", depth);
+    }
+}
+
+uint32_t Application::AddTimer(uint32_t delay_ms, uint32_t period_ms, ScheduledTask&& callback) {
+    uint32_t id = timers_.Add(esp_timer_get_time() / 1000, delay_ms, period_ms, std::move(callback));
+    if (xTaskGetCurrentTaskHandle() != main_event_loop_task_handle_) {
+        // The main loop may be waiting for a later deadline
+        xEventGroupSetBits(event_group_, MAIN_EVENT_TIMER);
+    }
+    return id;
+}
+
+ScheduleStats Application::GetScheduleStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return main_tasks_.GetStats();
 }
 
 // The Main Event Loop controls the chat state and websocket connection
@@ -557,31 +904,36 @@ void Application::Schedule(std::function<void()> callback) {
 // they should use Schedule to call this function
 void Application::MainEventLoop() {
     while (true) {
+        // Sleep until the next timer at most, the timers due in the same tick run together
+        int64_t delay_ms = timers_.NextDelayMs(esp_timer_get_time() / 1000);
+        TickType_t timeout = delay_ms < 0 ? portMAX_DELAY : (delay_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
         auto bits = xEventGroupWaitBits(event_group_, MAIN_EVENT_SCHEDULE |
-            MAIN_EVENT_SEND_AUDIO |
+            MAIN_EVENT_WAKE_WORD_CANDIDATE |
             MAIN_EVENT_WAKE_WORD_DETECTED |
             MAIN_EVENT_VAD_CHANGE |
-            MAIN_EVENT_CLOCK_TICK |
-            MAIN_EVENT_ERROR, pdTRUE, pdFALSE, portMAX_DELAY);
+            MAIN_EVENT_TIMER |
+            MAIN_EVENT_ERROR, pdTRUE, pdFALSE, timeout);
 
         if (bits & MAIN_EVENT_ERROR) {
+            LoopProfiler::Scope scope(loop_profiler_, {"MAIN_EVENT_ERROR"});
             SetDeviceState(kDeviceStateIdle);
             Alert(Lang::Strings::ERROR, last_error_message_.c_str(), "circle_xmark", Lang::Sounds::OGG_EXCLAMATION);
         }
 
-        if (bits & MAIN_EVENT_SEND_AUDIO) {
-            while (auto packet = audio_service_.PopPacketFromSendQueue()) {
-                if (protocol_ && !protocol_->SendAudio(std::move(packet))) {
-                    break;
-                }
-            }
+        if (bits & MAIN_EVENT_WAKE_WORD_CANDIDATE) {
+            LoopProfiler::Scope scope(loop_profiler_, {"MAIN_EVENT_WAKE_WORD_CANDIDATE"});
+            NetworkPowerPolicy::GetInstance().OnWakeWord();
+            PrewarmAudioChannel();
         }
 
         if (bits & MAIN_EVENT_WAKE_WORD_DETECTED) {
+            LoopProfiler::Scope scope(loop_profiler_, {"MAIN_EVENT_WAKE_WORD_DETECTED"});
+            NetworkPowerPolicy::GetInstance().OnWakeWord();
             OnWakeWordDetected();
         }
 
         if (bits & MAIN_EVENT_VAD_CHANGE) {
+            LoopProfiler::Scope scope(loop_profiler_, {"MAIN_EVENT_VAD_CHANGE"});
             if (device_state_ == kDeviceStateListening) {
                 auto led = Board::GetInstance().GetLed();
                 led->OnStateChanged();
@@ -589,29 +941,145 @@ void Application::MainEventLoop() {
         }
 
         if (bits & MAIN_EVENT_SCHEDULE) {
+            // Only the tasks queued so far, the ones they schedule set the bit again. A high
+            // priority task scheduled meanwhile still runs before the queued normal ones.
             std::unique_lock<std::mutex> lock(mutex_);
-            auto tasks = std::move(main_tasks_);
-            lock.unlock();
-            for (auto& task : tasks) {
-                task();
+            size_t pending = main_tasks_.Size();
+            while (pending-- > 0) {
+                auto task = main_tasks_.Pop();
+                lock.unlock();
+                RunTask(task);
+                task.Reset();
+                lock.lock();
             }
         }
 
-        if (bits & MAIN_EVENT_CLOCK_TICK) {
-            clock_ticks_++;
-            auto display = Board::GetInstance().GetDisplay();
-            display->UpdateStatusBar();
-        
-            // Print the debug info every 10 seconds
-            if (clock_ticks_ % 10 == 0) {
-                // SystemInfo::PrintTaskCpuUsage(pdMS_TO_TICKS(1000));
-                // SystemInfo::PrintTaskList();
-                SystemInfo::PrintHeapStats();
+        timers_.Run(esp_timer_get_time() / 1000, [this](ScheduledTask& task) {
+            RunTask(task);
+        });
+    }
+}
+
+void Application::RunTask(ScheduledTask& task) {
+    LoopProfiler::Scope scope(loop_profiler_, task.site());
+    task();
+}
+
+void Application::OnClockTick() {
+    clock_ticks_++;
+    auto display = Board::GetInstance().GetDisplay();
+    display->UpdateStatusBar();
+
+    // Close the prewarmed audio channel if no wake word followed
+    if (prewarm_ticks_ > 0 && --prewarm_ticks_ == 0) {
+        if (device_state_ == kDeviceStateIdle && protocol_ && protocol_->IsAudioChannelOpened()) {
+            ESP_LOGI(TAG, "No wake word after prewarm, closing the audio channel");
+            protocol_->CloseAudioChannel();
+        }
+    }
+
+    // Measure the link RTT, and let the encoder controller back off when it grows
+    if (protocol_ && protocol_->IsAudioChannelOpened()) {
+#if CONFIG_LINK_PING_INTERVAL_SECONDS > 0
+        if (clock_ticks_ % CONFIG_LINK_PING_INTERVAL_SECONDS == 0) {
+            protocol_->SendPing();
+        }
+#endif
+        audio_service_.SetLinkRtt(protocol_->GetLinkMetrics().rtt_ms);
+    }
+    Telemetry::GetInstance().OnClockTick(protocol_.get(), device_state_ == kDeviceStateIdle);
+    BlackBox::GetInstance().OnClockTick(device_state_);
+    NetworkPowerPolicy::GetInstance().OnClockTick();
+    PerformanceProfileManager::GetInstance().OnClockTick();
+
+    // Print the debug info every 10 seconds
+    if (clock_ticks_ % 10 == 0) {
+        // The per task CPU usage is sampled in the background, see self.get_task_cpu_usage
+        // SystemInfo::PrintTaskList();
+        SystemInfo::PrintHeapStats();
+        HeapAccounting::Sample();
+        if (clock_ticks_ % 60 == 0) {
+            HeapAccounting::PrintStats();
+        }
+        if (clock_ticks_ % 600 == 0) {
+            TaskPlacements::PrintStackUsage();
+        }
+        auto schedule = GetScheduleStats();
+        if (schedule.overflowed > 0 || schedule.boxed > 0) {
+            ESP_LOGI(TAG, "Schedule: %lu tasks, high water %lu, overflowed %lu, boxed %lu",
+                schedule.scheduled, schedule.high_water, schedule.overflowed, schedule.boxed);
+        }
+    }
+}
+
+void Application::AudioSendTask() {
+    while (true) {
+        xEventGroupWaitBits(event_group_, MAIN_EVENT_SEND_AUDIO, pdTRUE, pdFALSE, portMAX_DELAY);
+
+        /*
+         * Only the packets already queued are batched, so a healthy link still sends every
+         * frame right away and the batches grow with the queue depth when the link stalls.
+         * A failed call leaves the rest queued for the next frame, the encoder applies the
+         * drop policy meanwhile.
+         */
+        std::lock_guard<std::mutex> lock(audio_send_mutex_);
+        if (!protocol_) {
+            continue;
+        }
+        bool sent = true;
+        while (sent) {
+            size_t batch_frames = protocol_->max_audio_batch_frames();
+            while (audio_send_batch_.size() < batch_frames) {
+                auto packet = audio_service_.PopPacketFromSendQueue();
+                if (!packet) {
+                    break;
+                }
+                audio_send_batch_.push_back(std::move(packet));
+            }
+            if (audio_send_batch_.empty()) {
+                break;
             }
+            int64_t start_us = esp_timer_get_time();
+            sent = protocol_->SendAudioBatch(audio_send_batch_);
+            int64_t elapsed_us = esp_timer_get_time() - start_us;
+            {
+                std::lock_guard<std::mutex> lock(send_stats_mutex_);
+                send_stats_.batches++;
+                send_stats_.frames += audio_send_batch_.size();
+                if (!sent) {
+                    send_stats_.failures++;
+                }
+                if (elapsed_us > audio_send_batch_.front()->frame_duration * 1000) {
+                    send_stats_.slow++;
+                }
+                send_stats_.last_us = elapsed_us;
+                send_stats_.average_us = send_stats_.batches == 1 ? elapsed_us :
+                    send_stats_.average_us + (elapsed_us - send_stats_.average_us) / 8;
+                send_stats_.max_us = std::max(send_stats_.max_us, elapsed_us);
+            }
+            for (auto& packet : audio_send_batch_) {
+                audio_service_.ReleasePacket(std::move(packet));
+            }
+            audio_send_batch_.clear();
         }
     }
 }
 
+void Application::ResetAudioSendStats() {
+    std::lock_guard<std::mutex> lock(send_stats_mutex_);
+    send_stats_ = {};
+    send_drops_base_ = audio_service_.GetSendQueueDrops();
+}
+
+AudioSendStats Application::GetAudioSendStats() {
+    std::lock_guard<std::mutex> lock(send_stats_mutex_);
+    auto stats = send_stats_;
+    auto drops = audio_service_.GetSendQueueDrops();
+    stats.dropped.newest = drops.newest - send_drops_base_.newest;
+    stats.dropped.oldest = drops.oldest - send_drops_base_.oldest;
+    return stats;
+}
+
 void Application::OnWakeWordDetected() {
     if (!protocol_) {
         return;
@@ -619,10 +1087,12 @@ void Application::OnWakeWordDetected() {
 
     if (device_state_ == kDeviceStateIdle) {
         audio_service_.EncodeWakeWord();
+        // The prewarmed channel is now used, keep it open
+        prewarm_ticks_ = 0;
 
         if (!protocol_->IsAudioChannelOpened()) {
             SetDeviceState(kDeviceStateConnecting);
-            if (!protocol_->OpenAudioChannel()) {
+            if (!OpenAudioChannel()) {
                 audio_service_.EnableWakeWordDetection(true);
                 return;
             }
@@ -633,7 +1103,8 @@ void Application::OnWakeWordDetected() {
 #if CONFIG_SEND_WAKE_WORD_DATA
         // Encode and send the wake word data to the server
         while (auto packet = audio_service_.PopWakeWordPacket()) {
-            protocol_->SendAudio(std::move(packet));
+            protocol_->SendAudio(*packet);
+            audio_service_.ReleasePacket(std::move(packet));
         }
         // Set the chat state to wake word detected
         protocol_->SendWakeWordDetected(wake_word);
@@ -650,9 +1121,62 @@ void Application::OnWakeWordDetected() {
     }
 }
 
+void Application::PrewarmAudioChannel() {
+#if CONFIG_USE_AUDIO_CHANNEL_PREWARM
+    if (!protocol_ || device_state_ != kDeviceStateIdle) {
+        return;
+    }
+    if (protocol_->IsAudioChannelOpened()) {
+        // Keep the prewarmed channel open while the user keeps speaking
+        if (prewarm_ticks_ > 0) {
+            prewarm_ticks_ = CONFIG_AUDIO_CHANNEL_PREWARM_TIMEOUT_SECONDS;
+        }
+        return;
+    }
+
+    if (prewarming_.exchange(true)) {
+        return;
+    }
+
+    /* Pay the hello round-trip now, the wake word detection usually follows within a second */
+    ESP_LOGI(TAG, "Voice onset in idle, prewarming the audio channel");
+    // On its own task, the main loop would wait for the whole handshake
+    if (TaskPlacements::Create(kTaskAudioChannelPrewarm, [](void* arg) {
+            auto app = static_cast<Application*>(arg);
+            bool opened = false;
+            {
+                std::lock_guard<std::mutex> lock(app->channel_open_mutex_);
+                if (app->protocol_ && !app->protocol_->IsAudioChannelOpened()) {
+                    opened = app->protocol_->OpenAudioChannel();
+                }
+            }
+            app->Schedule([app, opened]() {
+                app->prewarming_ = false;
+                // Unless a conversation has taken the channel meanwhile
+                if (opened && app->device_state_ == kDeviceStateIdle) {
+                    app->prewarm_ticks_ = CONFIG_AUDIO_CHANNEL_PREWARM_TIMEOUT_SECONDS;
+                }
+            });
+            TaskPlacements::Delete(kTaskAudioChannelPrewarm);
+        }, this) != pdPASS) {
+        prewarming_ = false;
+    }
+#endif
+}
+
+bool Application::OpenAudioChannel() {
+    std::lock_guard<std::mutex> lock(channel_open_mutex_);
+    return protocol_->IsAudioChannelOpened() || protocol_->OpenAudioChannel();
+}
+
 void Application::AbortSpeaking(AbortReason reason) {
     ESP_LOGI(TAG, "Abort speaking");
     aborted_ = true;
+    // Stop right away instead of playing what is buffered until the server stops
+    audio_service_.FlushPlayback();
+#if CONFIG_USE_TTS_CACHE
+    tts_cache_.CancelCapture();
+#endif
     if (protocol_) {
         protocol_->SendAbortSpeaking(reason);
     }
@@ -660,6 +1184,8 @@ void Application::AbortSpeaking(AbortReason reason) {
 
 void Application::SetListeningMode(ListeningMode mode) {
     listening_mode_ = mode;
+    // The realtime stream wants the freshest audio, the turn based ones want all of the utterance
+    audio_service_.SetSendPolicy(mode == kListeningModeRealtime ? kAudioSendPolicyDropOldest : kAudioSendPolicyBlock);
     SetDeviceState(kDeviceStateListening);
 }
 
@@ -672,10 +1198,34 @@ void Application::SetDeviceState(DeviceState state) {
     auto previous_state = device_state_;
     device_state_ = state;
     ESP_LOGI(TAG, "STATE: %s", STATE_STRINGS[device_state_]);
+    TraceRecorder::GetInstance().Instant(STATE_STRINGS[device_state_]);
+    BlackBox::GetInstance().OnStateChanged(previous_state, state);
+    PowerPolicy::GetInstance().OnStateChanged(state);
+    NetworkPowerPolicy::GetInstance().OnStateChanged(state);
+#if CONFIG_OTA_BACKGROUND_DOWNLOAD
+    if (background_ota_) {
+        background_ota_->SetRateLimit(BackgroundUpgradeRate(state));
+    }
+#endif
 
     // Send the state change event
     DeviceStateEventManager::GetInstance().PostStateChangeEvent(previous_state, state);
 
+#if CONFIG_USE_BARGE_IN
+    if (previous_state == kDeviceStateSpeaking) {
+        // Stops the processor again, unless the barge-in just took it over for the new turn
+        audio_service_.EnableBargeIn(false);
+    }
+    if (previous_state == kDeviceStateListening && barge_in_turn_) {
+        barge_in_turn_ = false;
+        if (!barge_in_heard_) {
+            false_barge_ins_++;
+            ESP_LOGW(TAG, "Barge-in without speech recognized, %lu of %lu false",
+                (unsigned long)false_barge_ins_, (unsigned long)barge_ins_);
+        }
+    }
+#endif
+
     auto& board = Board::GetInstance();
     auto display = board.GetDisplay();
     auto led = board.GetLed();
@@ -683,38 +1233,57 @@ void Application::SetDeviceState(DeviceState state) {
     switch (state) {
         case kDeviceStateUnknown:
         case kDeviceStateIdle:
-            display->SetStatus(Lang::Strings::STANDBY);
-            display->SetEmotion("neutral");
+            display->PostStatus(Lang::Strings::STANDBY);
+            display->PostEmotion("neutral");
             audio_service_.EnableVoiceProcessing(false);
             audio_service_.EnableWakeWordDetection(true);
+            audio_service_.SetDmaMode(kAudioDmaModeIdle);
             break;
         case kDeviceStateConnecting:
-            display->SetStatus(Lang::Strings::CONNECTING);
-            display->SetEmotion("neutral");
-            display->SetChatMessage("system", "");
+            display->PostStatus(Lang::Strings::CONNECTING);
+            display->PostEmotion("neutral");
+            display->PostChatMessage("system", "");
             break;
         case kDeviceStateListening:
-            display->SetStatus(Lang::Strings::LISTENING);
-            display->SetEmotion("neutral");
-
+            display->PostStatus(Lang::Strings::LISTENING);
+            chat_user_open_ = false;
+            display->PostEmotion("neutral");
+
+            audio_service_.SetDmaMode(listening_mode_ == kListeningModeRealtime ? kAudioDmaModeLowLatency : kAudioDmaModeDefault);
+            // In auto stop mode the server detects the end of speech, it needs the silent frames
+            audio_service_.SetSilenceSuppression(listening_mode_ == kListeningModeAutoStop ?
+                kSilenceSuppressionOff : protocol_->server_silence_suppression());
+            audio_service_.EnableEndpointing(listening_mode_ == kListeningModeAutoStop);
             // Make sure the audio processor is running
             if (!audio_service_.IsAudioProcessorRunning()) {
                 // Send the start listening command
                 protocol_->SendStartListening(listening_mode_);
+                audio_service_.SelectAfeProfile(listening_mode_ == kListeningModeRealtime);
                 audio_service_.EnableVoiceProcessing(true);
                 audio_service_.EnableWakeWordDetection(false);
             }
             break;
         case kDeviceStateSpeaking:
-            display->SetStatus(Lang::Strings::SPEAKING);
+            display->PostStatus(Lang::Strings::SPEAKING);
 
             if (listening_mode_ != kListeningModeRealtime) {
                 audio_service_.EnableVoiceProcessing(false);
+#if CONFIG_USE_BARGE_IN
+                // Talking over the TTS interrupts it, no need for the wake word
+                if (audio_service_.EnableBargeIn(true)) {
+                    audio_service_.EnableWakeWordDetection(false);
+                } else
+#endif
                 // Only AFE wake word can be detected in speaking mode
                 audio_service_.EnableWakeWordDetection(audio_service_.IsAfeWakeWord());
             }
             audio_service_.ResetDecoder();
             break;
+        case kDeviceStateWifiConfiguring:
+        case kDeviceStateUpgrading:
+            // Neither mode listens, the models go back to the heap until the next enable
+            audio_service_.ReleaseModels();
+            break;
         default:
             // Do nothing
             break;
@@ -727,9 +1296,15 @@ void Application::Reboot() {
     if (protocol_ && protocol_->IsAudioChannelOpened()) {
         protocol_->CloseAudioChannel();
     }
-    protocol_.reset();
+    {
+        // A prewarm or a batch in flight finishes on the protocol first
+        std::lock_guard<std::mutex> open_lock(channel_open_mutex_);
+        std::lock_guard<std::mutex> lock(audio_send_mutex_);
+        protocol_.reset();
+    }
     audio_service_.Stop();
 
+    Settings::Flush();
     vTaskDelay(pdMS_TO_TICKS(1000));
     esp_restart();
 }
@@ -741,52 +1316,83 @@ bool Application::UpgradeFirmware(Ota& ota, const std::string& url) {
     // Use provided URL or get from OTA object
     std::string upgrade_url = url.empty() ? ota.GetFirmwareUrl() : url;
     std::string version_info = url.empty() ? ota.GetFirmwareVersion() : "(Manual upgrade)";
-    
-    // Close audio channel if it's open
-    if (protocol_ && protocol_->IsAudioChannelOpened()) {
-        ESP_LOGI(TAG, "Closing audio channel before firmware upgrade");
-        protocol_->CloseAudioChannel();
+#if CONFIG_OTA_BACKGROUND_DOWNLOAD
+    if (background_ota_) {
+        // Both would write the next OTA partition
+        ESP_LOGW(TAG, "A background firmware download is in progress");
+        return false;
     }
-    ESP_LOGI(TAG, "Starting firmware upgrade from URL: %s", upgrade_url.c_str());
+#endif
     
-    Alert(Lang::Strings::OTA_UPGRADE, Lang::Strings::UPGRADING, "download", Lang::Sounds::OGG_UPGRADE);
+    // The state change and the channel close run on the main loop, only the download and the
+    // flash write stay on the caller, which is the MCP worker for a manual upgrade
+    RunOnMainLoop([this]() {
+        if (protocol_ && protocol_->IsAudioChannelOpened()) {
+            ESP_LOGI(TAG, "Closing audio channel before firmware upgrade");
+            protocol_->CloseAudioChannel();
+        }
+        Alert(Lang::Strings::OTA_UPGRADE, Lang::Strings::UPGRADING, "download", Lang::Sounds::OGG_UPGRADE);
+    });
+    ESP_LOGI(TAG, "Starting firmware upgrade from URL: %s", upgrade_url.c_str());
     vTaskDelay(pdMS_TO_TICKS(3000));
 
-    SetDeviceState(kDeviceStateUpgrading);
-    
-    std::string message = std::string(Lang::Strings::NEW_VERSION) + version_info;
-    display->SetChatMessage("system", message.c_str());
+    RunOnMainLoop([this, display, &version_info]() {
+        SetDeviceState(kDeviceStateUpgrading);
+        std::string message = std::string(Lang::Strings::NEW_VERSION) + version_info;
+        display->PostChatMessage("system", message.c_str());
+        // The tasks stay for a failed upgrade, the models make room for the download buffers
+        audio_service_.Suspend(true);
+    });
 
-    board.SetPowerSaveMode(false);
-    audio_service_.Stop();
+    NetworkPowerPolicy::GetInstance().SetTransferring(true);
+    // The pending settings are written before the flash is busy with the image
+    Settings::Flush();
     vTaskDelay(pdMS_TO_TICKS(1000));
 
-    bool upgrade_success = ota.StartUpgradeFromUrl(upgrade_url, [display](int progress, size_t speed) {
-        std::thread([display, progress, speed]() {
-            char buffer[32];
-            snprintf(buffer, sizeof(buffer), "%d%% %uKB/s", progress, speed / 1024);
-            display->SetChatMessage("system", buffer);
-        }).detach();
-    });
+    auto progress_callback = [display](int progress, size_t speed) {
+        // Posted, the download does not wait for the display
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%d%% %uKB/s", progress, speed / 1024);
+        display->PostChatMessage("system", buffer);
+    };
+    // The version from the server may come with a patch against the running image
+    bool upgrade_success = url.empty() ? ota.StartUpgrade(progress_callback) :
+        ota.StartUpgradeFromUrl(upgrade_url, progress_callback);
 
     if (!upgrade_success) {
         // Upgrade failed, restart audio service and continue running
-        ESP_LOGE(TAG, "Firmware upgrade failed, restarting audio service and continuing operation...");
-        audio_service_.Start(); // Restart audio service
-        board.SetPowerSaveMode(true); // Restore power save mode
-        Alert(Lang::Strings::ERROR, Lang::Strings::UPGRADE_FAILED, "circle_xmark", Lang::Sounds::OGG_EXCLAMATION);
+        ESP_LOGE(TAG, "Firmware upgrade failed, resuming audio service and continuing operation...");
+        NetworkPowerPolicy::GetInstance().SetTransferring(false);
+        RunOnMainLoop([this]() {
+            audio_service_.Resume();
+            Alert(Lang::Strings::ERROR, Lang::Strings::UPGRADE_FAILED, "circle_xmark", Lang::Sounds::OGG_EXCLAMATION);
+        });
         vTaskDelay(pdMS_TO_TICKS(3000));
         return false;
     } else {
         // Upgrade success, reboot immediately
         ESP_LOGI(TAG, "Firmware upgrade successful, rebooting...");
-        display->SetChatMessage("system", "Upgrade successful, rebooting...");
+        display->PostChatMessage("system", "Upgrade successful, rebooting...");
         vTaskDelay(pdMS_TO_TICKS(1000)); // Brief pause to show message
         Reboot();
         return true;
     }
 }
 
+void Application::RunOnMainLoop(const std::function<void()>& step) {
+    if (xTaskGetCurrentTaskHandle() == main_event_loop_task_handle_) {
+        step();
+        return;
+    }
+    SemaphoreHandle_t done = xSemaphoreCreateBinary();
+    Schedule([&step, done]() {
+        step();
+        xSemaphoreGive(done);
+    }, kSchedulePriorityHigh);
+    xSemaphoreTake(done, portMAX_DELAY);
+    vSemaphoreDelete(done);
+}
+
 void Application::WakeWordInvoke(const std::string& wake_word) {
     if (!protocol_) {
         return;
@@ -797,7 +1403,7 @@ void Application::WakeWordInvoke(const std::string& wake_word) {
 
         if (!protocol_->IsAudioChannelOpened()) {
             SetDeviceState(kDeviceStateConnecting);
-            if (!protocol_->OpenAudioChannel()) {
+            if (!OpenAudioChannel()) {
                 audio_service_.EnableWakeWordDetection(true);
                 return;
             }
@@ -807,7 +1413,8 @@ void Application::WakeWordInvoke(const std::string& wake_word) {
 #if CONFIG_USE_AFE_WAKE_WORD || CONFIG_USE_CUSTOM_WAKE_WORD
         // Encode and send the wake word data to the server
         while (auto packet = audio_service_.PopWakeWordPacket()) {
-            protocol_->SendAudio(std::move(packet));
+            protocol_->SendAudio(*packet);
+            audio_service_.ReleasePacket(std::move(packet));
         }
         // Set the chat state to wake word detected
         protocol_->SendWakeWordDetected(wake_word);
@@ -820,13 +1427,13 @@ void Application::WakeWordInvoke(const std::string& wake_word) {
     } else if (device_state_ == kDeviceStateSpeaking) {
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
-        });
+        }, kSchedulePriorityHigh);
     } else if (device_state_ == kDeviceStateListening) {   
         Schedule([this]() {
             if (protocol_) {
                 protocol_->CloseAudioChannel();
             }
-        });
+        }, kSchedulePriorityHigh);
     }
 }
 
@@ -847,21 +1454,46 @@ bool Application::CanEnterSleepMode() {
     return true;
 }
 
-void Application::SendMcpMessage(const std::string& payload) {
+void Application::SendMcpMessage(std::string payload) {
     if (protocol_ == nullptr) {
         return;
     }
 
     // Make sure you are using main thread to send MCP message
     if (xTaskGetCurrentTaskHandle() == main_event_loop_task_handle_) {
-        protocol_->SendMcpMessage(payload);
+        protocol_->SendMcpMessage(std::move(payload));
     } else {
-        Schedule([this, payload = std::move(payload)]() {
-            protocol_->SendMcpMessage(payload);
+        Schedule([this, payload = std::move(payload)]() mutable {
+            protocol_->SendMcpMessage(std::move(payload));
         });
     }
 }
 
+void Application::SendMcpNotification(std::string payload) {
+    Schedule([this, payload = std::move(payload)]() mutable {
+        if (protocol_ && protocol_->IsAudioChannelOpened()) {
+            protocol_->SendMcpMessage(std::move(payload));
+            return;
+        }
+        if (pending_mcp_notifications_.size() >= MAX_PENDING_MCP_NOTIFICATIONS) {
+            pending_mcp_notifications_.pop_front();
+        }
+        pending_mcp_notifications_.push_back(std::move(payload));
+    });
+}
+
+void Application::FlushMcpNotifications() {
+    while (!pending_mcp_notifications_.empty() && protocol_ && protocol_->IsAudioChannelOpened()) {
+        protocol_->SendMcpMessage(std::move(pending_mcp_notifications_.front()));
+        pending_mcp_notifications_.pop_front();
+    }
+}
+
+bool Application::SendVideoFrame(std::vector<uint8_t>& jpeg, uint32_t timestamp) {
+    // The transports guard their socket against the audio send task, so no main loop hop
+    return protocol_ != nullptr && protocol_->SendVideoFrame(jpeg, timestamp);
+}
+
 void Application::SetAecMode(AecMode mode) {
     aec_mode_ = mode;
     Schedule([this]() {
@@ -870,15 +1502,15 @@ void Application::SetAecMode(AecMode mode) {
         switch (aec_mode_) {
         case kAecOff:
             audio_service_.EnableDeviceAec(false);
-            display->ShowNotification(Lang::Strings::RTC_MODE_OFF);
+            display->PostNotification(Lang::Strings::RTC_MODE_OFF);
             break;
         case kAecOnServerSide:
             audio_service_.EnableDeviceAec(false);
-            display->ShowNotification(Lang::Strings::RTC_MODE_ON);
+            display->PostNotification(Lang::Strings::RTC_MODE_ON);
             break;
         case kAecOnDeviceSide:
             audio_service_.EnableDeviceAec(true);
-            display->ShowNotification(Lang::Strings::RTC_MODE_ON);
+            display->PostNotification(Lang::Strings::RTC_MODE_ON);
             break;
         }
 
@@ -8,23 +8,49 @@
 
 #include <string>
 #include <mutex>
-#include <deque>
 #include <memory>
+#include <deque>
+#include <atomic>
+#include <functional>
 
 #include "protocol.h"
 #include "ota.h"
 #include "audio_service.h"
+#include "tts_cache.h"
 #include "device_state_event.h"
+#include "scheduled_task.h"
+#include "timer_wheel.h"
+#include "loop_profiler.h"
+#include "memory_budget.h"
+#include "upgrade_probation.h"
 
 
 #define MAIN_EVENT_SCHEDULE (1 << 0)
+// Waited by the audio send task, not by the main event loop
 #define MAIN_EVENT_SEND_AUDIO (1 << 1)
 #define MAIN_EVENT_WAKE_WORD_DETECTED (1 << 2)
 #define MAIN_EVENT_VAD_CHANGE (1 << 3)
 #define MAIN_EVENT_ERROR (1 << 4)
 #define MAIN_EVENT_CHECK_NEW_VERSION_DONE (1 << 5)
-#define MAIN_EVENT_CLOCK_TICK (1 << 6)
-
+// Set when a timer is added from another task, the main loop recomputes its wait
+#define MAIN_EVENT_TIMER (1 << 6)
+#define MAIN_EVENT_WAKE_WORD_CANDIDATE (1 << 7)
+
+// MCP notifications kept while the audio channel is closed, the oldest are dropped
+#define MAX_PENDING_MCP_NOTIFICATIONS MEMORY_BUDGET_PENDING_MCP_NOTIFICATIONS
+
+
+// Uplink protocol calls of the audio send task, for the current conversation
+struct AudioSendStats {
+    uint32_t batches = 0;
+    uint32_t frames = 0;
+    uint32_t failures = 0;
+    uint32_t slow = 0;              // Calls longer than one frame duration
+    int64_t last_us = 0;
+    int64_t average_us = 0;         // Smoothed, alpha 1/8
+    int64_t max_us = 0;
+    SendQueueDrops dropped;
+};
 
 enum AecMode {
     kAecOff,
@@ -45,8 +71,32 @@ public:
     void Start();
     void MainEventLoop();
     DeviceState GetDeviceState() const { return device_state_; }
+    static const char* GetDeviceStateName(DeviceState state);
     bool IsVoiceDetected() const { return audio_service_.IsVoiceDetected(); }
-    void Schedule(std::function<void()> callback);
+    // Runs the callback on the main event loop, the high priority lane is drained first
+    void Schedule(ScheduledTask&& callback, SchedulePriority priority = kSchedulePriorityNormal);
+    template <typename F>
+    void Schedule(F&& callback, SchedulePriority priority = kSchedulePriorityNormal, CallSite site = CallSite::Here()) {
+        ScheduledTask task(std::forward<F>(callback));
+        task.set_site(site);
+        Schedule(std::move(task), priority);
+    }
+    // Timers of the main event loop, the callbacks run on it like the scheduled tasks.
+    // Both may be called from any task and return an id for CancelTimer().
+    template <typename F>
+    uint32_t ScheduleAfter(uint32_t delay_ms, F&& callback, CallSite site = CallSite::Here()) {
+        ScheduledTask task(std::forward<F>(callback));
+        task.set_site(site);
+        return AddTimer(delay_ms, 0, std::move(task));
+    }
+    template <typename F>
+    uint32_t ScheduleEvery(uint32_t period_ms, F&& callback, CallSite site = CallSite::Here()) {
+        ScheduledTask task(std::forward<F>(callback));
+        task.set_site(site);
+        return AddTimer(period_ms, period_ms, std::move(task));
+    }
+    // Returns false if the timer already ran, ids of 0 are ignored
+    bool CancelTimer(uint32_t id) { return timers_.Cancel(id); }
     void SetDeviceState(DeviceState state);
     void Alert(const char* status, const char* message, const char* emotion = "", const std::string_view& sound = "");
     void DismissAlert();
@@ -58,37 +108,115 @@ public:
     void WakeWordInvoke(const std::string& wake_word);
     bool UpgradeFirmware(Ota& ota, const std::string& url = "");
     bool CanEnterSleepMode();
-    void SendMcpMessage(const std::string& payload);
+    void SendMcpMessage(std::string payload);
+    // A message the server may learn about later, kept until the audio channel opens
+    void SendMcpNotification(std::string payload);
+    // Sends a camera stream frame from the calling task, see Protocol::SendVideoFrame()
+    bool SendVideoFrame(std::vector<uint8_t>& jpeg, uint32_t timestamp);
     void SetAecMode(AecMode mode);
     AecMode GetAecMode() const { return aec_mode_; }
     void PlaySound(const std::string_view& sound);
     AudioService& GetAudioService() { return audio_service_; }
+    // Link quality of the current or the last conversation
+    LinkMetrics GetLinkMetrics() { return protocol_ ? protocol_->GetLinkMetrics() : LinkMetrics(); }
+    AudioSendStats GetAudioSendStats();
+    ReconnectMetrics GetReconnectMetrics() { return protocol_ ? protocol_->GetReconnectMetrics() : ReconnectMetrics(); }
+    // Called by the boards when the network comes back, may be called from any task
+    void NotifyNetworkUp();
+    // The board switched to another network interface, the open conversation is closed
+    void NotifyNetworkChanged();
+    ScheduleStats GetScheduleStats();
+    // Durations of the main loop callbacks, for the MCP diagnostics
+    LoopProfiler& GetLoopProfiler() { return loop_profiler_; }
 
 private:
     Application();
     ~Application();
 
     std::mutex mutex_;
-    std::deque<std::function<void()>> main_tasks_;
+    ScheduleQueue main_tasks_;
+    TimerWheel timers_;
+    LoopProfiler loop_profiler_;
     std::unique_ptr<Protocol> protocol_;
     EventGroupHandle_t event_group_ = nullptr;
-    esp_timer_handle_t clock_timer_handle_ = nullptr;
     volatile DeviceState device_state_ = kDeviceStateUnknown;
     ListeningMode listening_mode_ = kListeningModeAutoStop;
     AecMode aec_mode_ = kAecOff;
     std::string last_error_message_;
     AudioService audio_service_;
+#if CONFIG_USE_TTS_CACHE
+    TtsCache tts_cache_;
+#endif
+#if CONFIG_USE_BARGE_IN
+    // Only touched by the main loop. A barge-in is counted false when its turn got no STT.
+    bool barge_in_turn_ = false;
+    bool barge_in_heard_ = false;
+    uint32_t barge_ins_ = 0;
+    uint32_t false_barge_ins_ = 0;
+#endif
+    // Packets drained from the send queue in one protocol call, only used by the audio send task
+    std::vector<std::unique_ptr<AudioStreamPacket>> audio_send_batch_;
+    // Held by the audio send task while it uses protocol_, and by Reboot() to reset it
+    std::mutex audio_send_mutex_;
+    std::mutex send_stats_mutex_;
+    AudioSendStats send_stats_;
+    // Drop counters of the audio service when the conversation started
+    SendQueueDrops send_drops_base_;
+
+#if CONFIG_USE_OTA_PROBATION
+    // The version check passed on a new image, it goes on probation once the boot is done
+    bool probation_due_ = false;
+    UpgradeProbation upgrade_probation_;
+#endif
+#if CONFIG_OTA_BACKGROUND_DOWNLOAD
+    // The version downloading or downloaded in the background, set by the version check and
+    // released by the main loop
+    std::unique_ptr<Ota> background_ota_;
+#endif
 
     bool has_server_time_ = false;
     bool aborted_ = false;
+    // The chat message the streamed STT or TTS text goes into, only touched by the main loop
+    bool chat_user_open_ = false;
+    bool chat_reply_open_ = false;
     int clock_ticks_ = 0;
+    // Seconds left before a speculatively opened audio channel is closed, 0 if not prewarmed
+    int prewarm_ticks_ = 0;
+    // The prewarm task runs
+    std::atomic<bool> prewarming_ = false;
+    // Held while an audio channel opens, the main loop waits for a prewarm in flight
+    std::mutex channel_open_mutex_;
+    // The MCP notifications made while the audio channel was closed, only touched by the main loop
+    std::deque<std::string> pending_mcp_notifications_;
     TaskHandle_t check_new_version_task_handle_ = nullptr;
     TaskHandle_t main_event_loop_task_handle_ = nullptr;
+    TaskHandle_t audio_send_task_handle_ = nullptr;
 
+    uint32_t AddTimer(uint32_t delay_ms, uint32_t period_ms, ScheduledTask&& callback);
+    void OnClockTick();
+    void RunTask(ScheduledTask& task);
+    void AudioSendTask();
+    void ResetAudioSendStats();
     void OnWakeWordDetected();
+    void FlushMcpNotifications();
+    void PrewarmAudioChannel();
+    // Returns true when the channel is open, maybe by the prewarm
+    bool OpenAudioChannel();
     void CheckNewVersion(Ota& ota);
+    // Runs the step on the main event loop and waits for it, directly when called from there
+    void RunOnMainLoop(const std::function<void()>& step);
+#if CONFIG_OTA_BACKGROUND_DOWNLOAD
+    bool StartBackgroundUpgrade(Ota& ota);
+    void ApplyBackgroundUpgrade();
+#endif
+    bool HasPendingAssetsDownload();
     void CheckAssetsVersion();
+    void DownloadStagedAssets(std::string url);
+    void ApplyStagedAssets();
+    void InitializeAudio(AudioCodec* codec);
+    bool StartProtocol(Ota& ota);
     void ShowActivationCode(const std::string& code, const std::string& message);
+    void ShowStreamedChatMessage(const char* role, const std::string& text);
     void SetListeningMode(ListeningMode mode);
 };
 
@@ -3,16 +3,50 @@
 #include "display.h"
 #include "application.h"
 #include "lvgl_theme.h"
+#include "lvgl_indexed_image.h"
 #include "emote_display.h"
+#include "assets/lang_config.h"
+#include "settings.h"
+#include "task_placement.h"
+#include "http_client.h"
 
 #include <esp_log.h>
 #include <spi_flash_mmap.h>
 #include <esp_timer.h>
+#include <esp_heap_caps.h>
 #include <cbin_font.h>
+#include <mbedtls/sha256.h>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+#if __has_include("rom/miniz.h")
+#include "rom/miniz.h"
+#define ASSETS_HAVE_INFLATE 1
+#endif
 
 
 #define TAG "Assets"
 
+// The settings key of the table digest of the last verified partition
+#define ASSETS_VERIFIED_KEY "verified"
+// The slot in use with the assets_b partition, 0 for assets and 1 for assets_b
+#define ASSETS_SLOT_KEY "slot"
+// The resume point of an interrupted download
+#define ASSETS_RESUME_URL_KEY "dl_url"
+#define ASSETS_RESUME_LENGTH_KEY "dl_length"
+#define ASSETS_RESUME_DONE_KEY "dl_done"
+#define ASSETS_RESUME_SUM_KEY "dl_sum"
+#define ASSETS_RESUME_SAVE_SECTORS 64
+// Sector buffers between the receive and the flash write
+#define ASSETS_DOWNLOAD_BUFFERS 8
+#define ASSETS_DOWNLOAD_ATTEMPTS 5
+#define ASSETS_DOWNLOAD_RETRY_DELAY_MS 2000
+
 struct mmap_assets_table {
     char asset_name[32];          /*!< Name of the asset */
     uint32_t asset_size;          /*!< Size of the asset */
@@ -21,6 +55,15 @@ struct mmap_assets_table {
     uint16_t asset_height;        /*!< Height of the asset */
 };
 
+namespace {
+
+// The name fills the 32 bytes without a terminator when it is that long
+std::string_view AssetName(const mmap_assets_table& item) {
+    return std::string_view(item.asset_name, strnlen(item.asset_name, sizeof(item.asset_name)));
+}
+
+} // namespace
+
 
 Assets::Assets() {
     // Initialize the partition
@@ -28,9 +71,8 @@ Assets::Assets() {
 }
 
 Assets::~Assets() {
-    if (mmap_handle_ != 0) {
-        esp_partition_munmap(mmap_handle_);
-    }
+    UnmapActive();
+    ReleaseRetired();
 }
 
 uint32_t Assets::CalculateChecksum(const char* data, uint32_t length) {
@@ -41,16 +83,87 @@ uint32_t Assets::CalculateChecksum(const char* data, uint32_t length) {
     return checksum & 0xFFFF;
 }
 
+void Assets::ClearIndex() {
+    asset_table_ = nullptr;
+    asset_count_ = 0;
+    asset_data_offset_ = 0;
+    sorted_index_.clear();
+    sorted_index_.shrink_to_fit();
+}
+
+std::string Assets::TableDigest(uint32_t stored_files) const {
+    // The SHA peripheral does the hashing, the table is a few KB even with hundreds of assets
+    uint8_t sha[32];
+    mbedtls_sha256((const unsigned char*)mmap_root_, 12 + stored_files * sizeof(mmap_assets_table), sha, 0);
+    char hex[sizeof(sha) * 2 + 1];
+    for (size_t i = 0; i < sizeof(sha); i++) {
+        snprintf(hex + i * 2, 3, "%02x", sha[i]);
+    }
+    return hex;
+}
+
 bool Assets::InitializePartition() {
     partition_valid_ = false;
     checksum_valid_ = false;
-    assets_.clear();
+    ClearIndex();
 
-    partition_ = esp_partition_find_first(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, "assets");
-    if (partition_ == nullptr) {
+    slots_[0] = esp_partition_find_first(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, "assets");
+    slots_[1] = esp_partition_find_first(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, "assets_b");
+    if (slots_[0] == nullptr) {
         ESP_LOGI(TAG, "No assets partition found");
         return false;
     }
+    if (slots_[1] != nullptr && slots_[1]->size != slots_[0]->size) {
+        ESP_LOGW(TAG, "The assets_b partition is not the size of the assets partition, not used");
+        slots_[1] = nullptr;
+    }
+
+    active_slot_ = 0;
+    if (slots_[1] != nullptr && Settings("assets").GetInt(ASSETS_SLOT_KEY) == 1) {
+        active_slot_ = 1;
+    }
+    if (MapSlot(active_slot_) || slots_[1] == nullptr) {
+        return checksum_valid_;
+    }
+
+    // The other slot holds the bundle before the last switch
+    ESP_LOGW(TAG, "The assets slot %d is not valid, going back to the other one", active_slot_);
+    UnmapActive();
+    active_slot_ = 1 - active_slot_;
+    Settings("assets", true).SetInt(ASSETS_SLOT_KEY, active_slot_);
+    Settings::Flush();
+    return MapSlot(active_slot_);
+}
+
+void Assets::UnmapActive() {
+    if (mmap_handle_ != 0) {
+        esp_partition_munmap(mmap_handle_);
+        mmap_handle_ = 0;
+        mmap_root_ = nullptr;
+    }
+    partition_valid_ = false;
+    checksum_valid_ = false;
+    ClearIndex();
+    ClearCache();
+}
+
+void Assets::ReleaseRetired() {
+    if (retired_mmap_handle_ != 0) {
+        esp_partition_munmap(retired_mmap_handle_);
+        retired_mmap_handle_ = 0;
+    }
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    for (auto& cached : retired_cache_) {
+        heap_caps_free(cached.data);
+    }
+    retired_cache_.clear();
+}
+
+bool Assets::MapSlot(int slot) {
+    partition_valid_ = false;
+    checksum_valid_ = false;
+    ClearIndex();
+    partition_ = slots_[slot];
 
     int free_pages = spi_flash_mmap_get_free_pages(SPI_FLASH_MMAP_DATA);
     uint32_t storage_size = free_pages * 64 * 1024;
@@ -78,38 +191,101 @@ bool Assets::InitializePartition() {
         return false;
     }
 
-    auto start_time = esp_timer_get_time();
-    uint32_t calculated_checksum = CalculateChecksum(mmap_root_ + 12, stored_len);
-    auto end_time = esp_timer_get_time();
-    ESP_LOGI(TAG, "The checksum calculation time is %d ms", int((end_time - start_time) / 1000));
-
-    if (calculated_checksum != stored_chksum) {
-        ESP_LOGE(TAG, "The calculated checksum (0x%lx) does not match the stored checksum (0x%lx)", calculated_checksum, stored_chksum);
+    if (stored_files > UINT16_MAX || stored_files * sizeof(mmap_assets_table) > stored_len) {
+        ESP_LOGE(TAG, "The asset table of %lu files does not fit the stored data", stored_files);
         return false;
     }
 
+    // The whole partition is only summed once, the digest of its table marks it verified
+    std::string digest = TableDigest(stored_files);
+    bool download_verified = download_verified_;
+    download_verified_ = false;
+    if (download_verified || Settings("assets").GetString(ASSETS_VERIFIED_KEY) != digest) {
+        if (!download_verified) {
+            auto start_time = esp_timer_get_time();
+            uint32_t calculated_checksum = CalculateChecksum(mmap_root_ + 12, stored_len);
+            auto end_time = esp_timer_get_time();
+            ESP_LOGI(TAG, "The checksum calculation time is %d ms", int((end_time - start_time) / 1000));
+
+            if (calculated_checksum != stored_chksum) {
+                ESP_LOGE(TAG, "The calculated checksum (0x%lx) does not match the stored checksum (0x%lx)", calculated_checksum, stored_chksum);
+                return false;
+            }
+        }
+        Settings("assets", true).SetString(ASSETS_VERIFIED_KEY, digest);
+    }
     checksum_valid_ = true;
 
-    for (uint32_t i = 0; i < stored_files; i++) {
-        auto item = (const mmap_assets_table*)(mmap_root_ + 12 + i * sizeof(mmap_assets_table));
-        auto asset = Asset{
-            .size = static_cast<size_t>(item->asset_size),
-            .offset = static_cast<size_t>(12 + sizeof(mmap_assets_table) * stored_files + item->asset_offset)
-        };
-        assets_[item->asset_name] = asset;
+    // The build scripts sort the table by name, so it is searched in place. A table packed in
+    // another order gets an index of the entries in name order.
+    asset_table_ = (const mmap_assets_table*)(mmap_root_ + 12);
+    asset_count_ = stored_files;
+    asset_data_offset_ = 12 + sizeof(mmap_assets_table) * stored_files;
+    bool sorted = true;
+    for (uint32_t i = 1; i < asset_count_ && sorted; i++) {
+        sorted = AssetName(asset_table_[i - 1]) <= AssetName(asset_table_[i]);
+    }
+    if (!sorted) {
+        sorted_index_.resize(asset_count_);
+        for (uint32_t i = 0; i < asset_count_; i++) {
+            sorted_index_[i] = i;
+        }
+        std::sort(sorted_index_.begin(), sorted_index_.end(), [this](uint16_t a, uint16_t b) {
+            return AssetName(asset_table_[a]) < AssetName(asset_table_[b]);
+        });
+        ESP_LOGI(TAG, "The asset table is not sorted by name, indexed %lu files", asset_count_);
     }
     return checksum_valid_;
 }
 
+bool Assets::SwitchToStaged() {
+    int slot = staged_slot_;
+    staged_slot_ = -1;
+    int previous_slot = active_slot_;
+    ESP_LOGI(TAG, "Switching the assets to slot %d", slot);
+
+    // The themes, fonts and models still point into the current mapping until Apply() is done,
+    // it is kept until the next download
+    ReleaseRetired();
+    retired_mmap_handle_ = mmap_handle_;
+    mmap_handle_ = 0;
+    mmap_root_ = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        retired_cache_.swap(cache_);
+        cache_bytes_ = 0;
+    }
+
+    if (!MapSlot(slot)) {
+        // Not enough address space for both mappings, or the new bundle is not valid
+        UnmapActive();
+        ReleaseRetired();
+        if (!MapSlot(slot)) {
+            ESP_LOGE(TAG, "The staged assets are not valid, keeping slot %d", previous_slot);
+            UnmapActive();
+            Settings("assets", true).SetInt(ASSETS_SLOT_KEY, previous_slot);
+            Settings::Flush();
+            MapSlot(previous_slot);
+            return false;
+        }
+    }
+    active_slot_ = slot;
+    return true;
+}
+
 bool Assets::Apply() {
     void* ptr = nullptr;
     size_t size = 0;
+    if (staged_slot_ >= 0 && !SwitchToStaged() && !checksum_valid_) {
+        return false;
+    }
     if (!GetAssetData("index.json", ptr, size)) {
         ESP_LOGE(TAG, "The index.json file is not found");
         return false;
     }
 
     cJSON* root = cJSON_ParseWithLength(static_cast<char*>(ptr), size);
+    ReleaseAssetData("index.json");
     if (root == nullptr) {
         ESP_LOGE(TAG, "The index.json file is not valid");
         return false;
@@ -152,11 +328,22 @@ bool Assets::Apply() {
     if (cJSON_IsString(font)) {
         std::string fonts_text_file = font->valuestring;
         if (GetAssetData(fonts_text_file, ptr, size)) {
+            auto font_start_time = esp_timer_get_time();
             auto text_font = std::make_shared<LvglCBinFont>(ptr);
             if (text_font->font() == nullptr) {
                 ESP_LOGE(TAG, "Failed to load fonts.bin");
                 return false;
             }
+            {
+                // The glyphs of the status bar of the locale are drawn all the time
+                DisplayLockGuard lock(Board::GetInstance().GetDisplay());
+                std::string warm_text = std::string(Lang::Strings::STANDBY) + Lang::Strings::CONNECTING +
+                    Lang::Strings::LISTENING + Lang::Strings::SPEAKING + "0123456789:%";
+                text_font->WarmGlyphCache(warm_text.c_str());
+            }
+            // The subset fonts of the default assets build are compared on this line
+            ESP_LOGI(TAG, "Text font %s loaded, %u bytes in %d ms", fonts_text_file.c_str(), (unsigned)size,
+                int((esp_timer_get_time() - font_start_time) / 1000));
             if (light_theme != nullptr) {
                 light_theme->set_text_font(text_font);
             }
@@ -183,7 +370,11 @@ bool Assets::Apply() {
                         ESP_LOGE(TAG, "Emoji %s image file %s is not found", name->valuestring, file->valuestring);
                         continue;
                     }
-                    custom_emoji_collection->AddEmoji(name->valuestring, new LvglRawImage(ptr, size));
+                    if (LvglIndexedImage::IsIndexedImage(ptr, size)) {
+                        custom_emoji_collection->AddEmoji(name->valuestring, new LvglIndexedImage(ptr, size));
+                    } else {
+                        custom_emoji_collection->AddEmoji(name->valuestring, new LvglRawImage(ptr, size));
+                    }
                 }
             }
         }
@@ -257,6 +448,7 @@ bool Assets::Apply() {
     if (cJSON_IsString(font)) {
         std::string fonts_text_file = font->valuestring;
         if (GetAssetData(fonts_text_file, ptr, size)) {
+            auto font_start_time = esp_timer_get_time();
             auto text_font = std::make_shared<LvglCBinFont>(ptr);
             if (text_font->font() == nullptr) {
                 ESP_LOGE(TAG, "Failed to load fonts.bin");
@@ -367,151 +559,596 @@ bool Assets::Apply() {
     return true;
 }
 
-bool Assets::Download(std::string url, std::function<void(int progress, size_t speed)> progress_callback) {
-    ESP_LOGI(TAG, "Downloading new version of assets from %s", url.c_str());
-    
-    // 取消当前资源分区的内存映射
-    if (mmap_handle_ != 0) {
-        esp_partition_munmap(mmap_handle_);
-        mmap_handle_ = 0;
-        mmap_root_ = nullptr;
+namespace {
+
+struct SectorBuffer {
+    char* data;         // nullptr ends the download
+    size_t offset;
+    size_t fill;
+};
+
+/*
+ * Writes the downloaded sectors on a task of its own, so the flash erase and write overlap the
+ * network receive. The unchanged sectors are left as they are, the checksum is summed on the
+ * way and the resume point is saved every ASSETS_RESUME_SAVE_SECTORS sectors.
+ */
+class SectorWriter {
+public:
+    SectorWriter(const esp_partition_t* partition, size_t sector_size, int buffers, size_t committed,
+                 uint32_t checksum, const uint8_t* header)
+        : partition_(partition), sector_size_(sector_size), committed_(committed), checksum_(checksum) {
+        memcpy(header_, header, sizeof(header_));
+        free_buffers_ = xQueueCreate(buffers, sizeof(char*));
+        filled_ = xQueueCreate(buffers + 1, sizeof(SectorBuffer));
+        done_ = xSemaphoreCreateBinary();
+        flash_sector_.resize(sector_size);
+        for (int i = 0; i < buffers; i++) {
+            auto buffer = (char*)heap_caps_malloc(sector_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+            if (buffer == nullptr) {
+                buffer = (char*)heap_caps_malloc(sector_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+            }
+            if (buffer != nullptr) {
+                buffers_.push_back(buffer);
+                xQueueSend(free_buffers_, &buffer, 0);
+            }
+        }
+        if (buffers_.empty() || TaskPlacements::Create(kTaskAssetsWriter, [](void* arg) {
+                auto self = static_cast<SectorWriter*>(arg);
+                self->Loop();
+                xSemaphoreGive(self->done_);
+                TaskPlacements::Delete(kTaskAssetsWriter);
+            }, this) != pdPASS) {
+            failed_ = true;
+            xSemaphoreGive(done_);
+        }
     }
-    checksum_valid_ = false;
-    assets_.clear();
 
-    // 下载新的资源文件
-    auto network = Board::GetInstance().GetNetwork();
-    auto http = network->CreateHttp(0);
-    
-    if (!http->Open("GET", url)) {
-        ESP_LOGE(TAG, "Failed to open HTTP connection");
-        return false;
+    ~SectorWriter() {
+        for (auto buffer : buffers_) {
+            heap_caps_free(buffer);
+        }
+        vQueueDelete(free_buffers_);
+        vQueueDelete(filled_);
+        vSemaphoreDelete(done_);
     }
 
-    if (http->GetStatusCode() != 200) {
-        ESP_LOGE(TAG, "Failed to get assets, status code: %d", http->GetStatusCode());
-        return false;
+    char* Acquire() {
+        char* buffer;
+        xQueueReceive(free_buffers_, &buffer, portMAX_DELAY);
+        return buffer;
     }
 
-    size_t content_length = http->GetBodyLength();
-    if (content_length == 0) {
-        ESP_LOGE(TAG, "Failed to get content length");
-        return false;
+    void Submit(const SectorBuffer& sector) {
+        xQueueSend(filled_, &sector, portMAX_DELAY);
     }
 
-    if (content_length > partition_->size) {
-        ESP_LOGE(TAG, "Assets file size (%u) is larger than partition size (%lu)", content_length, partition_->size);
-        return false;
+    // Waits for the queued sectors, false if one of them failed
+    bool Finish() {
+        // Also after a failure, the task only recycles the buffers then and still waits for the end
+        SectorBuffer end = {nullptr, 0, 0};
+        Submit(end);
+        xSemaphoreTake(done_, portMAX_DELAY);
+        return !failed_;
     }
 
-    // 定义扇区大小为4KB（ESP32的标准扇区大小）
-    const size_t SECTOR_SIZE = esp_partition_get_main_flash_sector_size();
-    
-    // 计算需要擦除的扇区数量
-    size_t sectors_to_erase = (content_length + SECTOR_SIZE - 1) / SECTOR_SIZE; // 向上取整
-    size_t total_erase_size = sectors_to_erase * SECTOR_SIZE;
-    
-    ESP_LOGI(TAG, "Sector size: %u, content length: %u, sectors to erase: %u, total erase size: %u", 
-             SECTOR_SIZE, content_length, sectors_to_erase, total_erase_size);
-    
-    // 写入新的资源文件到分区，一边erase一边写入
-    char buffer[512];
-    size_t total_written = 0;
-    size_t recent_written = 0;
-    size_t current_sector = 0;
-    auto last_calc_time = esp_timer_get_time();
-    
-    while (true) {
-        int ret = http->Read(buffer, sizeof(buffer));
-        if (ret < 0) {
-            ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
-            return false;
-        }
+    bool failed() const { return failed_; }
+    size_t committed() const { return committed_; }
+    uint32_t checksum() const { return checksum_; }
+    const uint8_t* header() const { return header_; }
+    size_t skipped() const { return skipped_; }
 
-        if (ret == 0) {
-            break;
+private:
+    const esp_partition_t* partition_;
+    size_t sector_size_;
+    QueueHandle_t free_buffers_;
+    QueueHandle_t filled_;
+    SemaphoreHandle_t done_;
+    std::vector<char*> buffers_;
+    std::vector<char> flash_sector_;
+    std::atomic<bool> failed_ = false;
+    std::atomic<size_t> committed_;
+    uint32_t checksum_;
+    uint8_t header_[12];
+    size_t skipped_ = 0;
+
+    void Loop() {
+        int unsaved = 0;
+        while (true) {
+            SectorBuffer sector;
+            xQueueReceive(filled_, &sector, portMAX_DELAY);
+            if (sector.data == nullptr) {
+                break;
+            }
+            if (!failed_ && !Write(sector)) {
+                failed_ = true;
+            }
+            xQueueSend(free_buffers_, &sector.data, portMAX_DELAY);
+            if (!failed_ && ++unsaved >= ASSETS_RESUME_SAVE_SECTORS) {
+                SaveResumePoint();
+                unsaved = 0;
+            }
+        }
+        if (!failed_ && unsaved > 0) {
+            SaveResumePoint();
         }
+    }
 
-        // 检查是否需要擦除新的扇区
-        size_t write_end_offset = total_written + ret;
-        size_t needed_sectors = (write_end_offset + SECTOR_SIZE - 1) / SECTOR_SIZE;
-        
-        // 擦除需要的新扇区
-        while (current_sector < needed_sectors) {
-            size_t sector_start = current_sector * SECTOR_SIZE;
-            size_t sector_end = (current_sector + 1) * SECTOR_SIZE;
-            
-            // 确保擦除范围不超过分区大小
-            if (sector_end > partition_->size) {
-                ESP_LOGE(TAG, "Sector end (%u) exceeds partition size (%lu)", sector_end, partition_->size);
+    bool Write(const SectorBuffer& sector) {
+        size_t i = 0;
+        for (; i < sector.fill && sector.offset + i < sizeof(header_); i++) {
+            header_[sector.offset + i] = sector.data[i];
+        }
+        // The header is a byte array, its fields are not aligned
+        uint32_t stored_len;
+        memcpy(&stored_len, header_ + 8, sizeof(stored_len));
+        for (; i < sector.fill; i++) {
+            if (sector.offset + i - sizeof(header_) < stored_len) {
+                checksum_ += sector.data[i];  // The same char arithmetic as CalculateChecksum()
+            }
+        }
+        // 确保擦除范围不超过分区大小
+        if (sector.offset + sector_size_ > partition_->size) {
+            ESP_LOGE(TAG, "Sector end (%u) exceeds partition size (%lu)", sector.offset + sector_size_, partition_->size);
+            return false;
+        }
+        if (esp_partition_read(partition_, sector.offset, flash_sector_.data(), sector.fill) == ESP_OK &&
+            memcmp(flash_sector_.data(), sector.data, sector.fill) == 0) {
+            skipped_++;
+        } else {
+            esp_err_t err = esp_partition_erase_range(partition_, sector.offset, sector_size_);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to erase sector at offset %u: %s", sector.offset, esp_err_to_name(err));
                 return false;
             }
-            
-            ESP_LOGD(TAG, "Erasing sector %u (offset: %u, size: %u)", current_sector, sector_start, SECTOR_SIZE);
-            esp_err_t err = esp_partition_erase_range(partition_, sector_start, SECTOR_SIZE);
+            // 写入数据到分区
+            err = esp_partition_write(partition_, sector.offset, sector.data, sector.fill);
             if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to erase sector %u at offset %u: %s", current_sector, sector_start, esp_err_to_name(err));
+                ESP_LOGE(TAG, "Failed to write to assets partition at offset %u: %s", sector.offset, esp_err_to_name(err));
                 return false;
             }
-            
-            current_sector++;
         }
+        committed_ = sector.offset + sector.fill;
+        return true;
+    }
+
+    void SaveResumePoint() {
+        Settings settings("assets", true);
+        settings.SetInt(ASSETS_RESUME_DONE_KEY, committed_);
+        settings.SetInt(ASSETS_RESUME_SUM_KEY, checksum_);
+    }
+};
+
+} // namespace
+
+/*
+ * One assets download on the HttpClient task: the attempts, each resuming at the last committed
+ * sector, and the switch to the new bundle at the end. The response chunks are gathered into
+ * sectors for the SectorWriter, which waits for a free buffer while the flash is behind.
+ */
+class Assets::DownloadJob {
+public:
+    DownloadJob(Assets& assets, std::string url, std::function<void(int progress, size_t speed)> progress_callback,
+                std::function<void(bool success)> done)
+        : assets_(assets), url_(std::move(url)), progress_callback_(std::move(progress_callback)), done_(std::move(done)) {}
+
+    void Start() {
+        ESP_LOGI(TAG, "Downloading new version of assets from %s", url_.c_str());
+
+        // With two slots the bundle in use stays mapped, the new one goes to the other slot
+        staged_ = assets_.staging_available();
+        if (staged_) {
+            // The slot to write may still be mapped from before the last switch
+            assets_.ReleaseRetired();
+            assets_.staged_slot_ = -1;
+            partition_ = assets_.slots_[1 - assets_.active_slot_];
+        } else {
+            // 取消当前资源分区的内存映射
+            assets_.UnmapActive();
+            partition_ = assets_.partition_;
+        }
+        assets_.download_verified_ = false;
+
+        // 定义扇区大小为4KB（ESP32的标准扇区大小）
+        sector_size_ = esp_partition_get_main_flash_sector_size();
+
+        // An interrupted download of the same URL goes on from its last saved sector
+        Settings settings("assets", true);
+        // A partial download must not pass for the verified partition
+        settings.EraseKey(ASSETS_VERIFIED_KEY);
+        if (settings.GetString(ASSETS_RESUME_URL_KEY) == url_) {
+            length_ = settings.GetInt(ASSETS_RESUME_LENGTH_KEY);
+            done_bytes_ = settings.GetInt(ASSETS_RESUME_DONE_KEY);
+            checksum_ = settings.GetInt(ASSETS_RESUME_SUM_KEY);
+        }
+        if (done_bytes_ == 0 || done_bytes_ >= length_ || done_bytes_ % sector_size_ != 0 ||
+            esp_partition_read(partition_, 0, header_, sizeof(header_)) != ESP_OK) {
+            length_ = 0;
+            done_bytes_ = 0;
+            checksum_ = 0;
+        } else {
+            ESP_LOGI(TAG, "Resuming the download at %u of %u bytes", done_bytes_, length_);
+        }
+        settings.SetString(ASSETS_RESUME_URL_KEY, url_);
+        // Committed before the first sector is written, not after the commit delay
+        Settings::Flush();
 
-        // 写入数据到分区
-        esp_err_t err = esp_partition_write(partition_, total_written, buffer, ret);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to write to assets partition at offset %u: %s", total_written, esp_err_to_name(err));
+        Attempt(0);
+    }
+
+private:
+    enum Outcome {
+        kOutcomeContinue,   // The body was read, what was committed decides
+        kOutcomeRestart,    // The server does not take the range, from the start
+        kOutcomeFatal,      // The response can not be written to the partition
+    };
+
+    Assets& assets_;
+    std::string url_;
+    std::function<void(int progress, size_t speed)> progress_callback_;
+    std::function<void(bool success)> done_;
+    const esp_partition_t* partition_ = nullptr;
+    bool staged_ = false;
+    size_t sector_size_ = 0;
+    size_t length_ = 0;
+    size_t done_bytes_ = 0;
+    uint32_t checksum_ = 0;
+    uint8_t header_[12] = {};
+    size_t skipped_ = 0;
+    int attempt_ = 0;
+
+    // The attempt in progress
+    Outcome outcome_ = kOutcomeContinue;
+    std::unique_ptr<SectorWriter> writer_;
+    SectorBuffer sector_ = {};
+    size_t total_received_ = 0;
+    size_t recent_received_ = 0;
+    int64_t last_calc_time_ = 0;
+
+    void Attempt(uint32_t delay_ms) {
+        outcome_ = kOutcomeContinue;
+        HttpRequest request;
+        request.url = url_;
+        if (done_bytes_ > 0) {
+            request.headers.emplace_back("Range", "bytes=" + std::to_string(done_bytes_) + "-");
+        }
+        request.on_response = [this](int status, size_t body_length) {
+            return OnResponse(status, body_length);
+        };
+        request.on_data = [this](const char* data, size_t size) {
+            return OnData(data, size);
+        };
+        request.on_done = [this](HttpResult result, int, std::string&&) {
+            OnDone(result);
+        };
+        HttpClient::GetInstance().Submit(std::move(request), delay_ms);
+    }
+
+    bool OnResponse(int status, size_t body_length) {
+        if (done_bytes_ > 0 && (status != 206 || body_length != length_ - done_bytes_)) {
+            // The server does not take the range, or the file changed
+            ESP_LOGW(TAG, "Cannot resume (status %d), downloading from the start", status);
+            outcome_ = kOutcomeRestart;
             return false;
         }
+        if (done_bytes_ == 0) {
+            if (status != 200) {
+                ESP_LOGE(TAG, "Failed to get assets, status code: %d", status);
+                outcome_ = kOutcomeFatal;
+                return false;
+            }
+            if (body_length == 0) {
+                ESP_LOGE(TAG, "Failed to get content length");
+                outcome_ = kOutcomeFatal;
+                return false;
+            }
+            if (body_length > partition_->size) {
+                ESP_LOGE(TAG, "Assets file size (%u) is larger than partition size (%lu)", body_length, partition_->size);
+                outcome_ = kOutcomeFatal;
+                return false;
+            }
+            length_ = body_length;
+            Settings settings("assets", true);
+            settings.SetInt(ASSETS_RESUME_LENGTH_KEY, length_);
+            settings.SetInt(ASSETS_RESUME_DONE_KEY, 0);
+        }
+        ESP_LOGI(TAG, "Sector size: %u, content length: %u, from: %u", sector_size_, length_, done_bytes_);
 
-        total_written += ret;
-        recent_written += ret;
+#if CONFIG_SPIRAM
+        const int buffers = ASSETS_DOWNLOAD_BUFFERS;
+#else
+        const int buffers = 2;
+#endif
+        // 写入新的资源文件到分区，接收与擦写在两个任务中并行
+        writer_ = std::make_unique<SectorWriter>(partition_, sector_size_, buffers, done_bytes_, checksum_, header_);
+        total_received_ = done_bytes_;
+        recent_received_ = 0;
+        last_calc_time_ = esp_timer_get_time();
+        sector_ = {nullptr, total_received_, 0};
+        return !writer_->failed();
+    }
 
-        // 计算进度和速度
-        if (esp_timer_get_time() - last_calc_time >= 1000000 || total_written == content_length || ret == 0) {
-            size_t progress = total_written * 100 / content_length;
-            size_t speed = recent_written; // 每秒的字节数
-            ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %u B/s, Sectors erased: %u", 
-                     progress, total_written, content_length, speed, current_sector);
-            if (progress_callback) {
-                progress_callback(progress, speed);
+    bool OnData(const char* data, size_t size) {
+        while (size > 0) {
+            if (writer_->failed()) {
+                return false;
+            }
+            if (sector_.data == nullptr) {
+                sector_ = {writer_->Acquire(), total_received_, 0};
+            }
+            size_t count = std::min(size, sector_size_ - sector_.fill);
+            memcpy(sector_.data + sector_.fill, data, count);
+            sector_.fill += count;
+            data += count;
+            size -= count;
+            total_received_ += count;
+            recent_received_ += count;
+            if (sector_.fill < sector_size_) {
+                continue;
+            }
+            writer_->Submit(sector_);
+            sector_ = {nullptr, total_received_, 0};
+
+            // 计算进度和速度
+            if (esp_timer_get_time() - last_calc_time_ >= 1000000 || total_received_ == length_) {
+                size_t progress = total_received_ * 100 / length_;
+                size_t speed = recent_received_; // 每秒的字节数
+                ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %u B/s", progress, total_received_, length_, speed);
+                if (progress_callback_) {
+                    progress_callback_(progress, speed);
+                }
+                last_calc_time_ = esp_timer_get_time();
+                recent_received_ = 0; // 重置最近接收的字节数
             }
-            last_calc_time = esp_timer_get_time();
-            recent_written = 0; // 重置最近写入的字节数
         }
+        return true;
     }
-    
-    http->Close();
 
-    if (total_written != content_length) {
-        ESP_LOGE(TAG, "Downloaded size (%u) does not match expected size (%u)", total_written, content_length);
-        return false;
+    void OnDone(HttpResult result) {
+        if (outcome_ == kOutcomeFatal) {
+            Complete(false);
+            return;
+        }
+        if (outcome_ == kOutcomeRestart) {
+            done_bytes_ = 0;
+            checksum_ = 0;
+            length_ = 0;
+            Retry();
+            return;
+        }
+        if (writer_ == nullptr) {
+            // No connection
+            Retry();
+            return;
+        }
+
+        // Only whole sectors are committed before a retry, the last one of the file may be short
+        if (sector_.data != nullptr && sector_.fill > 0 && result == kHttpOk && total_received_ == length_) {
+            writer_->Submit(sector_);
+        }
+        sector_ = {};
+        bool written = writer_->Finish();
+        done_bytes_ = writer_->committed();
+        checksum_ = writer_->checksum();
+        memcpy(header_, writer_->header(), sizeof(header_));
+        skipped_ += writer_->skipped();
+        writer_.reset();
+        if (!written) {
+            ESP_LOGE(TAG, "Failed to write the assets partition");
+            Complete(false);
+        } else if (done_bytes_ == length_) {
+            Complete(Finalize());
+        } else if (done_bytes_ > length_) {
+            ESP_LOGE(TAG, "Downloaded size (%u) does not match expected size (%u)", done_bytes_, length_);
+            Complete(false);
+        } else {
+            Retry();
+        }
     }
 
-    ESP_LOGI(TAG, "Assets download completed, total written: %u bytes, total sectors erased: %u", 
-             total_written, current_sector);
+    void Retry() {
+        if (++attempt_ >= ASSETS_DOWNLOAD_ATTEMPTS) {
+            ESP_LOGE(TAG, "Failed to download the assets, %u of %u bytes kept for the next attempt", done_bytes_, length_);
+            Complete(false);
+            return;
+        }
+        ESP_LOGW(TAG, "Download interrupted at %u of %u bytes, retrying", done_bytes_, length_);
+        Attempt(ASSETS_DOWNLOAD_RETRY_DELAY_MS);
+    }
 
-    // 重新初始化资源分区
-    if (!InitializePartition()) {
-        ESP_LOGE(TAG, "Failed to re-initialize assets partition");
+    bool Finalize() {
+        {
+            Settings settings("assets", true);
+            settings.EraseKey(ASSETS_RESUME_URL_KEY);
+            settings.EraseKey(ASSETS_RESUME_LENGTH_KEY);
+            settings.EraseKey(ASSETS_RESUME_DONE_KEY);
+            settings.EraseKey(ASSETS_RESUME_SUM_KEY);
+        }
+        ESP_LOGI(TAG, "Assets download completed, total written: %u bytes, unchanged sectors kept: %u", length_, skipped_);
+        uint32_t stored_chksum;
+        memcpy(&stored_chksum, header_ + 4, sizeof(stored_chksum));
+        if ((checksum_ & 0xFFFF) == stored_chksum) {
+            assets_.download_verified_ = true;
+        }
+
+        if (staged_) {
+            // Apply() switches to it, a reboot before that starts with it
+            assets_.staged_slot_ = 1 - assets_.active_slot_;
+            Settings("assets", true).SetInt(ASSETS_SLOT_KEY, assets_.staged_slot_);
+            Settings::Flush();
+            ESP_LOGI(TAG, "The new assets are staged in slot %d", assets_.staged_slot_);
+            return true;
+        }
+
+        // 重新初始化资源分区
+        if (!assets_.InitializePartition()) {
+            ESP_LOGE(TAG, "Failed to re-initialize assets partition");
+            return false;
+        }
+        return true;
+    }
+
+    // The last thing the job does, it deletes itself
+    void Complete(bool success) {
+        auto done = std::move(done_);
+        delete this;
+        if (done) {
+            done(success);
+        }
+    }
+};
+
+void Assets::DownloadAsync(std::string url, std::function<void(int progress, size_t speed)> progress_callback,
+                           std::function<void(bool success)> done) {
+    auto job = new DownloadJob(*this, std::move(url), std::move(progress_callback), std::move(done));
+    job->Start();
+}
+
+bool Assets::Download(std::string url, std::function<void(int progress, size_t speed)> progress_callback) {
+    if (HttpClient::GetInstance().InClientTask()) {
+        ESP_LOGE(TAG, "Download() would wait for the client task it runs on, use DownloadAsync()");
         return false;
     }
+    struct Completion {
+        SemaphoreHandle_t done;
+        bool success = false;
+    } completion;
+    completion.done = xSemaphoreCreateBinary();
+    DownloadAsync(std::move(url), std::move(progress_callback), [&completion](bool success) {
+        completion.success = success;
+        xSemaphoreGive(completion.done);
+    });
+    xSemaphoreTake(completion.done, portMAX_DELAY);
+    vSemaphoreDelete(completion.done);
+    return completion.success;
+}
 
-    return true;
+const mmap_assets_table* Assets::FindAsset(std::string_view name) const {
+    uint32_t low = 0;
+    uint32_t high = asset_count_;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        auto& item = asset_table_[sorted_index_.empty() ? middle : sorted_index_[middle]];
+        int order = AssetName(item).compare(name);
+        if (order == 0) {
+            return &item;
+        }
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return nullptr;
 }
 
-bool Assets::GetAssetData(const std::string& name, void*& ptr, size_t& size) {
-    auto asset = assets_.find(name);
-    if (asset == assets_.end()) {
+bool Assets::GetAssetData(std::string_view name, void*& ptr, size_t& size) {
+    auto item = FindAsset(name);
+    if (item == nullptr) {
         return false;
     }
-    auto data = (const char*)(mmap_root_ + asset->second.offset);
+    auto data = (const char*)(mmap_root_ + asset_data_offset_ + item->asset_offset);
+    if (data[0] == 'Z' && data[1] == 'C') {
+        return InflateAsset(name, data + 2, item->asset_size, ptr, size);
+    }
     if (data[0] != 'Z' || data[1] != 'Z') {
-        ESP_LOGE(TAG, "The asset %s is not valid with magic %02x%02x", name.c_str(), data[0], data[1]);
+        ESP_LOGE(TAG, "The asset %.*s is not valid with magic %02x%02x", (int)name.size(), name.data(), data[0], data[1]);
         return false;
     }
 
     ptr = static_cast<void*>(const_cast<char*>(data + 2));
-    size = asset->second.size;
+    size = item->asset_size;
+    return true;
+}
+
+void Assets::ReleaseAssetData(std::string_view name) {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    for (auto& cached : cache_) {
+        if (cached.name == name) {
+            cached.held = false;
+            TrimCache();
+            return;
+        }
+    }
+}
+
+// A compressed entry is the decompressed size (u32) followed by a raw deflate stream
+bool Assets::InflateAsset(std::string_view name, const char* data, size_t length, void*& ptr, size_t& size) {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    for (auto it = cache_.begin(); it != cache_.end(); ++it) {
+        if (it->name == name) {
+            it->held = true;
+            cache_.splice(cache_.begin(), cache_, it);
+            ptr = it->data;
+            size = it->size;
+            return true;
+        }
+    }
+
+#ifdef ASSETS_HAVE_INFLATE
+    if (length < 4) {
+        ESP_LOGE(TAG, "The compressed asset %.*s is truncated", (int)name.size(), name.data());
+        return false;
+    }
+    uint32_t inflated_size;
+    memcpy(&inflated_size, data, sizeof(inflated_size));
+    auto output = heap_caps_malloc(inflated_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (output == nullptr) {
+        output = heap_caps_malloc(inflated_size, MALLOC_CAP_8BIT);
+    }
+    // The decompressor state is about 11KB, too large for the caller's stack
+    auto inflator = (tinfl_decompressor*)heap_caps_malloc(sizeof(tinfl_decompressor), MALLOC_CAP_8BIT);
+    if (output == nullptr || inflator == nullptr) {
+        ESP_LOGE(TAG, "No memory to inflate the asset %.*s (%lu bytes)", (int)name.size(), name.data(), inflated_size);
+        heap_caps_free(output);
+        heap_caps_free(inflator);
+        return false;
+    }
+
+    auto start_time = esp_timer_get_time();
+    tinfl_init(inflator);
+    size_t in_bytes = length - 4;
+    size_t out_bytes = inflated_size;
+    auto out = (mz_uint8*)output;
+    tinfl_status status = tinfl_decompress(inflator, (const mz_uint8*)data + 4, &in_bytes, out, out, &out_bytes,
+        TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    heap_caps_free(inflator);
+    if (status != TINFL_STATUS_DONE || out_bytes != inflated_size) {
+        ESP_LOGE(TAG, "Failed to inflate the asset %.*s, status %d", (int)name.size(), name.data(), (int)status);
+        heap_caps_free(output);
+        return false;
+    }
+    ESP_LOGI(TAG, "Inflated %.*s: %u -> %lu bytes in %d ms", (int)name.size(), name.data(), length - 4, inflated_size,
+        int((esp_timer_get_time() - start_time) / 1000));
+
+    cache_.push_front({std::string(name), output, inflated_size, true});
+    cache_bytes_ += inflated_size;
+    TrimCache();
+    ptr = output;
+    size = inflated_size;
     return true;
+#else
+    ESP_LOGE(TAG, "The asset %.*s is compressed, the chip has no inflater", (int)name.size(), name.data());
+    return false;
+#endif
+}
+
+// Drops the least recently used assets no caller holds, the cache lock is held
+void Assets::TrimCache() {
+    for (auto it = cache_.end(); it != cache_.begin() && cache_bytes_ > CONFIG_XIAOZHI_ASSETS_CACHE_SIZE_KB * 1024;) {
+        --it;
+        if (!it->held) {
+            cache_bytes_ -= it->size;
+            heap_caps_free(it->data);
+            it = cache_.erase(it);
+        }
+    }
+}
+
+void Assets::ClearCache() {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    for (auto& cached : cache_) {
+        heap_caps_free(cached.data);
+    }
+    cache_.clear();
+    cache_bytes_ = 0;
 }
@@ -1,19 +1,19 @@
 #ifndef ASSETS_H
 #define ASSETS_H
 
-#include <map>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <list>
+#include <mutex>
 #include <functional>
 
 #include <cJSON.h>
 #include <esp_partition.h>
 #include <model_path.h>
 
-
-struct Asset {
-    size_t size;
-    size_t offset;
-};
+// An entry of the asset table at the start of the partition
+struct mmap_assets_table;
 
 class Assets {
 public:
@@ -23,30 +23,79 @@ public:
     }
     ~Assets();
 
+    // Waits for the download, must not be called from the HttpClient task
     bool Download(std::string url, std::function<void(int progress, size_t speed)> progress_callback);
+    // The download runs on the HttpClient task, the callbacks are called there
+    void DownloadAsync(std::string url, std::function<void(int progress, size_t speed)> progress_callback,
+                       std::function<void(bool success)> done);
     bool Apply();
-    bool GetAssetData(const std::string& name, void*& ptr, size_t& size);
+    // A compressed asset is inflated into the cache, its data stays valid until it is released
+    bool GetAssetData(std::string_view name, void*& ptr, size_t& size);
+    // The caller is done with the data of the asset, a compressed one may be dropped from the cache
+    void ReleaseAssetData(std::string_view name);
 
     inline bool partition_valid() const { return partition_valid_; }
     inline bool checksum_valid() const { return checksum_valid_; }
+    // With an assets_b partition the download goes to the slot not in use and Apply() switches to it
+    inline bool staging_available() const { return slots_[1] != nullptr; }
+    inline bool has_staged() const { return staged_slot_ >= 0; }
     inline std::string default_assets_url() const { return default_assets_url_; }
 
 private:
+    class DownloadJob;
+
     Assets();
     Assets(const Assets&) = delete;
     Assets& operator=(const Assets&) = delete;
 
     bool InitializePartition();
+    bool MapSlot(int slot);
+    void UnmapActive();
+    // Switches to the slot written by Download(), false if it stays on the current one
+    bool SwitchToStaged();
+    // Unmaps the bundle used before the last switch
+    void ReleaseRetired();
     uint32_t CalculateChecksum(const char* data, uint32_t length);
+    void ClearIndex();
+    // SHA-256 of the header and the asset table, the key of the verified partition in the settings
+    std::string TableDigest(uint32_t stored_files) const;
+    // Binary search of the table by name, nullptr if there is no such asset
+    const mmap_assets_table* FindAsset(std::string_view name) const;
+    bool InflateAsset(std::string_view name, const char* data, size_t length, void*& ptr, size_t& size);
+    void TrimCache();
+    void ClearCache();
 
     const esp_partition_t* partition_ = nullptr;
+    const esp_partition_t* slots_[2] = {};
+    int active_slot_ = 0;
+    int staged_slot_ = -1;
+    esp_partition_mmap_handle_t retired_mmap_handle_ = 0;
     esp_partition_mmap_handle_t mmap_handle_ = 0;
     const char* mmap_root_ = nullptr;
     bool partition_valid_ = false;
     bool checksum_valid_ = false;
+    // Download() summed the data as it wrote it, the next initialization skips the scan
+    bool download_verified_ = false;
     std::string default_assets_url_;
     srmodel_list_t* models_list_ = nullptr;
-    std::map<std::string, Asset> assets_;
+    // The asset table is used in place in the mapped partition
+    const mmap_assets_table* asset_table_ = nullptr;
+    uint32_t asset_count_ = 0;
+    size_t asset_data_offset_ = 0;
+    // The table entries in name order when the table is not sorted, empty when it is
+    std::vector<uint16_t> sorted_index_;
+
+    // The inflated copies of the compressed assets, most recently used first
+    struct CachedAsset {
+        std::string name;
+        void* data;
+        size_t size;
+        bool held;
+    };
+    std::mutex cache_mutex_;
+    std::list<CachedAsset> cache_;
+    std::list<CachedAsset> retired_cache_;
+    size_t cache_bytes_ = 0;
 };
 
 #endif
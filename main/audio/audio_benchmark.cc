@@ -0,0 +1,541 @@
+#include "audio_benchmark.h"
+
+#if CONFIG_AUDIO_PIPELINE_BENCHMARK
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <cJSON.h>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <string_view>
+#include <mutex>
+#include <atomic>
+
+#include "audio_service.h"
+#include "audio_codec.h"
+#include "audio_resampler.h"
+#include "ogg_opus_reader.h"
+#include "assets/lang_config.h"
+
+#if CONFIG_AUDIO_PIPELINE_BENCHMARK_WAKE_WORD
+#include <model_path.h>
+#if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
+#include "wake_words/afe_wake_word.h"
+#include "wake_words/custom_wake_word.h"
+#else
+#include "wake_words/esp_wake_word.h"
+#endif
+#endif
+
+#define TAG "AudioBenchmark"
+
+#define BENCHMARK_SAMPLE_INTERVAL_US 1000000
+
+#if CONFIG_AUDIO_PIPELINE_BENCHMARK_UNPACED
+#define BENCHMARK_PACED false
+#else
+#define BENCHMARK_PACED true
+#endif
+
+#if CONFIG_AUDIO_PIPELINE_BENCHMARK_WAV
+extern const char benchmark_corpus_wav_start[] asm("_binary_benchmark_corpus_wav_start");
+extern const char benchmark_corpus_wav_end[] asm("_binary_benchmark_corpus_wav_end");
+#endif
+#if CONFIG_AUDIO_PIPELINE_BENCHMARK_WAKE_WORD
+extern const char benchmark_labels_txt_start[] asm("_binary_benchmark_labels_txt_start");
+extern const char benchmark_labels_txt_end[] asm("_binary_benchmark_labels_txt_end");
+#endif
+
+namespace AudioBenchmark {
+
+namespace {
+
+/*
+ * Replays the corpus in a loop as the microphone and discards the playback. Both directions are
+ * paced at the real-time rate unless the benchmark runs unpaced.
+ */
+class ReplayAudioCodec : public AudioCodec {
+public:
+    ReplayAudioCodec(const std::vector<int16_t>& corpus, int input_sample_rate, int output_sample_rate) : corpus_(corpus) {
+        duplex_ = true;
+        input_reference_ = false;
+        input_channels_ = 1;
+        input_sample_rate_ = input_sample_rate;
+        output_sample_rate_ = output_sample_rate;
+    }
+
+private:
+    const std::vector<int16_t>& corpus_;
+    size_t corpus_position_ = 0;
+    int64_t input_start_us_ = 0;
+    uint64_t input_samples_ = 0;
+    int64_t output_start_us_ = 0;
+    uint64_t output_samples_ = 0;
+
+    static void Pace(int64_t& start_us, uint64_t& samples, int count, int sample_rate) {
+        if (!BENCHMARK_PACED) {
+            return;
+        }
+        int64_t now = esp_timer_get_time();
+        if (start_us == 0) {
+            start_us = now;
+        }
+        samples += count;
+        int64_t due_us = start_us + static_cast<int64_t>(samples * 1000000 / sample_rate);
+        if (due_us - now >= 1000) {
+            vTaskDelay(pdMS_TO_TICKS((due_us - now) / 1000));
+        }
+    }
+
+    int Read(int16_t* dest, int samples) override {
+        for (int i = 0; i < samples; i++) {
+            dest[i] = corpus_[corpus_position_];
+            if (++corpus_position_ == corpus_.size()) {
+                corpus_position_ = 0;
+            }
+        }
+        Pace(input_start_us_, input_samples_, samples, input_sample_rate_);
+        return samples;
+    }
+
+    int Write(const int16_t* data, int samples) override {
+        Pace(output_start_us_, output_samples_, samples, output_sample_rate_);
+        return samples;
+    }
+};
+
+void AppendResampled(std::vector<int16_t>& corpus, const int16_t* pcm, size_t samples, AudioResampler& resampler) {
+    if (resampler.input_sample_rate() == resampler.output_sample_rate()) {
+        corpus.insert(corpus.end(), pcm, pcm + samples);
+        return;
+    }
+    size_t offset = corpus.size();
+    corpus.resize(offset + resampler.GetOutputSamples(samples));
+    resampler.Process(pcm, samples, corpus.data() + offset);
+}
+
+#if CONFIG_AUDIO_PIPELINE_BENCHMARK_WAV
+// 16-bit PCM WAV, the channels are averaged to mono
+bool LoadWav(std::string_view wav, int sample_rate, std::vector<int16_t>& corpus) {
+    if (wav.size() < 12 || memcmp(wav.data(), "RIFF", 4) != 0 || memcmp(wav.data() + 8, "WAVE", 4) != 0) {
+        ESP_LOGE(TAG, "The corpus is not a WAV file");
+        return false;
+    }
+    int channels = 0, rate = 0, bits = 0;
+    size_t offset = 12;
+    while (offset + 8 <= wav.size()) {
+        const uint8_t* chunk = reinterpret_cast<const uint8_t*>(wav.data() + offset);
+        uint32_t chunk_size = chunk[4] | (chunk[5] << 8) | (chunk[6] << 16) | (chunk[7] << 24);
+        const uint8_t* body = chunk + 8;
+        if (memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16) {
+            channels = body[2] | (body[3] << 8);
+            rate = body[4] | (body[5] << 8) | (body[6] << 16) | (body[7] << 24);
+            bits = body[14] | (body[15] << 8);
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (bits != 16 || channels < 1) {
+                ESP_LOGE(TAG, "Unsupported WAV format: %d channels, %d bits", channels, bits);
+                return false;
+            }
+            size_t frames = std::min<size_t>(chunk_size, wav.size() - offset - 8) / (2 * channels);
+            std::vector<int16_t> mono(frames);
+            auto samples = reinterpret_cast<const int16_t*>(body);
+            for (size_t i = 0; i < frames; i++) {
+                int32_t sum = 0;
+                for (int c = 0; c < channels; c++) {
+                    sum += samples[i * channels + c];
+                }
+                mono[i] = sum / channels;
+            }
+            AudioResampler resampler;
+            resampler.Configure(rate, sample_rate);
+            AppendResampled(corpus, mono.data(), mono.size(), resampler);
+            ESP_LOGI(TAG, "Corpus: %u samples at %d Hz from the WAV file", frames, rate);
+            return true;
+        }
+        offset += 8 + chunk_size + (chunk_size & 1);
+    }
+    ESP_LOGE(TAG, "No data chunk in the WAV file");
+    return false;
+}
+#endif
+
+// The recorded prompts shipped with the firmware, used when no WAV corpus is embedded
+void LoadOggPrompts(int sample_rate, std::vector<int16_t>& corpus) {
+    const std::string_view sounds[] = {
+        Lang::Sounds::OGG_WELCOME,
+        Lang::Sounds::OGG_ACTIVATION,
+        Lang::Sounds::OGG_WIFICONFIG,
+    };
+    std::vector<uint8_t> payload;
+    std::vector<int16_t> pcm;
+    for (auto& sound : sounds) {
+        OggOpusReader reader;
+        if (!reader.Open(sound)) {
+            continue;
+        }
+        AudioResampler resampler;
+        resampler.Configure(reader.sample_rate(), sample_rate);
+        std::unique_ptr<OpusDecoderWrapper> decoder;
+        const uint8_t* packet;
+        size_t size;
+        while (reader.NextPacket(packet, size)) {
+            int duration = GetOpusPacketDuration(packet, size);
+            if (decoder == nullptr || decoder->duration_ms() != duration) {
+                decoder = std::make_unique<OpusDecoderWrapper>(reader.sample_rate(), 1, duration);
+            }
+            payload.assign(packet, packet + size);
+            if (decoder->Decode(std::move(payload), pcm)) {
+                AppendResampled(corpus, pcm.data(), pcm.size(), resampler);
+            }
+        }
+    }
+    ESP_LOGI(TAG, "Corpus: %u samples from the built-in prompts", corpus.size());
+}
+
+struct TaskSample {
+    const char* name;
+    bool uplink;
+    uint32_t run_time = 0;
+    uint32_t stack_high_water_mark = 0;
+};
+
+TaskSample task_samples[] = {
+    {"audio_input", true}, {"audio_communication", true}, {"opus_encode", true},
+    {"opus_decode", false}, {"audio_output", false},
+};
+
+void SampleTasks() {
+    UBaseType_t count = uxTaskGetNumberOfTasks();
+    std::vector<TaskStatus_t> status(count);
+    count = uxTaskGetSystemState(status.data(), count, nullptr);
+    for (auto& sample : task_samples) {
+        for (UBaseType_t i = 0; i < count; i++) {
+            if (strcmp(status[i].pcTaskName, sample.name) == 0) {
+                sample.run_time = status[i].ulRunTimeCounter;
+                sample.stack_high_water_mark = status[i].usStackHighWaterMark;
+                break;
+            }
+        }
+    }
+}
+
+void AddHeap(cJSON* root) {
+    cJSON_AddNumberToObject(root, "heap_internal_free", heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    cJSON_AddNumberToObject(root, "heap_internal_min", heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL));
+    cJSON_AddNumberToObject(root, "heap_spiram_free", heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+    cJSON_AddNumberToObject(root, "heap_spiram_min", heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM));
+}
+
+void Print(cJSON* root) {
+    auto json = cJSON_PrintUnformatted(root);
+    printf(AUDIO_BENCHMARK_PREFIX "%s\n", json);
+    cJSON_free(json);
+    cJSON_Delete(root);
+}
+
+#if CONFIG_AUDIO_PIPELINE_BENCHMARK_WAKE_WORD
+struct WakeWordLabel {
+    int start_ms;
+    int end_ms;
+    bool detected = false;
+};
+
+// One "start_ms end_ms" pair per wake word in the corpus, # starts a comment
+std::vector<WakeWordLabel> LoadLabels(std::string_view text) {
+    std::vector<WakeWordLabel> labels;
+    while (!text.empty()) {
+        auto eol = text.find('\n');
+        std::string line(text.substr(0, eol));
+        text.remove_prefix(eol == std::string_view::npos ? text.size() : eol + 1);
+        int start_ms, end_ms;
+        if (line.empty() || line[0] == '#' || sscanf(line.c_str(), "%d %d", &start_ms, &end_ms) != 2) {
+            continue;
+        }
+        labels.push_back({start_ms, end_ms});
+    }
+    ESP_LOGI(TAG, "Labels: %u wake words", labels.size());
+    return labels;
+}
+
+int Percentile(std::vector<int>& values, int percent) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, values.size() * percent / 100)];
+}
+
+uint32_t TaskRunTime(const char* name) {
+    UBaseType_t count = uxTaskGetNumberOfTasks();
+    std::vector<TaskStatus_t> status(count);
+    count = uxTaskGetSystemState(status.data(), count, nullptr);
+    for (UBaseType_t i = 0; i < count; i++) {
+        if (strcmp(status[i].pcTaskName, name) == 0) {
+            return status[i].ulRunTimeCounter;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Replays the corpus once through the wake word engine the models select, as the audio service
+ * would, and matches the detections against the labels. A detection counts for a label when it
+ * comes between its start and its end plus CONFIG_AUDIO_PIPELINE_BENCHMARK_WAKE_WORD_TOLERANCE_MS,
+ * the delay is measured from the end of the label.
+ */
+void RunWakeWord(const std::vector<int16_t>& corpus, int sample_rate) {
+    auto labels = LoadLabels(std::string_view(benchmark_labels_txt_start, benchmark_labels_txt_end - benchmark_labels_txt_start));
+
+    size_t internal_before = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    size_t spiram_before = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    srmodel_list_t* models = esp_srmodel_init("model");
+    std::unique_ptr<WakeWord> wake_word;
+    const char* engine = "none";
+#if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
+    if (esp_srmodel_filter(models, ESP_MN_PREFIX, NULL) != nullptr) {
+        wake_word = std::make_unique<CustomWakeWord>();
+        engine = "custom";
+    } else if (esp_srmodel_filter(models, ESP_WN_PREFIX, NULL) != nullptr) {
+        wake_word = std::make_unique<AfeWakeWord>();
+        engine = "afe";
+    }
+#else
+    if (esp_srmodel_filter(models, ESP_WN_PREFIX, NULL) != nullptr) {
+        wake_word = std::make_unique<EspWakeWord>();
+        engine = "esp";
+    }
+#endif
+    static ReplayAudioCodec codec(corpus, sample_rate, sample_rate);
+    if (wake_word == nullptr || !wake_word->Initialize(&codec, models)) {
+        ESP_LOGE(TAG, "No wake word model to benchmark");
+        return;
+    }
+    size_t model_internal = internal_before - heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    size_t model_spiram = spiram_before - heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+
+    // The AFE engine detects in its own task, the others in Feed()
+    std::atomic<uint64_t> fed_samples = 0;
+    std::mutex mutex;
+    std::vector<std::pair<int, WakeWordDetection>> detections;
+    std::atomic<bool> detected = false;
+    wake_word->OnWakeWordDetected([&](const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        detections.push_back({(int)(fed_samples * 1000 / sample_rate), wake_word->GetLastDetection()});
+        detected = true;
+    });
+
+    std::vector<int16_t> chunk(wake_word->GetFeedSize());
+    size_t chunks = 0;
+    int64_t feed_us = 0;
+    uint32_t detection_task_start = TaskRunTime("audio_detection");
+    int64_t start_us = esp_timer_get_time();
+    wake_word->Start();
+    while (fed_samples + chunk.size() <= corpus.size()) {
+        codec.InputData(chunk);
+        int64_t feed_start_us = esp_timer_get_time();
+        wake_word->Feed(chunk);
+        feed_us += esp_timer_get_time() - feed_start_us;
+        fed_samples += chunk.size();
+        chunks++;
+        // Started again outside of the callback, as the audio service does after a session
+        if (detected.exchange(false)) {
+            wake_word->Start();
+        }
+    }
+    // Let the detection task drain what is still buffered
+    vTaskDelay(pdMS_TO_TICKS(500));
+    wake_word->Stop();
+    double seconds = (esp_timer_get_time() - start_us) / 1000000.0;
+    int64_t cpu_us = feed_us + (TaskRunTime("audio_detection") - detection_task_start);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<int> delays;
+    int false_accepts = 0;
+    for (auto& [time_ms, detection] : detections) {
+        int label_index = -1;
+        for (size_t i = 0; i < labels.size(); i++) {
+            auto& label = labels[i];
+            if (!label.detected && time_ms >= label.start_ms && time_ms <= label.end_ms + CONFIG_AUDIO_PIPELINE_BENCHMARK_WAKE_WORD_TOLERANCE_MS) {
+                label.detected = true;
+                label_index = i;
+                delays.push_back(time_ms - label.end_ms);
+                break;
+            }
+        }
+        if (label_index < 0) {
+            false_accepts++;
+        }
+
+        auto root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "type", "detection");
+        cJSON_AddNumberToObject(root, "time_ms", time_ms);
+        cJSON_AddStringToObject(root, "wake_word", detection.wake_word.c_str());
+        cJSON_AddNumberToObject(root, "confidence", detection.confidence);
+        cJSON_AddNumberToObject(root, "onset_ms", detection.onset_ms);
+        cJSON_AddNumberToObject(root, "label", label_index);
+        if (label_index >= 0) {
+            cJSON_AddNumberToObject(root, "delay_ms", delays.back());
+        }
+        Print(root);
+    }
+
+    int true_accepts = delays.size();
+    double corpus_hours = fed_samples / (double)sample_rate / 3600;
+    auto root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "type", "summary");
+    cJSON_AddStringToObject(root, "mode", "wake_word");
+    cJSON_AddStringToObject(root, "engine", engine);
+    cJSON_AddBoolToObject(root, "paced", BENCHMARK_PACED);
+    cJSON_AddNumberToObject(root, "duration_s", seconds);
+    cJSON_AddNumberToObject(root, "corpus_s", corpus_hours * 3600);
+    cJSON_AddNumberToObject(root, "labels", labels.size());
+    cJSON_AddNumberToObject(root, "true_accepts", true_accepts);
+    cJSON_AddNumberToObject(root, "false_rejects", labels.size() - true_accepts);
+    cJSON_AddNumberToObject(root, "false_accepts", false_accepts);
+    cJSON_AddNumberToObject(root, "false_accepts_per_hour", corpus_hours > 0 ? false_accepts / corpus_hours : 0);
+    cJSON_AddNumberToObject(root, "delay_ms_p50", Percentile(delays, 50));
+    cJSON_AddNumberToObject(root, "delay_ms_p95", Percentile(delays, 95));
+    cJSON_AddNumberToObject(root, "delay_ms_max", delays.empty() ? 0 : delays.back());
+    cJSON_AddNumberToObject(root, "chunk_samples", chunk.size());
+    cJSON_AddNumberToObject(root, "cpu_us_per_chunk", chunks > 0 ? (double)cpu_us / chunks : 0);
+    cJSON_AddNumberToObject(root, "cpu_percent", cpu_us / (seconds * 10000.0));
+    cJSON_AddNumberToObject(root, "model_heap_internal", model_internal);
+    cJSON_AddNumberToObject(root, "model_heap_spiram", model_spiram);
+    AddHeap(root);
+    Print(root);
+}
+#endif
+
+} // namespace
+
+void Run() {
+    // The audio tasks keep a reference to the corpus and the service
+    static std::vector<int16_t> corpus;
+    int input_sample_rate = CONFIG_AUDIO_PIPELINE_BENCHMARK_INPUT_SAMPLE_RATE;
+    int output_sample_rate = CONFIG_AUDIO_PIPELINE_BENCHMARK_OUTPUT_SAMPLE_RATE;
+#if CONFIG_AUDIO_PIPELINE_BENCHMARK_WAV
+    LoadWav(std::string_view(benchmark_corpus_wav_start, benchmark_corpus_wav_end - benchmark_corpus_wav_start),
+        input_sample_rate, corpus);
+#endif
+    if (corpus.empty()) {
+        LoadOggPrompts(input_sample_rate, corpus);
+    }
+    if (corpus.empty()) {
+        ESP_LOGE(TAG, "No corpus to replay");
+        return;
+    }
+
+#if CONFIG_AUDIO_PIPELINE_BENCHMARK_WAKE_WORD
+    RunWakeWord(corpus, input_sample_rate);
+    ESP_LOGI(TAG, "Benchmark finished, reset the board to run it again");
+    vTaskSuspend(nullptr);
+#endif
+
+    static ReplayAudioCodec codec(corpus, input_sample_rate, output_sample_rate);
+    static AudioService audio_service;
+    audio_service.Initialize(&codec);
+    audio_service.Start();
+
+    auto self = xTaskGetCurrentTaskHandle();
+    AudioServiceCallbacks callbacks;
+    callbacks.on_send_queue_available = [self]() {
+        xTaskNotifyGive(self);
+    };
+    audio_service.SetCallbacks(callbacks);
+    audio_service.EnableVoiceProcessing(true);
+
+    auto start = audio_service.GetDebugStatistics();
+    SampleTasks();
+    uint32_t start_run_time[sizeof(task_samples) / sizeof(task_samples[0])];
+    for (size_t i = 0; i < sizeof(task_samples) / sizeof(task_samples[0]); i++) {
+        start_run_time[i] = task_samples[i].run_time;
+    }
+
+    int64_t start_us = esp_timer_get_time();
+    int64_t end_us = start_us + static_cast<int64_t>(CONFIG_AUDIO_PIPELINE_BENCHMARK_SECONDS) * 1000000;
+    int64_t next_sample_us = start_us + BENCHMARK_SAMPLE_INTERVAL_US;
+    uint32_t looped_back = 0;
+    int64_t now_us;
+    while ((now_us = esp_timer_get_time()) < end_us) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+
+        /* Loop the uplink back as the downlink, the keepalive packets have nothing to decode */
+        while (auto packet = audio_service.PopPacketFromSendQueue()) {
+            if (packet->payload.empty()) {
+                continue;
+            }
+            packet->sample_rate = 16000;
+            if (audio_service.PushPacketToDecodeQueue(std::move(packet), true)) {
+                looped_back++;
+            }
+        }
+
+        if (now_us >= next_sample_us) {
+            next_sample_us += BENCHMARK_SAMPLE_INTERVAL_US;
+            auto& stats = audio_service.GetDebugStatistics();
+            auto depths = audio_service.GetQueueDepths();
+            auto root = cJSON_CreateObject();
+            cJSON_AddStringToObject(root, "type", "sample");
+            cJSON_AddNumberToObject(root, "time_ms", (now_us - start_us) / 1000);
+            cJSON_AddNumberToObject(root, "input", stats.input_count - start.input_count);
+            cJSON_AddNumberToObject(root, "encoded", stats.encode_count - start.encode_count);
+            cJSON_AddNumberToObject(root, "decoded", stats.decode_count - start.decode_count);
+            cJSON_AddNumberToObject(root, "played", stats.playback_count - start.playback_count);
+            cJSON_AddNumberToObject(root, "encode_queue", depths.encode);
+            cJSON_AddNumberToObject(root, "send_queue", depths.send);
+            cJSON_AddNumberToObject(root, "decode_queue", depths.decode);
+            cJSON_AddNumberToObject(root, "playback_queue", depths.playback);
+            AddHeap(root);
+            Print(root);
+        }
+    }
+
+    SampleTasks();
+    auto& stats = audio_service.GetDebugStatistics();
+    double seconds = (now_us - start_us) / 1000000.0;
+    uint32_t encoded = stats.encode_count - start.encode_count;
+    uint32_t decoded = stats.decode_count - start.decode_count;
+    uint32_t played = stats.playback_count - start.playback_count;
+
+    auto root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "type", "summary");
+    cJSON_AddBoolToObject(root, "paced", BENCHMARK_PACED);
+    cJSON_AddNumberToObject(root, "duration_s", seconds);
+    cJSON_AddNumberToObject(root, "frame_duration_ms", audio_service.frame_duration());
+    cJSON_AddNumberToObject(root, "input_sample_rate", input_sample_rate);
+    cJSON_AddNumberToObject(root, "output_sample_rate", output_sample_rate);
+    cJSON_AddNumberToObject(root, "encoded_fps", encoded / seconds);
+    cJSON_AddNumberToObject(root, "decoded_fps", decoded / seconds);
+    cJSON_AddNumberToObject(root, "played_fps", played / seconds);
+    cJSON_AddNumberToObject(root, "looped_back", looped_back);
+
+    /* Run time counters are in esp_timer microseconds */
+    auto tasks = cJSON_CreateObject();
+    for (size_t i = 0; i < sizeof(task_samples) / sizeof(task_samples[0]); i++) {
+        auto& sample = task_samples[i];
+        uint32_t frames = sample.uplink ? encoded : decoded;
+        auto task = cJSON_CreateObject();
+        cJSON_AddNumberToObject(task, "cpu_us_per_frame", frames > 0 ? (double)(sample.run_time - start_run_time[i]) / frames : 0);
+        cJSON_AddNumberToObject(task, "cpu_percent", (sample.run_time - start_run_time[i]) / (seconds * 10000.0));
+        cJSON_AddNumberToObject(task, "stack_high_water_mark", sample.stack_high_water_mark);
+        cJSON_AddItemToObject(tasks, sample.name, task);
+    }
+    cJSON_AddItemToObject(root, "tasks", tasks);
+    AddHeap(root);
+    cJSON_AddItemToObject(root, "latency", audio_service.GetLatencyTracer().GetStatsJson());
+    Print(root);
+
+    audio_service.EnableVoiceProcessing(false);
+    audio_service.Stop();
+    ESP_LOGI(TAG, "Benchmark finished, reset the board to run it again");
+    vTaskSuspend(nullptr);
+}
+
+} // namespace AudioBenchmark
+
+#endif // CONFIG_AUDIO_PIPELINE_BENCHMARK
@@ -0,0 +1,36 @@
+#ifndef AUDIO_BENCHMARK_H
+#define AUDIO_BENCHMARK_H
+
+#include <sdkconfig.h>
+
+#if CONFIG_AUDIO_PIPELINE_BENCHMARK
+
+/*
+ * Audio pipeline benchmark firmware.
+ *
+ * Replaces the application: a real AudioService runs on a codec that replays a recorded corpus,
+ * and every encoded uplink packet is looped back into the decode queue. So the capture, processor,
+ * encoder, decoder, resamplers and playback all run as in a conversation, without a network or
+ * I2S. The codec paces the input and the playback to real time, so the CPU time and queue depths
+ * are those of a conversation. With CONFIG_AUDIO_PIPELINE_BENCHMARK_UNPACED it replays as fast
+ * as the pipeline consumes, and the frame rate is the pipeline throughput.
+ *
+ * The results are printed as JSON lines prefixed with AUDIO_BENCHMARK_PREFIX, one sample per
+ * second (frame counters, queue depths, heap) and a summary at the end (frames per second,
+ * CPU time per frame of each audio task, heap and stack high-water marks, latency stages).
+ * scripts/audio_benchmark.py turns a captured log into a JSON report.
+ *
+ * With CONFIG_AUDIO_PIPELINE_BENCHMARK_WAKE_WORD only the wake word engine runs: the WAV corpus
+ * is fed once through it and the detections are scored against a labels file.
+ */
+
+#define AUDIO_BENCHMARK_PREFIX "AUDIO_BENCH "
+
+namespace AudioBenchmark {
+    // Runs for CONFIG_AUDIO_PIPELINE_BENCHMARK_SECONDS, prints the results and never returns
+    void Run();
+}
+
+#endif // CONFIG_AUDIO_PIPELINE_BENCHMARK
+
+#endif // AUDIO_BENCHMARK_H
@@ -1,13 +1,26 @@
 #include "audio_codec.h"
 #include "board.h"
 #include "settings.h"
+#include "pcm_utils.h"
+#include "trace_recorder.h"
+#include "spsc_queue.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <cstring>
+#include <algorithm>
 #include <driver/i2s_common.h>
 
 #define TAG "AudioCodec"
 
+/*
+ * The fine steps below a hardware volume step, Q16. esp_codec_dev maps the volume linearly
+ * onto -49.5 to 0 dB, so one volume step is 0.495 dB: index n is -0.495 * n dB.
+ */
+static const int32_t kFineStepGain[AUDIO_CODEC_VOLUME_STEP] = {
+    65536, 61906, 58476, 55237, 52177, 49287, 46556, 43977, 41541, 39240,
+};
+
 AudioCodec::AudioCodec() {
 }
 
@@ -15,17 +28,299 @@ AudioCodec::~AudioCodec() {
 }
 
 void AudioCodec::OutputData(std::vector<int16_t>& data) {
+    CheckGlitch(kAudioGlitchUnderrun, &tx_overflows_, &tx_overflow_us_, tx_last_write_us_);
+    // A codec applying the digital gain in its own conversion gets it from NextOutputGain()
+    if (volume_control_ == kVolumeHardware &&
+        (output_gain_ != AUDIO_CODEC_GAIN_UNITY || output_gain_target_.load(std::memory_order_relaxed) != AUDIO_CODEC_GAIN_UNITY)) {
+        int32_t gain, step;
+        NextOutputGain(data.size(), &gain, &step);
+        PcmAttenuateRamp(data.data(), data.size(), gain, step);
+    }
+#if CONFIG_USE_SERVER_AEC
+    /*
+     * Write one DMA buffer at a time and count it once it is queued. The write blocks until the
+     * DMA frees a buffer, so a buffer is always counted before its completion interrupt fires.
+     */
+    size_t chunk = dma_profile_.frame_num;
+    for (size_t offset = 0; offset < data.size(); offset += chunk) {
+        int samples = std::min(chunk, data.size() - offset);
+        Write(data.data() + offset, samples);
+        tx_written_samples_.fetch_add(samples, std::memory_order_release);
+    }
+#else
     Write(data.data(), data.size());
+#endif
+#if CONFIG_AUDIO_SINGLE_TASK
+    // Counted once queued, a buffer sent meanwhile is taken for silence and the ring for fuller
+    tx_dma_written_.fetch_add(data.size() / output_channels_, std::memory_order_release);
+#endif
+    tx_last_write_us_ = esp_timer_get_time();
+}
+
+#if CONFIG_USE_SERVER_AEC || CONFIG_AUDIO_SINGLE_TASK
+bool IRAM_ATTR AudioCodec::OnTxSent(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) {
+    auto codec = static_cast<AudioCodec*>(user_ctx);
+#if CONFIG_USE_SERVER_AEC
+    int64_t now = esp_timer_get_time();
+    uint32_t written = codec->tx_written_samples_.load(std::memory_order_acquire);
+    portENTER_CRITICAL_ISR(&codec->tx_lock_);
+    // A buffer sent while nothing is queued is silence, it does not move the position
+    uint32_t pending = written - codec->tx_played_samples_;
+    codec->tx_played_samples_ += std::min<uint32_t>(pending, codec->dma_profile_.frame_num);
+    codec->tx_played_us_ = now;
+    portEXIT_CRITICAL_ISR(&codec->tx_lock_);
+#endif
+#if CONFIG_AUDIO_SINGLE_TASK
+    uint32_t queued = codec->tx_dma_written_.load(std::memory_order_acquire) -
+        codec->tx_dma_sent_.load(std::memory_order_relaxed);
+    if (queued > 0) {
+        codec->tx_dma_sent_.fetch_add(std::min<uint32_t>(queued, codec->dma_profile_.frame_num), std::memory_order_release);
+    }
+    codec->NotifyDmaWaiterFromIsr();
+#endif
+    return false;
+}
+#endif
+
+#if CONFIG_USE_SERVER_AEC
+
+int64_t AudioCodec::GetPlayoutTime(uint32_t position) {
+    portENTER_CRITICAL(&tx_lock_);
+    uint32_t played = tx_played_samples_;
+    int64_t played_us = tx_played_us_;
+    portEXIT_CRITICAL(&tx_lock_);
+    if (played_us == 0) {
+        played_us = esp_timer_get_time();
+    }
+    // Positions ahead of the DMA are assumed to play back to back
+    int32_t delta = static_cast<int32_t>(position - played);
+    return played_us + static_cast<int64_t>(delta) * 1000000 / output_sample_rate_;
 }
+#endif
 
 bool AudioCodec::InputData(std::vector<int16_t>& data) {
+    CheckGlitch(kAudioGlitchOverrun, &rx_overflows_, &rx_overflow_us_, rx_last_read_us_);
     int samples = Read(data.data(), data.size());
+    rx_last_read_us_ = esp_timer_get_time();
+#if CONFIG_AUDIO_SINGLE_TASK
+    rx_dma_read_ += data.size() / input_channels_;
+#endif
     if (samples > 0) {
         return true;
     }
     return false;
 }
 
+bool IRAM_ATTR AudioCodec::OnTxQueueOverflow(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) {
+    auto codec = static_cast<AudioCodec*>(user_ctx);
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL_ISR(&codec->glitch_lock_);
+    bool first = codec->tx_overflows_++ == 0;
+    if (first) {
+        codec->tx_overflow_us_ = now;
+    }
+    portEXIT_CRITICAL_ISR(&codec->glitch_lock_);
+#if CONFIG_USE_TRACE_RECORDER && !CONFIG_I2S_ISR_IRAM_SAFE
+    // On the timeline of the interrupted task. The end of every stream shows too, the trace
+    // recorder is not in IRAM
+    if (first) {
+        TraceRecorder::GetInstance().Instant("i2s_tx_dry");
+    }
+#endif
+    return false;
+}
+
+bool IRAM_ATTR AudioCodec::OnRxQueueOverflow(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) {
+    auto codec = static_cast<AudioCodec*>(user_ctx);
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL_ISR(&codec->glitch_lock_);
+    bool first = codec->rx_overflows_++ == 0;
+    if (first) {
+        codec->rx_overflow_us_ = now;
+    }
+    portEXIT_CRITICAL_ISR(&codec->glitch_lock_);
+#if CONFIG_USE_TRACE_RECORDER && !CONFIG_I2S_ISR_IRAM_SAFE
+    if (first) {
+        TraceRecorder::GetInstance().Instant("i2s_rx_full");
+    }
+#endif
+    return false;
+}
+
+#if CONFIG_AUDIO_SINGLE_TASK
+bool IRAM_ATTR AudioCodec::OnRxReceived(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) {
+    auto codec = static_cast<AudioCodec*>(user_ctx);
+    codec->rx_dma_received_.fetch_add(codec->dma_profile_.frame_num, std::memory_order_release);
+    codec->NotifyDmaWaiterFromIsr();
+    return false;
+}
+
+void IRAM_ATTR AudioCodec::NotifyDmaWaiterFromIsr() {
+    TaskHandle_t task = dma_waiter_.load(std::memory_order_acquire);
+    if (task != nullptr) {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveIndexedFromISR(task, SPSC_QUEUE_NOTIFY_INDEX, &woken);
+        portYIELD_FROM_ISR(woken);
+    }
+}
+
+// A ring that does not move for twice its length is not trusted anymore, until it moves again:
+// the caller writes or reads and waits in the driver as the tasks of the threaded mode do
+static bool IsReadyOrStalled(bool ready, int64_t* not_ready_us, uint32_t ring, int sample_rate) {
+    if (ready) {
+        *not_ready_us = 0;
+        return true;
+    }
+    int64_t now = esp_timer_get_time();
+    if (*not_ready_us == 0) {
+        *not_ready_us = now;
+        return false;
+    }
+    return sample_rate > 0 && now - *not_ready_us > 2000000LL * ring / sample_rate;
+}
+
+bool AudioCodec::CanWrite(size_t samples) {
+    if (tx_handle_ == nullptr || !output_enabled_) {
+        return true;
+    }
+    uint32_t ring = dma_profile_.desc_num * dma_profile_.frame_num;
+    uint32_t queued = tx_dma_written_.load(std::memory_order_relaxed) - tx_dma_sent_.load(std::memory_order_acquire);
+    uint32_t frames = std::min<uint32_t>(samples / output_channels_, ring - dma_profile_.frame_num);
+    return IsReadyOrStalled(queued <= ring - frames, &tx_not_ready_us_, ring, output_sample_rate_);
+}
+
+bool AudioCodec::CanRead(size_t samples) {
+    if (rx_handle_ == nullptr || !input_enabled_) {
+        return true;
+    }
+    uint32_t ring = dma_profile_.desc_num * dma_profile_.frame_num;
+    uint32_t received = rx_dma_received_.load(std::memory_order_acquire);
+    // The oldest buffers of a full ring were overwritten, the read starts at the oldest one left
+    if (received - rx_dma_read_ > ring) {
+        rx_dma_read_ = received - ring;
+    }
+    uint32_t frames = std::min<uint32_t>(samples / input_channels_, ring - dma_profile_.frame_num);
+    return IsReadyOrStalled(received - rx_dma_read_ >= frames, &rx_not_ready_us_, ring, input_sample_rate_);
+}
+#endif
+
+void AudioCodec::CheckGlitch(AudioGlitchType type, uint32_t* overflows, int64_t* overflow_us, int64_t last_us) {
+    portENTER_CRITICAL(&glitch_lock_);
+    uint32_t buffers = *overflows;
+    int64_t first_us = *overflow_us;
+    *overflows = 0;
+    portEXIT_CRITICAL(&glitch_lock_);
+    if (buffers == 0) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    if (last_us == 0 || now - last_us > AUDIO_CODEC_GLITCH_MAX_GAP_MS * 1000LL) {
+        return;
+    }
+
+    AudioGlitch glitch = {
+        .type = type,
+        .time_us = first_us,
+        .buffers = (int)buffers,
+        .duration_ms = (int)((now - first_us) / 1000),
+    };
+    {
+        std::lock_guard<std::mutex> lock(glitch_stats_mutex_);
+        if (type == kAudioGlitchUnderrun) {
+            glitch_stats_.underruns++;
+            glitch_stats_.underrun_buffers += buffers;
+        } else {
+            glitch_stats_.overruns++;
+            glitch_stats_.overrun_buffers += buffers;
+        }
+        recent_glitches_[glitches_++ % AUDIO_CODEC_RECENT_GLITCHES] = glitch;
+    }
+    // Next to the i2s_tx_dry / i2s_rx_full instant of the interrupt, at the write or read that
+    // ended the glitch
+    TraceRecorder::GetInstance().Instant(type == kAudioGlitchUnderrun ? "i2s_underrun" : "i2s_overrun");
+}
+
+AudioGlitchStats AudioCodec::GetGlitchStats() {
+    std::lock_guard<std::mutex> lock(glitch_stats_mutex_);
+    AudioGlitchStats stats = glitch_stats_;
+    uint32_t count = std::min<uint32_t>(glitches_, AUDIO_CODEC_RECENT_GLITCHES);
+    for (uint32_t i = glitches_ - count; i < glitches_; i++) {
+        stats.recent.push_back(recent_glitches_[i % AUDIO_CODEC_RECENT_GLITCHES]);
+    }
+    return stats;
+}
+
+void AudioCodec::AttachTxChannel() {
+    // The callbacks can only be registered while the channel is disabled
+    i2s_event_callbacks_t callbacks = {};
+    callbacks.on_send_q_ovf = OnTxQueueOverflow;
+#if CONFIG_USE_SERVER_AEC || CONFIG_AUDIO_SINGLE_TASK
+    callbacks.on_sent = OnTxSent;
+#endif
+    ESP_ERROR_CHECK_WITHOUT_ABORT(i2s_channel_register_event_callback(tx_handle_, &callbacks, this));
+    portENTER_CRITICAL(&glitch_lock_);
+    tx_overflows_ = 0;
+    portEXIT_CRITICAL(&glitch_lock_);
+#if CONFIG_AUDIO_SINGLE_TASK
+    tx_dma_sent_.store(tx_dma_written_.load(std::memory_order_relaxed), std::memory_order_release);
+#endif
+#if CONFIG_USE_SERVER_AEC
+    // A new channel starts with empty DMA buffers
+    portENTER_CRITICAL(&tx_lock_);
+    tx_played_samples_ = tx_written_samples_.load(std::memory_order_acquire);
+    tx_played_us_ = 0;
+    portEXIT_CRITICAL(&tx_lock_);
+#endif
+}
+
+void AudioCodec::AttachRxChannel() {
+    i2s_event_callbacks_t callbacks = {};
+    callbacks.on_recv_q_ovf = OnRxQueueOverflow;
+#if CONFIG_AUDIO_SINGLE_TASK
+    callbacks.on_recv = OnRxReceived;
+#endif
+    ESP_ERROR_CHECK_WITHOUT_ABORT(i2s_channel_register_event_callback(rx_handle_, &callbacks, this));
+    portENTER_CRITICAL(&glitch_lock_);
+    rx_overflows_ = 0;
+    portEXIT_CRITICAL(&glitch_lock_);
+#if CONFIG_AUDIO_SINGLE_TASK
+    rx_dma_read_ = rx_dma_received_.load(std::memory_order_acquire);
+#endif
+}
+
+bool AudioCodec::SetDmaProfile(const AudioDmaProfile& profile) {
+    return false;
+}
+
+bool AudioCodec::SetOutputSampleRate(int sample_rate) {
+    return sample_rate == output_sample_rate_;
+}
+
+bool AudioCodec::FlushOutput() {
+    if (tx_handle_ == nullptr || duplex_ || !output_enabled_) {
+        return false;
+    }
+    if (i2s_channel_disable(tx_handle_) != ESP_OK) {
+        return false;
+    }
+    // Zeros are silence whatever the slot width, preload them until every descriptor is overwritten
+    static const uint8_t zeros[512] = {};
+    size_t loaded;
+    do {
+        loaded = 0;
+        if (i2s_channel_preload_data(tx_handle_, zeros, sizeof(zeros), &loaded) != ESP_OK) {
+            break;
+        }
+    } while (loaded == sizeof(zeros));
+#if CONFIG_AUDIO_SINGLE_TASK
+    tx_dma_sent_.store(tx_dma_written_.load(std::memory_order_relaxed), std::memory_order_release);
+#endif
+    ESP_ERROR_CHECK(i2s_channel_enable(tx_handle_));
+    // The preloaded silence runs out before the next stream, that is no underrun
+    tx_last_write_us_ = 0;
+    return true;
+}
+
 void AudioCodec::Start() {
     Settings settings("audio", false);
     output_volume_ = settings.GetInt("output_volume", output_volume_);
@@ -33,12 +328,15 @@ void AudioCodec::Start() {
         ESP_LOGW(TAG, "Output volume value (%d) is too small, setting to default (10)", output_volume_);
         output_volume_ = 10;
     }
+    UpdateOutputGain();
 
     if (tx_handle_ != nullptr) {
+        AttachTxChannel();
         ESP_ERROR_CHECK(i2s_channel_enable(tx_handle_));
     }
 
     if (rx_handle_ != nullptr) {
+        AttachRxChannel();
         ESP_ERROR_CHECK(i2s_channel_enable(rx_handle_));
     }
 
@@ -53,6 +351,35 @@ void AudioCodec::SetOutputVolume(int volume) {
     
     Settings settings("audio", true);
     settings.SetInt("output_volume", output_volume_);
+    UpdateOutputGain();
+}
+
+int AudioCodec::hardware_volume() const {
+    if (volume_control_ != kVolumeHardware || output_volume_ <= 0) {
+        return output_volume_;
+    }
+    // Rounded up, the digital gain only attenuates
+    int steps = (output_volume_ + AUDIO_CODEC_VOLUME_STEP - 1) / AUDIO_CODEC_VOLUME_STEP;
+    return std::min(steps * AUDIO_CODEC_VOLUME_STEP, 100);
+}
+
+void AudioCodec::UpdateOutputGain() {
+    int volume = std::clamp(output_volume_, 0, 100);
+    int32_t gain = AUDIO_CODEC_GAIN_UNITY;
+    if (volume_control_ == kVolumeDigital) {
+        // Square law, closer to the loudness heard than a linear gain
+        gain = volume * volume * AUDIO_CODEC_GAIN_UNITY / 10000;
+    } else if (volume_control_ == kVolumeHardware) {
+        gain = kFineStepGain[std::min(hardware_volume() - volume, AUDIO_CODEC_VOLUME_STEP - 1)];
+    }
+    output_gain_target_.store(gain, std::memory_order_relaxed);
+}
+
+void AudioCodec::NextOutputGain(size_t samples, int32_t* gain, int32_t* step) {
+    int32_t target = output_gain_target_.load(std::memory_order_relaxed);
+    *gain = output_gain_;
+    *step = samples > 0 ? (target - output_gain_) / (int32_t)samples : 0;
+    output_gain_ = target;
 }
 
 void AudioCodec::SetInputGain(float gain) {
@@ -65,6 +392,11 @@ void AudioCodec::EnableInput(bool enable) {
         return;
     }
     input_enabled_ = enable;
+    input_standby_ = false;
+#if CONFIG_AUDIO_SINGLE_TASK
+    // The codec restarts the channel or not, the next read is not taken for ready either way
+    rx_dma_read_ = rx_dma_received_.load(std::memory_order_acquire);
+#endif
     ESP_LOGI(TAG, "Set input enable to %s", enable ? "true" : "false");
 }
 
@@ -73,5 +405,32 @@ void AudioCodec::EnableOutput(bool enable) {
         return;
     }
     output_enabled_ = enable;
+    output_standby_ = false;
+#if CONFIG_USE_SERVER_AEC
+    // Whatever was queued when the output stopped is not played anymore
+    portENTER_CRITICAL(&tx_lock_);
+    tx_played_samples_ = tx_written_samples_.load(std::memory_order_acquire);
+    tx_played_us_ = 0;
+    portEXIT_CRITICAL(&tx_lock_);
+#endif
+#if CONFIG_AUDIO_SINGLE_TASK
+    tx_dma_sent_.store(tx_dma_written_.load(std::memory_order_relaxed), std::memory_order_release);
+#endif
     ESP_LOGI(TAG, "Set output enable to %s", enable ? "true" : "false");
 }
+
+void AudioCodec::SetInputStandby(bool standby) {
+    if (!input_enabled_ || standby == input_standby_) {
+        return;
+    }
+    input_standby_ = standby;
+    ESP_LOGI(TAG, "Set input standby to %s", standby ? "true" : "false");
+}
+
+void AudioCodec::SetOutputStandby(bool standby) {
+    if (!output_enabled_ || standby == output_standby_) {
+        return;
+    }
+    output_standby_ = standby;
+    ESP_LOGI(TAG, "Set output standby to %s", standby ? "true" : "false");
+}
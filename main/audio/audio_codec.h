@@ -1,6 +1,7 @@
 #ifndef _AUDIO_CODEC_H
 #define _AUDIO_CODEC_H
 
+#include <sdkconfig.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 #include <driver/i2s_std.h>
@@ -8,12 +9,55 @@
 #include <vector>
 #include <string>
 #include <functional>
+#include <atomic>
+#include <mutex>
 
 #include "board.h"
 
 #define AUDIO_CODEC_DMA_DESC_NUM 6
 #define AUDIO_CODEC_DMA_FRAME_NUM 240
 
+// I2S DMA depth, shallow buffers cut the latency, deep ones wake the CPU less often
+struct AudioDmaProfile {
+    int desc_num;
+    int frame_num;
+};
+
+#define AUDIO_CODEC_DMA_PROFILE_DEFAULT { AUDIO_CODEC_DMA_DESC_NUM, AUDIO_CODEC_DMA_FRAME_NUM }
+#define AUDIO_CODEC_DMA_PROFILE_LOW_LATENCY { 4, 120 }
+#define AUDIO_CODEC_DMA_PROFILE_IDLE { 4, 480 }
+
+// A codec with a hardware volume is only written at multiples of this, the digital gain trims in between
+#define AUDIO_CODEC_VOLUME_STEP 10
+// Unity of the digital output gain, Q16
+#define AUDIO_CODEC_GAIN_UNITY 65536
+// A DMA overflow followed by a write or read within this time is a glitch, a longer silence is
+// the end of a stream or a pause of the input
+#define AUDIO_CODEC_GLITCH_MAX_GAP_MS 500
+// The last glitches kept with their time
+#define AUDIO_CODEC_RECENT_GLITCHES 8
+
+enum AudioGlitchType {
+    kAudioGlitchUnderrun,   // The TX DMA ran dry in a stream, the DAC played silence
+    kAudioGlitchOverrun,    // The RX DMA overflowed while the input was read, samples were lost
+};
+
+struct AudioGlitch {
+    AudioGlitchType type;
+    int64_t time_us;        // The first DMA buffer missed
+    int buffers;            // The DMA buffers missed
+    int duration_ms;        // Until the next write or read
+};
+
+struct AudioGlitchStats {
+    uint32_t underruns = 0;
+    uint32_t overruns = 0;
+    uint32_t underrun_buffers = 0;
+    uint32_t overrun_buffers = 0;
+    // Oldest first
+    std::vector<AudioGlitch> recent;
+};
+
 class AudioCodec {
 public:
     AudioCodec();
@@ -23,9 +67,22 @@ public:
     virtual void SetInputGain(float gain);
     virtual void EnableInput(bool enable);
     virtual void EnableOutput(bool enable);
+    // Standby keeps the device open and I2S clocked but mutes the ADC / DAC, so leaving it is cheap
+    virtual void SetInputStandby(bool standby);
+    virtual void SetOutputStandby(bool standby);
+    // Recreate the I2S channels with another DMA depth, returns false if the codec does not support it
+    virtual bool SetDmaProfile(const AudioDmaProfile& profile);
+    // Replace the audio queued in the TX DMA ring with silence, for a barge-in. Returns false when
+    // the codec cannot: a duplex channel pair shares its clock, stopping TX would stall the input
+    virtual bool FlushOutput();
+    // Retune the output clock to another sample rate, with nothing left to play in the TX DMA
+    // ring. Returns false when the codec cannot: a duplex channel pair shares its clock with the
+    // input, the codec chips are configured for one rate
+    virtual bool SetOutputSampleRate(int sample_rate);
 
-    virtual void OutputData(std::vector<int16_t>& data);
-    virtual bool InputData(std::vector<int16_t>& data);
+    // Not virtual, no codec overrides them: the audio tasks pay a single virtual Read / Write a frame
+    void OutputData(std::vector<int16_t>& data);
+    bool InputData(std::vector<int16_t>& data);
     virtual void Start();
 
     inline bool duplex() const { return duplex_; }
@@ -35,11 +92,45 @@ public:
     inline int input_channels() const { return input_channels_; }
     inline int output_channels() const { return output_channels_; }
     inline int output_volume() const { return output_volume_; }
+    // What the codec itself is set to for output_volume_, see VolumeControl
+    int hardware_volume() const;
     inline float input_gain() const { return input_gain_; }
     inline bool input_enabled() const { return input_enabled_; }
     inline bool output_enabled() const { return output_enabled_; }
+    inline bool input_standby() const { return input_standby_; }
+    inline bool output_standby() const { return output_standby_; }
+    inline const AudioDmaProfile& dma_profile() const { return dma_profile_; }
+    // The I2S underruns and overruns since boot
+    AudioGlitchStats GetGlitchStats();
+
+#if CONFIG_USE_SERVER_AEC
+    // Output samples handed to the DMA so far, wraps around
+    inline uint32_t output_position() const { return tx_written_samples_.load(std::memory_order_acquire); }
+    // When the given output position reaches (or reached) the DAC, from the I2S TX DMA completions
+    int64_t GetPlayoutTime(uint32_t position);
+#endif
+
+#if CONFIG_AUDIO_SINGLE_TASK
+    // Notified at every DMA buffer sent or received, on the notification index of the audio queues
+    void SetDmaWaiter(TaskHandle_t task) { dma_waiter_.store(task, std::memory_order_release); }
+    // Whether OutputData() / InputData() of this many samples returns without waiting for the
+    // DMA. Beyond the ring less one buffer they wait for that much, and a codec without I2S
+    // handles, or a channel not enabled yet, is always ready. Audio task only
+    bool CanWrite(size_t samples);
+    bool CanRead(size_t samples);
+#endif
 
 protected:
+    /*
+     * Where the volume is applied. The digital gain is a table lookup when the volume changes,
+     * and OutputData() ramps to it over the next frame, so a change never clicks.
+     */
+    enum VolumeControl {
+        kVolumeNone,        // Neither, the codec handles the volume itself
+        kVolumeDigital,     // All digital, for the I2S amplifiers without a volume register
+        kVolumeHardware,    // The codec at AUDIO_CODEC_VOLUME_STEP, the digital gain trims the fine steps
+    };
+
     i2s_chan_handle_t tx_handle_ = nullptr;
     i2s_chan_handle_t rx_handle_ = nullptr;
 
@@ -47,15 +138,86 @@ protected:
     bool input_reference_ = false;
     bool input_enabled_ = false;
     bool output_enabled_ = false;
+    bool input_standby_ = false;
+    bool output_standby_ = false;
     int input_sample_rate_ = 0;
     int output_sample_rate_ = 0;
     int input_channels_ = 1;
     int output_channels_ = 1;
     int output_volume_ = 70;
     float input_gain_ = 0.0;
+    VolumeControl volume_control_ = kVolumeNone;
+    AudioDmaProfile dma_profile_ = AUDIO_CODEC_DMA_PROFILE_DEFAULT;
+
+    // Call after (re)creating tx_handle_ or rx_handle_, before it is enabled
+    void AttachTxChannel();
+    void AttachRxChannel();
+    // The digital gain for the next samples of output: the Q16 gain of the first one and the step
+    // per sample, it reaches the target at the last one. Output task only
+    void NextOutputGain(size_t samples, int32_t* gain, int32_t* step);
 
     virtual int Read(int16_t* dest, int samples) = 0;
     virtual int Write(const int16_t* data, int samples) = 0;
+
+private:
+    // Set with the volume, ramped to by the output task
+    std::atomic<int32_t> output_gain_target_ = AUDIO_CODEC_GAIN_UNITY;
+    int32_t output_gain_ = AUDIO_CODEC_GAIN_UNITY;
+
+    void UpdateOutputGain();
+
+    /*
+     * The I2S driver reports a DMA ring without new data to send, or without room for the
+     * received data, as a queue overflow. The interrupt only counts them, the next write or
+     * read tells a glitch from an idle channel: the overflows of a channel nobody writes or
+     * reads for a while are not counted.
+     */
+    portMUX_TYPE glitch_lock_ = portMUX_INITIALIZER_UNLOCKED;
+    uint32_t tx_overflows_ = 0;
+    int64_t tx_overflow_us_ = 0;
+    uint32_t rx_overflows_ = 0;
+    int64_t rx_overflow_us_ = 0;
+    // Output and input task only
+    int64_t tx_last_write_us_ = 0;
+    int64_t rx_last_read_us_ = 0;
+    std::mutex glitch_stats_mutex_;
+    AudioGlitchStats glitch_stats_;
+    AudioGlitch recent_glitches_[AUDIO_CODEC_RECENT_GLITCHES];
+    uint32_t glitches_ = 0;
+
+    static bool OnTxQueueOverflow(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx);
+    static bool OnRxQueueOverflow(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx);
+    // Takes the overflows since the last call, a glitch if the channel was in use
+    void CheckGlitch(AudioGlitchType type, uint32_t* overflows, int64_t* overflow_us, int64_t last_us);
+
+#if CONFIG_USE_SERVER_AEC
+    // Written by the output task, the DMA completion ISR advances the played position
+    std::atomic<uint32_t> tx_written_samples_ = 0;
+    uint32_t tx_played_samples_ = 0;
+    int64_t tx_played_us_ = 0;
+    portMUX_TYPE tx_lock_ = portMUX_INITIALIZER_UNLOCKED;
+
+#endif
+#if CONFIG_AUDIO_SINGLE_TASK
+    /*
+     * The DMA frames queued and sent (a frame holds a sample of every slot), as the server AEC
+     * position above: a buffer sent with nothing queued is silence and is not counted. The
+     * received frames are counted by the RX interrupt, the read ones by the audio task.
+     */
+    std::atomic<TaskHandle_t> dma_waiter_ = nullptr;
+    std::atomic<uint32_t> tx_dma_written_ = 0;
+    std::atomic<uint32_t> tx_dma_sent_ = 0;
+    std::atomic<uint32_t> rx_dma_received_ = 0;
+    uint32_t rx_dma_read_ = 0;
+    int64_t tx_not_ready_us_ = 0;
+    int64_t rx_not_ready_us_ = 0;
+
+    static bool OnRxReceived(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx);
+    void NotifyDmaWaiterFromIsr();
+#endif
+#if CONFIG_USE_SERVER_AEC || CONFIG_AUDIO_SINGLE_TASK
+    static bool OnTxSent(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx);
+#endif
 };
 
 #endif // _AUDIO_CODEC_H
@@ -0,0 +1,63 @@
+#ifndef AUDIO_LEVEL_H
+#define AUDIO_LEVEL_H
+
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include <esp_timer.h>
+
+#include "pcm_utils.h"
+
+// A frame that is older than this reads as silence, the longest frame is 60 ms
+#define AUDIO_LEVEL_STALE_MS 200
+
+// Magnitudes of a 16-bit frame, 0-32767
+struct AudioLevel {
+    uint16_t rms = 0;
+    uint16_t peak = 0;
+};
+
+/*
+ * The RMS and the peak of the last frame of an audio path, for the LED and display effects.
+ *
+ * The audio task measures the frame it already has at hand, once, and publishes it with two
+ * relaxed stores. The readers never touch the PCM. Nothing is measured while no reader holds
+ * the meter enabled.
+ */
+class AudioLevelMeter {
+public:
+    // Called by the audio task once per frame
+    void Measure(const int16_t* data, size_t samples) {
+        if (users_.load(std::memory_order_relaxed) == 0 || samples == 0) {
+            return;
+        }
+        uint64_t sum_squares;
+        int32_t peak;
+        PcmMeasure(data, samples, &sum_squares, &peak);
+        uint32_t rms = (uint32_t)sqrtf((float)(sum_squares / samples));
+        level_.store((std::min<uint32_t>(rms, INT16_MAX) << 16) | (uint32_t)std::min<int32_t>(peak, INT16_MAX),
+            std::memory_order_relaxed);
+        updated_ms_.store((uint32_t)(esp_timer_get_time() / 1000), std::memory_order_relaxed);
+    }
+
+    AudioLevel Get() const {
+        uint32_t now_ms = (uint32_t)(esp_timer_get_time() / 1000);
+        if (now_ms - updated_ms_.load(std::memory_order_relaxed) > AUDIO_LEVEL_STALE_MS) {
+            return {};
+        }
+        uint32_t level = level_.load(std::memory_order_relaxed);
+        return { (uint16_t)(level >> 16), (uint16_t)(level & 0xFFFF) };
+    }
+
+    // Every reader enables the meter while it needs it, and disables it once
+    void Enable(bool enable) { users_.fetch_add(enable ? 1 : -1, std::memory_order_relaxed); }
+
+private:
+    std::atomic<int> users_ = 0;
+    std::atomic<uint32_t> level_ = 0;
+    std::atomic<uint32_t> updated_ms_ = 0;
+};
+
+#endif // AUDIO_LEVEL_H
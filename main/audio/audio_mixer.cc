@@ -0,0 +1,264 @@
+#include "audio_mixer.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#include "pcm_utils.h"
+
+#define TAG "AudioMixer"
+
+#if CONFIG_USE_AUDIO_MIXER
+#define AUDIO_MIXER_DUCK_GAIN (AUDIO_MIXER_UNITY_GAIN * CONFIG_AUDIO_MIXER_DUCK_PERCENT / 100)
+#else
+#define AUDIO_MIXER_DUCK_GAIN AUDIO_MIXER_UNITY_GAIN
+#endif
+// A cached sound is copied out this much at a time, like a packet of a decoded one
+#define AUDIO_MIXER_COPY_MS 60
+
+void AudioMixer::Initialize(int output_sample_rate) {
+    output_sample_rate_ = output_sample_rate;
+    decoders_.Initialize(output_sample_rate);
+}
+
+void AudioMixer::SetOutputSampleRate(int output_sample_rate) {
+    if (output_sample_rate == output_sample_rate_) {
+        return;
+    }
+    output_sample_rate_ = output_sample_rate;
+    decoders_.SetOutputSampleRate(output_sample_rate);
+    decoder_ = nullptr;
+    resampler_ = nullptr;
+    // The kept sounds are at the old rate
+    sound_cache_.clear();
+    sound_cache_bytes_ = 0;
+    cached_index_ = -1;
+    recording_ = false;
+    Pcm().swap(recorded_);
+    pending_.clear();
+    pending_start_ = 0;
+}
+
+void AudioMixer::Play(const std::string_view& ogg, int priority, float gain) {
+    Request request = {
+        .ogg = ogg,
+        .priority = priority,
+        .gain = static_cast<int32_t>(std::clamp(gain, 0.0f, 1.0f) * AUDIO_MIXER_UNITY_GAIN),
+    };
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Lower priority sounds are dropped, the new one plays after the queued ones of the same or higher priority
+    requests_.erase(std::remove_if(requests_.begin(), requests_.end(), [priority](const Request& r) {
+        return r.priority < priority;
+    }), requests_.end());
+    if (requests_.size() >= AUDIO_MIXER_MAX_PENDING_SOUNDS) {
+        ESP_LOGW(TAG, "Too many pending sounds, dropping the new one");
+        return;
+    }
+    requests_.push_back(request);
+    int current = current_priority_.load(std::memory_order_acquire);
+    if (current >= 0 && priority > current) {
+        stop_current_.store(true, std::memory_order_release);
+    }
+    active_.store(true, std::memory_order_release);
+}
+
+void AudioMixer::Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    requests_.clear();
+    if (current_priority_.load(std::memory_order_acquire) >= 0) {
+        stop_current_.store(true, std::memory_order_release);
+    }
+}
+
+bool AudioMixer::NextSound() {
+    while (true) {
+        Request request;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (requests_.empty()) {
+                current_priority_.store(-1, std::memory_order_release);
+                return false;
+            }
+            request = requests_.front();
+            requests_.pop_front();
+            current_priority_.store(request.priority, std::memory_order_release);
+        }
+        cached_index_ = FindCachedSound(request.ogg);
+        if (cached_index_ >= 0) {
+            sound_gain_ = request.gain;
+            cached_position_ = 0;
+            recording_ = false;
+            playing_ = true;
+            return true;
+        }
+        if (reader_.Open(request.ogg)) {
+            sound_gain_ = request.gain;
+            decoder_ = nullptr;
+            current_ogg_ = request.ogg;
+            recording_ = AUDIO_MIXER_SOUND_CACHE_SIZE > 0;
+            recorded_.clear();
+            playing_ = true;
+            return true;
+        }
+    }
+}
+
+bool AudioMixer::DecodeNextPacket() {
+    if (cached_index_ >= 0) {
+        return CopyCachedSound();
+    }
+
+    const uint8_t* packet;
+    size_t size;
+    if (!reader_.NextPacket(packet, size)) {
+        if (recording_) {
+            CacheSound();
+        }
+        return false;
+    }
+
+    int duration = GetOpusPacketDuration(packet, size);
+    int sample_rate = reader_.DecodeSampleRate(output_sample_rate_);
+    if (decoder_ == nullptr || sound_sample_rate_ != sample_rate || decoder_->duration_ms() != duration) {
+        auto& entry = decoders_.Get(sample_rate, duration);
+        decoder_ = entry.decoder.get();
+        resampler_ = entry.resampler.get();
+        sound_sample_rate_ = sample_rate;
+    }
+
+    payload_.assign(packet, packet + size);
+    if (!decoder_->Decode(std::move(payload_), decoded_)) {
+        ESP_LOGE(TAG, "Failed to decode sound");
+        return true;
+    }
+    const std::vector<int16_t>* output = &decoded_;
+    if (resampler_ != nullptr) {
+        resampled_.resize(resampler_->GetOutputSamples(decoded_.size()));
+        resampler_->Process(decoded_.data(), decoded_.size(), resampled_.data());
+        output = &resampled_;
+    }
+    pending_.insert(pending_.end(), output->begin(), output->end());
+    if (recording_) {
+        size_t limit = std::min<size_t>(AUDIO_MIXER_SOUND_CACHE_SIZE / 4 / sizeof(int16_t),
+            (size_t)output_sample_rate_ * AUDIO_MIXER_SOUND_CACHE_MAX_MS / 1000);
+        if (recorded_.size() + output->size() > limit) {
+            // Too long to be kept, it is decoded every time
+            recording_ = false;
+            Pcm().swap(recorded_);
+        } else {
+            recorded_.insert(recorded_.end(), output->begin(), output->end());
+        }
+    }
+    return true;
+}
+
+bool AudioMixer::CopyCachedSound() {
+    auto& pcm = sound_cache_[cached_index_].pcm;
+    if (cached_position_ >= pcm.size()) {
+        cached_index_ = -1;
+        return false;
+    }
+    // Not all at once, so a higher priority sound still cuts in
+    size_t count = std::min(pcm.size() - cached_position_, (size_t)output_sample_rate_ * AUDIO_MIXER_COPY_MS / 1000);
+    pending_.insert(pending_.end(), pcm.begin() + cached_position_, pcm.begin() + cached_position_ + count);
+    cached_position_ += count;
+    return true;
+}
+
+int AudioMixer::FindCachedSound(const std::string_view& ogg) {
+    for (size_t i = 0; i < sound_cache_.size(); ++i) {
+        if (sound_cache_[i].data == ogg.data() && sound_cache_[i].size == ogg.size()) {
+            sound_cache_[i].last_used = ++sound_cache_uses_;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void AudioMixer::CacheSound() {
+    recording_ = false;
+    size_t bytes = recorded_.size() * sizeof(int16_t);
+    if (bytes == 0 || FindCachedSound(current_ogg_) >= 0) {
+        return;
+    }
+    // The least recently played sounds make room
+    while (!sound_cache_.empty() && sound_cache_bytes_ + bytes > AUDIO_MIXER_SOUND_CACHE_SIZE) {
+        auto victim = std::min_element(sound_cache_.begin(), sound_cache_.end(), [](const CachedSound& a, const CachedSound& b) {
+            return a.last_used < b.last_used;
+        });
+        sound_cache_bytes_ -= victim->pcm.size() * sizeof(int16_t);
+        sound_cache_.erase(victim);
+    }
+    CachedSound entry = {
+        .data = current_ogg_.data(),
+        .size = current_ogg_.size(),
+        .last_used = ++sound_cache_uses_,
+    };
+    entry.pcm.swap(recorded_);
+    entry.pcm.shrink_to_fit();
+    sound_cache_bytes_ += bytes;
+    sound_cache_.push_back(std::move(entry));
+    ESP_LOGD(TAG, "Cached a sound of %u bytes, %u sounds, %u bytes", (unsigned)bytes, (unsigned)sound_cache_.size(),
+        (unsigned)sound_cache_bytes_);
+}
+
+size_t AudioMixer::Fill(size_t samples) {
+    if (stop_current_.exchange(false, std::memory_order_acq_rel)) {
+        playing_ = false;
+        cached_index_ = -1;
+        recording_ = false;
+        pending_.clear();
+        pending_start_ = 0;
+    }
+    // Keep the unread samples only, the buffer stays at about one packet
+    if (pending_start_ > 0) {
+        pending_.erase(pending_.begin(), pending_.begin() + pending_start_);
+        pending_start_ = 0;
+    }
+
+    while (pending_.size() < samples) {
+        if (!playing_ && !NextSound()) {
+            break;
+        }
+        if (!DecodeNextPacket()) {
+            playing_ = false;
+        }
+    }
+
+    if (pending_.empty() && !playing_) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (requests_.empty()) {
+            active_.store(false, std::memory_order_release);
+        }
+    }
+    return std::min(samples, pending_.size());
+}
+
+void AudioMixer::Mix(std::vector<int16_t>& pcm) {
+    if (!active() && stream_gain_ == AUDIO_MIXER_UNITY_GAIN) {
+        return;
+    }
+
+    size_t available = Fill(pcm.size());
+    int32_t target = available > 0 ? AUDIO_MIXER_DUCK_GAIN : AUDIO_MIXER_UNITY_GAIN;
+    int32_t step = pcm.empty() ? 0 : (target - stream_gain_) / static_cast<int32_t>(pcm.size());
+    PcmMixDucked(pcm.data(), pending_.data(), available, stream_gain_, step, sound_gain_);
+    PcmApplyGainRamp(pcm.data() + available, pcm.size() - available, stream_gain_ + step * static_cast<int32_t>(available), step);
+    pending_start_ = available;
+    stream_gain_ = target;
+}
+
+bool AudioMixer::Render(std::vector<int16_t>& pcm) {
+    // One packet worth of sound, the stream is silent so it does not need ducking
+    size_t available = Fill(1);
+    if (available == 0) {
+        return false;
+    }
+    available = pending_.size();
+    pcm.resize(available);
+    std::copy(pending_.begin(), pending_.end(), pcm.begin());
+    PcmApplyGainRamp(pcm.data(), available, sound_gain_, 0);
+    pending_start_ = available;
+    stream_gain_ = AUDIO_MIXER_DUCK_GAIN;
+    return true;
+}
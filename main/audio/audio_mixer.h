@@ -0,0 +1,111 @@
+#ifndef AUDIO_MIXER_H
+#define AUDIO_MIXER_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <string_view>
+
+#include <sdkconfig.h>
+
+#include "ogg_opus_reader.h"
+#include "decoder_cache.h"
+#include "heap_accounting.h"
+#include "memory_budget.h"
+
+#define AUDIO_MIXER_UNITY_GAIN 32768
+#define AUDIO_MIXER_MAX_PENDING_SOUNDS 16
+// Decoded sounds kept at the output rate, a sound longer than a quarter of it or than a second is not kept
+#define AUDIO_MIXER_SOUND_CACHE_SIZE (MEMORY_BUDGET_SOUND_CACHE_KB * 1024)
+#define AUDIO_MIXER_SOUND_CACHE_MAX_MS 1000
+
+/*
+ * Overlays local sounds on the downlink stream, between the decoder and the playback queue.
+ *
+ * Sounds have their own decoders, so playing one never resets the stream decoder. They are
+ * played one after another (e.g. the digits of the activation code), a sound with a higher
+ * priority interrupts the current one and drops the queued lower priority sounds. While a sound
+ * plays the stream is ducked, the gain ramps over one frame to avoid clicks. Without
+ * CONFIG_USE_AUDIO_MIXER the decode task only renders the sounds alone, ahead of the stream.
+ *
+ * The Ogg pages are walked in place as the sound plays, one packet ahead of the output. Short
+ * sounds are kept decoded (the notifications, the digits), the next time they are copied
+ * instead of decoded. The sounds are keyed by their buffer, the embedded and mapped assets
+ * stay at the same address.
+ *
+ * Play() and Stop() can be called from any task, the other methods only from the decode task.
+ */
+class AudioMixer {
+public:
+    void Initialize(int output_sample_rate);
+    // The codec output was retuned, decode task only and while nothing plays
+    void SetOutputSampleRate(int output_sample_rate);
+    // gain is 0-1, applied to the sound
+    void Play(const std::string_view& ogg, int priority, float gain);
+    void Stop();
+    inline bool active() const { return active_.load(std::memory_order_acquire); }
+
+    // Mix the sounds into a decoded stream frame at the output rate
+    void Mix(std::vector<int16_t>& pcm);
+    // A sound-only frame when no stream audio is available, returns false when nothing is playing
+    bool Render(std::vector<int16_t>& pcm);
+
+private:
+    struct Request {
+        std::string_view ogg;
+        int priority;
+        int32_t gain;
+    };
+    using Pcm = std::vector<int16_t, PsramAllocator<int16_t, kHeapTagAudio>>;
+    struct CachedSound {
+        const char* data;
+        size_t size;
+        uint32_t last_used;
+        Pcm pcm;
+    };
+
+    std::mutex mutex_;
+    std::deque<Request> requests_;
+    std::atomic<bool> active_ = false;
+    std::atomic<bool> stop_current_ = false;
+    std::atomic<int> current_priority_ = -1;
+
+    // Decode task state
+    int output_sample_rate_ = 0;
+    bool playing_ = false;
+    int32_t sound_gain_ = AUDIO_MIXER_UNITY_GAIN;
+    int32_t stream_gain_ = AUDIO_MIXER_UNITY_GAIN;
+    OggOpusReader reader_;
+    DecoderCache decoders_;
+    OpusDecoderWrapper* decoder_ = nullptr;
+    AudioResampler* resampler_ = nullptr;
+    int sound_sample_rate_ = 0;
+    std::vector<uint8_t> payload_;
+    std::vector<int16_t> decoded_;
+    std::vector<int16_t> resampled_;
+    // Decoded sound at the output rate, consumed from pending_start_
+    std::vector<int16_t> pending_;
+    size_t pending_start_ = 0;
+
+    // The sound cache, only touched by the decode task
+    std::vector<CachedSound> sound_cache_;
+    size_t sound_cache_bytes_ = 0;
+    uint32_t sound_cache_uses_ = 0;
+    // The cached sound playing, copied from cached_position_, -1 when decoding
+    int cached_index_ = -1;
+    size_t cached_position_ = 0;
+    // The sound being decoded and recorded for the cache
+    std::string_view current_ogg_;
+    bool recording_ = false;
+    Pcm recorded_;
+
+    size_t Fill(size_t samples);
+    bool NextSound();
+    bool DecodeNextPacket();
+    bool CopyCachedSound();
+    int FindCachedSound(const std::string_view& ogg);
+    void CacheSound();
+};
+
+#endif // AUDIO_MIXER_H
@@ -0,0 +1,71 @@
+#ifndef AUDIO_PRESSURE_H
+#define AUDIO_PRESSURE_H
+
+#include <sdkconfig.h>
+#include <esp_timer.h>
+
+#include <atomic>
+#include <cstdint>
+
+enum AudioPressureSource {
+    kAudioPressurePlayback,     // The playback queue runs dry while the decoder still has frames
+    kAudioPressureEncode,       // The encoder is behind, the processed frames wait for the encode queue
+    kAudioPressureInput,        // The codec was read later than a frame after the last read, its DMA ring fills up
+    kAudioPressureSourceCount,
+};
+
+/*
+ * Whether the audio pipeline is at risk of an underrun or an overrun right now.
+ *
+ * The audio tasks raise it where they see a queue about to run dry or to overflow, and it holds
+ * for AUDIO_PRESSURE_HOLD_MS after the last raise, so the queues have time to recover. The UI
+ * work sharing the cores checks it on its own schedule and defers what can wait: the LVGL
+ * displays hold the chat messages and refresh slower, the GIF emotions hold their frame, the
+ * emote eyes lower their frame rate and the LED animations skip their ticks. Checking is an
+ * atomic load and a timer read, cheap enough for every frame.
+ *
+ * Without CONFIG_USE_AUDIO_PRESSURE_QOS it is never active.
+ */
+class AudioPressure {
+public:
+    static AudioPressure& GetInstance() {
+        static AudioPressure instance;
+        return instance;
+    }
+    AudioPressure(const AudioPressure&) = delete;
+    AudioPressure& operator=(const AudioPressure&) = delete;
+
+#if CONFIG_USE_AUDIO_PRESSURE_QOS
+    void Raise(AudioPressureSource source) {
+        active_until_us_.store(esp_timer_get_time() + CONFIG_AUDIO_PRESSURE_HOLD_MS * 1000LL, std::memory_order_relaxed);
+        raised_[source].fetch_add(1, std::memory_order_relaxed);
+    }
+    bool IsActive() const {
+        return esp_timer_get_time() < active_until_us_.load(std::memory_order_relaxed);
+    }
+    // The raises since boot, of one source or of all
+    uint32_t raised(AudioPressureSource source) const { return raised_[source].load(std::memory_order_relaxed); }
+    uint32_t raised() const {
+        uint32_t total = 0;
+        for (auto& raised : raised_) {
+            total += raised.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+#else
+    void Raise(AudioPressureSource source) {}
+    bool IsActive() const { return false; }
+    uint32_t raised(AudioPressureSource source) const { return 0; }
+    uint32_t raised() const { return 0; }
+#endif
+
+private:
+    AudioPressure() = default;
+
+#if CONFIG_USE_AUDIO_PRESSURE_QOS
+    std::atomic<int64_t> active_until_us_ = 0;
+    std::atomic<uint32_t> raised_[kAudioPressureSourceCount] = {};
+#endif
+};
+
+#endif // AUDIO_PRESSURE_H
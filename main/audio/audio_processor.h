@@ -1,18 +1,72 @@
 #ifndef AUDIO_PROCESSOR_H
 #define AUDIO_PROCESSOR_H
 
+#include <cstdint>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <functional>
 
+#include <sdkconfig.h>
 #include <model_path.h>
 #include "audio_codec.h"
 
+// The AFE settings a processor is created with, see afe_profile.h. From the lightest to the heaviest
+enum AfeProfile {
+    kAfeProfileLowPower,
+    kAfeProfileBalanced,
+    kAfeProfileHighQuality,
+    kAfeProfileCount,
+};
+
+inline const char* AfeProfileName(AfeProfile profile) {
+    static const char* const names[kAfeProfileCount] = {"low-power", "balanced", "high-quality"};
+    return profile < kAfeProfileCount ? names[profile] : "unknown";
+}
+
+// kAfeProfileCount for a name that is none of them
+inline AfeProfile AfeProfileFromName(const char* name) {
+    for (int i = 0; i < kAfeProfileCount; i++) {
+        if (strcmp(name, AfeProfileName((AfeProfile)i)) == 0) {
+            return (AfeProfile)i;
+        }
+    }
+    return kAfeProfileCount;
+}
+
+#if CONFIG_AFE_PROFILE_LOW_POWER
+#define AFE_PROFILE_DEFAULT kAfeProfileLowPower
+#elif CONFIG_AFE_PROFILE_BALANCED
+#define AFE_PROFILE_DEFAULT kAfeProfileBalanced
+#else
+#define AFE_PROFILE_DEFAULT kAfeProfileHighQuality
+#endif
+
+// The realtime listening mode runs the AEC for the whole conversation
+#if CONFIG_AFE_PROFILE_REALTIME_LOW_POWER
+#define AFE_PROFILE_REALTIME kAfeProfileLowPower
+#elif CONFIG_AFE_PROFILE_REALTIME_BALANCED
+#define AFE_PROFILE_REALTIME kAfeProfileBalanced
+#else
+#define AFE_PROFILE_REALTIME kAfeProfileHighQuality
+#endif
+
+// The CPU time of the fetching task per fetched chunk, while a profile was in use
+struct AudioProcessorCost {
+    uint32_t chunks = 0;
+    uint64_t total_us = 0;
+    uint32_t max_us = 0;
+    int chunk_ms = 0;       // The audio in one chunk
+};
+
 class AudioProcessor {
 public:
     virtual ~AudioProcessor() = default;
     
     virtual void Initialize(AudioCodec* codec, int frame_duration_ms, srmodel_list_t* models_list) = 0;
+    // Frees what Initialize() created, the callbacks are kept for the next Initialize()
+    virtual void Deinitialize() = 0;
+    virtual void SetFrameDuration(int frame_duration_ms) = 0;
     virtual void Feed(std::vector<int16_t>&& data) = 0;
     virtual void Start() = 0;
     virtual void Stop() = 0;
@@ -21,6 +75,14 @@ public:
     virtual void OnVadStateChange(std::function<void(bool speaking)> callback) = 0;
     virtual size_t GetFeedSize() = 0;
     virtual void EnableDeviceAec(bool enable) = 0;
+    // False when nothing reports the VAD state, e.g. while the device AEC replaces the VAD
+    virtual bool IsVadEnabled() = 0;
+    // Takes effect at the next Initialize()
+    virtual void SetProfile(AfeProfile profile) {}
+    // The profile of the current instance, or the one the next Initialize() uses
+    virtual AfeProfile GetProfile() { return kAfeProfileHighQuality; }
+    // Zero chunks when the profile never ran, or nothing measures it
+    virtual AudioProcessorCost GetCost(AfeProfile profile) { return AudioProcessorCost(); }
 };
 
 #endif
@@ -0,0 +1,168 @@
+#include "audio_resampler.h"
+
+#include <esp_log.h>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <numeric>
+
+#include "pcm_utils.h"
+
+#define TAG "AudioResampler"
+
+template <int Up, int Down>
+struct PolyphaseKernel {
+    // 8 taps per period of the slower rate, always a multiple of 4
+    static constexpr int kTaps = 8 * (Up > Down ? Up : Down) / Up;
+    static_assert(kTaps % 4 == 0 && kTaps <= AUDIO_RESAMPLER_MAX_TAPS, "Unsupported ratio");
+
+    static void Process(const int16_t* coeffs, const int16_t* buffer, int input_samples, int& position, int16_t* output) {
+        int end = input_samples * Up;
+        int t = position;
+        for (; t < end; t += Down) {
+            // The window ends at input sample t / Up, the coefficients of each phase are stored reversed
+            const int16_t* __restrict x = buffer + t / Up;
+            const int16_t* __restrict c = coeffs + (t % Up) * kTaps;
+            int32_t acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+            for (int k = 0; k < kTaps; k += 4) {
+                acc0 += c[k] * x[k];
+                acc1 += c[k + 1] * x[k + 1];
+                acc2 += c[k + 2] * x[k + 2];
+                acc3 += c[k + 3] * x[k + 3];
+            }
+            *output++ = PcmSaturate16((acc0 + acc1 + acc2 + acc3 + (1 << 14)) >> 15);
+        }
+        position = t - end;
+    }
+};
+
+void AudioResampler::Configure(int input_sample_rate, int output_sample_rate) {
+    input_sample_rate_ = input_sample_rate;
+    output_sample_rate_ = output_sample_rate;
+    int divisor = std::gcd(input_sample_rate, output_sample_rate);
+    up_ = output_sample_rate / divisor;
+    down_ = input_sample_rate / divisor;
+    position_ = 0;
+
+    if (up_ == 2 && down_ == 1) {
+        kernel_ = PolyphaseKernel<2, 1>::Process;
+        taps_ = PolyphaseKernel<2, 1>::kTaps;
+    } else if (up_ == 1 && down_ == 2) {
+        kernel_ = PolyphaseKernel<1, 2>::Process;
+        taps_ = PolyphaseKernel<1, 2>::kTaps;
+    } else if (up_ == 3 && down_ == 1) {
+        kernel_ = PolyphaseKernel<3, 1>::Process;
+        taps_ = PolyphaseKernel<3, 1>::kTaps;
+    } else if (up_ == 1 && down_ == 3) {
+        kernel_ = PolyphaseKernel<1, 3>::Process;
+        taps_ = PolyphaseKernel<1, 3>::kTaps;
+    } else if (up_ == 3 && down_ == 2) {
+        kernel_ = PolyphaseKernel<3, 2>::Process;
+        taps_ = PolyphaseKernel<3, 2>::kTaps;
+    } else if (up_ == 2 && down_ == 3) {
+        kernel_ = PolyphaseKernel<2, 3>::Process;
+        taps_ = PolyphaseKernel<2, 3>::kTaps;
+    } else {
+        kernel_ = nullptr;
+        taps_ = 0;
+        fallback_.Configure(input_sample_rate, output_sample_rate);
+        ESP_LOGI(TAG, "Resample %d -> %d with OpusResampler", input_sample_rate, output_sample_rate);
+        return;
+    }
+
+    DesignCoefficients();
+    buffer_.assign(taps_ - 1, 0);
+    ESP_LOGI(TAG, "Resample %d -> %d with the %d:%d polyphase kernel", input_sample_rate, output_sample_rate, up_, down_);
+}
+
+void AudioResampler::DesignCoefficients() {
+    /*
+     * Blackman windowed sinc at the upsampled rate, cut off below the lower Nyquist frequency.
+     * The gain is Up, which makes up for the zeros inserted by the upsampling.
+     */
+    int length = taps_ * up_;
+    double cutoff = 0.45 / std::max(up_, down_);
+    double center = (length - 1) / 2.0;
+    std::vector<double> h(length);
+    double sum = 0;
+    for (int i = 0; i < length; i++) {
+        double x = i - center;
+        double sinc = x == 0 ? 2 * cutoff : std::sin(2 * M_PI * cutoff * x) / (M_PI * x);
+        double window = 0.42 - 0.5 * std::cos(2 * M_PI * i / (length - 1)) + 0.08 * std::cos(4 * M_PI * i / (length - 1));
+        h[i] = sinc * window;
+        sum += h[i];
+    }
+
+    // Phase p uses h[p], h[p + Up], ... from the newest input sample backwards
+    for (int p = 0; p < up_; p++) {
+        for (int k = 0; k < taps_; k++) {
+            double value = h[p + (taps_ - 1 - k) * up_] * up_ / sum;
+            coeffs_[p * taps_ + k] = static_cast<int16_t>(std::clamp<long>(std::lround(value * 32768), INT16_MIN, INT16_MAX));
+        }
+    }
+}
+
+int AudioResampler::GetOutputSamples(int input_samples) const {
+    if (kernel_ == nullptr) {
+        return fallback_.GetOutputSamples(input_samples);
+    }
+    int end = input_samples * up_;
+    return end > position_ ? (end - position_ + down_ - 1) / down_ : 0;
+}
+
+void AudioResampler::Process(const int16_t* input, int input_samples, int16_t* output) {
+    if (kernel_ == nullptr) {
+        fallback_.Process(input, input_samples, output);
+        return;
+    }
+
+    size_t history = taps_ - 1;
+    // Only grows, so the steady state does not allocate
+    if (buffer_.size() < history + input_samples) {
+        buffer_.resize(history + input_samples);
+    }
+    memcpy(buffer_.data() + history, input, input_samples * sizeof(int16_t));
+    kernel_(coeffs_, buffer_.data(), input_samples, position_, output);
+    memmove(buffer_.data(), buffer_.data() + input_samples, history * sizeof(int16_t));
+}
+
+#if CONFIG_AUDIO_RESAMPLER_BENCHMARK
+#include <esp_cpu.h>
+
+void AudioResampler::RunBenchmark() {
+    static const int kPairs[][2] = {
+        {24000, 48000}, {48000, 24000}, {16000, 48000}, {48000, 16000}, {16000, 24000}, {24000, 16000},
+    };
+    const int kIterations = 20;
+
+    for (auto& pair : kPairs) {
+        int input_samples = pair[0] * 60 / 1000;
+        std::vector<int16_t> input(input_samples);
+        for (int i = 0; i < input_samples; i++) {
+            input[i] = static_cast<int16_t>(8000 * std::sin(2 * M_PI * 440 * i / pair[0]));
+        }
+
+        AudioResampler fast;
+        fast.Configure(pair[0], pair[1]);
+        std::vector<int16_t> output(fast.GetOutputSamples(input_samples) + 1);
+        uint32_t start = esp_cpu_get_cycle_count();
+        for (int i = 0; i < kIterations; i++) {
+            fast.Process(input.data(), input_samples, output.data());
+        }
+        uint32_t fast_cycles = esp_cpu_get_cycle_count() - start;
+
+        OpusResampler opus;
+        opus.Configure(pair[0], pair[1]);
+        output.resize(opus.GetOutputSamples(input_samples) + 1);
+        start = esp_cpu_get_cycle_count();
+        for (int i = 0; i < kIterations; i++) {
+            opus.Process(input.data(), input_samples, output.data());
+        }
+        uint32_t opus_cycles = esp_cpu_get_cycle_count() - start;
+
+        int output_samples = pair[1] * 60 / 1000 * kIterations;
+        ESP_LOGI(TAG, "%d -> %d: %.1f cycles/sample (OpusResampler %.1f)", pair[0], pair[1],
+            (float)fast_cycles / output_samples, (float)opus_cycles / output_samples);
+    }
+}
+#endif
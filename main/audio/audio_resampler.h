@@ -0,0 +1,59 @@
+#ifndef AUDIO_RESAMPLER_H
+#define AUDIO_RESAMPLER_H
+
+#include <cstdint>
+#include <vector>
+
+#include <sdkconfig.h>
+#include <opus_resampler.h>
+
+// The longest kernel is the 3:1 decimator, 8 taps per input period of the slower side
+#define AUDIO_RESAMPLER_MAX_PHASES 3
+#define AUDIO_RESAMPLER_MAX_TAPS 24
+
+/*
+ * Sample rate converter with integer-ratio fast paths.
+ *
+ * The 2:1, 3:1 and 3:2 ratios (both directions) cover the usual codec / server pairs, e.g.
+ * 24 kHz -> 48 kHz, 48 kHz -> 16 kHz or 24 kHz -> 16 kHz. They run a polyphase FIR whose
+ * up / down factors are template parameters, so the phase and index arithmetic compiles to
+ * constants and the inner dot product is unrolled. The Q15 coefficients are designed once
+ * in Configure(). Any other ratio falls back to OpusResampler.
+ *
+ * Same interface as OpusResampler.
+ */
+class AudioResampler {
+public:
+    void Configure(int input_sample_rate, int output_sample_rate);
+    int GetOutputSamples(int input_samples) const;
+    void Process(const int16_t* input, int input_samples, int16_t* output);
+
+    inline int input_sample_rate() const { return input_sample_rate_; }
+    inline int output_sample_rate() const { return output_sample_rate_; }
+    inline bool fast_path() const { return kernel_ != nullptr; }
+
+#if CONFIG_AUDIO_RESAMPLER_BENCHMARK
+    // Logs the cycles per output sample of every fast path against OpusResampler
+    static void RunBenchmark();
+#endif
+
+private:
+    typedef void (*Kernel)(const int16_t* coeffs, const int16_t* buffer, int input_samples, int& position, int16_t* output);
+
+    int input_sample_rate_ = 0;
+    int output_sample_rate_ = 0;
+    int up_ = 1;
+    int down_ = 1;
+    int taps_ = 0;
+    // Position of the next output sample in the upsampled domain, relative to the next input sample
+    int position_ = 0;
+    Kernel kernel_ = nullptr;
+    int16_t coeffs_[AUDIO_RESAMPLER_MAX_PHASES * AUDIO_RESAMPLER_MAX_TAPS];
+    // The last taps_ - 1 input samples followed by the input being processed
+    std::vector<int16_t> buffer_;
+    OpusResampler fallback_;
+
+    void DesignCoefficients();
+};
+
+#endif // AUDIO_RESAMPLER_H
@@ -1,8 +1,19 @@
 #include "audio_service.h"
 #include <esp_log.h>
 #include <cstring>
-
-#if CONFIG_USE_AUDIO_PROCESSOR
+#include <algorithm>
+#include <esp_heap_caps.h>
+#include "task_placement.h"
+#include "trace_recorder.h"
+#include "log_ring.h"
+#include "audio_pressure.h"
+#include "pcm_utils.h"
+#include "settings.h"
+
+#if CONFIG_USE_SHARED_AFE
+#include "processors/shared_afe.h"
+#include "wake_words/shared_afe_wake_word.h"
+#elif CONFIG_USE_AUDIO_PROCESSOR
 #include "processors/afe_audio_processor.h"
 #else
 #include "processors/no_audio_processor.h"
@@ -32,24 +43,118 @@ AudioService::~AudioService() {
 void AudioService::Initialize(AudioCodec* codec) {
     codec_ = codec;
     codec_->Start();
+    input_format_.sample_rate = codec->input_sample_rate();
+    input_format_.channels = codec->input_channels();
+    input_format_.reference = codec->input_reference();
+#if CONFIG_USE_LOOPBACK_TEST
+    {
+        Settings settings("audio");
+        if (settings.GetStruct("loopback", loopback_calibration_, LOOPBACK_CALIBRATION_VERSION)) {
+            aec_capture_offset_us_ = loopback_calibration_.loop_us;
+            ESP_LOGI(TAG, "Loopback calibration: loop %ld us", (long)loopback_calibration_.loop_us);
+        }
+    }
+#endif
 
     /* Setup the audio codec */
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
+    decoder_cache_.Initialize(codec->output_sample_rate());
+#if CONFIG_AUDIO_OUTPUT_FOLLOW_STREAM_RATE
+    native_output_sample_rate_ = codec->output_sample_rate();
+#endif
+    audio_mixer_.Initialize(codec->output_sample_rate());
+    /* The stream decoder exists from the start, the server audio switches it to its own format */
+    SetDecodeSampleRate(16000, OPUS_MAX_FRAME_DURATION_MS);
     opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
     opus_encoder_->SetComplexity(0);
 
+    audio_encode_queue_.Reset(MAX_ENCODE_TASKS_IN_QUEUE);
+    audio_playback_queue_.Reset(MAX_PLAYBACK_TASKS_IN_QUEUE);
+    audio_decode_queue_.Reset(MAX_DECODE_PACKETS_IN_QUEUE);
+    audio_decode_queue_.SetLimit(AUDIO_QUEUE_DURATION_MS / frame_duration_ms_);
+    jitter_buffer_.Initialize(MAX_DECODE_PACKETS_IN_QUEUE, JITTER_BUFFER_MIN_FRAMES, JITTER_BUFFER_MAX_FRAMES);
+    audio_send_queue_.Reset(SEND_QUEUE_SLOTS);
+    audio_send_queue_.SetLimit(AUDIO_QUEUE_DURATION_MS / frame_duration_ms_);
+    audio_testing_queue_.Reset(AUDIO_TESTING_MAX_DURATION_MS / OPUS_MIN_FRAME_DURATION_MS);
+    audio_testing_queue_.SetLimit(AUDIO_TESTING_MAX_DURATION_MS / frame_duration_ms_);
+    timestamp_queue_.Reset(MAX_TIMESTAMPS_IN_QUEUE + 1);
+
+    /* Preallocate the frames, a PCM frame is at most 60ms of mono audio at the higher sample rate */
+    size_t max_frame_samples = std::max(16000, codec->output_sample_rate()) * OPUS_MAX_FRAME_DURATION_MS / 1000;
+    task_pool_.Reserve(AUDIO_TASK_POOL_SIZE, [max_frame_samples](AudioTask& task) {
+        task.pcm.reserve(max_frame_samples);
+    });
+    packet_pool_.Reserve(AUDIO_PACKET_POOL_SIZE, [](AudioStreamPacket& packet) {
+        packet.payload.reserve(AUDIO_PACKET_PAYLOAD_RESERVE);
+    });
+    resample_buffer_.reserve(max_frame_samples);
+
+#if CONFIG_AUDIO_RESAMPLER_BENCHMARK
+    AudioResampler::RunBenchmark();
+#endif
+
     if (codec->input_sample_rate() != 16000) {
         input_resampler_.Configure(codec->input_sample_rate(), 16000);
         reference_resampler_.Configure(codec->input_sample_rate(), 16000);
+
+        /* Size the input scratch buffers for the largest feed, so ReadAudioData never grows them */
+        size_t max_input_samples = codec->input_sample_rate() * OPUS_MAX_FRAME_DURATION_MS / 1000 * codec->input_channels();
+        input_buffer_.reserve(max_input_samples);
+        input_channel_buffer_.reserve(max_input_samples);
+        input_resample_buffer_.reserve(16000 * OPUS_MAX_FRAME_DURATION_MS / 1000 * codec->input_channels());
     }
 
-#if CONFIG_USE_AUDIO_PROCESSOR
+#if CONFIG_USE_SHARED_AFE
+    audio_processor_ = std::make_unique<SharedAfe>();
+#elif CONFIG_USE_AUDIO_PROCESSOR
     audio_processor_ = std::make_unique<AfeAudioProcessor>();
 #else
     audio_processor_ = std::make_unique<NoAudioProcessor>();
 #endif
 
+#if CONFIG_USE_AUDIO_PROCESSOR
+    {
+        Settings settings("audio");
+        afe_profiles_[0] = (AfeProfile)settings.GetInt("afe_profile", AFE_PROFILE_DEFAULT);
+        afe_profiles_[1] = (AfeProfile)settings.GetInt("afe_profile_rt", AFE_PROFILE_REALTIME);
+        for (auto& profile : afe_profiles_) {
+            if (profile < 0 || profile >= kAfeProfileCount) {
+                profile = AFE_PROFILE_DEFAULT;
+            }
+        }
+    }
+    audio_processor_->SetProfile(afe_profiles_[0]);
+    afe_profile_active_ = afe_profiles_[0];
+#endif
+
+#if CONFIG_USE_AUDIO_DEBUGGER
+    audio_debugger_ = std::make_unique<AudioDebugger>();
+#endif
+
+#if CONFIG_USE_WAKE_WORD_GATE
+    // Fails without CONFIG_PM_ENABLE, the frequency is not scaled then
+    if (esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "wake_word", &wake_word_gate_lock_) != ESP_OK) {
+        wake_word_gate_lock_ = nullptr;
+    }
+#endif
+
     audio_processor_->OnOutput([this](std::vector<int16_t>&& data) {
+        input_level_.Measure(data.data(), data.size());
+#if CONFIG_USE_BARGE_IN
+        if (HoldForBargeIn(data)) {
+            return;
+        }
+#endif
+#if CONFIG_USE_LOCAL_ENDPOINTING
+        if (endpointing_) {
+            float confidence = endpointer_.Feed(data.data(), data.size(), voice_detected_);
+            if (confidence >= 0 && callbacks_.on_endpoint) {
+                callbacks_.on_endpoint(confidence);
+            }
+        }
+#endif
+#if CONFIG_USE_AUDIO_DEBUGGER
+        audio_debugger_->Feed(kAudioDebugStreamProcessed, data.data(), data.size(), 16000);
+#endif
         PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(data));
     });
 
@@ -75,113 +180,183 @@ void AudioService::Initialize(AudioCodec* codec) {
 
 void AudioService::Start() {
     service_stopped_ = false;
+    service_suspended_ = false;
+    xEventGroupSetBits(event_group_, AS_EVENT_SERVICE_RESUMED);
     xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING);
 
     esp_timer_start_periodic(audio_power_timer_, 1000000);
 
-#if CONFIG_USE_AUDIO_PROCESSOR
-    /* Start the audio input task */
-    xTaskCreatePinnedToCore([](void* arg) {
-        AudioService* audio_service = (AudioService*)arg;
-        audio_service->AudioInputTask();
-        vTaskDelete(NULL);
-    }, "audio_input", 2048 * 3, this, 8, &audio_input_task_handle_, 0);
-
-    /* Start the audio output task */
-    xTaskCreate([](void* arg) {
+#if CONFIG_AUDIO_SINGLE_TASK
+    /* One task takes the input, the output and the Opus codec in turns, see AudioPipelineTask() */
+    TaskPlacements::Create(kTaskAudioPipeline, [](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
-        audio_service->AudioOutputTask();
-        vTaskDelete(NULL);
-    }, "audio_output", 2048 * 2, this, 4, &audio_output_task_handle_);
+        audio_service->AudioPipelineTask();
+        TaskPlacements::Delete(kTaskAudioPipeline);
+    }, this, &audio_pipeline_task_handle_);
 #else
-    /* Start the audio input task */
-    xTaskCreate([](void* arg) {
+    /* Start the audio input and output tasks */
+    TaskPlacements::Create(kTaskAudioInput, [](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->AudioInputTask();
         vTaskDelete(NULL);
-    }, "audio_input", 2048 * 2, this, 8, &audio_input_task_handle_);
+    }, this, &audio_input_task_handle_);
 
-    /* Start the audio output task */
-    xTaskCreate([](void* arg) {
+    TaskPlacements::Create(kTaskAudioOutput, [](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->AudioOutputTask();
         vTaskDelete(NULL);
-    }, "audio_output", 2048, this, 4, &audio_output_task_handle_);
-#endif
+    }, this, &audio_output_task_handle_);
 
-    /* Start the opus codec task */
-    xTaskCreate([](void* arg) {
+    /* Start the opus encoder and decoder tasks, so uplink and downlink never wait on each other */
+    TaskPlacements::Create(kTaskOpusEncode, [](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
-        audio_service->OpusCodecTask();
-        vTaskDelete(NULL);
-    }, "opus_codec", 2048 * 13, this, 2, &opus_codec_task_handle_);
+        audio_service->OpusEncodeTask();
+        TaskPlacements::Delete(kTaskOpusEncode);
+    }, this, &opus_encode_task_handle_);
+    TaskPlacements::Create(kTaskOpusDecode, [](void* arg) {
+        AudioService* audio_service = (AudioService*)arg;
+        audio_service->OpusDecodeTask();
+        TaskPlacements::Delete(kTaskOpusDecode);
+    }, this, &opus_decode_task_handle_);
+#endif
 }
 
 void AudioService::Stop() {
     esp_timer_stop(audio_power_timer_);
     service_stopped_ = true;
+    service_suspended_ = false;
     xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING |
         AS_EVENT_WAKE_WORD_RUNNING |
-        AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+        AS_EVENT_AUDIO_PROCESSOR_RUNNING |
+        AS_EVENT_SERVICE_RESUMED);
+
+    audio_testing_playback_ = false;
+    audio_encode_queue_.Clear();
+    audio_decode_queue_.Clear();
+    jitter_buffer_.Reset();
+    audio_playback_queue_.Clear();
+    audio_testing_queue_.Clear();
+    /* Wake up the producers blocked on a full queue, so they can see the service is stopped */
+    audio_encode_queue_.NotifyProducer();
+    audio_decode_queue_.NotifyProducer();
+    audio_send_queue_.NotifyProducer();
+    audio_playback_queue_.NotifyProducer();
+}
 
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    audio_encode_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+void AudioService::Suspend(bool release_memory) {
+    if (service_stopped_ || service_suspended_) {
+        return;
+    }
+    xEventGroupClearBits(event_group_, AS_EVENT_SERVICE_RESUMED);
+    service_suspended_ = true;
+
+    audio_testing_playback_ = false;
+    audio_encode_queue_.Clear();
+    audio_decode_queue_.Clear();
+    jitter_buffer_.Reset();
+    audio_playback_queue_.Clear();
+    audio_testing_queue_.Clear();
+    /* The producers blocked on a full queue give up, the consumers park at the top of their loop */
+    audio_encode_queue_.NotifyProducer();
+    audio_decode_queue_.NotifyProducer();
+    audio_send_queue_.NotifyProducer();
+    audio_playback_queue_.NotifyProducer();
+    audio_decode_queue_.NotifyConsumer();
+
+    if (release_memory) {
+        int free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+        ReleaseModels();
+        task_pool_.Trim([](AudioTask& task) {
+            std::vector<int16_t>().swap(task.pcm);
+        });
+        packet_pool_.Trim([](AudioStreamPacket& packet) {
+            std::vector<uint8_t>().swap(packet.payload);
+        });
+        frames_trimmed_ = true;
+        ESP_LOGI(TAG, "Suspended, %d bytes released", (int)heap_caps_get_free_size(MALLOC_CAP_8BIT) - free_before);
+    } else {
+        ESP_LOGI(TAG, "Suspended");
+    }
 }
 
-bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples) {
-    if (!codec_->input_enabled()) {
-        esp_timer_stop(audio_power_timer_);
-        esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
-        codec_->EnableInput(true);
+void AudioService::Resume() {
+    if (!service_suspended_) {
+        return;
     }
+    if (frames_trimmed_) {
+        // Before the tasks run, so the first frames do not allocate
+        task_pool_.Renew();
+        packet_pool_.Renew();
+        frames_trimmed_ = false;
+    }
+    service_suspended_ = false;
+    xEventGroupSetBits(event_group_, AS_EVENT_SERVICE_RESUMED);
+    ESP_LOGI(TAG, "Resumed");
+}
 
-    if (codec_->input_sample_rate() != sample_rate) {
-        data.resize(samples * codec_->input_sample_rate() / sample_rate * codec_->input_channels());
-        if (!codec_->InputData(data)) {
+bool AudioService::WaitWhileSuspended() {
+    if (!service_suspended_) {
+        return false;
+    }
+    xEventGroupWaitBits(event_group_, AS_EVENT_SERVICE_RESUMED, pdFALSE, pdTRUE, portMAX_DELAY);
+    return true;
+}
+
+bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples) {
+    TraceScope trace("audio_read");
+    PowerUpInput();
+
+    const int input_rate = input_format_.sample_rate;
+    const int input_channels = input_format_.channels;
+    // Later than a frame since the last read, the DMA ring took up the difference. A much longer
+    // gap is a pause of the input, not a slow reader
+    int64_t read_gap_us = esp_timer_get_time() - input_read_end_us_;
+    int64_t frame_us = samples * 1000000LL / sample_rate;
+    if (input_read_end_us_ != 0 && read_gap_us > frame_us && read_gap_us < frame_us * AUDIO_INPUT_PAUSE_FRAMES) {
+        AudioPressure::GetInstance().Raise(kAudioPressureInput);
+    }
+    if (input_rate != sample_rate) {
+        /* Read into the persistent scratch buffer, the resamplers then write into the caller's buffer */
+        input_buffer_.resize(samples * input_rate / sample_rate * input_channels);
+        if (!codec_->InputData(input_buffer_)) {
             return false;
         }
-        if (codec_->input_channels() == 2) {
-            auto mic_channel = std::vector<int16_t>(data.size() / 2);
-            auto reference_channel = std::vector<int16_t>(data.size() / 2);
-            for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
-                mic_channel[i] = data[j];
-                reference_channel[i] = data[j + 1];
-            }
-            auto resampled_mic = std::vector<int16_t>(input_resampler_.GetOutputSamples(mic_channel.size()));
-            auto resampled_reference = std::vector<int16_t>(reference_resampler_.GetOutputSamples(reference_channel.size()));
-            input_resampler_.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
-            reference_resampler_.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
-            data.resize(resampled_mic.size() + resampled_reference.size());
-            for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
-                data[j] = resampled_mic[i];
-                data[j + 1] = resampled_reference[i];
-            }
+        if (input_channels == 2) {
+            size_t frames = input_buffer_.size() / 2;
+            input_channel_buffer_.resize(frames * 2);
+            int16_t* mic_channel = input_channel_buffer_.data();
+            int16_t* reference_channel = mic_channel + frames;
+            PcmDeinterleave2(input_buffer_.data(), mic_channel, reference_channel, frames);
+
+            size_t mic_samples = input_resampler_.GetOutputSamples(frames);
+            size_t reference_samples = reference_resampler_.GetOutputSamples(frames);
+            input_resample_buffer_.resize(mic_samples + reference_samples);
+            int16_t* resampled_mic = input_resample_buffer_.data();
+            int16_t* resampled_reference = resampled_mic + mic_samples;
+            input_resampler_.Process(mic_channel, frames, resampled_mic);
+            reference_resampler_.Process(reference_channel, frames, resampled_reference);
+
+            data.resize(mic_samples * 2);
+            PcmInterleave2(resampled_mic, resampled_reference, data.data(), mic_samples);
         } else {
-            auto resampled = std::vector<int16_t>(input_resampler_.GetOutputSamples(data.size()));
-            input_resampler_.Process(data.data(), data.size(), resampled.data());
-            data = std::move(resampled);
+            data.resize(input_resampler_.GetOutputSamples(input_buffer_.size()));
+            input_resampler_.Process(input_buffer_.data(), input_buffer_.size(), data.data());
         }
     } else {
-        data.resize(samples * codec_->input_channels());
+        data.resize(samples * input_channels);
         if (!codec_->InputData(data)) {
             return false;
         }
     }
 
+    input_read_end_us_ = esp_timer_get_time();
     /* Update the last input time */
     last_input_time_ = std::chrono::steady_clock::now();
     debug_statistics_.input_count++;
 
 #if CONFIG_USE_AUDIO_DEBUGGER
     // 音频调试：发送原始音频数据
-    if (audio_debugger_ == nullptr) {
-        audio_debugger_ = std::make_unique<AudioDebugger>();
-    }
-    audio_debugger_->Feed(data);
+    audio_debugger_->FeedInput(data, sample_rate, input_channels, input_format_.reference);
 #endif
 
     return true;
@@ -189,248 +364,782 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
 
 void AudioService::AudioInputTask() {
     while (true) {
-        EventBits_t bits = xEventGroupWaitBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING |
-            AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING,
-            pdFALSE, pdFALSE, portMAX_DELAY);
+        EventBits_t bits = xEventGroupWaitBits(event_group_, AUDIO_INPUT_EVENTS, pdFALSE, pdFALSE, portMAX_DELAY);
 
         if (service_stopped_) {
             break;
         }
-        if (audio_input_need_warmup_) {
-            audio_input_need_warmup_ = false;
-            vTaskDelay(pdMS_TO_TICKS(120));
+        if (WaitWhileSuspended()) {
             continue;
         }
+        if (!InputStep(bits, nullptr)) {
+            break;
+        }
+    }
 
-        /* Used for audio testing in NetworkConfiguring mode by clicking the BOOT button */
-        if (bits & AS_EVENT_AUDIO_TESTING_RUNNING) {
-            if (audio_testing_queue_.size() >= AUDIO_TESTING_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS) {
-                ESP_LOGW(TAG, "Audio testing queue is full, stopping audio testing");
-                EnableAudioTesting(false);
-                continue;
-            }
-            std::vector<int16_t> data;
-            int samples = OPUS_FRAME_DURATION_MS * 16000 / 1000;
-            if (ReadAudioData(data, 16000, samples)) {
-                // If input channels is 2, we need to fetch the left channel data
-                if (codec_->input_channels() == 2) {
-                    auto mono_data = std::vector<int16_t>(data.size() / 2);
-                    for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                        mono_data[i] = data[j];
-                    }
-                    data = std::move(mono_data);
-                }
-                PushTaskToEncodeQueue(kAudioTaskTypeEncodeToTestingQueue, std::move(data));
-                continue;
-            }
+    ESP_LOGW(TAG, "Audio input task stopped");
+}
+
+bool AudioService::IsInputReady(int sample_rate, int samples, TickType_t* not_ready) {
+#if CONFIG_AUDIO_SINGLE_TASK
+    if (not_ready != nullptr &&
+        !codec_->CanRead((size_t)samples * input_format_.sample_rate / sample_rate * input_format_.channels)) {
+        *not_ready = pdMS_TO_TICKS(AUDIO_TASK_POLL_MS);
+        return false;
+    }
+#endif
+    return true;
+}
+
+bool AudioService::InputStep(EventBits_t bits, TickType_t* not_ready) {
+#if CONFIG_USE_LOOPBACK_TEST
+    /* Ahead of the consumers, the test only runs for a second */
+    if (bits & AS_EVENT_LOOPBACK_CAPTURE) {
+        std::vector<int16_t> data;
+        bool done = !ReadAudioData(data, 16000, 16000 * 10 / 1000);
+        if (!done) {
+            done = loopback_test_.load()->AddCapture(data.data(), data.size() / input_format_.channels,
+                esp_timer_get_time());
+        }
+        if (done) {
+            xEventGroupClearBits(event_group_, AS_EVENT_LOOPBACK_CAPTURE);
+            xEventGroupSetBits(event_group_, AS_EVENT_LOOPBACK_CAPTURED);
         }
+        return true;
+    }
+#endif
+    if (audio_input_need_warmup_) {
+        audio_input_need_warmup_ = false;
+        WarmupAudioInput();
+        return true;
+    }
 
-        /* Feed the wake word */
-        if (bits & AS_EVENT_WAKE_WORD_RUNNING) {
-            std::vector<int16_t> data;
-            int samples = wake_word_->GetFeedSize();
-            if (samples > 0) {
-                if (ReadAudioData(data, 16000, samples)) {
-                    wake_word_->Feed(data);
-                    continue;
-                }
+    /* Used for audio testing in NetworkConfiguring mode by clicking the BOOT button */
+    if (bits & AS_EVENT_AUDIO_TESTING_RUNNING) {
+        if (audio_testing_queue_.full()) {
+            ESP_LOGW(TAG, "Audio testing queue is full, stopping audio testing");
+            EnableAudioTesting(false);
+            return true;
+        }
+        std::vector<int16_t> data;
+        int samples = frame_duration_ms_ * 16000 / 1000;
+        if (!IsInputReady(16000, samples, not_ready)) {
+            return true;
+        }
+        if (ReadAudioData(data, 16000, samples)) {
+            // If input channels is 2, we need to fetch the left channel data
+            if (input_format_.channels == 2) {
+                PcmTakeLeftInPlace(data.data(), data.size() / 2);
+                data.resize(data.size() / 2);
             }
+            PushTaskToEncodeQueue(kAudioTaskTypeEncodeToTestingQueue, std::move(data));
+            return true;
         }
+    }
 
-        /* Feed the audio processor */
-        if (bits & AS_EVENT_AUDIO_PROCESSOR_RUNNING) {
-            std::vector<int16_t> data;
-            int samples = audio_processor_->GetFeedSize();
-            if (samples > 0) {
-                if (ReadAudioData(data, 16000, samples)) {
-                    audio_processor_->Feed(std::move(data));
-                    continue;
-                }
+    /* Feed the wake word, ReleaseModels() may free it once the bit is cleared */
+    if (bits & AS_EVENT_WAKE_WORD_RUNNING) {
+        std::lock_guard<std::mutex> lock(models_mutex_);
+        if (!IsWakeWordRunning()) {
+            return true;
+        }
+        std::vector<int16_t> data;
+        int samples = wake_word_->GetFeedSize();
+        if (samples > 0) {
+            if (!IsInputReady(16000, samples, not_ready)) {
+                return true;
+            }
+            if (ReadAudioData(data, 16000, samples)) {
+#if CONFIG_USE_WAKE_WORD_GATE
+                FeedWakeWordGated(data);
+#else
+                wake_word_->Feed(data);
+#endif
+                return true;
             }
         }
+    }
 
-        ESP_LOGE(TAG, "Should not be here, bits: %lx", bits);
-        break;
+    /* Feed the audio processor */
+    if (bits & AS_EVENT_AUDIO_PROCESSOR_RUNNING) {
+        std::lock_guard<std::mutex> lock(models_mutex_);
+        if (!IsAudioProcessorRunning()) {
+            return true;
+        }
+        std::vector<int16_t> data;
+        int samples = audio_processor_->GetFeedSize();
+        if (samples > 0) {
+            if (!IsInputReady(16000, samples, not_ready)) {
+                return true;
+            }
+            if (ReadAudioData(data, 16000, samples)) {
+                latency_tracer_.OnCapture(samples);
+                audio_processor_->Feed(std::move(data));
+                return true;
+            }
+        }
     }
 
-    ESP_LOGW(TAG, "Audio input task stopped");
+    ESP_LOGE(TAG, "Should not be here, bits: %lx", bits);
+    return false;
 }
 
 void AudioService::AudioOutputTask() {
-    while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() { return !audio_playback_queue_.empty() || service_stopped_; });
-        if (service_stopped_) {
-            break;
+    audio_playback_queue_.AttachConsumer(xTaskGetCurrentTaskHandle());
+    output_flushed_generation_ = playback_generation_;
+    while (!service_stopped_) {
+        if (WaitWhileSuspended()) {
+            continue;
+        }
+        TickType_t wait = OutputStep(false);
+        if (wait != 0) {
+            audio_playback_queue_.Wait(wait);
+        }
+    }
+
+    audio_playback_queue_.AttachConsumer(nullptr);
+    ESP_LOGW(TAG, "Audio output task stopped");
+}
+
+TickType_t AudioService::OutputStep(bool wait_for_dma) {
+    // Only this task writes to the codec, so the DMA ring is flushed here
+    uint32_t generation = playback_generation_;
+    if (generation != output_flushed_generation_) {
+        output_flushed_generation_ = generation;
+        if (codec_->FlushOutput()) {
+            ESP_LOGI(TAG, "Playback flushed");
         }
+    }
 
-        auto task = std::move(audio_playback_queue_.front());
-        audio_playback_queue_.pop_front();
-        audio_queue_cv_.notify_all();
-        lock.unlock();
+#if CONFIG_USE_LOOPBACK_TEST
+    auto loopback_test = loopback_test_.load();
+    if (loopback_test != nullptr && !(xEventGroupGetBits(event_group_) & AS_EVENT_LOOPBACK_PLAYED)) {
+        PlayLoopback(loopback_test);
+        return 0;
+    }
+#endif
 
-        if (!codec_->output_enabled()) {
-            esp_timer_stop(audio_power_timer_);
-            esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
-            codec_->EnableOutput(true);
+    std::unique_ptr<AudioTask> task = std::move(output_pending_);
+    if (task == nullptr && !audio_playback_queue_.Pop(task)) {
+        if (IsDecoderBehind()) {
+            playback_starved_.fetch_add(1, std::memory_order_relaxed);
+            AudioPressure::GetInstance().Raise(kAudioPressurePlayback);
         }
+        return portMAX_DELAY;
+    }
+    if (task->generation != generation) {
+        task_pool_.Release(std::move(task));
+        return 0;
+    }
+#if CONFIG_AUDIO_SINGLE_TASK
+    if (wait_for_dma && !codec_->CanWrite(task->pcm.size())) {
+        // Kept for the next turn, the write would wait for the DMA to free the ring
+        output_pending_ = std::move(task);
+        return pdMS_TO_TICKS(AUDIO_TASK_POLL_MS);
+    }
+#endif
+
+    PowerUpOutput();
+    output_level_.Measure(task->pcm.data(), task->pcm.size());
+#if CONFIG_USE_AUDIO_DEBUGGER
+    audio_debugger_->Feed(kAudioDebugStreamPlayback, task->pcm.data(), task->pcm.size(), codec_->output_sample_rate());
+#endif
+    {
+        TraceScope trace("audio_write");
         codec_->OutputData(task->pcm);
+    }
+    TraceRecorder::GetInstance().Counter("playback_queue", audio_playback_queue_.size());
+#if CONFIG_USE_AUDIO_PRESSURE_QOS
+    // Nothing left to play after this frame, the next write starves unless the decoder catches up
+    if (audio_playback_queue_.empty() && IsDecoderBehind()) {
+        AudioPressure::GetInstance().Raise(kAudioPressurePlayback);
+    }
+#endif
+    latency_tracer_.Record(kLatencyStageDecodedToPlayed, task->trace_origin_us, task->trace_stage_us);
+    latency_tracer_.RecordTotal(kLatencyStageDownlinkTotal, task->trace_origin_us);
 
-        /* Update the last output time */
-        last_output_time_ = std::chrono::steady_clock::now();
-        debug_statistics_.playback_count++;
+    /* Update the last output time */
+    last_output_time_ = std::chrono::steady_clock::now();
+    debug_statistics_.playback_count++;
 
 #if CONFIG_USE_SERVER_AEC
-        /* Record the timestamp for server AEC */
-        if (task->timestamp > 0) {
-            lock.lock();
-            timestamp_queue_.push_back(task->timestamp);
+    /* Record the timestamp for server AEC */
+    if (task->timestamp > 0) {
+        PlayoutTimestamp playout = {
+            .timestamp = task->timestamp,
+            .end_position = codec_->output_position(),
+            .samples = static_cast<uint32_t>(task->pcm.size()),
+        };
+        timestamp_queue_.Push(std::move(playout));
+    }
+#endif
+    task_pool_.Release(std::move(task));
+    return 0;
+}
+
+bool AudioService::IsDecoderBehind() {
+    if (!audio_decode_queue_.empty()) {
+        return true;
+    }
+    // A jitter buffer below its target depth is still buffering, not waiting for the decoder
+    if (jitter_buffer_.empty()) {
+        return false;
+    }
+    auto stats = jitter_buffer_.GetStats();
+    return stats.depth >= stats.target_depth;
+}
+
+void AudioService::OpusDecodeTask() {
+    auto self = xTaskGetCurrentTaskHandle();
+    audio_decode_queue_.AttachConsumer(self);
+    audio_testing_queue_.AttachConsumer(self);
+    audio_playback_queue_.AttachProducer(self);
+    decoded_generation_ = playback_generation_;
+
+    while (!service_stopped_) {
+        if (WaitWhileSuspended()) {
+            continue;
         }
+        TickType_t wait = DecodeStep();
+        if (wait != 0) {
+            audio_decode_queue_.Wait(wait);
+        }
+    }
+
+    audio_decode_queue_.AttachConsumer(nullptr);
+    audio_testing_queue_.AttachConsumer(nullptr);
+    audio_playback_queue_.AttachProducer(nullptr);
+    ESP_LOGW(TAG, "Opus decode task stopped");
+}
+
+TickType_t AudioService::DecodeStep() {
+    if (audio_playback_queue_.full()) {
+        return portMAX_DELAY;
+    }
+    uint32_t generation = playback_generation_;
+    if (generation != decoded_generation_) {
+        // The flushed stream is not continued, start the next one from a clean decoder state
+        decoded_generation_ = generation;
+        opus_decoder_->ResetState();
+    }
+
+#if !CONFIG_USE_AUDIO_MIXER
+    if (audio_mixer_.active()) {
+        /* Not mixed, the local sounds play ahead of the stream */
+        auto task = task_pool_.Acquire();
+        task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+        task->timestamp = 0;
+        task->trace_origin_us = 0;
+        task->generation = generation;
+        if (audio_mixer_.Render(task->pcm)) {
+            audio_playback_queue_.Push(std::move(task));
+            return 0;
+        }
+        task_pool_.Release(std::move(task));
+    }
 #endif
+
+    /* Decode the queued packets first (cached TTS), then the server audio from the jitter buffer, or play back the testing queue */
+    std::unique_ptr<AudioStreamPacket> packet;
+    auto result = audio_decode_queue_.Pop(packet) ? kJitterBufferFrame : jitter_buffer_.Pop(packet);
+    if (result == kJitterBufferEmpty && audio_testing_playback_) {
+        if (audio_testing_queue_.Pop(packet)) {
+            result = kJitterBufferFrame;
+        } else {
+            audio_testing_playback_ = false;
+        }
+    }
+#if CONFIG_USE_AUDIO_MIXER
+    if (result == kJitterBufferEmpty && audio_mixer_.active()) {
+        /* No stream audio, play the local sounds alone */
+        auto task = task_pool_.Acquire();
+        task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+        task->timestamp = 0;
+        task->trace_origin_us = 0;
+        task->generation = generation;
+        if (audio_mixer_.Render(task->pcm)) {
+            audio_playback_queue_.Push(std::move(task));
+            return 0;
+        }
+        task_pool_.Release(std::move(task));
+    }
+#endif
+    if (result == kJitterBufferEmpty) {
+        // While the jitter buffer is filling up, poll it once per frame
+        return jitter_buffer_.empty() ? portMAX_DELAY : pdMS_TO_TICKS(OPUS_MIN_FRAME_DURATION_MS / 2);
     }
 
-    ESP_LOGW(TAG, "Audio output task stopped");
+    auto task = task_pool_.Acquire();
+    task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+    task->generation = generation;
+
+    bool decoded;
+    if (result == kJitterBufferLost) {
+        /* Packet loss concealment, an empty payload makes the Opus decoder extrapolate the missing frame */
+        task->timestamp = 0;
+        task->trace_origin_us = 0;
+        TraceScope trace("opus_plc");
+        decoded = opus_decoder_->Decode(std::vector<uint8_t>(), task->pcm);
+        if (!decoded) {
+            task->pcm.assign(opus_decoder_->sample_rate() * opus_decoder_->duration_ms() / 1000, 0);
+            decoded = true;
+        }
+    } else {
+        task->timestamp = packet->timestamp;
+        task->trace_origin_us = packet->trace_origin_us;
+        task->trace_stage_us = packet->trace_stage_us;
+        SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
+        TraceScope trace("opus_decode");
+        decoded = opus_decoder_->Decode(std::move(packet->payload), task->pcm);
+    }
+    if (decoded) {
+        // Resample if the sample rate is different
+        if (output_resampler_ != nullptr) {
+            int target_size = output_resampler_->GetOutputSamples(task->pcm.size());
+            resample_buffer_.resize(target_size);
+            output_resampler_->Process(task->pcm.data(), task->pcm.size(), resample_buffer_.data());
+            // Swap instead of move, so both buffers keep their capacity
+            task->pcm.swap(resample_buffer_);
+        }
+#if CONFIG_USE_AUDIO_MIXER
+        audio_mixer_.Mix(task->pcm);
+#endif
+        latency_tracer_.Record(kLatencyStageReceivedToDecoded, task->trace_origin_us, task->trace_stage_us);
+        if (task->generation != playback_generation_) {
+            // Flushed while it was decoded
+            task_pool_.Release(std::move(task));
+        } else {
+            audio_playback_queue_.Push(std::move(task));
+        }
+    } else {
+        LOG_RATE_LIMITED(1000, ESP_LOGE, TAG, "Failed to decode audio");
+        task_pool_.Release(std::move(task));
+    }
+    packet_pool_.Release(std::move(packet));
+    debug_statistics_.decode_count++;
+    return 0;
 }
 
-void AudioService::OpusCodecTask() {
-    while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() {
-            return service_stopped_ ||
-                (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) ||
-                (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE);
-        });
-        if (service_stopped_) {
-            break;
+void AudioService::OpusEncodeTask() {
+    auto self = xTaskGetCurrentTaskHandle();
+    audio_encode_queue_.AttachConsumer(self);
+    audio_send_queue_.AttachProducer(self);
+
+    while (!service_stopped_) {
+        if (WaitWhileSuspended()) {
+            continue;
         }
+        TickType_t wait = EncodeStep();
+        if (wait != 0) {
+            audio_encode_queue_.Wait(wait);
+        }
+    }
 
-        /* Decode the audio from decode queue */
-        if (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
-            auto packet = std::move(audio_decode_queue_.front());
-            audio_decode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto task = std::make_unique<AudioTask>();
-            task->type = kAudioTaskTypeDecodeToPlaybackQueue;
-            task->timestamp = packet->timestamp;
-
-            SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
-            if (opus_decoder_->Decode(std::move(packet->payload), task->pcm)) {
-                // Resample if the sample rate is different
-                if (opus_decoder_->sample_rate() != codec_->output_sample_rate()) {
-                    int target_size = output_resampler_.GetOutputSamples(task->pcm.size());
-                    std::vector<int16_t> resampled(target_size);
-                    output_resampler_.Process(task->pcm.data(), task->pcm.size(), resampled.data());
-                    task->pcm = std::move(resampled);
-                }
+    audio_encode_queue_.AttachConsumer(nullptr);
+    audio_send_queue_.AttachProducer(nullptr);
+    ESP_LOGW(TAG, "Opus encode task stopped");
+}
+
+TickType_t AudioService::EncodeStep() {
+    TickType_t blocked = GetSendQueueWait();
+    if (blocked != 0) {
+        return blocked;
+    }
+
+    /* Encode the audio to send queue */
+    std::unique_ptr<AudioTask> task;
+    if (!audio_encode_queue_.Pop(task)) {
+        return portMAX_DELAY;
+    }
+
+    /* An omitted stretch of silence, the empty packet only keeps the timestamps going */
+    if (task->pcm.empty()) {
+        auto packet = packet_pool_.Acquire();
+        packet->frame_duration = encoder_frame_duration_ms_;
+        packet->sample_rate = 16000;
+        packet->timestamp = task->timestamp;
+        packet->trace_origin_us = 0;
+        packet->payload.clear();
+        task_pool_.Release(std::move(task));
+        PushToSendQueue(std::move(packet));
+        return 0;
+    }
+
+    /* The frame duration follows the processor output, so a runtime change never splits a frame */
+    int frame_duration = task->pcm.size() * 1000 / 16000;
+    if (frame_duration != encoder_frame_duration_ms_) {
+        ESP_LOGI(TAG, "Encoder frame duration changed from %d ms to %d ms", encoder_frame_duration_ms_, frame_duration);
+        opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, frame_duration);
+        opus_encoder_->SetComplexity(encoder_controller_.complexity());
+        encoder_dtx_ = encoder_controller_.dtx();
+        opus_encoder_->SetDtx(encoder_dtx_);
+        encoder_frame_duration_ms_ = frame_duration;
+    }
+
+    /* Silent frames use DTX whatever the controller chose, the other ones go back to its choice */
+    bool dtx = task->silent || encoder_controller_.dtx();
+    if (dtx != encoder_dtx_) {
+        opus_encoder_->SetDtx(dtx);
+        encoder_dtx_ = dtx;
+    }
+
+    auto packet = packet_pool_.Acquire();
+    packet->frame_duration = frame_duration;
+    packet->sample_rate = 16000;
+    packet->timestamp = task->timestamp;
+    packet->trace_origin_us = task->trace_origin_us;
+    packet->trace_stage_us = task->trace_stage_us;
+    auto type = task->type;
+    int64_t encode_start_us = esp_timer_get_time();
+    TraceRecorder::GetInstance().Begin("opus_encode");
+    bool encoded = opus_encoder_->Encode(std::move(task->pcm), packet->payload);
+    TraceRecorder::GetInstance().End("opus_encode");
+    int64_t encode_us = esp_timer_get_time() - encode_start_us;
+    task_pool_.Release(std::move(task));
+    if (!encoded) {
+        ESP_LOGE(TAG, "Failed to encode audio");
+        packet_pool_.Release(std::move(packet));
+        return 0;
+    }
+
+    /* Only the uplink drives the controller, the testing queue fills up by design */
+    if (type == kAudioTaskTypeEncodeToSendQueue &&
+        encoder_controller_.AddFrame(frame_duration, encode_us, audio_send_queue_.size(), audio_send_queue_.limit())) {
+        auto stats = jitter_buffer_.GetStats();
+        if (encoder_controller_.Evaluate(stats.received, stats.lost, link_rtt_ms_, congestion_rtt_ms_)) {
+            // The DTX setting is applied with the next frame
+            opus_encoder_->SetComplexity(encoder_controller_.complexity());
+        }
+    }
+    latency_tracer_.Record(kLatencyStageProcessedToEncoded, packet->trace_origin_us, packet->trace_stage_us);
+
+    if (type == kAudioTaskTypeEncodeToSendQueue) {
+        PushToSendQueue(std::move(packet));
+    } else if (type == kAudioTaskTypeEncodeToTestingQueue) {
+        if (!audio_testing_queue_.Push(std::move(packet))) {
+            packet_pool_.Release(std::move(packet));
+        }
+    }
+    debug_statistics_.encode_count++;
+    return 0;
+}
+
+void AudioService::SetInputEvents(EventBits_t bits) {
+    xEventGroupSetBits(event_group_, bits);
+#if CONFIG_AUDIO_SINGLE_TASK
+    // The pipeline task polls the bits, it may be waiting for a queue or the DMA
+    if (audio_pipeline_task_handle_ != nullptr) {
+        xTaskNotifyGiveIndexed(audio_pipeline_task_handle_, SPSC_QUEUE_NOTIFY_INDEX);
+    }
+#endif
+}
+
+#if CONFIG_AUDIO_SINGLE_TASK
+void AudioService::AudioPipelineTask() {
+    auto self = xTaskGetCurrentTaskHandle();
+    audio_encode_queue_.AttachConsumer(self);
+    audio_send_queue_.AttachProducer(self);
+    audio_decode_queue_.AttachConsumer(self);
+    audio_testing_queue_.AttachConsumer(self);
+    audio_playback_queue_.AttachProducer(self);
+    audio_playback_queue_.AttachConsumer(self);
+    output_flushed_generation_ = playback_generation_;
+    decoded_generation_ = playback_generation_;
+    bool input_running = true;
+
+    while (!service_stopped_) {
+        if (WaitWhileSuspended()) {
+            continue;
+        }
 
-                lock.lock();
-                audio_playback_queue_.push_back(std::move(task));
-                audio_queue_cv_.notify_all();
+        /* The I2S rings first, a turn only writes and reads what they take without waiting */
+        TickType_t wait = OutputStep(true);
+        bool worked = wait == 0;
+        bool dma_wait = output_pending_ != nullptr;
+        EventBits_t bits = xEventGroupGetBits(event_group_) & AUDIO_INPUT_EVENTS;
+        if (bits != 0 && input_running) {
+            TickType_t not_ready = 0;
+            if (!InputStep(bits, &not_ready)) {
+                // As the input task of the threaded mode, which stops there
+                ESP_LOGW(TAG, "Audio input stopped");
+                input_running = false;
+            } else if (not_ready == 0) {
+                worked = true;
             } else {
-                ESP_LOGE(TAG, "Failed to decode audio");
-                lock.lock();
-            }
-            debug_statistics_.decode_count++;
-        }
-        
-        /* Encode the audio to send queue */
-        if (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) {
-            auto task = std::move(audio_encode_queue_.front());
-            audio_encode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->frame_duration = OPUS_FRAME_DURATION_MS;
-            packet->sample_rate = 16000;
-            packet->timestamp = task->timestamp;
-            if (!opus_encoder_->Encode(std::move(task->pcm), packet->payload)) {
-                ESP_LOGE(TAG, "Failed to encode audio");
-                continue;
+                wait = std::min(wait, not_ready);
+                dma_wait = true;
             }
+        }
 
-            if (task->type == kAudioTaskTypeEncodeToSendQueue) {
-                {
-                    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-                    audio_send_queue_.push_back(std::move(packet));
-                }
-                if (callbacks_.on_send_queue_available) {
-                    callbacks_.on_send_queue_available();
-                }
-            } else if (task->type == kAudioTaskTypeEncodeToTestingQueue) {
-                std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-                audio_testing_queue_.push_back(std::move(packet));
-            }
-            debug_statistics_.encode_count++;
-            lock.lock();
+        /*
+         * Then one frame of Opus, the earliest deadline first: the decoder has until the queued
+         * playback runs out, the encoder until the encode queue is full. Each frame is shorter
+         * than the DMA rings, so the I2S is served again before they underrun or overflow.
+         */
+        int playback_ms = audio_playback_queue_.size() * opus_decoder_->duration_ms();
+        size_t encode_queued = std::min(audio_encode_queue_.size(), audio_encode_queue_.limit());
+        int encode_ms = (audio_encode_queue_.limit() - encode_queued) * encoder_frame_duration_ms_;
+        bool decode_first = playback_ms <= encode_ms;
+        TickType_t codec_wait = decode_first ? DecodeStep() : EncodeStep();
+        if (codec_wait != 0) {
+            TickType_t other_wait = decode_first ? EncodeStep() : DecodeStep();
+            codec_wait = other_wait == 0 ? 0 : std::min(codec_wait, other_wait);
+        }
+        if (codec_wait == 0) {
+            worked = true;
+        } else {
+            wait = std::min(wait, codec_wait);
+        }
+
+        if (!worked) {
+            // Woken by every queue and the input events, and by the DMA buffers while a read or
+            // a write waits for them
+            codec_->SetDmaWaiter(dma_wait ? self : nullptr);
+            audio_encode_queue_.Wait(wait);
         }
     }
 
-    ESP_LOGW(TAG, "Opus codec task stopped");
+    codec_->SetDmaWaiter(nullptr);
+    audio_encode_queue_.AttachConsumer(nullptr);
+    audio_send_queue_.AttachProducer(nullptr);
+    audio_decode_queue_.AttachConsumer(nullptr);
+    audio_testing_queue_.AttachConsumer(nullptr);
+    audio_playback_queue_.AttachProducer(nullptr);
+    audio_playback_queue_.AttachConsumer(nullptr);
+    audio_pipeline_task_handle_ = nullptr;
+    ESP_LOGW(TAG, "Audio pipeline task stopped");
+}
+#endif
+
+TickType_t AudioService::GetSendQueueWait() {
+    /*
+     * Only the block policy holds the encoder back, and only for the timeout, so a stalled
+     * socket never backs up the encode queue and the audio input for longer than that.
+     */
+    if (send_policy_ != kAudioSendPolicyBlock || !audio_send_queue_.full()) {
+        send_blocked_since_us_ = 0;
+        return 0;
+    }
+    int64_t now = esp_timer_get_time();
+    if (send_blocked_since_us_ == 0) {
+        send_blocked_since_us_ = now;
+    }
+    int64_t left_ms = CONFIG_AUDIO_SEND_BLOCK_TIMEOUT_MS - (now - send_blocked_since_us_) / 1000;
+    if (left_ms <= 0) {
+        // Timed out, the new frames are dropped until the queue has room again
+        return 0;
+    }
+    return std::max<TickType_t>(pdMS_TO_TICKS(left_ms), 1);
+}
+
+void AudioService::PushToSendQueue(std::unique_ptr<AudioStreamPacket>&& packet) {
+    bool pushed;
+    if (send_policy_ == kAudioSendPolicyDropOldest) {
+        bool discarded;
+        pushed = audio_send_queue_.PushDiscardOldest(std::move(packet), discarded);
+        if (discarded) {
+            send_dropped_oldest_++;
+        }
+    } else {
+        pushed = audio_send_queue_.Push(std::move(packet));
+    }
+    if (!pushed) {
+        send_dropped_newest_++;
+        packet_pool_.Release(std::move(packet));
+        return;
+    }
+    if (callbacks_.on_send_queue_available) {
+        callbacks_.on_send_queue_available();
+    }
 }
 
 void AudioService::SetDecodeSampleRate(int sample_rate, int frame_duration) {
-    if (opus_decoder_->sample_rate() == sample_rate && opus_decoder_->duration_ms() == frame_duration) {
+    bool retuned = false;
+#if CONFIG_AUDIO_OUTPUT_FOLLOW_STREAM_RATE
+    retuned = RetuneOutput(sample_rate);
+#endif
+    if (!retuned && opus_decoder_ != nullptr && opus_decoder_->sample_rate() == sample_rate && opus_decoder_->duration_ms() == frame_duration) {
         return;
     }
 
-    opus_decoder_.reset();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
+    auto& entry = decoder_cache_.Get(sample_rate, frame_duration);
+    opus_decoder_ = entry.decoder.get();
+    output_resampler_ = entry.resampler.get();
+}
 
-    auto codec = Board::GetInstance().GetAudioCodec();
-    if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
-        ESP_LOGI(TAG, "Resampling audio from %d to %d", opus_decoder_->sample_rate(), codec->output_sample_rate());
-        output_resampler_.Configure(opus_decoder_->sample_rate(), codec->output_sample_rate());
+#if CONFIG_AUDIO_OUTPUT_FOLLOW_STREAM_RATE
+bool AudioService::RetuneOutput(int sample_rate) {
+    // Not above the rate of the codec, the preallocated frames and the DMA ring are sized for it
+    int target = std::min(sample_rate, native_output_sample_rate_);
+    if (output_rate_fixed_ || opus_decoder_ == nullptr || target == codec_->output_sample_rate()) {
+        return false;
+    }
+    // Only between two streams: the last one has played out of the DMA ring and no sound is mixed in
+    auto output_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - last_output_time_).count();
+    if (!audio_playback_queue_.empty() || audio_mixer_.active() || output_elapsed < AUDIO_OUTPUT_RETUNE_IDLE_MS) {
+        return false;
     }
+    int previous = codec_->output_sample_rate();
+    if (!codec_->SetOutputSampleRate(target)) {
+        // Tried once, the downlink keeps the resampler
+        output_rate_fixed_ = true;
+        ESP_LOGI(TAG, "The codec keeps its output at %d Hz, resampling %d Hz", previous, sample_rate);
+        return false;
+    }
+    decoder_cache_.SetOutputSampleRate(target);
+    audio_mixer_.SetOutputSampleRate(target);
+    ESP_LOGI(TAG, "Output retuned %d -> %d Hz for the %d Hz stream", previous, target, sample_rate);
+    return true;
 }
+#endif
 
 void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm) {
-    auto task = std::make_unique<AudioTask>();
+    // Also guards the silence suppression state, which every producer goes through
+    std::lock_guard<std::mutex> lock(encode_push_mutex_);
+    auto task = task_pool_.Acquire();
     task->type = type;
-    task->pcm = std::move(pcm);
-    
-    /* Push the task to the encode queue */
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
+    task->timestamp = 0;
+    task->silent = false;
+    task->trace_origin_us = 0;
+    // Swap instead of move, the caller gets the pooled buffer back and can fill it again without allocating
+    task->pcm.swap(pcm);
+    pcm.clear();
 
     /* If the task is to send queue, we need to set the timestamp */
-    if (type == kAudioTaskTypeEncodeToSendQueue && !timestamp_queue_.empty()) {
-        if (timestamp_queue_.size() <= MAX_TIMESTAMPS_IN_QUEUE) {
-            task->timestamp = timestamp_queue_.front();
-        } else {
-            ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", timestamp_queue_.size());
+    if (type == kAudioTaskTypeEncodeToSendQueue) {
+        task->trace_origin_us = latency_tracer_.OnProcessed(task->pcm.size());
+        task->trace_stage_us = task->trace_origin_us;
+        latency_tracer_.Record(kLatencyStageCaptureToProcessed, task->trace_origin_us, task->trace_stage_us);
+
+#if CONFIG_USE_SERVER_AEC
+        /* Reference the downlink audio that was playing when the first sample of this frame was captured */
+        int64_t frame_us = static_cast<int64_t>(task->pcm.size()) * 1000000 / 16000;
+        int64_t capture_end_us = task->trace_origin_us != 0 ? task->trace_origin_us : esp_timer_get_time();
+        task->timestamp = GetAecReferenceTimestamp(capture_end_us - frame_us - aec_capture_offset_us_);
+#endif
+        /* After the timestamp, so a suppressed stretch does not shift the following frames */
+        if (SuppressSilence(task)) {
+            return;
         }
-        timestamp_queue_.pop_front();
     }
 
-    audio_queue_cv_.wait(lock, [this]() { return audio_encode_queue_.size() < MAX_ENCODE_TASKS_IN_QUEUE; });
-    audio_encode_queue_.push_back(std::move(task));
-    audio_queue_cv_.notify_all();
+    PushEncodeTask(std::move(task));
+}
+
+bool AudioService::SuppressSilence(std::unique_ptr<AudioTask>& task) {
+    int frame_ms = task->pcm.size() * 1000 / 16000;
+    if (silence_reset_.exchange(false)) {
+        if (silence_held_task_) {
+            task_pool_.Release(std::move(silence_held_task_));
+        }
+        silence_hangover_ms_ = SILENCE_HANGOVER_MS;
+        silence_keepalive_ms_ = 0;
+    }
+
+    auto mode = silence_suppression_.load();
+    if (mode == kSilenceSuppressionOff || voice_detected_ || !audio_processor_->IsVadEnabled()) {
+        silence_hangover_ms_ = SILENCE_HANGOVER_MS;
+    } else if (silence_hangover_ms_ > 0) {
+        silence_hangover_ms_ -= frame_ms;
+    }
+
+    if (silence_hangover_ms_ > 0) {
+        /* Speech onset, the held frame goes first */
+        if (silence_held_task_) {
+            PushEncodeTask(std::move(silence_held_task_));
+        }
+        silence_keepalive_ms_ = 0;
+        return false;
+    }
+
+    if (mode == kSilenceSuppressionDtx) {
+        task->silent = true;
+        return false;
+    }
+
+    /* Hold the newest silent frame, the previous one is dropped or turned into a keepalive */
+    std::swap(task, silence_held_task_);
+    silence_keepalive_ms_ += frame_ms;
+    if (task == nullptr) {
+        return true;
+    }
+    if (silence_keepalive_ms_ < SILENCE_KEEPALIVE_INTERVAL_MS) {
+        task_pool_.Release(std::move(task));
+        return true;
+    }
+    silence_keepalive_ms_ = 0;
+    task->pcm.clear();
+    task->silent = true;
+    return false;
+}
+
+void AudioService::PushEncodeTask(std::unique_ptr<AudioTask>&& task) {
+#if CONFIG_AUDIO_SINGLE_TASK
+    /* The pipeline task is also the only consumer, waiting for it would never end: the oldest frame goes */
+    if (xTaskGetCurrentTaskHandle() == audio_pipeline_task_handle_) {
+        if (!audio_encode_queue_.Push(std::move(task))) {
+            AudioPressure::GetInstance().Raise(kAudioPressureEncode);
+            std::unique_ptr<AudioTask> oldest;
+            if (audio_encode_queue_.Pop(oldest)) {
+                task_pool_.Release(std::move(oldest));
+            }
+            if (!audio_encode_queue_.Push(std::move(task))) {
+                task_pool_.Release(std::move(task));
+            }
+        }
+        return;
+    }
+#endif
+    /* Push the task to the encode queue, wait if the codec task is behind */
+    while (!audio_encode_queue_.Push(std::move(task))) {
+        if (service_stopped_ || service_suspended_) {
+            task_pool_.Release(std::move(task));
+            return;
+        }
+        AudioPressure::GetInstance().Raise(kAudioPressureEncode);
+        audio_encode_queue_.AttachProducer(xTaskGetCurrentTaskHandle());
+        audio_encode_queue_.Wait(pdMS_TO_TICKS(OPUS_FRAME_DURATION_MS));
+    }
+    audio_encode_queue_.AttachProducer(nullptr);
+}
+
+bool AudioService::PushPacketToJitterBuffer(std::unique_ptr<AudioStreamPacket> packet) {
+    packet->trace_origin_us = esp_timer_get_time();
+    packet->trace_stage_us = packet->trace_origin_us;
+    if (!jitter_buffer_.Push(std::move(packet))) {
+        return false;
+    }
+    audio_decode_queue_.NotifyConsumer();
+    return true;
 }
 
 bool AudioService::PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait) {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    if (audio_decode_queue_.size() >= MAX_DECODE_PACKETS_IN_QUEUE) {
-        if (wait) {
-            audio_queue_cv_.wait(lock, [this]() { return audio_decode_queue_.size() < MAX_DECODE_PACKETS_IN_QUEUE; });
-        } else {
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(decode_push_mutex_);
+            if (audio_decode_queue_.Push(std::move(packet))) {
+                break;
+            }
+        }
+        if (!wait || service_stopped_ || service_suspended_) {
             return false;
         }
+        audio_decode_queue_.AttachProducer(xTaskGetCurrentTaskHandle());
+        audio_decode_queue_.Wait(pdMS_TO_TICKS(OPUS_FRAME_DURATION_MS));
+    }
+    if (wait) {
+        audio_decode_queue_.AttachProducer(nullptr);
     }
-    audio_decode_queue_.push_back(std::move(packet));
-    audio_queue_cv_.notify_all();
     return true;
 }
 
 std::unique_ptr<AudioStreamPacket> AudioService::PopPacketFromSendQueue() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    if (audio_send_queue_.empty()) {
-        return nullptr;
+    std::unique_ptr<AudioStreamPacket> packet;
+    if (audio_send_queue_.Pop(packet)) {
+        latency_tracer_.Record(kLatencyStageEncodedToSent, packet->trace_origin_us, packet->trace_stage_us);
+        latency_tracer_.RecordTotal(kLatencyStageUplinkTotal, packet->trace_origin_us);
     }
-    auto packet = std::move(audio_send_queue_.front());
-    audio_send_queue_.pop_front();
-    audio_queue_cv_.notify_all();
     return packet;
 }
 
@@ -445,29 +1154,125 @@ const std::string& AudioService::GetLastWakeWord() const {
 }
 
 std::unique_ptr<AudioStreamPacket> AudioService::PopWakeWordPacket() {
-    auto packet = std::make_unique<AudioStreamPacket>();
+    auto packet = packet_pool_.Acquire();
+    packet->sample_rate = 0;
+    packet->frame_duration = 0;
+    packet->timestamp = 0;
+    packet->trace_origin_us = 0;
     if (wake_word_->GetWakeWordOpus(packet->payload)) {
         return packet;
     }
+    packet_pool_.Release(std::move(packet));
     return nullptr;
 }
 
+void AudioService::PrepareWakeWord() {
+    std::lock_guard<std::mutex> lock(models_mutex_);
+    if (!wake_word_ || wake_word_initialized_) {
+        return;
+    }
+    if (!wake_word_->Initialize(codec_, models_list_)) {
+        ESP_LOGE(TAG, "Failed to initialize wake word");
+        return;
+    }
+    wake_word_initialized_ = true;
+}
+
+void AudioService::PrepareVoiceProcessing() {
+    std::lock_guard<std::mutex> lock(models_mutex_);
+    InitializeAudioProcessor();
+}
+
+// Called with models_mutex_ held
+void AudioService::InitializeAudioProcessor() {
+    // Another profile means another instance, only recreated while nothing fetches from it
+    bool idle = !IsAudioProcessorRunning();
+#if CONFIG_USE_SHARED_AFE
+    idle = idle && !IsWakeWordRunning();
+#endif
+    if (audio_processor_initialized_ && audio_processor_->GetProfile() != afe_profile_active_ && idle) {
+        ESP_LOGI(TAG, "AFE profile %s -> %s", AfeProfileName(afe_profile_active_), AfeProfileName(audio_processor_->GetProfile()));
+        audio_processor_->Deinitialize();
+        audio_processor_initialized_ = false;
+    }
+    if (audio_processor_initialized_) {
+        return;
+    }
+    audio_processor_->Initialize(codec_, frame_duration_ms_, models_list_);
+    audio_processor_initialized_ = true;
+    afe_profile_active_ = audio_processor_->GetProfile();
+    if (device_aec_set_) {
+        // Restore the mode picked before the models were released
+        audio_processor_->EnableDeviceAec(device_aec_enabled_);
+    }
+}
+
+void AudioService::ReleaseModels() {
+    if (!wake_word_initialized_ && !audio_processor_initialized_) {
+        return;
+    }
+    EnableWakeWordDetection(false);
+    EnableVoiceProcessing(false);
+
+    std::lock_guard<std::mutex> lock(models_mutex_);
+    int free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    if (wake_word_initialized_) {
+        // The wake word has no way back to its uninitialized state, a fresh instance takes its place
+        wake_word_.reset();
+        CreateWakeWord();
+        wake_word_initialized_ = false;
+    }
+#if CONFIG_USE_SHARED_AFE
+    // The wake word may have created the shared instance alone
+    audio_processor_->Deinitialize();
+    audio_processor_initialized_ = false;
+#else
+    if (audio_processor_initialized_) {
+        audio_processor_->Deinitialize();
+        audio_processor_initialized_ = false;
+    }
+#endif
+    ESP_LOGI(TAG, "Models released, %d bytes reclaimed", (int)heap_caps_get_free_size(MALLOC_CAP_8BIT) - free_before);
+}
+
+void AudioService::SetAfeProfiles(AfeProfile profile, AfeProfile realtime_profile) {
+    afe_profiles_[0] = profile;
+    afe_profiles_[1] = realtime_profile;
+    Settings settings("audio", true);
+    settings.SetInt("afe_profile", profile);
+    settings.SetInt("afe_profile_rt", realtime_profile);
+}
+
+void AudioService::SelectAfeProfile(bool realtime) {
+    std::lock_guard<std::mutex> lock(models_mutex_);
+    audio_processor_->SetProfile(std::min(afe_profiles_[realtime ? 1 : 0], afe_profile_limit_));
+}
+
+void AudioService::SetAfeProfileLimit(AfeProfile highest) {
+    std::lock_guard<std::mutex> lock(models_mutex_);
+    afe_profile_limit_ = highest;
+}
+
 void AudioService::EnableWakeWordDetection(bool enable) {
     if (!wake_word_) {
         return;
     }
 
     ESP_LOGD(TAG, "%s wake word detection", enable ? "Enabling" : "Disabling");
+#if CONFIG_USE_WAKE_WORD_GATE
+    {
+        // Every start begins with the gate closed and a fresh pre-roll
+        std::lock_guard<std::mutex> lock(models_mutex_);
+        CloseWakeWordGate();
+    }
+#endif
     if (enable) {
+        PrepareWakeWord();
         if (!wake_word_initialized_) {
-            if (!wake_word_->Initialize(codec_, models_list_)) {
-                ESP_LOGE(TAG, "Failed to initialize wake word");
-                return;
-            }
-            wake_word_initialized_ = true;
+            return;
         }
         wake_word_->Start();
-        xEventGroupSetBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
+        SetInputEvents(AS_EVENT_WAKE_WORD_RUNNING);
     } else {
         wake_word_->Stop();
         xEventGroupClearBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
@@ -477,189 +1282,437 @@ void AudioService::EnableWakeWordDetection(bool enable) {
 void AudioService::EnableVoiceProcessing(bool enable) {
     ESP_LOGD(TAG, "%s voice processing", enable ? "Enabling" : "Disabling");
     if (enable) {
-        if (!audio_processor_initialized_) {
-            audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
-            audio_processor_initialized_ = true;
-        }
+        PrepareVoiceProcessing();
 
         /* We should make sure no audio is playing */
         ResetDecoder();
+#if CONFIG_USE_SHARED_AFE
+        // Still fed for the wake word, the handoff audio follows it without a gap
+        audio_input_need_warmup_ = !IsWakeWordRunning();
+#else
         audio_input_need_warmup_ = true;
+#endif
+        silence_reset_ = true;
+        latency_tracer_.ResetCapture();
+#if CONFIG_USE_LOCAL_ENDPOINTING
+        endpointer_.Reset();
+#endif
         audio_processor_->Start();
-        xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+        SetInputEvents(AS_EVENT_AUDIO_PROCESSOR_RUNNING);
     } else {
         audio_processor_->Stop();
         xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
     }
 }
 
+bool AudioService::EnableBargeIn(bool enable) {
+#if CONFIG_USE_BARGE_IN
+    if (enable) {
+        PrepareVoiceProcessing();
+        {
+            std::lock_guard<std::mutex> lock(barge_in_mutex_);
+            barge_in_state_ = kBargeInArmed;
+            barge_in_frames_.clear();
+            barge_in_detector_.Reset();
+        }
+        ESP_LOGI(TAG, "Barge-in armed");
+        // Unlike EnableVoiceProcessing(true) the decoder goes on playing, the AEC cancels it
+        audio_processor_->EnableDeviceAec(true);
+        audio_input_need_warmup_ = true;
+        audio_processor_->Start();
+        SetInputEvents(AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(barge_in_mutex_);
+        if (barge_in_state_ == kBargeInOff) {
+            // Committed, or never armed
+            return true;
+        }
+        barge_in_state_ = kBargeInOff;
+        barge_in_frames_.clear();
+    }
+    audio_processor_->Stop();
+    xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+    audio_processor_->EnableDeviceAec(device_aec_enabled_);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void AudioService::CommitBargeIn() {
+#if CONFIG_USE_BARGE_IN
+    // The VAD of the new turn needs the AEC off again, unless it was on already
+    audio_processor_->EnableDeviceAec(device_aec_enabled_);
+    silence_reset_ = true;
+    latency_tracer_.ResetCapture();
+#if CONFIG_USE_LOCAL_ENDPOINTING
+    endpointer_.Reset();
+#endif
+    // Under the lock, so the processor task cannot push a live frame ahead of the held ones
+    std::lock_guard<std::mutex> lock(barge_in_mutex_);
+    if (barge_in_state_ == kBargeInOff) {
+        return;
+    }
+    ESP_LOGI(TAG, "Barge-in committed, %u frames held", (unsigned)barge_in_frames_.size());
+    for (auto& frame : barge_in_frames_) {
+        PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(frame));
+    }
+    barge_in_frames_.clear();
+    barge_in_state_ = kBargeInOff;
+#endif
+}
+
+#if CONFIG_USE_BARGE_IN
+// Called by the audio processor task, true when the frame is held instead of sent
+bool AudioService::HoldForBargeIn(std::vector<int16_t>& data) {
+    int speech_ms = -1;
+    {
+        std::lock_guard<std::mutex> lock(barge_in_mutex_);
+        if (barge_in_state_ == kBargeInOff) {
+            return false;
+        }
+        if (barge_in_state_ == kBargeInArmed) {
+            speech_ms = barge_in_detector_.Feed(data.data(), data.size());
+            if (speech_ms >= 0) {
+                barge_in_state_ = kBargeInTriggered;
+            }
+        }
+
+        // The detected speech and a bit ahead of it, the oldest frame buffer is reused
+        size_t max_frames = (CONFIG_BARGE_IN_MIN_SPEECH_MS + BARGE_IN_PREROLL_MS) / frame_duration_ms_ + 1;
+        if (barge_in_state_ == kBargeInArmed && barge_in_frames_.size() >= max_frames) {
+            auto frame = std::move(barge_in_frames_.front());
+            barge_in_frames_.pop_front();
+            frame.assign(data.begin(), data.end());
+            barge_in_frames_.push_back(std::move(frame));
+        } else {
+            // Once triggered everything is kept until the commit
+            barge_in_frames_.push_back(data);
+        }
+    }
+
+    if (speech_ms >= 0) {
+        ESP_LOGI(TAG, "Barge-in after %d ms of speech", speech_ms);
+        if (callbacks_.on_barge_in) {
+            callbacks_.on_barge_in(speech_ms);
+        }
+    }
+    return true;
+}
+#endif
+
+bool AudioService::RunLoopbackTest(LoopbackResult& result) {
+#if CONFIG_USE_LOOPBACK_TEST
+    result = LoopbackResult();
+    if (service_stopped_ || loopback_test_ != nullptr) {
+        return false;
+    }
+    auto test = std::make_unique<LoopbackTest>(codec_->output_sample_rate(), input_format_.reference);
+    xEventGroupClearBits(event_group_, AS_EVENT_LOOPBACK_CAPTURED | AS_EVENT_LOOPBACK_PLAYED);
+    loopback_test_ = test.get();
+    SetInputEvents(AS_EVENT_LOOPBACK_CAPTURE);
+    audio_playback_queue_.NotifyConsumer();
+
+    auto bits = xEventGroupWaitBits(event_group_, AS_EVENT_LOOPBACK_CAPTURED | AS_EVENT_LOOPBACK_PLAYED,
+        pdFALSE, pdTRUE, pdMS_TO_TICKS(5000));
+    if ((bits & (AS_EVENT_LOOPBACK_CAPTURED | AS_EVENT_LOOPBACK_PLAYED)) != (AS_EVENT_LOOPBACK_CAPTURED | AS_EVENT_LOOPBACK_PLAYED)) {
+        // A task may still hold the test, it is left allocated rather than freed under it
+        ESP_LOGE(TAG, "Loopback test timed out");
+        xEventGroupClearBits(event_group_, AS_EVENT_LOOPBACK_CAPTURE);
+        test.release();
+        loopback_test_ = nullptr;
+        return false;
+    }
+    loopback_test_ = nullptr;
+
+    result = test->Analyze();
+    if (!result.valid) {
+        return false;
+    }
+    loopback_calibration_ = result.calibration;
+    aec_capture_offset_us_ = result.calibration.loop_us;
+    Settings settings("audio", true);
+    settings.SetStruct("loopback", result.calibration, LOOPBACK_CALIBRATION_VERSION);
+    return true;
+#else
+    return false;
+#endif
+}
+
+#if CONFIG_USE_LOOPBACK_TEST
+// Output task: the whole stimulus in one go, the playback queue waits meanwhile
+void AudioService::PlayLoopback(LoopbackTest* test) {
+    PowerUpOutput();
+    std::vector<int16_t> pcm;
+    bool chirp_start = false;
+    while (test->NextOutput(pcm, chirp_start)) {
+        int64_t write_us = esp_timer_get_time();
+#if CONFIG_USE_SERVER_AEC
+        uint32_t position = codec_->output_position();
+#endif
+        codec_->OutputData(pcm);
+        if (chirp_start) {
+#if CONFIG_USE_SERVER_AEC
+            int64_t play_us = codec_->GetPlayoutTime(position);
+#else
+            // The lead silence filled the DMA ring, the chunk just written is the last one in it
+            auto& dma = codec_->dma_profile();
+            int64_t queued = (int64_t)dma.desc_num * dma.frame_num - (int64_t)pcm.size();
+            int64_t play_us = esp_timer_get_time() + std::max<int64_t>(queued, 0) * 1000000 / codec_->output_sample_rate();
+#endif
+            test->OnChirpWritten(write_us, play_us);
+        }
+    }
+    last_output_time_ = std::chrono::steady_clock::now();
+    xEventGroupSetBits(event_group_, AS_EVENT_LOOPBACK_PLAYED);
+}
+#endif
+
 void AudioService::EnableAudioTesting(bool enable) {
     ESP_LOGI(TAG, "%s audio testing", enable ? "Enabling" : "Disabling");
     if (enable) {
-        xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
+        audio_testing_playback_ = false;
+        audio_testing_queue_.Clear();
+        SetInputEvents(AS_EVENT_AUDIO_TESTING_RUNNING);
     } else {
         xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
-        /* Copy audio_testing_queue_ to audio_decode_queue_ */
-        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-        audio_decode_queue_ = std::move(audio_testing_queue_);
-        audio_queue_cv_.notify_all();
+        /* Let the codec task play back audio_testing_queue_ */
+        audio_testing_playback_ = true;
+        audio_decode_queue_.NotifyConsumer();
     }
 }
 
 void AudioService::EnableDeviceAec(bool enable) {
     ESP_LOGI(TAG, "%s device AEC", enable ? "Enabling" : "Disabling");
-    if (!audio_processor_initialized_) {
-        audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
-        audio_processor_initialized_ = true;
+    std::lock_guard<std::mutex> lock(models_mutex_);
+    device_aec_set_ = true;
+    device_aec_enabled_ = enable;
+    InitializeAudioProcessor();
+    audio_processor_->EnableDeviceAec(enable);
+}
+
+void AudioService::SetDmaMode(AudioDmaMode mode) {
+#if CONFIG_USE_AUDIO_DMA_PROFILES
+    AudioDmaProfile profile;
+    switch (mode) {
+        case kAudioDmaModeIdle:
+            profile = AUDIO_CODEC_DMA_PROFILE_IDLE;
+            break;
+        case kAudioDmaModeLowLatency:
+            profile = AUDIO_CODEC_DMA_PROFILE_LOW_LATENCY;
+            break;
+        default:
+            profile = AUDIO_CODEC_DMA_PROFILE_DEFAULT;
+            break;
+    }
+    if (!codec_->SetDmaProfile(profile)) {
+        ESP_LOGD(TAG, "The codec keeps its DMA profile");
     }
+#endif
+}
 
-    audio_processor_->EnableDeviceAec(enable);
+void AudioService::SetTransportProfile(const TransportProfile& profile) {
+    jitter_buffer_.SetLink(profile.name);
+    jitter_buffer_.SetMinDepth(std::max<size_t>(profile.jitter_min_frames, JITTER_BUFFER_MIN_FRAMES));
+    congestion_rtt_ms_ = profile.congestion_rtt_ms;
 }
 
 void AudioService::SetCallbacks(AudioServiceCallbacks& callbacks) {
     callbacks_ = callbacks;
 }
 
-void AudioService::PlaySound(const std::string_view& ogg) {
-    if (!codec_->output_enabled()) {
-        esp_timer_stop(audio_power_timer_);
-        esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
-        codec_->EnableOutput(true);
-    }
-
-    const uint8_t* buf = reinterpret_cast<const uint8_t*>(ogg.data());
-    size_t size = ogg.size();
-    size_t offset = 0;
-
-    auto find_page = [&](size_t start)->size_t {
-        for (size_t i = start; i + 4 <= size; ++i) {
-            if (buf[i] == 'O' && buf[i+1] == 'g' && buf[i+2] == 'g' && buf[i+3] == 'S') return i;
-        }
-        return static_cast<size_t>(-1);
-    };
-
-    bool seen_head = false;
-    bool seen_tags = false;
-    int sample_rate = 16000; // 默认值
-
-    while (true) {
-        size_t pos = find_page(offset);
-        if (pos == static_cast<size_t>(-1)) break;
-        offset = pos;
-        if (offset + 27 > size) break;
-
-        const uint8_t* page = buf + offset;
-        uint8_t page_segments = page[26];
-        size_t seg_table_off = offset + 27;
-        if (seg_table_off + page_segments > size) break;
-
-        size_t body_size = 0;
-        for (size_t i = 0; i < page_segments; ++i) body_size += page[27 + i];
-
-        size_t body_off = seg_table_off + page_segments;
-        if (body_off + body_size > size) break;
-
-        // Parse packets using lacing
-        size_t cur = body_off;
-        size_t seg_idx = 0;
-        while (seg_idx < page_segments) {
-            size_t pkt_len = 0;
-            size_t pkt_start = cur;
-            bool continued = false;
-            do {
-                uint8_t l = page[27 + seg_idx++];
-                pkt_len += l;
-                cur += l;
-                continued = (l == 255);
-            } while (continued && seg_idx < page_segments);
-
-            if (pkt_len == 0) continue;
-            const uint8_t* pkt_ptr = buf + pkt_start;
-
-            if (!seen_head) {
-                // 解析OpusHead包
-                if (pkt_len >= 19 && std::memcmp(pkt_ptr, "OpusHead", 8) == 0) {
-                    seen_head = true;
-                    
-                    // OpusHead结构：[0-7] "OpusHead", [8] version, [9] channel_count, [10-11] pre_skip
-                    // [12-15] input_sample_rate, [16-17] output_gain, [18] mapping_family
-                    if (pkt_len >= 12) {
-                        uint8_t version = pkt_ptr[8];
-                        uint8_t channel_count = pkt_ptr[9];
-                        
-                        if (pkt_len >= 16) {
-                            // 读取输入采样率 (little-endian)
-                            sample_rate = pkt_ptr[12] | (pkt_ptr[13] << 8) | 
-                                        (pkt_ptr[14] << 16) | (pkt_ptr[15] << 24);
-                            ESP_LOGI(TAG, "OpusHead: version=%d, channels=%d, sample_rate=%d", 
-                                   version, channel_count, sample_rate);
-                        }
-                    }
-                }
-                continue;
-            }
-            if (!seen_tags) {
-                // Expect OpusTags in second packet
-                if (pkt_len >= 8 && std::memcmp(pkt_ptr, "OpusTags", 8) == 0) {
-                    seen_tags = true;
-                }
-                continue;
-            }
+void AudioService::PlaySound(const std::string_view& ogg, int priority, float gain) {
+    PowerUpOutput();
 
-            // Audio packet (Opus)
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->sample_rate = sample_rate;
-            packet->frame_duration = 60;
-            packet->payload.resize(pkt_len);
-            std::memcpy(packet->payload.data(), pkt_ptr, pkt_len);
-            PushPacketToDecodeQueue(std::move(packet), true);
-        }
+    /* Demuxed and decoded by the decode task as it plays, the caller does not wait for room in the queue */
+    audio_mixer_.Play(ogg, priority, gain);
+    audio_decode_queue_.NotifyConsumer();
+}
 
-        offset = body_off + body_size;
-    }
+void AudioService::FlushPlayback() {
+    playback_generation_++;
+    jitter_buffer_.Reset();
+    audio_decode_queue_.Clear();
+    audio_playback_queue_.Clear();
+    timestamp_queue_.Clear();
+    // The decode task may wait for room, the output task for a frame, both pick the flush up
+    audio_playback_queue_.NotifyProducer();
+    audio_playback_queue_.NotifyConsumer();
+    audio_decode_queue_.NotifyConsumer();
 }
 
 bool AudioService::IsIdle() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    return audio_encode_queue_.empty() && audio_decode_queue_.empty() && audio_playback_queue_.empty() && audio_testing_queue_.empty();
+    return audio_encode_queue_.empty() && audio_decode_queue_.empty() && jitter_buffer_.empty() && audio_playback_queue_.empty() && audio_testing_queue_.empty() && !audio_mixer_.active();
 }
 
 void AudioService::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
     opus_decoder_->ResetState();
-    timestamp_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    audio_testing_playback_ = false;
+    timestamp_queue_.Clear();
+    aec_reference_valid_ = false;
+    audio_decode_queue_.Clear();
+
+    auto stats = jitter_buffer_.GetStats();
+    if (stats.received > 0) {
+        ESP_LOGI(TAG, "Jitter buffer: received %lu, late %lu, lost %lu, underruns %lu (%lu at startup), jitter %d ms, target depth %u",
+            stats.received, stats.late, stats.lost, stats.underruns, stats.startup_underruns, stats.jitter_ms, stats.target_depth);
+        ESP_LOGI(TAG, "Playout: first audio after %d ms, %lu ms rebuffering, next start at %u frames",
+            stats.first_audio_ms, stats.rebuffer_ms, stats.start_depth);
+    }
+    jitter_buffer_.Reset();
+    audio_playback_queue_.Clear();
+    audio_testing_queue_.Clear();
 }
 
+#if CONFIG_USE_SERVER_AEC
+uint32_t AudioService::GetAecReferenceTimestamp(int64_t capture_us) {
+    int64_t end_us;
+    while (true) {
+        if (!aec_reference_valid_) {
+            if (!timestamp_queue_.Pop(aec_reference_)) {
+                return 0;
+            }
+            aec_reference_valid_ = true;
+        }
+        end_us = codec_->GetPlayoutTime(aec_reference_.end_position);
+        if (end_us > capture_us) {
+            break;
+        }
+        /* Played completely before the capture, the next uplink frames are later still */
+        aec_reference_valid_ = false;
+    }
+
+    int64_t start_us = end_us - static_cast<int64_t>(aec_reference_.samples) * 1000000 / codec_->output_sample_rate();
+    if (capture_us < start_us) {
+        /* Nothing from the server was playing yet */
+        return 0;
+    }
+    /* The timestamp is in ms, add how far into the frame the capture started */
+    return aec_reference_.timestamp + static_cast<uint32_t>((capture_us - start_us) / 1000);
+}
+#endif
+
 void AudioService::CheckAndUpdateAudioPowerState() {
     auto now = std::chrono::steady_clock::now();
     auto input_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_input_time_).count();
     auto output_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_output_time_).count();
-    if (input_elapsed > AUDIO_POWER_TIMEOUT_MS && codec_->input_enabled()) {
-        codec_->EnableInput(false);
+    if (codec_->input_enabled()) {
+        if (input_elapsed > AUDIO_POWER_TIMEOUT_MS) {
+            codec_->EnableInput(false);
+        } else if (input_elapsed > AUDIO_STANDBY_TIMEOUT_MS) {
+            codec_->SetInputStandby(true);
+        }
     }
-    if (output_elapsed > AUDIO_POWER_TIMEOUT_MS && codec_->output_enabled()) {
-        codec_->EnableOutput(false);
+    if (codec_->output_enabled()) {
+        if (output_elapsed > AUDIO_POWER_TIMEOUT_MS) {
+            codec_->EnableOutput(false);
+        } else if (output_elapsed > AUDIO_STANDBY_TIMEOUT_MS) {
+            codec_->SetOutputStandby(true);
+        }
     }
     if (!codec_->input_enabled() && !codec_->output_enabled()) {
         esp_timer_stop(audio_power_timer_);
     }
 }
 
+void AudioService::PowerUpInput() {
+    if (codec_->input_standby()) {
+        /* Only unmutes the ADC, no need to reopen the device */
+        codec_->SetInputStandby(false);
+    } else if (!codec_->input_enabled()) {
+        esp_timer_stop(audio_power_timer_);
+        esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+        codec_->EnableInput(true);
+    }
+}
+
+void AudioService::PowerUpOutput() {
+    if (codec_->output_standby()) {
+        codec_->SetOutputStandby(false);
+    } else if (!codec_->output_enabled()) {
+        esp_timer_stop(audio_power_timer_);
+        esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+        codec_->EnableOutput(true);
+    }
+}
+
+void AudioService::WarmupAudioInput() {
+    /*
+     * A codec that was just opened needs its ADC to settle, so read for the whole warm-up time.
+     * A running codec only has stale samples queued in the DMA buffers: a read that returns
+     * without blocking is stale, once a read has to wait for the DMA the next ones are fresh.
+     */
+    bool cold = !codec_->input_enabled();
+    int chunk_samples = 16000 * AUDIO_INPUT_WARMUP_CHUNK_MS / 1000;
+    int64_t start_us = esp_timer_get_time();
+    while (esp_timer_get_time() - start_us < AUDIO_INPUT_WARMUP_MAX_MS * 1000) {
+        int64_t read_start_us = esp_timer_get_time();
+        if (!ReadAudioData(input_warmup_buffer_, 16000, chunk_samples)) {
+            break;
+        }
+        if (!cold && esp_timer_get_time() - read_start_us >= AUDIO_INPUT_WARMUP_CHUNK_MS * 1000 / 2) {
+            break;
+        }
+    }
+    ESP_LOGD(TAG, "Input warm-up took %d ms", (int)((esp_timer_get_time() - start_us) / 1000));
+}
+
+bool AudioService::SetFrameDuration(int frame_duration_ms) {
+    if (frame_duration_ms != 20 && frame_duration_ms != 40 && frame_duration_ms != 60) {
+        ESP_LOGW(TAG, "Unsupported frame duration %d ms, keep %d ms", frame_duration_ms, frame_duration_ms_.load());
+        return false;
+    }
+    if (frame_duration_ms == frame_duration_ms_) {
+        return true;
+    }
+
+    ESP_LOGI(TAG, "Set frame duration to %d ms", frame_duration_ms);
+    frame_duration_ms_ = frame_duration_ms;
+    audio_decode_queue_.SetLimit(AUDIO_QUEUE_DURATION_MS / frame_duration_ms);
+    audio_send_queue_.SetLimit(AUDIO_QUEUE_DURATION_MS / frame_duration_ms);
+    audio_testing_queue_.SetLimit(AUDIO_TESTING_MAX_DURATION_MS / frame_duration_ms);
+    if (audio_processor_initialized_) {
+        audio_processor_->SetFrameDuration(frame_duration_ms);
+    }
+    return true;
+}
+
+void AudioService::SetSilenceSuppression(SilenceSuppression mode) {
+    if (silence_suppression_.exchange(mode) != mode) {
+        ESP_LOGI(TAG, "Set silence suppression to %d", mode);
+        silence_reset_ = true;
+    }
+}
+
 void AudioService::SetModelsList(srmodel_list_t* models_list) {
+    std::lock_guard<std::mutex> lock(models_mutex_);
     models_list_ = models_list;
+    wake_word_initialized_ = false;
+    CreateWakeWord();
+}
 
+// Picks the wake word for models_list_, called with models_mutex_ held. The instance only
+// loads its models in Initialize()
+void AudioService::CreateWakeWord() {
 #if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
     if (esp_srmodel_filter(models_list_, ESP_MN_PREFIX, NULL) != nullptr) {
         wake_word_ = std::make_unique<CustomWakeWord>();
     } else if (esp_srmodel_filter(models_list_, ESP_WN_PREFIX, NULL) != nullptr) {
+#if CONFIG_USE_SHARED_AFE
+        wake_word_ = std::make_unique<SharedAfeWakeWord>(*static_cast<SharedAfe*>(audio_processor_.get()));
+#else
         wake_word_ = std::make_unique<AfeWakeWord>();
+#endif
     } else {
         wake_word_ = nullptr;
     }
+#if CONFIG_USE_SHARED_AFE
+    static_cast<SharedAfe*>(audio_processor_.get())->SetWakeWordEnabled(
+        dynamic_cast<SharedAfeWakeWord*>(wake_word_.get()) != nullptr);
+#endif
 #else
     if (esp_srmodel_filter(models_list_, ESP_WN_PREFIX, NULL) != nullptr) {
         wake_word_ = std::make_unique<EspWakeWord>();
@@ -670,16 +1723,114 @@ void AudioService::SetModelsList(srmodel_list_t* models_list) {
 
     if (wake_word_) {
         wake_word_->OnWakeWordDetected([this](const std::string& wake_word) {
+            RecordWakeWordDetection(wake_word_->GetLastDetection());
             if (callbacks_.on_wake_word_detected) {
                 callbacks_.on_wake_word_detected(wake_word);
             }
         });
+
+        wake_word_->OnWakeWordCandidate([this]() {
+            if (callbacks_.on_wake_word_candidate) {
+                callbacks_.on_wake_word_candidate();
+            }
+        });
+
+#if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
+        if (auto custom_wake_word = dynamic_cast<CustomWakeWord*>(wake_word_.get())) {
+            custom_wake_word->OnLocalCommand([this](const std::string& text, const std::string& tool, const std::string& arguments) {
+                if (callbacks_.on_local_command) {
+                    callbacks_.on_local_command(text, tool, arguments);
+                }
+            });
+        }
+#endif
     }
 }
 
+void AudioService::RecordWakeWordDetection(const WakeWordDetection& detection) {
+    ESP_LOGI(TAG, "Wake word %s detected, confidence %.2f, %d ms after the speech onset",
+        detection.wake_word.c_str(), detection.confidence, detection.onset_ms);
+
+    std::lock_guard<std::mutex> lock(wake_word_stats_mutex_);
+    auto& stats = wake_word_stats_;
+    stats.detections++;
+    if (detection.confidence >= 0) {
+        stats.confidence_min = stats.confidence_count == 0 ? detection.confidence : std::min(stats.confidence_min, detection.confidence);
+        stats.confidence_count++;
+        stats.confidence_sum += detection.confidence;
+    }
+    if (detection.onset_ms >= 0) {
+        stats.onset_count++;
+        stats.onset_sum_ms += detection.onset_ms;
+        stats.onset_max_ms = std::max(stats.onset_max_ms, detection.onset_ms);
+    }
+    stats.last = detection;
+}
+
+WakeWordStats AudioService::GetWakeWordStats() {
+    std::lock_guard<std::mutex> lock(wake_word_stats_mutex_);
+    WakeWordStats stats = wake_word_stats_;
+#if CONFIG_USE_WAKE_WORD_GATE
+    stats.gate_opened = wake_word_gate_.opened();
+    stats.gate_chunks = wake_word_gate_.chunks();
+    stats.gate_fed_chunks = wake_word_gate_.fed_chunks();
+#endif
+    return stats;
+}
+
+#if CONFIG_USE_WAKE_WORD_GATE
+// Input task, with models_mutex_ held
+void AudioService::FeedWakeWordGated(std::vector<int16_t>& data) {
+    int feeds = wake_word_gate_.Process(data, input_format_.channels);
+    bool open = wake_word_gate_.is_open();
+    if (wake_word_gate_lock_ != nullptr && open != wake_word_gate_locked_) {
+        open ? esp_pm_lock_acquire(wake_word_gate_lock_) : esp_pm_lock_release(wake_word_gate_lock_);
+        wake_word_gate_locked_ = open;
+    }
+    for (int i = 0; i < feeds; i++) {
+        wake_word_gate_.Pop(data);
+        wake_word_->Feed(data);
+    }
+}
+
+// Called with models_mutex_ held
+void AudioService::CloseWakeWordGate() {
+    wake_word_gate_.Reset();
+    if (wake_word_gate_locked_) {
+        esp_pm_lock_release(wake_word_gate_lock_);
+        wake_word_gate_locked_ = false;
+    }
+}
+#endif
+
+bool AudioService::AddWakeWordCommand(const std::string& command, const std::string& text, const std::string& action,
+        const std::string& arguments) {
+#if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
+    std::lock_guard<std::mutex> lock(models_mutex_);
+    auto custom_wake_word = dynamic_cast<CustomWakeWord*>(wake_word_.get());
+    return custom_wake_word != nullptr && custom_wake_word->AddCommand(command, text, action, arguments);
+#else
+    return false;
+#endif
+}
+
+bool AudioService::RemoveWakeWordCommand(const std::string& command) {
+#if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
+    std::lock_guard<std::mutex> lock(models_mutex_);
+    auto custom_wake_word = dynamic_cast<CustomWakeWord*>(wake_word_.get());
+    return custom_wake_word != nullptr && custom_wake_word->RemoveCommand(command);
+#else
+    return false;
+#endif
+}
+
 bool AudioService::IsAfeWakeWord() {
 #if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
+#if CONFIG_USE_SHARED_AFE
+    return wake_word_ != nullptr && dynamic_cast<SharedAfeWakeWord*>(wake_word_.get()) != nullptr;
+#else
     return wake_word_ != nullptr && dynamic_cast<AfeWakeWord*>(wake_word_.get()) != nullptr;
+#endif
 #else
     return false;
 #endif
@@ -2,64 +2,148 @@
 #define AUDIO_SERVICE_H
 
 #include <memory>
-#include <deque>
-#include <condition_variable>
+#include <atomic>
 #include <chrono>
 #include <mutex>
+#include <deque>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
 #include <esp_timer.h>
+#include <esp_pm.h>
 #include <model_path.h>
 
 #include <opus_encoder.h>
 #include <opus_decoder.h>
-#include <opus_resampler.h>
 
 #include "audio_codec.h"
 #include "audio_processor.h"
+#include "spsc_queue.h"
+#include "frame_pool.h"
+#include "jitter_buffer.h"
+#include "latency_tracer.h"
+#include "encoder_controller.h"
+#include "decoder_cache.h"
+#include "audio_resampler.h"
+#include "audio_mixer.h"
+#include "audio_level.h"
+#include "endpointer.h"
+#include "barge_in_detector.h"
+#include "wake_word_gate.h"
+#include "loopback_test.h"
+#include "ogg_opus_reader.h"
 #include "processors/audio_debugger.h"
 #include "wake_word.h"
 #include "protocol.h"
+#include "transport_profile.h"
+#include "memory_budget.h"
+#include "heap_accounting.h"
 
 
 /*
  * There are two types of audio data flow:
  * 1. (MIC) -> [Processors] -> {Encode Queue} -> [Opus Encoder] -> {Send Queue} -> (Server)
- * 2. (Server) -> {Decode Queue} -> [Opus Decoder] -> {Playback Queue} -> (Speaker)
+ * 2. (Server) -> {Jitter Buffer} -> [Opus Decoder] -> {Playback Queue} -> (Speaker)
+ *    Local sounds skip the jitter buffer and go through the Decode Queue.
  *
- * We use one task for MIC / Speaker / Processors, and one task for Opus Encoder / Opus Decoder.
+ * We use one task for MIC / Speaker / Processors, and separate tasks for the Opus Encoder and the Opus Decoder.
  * 
  * Decode Queue and Send Queue are the main queues, because Opus packets are quite smaller than PCM packets.
- * 
+ *
+ * Every queue is a lock-free SPSC ring, and each consumer / producer task is woken by a task notification
+ * only when the queue it waits on changes. The decode and encode queues have several producers, a mutex
+ * on the producer side makes them one.
  */
 
-#define OPUS_FRAME_DURATION_MS 60
+// The frame duration proposed in the hello message, the server may negotiate another one at runtime
+#define OPUS_FRAME_DURATION_MS CONFIG_AUDIO_OPUS_FRAME_DURATION_MS
+#define OPUS_MIN_FRAME_DURATION_MS 20
+#define OPUS_MAX_FRAME_DURATION_MS 60
 #define MAX_ENCODE_TASKS_IN_QUEUE 2
 #define MAX_PLAYBACK_TASKS_IN_QUEUE 2
-#define MAX_DECODE_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
-#define MAX_SEND_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
+// Decode and send queues hold the same amount of audio whatever the frame duration is
+#define AUDIO_QUEUE_DURATION_MS MEMORY_BUDGET_AUDIO_QUEUE_MS
+#define MAX_DECODE_PACKETS_IN_QUEUE (AUDIO_QUEUE_DURATION_MS / OPUS_MIN_FRAME_DURATION_MS)
+#define MAX_SEND_PACKETS_IN_QUEUE (AUDIO_QUEUE_DURATION_MS / OPUS_MIN_FRAME_DURATION_MS)
+// The send queue ring is larger than its limit, the frames discarded by kAudioSendPolicyDropOldest
+// keep their slots until the send task pops them
+#define SEND_QUEUE_SLOTS (MAX_SEND_PACKETS_IN_QUEUE * 2)
+#define JITTER_BUFFER_MIN_FRAMES 1
+#define JITTER_BUFFER_MAX_FRAMES (MAX_DECODE_PACKETS_IN_QUEUE / 2)
 #define AUDIO_TESTING_MAX_DURATION_MS 10000
-#define MAX_TIMESTAMPS_IN_QUEUE 3
+// Audio kept from before the speech the barge-in detected, the onset is often under the threshold
+#define BARGE_IN_PREROLL_MS 300
+// Played downlink frames waiting to be paired with an uplink frame (20 ms frames played during a 60 ms capture, plus the DMA)
+#define MAX_TIMESTAMPS_IN_QUEUE 8
+// A gap between two codec reads longer than this many frames is a pause of the input
+#define AUDIO_INPUT_PAUSE_FRAMES 10
+// Frames that can be queued plus the ones being encoded, decoded, played and held by the silence suppression
+#define AUDIO_TASK_POOL_SIZE (MAX_ENCODE_TASKS_IN_QUEUE + MAX_PLAYBACK_TASKS_IN_QUEUE + 4)
+// Sized for the shortest frames, the server may negotiate them whatever the proposed duration is
+#define AUDIO_PACKET_POOL_SIZE (AUDIO_QUEUE_DURATION_MS / OPUS_MIN_FRAME_DURATION_MS + 2)
+// Payload capacity reserved per packet, a speech frame plus the transport header written in front of it
+#define AUDIO_PACKET_PAYLOAD_RESERVE (AUDIO_PACKET_HEADROOM + 512)
+
 
-#define AUDIO_POWER_TIMEOUT_MS 15000
+// Idle codecs first go to standby (muted, still clocked), and are only closed after a longer idle time
+#define AUDIO_STANDBY_TIMEOUT_MS 15000
+#define AUDIO_POWER_TIMEOUT_MS 60000
 #define AUDIO_POWER_CHECK_INTERVAL_MS 1000
+// The output is only retuned to a stream after this long without a write, longer than the deepest DMA ring
+#define AUDIO_OUTPUT_RETUNE_IDLE_MS 300
+// Upper bound of the input warm-up, stale DMA buffers are drained in chunks until the reads block
+#define AUDIO_INPUT_WARMUP_MAX_MS 120
+#define AUDIO_INPUT_WARMUP_CHUNK_MS 10
+// Silence suppression starts once the VAD has reported silence for this long, so word endings are kept
+#define SILENCE_HANGOVER_MS 400
+// Interval of the empty packets sent while silent frames are omitted
+#define SILENCE_KEEPALIVE_INTERVAL_MS 1000
 
 
 #define AS_EVENT_AUDIO_TESTING_RUNNING      (1 << 0)
 #define AS_EVENT_WAKE_WORD_RUNNING          (1 << 1)
 #define AS_EVENT_AUDIO_PROCESSOR_RUNNING    (1 << 2)
 #define AS_EVENT_PLAYBACK_NOT_EMPTY         (1 << 3)
+#define AS_EVENT_LOOPBACK_CAPTURE           (1 << 4)
+#define AS_EVENT_LOOPBACK_CAPTURED          (1 << 5)
+#define AS_EVENT_LOOPBACK_PLAYED            (1 << 6)
+#define AS_EVENT_SERVICE_RESUMED            (1 << 7)
+// The events the audio input waits for, one of them is set while something reads the microphone
+#define AUDIO_INPUT_EVENTS (AS_EVENT_AUDIO_TESTING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING | \
+    AS_EVENT_AUDIO_PROCESSOR_RUNNING | AS_EVENT_LOOPBACK_CAPTURE)
+// The single task mode retries a read or a write the DMA cannot take yet after this, unless a DMA
+// buffer wakes it first
+#define AUDIO_TASK_POLL_MS (OPUS_MIN_FRAME_DURATION_MS / 2)
 
 struct AudioServiceCallbacks {
     std::function<void(void)> on_send_queue_available;
     std::function<void(const std::string&)> on_wake_word_detected;
+    std::function<void(void)> on_wake_word_candidate;
+    // A local command of the wake word model, to run as a call of the MCP tool on the device
+    std::function<void(const std::string& text, const std::string& tool, const std::string& arguments)> on_local_command;
     std::function<void(bool)> on_vad_change;
+    // The local endpointer saw the end of the utterance, called from the audio processor task
+    std::function<void(float confidence)> on_endpoint;
+    // The user talks over the TTS, called from the audio processor task with the ms of speech heard
+    std::function<void(int speech_ms)> on_barge_in;
     std::function<void(void)> on_audio_testing_queue_full;
 };
 
 
+enum AudioDmaMode {
+    kAudioDmaModeDefault,
+    kAudioDmaModeIdle,          // Wake word only, deep buffers
+    kAudioDmaModeLowLatency,    // Realtime conversation, shallow buffers
+};
+
+// What the encoder does with a new uplink frame when the send queue is full
+enum AudioSendPolicy {
+    kAudioSendPolicyBlock,          // Wait up to CONFIG_AUDIO_SEND_BLOCK_TIMEOUT_MS, then drop the new frames
+    kAudioSendPolicyDropNewest,     // Drop the new frame
+    kAudioSendPolicyDropOldest,     // Drop the oldest queued frame, the server gets the freshest audio
+};
+
 enum AudioTaskType {
     kAudioTaskTypeEncodeToSendQueue,
     kAudioTaskTypeEncodeToTestingQueue,
@@ -70,6 +154,20 @@ struct AudioTask {
     AudioTaskType type;
     std::vector<int16_t> pcm;
     uint32_t timestamp;
+    // Set on suppressed uplink frames, encoded with DTX, or sent as an empty packet when pcm is empty
+    bool silent = false;
+    // Latency tracing timestamps, see latency_tracer.h
+    int64_t trace_origin_us = 0;
+    int64_t trace_stage_us = 0;
+    // Playback generation the frame was decoded in, FlushPlayback() drops the older ones
+    uint32_t generation = 0;
+};
+
+// A downlink frame handed to the codec, for server AEC
+struct PlayoutTimestamp {
+    uint32_t timestamp;
+    uint32_t end_position; // codec output position after the last sample
+    uint32_t samples;
 };
 
 struct DebugStatistics {
@@ -79,6 +177,43 @@ struct DebugStatistics {
     uint32_t playback_count = 0;
 };
 
+struct SendQueueDrops {
+    uint32_t newest = 0;
+    uint32_t oldest = 0;
+};
+
+// The detections since the service started, for the telemetry
+struct WakeWordStats {
+    uint32_t detections = 0;
+    // Over the detections that reported a confidence / followed a speech onset
+    uint32_t confidence_count = 0;
+    float confidence_sum = 0;
+    float confidence_min = 0;
+    uint32_t onset_count = 0;
+    int64_t onset_sum_ms = 0;
+    int onset_max_ms = 0;
+    WakeWordDetection last;
+    // The energy gate in front of the engine, see WakeWordGate
+    uint32_t gate_opened = 0;
+    uint32_t gate_chunks = 0;
+    uint32_t gate_fed_chunks = 0;
+};
+
+// The codec's input format, fixed once the codec is started. ReadAudioData branches on this copy
+// instead of asking the codec on every frame
+struct AudioInputFormat {
+    int sample_rate = 16000;
+    int channels = 1;
+    bool reference = false;
+};
+
+struct AudioQueueDepths {
+    size_t encode;
+    size_t send;
+    size_t decode;
+    size_t playback;
+};
+
 class AudioService {
 public:
     AudioService();
@@ -87,9 +222,21 @@ public:
     void Initialize(AudioCodec* codec);
     void Start();
     void Stop();
+    // Parks the tasks on an event bit and drops the queued audio, for the upgrade and the assets
+    // download. The tasks, the codecs and the buffers stay, so Resume() is immediate. The codec
+    // powers down by the idle timeout as usual. With release_memory the models and the buffers
+    // of the pooled frames are freed too, they are loaded and grow again on use
+    void Suspend(bool release_memory = false);
+    void Resume();
+    bool IsSuspended() const { return service_suspended_; }
     void EncodeWakeWord();
     std::unique_ptr<AudioStreamPacket> PopWakeWordPacket();
     const std::string& GetLastWakeWord() const;
+    WakeWordStats GetWakeWordStats();
+    // Local command phrases of the MultiNet wake word, false without one or for a phrase the model rejects
+    bool AddWakeWordCommand(const std::string& command, const std::string& text, const std::string& action,
+        const std::string& arguments = "{}");
+    bool RemoveWakeWordCommand(const std::string& command);
     bool IsVoiceDetected() const { return voice_detected_; }
     bool IsIdle();
     bool IsWakeWordRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_WAKE_WORD_RUNNING; }
@@ -97,31 +244,114 @@ public:
     bool IsAfeWakeWord();
 
     void EnableWakeWordDetection(bool enable);
+    // Loads the wake word model ahead of the first EnableWakeWordDetection(), which is then quick
+    void PrepareWakeWord();
+    // The same for the audio processor and the first EnableVoiceProcessing()
+    void PrepareVoiceProcessing();
+    // Stops the wake word and the audio processor and frees their models, for the modes that
+    // never listen (WiFi configuration, upgrade). The next Enable* or Prepare* loads them again
+    void ReleaseModels();
     void EnableVoiceProcessing(bool enable);
+    // The AFE profile of the auto and manual stop modes and of the realtime mode, kept across
+    // reboots. A change is applied when the voice processing is next started
+    void SetAfeProfiles(AfeProfile profile, AfeProfile realtime_profile);
+    AfeProfile GetAfeProfile(bool realtime) const { return afe_profiles_[realtime ? 1 : 0]; }
+    // Picks the profile of the listening mode about to start, before EnableVoiceProcessing(true)
+    void SelectAfeProfile(bool realtime);
+    // The highest profile SelectAfeProfile() picks, whatever the setting, for the performance profiles
+    void SetAfeProfileLimit(AfeProfile highest);
+    // The highest Opus complexity the encoder controller steps up to
+    void SetEncoderComplexityLimit(int limit) { encoder_controller_.SetComplexityLimit(limit); }
+    // The profile the audio processor runs, or last ran
+    AfeProfile GetActiveAfeProfile() const { return afe_profile_active_; }
+    AudioProcessorCost GetAfeProfileCost(AfeProfile profile) { return audio_processor_->GetCost(profile); }
     void EnableAudioTesting(bool enable);
     void EnableDeviceAec(bool enable);
+    void SetDmaMode(AudioDmaMode mode);
+    // Link round-trip time from the protocol, -1 if unknown, the encoder controller backs off when it grows
+    void SetLinkRtt(int rtt_ms) { link_rtt_ms_ = rtt_ms; }
+    // Jitter buffer start depth and congestion RTT of the network the audio channel runs on
+    void SetTransportProfile(const TransportProfile& profile);
+    void SetSendPolicy(AudioSendPolicy policy) { send_policy_ = policy; }
+    // Uplink frames dropped since the service started because the send queue was full
+    SendQueueDrops GetSendQueueDrops() const { return {send_dropped_newest_, send_dropped_oldest_}; }
+    // The times the playback ran dry while the decoder still had frames to decode, the decoder
+    // is short of CPU then and the display lowers its frame rate
+    uint32_t GetPlaybackStarved() const { return playback_starved_.load(std::memory_order_relaxed); }
 
     void SetCallbacks(AudioServiceCallbacks& callbacks);
 
     bool PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait = false);
+    bool PushPacketToJitterBuffer(std::unique_ptr<AudioStreamPacket> packet);
+    JitterBufferStats GetJitterBufferStats() { return jitter_buffer_.GetStats(); }
+    LatencyTracer& GetLatencyTracer() { return latency_tracer_; }
+    const DebugStatistics& GetDebugStatistics() const { return debug_statistics_; }
+    AudioQueueDepths GetQueueDepths() const {
+        return {audio_encode_queue_.size(), audio_send_queue_.size(), audio_decode_queue_.size(), audio_playback_queue_.size()};
+    }
     std::unique_ptr<AudioStreamPacket> PopPacketFromSendQueue();
-    void PlaySound(const std::string_view& sound);
+    // A packet from the pool, the fields are left from its previous use
+    std::unique_ptr<AudioStreamPacket> AcquirePacket() { return packet_pool_.Acquire(); }
+    // Returns a sent packet to the pool, so its payload buffer is reused
+    void ReleasePacket(std::unique_ptr<AudioStreamPacket>&& packet) { packet_pool_.Release(std::move(packet)); }
+    // Higher priority sounds interrupt the current one, gain is 0-1
+    void PlaySound(const std::string_view& sound, int priority = 0, float gain = 1.0f);
     bool ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples);
     void ResetDecoder();
+    // Barge-in: drop the queued and in-flight downlink audio and silence the DMA ring right away
+    void FlushPlayback();
+    // Look for the end of the utterance while the voice processing runs, for the auto stop mode
+    void EnableEndpointing(bool enable) { endpointing_ = enable; }
+    // While speaking in a turn based mode, run the voice processing with the device AEC to detect
+    // the user talking over the TTS, nothing is sent. Disabling it stops the processor again,
+    // unless the barge-in was committed. Returns false without a device AEC.
+    bool EnableBargeIn(bool enable);
+    // Plays a chirp and measures when it comes back on the microphone and the reference channel,
+    // blocking for about a second. A valid result is stored and calibrates the server AEC
+    // timestamps. The two audio tasks are taken over meanwhile, a conversation pauses with it.
+    bool RunLoopbackTest(LoopbackResult& result);
+    // The stored calibration, zeros until a test succeeded
+    LoopbackCalibration GetLoopbackCalibration() const { return loopback_calibration_; }
+    // After the listen start is sent: the held speech goes to the send queue ahead of the live
+    // audio, and the processor goes on as the voice processing of the new turn
+    void CommitBargeIn();
+    // Apply a negotiated uplink frame duration (20, 40 or 60 ms) to the processor, encoder and queues
+    bool SetFrameDuration(int frame_duration_ms);
+    int frame_duration() const { return frame_duration_ms_; }
+    // Applies to the frames the VAD reports silent, from the next processed frame on
+    void SetSilenceSuppression(SilenceSuppression mode);
     void SetModelsList(srmodel_list_t* models_list);
+    // The RMS / peak of the last played frame and of the last processed microphone frame. They are
+    // only measured while some effect holds the meters enabled, each Enable(true) needs its Enable(false)
+    void EnableLevelMeters(bool enable) { output_level_.Enable(enable); input_level_.Enable(enable); }
+    AudioLevel GetOutputLevel() const { return output_level_.Get(); }
+    AudioLevel GetInputLevel() const { return input_level_.Get(); }
 
 private:
     AudioCodec* codec_ = nullptr;
+    AudioInputFormat input_format_;
+    std::atomic<uint32_t> playback_generation_ = 0;
     AudioServiceCallbacks callbacks_;
     std::unique_ptr<AudioProcessor> audio_processor_;
     std::unique_ptr<WakeWord> wake_word_;
     std::unique_ptr<AudioDebugger> audio_debugger_;
     std::unique_ptr<OpusEncoderWrapper> opus_encoder_;
-    std::unique_ptr<OpusDecoderWrapper> opus_decoder_;
-    OpusResampler input_resampler_;
-    OpusResampler reference_resampler_;
-    OpusResampler output_resampler_;
+    // The active decoder and output resampler, owned by decoder_cache_
+    DecoderCache decoder_cache_;
+    AudioMixer audio_mixer_;
+    OpusDecoderWrapper* opus_decoder_ = nullptr;
+    AudioResampler* output_resampler_ = nullptr;
+#if CONFIG_AUDIO_OUTPUT_FOLLOW_STREAM_RATE
+    // The rate the codec was created with, the output is retuned at most up to it
+    int native_output_sample_rate_ = 0;
+    bool output_rate_fixed_ = false;
+#endif
+    AudioResampler input_resampler_;
+    AudioResampler reference_resampler_;
     DebugStatistics debug_statistics_;
+    LatencyTracer latency_tracer_;
+    AudioLevelMeter output_level_;
+    AudioLevelMeter input_level_;
     srmodel_list_t* models_list_ = nullptr;
 
     EventGroupHandle_t event_group_;
@@ -129,22 +359,116 @@ private:
     // Audio encode / decode
     TaskHandle_t audio_input_task_handle_ = nullptr;
     TaskHandle_t audio_output_task_handle_ = nullptr;
-    TaskHandle_t opus_codec_task_handle_ = nullptr;
-    std::mutex audio_queue_mutex_;
-    std::condition_variable audio_queue_cv_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_send_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_testing_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_encode_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_playback_queue_;
-    // For server AEC
-    std::deque<uint32_t> timestamp_queue_;
+    TaskHandle_t opus_encode_task_handle_ = nullptr;
+    TaskHandle_t opus_decode_task_handle_ = nullptr;
+    TaskHandle_t audio_pipeline_task_handle_ = nullptr;
+    // The playback generation the output last flushed and the decoder last reset for
+    uint32_t output_flushed_generation_ = 0;
+    uint32_t decoded_generation_ = 0;
+    // The frame the single task mode popped before the TX DMA had room for it
+    std::unique_ptr<AudioTask> output_pending_;
+    // The decode queue has several producers (protocol, PlaySound), they are serialized by this mutex
+    std::mutex decode_push_mutex_;
+    SpscQueue<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_;
+    JitterBuffer jitter_buffer_;
+    SpscQueue<std::unique_ptr<AudioStreamPacket>> audio_send_queue_;
+    SpscQueue<std::unique_ptr<AudioStreamPacket>> audio_testing_queue_;
+    // The encode queue has several producers too (the processor output, the testing input and
+    // CommitBargeIn), PushTaskToEncodeQueue() serializes them by this mutex
+    std::mutex encode_push_mutex_;
+    SpscQueue<std::unique_ptr<AudioTask>> audio_encode_queue_;
+    SpscQueue<std::unique_ptr<AudioTask>> audio_playback_queue_;
+    // For server AEC, the output task produces and the input task pairs them with the capture
+    SpscQueue<PlayoutTimestamp> timestamp_queue_;
+    PlayoutTimestamp aec_reference_ = {};
+    bool aec_reference_valid_ = false;
+    // The measured loop latency, the uplink capture times are moved back by it
+    std::atomic<int32_t> aec_capture_offset_us_ = 0;
+    LoopbackCalibration loopback_calibration_ = {};
+    // Set while a loopback test runs, the output and input tasks then play and capture for it
+    std::atomic<LoopbackTest*> loopback_test_ = nullptr;
+    void PlayLoopback(LoopbackTest* test);
+    // Set when audio testing stops, the codec task then plays back the testing queue
+    std::atomic<bool> audio_testing_playback_ = false;
+    // Recycled frames, so the steady-state pipeline does not allocate
+    FramePool<AudioTask> task_pool_;
+    FramePool<AudioStreamPacket> packet_pool_;
+    std::vector<int16_t> resample_buffer_;
+    // Input scratch buffers, only used by ReadAudioData when the codec rate differs from 16 kHz
+    std::vector<int16_t> input_buffer_;
+    // Touched by every resampled input frame, kept in internal RAM
+    std::vector<int16_t, InternalAllocator<int16_t, kHeapTagAudio>> input_channel_buffer_;
+    std::vector<int16_t, InternalAllocator<int16_t, kHeapTagAudio>> input_resample_buffer_;
+    std::vector<int16_t> input_warmup_buffer_;
 
+    // Guards the lifetime of the wake word and audio processor models against the input task
+    std::mutex models_mutex_;
     bool wake_word_initialized_ = false;
+    // Written by the detection context of the wake word, read by the MCP tool
+    std::mutex wake_word_stats_mutex_;
+    WakeWordStats wake_word_stats_;
     bool audio_processor_initialized_ = false;
+    AfeProfile afe_profiles_[2] = {AFE_PROFILE_DEFAULT, AFE_PROFILE_REALTIME};
+    AfeProfile afe_profile_limit_ = kAfeProfileHighQuality;
+    AfeProfile afe_profile_active_ = AFE_PROFILE_DEFAULT;
+    // The last EnableDeviceAec(), applied again when the processor is initialized after a release
+    bool device_aec_set_ = false;
+    bool device_aec_enabled_ = false;
     bool voice_detected_ = false;
-    bool service_stopped_ = true;
+    std::atomic<bool> endpointing_ = false;
+#if CONFIG_USE_BARGE_IN
+    enum BargeInState {
+        kBargeInOff,
+        kBargeInArmed,
+        kBargeInTriggered,
+    };
+    // The processor task holds the frames under it until the application commits
+    std::mutex barge_in_mutex_;
+    BargeInState barge_in_state_ = kBargeInOff;
+    std::deque<std::vector<int16_t>> barge_in_frames_;
+    BargeInDetector barge_in_detector_{CONFIG_BARGE_IN_MIN_SPEECH_MS, CONFIG_BARGE_IN_ENERGY_GATE_RMS, CONFIG_BARGE_IN_ECHO_MARGIN};
+    bool HoldForBargeIn(std::vector<int16_t>& data);
+#endif
+#if CONFIG_USE_WAKE_WORD_GATE
+    // Input task only, with models_mutex_ held
+    WakeWordGate wake_word_gate_{CONFIG_WAKE_WORD_GATE_PREROLL_MS, CONFIG_WAKE_WORD_GATE_HANGOVER_MS,
+        CONFIG_WAKE_WORD_GATE_OPEN_MARGIN, CONFIG_WAKE_WORD_GATE_MIN_RMS};
+    // The engine runs at the full CPU frequency while the gate is open
+    esp_pm_lock_handle_t wake_word_gate_lock_ = nullptr;
+    bool wake_word_gate_locked_ = false;
+    void FeedWakeWordGated(std::vector<int16_t>& data);
+    void CloseWakeWordGate();
+#endif
+#if CONFIG_USE_LOCAL_ENDPOINTING
+    Endpointer endpointer_{CONFIG_ENDPOINT_HANGOVER_MS, CONFIG_ENDPOINT_MIN_SPEECH_MS, CONFIG_ENDPOINT_ENERGY_GATE_RMS};
+#endif
+    std::atomic<bool> service_stopped_ = true;
+    std::atomic<bool> service_suspended_ = false;
+    // The pooled frames lost their buffers in Suspend(true)
+    bool frames_trimmed_ = false;
+    std::atomic<int> frame_duration_ms_ = OPUS_FRAME_DURATION_MS;
+    // Only touched by the encoder task after Initialize
+    int encoder_frame_duration_ms_ = OPUS_FRAME_DURATION_MS;
+    EncoderController encoder_controller_;
+    std::atomic<int> link_rtt_ms_ = -1;
+    std::atomic<int> congestion_rtt_ms_ = TRANSPORT_DEFAULT_CONGESTION_RTT_MS;
+    std::atomic<AudioSendPolicy> send_policy_ = kAudioSendPolicyBlock;
+    std::atomic<uint32_t> send_dropped_newest_ = 0;
+    std::atomic<uint32_t> send_dropped_oldest_ = 0;
+    std::atomic<uint32_t> playback_starved_ = 0;
+    // Only touched by the encoder task, 0 while the send queue has room
+    int64_t send_blocked_since_us_ = 0;
+    bool encoder_dtx_ = false;
+    // Silence suppression, the state is only touched by the processor output callback
+    std::atomic<SilenceSuppression> silence_suppression_ = kSilenceSuppressionOff;
+    std::atomic<bool> silence_reset_ = true;
+    int silence_hangover_ms_ = 0;
+    int silence_keepalive_ms_ = 0;
+    // The last omitted frame, sent before the speech onset so the first syllable is not clipped
+    std::unique_ptr<AudioTask> silence_held_task_;
     bool audio_input_need_warmup_ = false;
+    // When the last codec read returned, the next read checks how long the caller took
+    int64_t input_read_end_us_ = 0;
 
     esp_timer_handle_t audio_power_timer_ = nullptr;
     std::chrono::steady_clock::time_point last_input_time_;
@@ -152,10 +476,48 @@ private:
 
     void AudioInputTask();
     void AudioOutputTask();
-    void OpusCodecTask();
+    // The decoder has frames to decode, the playback waits for it rather than for the network
+    bool IsDecoderBehind();
+    void OpusEncodeTask();
+    void OpusDecodeTask();
+    /*
+     * One turn of each task loop. The steps return 0 after a frame, otherwise how long to wait
+     * for the queues. InputStep() is false when no consumer took the frame, the input stops then.
+     * With not_ready / wait_for_dma (the single task mode) a read or a write the DMA cannot take
+     * yet is left for the next turn instead of blocking.
+     */
+    bool InputStep(EventBits_t bits, TickType_t* not_ready);
+    bool IsInputReady(int sample_rate, int samples, TickType_t* not_ready);
+    TickType_t OutputStep(bool wait_for_dma);
+    TickType_t DecodeStep();
+    TickType_t EncodeStep();
+#if CONFIG_AUDIO_SINGLE_TASK
+    // Runs all the steps in one task, on the single core chips
+    void AudioPipelineTask();
+#endif
+    // Sets input events, and wakes the pipeline task of the single task mode
+    void SetInputEvents(EventBits_t bits);
+    // How long the encoder should wait for the send queue to drain, 0 when it may go on
+    TickType_t GetSendQueueWait();
+    void PushToSendQueue(std::unique_ptr<AudioStreamPacket>&& packet);
     void PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm);
+    void PushEncodeTask(std::unique_ptr<AudioTask>&& task);
+    bool SuppressSilence(std::unique_ptr<AudioTask>& task);
     void SetDecodeSampleRate(int sample_rate, int frame_duration);
+#if CONFIG_AUDIO_OUTPUT_FOLLOW_STREAM_RATE
+    // Retunes the codec output to the stream between two streams, true if the rate changed
+    bool RetuneOutput(int sample_rate);
+#endif
     void CheckAndUpdateAudioPowerState();
+    uint32_t GetAecReferenceTimestamp(int64_t capture_us);
+    void PowerUpInput();
+    // Blocks the calling task while the service is suspended, true if it was
+    bool WaitWhileSuspended();
+    void PowerUpOutput();
+    void WarmupAudioInput();
+    void CreateWakeWord();
+    void RecordWakeWordDetection(const WakeWordDetection& detection);
+    void InitializeAudioProcessor();
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,47 @@
+#include "barge_in_detector.h"
+#include "pcm_utils.h"
+
+#include <algorithm>
+#include <cmath>
+
+void BargeInDetector::Reset() {
+    speech_ms_ = 0;
+    gap_ms_ = 0;
+    fired_ = false;
+    echo_rms_ = -1;
+}
+
+int BargeInDetector::Feed(const int16_t* data, size_t samples) {
+    if (fired_ || samples == 0) {
+        return -1;
+    }
+    uint64_t sum_squares;
+    int32_t peak;
+    PcmMeasure(data, samples, &sum_squares, &peak);
+    float rms = sqrtf((float)(sum_squares / samples));
+    // The processed audio is always 16 kHz mono
+    int frame_ms = samples / 16;
+
+    if (echo_rms_ < 0) {
+        echo_rms_ = rms;
+    }
+    float threshold = std::max((float)energy_gate_rms_, echo_rms_ * echo_margin_);
+    if (rms < threshold) {
+        echo_rms_ += (rms - echo_rms_) / 16;
+        gap_ms_ += frame_ms;
+        if (gap_ms_ > frame_ms) {
+            speech_ms_ = 0;
+        }
+        return -1;
+    }
+
+    // Slowly, so a louder passage of the TTS leaking through does not stay above the floor
+    echo_rms_ += (rms - echo_rms_) / 64;
+    gap_ms_ = 0;
+    speech_ms_ += frame_ms;
+    if (speech_ms_ < min_speech_ms_) {
+        return -1;
+    }
+    fired_ = true;
+    return speech_ms_;
+}
@@ -0,0 +1,38 @@
+#ifndef BARGE_IN_DETECTOR_H
+#define BARGE_IN_DETECTOR_H
+
+#include <sdkconfig.h>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Detects the user talking over the TTS, on the echo cancelled output of the AFE.
+ *
+ * The AFE VAD is off while the device AEC runs, so the decision is on the energy: a frame counts
+ * as speech when its RMS is above the energy gate and above echo_margin times the residual echo
+ * floor, learnt from the frames under the threshold. The barge-in needs min_speech_ms of speech,
+ * a dip of up to one frame in between is tolerated.
+ *
+ * Only called by the audio processor output task, Reset() before the task is started.
+ */
+class BargeInDetector {
+public:
+    BargeInDetector(int min_speech_ms, int energy_gate_rms, int echo_margin)
+        : min_speech_ms_(min_speech_ms), energy_gate_rms_(energy_gate_rms), echo_margin_(echo_margin) {}
+
+    void Reset();
+    // Returns the ms of speech heard when this frame completes the detection, -1 otherwise
+    int Feed(const int16_t* data, size_t samples);
+
+private:
+    const int min_speech_ms_;
+    const int energy_gate_rms_;
+    const int echo_margin_;
+
+    int speech_ms_ = 0;
+    int gap_ms_ = 0;
+    bool fired_ = false;
+    float echo_rms_ = -1;
+};
+
+#endif // BARGE_IN_DETECTOR_H
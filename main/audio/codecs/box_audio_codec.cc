@@ -11,10 +11,12 @@ BoxAudioCodec::BoxAudioCodec(void* i2c_master_handle, int input_sample_rate, int
     gpio_num_t pa_pin, uint8_t es8311_addr, uint8_t es7210_addr, bool input_reference) {
     duplex_ = true; // 是否双工
     input_reference_ = input_reference; // 是否使用参考输入，实现回声消除
+    volume_control_ = kVolumeHardware; // 硬件音量粗调，数字增益细调
     input_channels_ = input_reference_ ? 2 : 1; // 输入通道数
     input_sample_rate_ = input_sample_rate;
     output_sample_rate_ = output_sample_rate;
     input_gain_ = 30;
+    pa_pin_ = pa_pin;
 
     CreateDuplexChannels(mclk, bclk, ws, dout, din);
 
@@ -180,8 +182,12 @@ void BoxAudioCodec::CreateDuplexChannels(gpio_num_t mclk, gpio_num_t bclk, gpio_
 }
 
 void BoxAudioCodec::SetOutputVolume(int volume) {
-    ESP_ERROR_CHECK(esp_codec_dev_set_out_vol(output_dev_, volume));
+    int previous = hardware_volume();
     AudioCodec::SetOutputVolume(volume);
+    // The fine steps only move the digital gain, the I2C write is for a coarse one
+    if (hardware_volume() != previous) {
+        ESP_ERROR_CHECK(esp_codec_dev_set_out_vol(output_dev_, hardware_volume()));
+    }
 }
 
 void BoxAudioCodec::EnableInput(bool enable) {
@@ -189,6 +195,10 @@ void BoxAudioCodec::EnableInput(bool enable) {
     if (enable == input_enabled_) {
         return;
     }
+    if (!enable && input_standby_) {
+        // Unmute before closing, so the next open starts from a clean state
+        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_set_in_mute(input_dev_, false));
+    }
     if (enable) {
         esp_codec_dev_sample_info_t fs = {
             .bits_per_sample = 16,
@@ -213,6 +223,10 @@ void BoxAudioCodec::EnableOutput(bool enable) {
     if (enable == output_enabled_) {
         return;
     }
+    if (!enable && output_standby_) {
+        // Unmute before closing, so the next open starts from a clean state
+        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_set_out_mute(output_dev_, false));
+    }
     if (enable) {
         // Play 16bit 1 channel
         esp_codec_dev_sample_info_t fs = {
@@ -223,13 +237,35 @@ void BoxAudioCodec::EnableOutput(bool enable) {
             .mclk_multiple = 0,
         };
         ESP_ERROR_CHECK(esp_codec_dev_open(output_dev_, &fs));
-        ESP_ERROR_CHECK(esp_codec_dev_set_out_vol(output_dev_, output_volume_));
+        ESP_ERROR_CHECK(esp_codec_dev_set_out_vol(output_dev_, hardware_volume()));
     } else {
         ESP_ERROR_CHECK(esp_codec_dev_close(output_dev_));
     }
     AudioCodec::EnableOutput(enable);
 }
 
+void BoxAudioCodec::SetInputStandby(bool standby) {
+    std::lock_guard<std::mutex> lock(data_if_mutex_);
+    if (!input_enabled_ || standby == input_standby_) {
+        return;
+    }
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_set_in_mute(input_dev_, standby));
+    AudioCodec::SetInputStandby(standby);
+}
+
+void BoxAudioCodec::SetOutputStandby(bool standby) {
+    std::lock_guard<std::mutex> lock(data_if_mutex_);
+    if (!output_enabled_ || standby == output_standby_) {
+        return;
+    }
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_set_out_mute(output_dev_, standby));
+    if (pa_pin_ != GPIO_NUM_NC) {
+        // The ES8311 driver only switches the PA on open and close
+        gpio_if_->set(pa_pin_, !standby);
+    }
+    AudioCodec::SetOutputStandby(standby);
+}
+
 int BoxAudioCodec::Read(int16_t* dest, int samples) {
     if (input_enabled_) {
         ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_read(input_dev_, (void*)dest, samples * sizeof(int16_t)));
@@ -16,6 +16,7 @@ private:
     const audio_codec_ctrl_if_t* in_ctrl_if_ = nullptr;
     const audio_codec_if_t* in_codec_if_ = nullptr;
     const audio_codec_gpio_if_t* gpio_if_ = nullptr;
+    gpio_num_t pa_pin_ = GPIO_NUM_NC;
 
     esp_codec_dev_handle_t output_dev_ = nullptr;
     esp_codec_dev_handle_t input_dev_ = nullptr;
@@ -35,6 +36,8 @@ public:
     virtual void SetOutputVolume(int volume) override;
     virtual void EnableInput(bool enable) override;
     virtual void EnableOutput(bool enable) override;
+    virtual void SetInputStandby(bool standby) override;
+    virtual void SetOutputStandby(bool standby) override;
 };
 
 #endif // _BOX_AUDIO_CODEC_H
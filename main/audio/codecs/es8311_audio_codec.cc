@@ -9,6 +9,7 @@ Es8311AudioCodec::Es8311AudioCodec(void* i2c_master_handle, i2c_port_t i2c_port,
     gpio_num_t pa_pin, uint8_t es8311_addr, bool use_mclk, bool pa_inverted) {
     duplex_ = true; // 是否双工
     input_reference_ = false; // 是否使用参考输入，实现回声消除
+    volume_control_ = kVolumeHardware; // 硬件音量粗调，数字增益细调
     input_channels_ = 1; // 输入通道数
     input_sample_rate_ = input_sample_rate;
     output_sample_rate_ = output_sample_rate;
@@ -86,7 +87,7 @@ void Es8311AudioCodec::UpdateDeviceState() {
         };
         ESP_ERROR_CHECK(esp_codec_dev_open(dev_, &fs));
         ESP_ERROR_CHECK(esp_codec_dev_set_in_gain(dev_, input_gain_));
-        ESP_ERROR_CHECK(esp_codec_dev_set_out_vol(dev_, output_volume_));
+        ESP_ERROR_CHECK(esp_codec_dev_set_out_vol(dev_, hardware_volume()));
     } else if (!input_enabled_ && !output_enabled_ && dev_ != nullptr) {
         esp_codec_dev_close(dev_);
         dev_ = nullptr;
@@ -154,8 +155,12 @@ void Es8311AudioCodec::CreateDuplexChannels(gpio_num_t mclk, gpio_num_t bclk, gp
 }
 
 void Es8311AudioCodec::SetOutputVolume(int volume) {
-    ESP_ERROR_CHECK(esp_codec_dev_set_out_vol(dev_, volume));
+    int previous = hardware_volume();
     AudioCodec::SetOutputVolume(volume);
+    // The fine steps only move the digital gain, the I2C write is for a coarse one
+    if (hardware_volume() != previous) {
+        ESP_ERROR_CHECK(esp_codec_dev_set_out_vol(dev_, hardware_volume()));
+    }
 }
 
 void Es8311AudioCodec::EnableInput(bool enable) {
@@ -166,6 +171,10 @@ void Es8311AudioCodec::EnableInput(bool enable) {
     if (enable == input_enabled_) {
         return;
     }
+    if (!enable && input_standby_) {
+        // Unmute before closing, so the next open starts from a clean state
+        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_set_in_mute(dev_, false));
+    }
     AudioCodec::EnableInput(enable);
     UpdateDeviceState();
 }
@@ -178,10 +187,36 @@ void Es8311AudioCodec::EnableOutput(bool enable) {
     if (enable == output_enabled_) {
         return;
     }
+    if (!enable && output_standby_) {
+        // Unmute before closing, so the next open starts from a clean state
+        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_set_out_mute(dev_, false));
+    }
     AudioCodec::EnableOutput(enable);
     UpdateDeviceState();
 }
 
+void Es8311AudioCodec::SetInputStandby(bool standby) {
+    std::lock_guard<std::mutex> lock(data_if_mutex_);
+    if (!input_enabled_ || standby == input_standby_) {
+        return;
+    }
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_set_in_mute(dev_, standby));
+    AudioCodec::SetInputStandby(standby);
+}
+
+void Es8311AudioCodec::SetOutputStandby(bool standby) {
+    std::lock_guard<std::mutex> lock(data_if_mutex_);
+    if (!output_enabled_ || standby == output_standby_) {
+        return;
+    }
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_set_out_mute(dev_, standby));
+    if (pa_pin_ != GPIO_NUM_NC) {
+        int level = standby ? 0 : 1;
+        gpio_set_level(pa_pin_, pa_inverted_ ? !level : level);
+    }
+    AudioCodec::SetOutputStandby(standby);
+}
+
 int Es8311AudioCodec::Read(int16_t* dest, int samples) {
     if (input_enabled_) {
         ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_read(dev_, (void*)dest, samples * sizeof(int16_t)));
@@ -9,6 +9,7 @@ Es8374AudioCodec::Es8374AudioCodec(void* i2c_master_handle, i2c_port_t i2c_port,
     gpio_num_t pa_pin, uint8_t es8374_addr, bool use_mclk) {
     duplex_ = true; // 是否双工
     input_reference_ = false; // 是否使用参考输入，实现回声消除
+    volume_control_ = kVolumeHardware; // 硬件音量粗调，数字增益细调
     input_channels_ = 1; // 输入通道数
     input_sample_rate_ = input_sample_rate;
     output_sample_rate_ = output_sample_rate;
@@ -130,8 +131,12 @@ void Es8374AudioCodec::CreateDuplexChannels(gpio_num_t mclk, gpio_num_t bclk, gp
 }
 
 void Es8374AudioCodec::SetOutputVolume(int volume) {
-    ESP_ERROR_CHECK(esp_codec_dev_set_out_vol(output_dev_, volume));
+    int previous = hardware_volume();
     AudioCodec::SetOutputVolume(volume);
+    // The fine steps only move the digital gain, the I2C write is for a coarse one
+    if (hardware_volume() != previous) {
+        ESP_ERROR_CHECK(esp_codec_dev_set_out_vol(output_dev_, hardware_volume()));
+    }
 }
 
 void Es8374AudioCodec::EnableInput(bool enable) {
@@ -139,6 +144,10 @@ void Es8374AudioCodec::EnableInput(bool enable) {
     if (enable == input_enabled_) {
         return;
     }
+    if (!enable && input_standby_) {
+        // Unmute before closing, so the next open starts from a clean state
+        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_set_in_mute(input_dev_, false));
+    }
     if (enable) {
         esp_codec_dev_sample_info_t fs = {
             .bits_per_sample = 16,
@@ -160,6 +169,10 @@ void Es8374AudioCodec::EnableOutput(bool enable) {
     if (enable == output_enabled_) {
         return;
     }
+    if (!enable && output_standby_) {
+        // Unmute before closing, so the next open starts from a clean state
+        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_set_out_mute(output_dev_, false));
+    }
     if (enable) {
         // Play 16bit 1 channel
         esp_codec_dev_sample_info_t fs = {
@@ -170,7 +183,7 @@ void Es8374AudioCodec::EnableOutput(bool enable) {
             .mclk_multiple = 0,
         };
         ESP_ERROR_CHECK(esp_codec_dev_open(output_dev_, &fs));
-        ESP_ERROR_CHECK(esp_codec_dev_set_out_vol(output_dev_, output_volume_));
+        ESP_ERROR_CHECK(esp_codec_dev_set_out_vol(output_dev_, hardware_volume()));
         if (pa_pin_ != GPIO_NUM_NC) {
             gpio_set_level(pa_pin_, 1);
         }
@@ -183,6 +196,27 @@ void Es8374AudioCodec::EnableOutput(bool enable) {
     AudioCodec::EnableOutput(enable);
 }
 
+void Es8374AudioCodec::SetInputStandby(bool standby) {
+    std::lock_guard<std::mutex> lock(data_if_mutex_);
+    if (!input_enabled_ || standby == input_standby_) {
+        return;
+    }
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_set_in_mute(input_dev_, standby));
+    AudioCodec::SetInputStandby(standby);
+}
+
+void Es8374AudioCodec::SetOutputStandby(bool standby) {
+    std::lock_guard<std::mutex> lock(data_if_mutex_);
+    if (!output_enabled_ || standby == output_standby_) {
+        return;
+    }
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_set_out_mute(output_dev_, standby));
+    if (pa_pin_ != GPIO_NUM_NC) {
+        gpio_set_level(pa_pin_, standby ? 0 : 1);
+    }
+    AudioCodec::SetOutputStandby(standby);
+}
+
 int Es8374AudioCodec::Read(int16_t* dest, int samples) {
     if (input_enabled_) {
         ESP_ERROR_CHECK_WITHOUT_ABORT(esp_codec_dev_read(input_dev_, (void*)dest, samples * sizeof(int16_t)));
@@ -36,6 +36,8 @@ public:
     virtual void SetOutputVolume(int volume) override;
     virtual void EnableInput(bool enable) override;
     virtual void EnableOutput(bool enable) override;
+    virtual void SetInputStandby(bool standby) override;
+    virtual void SetOutputStandby(bool standby) override;
 };
 
 #endif // _ES8374_AUDIO_CODEC_H
\ No newline at end of file
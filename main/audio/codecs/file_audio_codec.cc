@@ -0,0 +1,98 @@
+#include "file_audio_codec.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/task.h>
+#include <cstring>
+
+#define TAG "FileAudioCodec"
+
+FileAudioCodec::FileAudioCodec(const std::string& input_path, const std::string& output_path,
+    int input_sample_rate, int output_sample_rate, bool paced) : paced_(paced) {
+    duplex_ = true;
+    input_reference_ = false;
+    input_channels_ = 1;
+    input_sample_rate_ = input_sample_rate;
+    output_sample_rate_ = output_sample_rate;
+
+    input_file_ = fopen(input_path.c_str(), "rb");
+    if (input_file_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to open %s, the input is silence", input_path.c_str());
+    } else {
+        // Skip the WAV header, the chunks up to "data"
+        char id[4];
+        uint32_t size;
+        if (fread(id, 1, 4, input_file_) == 4 && memcmp(id, "RIFF", 4) == 0) {
+            fseek(input_file_, 12, SEEK_SET);
+            while (fread(id, 1, 4, input_file_) == 4 && fread(&size, 4, 1, input_file_) == 1) {
+                if (memcmp(id, "data", 4) == 0) {
+                    input_data_offset_ = ftell(input_file_);
+                    break;
+                }
+                fseek(input_file_, size + (size & 1), SEEK_CUR);
+            }
+        }
+        fseek(input_file_, input_data_offset_, SEEK_SET);
+    }
+
+    if (!output_path.empty()) {
+        output_file_ = fopen(output_path.c_str(), "wb");
+        if (output_file_ == nullptr) {
+            ESP_LOGE(TAG, "Failed to open %s, the output is dropped", output_path.c_str());
+        }
+    }
+    ESP_LOGI(TAG, "Input %s at %d Hz, output %s at %d Hz%s", input_path.c_str(), input_sample_rate,
+        output_path.empty() ? "(none)" : output_path.c_str(), output_sample_rate, paced ? ", paced" : "");
+}
+
+FileAudioCodec::~FileAudioCodec() {
+    if (input_file_ != nullptr) {
+        fclose(input_file_);
+    }
+    if (output_file_ != nullptr) {
+        fclose(output_file_);
+    }
+}
+
+void FileAudioCodec::Pace(int64_t& start_us, uint64_t& samples, int count, int sample_rate) {
+    if (!paced_) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    if (start_us == 0) {
+        start_us = now;
+    }
+    samples += count;
+    int64_t due_us = start_us + static_cast<int64_t>(samples * 1000000 / sample_rate);
+    if (due_us - now >= 1000) {
+        vTaskDelay(pdMS_TO_TICKS((due_us - now) / 1000));
+    }
+}
+
+int FileAudioCodec::Read(int16_t* dest, int samples) {
+    int read = 0;
+    if (input_file_ != nullptr) {
+        while (read < samples) {
+            size_t n = fread(dest + read, sizeof(int16_t), samples - read, input_file_);
+            read += n;
+            if (read < samples) {
+                if (n == 0 && ftell(input_file_) <= input_data_offset_) {
+                    // Nothing to play at all
+                    break;
+                }
+                fseek(input_file_, input_data_offset_, SEEK_SET);
+            }
+        }
+    }
+    memset(dest + read, 0, (samples - read) * sizeof(int16_t));
+    Pace(input_start_us_, input_samples_, samples, input_sample_rate_);
+    return samples;
+}
+
+int FileAudioCodec::Write(const int16_t* data, int samples) {
+    if (output_file_ != nullptr) {
+        fwrite(data, sizeof(int16_t), samples, output_file_);
+    }
+    Pace(output_start_us_, output_samples_, samples, output_sample_rate_);
+    return samples;
+}
@@ -0,0 +1,42 @@
+#ifndef _FILE_AUDIO_CODEC_H
+#define _FILE_AUDIO_CODEC_H
+
+#include "audio_codec.h"
+
+#include <cstdio>
+#include <string>
+
+/*
+ * Audio codec backed by files, for running the audio pipeline without an I2S codec.
+ *
+ * The input is 16-bit mono PCM, raw or in a WAV file (the header is skipped), and starts over
+ * at the end. The output is appended as raw 16-bit PCM, an empty path drops it. With pacing the
+ * reads and writes block for as long as the samples last, so the audio tasks see the timing of
+ * a real codec; without it they run as fast as the CPU allows.
+ *
+ * The paths go through the VFS: the SD card or SPIFFS on the device, the host file system on
+ * the linux target.
+ */
+class FileAudioCodec : public AudioCodec {
+public:
+    FileAudioCodec(const std::string& input_path, const std::string& output_path,
+        int input_sample_rate, int output_sample_rate, bool paced = true);
+    virtual ~FileAudioCodec();
+
+private:
+    FILE* input_file_ = nullptr;
+    FILE* output_file_ = nullptr;
+    long input_data_offset_ = 0;
+    bool paced_;
+    int64_t input_start_us_ = 0;
+    uint64_t input_samples_ = 0;
+    int64_t output_start_us_ = 0;
+    uint64_t output_samples_ = 0;
+
+    void Pace(int64_t& start_us, uint64_t& samples, int count, int sample_rate);
+
+    virtual int Read(int16_t* dest, int samples) override;
+    virtual int Write(const int16_t* data, int samples) override;
+};
+
+#endif // _FILE_AUDIO_CODEC_H
@@ -4,6 +4,8 @@
 #include <cmath>
 #include <cstring>
 
+#include "pcm_utils.h"
+
 #define TAG "NoAudioCodec"
 
 NoAudioCodec::~NoAudioCodec() {
@@ -71,6 +73,11 @@ NoAudioCodecDuplex::NoAudioCodecDuplex(int input_sample_rate, int output_sample_
     };
     ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle_, &std_cfg));
     ESP_ERROR_CHECK(i2s_channel_init_std_mode(rx_handle_, &std_cfg));
+    tx_chan_cfg_ = chan_cfg;
+    rx_chan_cfg_ = chan_cfg;
+    tx_std_cfg_ = std_cfg;
+    rx_std_cfg_ = std_cfg;
+    dma_reconfigurable_ = true;
     ESP_LOGI(TAG, "Duplex channels created");
 }
 
@@ -131,6 +138,8 @@ NoAudioCodecSimplex::NoAudioCodecSimplex(int input_sample_rate, int output_sampl
         }
     };
     ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle_, &std_cfg));
+    tx_chan_cfg_ = chan_cfg;
+    tx_std_cfg_ = std_cfg;
 
     // Create a new channel for MIC
     chan_cfg.id = (i2s_port_t)1;
@@ -141,6 +150,9 @@ NoAudioCodecSimplex::NoAudioCodecSimplex(int input_sample_rate, int output_sampl
     std_cfg.gpio_cfg.dout = I2S_GPIO_UNUSED;
     std_cfg.gpio_cfg.din = mic_din;
     ESP_ERROR_CHECK(i2s_channel_init_std_mode(rx_handle_, &std_cfg));
+    rx_chan_cfg_ = chan_cfg;
+    rx_std_cfg_ = std_cfg;
+    dma_reconfigurable_ = true;
     ESP_LOGI(TAG, "Simplex channels created");
 }
 
@@ -200,6 +212,8 @@ NoAudioCodecSimplex::NoAudioCodecSimplex(int input_sample_rate, int output_sampl
         }
     };
     ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle_, &std_cfg));
+    tx_chan_cfg_ = chan_cfg;
+    tx_std_cfg_ = std_cfg;
 
     // Create a new channel for MIC
     chan_cfg.id = (i2s_port_t)1;
@@ -211,47 +225,138 @@ NoAudioCodecSimplex::NoAudioCodecSimplex(int input_sample_rate, int output_sampl
     std_cfg.gpio_cfg.dout = I2S_GPIO_UNUSED;
     std_cfg.gpio_cfg.din = mic_din;
     ESP_ERROR_CHECK(i2s_channel_init_std_mode(rx_handle_, &std_cfg));
+    rx_chan_cfg_ = chan_cfg;
+    rx_std_cfg_ = std_cfg;
+    dma_reconfigurable_ = true;
     ESP_LOGI(TAG, "Simplex channels created");
 }
 
+void NoAudioCodec::Start() {
+    AudioCodec::Start();
+    started_ = true;
+}
+
+bool NoAudioCodec::SetDmaProfile(const AudioDmaProfile& profile) {
+    if (!dma_reconfigurable_) {
+        return false;
+    }
+    if (profile.desc_num == dma_profile_.desc_num && profile.frame_num == dma_profile_.frame_num) {
+        return true;
+    }
+
+    // Wait for the pending transfers, the tasks block on the mutexes until the channels are back
+    std::lock_guard<std::mutex> tx_lock(data_if_mutex_);
+    std::lock_guard<std::mutex> rx_lock(rx_mutex_);
+    if (started_) {
+        ESP_ERROR_CHECK(i2s_channel_disable(tx_handle_));
+        ESP_ERROR_CHECK(i2s_channel_disable(rx_handle_));
+    }
+    ESP_ERROR_CHECK(i2s_del_channel(tx_handle_));
+    ESP_ERROR_CHECK(i2s_del_channel(rx_handle_));
+    tx_handle_ = nullptr;
+    rx_handle_ = nullptr;
+
+    tx_chan_cfg_.dma_desc_num = rx_chan_cfg_.dma_desc_num = profile.desc_num;
+    tx_chan_cfg_.dma_frame_num = rx_chan_cfg_.dma_frame_num = profile.frame_num;
+    if (duplex_) {
+        ESP_ERROR_CHECK(i2s_new_channel(&tx_chan_cfg_, &tx_handle_, &rx_handle_));
+    } else {
+        ESP_ERROR_CHECK(i2s_new_channel(&tx_chan_cfg_, &tx_handle_, nullptr));
+        ESP_ERROR_CHECK(i2s_new_channel(&rx_chan_cfg_, nullptr, &rx_handle_));
+    }
+    ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle_, &tx_std_cfg_));
+#if SOC_I2S_SUPPORTS_PDM_RX
+    if (rx_pdm_) {
+        ESP_ERROR_CHECK(i2s_channel_init_pdm_rx_mode(rx_handle_, &rx_pdm_cfg_));
+    } else
+#endif
+    {
+        ESP_ERROR_CHECK(i2s_channel_init_std_mode(rx_handle_, &rx_std_cfg_));
+    }
+
+    dma_profile_ = profile;
+    AttachTxChannel();
+    AttachRxChannel();
+    if (started_) {
+        ESP_ERROR_CHECK(i2s_channel_enable(tx_handle_));
+        ESP_ERROR_CHECK(i2s_channel_enable(rx_handle_));
+    }
+    ESP_LOGI(TAG, "DMA profile set to %d x %d frames", profile.desc_num, profile.frame_num);
+    return true;
+}
+
+bool NoAudioCodec::SetOutputSampleRate(int sample_rate) {
+    if (sample_rate == output_sample_rate_) {
+        return true;
+    }
+    if (duplex_ || !dma_reconfigurable_) {
+        return false;
+    }
+
+    // The sent buffers are cleared after the callback, an idle ring only holds silence
+    std::lock_guard<std::mutex> lock(data_if_mutex_);
+    i2s_std_clk_config_t clk_cfg = tx_std_cfg_.clk_cfg;
+    clk_cfg.sample_rate_hz = (uint32_t)sample_rate;
+    if (started_) {
+        ESP_ERROR_CHECK(i2s_channel_disable(tx_handle_));
+    }
+    esp_err_t err = i2s_channel_reconfig_std_clock(tx_handle_, &clk_cfg);
+    if (err == ESP_OK) {
+        tx_std_cfg_.clk_cfg = clk_cfg;
+        output_sample_rate_ = sample_rate;
+        ESP_LOGI(TAG, "Output sample rate set to %d Hz", sample_rate);
+    } else {
+        ESP_LOGW(TAG, "Failed to set the output sample rate to %d Hz: %s", sample_rate, esp_err_to_name(err));
+    }
+    if (started_) {
+        ESP_ERROR_CHECK(i2s_channel_enable(tx_handle_));
+    }
+    return err == ESP_OK;
+}
+
 int NoAudioCodec::Write(const int16_t* data, int samples) {
     std::lock_guard<std::mutex> lock(data_if_mutex_);
-    std::vector<int32_t> buffer(samples);
-
-    // output_volume_: 0-100
-    // volume_factor_: 0-65536
-    int32_t volume_factor = pow(double(output_volume_) / 100.0, 2) * 65536;
-    for (int i = 0; i < samples; i++) {
-        int64_t temp = int64_t(data[i]) * volume_factor; // 使用 int64_t 进行乘法运算
-        if (temp > INT32_MAX) {
-            buffer[i] = INT32_MAX;
-        } else if (temp < INT32_MIN) {
-            buffer[i] = INT32_MIN;
+    int written = 0;
+    while (written < samples) {
+        int chunk = std::min(samples - written, NO_AUDIO_CODEC_CHUNK_SAMPLES);
+        // The digital gain goes into the 32-bit slots, the quiet volumes keep the 16 bits of the samples
+        int32_t gain, step;
+        NextOutputGain(chunk, &gain, &step);
+        if (step == 0) {
+            PcmScaleToInt32(data + written, write_buffer_, gain, chunk);
         } else {
-            buffer[i] = static_cast<int32_t>(temp);
+            PcmScaleToInt32Ramp(data + written, write_buffer_, gain, step, chunk);
         }
-    }
 
-    size_t bytes_written;
-    ESP_ERROR_CHECK(i2s_channel_write(tx_handle_, buffer.data(), samples * sizeof(int32_t), &bytes_written, portMAX_DELAY));
-    return bytes_written / sizeof(int32_t);
+        size_t bytes_written;
+        ESP_ERROR_CHECK(i2s_channel_write(tx_handle_, write_buffer_, chunk * sizeof(int32_t), &bytes_written, portMAX_DELAY));
+        written += bytes_written / sizeof(int32_t);
+        if (bytes_written < chunk * sizeof(int32_t)) {
+            break;
+        }
+    }
+    return written;
 }
 
 int NoAudioCodec::Read(int16_t* dest, int samples) {
-    size_t bytes_read;
-
-    std::vector<int32_t> bit32_buffer(samples);
-    if (i2s_channel_read(rx_handle_, bit32_buffer.data(), samples * sizeof(int32_t), &bytes_read, portMAX_DELAY) != ESP_OK) {
-        ESP_LOGE(TAG, "Read Failed!");
-        return 0;
-    }
+    std::lock_guard<std::mutex> lock(rx_mutex_);
+    int read = 0;
+    while (read < samples) {
+        int chunk = std::min(samples - read, NO_AUDIO_CODEC_CHUNK_SAMPLES);
+        size_t bytes_read;
+        if (i2s_channel_read(rx_handle_, read_buffer_, chunk * sizeof(int32_t), &bytes_read, portMAX_DELAY) != ESP_OK) {
+            ESP_LOGE(TAG, "Read Failed!");
+            return 0;
+        }
 
-    samples = bytes_read / sizeof(int32_t);
-    for (int i = 0; i < samples; i++) {
-        int32_t value = bit32_buffer[i] >> 12;
-        dest[i] = (value > INT16_MAX) ? INT16_MAX : (value < -INT16_MAX) ? -INT16_MAX : (int16_t)value;
+        int chunk_read = bytes_read / sizeof(int32_t);
+        PcmInt32ToInt16(read_buffer_, dest + read, 12, chunk_read);
+        read += chunk_read;
+        if (chunk_read < chunk) {
+            break;
+        }
     }
-    return samples;
+    return read;
 }
 
 // Delegating constructor: calls the main constructor with default slot mask
@@ -314,6 +419,8 @@ NoAudioCodecSimplexPdm::NoAudioCodecSimplexPdm(int input_sample_rate, int output
         },
     };
     ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle_, &tx_std_cfg));
+    tx_chan_cfg_ = tx_chan_cfg;
+    tx_std_cfg_ = tx_std_cfg;
 #if SOC_I2S_SUPPORTS_PDM_RX
     // Create a new channel for MIC in PDM mode
     i2s_chan_config_t rx_chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG((i2s_port_t)0, I2S_ROLE_MASTER);
@@ -332,6 +439,10 @@ NoAudioCodecSimplexPdm::NoAudioCodecSimplexPdm(int input_sample_rate, int output
         },
     };
     ESP_ERROR_CHECK(i2s_channel_init_pdm_rx_mode(rx_handle_, &pdm_rx_cfg));
+    rx_chan_cfg_ = rx_chan_cfg;
+    rx_pdm_ = true;
+    rx_pdm_cfg_ = pdm_rx_cfg;
+    dma_reconfigurable_ = true;
 #else
     ESP_LOGE(TAG, "PDM is not supported");
 #endif
@@ -339,6 +450,7 @@ NoAudioCodecSimplexPdm::NoAudioCodecSimplexPdm(int input_sample_rate, int output
 }
 
 int NoAudioCodecSimplexPdm::Read(int16_t* dest, int samples) {
+    std::lock_guard<std::mutex> lock(rx_mutex_);
     size_t bytes_read;
 
     // PDM 解调后的数据位宽为 16 位，直接读取到目标缓冲区
@@ -349,11 +461,7 @@ int NoAudioCodecSimplexPdm::Read(int16_t* dest, int samples) {
 
     samples = bytes_read / sizeof(int16_t);
     if (input_gain_ > 0) {
-        int gain_factor = (int)input_gain_;
-        for (int i = 0; i < samples; i++) {
-            int32_t amplified = dest[i] * gain_factor;
-            dest[i] = (amplified > INT16_MAX) ? INT16_MAX : (amplified < -INT16_MAX) ? -INT16_MAX : (int16_t)amplified;
-        }
+        PcmApplyGain(dest, (int32_t)input_gain_, samples);
     }
     return samples;
 }
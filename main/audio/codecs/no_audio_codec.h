@@ -7,15 +7,40 @@
 #include <driver/i2s_pdm.h>
 #include <mutex>
 
+// Samples converted per I2S transfer, the conversion buffers are preallocated for this size
+#define NO_AUDIO_CODEC_CHUNK_SAMPLES (AUDIO_CODEC_DMA_FRAME_NUM * 2)
+
 class NoAudioCodec : public AudioCodec {
 protected:
+    // data_if_mutex_ guards the TX channel, rx_mutex_ the RX channel
     std::mutex data_if_mutex_;
+    std::mutex rx_mutex_;
+    bool started_ = false;
+
+    // Kept by the constructors, so SetDmaProfile() can recreate the channels
+    bool dma_reconfigurable_ = false;
+    i2s_chan_config_t tx_chan_cfg_ = {};
+    i2s_chan_config_t rx_chan_cfg_ = {};
+    i2s_std_config_t tx_std_cfg_ = {};
+    i2s_std_config_t rx_std_cfg_ = {};
+#if SOC_I2S_SUPPORTS_PDM_RX
+    bool rx_pdm_ = false;
+    i2s_pdm_rx_config_t rx_pdm_cfg_ = {};
+#endif
+
+    int32_t write_buffer_[NO_AUDIO_CODEC_CHUNK_SAMPLES];
+    int32_t read_buffer_[NO_AUDIO_CODEC_CHUNK_SAMPLES];
 
     virtual int Write(const int16_t* data, int samples) override;
     virtual int Read(int16_t* dest, int samples) override;
 
 public:
+    // No volume register on an I2S amplifier, Write() scales by the digital gain
+    NoAudioCodec() { volume_control_ = kVolumeDigital; }
     virtual ~NoAudioCodec();
+    virtual void Start() override;
+    virtual bool SetDmaProfile(const AudioDmaProfile& profile) override;
+    virtual bool SetOutputSampleRate(int sample_rate) override;
 };
 
 class NoAudioCodecDuplex : public NoAudioCodec {
@@ -0,0 +1,60 @@
+#include "decoder_cache.h"
+
+#include <esp_log.h>
+
+#define TAG "DecoderCache"
+
+void DecoderCache::Initialize(int output_sample_rate) {
+    output_sample_rate_ = output_sample_rate;
+}
+
+void DecoderCache::SetOutputSampleRate(int output_sample_rate) {
+    output_sample_rate_ = output_sample_rate;
+    for (auto& entry : entries_) {
+        if (entry.decoder == nullptr) {
+            continue;
+        }
+        if (entry.sample_rate == output_sample_rate) {
+            entry.resampler.reset();
+            continue;
+        }
+        if (entry.resampler == nullptr) {
+            entry.resampler = std::make_unique<AudioResampler>();
+        }
+        entry.resampler->Configure(entry.sample_rate, output_sample_rate);
+    }
+}
+
+DecoderCacheEntry& DecoderCache::Get(int sample_rate, int frame_duration) {
+    DecoderCacheEntry* victim = &entries_[0];
+    for (auto& entry : entries_) {
+        if (entry.decoder != nullptr && entry.sample_rate == sample_rate && entry.frame_duration == frame_duration) {
+            // The state belongs to the previous stream of this format, start clean
+            entry.decoder->ResetState();
+            if (entry.resampler != nullptr) {
+                entry.resampler->Configure(sample_rate, output_sample_rate_);
+            }
+            entry.last_used = ++use_count_;
+            return entry;
+        }
+        if (entry.decoder == nullptr || (victim->decoder != nullptr && entry.last_used < victim->last_used)) {
+            victim = &entry;
+        }
+    }
+
+    ESP_LOGI(TAG, "Create decoder for %d Hz, %d ms", sample_rate, frame_duration);
+    victim->decoder.reset();
+    victim->decoder = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
+    victim->sample_rate = sample_rate;
+    victim->frame_duration = frame_duration;
+    if (sample_rate != output_sample_rate_) {
+        if (victim->resampler == nullptr) {
+            victim->resampler = std::make_unique<AudioResampler>();
+        }
+        victim->resampler->Configure(sample_rate, output_sample_rate_);
+    } else {
+        victim->resampler.reset();
+    }
+    victim->last_used = ++use_count_;
+    return *victim;
+}
@@ -0,0 +1,45 @@
+#ifndef DECODER_CACHE_H
+#define DECODER_CACHE_H
+
+#include <memory>
+#include <cstdint>
+
+#include <opus_decoder.h>
+#include "audio_resampler.h"
+#include "memory_budget.h"
+
+#define DECODER_CACHE_SIZE MEMORY_BUDGET_DECODER_CACHE_SIZE
+
+struct DecoderCacheEntry {
+    int sample_rate = 0;
+    int frame_duration = 0;
+    uint32_t last_used = 0;
+    std::unique_ptr<OpusDecoderWrapper> decoder;
+    // nullptr when the format already matches the codec output rate
+    std::unique_ptr<AudioResampler> resampler;
+};
+
+/*
+ * Opus decoders and output resamplers kept per (sample rate, frame duration).
+ *
+ * Local sounds (16 kHz) and server audio (usually 24 kHz) interleave all the time, so instead of
+ * rebuilding the decoder on every switch the last DECODER_CACHE_SIZE formats stay allocated.
+ * Switching to a cached format only resets the decoder and resampler state, the least recently
+ * used entry is replaced on a miss.
+ *
+ * Only used by the decode task.
+ */
+class DecoderCache {
+public:
+    void Initialize(int output_sample_rate);
+    // The codec output was retuned, the cached entries get a resampler to the new rate or lose it
+    void SetOutputSampleRate(int output_sample_rate);
+    DecoderCacheEntry& Get(int sample_rate, int frame_duration);
+
+private:
+    DecoderCacheEntry entries_[DECODER_CACHE_SIZE];
+    int output_sample_rate_ = 0;
+    uint32_t use_count_ = 0;
+};
+
+#endif // DECODER_CACHE_H
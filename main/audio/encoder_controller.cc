@@ -0,0 +1,72 @@
+#include "encoder_controller.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "EncoderController"
+
+bool EncoderController::AddFrame(int frame_duration_ms, int64_t encode_us, size_t send_queue_depth, size_t send_queue_limit) {
+#if !CONFIG_USE_AUDIO_ENCODER_ADAPTIVE
+    // Nothing to evaluate, and Evaluate() would not reset the window
+    return false;
+#endif
+    window_encode_us_ += encode_us;
+    window_frame_us_ += frame_duration_ms * 1000;
+    if (send_queue_limit > 0) {
+        window_max_depth_percent_ = std::max(window_max_depth_percent_, send_queue_depth * 100 / send_queue_limit);
+    }
+    return window_frame_us_ >= ENCODER_WINDOW_MS * 1000;
+}
+
+bool EncoderController::Evaluate(uint32_t received, uint32_t lost, int rtt_ms, int congestion_rtt_ms) {
+#if !CONFIG_USE_AUDIO_ENCODER_ADAPTIVE
+    return false;
+#else
+    int load_percent = window_frame_us_ > 0 ? window_encode_us_ * 100 / window_frame_us_ : 0;
+    size_t depth_percent = window_max_depth_percent_;
+    window_encode_us_ = 0;
+    window_frame_us_ = 0;
+    window_max_depth_percent_ = 0;
+
+    // The counters are cumulative and restart with the jitter buffer
+    uint32_t new_received = received >= last_received_ ? received - last_received_ : received;
+    uint32_t new_lost = lost >= last_lost_ ? lost - last_lost_ : lost;
+    last_received_ = received;
+    last_lost_ = lost;
+    uint32_t loss_permille = new_received + new_lost > 0 ? new_lost * 1000 / (new_received + new_lost) : 0;
+
+    bool congested = depth_percent > ENCODER_CONGESTION_QUEUE_PERCENT || loss_permille > ENCODER_CONGESTION_LOSS_PERMILLE ||
+        rtt_ms > congestion_rtt_ms;
+    int complexity = complexity_;
+    bool dtx = dtx_;
+    int max_complexity = std::min<int>(ENCODER_MAX_COMPLEXITY, complexity_limit_);
+
+    if (complexity > max_complexity) {
+        // The limit was lowered, e.g. by the saver performance profile
+        complexity = max_complexity;
+        good_windows_ = 0;
+    } else if (load_percent > ENCODER_LOAD_HIGH_PERCENT && complexity > 0) {
+        complexity--;
+        good_windows_ = 0;
+    } else if (congested) {
+        dtx = ENCODER_ALLOW_DTX;
+        good_windows_ = 0;
+    } else if (load_percent < ENCODER_LOAD_LOW_PERCENT && ++good_windows_ >= ENCODER_STEP_UP_WINDOWS) {
+        good_windows_ = 0;
+        if (dtx) {
+            dtx = false;
+        } else if (complexity < max_complexity) {
+            complexity++;
+        }
+    }
+
+    if (complexity == complexity_ && dtx == dtx_) {
+        return false;
+    }
+    ESP_LOGI(TAG, "Encoder complexity %d -> %d, DTX %s (load %d%%, send queue %u%%, loss %lu/1000, rtt %d ms)",
+        complexity_, complexity, dtx ? "on" : "off", load_percent, (unsigned)depth_percent, loss_permille, rtt_ms);
+    complexity_ = complexity;
+    dtx_ = dtx;
+    return true;
+#endif
+}
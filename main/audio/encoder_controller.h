@@ -0,0 +1,74 @@
+#ifndef ENCODER_CONTROLLER_H
+#define ENCODER_CONTROLLER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#include <sdkconfig.h>
+
+/*
+ * Adaptive Opus encoder settings.
+ *
+ * The encode task reports every frame (encode time and send queue depth). Once per window
+ * (about one second of audio) the controller also looks at the downlink loss, and takes at most
+ * one step:
+ *   - the encoder uses too much of the frame time: lower the complexity
+ *   - the uplink is congested (send queue, loss or link RTT): enable DTX
+ *   - the encoder has headroom and the link is clean: raise the complexity, then disable DTX
+ * Stepping up needs several good windows in a row, stepping down only one, so the settings do
+ * not oscillate.
+ *
+ * The OpusEncoderWrapper does not expose the bitrate, so DTX is the lever for congestion.
+ */
+
+// Share of the frame time the encoder may use, the rest is left to the AFE and the network
+#define ENCODER_LOAD_HIGH_PERCENT 35
+#define ENCODER_LOAD_LOW_PERCENT 15
+// Send queue depth, in percent of its limit, above which the uplink is congested
+#define ENCODER_CONGESTION_QUEUE_PERCENT 25
+// Downlink loss in per mille above which the link is considered lossy
+#define ENCODER_CONGESTION_LOSS_PERMILLE 50
+#define ENCODER_WINDOW_MS 1000
+#define ENCODER_STEP_UP_WINDOWS 3
+
+#if CONFIG_USE_AUDIO_ENCODER_ADAPTIVE
+#define ENCODER_MAX_COMPLEXITY CONFIG_AUDIO_ENCODER_MAX_COMPLEXITY
+#else
+#define ENCODER_MAX_COMPLEXITY 0
+#endif
+#if CONFIG_AUDIO_ENCODER_ALLOW_DTX
+#define ENCODER_ALLOW_DTX true
+#else
+#define ENCODER_ALLOW_DTX false
+#endif
+
+class EncoderController {
+public:
+    // Returns true when a window is complete and Evaluate() should be called, never without adaptation
+    bool AddFrame(int frame_duration_ms, int64_t encode_us, size_t send_queue_depth, size_t send_queue_limit);
+    // Cumulative downlink counters from the jitter buffer and the link RTT (-1 if unknown),
+    // returns true when the settings changed
+    // congestion_rtt_ms: link round-trip time above which the uplink is considered congested
+    bool Evaluate(uint32_t received, uint32_t lost, int rtt_ms, int congestion_rtt_ms);
+
+    inline int complexity() const { return complexity_; }
+    inline bool dtx() const { return dtx_; }
+    // The highest complexity allowed from the next window on, any task
+    void SetComplexityLimit(int limit) { complexity_limit_ = limit; }
+
+private:
+    std::atomic<int> complexity_limit_ = ENCODER_MAX_COMPLEXITY;
+    int complexity_ = 0;
+    bool dtx_ = false;
+
+    int64_t window_encode_us_ = 0;
+    int64_t window_frame_us_ = 0;
+    size_t window_max_depth_percent_ = 0;
+    int good_windows_ = 0;
+
+    uint32_t last_received_ = 0;
+    uint32_t last_lost_ = 0;
+};
+
+#endif // ENCODER_CONTROLLER_H
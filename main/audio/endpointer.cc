@@ -0,0 +1,47 @@
+#include "endpointer.h"
+#include "pcm_utils.h"
+
+#include <algorithm>
+#include <cmath>
+
+void Endpointer::Reset() {
+    speech_ms_ = 0;
+    silence_ms_ = 0;
+    fired_ = false;
+    speech_rms_ = 0;
+    silence_rms_ = 0;
+}
+
+float Endpointer::Feed(const int16_t* data, size_t samples, bool vad_speech) {
+    if (fired_ || samples == 0) {
+        return -1;
+    }
+    uint64_t sum_squares;
+    int32_t peak;
+    PcmMeasure(data, samples, &sum_squares, &peak);
+    float rms = sqrtf((float)(sum_squares / samples));
+    // The processed audio is always 16 kHz mono
+    int frame_ms = samples / 16;
+
+    if (vad_speech && rms >= energy_gate_rms_) {
+        speech_rms_ = speech_ms_ == 0 ? rms : speech_rms_ + (rms - speech_rms_) / 8;
+        speech_ms_ += frame_ms;
+        silence_ms_ = 0;
+        silence_rms_ = 0;
+        return -1;
+    }
+    if (speech_ms_ == 0) {
+        // Nothing said yet
+        return -1;
+    }
+    silence_rms_ = silence_ms_ == 0 ? rms : silence_rms_ + (rms - silence_rms_) / 4;
+    silence_ms_ += frame_ms;
+    if (speech_ms_ < min_speech_ms_ || silence_ms_ < hangover_ms_) {
+        return -1;
+    }
+
+    fired_ = true;
+    float duration = std::min(1.0f, (float)speech_ms_ / (2 * min_speech_ms_));
+    float drop = speech_rms_ > 0 ? std::clamp(1.0f - silence_rms_ / speech_rms_, 0.0f, 1.0f) : 0;
+    return duration * (0.5f + 0.5f * drop);
+}
@@ -0,0 +1,43 @@
+#ifndef ENDPOINTER_H
+#define ENDPOINTER_H
+
+#include <sdkconfig.h>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Local end of utterance detection for the auto stop listening mode.
+ *
+ * Fed with every processed frame and the AFE VAD state. A frame counts as speech when the VAD
+ * says so and its RMS is above the energy gate, which keeps steady noise the VAD holds on to
+ * from extending the utterance. The endpoint is reached once there was at least min_speech_ms
+ * of speech followed by hangover_ms of non-speech, then Feed() returns the confidence once.
+ *
+ * The confidence (0-1) grows with the speech duration and with how far the trailing frames
+ * fell below the speech level, so the server can still wait on its own VAD for a weak one.
+ *
+ * Only called by the audio processor output task, Reset() before the task is started.
+ */
+class Endpointer {
+public:
+    Endpointer(int hangover_ms, int min_speech_ms, int energy_gate_rms)
+        : hangover_ms_(hangover_ms), min_speech_ms_(min_speech_ms), energy_gate_rms_(energy_gate_rms) {}
+
+    void Reset();
+    // Returns the confidence when this frame completes the endpoint, -1 otherwise
+    float Feed(const int16_t* data, size_t samples, bool vad_speech);
+
+private:
+    const int hangover_ms_;
+    const int min_speech_ms_;
+    const int energy_gate_rms_;
+
+    int speech_ms_ = 0;
+    int silence_ms_ = 0;
+    bool fired_ = false;
+    // Smoothed RMS of the speech and of the trailing frames
+    float speech_rms_ = 0;
+    float silence_rms_ = 0;
+};
+
+#endif // ENDPOINTER_H
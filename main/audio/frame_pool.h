@@ -0,0 +1,114 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <functional>
+
+#include <freertos/FreeRTOS.h>
+
+/*
+ * A fixed-size pool of preallocated frames (AudioTask / AudioStreamPacket).
+ *
+ * Released frames keep their buffers (the capacity of their vectors), so a frame that
+ * comes back from the pool can be filled again without touching the heap.
+ * When the pool runs dry Acquire() falls back to a heap allocation and counts a miss,
+ * and when the pool is already full Release() simply frees the frame.
+ */
+template <typename T>
+class FramePool {
+public:
+    FramePool() = default;
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+    // Not thread-safe, only call it before the pool is used by the audio tasks
+    void Reserve(size_t count, std::function<void(T&)> init = nullptr) {
+        init_ = std::move(init);
+        free_.clear();
+        free_.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            free_.push_back(Create());
+        }
+        capacity_ = count;
+    }
+
+    std::unique_ptr<T> Acquire() {
+        std::unique_ptr<T> item;
+        portENTER_CRITICAL(&lock_);
+        if (!free_.empty()) {
+            item = std::move(free_.back());
+            free_.pop_back();
+        }
+        portEXIT_CRITICAL(&lock_);
+
+        if (item == nullptr) {
+            misses_++;
+            item = Create();
+        }
+        return item;
+    }
+
+    void Release(std::unique_ptr<T>&& item) {
+        if (item == nullptr) {
+            return;
+        }
+        portENTER_CRITICAL(&lock_);
+        if (free_.size() < capacity_) {
+            free_.push_back(std::move(item));
+        }
+        portEXIT_CRITICAL(&lock_);
+        // If the pool is full, the item is freed here, outside of the critical section
+        item.reset();
+    }
+
+    // Lets trim free the buffers of the pooled frames, they grow again on their next use
+    void Trim(const std::function<void(T&)>& trim) {
+        ForEachFree(trim);
+    }
+
+    // Gives the pooled frames their buffers back after a Trim(), with the init function of Reserve()
+    void Renew() {
+        if (init_) {
+            ForEachFree(init_);
+        }
+    }
+
+    size_t available() const { return free_.size(); }
+    size_t capacity() const { return capacity_; }
+    uint32_t misses() const { return misses_; }
+
+private:
+    std::vector<std::unique_ptr<T>> free_;
+    std::function<void(T&)> init_;
+    size_t capacity_ = 0;
+    std::atomic<uint32_t> misses_ = 0;
+    portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+
+    // The frames are taken out while fn runs, which may allocate or free
+    void ForEachFree(const std::function<void(T&)>& fn) {
+        std::vector<std::unique_ptr<T>> items;
+        items.reserve(capacity_);
+        portENTER_CRITICAL(&lock_);
+        while (!free_.empty()) {
+            items.push_back(std::move(free_.back()));
+            free_.pop_back();
+        }
+        portEXIT_CRITICAL(&lock_);
+        for (auto& item : items) {
+            fn(*item);
+            Release(std::move(item));
+        }
+    }
+
+    std::unique_ptr<T> Create() {
+        auto item = std::make_unique<T>();
+        if (init_) {
+            init_(*item);
+        }
+        return item;
+    }
+};
+
+#endif // FRAME_POOL_H
@@ -0,0 +1,247 @@
+#include "jitter_buffer.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cstdlib>
+
+#define TAG "JitterBuffer"
+
+// Frames without underrun before the extra depth added by an underrun is given back
+#define JITTER_BUFFER_STABLE_FRAMES 500
+// An underrun this early in a stream is charged to the start threshold, about 1.5 s of 60 ms frames
+#define JITTER_BUFFER_STARTUP_FRAMES 25
+// Streams in a row without an early underrun before the start margin is lowered by a frame
+#define JITTER_BUFFER_CLEAN_STREAMS 5
+
+void JitterBuffer::Initialize(size_t capacity, size_t min_depth, size_t max_depth) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    slots_.clear();
+    slots_.resize(capacity);
+    min_depth_ = std::max<size_t>(min_depth, 1);
+    max_depth_ = std::min(std::max(max_depth, min_depth_), capacity);
+    target_depth_ = min_depth_;
+    count_ = 0;
+    synced_ = false;
+    playing_ = false;
+}
+
+void JitterBuffer::DropAll() {
+    for (auto& slot : slots_) {
+        slot.reset();
+    }
+    count_ = 0;
+    playing_ = false;
+}
+
+size_t JitterBuffer::GetStartDepth() const {
+    return std::min(target_depth_ + startup_depth_, max_depth_);
+}
+
+void JitterBuffer::UpdateTargetDepth() {
+    // Cover three times the mean deviation of the packet arrival time, plus one frame
+    size_t jitter_frames = (3 * jitter_us_ + frame_duration_us_ - 1) / frame_duration_us_;
+    target_depth_ = std::clamp(1 + jitter_frames + extra_depth_, min_depth_, max_depth_);
+}
+
+bool JitterBuffer::Push(std::unique_ptr<AudioStreamPacket> packet) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (slots_.empty()) {
+        return false;
+    }
+
+    int64_t now = esp_timer_get_time();
+    const size_t capacity = slots_.size();
+    if (packet->sequence == 0) {
+        packet->sequence = ++arrival_sequence_;
+    }
+    if (packet->frame_duration > 0) {
+        frame_duration_us_ = packet->frame_duration * 1000;
+    }
+    uint32_t sequence = packet->sequence;
+    stats_.received++;
+
+    if (!synced_) {
+        synced_ = true;
+        next_sequence_ = sequence;
+        last_arrival_us_ = 0;
+    }
+
+    int32_t offset = static_cast<int32_t>(sequence - next_sequence_);
+    if (offset < 0) {
+        // Already played or concealed
+        stats_.late++;
+        return false;
+    }
+    if (offset >= static_cast<int32_t>(capacity)) {
+        ESP_LOGW(TAG, "Sequence jumped from %lu to %lu, resync", next_sequence_, sequence);
+        DropAll();
+        next_sequence_ = sequence;
+        last_arrival_us_ = 0;
+    }
+
+    /* Interarrival jitter, as in RFC 3550 but in frame units of the sequence number */
+    if (last_arrival_us_ != 0 && static_cast<int32_t>(sequence - last_arrival_sequence_) > 0) {
+        int64_t expected = static_cast<int64_t>(sequence - last_arrival_sequence_) * frame_duration_us_;
+        int64_t deviation = std::llabs((now - last_arrival_us_) - expected);
+        jitter_us_ += (deviation - jitter_us_) / 16;
+    }
+    if (last_arrival_us_ == 0 || static_cast<int32_t>(sequence - last_arrival_sequence_) > 0) {
+        last_arrival_us_ = now;
+        last_arrival_sequence_ = sequence;
+    }
+
+    /* The stream continued after the buffer ran dry, so that was a real underrun, not the end of a sentence */
+    if (underrun_pending_) {
+        underrun_pending_ = false;
+        rebuffering_ = true;
+        stats_.underruns++;
+        extra_depth_ = std::min(extra_depth_ + 1, max_depth_);
+        stable_frames_ = 0;
+        if (played_frames_ < JITTER_BUFFER_STARTUP_FRAMES && !startup_underrun_) {
+            // The start threshold was too low for this link, the next stream buffers more first
+            startup_underrun_ = true;
+            stats_.startup_underruns++;
+            startup_depth_ = std::min(startup_depth_ + 1, max_depth_);
+            clean_streams_ = 0;
+        }
+    }
+
+    auto& slot = slots_[sequence % capacity];
+    if (slot != nullptr) {
+        // Duplicate packet
+        return false;
+    }
+    slot = std::move(packet);
+    if (count_++ == 0 && !playing_) {
+        buffering_since_us_ = now;
+    }
+    UpdateTargetDepth();
+    return true;
+}
+
+JitterBufferResult JitterBuffer::Pop(std::unique_ptr<AudioStreamPacket>& packet) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (count_ == 0) {
+        if (playing_) {
+            playing_ = false;
+            underrun_pending_ = true;
+            underrun_us_ = esp_timer_get_time();
+        }
+        return kJitterBufferEmpty;
+    }
+
+    const size_t capacity = slots_.size();
+    if (!playing_) {
+        // Start once the depth is reached, or when the buffered audio is old enough (end of stream)
+        int64_t now = esp_timer_get_time();
+        int64_t waited = now - buffering_since_us_;
+        size_t depth = stream_started_ ? target_depth_ : GetStartDepth();
+        if (count_ < depth && waited < static_cast<int64_t>(depth) * frame_duration_us_) {
+            return kJitterBufferEmpty;
+        }
+        playing_ = true;
+        if (!stream_started_) {
+            stream_started_ = true;
+            stats_.first_audio_ms = waited / 1000;
+        } else if (rebuffering_) {
+            stats_.rebuffer_ms += (now - underrun_us_) / 1000;
+        }
+        rebuffering_ = false;
+        while (slots_[next_sequence_ % capacity] == nullptr) {
+            next_sequence_++;
+        }
+    }
+
+    auto& slot = slots_[next_sequence_ % capacity];
+    next_sequence_++;
+    if (slot == nullptr) {
+        stats_.lost++;
+        return kJitterBufferLost;
+    }
+
+    packet = std::move(slot);
+    count_--;
+    played_frames_++;
+    if (extra_depth_ > 0 && ++stable_frames_ >= JITTER_BUFFER_STABLE_FRAMES) {
+        extra_depth_--;
+        stable_frames_ = 0;
+        UpdateTargetDepth();
+    }
+    return kJitterBufferFrame;
+}
+
+void JitterBuffer::Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // A stream long enough to judge and without an early underrun lets the next one start sooner
+    if (stream_started_ && !startup_underrun_ && played_frames_ >= JITTER_BUFFER_STARTUP_FRAMES &&
+        ++clean_streams_ >= JITTER_BUFFER_CLEAN_STREAMS) {
+        clean_streams_ = 0;
+        if (startup_depth_ > 0) {
+            startup_depth_--;
+        }
+    }
+    DropAll();
+    synced_ = false;
+    underrun_pending_ = false;
+    rebuffering_ = false;
+    stream_started_ = false;
+    startup_underrun_ = false;
+    played_frames_ = 0;
+    last_arrival_us_ = 0;
+}
+
+void JitterBuffer::SetLink(const char* name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (name == link_) {
+        return;
+    }
+    LinkState* saved = nullptr;
+    LinkState* restored = nullptr;
+    for (auto& link : links_) {
+        if (link.name == link_ || (saved == nullptr && link.name == nullptr)) {
+            saved = &link;
+        }
+        if (link.name == name) {
+            restored = &link;
+        }
+    }
+    if (link_ != nullptr && saved != nullptr) {
+        *saved = { link_, jitter_us_, extra_depth_, startup_depth_ };
+    }
+    if (restored != nullptr) {
+        jitter_us_ = restored->jitter_us;
+        extra_depth_ = restored->extra_depth;
+        startup_depth_ = restored->startup_depth;
+    } else {
+        jitter_us_ = 0;
+        extra_depth_ = 0;
+        startup_depth_ = 0;
+    }
+    ESP_LOGI(TAG, "Link %s, jitter %d ms, start margin %u frames", name, (int)(jitter_us_ / 1000), (unsigned)startup_depth_);
+    link_ = name;
+    clean_streams_ = 0;
+    stable_frames_ = 0;
+    UpdateTargetDepth();
+}
+
+void JitterBuffer::SetMinDepth(size_t min_depth) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    min_depth_ = std::clamp<size_t>(min_depth, 1, max_depth_);
+    UpdateTargetDepth();
+}
+
+bool JitterBuffer::empty() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return count_ == 0;
+}
+
+JitterBufferStats JitterBuffer::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    JitterBufferStats stats = stats_;
+    stats.depth = count_;
+    stats.target_depth = target_depth_;
+    stats.start_depth = GetStartDepth();
+    stats.jitter_ms = jitter_us_ / 1000;
+    return stats;
+}
@@ -0,0 +1,110 @@
+#ifndef JITTER_BUFFER_H
+#define JITTER_BUFFER_H
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+
+#include "protocol.h"
+
+enum JitterBufferResult {
+    kJitterBufferEmpty,     // Nothing to play yet (buffering or underrun)
+    kJitterBufferFrame,     // A packet is returned
+    kJitterBufferLost,      // The next frame is missing, the caller should conceal it
+};
+
+struct JitterBufferStats {
+    size_t depth = 0;
+    size_t target_depth = 0;
+    int jitter_ms = 0;
+    uint32_t received = 0;
+    uint32_t late = 0;
+    uint32_t lost = 0;
+    uint32_t underruns = 0;
+    // Playout start threshold of the next stream, in frames
+    size_t start_depth = 0;
+    // Underruns within the first JITTER_BUFFER_STARTUP_FRAMES of a stream, they raise start_depth
+    uint32_t startup_underruns = 0;
+    // Time spent buffering again after the underruns, and before the first frame of the last stream
+    uint32_t rebuffer_ms = 0;
+    int first_audio_ms = 0;
+};
+
+/*
+ * Downlink jitter buffer between the protocol and the Opus decoder.
+ *
+ * Packets are stored in a ring indexed by their sequence number (packets without a sequence,
+ * e.g. from WebSocket, are numbered in arrival order). Playback starts once target_depth frames
+ * are buffered, and the target depth follows the measured inter-arrival jitter, growing after
+ * mid-stream underruns. A missing frame is reported as kJitterBufferLost so the decoder can run
+ * packet-loss concealment instead of leaving a gap.
+ *
+ * The first frame of a stream (after Reset()) waits for start_depth instead, the target depth
+ * plus a startup margin: an underrun early in a stream raises the margin, several clean streams
+ * in a row lower it again, so the time to the first audio follows what the link can sustain.
+ * The learned jitter and margins are kept per link (SetLink()), a dual network board does not
+ * carry the 4G margins over to Wi-Fi.
+ *
+ * Push() and Pop() may be called from different tasks.
+ */
+class JitterBuffer {
+public:
+    void Initialize(size_t capacity, size_t min_depth, size_t max_depth);
+    bool Push(std::unique_ptr<AudioStreamPacket> packet);
+    JitterBufferResult Pop(std::unique_ptr<AudioStreamPacket>& packet);
+    // Drop the buffered packets and resync on the next packet, the jitter estimate is kept
+    void Reset();
+    // Change the depth playback starts from, e.g. for a new network, the buffered packets are kept
+    void SetMinDepth(size_t min_depth);
+    // Switch to the learned state of another link, the name must be a string literal
+    void SetLink(const char* name);
+    bool empty();
+    JitterBufferStats GetStats();
+
+private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<AudioStreamPacket>> slots_;
+    size_t count_ = 0;
+    size_t min_depth_ = 1;
+    size_t max_depth_ = 1;
+    size_t target_depth_ = 1;
+    size_t extra_depth_ = 0;
+    uint32_t stable_frames_ = 0;
+    size_t startup_depth_ = 0;      // Start margin on top of the target depth
+    uint32_t clean_streams_ = 0;
+
+    // What was learned on the other links
+    struct LinkState {
+        const char* name = nullptr;
+        int64_t jitter_us = 0;
+        size_t extra_depth = 0;
+        size_t startup_depth = 0;
+    };
+    static constexpr size_t kLinkCount = 4;
+    LinkState links_[kLinkCount];
+    const char* link_ = nullptr;
+
+    bool synced_ = false;
+    bool playing_ = false;
+    bool underrun_pending_ = false;
+    bool rebuffering_ = false;
+    bool stream_started_ = false;
+    bool startup_underrun_ = false;
+    uint32_t played_frames_ = 0;    // Since the start of the stream
+    int64_t underrun_us_ = 0;
+    uint32_t next_sequence_ = 0;
+    uint32_t arrival_sequence_ = 0;
+    uint32_t last_arrival_sequence_ = 0;
+    int64_t last_arrival_us_ = 0;
+    int64_t buffering_since_us_ = 0;
+    int64_t frame_duration_us_ = 60000;
+    int64_t jitter_us_ = 0;
+    JitterBufferStats stats_;
+
+    void DropAll();
+    void UpdateTargetDepth();
+    size_t GetStartDepth() const;
+};
+
+#endif // JITTER_BUFFER_H
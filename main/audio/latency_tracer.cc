@@ -0,0 +1,102 @@
+#include "latency_tracer.h"
+
+#include <esp_timer.h>
+#include <algorithm>
+
+#if LATENCY_TRACE_CAPTURE
+
+void LatencyTracer::OnCapture(size_t samples) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&lock_);
+    samples_in_ += samples;
+    last_capture_us_ = now;
+    portEXIT_CRITICAL(&lock_);
+}
+
+int64_t LatencyTracer::OnProcessed(size_t samples) {
+    portENTER_CRITICAL(&lock_);
+    samples_out_ += samples;
+    int64_t origin = 0;
+    if (last_capture_us_ != 0 && samples_in_ >= samples_out_) {
+        // The samples still inside the processor were captured after the last sample of this frame
+        origin = last_capture_us_ - static_cast<int64_t>(samples_in_ - samples_out_) * 1000000 / 16000;
+    }
+    portEXIT_CRITICAL(&lock_);
+    return origin;
+}
+
+void LatencyTracer::ResetCapture() {
+    portENTER_CRITICAL(&lock_);
+    samples_in_ = 0;
+    samples_out_ = 0;
+    last_capture_us_ = 0;
+    portEXIT_CRITICAL(&lock_);
+}
+
+#endif // LATENCY_TRACE_CAPTURE
+
+#if CONFIG_USE_AUDIO_LATENCY_TRACE
+
+static const char* const kStageNames[kLatencyStageCount] = {
+    "capture_to_processed",
+    "processed_to_encoded",
+    "encoded_to_sent",
+    "uplink_total",
+    "received_to_decoded",
+    "decoded_to_played",
+    "downlink_total",
+};
+
+void LatencyTracer::Add(LatencyStage stage, int64_t latency_us) {
+    if (latency_us < 0) {
+        return;
+    }
+    auto& window = windows_[stage];
+    portENTER_CRITICAL(&lock_);
+    window.samples[window.count % LATENCY_TRACE_WINDOW] = static_cast<uint32_t>(std::min<int64_t>(latency_us, UINT32_MAX));
+    window.count++;
+    portEXIT_CRITICAL(&lock_);
+}
+
+void LatencyTracer::Record(LatencyStage stage, int64_t origin_us, int64_t& stage_us) {
+    if (origin_us == 0) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    Add(stage, now - stage_us);
+    stage_us = now;
+}
+
+void LatencyTracer::RecordTotal(LatencyStage stage, int64_t origin_us) {
+    if (origin_us == 0) {
+        return;
+    }
+    Add(stage, esp_timer_get_time() - origin_us);
+}
+
+cJSON* LatencyTracer::GetStatsJson() {
+    cJSON* json = cJSON_CreateObject();
+    uint32_t samples[LATENCY_TRACE_WINDOW];
+    for (int stage = 0; stage < kLatencyStageCount; stage++) {
+        auto& window = windows_[stage];
+        portENTER_CRITICAL(&lock_);
+        uint32_t count = window.count;
+        size_t n = std::min<uint32_t>(count, LATENCY_TRACE_WINDOW);
+        std::copy(window.samples, window.samples + n, samples);
+        portEXIT_CRITICAL(&lock_);
+
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "count", count);
+        if (n > 0) {
+            std::sort(samples, samples + n);
+            cJSON_AddNumberToObject(item, "p50_us", samples[n * 50 / 100]);
+            cJSON_AddNumberToObject(item, "p95_us", samples[n * 95 / 100]);
+            cJSON_AddNumberToObject(item, "p99_us", samples[n * 99 / 100]);
+            cJSON_AddNumberToObject(item, "max_us", samples[n - 1]);
+        }
+        cJSON_AddItemToObject(json, kStageNames[stage], item);
+    }
+    return json;
+}
+
+#endif // CONFIG_USE_AUDIO_LATENCY_TRACE
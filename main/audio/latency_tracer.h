@@ -0,0 +1,85 @@
+#ifndef LATENCY_TRACER_H
+#define LATENCY_TRACER_H
+
+#include <cstdint>
+#include <cstddef>
+
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <cJSON.h>
+
+/*
+ * Per-frame audio latency tracing.
+ *
+ * Frames carry two timestamps: the origin (capture time on the uplink, receive time on the
+ * downlink) and the time of the previous stage. Each stage records the delay since the
+ * previous one, and the last stage of a path also records the total since the origin.
+ * Every stage keeps the last LATENCY_TRACE_WINDOW samples, percentiles are computed on demand.
+ *
+ * When CONFIG_USE_AUDIO_LATENCY_TRACE is disabled every method is an empty inline, except the
+ * capture dating (OnCapture / OnProcessed) which server AEC also needs to align the uplink frames
+ * with the playback.
+ */
+
+#define LATENCY_TRACE_CAPTURE (CONFIG_USE_AUDIO_LATENCY_TRACE || CONFIG_USE_SERVER_AEC)
+
+#define LATENCY_TRACE_WINDOW 128
+
+enum LatencyStage {
+    kLatencyStageCaptureToProcessed,
+    kLatencyStageProcessedToEncoded,
+    kLatencyStageEncodedToSent,
+    kLatencyStageUplinkTotal,
+    kLatencyStageReceivedToDecoded,
+    kLatencyStageDecodedToPlayed,
+    kLatencyStageDownlinkTotal,
+    kLatencyStageCount,
+};
+
+class LatencyTracer {
+public:
+#if LATENCY_TRACE_CAPTURE
+    // Count the 16 kHz samples fed to the audio processor, they date the processor output
+    void OnCapture(size_t samples);
+    // Capture time of the last sample of a processor output frame
+    int64_t OnProcessed(size_t samples);
+    void ResetCapture();
+#else
+    void OnCapture(size_t samples) {}
+    int64_t OnProcessed(size_t samples) { return 0; }
+    void ResetCapture() {}
+#endif
+
+#if CONFIG_USE_AUDIO_LATENCY_TRACE
+    // Record a stage that ends now, updates stage_us to now. Frames with origin 0 are not traced
+    void Record(LatencyStage stage, int64_t origin_us, int64_t& stage_us);
+    void RecordTotal(LatencyStage stage, int64_t origin_us);
+
+    // {"stage": {"count", "p50_us", "p95_us", "p99_us", "max_us"}, ...}
+    cJSON* GetStatsJson();
+#else
+    void Record(LatencyStage stage, int64_t origin_us, int64_t& stage_us) {}
+    void RecordTotal(LatencyStage stage, int64_t origin_us) {}
+    cJSON* GetStatsJson() { return cJSON_CreateObject(); }
+#endif
+
+private:
+#if LATENCY_TRACE_CAPTURE
+    uint64_t samples_in_ = 0;
+    uint64_t samples_out_ = 0;
+    int64_t last_capture_us_ = 0;
+    portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+#endif
+#if CONFIG_USE_AUDIO_LATENCY_TRACE
+    struct Window {
+        uint32_t samples[LATENCY_TRACE_WINDOW];
+        uint32_t count = 0;
+    };
+
+    Window windows_[kLatencyStageCount];
+
+    void Add(LatencyStage stage, int64_t latency_us);
+#endif
+};
+
+#endif // LATENCY_TRACER_H
@@ -0,0 +1,207 @@
+#include "loopback_test.h"
+
+#include <esp_log.h>
+#include <cmath>
+#include <algorithm>
+
+#define TAG "LoopbackTest"
+
+#define LOOPBACK_LEAD_MS 300
+#define LOOPBACK_CHIRP_MS 200
+#define LOOPBACK_TAIL_MS 300
+// Long enough for the chirp to come back with the slowest pipelines
+#define LOOPBACK_CAPTURE_MS 1000
+#define LOOPBACK_CHUNK_MS 10
+#define LOOPBACK_CHIRP_START_HZ 300.0
+#define LOOPBACK_CHIRP_END_HZ 3400.0
+#define LOOPBACK_CHIRP_AMPLITUDE 8000.0
+#define LOOPBACK_FADE_MS 5.0
+// Below it the peak is more likely noise or a reflection than the direct path
+#define LOOPBACK_MIN_CONFIDENCE 0.2f
+#define LOOPBACK_MAX_LOOP_US 250000
+
+LoopbackTest::LoopbackTest(int output_sample_rate, bool reference)
+    : output_sample_rate_(output_sample_rate), reference_(reference) {
+    size_t chirp_samples = 16 * LOOPBACK_CHIRP_MS;
+    chirp_.resize(chirp_samples);
+    for (size_t i = 0; i < chirp_samples; i++) {
+        chirp_[i] = ChirpSample(i / 16000.0);
+    }
+    mic_.reserve(16 * LOOPBACK_CAPTURE_MS);
+    if (reference_) {
+        ref_.reserve(16 * LOOPBACK_CAPTURE_MS);
+    }
+    chunks_.reserve(LOOPBACK_CAPTURE_MS / LOOPBACK_CHUNK_MS + 4);
+}
+
+// The same waveform at any sample rate, from the time into the chirp
+int16_t LoopbackTest::ChirpSample(double t) {
+    const double duration = LOOPBACK_CHIRP_MS / 1000.0;
+    if (t < 0 || t >= duration) {
+        return 0;
+    }
+    double rate = (LOOPBACK_CHIRP_END_HZ - LOOPBACK_CHIRP_START_HZ) / duration;
+    double phase = 2 * M_PI * (LOOPBACK_CHIRP_START_HZ * t + rate * t * t / 2);
+    // Faded in and out, the edges would otherwise click over the whole band
+    double fade = LOOPBACK_FADE_MS / 1000.0;
+    double gain = std::min({1.0, t / fade, (duration - t) / fade});
+    return (int16_t)(LOOPBACK_CHIRP_AMPLITUDE * gain * sin(phase));
+}
+
+bool LoopbackTest::NextOutput(std::vector<int16_t>& pcm, bool& chirp_start) {
+    size_t lead = (size_t)output_sample_rate_ * LOOPBACK_LEAD_MS / 1000;
+    size_t total = (size_t)output_sample_rate_ * (LOOPBACK_LEAD_MS + LOOPBACK_CHIRP_MS + LOOPBACK_TAIL_MS) / 1000;
+    if (output_samples_ >= total) {
+        return false;
+    }
+    size_t chunk = (size_t)output_sample_rate_ * LOOPBACK_CHUNK_MS / 1000;
+    if (output_samples_ < lead) {
+        // The last lead chunk ends where the chirp starts, whatever the sample rate
+        chunk = std::min(chunk, lead - output_samples_);
+    }
+    pcm.resize(std::min(chunk, total - output_samples_));
+    for (size_t i = 0; i < pcm.size(); i++) {
+        double t = ((double)(output_samples_ + i) - lead) / output_sample_rate_;
+        pcm[i] = ChirpSample(t);
+    }
+    chirp_start = output_samples_ == lead;
+    output_samples_ += pcm.size();
+    return true;
+}
+
+void LoopbackTest::OnChirpWritten(int64_t write_us, int64_t play_us) {
+    chirp_write_us_ = write_us;
+    chirp_play_us_ = play_us;
+}
+
+bool LoopbackTest::AddCapture(const int16_t* data, size_t frames, int64_t return_us) {
+    size_t capacity = 16 * LOOPBACK_CAPTURE_MS;
+    frames = std::min(frames, capacity - mic_.size());
+    for (size_t i = 0; i < frames; i++) {
+        if (reference_) {
+            mic_.push_back(data[i * 2]);
+            ref_.push_back(data[i * 2 + 1]);
+        } else {
+            mic_.push_back(data[i]);
+        }
+    }
+    chunks_.push_back({mic_.size(), return_us});
+    return mic_.size() >= capacity;
+}
+
+// The capture time of a sample as the uplink frames get it: the read return time is the
+// capture time of the last sample read
+int64_t LoopbackTest::CaptureTime(double index) const {
+    for (auto& chunk : chunks_) {
+        if (index < chunk.end) {
+            return chunk.return_us - (int64_t)((chunk.end - 1 - index) * 1000000 / 16000);
+        }
+    }
+    return 0;
+}
+
+double LoopbackTest::FindChirp(const Buffer<int16_t>& capture, float& confidence) const {
+    confidence = 0;
+    if (capture.size() <= chirp_.size()) {
+        return -1;
+    }
+    size_t lags = capture.size() - chirp_.size();
+    auto correlate = [&](size_t lag, size_t step) {
+        int64_t sum = 0;
+        for (size_t i = 0; i < chirp_.size(); i += step) {
+            sum += (int32_t)chirp_[i] * capture[lag + i];
+        }
+        return sum;
+    };
+
+    // Coarse, every other lag over every other sample. The chirp stays under 4 kHz
+    size_t best = 0;
+    int64_t best_sum = 0;
+    for (size_t lag = 0; lag < lags; lag += 2) {
+        int64_t sum = correlate(lag, 2);
+        if (sum > best_sum) {
+            best_sum = sum;
+            best = lag;
+        }
+    }
+
+    size_t from = best > 2 ? best - 2 : 0;
+    size_t to = std::min(best + 2, lags - 1);
+    best_sum = 0;
+    for (size_t lag = from; lag <= to; lag++) {
+        int64_t sum = correlate(lag, 1);
+        if (sum > best_sum) {
+            best_sum = sum;
+            best = lag;
+        }
+    }
+    if (best_sum <= 0) {
+        return -1;
+    }
+
+    double template_energy = 0;
+    double window_energy = 0;
+    for (size_t i = 0; i < chirp_.size(); i++) {
+        template_energy += (double)chirp_[i] * chirp_[i];
+        window_energy += (double)capture[best + i] * capture[best + i];
+    }
+    confidence = window_energy > 0 ? (float)(best_sum / sqrt(template_energy * window_energy)) : 0;
+
+    // Parabolic interpolation between the neighbouring lags
+    double offset = 0;
+    if (best > 0 && best + 1 < lags) {
+        double left = (double)correlate(best - 1, 1);
+        double right = (double)correlate(best + 1, 1);
+        double center = (double)best_sum;
+        double denominator = left - 2 * center + right;
+        if (denominator < 0) {
+            offset = std::clamp(0.5 * (left - right) / denominator, -0.5, 0.5);
+        }
+    }
+    return best + offset;
+}
+
+LoopbackResult LoopbackTest::Analyze() const {
+    LoopbackResult result;
+    if (chirp_play_us_ == 0 || chunks_.empty()) {
+        ESP_LOGE(TAG, "Incomplete run: %s", chirp_play_us_ == 0 ? "no chirp played" : "nothing captured");
+        return result;
+    }
+
+    float confidence;
+    double mic_lag = FindChirp(mic_, confidence);
+    result.confidence = confidence;
+    if (mic_lag < 0 || confidence < LOOPBACK_MIN_CONFIDENCE) {
+        ESP_LOGE(TAG, "Chirp not found on the microphone, confidence %.2f", confidence);
+        return result;
+    }
+
+    auto& calibration = result.calibration;
+    int64_t mic_us = CaptureTime(mic_lag);
+    calibration.output_latency_us = (int32_t)(chirp_play_us_ - chirp_write_us_);
+    calibration.loop_us = (int32_t)(mic_us - chirp_play_us_);
+    calibration.electrical_us = -1;
+    calibration.reference_offset_us = 0;
+
+    if (reference_) {
+        float ref_confidence;
+        double ref_lag = FindChirp(ref_, ref_confidence);
+        if (ref_lag >= 0 && ref_confidence >= LOOPBACK_MIN_CONFIDENCE) {
+            calibration.electrical_us = (int32_t)(CaptureTime(ref_lag) - chirp_play_us_);
+            calibration.reference_offset_us = (int32_t)((mic_lag - ref_lag) * 1000000 / 16000);
+        } else {
+            ESP_LOGW(TAG, "Chirp not found on the reference channel, confidence %.2f", ref_confidence);
+        }
+    }
+
+    // A capture estimated before the playout, or far after it, is a wrong peak or a broken clock
+    if (calibration.loop_us < 0 || calibration.loop_us > LOOPBACK_MAX_LOOP_US) {
+        ESP_LOGE(TAG, "Implausible loop latency %ld us", (long)calibration.loop_us);
+        return result;
+    }
+    result.valid = true;
+    ESP_LOGI(TAG, "Output %ld us, loop %ld us, electrical %ld us, reference offset %ld us, confidence %.2f",
+        (long)calibration.output_latency_us, (long)calibration.loop_us, (long)calibration.electrical_us,
+        (long)calibration.reference_offset_us, confidence);
+    return result;
+}
@@ -0,0 +1,86 @@
+#ifndef LOOPBACK_TEST_H
+#define LOOPBACK_TEST_H
+
+#include <sdkconfig.h>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "heap_accounting.h"
+
+// The measured delays of a board, kept in the "audio" settings
+struct LoopbackCalibration {
+    // OutputData() to the DAC, from the TX DMA model
+    int32_t output_latency_us;
+    // Estimated playout of the chirp to its estimated capture on the microphone. The capture
+    // and playout times of the server AEC are off by this much, see GetAecReferenceTimestamp()
+    int32_t loop_us;
+    // The same on the reference channel, the DAC and input pipeline without the air. -1 without
+    int32_t electrical_us;
+    // How far the microphone lags the reference channel, what the device AEC has to absorb
+    int32_t reference_offset_us;
+};
+
+#define LOOPBACK_CALIBRATION_VERSION 1
+
+struct LoopbackResult {
+    bool valid = false;
+    LoopbackCalibration calibration = {};
+    // Normalized correlation peak of the chirp on the microphone (0-1)
+    float confidence = 0;
+};
+
+/*
+ * Speaker to microphone latency measurement.
+ *
+ * The output task plays a lead silence, then a linear chirp, then a tail silence, and reports
+ * when it wrote the first chirp chunk and when that chunk should reach the DAC. The input task
+ * captures the 16 kHz input meanwhile, the microphone and the reference channel, with the time
+ * each read returned. Analyze() cross-correlates the captures with the chirp, coarsely at half
+ * the rate then around the best lag, and turns the lags into capture times on the same clock
+ * the audio service stamps the uplink frames with.
+ *
+ * One object per run, the output and input sides are only touched by their own tasks.
+ */
+class LoopbackTest {
+public:
+    LoopbackTest(int output_sample_rate, bool reference);
+
+    // Output task: fills the next 10 ms chunk, false once the stimulus is written
+    bool NextOutput(std::vector<int16_t>& pcm, bool& chirp_start);
+    void OnChirpWritten(int64_t write_us, int64_t play_us);
+
+    // Input task: 16 kHz frames, interleaved with the reference when there is one. True once
+    // the capture is complete
+    bool AddCapture(const int16_t* data, size_t frames, int64_t return_us);
+
+    LoopbackResult Analyze() const;
+
+private:
+    template <typename T>
+    using Buffer = std::vector<T, PsramAllocator<T, kHeapTagAudio>>;
+
+    const int output_sample_rate_;
+    const bool reference_;
+
+    Buffer<int16_t> chirp_;      // At 16 kHz, to correlate against
+    size_t output_samples_ = 0;  // Stimulus samples written so far
+    int64_t chirp_write_us_ = 0;
+    int64_t chirp_play_us_ = 0;
+
+    Buffer<int16_t> mic_;
+    Buffer<int16_t> ref_;
+    // When the read of each chunk returned, with the index of its last sample
+    struct Chunk {
+        size_t end;
+        int64_t return_us;
+    };
+    std::vector<Chunk> chunks_;
+
+    static int16_t ChirpSample(double t);
+    int64_t CaptureTime(double index) const;
+    // Fractional lag of the chirp in the capture, -1 if not found
+    double FindChirp(const Buffer<int16_t>& capture, float& confidence) const;
+};
+
+#endif // LOOPBACK_TEST_H
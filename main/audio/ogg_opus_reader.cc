@@ -0,0 +1,136 @@
+#include "ogg_opus_reader.h"
+
+#include <esp_log.h>
+#include <sdkconfig.h>
+#include <cstring>
+
+#define TAG "OggOpusReader"
+
+#define OGG_PAGE_NOT_FOUND static_cast<size_t>(-1)
+
+int GetOpusPacketDuration(const uint8_t* packet, size_t size) {
+    if (size < 1) {
+        return CONFIG_AUDIO_OPUS_FRAME_DURATION_MS;
+    }
+    // Frame size for each TOC config
+    static const int frame_us[32] = {
+        10000, 20000, 40000, 60000, 10000, 20000, 40000, 60000, 10000, 20000, 40000, 60000, // SILK
+        10000, 20000, 10000, 20000,                                                         // Hybrid
+        2500, 5000, 10000, 20000, 2500, 5000, 10000, 20000,                                 // CELT
+        2500, 5000, 10000, 20000, 2500, 5000, 10000, 20000,
+    };
+    int frames;
+    switch (packet[0] & 0x03) {
+        case 0: frames = 1; break;
+        case 3: frames = size >= 2 ? (packet[1] & 0x3F) : 1; break;
+        default: frames = 2; break;
+    }
+    int duration_us = frame_us[packet[0] >> 3] * frames;
+    if (duration_us == 0 || duration_us > 120000) {
+        // A code 3 packet of no frames or more than 120 ms is malformed, a zero would stall the pacing
+        return CONFIG_AUDIO_OPUS_FRAME_DURATION_MS;
+    }
+    return duration_us / 1000;
+}
+
+bool IsOpusDecodeSampleRate(int sample_rate) {
+    return sample_rate == 8000 || sample_rate == 12000 || sample_rate == 16000 || sample_rate == 24000 ||
+        sample_rate == 48000;
+}
+
+int OggOpusReader::DecodeSampleRate(int output_sample_rate) const {
+    if (IsOpusDecodeSampleRate(output_sample_rate)) {
+        return output_sample_rate;
+    }
+    // 44.1 kHz and the like are resampled anyway, from the original rate of the sound
+    return IsOpusDecodeSampleRate(sample_rate_) ? sample_rate_ : 48000;
+}
+
+bool OggOpusReader::Open(const std::string_view& ogg) {
+    data_ = reinterpret_cast<const uint8_t*>(ogg.data());
+    size_ = ogg.size();
+    offset_ = 0;
+    page_ = nullptr;
+    segments_ = 0;
+    segment_ = 0;
+    sample_rate_ = 16000;
+
+    bool seen_head = false;
+    const uint8_t* packet;
+    size_t size;
+    while (NextPacket(packet, size)) {
+        if (!seen_head) {
+            // OpusHead: [0-7] "OpusHead", [8] version, [9] channel_count, [10-11] pre_skip,
+            // [12-15] input_sample_rate, [16-17] output_gain, [18] mapping_family
+            if (size >= 19 && std::memcmp(packet, "OpusHead", 8) == 0) {
+                seen_head = true;
+                sample_rate_ = packet[12] | (packet[13] << 8) | (packet[14] << 16) | (packet[15] << 24);
+                ESP_LOGD(TAG, "OpusHead: version=%d, channels=%d, sample_rate=%d", packet[8], packet[9], sample_rate_);
+            }
+            continue;
+        }
+        // Expect OpusTags in the second packet, the audio packets follow
+        if (size >= 8 && std::memcmp(packet, "OpusTags", 8) == 0) {
+            return true;
+        }
+    }
+    ESP_LOGW(TAG, "Not an Ogg Opus stream");
+    return false;
+}
+
+size_t OggOpusReader::FindPage(size_t start) const {
+    for (size_t i = start; i + 4 <= size_; ++i) {
+        if (data_[i] == 'O' && data_[i + 1] == 'g' && data_[i + 2] == 'g' && data_[i + 3] == 'S') {
+            return i;
+        }
+    }
+    return OGG_PAGE_NOT_FOUND;
+}
+
+bool OggOpusReader::NextPacket(const uint8_t*& packet, size_t& size) {
+    while (true) {
+        // Parse the packets of the current page using lacing
+        while (page_ != nullptr && segment_ < segments_) {
+            size_t start = cursor_;
+            size_t length = 0;
+            bool continued;
+            do {
+                uint8_t lacing = page_[27 + segment_++];
+                length += lacing;
+                cursor_ += lacing;
+                continued = (lacing == 255);
+            } while (continued && segment_ < segments_);
+
+            if (length > 0) {
+                packet = data_ + start;
+                size = length;
+                return true;
+            }
+        }
+
+        page_ = nullptr;
+        size_t pos = FindPage(offset_);
+        if (pos == OGG_PAGE_NOT_FOUND || pos + 27 > size_) {
+            return false;
+        }
+        const uint8_t* page = data_ + pos;
+        size_t page_segments = page[26];
+        size_t body_offset = pos + 27 + page_segments;
+        if (body_offset > size_) {
+            return false;
+        }
+        size_t body_size = 0;
+        for (size_t i = 0; i < page_segments; ++i) {
+            body_size += page[27 + i];
+        }
+        if (body_offset + body_size > size_) {
+            return false;
+        }
+
+        page_ = page;
+        segments_ = page_segments;
+        segment_ = 0;
+        cursor_ = body_offset;
+        offset_ = body_offset + body_size;
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef OGG_OPUS_READER_H
+#define OGG_OPUS_READER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+
+// Duration of an Opus packet in ms, from its TOC byte (RFC 6716, section 3.1). A malformed packet
+// takes the configured frame duration.
+int GetOpusPacketDuration(const uint8_t* packet, size_t size);
+// Whether an Opus decoder can output at this rate (RFC 6716, section 2)
+bool IsOpusDecodeSampleRate(int sample_rate);
+
+/*
+ * Walks the Opus packets of an Ogg Opus stream held in memory (the embedded sound assets),
+ * without copying them. Packets spanning several pages are not supported.
+ */
+class OggOpusReader {
+public:
+    // Parses OpusHead / OpusTags, returns false if they are not found
+    bool Open(const std::string_view& ogg);
+    // The next audio packet, points into the stream. Returns false at the end
+    bool NextPacket(const uint8_t*& packet, size_t& size);
+
+    inline int sample_rate() const { return sample_rate_; }
+    // The rate to decode the stream at for a codec: the input rate of OpusHead is only informative,
+    // any stream decodes at 8/12/16/24/48 kHz, so at the codec rate no output resampler is needed
+    int DecodeSampleRate(int output_sample_rate) const;
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    size_t offset_ = 0;     // Where to look for the next page
+    const uint8_t* page_ = nullptr;
+    size_t segments_ = 0;
+    size_t segment_ = 0;
+    size_t cursor_ = 0;     // Start of the next packet in the current page
+    int sample_rate_ = 16000;
+
+    size_t FindPage(size_t start) const;
+};
+
+#endif // OGG_OPUS_READER_H
@@ -0,0 +1,374 @@
+#include "opus_benchmark.h"
+
+#if CONFIG_OPUS_BENCHMARK
+
+#include <esp_log.h>
+#include <esp_cpu.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <esp_clk_tree.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/idf_additions.h>
+#include <opus.h>
+#include <cJSON.h>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+
+#define TAG "OpusBenchmark"
+
+// The codec runs at a higher priority than the main task, on its core, so the main task only
+// picks up the results once the codec task is done
+#define BENCHMARK_TASK_PRIORITY 10
+#define BENCHMARK_TASK_STACK_SIZE (32 * 1024)
+// Every this many packets, one is lost on the way to the decoder
+#define BENCHMARK_LOSS_INTERVAL 10
+#define BENCHMARK_LOSS_PERCENT (100 / BENCHMARK_LOSS_INTERVAL)
+#define BENCHMARK_MAX_PACKET 4000
+
+namespace {
+
+struct Setting {
+    int sample_rate;
+    int frame_ms;
+    int complexity;
+    int bitrate;    // OPUS_AUTO or bits per second
+    bool fec;
+    bool dtx;
+};
+
+struct Placement {
+    const char* name;
+    bool stack_psram;
+    bool state_psram;
+};
+
+const Placement kPlacements[] = {
+    {"internal", false, false},
+#if CONFIG_SPIRAM
+    {"psram_stack", true, false},
+    {"psram_state", false, true},
+    {"psram", true, true},
+#endif
+};
+
+const int kSampleRates[] = {8000, 16000, 24000};
+const int kFrameDurations[] = {20, 40, 60};
+const int kComplexities[] = {0, 1, 3, 5, 8, 10};
+const int kBitrates[] = {OPUS_AUTO, 12000, 16000, 24000, 32000};
+// FEC, DTX
+const bool kModes[][2] = {{false, false}, {true, false}, {false, true}, {true, true}};
+
+const Setting kBaseline = {16000, CONFIG_AUDIO_OPUS_FRAME_DURATION_MS, 0, OPUS_AUTO, false, false};
+
+struct Timing {
+    uint32_t count = 0;
+    uint64_t total_cycles = 0;
+    uint32_t max_cycles = 0;
+
+    void Add(uint32_t cycles) {
+        count++;
+        total_cycles += cycles;
+        max_cycles = std::max(max_cycles, cycles);
+    }
+
+    void AddTo(cJSON* root, const char* name, uint32_t cpu_mhz) const {
+        uint32_t average = count > 0 ? total_cycles / count : 0;
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "count", count);
+        cJSON_AddNumberToObject(item, "cycles_avg", average);
+        cJSON_AddNumberToObject(item, "cycles_max", max_cycles);
+        cJSON_AddNumberToObject(item, "us_avg", average / cpu_mhz);
+        cJSON_AddNumberToObject(item, "us_max", max_cycles / cpu_mhz);
+        cJSON_AddItemToObject(root, name, item);
+    }
+};
+
+struct Run {
+    Setting setting;
+    Placement placement;
+    TaskHandle_t caller;
+    // Results
+    bool ok = false;
+    Timing encode;
+    Timing decode;
+    Timing conceal;     // The lost packets, concealed or recovered with the FEC of the next one
+    uint64_t encoded_bytes = 0;
+    uint32_t dtx_frames = 0;
+    size_t encoder_state = 0;
+    size_t decoder_state = 0;
+    size_t heap_internal = 0;
+    size_t heap_psram = 0;
+};
+
+/*
+ * A voice-like test signal: a few harmonics of a pitch gliding between 100 and 220 Hz, shaped
+ * into syllables of about 250 ms, with a pause of 600 ms every 2.4 s so that DTX has silence to
+ * skip. A little noise keeps the pauses from being digital silence.
+ */
+class Voice {
+public:
+    explicit Voice(int sample_rate) : sample_rate_(sample_rate) {}
+
+    void Fill(int16_t* pcm, int samples) {
+        for (int i = 0; i < samples; i++, n_++) {
+            float t = (float)n_ / sample_rate_;
+            float f0 = 160.0f + 60.0f * sinf(2 * (float)M_PI * 0.3f * t);
+            phase_ += 2 * (float)M_PI * f0 / sample_rate_;
+            if (phase_ > 2 * (float)M_PI) {
+                phase_ -= 2 * (float)M_PI;
+            }
+            float value = 0;
+            for (int k = 1; k <= 12 && k * f0 < sample_rate_ / 2 && k * f0 < 3400; k++) {
+                value += sinf(k * phase_) / k;
+            }
+            float cycle = fmodf(t, 2.4f);
+            float envelope = cycle < 1.8f ? fabsf(sinf((float)M_PI * 4.0f * cycle)) : 0;
+            noise_ = noise_ * 1664525u + 1013904223u;
+            float noise = (int32_t)noise_ / 2147483648.0f;
+            pcm[i] = (int16_t)(6000.0f * envelope * value + 30.0f * noise);
+        }
+    }
+
+private:
+    int sample_rate_;
+    uint32_t n_ = 0;
+    float phase_ = 0;
+    uint32_t noise_ = 12345;
+};
+
+uint32_t CpuMhz() {
+    uint32_t hz = 0;
+    esp_clk_tree_src_get_freq_hz(SOC_MOD_CLK_CPU, ESP_CLK_TREE_SRC_FREQ_PRECISION_CACHED, &hz);
+    return std::max<uint32_t>(hz / 1000000, 1);
+}
+
+void* AllocateState(size_t size, bool psram) {
+    return heap_caps_malloc(size, psram ? MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT : MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+
+void CodecTask(void* arg) {
+    auto run = static_cast<Run*>(arg);
+    const Setting& setting = run->setting;
+    int frame_samples = setting.sample_rate * setting.frame_ms / 1000;
+    std::vector<int16_t> pcm(frame_samples);
+    std::vector<int16_t> decoded(frame_samples);
+    std::vector<uint8_t> packet(BENCHMARK_MAX_PACKET);
+    size_t internal_before = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    size_t psram_before = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+
+    run->encoder_state = opus_encoder_get_size(1);
+    run->decoder_state = opus_decoder_get_size(1);
+    auto encoder = (OpusEncoder*)AllocateState(run->encoder_state, run->placement.state_psram);
+    auto decoder = (OpusDecoder*)AllocateState(run->decoder_state, run->placement.state_psram);
+
+    if (encoder != nullptr && decoder != nullptr &&
+        opus_encoder_init(encoder, setting.sample_rate, 1, OPUS_APPLICATION_VOIP) == OPUS_OK &&
+        opus_decoder_init(decoder, setting.sample_rate, 1) == OPUS_OK) {
+        opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(setting.complexity));
+        opus_encoder_ctl(encoder, OPUS_SET_BITRATE(setting.bitrate));
+        opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(setting.fec ? 1 : 0));
+        opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(setting.fec ? BENCHMARK_LOSS_PERCENT : 0));
+        opus_encoder_ctl(encoder, OPUS_SET_DTX(setting.dtx ? 1 : 0));
+
+        Voice voice(setting.sample_rate);
+        int frames = CONFIG_OPUS_BENCHMARK_SECONDS * 1000 / setting.frame_ms;
+        bool previous_lost = false;
+        run->ok = true;
+        for (int i = 0; i < frames && run->ok; i++) {
+            voice.Fill(pcm.data(), frame_samples);
+            uint32_t start = esp_cpu_get_cycle_count();
+            int bytes = opus_encode(encoder, pcm.data(), frame_samples, packet.data(), packet.size());
+            run->encode.Add(esp_cpu_get_cycle_count() - start);
+            if (bytes < 0) {
+                ESP_LOGE(TAG, "opus_encode: %s", opus_strerror(bytes));
+                run->ok = false;
+                break;
+            }
+            run->encoded_bytes += bytes;
+            if (bytes <= 2) {
+                run->dtx_frames++;
+            }
+
+            if (previous_lost) {
+                // The lost frame first: from the FEC of this packet, or concealed
+                start = esp_cpu_get_cycle_count();
+                if (setting.fec) {
+                    opus_decode(decoder, packet.data(), bytes, decoded.data(), frame_samples, 1);
+                } else {
+                    opus_decode(decoder, nullptr, 0, decoded.data(), frame_samples, 0);
+                }
+                run->conceal.Add(esp_cpu_get_cycle_count() - start);
+                previous_lost = false;
+            }
+            if (i % BENCHMARK_LOSS_INTERVAL == BENCHMARK_LOSS_INTERVAL - 1) {
+                previous_lost = true;
+                continue;
+            }
+            start = esp_cpu_get_cycle_count();
+            int samples = opus_decode(decoder, packet.data(), bytes, decoded.data(), frame_samples, 0);
+            run->decode.Add(esp_cpu_get_cycle_count() - start);
+            if (samples < 0) {
+                ESP_LOGE(TAG, "opus_decode: %s", opus_strerror(samples));
+                run->ok = false;
+            }
+        }
+    }
+    // What the codecs hold at the end, the states and whatever libopus allocated on the way
+    run->heap_internal = internal_before - std::min(internal_before, heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    run->heap_psram = psram_before - std::min(psram_before, heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+    heap_caps_free(encoder);
+    heap_caps_free(decoder);
+
+    xTaskNotifyGive(run->caller);
+    // Deleted by the caller, after it read the stack high-water mark
+    vTaskSuspend(nullptr);
+}
+
+void Print(Run& run, uint32_t stack_used, uint32_t cpu_mhz) {
+    const Setting& setting = run.setting;
+    auto root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "type", "result");
+    cJSON_AddStringToObject(root, "target", CONFIG_IDF_TARGET);
+    cJSON_AddNumberToObject(root, "cpu_mhz", cpu_mhz);
+    cJSON_AddStringToObject(root, "placement", run.placement.name);
+    cJSON_AddNumberToObject(root, "sample_rate", setting.sample_rate);
+    cJSON_AddNumberToObject(root, "frame_ms", setting.frame_ms);
+    cJSON_AddNumberToObject(root, "complexity", setting.complexity);
+    if (setting.bitrate == OPUS_AUTO) {
+        cJSON_AddStringToObject(root, "bitrate", "auto");
+    } else {
+        cJSON_AddNumberToObject(root, "bitrate", setting.bitrate);
+    }
+    cJSON_AddBoolToObject(root, "fec", setting.fec);
+    cJSON_AddBoolToObject(root, "dtx", setting.dtx);
+    cJSON_AddBoolToObject(root, "ok", run.ok);
+    run.encode.AddTo(root, "encode", cpu_mhz);
+    run.decode.AddTo(root, "decode", cpu_mhz);
+    run.conceal.AddTo(root, "conceal", cpu_mhz);
+    uint64_t frame_cycles = (uint64_t)setting.frame_ms * 1000 * cpu_mhz;
+    cJSON_AddNumberToObject(root, "encode_load_pct",
+        run.encode.count > 0 ? run.encode.total_cycles * 100.0 / run.encode.count / frame_cycles : 0);
+    cJSON_AddNumberToObject(root, "actual_bitrate",
+        run.encode.count > 0 ? run.encoded_bytes * 8 * 1000 / ((uint64_t)run.encode.count * setting.frame_ms) : 0);
+    cJSON_AddNumberToObject(root, "dtx_frames", run.dtx_frames);
+    cJSON_AddNumberToObject(root, "encoder_state", run.encoder_state);
+    cJSON_AddNumberToObject(root, "decoder_state", run.decoder_state);
+    cJSON_AddNumberToObject(root, "stack_used", stack_used);
+    cJSON_AddNumberToObject(root, "heap_internal", run.heap_internal);
+    cJSON_AddNumberToObject(root, "heap_psram", run.heap_psram);
+    auto json = cJSON_PrintUnformatted(root);
+    printf(OPUS_BENCHMARK_PREFIX "%s\n", json);
+    cJSON_free(json);
+    cJSON_Delete(root);
+}
+
+// Runs the setting once per placement
+int RunSetting(const Setting& setting, uint32_t cpu_mhz) {
+    int runs = 0;
+    for (auto& placement : kPlacements) {
+        Run run;
+        run.setting = setting;
+        run.placement = placement;
+        run.caller = xTaskGetCurrentTaskHandle();
+        uint32_t caps = placement.stack_psram ? MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT : MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+        TaskHandle_t task = nullptr;
+        if (xTaskCreatePinnedToCoreWithCaps(CodecTask, "opus_bench", BENCHMARK_TASK_STACK_SIZE, &run,
+                BENCHMARK_TASK_PRIORITY, &task, xPortGetCoreID(), caps) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to create the codec task (%s)", placement.name);
+            continue;
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t stack_used = BENCHMARK_TASK_STACK_SIZE - uxTaskGetStackHighWaterMark(task) * sizeof(StackType_t);
+        vTaskDeleteWithCaps(task);
+        Print(run, stack_used, cpu_mhz);
+        runs++;
+    }
+    return runs;
+}
+
+} // namespace
+
+namespace OpusBenchmark {
+
+void Run() {
+    uint32_t cpu_mhz = CpuMhz();
+    ESP_LOGI(TAG, "Opus sweep on %s at %lu MHz, %d s of audio per setting", CONFIG_IDF_TARGET,
+        cpu_mhz, CONFIG_OPUS_BENCHMARK_SECONDS);
+    int64_t start_us = esp_timer_get_time();
+    int runs = 0;
+
+#if CONFIG_OPUS_BENCHMARK_FULL_GRID
+    for (int sample_rate : kSampleRates) {
+        for (int frame_ms : kFrameDurations) {
+            for (int complexity : kComplexities) {
+                for (int bitrate : kBitrates) {
+                    for (auto& mode : kModes) {
+                        runs += RunSetting({sample_rate, frame_ms, complexity, bitrate, mode[0], mode[1]}, cpu_mhz);
+                    }
+                }
+            }
+        }
+    }
+#else
+    // One setting at a time around the baseline, which runs first
+    runs += RunSetting(kBaseline, cpu_mhz);
+    for (int sample_rate : kSampleRates) {
+        if (sample_rate != kBaseline.sample_rate) {
+            Setting setting = kBaseline;
+            setting.sample_rate = sample_rate;
+            runs += RunSetting(setting, cpu_mhz);
+        }
+    }
+    for (int frame_ms : kFrameDurations) {
+        if (frame_ms != kBaseline.frame_ms) {
+            Setting setting = kBaseline;
+            setting.frame_ms = frame_ms;
+            runs += RunSetting(setting, cpu_mhz);
+        }
+    }
+    for (int complexity : kComplexities) {
+        if (complexity != kBaseline.complexity) {
+            Setting setting = kBaseline;
+            setting.complexity = complexity;
+            runs += RunSetting(setting, cpu_mhz);
+        }
+    }
+    for (int bitrate : kBitrates) {
+        if (bitrate != kBaseline.bitrate) {
+            Setting setting = kBaseline;
+            setting.bitrate = bitrate;
+            runs += RunSetting(setting, cpu_mhz);
+        }
+    }
+    for (auto& mode : kModes) {
+        if (mode[0] != kBaseline.fec || mode[1] != kBaseline.dtx) {
+            Setting setting = kBaseline;
+            setting.fec = mode[0];
+            setting.dtx = mode[1];
+            runs += RunSetting(setting, cpu_mhz);
+        }
+    }
+#endif
+
+    auto root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "type", "summary");
+    cJSON_AddStringToObject(root, "target", CONFIG_IDF_TARGET);
+    cJSON_AddNumberToObject(root, "runs", runs);
+    cJSON_AddNumberToObject(root, "seconds", (esp_timer_get_time() - start_us) / 1000000);
+    auto json = cJSON_PrintUnformatted(root);
+    printf(OPUS_BENCHMARK_PREFIX "%s\n", json);
+    cJSON_free(json);
+    cJSON_Delete(root);
+
+    ESP_LOGI(TAG, "Opus sweep done");
+    while (true) {
+        vTaskDelay(portMAX_DELAY);
+    }
+}
+
+} // namespace OpusBenchmark
+
+#endif // CONFIG_OPUS_BENCHMARK
@@ -0,0 +1,40 @@
+#ifndef OPUS_BENCHMARK_H
+#define OPUS_BENCHMARK_H
+
+#include <sdkconfig.h>
+
+#if CONFIG_OPUS_BENCHMARK
+
+/*
+ * Opus parameter sweep benchmark firmware.
+ *
+ * Replaces the application: a synthetic voice (harmonics with a gliding pitch, syllables and
+ * pauses) is encoded and decoded again for every setting of the sweep: sample rate, frame
+ * duration, complexity, bitrate, in-band FEC and DTX. Every setting runs in a task of its own,
+ * once with the stack and the codec states in internal RAM and, with PSRAM, with either of them
+ * in PSRAM. Every tenth packet is dropped on the decoder side, to time the concealment (or the
+ * FEC recovery) along the normal decodes.
+ *
+ * By default the settings are swept one at a time around the ones of the firmware (16 kHz,
+ * OPUS_FRAME_DURATION_MS, complexity 0, automatic bitrate, no FEC or DTX). With
+ * CONFIG_OPUS_BENCHMARK_FULL_GRID the whole grid is run, which takes hours.
+ *
+ * The settings are set on libopus directly: OpusEncoderWrapper only exposes the complexity and
+ * DTX, and allocates its state itself. The encoder uses the VOIP application like the uplink.
+ *
+ * Every setting prints a JSON line prefixed with OPUS_BENCHMARK_PREFIX: the CPU cycles and time
+ * per frame of the encoder and the decoder (average and max), the share of the frame time the
+ * encoder takes, the actual bitrate, the DTX frames, the state sizes, the stack used and the
+ * heap taken. scripts/opus_benchmark.py turns a captured log into a table per target.
+ */
+
+#define OPUS_BENCHMARK_PREFIX "OPUS_BENCH "
+
+namespace OpusBenchmark {
+    // Runs the sweep, prints the results and never returns
+    void Run();
+}
+
+#endif // CONFIG_OPUS_BENCHMARK
+
+#endif // OPUS_BENCHMARK_H
@@ -0,0 +1,167 @@
+#ifndef PCM_UTILS_H
+#define PCM_UTILS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+/*
+ * Small PCM kernels used on the audio input / output paths.
+ *
+ * They work on raw pointers and never allocate, so callers can run them on persistent
+ * scratch buffers. The loops are unrolled by four and use restrict pointers, which lets
+ * the compiler keep the samples in registers and pair the loads / stores.
+ */
+
+// Split interleaved stereo samples into two mono buffers
+static inline void PcmDeinterleave2(const int16_t* __restrict in, int16_t* __restrict left,
+    int16_t* __restrict right, size_t frames) {
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4, in += 8) {
+        left[i] = in[0];
+        right[i] = in[1];
+        left[i + 1] = in[2];
+        right[i + 1] = in[3];
+        left[i + 2] = in[4];
+        right[i + 2] = in[5];
+        left[i + 3] = in[6];
+        right[i + 3] = in[7];
+    }
+    for (; i < frames; ++i, in += 2) {
+        left[i] = in[0];
+        right[i] = in[1];
+    }
+}
+
+// Merge two mono buffers into interleaved stereo samples
+static inline void PcmInterleave2(const int16_t* __restrict left, const int16_t* __restrict right,
+    int16_t* __restrict out, size_t frames) {
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4, out += 8) {
+        out[0] = left[i];
+        out[1] = right[i];
+        out[2] = left[i + 1];
+        out[3] = right[i + 1];
+        out[4] = left[i + 2];
+        out[5] = right[i + 2];
+        out[6] = left[i + 3];
+        out[7] = right[i + 3];
+    }
+    for (; i < frames; ++i, out += 2) {
+        out[0] = left[i];
+        out[1] = right[i];
+    }
+}
+
+// Keep the first channel of interleaved stereo samples, in place
+static inline void PcmTakeLeftInPlace(int16_t* data, size_t frames) {
+    for (size_t i = 0; i < frames; ++i) {
+        data[i] = data[i * 2];
+    }
+}
+
+// Saturate to the symmetric 16-bit range, min / max map to single instructions on Xtensa
+static inline int16_t PcmSaturate16(int32_t value) {
+    return static_cast<int16_t>(std::min<int32_t>(std::max<int32_t>(value, -INT16_MAX), INT16_MAX));
+}
+
+/*
+ * Scale 16-bit samples to 32-bit I2S slots. With a factor in 0-65536 the product always
+ * fits in 32 bits (32768 * 65536 == 2^31), so no widening or clamping is needed.
+ */
+static inline void PcmScaleToInt32(const int16_t* __restrict in, int32_t* __restrict out, int32_t factor, size_t samples) {
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        out[i] = in[i] * factor;
+        out[i + 1] = in[i + 1] * factor;
+        out[i + 2] = in[i + 2] * factor;
+        out[i + 3] = in[i + 3] * factor;
+    }
+    for (; i < samples; ++i) {
+        out[i] = in[i] * factor;
+    }
+}
+
+// PcmScaleToInt32 with the factor ramping linearly by factor_step per sample
+static inline void PcmScaleToInt32Ramp(const int16_t* __restrict in, int32_t* __restrict out, int32_t factor,
+    int32_t factor_step, size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        out[i] = in[i] * factor;
+        factor += factor_step;
+    }
+}
+
+// Convert 32-bit I2S slots to 16-bit samples, shifting right then saturating
+static inline void PcmInt32ToInt16(const int32_t* __restrict in, int16_t* __restrict out, int shift, size_t samples) {
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        out[i] = PcmSaturate16(in[i] >> shift);
+        out[i + 1] = PcmSaturate16(in[i + 1] >> shift);
+        out[i + 2] = PcmSaturate16(in[i + 2] >> shift);
+        out[i + 3] = PcmSaturate16(in[i + 3] >> shift);
+    }
+    for (; i < samples; ++i) {
+        out[i] = PcmSaturate16(in[i] >> shift);
+    }
+}
+
+// Apply an integer gain to 16-bit samples in place, saturating
+static inline void PcmApplyGain(int16_t* data, int32_t gain, size_t samples) {
+    for (size_t i = 0; i < samples; ++i) {
+        data[i] = PcmSaturate16(data[i] * gain);
+    }
+}
+
+/*
+ * Overlay a sound on a stream frame in one pass, in place: the stream gain ramps linearly
+ * from stream_gain by stream_gain_step per sample (ducking without clicks), the sound has a
+ * fixed gain. Gains are Q15, so 32768 is unity.
+ */
+static inline void PcmMixDucked(int16_t* __restrict stream, const int16_t* __restrict sound, size_t samples,
+    int32_t stream_gain, int32_t stream_gain_step, int32_t sound_gain) {
+    for (size_t i = 0; i < samples; ++i) {
+        int32_t value = (stream[i] * stream_gain + sound[i] * sound_gain) >> 15;
+        stream[i] = PcmSaturate16(value);
+        stream_gain += stream_gain_step;
+    }
+}
+
+// Scale by a Q15 gain ramp, in place
+static inline void PcmApplyGainRamp(int16_t* data, size_t samples, int32_t gain, int32_t gain_step) {
+    for (size_t i = 0; i < samples; ++i) {
+        data[i] = PcmSaturate16((data[i] * gain) >> 15);
+        gain += gain_step;
+    }
+}
+
+// Attenuate by a Q16 gain ramp in place, the gains stay within 0-65536 so nothing overflows
+static inline void PcmAttenuateRamp(int16_t* data, size_t samples, int32_t gain, int32_t gain_step) {
+    for (size_t i = 0; i < samples; ++i) {
+        data[i] = static_cast<int16_t>((data[i] * gain) >> 16);
+        gain += gain_step;
+    }
+}
+
+// Sum of the squares and the peak magnitude, in one pass
+static inline void PcmMeasure(const int16_t* data, size_t samples, uint64_t* sum_squares, int32_t* peak) {
+    uint64_t sum = 0;
+    int32_t max_value = 0;
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        int32_t a = data[i], b = data[i + 1], c = data[i + 2], d = data[i + 3];
+        // Two squares always fit in 32 bits, so half of the adds stay 32-bit
+        sum += (uint32_t)(a * a) + (uint32_t)(b * b);
+        sum += (uint32_t)(c * c) + (uint32_t)(d * d);
+        max_value = std::max(max_value, std::max(std::max(a, -a), std::max(b, -b)));
+        max_value = std::max(max_value, std::max(std::max(c, -c), std::max(d, -d)));
+    }
+    for (; i < samples; ++i) {
+        int32_t a = data[i];
+        sum += (uint32_t)(a * a);
+        max_value = std::max(max_value, std::max(a, -a));
+    }
+    *sum_squares = sum;
+    *peak = max_value;
+}
+
+#endif // PCM_UTILS_H
@@ -1,12 +1,22 @@
 #include "afe_audio_processor.h"
+#include "afe_profile.h"
+#include "task_placement.h"
+#include "trace_recorder.h"
 #include <esp_log.h>
+#include <sdkconfig.h>
+#include <algorithm>
 
 #define PROCESSOR_RUNNING 0x01
+#define PROCESSOR_EXIT    0x02
+#define PROCESSOR_EXITED  0x04
+
+// A fetch gives up after this, so a stopped processor still sees PROCESSOR_EXIT
+#define PROCESSOR_FETCH_TIMEOUT_MS 100
 
 #define TAG "AfeAudioProcessor"
 
 AfeAudioProcessor::AfeAudioProcessor()
-    : afe_data_(nullptr) {
+    : afe_data_(nullptr), profile_(AFE_PROFILE_DEFAULT) {
     event_group_ = xEventGroupCreate();
 }
 
@@ -14,8 +24,8 @@ void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms, srm
     codec_ = codec;
     frame_samples_ = frame_duration_ms * 16000 / 1000;
 
-    // Pre-allocate output buffer capacity
-    output_buffer_.reserve(frame_samples_);
+    // Pre-allocate output frame capacity
+    output_frame_.reserve(frame_samples_);
 
     int ref_num = codec_->input_reference() ? 1 : 0;
 
@@ -34,24 +44,9 @@ void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms, srm
         models = models_list;
     }
 
-    char* ns_model_name = esp_srmodel_filter(models, ESP_NSNET_PREFIX, NULL);
-    char* vad_model_name = esp_srmodel_filter(models, ESP_VADN_PREFIX, NULL);
-    
-    afe_config_t* afe_config = afe_config_init(input_format.c_str(), NULL, AFE_TYPE_VC, AFE_MODE_HIGH_PERF);
-    afe_config->aec_mode = AEC_MODE_VOIP_HIGH_PERF;
-    afe_config->vad_mode = VAD_MODE_0;
-    afe_config->vad_min_noise_ms = 100;
-    if (vad_model_name != nullptr) {
-        afe_config->vad_model_name = vad_model_name;
-    }
-
-    if (ns_model_name != nullptr) {
-        afe_config->ns_init = true;
-        afe_config->ns_model_name = ns_model_name;
-        afe_config->afe_ns_mode = AFE_NS_MODE_NET;
-    } else {
-        afe_config->ns_init = false;
-    }
+    afe_config_t* afe_config = afe_config_init(input_format.c_str(), NULL, AFE_TYPE_VC,
+        GetAfeProfileConfig(profile_).afe_mode);
+    ApplyAfeProfile(afe_config, profile_, models, false);
 
     afe_config->agc_init = false;
     afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
@@ -63,24 +58,48 @@ void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms, srm
     afe_config->aec_init = false;
     afe_config->vad_init = true;
 #endif
+    vad_enabled_ = afe_config->vad_init;
 
     afe_iface_ = esp_afe_handle_from_config(afe_config);
     afe_data_ = afe_iface_->create_from_config(afe_config);
-    
-    xTaskCreate([](void* arg) {
+    {
+        std::lock_guard<std::mutex> lock(cost_mutex_);
+        cost_profile_ = profile_;
+        costs_[profile_].chunk_ms = afe_iface_->get_fetch_chunksize(afe_data_) * 1000 / 16000;
+    }
+
+    xEventGroupClearBits(event_group_, PROCESSOR_EXIT | PROCESSOR_EXITED);
+    TaskPlacements::Create(kTaskAudioProcessor, [](void* arg) {
         auto this_ = (AfeAudioProcessor*)arg;
         this_->AudioProcessorTask();
         vTaskDelete(NULL);
-    }, "audio_communication", 4096, this, 3, NULL);
+    }, this);
 }
 
 AfeAudioProcessor::~AfeAudioProcessor() {
-    if (afe_data_ != nullptr) {
-        afe_iface_->destroy(afe_data_);
-    }
+    Deinitialize();
     vEventGroupDelete(event_group_);
 }
 
+void AfeAudioProcessor::Deinitialize() {
+    if (afe_data_ == nullptr) {
+        return;
+    }
+    xEventGroupClearBits(event_group_, PROCESSOR_RUNNING);
+    xEventGroupSetBits(event_group_, PROCESSOR_EXIT);
+    xEventGroupWaitBits(event_group_, PROCESSOR_EXITED, pdFALSE, pdTRUE, portMAX_DELAY);
+
+    afe_iface_->destroy(afe_data_);
+    afe_data_ = nullptr;
+    output_frame_.clear();
+    output_frame_.shrink_to_fit();
+    is_speaking_ = false;
+}
+
+void AfeAudioProcessor::SetFrameDuration(int frame_duration_ms) {
+    frame_samples_ = frame_duration_ms * 16000 / 1000;
+}
+
 size_t AfeAudioProcessor::GetFeedSize() {
     if (afe_data_ == nullptr) {
         return 0;
@@ -125,9 +144,16 @@ void AfeAudioProcessor::AudioProcessorTask() {
         feed_size, fetch_size);
 
     while (true) {
-        xEventGroupWaitBits(event_group_, PROCESSOR_RUNNING, pdFALSE, pdTRUE, portMAX_DELAY);
+        auto bits = xEventGroupWaitBits(event_group_, PROCESSOR_RUNNING | PROCESSOR_EXIT, pdFALSE, pdFALSE, portMAX_DELAY);
+        if (bits & PROCESSOR_EXIT) {
+            break;
+        }
 
-        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+        // The fetch waits blocked for the audio, only the processing counts in the run time
+        auto run_time = ulTaskGetRunTimeCounter(nullptr);
+#endif
+        auto res = afe_iface_->fetch_with_delay(afe_data_, pdMS_TO_TICKS(PROCESSOR_FETCH_TIMEOUT_MS));
         if ((xEventGroupGetBits(event_group_) & PROCESSOR_RUNNING) == 0) {
             continue;
         }
@@ -137,6 +163,17 @@ void AfeAudioProcessor::AudioProcessorTask() {
             }
             continue;
         }
+        TraceRecorder::GetInstance().Instant("afe_fetch");
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+        {
+            uint32_t cost_us = ulTaskGetRunTimeCounter(nullptr) - run_time;
+            std::lock_guard<std::mutex> lock(cost_mutex_);
+            auto& cost = costs_[cost_profile_];
+            cost.chunks++;
+            cost.total_us += cost_us;
+            cost.max_us = std::max(cost.max_us, cost_us);
+        }
+#endif
 
         // VAD state change
         if (vad_state_change_callback_) {
@@ -150,26 +187,28 @@ void AfeAudioProcessor::AudioProcessorTask() {
         }
 
         if (output_callback_) {
+            const int16_t* data = res->data;
             size_t samples = res->data_size / sizeof(int16_t);
-            
-            // Add data to buffer
-            output_buffer_.insert(output_buffer_.end(), res->data, res->data + samples);
-            
-            // Output complete frames when buffer has enough data
-            while (output_buffer_.size() >= frame_samples_) {
-                if (output_buffer_.size() == frame_samples_) {
-                    // If buffer size equals frame size, move the entire buffer
-                    output_callback_(std::move(output_buffer_));
-                    output_buffer_.clear();
-                    output_buffer_.reserve(frame_samples_);
-                } else {
-                    // If buffer size exceeds frame size, copy one frame and remove it
-                    output_callback_(std::vector<int16_t>(output_buffer_.begin(), output_buffer_.begin() + frame_samples_));
-                    output_buffer_.erase(output_buffer_.begin(), output_buffer_.begin() + frame_samples_);
+
+            // Split the fetched chunk across frames, the fetch size does not have to divide the frame size
+            while (samples > 0) {
+                size_t frame_samples = frame_samples_;
+                if (output_frame_.size() < frame_samples) {
+                    size_t count = std::min(samples, frame_samples - output_frame_.size());
+                    output_frame_.insert(output_frame_.end(), data, data + count);
+                    data += count;
+                    samples -= count;
+                }
+                if (output_frame_.size() >= frame_samples) {
+                    // The consumer swaps a recycled buffer in, so the next frame is filled without allocating
+                    output_callback_(std::move(output_frame_));
+                    output_frame_.clear();
+                    output_frame_.reserve(frame_samples);
                 }
             }
         }
     }
+    xEventGroupSetBits(event_group_, PROCESSOR_EXITED);
 }
 
 void AfeAudioProcessor::EnableDeviceAec(bool enable) {
@@ -177,11 +216,22 @@ void AfeAudioProcessor::EnableDeviceAec(bool enable) {
 #if CONFIG_USE_DEVICE_AEC
         afe_iface_->disable_vad(afe_data_);
         afe_iface_->enable_aec(afe_data_);
+        vad_enabled_ = false;
 #else
         ESP_LOGE(TAG, "Device AEC is not supported");
 #endif
     } else {
         afe_iface_->disable_aec(afe_data_);
         afe_iface_->enable_vad(afe_data_);
+        vad_enabled_ = true;
     }
 }
+
+bool AfeAudioProcessor::IsVadEnabled() {
+    return vad_enabled_;
+}
+
+AudioProcessorCost AfeAudioProcessor::GetCost(AfeProfile profile) {
+    std::lock_guard<std::mutex> lock(cost_mutex_);
+    return costs_[profile];
+}
@@ -6,6 +6,8 @@
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
 
+#include <atomic>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <functional>
@@ -19,6 +21,8 @@ public:
     ~AfeAudioProcessor();
 
     void Initialize(AudioCodec* codec, int frame_duration_ms, srmodel_list_t* models_list) override;
+    void Deinitialize() override;
+    void SetFrameDuration(int frame_duration_ms) override;
     void Feed(std::vector<int16_t>&& data) override;
     void Start() override;
     void Stop() override;
@@ -27,6 +31,10 @@ public:
     void OnVadStateChange(std::function<void(bool speaking)> callback) override;
     size_t GetFeedSize() override;
     void EnableDeviceAec(bool enable) override;
+    bool IsVadEnabled() override;
+    void SetProfile(AfeProfile profile) override { profile_ = profile; }
+    AfeProfile GetProfile() override { return profile_; }
+    AudioProcessorCost GetCost(AfeProfile profile) override;
 
 private:
     EventGroupHandle_t event_group_ = nullptr;
@@ -35,9 +43,17 @@ private:
     std::function<void(std::vector<int16_t>&& data)> output_callback_;
     std::function<void(bool speaking)> vad_state_change_callback_;
     AudioCodec* codec_ = nullptr;
-    int frame_samples_ = 0;
+    // Set by SetFrameDuration() from the caller, read by the input task
+    std::atomic<int> frame_samples_ = 0;
     bool is_speaking_ = false;
-    std::vector<int16_t> output_buffer_;
+    bool vad_enabled_ = false;
+    // The frame being filled, handed to the output callback once it holds frame_samples_
+    std::vector<int16_t> output_frame_;
+    AfeProfile profile_;
+    // The profile the task measures, and what it measured of each, written by the task
+    std::mutex cost_mutex_;
+    AfeProfile cost_profile_ = kAfeProfileHighQuality;
+    AudioProcessorCost costs_[kAfeProfileCount];
 
     void AudioProcessorTask();
 };
@@ -0,0 +1,83 @@
+#include "afe_profile.h"
+
+#include <esp_log.h>
+
+#define TAG "AfeProfile"
+
+namespace {
+
+const AfeProfileConfig kLowPowerProfile = {
+    .afe_mode = AFE_MODE_LOW_COST,
+    .voip_aec_mode = AEC_MODE_VOIP_LOW_COST,
+    .sr_aec_mode = AEC_MODE_SR_LOW_COST,
+    .aec_filter_length = 2,
+    .ns_mode = AFE_NS_MODE_WEBRTC,
+    .vad_net = false,
+    // The WebRTC VAD misses more of the quiet speech, a more eager mode makes up for it
+    .vad_mode = VAD_MODE_1,
+    .vad_min_noise_ms = 100,
+};
+
+const AfeProfileConfig kBalancedProfile = {
+    .afe_mode = AFE_MODE_HIGH_PERF,
+    .voip_aec_mode = AEC_MODE_VOIP_LOW_COST,
+    .sr_aec_mode = AEC_MODE_SR_LOW_COST,
+    .aec_filter_length = 3,
+    .ns_mode = AFE_NS_MODE_NET,
+    .vad_net = true,
+    .vad_mode = VAD_MODE_0,
+    .vad_min_noise_ms = 100,
+};
+
+const AfeProfileConfig kHighQualityProfile = {
+    .afe_mode = AFE_MODE_HIGH_PERF,
+    .voip_aec_mode = AEC_MODE_VOIP_HIGH_PERF,
+    .sr_aec_mode = AEC_MODE_SR_HIGH_PERF,
+    .aec_filter_length = 4,
+    .ns_mode = AFE_NS_MODE_NET,
+    .vad_net = true,
+    .vad_mode = VAD_MODE_0,
+    .vad_min_noise_ms = 100,
+};
+
+} // namespace
+
+const AfeProfileConfig& GetAfeProfileConfig(AfeProfile profile) {
+    switch (profile) {
+        case kAfeProfileLowPower:
+            return kLowPowerProfile;
+        case kAfeProfileBalanced:
+            return kBalancedProfile;
+        default:
+            return kHighQualityProfile;
+    }
+}
+
+bool ApplyAfeProfile(afe_config_t* afe_config, AfeProfile profile, srmodel_list_t* models, bool sr) {
+    auto& config = GetAfeProfileConfig(profile);
+    afe_config->aec_mode = sr ? config.sr_aec_mode : config.voip_aec_mode;
+    afe_config->aec_filter_length = config.aec_filter_length;
+    afe_config->vad_mode = config.vad_mode;
+    afe_config->vad_min_noise_ms = config.vad_min_noise_ms;
+
+    char* vad_model_name = config.vad_net ? esp_srmodel_filter(models, ESP_VADN_PREFIX, NULL) : nullptr;
+    // Without a model name the AFE falls back to the WebRTC VAD
+    afe_config->vad_model_name = vad_model_name;
+
+    char* ns_model_name = nullptr;
+    if (config.ns_mode == AFE_NS_MODE_NET) {
+        ns_model_name = esp_srmodel_filter(models, ESP_NSNET_PREFIX, NULL);
+        afe_config->ns_init = ns_model_name != nullptr;
+    } else {
+        afe_config->ns_init = true;
+    }
+    afe_config->ns_model_name = ns_model_name;
+    afe_config->afe_ns_mode = config.ns_mode;
+
+    bool high_perf = afe_config->aec_mode == AEC_MODE_SR_HIGH_PERF || afe_config->aec_mode == AEC_MODE_VOIP_HIGH_PERF;
+    ESP_LOGI(TAG, "Profile %s: %s AEC, filter length %d, NS %s, %s VAD mode %d", AfeProfileName(profile),
+        high_perf ? "high perf" : "low cost", config.aec_filter_length,
+        !afe_config->ns_init ? "off" : (ns_model_name != nullptr ? "net" : "webrtc"),
+        vad_model_name != nullptr ? "net" : "webrtc", (int)config.vad_mode);
+    return afe_config->ns_init;
+}
@@ -0,0 +1,37 @@
+#ifndef AFE_PROFILE_H
+#define AFE_PROFILE_H
+
+#include <esp_afe_config.h>
+#include <model_path.h>
+
+#include "audio_processor.h"
+
+/*
+ * The AFE settings of a processing profile.
+ *
+ * The high quality profile is what the processors always used: the high performance AEC, the
+ * net NS and the net VAD when their models are in the partition. The balanced profile keeps the
+ * models but runs the low cost AEC with a shorter filter, the low power profile drops the models
+ * for the WebRTC NS and VAD and runs the whole AFE in its low cost mode. On the boards that
+ * also drive a large display or a camera the AFE alone can fill a core, they default to one of
+ * the lighter profiles.
+ */
+struct AfeProfileConfig {
+    afe_mode_t afe_mode;
+    afe_aec_mode_t voip_aec_mode;   // AFE_TYPE_VC, the voice processing
+    afe_aec_mode_t sr_aec_mode;     // AFE_TYPE_SR, the shared AFE with WakeNet
+    int aec_filter_length;          // In frames of 16 ms
+    // AFE_NS_MODE_NET runs the NSNet model, no NS without it. AFE_NS_MODE_WEBRTC needs no model
+    afe_ns_mode_t ns_mode;
+    bool vad_net;                   // The VADNet model if present, the WebRTC VAD otherwise
+    vad_mode_t vad_mode;
+    int vad_min_noise_ms;
+};
+
+const AfeProfileConfig& GetAfeProfileConfig(AfeProfile profile);
+
+// Sets the AEC, NS and VAD fields of a config from afe_config_init(), the caller decides what is
+// initialized. Returns whether the NS is on
+bool ApplyAfeProfile(afe_config_t* afe_config, AfeProfile profile, srmodel_list_t* models, bool sr);
+
+#endif // AFE_PROFILE_H
@@ -3,15 +3,23 @@
 
 #if CONFIG_USE_AUDIO_DEBUGGER
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
 #include <cstring>
 #include <string>
+#include <algorithm>
+
+#include "task_placement.h"
 #endif
 
 #define TAG "AudioDebugger"
 
+// Whole chunks of every channel that fit a datagram with its header
+#define AUDIO_DEBUG_CHUNK_BYTES (AUDIO_DEBUG_DATAGRAM_SIZE - 8 - sizeof(ChunkHeader))
+
 
 AudioDebugger::AudioDebugger() {
 #if CONFIG_USE_AUDIO_DEBUGGER
@@ -39,11 +47,47 @@ AudioDebugger::AudioDebugger() {
     } else {
         ESP_LOGW(TAG, "Failed to create UDP socket: %d", errno);
     }
+    if (udp_sockfd_ < 0) {
+        return;
+    }
+
+#if CONFIG_AUDIO_DEBUG_TAP_MIC
+    streams_ |= 1u << kAudioDebugStreamMic;
+#endif
+#if CONFIG_AUDIO_DEBUG_TAP_REFERENCE
+    streams_ |= 1u << kAudioDebugStreamReference;
+#endif
+#if CONFIG_AUDIO_DEBUG_TAP_PROCESSED
+    streams_ |= 1u << kAudioDebugStreamProcessed;
+#endif
+#if CONFIG_AUDIO_DEBUG_TAP_PLAYBACK
+    streams_ |= 1u << kAudioDebugStreamPlayback;
+#endif
+
+    size_t ring_size = CONFIG_AUDIO_DEBUG_RING_KB * 1024;
+    ring_ = xRingbufferCreateWithCaps(ring_size, RINGBUF_TYPE_NOSPLIT, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (ring_ == nullptr) {
+        ring_ = xRingbufferCreateWithCaps(ring_size, RINGBUF_TYPE_NOSPLIT, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+    if (ring_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the ring buffer of %u bytes", ring_size);
+        return;
+    }
+    datagram_.reserve(AUDIO_DEBUG_DATAGRAM_SIZE);
+    TaskPlacements::Create(kTaskAudioDebugger, [](void* arg) {
+        ((AudioDebugger*)arg)->SenderTask();
+    }, this, &task_);
 #endif
 }
 
 AudioDebugger::~AudioDebugger() {
 #if CONFIG_USE_AUDIO_DEBUGGER
+    if (task_ != nullptr) {
+        TaskPlacements::Delete(kTaskAudioDebugger, task_);
+    }
+    if (ring_ != nullptr) {
+        vRingbufferDeleteWithCaps(ring_);
+    }
     if (udp_sockfd_ >= 0) {
         close(udp_sockfd_);
         ESP_LOGI(TAG, "Closed UDP socket");
@@ -51,18 +95,102 @@ AudioDebugger::~AudioDebugger() {
 #endif
 }
 
-void AudioDebugger::Feed(const std::vector<int16_t>& data) {
+void AudioDebugger::Feed(AudioDebugStream stream, const int16_t* data, size_t samples, int sample_rate, int channels) {
 #if CONFIG_USE_AUDIO_DEBUGGER
-    if (udp_sockfd_ >= 0) {
-        ssize_t sent = sendto(udp_sockfd_, data.data(), data.size() * sizeof(int16_t), 0,
-                             (struct sockaddr*)&udp_server_addr_, sizeof(udp_server_addr_));
-        if (sent < 0) {
-            ESP_LOGW(TAG, "Failed to send audio data to %s: %d", CONFIG_AUDIO_DEBUG_UDP_SERVER, errno);
+    if (!IsEnabled(stream) || channels <= 0) {
+        return;
+    }
+    size_t max_samples = AUDIO_DEBUG_CHUNK_BYTES / sizeof(int16_t) / channels * channels;
+    uint32_t timestamp_ms = esp_timer_get_time() / 1000;
+    while (samples > 0) {
+        size_t count = std::min(samples, max_samples);
+        ChunkHeader header = {
+            .stream = stream,
+            .channels = (uint8_t)channels,
+            .samples = (uint16_t)count,
+            .sample_rate = (uint32_t)sample_rate,
+            .sequence = sequences_[stream]++,
+            .timestamp_ms = timestamp_ms,
+        };
+        // Written in place and never waits, the host tells the dropped chunks from the sequence gaps
+        void* item = nullptr;
+        if (xRingbufferSendAcquire(ring_, &item, sizeof(header) + count * sizeof(int16_t), 0) == pdTRUE) {
+            memcpy(item, &header, sizeof(header));
+            memcpy((uint8_t*)item + sizeof(header), data, count * sizeof(int16_t));
+            xRingbufferSendComplete(ring_, item);
         } else {
-            ESP_LOGD(TAG, "Sent %d bytes audio data to %s", sent, CONFIG_AUDIO_DEBUG_UDP_SERVER);
+            dropped_++;
+        }
+        data += count;
+        samples -= count;
+    }
+#endif
+}
+
+void AudioDebugger::FeedInput(const std::vector<int16_t>& data, int sample_rate, int channels, bool reference) {
+#if CONFIG_USE_AUDIO_DEBUGGER
+    if (!reference || channels < 2 || !IsEnabled(kAudioDebugStreamReference)) {
+        Feed(kAudioDebugStreamMic, data.data(), data.size(), sample_rate, channels);
+        return;
+    }
+    // Only the input task feeds it
+    size_t frames = data.size() / channels;
+    int mic_channels = channels - 1;
+    channel_buffer_.resize(data.size());
+    int16_t* mic = channel_buffer_.data();
+    int16_t* ref = mic + frames * mic_channels;
+    for (size_t i = 0; i < frames; i++) {
+        for (int c = 0; c < mic_channels; c++) {
+            mic[i * mic_channels + c] = data[i * channels + c];
         }
+        ref[i] = data[i * channels + mic_channels];
     }
+    Feed(kAudioDebugStreamMic, mic, frames * mic_channels, sample_rate, mic_channels);
+    Feed(kAudioDebugStreamReference, ref, frames, sample_rate, 1);
 #endif
 }
 
- 
\ No newline at end of file
+void AudioDebugger::Send() {
+#if CONFIG_USE_AUDIO_DEBUGGER
+    ssize_t sent = sendto(udp_sockfd_, datagram_.data(), datagram_.size(), 0,
+                         (struct sockaddr*)&udp_server_addr_, sizeof(udp_server_addr_));
+    if (sent < 0) {
+        ESP_LOGW(TAG, "Failed to send audio data to %s: %d", CONFIG_AUDIO_DEBUG_UDP_SERVER, errno);
+    }
+    datagram_.clear();
+#endif
+}
+
+void AudioDebugger::SenderTask() {
+#if CONFIG_USE_AUDIO_DEBUGGER
+    uint32_t reported_drops = 0;
+    int64_t reported_us = 0;
+    while (true) {
+        size_t size;
+        void* item = xRingbufferReceive(ring_, &size, portMAX_DELAY);
+        // Everything queued meanwhile goes out in as few datagrams as fit
+        while (item != nullptr) {
+            if (!datagram_.empty() && datagram_.size() + size > AUDIO_DEBUG_DATAGRAM_SIZE) {
+                Send();
+            }
+            if (datagram_.empty()) {
+                uint32_t sequence = datagram_sequence_++;
+                datagram_.insert(datagram_.end(), AUDIO_DEBUG_MAGIC, AUDIO_DEBUG_MAGIC + 4);
+                datagram_.insert(datagram_.end(), (uint8_t*)&sequence, (uint8_t*)&sequence + sizeof(sequence));
+            }
+            datagram_.insert(datagram_.end(), (uint8_t*)item, (uint8_t*)item + size);
+            vRingbufferReturnItem(ring_, item);
+            item = xRingbufferReceive(ring_, &size, 0);
+        }
+        Send();
+
+        uint32_t dropped = dropped_;
+        int64_t now_us = esp_timer_get_time();
+        if (dropped != reported_drops && now_us - reported_us >= 1000000) {
+            ESP_LOGW(TAG, "%lu chunks dropped, the link is slower than the tapped audio", dropped - reported_drops);
+            reported_drops = dropped;
+            reported_us = now_us;
+        }
+    }
+#endif
+}
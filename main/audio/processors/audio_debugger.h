@@ -2,21 +2,74 @@
 #define AUDIO_DEBUGGER_H
 
 #include <vector>
+#include <atomic>
 #include <cstdint>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/ringbuf.h>
 
+// Datagrams stay below the Wi-Fi MTU, so they are never fragmented
+#define AUDIO_DEBUG_DATAGRAM_SIZE 1400
+#define AUDIO_DEBUG_MAGIC "ADBG"
+
+// The tap points, the stream id of the chunks
+enum AudioDebugStream : uint8_t {
+    kAudioDebugStreamMic = 0,       // Microphone channels as read from the codec
+    kAudioDebugStreamReference,     // AEC reference channel of the codec
+    kAudioDebugStreamProcessed,     // Output of the audio processor (AFE)
+    kAudioDebugStreamPlayback,      // Decoded audio written to the codec
+    kAudioDebugStreamCount,
+};
+
+/*
+ * Sends tapped PCM to a host over UDP, see scripts/audio_debug_server.py.
+ *
+ * Feed() only copies the samples with a chunk header into a ring buffer and never blocks: when
+ * the ring is full the chunk is dropped and counted, so a slow link cannot stall the audio
+ * tasks. A low priority task packs the chunks into datagrams of up to AUDIO_DEBUG_DATAGRAM_SIZE.
+ *
+ * Datagram: "ADBG", uint32 datagram sequence, then chunks of
+ *   uint8 stream, uint8 channels, uint16 samples (all channels), uint32 sample rate,
+ *   uint32 chunk sequence (per stream), uint32 timestamp (ms since boot), int16 samples[]
+ * all little endian.
+ */
 class AudioDebugger {
 public:
     AudioDebugger();
     ~AudioDebugger();
 
-    void Feed(const std::vector<int16_t>& data);
+    bool IsEnabled(AudioDebugStream stream) const { return ring_ != nullptr && (streams_ & (1u << stream)) != 0; }
+    void Feed(AudioDebugStream stream, const int16_t* data, size_t samples, int sample_rate, int channels = 1);
+    // The codec input, its last channel goes to the reference stream when it is the reference
+    void FeedInput(const std::vector<int16_t>& data, int sample_rate, int channels, bool reference);
 
 private:
+    struct __attribute__((packed)) ChunkHeader {
+        uint8_t stream;
+        uint8_t channels;
+        uint16_t samples;
+        uint32_t sample_rate;
+        uint32_t sequence;
+        uint32_t timestamp_ms;
+    };
+
     int udp_sockfd_ = -1;
     struct sockaddr_in udp_server_addr_;
+    uint32_t streams_ = 0;
+    RingbufHandle_t ring_ = nullptr;
+    TaskHandle_t task_ = nullptr;
+    std::atomic<uint32_t> sequences_[kAudioDebugStreamCount] = {};
+    std::atomic<uint32_t> dropped_ = 0;
+    // Only touched by the sender task
+    std::vector<uint8_t> datagram_;
+    uint32_t datagram_sequence_ = 0;
+    std::vector<int16_t> channel_buffer_;
+
+    void SenderTask();
+    void Send();
 };
 
-#endif 
\ No newline at end of file
+#endif
@@ -1,6 +1,7 @@
 #ifndef DUMMY_AUDIO_PROCESSOR_H
 #define DUMMY_AUDIO_PROCESSOR_H
 
+#include <atomic>
 #include <vector>
 #include <functional>
 
@@ -13,6 +14,8 @@ public:
     ~NoAudioProcessor() = default;
 
     void Initialize(AudioCodec* codec, int frame_duration_ms, srmodel_list_t* models_list) override;
+    void Deinitialize() override {}
+    void SetFrameDuration(int frame_duration_ms) override;
     void Feed(std::vector<int16_t>&& data) override;
     void Start() override;
     void Stop() override;
@@ -21,10 +24,12 @@ public:
     void OnVadStateChange(std::function<void(bool speaking)> callback) override;
     size_t GetFeedSize() override;
     void EnableDeviceAec(bool enable) override;
+    bool IsVadEnabled() override;
 
 private:
     AudioCodec* codec_ = nullptr;
-    int frame_samples_ = 0;
+    // Set by SetFrameDuration() from the caller, read by the input task
+    std::atomic<int> frame_samples_ = 0;
     std::function<void(std::vector<int16_t>&& data)> output_callback_;
     std::function<void(bool speaking)> vad_state_change_callback_;
     bool is_running_ = false;
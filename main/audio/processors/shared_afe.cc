@@ -0,0 +1,340 @@
+#include "shared_afe.h"
+#include "afe_profile.h"
+#include "wake_words/shared_afe_wake_word.h"
+#include "audio_service.h"
+#include "task_placement.h"
+#include "trace_recorder.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define SHARED_AFE_WAKE_WORD_RUNNING 0x01
+#define SHARED_AFE_PROCESSOR_RUNNING 0x02
+#define SHARED_AFE_HANDOFF           0x04
+#define SHARED_AFE_EXIT              0x08
+#define SHARED_AFE_EXITED            0x10
+
+// A fetch gives up after this, so a stopped instance still sees SHARED_AFE_EXIT
+#define SHARED_AFE_FETCH_TIMEOUT_MS 100
+
+#define TAG "SharedAfe"
+
+SharedAfe::SharedAfe() {
+    event_group_ = xEventGroupCreate();
+}
+
+SharedAfe::~SharedAfe() {
+    Deinitialize();
+    vEventGroupDelete(event_group_);
+}
+
+void SharedAfe::Initialize(AudioCodec* codec, int frame_duration_ms, srmodel_list_t* models_list) {
+    frame_samples_ = frame_duration_ms * 16000 / 1000;
+    output_frame_.reserve(frame_samples_);
+    Create(codec, models_list);
+}
+
+bool SharedAfe::Create(AudioCodec* codec, srmodel_list_t* models_list) {
+    if (afe_data_ != nullptr) {
+        return true;
+    }
+    codec_ = codec;
+    if (frame_samples_ == 0) {
+        // The wake word came first, the session sets the frame duration later
+        frame_samples_ = OPUS_FRAME_DURATION_MS * 16000 / 1000;
+    }
+
+    if (models_list == nullptr) {
+        models_ = esp_srmodel_init("model");
+        owns_models_ = true;
+    } else {
+        models_ = models_list;
+        owns_models_ = false;
+    }
+
+    int ref_num = codec_->input_reference() ? 1 : 0;
+    std::string input_format;
+    for (int i = 0; i < codec_->input_channels() - ref_num; i++) {
+        input_format.push_back('M');
+    }
+    for (int i = 0; i < ref_num; i++) {
+        input_format.push_back('R');
+    }
+
+    has_wakenet_ = with_wake_word_ && esp_srmodel_filter(models_, ESP_WN_PREFIX, NULL) != nullptr;
+
+    afe_mode_t afe_mode = GetAfeProfileConfig(profile_).afe_mode;
+    afe_config_t* afe_config;
+    if (has_wakenet_) {
+        afe_config = afe_config_init(input_format.c_str(), models_, AFE_TYPE_SR, afe_mode);
+        // The wake word barges in while speaking, the echo has to go
+        afe_config->aec_init = codec_->input_reference();
+        auto& afe_placement = TaskPlacements::Get(kTaskWakeWordAfe);
+        afe_config->afe_perferred_core = afe_placement.core == tskNO_AFFINITY ? 0 : afe_placement.core;
+        afe_config->afe_perferred_priority = afe_placement.priority;
+    } else {
+        afe_config = afe_config_init(input_format.c_str(), NULL, AFE_TYPE_VC, afe_mode);
+        afe_config->aec_init = false;
+    }
+
+    afe_config->vad_init = true;
+    has_ns_ = ApplyAfeProfile(afe_config, profile_, models_, has_wakenet_);
+    afe_config->agc_init = false;
+    afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
+
+    afe_iface_ = esp_afe_handle_from_config(afe_config);
+    afe_data_ = afe_iface_->create_from_config(afe_config);
+    if (afe_data_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create the AFE");
+        if (owns_models_) {
+            esp_srmodel_deinit(models_);
+            models_ = nullptr;
+        }
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(cost_mutex_);
+        cost_profile_ = profile_;
+        costs_[profile_].chunk_ms = afe_iface_->get_fetch_chunksize(afe_data_) * 1000 / 16000;
+    }
+
+    if (has_wakenet_) {
+        // Each stage runs only while its side is started
+        afe_iface_->disable_wakenet(afe_data_);
+        if (has_ns_) {
+            afe_iface_->disable_ns(afe_data_);
+        }
+    }
+    ESP_LOGI(TAG, "Created %s AFE, profile %s, NS %s", has_wakenet_ ? "SR" : "VC", AfeProfileName(profile_), has_ns_ ? "on" : "off");
+
+    xEventGroupClearBits(event_group_, SHARED_AFE_EXIT | SHARED_AFE_EXITED);
+    TaskPlacements::Create(kTaskAudioProcessor, [](void* arg) {
+        auto this_ = (SharedAfe*)arg;
+        this_->FetchTask();
+        vTaskDelete(NULL);
+    }, this);
+    return true;
+}
+
+void SharedAfe::Deinitialize() {
+    if (afe_data_ == nullptr) {
+        return;
+    }
+    xEventGroupClearBits(event_group_, SHARED_AFE_WAKE_WORD_RUNNING | SHARED_AFE_PROCESSOR_RUNNING | SHARED_AFE_HANDOFF);
+    xEventGroupSetBits(event_group_, SHARED_AFE_EXIT);
+    xEventGroupWaitBits(event_group_, SHARED_AFE_EXITED, pdFALSE, pdTRUE, portMAX_DELAY);
+
+    afe_iface_->destroy(afe_data_);
+    afe_data_ = nullptr;
+    if (models_ != nullptr && owns_models_) {
+        esp_srmodel_deinit(models_);
+    }
+    models_ = nullptr;
+    output_frame_.clear();
+    output_frame_.shrink_to_fit();
+    handoff_.clear();
+    handoff_.shrink_to_fit();
+    is_speaking_ = false;
+}
+
+void SharedAfe::SetFrameDuration(int frame_duration_ms) {
+    frame_samples_ = frame_duration_ms * 16000 / 1000;
+}
+
+size_t SharedAfe::GetFeedSize() {
+    if (afe_data_ == nullptr) {
+        return 0;
+    }
+    return afe_iface_->get_feed_chunksize(afe_data_);
+}
+
+void SharedAfe::Feed(std::vector<int16_t>&& data) {
+    if (afe_data_ == nullptr) {
+        return;
+    }
+    afe_iface_->feed(afe_data_, data.data());
+}
+
+void SharedAfe::Start() {
+    if (afe_data_ != nullptr && has_wakenet_ && has_ns_) {
+        afe_iface_->enable_ns(afe_data_);
+    }
+    // The fetch task sends the handoff audio first
+    xEventGroupSetBits(event_group_, SHARED_AFE_PROCESSOR_RUNNING);
+}
+
+void SharedAfe::Stop() {
+    xEventGroupClearBits(event_group_, SHARED_AFE_PROCESSOR_RUNNING | SHARED_AFE_HANDOFF);
+    if (afe_data_ == nullptr) {
+        return;
+    }
+    if (has_wakenet_ && has_ns_) {
+        afe_iface_->disable_ns(afe_data_);
+    }
+    if ((xEventGroupGetBits(event_group_) & SHARED_AFE_WAKE_WORD_RUNNING) == 0) {
+        afe_iface_->reset_buffer(afe_data_);
+    }
+}
+
+bool SharedAfe::IsRunning() {
+    return xEventGroupGetBits(event_group_) & SHARED_AFE_PROCESSOR_RUNNING;
+}
+
+void SharedAfe::OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) {
+    output_callback_ = callback;
+}
+
+void SharedAfe::OnVadStateChange(std::function<void(bool speaking)> callback) {
+    vad_state_change_callback_ = callback;
+}
+
+void SharedAfe::EnableDeviceAec(bool enable) {
+    if (enable) {
+        ESP_LOGE(TAG, "Device AEC is not supported");
+    }
+}
+
+bool SharedAfe::IsVadEnabled() {
+    return true;
+}
+
+AudioProcessorCost SharedAfe::GetCost(AfeProfile profile) {
+    std::lock_guard<std::mutex> lock(cost_mutex_);
+    return costs_[profile];
+}
+
+void SharedAfe::SetWakeWord(SharedAfeWakeWord* wake_word) {
+    std::lock_guard<std::mutex> lock(wake_word_mutex_);
+    wake_word_ = wake_word;
+}
+
+void SharedAfe::StartWakeWord() {
+    if (afe_data_ == nullptr || !has_wakenet_) {
+        return;
+    }
+    afe_iface_->enable_wakenet(afe_data_);
+    xEventGroupClearBits(event_group_, SHARED_AFE_HANDOFF);
+    xEventGroupSetBits(event_group_, SHARED_AFE_WAKE_WORD_RUNNING);
+}
+
+void SharedAfe::StopWakeWord() {
+    auto bits = xEventGroupClearBits(event_group_, SHARED_AFE_WAKE_WORD_RUNNING);
+    if (afe_data_ == nullptr || !has_wakenet_) {
+        return;
+    }
+    afe_iface_->disable_wakenet(afe_data_);
+    if ((bits & SHARED_AFE_PROCESSOR_RUNNING) == 0) {
+        // Nothing takes over, drop the handoff
+        xEventGroupClearBits(event_group_, SHARED_AFE_HANDOFF);
+        afe_iface_->reset_buffer(afe_data_);
+    }
+}
+
+void SharedAfe::Output(const int16_t* data, size_t samples) {
+    // Split the fetched chunk across frames, the fetch size does not have to divide the frame size
+    while (samples > 0) {
+        size_t frame_samples = frame_samples_;
+        if (output_frame_.size() < frame_samples) {
+            size_t count = std::min(samples, frame_samples - output_frame_.size());
+            output_frame_.insert(output_frame_.end(), data, data + count);
+            data += count;
+            samples -= count;
+        }
+        if (output_frame_.size() >= frame_samples) {
+            if (output_callback_) {
+                output_callback_(std::move(output_frame_));
+            }
+            output_frame_.clear();
+            output_frame_.reserve(frame_samples);
+        }
+    }
+}
+
+void SharedAfe::FlushHandoff() {
+    if (handoff_.empty()) {
+        return;
+    }
+    ESP_LOGI(TAG, "Sending %d ms of audio since the wake word", (int)(handoff_.size() / 16));
+    std::vector<int16_t> samples(handoff_.begin(), handoff_.end());
+    handoff_.clear();
+    Output(samples.data(), samples.size());
+}
+
+void SharedAfe::FetchTask() {
+    auto fetch_size = afe_iface_->get_fetch_chunksize(afe_data_);
+    auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
+    ESP_LOGI(TAG, "Shared AFE task started, feed size: %d fetch size: %d", feed_size, fetch_size);
+
+    const size_t handoff_capacity = SHARED_AFE_HANDOFF_MS * 16000 / 1000;
+    while (true) {
+        auto bits = xEventGroupWaitBits(event_group_, SHARED_AFE_WAKE_WORD_RUNNING | SHARED_AFE_PROCESSOR_RUNNING |
+            SHARED_AFE_HANDOFF | SHARED_AFE_EXIT, pdFALSE, pdFALSE, portMAX_DELAY);
+        if (bits & SHARED_AFE_EXIT) {
+            break;
+        }
+
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+        // The fetch waits blocked for the audio, only the processing counts in the run time
+        auto run_time = ulTaskGetRunTimeCounter(nullptr);
+#endif
+        auto res = afe_iface_->fetch_with_delay(afe_data_, pdMS_TO_TICKS(SHARED_AFE_FETCH_TIMEOUT_MS));
+        bits = xEventGroupGetBits(event_group_);
+        if (res == nullptr || res->ret_value == ESP_FAIL) {
+            continue;
+        }
+        TraceRecorder::GetInstance().Instant("afe_fetch");
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+        {
+            uint32_t cost_us = ulTaskGetRunTimeCounter(nullptr) - run_time;
+            std::lock_guard<std::mutex> lock(cost_mutex_);
+            auto& cost = costs_[cost_profile_];
+            cost.chunks++;
+            cost.total_us += cost_us;
+            cost.max_us = std::max(cost.max_us, cost_us);
+        }
+#endif
+
+        if (bits & SHARED_AFE_WAKE_WORD_RUNNING) {
+            std::lock_guard<std::mutex> lock(wake_word_mutex_);
+            if (wake_word_ != nullptr && wake_word_->OnFetch(res)) {
+                // The wake word audio went to the preroll, what follows waits for the voice processing
+                afe_iface_->disable_wakenet(afe_data_);
+                xEventGroupClearBits(event_group_, SHARED_AFE_WAKE_WORD_RUNNING);
+                if ((bits & SHARED_AFE_PROCESSOR_RUNNING) == 0) {
+                    handoff_.clear();
+                    output_frame_.clear();
+                    xEventGroupSetBits(event_group_, SHARED_AFE_HANDOFF);
+                }
+                continue;
+            }
+        }
+
+        const int16_t* data = res->data;
+        size_t samples = res->data_size / sizeof(int16_t);
+        if (bits & SHARED_AFE_PROCESSOR_RUNNING) {
+            if (bits & SHARED_AFE_HANDOFF) {
+                xEventGroupClearBits(event_group_, SHARED_AFE_HANDOFF);
+            }
+            FlushHandoff();
+
+            if (vad_state_change_callback_) {
+                if (res->vad_state == VAD_SPEECH && !is_speaking_) {
+                    is_speaking_ = true;
+                    vad_state_change_callback_(true);
+                } else if (res->vad_state == VAD_SILENCE && is_speaking_) {
+                    is_speaking_ = false;
+                    vad_state_change_callback_(false);
+                }
+            }
+            Output(data, samples);
+        } else if (bits & SHARED_AFE_HANDOFF) {
+            handoff_.insert(handoff_.end(), data, data + samples);
+            if (handoff_.size() > handoff_capacity) {
+                handoff_.erase(handoff_.begin(), handoff_.begin() + (handoff_.size() - handoff_capacity));
+            }
+        } else if (!handoff_.empty()) {
+            handoff_.clear();
+        }
+    }
+    xEventGroupSetBits(event_group_, SHARED_AFE_EXITED);
+}
@@ -0,0 +1,105 @@
+#ifndef SHARED_AFE_H
+#define SHARED_AFE_H
+
+#include <esp_afe_sr_models.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/event_groups.h>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <functional>
+
+#include "audio_processor.h"
+#include "audio_codec.h"
+
+// Processed audio kept between the wake word and the start of the voice processing
+#define SHARED_AFE_HANDOFF_MS 1000
+
+class SharedAfeWakeWord;
+
+/*
+ * One AFE instance for the wake word and the voice processing.
+ *
+ * With a WakeNet model the instance is created as an AFE_TYPE_SR pipeline with the NS and VAD
+ * models too, and the stages follow the modes: WakeNet runs while the wake word is started, the
+ * NS while the voice processing is started. The models, the ring buffers and the fetch task
+ * exist once instead of in an AfeWakeWord and an AfeAudioProcessor each.
+ *
+ * The instance is fed without a break from the wake word to the listening: after a detection
+ * the processed audio goes into a handoff buffer, which is sent ahead of the live audio once
+ * the voice processing starts, so the first words after the wake word are not clipped.
+ *
+ * Without a WakeNet model (custom wake word or none) it is the same AFE_TYPE_VC pipeline as
+ * AfeAudioProcessor.
+ */
+class SharedAfe : public AudioProcessor {
+public:
+    SharedAfe();
+    ~SharedAfe();
+
+    void Initialize(AudioCodec* codec, int frame_duration_ms, srmodel_list_t* models_list) override;
+    void Deinitialize() override;
+    void SetFrameDuration(int frame_duration_ms) override;
+    void Feed(std::vector<int16_t>&& data) override;
+    void Start() override;
+    void Stop() override;
+    bool IsRunning() override;
+    void OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) override;
+    void OnVadStateChange(std::function<void(bool speaking)> callback) override;
+    size_t GetFeedSize() override;
+    void EnableDeviceAec(bool enable) override;
+    bool IsVadEnabled() override;
+    void SetProfile(AfeProfile profile) override { profile_ = profile; }
+    AfeProfile GetProfile() override { return profile_; }
+    AudioProcessorCost GetCost(AfeProfile profile) override;
+
+    // Picked by the audio service from the models before the instance is created
+    void SetWakeWordEnabled(bool enabled) { with_wake_word_ = enabled; }
+
+private:
+    friend class SharedAfeWakeWord;
+
+    EventGroupHandle_t event_group_ = nullptr;
+    esp_afe_sr_iface_t* afe_iface_ = nullptr;
+    esp_afe_sr_data_t* afe_data_ = nullptr;
+    srmodel_list_t* models_ = nullptr;
+    bool owns_models_ = false;
+    bool with_wake_word_ = false;
+    // What the instance was created with
+    bool has_wakenet_ = false;
+    bool has_ns_ = false;
+    AfeProfile profile_ = AFE_PROFILE_DEFAULT;
+    // The profile the fetch task measures, and what it measured of each, wake word included
+    std::mutex cost_mutex_;
+    AfeProfile cost_profile_ = AFE_PROFILE_DEFAULT;
+    AudioProcessorCost costs_[kAfeProfileCount];
+    AudioCodec* codec_ = nullptr;
+    std::function<void(std::vector<int16_t>&& data)> output_callback_;
+    std::function<void(bool speaking)> vad_state_change_callback_;
+    // Set by SetFrameDuration() from the caller, read by the input task
+    std::atomic<int> frame_samples_ = 0;
+    bool is_speaking_ = false;
+
+    // The wake word side, the fetch task calls it with the mutex held
+    std::mutex wake_word_mutex_;
+    SharedAfeWakeWord* wake_word_ = nullptr;
+
+    // Only touched by the fetch task
+    std::vector<int16_t> output_frame_;
+    // Samples rather than frames, the session may change the frame duration meanwhile
+    std::deque<int16_t> handoff_;
+
+    // Called with the models mutex of the audio service held, by either side
+    bool Create(AudioCodec* codec, srmodel_list_t* models_list);
+    void SetWakeWord(SharedAfeWakeWord* wake_word);
+    void StartWakeWord();
+    void StopWakeWord();
+    void FetchTask();
+    void Output(const int16_t* data, size_t samples);
+    void FlushHandoff();
+};
+
+#endif
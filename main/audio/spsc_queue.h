@@ -0,0 +1,166 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+/*
+ * The notification slot used by audio queues. Index 0 is left to ESP-IDF drivers
+ * that block on task notifications, so we take the last entry of the array.
+ */
+#define SPSC_QUEUE_NOTIFY_INDEX (configTASK_NOTIFICATION_ARRAY_ENTRIES - 1)
+
+/*
+ * Fixed-capacity single-producer / single-consumer ring.
+ *
+ * Push() must only be called from the producer side and Pop() from the consumer side.
+ * Both sides are lock-free. When an item is pushed the attached consumer task is notified,
+ * and when an item is popped the attached producer task is notified, so each side only
+ * wakes up for the queue it actually waits on.
+ *
+ * Clear() may be called from any task. It marks everything currently queued as discarded;
+ * the consumer drops those items on its next Pop(), so the element destructors always run
+ * on the consumer side.
+ */
+template <typename T>
+class SpscQueue {
+public:
+    SpscQueue() = default;
+    explicit SpscQueue(size_t capacity) { Reset(capacity); }
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Not thread-safe, only call it before the producer and consumer tasks are started
+    void Reset(size_t capacity) {
+        slots_ = std::make_unique<T[]>(capacity);
+        capacity_ = capacity;
+        limit_.store(capacity, std::memory_order_relaxed);
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+        discard_until_.store(0, std::memory_order_relaxed);
+    }
+
+    // Lower the usable depth at runtime (e.g. when the frame duration changes), never above the capacity
+    void SetLimit(size_t limit) { limit_.store(limit < capacity_ ? limit : capacity_, std::memory_order_release); }
+
+    void AttachProducer(TaskHandle_t task) { producer_task_.store(task, std::memory_order_release); }
+    void AttachConsumer(TaskHandle_t task) { consumer_task_.store(task, std::memory_order_release); }
+
+    // Returns false if the queue is full, the item is left untouched in that case
+    bool Push(T&& item) {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) >= limit_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        slots_[tail % capacity_] = std::move(item);
+        tail_.store(tail + 1, std::memory_order_release);
+        NotifyConsumer();
+        return true;
+    }
+
+    /*
+     * Push for a producer that prefers fresh items: at the limit, the oldest queued item is
+     * discarded to make room. The discarded item keeps its slot until the consumer pops it, so
+     * this needs a capacity above the limit and returns false only when the ring itself is full.
+     */
+    bool PushDiscardOldest(T&& item, bool& discarded) {
+        discarded = false;
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        uint32_t head = head_.load(std::memory_order_acquire);
+        if (tail - head >= capacity_) {
+            return false;
+        }
+        uint32_t discard = discard_until_.load(std::memory_order_acquire);
+        while (true) {
+            uint32_t first = static_cast<int32_t>(discard - head) > 0 ? discard : head;
+            if (tail - first < limit_.load(std::memory_order_acquire)) {
+                break;
+            }
+            if (discard_until_.compare_exchange_weak(discard, first + 1, std::memory_order_acq_rel)) {
+                discarded = true;
+                break;
+            }
+        }
+        slots_[tail % capacity_] = std::move(item);
+        tail_.store(tail + 1, std::memory_order_release);
+        NotifyConsumer();
+        return true;
+    }
+
+    // Returns false if the queue is empty
+    bool Pop(T& item) {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        while (head != tail_.load(std::memory_order_acquire)) {
+            T value = std::move(slots_[head % capacity_]);
+            head_.store(++head, std::memory_order_release);
+            NotifyProducer();
+            if (static_cast<int32_t>(discard_until_.load(std::memory_order_acquire) - head) >= 0) {
+                continue;
+            }
+            item = std::move(value);
+            return true;
+        }
+        return false;
+    }
+
+    void Clear() {
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        uint32_t discard = discard_until_.load(std::memory_order_relaxed);
+        while (static_cast<int32_t>(tail - discard) > 0 &&
+            !discard_until_.compare_exchange_weak(discard, tail, std::memory_order_acq_rel)) {
+        }
+        NotifyConsumer();
+    }
+
+    size_t size() const {
+        uint32_t head = head_.load(std::memory_order_acquire);
+        uint32_t discard = discard_until_.load(std::memory_order_acquire);
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        if (static_cast<int32_t>(discard - head) > 0) {
+            head = discard;
+        }
+        return static_cast<int32_t>(tail - head) > 0 ? tail - head : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+    // Full means the producer cannot push, discarded items still occupy their slots until popped
+    bool full() const { return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire) >= limit_.load(std::memory_order_acquire); }
+    size_t capacity() const { return capacity_; }
+    size_t limit() const { return limit_.load(std::memory_order_acquire); }
+
+    void NotifyProducer() {
+        auto task = producer_task_.load(std::memory_order_acquire);
+        if (task != nullptr) {
+            xTaskNotifyGiveIndexed(task, SPSC_QUEUE_NOTIFY_INDEX);
+        }
+    }
+
+    void NotifyConsumer() {
+        auto task = consumer_task_.load(std::memory_order_acquire);
+        if (task != nullptr) {
+            xTaskNotifyGiveIndexed(task, SPSC_QUEUE_NOTIFY_INDEX);
+        }
+    }
+
+    // Block the calling task until one of the queues it is attached to changes
+    static void Wait(TickType_t timeout) {
+        ulTaskNotifyTakeIndexed(SPSC_QUEUE_NOTIFY_INDEX, pdTRUE, timeout);
+    }
+
+private:
+    std::unique_ptr<T[]> slots_;
+    size_t capacity_ = 0;
+    std::atomic<size_t> limit_{0};
+    std::atomic<uint32_t> head_{0};
+    std::atomic<uint32_t> tail_{0};
+    std::atomic<uint32_t> discard_until_{0};
+    std::atomic<TaskHandle_t> producer_task_{nullptr};
+    std::atomic<TaskHandle_t> consumer_task_{nullptr};
+};
+
+#endif // SPSC_QUEUE_H
@@ -0,0 +1,101 @@
+#include "tts_cache.h"
+
+#if CONFIG_USE_TTS_CACHE
+
+#include "audio_service.h"
+
+#include <esp_log.h>
+
+#define TAG "TtsCache"
+
+void TtsCache::StartCapture(const std::string& hash, int sample_rate) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (index_.find(hash) != index_.end()) {
+        // The server sent the audio anyway, the cached copy stays
+        capture_.reset();
+        return;
+    }
+    capture_ = std::make_unique<Entry>();
+    capture_->hash = hash;
+    capture_->sample_rate = sample_rate;
+}
+
+void TtsCache::Capture(const AudioStreamPacket& packet) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (capture_ == nullptr) {
+        return;
+    }
+    if (packet.sample_rate != capture_->sample_rate || packet.payload.size() > UINT16_MAX ||
+        capture_->duration_ms + packet.frame_duration > CONFIG_TTS_CACHE_MAX_UTTERANCE_MS) {
+        ESP_LOGD(TAG, "Utterance %s not cacheable", capture_->hash.c_str());
+        capture_.reset();
+        return;
+    }
+    auto& data = capture_->data;
+    uint16_t size = packet.payload.size();
+    data.push_back(size & 0xFF);
+    data.push_back(size >> 8);
+    data.push_back(packet.frame_duration);
+    data.insert(data.end(), packet.payload.begin(), packet.payload.end());
+    capture_->duration_ms += packet.frame_duration;
+}
+
+void TtsCache::CommitCapture() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (capture_ == nullptr) {
+        return;
+    }
+    std::unique_ptr<Entry> entry = std::move(capture_);
+    size_t capacity = CONFIG_TTS_CACHE_KB * 1024;
+    if (entry->data.empty() || entry->data.size() > capacity) {
+        return;
+    }
+    entry->data.shrink_to_fit();
+    while (bytes_ + entry->data.size() > capacity && !entries_.empty()) {
+        auto& oldest = entries_.back();
+        bytes_ -= oldest->data.size();
+        index_.erase(oldest->hash);
+        entries_.pop_back();
+    }
+    bytes_ += entry->data.size();
+    ESP_LOGI(TAG, "Cached %s, %d ms in %u bytes, %u bytes in total", entry->hash.c_str(), entry->duration_ms,
+        (unsigned)entry->data.size(), (unsigned)bytes_);
+    entries_.push_front(std::move(entry));
+    index_[entries_.front()->hash] = entries_.begin();
+}
+
+void TtsCache::CancelCapture() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capture_.reset();
+}
+
+bool TtsCache::Play(const std::string& hash, AudioService& audio_service) {
+    std::shared_ptr<const Entry> entry;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(hash);
+        if (it == index_.end()) {
+            return false;
+        }
+        entries_.splice(entries_.begin(), entries_, it->second);
+        entry = entries_.front();
+    }
+
+    // Shorter than the decode queue holds, so waiting for room only lasts while earlier audio plays
+    const uint8_t* data = entry->data.data();
+    const uint8_t* end = data + entry->data.size();
+    while (data + 3 <= end) {
+        size_t size = data[0] | (data[1] << 8);
+        auto packet = std::make_unique<AudioStreamPacket>();
+        packet->sample_rate = entry->sample_rate;
+        packet->frame_duration = data[2];
+        packet->payload.assign(data + 3, data + 3 + size);
+        data += 3 + size;
+        if (!audio_service.PushPacketToDecodeQueue(std::move(packet), true)) {
+            break;
+        }
+    }
+    return true;
+}
+
+#endif // CONFIG_USE_TTS_CACHE
@@ -0,0 +1,60 @@
+#ifndef TTS_CACHE_H
+#define TTS_CACHE_H
+
+#include <sdkconfig.h>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "protocol.h"
+#include "heap_accounting.h"
+
+class AudioService;
+
+/*
+ * Opus packets of the TTS utterances the server marked as cacheable, so a repeated phrase
+ * (greetings, confirmations, errors) plays from memory and the server only sends its hash.
+ *
+ * A sentence_start with a "cache_hash" starts a capture, the audio packets that follow are
+ * copied until the next sentence_start or the tts stop commits them. The capture is dropped
+ * when it is aborted or longer than CONFIG_TTS_CACHE_MAX_UTTERANCE_MS. A sentence_cached plays
+ * the packets through the decode queue like PlaySound(), or reports a miss so the server
+ * streams the utterance instead.
+ *
+ * The entries live in PSRAM and are evicted least recently used first once they take more than
+ * CONFIG_TTS_CACHE_KB. The capture runs on the network task, the playback on the main loop,
+ * the entries are shared so playing does not hold the lock.
+ */
+class TtsCache {
+public:
+    void StartCapture(const std::string& hash, int sample_rate);
+    void Capture(const AudioStreamPacket& packet);
+    void CommitCapture();
+    void CancelCapture();
+
+    // Queues the cached packets for playback, false if the hash is not cached
+    bool Play(const std::string& hash, AudioService& audio_service);
+
+private:
+    using Buffer = std::vector<uint8_t, PsramAllocator<uint8_t, kHeapTagAudio>>;
+
+    // The packets one after the other, each as uint16 size, uint8 frame duration, payload
+    struct Entry {
+        std::string hash;
+        int sample_rate = 0;
+        int duration_ms = 0;
+        Buffer data;
+    };
+
+    std::mutex mutex_;
+    std::list<std::shared_ptr<const Entry>> entries_;   // Most recently used first
+    std::unordered_map<std::string, std::list<std::shared_ptr<const Entry>>::iterator> index_;
+    size_t bytes_ = 0;
+    std::unique_ptr<Entry> capture_;
+};
+
+#endif // TTS_CACHE_H
@@ -4,10 +4,22 @@
 #include <string>
 #include <vector>
 #include <functional>
+#include <cstdlib>
 
+#include <esp_timer.h>
 #include <model_path.h>
 #include "audio_codec.h"
 
+// What the engine knew about its last detection
+struct WakeWordDetection {
+    std::string wake_word;
+    // Model probability, -1 when the engine does not report one (WakeNet)
+    float confidence = -1;
+    // From the speech onset to the detection, -1 when no onset was seen before it
+    int onset_ms = -1;
+    int64_t time_us = 0;
+};
+
 class WakeWord {
 public:
     virtual ~WakeWord() = default;
@@ -15,12 +27,64 @@ public:
     virtual bool Initialize(AudioCodec* codec, srmodel_list_t* models_list) = 0;
     virtual void Feed(const std::vector<int16_t>& data) = 0;
     virtual void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback) = 0;
+    // Speech that may turn into a wake word, used to open the audio channel ahead of the detection
+    virtual void OnWakeWordCandidate(std::function<void()> callback) = 0;
     virtual void Start() = 0;
     virtual void Stop() = 0;
     virtual size_t GetFeedSize() = 0;
     virtual void EncodeWakeWordData() = 0;
     virtual bool GetWakeWordOpus(std::vector<uint8_t>& opus) = 0;
     virtual const std::string& GetLastDetectedWakeWord() const = 0;
+
+    // Valid in the detected callback and until the next detection
+    const WakeWordDetection& GetLastDetection() const { return last_detection_; }
+
+protected:
+    // Called by the engines from their detection context, before the detected callback
+    void MarkOnset() { onset_us_ = esp_timer_get_time(); }
+    void RecordDetection(const std::string& wake_word, float confidence = -1) {
+        int64_t now = esp_timer_get_time();
+        last_detection_.wake_word = wake_word;
+        last_detection_.confidence = confidence;
+        last_detection_.onset_ms = onset_us_ != 0 ? (int)((now - onset_us_) / 1000) : -1;
+        last_detection_.time_us = now;
+        onset_us_ = 0;
+    }
+
+private:
+    WakeWordDetection last_detection_;
+    int64_t onset_us_ = 0;
+};
+
+/*
+ * Energy based speech onset, for the engines without a VAD model.
+ * Reports the first loud chunk after WAKE_WORD_ONSET_QUIET_CHUNKS quiet ones. Only run with
+ * CONFIG_USE_AUDIO_CHANNEL_PREWARM, nothing else waits for the onset.
+ */
+#define WAKE_WORD_ONSET_LEVEL 600
+#define WAKE_WORD_ONSET_QUIET_CHUNKS 10
+
+class VoiceOnsetDetector {
+public:
+    bool Process(const int16_t* data, size_t samples) {
+        if (samples == 0) {
+            return false;
+        }
+        uint32_t sum = 0;
+        for (size_t i = 0; i < samples; i++) {
+            sum += std::abs(data[i]);
+        }
+        if (sum / samples < WAKE_WORD_ONSET_LEVEL) {
+            quiet_chunks_++;
+            return false;
+        }
+        bool onset = quiet_chunks_ >= WAKE_WORD_ONSET_QUIET_CHUNKS;
+        quiet_chunks_ = 0;
+        return onset;
+    }
+
+private:
+    int quiet_chunks_ = 0;
 };
 
 #endif
@@ -0,0 +1,85 @@
+#include "wake_word_gate.h"
+
+#include <esp_log.h>
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#define TAG "WakeWordGate"
+
+void WakeWordGate::Reset() {
+    head_ = 0;
+    count_ = 0;
+    open_ = false;
+    quiet_ms_ = 0;
+}
+
+int WakeWordGate::Process(std::vector<int16_t>& chunk, int channels) {
+    size_t samples = chunk.size() / channels;
+    if (samples == 0) {
+        return 0;
+    }
+    uint64_t sum_squares = 0;
+    for (size_t i = 0; i < samples; i++) {
+        int32_t sample = chunk[i * channels];
+        sum_squares += sample * sample;
+    }
+    float rms = sqrtf((float)(sum_squares / samples));
+    // The wake word is always fed at 16 kHz
+    int chunk_ms = samples / 16;
+    chunks_.fetch_add(1, std::memory_order_relaxed);
+
+    if (ring_.empty()) {
+        // Two more than the pre-roll, for the live chunks that come while it is caught up on
+        ring_.resize(std::max(1, preroll_ms_ / std::max(chunk_ms, 1)) + 2);
+    }
+    if (floor_rms_ < 0) {
+        floor_rms_ = rms;
+    }
+
+    bool loud = rms >= std::max((float)min_rms_, floor_rms_ * open_margin_);
+    if (loud) {
+        // Slowly, so a noise that stays does not hold the gate open for good
+        floor_rms_ += (rms - floor_rms_) / 256;
+        quiet_ms_ = 0;
+        if (!open_) {
+            open_ = true;
+            opened_.fetch_add(1, std::memory_order_relaxed);
+            ESP_LOGD(TAG, "Open, rms %d floor %d", (int)rms, (int)floor_rms_);
+        }
+    } else {
+        floor_rms_ += (rms - floor_rms_) / 32;
+        if (open_) {
+            quiet_ms_ += chunk_ms;
+            if (quiet_ms_ >= hangover_ms_) {
+                open_ = false;
+                ESP_LOGD(TAG, "Closed, floor %d", (int)floor_rms_);
+            }
+        }
+    }
+
+    size_t preroll_chunks = ring_.size() - 2;
+    if (!open_ && count_ >= preroll_chunks) {
+        // A sliding window while closed, the oldest chunk makes room
+        head_ = (head_ + 1) % ring_.size();
+        count_--;
+    }
+    std::swap(ring_[(head_ + count_) % ring_.size()], chunk);
+    count_++;
+    if (!open_) {
+        return 0;
+    }
+    int feeds = std::min<size_t>(count_, 2);
+    fed_chunks_.fetch_add(feeds, std::memory_order_relaxed);
+    return feeds;
+}
+
+void WakeWordGate::Pop(std::vector<int16_t>& chunk) {
+    if (count_ == 0) {
+        return;
+    }
+    std::swap(ring_[head_], chunk);
+    head_ = (head_ + 1) % ring_.size();
+    count_--;
+}
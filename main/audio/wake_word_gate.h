@@ -0,0 +1,63 @@
+#ifndef WAKE_WORD_GATE_H
+#define WAKE_WORD_GATE_H
+
+#include <sdkconfig.h>
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <vector>
+
+/*
+ * Energy front end of the wake word, for the battery boards.
+ *
+ * In idle the wake word engine would run its network on every chunk of the microphone. The gate
+ * looks at the energy of the chunk first: while it stays at the learnt noise floor the chunk is
+ * only kept in a short ring, the pre-roll, and the engine is not fed. A chunk louder than
+ * open_margin times the floor opens the gate, the engine gets the pre-roll and then the live
+ * chunks, until hangover_ms of quiet close it again. The onset of the wake word is in the
+ * pre-roll, so the detection sees the whole phrase.
+ *
+ * The pre-roll is fed two chunks per live one, a burst of it would overflow the ring of an AFE.
+ *
+ * The microphone channel is the first one of the interleaved chunk. Only called by the audio
+ * input task, with the models mutex held.
+ */
+class WakeWordGate {
+public:
+    WakeWordGate(int preroll_ms, int hangover_ms, int open_margin, int min_rms)
+        : preroll_ms_(preroll_ms), hangover_ms_(hangover_ms), open_margin_(open_margin), min_rms_(min_rms) {}
+
+    // Closes the gate and drops the pre-roll, the noise floor is kept
+    void Reset();
+    // Takes the chunk, swapping a spare buffer into it. Returns how many chunks Pop() hands out
+    // now: none while the gate is closed
+    int Process(std::vector<int16_t>& chunk, int channels);
+    // The oldest chunk to feed, swapped into chunk
+    void Pop(std::vector<int16_t>& chunk);
+
+    bool is_open() const { return open_; }
+    // The counters may be read from any task
+    uint32_t opened() const { return opened_.load(std::memory_order_relaxed); }
+    // Of the chunks seen, how many were fed to the engine
+    uint32_t chunks() const { return chunks_.load(std::memory_order_relaxed); }
+    uint32_t fed_chunks() const { return fed_chunks_.load(std::memory_order_relaxed); }
+
+private:
+    const int preroll_ms_;
+    const int hangover_ms_;
+    const int open_margin_;
+    const int min_rms_;
+
+    // The pre-roll ring, its buffers are reused
+    std::vector<std::vector<int16_t>> ring_;
+    size_t head_ = 0;       // The oldest chunk
+    size_t count_ = 0;
+    bool open_ = false;
+    int quiet_ms_ = 0;
+    float floor_rms_ = -1;
+    std::atomic<uint32_t> opened_ = 0;
+    std::atomic<uint32_t> chunks_ = 0;
+    std::atomic<uint32_t> fed_chunks_ = 0;
+};
+
+#endif // WAKE_WORD_GATE_H
@@ -1,35 +1,38 @@
 #include "afe_wake_word.h"
 #include "audio_service.h"
+#include "task_placement.h"
 
 #include <esp_log.h>
 #include <sstream>
 
 #define DETECTION_RUNNING_EVENT 1
+#define DETECTION_EXIT_EVENT    2
+#define DETECTION_EXITED_EVENT  4
+
+// A fetch gives up after this, so a stopped detection still sees DETECTION_EXIT_EVENT
+#define DETECTION_FETCH_TIMEOUT_MS 100
 
 #define TAG "AfeWakeWord"
 
 AfeWakeWord::AfeWakeWord()
-    : afe_data_(nullptr),
-      wake_word_pcm_(),
-      wake_word_opus_() {
+    : afe_data_(nullptr) {
 
     event_group_ = xEventGroupCreate();
 }
 
 AfeWakeWord::~AfeWakeWord() {
-    if (afe_data_ != nullptr) {
-        afe_iface_->destroy(afe_data_);
+    if (detection_task_ != nullptr) {
+        // The task still uses afe_data_, wait until it is out of its loop
+        xEventGroupClearBits(event_group_, DETECTION_RUNNING_EVENT);
+        xEventGroupSetBits(event_group_, DETECTION_EXIT_EVENT);
+        xEventGroupWaitBits(event_group_, DETECTION_EXITED_EVENT, pdFALSE, pdTRUE, portMAX_DELAY);
     }
 
-    if (wake_word_encode_task_stack_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_stack_);
-    }
-
-    if (wake_word_encode_task_buffer_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_buffer_);
+    if (afe_data_ != nullptr) {
+        afe_iface_->destroy(afe_data_);
     }
 
-    if (models_ != nullptr) {
+    if (models_ != nullptr && owns_models_) {
         esp_srmodel_deinit(models_);
     }
 
@@ -42,6 +45,7 @@ bool AfeWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list) {
 
     if (models_list == nullptr) {
         models_ = esp_srmodel_init("model");
+        owns_models_ = true;
     } else {
         models_ = models_list;
     }
@@ -74,18 +78,20 @@ bool AfeWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list) {
     afe_config_t* afe_config = afe_config_init(input_format.c_str(), models_, AFE_TYPE_SR, AFE_MODE_HIGH_PERF);
     afe_config->aec_init = codec_->input_reference();
     afe_config->aec_mode = AEC_MODE_SR_HIGH_PERF;
-    afe_config->afe_perferred_core = 1;
-    afe_config->afe_perferred_priority = 1;
+    auto& afe_placement = TaskPlacements::Get(kTaskWakeWordAfe);
+    afe_config->afe_perferred_core = afe_placement.core == tskNO_AFFINITY ? 0 : afe_placement.core;
+    afe_config->afe_perferred_priority = afe_placement.priority;
     afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
     
     afe_iface_ = esp_afe_handle_from_config(afe_config);
     afe_data_ = afe_iface_->create_from_config(afe_config);
+    preroll_.Initialize(OPUS_FRAME_DURATION_MS);
 
-    xTaskCreate([](void* arg) {
+    TaskPlacements::Create(kTaskWakeWord, [](void* arg) {
         auto this_ = (AfeWakeWord*)arg;
         this_->AudioDetectionTask();
         vTaskDelete(NULL);
-    }, "audio_detection", 4096, this, 3, nullptr);
+    }, this, &detection_task_);
 
     return true;
 }
@@ -94,7 +100,12 @@ void AfeWakeWord::OnWakeWordDetected(std::function<void(const std::string& wake_
     wake_word_detected_callback_ = callback;
 }
 
+void AfeWakeWord::OnWakeWordCandidate(std::function<void()> callback) {
+    wake_word_candidate_callback_ = callback;
+}
+
 void AfeWakeWord::Start() {
+    preroll_.Reset();
     xEventGroupSetBits(event_group_, DETECTION_RUNNING_EVENT);
 }
 
@@ -126,9 +137,12 @@ void AfeWakeWord::AudioDetectionTask() {
         feed_size, fetch_size);
 
     while (true) {
-        xEventGroupWaitBits(event_group_, DETECTION_RUNNING_EVENT, pdFALSE, pdTRUE, portMAX_DELAY);
+        auto bits = xEventGroupWaitBits(event_group_, DETECTION_RUNNING_EVENT | DETECTION_EXIT_EVENT, pdFALSE, pdFALSE, portMAX_DELAY);
+        if (bits & DETECTION_EXIT_EVENT) {
+            break;
+        }
 
-        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
+        auto res = afe_iface_->fetch_with_delay(afe_data_, pdMS_TO_TICKS(DETECTION_FETCH_TIMEOUT_MS));
         if (res == nullptr || res->ret_value == ESP_FAIL) {
             continue;;
         }
@@ -136,73 +150,39 @@ void AfeWakeWord::AudioDetectionTask() {
         // Store the wake word data for voice recognition, like who is speaking
         StoreWakeWordData(res->data, res->data_size / sizeof(int16_t));
 
+        // Speech onset, the wake word may follow
+        if (res->vad_state == VAD_SPEECH && !is_speaking_) {
+            is_speaking_ = true;
+            MarkOnset();
+            if (wake_word_candidate_callback_) {
+                wake_word_candidate_callback_();
+            }
+        } else if (res->vad_state == VAD_SILENCE) {
+            is_speaking_ = false;
+        }
+
         if (res->wakeup_state == WAKENET_DETECTED) {
             Stop();
             last_detected_wake_word_ = wake_words_[res->wakenet_model_index - 1];
+            RecordDetection(last_detected_wake_word_);
 
             if (wake_word_detected_callback_) {
                 wake_word_detected_callback_(last_detected_wake_word_);
             }
         }
     }
+    xEventGroupSetBits(event_group_, DETECTION_EXITED_EVENT);
 }
 
 void AfeWakeWord::StoreWakeWordData(const int16_t* data, size_t samples) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.emplace_back(std::vector<int16_t>(data, data + samples));
-    // keep about 2 seconds of data, detect duration is 30ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 30) {
-        wake_word_pcm_.pop_front();
-    }
+    // keep the last WAKE_WORD_PREROLL_MS of audio, encoded in the background
+    preroll_.Store(data, samples);
 }
 
 void AfeWakeWord::EncodeWakeWordData() {
-    const size_t stack_size = 4096 * 7;
-    wake_word_opus_.clear();
-    if (wake_word_encode_task_stack_ == nullptr) {
-        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(stack_size, MALLOC_CAP_SPIRAM);
-        assert(wake_word_encode_task_stack_ != nullptr);
-    }
-    if (wake_word_encode_task_buffer_ == nullptr) {
-        wake_word_encode_task_buffer_ = (StaticTask_t*)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL);
-        assert(wake_word_encode_task_buffer_ != nullptr);
-    }
-
-    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
-        auto this_ = (AfeWakeWord*)arg;
-        {
-            auto start_time = esp_timer_get_time();
-            auto encoder = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-            encoder->SetComplexity(0); // 0 is the fastest
-
-            int packets = 0;
-            for (auto& pcm: this_->wake_word_pcm_) {
-                encoder->Encode(std::move(pcm), [this_](std::vector<uint8_t>&& opus) {
-                    std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                    this_->wake_word_opus_.emplace_back(std::move(opus));
-                    this_->wake_word_cv_.notify_all();
-                });
-                packets++;
-            }
-            this_->wake_word_pcm_.clear();
-
-            auto end_time = esp_timer_get_time();
-            ESP_LOGI(TAG, "Encode wake word opus %d packets in %ld ms", packets, (long)((end_time - start_time) / 1000));
-
-            std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-            this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-            this_->wake_word_cv_.notify_all();
-        }
-        vTaskDelete(NULL);
-    }, "encode_wake_word", stack_size, this, 2, wake_word_encode_task_stack_, wake_word_encode_task_buffer_);
+    preroll_.Flush();
 }
 
 bool AfeWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
-    std::unique_lock<std::mutex> lock(wake_word_mutex_);
-    wake_word_cv_.wait(lock, [this]() {
-        return !wake_word_opus_.empty();
-    });
-    opus.swap(wake_word_opus_.front());
-    wake_word_opus_.pop_front();
-    return !opus.empty();
+    return preroll_.Pop(opus);
 }
@@ -9,15 +9,13 @@
 #include <esp_nsn_models.h>
 #include <model_path.h>
 
-#include <deque>
 #include <string>
 #include <vector>
 #include <functional>
-#include <mutex>
-#include <condition_variable>
 
 #include "audio_codec.h"
 #include "wake_word.h"
+#include "wake_word_preroll.h"
 
 class AfeWakeWord : public WakeWord {
 public:
@@ -27,6 +25,7 @@ public:
     bool Initialize(AudioCodec* codec, srmodel_list_t* models_list);
     void Feed(const std::vector<int16_t>& data);
     void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback);
+    void OnWakeWordCandidate(std::function<void()> callback);
     void Start();
     void Stop();
     size_t GetFeedSize();
@@ -36,22 +35,21 @@ public:
 
 private:
     srmodel_list_t *models_ = nullptr;
+    // Loaded here rather than shared by the assets, freed with this instance
+    bool owns_models_ = false;
+    TaskHandle_t detection_task_ = nullptr;
     esp_afe_sr_iface_t* afe_iface_ = nullptr;
     esp_afe_sr_data_t* afe_data_ = nullptr;
     char* wakenet_model_ = NULL;
     std::vector<std::string> wake_words_;
     EventGroupHandle_t event_group_;
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
+    std::function<void()> wake_word_candidate_callback_;
     AudioCodec* codec_ = nullptr;
     std::string last_detected_wake_word_;
+    bool is_speaking_ = false;
 
-    TaskHandle_t wake_word_encode_task_ = nullptr;
-    StaticTask_t* wake_word_encode_task_buffer_ = nullptr;
-    StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::deque<std::vector<int16_t>> wake_word_pcm_;
-    std::deque<std::vector<uint8_t>> wake_word_opus_;
-    std::mutex wake_word_mutex_;
-    std::condition_variable wake_word_cv_;
+    WakeWordPreroll preroll_;
 
     void StoreWakeWordData(const int16_t* data, size_t size);
     void AudioDetectionTask();
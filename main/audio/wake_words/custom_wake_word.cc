@@ -2,19 +2,20 @@
 #include "audio_service.h"
 #include "system_info.h"
 #include "assets.h"
+#include "settings.h"
 
 #include <esp_log.h>
 #include <esp_mn_iface.h>
 #include <esp_mn_models.h>
 #include <esp_mn_speech_commands.h>
 #include <cJSON.h>
+#include <cstring>
 
 
 #define TAG "CustomWakeWord"
 
 
-CustomWakeWord::CustomWakeWord()
-    : wake_word_pcm_(), wake_word_opus_() {
+CustomWakeWord::CustomWakeWord() {
 }
 
 CustomWakeWord::~CustomWakeWord() {
@@ -23,17 +24,23 @@ CustomWakeWord::~CustomWakeWord() {
         multinet_model_data_ = nullptr;
     }
 
-    if (wake_word_encode_task_stack_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_stack_);
+    if (models_ != nullptr && owns_models_) {
+        esp_srmodel_deinit(models_);
     }
+}
 
-    if (wake_word_encode_task_buffer_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_buffer_);
-    }
+#define LOCAL_COMMAND_TOOL_PREFIX "tool:"
 
-    if (models_ != nullptr) {
-        esp_srmodel_deinit(models_);
+// The arguments of a tool command, an object or nothing
+static std::string GetArguments(const cJSON* command) {
+    cJSON* arguments = cJSON_GetObjectItem(command, "arguments");
+    if (!cJSON_IsObject(arguments)) {
+        return "{}";
     }
+    char* json = cJSON_PrintUnformatted(arguments);
+    std::string result(json);
+    cJSON_free(json);
+    return result;
 }
 
 void CustomWakeWord::ParseWakenetModelConfig() {
@@ -46,6 +53,7 @@ void CustomWakeWord::ParseWakenetModelConfig() {
         return;
     }
     cJSON* root = cJSON_ParseWithLength(static_cast<char*>(ptr), size);
+    assets.ReleaseAssetData("index.json");
     if (root == nullptr) {
         ESP_LOGE(TAG, "Failed to parse index.json");
         return;
@@ -73,7 +81,7 @@ void CustomWakeWord::ParseWakenetModelConfig() {
                     cJSON* text = cJSON_GetObjectItem(command, "text");
                     cJSON* action = cJSON_GetObjectItem(command, "action");
                     if (cJSON_IsString(command_name) && cJSON_IsString(text) && cJSON_IsString(action)) {
-                        commands_.push_back({command_name->valuestring, text->valuestring, action->valuestring});
+                        PutCommand({command_name->valuestring, text->valuestring, action->valuestring, GetArguments(command)});
                         ESP_LOGI(TAG, "Command: %s, Text: %s, Action: %s", command_name->valuestring, text->valuestring, action->valuestring);
                     }
                 }
@@ -84,21 +92,137 @@ void CustomWakeWord::ParseWakenetModelConfig() {
 }
 
 
+// Local commands as a JSON array of {command, text, action, arguments}
+void CustomWakeWord::LoadLocalCommands() {
+    Settings settings("wake_word");
+    auto json = settings.GetString("commands");
+    if (json.empty()) {
+        return;
+    }
+    cJSON* root = cJSON_Parse(json.c_str());
+    cJSON* item;
+    cJSON_ArrayForEach(item, root) {
+        cJSON* command = cJSON_GetObjectItem(item, "command");
+        cJSON* text = cJSON_GetObjectItem(item, "text");
+        cJSON* action = cJSON_GetObjectItem(item, "action");
+        if (cJSON_IsString(command) && cJSON_IsString(text) && cJSON_IsString(action)) {
+            PutCommand({command->valuestring, text->valuestring, action->valuestring, GetArguments(item), true});
+        }
+    }
+    cJSON_Delete(root);
+}
+
+void CustomWakeWord::SaveLocalCommands() {
+    cJSON* root = cJSON_CreateArray();
+    for (auto& [id, command] : commands_) {
+        if (!command.local) {
+            continue;
+        }
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "command", command.command.c_str());
+        cJSON_AddStringToObject(item, "text", command.text.c_str());
+        cJSON_AddStringToObject(item, "action", command.action.c_str());
+        cJSON* arguments = cJSON_Parse(command.arguments.c_str());
+        if (arguments != nullptr) {
+            cJSON_AddItemToObject(item, "arguments", arguments);
+        }
+        cJSON_AddItemToArray(root, item);
+    }
+    char* json = cJSON_PrintUnformatted(root);
+    Settings settings("wake_word", true);
+    settings.SetString("commands", json);
+    cJSON_free(json);
+    cJSON_Delete(root);
+}
+
+int CustomWakeWord::PutCommand(Command&& command) {
+    auto it = command_ids_.find(command.command);
+    if (it != command_ids_.end()) {
+        commands_[it->second] = std::move(command);
+        return it->second;
+    }
+    // The lowest free id, the ids of the other commands do not move
+    int id = 1;
+    while (commands_.count(id) > 0) {
+        id++;
+    }
+    command_ids_[command.command] = id;
+    commands_[id] = std::move(command);
+    return id;
+}
+
+bool CustomWakeWord::UpdateModelCommands() {
+    esp_mn_error_t* errors = esp_mn_commands_update();
+    if (errors != nullptr && errors->num > 0) {
+        for (int i = 0; i < errors->num; i++) {
+            ESP_LOGE(TAG, "Invalid command phrase: %s", errors->phrases[i]->string);
+        }
+        return false;
+    }
+    return true;
+}
+
+bool CustomWakeWord::AddCommand(const std::string& command, const std::string& text, const std::string& action,
+        const std::string& arguments) {
+    std::lock_guard<std::mutex> lock(commands_mutex_);
+    bool exists = command_ids_.count(command) > 0;
+    int id = PutCommand({command, text, action, arguments, true});
+    if (multinet_model_data_ != nullptr) {
+        // An existing phrase keeps its id, only the text and the action changed
+        if (!exists && (esp_mn_commands_add(id, command.c_str()) != ESP_OK || !UpdateModelCommands())) {
+            esp_mn_commands_remove(command.c_str());
+            UpdateModelCommands();
+            commands_.erase(id);
+            command_ids_.erase(command);
+            return false;
+        }
+        multinet_->clean(multinet_model_data_);
+    }
+    SaveLocalCommands();
+    ESP_LOGI(TAG, "Command %d: %s, Text: %s, Action: %s", id, command.c_str(), text.c_str(), action.c_str());
+    return true;
+}
+
+bool CustomWakeWord::RemoveCommand(const std::string& command) {
+    std::lock_guard<std::mutex> lock(commands_mutex_);
+    auto it = command_ids_.find(command);
+    if (it == command_ids_.end()) {
+        return false;
+    }
+    bool local = commands_[it->second].local;
+    commands_.erase(it->second);
+    command_ids_.erase(it);
+    if (multinet_model_data_ != nullptr) {
+        esp_mn_commands_remove(command.c_str());
+        UpdateModelCommands();
+        multinet_->clean(multinet_model_data_);
+    }
+    if (local) {
+        SaveLocalCommands();
+    }
+    ESP_LOGI(TAG, "Command removed: %s", command.c_str());
+    return true;
+}
+
 bool CustomWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list) {
     codec_ = codec;
+    std::lock_guard<std::mutex> lock(commands_mutex_);
     commands_.clear();
+    command_ids_.clear();
 
     if (models_list == nullptr) {
         language_ = "cn";
         models_ = esp_srmodel_init("model");
+        owns_models_ = true;
 #ifdef CONFIG_CUSTOM_WAKE_WORD
         threshold_ = CONFIG_CUSTOM_WAKE_WORD_THRESHOLD / 100.0f;
-        commands_.push_back({CONFIG_CUSTOM_WAKE_WORD, CONFIG_CUSTOM_WAKE_WORD_DISPLAY, "wake"});
+        PutCommand({CONFIG_CUSTOM_WAKE_WORD, CONFIG_CUSTOM_WAKE_WORD_DISPLAY, "wake"});
 #endif
     } else {
         models_ = models_list;
         ParseWakenetModelConfig();
     }
+    LoadLocalCommands();
 
     if (models_ == nullptr || models_->num == -1) {
         ESP_LOGE(TAG, "Failed to initialize wakenet model");
@@ -121,12 +245,13 @@ bool CustomWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list)
     multinet_model_data_ = multinet_->create(mn_name_, duration_);
     multinet_->set_det_threshold(multinet_model_data_, threshold_);
     esp_mn_commands_clear();
-    for (int i = 0; i < commands_.size(); i++) {
-        esp_mn_commands_add(i + 1, commands_[i].command.c_str());
+    for (auto& [id, command] : commands_) {
+        esp_mn_commands_add(id, command.command.c_str());
     }
-    esp_mn_commands_update();
+    UpdateModelCommands();
     
     multinet_->print_active_speech_commands(multinet_model_data_);
+    preroll_.Initialize(OPUS_FRAME_DURATION_MS);
     return true;
 }
 
@@ -134,7 +259,12 @@ void CustomWakeWord::OnWakeWordDetected(std::function<void(const std::string& wa
     wake_word_detected_callback_ = callback;
 }
 
+void CustomWakeWord::OnWakeWordCandidate(std::function<void()> callback) {
+    wake_word_candidate_callback_ = callback;
+}
+
 void CustomWakeWord::Start() {
+    preroll_.Reset();
     running_ = true;
 }
 
@@ -147,6 +277,7 @@ void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
         return;
     }
 
+    std::lock_guard<std::mutex> lock(commands_mutex_);
     esp_mn_state_t mn_state;
     // If input channels is 2, we need to fetch the left channel data
     if (codec_->input_channels() == 2) {
@@ -156,9 +287,25 @@ void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
         }
 
         StoreWakeWordData(mono_data);
+#if CONFIG_USE_AUDIO_CHANNEL_PREWARM
+        if (onset_detector_.Process(mono_data.data(), mono_data.size())) {
+            MarkOnset();
+            if (wake_word_candidate_callback_) {
+                wake_word_candidate_callback_();
+            }
+        }
+#endif
         mn_state = multinet_->detect(multinet_model_data_, const_cast<int16_t*>(mono_data.data()));
     } else {
         StoreWakeWordData(data);
+#if CONFIG_USE_AUDIO_CHANNEL_PREWARM
+        if (onset_detector_.Process(data.data(), data.size())) {
+            MarkOnset();
+            if (wake_word_candidate_callback_) {
+                wake_word_candidate_callback_();
+            }
+        }
+#endif
         mn_state = multinet_->detect(multinet_model_data_, const_cast<int16_t*>(data.data()));
     }
     
@@ -169,14 +316,25 @@ void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
         for (int i = 0; i < mn_result->num && running_; i++) {
             ESP_LOGI(TAG, "Custom wake word detected: command_id=%d, string=%s, prob=%f", 
                     mn_result->command_id[i], mn_result->string, mn_result->prob[i]);
-            auto& command = commands_[mn_result->command_id[i] - 1];
+            auto it = commands_.find(mn_result->command_id[i]);
+            if (it == commands_.end()) {
+                continue;
+            }
+            auto& command = it->second;
             if (command.action == "wake") {
                 last_detected_wake_word_ = command.text;
                 running_ = false;
+                RecordDetection(last_detected_wake_word_, mn_result->prob[i]);
                 
                 if (wake_word_detected_callback_) {
                     wake_word_detected_callback_(last_detected_wake_word_);
                 }
+            } else if (command.action.rfind(LOCAL_COMMAND_TOOL_PREFIX, 0) == 0) {
+                if (local_command_callback_) {
+                    local_command_callback_(command.text, command.action.substr(strlen(LOCAL_COMMAND_TOOL_PREFIX)), command.arguments);
+                }
+                // Only the most likely command runs
+                break;
             }
         }
         multinet_->clean(multinet_model_data_);
@@ -194,61 +352,14 @@ size_t CustomWakeWord::GetFeedSize() {
 }
 
 void CustomWakeWord::StoreWakeWordData(const std::vector<int16_t>& data) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.push_back(data);
-    // keep about 2 seconds of data, detect duration is 30ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 30) {
-        wake_word_pcm_.pop_front();
-    }
+    // keep the last WAKE_WORD_PREROLL_MS of audio, encoded in the background
+    preroll_.Store(data.data(), data.size());
 }
 
 void CustomWakeWord::EncodeWakeWordData() {
-    const size_t stack_size = 4096 * 7;
-    wake_word_opus_.clear();
-    if (wake_word_encode_task_stack_ == nullptr) {
-        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(stack_size, MALLOC_CAP_SPIRAM);
-        assert(wake_word_encode_task_stack_ != nullptr);
-    }
-    if (wake_word_encode_task_buffer_ == nullptr) {
-        wake_word_encode_task_buffer_ = (StaticTask_t*)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL);
-        assert(wake_word_encode_task_buffer_ != nullptr);
-    }
-
-    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
-        auto this_ = (CustomWakeWord*)arg;
-        {
-            auto start_time = esp_timer_get_time();
-            auto encoder = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-            encoder->SetComplexity(0); // 0 is the fastest
-
-            int packets = 0;
-            for (auto& pcm: this_->wake_word_pcm_) {
-                encoder->Encode(std::move(pcm), [this_](std::vector<uint8_t>&& opus) {
-                    std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                    this_->wake_word_opus_.emplace_back(std::move(opus));
-                    this_->wake_word_cv_.notify_all();
-                });
-                packets++;
-            }
-            this_->wake_word_pcm_.clear();
-
-            auto end_time = esp_timer_get_time();
-            ESP_LOGI(TAG, "Encode wake word opus %d packets in %ld ms", packets, (long)((end_time - start_time) / 1000));
-
-            std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-            this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-            this_->wake_word_cv_.notify_all();
-        }
-        vTaskDelete(NULL);
-    }, "encode_wake_word", stack_size, this, 2, wake_word_encode_task_stack_, wake_word_encode_task_buffer_);
+    preroll_.Flush();
 }
 
 bool CustomWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
-    std::unique_lock<std::mutex> lock(wake_word_mutex_);
-    wake_word_cv_.wait(lock, [this]() {
-        return !wake_word_opus_.empty();
-    });
-    opus.swap(wake_word_opus_.front());
-    wake_word_opus_.pop_front();
-    return !opus.empty();
+    return preroll_.Pop(opus);
 }
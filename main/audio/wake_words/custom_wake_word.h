@@ -6,16 +6,17 @@
 #include <esp_mn_models.h>
 #include <model_path.h>
 
-#include <deque>
+#include <map>
+#include <mutex>
+#include <unordered_map>
 #include <string>
 #include <vector>
 #include <functional>
-#include <mutex>
-#include <condition_variable>
 #include <atomic>
 
 #include "audio_codec.h"
 #include "wake_word.h"
+#include "wake_word_preroll.h"
 
 class CustomWakeWord : public WakeWord {
 public:
@@ -25,6 +26,7 @@ public:
     bool Initialize(AudioCodec* codec, srmodel_list_t* models_list);
     void Feed(const std::vector<int16_t>& data);
     void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback);
+    void OnWakeWordCandidate(std::function<void()> callback);
     void Start();
     void Stop();
     size_t GetFeedSize();
@@ -32,38 +34,64 @@ public:
     bool GetWakeWordOpus(std::vector<uint8_t>& opus);
     const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
 
+    /*
+     * Local commands, on top of the ones of the assets. A command with the action "wake" is a
+     * wake phrase. They go to the running model through the incremental command API, without
+     * creating it again, and are kept in NVS. Adding a phrase that exists replaces its text and
+     * action. Removing a command of the assets only lasts until the model is loaded again.
+     */
+    bool AddCommand(const std::string& command, const std::string& text, const std::string& action,
+        const std::string& arguments = "{}");
+    bool RemoveCommand(const std::string& command);
+    // A command with the action "tool:<name>" calls that MCP tool with its arguments (a JSON
+    // object) on the device. The detection keeps running, nothing opens the audio channel
+    void OnLocalCommand(std::function<void(const std::string& text, const std::string& tool, const std::string& arguments)> callback) {
+        local_command_callback_ = callback;
+    }
+
 private:
     struct Command {
         std::string command;
         std::string text;
         std::string action;
+        std::string arguments = "{}";
+        // Added at runtime, saved to NVS
+        bool local = false;
     };
 
     // multinet 相关成员变量
     esp_mn_iface_t* multinet_ = nullptr;
     model_iface_data_t* multinet_model_data_ = nullptr;
     srmodel_list_t *models_ = nullptr;
+    // Loaded here rather than shared by the assets, freed with this instance
+    bool owns_models_ = false;
     char* mn_name_ = nullptr;
     std::string language_ = "cn";
     int duration_ = 3000;
     float threshold_ = 0.2;
-    std::deque<Command> commands_;
+    // By multinet command id, and the id of each phrase. Feed() looks the detections up
+    // with commands_mutex_ held, which also keeps the model out of detect() during an update
+    std::mutex commands_mutex_;
+    std::unordered_map<int, Command> commands_;
+    std::map<std::string, int> command_ids_;
  
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
+    std::function<void()> wake_word_candidate_callback_;
+    std::function<void(const std::string& text, const std::string& tool, const std::string& arguments)> local_command_callback_;
     AudioCodec* codec_ = nullptr;
     std::string last_detected_wake_word_;
     std::atomic<bool> running_ = false;
 
-    TaskHandle_t wake_word_encode_task_ = nullptr;
-    StaticTask_t* wake_word_encode_task_buffer_ = nullptr;
-    StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::deque<std::vector<int16_t>> wake_word_pcm_;
-    std::deque<std::vector<uint8_t>> wake_word_opus_;
-    std::mutex wake_word_mutex_;
-    std::condition_variable wake_word_cv_;
+    WakeWordPreroll preroll_;
+    VoiceOnsetDetector onset_detector_;
 
     void StoreWakeWordData(const std::vector<int16_t>& data);
     void ParseWakenetModelConfig();
+    void LoadLocalCommands();
+    void SaveLocalCommands();
+    // Called with commands_mutex_ held, the model only sees them after UpdateModelCommands()
+    int PutCommand(Command&& command);
+    bool UpdateModelCommands();
 };
 
 #endif
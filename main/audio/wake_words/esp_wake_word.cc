@@ -10,6 +10,8 @@ EspWakeWord::EspWakeWord() {
 EspWakeWord::~EspWakeWord() {
     if (wakenet_data_ != nullptr) {
         wakenet_iface_->destroy(wakenet_data_);
+    }
+    if (wakenet_model_ != nullptr && owns_model_) {
         esp_srmodel_deinit(wakenet_model_);
     }
 }
@@ -19,6 +21,7 @@ bool EspWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list) {
 
     if (models_list == nullptr) {
         wakenet_model_ = esp_srmodel_init("model");
+        owns_model_ = true;
     } else {
         wakenet_model_ = models_list;
     }
@@ -48,6 +51,10 @@ void EspWakeWord::OnWakeWordDetected(std::function<void(const std::string& wake_
     wake_word_detected_callback_ = callback;
 }
 
+void EspWakeWord::OnWakeWordCandidate(std::function<void()> callback) {
+    wake_word_candidate_callback_ = callback;
+}
+
 void EspWakeWord::Start() {
     running_ = true;
 }
@@ -61,10 +68,20 @@ void EspWakeWord::Feed(const std::vector<int16_t>& data) {
         return;
     }
 
+#if CONFIG_USE_AUDIO_CHANNEL_PREWARM
+    if (onset_detector_.Process(data.data(), data.size())) {
+        MarkOnset();
+        if (wake_word_candidate_callback_) {
+            wake_word_candidate_callback_();
+        }
+    }
+#endif
+
     int res = wakenet_iface_->detect(wakenet_data_, (int16_t *)data.data());
     if (res > 0) {
         last_detected_wake_word_ = wakenet_iface_->get_word_name(wakenet_data_, res);
         running_ = false;
+        RecordDetection(last_detected_wake_word_);
 
         if (wake_word_detected_callback_) {
             wake_word_detected_callback_(last_detected_wake_word_);
@@ -21,6 +21,7 @@ public:
     bool Initialize(AudioCodec* codec, srmodel_list_t* models_list);
     void Feed(const std::vector<int16_t>& data);
     void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback);
+    void OnWakeWordCandidate(std::function<void()> callback);
     void Start();
     void Stop();
     size_t GetFeedSize();
@@ -32,11 +33,15 @@ private:
     esp_wn_iface_t *wakenet_iface_ = nullptr;
     model_iface_data_t *wakenet_data_ = nullptr;
     srmodel_list_t *wakenet_model_ = nullptr;
+    // Loaded here rather than shared by the assets, freed with this instance
+    bool owns_model_ = false;
     AudioCodec* codec_ = nullptr;
     std::atomic<bool> running_ = false;
 
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
+    std::function<void()> wake_word_candidate_callback_;
     std::string last_detected_wake_word_;
+    VoiceOnsetDetector onset_detector_;
 };
 
 #endif
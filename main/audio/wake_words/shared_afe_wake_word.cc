@@ -0,0 +1,106 @@
+#include "shared_afe_wake_word.h"
+#include "processors/shared_afe.h"
+#include "audio_service.h"
+
+#include <esp_log.h>
+#include <sstream>
+
+#define TAG "SharedAfeWakeWord"
+
+SharedAfeWakeWord::SharedAfeWakeWord(SharedAfe& afe) : afe_(afe) {
+}
+
+SharedAfeWakeWord::~SharedAfeWakeWord() {
+    // Waits for the fetch task to be out of OnFetch()
+    afe_.SetWakeWord(nullptr);
+}
+
+bool SharedAfeWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list) {
+    if (!afe_.Create(codec, models_list)) {
+        return false;
+    }
+    auto models = afe_.models_;
+    if (models == nullptr || models->num == -1 || !afe_.has_wakenet_) {
+        ESP_LOGE(TAG, "Failed to initialize wakenet model");
+        return false;
+    }
+
+    for (int i = 0; i < models->num; i++) {
+        if (strstr(models->model_name[i], ESP_WN_PREFIX) != NULL) {
+            auto words = esp_srmodel_get_wake_words(models, models->model_name[i]);
+            // split by ";" to get all wake words
+            std::stringstream ss(words);
+            std::string word;
+            while (std::getline(ss, word, ';')) {
+                wake_words_.push_back(word);
+            }
+        }
+    }
+    preroll_.Initialize(OPUS_FRAME_DURATION_MS);
+    afe_.SetWakeWord(this);
+    return true;
+}
+
+void SharedAfeWakeWord::OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback) {
+    wake_word_detected_callback_ = callback;
+}
+
+void SharedAfeWakeWord::OnWakeWordCandidate(std::function<void()> callback) {
+    wake_word_candidate_callback_ = callback;
+}
+
+void SharedAfeWakeWord::Start() {
+    preroll_.Reset();
+    is_speaking_ = false;
+    afe_.StartWakeWord();
+}
+
+void SharedAfeWakeWord::Stop() {
+    afe_.StopWakeWord();
+}
+
+void SharedAfeWakeWord::Feed(const std::vector<int16_t>& data) {
+    if (afe_.afe_data_ == nullptr) {
+        return;
+    }
+    afe_.afe_iface_->feed(afe_.afe_data_, data.data());
+}
+
+size_t SharedAfeWakeWord::GetFeedSize() {
+    return afe_.GetFeedSize();
+}
+
+bool SharedAfeWakeWord::OnFetch(afe_fetch_result_t* res) {
+    // Keep the wake word audio for voice recognition, like who is speaking
+    preroll_.Store(res->data, res->data_size / sizeof(int16_t));
+
+    // Speech onset, the wake word may follow
+    if (res->vad_state == VAD_SPEECH && !is_speaking_) {
+        is_speaking_ = true;
+        MarkOnset();
+        if (wake_word_candidate_callback_) {
+            wake_word_candidate_callback_();
+        }
+    } else if (res->vad_state == VAD_SILENCE) {
+        is_speaking_ = false;
+    }
+
+    if (res->wakeup_state != WAKENET_DETECTED) {
+        return false;
+    }
+    int index = res->wakenet_model_index - 1;
+    last_detected_wake_word_ = index >= 0 && index < (int)wake_words_.size() ? wake_words_[index] : "";
+    RecordDetection(last_detected_wake_word_);
+    if (wake_word_detected_callback_) {
+        wake_word_detected_callback_(last_detected_wake_word_);
+    }
+    return true;
+}
+
+void SharedAfeWakeWord::EncodeWakeWordData() {
+    preroll_.Flush();
+}
+
+bool SharedAfeWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
+    return preroll_.Pop(opus);
+}
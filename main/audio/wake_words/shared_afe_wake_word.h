@@ -0,0 +1,54 @@
+#ifndef SHARED_AFE_WAKE_WORD_H
+#define SHARED_AFE_WAKE_WORD_H
+
+#include <esp_afe_sr_models.h>
+#include <model_path.h>
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "audio_codec.h"
+#include "wake_word.h"
+#include "wake_word_preroll.h"
+
+class SharedAfe;
+
+/*
+ * The WakeNet side of a SharedAfe, which the audio service also uses as its audio processor.
+ * It owns what only the wake word needs (the preroll, the callbacks), the AFE instance and
+ * its fetch task belong to the SharedAfe and outlive this object.
+ */
+class SharedAfeWakeWord : public WakeWord {
+public:
+    explicit SharedAfeWakeWord(SharedAfe& afe);
+    ~SharedAfeWakeWord();
+
+    bool Initialize(AudioCodec* codec, srmodel_list_t* models_list);
+    void Feed(const std::vector<int16_t>& data);
+    void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback);
+    void OnWakeWordCandidate(std::function<void()> callback);
+    void Start();
+    void Stop();
+    size_t GetFeedSize();
+    void EncodeWakeWordData();
+    bool GetWakeWordOpus(std::vector<uint8_t>& opus);
+    const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
+
+private:
+    friend class SharedAfe;
+
+    SharedAfe& afe_;
+    std::vector<std::string> wake_words_;
+    std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
+    std::function<void()> wake_word_candidate_callback_;
+    std::string last_detected_wake_word_;
+    bool is_speaking_ = false;
+
+    WakeWordPreroll preroll_;
+
+    // Fetch task of the SharedAfe, returns true on a detection
+    bool OnFetch(afe_fetch_result_t* res);
+};
+
+#endif
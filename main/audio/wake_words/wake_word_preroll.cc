@@ -0,0 +1,163 @@
+#include "wake_word_preroll.h"
+
+#include <esp_log.h>
+#include "heap_accounting.h"
+#include "task_placement.h"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+
+#define TAG "WakeWordPreroll"
+
+WakeWordPreroll::WakeWordPreroll() {
+}
+
+WakeWordPreroll::~WakeWordPreroll() {
+    if (task_ != nullptr) {
+        TaskPlacements::Delete(kTaskWakeWordPreroll, task_);
+    }
+    if (pcm_ != nullptr) {
+        HeapAccounting::Free(kHeapTagAudio, pcm_);
+    }
+}
+
+void WakeWordPreroll::Initialize(int frame_duration_ms) {
+    if (task_ != nullptr) {
+        return;
+    }
+
+    frame_samples_ = 16000 * frame_duration_ms / 1000;
+    frame_.reserve(frame_samples_);
+    packets_.resize(WAKE_WORD_PREROLL_MS / frame_duration_ms);
+
+    pcm_capacity_ = 16000 * WAKE_WORD_PREROLL_MS / 1000;
+    pcm_ = (int16_t*)HeapAccounting::Place(kHeapTagAudio, pcm_capacity_ * sizeof(int16_t), kHeapPlacementPsram);
+    assert(pcm_ != nullptr);
+
+    encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, frame_duration_ms);
+    encoder_->SetComplexity(0); // 0 is the fastest
+
+    TaskPlacements::Create(kTaskWakeWordPreroll, [](void* arg) {
+        auto this_ = (WakeWordPreroll*)arg;
+        this_->EncodeTask();
+        TaskPlacements::Delete(kTaskWakeWordPreroll);
+    }, this, &task_);
+}
+
+void WakeWordPreroll::Reset() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        packet_count_ = 0;
+        flushed_ = false;
+    }
+    reset_requested_ = true;
+    if (task_ != nullptr) {
+        xTaskNotifyGive(task_);
+    }
+}
+
+void WakeWordPreroll::Store(const int16_t* data, size_t samples) {
+    if (pcm_ == nullptr) {
+        return;
+    }
+
+    uint32_t tail = pcm_tail_.load(std::memory_order_relaxed);
+    size_t space = pcm_capacity_ - (tail - pcm_head_.load(std::memory_order_acquire));
+    if (samples > space) {
+        // The encoder is starved by higher priority tasks, keep what fits
+        if (pcm_dropped_ == 0) {
+            ESP_LOGW(TAG, "PCM ring is full, dropping audio");
+        }
+        pcm_dropped_ += samples - space;
+        samples = space;
+    }
+    for (size_t i = 0; i < samples; i++) {
+        pcm_[(tail + i) % pcm_capacity_] = data[i];
+    }
+    pcm_tail_.store(tail + samples, std::memory_order_release);
+    xTaskNotifyGive(task_);
+}
+
+void WakeWordPreroll::Flush() {
+    if (task_ == nullptr) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        flushed_ = true;
+        cv_.notify_all();
+        return;
+    }
+    flush_requested_ = true;
+    xTaskNotifyGive(task_);
+}
+
+bool WakeWordPreroll::Pop(std::vector<uint8_t>& opus) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // The flush only has to encode the last few frames, do not wait forever if it was never requested
+    bool flushed = cv_.wait_for(lock, std::chrono::seconds(1), [this]() {
+        return flushed_;
+    });
+    if (!flushed || packet_count_ == 0) {
+        opus.clear();
+        return false;
+    }
+    // Swap, so the ring slot keeps a buffer to encode into later
+    opus.swap(packets_[packet_head_]);
+    packet_head_ = (packet_head_ + 1) % packets_.size();
+    packet_count_--;
+    return true;
+}
+
+void WakeWordPreroll::EncodeAvailable() {
+    uint32_t head = pcm_head_.load(std::memory_order_relaxed);
+    uint32_t tail = pcm_tail_.load(std::memory_order_acquire);
+    while (head != tail) {
+        size_t count = std::min<size_t>(tail - head, frame_samples_ - frame_.size());
+        for (size_t i = 0; i < count; i++) {
+            frame_.push_back(pcm_[(head + i) % pcm_capacity_]);
+        }
+        head += count;
+        pcm_head_.store(head, std::memory_order_release);
+        if (frame_.size() < frame_samples_) {
+            continue;
+        }
+
+        // The encoder only reads the frame, it keeps the capacity reserved in Initialize()
+        bool encoded = encoder_->Encode(std::move(frame_), encoded_);
+        frame_.clear();
+        if (!encoded) {
+            ESP_LOGE(TAG, "Failed to encode wake word audio");
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t index = (packet_head_ + packet_count_) % packets_.size();
+        packets_[index].swap(encoded_);
+        if (packet_count_ < packets_.size()) {
+            packet_count_++;
+        } else {
+            packet_head_ = (packet_head_ + 1) % packets_.size();
+        }
+    }
+}
+
+void WakeWordPreroll::EncodeTask() {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        if (reset_requested_.exchange(false)) {
+            pcm_head_.store(pcm_tail_.load(std::memory_order_acquire), std::memory_order_release);
+            frame_.clear();
+            encoder_->ResetState();
+        }
+
+        EncodeAvailable();
+
+        if (flush_requested_.exchange(false)) {
+            // The samples of an incomplete frame are dropped
+            frame_.clear();
+            std::lock_guard<std::mutex> lock(mutex_);
+            ESP_LOGI(TAG, "Flush %u wake word packets", packet_count_);
+            flushed_ = true;
+            cv_.notify_all();
+        }
+    }
+}
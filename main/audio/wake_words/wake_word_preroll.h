@@ -0,0 +1,72 @@
+#ifndef WAKE_WORD_PREROLL_H
+#define WAKE_WORD_PREROLL_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include <opus_encoder.h>
+
+// Audio kept before the wake word is detected
+#define WAKE_WORD_PREROLL_MS 2000
+
+/*
+ * Rolling pre-roll of the wake word audio, already encoded to Opus.
+ *
+ * The detector stores PCM into a fixed PSRAM ring, and a low priority task encodes it
+ * in the background into a fixed ring of Opus packets holding the last WAKE_WORD_PREROLL_MS.
+ * When the wake word is detected, Flush() only has to encode the few samples left in the
+ * PCM ring, so the packets can be sent right away.
+ *
+ * Store() must be called from a single task (the detector).
+ */
+class WakeWordPreroll {
+public:
+    WakeWordPreroll();
+    ~WakeWordPreroll();
+
+    void Initialize(int frame_duration_ms);
+    // Drop the stored audio, called when the detection (re)starts
+    void Reset();
+    void Store(const int16_t* data, size_t samples);
+    // Encode what is left and make the packets available to Pop()
+    void Flush();
+    // Blocks until flushed, returns false after the last packet
+    bool Pop(std::vector<uint8_t>& opus);
+
+private:
+    TaskHandle_t task_ = nullptr;
+
+    // PCM ring, the detector produces and the encoder task consumes
+    int16_t* pcm_ = nullptr;
+    size_t pcm_capacity_ = 0;
+    std::atomic<uint32_t> pcm_head_ = 0;
+    std::atomic<uint32_t> pcm_tail_ = 0;
+    uint32_t pcm_dropped_ = 0;
+
+    // Only touched by the encoder task
+    std::unique_ptr<OpusEncoderWrapper> encoder_;
+    std::vector<int16_t> frame_;
+    std::vector<uint8_t> encoded_;
+    size_t frame_samples_ = 0;
+
+    // Opus ring, the oldest packet is overwritten when it is full
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<std::vector<uint8_t>> packets_;
+    size_t packet_head_ = 0;
+    size_t packet_count_ = 0;
+    bool flushed_ = false;
+    std::atomic<bool> flush_requested_ = false;
+    std::atomic<bool> reset_requested_ = false;
+
+    void EncodeTask();
+    void EncodeAvailable();
+};
+
+#endif // WAKE_WORD_PREROLL_H
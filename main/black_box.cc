@@ -0,0 +1,300 @@
+#include "black_box.h"
+
+#if CONFIG_USE_BLACK_BOX
+
+#include <esp_log.h>
+#include <esp_attr.h>
+#include <esp_timer.h>
+#include <esp_system.h>
+#include <esp_heap_caps.h>
+#include <esp_app_desc.h>
+#include <esp_memory_utils.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "application.h"
+#include "board.h"
+#include "audio_codec.h"
+#include "cpu_sampler.h"
+#include "json_writer.h"
+#include "settings.h"
+
+#define TAG "BlackBox"
+
+// Changes with the layout, so the record of a build with another layout reads as missing
+#define BLACK_BOX_MAGIC (0x42420000u ^ (uint32_t)sizeof(BlackBoxRecord))
+#define BLACK_BOX_SAVED_VERSION 1
+
+// Kept through the resets that do not cut the power, cleared by Start()
+RTC_NOINIT_ATTR static BlackBoxRecord rtc_record_;
+
+static bool IsAbnormalReset(esp_reset_reason_t reason) {
+    switch (reason) {
+    case ESP_RST_PANIC:
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+    case ESP_RST_BROWNOUT:
+    case ESP_RST_UNKNOWN:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static const char* ResetReasonName(int reason) {
+    switch (reason) {
+    case ESP_RST_PANIC:
+        return "panic";
+    case ESP_RST_INT_WDT:
+        return "int_wdt";
+    case ESP_RST_TASK_WDT:
+        return "task_wdt";
+    case ESP_RST_WDT:
+        return "wdt";
+    case ESP_RST_BROWNOUT:
+        return "brownout";
+    default:
+        return "unknown";
+    }
+}
+
+// "application.cc:271", or the handler name for line 0
+static void FormatSite(const char* file, int line, char* buffer, size_t size) {
+    const char* name = strrchr(file, '/');
+    name = name != nullptr ? name + 1 : file;
+    if (line > 0) {
+        snprintf(buffer, size, "%s:%d", name, line);
+    } else {
+        snprintf(buffer, size, "%s", name);
+    }
+}
+
+void BlackBox::Start() {
+    if (started_) {
+        return;
+    }
+    started_ = true;
+    auto app_desc = esp_app_get_description();
+    Settings settings("black_box", true);
+
+    esp_reset_reason_t reason = esp_reset_reason();
+    if (rtc_record_.magic == BLACK_BOX_MAGIC && IsAbnormalReset(reason)) {
+        // Too large for the stack of the main task
+        auto saved = std::make_unique<BlackBoxSaved>();
+        saved->reset_reason = reason;
+        saved->record = rtc_record_;
+        saved->record.callback_file = nullptr;
+        // The file name is a literal of the image that wrote the record
+        const char* file = rtc_record_.callback_file;
+        if (file != nullptr && esp_ptr_in_drom(file) &&
+            memcmp(rtc_record_.elf_sha256, app_desc->app_elf_sha256, sizeof(rtc_record_.elf_sha256)) == 0) {
+            FormatSite(file, rtc_record_.callback_line, saved->callback, sizeof(saved->callback));
+        } else {
+            strlcpy(saved->callback, "unknown", sizeof(saved->callback));
+        }
+        settings.SetStruct("last", *saved, BLACK_BOX_SAVED_VERSION);
+        settings.SetBool("pending", true);
+        ESP_LOGW(TAG, "Saved the record of the %s reset: %lu samples, main loop %s %s", ResetReasonName(reason),
+            rtc_record_.samples, rtc_record_.in_callback ? "in" : "after", saved->callback);
+    }
+    upload_pending_ = settings.GetBool("pending");
+
+    memset(&rtc_record_, 0, sizeof(rtc_record_));
+    memcpy(rtc_record_.elf_sha256, app_desc->app_elf_sha256, sizeof(rtc_record_.elf_sha256));
+    rtc_record_.magic = BLACK_BOX_MAGIC;
+    heap_caps_register_failed_alloc_callback(OnAllocFailed);
+}
+
+void BlackBox::OnClockTick(DeviceState state) {
+    if (!started_ || ++ticks_ < CONFIG_BLACK_BOX_INTERVAL_SECONDS) {
+        return;
+    }
+    ticks_ = 0;
+    TakeSample(state);
+}
+
+void BlackBox::TakeSample(DeviceState state) {
+    BlackBoxSample sample = {};
+    sample.uptime_s = esp_timer_get_time() / 1000000;
+    sample.free_internal = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    sample.min_free_internal = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+    sample.largest_internal = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL);
+    sample.free_psram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    sample.state = state;
+
+    int core_load[portNUM_PROCESSORS] = {};
+    CpuTaskLoad top[BLACK_BOX_TOP_TASKS];
+    int count = CpuSampler::GetInstance().GetLastSample(core_load, top, BLACK_BOX_TOP_TASKS);
+    for (int core = 0; core < std::min(portNUM_PROCESSORS, 2); core++) {
+        sample.core_load[core] = core_load[core];
+    }
+    for (int i = 0; i < count; i++) {
+        strlcpy(sample.top[i].name, top[i].name, sizeof(sample.top[i].name));
+        sample.top[i].cpu = top[i].cpu;
+    }
+
+    auto& audio_service = Application::GetInstance().GetAudioService();
+    auto depths = audio_service.GetQueueDepths();
+    sample.queues[0] = std::min<size_t>(depths.encode, UINT8_MAX);
+    sample.queues[1] = std::min<size_t>(depths.send, UINT8_MAX);
+    sample.queues[2] = std::min<size_t>(depths.decode, UINT8_MAX);
+    sample.queues[3] = std::min<size_t>(depths.playback, UINT8_MAX);
+    auto glitches = Board::GetInstance().GetAudioCodec()->GetGlitchStats();
+    uint32_t starved = audio_service.GetPlaybackStarved();
+    sample.underruns = std::min<uint32_t>(glitches.underruns - underruns_, UINT8_MAX);
+    sample.overruns = std::min<uint32_t>(glitches.overruns - overruns_, UINT8_MAX);
+    sample.starved = std::min<uint32_t>(starved - starved_, UINT8_MAX);
+    underruns_ = glitches.underruns;
+    overruns_ = glitches.overruns;
+    starved_ = starved;
+
+    rtc_record_.ring[rtc_record_.samples % CONFIG_BLACK_BOX_SAMPLES] = sample;
+    rtc_record_.samples++;
+}
+
+void BlackBox::OnStateChanged(DeviceState from, DeviceState to) {
+    if (!started_) {
+        return;
+    }
+    auto& transition = rtc_record_.transition_ring[rtc_record_.transitions % BLACK_BOX_TRANSITIONS];
+    transition.uptime_ms = esp_timer_get_time() / 1000;
+    transition.from = from;
+    transition.to = to;
+    rtc_record_.transitions++;
+}
+
+void BlackBox::EnterCallback(const CallSite& site) {
+    if (!started_) {
+        return;
+    }
+    rtc_record_.callback_file = site.file;
+    rtc_record_.callback_line = site.line;
+    rtc_record_.callback_ms = esp_timer_get_time() / 1000;
+    rtc_record_.in_callback = 1;
+}
+
+void BlackBox::LeaveCallback() {
+    rtc_record_.in_callback = 0;
+}
+
+void BlackBox::OnAllocFailed(size_t size, uint32_t caps, const char* function_name) {
+    // Any task, the fields of two failures at once may mix
+    rtc_record_.failed_allocs++;
+    rtc_record_.failed_alloc_size = size;
+    rtc_record_.failed_alloc_caps = caps;
+    rtc_record_.failed_alloc_ms = esp_timer_get_time() / 1000;
+}
+
+void BlackBox::WriteRecordJson(JsonWriter& writer, const BlackBoxRecord& record, const char* callback) {
+    writer.Array("samples");
+    uint32_t count = std::min<uint32_t>(record.samples, CONFIG_BLACK_BOX_SAMPLES);
+    for (uint32_t i = record.samples - count; i < record.samples; i++) {
+        auto& sample = record.ring[i % CONFIG_BLACK_BOX_SAMPLES];
+        writer.Object();
+        writer.Int("t_s", sample.uptime_s);
+        writer.String("state", Application::GetDeviceStateName((DeviceState)sample.state));
+        writer.Int("free", sample.free_internal);
+        writer.Int("min_free", sample.min_free_internal);
+        writer.Int("largest", sample.largest_internal);
+        writer.Int("psram", sample.free_psram);
+        writer.Array("load");
+        for (int core = 0; core < std::min(portNUM_PROCESSORS, 2); core++) {
+            writer.Fragment(std::to_string(sample.core_load[core]));
+        }
+        writer.EndArray();
+        writer.Array("top");
+        for (auto& task : sample.top) {
+            if (task.name[0] == '\0') {
+                break;
+            }
+            writer.Object();
+            writer.String("name", std::string_view(task.name, strnlen(task.name, sizeof(task.name))));
+            writer.Int("cpu", task.cpu);
+            writer.EndObject();
+        }
+        writer.EndArray();
+        writer.Object("queues");
+        writer.Int("encode", sample.queues[0]);
+        writer.Int("send", sample.queues[1]);
+        writer.Int("decode", sample.queues[2]);
+        writer.Int("playback", sample.queues[3]);
+        writer.EndObject();
+        writer.Int("underruns", sample.underruns);
+        writer.Int("overruns", sample.overruns);
+        writer.Int("starved", sample.starved);
+        writer.EndObject();
+    }
+    writer.EndArray();
+
+    writer.Array("transitions");
+    count = std::min<uint32_t>(record.transitions, BLACK_BOX_TRANSITIONS);
+    for (uint32_t i = record.transitions - count; i < record.transitions; i++) {
+        auto& transition = record.transition_ring[i % BLACK_BOX_TRANSITIONS];
+        writer.Object();
+        writer.Int("t_ms", transition.uptime_ms);
+        writer.String("from", Application::GetDeviceStateName((DeviceState)transition.from));
+        writer.String("to", Application::GetDeviceStateName((DeviceState)transition.to));
+        writer.EndObject();
+    }
+    writer.EndArray();
+
+    writer.Object("callback");
+    writer.String("site", callback);
+    writer.Int("t_ms", record.callback_ms);
+    writer.Bool("running", record.in_callback != 0);
+    writer.EndObject();
+
+    writer.Object("failed_alloc");
+    writer.Int("count", record.failed_allocs);
+    writer.Int("size", record.failed_alloc_size);
+    writer.Int("caps", record.failed_alloc_caps);
+    writer.Int("t_ms", record.failed_alloc_ms);
+    writer.EndObject();
+}
+
+void BlackBox::WriteSavedJson(JsonWriter& writer, const char* key) {
+    auto saved = std::make_unique<BlackBoxSaved>();
+    Settings settings("black_box");
+    if (!settings.GetStruct("last", *saved, BLACK_BOX_SAVED_VERSION)) {
+        return;
+    }
+    saved->callback[sizeof(saved->callback) - 1] = '\0';
+    writer.Object(key);
+    writer.String("reset_reason", ResetReasonName(saved->reset_reason));
+    WriteRecordJson(writer, saved->record, saved->callback);
+    writer.EndObject();
+}
+
+void BlackBox::WriteCurrentJson(JsonWriter& writer, const char* key) {
+    // Copied at once, the main loop goes on writing
+    auto record = std::make_unique<BlackBoxRecord>(rtc_record_);
+    char callback[BLACK_BOX_SITE_NAME] = "none";
+    if (record->callback_file != nullptr) {
+        FormatSite(record->callback_file, record->callback_line, callback, sizeof(callback));
+    }
+    writer.Object(key);
+    WriteRecordJson(writer, *record, callback);
+    writer.EndObject();
+}
+
+void BlackBox::OnUploaded() {
+    if (!upload_pending_) {
+        return;
+    }
+    upload_pending_ = false;
+    Settings settings("black_box", true);
+    settings.SetBool("pending", false);
+}
+
+void BlackBox::ClearSaved() {
+    upload_pending_ = false;
+    Settings settings("black_box", true);
+    settings.EraseAll();
+}
+
+#endif // CONFIG_USE_BLACK_BOX
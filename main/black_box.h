@@ -0,0 +1,149 @@
+#ifndef BLACK_BOX_H
+#define BLACK_BOX_H
+
+#include <sdkconfig.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "device_state.h"
+#include "scheduled_task.h"
+
+class JsonWriter;
+
+// The busiest tasks kept per sample, and the length of their names
+#define BLACK_BOX_TOP_TASKS 2
+#define BLACK_BOX_TASK_NAME 12
+// The last state transitions kept
+#define BLACK_BOX_TRANSITIONS 16
+// "application.cc:271" of the main loop callback in the saved record
+#define BLACK_BOX_SITE_NAME 40
+
+struct BlackBoxSample {
+    uint32_t uptime_s;
+    uint32_t free_internal;
+    uint32_t min_free_internal;
+    uint32_t largest_internal;
+    uint32_t free_psram;
+    uint8_t state;
+    uint8_t core_load[2];
+    uint8_t queues[4];      // Encode, send, decode, playback
+    // Since the previous sample, saturated
+    uint8_t underruns;
+    uint8_t overruns;
+    uint8_t starved;
+    struct {
+        char name[BLACK_BOX_TASK_NAME];
+        uint8_t cpu;
+    } top[BLACK_BOX_TOP_TASKS];
+};
+
+struct BlackBoxTransition {
+    uint32_t uptime_ms;
+    uint8_t from;
+    uint8_t to;
+};
+
+// Lives in the RTC memory, it stays through a panic, a watchdog or a software reset
+struct BlackBoxRecord {
+    uint32_t magic;
+    uint8_t elf_sha256[8];          // Of the image that wrote it, the callback file is a pointer into it
+    uint32_t samples;               // Taken so far, the ring keeps the last CONFIG_BLACK_BOX_SAMPLES
+    BlackBoxSample ring[CONFIG_BLACK_BOX_SAMPLES];
+    uint32_t transitions;
+    BlackBoxTransition transition_ring[BLACK_BOX_TRANSITIONS];
+    // The last main loop callback
+    const char* callback_file;
+    int32_t callback_line;
+    uint32_t callback_ms;
+    uint8_t in_callback;
+    // The last allocation that failed
+    uint32_t failed_allocs;
+    uint32_t failed_alloc_size;
+    uint32_t failed_alloc_caps;
+    uint32_t failed_alloc_ms;
+};
+
+// The record of the last abnormal reset, in NVS
+struct BlackBoxSaved {
+    int32_t reset_reason;
+    char callback[BLACK_BOX_SITE_NAME];
+    BlackBoxRecord record;
+};
+
+/*
+ * A flight recorder of the performance context, for the resets that leave nothing else behind.
+ *
+ * Every CONFIG_BLACK_BOX_INTERVAL_SECONDS the main loop writes a sample into a ring in the RTC
+ * memory: the free, lowest and largest internal heap, the PSRAM, the state, the load of each
+ * core and the busiest tasks, the audio queue depths and the I2S and playback glitches since
+ * the previous sample. The state transitions, the main loop callback running and the last
+ * failed allocation are written when they happen, so they are current at the moment of a
+ * panic. Nothing is written to flash while the device runs.
+ *
+ * At the next boot, after a panic, a watchdog or a brownout, Start() copies the ring into NVS
+ * with the reset reason. It stays there until the next abnormal reset, is returned by the
+ * self.get_black_box MCP tool, and is sent once in the "black_box" member of the system info
+ * of the OTA check. A power loss clears the RTC memory, there is nothing to keep then.
+ *
+ * The methods are called by the main task and the main loop. Without CONFIG_USE_BLACK_BOX
+ * every method is an empty inline.
+ */
+class BlackBox {
+public:
+    static BlackBox& GetInstance() {
+        static BlackBox instance;
+        return instance;
+    }
+    BlackBox(const BlackBox&) = delete;
+    BlackBox& operator=(const BlackBox&) = delete;
+
+#if CONFIG_USE_BLACK_BOX
+    // First in the boot: saves the record of an abnormal reset, then starts a new one
+    void Start();
+    // Main loop, every second
+    void OnClockTick(DeviceState state);
+    void OnStateChanged(DeviceState from, DeviceState to);
+    // Main loop, around every callback
+    void EnterCallback(const CallSite& site);
+    void LeaveCallback();
+
+    // The saved record of the last abnormal reset, nothing when there is none
+    void WriteSavedJson(JsonWriter& writer, const char* key);
+    // The record of this boot so far
+    void WriteCurrentJson(JsonWriter& writer, const char* key);
+    // Whether the saved record was not sent with an OTA check yet
+    bool upload_pending() const { return upload_pending_; }
+    void OnUploaded();
+    void ClearSaved();
+#else
+    void Start() {}
+    void OnClockTick(DeviceState state) {}
+    void OnStateChanged(DeviceState from, DeviceState to) {}
+    void EnterCallback(const CallSite& site) {}
+    void LeaveCallback() {}
+    void WriteSavedJson(JsonWriter& writer, const char* key) {}
+    void WriteCurrentJson(JsonWriter& writer, const char* key) {}
+    bool upload_pending() const { return false; }
+    void OnUploaded() {}
+    void ClearSaved() {}
+#endif
+
+private:
+    BlackBox() = default;
+
+#if CONFIG_USE_BLACK_BOX
+    bool started_ = false;
+    bool upload_pending_ = false;
+    uint32_t ticks_ = 0;
+    uint32_t underruns_ = 0;
+    uint32_t overruns_ = 0;
+    uint32_t starved_ = 0;
+
+    void TakeSample(DeviceState state);
+    void WriteRecordJson(JsonWriter& writer, const BlackBoxRecord& record, const char* callback);
+    static void OnAllocFailed(size_t size, uint32_t caps, const char* function_name);
+#endif
+};
+
+#endif // BLACK_BOX_H
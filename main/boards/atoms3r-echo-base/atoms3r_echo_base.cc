@@ -40,20 +40,21 @@ public:
 class Lp5562 : public I2cDevice {
 public:
     Lp5562(i2c_master_bus_handle_t i2c_bus, uint8_t addr) : I2cDevice(i2c_bus, addr) {
-        WriteReg(0x00, 0B01000000); // Set chip_en to 1
-        WriteReg(0x08, 0B00000001); // Enable internal clock
-        WriteReg(0x70, 0B00000000); // Configure all LED outputs to be controlled from I2C registers
+        WriteRegs({
+            {0x00, 0B01000000}, // Set chip_en to 1
+            {0x08, 0B00000001}, // Enable internal clock
+            {0x70, 0B00000000}, // Configure all LED outputs to be controlled from I2C registers
+        });
 
         // PWM clock frequency 558 Hz
-        auto data = ReadReg(0x08);
-        data = data | 0B01000000;
-        WriteReg(0x08, data);
+        SetRegBits(0x08, 0B01000000);
     }
 
     void SetBrightness(uint8_t brightness) {
         // Map 0~100 to 0~255
         brightness = brightness * 255 / 100;
-        WriteReg(0x0E, brightness);
+        // Called by the fade timer of the backlight
+        WriteRegAsync(0x0E, brightness);
     }
 };
 
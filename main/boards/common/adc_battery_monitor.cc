@@ -1,8 +1,77 @@
 #include "adc_battery_monitor.h"
 
+#include <esp_log.h>
+#include <esp_adc/adc_cali_scheme.h>
+#include <algorithm>
+#include <cstdlib>
+
+#define TAG "AdcBatteryMonitor"
+
+#define BATTERY_CHECK_INTERVAL_MS 1000
+// One measurement every this many checks
+#define BATTERY_SAMPLE_TICKS 10
+// The burst takes about 105 ms at the lowest continuous sample rate (611 Hz)
+#define BATTERY_BURST_TIME_MS 150
+#define BATTERY_ONESHOT_SAMPLES 16
+// The reported level only moves by this much, except to 0 and 100
+#define BATTERY_LEVEL_HYSTERESIS 3
+// Without a charging pin, the voltage trend over this many measurements tells if it charges
+#define BATTERY_TREND_MEASUREMENTS 6
+#define BATTERY_TREND_RISE_MV 15
+#define BATTERY_TREND_FALL_MV 5
+
+#if CONFIG_IDF_TARGET_ESP32 || CONFIG_IDF_TARGET_ESP32S2
+#define ADC_OUTPUT_TYPE ADC_DIGI_OUTPUT_FORMAT_TYPE1
+#define ADC_GET_CHANNEL(p_data) ((p_data)->type1.channel)
+#define ADC_GET_DATA(p_data) ((p_data)->type1.data)
+#else
+#define ADC_OUTPUT_TYPE ADC_DIGI_OUTPUT_FORMAT_TYPE2
+#define ADC_GET_CHANNEL(p_data) ((p_data)->type2.channel)
+#define ADC_GET_DATA(p_data) ((p_data)->type2.data)
+#endif
+
+namespace {
+
+// 锂电池放电曲线
+const struct {
+    int mv;
+    int level;
+} kBatteryLevels[] = {
+    {3000, 0},
+    {3450, 5},
+    {3680, 10},
+    {3740, 20},
+    {3770, 30},
+    {3790, 40},
+    {3820, 50},
+    {3870, 60},
+    {3920, 70},
+    {3980, 80},
+    {4050, 90},
+    {4160, 100},
+};
+
+int LevelOfVoltage(int mv) {
+    const int count = sizeof(kBatteryLevels) / sizeof(kBatteryLevels[0]);
+    if (mv <= kBatteryLevels[0].mv) {
+        return 0;
+    }
+    for (int i = 1; i < count; i++) {
+        if (mv < kBatteryLevels[i].mv) {
+            auto& low = kBatteryLevels[i - 1];
+            auto& high = kBatteryLevels[i];
+            return low.level + (mv - low.mv) * (high.level - low.level) / (high.mv - low.mv);
+        }
+    }
+    return 100;
+}
+
+} // namespace
+
 AdcBatteryMonitor::AdcBatteryMonitor(adc_unit_t adc_unit, adc_channel_t adc_channel, float upper_resistor, float lower_resistor, gpio_num_t charging_pin)
-    : charging_pin_(charging_pin) {
-    
+    : charging_pin_(charging_pin), adc_unit_(adc_unit), adc_channel_(adc_channel),
+      divider_ratio_((upper_resistor + lower_resistor) / lower_resistor) {
+
     // Initialize charging pin (only if it's not NC)
     if (charging_pin_ != GPIO_NUM_NC) {
         gpio_config_t gpio_cfg = {
@@ -13,33 +82,10 @@ AdcBatteryMonitor::AdcBatteryMonitor(adc_unit_t adc_unit, adc_channel_t adc_chan
             .intr_type = GPIO_INTR_DISABLE,
         };
         ESP_ERROR_CHECK(gpio_config(&gpio_cfg));
+        is_charging_ = gpio_get_level(charging_pin_) == 1;
     }
 
-    // Initialize ADC battery estimation
-    adc_battery_estimation_t adc_cfg = {
-        .internal = {
-            .adc_unit = adc_unit,
-            .adc_bitwidth = ADC_BITWIDTH_DEFAULT,
-            .adc_atten = ADC_ATTEN_DB_12,
-        },
-        .adc_channel = adc_channel,
-        .upper_resistor = upper_resistor,
-        .lower_resistor = lower_resistor
-    };
-
-    // 在ADC配置部分进行条件设置
-    if (charging_pin_ != GPIO_NUM_NC) {
-        adc_cfg.charging_detect_cb = [](void *user_data) -> bool {
-            AdcBatteryMonitor *self = (AdcBatteryMonitor *)user_data;
-            return gpio_get_level(self->charging_pin_) == 1;
-        };
-        adc_cfg.charging_detect_user_data = this;
-    } else {
-        // 不设置回调，让adc_battery_estimation库使用软件估算
-        adc_cfg.charging_detect_cb = nullptr;
-        adc_cfg.charging_detect_user_data = nullptr;
-    }
-    adc_battery_estimation_handle_ = adc_battery_estimation_create(&adc_cfg);
+    InitializeAdc();
 
     // Initialize timer
     esp_timer_create_args_t timer_cfg = {
@@ -48,39 +94,114 @@ AdcBatteryMonitor::AdcBatteryMonitor(adc_unit_t adc_unit, adc_channel_t adc_chan
             self->CheckBatteryStatus();
         },
         .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
         .name = "adc_battery_monitor",
+        .skip_unhandled_events = true,
     };
     ESP_ERROR_CHECK(esp_timer_create(&timer_cfg, &timer_handle_));
-    ESP_ERROR_CHECK(esp_timer_start_periodic(timer_handle_, 1000000));
+
+    esp_timer_create_args_t burst_timer_cfg = {
+        .callback = [](void *arg) {
+            AdcBatteryMonitor *self = (AdcBatteryMonitor *)arg;
+            self->ReadBurst();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "adc_battery_burst",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&burst_timer_cfg, &burst_timer_handle_));
+
+    // The first level comes with the first burst, not a whole interval later
+    StartBurst();
+    ESP_ERROR_CHECK(esp_timer_start_periodic(timer_handle_, BATTERY_CHECK_INTERVAL_MS * 1000));
 }
 
 AdcBatteryMonitor::~AdcBatteryMonitor() {
-    if (adc_battery_estimation_handle_) {
-        ESP_ERROR_CHECK(adc_battery_estimation_destroy(adc_battery_estimation_handle_));
-    }
-    
     if (timer_handle_) {
         esp_timer_stop(timer_handle_);
         esp_timer_delete(timer_handle_);
     }
+    if (burst_timer_handle_) {
+        esp_timer_stop(burst_timer_handle_);
+        esp_timer_delete(burst_timer_handle_);
+    }
+#if SOC_ADC_DMA_SUPPORTED && !CONFIG_IDF_TARGET_ESP32
+    if (adc_handle_) {
+        adc_continuous_stop(adc_handle_);
+        adc_continuous_deinit(adc_handle_);
+    }
+#else
+    if (adc_handle_) {
+        adc_oneshot_del_unit(adc_handle_);
+    }
+#endif
+    if (cali_handle_) {
+#if ADC_CALI_SCHEME_CURVE_FITTING_SUPPORTED
+        adc_cali_delete_scheme_curve_fitting(cali_handle_);
+#elif ADC_CALI_SCHEME_LINE_FITTING_SUPPORTED
+        adc_cali_delete_scheme_line_fitting(cali_handle_);
+#endif
+    }
 }
 
-bool AdcBatteryMonitor::IsCharging() {
-    // 优先使用adc_battery_estimation库的功能
-    if (adc_battery_estimation_handle_ != nullptr) {
-        bool is_charging = false;
-        esp_err_t err = adc_battery_estimation_get_charging_state(adc_battery_estimation_handle_, &is_charging);
-        if (err == ESP_OK) {
-            return is_charging;
-        }
-    }
-    
-    // 回退到GPIO读取或返回默认值
-    if (charging_pin_ != GPIO_NUM_NC) {
-        return gpio_get_level(charging_pin_) == 1;
+void AdcBatteryMonitor::InitializeAdc() {
+#if SOC_ADC_DMA_SUPPORTED && !CONFIG_IDF_TARGET_ESP32
+    adc_continuous_handle_cfg_t handle_cfg = {};
+    handle_cfg.max_store_buf_size = sizeof(burst_buffer_) * 2;
+    handle_cfg.conv_frame_size = sizeof(burst_buffer_);
+    // Only the latest frame matters, the older ones are dropped while nobody reads
+    handle_cfg.flags.flush_pool = true;
+    ESP_ERROR_CHECK(adc_continuous_new_handle(&handle_cfg, &adc_handle_));
+
+    adc_digi_pattern_config_t pattern = {};
+    pattern.atten = ADC_ATTEN_DB_12;
+    pattern.channel = adc_channel_;
+    pattern.unit = adc_unit_;
+    pattern.bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+
+    adc_continuous_config_t adc_cfg = {};
+    adc_cfg.pattern_num = 1;
+    adc_cfg.adc_pattern = &pattern;
+    adc_cfg.sample_freq_hz = SOC_ADC_SAMPLE_FREQ_THRES_LOW;
+    adc_cfg.conv_mode = adc_unit_ == ADC_UNIT_1 ? ADC_CONV_SINGLE_UNIT_1 : ADC_CONV_SINGLE_UNIT_2;
+    adc_cfg.format = ADC_OUTPUT_TYPE;
+    ESP_ERROR_CHECK(adc_continuous_config(adc_handle_, &adc_cfg));
+#else
+    adc_oneshot_unit_init_cfg_t init_config = {};
+    init_config.unit_id = adc_unit_;
+    init_config.ulp_mode = ADC_ULP_MODE_DISABLE;
+    ESP_ERROR_CHECK(adc_oneshot_new_unit(&init_config, &adc_handle_));
+
+    adc_oneshot_chan_cfg_t chan_config = {};
+    chan_config.atten = ADC_ATTEN_DB_12;
+    chan_config.bitwidth = ADC_BITWIDTH_DEFAULT;
+    ESP_ERROR_CHECK(adc_oneshot_config_channel(adc_handle_, adc_channel_, &chan_config));
+#endif
+
+    esp_err_t err = ESP_ERR_NOT_SUPPORTED;
+#if ADC_CALI_SCHEME_CURVE_FITTING_SUPPORTED
+    adc_cali_curve_fitting_config_t cali_cfg = {};
+    cali_cfg.unit_id = adc_unit_;
+    cali_cfg.chan = adc_channel_;
+    cali_cfg.atten = ADC_ATTEN_DB_12;
+    cali_cfg.bitwidth = ADC_BITWIDTH_DEFAULT;
+    err = adc_cali_create_scheme_curve_fitting(&cali_cfg, &cali_handle_);
+#elif ADC_CALI_SCHEME_LINE_FITTING_SUPPORTED
+    adc_cali_line_fitting_config_t cali_cfg = {};
+    cali_cfg.unit_id = adc_unit_;
+    cali_cfg.atten = ADC_ATTEN_DB_12;
+    cali_cfg.bitwidth = ADC_BITWIDTH_DEFAULT;
+    err = adc_cali_create_scheme_line_fitting(&cali_cfg, &cali_handle_);
+#endif
+    if (err != ESP_OK) {
+        cali_handle_ = nullptr;
+        ESP_LOGW(TAG, "ADC calibration not available: %s", esp_err_to_name(err));
     }
-    
-    return false;
+}
+
+bool AdcBatteryMonitor::IsCharging() {
+    return is_charging_;
 }
 
 bool AdcBatteryMonitor::IsDischarging() {
@@ -88,17 +209,7 @@ bool AdcBatteryMonitor::IsDischarging() {
 }
 
 uint8_t AdcBatteryMonitor::GetBatteryLevel() {
-    // 如果句柄无效，返回默认值
-    if (adc_battery_estimation_handle_ == nullptr) {
-        return 100;
-    }
-    
-    float capacity = 0;
-    esp_err_t err = adc_battery_estimation_get_capacity(adc_battery_estimation_handle_, &capacity);
-    if (err != ESP_OK) {
-        return 100; // 出错时返回默认值
-    }
-    return (uint8_t)capacity;
+    return level_;
 }
 
 void AdcBatteryMonitor::OnChargingStatusChanged(std::function<void(bool)> callback) {
@@ -106,11 +217,108 @@ void AdcBatteryMonitor::OnChargingStatusChanged(std::function<void(bool)> callba
 }
 
 void AdcBatteryMonitor::CheckBatteryStatus() {
-    bool new_charging_status = IsCharging();
-    if (new_charging_status != is_charging_) {
-        is_charging_ = new_charging_status;
-        if (on_charging_status_changed_) {
-            on_charging_status_changed_(is_charging_);
+    if (charging_pin_ != GPIO_NUM_NC) {
+        SetCharging(gpio_get_level(charging_pin_) == 1);
+    }
+
+    if (++ticks_ % BATTERY_SAMPLE_TICKS == 0) {
+        StartBurst();
+    }
+}
+
+void AdcBatteryMonitor::StartBurst() {
+#if SOC_ADC_DMA_SUPPORTED && !CONFIG_IDF_TARGET_ESP32
+    esp_err_t err = adc_continuous_start(adc_handle_);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to start the ADC: %s", esp_err_to_name(err));
+        return;
+    }
+    // The DMA fills the frame meanwhile, the CPU wakes up once to read it
+    esp_timer_start_once(burst_timer_handle_, BATTERY_BURST_TIME_MS * 1000);
+#else
+    ReadBurst();
+#endif
+}
+
+void AdcBatteryMonitor::ReadBurst() {
+    uint16_t samples[BATTERY_BURST_SAMPLES];
+    int count = 0;
+#if SOC_ADC_DMA_SUPPORTED && !CONFIG_IDF_TARGET_ESP32
+    uint32_t length = 0;
+    esp_err_t err = adc_continuous_read(adc_handle_, burst_buffer_, sizeof(burst_buffer_), &length, 0);
+    // Stopped until the next burst, so the ADC does not hold its power management lock
+    adc_continuous_stop(adc_handle_);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "No ADC data: %s", esp_err_to_name(err));
+        return;
+    }
+    for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= length && count < BATTERY_BURST_SAMPLES; i += SOC_ADC_DIGI_RESULT_BYTES) {
+        auto data = reinterpret_cast<adc_digi_output_data_t*>(&burst_buffer_[i]);
+        if (ADC_GET_CHANNEL(data) == adc_channel_) {
+            samples[count++] = ADC_GET_DATA(data);
         }
     }
-}
\ No newline at end of file
+#else
+    for (int i = 0; i < BATTERY_ONESHOT_SAMPLES; i++) {
+        int raw;
+        if (adc_oneshot_read(adc_handle_, adc_channel_, &raw) == ESP_OK) {
+            samples[count++] = raw;
+        }
+    }
+#endif
+    if (count == 0) {
+        return;
+    }
+    // The median drops the spikes of the radio and the speaker on the supply
+    std::nth_element(samples, samples + count / 2, samples + count);
+    Update(samples[count / 2]);
+}
+
+void AdcBatteryMonitor::Update(int raw) {
+    int mv;
+    if (cali_handle_ == nullptr || adc_cali_raw_to_voltage(cali_handle_, raw, &mv) != ESP_OK) {
+        // Nominal full scale of the 12 dB attenuation
+        mv = raw * 3100 / 4095;
+    }
+    int battery_mv = (int)(mv * divider_ratio_);
+
+    // IIR filter, a quarter of the step per measurement
+    if (filtered_mv_ == 0) {
+        filtered_mv_ = battery_mv;
+        trend_mv_ = battery_mv;
+    } else {
+        filtered_mv_ += (battery_mv - filtered_mv_) / 4;
+    }
+
+    if (charging_pin_ == GPIO_NUM_NC && ++measurements_ % BATTERY_TREND_MEASUREMENTS == 0) {
+        int delta = filtered_mv_ - trend_mv_;
+        if (delta > BATTERY_TREND_RISE_MV) {
+            SetCharging(true);
+        } else if (delta < -BATTERY_TREND_FALL_MV) {
+            SetCharging(false);
+        }
+        trend_mv_ = filtered_mv_;
+    }
+
+    int level = LevelOfVoltage(filtered_mv_);
+    int current = level_;
+    if (!level_valid_ || std::abs(level - current) >= BATTERY_LEVEL_HYSTERESIS || level == 0 || level == 100) {
+        if (level != current) {
+            ESP_LOGI(TAG, "Battery %d mV, level %d%%", filtered_mv_, level);
+        }
+        level_ = level;
+        level_valid_ = true;
+    }
+}
+
+void AdcBatteryMonitor::SetCharging(bool charging) {
+    if (charging == is_charging_) {
+        return;
+    }
+    is_charging_ = charging;
+    // The charger shifts the voltage, the next level is taken as it is
+    level_valid_ = false;
+    if (on_charging_status_changed_) {
+        on_charging_status_changed_(charging);
+    }
+}
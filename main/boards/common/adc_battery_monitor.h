@@ -1,11 +1,28 @@
 #ifndef ADC_BATTERY_MONITOR_H
 #define ADC_BATTERY_MONITOR_H
 
+#include <sdkconfig.h>
 #include <functional>
+#include <atomic>
 #include <driver/gpio.h>
-#include <adc_battery_estimation.h>
+#include <esp_adc/adc_cali.h>
+#include <esp_adc/adc_oneshot.h>
+#include <esp_adc/adc_continuous.h>
 #include <esp_timer.h>
+#include <soc/soc_caps.h>
 
+// Samples of one measurement, their median goes through the IIR filter
+#define BATTERY_BURST_SAMPLES 64
+
+/*
+ * 电池电压经电阻分压后由 ADC 采样
+ *
+ * Every BATTERY_SAMPLE_INTERVAL_MS the ADC runs in continuous mode for a short burst, DMA fills
+ * the buffer at the lowest sample rate and the CPU only wakes up once to read it back. The median
+ * of the burst goes through an IIR filter, and the reported level only moves by the hysteresis,
+ * so the battery icon does not flip between two levels.
+ * The ESP32 has the ADC DMA on I2S0, which the audio uses, so it reads the burst in one-shot mode.
+ */
 class AdcBatteryMonitor {
 public:
     AdcBatteryMonitor(adc_unit_t adc_unit, adc_channel_t adc_channel, float upper_resistor, float lower_resistor, gpio_num_t charging_pin = GPIO_NUM_NC);
@@ -19,12 +36,35 @@ public:
 
 private:
     gpio_num_t charging_pin_;
-    adc_battery_estimation_handle_t adc_battery_estimation_handle_ = nullptr;
+    adc_unit_t adc_unit_;
+    adc_channel_t adc_channel_;
+    float divider_ratio_;
+#if SOC_ADC_DMA_SUPPORTED && !CONFIG_IDF_TARGET_ESP32
+    adc_continuous_handle_t adc_handle_ = nullptr;
+    uint8_t burst_buffer_[BATTERY_BURST_SAMPLES * SOC_ADC_DIGI_RESULT_BYTES];
+#else
+    adc_oneshot_unit_handle_t adc_handle_ = nullptr;
+#endif
+    adc_cali_handle_t cali_handle_ = nullptr;
     esp_timer_handle_t timer_handle_ = nullptr;
-    bool is_charging_ = false;
+    esp_timer_handle_t burst_timer_handle_ = nullptr;
+    int ticks_ = 0;
+    int measurements_ = 0;
+    bool level_valid_ = false;          // Cleared when the charging status changes, the next level applies as it is
+
+    // Filtered battery voltage, 0 until the first measurement
+    int filtered_mv_ = 0;
+    int trend_mv_ = 0;                  // filtered_mv_ at the last trend check, without a charging pin
+    std::atomic<uint8_t> level_ = 100;
+    std::atomic<bool> is_charging_ = false;
     std::function<void(bool)> on_charging_status_changed_;
 
+    void InitializeAdc();
     void CheckBatteryStatus();
+    void StartBurst();
+    void ReadBurst();
+    void Update(int raw);
+    void SetCharging(bool charging);
 };
 
 #endif // ADC_BATTERY_MONITOR_H
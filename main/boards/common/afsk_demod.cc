@@ -1,6 +1,7 @@
 #include "afsk_demod.h"
 #include <cstring>
 #include <algorithm>
+#include <limits>
 #include "esp_log.h"
 #include "display.h"
 
@@ -19,9 +20,11 @@ namespace audio_wifi_config
                                     )
     {
         const int kInputSampleRate = 16000;                                    // Input sampling rate
-        const float kDownsampleStep = static_cast<float>(kInputSampleRate) / static_cast<float>(kAudioSampleRate); // Downsampling step
         std::vector<int16_t> audio_data;
-        AudioSignalProcessor signal_processor(kAudioSampleRate, kMarkFrequency, kSpaceFrequency, kBitRate, kWindowSize);
+        std::vector<float> probabilities;
+        probabilities.reserve(8);
+        AudioSignalProcessor signal_processor(kAudioSampleRate, kMarkFrequency, kSpaceFrequency, kBitRate, kWindowSize,
+                                              kInputSampleRate);
         AudioDataBuffer data_buffer;
 
         while (true)
@@ -40,36 +43,8 @@ namespace audio_wifi_config
                 continue;
             }
 
-            if (input_channels == 2) { // 如果是双声道输入，转换为单声道
-                auto mono_data = std::vector<int16_t>(audio_data.size() / 2);
-                for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                    mono_data[i] = audio_data[j];
-                }
-                audio_data = std::move(mono_data);
-            }
-            
-            // Downsample the audio data
-            std::vector<float> downsampled_data;
-            size_t last_index = 0;
-
-            if (kDownsampleStep > 1.0f) {
-                downsampled_data.reserve(audio_data.size() / static_cast<size_t>(kDownsampleStep));
-                for (size_t i = 0; i < audio_data.size(); ++i) {
-                    size_t sample_index = static_cast<size_t>(i / kDownsampleStep);
-                    if ((sample_index + 1) > last_index) {
-                        downsampled_data.push_back(static_cast<float>(audio_data[i]));
-                        last_index = sample_index + 1;
-                    }
-                }
-            } else {
-                downsampled_data.reserve(audio_data.size());
-                for (int16_t sample : audio_data) {
-                    downsampled_data.push_back(static_cast<float>(sample));
-                }
-            }
-            
-            // Process audio samples to get probability data
-            auto probabilities = signal_processor.ProcessAudioSamples(downsampled_data);
+            // 双声道输入只取第一个声道，降采样在信号处理器里完成，不复制数据
+            signal_processor.ProcessAudioSamples(audio_data.data(), audio_data.size(), input_channels, probabilities);
             
             // Feed probability data to the data buffer
             if (data_buffer.ProcessProbabilityData(probabilities, 0.5f)) {
@@ -113,109 +88,117 @@ namespace audio_wifi_config
         0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 1, 0, 0};
 
     // FrequencyDetector implementation
-    FrequencyDetector::FrequencyDetector(float frequency, size_t window_size)
-        : frequency_(frequency), window_size_(window_size) {
-        frequency_bin_ = std::floor(frequency_ * static_cast<float>(window_size_));
-        angular_frequency_ = 2.0f * M_PI * frequency_;
-        cos_coefficient_ = std::cos(angular_frequency_);
-        sin_coefficient_ = std::sin(angular_frequency_);
-        filter_coefficient_ = 2.0f * cos_coefficient_;
-
-        // Initialize state buffer
-        state_buffer_.push_back(0.0f);
-        state_buffer_.push_back(0.0f);
-    }
-
-    void FrequencyDetector::Reset() {
-        state_buffer_.clear();
-        state_buffer_.push_back(0.0f);
-        state_buffer_.push_back(0.0f);
+    FrequencyDetector::FrequencyDetector(float frequency)
+        : filter_coefficient_(static_cast<int32_t>(std::lround(2.0 * std::cos(2.0 * M_PI * frequency) * 16384.0))) {
     }
 
-    void FrequencyDetector::ProcessSample(float sample) {
-        if (state_buffer_.size() < 2) {
-            return;
-        }
-
-        float s_minus_2 = state_buffer_.front();  // S[-2]
-        state_buffer_.pop_front();
-        float s_minus_1 = state_buffer_.front();  // S[-1]
-        state_buffer_.pop_front();
-
-        float s_current = sample + filter_coefficient_ * s_minus_1 - s_minus_2;
-
-        state_buffer_.push_back(s_minus_1);  // Put S[-1] back
-        state_buffer_.push_back(s_current);  // Add new S[0]
-    }
-
-    float FrequencyDetector::GetAmplitude() const {
-        if (state_buffer_.size() < 2) {
-            return 0.0f;
-        }
-
-        float s_minus_1 = state_buffer_[1];                      // S[-1]
-        float s_minus_2 = state_buffer_[0];                      // S[-2]
-        float real_part = cos_coefficient_ * s_minus_1 - s_minus_2;  // Real part
-        float imaginary_part = sin_coefficient_ * s_minus_1;         // Imaginary part
-
-        return std::sqrt(real_part * real_part + imaginary_part * imaginary_part) / 
-               (static_cast<float>(window_size_) / 2.0f);
+    uint64_t FrequencyDetector::GetPower() const {
+        // |S[-1] - e^(-jw) S[-2]|^2 = S[-1]^2 + S[-2]^2 - 2cos(w) S[-1] S[-2]
+        int64_t s1 = s_minus_1_;
+        int64_t s2 = s_minus_2_;
+        int64_t power = s1 * s1 + s2 * s2 - ((filter_coefficient_ * s1 * s2) >> 14);
+        return power > 0 ? static_cast<uint64_t>(power) : 0;
     }
 
     // AudioSignalProcessor implementation
     AudioSignalProcessor::AudioSignalProcessor(size_t sample_rate, size_t mark_frequency, size_t space_frequency,
-                                             size_t bit_rate, size_t window_size)
-        : input_buffer_size_(window_size), output_sample_count_(0) {
+                                             size_t bit_rate, size_t window_size, size_t input_sample_rate)
+        : input_sample_rate_(input_sample_rate > sample_rate ? input_sample_rate : sample_rate),
+          sample_rate_(sample_rate),
+          mark_detector_(static_cast<float>(mark_frequency) / static_cast<float>(sample_rate)),
+          space_detector_(static_cast<float>(space_frequency) / static_cast<float>(sample_rate)) {
         if (sample_rate % bit_rate != 0) {
             // On ESP32 we can continue execution, but log the error
             ESP_LOGW(kLogTag, "Sample rate %zu is not divisible by bit rate %zu", sample_rate, bit_rate);
         }
 
-        float normalized_mark_freq = static_cast<float>(mark_frequency) / static_cast<float>(sample_rate);
-        float normalized_space_freq = static_cast<float>(space_frequency) / static_cast<float>(sample_rate);
+        window_.assign(window_size, 0);
+        samples_per_bit_ = sample_rate / bit_rate;  // Number of samples per bit
+        samples_per_phase_ = std::max<size_t>(samples_per_bit_ / kTimingPhases, 1);
+        if (samples_per_bit_ % kTimingPhases != 0) {
+            ESP_LOGW(kLogTag, "Samples per bit %zu is not divisible by %zu timing phases", samples_per_bit_, kTimingPhases);
+        }
+    }
 
-        mark_detector_ = std::make_unique<FrequencyDetector>(normalized_mark_freq, window_size);
-        space_detector_ = std::make_unique<FrequencyDetector>(normalized_space_freq, window_size);
+    void AudioSignalProcessor::ProcessAudioSamples(const int16_t *samples, size_t count, size_t channels,
+                                                   std::vector<float> &probabilities) {
+        probabilities.clear();
+        if (channels == 0) {
+            channels = 1;
+        }
 
-        samples_per_bit_ = sample_rate / bit_rate;  // Number of samples per bit
+        for (size_t i = 0; i < count; i += channels) {
+            if (input_sample_rate_ == sample_rate_) {
+                ProcessSample(samples[i], probabilities);
+                continue;
+            }
+            decimation_sum_ += samples[i];
+            decimation_count_++;
+            decimation_phase_ += sample_rate_;
+            if (decimation_phase_ >= input_sample_rate_) {
+                decimation_phase_ -= input_sample_rate_;
+                ProcessSample(static_cast<int16_t>(decimation_sum_ / decimation_count_), probabilities);
+                decimation_sum_ = 0;
+                decimation_count_ = 0;
+            }
+        }
     }
 
-    std::vector<float> AudioSignalProcessor::ProcessAudioSamples(const std::vector<float> &samples) {
-        std::vector<float> result;
-
-        for (float sample : samples) {
-            if (input_buffer_.size() < input_buffer_size_) {
-                input_buffer_.push_back(sample);  // Just add, don't process yet
-            } else {
-                // Input buffer is full, process the data
-                input_buffer_.pop_front();   // Remove oldest sample
-                input_buffer_.push_back(sample);  // Add new sample
-                output_sample_count_++;
-
-                if (output_sample_count_ >= samples_per_bit_) {
-                    // Process all samples in the window using Goertzel algorithm
-                    for (float window_sample : input_buffer_) {
-                        mark_detector_->ProcessSample(window_sample);
-                        space_detector_->ProcessSample(window_sample);
-                    }
+    void AudioSignalProcessor::ProcessSample(int16_t sample, std::vector<float> &probabilities) {
+        window_[window_position_] = sample;
+        window_position_ = (window_position_ + 1) % window_.size();
+        if (window_filled_ < window_.size()) {
+            window_filled_++;
+        }
 
-                    float mark_amplitude = mark_detector_->GetAmplitude();   // Mark amplitude
-                    float space_amplitude = space_detector_->GetAmplitude(); // Space amplitude
+        if (++phase_sample_count_ < samples_per_phase_) {
+            return;
+        }
+        phase_sample_count_ = 0;
+        if (window_filled_ == window_.size()) {
+            Measure(probabilities);
+        }
+    }
 
-                    // Avoid division by zero
-                    float mark_probability = mark_amplitude / 
-                                           (space_amplitude + mark_amplitude + std::numeric_limits<float>::epsilon());
-                    result.push_back(mark_probability);
+    void AudioSignalProcessor::Measure(std::vector<float> &probabilities) {
+        // The ring starts with the oldest sample at window_position_
+        mark_detector_.Reset();
+        space_detector_.Reset();
+        size_t size = window_.size();
+        for (size_t i = 0, j = window_position_; i < size; ++i, j = (j + 1 == size) ? 0 : j + 1) {
+            int32_t window_sample = window_[j];
+            mark_detector_.ProcessSample(window_sample);
+            space_detector_.ProcessSample(window_sample);
+        }
 
-                    // Reset detector windows
-                    mark_detector_->Reset();
-                    space_detector_->Reset();
-                    output_sample_count_ = 0;  // Reset output counter
-                }
-            }
+        uint64_t mark_power = mark_detector_.GetPower();     // Mark power
+        uint64_t space_power = space_detector_.GetPower();   // Space power
+        uint64_t total_power = mark_power + space_power;
+        uint64_t difference = mark_power > space_power ? mark_power - space_power : space_power - mark_power;
+        uint32_t contrast = total_power > 0 ? static_cast<uint32_t>((difference << 8) / total_power) : 0;
+
+        // Leaky integration over about 8 bits, the phase where the window covers a single bit wins
+        uint32_t &integrated = phase_contrast_[phase_];
+        integrated = integrated - (integrated >> 3) + contrast;
+        if (integrated > phase_contrast_[best_phase_]) {
+            best_phase_ = phase_;
         }
 
-        return result;
+        // One bit per bit period. When the best phase moves, the bit comes a little early or late,
+        // never twice or not at all
+        measurements_since_bit_++;
+        bool aligned = phase_ == best_phase_ && measurements_since_bit_ >= kTimingPhases / 2;
+        if (aligned || measurements_since_bit_ >= kTimingPhases + kTimingPhases / 2) {
+            float mark_amplitude = std::sqrt(static_cast<float>(mark_power));     // Mark amplitude
+            float space_amplitude = std::sqrt(static_cast<float>(space_power));   // Space amplitude
+
+            // Avoid division by zero
+            float mark_probability = mark_amplitude /
+                                   (space_amplitude + mark_amplitude + std::numeric_limits<float>::epsilon());
+            probabilities.push_back(mark_probability);
+            measurements_since_bit_ = 0;
+        }
+        phase_ = (phase_ + 1) % kTimingPhases;
     }
 
     // AudioDataBuffer implementation
@@ -276,8 +259,8 @@ namespace audio_wifi_config
             case DataReceptionState::kWaiting:
                 // Waiting state, possibly waiting for transmission end
                 if (identifier_buffer_.size() >= start_of_transmission_.size()) {
-                    std::vector<uint8_t> identifier_snapshot(identifier_buffer_.begin(), identifier_buffer_.end());
-                    if (identifier_snapshot == start_of_transmission_)
+                    if (std::equal(identifier_buffer_.begin(), identifier_buffer_.end(),
+                                   start_of_transmission_.begin(), start_of_transmission_.end()))
                     {
                         ClearBuffers();                                // Clear buffers
                         current_state_ = DataReceptionState::kReceiving;  // Enter receiving state
@@ -289,8 +272,8 @@ namespace audio_wifi_config
             case DataReceptionState::kReceiving:
                 bit_buffer_.push_back(bit);
                 if (identifier_buffer_.size() >= end_of_transmission_.size()) {
-                    std::vector<uint8_t> identifier_snapshot(identifier_buffer_.begin(), identifier_buffer_.end());
-                    if (identifier_snapshot == end_of_transmission_) {
+                    if (std::equal(identifier_buffer_.begin(), identifier_buffer_.end(),
+                                   end_of_transmission_.begin(), end_of_transmission_.end())) {
                         current_state_ = DataReceptionState::kInactive;  // Enter inactive state
 
                         // Convert bits to bytes
@@ -6,6 +6,7 @@
 #include <memory>
 #include <optional>
 #include <cmath>
+#include <cstdint>
 #include "wifi_configuration_ap.h"
 #include "application.h"
 
@@ -23,60 +24,82 @@ namespace audio_wifi_config
                                          size_t input_channels = 1);
 
     /**
-     * Goertzel algorithm implementation for single frequency detection
-     * Used to detect specific audio frequencies in the AFSK demodulation process
+     * Fixed-point Goertzel algorithm for single frequency detection
+     * Used to detect specific audio frequencies in the AFSK demodulation process.
+     * The state is two integer registers, so it runs as fast on the chips without an FPU
      */
     class FrequencyDetector
     {
     private:
-        float frequency_;              // Target frequency (normalized, i.e., f / fs)
-        size_t window_size_;           // Window size for analysis
-        float frequency_bin_;          // Frequency bin
-        float angular_frequency_;      // Angular frequency
-        float cos_coefficient_;        // cos(w)
-        float sin_coefficient_;        // sin(w)
-        float filter_coefficient_;     // 2 * cos(w)
-        std::deque<float> state_buffer_;  // Circular buffer for storing S[-1] and S[-2]
+        int32_t filter_coefficient_;   // 2 * cos(w), Q14
+        int32_t s_minus_1_ = 0;       // S[-1]
+        int32_t s_minus_2_ = 0;       // S[-2]
 
     public:
         /**
          * Constructor
          * @param frequency Normalized frequency (f / fs)
-         * @param window_size Window size for analysis
          */
-        FrequencyDetector(float frequency, size_t window_size);
+        explicit FrequencyDetector(float frequency);
 
         /**
          * Reset the detector state
          */
-        void Reset();
+        void Reset() { s_minus_1_ = 0; s_minus_2_ = 0; }
 
         /**
          * Process one audio sample
          * @param sample Input audio sample
          */
-        void ProcessSample(float sample);
+        void ProcessSample(int32_t sample) {
+            int32_t s_current = sample + (int32_t)(((int64_t)filter_coefficient_ * s_minus_1_) >> 14) - s_minus_2_;
+            s_minus_2_ = s_minus_1_;
+            s_minus_1_ = s_current;
+        }
 
         /**
-         * Calculate current amplitude
-         * @return Amplitude value
+         * Calculate the power of the samples processed since the reset
+         * @return Squared amplitude, in squared sample units times (window / 2)^2
          */
-        float GetAmplitude() const;
+        uint64_t GetPower() const;
     };
 
     /**
      * Audio signal processor for Mark/Space frequency pair detection
      * Processes audio signals to extract digital data using AFSK demodulation
+     *
+     * The input is decimated to the processing rate by averaging, which also keeps the noise
+     * above the new Nyquist frequency out. The last window of samples is kept in a ring. Every
+     * 1/kTimingPhases of a bit both tones are measured over that window, and how clearly one of
+     * them wins is integrated per bit phase. A bit is output at the phase where the windows line
+     * up with the bits, wherever the sender started, so a weak signal is not read across two bits.
      */
     class AudioSignalProcessor
     {
     private:
-        std::deque<float> input_buffer_;             // Input sample buffer
-        size_t input_buffer_size_;                   // Input buffer size = window size
-        size_t output_sample_count_;                 // Output sample counter
+        static const size_t kTimingPhases = 8;
+
+        std::vector<int16_t> window_;                // Ring of the last window_size samples
+        size_t window_position_ = 0;                 // Next sample slot of the ring
+        size_t window_filled_ = 0;
         size_t samples_per_bit_;                     // Samples per bit threshold
-        std::unique_ptr<FrequencyDetector> mark_detector_;   // Mark frequency detector
-        std::unique_ptr<FrequencyDetector> space_detector_;  // Space frequency detector
+        size_t samples_per_phase_;
+        size_t phase_sample_count_ = 0;              // Samples since the last measurement
+        size_t phase_ = 0;                           // Bit phase of the next measurement
+        size_t measurements_since_bit_ = 0;
+        uint32_t phase_contrast_[kTimingPhases] = {};  // Integrated contrast of each bit phase, Q8
+        size_t best_phase_ = 0;
+        // Decimation from the input rate, by averaging the input samples of each output sample
+        uint32_t input_sample_rate_;
+        uint32_t sample_rate_;
+        uint32_t decimation_phase_ = 0;
+        int32_t decimation_sum_ = 0;
+        int32_t decimation_count_ = 0;
+        FrequencyDetector mark_detector_;            // Mark frequency detector
+        FrequencyDetector space_detector_;           // Space frequency detector
+
+        void ProcessSample(int16_t sample, std::vector<float> &probabilities);
+        void Measure(std::vector<float> &probabilities);
 
     public:
         /**
@@ -86,16 +109,20 @@ namespace audio_wifi_config
          * @param space_frequency Space frequency for digital '0'
          * @param bit_rate Data transmission bit rate
          * @param window_size Analysis window size
+         * @param input_sample_rate Sampling rate of the samples given, decimated to sample_rate
          */
         AudioSignalProcessor(size_t sample_rate, size_t mark_frequency, size_t space_frequency,
-                           size_t bit_rate, size_t window_size);
+                           size_t bit_rate, size_t window_size, size_t input_sample_rate = 0);
 
         /**
-         * Process input audio samples
-         * @param samples Input audio sample vector
-         * @return Vector of Mark probability values (0.0 to 1.0)
+         * Process input audio samples, never allocates once the output has some capacity
+         * @param samples Interleaved input audio samples, only the first channel is used
+         * @param count Number of samples of all channels
+         * @param channels Number of interleaved channels
+         * @param probabilities Cleared, then filled with the Mark probability values (0.0 to 1.0)
          */
-        std::vector<float> ProcessAudioSamples(const std::vector<float> &samples);
+        void ProcessAudioSamples(const int16_t *samples, size_t count, size_t channels,
+                               std::vector<float> &probabilities);
     };
 
     /**
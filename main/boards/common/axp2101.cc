@@ -9,33 +9,35 @@
 Axp2101::Axp2101(i2c_master_bus_handle_t i2c_bus, uint8_t addr) : I2cDevice(i2c_bus, addr) {
 }
 
-int Axp2101::GetBatteryCurrentDirection() {
-    return (ReadReg(0x01) & 0b01100000) >> 5;
-}
-
-bool Axp2101::IsCharging() {
-    return GetBatteryCurrentDirection() == 1;
-}
-
-bool Axp2101::IsDischarging() {
-    return GetBatteryCurrentDirection() == 2;
-}
-
-bool Axp2101::IsChargingDone() {
+void Axp2101::ReadStatus(PmicStatus& status) {
     uint8_t value = ReadReg(0x01);
-    return (value & 0b00000111) == 0b00000100;
+    int direction = (value & 0b01100000) >> 5;
+    status.charging = direction == 1;
+    status.discharging = direction == 2;
+    status.charging_done = (value & 0b00000111) == 0b00000100;
+    status.power_good = (ReadReg(0x00) & 0b00100000) != 0;
+    // The fuel gauge percentage and the temperature
+    uint8_t gauge[2];
+    ReadRegs(0xA4, gauge, sizeof(gauge));
+    status.battery_level = gauge[0];
+    status.temperature = gauge[1];
 }
 
-int Axp2101::GetBatteryLevel() {
-    return ReadReg(0xA4);
+void Axp2101::EnableStatusInterrupts() {
+    // Only adds to the sources the board enabled: new fuel gauge percentage, VBUS and battery
+    // insertion and removal, charge start and done
+    SetRegBits(0x40, 0b00010000);
+    SetRegBits(0x41, 0b11110000);
+    SetRegBits(0x42, 0b00011000);
 }
 
-float Axp2101::GetTemperature() {
-    return ReadReg(0xA5);
+void Axp2101::AcknowledgeInterrupts() {
+    // Write 1 to clear, the IRQ line goes high once every status bit is clear
+    WriteReg(0x48, 0xFF);
+    WriteReg(0x49, 0xFF);
+    WriteReg(0x4A, 0xFF);
 }
 
 void Axp2101::PowerOff() {
-    uint8_t value = ReadReg(0x10);
-    value = value | 0x01;
-    WriteReg(0x10, value);
+    SetRegBits(0x10, 0x01);
 }
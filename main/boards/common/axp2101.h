@@ -2,19 +2,23 @@
 #define __AXP2101_H__
 
 #include "i2c_device.h"
+#include "pmic_monitor.h"
 
-class Axp2101 : public I2cDevice {
+// The status getters read the cache of PmicMonitor, see EnableInterrupt()
+class Axp2101 : public I2cDevice, public PmicMonitor {
 public:
     Axp2101(i2c_master_bus_handle_t i2c_bus, uint8_t addr);
-    bool IsCharging();
-    bool IsDischarging();
-    bool IsChargingDone();
-    int GetBatteryLevel();
-    float GetTemperature();
+    bool IsCharging() { return GetStatus().charging; }
+    bool IsDischarging() { return GetStatus().discharging; }
+    bool IsChargingDone() { return GetStatus().charging_done; }
+    int GetBatteryLevel() { return GetStatus().battery_level; }
+    float GetTemperature() { return GetStatus().temperature; }
     void PowerOff();
 
-private:
-    int GetBatteryCurrentDirection();
+protected:
+    virtual void ReadStatus(PmicStatus& status) override;
+    virtual void EnableStatusInterrupts() override;
+    virtual void AcknowledgeInterrupts() override;
 };
 
 #endif
@@ -48,14 +48,17 @@ void Backlight::SetBrightness(uint8_t brightness, bool permanent) {
         brightness = 100;
     }
 
-    if (brightness_ == brightness) {
-        return;
-    }
-
     if (permanent) {
         Settings settings("display", true);
         settings.SetInt("brightness", brightness);
     }
+    if (brightness > limit_) {
+        brightness = limit_;
+    }
+
+    if (brightness_ == brightness) {
+        return;
+    }
 
     target_brightness_ = brightness;
     step_ = (target_brightness_ > brightness_) ? 1 : -1;
@@ -67,6 +70,17 @@ void Backlight::SetBrightness(uint8_t brightness, bool permanent) {
     ESP_LOGI(TAG, "Set brightness to %d", brightness);
 }
 
+void Backlight::SetBrightnessLimit(uint8_t limit) {
+    uint8_t previous = limit_;
+    limit_ = limit > 100 ? 100 : limit;
+    if (target_brightness_ > limit_) {
+        SetBrightness(limit_);
+    } else if (limit_ > previous && target_brightness_ == previous) {
+        // Held at the old limit, back to the setting
+        RestoreBrightness();
+    }
+}
+
 void Backlight::OnTransitionTimer() {
     if (brightness_ == target_brightness_) {
         esp_timer_stop(transition_timer_);
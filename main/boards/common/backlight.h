@@ -14,7 +14,10 @@ public:
 
     void RestoreBrightness();
     void SetBrightness(uint8_t brightness, bool permanent = false);
+    // The highest brightness applied, the saved setting keeps what was asked for
+    void SetBrightnessLimit(uint8_t limit);
     inline uint8_t brightness() const { return brightness_; }
+    inline uint8_t target_brightness() const { return target_brightness_; }
 
 protected:
     void OnTransitionTimer();
@@ -23,6 +26,7 @@ protected:
     esp_timer_handle_t transition_timer_ = nullptr;
     uint8_t brightness_ = 0;
     uint8_t target_brightness_ = 0;
+    uint8_t limit_ = 100;
     uint8_t step_ = 1;
 };
 
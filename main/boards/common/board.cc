@@ -3,6 +3,8 @@
 #include "settings.h"
 #include "display/display.h"
 #include "display/oled_display.h"
+#include "audio_codec.h"
+#include "black_box.h"
 #include "assets/lang_config.h"
 
 #include <esp_log.h>
@@ -12,6 +14,10 @@
 
 #define TAG "Board"
 
+// Enough for the documents of a typical board, so they are built without growing the buffer
+#define BOARD_SYSTEM_INFO_RESERVE 1536
+#define BOARD_DEVICE_STATUS_RESERVE 1024
+
 Board::Board() {
     Settings settings("board", true);
     uuid_ = settings.GetString("uuid");
@@ -67,6 +73,10 @@ Led* Board::GetLed() {
     return &led;
 }
 
+void Board::SetNetworkPowerLevel(NetworkPowerLevel level) {
+    SetPowerSaveMode(level != kNetworkPowerActive);
+}
+
 std::string Board::GetSystemInfoJson() {
     /* 
         {
@@ -107,72 +117,156 @@ std::string Board::GetSystemInfoJson() {
             }
         }
     */
-    std::string json = R"({"version":2,"language":")" + std::string(Lang::CODE) + R"(",)";
-    json += R"("flash_size":)" + std::to_string(SystemInfo::GetFlashSize()) + R"(,)";
-    json += R"("minimum_free_heap_size":")" + std::to_string(SystemInfo::GetMinimumFreeHeapSize()) + R"(",)";
-    json += R"("mac_address":")" + SystemInfo::GetMacAddress() + R"(",)";
-    json += R"("uuid":")" + uuid_ + R"(",)";
-    json += R"("chip_model_name":")" + SystemInfo::GetChipModelName() + R"(",)";
-
-    esp_chip_info_t chip_info;
-    esp_chip_info(&chip_info);
-    json += R"("chip_info":{)";
-    json += R"("model":)" + std::to_string(chip_info.model) + R"(,)";
-    json += R"("cores":)" + std::to_string(chip_info.cores) + R"(,)";
-    json += R"("revision":)" + std::to_string(chip_info.revision) + R"(,)";
-    json += R"("features":)" + std::to_string(chip_info.features) + R"(},)";
-
-    auto app_desc = esp_app_get_description();
-    json += R"("application":{)";
-    json += R"("name":")" + std::string(app_desc->project_name) + R"(",)";
-    json += R"("version":")" + std::string(app_desc->version) + R"(",)";
-    json += R"("compile_time":")" + std::string(app_desc->date) + R"(T)" + std::string(app_desc->time) + R"(Z",)";
-    json += R"("idf_version":")" + std::string(app_desc->idf_ver) + R"(",)";
-    char sha256_str[65];
-    for (int i = 0; i < 32; i++) {
-        snprintf(sha256_str + i * 2, sizeof(sha256_str) - i * 2, "%02x", app_desc->app_elf_sha256[i]);
-    }
-    json += R"("elf_sha256":")" + std::string(sha256_str) + R"(")";
-    json += R"(},)";
-
-    json += R"("partition_table": [)";
-    esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, NULL);
-    while (it) {
-        const esp_partition_t *partition = esp_partition_get(it);
-        json += R"({)";
-        json += R"("label":")" + std::string(partition->label) + R"(",)";
-        json += R"("type":)" + std::to_string(partition->type) + R"(,)";
-        json += R"("subtype":)" + std::to_string(partition->subtype) + R"(,)";
-        json += R"("address":)" + std::to_string(partition->address) + R"(,)";
-        json += R"("size":)" + std::to_string(partition->size) + R"(},)";;
-        it = esp_partition_next(it);
+    std::string json;
+    json.reserve(BOARD_SYSTEM_INFO_RESERVE);
+    JsonWriter writer(json);
+    writer.Object();
+    writer.Int("version", 2);
+    writer.String("language", Lang::CODE);
+    writer.Int("flash_size", SystemInfo::GetFlashSize());
+    writer.String("minimum_free_heap_size", std::to_string(SystemInfo::GetMinimumFreeHeapSize()));
+    writer.String("mac_address", SystemInfo::GetMacAddress());
+    writer.String("uuid", uuid_);
+
+    // The chip, the application, the partitions and the display are the same until a reboot
+    system_info_json_.Write(writer, JsonCache::Key(), [this](JsonWriter& fragment) {
+        fragment.String("chip_model_name", SystemInfo::GetChipModelName());
+
+        esp_chip_info_t chip_info;
+        esp_chip_info(&chip_info);
+        fragment.Object("chip_info");
+        fragment.Int("model", chip_info.model);
+        fragment.Int("cores", chip_info.cores);
+        fragment.Int("revision", chip_info.revision);
+        fragment.Int("features", chip_info.features);
+        fragment.EndObject();
+
+        auto app_desc = esp_app_get_description();
+        fragment.Object("application");
+        fragment.String("name", app_desc->project_name);
+        fragment.String("version", app_desc->version);
+        char compile_time[40];
+        snprintf(compile_time, sizeof(compile_time), "%sT%sZ", app_desc->date, app_desc->time);
+        fragment.String("compile_time", compile_time);
+        fragment.String("idf_version", app_desc->idf_ver);
+        char sha256_str[65];
+        for (int i = 0; i < 32; i++) {
+            snprintf(sha256_str + i * 2, sizeof(sha256_str) - i * 2, "%02x", app_desc->app_elf_sha256[i]);
+        }
+        fragment.String("elf_sha256", sha256_str);
+        fragment.EndObject();
+
+        fragment.Array("partition_table");
+        esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, NULL);
+        while (it) {
+            const esp_partition_t *partition = esp_partition_get(it);
+            fragment.Object();
+            fragment.String("label", partition->label);
+            fragment.Int("type", partition->type);
+            fragment.Int("subtype", partition->subtype);
+            fragment.Int("address", partition->address);
+            fragment.Int("size", partition->size);
+            fragment.EndObject();
+            it = esp_partition_next(it);
+        }
+        fragment.EndArray();
+
+        fragment.Object("ota");
+        auto ota_partition = esp_ota_get_running_partition();
+        fragment.String("label", ota_partition->label);
+        fragment.EndObject();
+
+        // Append display info
+        auto display = GetDisplay();
+        if (display) {
+            fragment.Object("display");
+            fragment.Bool("monochrome", dynamic_cast<OledDisplay*>(display) != nullptr);
+            fragment.Int("width", display->width());
+            fragment.Int("height", display->height());
+            fragment.EndObject();
+        }
+    });
+
+    writer.Key("board");
+    WriteBoardJson(writer);
+    // The record of the last abnormal reset, until an OTA check took it
+    auto& black_box = BlackBox::GetInstance();
+    if (black_box.upload_pending()) {
+        black_box.WriteSavedJson(writer, "black_box");
     }
-    json.pop_back(); // Remove the last comma
-    json += R"(],)";
-
-    json += R"("ota":{)";
-    auto ota_partition = esp_ota_get_running_partition();
-    json += R"("label":")" + std::string(ota_partition->label) + R"(")";
-    json += R"(},)";
-
-    // Append display info
-    auto display = GetDisplay();
-    if (display) {
-        json += R"("display":{)";
-        if (dynamic_cast<OledDisplay*>(display)) {
-            json += R"("monochrome":)" + std::string("true") + R"(,)";
-        } else {
-            json += R"("monochrome":)" + std::string("false") + R"(,)";
+    writer.EndObject();
+    return json;
+}
+
+void Board::WriteLocalStatusJson(JsonWriter& writer) {
+    // Through the instance, a dual network board writes the status of its current network board
+    auto& board = Board::GetInstance();
+    auto audio_codec = board.GetAudioCodec();
+    auto backlight = board.GetBacklight();
+    auto display = board.GetDisplay();
+    std::string theme_name;
+    if (display && display->height() > 64) { // For LCD display only
+        auto theme = display->GetTheme();
+        if (theme != nullptr) {
+            theme_name = theme->name();
         }
-        json += R"("width":)" + std::to_string(display->width()) + R"(,)";
-        json += R"("height":)" + std::to_string(display->height()) + R"(,)";
-        json.pop_back(); // Remove the last comma
     }
-    json += R"(},)";
+    int battery_level = 0;
+    bool charging = false;
+    bool discharging = false;
+    bool has_battery = board.GetBatteryLevel(battery_level, charging, discharging);
+    float esp32temp = 0.0f;
+    bool has_temperature = board.GetTemperature(esp32temp);
+
+    JsonCache::Key key;
+    key.Add(audio_codec ? audio_codec->output_volume() : -1)
+        .Add(backlight ? backlight->brightness() : -1)
+        .Add(theme_name)
+        .Add(has_battery ? battery_level : -1)
+        .Add(charging)
+        .Add(has_temperature ? (int)esp32temp : INT16_MIN);
+    local_status_json_.Write(writer, key, [&](JsonWriter& fragment) {
+        fragment.Object("audio_speaker");
+        if (audio_codec) {
+            fragment.Int("volume", audio_codec->output_volume());
+        }
+        fragment.EndObject();
+
+        fragment.Object("screen");
+        if (backlight) {
+            fragment.Int("brightness", backlight->brightness());
+        }
+        if (!theme_name.empty()) {
+            fragment.String("theme", theme_name);
+        }
+        fragment.EndObject();
 
-    json += R"("board":)" + GetBoardJson();
+        if (has_battery) {
+            fragment.Object("battery");
+            fragment.Int("level", battery_level);
+            fragment.Bool("charging", charging);
+            fragment.EndObject();
+        }
+
+        if (has_temperature) {
+            fragment.Object("chip");
+            fragment.Number("temperature", esp32temp);
+            fragment.EndObject();
+        }
+    });
+}
+
+std::string Board::GetBoardJson() {
+    std::string json;
+    JsonWriter writer(json);
+    WriteBoardJson(writer);
+    return json;
+}
 
-    // Close the JSON object
-    json += R"(})";
+std::string Board::GetDeviceStatusJson() {
+    std::string json;
+    json.reserve(BOARD_DEVICE_STATUS_RESERVE);
+    JsonWriter writer(json);
+    WriteDeviceStatusJson(writer);
     return json;
 }
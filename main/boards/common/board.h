@@ -12,8 +12,16 @@
 #include "backlight.h"
 #include "camera.h"
 #include "assets.h"
+#include "json_writer.h"
 
 
+// How much the network link may sleep, see Board::SetNetworkPowerLevel()
+enum NetworkPowerLevel {
+    kNetworkPowerActive,    // No modem sleep, the downlink audio comes without the beacon delay
+    kNetworkPowerIdle,      // Modem sleep, woken at every DTIM beacon
+    kNetworkPowerSleep,     // Deepest modem sleep, woken every listen interval, while the device sleeps
+};
+
 void* create_board();
 class AudioCodec;
 class Display;
@@ -28,6 +36,11 @@ protected:
 
     // 软件生成的设备唯一标识
     std::string uuid_;
+    // The part of the system info that cannot change before a reboot
+    JsonCache system_info_json_;
+    // The speaker, screen, battery and chip of the device status, rebuilt when one of them changes
+    JsonCache local_status_json_;
+    void WriteLocalStatusJson(JsonWriter& writer);
 
 public:
     static Board& GetInstance() {
@@ -50,8 +63,13 @@ public:
     virtual bool GetBatteryLevel(int &level, bool& charging, bool& discharging);
     virtual std::string GetSystemInfoJson();
     virtual void SetPowerSaveMode(bool enabled) = 0;
-    virtual std::string GetBoardJson() = 0;
-    virtual std::string GetDeviceStatusJson() = 0;
+    // Called by NetworkPowerPolicy. By default the idle and sleep levels are the power save mode
+    virtual void SetNetworkPowerLevel(NetworkPowerLevel level);
+    // Written into the caller's buffer, the boards keep the parts that did not change cached
+    virtual void WriteBoardJson(JsonWriter& writer) = 0;
+    virtual void WriteDeviceStatusJson(JsonWriter& writer) = 0;
+    std::string GetBoardJson();
+    std::string GetDeviceStatusJson();
 };
 
 #define DECLARE_BOARD(BOARD_CLASS_NAME) \
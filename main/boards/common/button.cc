@@ -2,9 +2,22 @@
 
 #include <button_gpio.h>
 #include <esp_log.h>
+#include <esp_sleep.h>
 
 #define TAG "Button"
 
+// The defaults of iot_button, from its Kconfig
+#ifdef CONFIG_BUTTON_LONG_PRESS_TIME_MS
+#define BUTTON_DEFAULT_LONG_PRESS_MS CONFIG_BUTTON_LONG_PRESS_TIME_MS
+#else
+#define BUTTON_DEFAULT_LONG_PRESS_MS 1500
+#endif
+#ifdef CONFIG_BUTTON_SHORT_PRESS_TIME_MS
+#define BUTTON_DEFAULT_SHORT_PRESS_MS CONFIG_BUTTON_SHORT_PRESS_TIME_MS
+#else
+#define BUTTON_DEFAULT_SHORT_PRESS_MS 180
+#endif
+
 #if CONFIG_SOC_ADC_SUPPORTED
 AdcButton::AdcButton(const button_adc_config_t& adc_config) : Button(nullptr) {
     button_config_t btn_config = {
@@ -18,34 +31,156 @@ AdcButton::AdcButton(const button_adc_config_t& adc_config) : Button(nullptr) {
 Button::Button(button_handle_t button_handle) : button_handle_(button_handle) {
 }
 
-Button::Button(gpio_num_t gpio_num, bool active_high, uint16_t long_press_time, uint16_t short_press_time, bool enable_power_save) : gpio_num_(gpio_num) {
+Button::Button(gpio_num_t gpio_num, bool active_high, uint16_t long_press_time, uint16_t short_press_time, bool enable_power_save)
+    : gpio_num_(gpio_num), active_high_(active_high), power_save_(enable_power_save),
+      long_press_ms_(long_press_time != 0 ? long_press_time : BUTTON_DEFAULT_LONG_PRESS_MS),
+      short_press_ms_(short_press_time != 0 ? short_press_time : BUTTON_DEFAULT_SHORT_PRESS_MS) {
     if (gpio_num == GPIO_NUM_NC) {
         return;
     }
-    button_config_t button_config = {
-        .long_press_time = long_press_time,
-        .short_press_time = short_press_time
+    gpio_config_t config = {
+        .pin_bit_mask = 1ULL << gpio_num,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = active_high ? GPIO_PULLUP_DISABLE : GPIO_PULLUP_ENABLE,
+        .pull_down_en = active_high ? GPIO_PULLDOWN_ENABLE : GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_DISABLE,
     };
-    button_gpio_config_t gpio_config = {
-        .gpio_num = gpio_num,
-        .active_level = static_cast<uint8_t>(active_high ? 1 : 0),
-        .enable_power_save = enable_power_save,
-        .disable_pull = false
-    };
-    ESP_ERROR_CHECK(iot_button_new_gpio_device(&button_config, &gpio_config, &button_handle_));
+    ESP_ERROR_CHECK(gpio_config(&config));
+    pressed_ = gpio_get_level(gpio_num) == (active_high ? 1 : 0);
+
+    InputEvents::GetInstance().Register(this);
+    ESP_ERROR_CHECK(gpio_isr_handler_add(gpio_num, IsrHandler, this));
+    if (power_save_) {
+        esp_sleep_enable_gpio_wakeup();
+    }
+    ArmInterrupt();
 }
 
 Button::~Button() {
     if (button_handle_ != NULL) {
         iot_button_delete(button_handle_);
+    } else if (gpio_num_ != GPIO_NUM_NC) {
+        gpio_intr_disable(gpio_num_);
+        gpio_isr_handler_remove(gpio_num_);
+        if (power_save_) {
+            gpio_wakeup_disable(gpio_num_);
+        }
+        InputEvents::GetInstance().Unregister(this);
+    }
+}
+
+void Button::IsrHandler(void* arg) {
+    auto button = static_cast<Button*>(arg);
+    // A level interrupt, it stays masked until the input task has read the settled level
+    gpio_intr_disable(button->gpio_num_);
+    InputEvents::PostFromIsr(button, 0);
+}
+
+void Button::ArmInterrupt() {
+    // Wait for the level the button is not at, a change in between fires right away
+    bool wait_high = pressed_ != active_high_;
+    gpio_int_type_t type = wait_high ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL;
+    if (power_save_) {
+        // Only a press wakes the chip, it sets the same level interrupt
+        if (!pressed_) {
+            gpio_wakeup_enable(gpio_num_, type);
+        } else {
+            gpio_wakeup_disable(gpio_num_);
+        }
+    }
+    gpio_set_intr_type(gpio_num_, type);
+    gpio_intr_enable(gpio_num_);
+}
+
+int64_t Button::OnInput(const uint32_t* value, int64_t now_us) {
+    if (value != nullptr) {
+        settling_ = true;
+        settle_deadline_us_ = now_us + INPUT_DEBOUNCE_MS * 1000;
+    } else if (settling_ && now_us >= settle_deadline_us_) {
+        settling_ = false;
+        bool pressed = gpio_get_level(gpio_num_) == (active_high_ ? 1 : 0);
+        if (pressed != pressed_) {
+            pressed_ = pressed;
+            pressed ? OnPress(now_us) : OnRelease(now_us);
+        }
+        ArmInterrupt();
+    }
+
+    if (state_ == kStatePressed && now_us >= long_deadline_us_) {
+        InputEvents::GetInstance().Emit(this, BUTTON_LONG_PRESS_START);
+        state_ = kStateLongPress;
+    } else if (state_ == kStateWaitClick && now_us >= click_deadline_us_) {
+        auto& events = InputEvents::GetInstance();
+        if (clicks_ == 1) {
+            events.Emit(this, BUTTON_SINGLE_CLICK);
+        } else if (clicks_ == 2) {
+            events.Emit(this, BUTTON_DOUBLE_CLICK);
+        }
+        if (clicks_ == click_count_) {
+            events.Emit(this, BUTTON_MULTIPLE_CLICK);
+        }
+        state_ = kStateReleased;
+    }
+
+    int64_t deadline_us = settling_ ? settle_deadline_us_ : 0;
+    int64_t timing_us = state_ == kStatePressed ? long_deadline_us_ :
+        state_ == kStateWaitClick ? click_deadline_us_ : 0;
+    if (timing_us != 0 && (deadline_us == 0 || timing_us < deadline_us)) {
+        deadline_us = timing_us;
+    }
+    return deadline_us;
+}
+
+void Button::OnPress(int64_t now_us) {
+    InputEvents::GetInstance().Emit(this, BUTTON_PRESS_DOWN);
+    if (state_ == kStateWaitClick) {
+        clicks_++;
+        state_ = kStateRepressed;
+    } else {
+        clicks_ = 1;
+        state_ = kStatePressed;
+        long_deadline_us_ = now_us + long_press_ms_ * 1000LL;
+    }
+}
+
+void Button::OnRelease(int64_t now_us) {
+    InputEvents::GetInstance().Emit(this, BUTTON_PRESS_UP);
+    // kStateReleased: held since boot, no press was seen
+    if (state_ == kStateLongPress || state_ == kStateReleased) {
+        state_ = kStateReleased;
+        return;
+    }
+    // Without a double or multiple click callback there is nothing to wait for
+    uint32_t multi = (1u << BUTTON_DOUBLE_CLICK) | (1u << BUTTON_MULTIPLE_CLICK);
+    bool wait = (registered_.load(std::memory_order_relaxed) & multi) != 0;
+    click_deadline_us_ = now_us + (wait ? short_press_ms_ * 1000LL : 0);
+    state_ = kStateWaitClick;
+}
+
+void Button::Dispatch(uint32_t event) {
+    std::function<void()>* callback = nullptr;
+    switch (event) {
+        case BUTTON_PRESS_DOWN: callback = &on_press_down_; break;
+        case BUTTON_PRESS_UP: callback = &on_press_up_; break;
+        case BUTTON_LONG_PRESS_START: callback = &on_long_press_; break;
+        case BUTTON_SINGLE_CLICK: callback = &on_click_; break;
+        case BUTTON_DOUBLE_CLICK: callback = &on_double_click_; break;
+        case BUTTON_MULTIPLE_CLICK: callback = &on_multiple_click_; break;
+        default: break;
+    }
+    if (callback != nullptr && *callback) {
+        // A copy, the callback may replace itself, e.g. register the next one and clear its own
+        auto run = *callback;
+        run();
     }
 }
 
 void Button::OnPressDown(std::function<void()> callback) {
+    on_press_down_ = callback;
     if (button_handle_ == nullptr) {
+        Register(BUTTON_PRESS_DOWN);
         return;
     }
-    on_press_down_ = callback;
     iot_button_register_cb(button_handle_, BUTTON_PRESS_DOWN, nullptr, [](void* handle, void* usr_data) {
         Button* button = static_cast<Button*>(usr_data);
         if (button->on_press_down_) {
@@ -55,10 +190,11 @@ void Button::OnPressDown(std::function<void()> callback) {
 }
 
 void Button::OnPressUp(std::function<void()> callback) {
+    on_press_up_ = callback;
     if (button_handle_ == nullptr) {
+        Register(BUTTON_PRESS_UP);
         return;
     }
-    on_press_up_ = callback;
     iot_button_register_cb(button_handle_, BUTTON_PRESS_UP, nullptr, [](void* handle, void* usr_data) {
         Button* button = static_cast<Button*>(usr_data);
         if (button->on_press_up_) {
@@ -68,10 +204,11 @@ void Button::OnPressUp(std::function<void()> callback) {
 }
 
 void Button::OnLongPress(std::function<void()> callback) {
+    on_long_press_ = callback;
     if (button_handle_ == nullptr) {
+        Register(BUTTON_LONG_PRESS_START);
         return;
     }
-    on_long_press_ = callback;
     iot_button_register_cb(button_handle_, BUTTON_LONG_PRESS_START, nullptr, [](void* handle, void* usr_data) {
         Button* button = static_cast<Button*>(usr_data);
         if (button->on_long_press_) {
@@ -81,10 +218,11 @@ void Button::OnLongPress(std::function<void()> callback) {
 }
 
 void Button::OnClick(std::function<void()> callback) {
+    on_click_ = callback;
     if (button_handle_ == nullptr) {
+        Register(BUTTON_SINGLE_CLICK);
         return;
     }
-    on_click_ = callback;
     iot_button_register_cb(button_handle_, BUTTON_SINGLE_CLICK, nullptr, [](void* handle, void* usr_data) {
         Button* button = static_cast<Button*>(usr_data);
         if (button->on_click_) {
@@ -94,10 +232,11 @@ void Button::OnClick(std::function<void()> callback) {
 }
 
 void Button::OnDoubleClick(std::function<void()> callback) {
+    on_double_click_ = callback;
     if (button_handle_ == nullptr) {
+        Register(BUTTON_DOUBLE_CLICK);
         return;
     }
-    on_double_click_ = callback;
     iot_button_register_cb(button_handle_, BUTTON_DOUBLE_CLICK, nullptr, [](void* handle, void* usr_data) {
         Button* button = static_cast<Button*>(usr_data);
         if (button->on_double_click_) {
@@ -107,10 +246,12 @@ void Button::OnDoubleClick(std::function<void()> callback) {
 }
 
 void Button::OnMultipleClick(std::function<void()> callback, uint8_t click_count) {
+    on_multiple_click_ = callback;
     if (button_handle_ == nullptr) {
+        click_count_ = click_count;
+        Register(BUTTON_MULTIPLE_CLICK);
         return;
     }
-    on_multiple_click_ = callback;
     button_event_args_t event_args = {
         .multiple_clicks = {
             .clicks = click_count
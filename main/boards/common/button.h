@@ -7,8 +7,20 @@
 #include <button_adc.h>
 #include <button_gpio.h>
 #include <functional>
+#include <atomic>
 
-class Button {
+#include "input_events.h"
+
+/*
+ * A GPIO button is driven by its interrupt, see InputEvents. The pin waits for the level it is
+ * not at, the ISR masks it and the input task reads the level again after INPUT_DEBOUNCE_MS,
+ * then times the long press and the clicks like iot_button does. The callbacks run on the main
+ * event loop. With enable_power_save a press also wakes the chip from light sleep.
+ *
+ * The ADC buttons and the buttons made from an iot_button handle still poll through
+ * iot_button, their callbacks run in the esp_timer task.
+ */
+class Button : public InputSource {
 public:
     Button(button_handle_t button_handle);
     Button(gpio_num_t gpio_num, bool active_high = false, uint16_t long_press_time = 0, uint16_t short_press_time = 0, bool enable_power_save = false);
@@ -22,7 +34,7 @@ public:
     void OnMultipleClick(std::function<void()> callback, uint8_t click_count = 3);
 
 protected:
-    gpio_num_t gpio_num_;
+    gpio_num_t gpio_num_ = GPIO_NUM_NC;
     button_handle_t button_handle_ = nullptr;
 
     std::function<void()> on_press_down_;
@@ -31,6 +43,41 @@ protected:
     std::function<void()> on_click_;
     std::function<void()> on_double_click_;
     std::function<void()> on_multiple_click_;
+
+    int64_t OnInput(const uint32_t* value, int64_t now_us) override;
+    void Dispatch(uint32_t event) override;
+
+private:
+    enum State {
+        kStateReleased,
+        kStatePressed,
+        kStateWaitClick,    // Released, another press within the short press time adds a click
+        kStateRepressed,
+        kStateLongPress,
+    };
+
+    bool active_high_ = false;
+    bool power_save_ = false;
+    uint16_t long_press_ms_ = 0;
+    uint16_t short_press_ms_ = 0;
+    uint8_t click_count_ = 3;
+    // A bit per button_event_t with a callback
+    std::atomic<uint32_t> registered_ = 0;
+
+    // Only touched by the input task once the interrupt is armed
+    bool pressed_ = false;
+    bool settling_ = false;
+    State state_ = kStateReleased;
+    int clicks_ = 0;
+    int64_t settle_deadline_us_ = 0;
+    int64_t long_deadline_us_ = 0;
+    int64_t click_deadline_us_ = 0;
+
+    static void IsrHandler(void* arg);
+    void ArmInterrupt();
+    void OnPress(int64_t now_us);
+    void OnRelease(int64_t now_us);
+    void Register(button_event_t event) { registered_.fetch_or(1u << event, std::memory_order_relaxed); }
 };
 
 #if CONFIG_SOC_ADC_SUPPORTED
@@ -2,6 +2,29 @@
 #define CAMERA_H
 
 #include <string>
+#include <cstdint>
+
+// Hints for the photo sent by Explain(), the defaults send the whole photo as captured
+struct ExplainOptions {
+    // The photo is scaled down to fit, 0 keeps the captured size
+    uint16_t max_width = 0;
+    uint16_t max_height = 0;
+    // The region of interest in percent of the photo
+    uint8_t roi_x = 0;
+    uint8_t roi_y = 0;
+    uint8_t roi_width = 100;
+    uint8_t roi_height = 100;
+    int quality = 80;
+};
+
+// The camera stream pushed over the protocol, see Camera::StartStreaming()
+struct StreamOptions {
+    int fps = 1;
+    int bitrate_kbps = 256;     // The quality drops to stay below it
+    uint16_t max_width = 320;
+    uint16_t max_height = 240;
+    int quality = 60;           // The highest JPEG quality of the frames
+};
 
 class Camera {
 public:
@@ -9,7 +32,11 @@ public:
     virtual bool Capture() = 0;
     virtual bool SetHMirror(bool enabled) = 0;
     virtual bool SetVFlip(bool enabled) = 0;
-    virtual std::string Explain(const std::string& question) = 0;
+    virtual std::string Explain(const std::string& question, const ExplainOptions& options = {}) = 0;
+    // Pushes JPEG frames over the active protocol until stopped, false if the camera cannot
+    virtual bool StartStreaming(const StreamOptions& options) { return false; }
+    virtual void StopStreaming() {}
+    virtual bool IsStreaming() { return false; }
 };
 
 #endif // CAMERA_H
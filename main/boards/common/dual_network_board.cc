@@ -3,10 +3,19 @@
 #include "display.h"
 #include "assets/lang_config.h"
 #include "settings.h"
+#include "task_placement.h"
 #include <esp_log.h>
+#include <wifi_station.h>
 
 static const char *TAG = "DualNetworkBoard";
 
+#if CONFIG_DUAL_NETWORK_FAILOVER
+// At boot the other link is used only if the selected one is still down this long after it came up
+#define DUAL_NETWORK_RACE_GRACE_MS 3000
+// A Wi-Fi board without a working SSID falls back to the configuration AP after this long
+#define DUAL_NETWORK_WIFI_TIMEOUT_MS (60 * 1000)
+#endif
+
 DualNetworkBoard::DualNetworkBoard(gpio_num_t ml307_tx_pin, gpio_num_t ml307_rx_pin, gpio_num_t ml307_dtr_pin, int32_t default_net_type) 
     : Board(), 
       ml307_tx_pin_(ml307_tx_pin), 
@@ -14,12 +23,22 @@ DualNetworkBoard::DualNetworkBoard(gpio_num_t ml307_tx_pin, gpio_num_t ml307_rx_
       ml307_dtr_pin_(ml307_dtr_pin) {
     
     // 从Settings加载网络类型
-    network_type_ = LoadNetworkTypeFromSettings(default_net_type);
+    preferred_type_ = LoadNetworkTypeFromSettings(default_net_type);
+    network_type_ = preferred_type_;
     
-    // 只初始化当前网络类型对应的板卡
+    // 只初始化当前网络类型对应的板卡, failover 模式下两个都初始化
     InitializeCurrentBoard();
 }
 
+DualNetworkBoard::~DualNetworkBoard() {
+#if CONFIG_DUAL_NETWORK_FAILOVER
+    if (health_timer_ != nullptr) {
+        esp_timer_stop(health_timer_);
+        esp_timer_delete(health_timer_);
+    }
+#endif
+}
+
 NetworkType DualNetworkBoard::LoadNetworkTypeFromSettings(int32_t default_net_type) {
     Settings settings("network", true);
     int network_type = settings.GetInt("type", default_net_type); // 默认使用ML307 (1)
@@ -33,18 +52,29 @@ void DualNetworkBoard::SaveNetworkTypeToSettings(NetworkType type) {
 }
 
 void DualNetworkBoard::InitializeCurrentBoard() {
+#if CONFIG_DUAL_NETWORK_FAILOVER
+    ESP_LOGI(TAG, "Initialize WiFi and ML307 boards, %s selected", preferred_type_ == NetworkType::ML307 ? "ML307" : "WiFi");
+    ml307_board_ = std::make_unique<Ml307Board>(ml307_tx_pin_, ml307_rx_pin_, ml307_dtr_pin_);
+    wifi_board_ = std::make_unique<WifiBoard>();
+#else
     if (network_type_ == NetworkType::ML307) {
         ESP_LOGI(TAG, "Initialize ML307 board");
-        current_board_ = std::make_unique<Ml307Board>(ml307_tx_pin_, ml307_rx_pin_, ml307_dtr_pin_);
+        ml307_board_ = std::make_unique<Ml307Board>(ml307_tx_pin_, ml307_rx_pin_, ml307_dtr_pin_);
     } else {
         ESP_LOGI(TAG, "Initialize WiFi board");
-        current_board_ = std::make_unique<WifiBoard>();
+        wifi_board_ = std::make_unique<WifiBoard>();
+    }
+#endif
+    if (network_type_ == NetworkType::ML307) {
+        current_board_ = ml307_board_.get();
+    } else {
+        current_board_ = wifi_board_.get();
     }
 }
 
 void DualNetworkBoard::SwitchNetworkType() {
     auto display = GetDisplay();
-    if (network_type_ == NetworkType::WIFI) {    
+    if (preferred_type_ == NetworkType::WIFI) {    
         SaveNetworkTypeToSettings(NetworkType::ML307);
         display->ShowNotification(Lang::Strings::SWITCH_TO_4G_NETWORK);
     } else {
@@ -58,7 +88,7 @@ void DualNetworkBoard::SwitchNetworkType() {
 
  
 std::string DualNetworkBoard::GetBoardType() {
-    return current_board_->GetBoardType();
+    return current_board_.load()->GetBoardType();
 }
 
 void DualNetworkBoard::StartNetwork() {
@@ -69,25 +99,168 @@ void DualNetworkBoard::StartNetwork() {
     } else {
         display->SetStatus(Lang::Strings::DETECTING_MODULE);
     }
-    current_board_->StartNetwork();
+#if !CONFIG_DUAL_NETWORK_FAILOVER
+    current_board_.load()->StartNetwork();
+#else
+    // The configuration AP was asked for, or the selected Wi-Fi has no SSID yet
+    bool wifi_started = !wifi_board_->IsConfigMode() && wifi_board_->StartStation();
+    if (wifi_board_->IsConfigMode() || (!wifi_started && preferred_type_ == NetworkType::WIFI)) {
+        UseLink(NetworkType::WIFI);
+        wifi_board_->StartNetwork();
+        return;
+    }
+
+    // The modem detection and the registration block, the standby task waits for them
+    TaskPlacements::Create(kTaskNetworkStandby, [](void* arg) {
+        static_cast<Ml307Board*>(arg)->StartNetwork();
+        TaskPlacements::Delete(kTaskNetworkStandby);
+    }, ml307_board_.get());
+
+    // Both links race, the selected one wins unless the other is clearly first
+    NetworkType other = preferred_type_ == NetworkType::WIFI ? NetworkType::ML307 : NetworkType::WIFI;
+    int64_t start_us = esp_timer_get_time();
+    int64_t other_up_us = 0;
+    NetworkType chosen;
+    while (true) {
+        int64_t now = esp_timer_get_time();
+        if (IsLinkReady(preferred_type_)) {
+            chosen = preferred_type_;
+            break;
+        }
+        if (IsLinkReady(other)) {
+            if (other_up_us == 0) {
+                other_up_us = now;
+            } else if (now - other_up_us >= DUAL_NETWORK_RACE_GRACE_MS * 1000) {
+                chosen = other;
+                break;
+            }
+        } else {
+            other_up_us = 0;
+        }
+        if (preferred_type_ == NetworkType::WIFI && other_up_us == 0 &&
+                now - start_us >= DUAL_NETWORK_WIFI_TIMEOUT_MS * 1000LL) {
+            // No link at all, the Wi-Fi board retries once more and then opens the configuration AP
+            ESP_LOGW(TAG, "No network after %d ms, falling back to WiFi board", DUAL_NETWORK_WIFI_TIMEOUT_MS);
+            WifiStation::GetInstance().Stop();
+            UseLink(NetworkType::WIFI);
+            wifi_board_->StartNetwork();
+            return;
+        }
+        vTaskDelay(pdMS_TO_TICKS(200));
+    }
+    ESP_LOGI(TAG, "Using %s, %s on standby", chosen == NetworkType::ML307 ? "ML307" : "WiFi",
+        chosen == NetworkType::ML307 ? "WiFi" : "ML307");
+    UseLink(chosen);
+
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            static_cast<DualNetworkBoard*>(arg)->CheckHealth();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "network_health",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &health_timer_));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(health_timer_, 1000 * 1000));
+#endif
+}
+
+#if CONFIG_DUAL_NETWORK_FAILOVER
+bool DualNetworkBoard::IsLinkReady(NetworkType type) {
+    return type == NetworkType::WIFI ? wifi_board_->IsNetworkReady() : ml307_board_->IsNetworkReady();
+}
+
+void DualNetworkBoard::UseLink(NetworkType type) {
+    if (type == NetworkType::WIFI) {
+        current_board_ = wifi_board_.get();
+    } else {
+        current_board_ = ml307_board_.get();
+    }
+    network_type_ = type;
 }
 
+void DualNetworkBoard::CheckHealth() {
+    int64_t now = esp_timer_get_time();
+    NetworkType active = network_type_;
+    NetworkType other = active == NetworkType::WIFI ? NetworkType::ML307 : NetworkType::WIFI;
+    NetworkType target = active;
+
+    if (!IsLinkReady(active)) {
+        if (down_since_us_ == 0) {
+            down_since_us_ = now;
+        }
+        // The protocol reconnects on its own when the link in use only blinked
+        if (now - down_since_us_ >= CONFIG_DUAL_NETWORK_FAILOVER_MS * 1000LL && IsLinkReady(other)) {
+            ESP_LOGW(TAG, "%s down for %lld ms, failing over", active == NetworkType::WIFI ? "WiFi" : "ML307",
+                (now - down_since_us_) / 1000);
+            target = other;
+        }
+    } else {
+        down_since_us_ = 0;
+        if (active != preferred_type_ && IsLinkReady(preferred_type_)) {
+            if (preferred_up_since_us_ == 0) {
+                preferred_up_since_us_ = now;
+            }
+            // Back to the selected link between two conversations only
+            if (now - preferred_up_since_us_ >= CONFIG_DUAL_NETWORK_FAILBACK_MS * 1000LL &&
+                    Application::GetInstance().GetDeviceState() == kDeviceStateIdle) {
+                ESP_LOGI(TAG, "Selected link is back, switching");
+                target = preferred_type_;
+            }
+        } else {
+            preferred_up_since_us_ = 0;
+        }
+    }
+    if (target == active) {
+        return;
+    }
+
+    UseLink(target);
+    down_since_us_ = 0;
+    preferred_up_since_us_ = 0;
+    auto display = Board::GetInstance().GetDisplay();
+    display->ShowNotification(target == NetworkType::ML307 ? Lang::Strings::SWITCH_TO_4G_NETWORK :
+        Lang::Strings::SWITCH_TO_WIFI_NETWORK);
+    Application::GetInstance().NotifyNetworkChanged();
+}
+#endif
+
 NetworkInterface* DualNetworkBoard::GetNetwork() {
-    return current_board_->GetNetwork();
+    return current_board_.load()->GetNetwork();
 }
 
 const char* DualNetworkBoard::GetNetworkStateIcon() {
-    return current_board_->GetNetworkStateIcon();
+    return current_board_.load()->GetNetworkStateIcon();
 }
 
 void DualNetworkBoard::SetPowerSaveMode(bool enabled) {
-    current_board_->SetPowerSaveMode(enabled);
+    current_board_.load()->SetPowerSaveMode(enabled);
+#if CONFIG_DUAL_NETWORK_FAILOVER
+    // The standby link saves power as well, once it is up
+    NetworkType standby = network_type_ == NetworkType::WIFI ? NetworkType::ML307 : NetworkType::WIFI;
+    if (IsLinkReady(standby)) {
+        Board* board = standby == NetworkType::WIFI ? static_cast<Board*>(wifi_board_.get()) : ml307_board_.get();
+        board->SetPowerSaveMode(enabled);
+    }
+#endif
+}
+
+void DualNetworkBoard::SetNetworkPowerLevel(NetworkPowerLevel level) {
+    current_board_.load()->SetNetworkPowerLevel(level);
+#if CONFIG_DUAL_NETWORK_FAILOVER
+    NetworkType standby = network_type_ == NetworkType::WIFI ? NetworkType::ML307 : NetworkType::WIFI;
+    if (IsLinkReady(standby)) {
+        Board* board = standby == NetworkType::WIFI ? static_cast<Board*>(wifi_board_.get()) : ml307_board_.get();
+        board->SetNetworkPowerLevel(level);
+    }
+#endif
 }
 
-std::string DualNetworkBoard::GetBoardJson() {   
-    return current_board_->GetBoardJson();
+void DualNetworkBoard::WriteBoardJson(JsonWriter& writer) {
+    current_board_.load()->WriteBoardJson(writer);
 }
 
-std::string DualNetworkBoard::GetDeviceStatusJson() {
-    return current_board_->GetDeviceStatusJson();
+void DualNetworkBoard::WriteDeviceStatusJson(JsonWriter& writer) {
+    current_board_.load()->WriteDeviceStatusJson(writer);
 }
@@ -1,10 +1,13 @@
 #ifndef DUAL_NETWORK_BOARD_H
 #define DUAL_NETWORK_BOARD_H
 
+#include <sdkconfig.h>
 #include "board.h"
 #include "wifi_board.h"
 #include "ml307_board.h"
 #include <memory>
+#include <atomic>
+#include <esp_timer.h>
 
 //enum NetworkType
 enum class NetworkType {
@@ -12,17 +15,43 @@ enum class NetworkType {
     ML307
 };
 
-// 双网络板卡类，可以在WiFi和ML307之间切换
+/*
+ * 双网络板卡类，可以在WiFi和ML307之间切换
+ *
+ * Without CONFIG_DUAL_NETWORK_FAILOVER only the board of the selected network type exists, and
+ * switching saves the other type and restarts.
+ *
+ * With it both boards are brought up at boot, the first link to come up is used. A timer checks
+ * the link in use every second, after CONFIG_DUAL_NETWORK_FAILOVER_MS down it moves to the other
+ * link if that one is up, and once the selected link has been up for CONFIG_DUAL_NETWORK_FAILBACK_MS
+ * it moves back while the device is idle. The protocol then reconnects over the new link, an open
+ * conversation is closed. GetNetworkType() and GetCurrentBoard() follow the link in use.
+ */
 class DualNetworkBoard : public Board {
 private:
-    // 使用基类指针存储当前活动的板卡
-    std::unique_ptr<Board> current_board_;
-    NetworkType network_type_ = NetworkType::ML307;  // Default to ML307
+    // 当前活动的板卡, 另一个在 failover 模式下待机
+    std::atomic<Board*> current_board_ = nullptr;
+    std::unique_ptr<WifiBoard> wifi_board_;
+    std::unique_ptr<Ml307Board> ml307_board_;
+    // The link in use
+    std::atomic<NetworkType> network_type_ = NetworkType::ML307;  // Default to ML307
+    // The type saved in the settings
+    NetworkType preferred_type_ = NetworkType::ML307;
 
     // ML307的引脚配置
     gpio_num_t ml307_tx_pin_;
     gpio_num_t ml307_rx_pin_;
     gpio_num_t ml307_dtr_pin_;
+
+#if CONFIG_DUAL_NETWORK_FAILOVER
+    esp_timer_handle_t health_timer_ = nullptr;
+    int64_t down_since_us_ = 0;         // The link in use went down, 0 while it is up
+    int64_t preferred_up_since_us_ = 0; // The selected link came up while the other one is in use
+
+    bool IsLinkReady(NetworkType type);
+    void UseLink(NetworkType type);
+    void CheckHealth();
+#endif
     
     // 从Settings加载网络类型
     NetworkType LoadNetworkTypeFromSettings(int32_t default_net_type);
@@ -35,7 +64,7 @@ private:
  
 public:
     DualNetworkBoard(gpio_num_t ml307_tx_pin, gpio_num_t ml307_rx_pin, gpio_num_t ml307_dtr_pin = GPIO_NUM_NC, int32_t default_net_type = 1);
-    virtual ~DualNetworkBoard() = default;
+    virtual ~DualNetworkBoard();
  
     // 切换网络类型
     void SwitchNetworkType();
@@ -52,8 +81,9 @@ public:
     virtual NetworkInterface* GetNetwork() override;
     virtual const char* GetNetworkStateIcon() override;
     virtual void SetPowerSaveMode(bool enabled) override;
-    virtual std::string GetBoardJson() override;
-    virtual std::string GetDeviceStatusJson() override;
+    virtual void SetNetworkPowerLevel(NetworkPowerLevel level) override;
+    virtual void WriteBoardJson(JsonWriter& writer) override;
+    virtual void WriteDeviceStatusJson(JsonWriter& writer) override;
 };
 
 #endif // DUAL_NETWORK_BOARD_H 
\ No newline at end of file
@@ -4,16 +4,20 @@
 #include <sys/mman.h>
 #include <sys/param.h>
 #include <unistd.h>
+#include "application.h"
 #include "board.h"
 #include "display.h"
 #include "esp_imgfx_color_convert.h"
 #include "esp_video_device.h"
 #include "esp_video_init.h"
+#include "heap_accounting.h"
+#include "http_client.h"
 #include "jpg/image_to_jpeg.h"
 #include "linux/videodev2.h"
 #include "lvgl_display.h"
 #include "mcp_server.h"
 #include "system_info.h"
+#include "task_placement.h"
 
 #ifdef CONFIG_XIAOZHI_ENABLE_CAMERA_DEBUG_MODE
 #undef LOG_LOCAL_LEVEL
@@ -42,14 +46,47 @@
 #endif  // target
 #endif  // CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
 
+#ifdef CONFIG_SOC_PPA_SUPPORTED
+#include "driver/ppa.h"  // Scales the photos for the upload
+#endif
+
 #include <errno.h>
 #include <esp_heap_caps.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #define TAG "Esp32Camera"
 
+// The pool of chunk buffers between the JPEG encoder and the Explain upload
+#define JPEG_CHUNK_SIZE 4096
+#define JPEG_CHUNK_COUNT 8
+
+namespace {
+
+struct JpegPipe {
+    BufferPool* chunks;             // The buffers the encoder can fill, back in the pool once uploaded
+    QueueHandle_t jpeg_queue;       // JpegChunk, filled buffers, nullptr handle at the end
+    SharedBuffer filling;           // Encoder only, the chunk being filled
+    size_t fill = 0;
+    int64_t encode_end_us = 0;
+
+    // Queues the chunk being filled, the upload holds the reference from then on
+    void Flush() {
+        if (fill > 0) {
+            JpegChunk chunk = BufferSlice(std::move(filling), 0, fill).Release();
+            xQueueSend(jpeg_queue, &chunk, portMAX_DELAY);
+            fill = 0;
+        }
+    }
+};
+
+} // namespace
+
 #if defined(CONFIG_CAMERA_SENSOR_SWAP_PIXEL_BYTE_ORDER) || defined(CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP)
 #warning \
     "CAMERA_SENSOR_SWAP_PIXEL_BYTE_ORDER or CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP is enabled, which may cause image corruption in YUV422 format!"
@@ -91,6 +128,29 @@ static void log_available_video_devices() {
 #endif  // CONFIG_XIAOZHI_ENABLE_CAMERA_DEBUG_MODE
 
 Esp32Camera::Esp32Camera(const esp_video_init_config_t& config) {
+#if CONFIG_XIAOZHI_CAMERA_FRAME_BENCHMARK
+    RunBenchmark();
+#endif
+#if CONFIG_XIAOZHI_CAMERA_EXPLAIN_KEEP_ALIVE_SECONDS > 0
+    esp_timer_create_args_t idle_timer_args = {
+        .callback = [](void* arg) {
+            auto self = static_cast<Esp32Camera*>(arg);
+            // An Explain() holding the client arms the timer again when it is done
+            std::unique_lock<std::mutex> lock(self->explain_http_mutex_, std::try_to_lock);
+            if (lock.owns_lock() && self->explain_http_) {
+                self->explain_http_->Close();
+                self->explain_http_.reset();
+                ESP_LOGI(TAG, "Closed the idle explain connection");
+            }
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "explain_idle",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&idle_timer_args, &explain_idle_timer_));
+#endif
+
     if (esp_video_init(&config) != ESP_OK) {
         ESP_LOGE(TAG, "esp_video_init failed");
         return;
@@ -269,7 +329,12 @@ Esp32Camera::Esp32Camera(const esp_video_init_config_t& config) {
 
     // 申请缓冲并mmap
     struct v4l2_requestbuffers req = {};
+#if CONFIG_XIAOZHI_CAMERA_CONTINUOUS_CAPTURE
+    // One buffer held with the latest frame, one for the driver to fill
+    req.count = 2;
+#else
     req.count = strcmp(video_device_name, ESP_VIDEO_MIPI_CSI_DEVICE_NAME) == 0 ? 2 : 1;
+#endif
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     req.memory = V4L2_MEMORY_MMAP;
     if (ioctl(video_fd_, VIDIOC_REQBUFS, &req) != 0) {
@@ -312,6 +377,21 @@ Esp32Camera::Esp32Camera(const esp_video_init_config_t& config) {
         }
     }
 
+    // The frame copies reuse one buffer, sized for the largest frame. None is needed when the
+    // photos are read from the V4L2 buffers.
+    size_t max_length = 0;
+    for (auto& b : mmap_buffers_) {
+        max_length = std::max(max_length, b.length);
+    }
+#ifndef CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
+    bool needs_copy = HeldFrameFormat(sensor_format_) == 0;
+#else
+    bool needs_copy = true;
+#endif  // CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
+    if (needs_copy && !ReserveFrameBuffer(max_length)) {
+        ESP_LOGW(TAG, "No frame buffer yet, allocated at the first capture");
+    }
+
     int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     if (ioctl(video_fd_, VIDIOC_STREAMON, &type) != 0) {
         ESP_LOGE(TAG, "VIDIOC_STREAMON failed");
@@ -321,7 +401,22 @@ Esp32Camera::Esp32Camera(const esp_video_init_config_t& config) {
         return;
     }
 
-#ifdef CONFIG_ESP_VIDEO_ENABLE_ISP_VIDEO_DEVICE
+#if CONFIG_XIAOZHI_CAMERA_CONTINUOUS_CAPTURE
+    stream_running_ = true;
+    stream_done_ = xSemaphoreCreateBinary();
+    if (TaskPlacements::Create(kTaskCameraStream, [](void* arg) {
+            auto self = static_cast<Esp32Camera*>(arg);
+            self->StreamLoop();
+            xSemaphoreGive(self->stream_done_);
+            TaskPlacements::Delete(kTaskCameraStream);
+        }, this) != pdPASS) {
+        // Capture() dequeues the frames itself
+        vSemaphoreDelete(stream_done_);
+        stream_done_ = nullptr;
+        stream_running_ = false;
+        streaming_on_ = true;
+    }
+#elif defined(CONFIG_ESP_VIDEO_ENABLE_ISP_VIDEO_DEVICE)
     // 当启用 ISP 时，ISP 需要一些照片来初始化参数，因此开启后后台拍摄5s照片并丢弃
     xTaskCreate(
         [](void* arg) {
@@ -356,10 +451,32 @@ Esp32Camera::Esp32Camera(const esp_video_init_config_t& config) {
 }
 
 Esp32Camera::~Esp32Camera() {
-    if (streaming_on_ && video_fd_ >= 0) {
+    StopStreaming();
+    if (encoder_thread_.joinable()) {
+        encoder_thread_.join();
+    }
+#if CONFIG_XIAOZHI_CAMERA_EXPLAIN_KEEP_ALIVE_SECONDS > 0
+    if (explain_idle_timer_ != nullptr) {
+        esp_timer_stop(explain_idle_timer_);
+        esp_timer_delete(explain_idle_timer_);
+    }
+    explain_http_.reset();
+#endif
+    ReleaseHeldFrame();
+#if CONFIG_XIAOZHI_CAMERA_CONTINUOUS_CAPTURE
+    stream_stop_ = true;
+#endif
+    if (video_fd_ >= 0) {
         int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         ioctl(video_fd_, VIDIOC_STREAMOFF, &type);
     }
+#if CONFIG_XIAOZHI_CAMERA_CONTINUOUS_CAPTURE
+    // The stream task leaves its blocking dequeue once the stream is off
+    if (stream_done_ != nullptr) {
+        xSemaphoreTake(stream_done_, portMAX_DELAY);
+        vSemaphoreDelete(stream_done_);
+    }
+#endif
     for (auto& b : mmap_buffers_) {
         if (b.start && b.length) {
             munmap(b.start, b.length);
@@ -370,25 +487,105 @@ Esp32Camera::~Esp32Camera() {
         video_fd_ = -1;
     }
     sensor_format_ = 0;
+    if (frame_.data) {
+        HeapAccounting::Free(kHeapTagCamera, frame_.data);
+        frame_.data = nullptr;
+    }
     esp_video_deinit();
 }
 
-void Esp32Camera::SetExplainUrl(const std::string& url, const std::string& token) {
-    explain_url_ = url;
-    explain_token_ = token;
+// The format of the frame when the V4L2 buffer can be used as it is, 0 when it must be copied
+v4l2_pix_fmt_t Esp32Camera::HeldFrameFormat(v4l2_pix_fmt_t sensor_format) {
+#ifdef CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP
+    // The encoder reads the swapped RGB565 as RGB565X, the other formats are swapped in the copy
+    return sensor_format == V4L2_PIX_FMT_RGB565 ? V4L2_PIX_FMT_RGB565X : 0;
+#else
+    switch (sensor_format) {
+        case V4L2_PIX_FMT_RGB565:
+        case V4L2_PIX_FMT_RGB565X:
+        case V4L2_PIX_FMT_RGB24:
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_YUV420:
+        case V4L2_PIX_FMT_GREY:
+            return sensor_format;
+        case V4L2_PIX_FMT_YUV422P:
+            // 这个格式是 422 YUYV，不是 planer
+            return V4L2_PIX_FMT_YUYV;
+        default:
+            return 0;
+    }
+#endif  // CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP
 }
 
-bool Esp32Camera::Capture() {
-    if (encoder_thread_.joinable()) {
-        encoder_thread_.join();
+void Esp32Camera::ReleaseHeldFrame() {
+    if (held_index_ < 0) {
+        return;
     }
+    struct v4l2_buffer buf = {};
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = held_index_;
+    if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
+        ESP_LOGE(TAG, "VIDIOC_QBUF failed");
+    }
+    held_index_ = -1;
+    frame_.data = frame_copy_;
+    frame_copy_ = nullptr;
+    frame_.len = 0;
+#if CONFIG_XIAOZHI_CAMERA_CONTINUOUS_CAPTURE
+    // The stream stalled while the buffer was held, its latest frame is old
+    std::lock_guard<std::mutex> lock(latest_mutex_);
+    if (latest_index_ >= 0) {
+        struct v4l2_buffer latest = {};
+        latest.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        latest.memory = V4L2_MEMORY_MMAP;
+        latest.index = latest_index_;
+        if (ioctl(video_fd_, VIDIOC_QBUF, &latest) != 0) {
+            ESP_LOGE(TAG, "VIDIOC_QBUF failed");
+        }
+        latest_index_ = -1;
+    }
+#endif
+}
 
-    if (!streaming_on_ || video_fd_ < 0) {
+bool Esp32Camera::ReserveFrameBuffer(size_t size) {
+    if (frame_.data != nullptr && frame_capacity_ >= size) {
+        return true;
+    }
+    if (frame_.data != nullptr) {
+        HeapAccounting::Free(kHeapTagCamera, frame_.data);
+        frame_.data = nullptr;
+    }
+    frame_capacity_ = 0;
+    frame_.data = (uint8_t*)HeapAccounting::Place(kHeapTagCamera, size, kHeapPlacementPsram);
+    if (frame_.data == nullptr) {
+        ESP_LOGE(TAG, "alloc frame copy failed");
         return false;
     }
+    frame_capacity_ = size;
+    return true;
+}
 
+bool Esp32Camera::DequeueFreshFrame(struct v4l2_buffer& buf) {
+#if CONFIG_XIAOZHI_CAMERA_CONTINUOUS_CAPTURE
+    if (stream_running_) {
+        std::unique_lock<std::mutex> lock(latest_mutex_);
+        if (!latest_cv_.wait_for(lock, std::chrono::seconds(1), [this]() { return latest_index_ >= 0; })) {
+            ESP_LOGE(TAG, "No camera frame in 1 s");
+            return false;
+        }
+        buf = {};
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = latest_index_;
+        buf.bytesused = latest_bytesused_;
+        latest_index_ = -1;
+        return true;
+    }
+#endif
+    // 驱动里排队的可能是旧帧，丢弃前两帧，取第三帧
     for (int i = 0; i < 3; i++) {
-        struct v4l2_buffer buf = {};
+        buf = {};
         buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         buf.memory = V4L2_MEMORY_MMAP;
         if (ioctl(video_fd_, VIDIOC_DQBUF, &buf) != 0) {
@@ -396,329 +593,437 @@ bool Esp32Camera::Capture() {
             return false;
         }
         if (i == 2) {
-            // 保存帧副本到PSRAM
-            if (frame_.data) {
-                heap_caps_free(frame_.data);
-                frame_.data = nullptr;
-                frame_.format = 0;
+            return true;
+        }
+        if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
+            ESP_LOGE(TAG, "VIDIOC_QBUF failed");
+        }
+    }
+    return false;
+}
+
+#if CONFIG_XIAOZHI_CAMERA_CONTINUOUS_CAPTURE
+void Esp32Camera::StreamLoop() {
+#ifdef CONFIG_ESP_VIDEO_ENABLE_ISP_VIDEO_DEVICE
+    // 当启用 ISP 时，ISP 需要一些照片来初始化参数，前5s的照片丢弃
+    int64_t ready_us = esp_timer_get_time() + 5000 * 1000;
+#else
+    int64_t ready_us = 0;
+#endif
+    while (!stream_stop_) {
+        struct v4l2_buffer buf = {};
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        if (ioctl(video_fd_, VIDIOC_DQBUF, &buf) != 0) {
+            if (!stream_stop_) {
+                ESP_LOGE(TAG, "VIDIOC_DQBUF failed");
+                vTaskDelay(pdMS_TO_TICKS(10));
             }
-            frame_.len = buf.bytesused;
-            frame_.data = (uint8_t*)heap_caps_malloc(frame_.len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-            if (!frame_.data) {
-                ESP_LOGE(TAG, "alloc frame copy failed");
-                if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                    ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                }
-                return false;
+            continue;
+        }
+        if (!streaming_on_ && esp_timer_get_time() < ready_us) {
+            if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
+                ESP_LOGE(TAG, "VIDIOC_QBUF failed");
             }
+            continue;
+        }
+
+        // The previous latest frame goes back to the driver, unless Capture() took it
+        std::lock_guard<std::mutex> lock(latest_mutex_);
+        if (latest_index_ >= 0) {
+            struct v4l2_buffer previous = {};
+            previous.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            previous.memory = V4L2_MEMORY_MMAP;
+            previous.index = latest_index_;
+            if (ioctl(video_fd_, VIDIOC_QBUF, &previous) != 0) {
+                ESP_LOGE(TAG, "VIDIOC_QBUF failed");
+            }
+        }
+        latest_index_ = buf.index;
+        latest_bytesused_ = buf.bytesused;
+        if (!streaming_on_) {
+            ESP_LOGI(TAG, "Camera init success, streaming continuously");
+            streaming_on_ = true;
+        }
+        latest_cv_.notify_all();
+    }
+
+    std::lock_guard<std::mutex> lock(latest_mutex_);
+    latest_index_ = -1;
+    stream_running_ = false;
+}
+#endif
+
+void Esp32Camera::SetExplainUrl(const std::string& url, const std::string& token) {
+#if CONFIG_XIAOZHI_CAMERA_EXPLAIN_KEEP_ALIVE_SECONDS > 0
+    // The kept client belongs to the old endpoint
+    std::lock_guard<std::mutex> lock(explain_http_mutex_);
+    if (explain_http_ && url != explain_url_) {
+        explain_http_->Close();
+        explain_http_.reset();
+    }
+#endif
+    explain_url_ = url;
+    explain_token_ = token;
+}
+
+bool Esp32Camera::Capture() {
+    std::lock_guard<std::mutex> lock(capture_mutex_);
+    return CaptureFrame(true);
+}
+
+bool Esp32Camera::CaptureFrame(bool preview) {
+    if (encoder_thread_.joinable()) {
+        encoder_thread_.join();
+    }
+
+    if (!streaming_on_ || video_fd_ < 0) {
+        return false;
+    }
+
+    ReleaseHeldFrame();
+    struct v4l2_buffer buf = {};
+    if (!DequeueFreshFrame(buf)) {
+        return false;
+    }
+
+#ifndef CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
+    v4l2_pix_fmt_t held_format = HeldFrameFormat(sensor_format_);
+    if (held_format != 0) {
+        // 直接使用 V4L2 缓冲区，不复制，编码后或下次拍照时归还
+        frame_copy_ = frame_.data;
+        frame_.data = (uint8_t*)mmap_buffers_[buf.index].start;
+        frame_.len = buf.bytesused;
+        frame_.format = held_format;
+        held_index_ = buf.index;
+        return !preview || ShowPreview();
+    }
+#endif  // CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
+
+    // 保存帧副本到PSRAM，复用初始化时分配的缓冲区
+    frame_.format = 0;
+    if (!ReserveFrameBuffer(std::max<size_t>(buf.bytesused, mmap_buffers_[buf.index].length))) {
+        if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
+            ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
+        }
+        return false;
+    }
+    frame_.len = buf.bytesused;
 
 #ifdef CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
-            ESP_LOGW(TAG, "mmap_buffers_[buf.index].length = %d, sensor_width = %d, sensor_height = %d",
-                     mmap_buffers_[buf.index].length, sensor_width_, sensor_height_);
+    ESP_LOGD(TAG, "mmap_buffers_[buf.index].length = %d, sensor_width = %d, sensor_height = %d",
+             mmap_buffers_[buf.index].length, sensor_width_, sensor_height_);
 #else
-            ESP_LOGW(TAG, "mmap_buffers_[buf.index].length = %d, frame.width = %d, frame.height = %d",
-                     mmap_buffers_[buf.index].length, frame_.width, frame_.height);
+    ESP_LOGD(TAG, "mmap_buffers_[buf.index].length = %d, frame.width = %d, frame.height = %d",
+             mmap_buffers_[buf.index].length, frame_.width, frame_.height);
 #endif  // CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
-            ESP_LOG_BUFFER_HEXDUMP(TAG, mmap_buffers_[buf.index].start, MIN(mmap_buffers_[buf.index].length, 256),
-                                   ESP_LOG_DEBUG);
-
-            switch (sensor_format_) {
-                case V4L2_PIX_FMT_RGB565:
-                case V4L2_PIX_FMT_RGB24:
-                case V4L2_PIX_FMT_YUYV:
-                case V4L2_PIX_FMT_YUV420:
-                case V4L2_PIX_FMT_GREY:
+    ESP_LOG_BUFFER_HEXDUMP(TAG, mmap_buffers_[buf.index].start, MIN(mmap_buffers_[buf.index].length, 256),
+                           ESP_LOG_DEBUG);
+
+#if defined(CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE) && defined(CONFIG_SOC_PPA_SUPPORTED)
+    bool ppa_byte_swap = false;  // The copy left the RGB565 bytes to the PPA
+#endif
+    switch (sensor_format_) {
+        case V4L2_PIX_FMT_RGB565:
+        case V4L2_PIX_FMT_RGB24:
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_YUV420:
+        case V4L2_PIX_FMT_GREY:
 #ifdef CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP
-                {
-                    auto src16 = (uint16_t*)mmap_buffers_[buf.index].start;
-                    auto dst16 = (uint16_t*)frame_.data;
-                    size_t count = (size_t)mmap_buffers_[buf.index].length / 2;
-                    for (size_t i = 0; i < count; i++) {
-                        dst16[i] = __builtin_bswap16(src16[i]);
-                    }
-                }
+#if defined(CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE) && defined(CONFIG_SOC_PPA_SUPPORTED)
+        if (sensor_format_ == V4L2_PIX_FMT_RGB565) {
+            // The PPA swaps the bytes while it rotates
+            memcpy(frame_.data, mmap_buffers_[buf.index].start,
+                   MIN(mmap_buffers_[buf.index].length, frame_.len));
+            ppa_byte_swap = true;
+        } else
+#endif
+        image_swap_bytes16(frame_.data, (const uint8_t*)mmap_buffers_[buf.index].start,
+                           mmap_buffers_[buf.index].length);
 #else
-                    memcpy(frame_.data, mmap_buffers_[buf.index].start,
-                           MIN(mmap_buffers_[buf.index].length, frame_.len));
+            memcpy(frame_.data, mmap_buffers_[buf.index].start,
+                   MIN(mmap_buffers_[buf.index].length, frame_.len));
 #endif  // CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP
-                    frame_.format = sensor_format_;
-                    break;
-                case V4L2_PIX_FMT_YUV422P: {
-                    // 这个格式是 422 YUYV，不是 planer
-                    frame_.format = V4L2_PIX_FMT_YUYV;
+            frame_.format = sensor_format_;
+            break;
+        case V4L2_PIX_FMT_YUV422P: {
+            // 这个格式是 422 YUYV，不是 planer
+            frame_.format = V4L2_PIX_FMT_YUYV;
 #ifdef CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP
-                    {
-                        auto src16 = (uint16_t*)mmap_buffers_[buf.index].start;
-                        auto dst16 = (uint16_t*)frame_.data;
-                        size_t count = (size_t)mmap_buffers_[buf.index].length / 2;
-                        for (size_t i = 0; i < count; i++) {
-                            dst16[i] = __builtin_bswap16(src16[i]);
-                        }
-                    }
+            image_swap_bytes16(frame_.data, (const uint8_t*)mmap_buffers_[buf.index].start,
+                               mmap_buffers_[buf.index].length);
 #else
-                    memcpy(frame_.data, mmap_buffers_[buf.index].start,
-                           MIN(mmap_buffers_[buf.index].length, frame_.len));
+            memcpy(frame_.data, mmap_buffers_[buf.index].start,
+                   MIN(mmap_buffers_[buf.index].length, frame_.len));
 #endif  // CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP
-                    break;
-                }
-                case V4L2_PIX_FMT_RGB565X: {
-                    // 大端序的 RGB565 需要转换为小端序
-                    // 目前 esp_video 的大小端都会返回格式为 RGB565，不会返回格式为 RGB565X，此 case 用于未来版本兼容
-                    auto src16 = (uint16_t*)mmap_buffers_[buf.index].start;
-                    auto dst16 = (uint16_t*)frame_.data;
-                    size_t pixel_count = (size_t)frame_.width * (size_t)frame_.height;
-                    for (size_t i = 0; i < pixel_count; i++) {
-                        dst16[i] = __builtin_bswap16(src16[i]);
-                    }
-                    frame_.format = V4L2_PIX_FMT_RGB565;
-                    break;
-                }
-                default:
-                    ESP_LOGE(TAG, "unsupported sensor format: 0x%08x", sensor_format_);
-                    if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                        ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                    }
-                    return false;
+            break;
+        }
+        case V4L2_PIX_FMT_RGB565X: {
+            // 大端序的 RGB565 需要转换为小端序
+            // 目前 esp_video 的大小端都会返回格式为 RGB565，不会返回格式为 RGB565X，此 case 用于未来版本兼容
+#if defined(CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE) && defined(CONFIG_SOC_PPA_SUPPORTED)
+            // The PPA swaps the bytes while it rotates
+            memcpy(frame_.data, mmap_buffers_[buf.index].start,
+                   MIN(mmap_buffers_[buf.index].length, frame_.len));
+            ppa_byte_swap = true;
+#else
+            image_swap_bytes16(frame_.data, (const uint8_t*)mmap_buffers_[buf.index].start,
+                               (size_t)frame_.width * frame_.height * 2);
+#endif
+            frame_.format = V4L2_PIX_FMT_RGB565;
+            break;
+        }
+        default:
+            ESP_LOGE(TAG, "unsupported sensor format: 0x%08x", sensor_format_);
+            if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
+                ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
             }
+            return false;
+    }
 
 #ifdef CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
 #ifndef CONFIG_SOC_PPA_SUPPORTED
-            uint8_t* rotate_dst =
-                (uint8_t*)heap_caps_aligned_alloc(64, frame_.len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-            if (rotate_dst == nullptr) {
-                ESP_LOGE(TAG, "Failed to allocate memory for rotate image");
-                if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                    ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                }
-                return false;
-            }
-            uint8_t* rotate_src = (uint8_t*)frame_.data;
-
-            esp_imgfx_rotate_cfg_t rotate_cfg = {
-                .in_res =
-                    {
-                        .width = static_cast<int16_t>(sensor_width_),
-                        .height = static_cast<int16_t>(sensor_height_),
-                    },
-                .degree = IMAGE_ROTATION_ANGLE,
-            };
-            switch (frame_.format) {
-                case V4L2_PIX_FMT_RGB565:
-                    rotate_cfg.in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB565_LE;
-                    break;
-                case V4L2_PIX_FMT_YUYV:
-                    rotate_cfg.in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB565_LE;
-                    break;
-                case V4L2_PIX_FMT_GREY:
-                    rotate_cfg.in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_Y;
-                    break;
-                case V4L2_PIX_FMT_RGB24:
-                    rotate_cfg.in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB888;
-                    break;
-                default:
-                    ESP_LOGE(TAG, "unsupported sensor format: 0x%08x", sensor_format_);
-                    if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                        ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                    }
-                    return false;
-            }
-            esp_imgfx_rotate_handle_t rotate_handle = nullptr;
-            esp_imgfx_err_t imgfx_err = esp_imgfx_rotate_open(&rotate_cfg, &rotate_handle);
-            if (imgfx_err != ESP_IMGFX_ERR_OK || rotate_handle == nullptr) {
-                ESP_LOGE(TAG, "esp_imgfx_rotate_create failed");
-                if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                    ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                }
-                return false;
+    uint8_t* rotate_dst =
+        (uint8_t*)HeapAccounting::AlignedAlloc(kHeapTagCamera, 64, frame_.len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (rotate_dst == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate memory for rotate image");
+        if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
+            ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
+        }
+        return false;
+    }
+    uint8_t* rotate_src = (uint8_t*)frame_.data;
+
+    esp_imgfx_rotate_cfg_t rotate_cfg = {
+        .in_res =
+            {
+                .width = static_cast<int16_t>(sensor_width_),
+                .height = static_cast<int16_t>(sensor_height_),
+            },
+        .degree = IMAGE_ROTATION_ANGLE,
+    };
+    switch (frame_.format) {
+        case V4L2_PIX_FMT_RGB565:
+            rotate_cfg.in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB565_LE;
+            break;
+        case V4L2_PIX_FMT_YUYV:
+            rotate_cfg.in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB565_LE;
+            break;
+        case V4L2_PIX_FMT_GREY:
+            rotate_cfg.in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_Y;
+            break;
+        case V4L2_PIX_FMT_RGB24:
+            rotate_cfg.in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB888;
+            break;
+        default:
+            ESP_LOGE(TAG, "unsupported sensor format: 0x%08x", sensor_format_);
+            if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
+                ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
             }
+            return false;
+    }
+    esp_imgfx_rotate_handle_t rotate_handle = nullptr;
+    esp_imgfx_err_t imgfx_err = esp_imgfx_rotate_open(&rotate_cfg, &rotate_handle);
+    if (imgfx_err != ESP_IMGFX_ERR_OK || rotate_handle == nullptr) {
+        ESP_LOGE(TAG, "esp_imgfx_rotate_create failed");
+        if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
+            ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
+        }
+        return false;
+    }
 
-            esp_imgfx_data_t rotate_input_data = {
-                .data = rotate_src,
-                .data_len = frame_.len,
-            };
-            esp_imgfx_data_t rotate_output_data = {
-                .data = rotate_dst,
-                .data_len = frame_.len,
-            };
+    esp_imgfx_data_t rotate_input_data = {
+        .data = rotate_src,
+        .data_len = frame_.len,
+    };
+    esp_imgfx_data_t rotate_output_data = {
+        .data = rotate_dst,
+        .data_len = frame_.len,
+    };
 
-            imgfx_err = esp_imgfx_rotate_process(rotate_handle, &rotate_input_data, &rotate_output_data);
-            if (imgfx_err != ESP_IMGFX_ERR_OK) {
-                ESP_LOGE(TAG, "esp_imgfx_rotate_process failed");
-                heap_caps_free(rotate_dst);
-                rotate_dst = nullptr;
-                if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                    ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                }
-                esp_imgfx_rotate_close(rotate_handle);
-                rotate_handle = nullptr;
-                return false;
-            }
+    imgfx_err = esp_imgfx_rotate_process(rotate_handle, &rotate_input_data, &rotate_output_data);
+    if (imgfx_err != ESP_IMGFX_ERR_OK) {
+        ESP_LOGE(TAG, "esp_imgfx_rotate_process failed");
+        HeapAccounting::Free(kHeapTagCamera, rotate_dst);
+        rotate_dst = nullptr;
+        if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
+            ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
+        }
+        esp_imgfx_rotate_close(rotate_handle);
+        rotate_handle = nullptr;
+        return false;
+    }
 
-            frame_.data = rotate_dst;
+    frame_.data = rotate_dst;
+    frame_capacity_ = frame_.len;
 
-            heap_caps_free(rotate_src);
-            rotate_src = nullptr;
+    HeapAccounting::Free(kHeapTagCamera, rotate_src);
+    rotate_src = nullptr;
 
-            esp_imgfx_rotate_close(rotate_handle);
-            rotate_handle = nullptr;
+    esp_imgfx_rotate_close(rotate_handle);
+    rotate_handle = nullptr;
 #else   // CONFIG_SOC_PPA_SUPPORTED
-            uint8_t* rotate_src = nullptr;
-
-            ppa_srm_color_mode_t ppa_color_mode;
-            switch (frame_.format) {
-                case V4L2_PIX_FMT_RGB565:
-                    rotate_src = (uint8_t*)frame_.data;
-                    ppa_color_mode = PPA_SRM_COLOR_MODE_RGB565;
-                    break;
-                case V4L2_PIX_FMT_RGB24:
-                    rotate_src = (uint8_t*)frame_.data;
-                    ppa_color_mode = PPA_SRM_COLOR_MODE_RGB888;
-                    break;
-                case V4L2_PIX_FMT_YUYV: {
-                    ESP_LOGW(TAG, "YUYV format is not supported for PPA rotation, using software conversion to RGB888");
-                    rotate_src = (uint8_t*)heap_caps_malloc(frame_.width * frame_.height * 3,
-                                                            MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-                    if (rotate_src == nullptr) {
-                        ESP_LOGE(TAG, "Failed to allocate memory for rotate image");
-                        if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                            ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                        }
-                        return false;
-                    }
-                    esp_imgfx_color_convert_cfg_t convert_cfg = {
-                        .in_res = {.width = static_cast<int16_t>(frame_.width),
-                                   .height = static_cast<int16_t>(frame_.height)},
-                        .in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_YUYV,
-                        .out_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB888,
-                    };
-                    esp_imgfx_color_convert_handle_t convert_handle = nullptr;
-                    esp_imgfx_err_t err = esp_imgfx_color_convert_open(&convert_cfg, &convert_handle);
-                    if (err != ESP_IMGFX_ERR_OK || convert_handle == nullptr) {
-                        ESP_LOGE(TAG, "esp_imgfx_color_convert_open failed");
-                        heap_caps_free(rotate_src);
-                        rotate_src = nullptr;
-                        if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                            ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                        }
-                        return false;
-                    }
-                    esp_imgfx_data_t convert_input_data = {
-                        .data = frame_.data,
-                        .data_len = frame_.len,
-                    };
-                    esp_imgfx_data_t convert_output_data = {
-                        .data = rotate_src,
-                        .data_len = static_cast<uint32_t>(frame_.width * frame_.height * 3),
-                    };
-                    err = esp_imgfx_color_convert_process(convert_handle, &convert_input_data, &convert_output_data);
-                    if (err != ESP_IMGFX_ERR_OK) {
-                        ESP_LOGE(TAG, "esp_imgfx_color_convert_process failed");
-                        heap_caps_free(rotate_src);
-                        rotate_src = nullptr;
-                        esp_imgfx_color_convert_close(convert_handle);
-                        convert_handle = nullptr;
-                        if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                            ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                        }
-                        return false;
-                    }
-                    esp_imgfx_color_convert_close(convert_handle);
-                    convert_handle = nullptr;
-                    ppa_color_mode = PPA_SRM_COLOR_MODE_RGB888;
-                    heap_caps_free(frame_.data);
-                    frame_.data = rotate_src;
-                    frame_.len = frame_.width * frame_.height * 3;
-                    break;
-                }
-                default:
-                    ESP_LOGE(TAG, "unsupported sensor format for PPA rotation: 0x%08x", sensor_format_);
-                    if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                        ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                    }
-                    return false;
-            }
+    uint8_t* rotate_src = nullptr;
 
-            uint8_t* rotate_dst = (uint8_t*)heap_caps_malloc(
-                frame_.width * frame_.height * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT | MALLOC_CAP_CACHE_ALIGNED);
-            if (rotate_dst == nullptr) {
+    ppa_srm_color_mode_t ppa_color_mode;
+    switch (frame_.format) {
+        case V4L2_PIX_FMT_RGB565:
+            rotate_src = (uint8_t*)frame_.data;
+            ppa_color_mode = PPA_SRM_COLOR_MODE_RGB565;
+            break;
+        case V4L2_PIX_FMT_RGB24:
+            rotate_src = (uint8_t*)frame_.data;
+            ppa_color_mode = PPA_SRM_COLOR_MODE_RGB888;
+            break;
+        case V4L2_PIX_FMT_YUYV: {
+            ESP_LOGW(TAG, "YUYV format is not supported for PPA rotation, using software conversion to RGB888");
+            rotate_src = (uint8_t*)HeapAccounting::Malloc(kHeapTagCamera, frame_.width * frame_.height * 3,
+                                                    MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+            if (rotate_src == nullptr) {
                 ESP_LOGE(TAG, "Failed to allocate memory for rotate image");
                 if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
                     ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
                 }
                 return false;
             }
-
-            ppa_client_handle_t ppa_client = nullptr;
-            ppa_client_config_t client_cfg = {
-                .oper_type = PPA_OPERATION_SRM,
-                .max_pending_trans_num = 1,
+            esp_imgfx_color_convert_cfg_t convert_cfg = {
+                .in_res = {.width = static_cast<int16_t>(frame_.width),
+                           .height = static_cast<int16_t>(frame_.height)},
+                .in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_YUYV,
+                .out_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB888,
             };
-            esp_err_t err = ppa_register_client(&client_cfg, &ppa_client);
-            if (err != ESP_OK || ppa_client == nullptr) {
-                ESP_LOGE(TAG, "ppa_register_client failed: %d", (int)err);
-                heap_caps_free(rotate_dst);
-                rotate_dst = nullptr;
+            esp_imgfx_color_convert_handle_t convert_handle = nullptr;
+            esp_imgfx_err_t err = esp_imgfx_color_convert_open(&convert_cfg, &convert_handle);
+            if (err != ESP_IMGFX_ERR_OK || convert_handle == nullptr) {
+                ESP_LOGE(TAG, "esp_imgfx_color_convert_open failed");
+                HeapAccounting::Free(kHeapTagCamera, rotate_src);
+                rotate_src = nullptr;
                 if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
                     ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
                 }
                 return false;
             }
-
-            ppa_srm_rotation_angle_t ppa_angle = IMAGE_ROTATION_ANGLE;
-
-            ppa_srm_oper_config_t srm_cfg = {};
-            srm_cfg.in.buffer = (void*)rotate_src;
-            srm_cfg.in.pic_w = sensor_width_;
-            srm_cfg.in.pic_h = sensor_height_;
-            srm_cfg.in.block_w = sensor_width_;
-            srm_cfg.in.block_h = sensor_height_;
-            srm_cfg.in.block_offset_x = 0;
-            srm_cfg.in.block_offset_y = 0;
-            srm_cfg.in.srm_cm = ppa_color_mode;
-
-            srm_cfg.out.buffer = (void*)rotate_dst;
-            srm_cfg.out.buffer_size = frame_.len;
-            srm_cfg.out.pic_w = frame_.width;
-            srm_cfg.out.pic_h = frame_.height;
-            srm_cfg.out.block_offset_x = 0;
-            srm_cfg.out.block_offset_y = 0;
-            srm_cfg.out.srm_cm = PPA_SRM_COLOR_MODE_RGB565;
-
-            // 等比例缩放 1.0
-            srm_cfg.scale_x = 1.0f;
-            srm_cfg.scale_y = 1.0f;
-            srm_cfg.rotation_angle = ppa_angle;
-            srm_cfg.mode = PPA_TRANS_MODE_BLOCKING;
-            srm_cfg.user_data = nullptr;
-
-            err = ppa_do_scale_rotate_mirror(ppa_client, &srm_cfg);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "ppa_do_scale_rotate_mirror failed: %d", (int)err);
-                heap_caps_free(rotate_dst);
-                rotate_dst = nullptr;
-                (void)ppa_unregister_client(ppa_client);
+            esp_imgfx_data_t convert_input_data = {
+                .data = frame_.data,
+                .data_len = frame_.len,
+            };
+            esp_imgfx_data_t convert_output_data = {
+                .data = rotate_src,
+                .data_len = static_cast<uint32_t>(frame_.width * frame_.height * 3),
+            };
+            err = esp_imgfx_color_convert_process(convert_handle, &convert_input_data, &convert_output_data);
+            if (err != ESP_IMGFX_ERR_OK) {
+                ESP_LOGE(TAG, "esp_imgfx_color_convert_process failed");
+                HeapAccounting::Free(kHeapTagCamera, rotate_src);
+                rotate_src = nullptr;
+                esp_imgfx_color_convert_close(convert_handle);
+                convert_handle = nullptr;
                 if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
                     ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
                 }
                 return false;
             }
+            esp_imgfx_color_convert_close(convert_handle);
+            convert_handle = nullptr;
+            ppa_color_mode = PPA_SRM_COLOR_MODE_RGB888;
+            HeapAccounting::Free(kHeapTagCamera, frame_.data);
+            frame_.data = rotate_src;
+            frame_.len = frame_.width * frame_.height * 3;
+            frame_capacity_ = frame_.len;
+            break;
+        }
+        default:
+            ESP_LOGE(TAG, "unsupported sensor format for PPA rotation: 0x%08x", sensor_format_);
+            if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
+                ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
+            }
+            return false;
+    }
 
-            (void)ppa_unregister_client(ppa_client);
+    uint8_t* rotate_dst = (uint8_t*)HeapAccounting::Malloc(kHeapTagCamera,
+        frame_.width * frame_.height * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT | MALLOC_CAP_CACHE_ALIGNED);
+    if (rotate_dst == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate memory for rotate image");
+        if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
+            ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
+        }
+        return false;
+    }
 
-            frame_.data = rotate_dst;
-            frame_.len = frame_.width * frame_.height * 2;
-            frame_.format = V4L2_PIX_FMT_RGB565;
-            heap_caps_free(rotate_src);
-            rotate_src = nullptr;
-#endif  // CONFIG_SOC_PPA_SUPPORTED
-#endif  // CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
+    ppa_client_handle_t ppa_client = nullptr;
+    ppa_client_config_t client_cfg = {
+        .oper_type = PPA_OPERATION_SRM,
+        .max_pending_trans_num = 1,
+    };
+    esp_err_t err = ppa_register_client(&client_cfg, &ppa_client);
+    if (err != ESP_OK || ppa_client == nullptr) {
+        ESP_LOGE(TAG, "ppa_register_client failed: %d", (int)err);
+        HeapAccounting::Free(kHeapTagCamera, rotate_dst);
+        rotate_dst = nullptr;
+        if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
+            ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
         }
+        return false;
+    }
 
+    ppa_srm_rotation_angle_t ppa_angle = IMAGE_ROTATION_ANGLE;
+
+    ppa_srm_oper_config_t srm_cfg = {};
+    srm_cfg.in.buffer = (void*)rotate_src;
+    srm_cfg.in.pic_w = sensor_width_;
+    srm_cfg.in.pic_h = sensor_height_;
+    srm_cfg.in.block_w = sensor_width_;
+    srm_cfg.in.block_h = sensor_height_;
+    srm_cfg.in.block_offset_x = 0;
+    srm_cfg.in.block_offset_y = 0;
+    srm_cfg.in.srm_cm = ppa_color_mode;
+
+    srm_cfg.out.buffer = (void*)rotate_dst;
+    srm_cfg.out.buffer_size = frame_.len;
+    srm_cfg.out.pic_w = frame_.width;
+    srm_cfg.out.pic_h = frame_.height;
+    srm_cfg.out.block_offset_x = 0;
+    srm_cfg.out.block_offset_y = 0;
+    srm_cfg.out.srm_cm = PPA_SRM_COLOR_MODE_RGB565;
+
+    // 等比例缩放 1.0
+    srm_cfg.scale_x = 1.0f;
+    srm_cfg.scale_y = 1.0f;
+    srm_cfg.rotation_angle = ppa_angle;
+    srm_cfg.byte_swap = ppa_byte_swap;
+    srm_cfg.mode = PPA_TRANS_MODE_BLOCKING;
+    srm_cfg.user_data = nullptr;
+
+    err = ppa_do_scale_rotate_mirror(ppa_client, &srm_cfg);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "ppa_do_scale_rotate_mirror failed: %d", (int)err);
+        HeapAccounting::Free(kHeapTagCamera, rotate_dst);
+        rotate_dst = nullptr;
+        (void)ppa_unregister_client(ppa_client);
         if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-            ESP_LOGE(TAG, "VIDIOC_QBUF failed");
+            ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
         }
+        return false;
     }
 
+    (void)ppa_unregister_client(ppa_client);
+
+    frame_.data = rotate_dst;
+    frame_.len = frame_.width * frame_.height * 2;
+    frame_capacity_ = frame_.len;
+    frame_.format = V4L2_PIX_FMT_RGB565;
+    HeapAccounting::Free(kHeapTagCamera, rotate_src);
+    rotate_src = nullptr;
+#endif  // CONFIG_SOC_PPA_SUPPORTED
+#endif  // CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
+
+    if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
+        ESP_LOGE(TAG, "VIDIOC_QBUF failed");
+    }
+    return !preview || ShowPreview();
+}
+
+bool Esp32Camera::ShowPreview() {
     // 显示预览图片
     auto display = dynamic_cast<LvglDisplay*>(Board::GetInstance().GetDisplay());
     if (display != nullptr) {
@@ -739,7 +1044,7 @@ bool Esp32Camera::Capture() {
             case V4L2_PIX_FMT_YUV420:
             case V4L2_PIX_FMT_RGB24: {
                 color_format = LV_COLOR_FORMAT_RGB565;
-                data = (uint8_t*)heap_caps_malloc(w * h * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+                data = (uint8_t*)HeapAccounting::Malloc(kHeapTagDisplay, w * h * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
                 if (data == nullptr) {
                     ESP_LOGE(TAG, "Failed to allocate memory for preview image");
                     return false;
@@ -755,7 +1060,7 @@ bool Esp32Camera::Capture() {
                 esp_imgfx_err_t err = esp_imgfx_color_convert_open(&convert_cfg, &convert_handle);
                 if (err != ESP_IMGFX_ERR_OK || convert_handle == nullptr) {
                     ESP_LOGE(TAG, "esp_imgfx_color_convert_open failed");
-                    heap_caps_free(data);
+                    HeapAccounting::Free(kHeapTagDisplay, data);
                     data = nullptr;
                     return false;
                 }
@@ -770,7 +1075,7 @@ bool Esp32Camera::Capture() {
                 err = esp_imgfx_color_convert_process(convert_handle, &convert_input_data, &convert_output_data);
                 if (err != ESP_IMGFX_ERR_OK) {
                     ESP_LOGE(TAG, "esp_imgfx_color_convert_process failed");
-                    heap_caps_free(data);
+                    HeapAccounting::Free(kHeapTagDisplay, data);
                     data = nullptr;
                     esp_imgfx_color_convert_close(convert_handle);
                     convert_handle = nullptr;
@@ -783,7 +1088,7 @@ bool Esp32Camera::Capture() {
             }
 
             case V4L2_PIX_FMT_RGB565:
-                data = (uint8_t*)heap_caps_malloc(w * h * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+                data = (uint8_t*)HeapAccounting::Malloc(kHeapTagDisplay, w * h * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
                 if (data == nullptr) {
                     ESP_LOGE(TAG, "Failed to allocate memory for preview image");
                     return false;
@@ -792,6 +1097,18 @@ bool Esp32Camera::Capture() {
                 lvgl_image_size = frame_.len;  // fallthrough 时兼顾 YUYV 与 RGB565
                 break;
 
+            case V4L2_PIX_FMT_RGB565X: {
+                // 直接使用 V4L2 缓冲区时，大端序在复制到预览时转换
+                data = (uint8_t*)HeapAccounting::Malloc(kHeapTagDisplay, w * h * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+                if (data == nullptr) {
+                    ESP_LOGE(TAG, "Failed to allocate memory for preview image");
+                    return false;
+                }
+                lvgl_image_size = std::min<size_t>(frame_.len, w * h * 2) & ~(size_t)1;
+                image_swap_bytes16(data, frame_.data, lvgl_image_size);
+                break;
+            }
+
             default:
                 ESP_LOGE(TAG, "unsupported frame format: 0x%08lx", frame_.format);
                 return false;
@@ -837,6 +1154,194 @@ bool Esp32Camera::SetVFlip(bool enabled) {
     return true;
 }
 
+#if CONFIG_XIAOZHI_CAMERA_SKIP_UNCHANGED
+#define THUMBNAIL_WIDTH 32
+#define THUMBNAIL_HEIGHT 24
+
+bool Esp32Camera::MakeThumbnail(std::vector<uint8_t>& thumbnail) const {
+    auto format = frame_.format;
+    if (format != V4L2_PIX_FMT_GREY && format != V4L2_PIX_FMT_YUV420 && format != V4L2_PIX_FMT_YUYV &&
+        format != V4L2_PIX_FMT_RGB565 && format != V4L2_PIX_FMT_RGB565X && format != V4L2_PIX_FMT_RGB24) {
+        return false;
+    }
+    int width = frame_.width;
+    int height = frame_.height;
+    if (width < THUMBNAIL_WIDTH * 2 || height < THUMBNAIL_HEIGHT * 2) {
+        return false;
+    }
+
+    auto luma = [this, format, width](int x, int y) -> int {
+        const uint8_t* p;
+        switch (format) {
+            case V4L2_PIX_FMT_GREY:
+            case V4L2_PIX_FMT_YUV420:  // The Y plane comes first
+                return frame_.data[y * width + x];
+            case V4L2_PIX_FMT_YUYV:
+                return frame_.data[(y * width + x) * 2];
+            case V4L2_PIX_FMT_RGB24:
+                p = frame_.data + (y * width + x) * 3;
+                return (p[0] * 77 + p[1] * 150 + p[2] * 29) >> 8;
+            default: {
+                p = frame_.data + (y * width + x) * 2;
+                int v = format == V4L2_PIX_FMT_RGB565 ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+                int r = (v >> 11) << 3, g = ((v >> 5) & 0x3F) << 2, b = (v & 0x1F) << 3;
+                return (r * 77 + g * 150 + b * 29) >> 8;
+            }
+        }
+    };
+
+    // Every cell averages four samples, enough against the sensor noise
+    int cell_width = width / THUMBNAIL_WIDTH;
+    int cell_height = height / THUMBNAIL_HEIGHT;
+    thumbnail.resize(THUMBNAIL_WIDTH * THUMBNAIL_HEIGHT);
+    for (int ty = 0; ty < THUMBNAIL_HEIGHT; ty++) {
+        int y0 = ty * cell_height + cell_height / 4;
+        int y1 = ty * cell_height + cell_height * 3 / 4;
+        for (int tx = 0; tx < THUMBNAIL_WIDTH; tx++) {
+            int x0 = tx * cell_width + cell_width / 4;
+            int x1 = tx * cell_width + cell_width * 3 / 4;
+            thumbnail[ty * THUMBNAIL_WIDTH + tx] = (luma(x0, y0) + luma(x1, y0) + luma(x0, y1) + luma(x1, y1)) / 4;
+        }
+    }
+    return true;
+}
+#endif  // CONFIG_XIAOZHI_CAMERA_SKIP_UNCHANGED
+
+bool Esp32Camera::ScaleForUpload(const ExplainOptions& options, FrameBuffer& scaled) {
+    size_t unit_bytes;      // A YUYV unit is two pixels sharing their U and V
+    int unit_pixels = 1;
+    switch (frame_.format) {
+        case V4L2_PIX_FMT_GREY:
+            unit_bytes = 1;
+            break;
+        case V4L2_PIX_FMT_RGB565:
+            unit_bytes = 2;
+            break;
+        case V4L2_PIX_FMT_RGB24:
+            unit_bytes = 3;
+            break;
+        case V4L2_PIX_FMT_YUYV:
+            unit_bytes = 4;
+            unit_pixels = 2;
+            break;
+        default:
+            ESP_LOGW(TAG, "Cannot scale format 0x%08lx, sending the photo as captured", (unsigned long)frame_.format);
+            return false;
+    }
+
+    // The region of interest, the sizes kept even for YUYV and the JPEG chroma subsampling
+    int width = frame_.width;
+    int height = frame_.height;
+    int roi_x = std::min<int>(options.roi_x, 99) * width / 100 & ~1;
+    int roi_y = std::min<int>(options.roi_y, 99) * height / 100 & ~1;
+    int roi_width = std::min(std::max(options.roi_width * width / 100, 2), width - roi_x) & ~1;
+    int roi_height = std::min(std::max(options.roi_height * height / 100, 2), height - roi_y) & ~1;
+
+    // Fits the region into the maximum size, never scaling up
+    float scale = 1.0f;
+    if (options.max_width > 0) {
+        scale = std::min(scale, (float)options.max_width / roi_width);
+    }
+    if (options.max_height > 0) {
+        scale = std::min(scale, (float)options.max_height / roi_height);
+    }
+#ifdef CONFIG_SOC_PPA_SUPPORTED
+    // The PPA scales in steps of 1/16
+    scale = std::max(1, (int)(scale * 16)) / 16.0f;
+#endif
+    int out_width = std::max(2, (int)(roi_width * scale) & ~1);
+    int out_height = std::max(2, (int)(roi_height * scale) & ~1);
+    if (out_width == width && out_height == height) {
+        return false;
+    }
+
+    size_t out_len = (size_t)out_width * out_height * unit_bytes / unit_pixels;
+    auto out = (uint8_t*)HeapAccounting::Malloc(kHeapTagCamera, out_len,
+        MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT | MALLOC_CAP_CACHE_ALIGNED);
+    if (out == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes for the scaled photo", (unsigned)out_len);
+        return false;
+    }
+
+#ifdef CONFIG_SOC_PPA_SUPPORTED
+    // The PPA crops and scales RGB in one pass, the other formats go to the software path
+    if (frame_.format == V4L2_PIX_FMT_RGB565 || frame_.format == V4L2_PIX_FMT_RGB24) {
+        ppa_srm_color_mode_t color_mode = frame_.format == V4L2_PIX_FMT_RGB565 ? PPA_SRM_COLOR_MODE_RGB565
+                                                                               : PPA_SRM_COLOR_MODE_RGB888;
+        ppa_client_handle_t ppa_client = nullptr;
+        ppa_client_config_t client_cfg = {
+            .oper_type = PPA_OPERATION_SRM,
+            .max_pending_trans_num = 1,
+        };
+        esp_err_t err = ppa_register_client(&client_cfg, &ppa_client);
+        if (err == ESP_OK) {
+            ppa_srm_oper_config_t srm_cfg = {};
+            srm_cfg.in.buffer = frame_.data;
+            srm_cfg.in.pic_w = width;
+            srm_cfg.in.pic_h = height;
+            srm_cfg.in.block_w = roi_width;
+            srm_cfg.in.block_h = roi_height;
+            srm_cfg.in.block_offset_x = roi_x;
+            srm_cfg.in.block_offset_y = roi_y;
+            srm_cfg.in.srm_cm = color_mode;
+            srm_cfg.out.buffer = out;
+            srm_cfg.out.buffer_size = out_len;
+            srm_cfg.out.pic_w = out_width;
+            srm_cfg.out.pic_h = out_height;
+            srm_cfg.out.srm_cm = color_mode;
+            srm_cfg.scale_x = scale;
+            srm_cfg.scale_y = scale;
+            srm_cfg.rotation_angle = PPA_SRM_ROTATION_ANGLE_0;
+            srm_cfg.mode = PPA_TRANS_MODE_BLOCKING;
+            err = ppa_do_scale_rotate_mirror(ppa_client, &srm_cfg);
+            (void)ppa_unregister_client(ppa_client);
+        }
+        if (err == ESP_OK) {
+            scaled = {out, out_len, (uint16_t)out_width, (uint16_t)out_height, frame_.format};
+            return true;
+        }
+        ESP_LOGW(TAG, "PPA scaling failed: %d, scaling in software", (int)err);
+    }
+#endif
+
+    // Nearest neighbour, the source unit of every output column is looked up once
+    int out_units = out_width / unit_pixels;
+    std::vector<uint32_t> columns(out_units);
+    for (int i = 0; i < out_units; i++) {
+        int x = roi_x + i * unit_pixels * roi_width / out_width;
+        columns[i] = x / unit_pixels * unit_bytes;
+    }
+    size_t row_bytes = (size_t)width * unit_bytes / unit_pixels;
+    uint8_t* dst = out;
+    for (int y = 0; y < out_height; y++) {
+        const uint8_t* src = frame_.data + (size_t)(roi_y + y * roi_height / out_height) * row_bytes;
+        switch (unit_bytes) {
+            case 1:
+                for (int i = 0; i < out_units; i++) {
+                    *dst++ = src[columns[i]];
+                }
+                break;
+            case 2:
+                for (int i = 0; i < out_units; i++, dst += 2) {
+                    *(uint16_t*)dst = *(const uint16_t*)(src + columns[i]);
+                }
+                break;
+            case 4:
+                for (int i = 0; i < out_units; i++, dst += 4) {
+                    *(uint32_t*)dst = *(const uint32_t*)(src + columns[i]);
+                }
+                break;
+            default:
+                for (int i = 0; i < out_units; i++, dst += unit_bytes) {
+                    memcpy(dst, src + columns[i], unit_bytes);
+                }
+                break;
+        }
+    }
+    scaled = {out, out_len, (uint16_t)out_width, (uint16_t)out_height, frame_.format};
+    return true;
+}
+
 /**
  * @brief 将摄像头捕获的图像发送到远程服务器进行AI分析和解释
  *
@@ -851,6 +1356,7 @@ bool Esp32Camera::SetVFlip(bool enabled) {
  * - 支持设备ID、客户端ID和认证令牌的HTTP头部配置
  *
  * @param question 要向AI提出的关于图像的问题，将作为表单字段发送
+ * @param options 上传前的裁剪、缩放和JPEG质量
  * @return std::string 服务器返回的JSON格式响应字符串
  *         成功时包含AI分析结果，失败时包含错误信息
  *         格式示例：{"success": true, "result": "分析结果"}
@@ -860,64 +1366,171 @@ bool Esp32Camera::SetVFlip(bool enabled) {
  * @note 函数会等待之前的编码线程完成后再开始新的处理
  * @warning 如果摄像头缓冲区为空或网络连接失败，将返回错误信息
  */
-std::string Esp32Camera::Explain(const std::string& question) {
+std::string Esp32Camera::Explain(const std::string& question, const ExplainOptions& options) {
     if (explain_url_.empty()) {
         throw std::runtime_error("Image explain URL or token is not set");
     }
+    std::lock_guard<std::mutex> capture_lock(capture_mutex_);
+    if (frame_.data == nullptr || frame_.len == 0) {
+        throw std::runtime_error("No photo captured");
+    }
+
+#if CONFIG_XIAOZHI_CAMERA_SKIP_UNCHANGED
+    std::vector<uint8_t> thumbnail;
+    if (MakeThumbnail(thumbnail)) {
+        bool same_request = question == last_question_ && options.max_width == last_options_.max_width &&
+            options.max_height == last_options_.max_height && options.roi_x == last_options_.roi_x &&
+            options.roi_y == last_options_.roi_y && options.roi_width == last_options_.roi_width &&
+            options.roi_height == last_options_.roi_height && options.quality == last_options_.quality;
+        if (same_request && last_thumbnail_.size() == thumbnail.size()) {
+            int diff = 0;
+            for (size_t i = 0; i < thumbnail.size(); i++) {
+                diff += std::abs(thumbnail[i] - last_thumbnail_[i]);
+            }
+            diff /= (int)thumbnail.size();
+            if (diff < CONFIG_XIAOZHI_CAMERA_CHANGE_THRESHOLD) {
+                ESP_LOGI(TAG, "Photo unchanged (difference %d), answering from the last explanation", diff);
+                ReleaseHeldFrame();
+                return last_result_;
+            }
+        }
+    }
+#endif
 
-    // 创建局部的 JPEG 队列, 40 entries is about to store 512 * 40 = 20480 bytes of JPEG data
-    QueueHandle_t jpeg_queue = xQueueCreate(40, sizeof(JpegChunk));
-    if (jpeg_queue == nullptr) {
+    // The JPEG goes to the upload through a pool of chunk buffers: the encoder fills a free one and
+    // queues it, the upload writes it and drops it, which puts it back in the pool
+    BufferPool chunks(kHeapTagCamera, JPEG_CHUNK_SIZE, JPEG_CHUNK_COUNT, kHeapPlacementPsram);
+    QueueHandle_t jpeg_queue = xQueueCreate(JPEG_CHUNK_COUNT + 1, sizeof(JpegChunk));
+    if (!chunks.ok() || jpeg_queue == nullptr) {
         ESP_LOGE(TAG, "Failed to create JPEG queue");
+        if (jpeg_queue != nullptr) {
+            vQueueDelete(jpeg_queue);
+        }
         throw std::runtime_error("Failed to create JPEG queue");
     }
-
-    // We spawn a thread to encode the image to JPEG using optimized encoder (cost about 500ms and 8KB SRAM)
-    encoder_thread_ = std::thread([this, jpeg_queue]() {
-        uint16_t w = frame_.width ? frame_.width : 320;
-        uint16_t h = frame_.height ? frame_.height : 240;
-        v4l2_pix_fmt_t enc_fmt = frame_.format;
-        image_to_jpeg_cb(
-            frame_.data, frame_.len, w, h, enc_fmt, 80,
+    JpegPipe pipe = {.chunks = &chunks, .jpeg_queue = jpeg_queue};
+
+    // We spawn a thread to encode the image to JPEG. The software encoder costs about 500ms and 8KB SRAM,
+    // with CONFIG_XIAOZHI_ENABLE_HARDWARE_JPEG_ENCODER the P4 JPEG codec does it in a few ms.
+    int64_t encode_start_us = esp_timer_get_time();
+    TaskPlacements::ThreadScope placement(kTaskCameraEncoder);
+    encoder_thread_ = std::thread([this, &pipe, options]() {
+        // A smaller photo costs less to encode and to upload, the vision model scales it down anyway
+        FrameBuffer scaled;
+        bool is_scaled = frame_.width > 0 && frame_.height > 0 && ScaleForUpload(options, scaled);
+        const FrameBuffer& photo = is_scaled ? scaled : frame_;
+        uint16_t w = photo.width ? photo.width : 320;
+        uint16_t h = photo.height ? photo.height : 240;
+        v4l2_pix_fmt_t enc_fmt = photo.format;
+        if (is_scaled) {
+            ESP_LOGI(TAG, "Photo scaled from %ux%u to %ux%u", frame_.width, frame_.height, w, h);
+        }
+        bool ok = image_to_jpeg_cb(
+            photo.data, photo.len, w, h, enc_fmt, std::clamp(options.quality, 1, 100),
             [](void* arg, size_t index, const void* data, size_t len) -> size_t {
-                auto jpeg_queue = (QueueHandle_t)arg;
-                JpegChunk chunk = {.data = (uint8_t*)heap_caps_aligned_alloc(16, len, MALLOC_CAP_SPIRAM), .len = len};
-                memcpy(chunk.data, data, len);
-                xQueueSend(jpeg_queue, &chunk, portMAX_DELAY);
+                auto pipe = (JpegPipe*)arg;
+                if (data == nullptr) {
+                    return 0;  // The end, sent below
+                }
+                // The encoder writes small pieces, they are gathered to whole chunks for the upload
+                for (size_t offset = 0; offset < len;) {
+                    if (!pipe->filling) {
+                        pipe->filling = pipe->chunks->Acquire();
+                    }
+                    size_t size = std::min<size_t>(len - offset, JPEG_CHUNK_SIZE - pipe->fill);
+                    memcpy(pipe->filling.data() + pipe->fill, (const uint8_t*)data + offset, size);
+                    pipe->fill += size;
+                    offset += size;
+                    if (pipe->fill == JPEG_CHUNK_SIZE) {
+                        pipe->Flush();
+                    }
+                }
                 return len;
             },
-            jpeg_queue);
+            &pipe);
+        if (!ok) {
+            ESP_LOGE(TAG, "Failed to encode the photo");
+        }
+        if (is_scaled) {
+            HeapAccounting::Free(kHeapTagCamera, scaled.data);
+        }
+        pipe.Flush();
+        pipe.filling.Reset();
+        pipe.encode_end_us = esp_timer_get_time();
+        JpegChunk end = {.handle = nullptr, .offset = 0, .size = 0};
+        xQueueSend(pipe.jpeg_queue, &end, portMAX_DELAY);
     });
 
+    // Gives the chunks back until the end, the encoder waits for free chunks
+    auto drain = [&pipe]() {
+        JpegChunk chunk;
+        while (xQueueReceive(pipe.jpeg_queue, &chunk, portMAX_DELAY) == pdPASS && chunk.handle != nullptr) {
+            BufferSlice::Adopt(chunk);
+        }
+    };
+    auto release_pipe = [&]() {
+        vQueueDelete(jpeg_queue);
+    };
+
     auto network = Board::GetInstance().GetNetwork();
-    auto http = network->CreateHttp(3);
     // 构造multipart/form-data请求体
     std::string boundary = "----ESP32_CAMERA_BOUNDARY";
 
     // 配置HTTP客户端，使用分块传输编码
-    http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
-    http->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
-    if (!explain_token_.empty()) {
-        http->SetHeader("Authorization", "Bearer " + explain_token_);
-    }
-    http->SetHeader("Content-Type", "multipart/form-data; boundary=" + boundary);
-    http->SetHeader("Transfer-Encoding", "chunked");
-    if (!http->Open("POST", explain_url_)) {
+    auto open_http = [&](Http* http) {
+        http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
+        http->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
+        if (!explain_token_.empty()) {
+            http->SetHeader("Authorization", "Bearer " + explain_token_);
+        }
+        http->SetHeader("Content-Type", "multipart/form-data; boundary=" + boundary);
+        http->SetHeader("Transfer-Encoding", "chunked");
+#if CONFIG_XIAOZHI_CAMERA_EXPLAIN_KEEP_ALIVE_SECONDS > 0
+        http->SetHeader("Connection", "keep-alive");
+#endif
+        return http->Open("POST", explain_url_);
+    };
+#if CONFIG_XIAOZHI_CAMERA_EXPLAIN_KEEP_ALIVE_SECONDS > 0
+    // The client of the last photo is reused while it is kept, a stale one is replaced once
+    std::unique_lock<std::mutex> http_lock(explain_http_mutex_);
+    esp_timer_stop(explain_idle_timer_);
+    bool reused = explain_http_ != nullptr;
+    if (!reused) {
+        explain_http_ = network->CreateHttp(3);
+    }
+    bool opened = open_http(explain_http_.get());
+    if (!opened && reused) {
+        ESP_LOGW(TAG, "The kept explain connection failed, reconnecting");
+        explain_http_ = network->CreateHttp(3);
+        opened = open_http(explain_http_.get());
+    }
+    Http* http = explain_http_.get();
+    // Dropped on the failures, the state of the connection is unknown
+    auto drop_http = [this]() {
+        explain_http_->Close();
+        explain_http_.reset();
+    };
+#else
+    auto owned_http = network->CreateHttp(3);
+    Http* http = owned_http.get();
+    bool opened = open_http(http);
+    auto drop_http = [http]() {
+        http->Close();
+    };
+#endif
+    if (!opened) {
         ESP_LOGE(TAG, "Failed to connect to explain URL");
+        drop_http();
         // Clear the queue
+        drain();
         encoder_thread_.join();
-        JpegChunk chunk;
-        while (xQueueReceive(jpeg_queue, &chunk, portMAX_DELAY) == pdPASS) {
-            if (chunk.data != nullptr) {
-                heap_caps_free(chunk.data);
-            } else {
-                break;
-            }
-        }
-        vQueueDelete(jpeg_queue);
+        ReleaseHeldFrame();
+        release_pipe();
         throw std::runtime_error("Failed to connect to explain URL");
     }
 
+    // The multipart parts go out in full chunks, the small ones do not cost a round trip each
+    HttpWriteBatcher body(http, JPEG_CHUNK_SIZE);
     {
         // 第一块：question字段
         std::string question_field;
@@ -925,7 +1538,7 @@ std::string Esp32Camera::Explain(const std::string& question) {
         question_field += "Content-Disposition: form-data; name=\"question\"\r\n";
         question_field += "\r\n";
         question_field += question + "\r\n";
-        http->Write(question_field.c_str(), question_field.size());
+        body.Write(question_field);
     }
     {
         // 第二块：文件字段头部
@@ -934,49 +1547,301 @@ std::string Esp32Camera::Explain(const std::string& question) {
         file_header += "Content-Disposition: form-data; name=\"file\"; filename=\"camera.jpg\"\r\n";
         file_header += "Content-Type: image/jpeg\r\n";
         file_header += "\r\n";
-        http->Write(file_header.c_str(), file_header.size());
+        body.Write(file_header);
     }
 
     // 第三块：JPEG数据
     size_t total_sent = 0;
+    int64_t first_chunk_us = 0;
     while (true) {
         JpegChunk chunk;
         if (xQueueReceive(jpeg_queue, &chunk, portMAX_DELAY) != pdPASS) {
             ESP_LOGE(TAG, "Failed to receive JPEG chunk");
             break;
         }
-        if (chunk.data == nullptr) {
+        if (chunk.handle == nullptr) {
             break;  // The last chunk
         }
-        http->Write((const char*)chunk.data, chunk.len);
-        total_sent += chunk.len;
-        heap_caps_free(chunk.data);
+        if (first_chunk_us == 0) {
+            first_chunk_us = esp_timer_get_time();
+        }
+        auto slice = BufferSlice::Adopt(chunk);
+        body.Write((const char*)slice.data(), slice.size());
+        total_sent += slice.size();
     }
-    // Wait for the encoder thread to finish
+    int64_t upload_end_us = esp_timer_get_time();
+    // Wait for the encoder thread to finish, it read the V4L2 buffer if one is held
     encoder_thread_.join();
+    size_t frame_len = frame_.len;
+    ReleaseHeldFrame();
     // 清理队列
-    vQueueDelete(jpeg_queue);
+    release_pipe();
+    // The overlap: the upload of the first chunks while the encoder still runs
+    ESP_LOGI(TAG, "JPEG encoded in %lld ms, first chunk uploaded from %lld ms, upload done %lld ms after the encoder",
+             (pipe.encode_end_us - encode_start_us) / 1000,
+             first_chunk_us > 0 ? (first_chunk_us - encode_start_us) / 1000 : -1,
+             (upload_end_us - pipe.encode_end_us) / 1000);
 
     {
         // 第四块：multipart尾部
         std::string multipart_footer;
         multipart_footer += "\r\n--" + boundary + "--\r\n";
-        http->Write(multipart_footer.c_str(), multipart_footer.size());
+        body.Write(multipart_footer);
     }
     // 结束块
-    http->Write("", 0);
+    body.Finish();
 
     if (http->GetStatusCode() != 200) {
         ESP_LOGE(TAG, "Failed to upload photo, status code: %d", http->GetStatusCode());
+        drop_http();
         throw std::runtime_error("Failed to upload photo");
     }
 
     std::string result = http->ReadAll();
+#if CONFIG_XIAOZHI_CAMERA_EXPLAIN_KEEP_ALIVE_SECONDS > 0
+    // A connection the server closed meanwhile fails the next Open() and is replaced
+    esp_timer_start_once(explain_idle_timer_, CONFIG_XIAOZHI_CAMERA_EXPLAIN_KEEP_ALIVE_SECONDS * 1000000ULL);
+    http_lock.unlock();
+#else
     http->Close();
+#endif
+
+#if CONFIG_XIAOZHI_CAMERA_SKIP_UNCHANGED
+    last_thumbnail_ = std::move(thumbnail);
+    last_question_ = question;
+    last_options_ = options;
+    last_result_ = result;
+#endif
 
     // Get remain task stack size
     size_t remain_stack_size = uxTaskGetStackHighWaterMark(nullptr);
     ESP_LOGI(TAG, "Explain image size=%d bytes, compressed size=%d, remain stack size=%d, question=%s\n%s",
-             (int)frame_.len, (int)total_sent, (int)remain_stack_size, question.c_str(), result.c_str());
+             (int)frame_len, (int)total_sent, (int)remain_stack_size, question.c_str(), result.c_str());
     return result;
 }
+
+bool Esp32Camera::StartStreaming(const StreamOptions& options) {
+    StopStreaming();
+    if (video_fd_ < 0) {
+        return false;
+    }
+    video_options_ = options;
+    video_options_.fps = std::clamp(options.fps, 1, 30);
+    video_options_.bitrate_kbps = std::max(options.bitrate_kbps, 8);
+    video_options_.quality = std::clamp(options.quality, 10, 100);
+    video_stop_ = false;
+    video_running_ = true;
+    if (TaskPlacements::Create(kTaskCameraVideo, [](void* arg) {
+            auto self = static_cast<Esp32Camera*>(arg);
+            self->VideoLoop();
+            self->video_running_ = false;
+            TaskPlacements::Delete(kTaskCameraVideo);
+        }, this) != pdPASS) {
+        video_running_ = false;
+        return false;
+    }
+    ESP_LOGI(TAG, "Streaming at %d fps, %d kbps, up to %ux%u", video_options_.fps, video_options_.bitrate_kbps,
+             video_options_.max_width, video_options_.max_height);
+    return true;
+}
+
+void Esp32Camera::StopStreaming() {
+    if (!video_running_) {
+        return;
+    }
+    video_stop_ = true;
+    while (video_running_) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    ESP_LOGI(TAG, "Streaming stopped");
+}
+
+void Esp32Camera::VideoLoop() {
+    auto& app = Application::GetInstance();
+    ExplainOptions scale_options;
+    scale_options.max_width = video_options_.max_width;
+    scale_options.max_height = video_options_.max_height;
+    int quality = video_options_.quality;
+    int64_t start_us = esp_timer_get_time();
+    int64_t next_us = start_us;
+    int64_t stats_us = start_us;
+    uint32_t sent = 0, dropped = 0;
+    size_t sent_bytes = 0;
+
+    while (!video_stop_) {
+        int64_t now_us = esp_timer_get_time();
+        if (now_us < next_us) {
+            vTaskDelay(pdMS_TO_TICKS(std::min<int64_t>((next_us - now_us) / 1000 + 1, 50)));
+            continue;
+        }
+        // The conversation goes first, the frames are four times rarer while it listens or speaks
+        int64_t interval_us = 1000000 / video_options_.fps;
+        auto state = app.GetDeviceState();
+        if (state == kDeviceStateListening || state == kDeviceStateSpeaking) {
+            interval_us *= 4;
+        }
+        next_us = now_us + interval_us;
+
+        video_frame_.clear();
+        {
+            std::lock_guard<std::mutex> lock(capture_mutex_);
+            if (!CaptureFrame(false)) {
+                dropped++;
+                continue;
+            }
+            FrameBuffer scaled;
+            bool is_scaled = ScaleForUpload(scale_options, scaled);
+            const FrameBuffer& frame = is_scaled ? scaled : frame_;
+            image_to_jpeg_cb(frame.data, frame.len, frame.width, frame.height, frame.format, quality,
+                [](void* arg, size_t index, const void* data, size_t len) -> size_t {
+                    auto jpeg = static_cast<std::vector<uint8_t>*>(arg);
+                    if (data != nullptr) {
+                        jpeg->insert(jpeg->end(), (const uint8_t*)data, (const uint8_t*)data + len);
+                    }
+                    return len;
+                },
+                &video_frame_);
+            if (is_scaled) {
+                HeapAccounting::Free(kHeapTagCamera, scaled.data);
+            }
+            ReleaseHeldFrame();
+        }
+        size_t size = video_frame_.size();
+        if (size == 0) {
+            dropped++;
+            continue;
+        }
+        if (app.SendVideoFrame(video_frame_, (now_us - start_us) / 1000)) {
+            sent++;
+            sent_bytes += size;
+        } else {
+            dropped++;
+        }
+
+        // Rate control: a frame over the budget of the bitrate delays the next one and lowers the
+        // quality, the quality comes back once the frames are well under it
+        size_t budget = (size_t)video_options_.bitrate_kbps * 125 * interval_us / 1000000;
+        if (size > budget) {
+            next_us = std::max(next_us, now_us + (int64_t)size * 8000 / video_options_.bitrate_kbps);
+            quality = std::max(10, quality - 10);
+        } else if (size < budget * 3 / 4 && quality < video_options_.quality) {
+            quality = std::min(video_options_.quality, quality + 5);
+        }
+
+        if (now_us - stats_us >= 10 * 1000000) {
+            ESP_LOGI(TAG, "Stream: %lu frames sent (%u KB), %lu dropped, quality %d", (unsigned long)sent,
+                     (unsigned)(sent_bytes / 1024), (unsigned long)dropped, quality);
+            stats_us = now_us;
+        }
+    }
+}
+
+#if CONFIG_XIAOZHI_CAMERA_FRAME_BENCHMARK
+#ifndef CONFIG_SOC_PPA_SUPPORTED
+#include "esp_imgfx_rotate.h"
+#endif
+
+void Esp32Camera::RunBenchmark() {
+    static const uint16_t kResolutions[][2] = {
+        {320, 240}, {640, 480}, {800, 600}, {1280, 720}, {1920, 1080},
+    };
+    const int kIterations = 5;
+
+    for (auto& resolution : kResolutions) {
+        uint16_t width = resolution[0];
+        uint16_t height = resolution[1];
+        size_t len = (size_t)width * height * 2;
+        auto src = (uint8_t*)heap_caps_aligned_alloc(64, len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        auto dst = (uint8_t*)heap_caps_aligned_alloc(64, len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (src == nullptr || dst == nullptr) {
+            ESP_LOGW(TAG, "%ux%u: skipped, out of PSRAM", width, height);
+            heap_caps_free(src);
+            heap_caps_free(dst);
+            continue;
+        }
+        for (size_t i = 0; i < len; i++) {
+            src[i] = (uint8_t)(i * 7);
+        }
+
+        int64_t start = esp_timer_get_time();
+        for (int n = 0; n < kIterations; n++) {
+            auto src16 = (const uint16_t*)src;
+            auto dst16 = (uint16_t*)dst;
+            for (size_t i = 0; i < len / 2; i++) {
+                dst16[i] = __builtin_bswap16(src16[i]);
+            }
+        }
+        int64_t loop_us = esp_timer_get_time() - start;
+
+        start = esp_timer_get_time();
+        for (int n = 0; n < kIterations; n++) {
+            image_swap_bytes16(dst, src, len);
+        }
+        int64_t swap_us = esp_timer_get_time() - start;
+
+        // The 90° rotation of Capture() with CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
+        int64_t rotate_us = -1;
+#ifdef CONFIG_SOC_PPA_SUPPORTED
+        ppa_client_handle_t ppa_client = nullptr;
+        ppa_client_config_t client_cfg = {
+            .oper_type = PPA_OPERATION_SRM,
+            .max_pending_trans_num = 1,
+        };
+        if (ppa_register_client(&client_cfg, &ppa_client) == ESP_OK) {
+            ppa_srm_oper_config_t srm_cfg = {};
+            srm_cfg.in.buffer = src;
+            srm_cfg.in.pic_w = width;
+            srm_cfg.in.pic_h = height;
+            srm_cfg.in.block_w = width;
+            srm_cfg.in.block_h = height;
+            srm_cfg.in.srm_cm = PPA_SRM_COLOR_MODE_RGB565;
+            srm_cfg.out.buffer = dst;
+            srm_cfg.out.buffer_size = len;
+            srm_cfg.out.pic_w = height;
+            srm_cfg.out.pic_h = width;
+            srm_cfg.out.srm_cm = PPA_SRM_COLOR_MODE_RGB565;
+            srm_cfg.scale_x = 1.0f;
+            srm_cfg.scale_y = 1.0f;
+            srm_cfg.rotation_angle = PPA_SRM_ROTATION_ANGLE_90;
+            srm_cfg.byte_swap = true;
+            srm_cfg.mode = PPA_TRANS_MODE_BLOCKING;
+            start = esp_timer_get_time();
+            bool ok = true;
+            for (int n = 0; n < kIterations && ok; n++) {
+                ok = ppa_do_scale_rotate_mirror(ppa_client, &srm_cfg) == ESP_OK;
+            }
+            if (ok) {
+                rotate_us = esp_timer_get_time() - start;
+            }
+            (void)ppa_unregister_client(ppa_client);
+        }
+#else
+        esp_imgfx_rotate_cfg_t rotate_cfg = {
+            .in_res = {.width = static_cast<int16_t>(width), .height = static_cast<int16_t>(height)},
+            .degree = 90,
+        };
+        rotate_cfg.in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB565_LE;
+        esp_imgfx_rotate_handle_t rotate_handle = nullptr;
+        if (esp_imgfx_rotate_open(&rotate_cfg, &rotate_handle) == ESP_IMGFX_ERR_OK) {
+            esp_imgfx_data_t in = {.data = src, .data_len = static_cast<uint32_t>(len)};
+            esp_imgfx_data_t out = {.data = dst, .data_len = static_cast<uint32_t>(len)};
+            start = esp_timer_get_time();
+            bool ok = true;
+            for (int n = 0; n < kIterations && ok; n++) {
+                ok = esp_imgfx_rotate_process(rotate_handle, &in, &out) == ESP_IMGFX_ERR_OK;
+            }
+            if (ok) {
+                rotate_us = esp_timer_get_time() - start;
+            }
+            esp_imgfx_rotate_close(rotate_handle);
+        }
+#endif
+
+        ESP_LOGI(TAG, "%ux%u RGB565: swap %.2f ms/frame (per-pixel loop %.2f), rotate 90 %.2f ms/frame",
+            width, height, swap_us / 1000.0f / kIterations, loop_us / 1000.0f / kIterations,
+            rotate_us < 0 ? -1.0f : rotate_us / 1000.0f / kIterations);
+        heap_caps_free(src);
+        heap_caps_free(dst);
+    }
+}
+#endif
@@ -6,18 +6,24 @@
 #include <thread>
 #include <memory>
 #include <vector>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
 
 #include "camera.h"
+#include "shared_buffer.h"
 #include "jpg/image_to_jpeg.h"
 #include "esp_video_init.h"
 
-struct JpegChunk {
-    uint8_t* data;
-    size_t len;
-};
+class Http;
+
+// A filled chunk of the photo on its way to the upload, the slice of a pooled SharedBuffer
+using JpegChunk = BufferSlice::Raw;
 
 class Esp32Camera : public Camera {
 private:
@@ -28,29 +34,94 @@ private:
         uint16_t height = 0;
         v4l2_pix_fmt_t format = 0;
     } frame_;
+    size_t frame_capacity_ = 0;     // Allocated at init for the largest V4L2 buffer, then reused
+    // The V4L2 buffer frame_ points to instead of a copy, -1 when frame_ is the copy
+    int held_index_ = -1;
+    uint8_t* frame_copy_ = nullptr;  // The reusable copy while a V4L2 buffer is held
     v4l2_pix_fmt_t sensor_format_ = 0;
 #ifdef CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
     uint16_t sensor_width_ = 0;
     uint16_t sensor_height_ = 0;
 #endif  // CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
     int video_fd_ = -1;
-    bool streaming_on_ = false;
+    // Set by the stream or the ISP warm-up task, read by Capture()
+    std::atomic<bool> streaming_on_ = false;
     struct MmapBuffer { void *start = nullptr; size_t length = 0; };
     std::vector<MmapBuffer> mmap_buffers_;
     std::string explain_url_;
     std::string explain_token_;
     std::thread encoder_thread_;
+#if CONFIG_XIAOZHI_CAMERA_EXPLAIN_KEEP_ALIVE_SECONDS > 0
+    // The explain client kept between the photos, closed by the timer when idle
+    std::mutex explain_http_mutex_;
+    std::unique_ptr<Http> explain_http_;
+    esp_timer_handle_t explain_idle_timer_ = nullptr;
+#endif
+
+#if CONFIG_XIAOZHI_CAMERA_CONTINUOUS_CAPTURE
+    // The stream task holds the latest dequeued buffer, Capture() takes it over
+    std::mutex latest_mutex_;
+    std::condition_variable latest_cv_;
+    int latest_index_ = -1;
+    uint32_t latest_bytesused_ = 0;
+    std::atomic<bool> stream_stop_ = false;
+    std::atomic<bool> stream_running_ = false;
+    // Given by the stream task when it ends, nullptr when the task was not started
+    SemaphoreHandle_t stream_done_ = nullptr;
+
+    void StreamLoop();
+#endif
+
+#if CONFIG_XIAOZHI_CAMERA_SKIP_UNCHANGED
+    // The last uploaded photo and its answer, to skip the unchanged ones
+    std::vector<uint8_t> last_thumbnail_;
+    std::string last_question_;
+    ExplainOptions last_options_;
+    std::string last_result_;
+
+    // A small luma image of frame_, false for the formats it cannot read
+    bool MakeThumbnail(std::vector<uint8_t>& thumbnail) const;
+#endif
+
+    // Held by Capture(), Explain() and every frame of the video stream
+    std::mutex capture_mutex_;
+    // The video stream, see StartStreaming()
+    StreamOptions video_options_;
+    std::atomic<bool> video_stop_ = false;
+    std::atomic<bool> video_running_ = false;
+    std::vector<uint8_t> video_frame_;  // The JPEG of the frame being sent, reused
+
+    void VideoLoop();
+    // Capture() without the lock, the stream frames are not previewed
+    bool CaptureFrame(bool preview);
+
+    // Dequeues the freshest frame, the caller queues it back
+    bool DequeueFreshFrame(struct v4l2_buffer& buf);
+    bool ReserveFrameBuffer(size_t size);
+    static v4l2_pix_fmt_t HeldFrameFormat(v4l2_pix_fmt_t sensor_format);
+    void ReleaseHeldFrame();
+    bool ShowPreview();
+    // Crops and scales frame_ down for the upload, false when frame_ goes as it is
+    bool ScaleForUpload(const ExplainOptions& options, FrameBuffer& scaled);
 
 public:
     Esp32Camera(const esp_video_init_config_t& config);
     ~Esp32Camera();
 
+#if CONFIG_XIAOZHI_CAMERA_FRAME_BENCHMARK
+    // Logs the ms per frame of the byte swap and the rotation at every benchmarked resolution
+    static void RunBenchmark();
+#endif
+
     virtual void SetExplainUrl(const std::string& url, const std::string& token);
     virtual bool Capture();
     // 翻转控制函数
     virtual bool SetHMirror(bool enabled) override;
     virtual bool SetVFlip(bool enabled) override;
-    virtual std::string Explain(const std::string& question);
+    virtual std::string Explain(const std::string& question, const ExplainOptions& options = {});
+    virtual bool StartStreaming(const StreamOptions& options) override;
+    virtual void StopStreaming() override;
+    virtual bool IsStreaming() override { return video_running_; }
 };
 
 #endif // ndef CONFIG_IDF_TARGET_ESP32
\ No newline at end of file
@@ -1,9 +1,82 @@
 #include "i2c_device.h"
+#include "task_placement.h"
 
 #include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <deque>
+#include <mutex>
 
 #define TAG "I2cDevice"
 
+namespace {
+
+struct PendingWrite {
+    i2c_master_dev_handle_t device;
+    uint8_t reg;
+    uint8_t value;
+};
+
+// The async writes of every I2cDevice, one task for all the buses
+class I2cAsyncWriter {
+public:
+    static I2cAsyncWriter& GetInstance() {
+        static I2cAsyncWriter instance;
+        return instance;
+    }
+
+    // Returns false when the queue is full, the caller writes itself
+    bool Post(i2c_master_dev_handle_t device, uint8_t reg, uint8_t value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (task_ == nullptr) {
+            TaskPlacements::Create(kTaskI2cAsync, [](void* arg) {
+                ((I2cAsyncWriter*)arg)->WriterTask();
+                vTaskDelete(NULL);
+            }, this, &task_);
+        }
+        if (!pending_.empty() && pending_.back().device == device && pending_.back().reg == reg) {
+            pending_.back().value = value;
+            return true;
+        }
+        if (pending_.size() >= I2C_ASYNC_QUEUE_SIZE) {
+            return false;
+        }
+        pending_.push_back({device, reg, value});
+        xTaskNotifyGive(task_);
+        return true;
+    }
+
+private:
+    std::mutex mutex_;
+    std::deque<PendingWrite> pending_;
+    TaskHandle_t task_ = nullptr;
+
+    void WriterTask() {
+        while (true) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            while (true) {
+                PendingWrite write;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (pending_.empty()) {
+                        break;
+                    }
+                    write = pending_.front();
+                    pending_.pop_front();
+                }
+                uint8_t buffer[2] = {write.reg, write.value};
+                esp_err_t ret = i2c_master_transmit(write.device, buffer, 2, 100);
+                if (ret != ESP_OK) {
+                    ESP_LOGE(TAG, "Async write of register 0x%02x failed: %s", write.reg, esp_err_to_name(ret));
+                }
+            }
+        }
+    }
+};
+
+} // namespace
+
 
 I2cDevice::I2cDevice(i2c_master_bus_handle_t i2c_bus, uint8_t addr) {
     i2c_device_config_t i2c_device_cfg = {
@@ -32,4 +105,33 @@ uint8_t I2cDevice::ReadReg(uint8_t reg) {
 
 void I2cDevice::ReadRegs(uint8_t reg, uint8_t* buffer, size_t length) {
     ESP_ERROR_CHECK(i2c_master_transmit_receive(i2c_device_, &reg, 1, buffer, length, 100));
-}
\ No newline at end of file
+}
+
+void I2cDevice::WriteRegs(uint8_t reg, const uint8_t* data, size_t length) {
+    i2c_master_transmit_multi_buffer_info_t buffers[2] = {
+        { .write_buffer = &reg, .buffer_size = 1 },
+        { .write_buffer = const_cast<uint8_t*>(data), .buffer_size = length },
+    };
+    ESP_ERROR_CHECK(i2c_master_multi_buffer_transmit(i2c_device_, buffers, 2, 100));
+}
+
+void I2cDevice::WriteRegs(std::initializer_list<I2cRegValue> values) {
+    for (auto& value : values) {
+        WriteReg(value.reg, value.value);
+    }
+}
+
+uint8_t I2cDevice::UpdateReg(uint8_t reg, uint8_t mask, uint8_t value) {
+    uint8_t current = ReadReg(reg);
+    uint8_t updated = (current & ~mask) | (value & mask);
+    if (updated != current) {
+        WriteReg(reg, updated);
+    }
+    return updated;
+}
+
+void I2cDevice::WriteRegAsync(uint8_t reg, uint8_t value) {
+    if (!I2cAsyncWriter::GetInstance().Post(i2c_device_, reg, value)) {
+        WriteReg(reg, value);
+    }
+}
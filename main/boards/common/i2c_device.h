@@ -3,6 +3,16 @@
 
 #include <driver/i2c_master.h>
 
+#include <initializer_list>
+
+// Writes waiting for the async I2C task, a write beyond it runs on the calling task
+#define I2C_ASYNC_QUEUE_SIZE 32
+
+struct I2cRegValue {
+    uint8_t reg;
+    uint8_t value;
+};
+
 class I2cDevice {
 public:
     I2cDevice(i2c_master_bus_handle_t i2c_bus, uint8_t addr);
@@ -13,6 +23,22 @@ protected:
     void WriteReg(uint8_t reg, uint8_t value);
     uint8_t ReadReg(uint8_t reg);
     void ReadRegs(uint8_t reg, uint8_t* buffer, size_t length);
+
+    // Consecutive registers in one transaction, the device must increment the address itself
+    void WriteRegs(uint8_t reg, const uint8_t* data, size_t length);
+    // An init sequence, register after register in the order given
+    void WriteRegs(std::initializer_list<I2cRegValue> values);
+    // Read-modify-write of the bits in mask, the write is skipped when they already match
+    uint8_t UpdateReg(uint8_t reg, uint8_t mask, uint8_t value);
+    void SetRegBits(uint8_t reg, uint8_t bits) { UpdateReg(reg, bits, bits); }
+    void ClearRegBits(uint8_t reg, uint8_t bits) { UpdateReg(reg, bits, 0); }
+
+    // Returns at once, a low priority task shared by every device writes the register. The
+    // writes keep their order, a write to the register the previous one targets replaces it,
+    // e.g. only the last step of a fade that got ahead of the bus is sent. For the writes
+    // coming from timers and the audio path, which must not wait for a busy bus. They are not
+    // ordered with the synchronous writes.
+    void WriteRegAsync(uint8_t reg, uint8_t value);
 };
 
 #endif // I2C_DEVICE_H
@@ -0,0 +1,105 @@
+#include "input_events.h"
+#include "application.h"
+#include "task_placement.h"
+
+#include <driver/gpio.h>
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "InputEvents"
+
+void InputEvents::Register(InputSource* source) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queue_ == nullptr) {
+        // Another driver (e.g. iot_button in power save mode) may have installed it already
+        esp_err_t ret = gpio_install_isr_service(0);
+        if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+            ESP_LOGE(TAG, "Failed to install the GPIO ISR service: %s", esp_err_to_name(ret));
+        }
+        queue_ = xQueueCreate(INPUT_QUEUE_SIZE, sizeof(Message));
+        TaskPlacements::Create(kTaskInput, [](void* arg) {
+            ((InputEvents*)arg)->InputTask();
+            vTaskDelete(NULL);
+        }, this, &task_);
+    }
+    sources_.push_back({source, 0});
+}
+
+void InputEvents::Unregister(InputSource* source) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sources_.erase(std::remove_if(sources_.begin(), sources_.end(), [source](const Slot& slot) {
+        return slot.source == source;
+    }), sources_.end());
+}
+
+void InputEvents::PostFromIsr(InputSource* source, uint32_t value) {
+    auto& instance = GetInstance();
+    Message message = {source, value};
+    BaseType_t woken = pdFALSE;
+    xQueueSendFromISR(instance.queue_, &message, &woken);
+    if (woken == pdTRUE) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+void InputEvents::Emit(InputSource* source, uint32_t event) {
+    batch_.push_back({source, event});
+}
+
+void InputEvents::Handle(const Message& message, int64_t now_us) {
+    for (auto& slot : sources_) {
+        if (slot.source == message.source) {
+            slot.deadline_us = slot.source->OnInput(&message.value, now_us);
+            return;
+        }
+    }
+}
+
+void InputEvents::Flush() {
+    if (batch_.empty()) {
+        return;
+    }
+    Application::GetInstance().Schedule([batch = std::move(batch_)]() {
+        for (auto& event : batch) {
+            event.source->Dispatch(event.event);
+        }
+    }, kSchedulePriorityHigh);
+    batch_.clear();
+}
+
+void InputEvents::InputTask() {
+    Message message;
+    TickType_t wait = portMAX_DELAY;
+    while (true) {
+        bool received = xQueueReceive(queue_, &message, wait) == pdTRUE;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        int64_t now = esp_timer_get_time();
+        if (received) {
+            Handle(message, now);
+            // Whatever else came in meanwhile goes into the same batch
+            while (xQueueReceive(queue_, &message, 0) == pdTRUE) {
+                Handle(message, now);
+            }
+        }
+
+        int64_t next_us = 0;
+        for (auto& slot : sources_) {
+            if (slot.deadline_us != 0 && slot.deadline_us <= now) {
+                slot.deadline_us = slot.source->OnInput(nullptr, now);
+            }
+            if (slot.deadline_us != 0 && (next_us == 0 || slot.deadline_us < next_us)) {
+                next_us = slot.deadline_us;
+            }
+        }
+        Flush();
+
+        if (next_us == 0) {
+            wait = portMAX_DELAY;
+        } else {
+            // Rounded up, waking before the deadline would only cost another turn
+            int64_t delay_us = std::max<int64_t>(next_us - esp_timer_get_time(), 0);
+            wait = (TickType_t)((delay_us + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000));
+        }
+    }
+}
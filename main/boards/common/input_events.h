@@ -0,0 +1,94 @@
+#ifndef INPUT_EVENTS_H_
+#define INPUT_EVENTS_H_
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+
+#include <mutex>
+#include <vector>
+#include <cstdint>
+
+// Time a button level must hold before it counts
+#define INPUT_DEBOUNCE_MS 20
+// Every source has at most one value in the queue, see InputEvents::PostFromIsr()
+#define INPUT_QUEUE_SIZE 16
+
+/*
+ * A button or knob driven by GPIO interrupts.
+ *
+ * The ISR does the least it can (masks the pin or decodes the knob) and posts one value to the
+ * input task. The input task runs the timing (debounce, long press, clicks) and emits events,
+ * which run on the main event loop through Dispatch().
+ */
+class InputSource {
+public:
+    virtual ~InputSource() = default;
+
+protected:
+    friend class InputEvents;
+
+    // Input task: value is what the ISR posted, or nullptr when the deadline returned by the
+    // previous call has passed. Returns the next deadline in esp_timer time, 0 for none.
+    virtual int64_t OnInput(const uint32_t* value, int64_t now_us) = 0;
+    // Main event loop: runs the callback of an event emitted with InputEvents::Emit()
+    virtual void Dispatch(uint32_t event) = 0;
+};
+
+/*
+ * The input task shared by every button and knob.
+ *
+ * It blocks on one queue that the GPIO interrupts feed, with a timeout only while a source waits
+ * for a deadline, so nothing wakes the CPU between two presses and automatic light sleep can
+ * engage. The events emitted while handling one wake-up (a press with its debounce, several knob
+ * steps) go to Application::Schedule() as one batch.
+ */
+class InputEvents {
+public:
+    static InputEvents& GetInstance() {
+        static InputEvents instance;
+        return instance;
+    }
+    InputEvents(const InputEvents&) = delete;
+    InputEvents& operator=(const InputEvents&) = delete;
+
+    // Installs the GPIO ISR service and starts the task with the first source
+    void Register(InputSource* source);
+    void Unregister(InputSource* source);
+
+    // ISR: a source must not post again before the task has handled its value, e.g. it keeps
+    // its interrupt masked or only posts when its pending count was 0, the queue never fills.
+    static void PostFromIsr(InputSource* source, uint32_t value);
+    // Input task: queues the event for the batch of this wake-up
+    void Emit(InputSource* source, uint32_t event);
+
+private:
+    InputEvents() = default;
+
+    struct Message {
+        InputSource* source;
+        uint32_t value;
+    };
+    struct Slot {
+        InputSource* source;
+        int64_t deadline_us;
+    };
+    struct Event {
+        InputSource* source;
+        uint32_t event;
+    };
+
+    std::mutex mutex_;
+    QueueHandle_t queue_ = nullptr;
+    TaskHandle_t task_ = nullptr;
+    std::vector<Slot> sources_;
+    // Only touched by the input task
+    std::vector<Event> batch_;
+
+    void InputTask();
+    void Handle(const Message& message, int64_t now_us);
+    void Flush();
+};
+
+#endif // INPUT_EVENTS_H_
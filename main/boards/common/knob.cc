@@ -1,30 +1,43 @@
 #include "knob.h"
 
+#include <cstdlib>
+
 static const char* TAG = "Knob";
 
-Knob::Knob(gpio_num_t pin_a, gpio_num_t pin_b) {
-    knob_config_t config = {
-        .default_direction = 0,
-        .gpio_encoder_a = static_cast<uint8_t>(pin_a),
-        .gpio_encoder_b = static_cast<uint8_t>(pin_b),
-    };
+// Both pins read high between the detents, the pull-ups hold them
+#define KNOB_REST_STATE 0x3
 
-    esp_err_t err = ESP_OK;
-    knob_handle_ = iot_knob_create(&config);
-    if (knob_handle_ == NULL) {
-        ESP_LOGE(TAG, "Failed to create knob instance");
-        return;
-    }
+// Indexed by (previous A B << 2) | (current A B), +1 when A changes first (clockwise).
+// 0 for no change and for the impossible jumps of a bouncing contact.
+static const int8_t kQuadrature[16] = {
+    0, -1, 1, 0,
+    1, 0, 0, -1,
+    -1, 0, 0, 1,
+    0, 1, -1, 0,
+};
 
-    err = iot_knob_register_cb(knob_handle_, KNOB_LEFT, knob_callback, this);
+Knob::Knob(gpio_num_t pin_a, gpio_num_t pin_b) : pin_a_(pin_a), pin_b_(pin_b) {
+    gpio_config_t config = {
+        .pin_bit_mask = (1ULL << pin_a) | (1ULL << pin_b),
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_ANYEDGE,
+    };
+    esp_err_t err = gpio_config(&config);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to register left callback: %s", esp_err_to_name(err));
+        ESP_LOGE(TAG, "Failed to configure the knob pins: %s", esp_err_to_name(err));
         return;
     }
+    state_ = (gpio_get_level(pin_a) << 1) | gpio_get_level(pin_b);
 
-    err = iot_knob_register_cb(knob_handle_, KNOB_RIGHT, knob_callback, this);
+    InputEvents::GetInstance().Register(this);
+    err = gpio_isr_handler_add(pin_a, IsrHandler, this);
+    if (err == ESP_OK) {
+        err = gpio_isr_handler_add(pin_b, IsrHandler, this);
+    }
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to register right callback: %s", esp_err_to_name(err));
+        ESP_LOGE(TAG, "Failed to add the knob interrupts: %s", esp_err_to_name(err));
         return;
     }
 
@@ -32,21 +45,50 @@ Knob::Knob(gpio_num_t pin_a, gpio_num_t pin_b) {
 }
 
 Knob::~Knob() {
-    if (knob_handle_ != NULL) {
-        iot_knob_delete(knob_handle_);
-        knob_handle_ = NULL;
-    }
+    gpio_isr_handler_remove(pin_a_);
+    gpio_isr_handler_remove(pin_b_);
+    InputEvents::GetInstance().Unregister(this);
 }
 
 void Knob::OnRotate(std::function<void(bool)> callback) {
     on_rotate_ = callback;
 }
 
-void Knob::knob_callback(void* arg, void* data) {
-    Knob* knob = static_cast<Knob*>(data);
-    knob_event_t event = iot_knob_get_event(arg);
-    
-    if (knob->on_rotate_) {
-        knob->on_rotate_(event == KNOB_RIGHT);
+void Knob::IsrHandler(void* arg) {
+    auto knob = static_cast<Knob*>(arg);
+    uint8_t state = (gpio_get_level(knob->pin_a_) << 1) | gpio_get_level(knob->pin_b_);
+    knob->position_ += kQuadrature[(knob->state_ << 2) | state];
+    knob->state_ = state;
+    if (state != KNOB_REST_STATE) {
+        return;
     }
-}
\ No newline at end of file
+
+    // A full cycle is 4 transitions, one of them may be lost to a bounce
+    int step = knob->position_ >= 2 ? 1 : knob->position_ <= -2 ? -1 : 0;
+    knob->position_ = 0;
+    if (step == 0) {
+        return;
+    }
+    knob->pending_steps_.fetch_add(step, std::memory_order_relaxed);
+    // Posts once until the input task takes the steps, the queue holds one value per source at most
+    if (!knob->posted_.exchange(true, std::memory_order_acq_rel)) {
+        InputEvents::PostFromIsr(knob, 0);
+    }
+}
+
+int64_t Knob::OnInput(const uint32_t* value, int64_t now_us) {
+    // Cleared first, a step added after it posts again
+    posted_.store(false, std::memory_order_release);
+    int steps = pending_steps_.exchange(0, std::memory_order_acq_rel);
+    auto& events = InputEvents::GetInstance();
+    for (int i = 0; i < std::abs(steps); i++) {
+        events.Emit(this, steps > 0 ? 1 : 0);
+    }
+    return 0;
+}
+
+void Knob::Dispatch(uint32_t event) {
+    if (on_rotate_) {
+        on_rotate_(event != 0);
+    }
+}
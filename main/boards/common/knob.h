@@ -3,23 +3,43 @@
 
 #include <driver/gpio.h>
 #include <functional>
+#include <atomic>
 #include <esp_log.h>
-#include <iot_knob.h>
 
-class Knob {
+#include "input_events.h"
+
+/*
+ * A quadrature encoder on two GPIOs, decoded at ISR time.
+ *
+ * Every edge of either pin runs the ISR, which follows the Gray code and ignores the transitions
+ * a bouncing contact makes, so no timer polls the pins. A detent is counted when the pins are
+ * back at rest. The steps add up until the input task takes them, the callback runs on the main
+ * event loop. Swap the pins to reverse the direction. Turning the knob does not wake the chip
+ * from light sleep.
+ */
+class Knob : public InputSource {
 public:
     Knob(gpio_num_t pin_a, gpio_num_t pin_b);
     ~Knob();
 
     void OnRotate(std::function<void(bool)> callback);
 
+protected:
+    int64_t OnInput(const uint32_t* value, int64_t now_us) override;
+    void Dispatch(uint32_t event) override;
+
 private:
-    static void knob_callback(void* arg, void* data);
+    static void IsrHandler(void* arg);
 
-    knob_handle_t knob_handle_;
     gpio_num_t pin_a_;
     gpio_num_t pin_b_;
+    // Only touched by the ISR
+    uint8_t state_ = 0;
+    int8_t position_ = 0;
+    // Detents not taken by the input task yet, clockwise is positive
+    std::atomic<int> pending_steps_ = 0;
+    std::atomic<bool> posted_ = false;
     std::function<void(bool)> on_rotate_;
 };
 
-#endif // KNOB_H_
\ No newline at end of file
+#endif // KNOB_H_
@@ -2,6 +2,7 @@
 
 #include "application.h"
 #include "display.h"
+#include "cpu_sampler.h"
 #include "assets/lang_config.h"
 
 #include <esp_log.h>
@@ -11,6 +12,9 @@
 
 static const char *TAG = "Ml307Board";
 
+// A CSQ change within a bucket leaves the cached board JSON as it is
+#define BOARD_JSON_CSQ_BUCKET 3
+
 Ml307Board::Ml307Board(gpio_num_t tx_pin, gpio_num_t rx_pin, gpio_num_t dtr_pin) : tx_pin_(tx_pin), rx_pin_(rx_pin), dtr_pin_(dtr_pin) {
 }
 
@@ -34,13 +38,18 @@ void Ml307Board::StartNetwork() {
     modem_->OnNetworkStateChanged([this, &application](bool network_ready) {
         if (network_ready) {
             ESP_LOGI(TAG, "Network is ready");
+            application.NotifyNetworkUp();
         } else {
             ESP_LOGE(TAG, "Network is down");
+            // A standby modem of DualNetworkBoard going down does not touch the conversation
+            if (Board::GetInstance().GetNetwork() != modem_.get()) {
+                return;
+            }
             auto device_state = application.GetDeviceState();
             if (device_state == kDeviceStateListening || device_state == kDeviceStateSpeaking) {
                 application.Schedule([this, &application]() {
                     application.SetDeviceState(kDeviceStateIdle);
-                });
+                }, kSchedulePriorityHigh);
             }
         }
     });
@@ -93,24 +102,36 @@ const char* Ml307Board::GetNetworkStateIcon() {
     return FONT_AWESOME_SIGNAL_OFF;
 }
 
-std::string Ml307Board::GetBoardJson() {
+void Ml307Board::WriteBoardJson(JsonWriter& writer) {
     // Set the board type for OTA
-    std::string board_json = std::string("{\"type\":\"" BOARD_TYPE "\",");
-    board_json += "\"name\":\"" BOARD_NAME "\",";
-    board_json += "\"revision\":\"" + modem_->GetModuleRevision() + "\",";
-    board_json += "\"carrier\":\"" + modem_->GetCarrierName() + "\",";
-    board_json += "\"csq\":\"" + std::to_string(modem_->GetCsq()) + "\",";
-    board_json += "\"imei\":\"" + modem_->GetImei() + "\",";
-    board_json += "\"iccid\":\"" + modem_->GetIccid() + "\",";
-    board_json += "\"cereg\":" + modem_->GetRegistrationState().ToString() + "}";
-    return board_json;
+    std::string revision = modem_->GetModuleRevision();
+    std::string carrier = modem_->GetCarrierName();
+    int csq = modem_->GetCsq();
+    std::string imei = modem_->GetImei();
+    std::string iccid = modem_->GetIccid();
+    std::string cereg = modem_->GetRegistrationState().ToString();
+
+    JsonCache::Key key;
+    key.Add(revision).Add(carrier).Add(csq / BOARD_JSON_CSQ_BUCKET).Add(imei).Add(iccid).Add(cereg);
+    board_json_.Write(writer, key, [&](JsonWriter& fragment) {
+        fragment.Object();
+        fragment.String("type", BOARD_TYPE);
+        fragment.String("name", BOARD_NAME);
+        fragment.String("revision", revision);
+        fragment.String("carrier", carrier);
+        fragment.String("csq", std::to_string(csq));
+        fragment.String("imei", imei);
+        fragment.String("iccid", iccid);
+        fragment.Raw("cereg", cereg);
+        fragment.EndObject();
+    });
 }
 
 void Ml307Board::SetPowerSaveMode(bool enabled) {
     // TODO: Implement power save mode for ML307
 }
 
-std::string Ml307Board::GetDeviceStatusJson() {
+void Ml307Board::WriteDeviceStatusJson(JsonWriter& writer) {
     /*
      * 返回设备状态JSON
      * 
@@ -130,68 +151,44 @@ std::string Ml307Board::GetDeviceStatusJson() {
      *     "network": {
      *         "type": "cellular",
      *         "carrier": "CHINA MOBILE",
-     *         "csq": 10
+     *         "csq": 10,
+     *         "link": {
+     *             "rtt_ms": 180,
+     *             "jitter_ms": 30,
+     *             ...
+     *         }
+     *     },
+     *     "cpu": {
+     *         "load": [35, 60],
+     *         "top": [{"name": "opus_encode", "cpu": 28}, ...]
      *     }
      * }
      */
-    auto& board = Board::GetInstance();
-    auto root = cJSON_CreateObject();
-
-    // Audio speaker
-    auto audio_speaker = cJSON_CreateObject();
-    auto audio_codec = board.GetAudioCodec();
-    if (audio_codec) {
-        cJSON_AddNumberToObject(audio_speaker, "volume", audio_codec->output_volume());
-    }
-    cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
-
-    // Screen brightness
-    auto backlight = board.GetBacklight();
-    auto screen = cJSON_CreateObject();
-    if (backlight) {
-        cJSON_AddNumberToObject(screen, "brightness", backlight->brightness());
-    }
-    auto display = board.GetDisplay();
-    if (display && display->height() > 64) { // For LCD display only
-        auto theme = display->GetTheme();
-        if (theme != nullptr) {
-            cJSON_AddStringToObject(screen, "theme", theme->name().c_str());
-        }
-    }
-    cJSON_AddItemToObject(root, "screen", screen);
-
-    // Battery
-    int battery_level = 0;
-    bool charging = false;
-    bool discharging = false;
-    if (board.GetBatteryLevel(battery_level, charging, discharging)) {
-        cJSON* battery = cJSON_CreateObject();
-        cJSON_AddNumberToObject(battery, "level", battery_level);
-        cJSON_AddBoolToObject(battery, "charging", charging);
-        cJSON_AddItemToObject(root, "battery", battery);
-    }
+    writer.Object();
+    WriteLocalStatusJson(writer);
 
     // Network
-    auto network = cJSON_CreateObject();
-    cJSON_AddStringToObject(network, "type", "cellular");
-    cJSON_AddStringToObject(network, "carrier", modem_->GetCarrierName().c_str());
+    writer.Object("network");
+    writer.String("type", "cellular");
+    writer.String("carrier", modem_->GetCarrierName());
     int csq = modem_->GetCsq();
     if (csq == -1) {
-        cJSON_AddStringToObject(network, "signal", "unknown");
+        writer.String("signal", "unknown");
     } else if (csq >= 0 && csq <= 14) {
-        cJSON_AddStringToObject(network, "signal", "very weak");
+        writer.String("signal", "very weak");
     } else if (csq >= 15 && csq <= 19) {
-        cJSON_AddStringToObject(network, "signal", "weak");
+        writer.String("signal", "weak");
     } else if (csq >= 20 && csq <= 24) {
-        cJSON_AddStringToObject(network, "signal", "medium");
+        writer.String("signal", "medium");
     } else if (csq >= 25 && csq <= 31) {
-        cJSON_AddStringToObject(network, "signal", "strong");
+        writer.String("signal", "strong");
     }
-    cJSON_AddItemToObject(root, "network", network);
-
-    auto json_str = cJSON_PrintUnformatted(root);
-    std::string json(json_str);
-    cJSON_free(json_str);
-    cJSON_Delete(root);
-    return json;
+    // Link quality of the current or the last conversation, it changes with every call
+    writer.Json("link", LinkMetricsToJson(Application::GetInstance().GetLinkMetrics()));
+    writer.Json("reconnect", ReconnectMetricsToJson(Application::GetInstance().GetReconnectMetrics()));
+    writer.EndObject();
+
+    // CPU load per core and the busiest tasks over the last minute
+    writer.Json("cpu", CpuSampler::GetInstance().GetSummaryJson());
+    writer.EndObject();
 }
@@ -12,8 +12,8 @@ protected:
     gpio_num_t tx_pin_;
     gpio_num_t rx_pin_;
     gpio_num_t dtr_pin_;
-
-    virtual std::string GetBoardJson() override;
+    // Rebuilt when the carrier, the registration or the CSQ bucket changes
+    JsonCache board_json_;
 
 public:
     Ml307Board(gpio_num_t tx_pin, gpio_num_t rx_pin, gpio_num_t dtr_pin = GPIO_NUM_NC);
@@ -23,7 +23,9 @@ public:
     virtual const char* GetNetworkStateIcon() override;
     virtual void SetPowerSaveMode(bool enabled) override;
     virtual AudioCodec* GetAudioCodec() override { return nullptr; }
-    virtual std::string GetDeviceStatusJson() override;
+    virtual void WriteBoardJson(JsonWriter& writer) override;
+    virtual void WriteDeviceStatusJson(JsonWriter& writer) override;
+    bool IsNetworkReady() { return modem_ != nullptr && modem_->network_ready(); }
 };
 
 #endif // ML307_BOARD_H
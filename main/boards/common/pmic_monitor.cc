@@ -0,0 +1,79 @@
+#include "pmic_monitor.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "PmicMonitor"
+
+PmicMonitor::~PmicMonitor() {
+    if (irq_gpio_ != GPIO_NUM_NC) {
+        gpio_intr_disable(irq_gpio_);
+        gpio_isr_handler_remove(irq_gpio_);
+        InputEvents::GetInstance().Unregister(this);
+    }
+}
+
+void PmicMonitor::EnableInterrupt(gpio_num_t gpio) {
+    if (gpio == GPIO_NUM_NC || irq_gpio_ != GPIO_NUM_NC) {
+        return;
+    }
+    gpio_config_t config = {
+        .pin_bit_mask = 1ULL << gpio,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_ENABLE,   // Open drain on the PMIC side
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_DISABLE,
+    };
+    ESP_ERROR_CHECK(gpio_config(&config));
+
+    EnableStatusInterrupts();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        AcknowledgeInterrupts();
+        Refresh(esp_timer_get_time());
+    }
+    irq_gpio_ = gpio;
+
+    // Installs the GPIO ISR service
+    InputEvents::GetInstance().Register(this);
+    ESP_ERROR_CHECK(gpio_isr_handler_add(gpio, IsrHandler, this));
+    gpio_set_intr_type(gpio, GPIO_INTR_LOW_LEVEL);
+    gpio_intr_enable(gpio);
+    ESP_LOGI(TAG, "Status on the interrupt of GPIO %d", gpio);
+}
+
+void PmicMonitor::IsrHandler(void* arg) {
+    auto monitor = static_cast<PmicMonitor*>(arg);
+    // A level interrupt, it stays masked until the input task has acknowledged it
+    gpio_intr_disable(monitor->irq_gpio_);
+    InputEvents::PostFromIsr(monitor, 0);
+}
+
+int64_t PmicMonitor::OnInput(const uint32_t* value, int64_t now_us) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        AcknowledgeInterrupts();
+        Refresh(now_us);
+    }
+    if (value != nullptr && gpio_get_level(irq_gpio_) == 0) {
+        // Still held low, by a source that is not acknowledged this way: do not spin on it
+        return now_us + PMIC_IRQ_RETRY_MS * 1000;
+    }
+    gpio_intr_enable(irq_gpio_);
+    return 0;
+}
+
+PmicStatus PmicMonitor::GetStatus() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    int64_t max_age_us = (irq_gpio_ != GPIO_NUM_NC ? PMIC_SAFETY_POLL_MS : PMIC_POLL_MS) * 1000LL;
+    if (updated_us_ == 0 || now - updated_us_ >= max_age_us) {
+        Refresh(now);
+    }
+    return status_;
+}
+
+void PmicMonitor::Refresh(int64_t now_us) {
+    ReadStatus(status_);
+    updated_us_ = now_us;
+}
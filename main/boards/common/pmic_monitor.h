@@ -0,0 +1,64 @@
+#ifndef PMIC_MONITOR_H_
+#define PMIC_MONITOR_H_
+
+#include <driver/gpio.h>
+
+#include <mutex>
+#include <cstdint>
+
+#include "input_events.h"
+
+// Without the IRQ line, the readers get the status read at most this long ago
+#define PMIC_POLL_MS 1000
+// With it, the registers that raise no interrupt (fuel gauge, temperature) and a missed edge
+#define PMIC_SAFETY_POLL_MS 30000
+// The IRQ line stayed low after the acknowledgement, the next try
+#define PMIC_IRQ_RETRY_MS 100
+
+struct PmicStatus {
+    bool charging = false;
+    bool discharging = false;
+    bool charging_done = false;
+    bool power_good = false;
+    int battery_level = 0;
+    float temperature = 0.0f;
+};
+
+/*
+ * The charger and battery status of a PMIC, cached so the readers do not go to the I2C bus.
+ *
+ * The status bar asks every second and the device status JSON at every report, each getter was
+ * a transaction on the bus the audio codec shares. With EnableInterrupt() the IRQ line of the
+ * PMIC is a level interrupt handled by the input task (InputEvents): it reads the status and
+ * acknowledges the interrupt there, the readers only copy the cache, until it is older than
+ * PMIC_SAFETY_POLL_MS. Without the IRQ line the first reader after PMIC_POLL_MS reads the whole
+ * status in one go.
+ */
+class PmicMonitor : public InputSource {
+public:
+    virtual ~PmicMonitor();
+
+    // The GPIO of the active low IRQ output of the PMIC
+    void EnableInterrupt(gpio_num_t gpio);
+    PmicStatus GetStatus();
+
+protected:
+    // Reads the registers into status, any task
+    virtual void ReadStatus(PmicStatus& status) = 0;
+    // Raises the IRQ line on the status changes, and clears what it latched
+    virtual void EnableStatusInterrupts() {}
+    virtual void AcknowledgeInterrupts() {}
+
+private:
+    std::mutex mutex_;
+    PmicStatus status_;
+    int64_t updated_us_ = 0;    // 0 until the first read
+    gpio_num_t irq_gpio_ = GPIO_NUM_NC;
+
+    void Refresh(int64_t now_us);
+    static void IsrHandler(void* arg);
+    int64_t OnInput(const uint32_t* value, int64_t now_us) override;
+    void Dispatch(uint32_t event) override {}
+};
+
+#endif // PMIC_MONITOR_H_
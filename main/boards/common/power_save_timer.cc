@@ -1,7 +1,9 @@
 #include "power_save_timer.h"
 #include "application.h"
 #include "settings.h"
+#include "network_power_policy.h"
 
+#include <sdkconfig.h>
 #include <esp_log.h>
 
 #define TAG "PowerSaveTimer"
@@ -71,6 +73,7 @@ void PowerSaveTimer::PowerSaveCheck() {
         if (!in_sleep_mode_) {
             ESP_LOGI(TAG, "Enabling power save mode");
             in_sleep_mode_ = true;
+            NetworkPowerPolicy::GetInstance().SetDeviceSleeping(true);
             if (on_enter_sleep_mode_) {
                 on_enter_sleep_mode_();
             }
@@ -89,12 +92,15 @@ void PowerSaveTimer::PowerSaveCheck() {
                     codec->EnableInput(false);
                 }
 
+#if !CONFIG_USE_STATE_POWER_POLICY
+                // With the power policy esp_pm is already configured, it goes by the device state
                 esp_pm_config_t pm_config = {
                     .max_freq_mhz = cpu_max_freq_,
                     .min_freq_mhz = 40,
                     .light_sleep_enable = true,
                 };
                 esp_pm_configure(&pm_config);
+#endif
             }
         }
     }
@@ -108,14 +114,17 @@ void PowerSaveTimer::WakeUp() {
     if (in_sleep_mode_) {
         ESP_LOGI(TAG, "Exiting power save mode");
         in_sleep_mode_ = false;
+        NetworkPowerPolicy::GetInstance().SetDeviceSleeping(false);
 
         if (cpu_max_freq_ != -1) {
+#if !CONFIG_USE_STATE_POWER_POLICY
             esp_pm_config_t pm_config = {
                 .max_freq_mhz = cpu_max_freq_,
                 .min_freq_mhz = cpu_max_freq_,
                 .light_sleep_enable = false,
             };
             esp_pm_configure(&pm_config);
+#endif
 
             // Enable wake word detection
             auto& app = Application::GetInstance();
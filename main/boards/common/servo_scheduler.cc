@@ -0,0 +1,156 @@
+#include "servo_scheduler.h"
+#include "task_placement.h"
+
+#include <esp_log.h>
+
+#define TAG "ServoScheduler"
+
+#define SERVO_IDLE_EVENT (1 << 0)
+
+ServoScheduler::ServoScheduler(int servo_count, Writer writer)
+    : servo_count_(servo_count), writer_(std::move(writer)), last_(servo_count, 90) {
+    queue_ = xQueueCreate(SERVO_QUEUE_DEPTH, sizeof(ServoMotion*));
+    event_group_ = xEventGroupCreate();
+    xEventGroupSetBits(event_group_, SERVO_IDLE_EVENT);
+
+    TaskPlacements::Create(kTaskServo, [](void* arg) {
+        ((ServoScheduler*)arg)->SchedulerTask();
+        vTaskDelete(NULL);
+    }, this, &task_);
+
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            xTaskNotifyGive(((ServoScheduler*)arg)->task_);
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "servo_frame",
+        .skip_unhandled_events = false
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &frame_timer_));
+}
+
+ServoScheduler::~ServoScheduler() {
+    esp_timer_stop(frame_timer_);
+    esp_timer_delete(frame_timer_);
+    TaskPlacements::Delete(kTaskServo, task_);
+
+    ServoMotion* motion;
+    while (xQueueReceive(queue_, &motion, 0) == pdTRUE) {
+        delete motion;
+    }
+    delete current_;
+    vQueueDelete(queue_);
+    vEventGroupDelete(event_group_);
+}
+
+void ServoScheduler::Enqueue(ServoMotion&& motion) {
+    if (motion.frames <= 0) {
+        return;
+    }
+    if (!motion.keyframes.empty() && motion.keyframes.size() != (size_t)motion.frames * servo_count_) {
+        ESP_LOGE(TAG, "Motion of %d frames has %u keyframe values", motion.frames, (unsigned)motion.keyframes.size());
+        return;
+    }
+
+    auto* queued = new ServoMotion(std::move(motion));
+    xQueueSend(queue_, &queued, portMAX_DELAY);
+
+    // The task stops the timer under the same lock once the queue is empty
+    std::lock_guard<std::mutex> lock(mutex_);
+    xEventGroupClearBits(event_group_, SERVO_IDLE_EVENT);
+    if (!running_) {
+        running_ = true;
+        esp_timer_start_periodic(frame_timer_, SERVO_FRAME_MS * 1000);
+    }
+}
+
+void ServoScheduler::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ServoMotion* motion;
+    while (xQueueReceive(queue_, &motion, 0) == pdTRUE) {
+        delete motion;
+    }
+    if (running_) {
+        clear_ = true;
+    }
+}
+
+bool ServoScheduler::IsBusy() {
+    return (xEventGroupGetBits(event_group_) & SERVO_IDLE_EVENT) == 0;
+}
+
+bool ServoScheduler::WaitIdle(TickType_t timeout) {
+    auto bits = xEventGroupWaitBits(event_group_, SERVO_IDLE_EVENT, pdFALSE, pdTRUE, timeout);
+    return (bits & SERVO_IDLE_EVENT) != 0;
+}
+
+void ServoScheduler::SchedulerTask() {
+    while (true) {
+        // A frame the task was too late for is played right away, the motion keeps its duration
+        uint32_t frames = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (frames-- > 0) {
+            PlayFrame();
+        }
+    }
+}
+
+bool ServoScheduler::WriteFrame(const int16_t* positions, uint32_t mask) {
+    bool reached = true;
+    for (int i = 0; i < servo_count_; i++) {
+        if (mask & (1u << i)) {
+            reached = writer_(i, positions[i]) && reached;
+        }
+    }
+    return reached;
+}
+
+void ServoScheduler::PlayFrame() {
+    if (clear_) {
+        delete current_;
+        current_ = nullptr;
+        settle_frames_ = 0;
+        clear_ = false;
+    }
+
+    if (current_ == nullptr && xQueueReceive(queue_, &current_, 0) == pdTRUE) {
+        frame_ = 0;
+        settle_frames_ = 0;
+    }
+
+    if (current_ != nullptr) {
+        if (!current_->keyframes.empty()) {
+            const int16_t* positions = &current_->keyframes[frame_ * servo_count_];
+            WriteFrame(positions, current_->mask);
+            for (int i = 0; i < servo_count_; i++) {
+                if (current_->mask & (1u << i)) {
+                    last_[i] = positions[i];
+                }
+            }
+            last_mask_ |= current_->mask;
+        }
+        if (++frame_ >= current_->frames) {
+            delete current_;
+            current_ = nullptr;
+            settle_frames_ = SERVO_SETTLE_FRAMES;
+        }
+        return;
+    }
+
+    // Nothing left to play, the rate limited servos catch up with the last keyframe first
+    if (settle_frames_ > 0) {
+        settle_frames_--;
+        if (!WriteFrame(last_.data(), last_mask_) && settle_frames_ > 0) {
+            return;
+        }
+        settle_frames_ = 0;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (uxQueueMessagesWaiting(queue_) == 0) {
+        esp_timer_stop(frame_timer_);
+        running_ = false;
+        clear_ = false;
+        xEventGroupSetBits(event_group_, SERVO_IDLE_EVENT);
+    }
+}
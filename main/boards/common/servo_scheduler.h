@@ -0,0 +1,86 @@
+#ifndef SERVO_SCHEDULER_H_
+#define SERVO_SCHEDULER_H_
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/event_groups.h>
+#include <esp_timer.h>
+
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+
+// One keyframe per frame, a servo refreshes its pulse every 20 ms anyway
+#define SERVO_FRAME_MS 10
+// Motions queued ahead of the one playing, the producer blocks when it is full
+#define SERVO_QUEUE_DEPTH 4
+// Frames the last keyframe is repeated for while a rate limited servo has not reached it
+#define SERVO_SETTLE_FRAMES 10
+
+/*
+ * A motion of all the servos, rendered into keyframes before it is queued.
+ *
+ * keyframes holds frames * servo_count positions (degrees), frame after frame. A servo that is
+ * not in mask keeps whatever it does. A motion without keyframes holds every servo still for
+ * its frames, it is the pause between two moves.
+ */
+struct ServoMotion {
+    int frames = 0;
+    uint32_t mask = 0;
+    std::vector<int16_t> keyframes;
+};
+
+/*
+ * Plays the motions of a robot board with a fixed frame rate.
+ *
+ * A periodic esp_timer wakes a high priority task every SERVO_FRAME_MS, which writes one
+ * precomputed keyframe per frame through the writer, so the timing of a move no longer depends
+ * on how long the task computing it is preempted. The timer only runs while there is something
+ * to play. Enqueue() returns as soon as the motion is queued, the caller renders the next one
+ * meanwhile.
+ */
+class ServoScheduler {
+public:
+    // Sets one servo, returns whether it is at the position (false while its limiter lags)
+    using Writer = std::function<bool(int servo, int position)>;
+
+    ServoScheduler(int servo_count, Writer writer);
+    ~ServoScheduler();
+    ServoScheduler(const ServoScheduler&) = delete;
+    ServoScheduler& operator=(const ServoScheduler&) = delete;
+
+    // Blocks only while SERVO_QUEUE_DEPTH motions are waiting
+    void Enqueue(ServoMotion&& motion);
+    // Drops the queued motions and stops the one playing after its current frame
+    void Clear();
+    bool IsBusy();
+    // Returns false on timeout
+    bool WaitIdle(TickType_t timeout = portMAX_DELAY);
+
+    static int Frames(int duration_ms) { return duration_ms <= 0 ? 0 : (duration_ms + SERVO_FRAME_MS - 1) / SERVO_FRAME_MS; }
+
+private:
+    int servo_count_;
+    Writer writer_;
+    QueueHandle_t queue_ = nullptr;
+    EventGroupHandle_t event_group_ = nullptr;
+    esp_timer_handle_t frame_timer_ = nullptr;
+    TaskHandle_t task_ = nullptr;
+    std::mutex mutex_;
+    bool running_ = false;
+    volatile bool clear_ = false;
+
+    // Only touched by the task
+    ServoMotion* current_ = nullptr;
+    int frame_ = 0;
+    int settle_frames_ = 0;
+    std::vector<int16_t> last_;
+    uint32_t last_mask_ = 0;
+
+    void SchedulerTask();
+    void PlayFrame();
+    bool WriteFrame(const int16_t* positions, uint32_t mask);
+};
+
+#endif // SERVO_SCHEDULER_H_
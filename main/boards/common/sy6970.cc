@@ -9,20 +9,18 @@
 Sy6970::Sy6970(i2c_master_bus_handle_t i2c_bus, uint8_t addr) : I2cDevice(i2c_bus, addr) {
 }
 
-int Sy6970::GetChangingStatus() {
-    return (ReadReg(0x0B) >> 3) & 0x03;
+void Sy6970::ReadStatus(PmicStatus& status) {
+    uint8_t value = ReadReg(0x0B);
+    int charging_status = (value >> 3) & 0x03;
+    status.charging = charging_status != 0;
+    status.charging_done = charging_status == 3;
+    status.power_good = (value & 0x04) != 0;
+    status.battery_level = BatteryLevelFromVoltage(GetBatteryVoltage(), GetChargeTargetVoltage());
 }
 
-bool Sy6970::IsCharging() {
-    return GetChangingStatus() != 0;
-}
-
-bool Sy6970::IsPowerGood() {
-    return (ReadReg(0x0B) & 0x04) != 0;
-}
-
-bool Sy6970::IsChargingDone() {
-    return GetChangingStatus() == 3;
+void Sy6970::AcknowledgeInterrupts() {
+    // The fault register latches until it is read, the INT pulse needs nothing else
+    ReadReg(0x0C);
 }
 
 int Sy6970::GetBatteryVoltage() {
@@ -43,12 +41,10 @@ int Sy6970::GetChargeTargetVoltage() {
     return value * 16 + 3840;
 }
 
-int Sy6970::GetBatteryLevel() {
+int Sy6970::BatteryLevelFromVoltage(int battery_voltage, int charge_voltage_limit) {
     int level = 0;
     // 电池所能掉电的最低电压
     int battery_minimum_voltage = 3200;
-    int battery_voltage = GetBatteryVoltage();
-    int charge_voltage_limit = GetChargeTargetVoltage();
     // ESP_LOGI(TAG, "battery_voltage: %d, charge_voltage_limit: %d", battery_voltage, charge_voltage_limit);
     if (battery_voltage > battery_minimum_voltage && charge_voltage_limit > battery_minimum_voltage) {
         level = (((float) battery_voltage - (float) battery_minimum_voltage) / ((float) charge_voltage_limit - (float) battery_minimum_voltage)) * 100.0;
@@ -2,20 +2,27 @@
 #define __SY6970_H__
 
 #include "i2c_device.h"
+#include "pmic_monitor.h"
 
-class Sy6970 : public I2cDevice {
+// The status getters read the cache of PmicMonitor, see EnableInterrupt(). The INT pulse comes
+// with the charge status and the faults, the battery voltage is only read by the safety poll then
+class Sy6970 : public I2cDevice, public PmicMonitor {
 public:
     Sy6970(i2c_master_bus_handle_t i2c_bus, uint8_t addr);
-    bool IsCharging();
-    bool IsPowerGood();
-    bool IsChargingDone();
-    int GetBatteryLevel();
+    bool IsCharging() { return GetStatus().charging; }
+    bool IsPowerGood() { return GetStatus().power_good; }
+    bool IsChargingDone() { return GetStatus().charging_done; }
+    int GetBatteryLevel() { return GetStatus().battery_level; }
     void PowerOff();
 
+protected:
+    virtual void ReadStatus(PmicStatus& status) override;
+    virtual void AcknowledgeInterrupts() override;
+
 private:
-    int GetChangingStatus();
     int GetBatteryVoltage();
     int GetChargeTargetVoltage();
+    static int BatteryLevelFromVoltage(int battery_voltage, int charge_voltage_limit);
 };
 
-#endif
\ No newline at end of file
+#endif
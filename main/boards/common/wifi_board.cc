@@ -3,6 +3,8 @@
 #include "display.h"
 #include "application.h"
 #include "system_info.h"
+#include "cpu_sampler.h"
+#include "power_policy.h"
 #include "settings.h"
 #include "assets/lang_config.h"
 
@@ -10,6 +12,11 @@
 #include <freertos/task.h>
 #include <esp_network.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+
+#include <array>
+#include <algorithm>
 
 #include <font_awesome.h>
 #include <wifi_station.h>
@@ -19,6 +26,9 @@
 
 static const char *TAG = "WifiBoard";
 
+// An RSSI change within a bucket leaves the cached board JSON as it is
+#define BOARD_JSON_RSSI_BUCKET_DB 5
+
 WifiBoard::WifiBoard() {
     Settings settings("wifi", true);
     wifi_config_mode_ = settings.GetInt("force_ap") == 1;
@@ -87,6 +97,22 @@ void WifiBoard::StartNetwork() {
         return;
     }
 
+    StartStation();
+
+    // Try to connect to WiFi, if failed, launch the WiFi configuration AP
+    auto& wifi_station = WifiStation::GetInstance();
+    if (!wifi_station.WaitForConnected(60 * 1000)) {
+        wifi_station.Stop();
+        wifi_config_mode_ = true;
+        EnterWifiConfigMode();
+        return;
+    }
+}
+
+bool WifiBoard::StartStation() {
+    if (SsidManager::GetInstance().GetSsidList().empty()) {
+        return false;
+    }
     auto& wifi_station = WifiStation::GetInstance();
     wifi_station.OnScanBegin([this]() {
         auto display = Board::GetInstance().GetDisplay();
@@ -104,16 +130,89 @@ void WifiBoard::StartNetwork() {
         std::string notification = Lang::Strings::CONNECTED_TO;
         notification += ssid;
         display->ShowNotification(notification.c_str(), 30000);
+        Application::GetInstance().NotifyNetworkUp();
     });
+
+    // The phases are timed from the events, WifiStation runs the scan and the association
+    if (wifi_event_instance_ == nullptr) {
+        ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
+            &WifiBoard::OnConnectEvent, this, &wifi_event_instance_));
+        ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
+            &WifiBoard::OnConnectEvent, this, &ip_event_instance_));
+    }
+    {
+        std::lock_guard<std::mutex> lock(connect_mutex_);
+        connect_times_ = ConnectTimes();
+        connect_times_.start_us = esp_timer_get_time();
+    }
     wifi_station.Start();
+    return true;
+}
 
-    // Try to connect to WiFi, if failed, launch the WiFi configuration AP
-    if (!wifi_station.WaitForConnected(60 * 1000)) {
-        wifi_station.Stop();
-        wifi_config_mode_ = true;
-        EnterWifiConfigMode();
+void WifiBoard::OnConnectEvent(void* arg, esp_event_base_t base, int32_t id, void* data) {
+    auto board = (WifiBoard*)arg;
+    int64_t now_us = esp_timer_get_time();
+    std::lock_guard<std::mutex> lock(board->connect_mutex_);
+    auto& times = board->connect_times_;
+    if (base == IP_EVENT) {
+        if (times.got_ip_us != 0 || times.start_us == 0) {
+            return;
+        }
+        times.got_ip_us = now_us;
+        int64_t associated_us = times.associated_us != 0 ? times.associated_us : now_us;
+        int64_t scanned_us = times.scanned_us != 0 ? times.scanned_us : times.start_us;
+        ESP_LOGI(TAG, "%s in %lld ms: scan %lld ms, associate %lld ms, DHCP %lld ms",
+            times.reconnect ? "Reconnected" : "Connected", (now_us - times.start_us) / 1000,
+            (scanned_us - times.start_us) / 1000, (associated_us - scanned_us) / 1000,
+            (now_us - associated_us) / 1000);
         return;
     }
+
+    if (id == WIFI_EVENT_SCAN_DONE) {
+        // The last scan before the association is the one that found the AP
+        if (times.associated_us == 0) {
+            times.scanned_us = now_us;
+        }
+    } else if (id == WIFI_EVENT_STA_CONNECTED) {
+        auto event = (const wifi_event_sta_connected_t*)data;
+        if (times.associated_us == 0) {
+            times.associated_us = now_us;
+            // The settings are written on the main task, the event task has a small stack
+            std::array<uint8_t, 6> bssid;
+            std::copy(event->bssid, event->bssid + 6, bssid.begin());
+            int channel = event->channel;
+            Application::GetInstance().Schedule([board, bssid, channel]() {
+                bool same_ap = board->RememberAccessPoint(bssid.data(), channel);
+                std::lock_guard<std::mutex> lock(board->connect_mutex_);
+                board->connect_times_.same_ap = same_ap;
+            });
+        }
+    } else if (id == WIFI_EVENT_STA_DISCONNECTED) {
+        // A drop of a working link times the way back to it
+        if (times.got_ip_us != 0) {
+            times = ConnectTimes();
+            times.start_us = now_us;
+            times.reconnect = true;
+        }
+    }
+}
+
+bool WifiBoard::RememberAccessPoint(const uint8_t* bssid, int channel) {
+    char text[18];
+    snprintf(text, sizeof(text), "%02x:%02x:%02x:%02x:%02x:%02x",
+        bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5]);
+    Settings settings("wifi", true);
+    if (settings.GetString("last_bssid") == text && settings.GetInt("last_channel") == channel) {
+        return true;
+    }
+    // Only written when the AP changes, a reconnect to the same one costs no flash write
+    settings.SetString("last_bssid", text);
+    settings.SetInt("last_channel", channel);
+    return false;
+}
+
+bool WifiBoard::IsNetworkReady() {
+    return !wifi_config_mode_ && WifiStation::GetInstance().IsConnected();
 }
 
 NetworkInterface* WifiBoard::GetNetwork() {
@@ -139,26 +238,50 @@ const char* WifiBoard::GetNetworkStateIcon() {
     }
 }
 
-std::string WifiBoard::GetBoardJson() {
+void WifiBoard::WriteBoardJson(JsonWriter& writer) {
     // Set the board type for OTA
     auto& wifi_station = WifiStation::GetInstance();
-    std::string board_json = R"({)";
-    board_json += R"("type":")" + std::string(BOARD_TYPE) + R"(",)";
-    board_json += R"("name":")" + std::string(BOARD_NAME) + R"(",)";
+    std::string ssid;
+    std::string ip;
+    int rssi = 0;
+    int channel = 0;
     if (!wifi_config_mode_) {
-        board_json += R"("ssid":")" + wifi_station.GetSsid() + R"(",)";
-        board_json += R"("rssi":)" + std::to_string(wifi_station.GetRssi()) + R"(,)";
-        board_json += R"("channel":)" + std::to_string(wifi_station.GetChannel()) + R"(,)";
-        board_json += R"("ip":")" + wifi_station.GetIpAddress() + R"(",)";
+        ssid = wifi_station.GetSsid();
+        ip = wifi_station.GetIpAddress();
+        rssi = wifi_station.GetRssi();
+        channel = wifi_station.GetChannel();
     }
-    board_json += R"("mac":")" + SystemInfo::GetMacAddress() + R"(")";
-    board_json += R"(})";
-    return board_json;
+
+    JsonCache::Key key;
+    key.Add(wifi_config_mode_).Add(ssid).Add(ip).Add(channel).Add(rssi / BOARD_JSON_RSSI_BUCKET_DB);
+    board_json_.Write(writer, key, [&](JsonWriter& fragment) {
+        fragment.Object();
+        fragment.String("type", BOARD_TYPE);
+        fragment.String("name", BOARD_NAME);
+        if (!wifi_config_mode_) {
+            fragment.String("ssid", ssid);
+            fragment.Int("rssi", rssi);
+            fragment.Int("channel", channel);
+            fragment.String("ip", ip);
+        }
+        fragment.String("mac", SystemInfo::GetMacAddress());
+        fragment.EndObject();
+    });
 }
 
 void WifiBoard::SetPowerSaveMode(bool enabled) {
     auto& wifi_station = WifiStation::GetInstance();
     wifi_station.SetPowerSaveMode(enabled);
+    PowerPolicy::GetInstance().SetModemSleep(enabled);
+}
+
+void WifiBoard::SetNetworkPowerLevel(NetworkPowerLevel level) {
+    // Through the virtual call, the boards wake their power save timer when it turns off
+    SetPowerSaveMode(level != kNetworkPowerActive);
+    if (level == kNetworkPowerSleep && !wifi_config_mode_) {
+        // The station wakes every listen interval of its association instead of every DTIM
+        esp_wifi_set_ps(WIFI_PS_MAX_MODEM);
+    }
 }
 
 void WifiBoard::ResetWifiConfiguration() {
@@ -173,7 +296,7 @@ void WifiBoard::ResetWifiConfiguration() {
     esp_restart();
 }
 
-std::string WifiBoard::GetDeviceStatusJson() {
+void WifiBoard::WriteDeviceStatusJson(JsonWriter& writer) {
     /*
      * 返回设备状态JSON
      * 
@@ -190,79 +313,73 @@ std::string WifiBoard::GetDeviceStatusJson() {
      *         "level": 50,
      *         "charging": true
      *     },
+     *     "chip": {
+     *         "temperature": 25
+     *     },
      *     "network": {
      *         "type": "wifi",
      *         "ssid": "Xiaozhi",
-     *         "rssi": -60
+     *         "rssi": -60,
+     *         "link": {
+     *             "rtt_ms": 80,
+     *             "jitter_ms": 12,
+     *             "uplink_loss_permille": 0,
+     *             "downlink_loss_permille": 5,
+     *             ...
+     *         },
+     *         "wifi_connect": {
+     *             "total_ms": 1850,
+     *             "scan_ms": 1200,
+     *             "associate_ms": 350,
+     *             "dhcp_ms": 300,
+     *             ...
+     *         }
      *     },
-     *     "chip": {
-     *         "temperature": 25
+     *     "cpu": {
+     *         "load": [35, 60],
+     *         "top": [{"name": "opus_encode", "cpu": 28}, ...]
      *     }
      * }
      */
-    auto& board = Board::GetInstance();
-    auto root = cJSON_CreateObject();
-
-    // Audio speaker
-    auto audio_speaker = cJSON_CreateObject();
-    auto audio_codec = board.GetAudioCodec();
-    if (audio_codec) {
-        cJSON_AddNumberToObject(audio_speaker, "volume", audio_codec->output_volume());
-    }
-    cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
-
-    // Screen brightness
-    auto backlight = board.GetBacklight();
-    auto screen = cJSON_CreateObject();
-    if (backlight) {
-        cJSON_AddNumberToObject(screen, "brightness", backlight->brightness());
-    }
-    auto display = board.GetDisplay();
-    if (display && display->height() > 64) { // For LCD display only
-        auto theme = display->GetTheme();
-        if (theme != nullptr) {
-            cJSON_AddStringToObject(screen, "theme", theme->name().c_str());
-        }
-    }
-    cJSON_AddItemToObject(root, "screen", screen);
-
-    // Battery
-    int battery_level = 0;
-    bool charging = false;
-    bool discharging = false;
-    if (board.GetBatteryLevel(battery_level, charging, discharging)) {
-        cJSON* battery = cJSON_CreateObject();
-        cJSON_AddNumberToObject(battery, "level", battery_level);
-        cJSON_AddBoolToObject(battery, "charging", charging);
-        cJSON_AddItemToObject(root, "battery", battery);
-    }
+    writer.Object();
+    WriteLocalStatusJson(writer);
 
     // Network
-    auto network = cJSON_CreateObject();
     auto& wifi_station = WifiStation::GetInstance();
-    cJSON_AddStringToObject(network, "type", "wifi");
-    cJSON_AddStringToObject(network, "ssid", wifi_station.GetSsid().c_str());
+    writer.Object("network");
+    writer.String("type", "wifi");
+    writer.String("ssid", wifi_station.GetSsid());
     int rssi = wifi_station.GetRssi();
     if (rssi >= -60) {
-        cJSON_AddStringToObject(network, "signal", "strong");
+        writer.String("signal", "strong");
     } else if (rssi >= -70) {
-        cJSON_AddStringToObject(network, "signal", "medium");
+        writer.String("signal", "medium");
     } else {
-        cJSON_AddStringToObject(network, "signal", "weak");
+        writer.String("signal", "weak");
     }
-    cJSON_AddItemToObject(root, "network", network);
-
-    // Chip
-    float esp32temp = 0.0f;
-    if (board.GetTemperature(esp32temp)) {
-        auto chip = cJSON_CreateObject();
-        cJSON_AddNumberToObject(chip, "temperature", esp32temp);
-        cJSON_AddItemToObject(root, "chip", chip);
+    // Link quality of the current or the last conversation, it changes with every call
+    writer.Json("link", LinkMetricsToJson(Application::GetInstance().GetLinkMetrics()));
+    writer.Json("reconnect", ReconnectMetricsToJson(Application::GetInstance().GetReconnectMetrics()));
+    {
+        // The phases of the last Wi-Fi connection, to compare the sites
+        std::lock_guard<std::mutex> lock(connect_mutex_);
+        auto& times = connect_times_;
+        if (times.got_ip_us != 0) {
+            int64_t associated_us = times.associated_us != 0 ? times.associated_us : times.got_ip_us;
+            int64_t scanned_us = times.scanned_us != 0 ? times.scanned_us : times.start_us;
+            writer.Object("wifi_connect");
+            writer.Int("total_ms", (times.got_ip_us - times.start_us) / 1000);
+            writer.Int("scan_ms", (scanned_us - times.start_us) / 1000);
+            writer.Int("associate_ms", (associated_us - scanned_us) / 1000);
+            writer.Int("dhcp_ms", (times.got_ip_us - associated_us) / 1000);
+            writer.Bool("reconnect", times.reconnect);
+            writer.Bool("same_ap", times.same_ap);
+            writer.EndObject();
+        }
     }
+    writer.EndObject();
 
-    auto json_str = cJSON_PrintUnformatted(root);
-    std::string json(json_str);
-    cJSON_free(json_str);
-    cJSON_Delete(root);
-    return json;
+    // CPU load per core and the busiest tasks over the last minute
+    writer.Json("cpu", CpuSampler::GetInstance().GetSummaryJson());
+    writer.EndObject();
 }
@@ -3,11 +3,34 @@
 
 #include "board.h"
 
+#include <esp_event.h>
+#include <mutex>
+
 class WifiBoard : public Board {
 protected:
     bool wifi_config_mode_ = false;
+    // Rebuilt when the SSID, IP, channel or RSSI bucket changes
+    JsonCache board_json_;
     void EnterWifiConfigMode();
-    virtual std::string GetBoardJson() override;
+
+private:
+    // Phases of the last connection, esp_timer microseconds, 0 until reached
+    struct ConnectTimes {
+        int64_t start_us = 0;       // The station started, or the link dropped
+        int64_t scanned_us = 0;
+        int64_t associated_us = 0;
+        int64_t got_ip_us = 0;
+        bool reconnect = false;
+        bool same_ap = false;       // The BSSID and channel of the connection before
+    };
+    std::mutex connect_mutex_;
+    ConnectTimes connect_times_;
+    esp_event_handler_instance_t wifi_event_instance_ = nullptr;
+    esp_event_handler_instance_t ip_event_instance_ = nullptr;
+
+    static void OnConnectEvent(void* arg, esp_event_base_t base, int32_t id, void* data);
+    // Persists the AP, returns whether it is the one of the last connection
+    bool RememberAccessPoint(const uint8_t* bssid, int channel);
 
 public:
     WifiBoard();
@@ -16,9 +39,16 @@ public:
     virtual NetworkInterface* GetNetwork() override;
     virtual const char* GetNetworkStateIcon() override;
     virtual void SetPowerSaveMode(bool enabled) override;
+    virtual void SetNetworkPowerLevel(NetworkPowerLevel level) override;
     virtual void ResetWifiConfiguration();
+    // Starts the station and returns at once, it keeps connecting in the background.
+    // False without a configured SSID. StartNetwork() falls back to the configuration AP instead.
+    bool StartStation();
+    bool IsNetworkReady();
+    bool IsConfigMode() const { return wifi_config_mode_; }
     virtual AudioCodec* GetAudioCodec() override { return nullptr; }
-    virtual std::string GetDeviceStatusJson() override;
+    virtual void WriteBoardJson(JsonWriter& writer) override;
+    virtual void WriteDeviceStatusJson(JsonWriter& writer) override;
 };
 
 #endif // WIFI_BOARD_H
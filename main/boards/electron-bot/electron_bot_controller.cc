@@ -95,6 +95,8 @@ private:
                     // 复位动作
                     controller->electron_bot_.Home(true);
                 }
+                // 动作排队后即返回，等舵机调度器播完再报告空闲
+                controller->electron_bot_.WaitIdle();
                 controller->is_action_in_progress_ = false;  // 动作执行完毕
             }
             vTaskDelay(pdMS_TO_TICKS(20));
@@ -251,6 +253,7 @@ public:
                            [this](const PropertyList& properties) -> ReturnValue {
                                // 清空队列但保持任务常驻
                                xQueueReset(action_queue_);
+                               electron_bot_.StopMotion();
                                is_action_in_progress_ = false;
                                QueueAction(ACTION_HOME, 1, 1000, 0, 0);
                                return true;
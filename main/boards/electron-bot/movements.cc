@@ -1,19 +1,27 @@
 #include "movements.h"
 
 #include <algorithm>
+#include <cmath>
 #include <cstring>
 
 #include "oscillator.h"
 
-Otto::Otto() {
+Otto::Otto()
+    : scheduler_(SERVO_COUNT, [this](int servo, int position) {
+          servo_[servo].SetPosition(position);
+          return servo_[servo].GetPosition() == position;
+      }) {
     is_otto_resting_ = false;
     for (int i = 0; i < SERVO_COUNT; i++) {
         servo_pins_[i] = -1;
         servo_trim_[i] = 0;
+        planned_[i] = 90;
+        phase_[i] = 0;
     }
 }
 
 Otto::~Otto() {
+    StopMotion();
     DetachServos();
 }
 
@@ -31,6 +39,9 @@ void Otto::Init(int right_pitch, int right_roll, int left_pitch, int left_roll,
     servo_pins_[HEAD] = head;
 
     AttachServos();
+    for (int i = 0; i < SERVO_COUNT; i++) {
+        planned_[i] = servo_[i].GetPosition();
+    }
     is_otto_resting_ = false;
 }
 
@@ -80,53 +91,30 @@ void Otto::MoveServos(int time, int servo_target[]) {
         SetRestState(false);
     }
 
-    final_time_ = millis() + time;
-    if (time > 10) {
-        for (int i = 0; i < SERVO_COUNT; i++) {
-            if (servo_pins_[i] != -1) {
-                increment_[i] = (servo_target[i] - servo_[i].GetPosition()) / (time / 10.0);
-            }
-        }
-
-        for (int iteration = 1; millis() < final_time_; iteration++) {
-            partial_time_ = millis() + 10;
-            for (int i = 0; i < SERVO_COUNT; i++) {
-                if (servo_pins_[i] != -1) {
-                    servo_[i].SetPosition(servo_[i].GetPosition() + increment_[i]);
-                }
-            }
-            vTaskDelay(pdMS_TO_TICKS(10));
+    // 按帧预先计算插值关键帧，由舵机调度器定时输出
+    ServoMotion motion;
+    motion.frames = std::max(ServoScheduler::Frames(time), 1);
+    motion.keyframes.resize(motion.frames * SERVO_COUNT);
+    for (int i = 0; i < SERVO_COUNT; i++) {
+        if (servo_pins_[i] != -1) {
+            motion.mask |= 1u << i;
         }
-    } else {
+    }
+    for (int frame = 0; frame < motion.frames; frame++) {
+        int16_t* positions = &motion.keyframes[frame * SERVO_COUNT];
         for (int i = 0; i < SERVO_COUNT; i++) {
             if (servo_pins_[i] != -1) {
-                servo_[i].SetPosition(servo_target[i]);
+                positions[i] = std::round(planned_[i] + (servo_target[i] - planned_[i]) *
+                                                            (frame + 1) / (double)motion.frames);
             }
         }
-        vTaskDelay(pdMS_TO_TICKS(time));
     }
-
-    // final adjustment to the target.
-    bool f = true;
-    int adjustment_count = 0;
-    while (f && adjustment_count < 10) {
-        f = false;
-        for (int i = 0; i < SERVO_COUNT; i++) {
-            if (servo_pins_[i] != -1 && servo_target[i] != servo_[i].GetPosition()) {
-                f = true;
-                break;
-            }
-        }
-        if (f) {
-            for (int i = 0; i < SERVO_COUNT; i++) {
-                if (servo_pins_[i] != -1) {
-                    servo_[i].SetPosition(servo_target[i]);
-                }
-            }
-            vTaskDelay(pdMS_TO_TICKS(10));
-            adjustment_count++;
+    for (int i = 0; i < SERVO_COUNT; i++) {
+        if (servo_pins_[i] != -1) {
+            planned_[i] = servo_target[i];
         }
-    };
+    }
+    scheduler_.Enqueue(std::move(motion));
 }
 
 void Otto::MoveSingle(int position, int servo_number) {
@@ -140,33 +128,68 @@ void Otto::MoveSingle(int position, int servo_number) {
     }
 
     if (servo_number >= 0 && servo_number < SERVO_COUNT && servo_pins_[servo_number] != -1) {
-        servo_[servo_number].SetPosition(position);
+        ServoMotion motion;
+        motion.frames = 1;
+        motion.mask = 1u << servo_number;
+        motion.keyframes.assign(planned_, planned_ + SERVO_COUNT);
+        motion.keyframes[servo_number] = position;
+        planned_[servo_number] = position;
+        scheduler_.Enqueue(std::move(motion));
     }
 }
 
 void Otto::OscillateServos(int amplitude[SERVO_COUNT], int offset[SERVO_COUNT], int period,
                            double phase_diff[SERVO_COUNT], float cycle = 1) {
+    if (period <= 0) {
+        return;
+    }
+
+    ServoMotion motion;
+    motion.frames = ServoScheduler::Frames(period * cycle);
+    if (motion.frames == 0) {
+        return;
+    }
+    motion.keyframes.resize(motion.frames * SERVO_COUNT);
+    double inc = 2 * M_PI * SERVO_FRAME_MS / period;
     for (int i = 0; i < SERVO_COUNT; i++) {
-        if (servo_pins_[i] != -1) {
-            servo_[i].SetO(offset[i]);
-            servo_[i].SetA(amplitude[i]);
-            servo_[i].SetT(period);
-            servo_[i].SetPh(phase_diff[i]);
+        if (servo_pins_[i] == -1) {
+            continue;
         }
+        motion.mask |= 1u << i;
+        for (int frame = 0; frame < motion.frames; frame++) {
+            int pos = std::round(amplitude[i] * std::sin(phase_[i] + phase_diff[i]) + offset[i]);
+            if (servo_[i].GetRev())
+                pos = -pos;
+            motion.keyframes[frame * SERVO_COUNT + i] = pos + 90;
+            // 相位在多次振荡之间连续
+            phase_[i] += inc;
+        }
+        planned_[i] = motion.keyframes[(motion.frames - 1) * SERVO_COUNT + i];
     }
+    scheduler_.Enqueue(std::move(motion));
+    Pause(10);
+}
 
-    double ref = millis();
-    double end_time = period * cycle + ref;
+void Otto::Pause(int time) {
+    ServoMotion motion;
+    motion.frames = ServoScheduler::Frames(time);
+    scheduler_.Enqueue(std::move(motion));
+}
 
-    while (millis() < end_time) {
-        for (int i = 0; i < SERVO_COUNT; i++) {
-            if (servo_pins_[i] != -1) {
-                servo_[i].Refresh();
-            }
-        }
-        vTaskDelay(5);
+void Otto::WaitIdle() {
+    scheduler_.WaitIdle();
+}
+
+bool Otto::IsMoving() {
+    return scheduler_.IsBusy();
+}
+
+void Otto::StopMotion() {
+    scheduler_.Clear();
+    scheduler_.WaitIdle();
+    for (int i = 0; i < SERVO_COUNT; i++) {
+        planned_[i] = servo_[i].GetPosition();
     }
-    vTaskDelay(pdMS_TO_TICKS(10));
 }
 
 void Otto::Execute(int amplitude[SERVO_COUNT], int offset[SERVO_COUNT], int period,
@@ -184,7 +207,7 @@ void Otto::Execute(int amplitude[SERVO_COUNT], int offset[SERVO_COUNT], int peri
 
     //-- Execute the final not complete cycle
     OscillateServos(amplitude, offset, period, phase_diff, (float)steps - cycles);
-    vTaskDelay(pdMS_TO_TICKS(10));
+    Pause(10);
 }
 
 ///////////////////////////////////////////////////////////////////
@@ -196,7 +219,7 @@ void Otto::Home(bool hands_down) {
         is_otto_resting_ = true;
     }
 
-    vTaskDelay(pdMS_TO_TICKS(1000));
+    Pause(1000);
 }
 
 bool Otto::GetRestState() {
@@ -228,7 +251,7 @@ void Otto::HandAction(int action, int times, int amount, int period) {
 
     int current_positions[SERVO_COUNT];
     for (int i = 0; i < SERVO_COUNT; i++) {
-        current_positions[i] = (servo_pins_[i] != -1) ? servo_[i].GetPosition() : servo_initial_[i];
+        current_positions[i] = (servo_pins_[i] != -1) ? planned_[i] : servo_initial_[i];
     }
 
     switch (action) {
@@ -262,7 +285,7 @@ void Otto::HandAction(int action, int times, int amount, int period) {
             for (int i = 0; i < times; i++) {
                 current_positions[LEFT_PITCH] = 150 + (i % 2 == 0 ? -30 : 30);
                 MoveServos(period / 10, current_positions);
-                vTaskDelay(pdMS_TO_TICKS(period / 10));
+                Pause(period / 10);
             }
             memcpy(current_positions, servo_initial_, sizeof(current_positions));
             MoveServos(period, current_positions);
@@ -274,7 +297,7 @@ void Otto::HandAction(int action, int times, int amount, int period) {
             for (int i = 0; i < times; i++) {
                 current_positions[RIGHT_PITCH] = 30 + (i % 2 == 0 ? 30 : -30);
                 MoveServos(period / 10, current_positions);
-                vTaskDelay(pdMS_TO_TICKS(period / 10));
+                Pause(period / 10);
             }
             memcpy(current_positions, servo_initial_, sizeof(current_positions));
             MoveServos(period, current_positions);
@@ -288,7 +311,7 @@ void Otto::HandAction(int action, int times, int amount, int period) {
                 current_positions[LEFT_PITCH] = 150 + (i % 2 == 0 ? -30 : 30);
                 current_positions[RIGHT_PITCH] = 30 + (i % 2 == 0 ? 30 : -30);
                 MoveServos(period / 10, current_positions);
-                vTaskDelay(pdMS_TO_TICKS(period / 10));
+                Pause(period / 10);
             }
             memcpy(current_positions, servo_initial_, sizeof(current_positions));
             MoveServos(period, current_positions);
@@ -356,7 +379,7 @@ void Otto::BodyAction(int action, int times, int amount, int period) {
     int current_positions[SERVO_COUNT];
     for (int i = 0; i < SERVO_COUNT; i++) {
         if (servo_pins_[i] != -1) {
-            current_positions[i] = servo_[i].GetPosition();
+            current_positions[i] = planned_[i];
         } else {
             current_positions[i] = servo_initial_[i];
         }
@@ -383,7 +406,7 @@ void Otto::BodyAction(int action, int times, int amount, int period) {
 
     current_positions[BODY] = target_angle;
     MoveServos(period, current_positions);
-    vTaskDelay(pdMS_TO_TICKS(100));
+    Pause(100);
 }
 
 //---------------------------------------------------------
@@ -403,7 +426,7 @@ void Otto::HeadAction(int action, int times, int amount, int period) {
     int current_positions[SERVO_COUNT];
     for (int i = 0; i < SERVO_COUNT; i++) {
         if (servo_pins_[i] != -1) {
-            current_positions[i] = servo_[i].GetPosition();
+            current_positions[i] = planned_[i];
         } else {
             current_positions[i] = servo_initial_[i];
         }
@@ -426,12 +449,12 @@ void Otto::HeadAction(int action, int times, int amount, int period) {
             // 先抬头
             current_positions[HEAD] = head_center + amount;
             MoveServos(period / 3, current_positions);
-            vTaskDelay(pdMS_TO_TICKS(period / 6));
+            Pause(period / 6);
 
             // 再低头
             current_positions[HEAD] = head_center - amount;
             MoveServos(period / 3, current_positions);
-            vTaskDelay(pdMS_TO_TICKS(period / 6));
+            Pause(period / 6);
 
             // 回到中心
             current_positions[HEAD] = head_center;
@@ -453,7 +476,7 @@ void Otto::HeadAction(int action, int times, int amount, int period) {
                 current_positions[HEAD] = head_center - amount;
                 MoveServos(period / 2, current_positions);
 
-                vTaskDelay(pdMS_TO_TICKS(50));  // 短暂停顿
+                Pause(50);  // 短暂停顿
             }
 
             // 回到中心
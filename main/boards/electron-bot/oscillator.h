@@ -34,6 +34,7 @@ public:
     void SetLimiter(int diff_limit) { diff_limit_ = diff_limit; };
     void DisableLimiter() { diff_limit_ = 0; };
     int GetTrim() { return trim_; };
+    bool GetRev() { return rev_; };
     void SetPosition(int position);
     void Stop() { stop_ = true; };
     void Play() { stop_ = false; };
@@ -173,6 +173,10 @@ private:
     void InitSy6970() {
         ESP_LOGI(TAG, "Init Sy6970");
         pmic_ = new Pmic(i2c_bus_, SY6970_ADDRESS);
+#ifdef SY6970_INT
+        // The status bar then reads the status cached at the INT pulse
+        pmic_->EnableInterrupt(SY6970_INT);
+#endif
     }
 
     void InitializeSt7789Display() {
@@ -307,7 +307,7 @@ private:
         dpi_config.dpi_clk_src = MIPI_DSI_DPI_CLK_SRC_DEFAULT;
         dpi_config.dpi_clock_freq_mhz = 70;  // ST7123 DPI clock frequency
         dpi_config.pixel_format = LCD_COLOR_PIXEL_FORMAT_RGB565;
-        dpi_config.num_fbs = 1;
+        dpi_config.num_fbs = 2;  // Drawn in turn by LcdDirectRenderer
         dpi_config.video_timing.h_size = 720;
         dpi_config.video_timing.v_size = 1280;
         dpi_config.video_timing.hsync_pulse_width = 2;
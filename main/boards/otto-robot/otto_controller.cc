@@ -18,6 +18,18 @@
 
 #define TAG "OttoController"
 
+// 舵机微调值，整体存为一条 NVS 记录
+struct OttoTrims {
+    int8_t left_leg;
+    int8_t right_leg;
+    int8_t left_foot;
+    int8_t right_foot;
+    int8_t left_hand;
+    int8_t right_hand;
+};
+#define OTTO_TRIMS_KEY "trims"
+#define OTTO_TRIMS_VERSION 1
+
 class OttoController {
 private:
     Otto otto_;
@@ -280,7 +292,7 @@ private:
                                     // 动作后的延迟（最后一个动作后不延迟）
                                     if (delay_after > 0 && i < array_size - 1) {
                                         ESP_LOGI(TAG, "动作%d执行完成，延迟%d毫秒", i, delay_after);
-                                        vTaskDelay(pdMS_TO_TICKS(delay_after));
+                                        controller->otto_.Pause(delay_after);
                                     }
                                 }
                             }
@@ -292,7 +304,7 @@ private:
                                 if (queue_count > 0) {
                                     ESP_LOGI(TAG, "序列执行完成，延迟%d毫秒后执行下一个序列（队列中还有%d个序列）", 
                                              sequence_delay, queue_count);
-                                    vTaskDelay(pdMS_TO_TICKS(sequence_delay));
+                                    controller->otto_.Pause(sequence_delay);
                                 }
                             }
                             // 释放JSON内存
@@ -425,6 +437,8 @@ private:
                         }
                     }
                 }
+                // 动作排队后即返回，等舵机调度器播完再报告空闲
+                controller->otto_.WaitIdle();
                 controller->is_action_in_progress_ = false;
                 vTaskDelay(pdMS_TO_TICKS(20));
             }
@@ -490,20 +504,41 @@ private:
         StartActionTaskIfNeeded();
     }
 
-    void LoadTrimsFromNVS() {
+    // 早期固件每个舵机一个键，读到后转存为一条记录
+    static OttoTrims ReadTrims() {
+        OttoTrims trims = {};
         Settings settings("otto_trims", false);
+        if (settings.GetStruct(OTTO_TRIMS_KEY, trims, OTTO_TRIMS_VERSION)) {
+            return trims;
+        }
+        trims.left_leg = settings.GetInt("left_leg", 0);
+        trims.right_leg = settings.GetInt("right_leg", 0);
+        trims.left_foot = settings.GetInt("left_foot", 0);
+        trims.right_foot = settings.GetInt("right_foot", 0);
+        trims.left_hand = settings.GetInt("left_hand", 0);
+        trims.right_hand = settings.GetInt("right_hand", 0);
+        WriteTrims(trims);
+        return trims;
+    }
 
-        int left_leg = settings.GetInt("left_leg", 0);
-        int right_leg = settings.GetInt("right_leg", 0);
-        int left_foot = settings.GetInt("left_foot", 0);
-        int right_foot = settings.GetInt("right_foot", 0);
-        int left_hand = settings.GetInt("left_hand", 0);
-        int right_hand = settings.GetInt("right_hand", 0);
+    static void WriteTrims(const OttoTrims& trims) {
+        Settings settings("otto_trims", true);
+        settings.SetStruct(OTTO_TRIMS_KEY, trims, OTTO_TRIMS_VERSION);
+    }
+
+    void ApplyTrims(const OttoTrims& trims) {
+        otto_.SetTrims(trims.left_leg, trims.right_leg, trims.left_foot, trims.right_foot, trims.left_hand,
+                       trims.right_hand);
+    }
+
+    void LoadTrimsFromNVS() {
+        OttoTrims trims = ReadTrims();
 
         ESP_LOGI(TAG, "从NVS加载微调设置: 左腿=%d, 右腿=%d, 左脚=%d, 右脚=%d, 左手=%d, 右手=%d",
-                 left_leg, right_leg, left_foot, right_foot, left_hand, right_hand);
+                 trims.left_leg, trims.right_leg, trims.left_foot, trims.right_foot, trims.left_hand,
+                 trims.right_hand);
 
-        otto_.SetTrims(left_leg, right_leg, left_foot, right_foot, left_hand, right_hand);
+        ApplyTrims(trims);
     }
 
 public:
@@ -712,6 +747,7 @@ public:
                                }
                                is_action_in_progress_ = false;
                                xQueueReset(action_queue_);
+                               otto_.StopMotion();
 
                                QueueAction(ACTION_HOME, 1, 1000, 1, 0);
                                return true;
@@ -731,45 +767,34 @@ public:
                 ESP_LOGI(TAG, "设置舵机微调: %s = %d度", servo_type.c_str(), trim_value);
 
                 // 获取当前所有微调值
-                Settings settings("otto_trims", true);
-                int left_leg = settings.GetInt("left_leg", 0);
-                int right_leg = settings.GetInt("right_leg", 0);
-                int left_foot = settings.GetInt("left_foot", 0);
-                int right_foot = settings.GetInt("right_foot", 0);
-                int left_hand = settings.GetInt("left_hand", 0);
-                int right_hand = settings.GetInt("right_hand", 0);
+                OttoTrims trims = ReadTrims();
 
                 // 更新指定舵机的微调值
                 if (servo_type == "left_leg") {
-                    left_leg = trim_value;
-                    settings.SetInt("left_leg", left_leg);
+                    trims.left_leg = trim_value;
                 } else if (servo_type == "right_leg") {
-                    right_leg = trim_value;
-                    settings.SetInt("right_leg", right_leg);
+                    trims.right_leg = trim_value;
                 } else if (servo_type == "left_foot") {
-                    left_foot = trim_value;
-                    settings.SetInt("left_foot", left_foot);
+                    trims.left_foot = trim_value;
                 } else if (servo_type == "right_foot") {
-                    right_foot = trim_value;
-                    settings.SetInt("right_foot", right_foot);
+                    trims.right_foot = trim_value;
                 } else if (servo_type == "left_hand") {
                     if (!has_hands_) {
                         return "错误：机器人没有配置手部舵机";
                     }
-                    left_hand = trim_value;
-                    settings.SetInt("left_hand", left_hand);
+                    trims.left_hand = trim_value;
                 } else if (servo_type == "right_hand") {
                     if (!has_hands_) {
                         return "错误：机器人没有配置手部舵机";
                     }
-                    right_hand = trim_value;
-                    settings.SetInt("right_hand", right_hand);
+                    trims.right_hand = trim_value;
                 } else {
                     return "错误：无效的舵机类型，请使用: left_leg, right_leg, left_foot, "
                            "right_foot, left_hand, right_hand";
                 }
+                WriteTrims(trims);
 
-                otto_.SetTrims(left_leg, right_leg, left_foot, right_foot, left_hand, right_hand);
+                ApplyTrims(trims);
 
                 QueueAction(ACTION_JUMP, 1, 500, 0, 0);
 
@@ -779,22 +804,15 @@ public:
 
         mcp_server.AddTool("self.otto.get_trims", "获取当前的舵机微调设置", PropertyList(),
                            [this](const PropertyList& properties) -> ReturnValue {
-                               Settings settings("otto_trims", false);
-
-                               int left_leg = settings.GetInt("left_leg", 0);
-                               int right_leg = settings.GetInt("right_leg", 0);
-                               int left_foot = settings.GetInt("left_foot", 0);
-                               int right_foot = settings.GetInt("right_foot", 0);
-                               int left_hand = settings.GetInt("left_hand", 0);
-                               int right_hand = settings.GetInt("right_hand", 0);
+                               OttoTrims trims = ReadTrims();
 
                                std::string result =
-                                   "{\"left_leg\":" + std::to_string(left_leg) +
-                                   ",\"right_leg\":" + std::to_string(right_leg) +
-                                   ",\"left_foot\":" + std::to_string(left_foot) +
-                                   ",\"right_foot\":" + std::to_string(right_foot) +
-                                   ",\"left_hand\":" + std::to_string(left_hand) +
-                                   ",\"right_hand\":" + std::to_string(right_hand) + "}";
+                                   "{\"left_leg\":" + std::to_string(trims.left_leg) +
+                                   ",\"right_leg\":" + std::to_string(trims.right_leg) +
+                                   ",\"left_foot\":" + std::to_string(trims.left_foot) +
+                                   ",\"right_foot\":" + std::to_string(trims.right_foot) +
+                                   ",\"left_hand\":" + std::to_string(trims.left_hand) +
+                                   ",\"right_hand\":" + std::to_string(trims.right_hand) + "}";
 
                                ESP_LOGI(TAG, "获取微调设置: %s", result.c_str());
                                return result;
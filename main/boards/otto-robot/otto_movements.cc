@@ -1,6 +1,7 @@
 #include "otto_movements.h"
 
 #include <algorithm>
+#include <cmath>
 
 #include "freertos/idf_additions.h"
 #include "oscillator.h"
@@ -9,17 +10,24 @@ static const char* TAG = "OttoMovements";
 
 #define HAND_HOME_POSITION 45
 
-Otto::Otto() {
+Otto::Otto()
+    : scheduler_(SERVO_COUNT, [this](int servo, int position) {
+          servo_[servo].SetPosition(position);
+          return servo_[servo].GetPosition() == position;
+      }) {
     is_otto_resting_ = false;
     has_hands_ = false;
     // 初始化所有舵机管脚为-1（未连接）
     for (int i = 0; i < SERVO_COUNT; i++) {
         servo_pins_[i] = -1;
         servo_trim_[i] = 0;
+        planned_[i] = 90;
+        phase_[i] = 0;
     }
 }
 
 Otto::~Otto() {
+    StopMotion();
     DetachServos();
 }
 
@@ -40,6 +48,9 @@ void Otto::Init(int left_leg, int right_leg, int left_foot, int right_foot, int
     has_hands_ = (left_hand != -1 && right_hand != -1);
 
     AttachServos();
+    for (int i = 0; i < SERVO_COUNT; i++) {
+        planned_[i] = servo_[i].GetPosition();
+    }
     is_otto_resting_ = false;
 }
 
@@ -92,53 +103,30 @@ void Otto::MoveServos(int time, int servo_target[]) {
         SetRestState(false);
     }
 
-    final_time_ = millis() + time;
-    if (time > 10) {
-        for (int i = 0; i < SERVO_COUNT; i++) {
-            if (servo_pins_[i] != -1) {
-                increment_[i] = (servo_target[i] - servo_[i].GetPosition()) / (time / 10.0);
-            }
-        }
-
-        for (int iteration = 1; millis() < final_time_; iteration++) {
-            partial_time_ = millis() + 10;
-            for (int i = 0; i < SERVO_COUNT; i++) {
-                if (servo_pins_[i] != -1) {
-                    servo_[i].SetPosition(servo_[i].GetPosition() + increment_[i]);
-                }
-            }
-            vTaskDelay(pdMS_TO_TICKS(10));
+    // 按帧预先计算插值关键帧，由舵机调度器定时输出
+    ServoMotion motion;
+    motion.frames = std::max(ServoScheduler::Frames(time), 1);
+    motion.keyframes.resize(motion.frames * SERVO_COUNT);
+    for (int i = 0; i < SERVO_COUNT; i++) {
+        if (servo_pins_[i] != -1) {
+            motion.mask |= 1u << i;
         }
-    } else {
+    }
+    for (int frame = 0; frame < motion.frames; frame++) {
+        int16_t* positions = &motion.keyframes[frame * SERVO_COUNT];
         for (int i = 0; i < SERVO_COUNT; i++) {
             if (servo_pins_[i] != -1) {
-                servo_[i].SetPosition(servo_target[i]);
+                positions[i] = std::round(planned_[i] + (servo_target[i] - planned_[i]) *
+                                                            (frame + 1) / (double)motion.frames);
             }
         }
-        vTaskDelay(pdMS_TO_TICKS(time));
     }
-
-    // final adjustment to the target.
-    bool f = true;
-    int adjustment_count = 0;
-    while (f && adjustment_count < 10) {
-        f = false;
-        for (int i = 0; i < SERVO_COUNT; i++) {
-            if (servo_pins_[i] != -1 && servo_target[i] != servo_[i].GetPosition()) {
-                f = true;
-                break;
-            }
-        }
-        if (f) {
-            for (int i = 0; i < SERVO_COUNT; i++) {
-                if (servo_pins_[i] != -1) {
-                    servo_[i].SetPosition(servo_target[i]);
-                }
-            }
-            vTaskDelay(pdMS_TO_TICKS(10));
-            adjustment_count++;
+    for (int i = 0; i < SERVO_COUNT; i++) {
+        if (servo_pins_[i] != -1) {
+            planned_[i] = servo_target[i];
         }
-    };
+    }
+    scheduler_.Enqueue(std::move(motion));
 }
 
 void Otto::MoveSingle(int position, int servo_number) {
@@ -152,33 +140,68 @@ void Otto::MoveSingle(int position, int servo_number) {
     }
 
     if (servo_number >= 0 && servo_number < SERVO_COUNT && servo_pins_[servo_number] != -1) {
-        servo_[servo_number].SetPosition(position);
+        ServoMotion motion;
+        motion.frames = 1;
+        motion.mask = 1u << servo_number;
+        motion.keyframes.assign(planned_, planned_ + SERVO_COUNT);
+        motion.keyframes[servo_number] = position;
+        planned_[servo_number] = position;
+        scheduler_.Enqueue(std::move(motion));
     }
 }
 
 void Otto::OscillateServos(int amplitude[SERVO_COUNT], int offset[SERVO_COUNT], int period,
                            double phase_diff[SERVO_COUNT], float cycle = 1) {
+    if (period <= 0) {
+        return;
+    }
+
+    ServoMotion motion;
+    motion.frames = ServoScheduler::Frames(period * cycle);
+    if (motion.frames == 0) {
+        return;
+    }
+    motion.keyframes.resize(motion.frames * SERVO_COUNT);
+    double inc = 2 * M_PI * SERVO_FRAME_MS / period;
     for (int i = 0; i < SERVO_COUNT; i++) {
-        if (servo_pins_[i] != -1) {
-            servo_[i].SetO(offset[i]);
-            servo_[i].SetA(amplitude[i]);
-            servo_[i].SetT(period);
-            servo_[i].SetPh(phase_diff[i]);
+        if (servo_pins_[i] == -1) {
+            continue;
         }
+        motion.mask |= 1u << i;
+        for (int frame = 0; frame < motion.frames; frame++) {
+            int pos = std::round(amplitude[i] * std::sin(phase_[i] + phase_diff[i]) + offset[i]);
+            if (servo_[i].GetRev())
+                pos = -pos;
+            motion.keyframes[frame * SERVO_COUNT + i] = pos + 90;
+            // 相位在多次振荡之间连续
+            phase_[i] += inc;
+        }
+        planned_[i] = motion.keyframes[(motion.frames - 1) * SERVO_COUNT + i];
     }
+    scheduler_.Enqueue(std::move(motion));
+    Pause(10);
+}
 
-    double ref = millis();
-    double end_time = period * cycle + ref;
+void Otto::Pause(int time) {
+    ServoMotion motion;
+    motion.frames = ServoScheduler::Frames(time);
+    scheduler_.Enqueue(std::move(motion));
+}
 
-    while (millis() < end_time) {
-        for (int i = 0; i < SERVO_COUNT; i++) {
-            if (servo_pins_[i] != -1) {
-                servo_[i].Refresh();
-            }
-        }
-        vTaskDelay(5);
+void Otto::WaitIdle() {
+    scheduler_.WaitIdle();
+}
+
+bool Otto::IsMoving() {
+    return scheduler_.IsBusy();
+}
+
+void Otto::StopMotion() {
+    scheduler_.Clear();
+    scheduler_.WaitIdle();
+    for (int i = 0; i < SERVO_COUNT; i++) {
+        planned_[i] = servo_[i].GetPosition();
     }
-    vTaskDelay(pdMS_TO_TICKS(10));
 }
 
 void Otto::Execute(int amplitude[SERVO_COUNT], int offset[SERVO_COUNT], int period,
@@ -196,7 +219,7 @@ void Otto::Execute(int amplitude[SERVO_COUNT], int offset[SERVO_COUNT], int peri
 
     //-- Execute the final not complete cycle
     OscillateServos(amplitude, offset, period, phase_diff, (float)steps - cycles);
-    vTaskDelay(pdMS_TO_TICKS(10));
+    Pause(10);
 }
 
 //---------------------------------------------------------
@@ -229,7 +252,7 @@ void Otto::Execute2(int amplitude[SERVO_COUNT], int center_angle[SERVO_COUNT], i
 
     //-- Execute the final not complete cycle
     OscillateServos(amplitude, offset, period, phase_diff, (float)steps - cycles);
-    vTaskDelay(pdMS_TO_TICKS(10));
+    Pause(10);
 }
 
 ///////////////////////////////////////////////////////////////////
@@ -250,7 +273,7 @@ void Otto::Home(bool hands_down) {
                     }
                 } else {
                     // 如果不需要复位手部，保持当前位置
-                    homes[i] = servo_[i].GetPosition();
+                    homes[i] = planned_[i];
                 }
             } else {
                 // 腿部和脚部舵机始终复位
@@ -262,7 +285,7 @@ void Otto::Home(bool hands_down) {
         is_otto_resting_ = true;
     }
 
-    vTaskDelay(pdMS_TO_TICKS(200));
+    Pause(200);
 }
 
 bool Otto::GetRestState() {
@@ -400,7 +423,7 @@ void Otto::Bend(int steps, int period, int dir) {
     for (int i = 0; i < steps; i++) {
         MoveServos(T2 / 2, bend1);
         MoveServos(T2 / 2, bend2);
-        vTaskDelay(pdMS_TO_TICKS(period * 0.8));
+        Pause(period * 0.8);
         MoveServos(500, homes);
     }
 }
@@ -451,7 +474,7 @@ void Otto::ShakeLeg(int steps, int period, int dir) {
         MoveServos(500, homes);  // Return to home position
     }
 
-    vTaskDelay(pdMS_TO_TICKS(period));
+    Pause(period);
 }
 
 //---------------------------------------------------------
@@ -644,7 +667,7 @@ void Otto::WhirlwindLeg(float steps, int period, int amplitude) {
     MoveServos(100, target);
     target[RIGHT_FOOT] = 160;
     MoveServos(500, target);
-    vTaskDelay(pdMS_TO_TICKS(1000));
+    Pause(1000);
 
     int C[SERVO_COUNT] = {90, 90, 180, 160, 45, 20};
     int A[SERVO_COUNT] = {amplitude, 0, 0, 0, amplitude, 0};
@@ -671,10 +694,10 @@ void Otto::HandsUp(int period, int dir) {
         target[RIGHT_HAND] = 10;
     } else if (dir == LEFT) {
         target[LEFT_HAND] = 170;
-        target[RIGHT_HAND] = servo_[RIGHT_HAND].GetPosition();
+        target[RIGHT_HAND] = planned_[RIGHT_HAND];
     } else if (dir == RIGHT) {
         target[RIGHT_HAND] = 10;
-        target[LEFT_HAND] = servo_[LEFT_HAND].GetPosition();
+        target[LEFT_HAND] = planned_[LEFT_HAND];
     }
 
     MoveServos(period, target);
@@ -694,9 +717,9 @@ void Otto::HandsDown(int period, int dir) {
     int target[SERVO_COUNT] = {90, 90, 90, 90, HAND_HOME_POSITION, 180 - HAND_HOME_POSITION};
 
     if (dir == LEFT) {
-        target[RIGHT_HAND] = servo_[RIGHT_HAND].GetPosition();
+        target[RIGHT_HAND] = planned_[RIGHT_HAND];
     } else if (dir == RIGHT) {
-        target[LEFT_HAND] = servo_[LEFT_HAND].GetPosition();
+        target[LEFT_HAND] = planned_[LEFT_HAND];
     }
 
     MoveServos(period, target);
@@ -785,7 +808,7 @@ void Otto::Fitness(float steps, int period, int amplitude) {
     MoveServos(100, target);
     target[LEFT_FOOT] = 20;
     MoveServos(400, target);
-    vTaskDelay(pdMS_TO_TICKS(2000));
+    Pause(2000);
 
     int C[SERVO_COUNT] = {90, 90, 20, 90, 160, 135};
     int A[SERVO_COUNT] = {0, 0, 0, 0, 0, amplitude};
@@ -909,38 +932,38 @@ void Otto::Showcase() {
 
     // 1. 往前走3步
     Walk(3, 1000, FORWARD, 50);
-    vTaskDelay(pdMS_TO_TICKS(500));
+    Pause(500);
 
     // 2. 挥挥手
     if (has_hands_) {
         HandWave(LEFT);
-        vTaskDelay(pdMS_TO_TICKS(500));
+        Pause(500);
     }
 
     // 3. 跳舞（使用广播体操）
     if (has_hands_) {
         RadioCalisthenics();
-        vTaskDelay(pdMS_TO_TICKS(500));
+        Pause(500);
     }
 
     // 4. 太空步
     Moonwalker(3, 900, 25, LEFT);
-    vTaskDelay(pdMS_TO_TICKS(500));
+    Pause(500);
 
     // 5. 摇摆
     Swing(3, 1000, 30);
-    vTaskDelay(pdMS_TO_TICKS(500));
+    Pause(500);
 
     // 6. 起飞
     if (has_hands_) {
         Takeoff(5, 300, 40);
-        vTaskDelay(pdMS_TO_TICKS(500));
+        Pause(500);
     }
 
     // 7. 健身
     if (has_hands_) {
         Fitness(5, 1000, 25);
-        vTaskDelay(pdMS_TO_TICKS(500));
+        Pause(500);
     }
 
     // 8. 往后走3步
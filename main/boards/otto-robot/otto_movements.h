@@ -7,6 +7,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "oscillator.h"
+#include "servo_scheduler.h"
 
 //-- Constants
 #define FORWARD 1
@@ -54,6 +55,12 @@ public:
     void Execute2(int amplitude[SERVO_COUNT], int center_angle[SERVO_COUNT], int period,
                   double phase_diff[SERVO_COUNT], float steps);
 
+    //-- 动作先排入舵机调度器再按帧输出，上面的函数排队后即返回
+    void Pause(int time);
+    void WaitIdle();
+    bool IsMoving();
+    void StopMotion();  // 丢弃排队的动作，停在当前位置
+
     //-- HOME = Otto at rest position
     void Home(bool hands_down = true);
     bool GetRestState();
@@ -102,9 +109,8 @@ private:
     int servo_pins_[SERVO_COUNT];
     int servo_trim_[SERVO_COUNT];
 
-    unsigned long final_time_;
-    unsigned long partial_time_;
-    float increment_[SERVO_COUNT];
+    int planned_[SERVO_COUNT];  // 已排队动作结束时的位置
+    double phase_[SERVO_COUNT];  // 振荡相位
 
     bool is_otto_resting_;
     bool has_hands_;  // 是否有手部舵机
@@ -112,6 +118,8 @@ private:
     void Execute(int amplitude[SERVO_COUNT], int offset[SERVO_COUNT], int period,
                  double phase_diff[SERVO_COUNT], float steps);
 
+    // 最后声明、最先析构，调度任务停下之后舵机才释放
+    ServoScheduler scheduler_;
 };
 
 #endif  // __OTTO_MOVEMENTS_H__
\ No newline at end of file
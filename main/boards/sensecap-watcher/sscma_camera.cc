@@ -9,12 +9,19 @@
 
 #include <esp_log.h>
 #include <esp_heap_caps.h>
+#include "heap_accounting.h"
 #include <cstring>
+#include <algorithm>
 #include "application.h"
+#include "http_client.h"
+#include "json_writer.h"
+#include "task_placement.h"
 
 #define TAG "SscmaCamera"
 
 #define IMG_JPEG_BUF_SIZE   48 * 1024
+// The inference results sent with a photo or returned by self.model.get_detections are this recent
+#define DETECTIONS_MAX_AGE_MS   3000
 
 SscmaCamera::SscmaCamera(esp_io_expander_handle_t io_exp_handle) {
     sscma_client_io_spi_config_t spi_io_config = {0};
@@ -46,6 +53,7 @@ SscmaCamera::SscmaCamera(esp_io_expander_handle_t io_exp_handle) {
     sscma_client_new(sscma_client_io_handle_, &sscma_client_config, &sscma_client_handle_);
 
     sscma_data_queue_ = xQueueCreate(1, sizeof(SscmaData));
+    stream_captured_ = xSemaphoreCreateBinary();
 
     sscma_client_callback_t callback = {0};
 
@@ -88,6 +96,11 @@ SscmaCamera::SscmaCamera(esp_io_expander_handle_t io_exp_handle) {
 
                 // 尝试获取检测框数据（目标检测模型）
                 if (sscma_utils_fetch_boxes_from_reply(reply, &boxes, &box_count) == ESP_OK && box_count > 0) {
+                    std::vector<SscmaDetection> detections;
+                    for (int i = 0; i < box_count; i++) {
+                        detections.push_back({boxes[i].target, boxes[i].score, boxes[i].x, boxes[i].y, boxes[i].w, boxes[i].h});
+                    }
+                    self->SaveDetections("boxes", std::move(detections));
                     for (int i = 0; i < box_count; i++) {
                         ESP_LOGI(TAG, "[box %d]: x=%d, y=%d, w=%d, h=%d, score=%d, target=%d", i,  \
                                 boxes[i].x, boxes[i].y, boxes[i].w, boxes[i].h, boxes[i].score, boxes[i].target);
@@ -101,6 +114,11 @@ SscmaCamera::SscmaCamera(esp_io_expander_handle_t io_exp_handle) {
                     free(boxes);
                 } else if (sscma_utils_fetch_classes_from_reply(reply, &classes, &class_count) == ESP_OK && class_count > 0) {
                     // 尝试获取分类数据（分类模型）
+                    std::vector<SscmaDetection> detections;
+                    for (int i = 0; i < class_count; i++) {
+                        detections.push_back({classes[i].target, classes[i].score, 0, 0, 0, 0});
+                    }
+                    self->SaveDetections("classes", std::move(detections));
                     for (int i = 0; i < class_count; i++) {
                         ESP_LOGI(TAG, "[class %d]: target=%d, score=%d", i,
                                 classes[i].target, classes[i].score);
@@ -113,6 +131,11 @@ SscmaCamera::SscmaCamera(esp_io_expander_handle_t io_exp_handle) {
                     free(classes);
                 } else if (sscma_utils_fetch_points_from_reply(reply, &points, &point_count) == ESP_OK && point_count > 0) {
                      // 尝试获取关键点数据（姿态估计模型）
+                    std::vector<SscmaDetection> detections;
+                    for (int i = 0; i < point_count; i++) {
+                        detections.push_back({points[i].target, points[i].score, points[i].x, points[i].y, 0, 0});
+                    }
+                    self->SaveDetections("points", std::move(detections));
                     for (int i = 0; i < point_count; i++) {
                         ESP_LOGI(TAG, "[point %d]: x=%d, y=%d, z=%d, score=%d, target=%d", i, 
                                 points[i].x, points[i].y, points[i].z, points[i].score, points[i].target);
@@ -347,6 +370,13 @@ SscmaCamera::SscmaCamera(esp_io_expander_handle_t io_exp_handle) {
         bool is_inference = false;
         while (true)
         {
+            // 视频流期间由视频流任务控制 Himax, 推理暂停
+            if (this_->stream_running_) {
+                is_inference = false;
+                vTaskDelay(pdMS_TO_TICKS(200));
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(this_->mode_mutex_);
             if (this_->inference_en && Application::GetInstance().GetDeviceState() == kDeviceStateIdle ) {
                 if (!is_inference) {
                     ESP_LOGI(TAG, "Start inference (enable=1)");
@@ -361,6 +391,7 @@ SscmaCamera::SscmaCamera(esp_io_expander_handle_t io_exp_handle) {
                 is_inference = false;
                 sscma_client_break(this_->sscma_client_handle_);
             }
+            lock.unlock();
             vTaskDelay(pdMS_TO_TICKS(200));
         }
     }, "sscma_camera", 4096, this, 1, nullptr);
@@ -368,6 +399,7 @@ SscmaCamera::SscmaCamera(esp_io_expander_handle_t io_exp_handle) {
 }
 
 SscmaCamera::~SscmaCamera() {
+    StopStreaming();
     if (preview_image_.data) {
         heap_caps_free((void*)preview_image_.data);
         preview_image_.data = nullptr;
@@ -378,6 +410,9 @@ SscmaCamera::~SscmaCamera() {
     if (sscma_data_queue_) {
         vQueueDelete(sscma_data_queue_);
     }
+    if (stream_captured_) {
+        vSemaphoreDelete(stream_captured_);
+    }
     if (jpeg_data_.buf) {
         heap_caps_free(jpeg_data_.buf);
         jpeg_data_.buf = nullptr;
@@ -509,6 +544,60 @@ void SscmaCamera::InitializeMcpTools() {
             int cur_en = settings.GetInt("enable", this->inference_en);
             return std::string("{\"enable\":") + std::to_string(cur_en) + "}";
         });
+
+    // 只需要检测结果时不必拍照上传
+    mcp_server.AddTool("self.model.get_detections",
+        "获取端侧模型最近的推理结果（检测框、分类或关键点），不拍照也不上传图片。"
+        "推理需先用 self.model.enable 开启，结果为空表示最近没有推理结果。",
+        PropertyList(),
+        [this](const PropertyList& properties) -> ReturnValue {
+            std::string json = GetDetectionsJson(DETECTIONS_MAX_AGE_MS);
+            return json.empty() ? std::string("{\"detections\":null}") : json;
+        });
+}
+
+const char* SscmaCamera::ClassName(int target) const {
+    if (model != NULL && target >= 0 && target < model_class_cnt && model->classes[target] != NULL) {
+        return model->classes[target];
+    }
+    return "object";
+}
+
+void SscmaCamera::SaveDetections(const char* kind, std::vector<SscmaDetection>&& detections) {
+    std::lock_guard<std::mutex> lock(detections_mutex_);
+    detections_kind_ = kind;
+    detections_ = std::move(detections);
+    detections_us_ = esp_timer_get_time();
+}
+
+std::string SscmaCamera::GetDetectionsJson(int max_age_ms) {
+    std::lock_guard<std::mutex> lock(detections_mutex_);
+    int64_t age_ms = (esp_timer_get_time() - detections_us_) / 1000;
+    std::string json;
+    if (detections_kind_ == nullptr || age_ms > max_age_ms) {
+        return json;
+    }
+    JsonWriter writer(json);
+    writer.Object();
+    writer.Int("age_ms", age_ms);
+    writer.Array(detections_kind_);
+    for (const auto& detection : detections_) {
+        writer.Object();
+        writer.String("class", ClassName(detection.target));
+        writer.Int("score", detection.score);
+        if (detections_kind_[0] != 'c') {
+            writer.Int("x", detection.x);
+            writer.Int("y", detection.y);
+        }
+        if (detection.w > 0 || detection.h > 0) {
+            writer.Int("w", detection.w);
+            writer.Int("h", detection.h);
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    return json;
 }
 
 void SscmaCamera::SetExplainUrl(const std::string& url, const std::string& token) {
@@ -525,35 +614,54 @@ bool SscmaCamera::Capture() {
         ESP_LOGE(TAG, "SSCMA client handle is not initialized");
         return false;
     }
-
-    if (sscma_client_set_sensor(sscma_client_handle_, 1, 3, true)) {
-        ESP_LOGE(TAG, "Failed to set sensor");
-        return false;
-    }
-    ESP_LOGI(TAG, "Capturing image...");
-    // himax 有缓存数据,需要拍两张照片, 只获取最新的照片即可.
-    if (sscma_client_sample(sscma_client_handle_, 2) ) {
-        ESP_LOGE(TAG, "Failed to capture image from SSCMA client");
-        return false;
-    }
-    vTaskDelay(pdMS_TO_TICKS(500)); // 等待SSCMA客户端处理数据
-    if (xQueueReceive(sscma_data_queue_, &data, pdMS_TO_TICKS(1000)) != pdPASS) {
-        ESP_LOGE(TAG, "Failed to receive JPEG data from SSCMA client");
-        return false;
-    }
-
     if (jpeg_data_.buf == nullptr) {
-        heap_caps_free(data.img);
         return false;
     }
 
-    ret = mbedtls_base64_decode(jpeg_data_.buf, IMG_JPEG_BUF_SIZE, &jpeg_data_.len, data.img, data.len);
-    if (ret != 0 || jpeg_data_.len == 0) {
-        ESP_LOGE(TAG, "Failed to decode base64 image data, ret: %d, output_len: %zu", ret, jpeg_data_.len);
+    if (stream_running_) {
+        // 视频流已经在取图, 直接用下一帧, 不再切换传感器
+        xSemaphoreTake(stream_captured_, 0);
+        stream_capture_ = true;
+        if (xSemaphoreTake(stream_captured_, pdMS_TO_TICKS(2000)) != pdTRUE) {
+            stream_capture_ = false;
+            ESP_LOGE(TAG, "No frame from the stream");
+            return false;
+        }
+    } else {
+        std::lock_guard<std::mutex> lock(mode_mutex_);
+        if (sscma_client_set_sensor(sscma_client_handle_, 1, 3, true)) {
+            ESP_LOGE(TAG, "Failed to set sensor");
+            return false;
+        }
+        ESP_LOGI(TAG, "Capturing image...");
+        // 丢弃之前残留的图片
+        while (xQueueReceive(sscma_data_queue_, &data, 0) == pdPASS) {
+            heap_caps_free(data.img);
+        }
+        // himax 有缓存数据,需要拍两张照片, 只获取最新的照片即可.
+        if (sscma_client_sample(sscma_client_handle_, 2) ) {
+            ESP_LOGE(TAG, "Failed to capture image from SSCMA client");
+            return false;
+        }
+        if (xQueueReceive(sscma_data_queue_, &data, pdMS_TO_TICKS(1500)) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to receive JPEG data from SSCMA client");
+            return false;
+        }
+        // 两张都已到达时队列里只剩第二张, 否则等第二张
+        SscmaData newer;
+        if (xQueueReceive(sscma_data_queue_, &newer, pdMS_TO_TICKS(500)) == pdPASS) {
+            heap_caps_free(data.img);
+            data = newer;
+        }
+
+        ret = mbedtls_base64_decode(jpeg_data_.buf, IMG_JPEG_BUF_SIZE, &jpeg_data_.len, data.img, data.len);
+        if (ret != 0 || jpeg_data_.len == 0) {
+            ESP_LOGE(TAG, "Failed to decode base64 image data, ret: %d, output_len: %zu", ret, jpeg_data_.len);
+            heap_caps_free(data.img);
+            return false;
+        }
         heap_caps_free(data.img);
-        return false;
     }
-    heap_caps_free(data.img);
 
     //DECODE JPEG
     if (!jpeg_dec_ || !jpeg_io_ || !jpeg_out_ || !preview_image_.data) {
@@ -585,7 +693,7 @@ bool SscmaCamera::Capture() {
         size_t image_size = w * h * 2;
         size_t stride = preview_image_.header.w * 2;
 
-        uint8_t* data = (uint8_t*)heap_caps_malloc(image_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        uint8_t* data = (uint8_t*)HeapAccounting::Malloc(kHeapTagDisplay, image_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
         if (data == nullptr) {
             ESP_LOGE(TAG, "Failed to allocate memory for display image");
             return true;
@@ -613,6 +721,8 @@ bool SscmaCamera::SetVFlip(bool enabled) {
  * 问题对图像进行AI分析并返回结果。
  * 
  * @param question 要向AI提出的关于图像的问题，将作为表单字段发送
+ * @param options Ignored, the SSCMA module sends the JPEG as it encoded it. The recent inference
+ *                results of the model go along in a `detections` field
  * @return std::string 服务器返回的JSON格式响应字符串
  *         成功时包含AI分析结果，失败时包含错误信息
  *         格式示例：{"success": true, "result": "分析结果"}
@@ -622,7 +732,7 @@ bool SscmaCamera::SetVFlip(bool enabled) {
  * @note 函数会等待之前的编码线程完成后再开始新的处理
  * @warning 如果摄像头缓冲区为空或网络连接失败，将返回错误信息
  */
-std::string SscmaCamera::Explain(const std::string& question) {
+std::string SscmaCamera::Explain(const std::string& question, const ExplainOptions& options) {
     if (explain_url_.empty()) {
         return "{\"success\": false, \"message\": \"Image explain URL or token is not set\"}";
     }
@@ -638,6 +748,16 @@ std::string SscmaCamera::Explain(const std::string& question) {
     question_field += "Content-Disposition: form-data; name=\"question\"\r\n";
     question_field += "\r\n";
     question_field += question + "\r\n";
+
+    // 端侧模型的推理结果, 服务器可以不必再识别
+    std::string detections = GetDetectionsJson(DETECTIONS_MAX_AGE_MS);
+    if (!detections.empty()) {
+        question_field += "--" + boundary + "\r\n";
+        question_field += "Content-Disposition: form-data; name=\"detections\"\r\n";
+        question_field += "Content-Type: application/json\r\n";
+        question_field += "\r\n";
+        question_field += detections + "\r\n";
+    }
     
     // 构造文件字段头部
     std::string file_header;
@@ -663,20 +783,22 @@ std::string SscmaCamera::Explain(const std::string& question) {
         return "{\"success\": false, \"message\": \"Failed to connect to explain URL\"}";
     }
     
+    // The multipart parts go out in full chunks, the small ones do not cost a round trip each
+    HttpWriteBatcher body(http.get());
     // 第一块：question字段
-    http->Write(question_field.c_str(), question_field.size());
+    body.Write(question_field);
     
     // 第二块：文件字段头部
-    http->Write(file_header.c_str(), file_header.size());
+    body.Write(file_header);
     
-    // 第三块：JPEG数据
-    http->Write((const char*)jpeg_data_.buf, jpeg_data_.len);
+    // 第三块：JPEG数据, Himax 编码好的原图, 不在 ESP32 上重新编码
+    body.Write((const char*)jpeg_data_.buf, jpeg_data_.len);
 
     // 第四块：multipart尾部
-    http->Write(multipart_footer.c_str(), multipart_footer.size());
+    body.Write(multipart_footer);
     
     // 结束块
-    http->Write("", 0);
+    body.Finish();
 
     if (http->GetStatusCode() != 200) {
         ESP_LOGE(TAG, "Failed to upload photo, status code: %d", http->GetStatusCode());
@@ -689,3 +811,129 @@ std::string SscmaCamera::Explain(const std::string& question) {
     ESP_LOGI(TAG, "Explain image size=%d, question=%s\n%s", jpeg_data_.len, question.c_str(), result.c_str());
     return result;
 }
+
+bool SscmaCamera::StartStreaming(const StreamOptions& options) {
+    StopStreaming();
+    if (sscma_client_handle_ == nullptr) {
+        return false;
+    }
+    stream_options_ = options;
+    stream_options_.fps = std::clamp(options.fps, 1, 10);
+    stream_options_.bitrate_kbps = std::max(options.bitrate_kbps, 8);
+    stream_stop_ = false;
+    stream_running_ = true;
+    if (TaskPlacements::Create(kTaskCameraVideo, [](void* arg) {
+            auto self = static_cast<SscmaCamera*>(arg);
+            self->StreamLoop();
+            self->stream_running_ = false;
+            TaskPlacements::Delete(kTaskCameraVideo);
+        }, this) != pdPASS) {
+        stream_running_ = false;
+        return false;
+    }
+    ESP_LOGI(TAG, "Streaming at %d fps, %d kbps", stream_options_.fps, stream_options_.bitrate_kbps);
+    return true;
+}
+
+void SscmaCamera::StopStreaming() {
+    if (!stream_running_) {
+        return;
+    }
+    stream_stop_ = true;
+    while (stream_running_) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    ESP_LOGI(TAG, "Streaming stopped");
+}
+
+/*
+ * The Himax samples 640x480 JPEG frames without pause, and the client task of the SPI link
+ * queues the newest one while this task decodes and sends the previous one. So the transfer
+ * from the Himax overlaps the upload, and a frame that came while the upload was busy
+ * replaces the stale one instead of waiting behind it. The frames beyond the rate of the
+ * stream are dropped. The Himax decides the size and the quality of the frames, the bitrate
+ * is kept by dropping more of them.
+ */
+void SscmaCamera::StreamLoop() {
+    auto& app = Application::GetInstance();
+    {
+        std::lock_guard<std::mutex> lock(mode_mutex_);
+        sscma_client_break(sscma_client_handle_);
+        if (sscma_client_set_sensor(sscma_client_handle_, 1, 3, true) ||
+            sscma_client_sample(sscma_client_handle_, -1)) {
+            ESP_LOGE(TAG, "Failed to start sampling");
+            return;
+        }
+    }
+
+    int64_t start_us = esp_timer_get_time();
+    int64_t next_us = start_us;
+    int64_t stats_us = start_us;
+    uint32_t sent = 0, dropped = 0;
+    size_t sent_bytes = 0;
+    while (!stream_stop_) {
+        SscmaData data;
+        if (xQueueReceive(sscma_data_queue_, &data, pdMS_TO_TICKS(100)) != pdPASS) {
+            continue;
+        }
+        int64_t now_us = esp_timer_get_time();
+        if (now_us < next_us && !stream_capture_) {
+            heap_caps_free(data.img);
+            dropped++;
+            continue;
+        }
+
+        size_t size = 0;
+        stream_frame_.resize(data.len / 4 * 3 + 3);
+        int ret = mbedtls_base64_decode(stream_frame_.data(), stream_frame_.size(), &size, data.img, data.len);
+        heap_caps_free(data.img);
+        if (ret != 0 || size == 0) {
+            dropped++;
+            continue;
+        }
+        stream_frame_.resize(size);
+
+        if (stream_capture_ && size <= IMG_JPEG_BUF_SIZE) {
+            memcpy(jpeg_data_.buf, stream_frame_.data(), size);
+            jpeg_data_.len = size;
+            stream_capture_ = false;
+            xSemaphoreGive(stream_captured_);
+        }
+        if (now_us < next_us) {
+            continue;
+        }
+
+        // The conversation goes first, the frames are four times rarer while it listens or speaks
+        int64_t interval_us = 1000000 / stream_options_.fps;
+        auto state = app.GetDeviceState();
+        if (state == kDeviceStateListening || state == kDeviceStateSpeaking) {
+            interval_us *= 4;
+        }
+        next_us = now_us + interval_us;
+        if (app.SendVideoFrame(stream_frame_, (now_us - start_us) / 1000)) {
+            sent++;
+            sent_bytes += size;
+        } else {
+            dropped++;
+        }
+
+        // A frame over the budget of the bitrate delays the next one
+        size_t budget = (size_t)stream_options_.bitrate_kbps * 125 * interval_us / 1000000;
+        if (size > budget) {
+            next_us = std::max(next_us, now_us + (int64_t)size * 8000 / stream_options_.bitrate_kbps);
+        }
+
+        if (now_us - stats_us >= 10 * 1000000) {
+            ESP_LOGI(TAG, "Stream: %lu frames sent (%u KB), %lu dropped", (unsigned long)sent,
+                     (unsigned)(sent_bytes / 1024), (unsigned long)dropped);
+            stats_us = now_us;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mode_mutex_);
+    sscma_client_break(sscma_client_handle_);
+    SscmaData data;
+    while (xQueueReceive(sscma_data_queue_, &data, 0) == pdPASS) {
+        heap_caps_free(data.img);
+    }
+}
@@ -5,9 +5,14 @@
 #include <lvgl.h>
 #include <thread>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include <esp_io_expander_tca95xx_16bit.h>
 #include <esp_jpeg_dec.h>
 #include <mbedtls/base64.h>
@@ -23,6 +28,15 @@ struct JpegData {
     uint8_t* buf;
     size_t len;
 };
+// An inference result of the Himax model, w and h are 0 for a class or a key point
+struct SscmaDetection {
+    int target;
+    int score;
+    int x;
+    int y;
+    int w;
+    int h;
+};
 
 class SscmaCamera : public Camera {
 private:
@@ -57,6 +71,30 @@ private:
     
     sscma_client_model_t *model;
     int model_class_cnt = 0;
+
+    // Himax 的模式切换（推理、视频流、拍照）互斥
+    std::mutex mode_mutex_;
+
+    // The stream of the JPEG frames the Himax encodes, see StartStreaming()
+    StreamOptions stream_options_;
+    std::atomic<bool> stream_stop_ = false;
+    std::atomic<bool> stream_running_ = false;
+    std::vector<uint8_t> stream_frame_;
+    // Capture() while streaming takes the next streamed frame instead of sampling one
+    std::atomic<bool> stream_capture_ = false;
+    SemaphoreHandle_t stream_captured_ = nullptr;
+
+    // The last inference results
+    std::mutex detections_mutex_;
+    const char* detections_kind_ = nullptr;
+    std::vector<SscmaDetection> detections_;
+    int64_t detections_us_ = 0;
+
+    void StreamLoop();
+    void SaveDetections(const char* kind, std::vector<SscmaDetection>&& detections);
+    // The last results with the class names, null when there are none from the last max_age_ms
+    std::string GetDetectionsJson(int max_age_ms);
+    const char* ClassName(int target) const;
 public:
     SscmaCamera(esp_io_expander_handle_t io_exp_handle);
     ~SscmaCamera();
@@ -67,7 +105,11 @@ public:
     // 翻转控制函数
     virtual bool SetHMirror(bool enabled) override;
     virtual bool SetVFlip(bool enabled) override;
-    virtual std::string Explain(const std::string& question);
+    virtual std::string Explain(const std::string& question, const ExplainOptions& options = {});
+    // Streams the JPEG frames of the Himax as they are, there is no encoding on the ESP32
+    virtual bool StartStreaming(const StreamOptions& options) override;
+    virtual void StopStreaming() override;
+    virtual bool IsStreaming() override { return stream_running_; }
 
 };
 
@@ -41,19 +41,20 @@ public:
 
 class CustomButton: public Button {
 public:
+    using Button::Button;
+
+    // GPIO 按键在中断模式下没有 iot_button 句柄, 清掉回调即可
     void OnPressDownDel(void) {
-        if (button_handle_ == nullptr) {
-            return;
-        }
         on_press_down_ = NULL;
-        iot_button_unregister_cb(button_handle_, BUTTON_PRESS_DOWN, nullptr);
+        if (button_handle_ != nullptr) {
+            iot_button_unregister_cb(button_handle_, BUTTON_PRESS_DOWN, nullptr);
+        }
     }
     void OnPressUpDel(void) {
-        if (button_handle_ == nullptr) {
-            return;
-        }
         on_press_up_ = NULL;
-        iot_button_unregister_cb(button_handle_, BUTTON_PRESS_UP, nullptr);
+        if (button_handle_ != nullptr) {
+            iot_button_unregister_cb(button_handle_, BUTTON_PRESS_UP, nullptr);
+        }
     }
 };
 
@@ -80,7 +80,7 @@ private:
             .dpi_clk_src = MIPI_DSI_DPI_CLK_SRC_DEFAULT,
             .dpi_clock_freq_mhz = 52,
             .pixel_format = LCD_COLOR_PIXEL_FORMAT_RGB565,
-            .num_fbs = 1,
+            .num_fbs = 2,  // Drawn in turn by LcdDirectRenderer
             .video_timing = {
                 .h_size = 1024,
                 .v_size = 600,
@@ -76,8 +76,11 @@ void PowerManager::Initialize(){
     ESP_ERROR_CHECK(gpio_config(&io_conf_batt_mon));
     // 创建电量GPIO事件队列
     gpio_evt_queue = xQueueCreate(2, sizeof(uint32_t));
-    // 安装电量GPIO ISR服务
-    ESP_ERROR_CHECK(gpio_install_isr_service(0));
+    // 安装电量GPIO ISR服务，按键的 InputEvents 可能已经安装过
+    esp_err_t ret = gpio_install_isr_service(0);
+    if (ret != ESP_ERR_INVALID_STATE) {
+        ESP_ERROR_CHECK(ret);
+    }
     // 添加中断处理
     ESP_ERROR_CHECK(gpio_isr_handler_add(MON_BATT_PIN, batt_mon_isr_handler, (void*)MON_BATT_PIN));
      // 创建监控任务
@@ -0,0 +1,114 @@
+#include "boot_sequence.h"
+#include "task_placement.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/task.h>
+#include <string>
+#include <algorithm>
+
+#define TAG "BootSequence"
+
+#define BOOT_WORKER_DONE_BIT (1 << BOOT_SEQUENCE_MAX_STEPS)
+
+BootSequence::BootSequence() {
+    event_group_ = xEventGroupCreate();
+}
+
+BootSequence::~BootSequence() {
+    vEventGroupDelete(event_group_);
+}
+
+int BootSequence::AddStep(const char* name, BootLane lane, const std::vector<int>& dependencies, std::function<void()> run) {
+    if (steps_.size() >= BOOT_SEQUENCE_MAX_STEPS) {
+        ESP_LOGE(TAG, "Too many boot steps, %s runs right away", name);
+        run();
+        return -1;
+    }
+    EventBits_t bits = 0;
+    for (int dependency : dependencies) {
+        // Only earlier steps, which keeps the graph acyclic
+        if (dependency >= 0 && dependency < static_cast<int>(steps_.size())) {
+            bits |= 1 << dependency;
+        }
+    }
+    steps_.push_back({name, lane, bits, std::move(run)});
+    return steps_.size() - 1;
+}
+
+void BootSequence::Run() {
+    bool has_worker = false;
+    for (auto& step : steps_) {
+        has_worker |= step.lane == kBootLaneWorker;
+    }
+    if (has_worker) {
+        TaskPlacements::Create(kTaskBootWorker, [](void* arg) {
+            auto sequence = (BootSequence*)arg;
+            sequence->RunLane(kBootLaneWorker);
+            xEventGroupSetBits(sequence->event_group_, BOOT_WORKER_DONE_BIT);
+            vTaskDelete(NULL);
+        }, this);
+    }
+    RunLane(kBootLaneMain);
+    if (has_worker) {
+        xEventGroupWaitBits(event_group_, BOOT_WORKER_DONE_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+}
+
+void BootSequence::RunLane(BootLane lane) {
+    for (size_t i = 0; i < steps_.size(); i++) {
+        auto& step = steps_[i];
+        if (step.lane != lane) {
+            continue;
+        }
+        step.lane_free_us = esp_timer_get_time();
+        if (step.dependencies != 0) {
+            xEventGroupWaitBits(event_group_, step.dependencies, pdFALSE, pdTRUE, portMAX_DELAY);
+        }
+        step.start_us = esp_timer_get_time();
+        step.run();
+        step.end_us = esp_timer_get_time();
+        xEventGroupSetBits(event_group_, 1 << i);
+    }
+}
+
+int64_t BootSequence::GetReadyTimeMs() const {
+    int64_t end_us = 0;
+    for (auto& step : steps_) {
+        end_us = std::max(end_us, step.end_us);
+    }
+    return end_us / 1000;
+}
+
+void BootSequence::PrintTimeline() const {
+    ESP_LOGI(TAG, "Boot timeline (ms since power-on):");
+    for (auto& step : steps_) {
+        ESP_LOGI(TAG, "  %-10s %-6s start %6lld  wait %5lld  run %5lld  end %6lld", step.name,
+            step.lane == kBootLaneMain ? "main" : "worker", step.start_us / 1000,
+            (step.start_us - step.lane_free_us) / 1000, (step.end_us - step.start_us) / 1000, step.end_us / 1000);
+    }
+
+    // Walk back from the step that ended last, through whatever each step waited for: the
+    // dependency that ended last, or the previous step of its own lane
+    int current = -1;
+    for (size_t i = 0; i < steps_.size(); i++) {
+        if (current < 0 || steps_[i].end_us > steps_[current].end_us) {
+            current = i;
+        }
+    }
+    std::string path;
+    while (current >= 0) {
+        auto& step = steps_[current];
+        path = path.empty() ? step.name : std::string(step.name) + " > " + path;
+        int blocker = -1;
+        for (int i = current - 1; i >= 0; i--) {
+            bool dependency = step.dependencies & (1 << i);
+            bool lane = steps_[i].lane == step.lane;
+            if ((dependency || lane) && (blocker < 0 || steps_[i].end_us > steps_[blocker].end_us)) {
+                blocker = i;
+            }
+        }
+        current = blocker;
+    }
+    ESP_LOGI(TAG, "Ready at %lld ms, critical path: %s", GetReadyTimeMs(), path.c_str());
+}
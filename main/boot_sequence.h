@@ -0,0 +1,63 @@
+#ifndef BOOT_SEQUENCE_H
+#define BOOT_SEQUENCE_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+
+#include <functional>
+#include <vector>
+#include <cstdint>
+
+// One event bit per step, the last bit tells the worker lane is done
+#define BOOT_SEQUENCE_MAX_STEPS 23
+
+enum BootLane {
+    kBootLaneMain,      // The task calling Run()
+    kBootLaneWorker,    // A helper task that only lives during Run()
+};
+
+/*
+ * The boot steps as a dependency graph over two lanes.
+ *
+ * Each lane runs its steps in the order they were added, a step first waits for its
+ * dependencies, which may run in the other lane. Steps can only depend on steps added before
+ * them, so the graph is acyclic and the lanes never wait on each other in a loop. The steps
+ * that talk to the network or change the device state belong in the main lane, the ones that
+ * only prepare local resources (assets, models, tool lists) in the worker lane.
+ *
+ * Every step is timestamped, PrintTimeline() logs the steps since power-on with their wait and
+ * run times and the critical path, the chain of steps the boot time actually waited on.
+ */
+class BootSequence {
+public:
+    BootSequence();
+    ~BootSequence();
+    BootSequence(const BootSequence&) = delete;
+    BootSequence& operator=(const BootSequence&) = delete;
+
+    // Returns the id to list in the dependencies of later steps
+    int AddStep(const char* name, BootLane lane, const std::vector<int>& dependencies, std::function<void()> run);
+    // Returns when every step is done
+    void Run();
+    // Time from power-on to the end of the last step
+    int64_t GetReadyTimeMs() const;
+    void PrintTimeline() const;
+
+private:
+    struct Step {
+        const char* name;
+        BootLane lane;
+        EventBits_t dependencies;
+        std::function<void()> run;
+        int64_t lane_free_us = 0;   // The previous step of the lane ended
+        int64_t start_us = 0;
+        int64_t end_us = 0;
+    };
+
+    std::vector<Step> steps_;
+    EventGroupHandle_t event_group_;
+
+    void RunLane(BootLane lane);
+};
+
+#endif // BOOT_SEQUENCE_H
@@ -0,0 +1,230 @@
+#include "cpu_sampler.h"
+
+#if CONFIG_USE_TASK_CPU_SAMPLER
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "CpuSampler"
+
+CpuSampler::~CpuSampler() {
+    if (timer_ != nullptr) {
+        esp_timer_stop(timer_);
+        esp_timer_delete(timer_);
+    }
+}
+
+void CpuSampler::Start() {
+    if (timer_ != nullptr) {
+        return;
+    }
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        idle_tasks_[core] = xTaskGetIdleTaskHandleForCore(core);
+    }
+
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            ((CpuSampler*)arg)->Sample();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "cpu_sampler",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&timer_args, &timer_);
+    // The first sample only takes the counters, the usage starts with the second one
+    Sample();
+    esp_timer_start_periodic(timer_, CONFIG_TASK_CPU_SAMPLE_INTERVAL_MS * 1000);
+}
+
+CpuSampler::TaskSlot* CpuSampler::FindSlot(TaskHandle_t handle) {
+    TaskSlot* free_slot = nullptr;
+    for (auto& slot : tasks_) {
+        if (slot.handle == handle) {
+            return &slot;
+        }
+        if (slot.handle == nullptr && free_slot == nullptr) {
+            free_slot = &slot;
+        }
+    }
+    return free_slot;
+}
+
+void CpuSampler::Sample() {
+    // Some room for the tasks created in between, the snapshot fails when the array is short
+    size_t capacity = uxTaskGetNumberOfTasks() + 4;
+    if (status_.size() < capacity) {
+        status_.resize(capacity);
+    }
+    configRUN_TIME_COUNTER_TYPE total = 0;
+    UBaseType_t count = uxTaskGetSystemState(status_.data(), status_.size(), &total);
+    if (count == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Unsigned, the deltas stay right when a counter wraps
+    configRUN_TIME_COUNTER_TYPE elapsed = total - total_;
+    total_ = total;
+    bool baseline = serial_ == 0;
+    serial_++;
+    if (!baseline) {
+        head_ = (head_ + 1) % CPU_SAMPLER_HISTORY;
+        samples_ = std::min<size_t>(samples_ + 1, CPU_SAMPLER_HISTORY);
+        for (int core = 0; core < portNUM_PROCESSORS; core++) {
+            core_load_[core][head_] = 0;
+        }
+    }
+
+    for (UBaseType_t i = 0; i < count; i++) {
+        auto& status = status_[i];
+        auto slot = FindSlot(status.xHandle);
+        if (slot == nullptr) {
+            continue;
+        }
+        uint8_t percent = kUnknown;
+        if (slot->handle != nullptr && strncmp(slot->name, status.pcTaskName, sizeof(slot->name) - 1) != 0) {
+            // A new task in the control block of a deleted one
+            slot->handle = nullptr;
+        }
+        if (slot->handle == nullptr) {
+            // New task, its usage shows from the next sample on
+            slot->handle = status.xHandle;
+            strncpy(slot->name, status.pcTaskName, sizeof(slot->name) - 1);
+            slot->name[sizeof(slot->name) - 1] = '\0';
+#if CONFIG_FREERTOS_VTASKLIST_INCLUDE_COREID
+            slot->core = status.xCoreID == tskNO_AFFINITY ? -1 : status.xCoreID;
+#endif
+            std::fill(slot->history, slot->history + CPU_SAMPLER_HISTORY, kUnknown);
+        } else if (!baseline && elapsed > 0) {
+            uint64_t used = status.ulRunTimeCounter - slot->counter;
+            percent = std::min<uint64_t>(used * 100 / elapsed, 100);
+        }
+        slot->counter = status.ulRunTimeCounter;
+        slot->serial = serial_;
+        if (baseline) {
+            continue;
+        }
+        slot->history[head_] = percent;
+
+        for (int core = 0; core < portNUM_PROCESSORS; core++) {
+            if (status.xHandle == idle_tasks_[core] && percent != kUnknown) {
+                core_load_[core][head_] = 100 - percent;
+            }
+        }
+    }
+
+    // The tasks missing from the snapshot were deleted
+    for (auto& slot : tasks_) {
+        if (slot.handle != nullptr && slot.serial != serial_) {
+            slot.handle = nullptr;
+        }
+    }
+}
+
+std::vector<CpuSampler::TaskUsage> CpuSampler::GetUsage() {
+    std::vector<TaskUsage> usage;
+    for (auto& slot : tasks_) {
+        // The idle tasks are in the core load instead
+        auto idle_end = idle_tasks_ + portNUM_PROCESSORS;
+        if (slot.handle == nullptr || std::find(idle_tasks_, idle_end, slot.handle) != idle_end) {
+            continue;
+        }
+        int last = slot.history[head_];
+        int sum = 0;
+        int known = 0;
+        int max = 0;
+        for (uint8_t percent : slot.history) {
+            if (percent != kUnknown) {
+                sum += percent;
+                known++;
+                max = std::max<int>(max, percent);
+            }
+        }
+        if (known == 0) {
+            continue;
+        }
+        usage.push_back({slot.name, slot.core, last == kUnknown ? 0 : last, sum / known, max});
+    }
+    std::sort(usage.begin(), usage.end(), [](const TaskUsage& a, const TaskUsage& b) {
+        return a.average > b.average;
+    });
+    return usage;
+}
+
+cJSON* CpuSampler::GetStatsJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "interval_ms", CONFIG_TASK_CPU_SAMPLE_INTERVAL_MS);
+    cJSON_AddNumberToObject(json, "samples", samples_);
+
+    cJSON* core_load = cJSON_CreateArray();
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        cJSON* history = cJSON_CreateArray();
+        for (size_t i = samples_; i > 0; i--) {
+            size_t index = (head_ + CPU_SAMPLER_HISTORY - i + 1) % CPU_SAMPLER_HISTORY;
+            cJSON_AddItemToArray(history, cJSON_CreateNumber(core_load_[core][index]));
+        }
+        cJSON_AddItemToArray(core_load, history);
+    }
+    cJSON_AddItemToObject(json, "core_load", core_load);
+
+    cJSON* tasks = cJSON_CreateArray();
+    for (auto& usage : GetUsage()) {
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "name", usage.name);
+        cJSON_AddNumberToObject(item, "core", usage.core);
+        cJSON_AddNumberToObject(item, "last", usage.last);
+        cJSON_AddNumberToObject(item, "average", usage.average);
+        cJSON_AddNumberToObject(item, "max", usage.max);
+        cJSON_AddItemToArray(tasks, item);
+    }
+    cJSON_AddItemToObject(json, "tasks", tasks);
+    return json;
+}
+
+cJSON* CpuSampler::GetSummaryJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cJSON* json = cJSON_CreateObject();
+
+    cJSON* load = cJSON_CreateArray();
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        int sum = 0;
+        for (size_t i = 0; i < samples_; i++) {
+            sum += core_load_[core][(head_ + CPU_SAMPLER_HISTORY - i) % CPU_SAMPLER_HISTORY];
+        }
+        cJSON_AddItemToArray(load, cJSON_CreateNumber(samples_ > 0 ? sum / (int)samples_ : 0));
+    }
+    cJSON_AddItemToObject(json, "load", load);
+
+    cJSON* top = cJSON_CreateArray();
+    auto usage = GetUsage();
+    for (size_t i = 0; i < std::min<size_t>(usage.size(), CPU_SAMPLER_STATUS_TOP); i++) {
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "name", usage[i].name);
+        cJSON_AddNumberToObject(item, "cpu", usage[i].average);
+        cJSON_AddItemToArray(top, item);
+    }
+    cJSON_AddItemToObject(json, "top", top);
+    return json;
+}
+
+int CpuSampler::GetLastSample(int* core_load, CpuTaskLoad* top, int count) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        core_load[core] = samples_ > 0 ? core_load_[core][head_] : 0;
+    }
+    auto usage = GetUsage();
+    std::sort(usage.begin(), usage.end(), [](const TaskUsage& a, const TaskUsage& b) {
+        return a.last > b.last;
+    });
+    int written = std::min<int>(usage.size(), count);
+    for (int i = 0; i < written; i++) {
+        strlcpy(top[i].name, usage[i].name, sizeof(top[i].name));
+        top[i].cpu = usage[i].last;
+    }
+    return written;
+}
+
+#endif // CONFIG_USE_TASK_CPU_SAMPLER
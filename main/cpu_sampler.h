@@ -0,0 +1,109 @@
+#ifndef CPU_SAMPLER_H
+#define CPU_SAMPLER_H
+
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include <cJSON.h>
+
+#include <mutex>
+#include <vector>
+#include <cstdint>
+
+// Tasks tracked at once, a task created while the table is full is left out
+#define CPU_SAMPLER_MAX_TASKS 40
+// Samples kept per task and per core, one minute at the default interval
+#define CPU_SAMPLER_HISTORY 12
+// Tasks listed in the device status
+#define CPU_SAMPLER_STATUS_TOP 3
+
+struct CpuTaskLoad {
+    char name[configMAX_TASK_NAME_LEN];
+    int cpu;    // Percent of one core
+};
+
+/*
+ * Per task CPU usage, sampled in the background from the FreeRTOS run time counters.
+ *
+ * Every CONFIG_TASK_CPU_SAMPLE_INTERVAL_MS the esp_timer task takes one snapshot of the task
+ * list and turns the counter deltas into the percentage of one core each task used since the
+ * previous snapshot. The load of a core is whatever its idle task did not use. The last
+ * CPU_SAMPLER_HISTORY samples are kept in a ring, nothing blocks the caller the way
+ * SystemInfo::PrintTaskCpuUsage() does.
+ *
+ * Without CONFIG_USE_TASK_CPU_SAMPLER every method is an empty inline.
+ */
+class CpuSampler {
+public:
+    static CpuSampler& GetInstance() {
+        static CpuSampler instance;
+        return instance;
+    }
+    CpuSampler(const CpuSampler&) = delete;
+    CpuSampler& operator=(const CpuSampler&) = delete;
+
+#if CONFIG_USE_TASK_CPU_SAMPLER
+    void Start();
+
+    // {"interval_ms", "samples", "core_load": [[oldest, ..., newest], ...],
+    //  "tasks": [{"name", "core", "last", "average", "max"}, ...]}, busiest first
+    cJSON* GetStatsJson();
+    // {"load": [average per core], "top": [{"name", "cpu"}, ...]}, for the device status
+    cJSON* GetSummaryJson();
+    // The last sample: the load of each core and the busiest tasks, returns the tasks written
+    int GetLastSample(int* core_load, CpuTaskLoad* top, int count);
+#else
+    void Start() {}
+    cJSON* GetStatsJson() { return cJSON_CreateObject(); }
+    cJSON* GetSummaryJson() { return cJSON_CreateObject(); }
+    int GetLastSample(int* core_load, CpuTaskLoad* top, int count) { return 0; }
+#endif
+
+private:
+    CpuSampler() = default;
+
+#if CONFIG_USE_TASK_CPU_SAMPLER
+    ~CpuSampler();
+
+    // A history entry of a task that was not alive at that sample
+    static constexpr uint8_t kUnknown = 0xFF;
+
+    struct TaskSlot {
+        TaskHandle_t handle = nullptr;
+        char name[configMAX_TASK_NAME_LEN];
+        int core = -1;
+        configRUN_TIME_COUNTER_TYPE counter = 0;
+        uint32_t serial = 0;    // The last sample that saw the task
+        uint8_t history[CPU_SAMPLER_HISTORY];   // Percent of one core
+    };
+
+    struct TaskUsage {
+        const char* name;
+        int core;
+        int last;
+        int average;
+        int max;
+    };
+
+    // Guards everything below, the samples are taken in the esp_timer task
+    std::mutex mutex_;
+    TaskSlot tasks_[CPU_SAMPLER_MAX_TASKS];
+    uint8_t core_load_[portNUM_PROCESSORS][CPU_SAMPLER_HISTORY] = {};
+    TaskHandle_t idle_tasks_[portNUM_PROCESSORS] = {};
+    // Only touched by the esp_timer task
+    std::vector<TaskStatus_t> status_;
+    configRUN_TIME_COUNTER_TYPE total_ = 0;
+    uint32_t serial_ = 0;
+    size_t head_ = 0;       // The newest sample
+    size_t samples_ = 0;
+    esp_timer_handle_t timer_ = nullptr;
+
+    void Sample();
+    TaskSlot* FindSlot(TaskHandle_t handle);
+    // Called with the lock held
+    std::vector<TaskUsage> GetUsage();
+#endif
+};
+
+#endif // CPU_SAMPLER_H
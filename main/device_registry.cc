@@ -4,13 +4,17 @@
 
 #include <algorithm>
 #include <cctype>
+#include <cstdio>
 #include <esp_log.h>
 #include <cJSON.h>
 
 namespace {
 constexpr const char* kTag = "DeviceRegistry";
 constexpr const char* kNamespace = "devices";
-constexpr const char* kProfilesKey = "profiles";
+// The whole list as one JSON array, before the records of each profile
+constexpr const char* kLegacyProfilesKey = "profiles";
+// The record keys of the profiles, separated by commas
+constexpr const char* kProfileKeysKey = "profile_keys";
 constexpr const char* kPreferredSessionKey = "preferred_session";
 
 std::string NormalizeMacAddress(const std::string& mac_address) {
@@ -73,6 +77,29 @@ DeviceProfile ParseProfile(const cJSON* node) {
     return NormalizeProfile(profile);
 }
 
+// "p" and the FNV-1a hash of the MAC, or of the ID without a MAC, fits the 15 characters of NVS
+std::string ProfileRecordKey(const DeviceProfile& profile) {
+    const std::string& identity = profile.mac_address.empty() ? profile.device_id : profile.mac_address;
+    uint32_t hash = profile.mac_address.empty() ? 0x811c9dc5u ^ 'i' : 0x811c9dc5u;
+    for (char ch : identity) {
+        hash = (hash ^ static_cast<unsigned char>(ch)) * 16777619u;
+    }
+    char key[16];
+    snprintf(key, sizeof(key), "p%08lx", static_cast<unsigned long>(hash));
+    return key;
+}
+
+std::string PrintProfile(const DeviceProfile& profile) {
+    cJSON* node = SerializeProfile(profile);
+    char* json = cJSON_PrintUnformatted(node);
+    std::string text = json != nullptr ? json : "";
+    if (json != nullptr) {
+        cJSON_free(json);
+    }
+    cJSON_Delete(node);
+    return text;
+}
+
 void LoadPreferredSession(std::string& preferred_session_id) {
     Settings settings(kNamespace, false);
     preferred_session_id = settings.GetString(kPreferredSessionKey, "");
@@ -86,13 +113,23 @@ DeviceRegistry& DeviceRegistry::GetInstance() {
 }
 
 DeviceRegistry::DeviceRegistry() {
+    std::lock_guard<std::mutex> lock(mutex_);
     LoadProfilesLocked();
     LoadPreferredSession(preferred_session_id_);
+    PublishProfilesLocked();
+    PublishSessionsLocked();
+}
+
+std::shared_ptr<const DeviceRegistry::ProfilesView> DeviceRegistry::GetProfilesView() const {
+    return std::atomic_load(&profiles_view_);
+}
+
+std::shared_ptr<const DeviceRegistry::SessionsView> DeviceRegistry::GetSessionsView() const {
+    return std::atomic_load(&sessions_view_);
 }
 
 std::vector<DeviceProfile> DeviceRegistry::GetProfiles() const {
-    std::lock_guard<std::mutex> lock(mutex_);
-    return profiles_;
+    return GetProfilesView()->profiles;
 }
 
 bool DeviceRegistry::AddOrUpdateProfile(const DeviceProfile& profile) {
@@ -109,64 +146,71 @@ bool DeviceRegistry::AddOrUpdateProfile(const DeviceProfile& profile) {
     };
     auto it = std::find_if(profiles_.begin(), profiles_.end(), predicate);
     if (it != profiles_.end()) {
+        bool moved = ProfileRecordKey(*it) != ProfileRecordKey(normalized);
+        if (moved) {
+            ErasePersistedProfileLocked(*it);
+        }
         *it = normalized;
+        PersistProfileLocked(normalized, moved);
     } else {
         profiles_.push_back(normalized);
+        PersistProfileLocked(normalized, true);
     }
-    PersistProfilesLocked();
+    PublishProfilesLocked();
     return true;
 }
 
 bool DeviceRegistry::RemoveProfileByMac(const std::string& mac_address) {
     std::string normalized_mac = NormalizeMac(mac_address);
     std::lock_guard<std::mutex> lock(mutex_);
-    auto size_before = profiles_.size();
-    profiles_.erase(std::remove_if(profiles_.begin(), profiles_.end(), [&](const DeviceProfile& profile) {
-                        return profile.mac_address == normalized_mac;
-                    }),
-                    profiles_.end());
-    if (profiles_.size() == size_before) {
+    auto removed = std::stable_partition(profiles_.begin(), profiles_.end(), [&](const DeviceProfile& profile) {
+        return profile.mac_address != normalized_mac;
+    });
+    if (removed == profiles_.end()) {
         return false;
     }
-    PersistProfilesLocked();
+    for (auto it = removed; it != profiles_.end(); ++it) {
+        ErasePersistedProfileLocked(*it);
+    }
+    profiles_.erase(removed, profiles_.end());
+    PersistProfileKeysLocked();
+    PublishProfilesLocked();
     return true;
 }
 
 bool DeviceRegistry::RemoveProfileById(const std::string& device_id) {
     std::lock_guard<std::mutex> lock(mutex_);
-    auto size_before = profiles_.size();
-    profiles_.erase(std::remove_if(profiles_.begin(), profiles_.end(), [&](const DeviceProfile& profile) {
-                        return profile.device_id == device_id;
-                    }),
-                    profiles_.end());
-    if (profiles_.size() == size_before) {
+    auto removed = std::stable_partition(profiles_.begin(), profiles_.end(), [&](const DeviceProfile& profile) {
+        return profile.device_id != device_id;
+    });
+    if (removed == profiles_.end()) {
         return false;
     }
-    PersistProfilesLocked();
+    for (auto it = removed; it != profiles_.end(); ++it) {
+        ErasePersistedProfileLocked(*it);
+    }
+    profiles_.erase(removed, profiles_.end());
+    PersistProfileKeysLocked();
+    PublishProfilesLocked();
     return true;
 }
 
 std::optional<DeviceProfile> DeviceRegistry::GetProfileByMac(const std::string& mac_address) const {
-    std::string normalized_mac = NormalizeMac(mac_address);
-    std::lock_guard<std::mutex> lock(mutex_);
-    auto it = std::find_if(profiles_.begin(), profiles_.end(), [&](const DeviceProfile& profile) {
-        return profile.mac_address == normalized_mac;
-    });
-    if (it == profiles_.end()) {
+    auto view = GetProfilesView();
+    auto it = view->by_mac.find(NormalizeMac(mac_address));
+    if (it == view->by_mac.end()) {
         return std::nullopt;
     }
-    return *it;
+    return view->profiles[it->second];
 }
 
 std::optional<DeviceProfile> DeviceRegistry::GetProfileById(const std::string& device_id) const {
-    std::lock_guard<std::mutex> lock(mutex_);
-    auto it = std::find_if(profiles_.begin(), profiles_.end(), [&](const DeviceProfile& profile) {
-        return profile.device_id == device_id;
-    });
-    if (it == profiles_.end()) {
+    auto view = GetProfilesView();
+    auto it = view->by_id.find(device_id);
+    if (it == view->by_id.end()) {
         return std::nullopt;
     }
-    return *it;
+    return view->profiles[it->second];
 }
 
 void DeviceRegistry::UpdateSessions(const std::vector<DeviceRegistry::SessionInfo>& sessions) {
@@ -201,54 +245,31 @@ void DeviceRegistry::UpdateSessions(const std::vector<DeviceRegistry::SessionInf
     for (auto& [session_id, info] : sessions_) {
         info.is_preferred = (session_id == preferred_session_id_);
     }
+    PublishSessionsLocked();
 }
 
 std::vector<DeviceRegistry::SessionInfo> DeviceRegistry::GetSessions() const {
-    std::lock_guard<std::mutex> lock(mutex_);
-    std::vector<DeviceRegistry::SessionInfo> sessions;
-    sessions.reserve(sessions_.size());
-    for (const auto& [_, info] : sessions_) {
-        sessions.push_back(info);
-    }
-    std::sort(sessions.begin(), sessions.end(), [](const DeviceRegistry::SessionInfo& lhs, const DeviceRegistry::SessionInfo& rhs) {
-        if (lhs.is_preferred != rhs.is_preferred) {
-            return lhs.is_preferred && !rhs.is_preferred;
-        }
-        if (lhs.is_active != rhs.is_active) {
-            return lhs.is_active && !rhs.is_active;
-        }
-        return lhs.session_id < rhs.session_id;
-    });
-    return sessions;
+    return *GetSessionsView();
 }
 
 std::optional<DeviceRegistry::SessionInfo> DeviceRegistry::GetActiveSession() const {
-    std::lock_guard<std::mutex> lock(mutex_);
-    if (!preferred_session_id_.empty()) {
-        auto it = sessions_.find(preferred_session_id_);
-        if (it != sessions_.end()) {
-            return it->second;
-        }
-    }
-    auto it = std::find_if(sessions_.begin(), sessions_.end(), [](const auto& entry) {
-        return entry.second.is_active;
-    });
-    if (it != sessions_.end()) {
-        return it->second;
-    }
-    if (!sessions_.empty()) {
-        return sessions_.begin()->second;
+    // The view starts with the preferred session, then the active ones
+    auto view = GetSessionsView();
+    if (view->empty()) {
+        return std::nullopt;
     }
-    return std::nullopt;
+    return view->front();
 }
 
 std::optional<DeviceRegistry::SessionInfo> DeviceRegistry::FindSession(const std::string& session_id) const {
-    std::lock_guard<std::mutex> lock(mutex_);
-    auto it = sessions_.find(session_id);
-    if (it == sessions_.end()) {
+    auto view = GetSessionsView();
+    auto it = std::find_if(view->begin(), view->end(), [&](const SessionInfo& info) {
+        return info.session_id == session_id;
+    });
+    if (it == view->end()) {
         return std::nullopt;
     }
-    return it->second;
+    return *it;
 }
 
 bool DeviceRegistry::SetPreferredSession(const std::string& session_id) {
@@ -263,25 +284,44 @@ bool DeviceRegistry::SetPreferredSession(const std::string& session_id) {
         info.is_preferred = (id == preferred_session_id_);
     }
     PersistPreferredSessionLocked();
+    PublishSessionsLocked();
     return true;
 }
 
 void DeviceRegistry::LoadProfilesLocked() {
+    profiles_.clear();
     Settings settings(kNamespace, false);
-    std::string json = settings.GetString(kProfilesKey, "");
-    if (json.empty()) {
-        profiles_.clear();
+    std::string keys = settings.GetString(kProfileKeysKey, "");
+    size_t start = 0;
+    while (start < keys.size()) {
+        size_t end = keys.find(',', start);
+        if (end == std::string::npos) {
+            end = keys.size();
+        }
+        std::string json = settings.GetString(keys.substr(start, end - start), "");
+        start = end + 1;
+        cJSON* node = cJSON_Parse(json.c_str());
+        if (cJSON_IsObject(node)) {
+            profiles_.push_back(ParseProfile(node));
+        } else {
+            ESP_LOGW(kTag, "Failed to parse a stored profile");
+        }
+        cJSON_Delete(node);
+    }
+    if (!keys.empty()) {
         return;
     }
 
+    // The list of the earlier firmware moves to one record per profile
+    std::string json = settings.GetString(kLegacyProfilesKey, "");
+    if (json.empty()) {
+        return;
+    }
     cJSON* root = cJSON_Parse(json.c_str());
     if (root == nullptr) {
         ESP_LOGW(kTag, "Failed to parse stored profiles");
-        profiles_.clear();
         return;
     }
-
-    profiles_.clear();
     if (cJSON_IsArray(root)) {
         cJSON* item = nullptr;
         cJSON_ArrayForEach(item, root) {
@@ -292,20 +332,69 @@ void DeviceRegistry::LoadProfilesLocked() {
         }
     }
     cJSON_Delete(root);
+    for (const auto& profile : profiles_) {
+        PersistProfileLocked(profile, false);
+    }
+    PersistProfileKeysLocked();
+    Settings(kNamespace, true).EraseKey(kLegacyProfilesKey);
+}
+
+void DeviceRegistry::PersistProfileLocked(const DeviceProfile& profile, bool added) {
+    Settings settings(kNamespace, true);
+    settings.SetString(ProfileRecordKey(profile), PrintProfile(profile));
+    if (added) {
+        PersistProfileKeysLocked();
+    }
+}
+
+void DeviceRegistry::ErasePersistedProfileLocked(const DeviceProfile& profile) {
+    Settings settings(kNamespace, true);
+    settings.EraseKey(ProfileRecordKey(profile));
 }
 
-void DeviceRegistry::PersistProfilesLocked() {
-    cJSON* root = cJSON_CreateArray();
+void DeviceRegistry::PersistProfileKeysLocked() {
+    std::string keys;
     for (const auto& profile : profiles_) {
-        cJSON_AddItemToArray(root, SerializeProfile(profile));
+        if (!keys.empty()) {
+            keys += ',';
+        }
+        keys += ProfileRecordKey(profile);
     }
-    char* json = cJSON_PrintUnformatted(root);
     Settings settings(kNamespace, true);
-    settings.SetString(kProfilesKey, json != nullptr ? json : "");
-    if (json != nullptr) {
-        cJSON_free(json);
+    settings.SetString(kProfileKeysKey, keys);
+}
+
+void DeviceRegistry::PublishProfilesLocked() {
+    auto view = std::make_shared<ProfilesView>();
+    view->profiles = profiles_;
+    for (size_t i = 0; i < profiles_.size(); i++) {
+        // The first match wins, as the scans did
+        if (!profiles_[i].mac_address.empty()) {
+            view->by_mac.emplace(profiles_[i].mac_address, i);
+        }
+        if (!profiles_[i].device_id.empty()) {
+            view->by_id.emplace(profiles_[i].device_id, i);
+        }
     }
-    cJSON_Delete(root);
+    std::atomic_store(&profiles_view_, std::shared_ptr<const ProfilesView>(std::move(view)));
+}
+
+void DeviceRegistry::PublishSessionsLocked() {
+    auto view = std::make_shared<SessionsView>();
+    view->reserve(sessions_.size());
+    for (const auto& [_, info] : sessions_) {
+        view->push_back(info);
+    }
+    std::sort(view->begin(), view->end(), [](const DeviceRegistry::SessionInfo& lhs, const DeviceRegistry::SessionInfo& rhs) {
+        if (lhs.is_preferred != rhs.is_preferred) {
+            return lhs.is_preferred && !rhs.is_preferred;
+        }
+        if (lhs.is_active != rhs.is_active) {
+            return lhs.is_active && !rhs.is_active;
+        }
+        return lhs.session_id < rhs.session_id;
+    });
+    std::atomic_store(&sessions_view_, std::shared_ptr<const SessionsView>(std::move(view)));
 }
 
 void DeviceRegistry::PersistPreferredSessionLocked() {
@@ -1,6 +1,7 @@
 #ifndef DEVICE_REGISTRY_H
 #define DEVICE_REGISTRY_H
 
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
@@ -31,10 +32,22 @@ public:
         bool is_preferred = false;
     };
 
+    // Read only views replaced as a whole on every change, a reader keeps its view without a lock
+    struct ProfilesView {
+        std::vector<DeviceProfile> profiles;
+        std::unordered_map<std::string, size_t> by_mac;
+        std::unordered_map<std::string, size_t> by_id;
+    };
+    // The sessions in the order of GetSessions()
+    using SessionsView = std::vector<SessionInfo>;
+
     static DeviceRegistry& GetInstance();
     DeviceRegistry(const DeviceRegistry&) = delete;
     DeviceRegistry& operator=(const DeviceRegistry&) = delete;
 
+    std::shared_ptr<const ProfilesView> GetProfilesView() const;
+    std::shared_ptr<const SessionsView> GetSessionsView() const;
+
     std::vector<DeviceProfile> GetProfiles() const;
     bool AddOrUpdateProfile(const DeviceProfile& profile);
     bool RemoveProfileByMac(const std::string& mac_address);
@@ -52,14 +65,22 @@ private:
     DeviceRegistry();
 
     void LoadProfilesLocked();
-    void PersistProfilesLocked();
+    // Writes the record of one profile, and the list of records when it is added
+    void PersistProfileLocked(const DeviceProfile& profile, bool added);
+    void ErasePersistedProfileLocked(const DeviceProfile& profile);
+    void PersistProfileKeysLocked();
+    void PublishProfilesLocked();
+    void PublishSessionsLocked();
     void PersistPreferredSessionLocked();
     static std::string NormalizeMac(const std::string& mac_address);
 
+    // Taken by the writers only
     mutable std::mutex mutex_;
     std::vector<DeviceProfile> profiles_;
     std::unordered_map<std::string, SessionInfo> sessions_;
     std::string preferred_session_id_;
+    std::shared_ptr<const ProfilesView> profiles_view_;
+    std::shared_ptr<const SessionsView> sessions_view_;
 };
 
 #endif // DEVICE_REGISTRY_H
@@ -1,4 +1,11 @@
 #include "device_state_event.h"
+#include "task_placement.h"
+
+#include <esp_log.h>
+
+#define TAG "StateEvents"
+
+#define STATE_EVENT_PENDING (1u << 16)
 
 ESP_EVENT_DEFINE_BASE(XIAOZHI_STATE_EVENTS);
 
@@ -7,25 +14,72 @@ DeviceStateEventManager& DeviceStateEventManager::GetInstance() {
     return instance;
 }
 
-void DeviceStateEventManager::RegisterStateChangeCallback(std::function<void(DeviceState, DeviceState)> callback) {
+void DeviceStateEventManager::RegisterStateChangeCallback(Callback callback) {
     std::lock_guard<std::mutex> lock(mutex_);
-    callbacks_.push_back(callback);
+    auto callbacks = std::make_shared<CallbackList>(*std::atomic_load(&callbacks_));
+    callbacks->push_back(std::move(callback));
+    std::atomic_store(&callbacks_, std::shared_ptr<const CallbackList>(std::move(callbacks)));
+}
+
+std::shared_ptr<const DeviceStateEventManager::CallbackList> DeviceStateEventManager::GetCallbacks() const {
+    return std::atomic_load(&callbacks_);
+}
+
+void DeviceStateEventManager::Dispatch(DeviceState previous_state, DeviceState current_state) {
+    auto callbacks = GetCallbacks();
+    for (const auto& callback : *callbacks) {
+        callback(previous_state, current_state);
+    }
 }
 
 void DeviceStateEventManager::PostStateChangeEvent(DeviceState previous_state, DeviceState current_state) {
+#if CONFIG_STATE_EVENT_DELIVERY_TASK
+    uint32_t pending = pending_.load(std::memory_order_relaxed);
+    uint32_t next;
+    do {
+        // An undelivered change keeps its previous state
+        uint32_t previous = (pending & STATE_EVENT_PENDING) ? (pending >> 8) & 0xff : (uint32_t)previous_state;
+        next = STATE_EVENT_PENDING | (previous << 8) | ((uint32_t)current_state & 0xff);
+    } while (!pending_.compare_exchange_weak(pending, next, std::memory_order_release, std::memory_order_relaxed));
+    if (pending & STATE_EVENT_PENDING) {
+        coalesced_.fetch_add(1, std::memory_order_relaxed);
+    }
+    xTaskNotifyGive(task_);
+#else
     device_state_event_data_t event_data = {
         .previous_state = previous_state,
         .current_state = current_state
     };
     esp_event_post(XIAOZHI_STATE_EVENTS, XIAOZHI_STATE_CHANGED_EVENT, &event_data, sizeof(event_data), portMAX_DELAY);
+#endif
 }
 
-std::vector<std::function<void(DeviceState, DeviceState)>> DeviceStateEventManager::GetCallbacks() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    return callbacks_;
+#if CONFIG_STATE_EVENT_DELIVERY_TASK
+void DeviceStateEventManager::DeliveryTask() {
+    uint32_t reported = 0;
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t pending = pending_.exchange(0, std::memory_order_acquire);
+        if (!(pending & STATE_EVENT_PENDING)) {
+            continue;
+        }
+        Dispatch((DeviceState)((pending >> 8) & 0xff), (DeviceState)(pending & 0xff));
+
+        uint32_t coalesced = coalesced_.load(std::memory_order_relaxed);
+        if (coalesced != reported) {
+            ESP_LOGD(TAG, "%lu state changes coalesced", (unsigned long)coalesced);
+            reported = coalesced;
+        }
+    }
 }
+#endif
 
-DeviceStateEventManager::DeviceStateEventManager() {
+DeviceStateEventManager::DeviceStateEventManager() : callbacks_(std::make_shared<const CallbackList>()) {
+#if CONFIG_STATE_EVENT_DELIVERY_TASK
+    TaskPlacements::Create(kTaskStateEvents, [](void* arg) {
+        ((DeviceStateEventManager*)arg)->DeliveryTask();
+    }, this, &task_);
+#else
     esp_err_t err = esp_event_loop_create_default();
     if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
         ESP_ERROR_CHECK(err);
@@ -34,13 +88,15 @@ DeviceStateEventManager::DeviceStateEventManager() {
     ESP_ERROR_CHECK(esp_event_handler_register(XIAOZHI_STATE_EVENTS, XIAOZHI_STATE_CHANGED_EVENT, 
         [](void* handler_args, esp_event_base_t base, int32_t id, void* event_data) {
             auto* data = static_cast<device_state_event_data_t*>(event_data);
-            auto& manager = DeviceStateEventManager::GetInstance();
-            for (const auto& callback : manager.GetCallbacks()) {
-                callback(data->previous_state, data->current_state);
-            }
+            DeviceStateEventManager::GetInstance().Dispatch(data->previous_state, data->current_state);
         }, nullptr));
+#endif
 }
 
 DeviceStateEventManager::~DeviceStateEventManager() {
+#if CONFIG_STATE_EVENT_DELIVERY_TASK
+    TaskPlacements::Delete(kTaskStateEvents, task_);
+#else
     esp_event_handler_unregister(XIAOZHI_STATE_EVENTS, XIAOZHI_STATE_CHANGED_EVENT, nullptr);
-}
\ No newline at end of file
+#endif
+}
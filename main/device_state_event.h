@@ -1,10 +1,15 @@
 #ifndef _DEVICE_STATE_EVENT_H_
 #define _DEVICE_STATE_EVENT_H_
 
+#include <sdkconfig.h>
 #include <esp_event.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <functional>
 #include <vector>
+#include <memory>
 #include <mutex>
+#include <atomic>
 #include "device_state.h"
 
 ESP_EVENT_DECLARE_BASE(XIAOZHI_STATE_EVENTS);
@@ -18,22 +23,46 @@ struct device_state_event_data_t {
     DeviceState current_state;
 };
 
+/*
+ * Runs the registered callbacks after a device state change, off the main loop.
+ *
+ * The callback list is immutable once published: a registration copies it, appends and
+ * publishes the new list, and a delivery only loads the current one, so neither the post
+ * nor the delivery takes a lock or copies the callbacks.
+ *
+ * With CONFIG_STATE_EVENT_DELIVERY_TASK the post is a compare-and-swap of the pending change
+ * and a task notification. Changes posted before the task delivers are coalesced, the
+ * callbacks see the first previous state and the last current state.
+ */
 class DeviceStateEventManager {
 public:
+    using Callback = std::function<void(DeviceState, DeviceState)>;
+    using CallbackList = std::vector<Callback>;
+
     static DeviceStateEventManager& GetInstance();
     DeviceStateEventManager(const DeviceStateEventManager&) = delete;
     DeviceStateEventManager& operator=(const DeviceStateEventManager&) = delete;
 
-    void RegisterStateChangeCallback(std::function<void(DeviceState, DeviceState)> callback);
+    void RegisterStateChangeCallback(Callback callback);
     void PostStateChangeEvent(DeviceState previous_state, DeviceState current_state);
-    std::vector<std::function<void(DeviceState, DeviceState)>> GetCallbacks();
+    std::shared_ptr<const CallbackList> GetCallbacks() const;
 
 private:
     DeviceStateEventManager();
     ~DeviceStateEventManager();
 
-    std::vector<std::function<void(DeviceState, DeviceState)>> callbacks_;
+    // Serializes the registrations only
     std::mutex mutex_;
+    std::shared_ptr<const CallbackList> callbacks_;
+
+#if CONFIG_STATE_EVENT_DELIVERY_TASK
+    // Bit 16 set while a change is pending, the previous state in bits 8-15, the current in 0-7
+    std::atomic<uint32_t> pending_ = 0;
+    std::atomic<uint32_t> coalesced_ = 0;
+    TaskHandle_t task_ = nullptr;
+    void DeliveryTask();
+#endif
+    void Dispatch(DeviceState previous_state, DeviceState current_state);
 };
 
-#endif // _DEVICE_STATE_EVENT_H_ 
\ No newline at end of file
+#endif // _DEVICE_STATE_EVENT_H_
@@ -3,6 +3,7 @@
 #include <string>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
 #include <font_awesome.h>
 
 #include "display.h"
@@ -45,6 +46,156 @@ void Display::SetChatMessage(const char* role, const char* content) {
     ESP_LOGW(TAG, "     %s", content);
 }
 
+void Display::UpdateChatMessage(const char* role, const char* content, bool append) {
+    if (append && chat_role_ == role) {
+        chat_text_ += content;
+    } else {
+        chat_role_ = role;
+        chat_text_ = content;
+    }
+    SetChatMessage(role, chat_text_.c_str());
+}
+
+void Display::PostStatus(const char* status) {
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex_);
+        posted_status_.sequence = ++post_sequence_;
+        posted_status_.posted_us = esp_timer_get_time();
+        posted_status_.text = status;
+    }
+    OnUpdatePosted();
+}
+
+void Display::PostNotification(const char* notification, int duration_ms) {
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex_);
+        posted_notification_.sequence = ++post_sequence_;
+        posted_notification_.posted_us = esp_timer_get_time();
+        posted_notification_.text = notification;
+        posted_notification_.duration_ms = duration_ms;
+    }
+    OnUpdatePosted();
+}
+
+void Display::PostEmotion(const char* emotion) {
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex_);
+        posted_emotion_.sequence = ++post_sequence_;
+        posted_emotion_.posted_us = esp_timer_get_time();
+        posted_emotion_.text = emotion;
+    }
+    OnUpdatePosted();
+}
+
+void Display::PostChatMessage(const char* role, const char* content) {
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex_);
+        PostedUpdate message;
+        message.sequence = ++post_sequence_;
+        message.posted_us = esp_timer_get_time();
+        message.role = role;
+        message.text = content;
+        posted_chat_messages_.push_back(std::move(message));
+    }
+    OnUpdatePosted();
+}
+
+void Display::PostChatMessageUpdate(const char* role, const char* content, bool append) {
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex_);
+        // Not applied yet, the message of the role is still in the queue: the update goes into it
+        if (!posted_chat_messages_.empty() && posted_chat_messages_.back().role == role) {
+            auto& last = posted_chat_messages_.back();
+            if (append) {
+                last.text += content;
+            } else {
+                last.text = content;
+                last.append = false;
+            }
+        } else {
+            PostedUpdate message;
+            message.sequence = ++post_sequence_;
+            message.posted_us = esp_timer_get_time();
+            message.role = role;
+            message.text = content;
+            message.update = true;
+            message.append = append;
+            posted_chat_messages_.push_back(std::move(message));
+        }
+    }
+    OnUpdatePosted();
+}
+
+bool Display::ApplyPostedUpdates(bool hold_chat_messages) {
+    PostedUpdate status, notification, emotion;
+    std::deque<PostedUpdate> chat_messages;
+    bool held = false;
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex_);
+        std::swap(status, posted_status_);
+        std::swap(notification, posted_notification_);
+        std::swap(emotion, posted_emotion_);
+        if (hold_chat_messages) {
+            held = !posted_chat_messages_.empty();
+        } else {
+            std::swap(chat_messages, posted_chat_messages_);
+        }
+    }
+
+    // Merge the single updates into the chat messages by the order they were posted
+    while (true) {
+        PostedUpdate* next = nullptr;
+        for (auto update : { &status, &notification, &emotion }) {
+            if (update->sequence != 0 && (next == nullptr || update->sequence < next->sequence)) {
+                next = update;
+            }
+        }
+        if (!chat_messages.empty() && (next == nullptr || chat_messages.front().sequence < next->sequence)) {
+            auto& message = chat_messages.front();
+            if (message.update) {
+                UpdateChatMessage(message.role.c_str(), message.text.c_str(), message.append);
+            } else {
+                chat_role_ = message.role;
+                chat_text_ = message.text;
+                SetChatMessage(message.role.c_str(), message.text.c_str());
+            }
+            AddUpdateLatency(message);
+            chat_messages.pop_front();
+            continue;
+        }
+        if (next == nullptr) {
+            break;
+        }
+        if (next == &status) {
+            SetStatus(status.text.c_str());
+        } else if (next == &notification) {
+            ShowNotification(notification.text.c_str(), notification.duration_ms);
+        } else {
+            SetEmotion(emotion.text.c_str());
+        }
+        AddUpdateLatency(*next);
+        next->sequence = 0;
+    }
+    return held;
+}
+
+void Display::AddUpdateLatency(const PostedUpdate& update) {
+    int64_t latency_us = esp_timer_get_time() - update.posted_us;
+    std::lock_guard<std::mutex> lock(posted_mutex_);
+    update_latency_.count++;
+    update_latency_.total_us += latency_us;
+    update_latency_.max_us = std::max(update_latency_.max_us, latency_us);
+}
+
+Display::UpdateLatency Display::GetUpdateLatency(bool reset) {
+    std::lock_guard<std::mutex> lock(posted_mutex_);
+    UpdateLatency latency = update_latency_;
+    if (reset) {
+        update_latency_ = UpdateLatency();
+    }
+    return latency;
+}
+
 void Display::SetTheme(Theme* theme) {
     current_theme_ = theme;
     Settings settings("display", true);
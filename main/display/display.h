@@ -14,6 +14,8 @@
 
 #include <string>
 #include <chrono>
+#include <deque>
+#include <mutex>
 
 class Theme {
 public:
@@ -35,6 +37,9 @@ public:
     virtual void ShowNotification(const std::string &notification, int duration_ms = 3000);
     virtual void SetEmotion(const char* emotion);
     virtual void SetChatMessage(const char* role, const char* content);
+    // The streamed text of the last chat message: appended to it, or replacing it. A message of
+    // another role starts a new one. By default the whole text is set again with SetChatMessage
+    virtual void UpdateChatMessage(const char* role, const char* content, bool append);
     virtual void SetTheme(Theme* theme);
     virtual Theme* GetTheme() { return current_theme_; }
     virtual void UpdateStatusBar(bool update_all = false);
@@ -43,15 +48,66 @@ public:
     inline int width() const { return width_; }
     inline int height() const { return height_; }
 
+    /*
+     * Queue an update for the UI task instead of waiting for the display lock, so a busy display
+     * never stalls the caller. Only the last status, notification and emotion posted apply, the
+     * chat messages all do. The updates apply in the order they were posted. The updates of a
+     * streamed message that are still posted merge into the last one of its role.
+     */
+    void PostStatus(const char* status);
+    void PostNotification(const char* notification, int duration_ms = 3000);
+    void PostEmotion(const char* emotion);
+    void PostChatMessage(const char* role, const char* content);
+    void PostChatMessageUpdate(const char* role, const char* content, bool append);
+
+    // Time from the post of an update to its apply, over the updates applied since the last reset
+    struct UpdateLatency {
+        uint32_t count = 0;
+        int64_t total_us = 0;
+        int64_t max_us = 0;
+    };
+    UpdateLatency GetUpdateLatency(bool reset);
+
 protected:
     int width_ = 0;
     int height_ = 0;
 
     Theme* current_theme_ = nullptr;
 
+    // Called after an update is posted, a display without a UI task applies it right away
+    virtual void OnUpdatePosted() { ApplyPostedUpdates(); }
+    // Applies the posted updates through the Set* methods. With hold_chat_messages the chat
+    // messages stay posted for a later run, true if some are left
+    bool ApplyPostedUpdates(bool hold_chat_messages = false);
+
     friend class DisplayLockGuard;
+    friend class DisplayBenchmark;
     virtual bool Lock(int timeout_ms = 0) = 0;
     virtual void Unlock() = 0;
+
+private:
+    struct PostedUpdate {
+        uint32_t sequence = 0;      // 0 when nothing is posted
+        std::string text;
+        std::string role;           // The role of a chat message
+        bool update = false;        // A chat message update, UpdateChatMessage()
+        bool append = false;
+        int duration_ms = 0;        // The duration of a notification
+        int64_t posted_us = 0;
+    };
+
+    std::mutex posted_mutex_;
+    uint32_t post_sequence_ = 0;
+    PostedUpdate posted_status_;
+    PostedUpdate posted_notification_;
+    PostedUpdate posted_emotion_;
+    std::deque<PostedUpdate> posted_chat_messages_;
+    UpdateLatency update_latency_;
+    // The last chat message, for the default UpdateChatMessage()
+    std::string chat_role_;
+    std::string chat_text_;
+
+    void AddUpdateLatency(const PostedUpdate& update);
 };
 
 
@@ -0,0 +1,325 @@
+#include "display_benchmark.h"
+
+#if CONFIG_DISPLAY_BENCHMARK
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <cJSON.h>
+#include <cstdio>
+#include <functional>
+#include <algorithm>
+#include <string>
+
+#include "board.h"
+#include "display.h"
+#include "assets.h"
+#ifdef HAVE_LVGL
+#include "lcd_display.h"
+#include "oled_display.h"
+#include "lvgl_theme.h"
+#endif
+#if CONFIG_USE_EMOTE_MESSAGE_STYLE
+#include "emote_display.h"
+#endif
+
+#define TAG "DisplayBenchmark"
+
+// Time between two calls of a phase, so the LVGL task renders some of them
+#define BENCHMARK_CALL_INTERVAL_MS 30
+#define BENCHMARK_EMOTION_CYCLES 3
+#define BENCHMARK_NOTIFICATIONS 50
+#define BENCHMARK_THEME_SWITCHES 10
+#define BENCHMARK_FULL_REFRESHES 20
+
+namespace {
+
+struct Timing {
+    uint32_t count = 0;
+    int64_t total_us = 0;
+    int64_t max_us = 0;
+
+    void Add(int64_t us) {
+        count++;
+        total_us += us;
+        max_us = std::max(max_us, us);
+    }
+
+    void AddTo(cJSON* root, const char* name) const {
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "count", count);
+        cJSON_AddNumberToObject(item, "avg_us", count > 0 ? total_us / count : 0);
+        cJSON_AddNumberToObject(item, "max_us", max_us);
+        cJSON_AddItemToObject(root, name, item);
+    }
+};
+
+// Updated by the LVGL task with the display lock held, read and reset under the lock
+struct FrameTimings {
+    int64_t render_start_us = 0;
+    int64_t flush_start_us = 0;
+    int64_t wait_start_us = 0;
+    Timing render;
+    Timing flush;
+    Timing flush_wait;
+};
+
+FrameTimings frame_timings;
+
+// What the chat replays, the user and the assistant take turns
+const char* const kChatMessages[] = {
+    "What's the weather like tomorrow?",
+    "Tomorrow will be sunny with a high of 24 degrees and a light breeze in the afternoon.",
+    "Set an alarm for seven.",
+    "Done, the alarm rings at 7:00 tomorrow morning.",
+    "明天天气怎么样？",
+    "明天晴，最高气温二十四度，下午有微风。",
+    "Tell me a long story about a lighthouse keeper who collects messages in bottles and answers every one of them.",
+    "OK.",
+};
+
+const char* const kEmotions[] = {
+    "neutral", "happy", "laughing", "funny", "sad", "angry", "crying", "loving", "embarrassed",
+    "surprised", "shocked", "thinking", "winking", "cool", "relaxed", "delicious", "kissy",
+    "confident", "sleepy", "silly", "confused",
+};
+
+const char* DisplayClass(Display* display) {
+#ifdef HAVE_LVGL
+    if (dynamic_cast<LcdDisplay*>(display) != nullptr) {
+        return "LcdDisplay";
+    }
+    if (dynamic_cast<OledDisplay*>(display) != nullptr) {
+        return "OledDisplay";
+    }
+#endif
+#if CONFIG_USE_EMOTE_MESSAGE_STYLE
+    if (dynamic_cast<emote::EmoteDisplay*>(display) != nullptr) {
+        return "EmoteDisplay";
+    }
+#endif
+    if (dynamic_cast<NoDisplay*>(display) != nullptr) {
+        return "NoDisplay";
+    }
+    return "Display";
+}
+
+void AddMemory(cJSON* root) {
+    cJSON_AddNumberToObject(root, "heap_internal_free", heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    cJSON_AddNumberToObject(root, "heap_internal_min", heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL));
+    cJSON_AddNumberToObject(root, "heap_spiram_free", heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+    cJSON_AddNumberToObject(root, "heap_spiram_min", heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM));
+#if defined(HAVE_LVGL) && LV_USE_STDLIB_MALLOC == LV_STDLIB_BUILTIN
+    // The LVGL heap is only known with its builtin allocator, otherwise it is in the heap above
+    lv_mem_monitor_t monitor;
+    lv_mem_monitor(&monitor);
+    cJSON_AddNumberToObject(root, "lv_mem_used", monitor.total_size - monitor.free_size);
+    cJSON_AddNumberToObject(root, "lv_mem_max_used", monitor.max_used);
+    cJSON_AddNumberToObject(root, "lv_mem_frag_pct", monitor.frag_pct);
+#endif
+}
+
+void Print(cJSON* root) {
+    auto json = cJSON_PrintUnformatted(root);
+    printf(DISPLAY_BENCHMARK_PREFIX "%s\n", json);
+    cJSON_free(json);
+    cJSON_Delete(root);
+}
+
+} // namespace
+
+bool DisplayBenchmark::Lock(Display* display) {
+    return display->Lock(30000);
+}
+
+void DisplayBenchmark::Unlock(Display* display) {
+    display->Unlock();
+}
+
+#ifdef HAVE_LVGL
+void DisplayBenchmark::AttachFrameEvents(LvglDisplay* display) {
+    if (!display->Lock(30000)) {
+        return;
+    }
+    lv_display_add_event_cb(display->display_, [](lv_event_t* e) {
+        auto& timings = frame_timings;
+        int64_t now = esp_timer_get_time();
+        switch (lv_event_get_code(e)) {
+        case LV_EVENT_RENDER_START:
+            timings.render_start_us = now;
+            break;
+        case LV_EVENT_REFR_READY:
+            if (timings.render_start_us != 0) {
+                timings.render.Add(now - timings.render_start_us);
+                timings.render_start_us = 0;
+            }
+            break;
+        case LV_EVENT_FLUSH_START:
+            timings.flush_start_us = now;
+            break;
+        case LV_EVENT_FLUSH_FINISH:
+            if (timings.flush_start_us != 0) {
+                timings.flush.Add(now - timings.flush_start_us);
+                timings.flush_start_us = 0;
+            }
+            break;
+        case LV_EVENT_FLUSH_WAIT_START:
+            timings.wait_start_us = now;
+            break;
+        case LV_EVENT_FLUSH_WAIT_FINISH:
+            if (timings.wait_start_us != 0) {
+                timings.flush_wait.Add(now - timings.wait_start_us);
+                timings.wait_start_us = 0;
+            }
+            break;
+        default:
+            break;
+        }
+    }, LV_EVENT_ALL, nullptr);
+    display->Unlock();
+}
+
+void DisplayBenchmark::RefreshFullScreen(LvglDisplay* display) {
+    display->Lock(30000);
+    lv_obj_invalidate(lv_screen_active());
+    lv_refr_now(display->display_);
+    display->Unlock();
+}
+#endif
+
+void DisplayBenchmark::Run() {
+    auto& board = Board::GetInstance();
+    auto display = board.GetDisplay();
+    auto& assets = Assets::GetInstance();
+    if (assets.partition_valid()) {
+        assets.Apply();
+    }
+    const char* display_class = DisplayClass(display);
+#ifdef HAVE_LVGL
+    auto lvgl_display = dynamic_cast<LvglDisplay*>(display);
+    if (lvgl_display != nullptr) {
+        AttachFrameEvents(lvgl_display);
+    }
+#endif
+    ESP_LOGI(TAG, "Benchmarking %s", display_class);
+
+    std::string phase_name;
+    Timing lock_wait;
+    Timing call;
+    int64_t phase_start_us = 0;
+
+    auto begin_phase = [&](const char* name) {
+        phase_name = name;
+        lock_wait = Timing();
+        call = Timing();
+        if (Lock(display)) {
+            frame_timings = FrameTimings();
+            Unlock(display);
+        }
+        phase_start_us = esp_timer_get_time();
+    };
+
+    /*
+     * The lock is probed just before the call, the wait then is what the caller of the Set* method
+     * would have waited. The Set* methods hold the lock for practically all of their call.
+     */
+    auto timed_call = [&](const std::function<void()>& fn, int interval_ms) {
+        int64_t start = esp_timer_get_time();
+        if (Lock(display)) {
+            Unlock(display);
+        }
+        int64_t locked = esp_timer_get_time();
+        fn();
+        int64_t end = esp_timer_get_time();
+        lock_wait.Add(locked - start);
+        call.Add(end - locked);
+        if (interval_ms > 0) {
+            vTaskDelay(pdMS_TO_TICKS(interval_ms));
+        }
+    };
+
+    auto end_phase = [&]() {
+        // Let the LVGL task draw what the phase left
+        vTaskDelay(pdMS_TO_TICKS(500));
+        auto root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "type", "phase");
+        cJSON_AddStringToObject(root, "display", display_class);
+        cJSON_AddStringToObject(root, "phase", phase_name.c_str());
+        cJSON_AddNumberToObject(root, "time_ms", (esp_timer_get_time() - phase_start_us) / 1000);
+        lock_wait.AddTo(root, "lock_wait");
+        call.AddTo(root, "lock_hold");
+        if (Lock(display)) {
+            frame_timings.render.AddTo(root, "frame");
+            frame_timings.flush.AddTo(root, "flush");
+            frame_timings.flush_wait.AddTo(root, "flush_wait");
+            Unlock(display);
+        }
+        AddMemory(root);
+        Print(root);
+    };
+
+    begin_phase("chat");
+    for (int i = 0; i < CONFIG_DISPLAY_BENCHMARK_CHAT_MESSAGES; i++) {
+        const char* role = i % 2 == 0 ? "user" : "assistant";
+        const char* content = kChatMessages[i % (sizeof(kChatMessages) / sizeof(kChatMessages[0]))];
+        timed_call([&]() { display->SetChatMessage(role, content); }, BENCHMARK_CALL_INTERVAL_MS);
+    }
+    end_phase();
+
+    begin_phase("emotion");
+    for (int cycle = 0; cycle < BENCHMARK_EMOTION_CYCLES; cycle++) {
+        for (auto emotion : kEmotions) {
+            timed_call([&]() { display->SetEmotion(emotion); }, BENCHMARK_CALL_INTERVAL_MS);
+        }
+    }
+    end_phase();
+
+    // Back to back, as a burst of status changes would post them
+    begin_phase("notification_storm");
+    for (int i = 0; i < BENCHMARK_NOTIFICATIONS; i++) {
+        std::string notification = "Notification " + std::to_string(i);
+        timed_call([&]() { display->ShowNotification(notification, 3000); }, 0);
+    }
+    end_phase();
+
+#ifdef HAVE_LVGL
+    if (dynamic_cast<LcdDisplay*>(display) != nullptr && display->GetTheme() != nullptr) {
+        auto& theme_manager = LvglThemeManager::GetInstance();
+        auto original = display->GetTheme();
+        auto light = theme_manager.GetTheme("light");
+        auto dark = theme_manager.GetTheme("dark");
+        if (light != nullptr && dark != nullptr) {
+            begin_phase("theme");
+            for (int i = 0; i < BENCHMARK_THEME_SWITCHES; i++) {
+                Theme* theme = i % 2 == 0 ? static_cast<Theme*>(light) : static_cast<Theme*>(dark);
+                timed_call([&]() { display->SetTheme(theme); }, BENCHMARK_CALL_INTERVAL_MS * 4);
+            }
+            display->SetTheme(original);
+            end_phase();
+        }
+    }
+
+    if (lvgl_display != nullptr) {
+        begin_phase("full_flush");
+        for (int i = 0; i < BENCHMARK_FULL_REFRESHES; i++) {
+            timed_call([&]() { RefreshFullScreen(lvgl_display); }, BENCHMARK_CALL_INTERVAL_MS);
+        }
+        end_phase();
+    }
+#endif
+
+    auto root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "type", "done");
+    cJSON_AddStringToObject(root, "display", display_class);
+    AddMemory(root);
+    Print(root);
+    ESP_LOGI(TAG, "Benchmark finished");
+
+    while (true) {
+        vTaskDelay(portMAX_DELAY);
+    }
+}
+
+#endif // CONFIG_DISPLAY_BENCHMARK
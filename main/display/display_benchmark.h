@@ -0,0 +1,42 @@
+#ifndef DISPLAY_BENCHMARK_H
+#define DISPLAY_BENCHMARK_H
+
+#include <sdkconfig.h>
+
+#if CONFIG_DISPLAY_BENCHMARK
+
+class Display;
+class LvglDisplay;
+
+/*
+ * Display benchmark firmware.
+ *
+ * Replaces the application: the board creates its display as usual and the assets are applied,
+ * then a scripted workload is replayed on it. The phases are a chat of
+ * CONFIG_DISPLAY_BENCHMARK_CHAT_MESSAGES messages, cycling through the emotions, a storm of
+ * notifications, theme switches (LcdDisplay) and full screen refreshes (LVGL displays).
+ *
+ * Every phase prints a JSON line prefixed with DISPLAY_BENCHMARK_PREFIX: the display class, the
+ * wait for the display lock and the time holding it per call, the render, flush and flush wait
+ * times of the frames drawn meanwhile, the heap and the LVGL memory. The same firmware on two
+ * boards gives comparable numbers.
+ */
+
+#define DISPLAY_BENCHMARK_PREFIX "DISPLAY_BENCH "
+
+class DisplayBenchmark {
+public:
+    // Runs the phases once, prints the results and never returns
+    static void Run();
+
+private:
+    // A friend of the displays, to time the lock and reach the LVGL display
+    static bool Lock(Display* display);
+    static void Unlock(Display* display);
+    static void AttachFrameEvents(LvglDisplay* display);
+    static void RefreshFullScreen(LvglDisplay* display);
+};
+
+#endif // CONFIG_DISPLAY_BENCHMARK
+
+#endif // DISPLAY_BENCHMARK_H
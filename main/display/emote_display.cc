@@ -5,6 +5,9 @@
 #include <memory>
 #include <unordered_map>
 #include <tuple>
+#include <atomic>
+#include <algorithm>
+#include <climits>
 
 // Standard C headers
 #include <sys/time.h>
@@ -20,6 +23,8 @@
 #include <freertos/task.h>
 
 // Project headers
+#include "application.h"
+#include "audio_pressure.h"
 #include "assets.h"
 #include "assets/lang_config.h"
 #include "board.h"
@@ -50,6 +55,13 @@ static const char* TAG = "EmoteDisplay";
 #define ICON_WIFI_OK             "icon_wifi"
 #define ICON_LISTEN              "listen"
 
+// Under load the eye animation drops to 1/EMOTE_MAX_FPS_DIVIDER of its frame rate at most
+#define EMOTE_MAX_FPS_DIVIDER    4
+// Seconds without load before the frame rate is raised again
+#define EMOTE_RECOVER_SECONDS    5
+// A gap of this many frame periods between render passes is a stopped animation, not a late one
+#define EMOTE_IDLE_PERIODS       8
+
 using FlushIoReadyCallback = std::function<bool(esp_lcd_panel_io_handle_t, esp_lcd_panel_io_event_data_t*, void*)>;
 using FlushCallback = std::function<void(gfx_handle_t, int, int, int, int, const void*)>;
 
@@ -135,18 +147,67 @@ public:
 
     void SetEyes(const std::string &emoji_name, const bool repeat, const int fps, EmoteDisplay* const display);
     void SetIcon(const std::string &icon_name, EmoteDisplay* const display);
+    // Once a second: lowers the frame rate of the eyes while the frames come late or the audio
+    // decoder runs short of CPU, raises it again once both are clear
+    void Pace();
+    // The eyes stop in the power save mode, they are not throttled meanwhile
+    void SetEyesStopped(const bool stopped)
+    {
+        eyes_stopped_ = stopped;
+    }
+    FrameStats GetFrameStats() const;
 
     void* GetEngineHandle() const
     {
         return engine_handle_;
     }
 
+    /*
+     * The flush of a render buffer is reported done when the panel IO has sent it, so the engine
+     * renders the next frame into the other buffer while the DMA transfer runs. Until the IO
+     * callback is registered, a flush is reported done as soon as it is queued.
+     */
+    struct FlushContext {
+        esp_lcd_panel_handle_t panel = nullptr;
+        gfx_handle_t handle = nullptr;
+        std::atomic<bool> io_ready_registered = false;
+        std::atomic<bool> transfer_pending = false;
+        // Frame timing, of the render passes of the engine task. A pass flushes its area top
+        // down, so a flush that does not start below the previous one begins the next frame
+        int last_y_start = INT_MAX;
+        int64_t last_pass_us = 0;
+        std::atomic<int> period_us = 0;
+        std::atomic<uint32_t> rendered = 0;
+        std::atomic<uint32_t> late = 0;
+    };
+
     // Callback functions (public to be accessible from static helper functions)
     static bool OnFlushIoReady(const esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_io_event_data_t* const edata, void* const user_ctx);
     static void OnFlush(const gfx_handle_t handle, const int x_start, const int y_start, const int x_end, const int y_end, const void* const color_data);
 
 private:
     gfx_handle_t engine_handle_;
+    esp_lcd_panel_io_handle_t panel_io_ = nullptr;
+    FlushContext flush_context_;
+
+    // The eyes as last set, the frame rate is that of the asset
+    bool eyes_repeat_ = false;
+    bool eyes_stopped_ = false;
+    int eyes_fps_ = 0;
+    int fps_divider_ = 1;
+    int clean_seconds_ = 0;
+    uint32_t paced_rendered_ = 0;
+    uint32_t paced_late_ = 0;
+    uint32_t paced_starved_ = 0;
+    uint32_t paced_pressure_ = 0;
+    uint32_t throttled_ = 0;
+
+    int EffectiveFps() const
+    {
+        return std::max(1, eyes_fps_ / fps_divider_);
+    }
+    void ApplyFps();
+    static void CountPass(FlushContext* const flush_context);
 };
 
 // ============================================================================
@@ -189,17 +250,17 @@ static void SetUIDisplayMode(const UIDisplayMode mode, EmoteDisplay* const displ
 // Graphics Initialization Functions
 // ============================================================================
 
-static void InitializeGraphics(const esp_lcd_panel_handle_t panel, gfx_handle_t* const engine_handle,
+static void InitializeGraphics(EmoteEngine::FlushContext* const flush_context, gfx_handle_t* const engine_handle,
                                const int width, const int height)
 {
-    if (!panel || !engine_handle) {
+    if (!flush_context || !flush_context->panel || !engine_handle) {
         ESP_LOGE(TAG, "InitializeGraphics: Invalid parameters");
         return;
     }
 
     gfx_core_config_t gfx_cfg = {
         .flush_cb = EmoteEngine::OnFlush,
-        .user_data = panel,
+        .user_data = flush_context,
         .flags = {
             .swap = true,
             .double_buffer = true,
@@ -222,6 +283,7 @@ static void InitializeGraphics(const esp_lcd_panel_handle_t panel, gfx_handle_t*
     gfx_cfg.task.task_stack = 8 * 1024;
 
     *engine_handle = gfx_emote_init(&gfx_cfg);
+    flush_context->handle = *engine_handle;
 }
 
 static void SetupUI(const gfx_handle_t engine_handle, EmoteDisplay* const display)
@@ -268,7 +330,7 @@ static void SetupUI(const gfx_handle_t engine_handle, EmoteDisplay* const displa
     SetUIDisplayMode(UIDisplayMode::SHOW_TIPS, display);
 }
 
-static void RegisterCallbacks(const esp_lcd_panel_io_handle_t panel_io, const gfx_handle_t engine_handle)
+static void RegisterCallbacks(const esp_lcd_panel_io_handle_t panel_io, EmoteEngine::FlushContext* const flush_context)
 {
     if (!panel_io) {
         ESP_LOGE(TAG, "RegisterCallbacks: panel_io is nullptr");
@@ -278,7 +340,11 @@ static void RegisterCallbacks(const esp_lcd_panel_io_handle_t panel_io, const gf
     const esp_lcd_panel_io_callbacks_t cbs = {
         .on_color_trans_done = EmoteEngine::OnFlushIoReady,
     };
-    esp_lcd_panel_io_register_event_callbacks(panel_io, &cbs, engine_handle);
+    if (esp_lcd_panel_io_register_event_callbacks(panel_io, &cbs, flush_context) != ESP_OK) {
+        ESP_LOGW(TAG, "RegisterCallbacks: no transfer done callback, flushes are reported done when queued");
+        return;
+    }
+    flush_context->io_ready_registered = true;
 }
 
 // ============================================================================
@@ -287,8 +353,10 @@ static void RegisterCallbacks(const esp_lcd_panel_io_handle_t panel_io, const gf
 
 EmoteEngine::EmoteEngine(const esp_lcd_panel_handle_t panel, const esp_lcd_panel_io_handle_t panel_io,
                          const int width, const int height, EmoteDisplay* const display)
+    : panel_io_(panel_io)
 {
-    InitializeGraphics(panel, &engine_handle_, width, height);
+    flush_context_.panel = panel;
+    InitializeGraphics(&flush_context_, &engine_handle_, width, height);
 
     if (display) {
         gfx_emote_lock(engine_handle_);
@@ -296,11 +364,19 @@ EmoteEngine::EmoteEngine(const esp_lcd_panel_handle_t panel, const esp_lcd_panel
         gfx_emote_unlock(engine_handle_);
     }
 
-    RegisterCallbacks(panel_io, engine_handle_);
+    if (engine_handle_) {
+        RegisterCallbacks(panel_io, &flush_context_);
+    }
 }
 
 EmoteEngine::~EmoteEngine()
 {
+    if (panel_io_ && flush_context_.io_ready_registered) {
+        const esp_lcd_panel_io_callbacks_t cbs = {
+            .on_color_trans_done = nullptr,
+        };
+        esp_lcd_panel_io_register_event_callbacks(panel_io_, &cbs, nullptr);
+    }
     if (engine_handle_) {
         gfx_emote_deinit(engine_handle_);
         engine_handle_ = nullptr;
@@ -322,8 +398,12 @@ void EmoteEngine::SetEyes(const std::string &emoji_name, const bool repeat, cons
     const AssetData emoji_data = display->GetEmojiData(emoji_name);
     if (emoji_data.data) {
         DisplayLockGuard lock(display);
+        eyes_repeat_ = repeat;
+        eyes_stopped_ = false;
+        eyes_fps_ = fps;
+        flush_context_.period_us = 1000000 / EffectiveFps();
         gfx_anim_set_src(g_obj_anim_eye, emoji_data.data, emoji_data.size);
-        gfx_anim_set_segment(g_obj_anim_eye, 0, 0xFFFF, fps, repeat);
+        gfx_anim_set_segment(g_obj_anim_eye, 0, 0xFFFF, EffectiveFps(), repeat);
         gfx_obj_set_visible(g_obj_anim_eye, true);
         gfx_anim_start(g_obj_anim_eye);
     } else {
@@ -358,21 +438,117 @@ void EmoteEngine::SetIcon(const std::string &icon_name, EmoteDisplay* const disp
     g_current_icon_type = icon_name;
 }
 
+void EmoteEngine::Pace()
+{
+    const uint32_t rendered = flush_context_.rendered.load(std::memory_order_relaxed);
+    const uint32_t late = flush_context_.late.load(std::memory_order_relaxed);
+    const uint32_t starved = Application::GetInstance().GetAudioService().GetPlaybackStarved();
+    // The audio pipeline was at risk in the last second, before or without a starved playback
+    const uint32_t pressure = AudioPressure::GetInstance().raised();
+    const uint32_t new_rendered = rendered - paced_rendered_;
+    const uint32_t new_late = late - paced_late_;
+    const bool audio_starved = starved != paced_starved_ || pressure != paced_pressure_;
+    paced_rendered_ = rendered;
+    paced_late_ = late;
+    paced_starved_ = starved;
+    paced_pressure_ = pressure;
+
+    const bool playing = eyes_repeat_ && !eyes_stopped_ && eyes_fps_ > 0;
+    if (playing && fps_divider_ > 1) {
+        throttled_ += eyes_fps_ - EffectiveFps();
+    }
+
+    // More than a quarter of the frames late
+    const bool behind = new_late >= 2 && new_late * 3 > new_rendered;
+    if (audio_starved || behind) {
+        clean_seconds_ = 0;
+        if (fps_divider_ < EMOTE_MAX_FPS_DIVIDER) {
+            fps_divider_ *= 2;
+            ESP_LOGI(TAG, "Eyes at 1/%d of the frame rate, %s", fps_divider_,
+                     audio_starved ? "the audio pipeline is at risk" : "the frames are late");
+            ApplyFps();
+        }
+    } else if (fps_divider_ > 1 && ++clean_seconds_ >= EMOTE_RECOVER_SECONDS) {
+        clean_seconds_ = 0;
+        fps_divider_ /= 2;
+        ESP_LOGI(TAG, "Eyes at 1/%d of the frame rate", fps_divider_);
+        ApplyFps();
+    }
+}
+
+void EmoteEngine::ApplyFps()
+{
+    if (eyes_fps_ <= 0) {
+        return;
+    }
+    flush_context_.period_us = 1000000 / EffectiveFps();
+    // A one-shot animation keeps its rate to the end, the next one starts at the new rate
+    if (eyes_repeat_ && !eyes_stopped_) {
+        gfx_anim_set_segment(g_obj_anim_eye, 0, 0xFFFF, EffectiveFps(), true);
+        gfx_anim_start(g_obj_anim_eye);
+    }
+}
+
+FrameStats EmoteEngine::GetFrameStats() const
+{
+    FrameStats stats;
+    stats.rendered = flush_context_.rendered.load(std::memory_order_relaxed);
+    stats.late = flush_context_.late.load(std::memory_order_relaxed);
+    stats.throttled = throttled_;
+    stats.fps_divider = fps_divider_;
+    return stats;
+}
+
+void EmoteEngine::CountPass(FlushContext* const flush_context)
+{
+    const int64_t now_us = esp_timer_get_time();
+    const int64_t period_us = flush_context->period_us.load(std::memory_order_relaxed);
+    if (flush_context->last_pass_us != 0 && period_us > 0) {
+        const int64_t interval_us = now_us - flush_context->last_pass_us;
+        if (interval_us > period_us * 3 / 2 && interval_us < period_us * EMOTE_IDLE_PERIODS) {
+            flush_context->late.fetch_add((interval_us + period_us / 2) / period_us - 1, std::memory_order_relaxed);
+        }
+    }
+    flush_context->last_pass_us = now_us;
+    flush_context->rendered.fetch_add(1, std::memory_order_relaxed);
+}
+
 bool EmoteEngine::OnFlushIoReady(const esp_lcd_panel_io_handle_t panel_io,
                                  esp_lcd_panel_io_event_data_t* const edata,
                                  void* const user_ctx)
 {
+    // From the ISR of the panel IO, only the transfers queued by OnFlush are reported
+    auto* const flush_context = static_cast<EmoteEngine::FlushContext*>(user_ctx);
+    if (flush_context && flush_context->transfer_pending.exchange(false)) {
+        gfx_emote_flush_ready(flush_context->handle, true);
+    }
     return true;
 }
 
 void EmoteEngine::OnFlush(const gfx_handle_t handle, const int x_start, const int y_start,
                           const int x_end, const int y_end, const void* const color_data)
 {
-    auto* const panel = static_cast<esp_lcd_panel_handle_t>(gfx_emote_get_user_data(handle));
-    if (panel) {
-        esp_lcd_panel_draw_bitmap(panel, x_start, y_start, x_end, y_end, color_data);
+    auto* const flush_context = static_cast<EmoteEngine::FlushContext*>(gfx_emote_get_user_data(handle));
+    if (!flush_context || !flush_context->panel) {
+        gfx_emote_flush_ready(handle, true);
+        return;
+    }
+
+    if (y_start <= flush_context->last_y_start) {
+        CountPass(flush_context);
+    }
+    flush_context->last_y_start = y_start;
+
+    const bool async = flush_context->io_ready_registered;
+    flush_context->transfer_pending = async;
+    if (esp_lcd_panel_draw_bitmap(flush_context->panel, x_start, y_start, x_end, y_end, color_data) != ESP_OK) {
+        flush_context->transfer_pending = false;
+        gfx_emote_flush_ready(handle, true);
+        return;
+    }
+    if (!async) {
+        gfx_emote_flush_ready(handle, true);
     }
-    gfx_emote_flush_ready(handle, true);
 }
 
 // ============================================================================
@@ -477,6 +653,7 @@ void EmoteDisplay::UpdateStatusBar(bool update_all)
 
     // Only display time when battery icon is shown
     DisplayLockGuard lock(this);
+    engine_->Pace();
     if (g_current_icon_type == ICON_BATTERY) {
         time_t now;
         struct tm timeinfo;
@@ -503,6 +680,7 @@ void EmoteDisplay::SetPowerSaveMode(bool on)
 
     DisplayLockGuard lock(this);
     ESP_LOGI(TAG, "SetPowerSaveMode: %s", on ? "ON" : "OFF");
+    engine_->SetEyesStopped(on);
     if (on) {
         gfx_anim_stop(g_obj_anim_eye);
     } else {
@@ -620,6 +798,11 @@ AssetData EmoteDisplay::GetIconData(const std::string &name) const
     return AssetData();
 }
 
+FrameStats EmoteDisplay::GetFrameStats() const
+{
+    return engine_ ? engine_->GetFrameStats() : FrameStats();
+}
+
 EmoteEngine* EmoteDisplay::GetEngine() const
 {
     return engine_.get();
@@ -49,6 +49,14 @@ struct LayoutData {
         : align(a), x(x_pos), y(y_pos), width(w), height(h), has_size(w > 0 && h > 0) {}
 };
 
+// The frames of the eye animation since boot
+struct FrameStats {
+    uint32_t rendered = 0;
+    uint32_t late = 0;          // Frame periods a render pass came late by
+    uint32_t throttled = 0;     // Frames left out while the frame rate was lowered
+    int fps_divider = 1;        // The frame rate is divided by this under load
+};
+
 // Function to convert align string to GFX_ALIGN enum value
 char StringToGfxAlign(const std::string &align_str);
 
@@ -74,6 +82,7 @@ public:
     void AddTextFont(std::shared_ptr<LvglFont> text_font);
     AssetData GetEmojiData(const std::string &name) const;
     AssetData GetIconData(const std::string &name) const;
+    FrameStats GetFrameStats() const;
 
     EmoteEngine* GetEngine() const;
     void* GetEngineHandle() const;
@@ -0,0 +1,240 @@
+#include "lcd_direct_renderer.h"
+
+#include <esp_log.h>
+#include <esp_attr.h>
+#include <esp_cache.h>
+#include <esp_lvgl_port.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "LcdDirectRenderer"
+
+// An area smaller than this is copied by the CPU, the PPA setup costs more than the memcpy
+#define PPA_MIN_PIXELS (64 * 64)
+// A buffer switch takes at most one frame of the panel, this is for a stopped panel
+#define VSYNC_TIMEOUT_MS 100
+
+LcdDirectRenderer* LcdDirectRenderer::Create(PanelType type, esp_lcd_panel_handle_t panel, int width, int height) {
+    auto renderer = new LcdDirectRenderer(type, panel, width, height);
+    if (!renderer->Initialize()) {
+        delete renderer;
+        return nullptr;
+    }
+    return renderer;
+}
+
+LcdDirectRenderer::LcdDirectRenderer(PanelType type, esp_lcd_panel_handle_t panel, int width, int height)
+    : type_(type), panel_(panel), width_(width), height_(height) {
+}
+
+bool LcdDirectRenderer::Initialize() {
+    esp_err_t err = ESP_ERR_NOT_SUPPORTED;
+    if (type_ == kPanelRgb) {
+#if SOC_LCD_RGB_SUPPORTED
+        err = esp_lcd_rgb_panel_get_frame_buffer(panel_, 2, &fbs_[0], &fbs_[1]);
+#endif
+    } else {
+#if SOC_MIPI_DSI_SUPPORTED
+        err = esp_lcd_dpi_panel_get_frame_buffer(panel_, 2, &fbs_[0], &fbs_[1]);
+#endif
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "The panel has no second frame buffer (%s)", esp_err_to_name(err));
+        return false;
+    }
+
+    vsync_ = xSemaphoreCreateBinary();
+    if (vsync_ == nullptr) {
+        return false;
+    }
+    if (type_ == kPanelRgb) {
+#if SOC_LCD_RGB_SUPPORTED
+        esp_lcd_rgb_panel_event_callbacks_t callbacks = {};
+        callbacks.on_vsync = OnRgbVsync;
+        callbacks.on_bounce_frame_finish = OnRgbBounceFrameFinish;
+        err = esp_lcd_rgb_panel_register_event_callbacks(panel_, &callbacks, this);
+#endif
+    } else {
+#if SOC_MIPI_DSI_SUPPORTED
+        esp_lcd_dpi_panel_event_callbacks_t callbacks = {};
+        callbacks.on_refresh_done = OnDpiRefreshDone;
+        err = esp_lcd_dpi_panel_register_event_callbacks(panel_, &callbacks, this);
+#endif
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to register the panel events (%s)", esp_err_to_name(err));
+        vSemaphoreDelete(vsync_);
+        return false;
+    }
+
+#if SOC_PPA_SUPPORTED
+    ppa_client_config_t ppa_config = {};
+    ppa_config.oper_type = PPA_OPERATION_SRM;
+    ppa_config.max_pending_trans_num = 1;
+    if (ppa_register_client(&ppa_config, &ppa_) != ESP_OK) {
+        ESP_LOGW(TAG, "No PPA client, the areas are copied by the CPU");
+        ppa_ = nullptr;
+    }
+#endif
+
+    lvgl_port_lock(0);
+    display_ = lv_display_create(width_, height_);
+    lv_color_format_t color_format = lv_display_get_color_format(display_);
+    pixel_size_ = lv_color_format_get_size(color_format);
+    uint32_t stride = width_ * pixel_size_;
+    for (int i = 0; i < 2; i++) {
+        lv_draw_buf_init(&draw_bufs_[i], width_, height_, color_format, stride, fbs_[i], stride * height_);
+    }
+    back_ = 0;
+    lv_display_set_draw_buffers(display_, &draw_bufs_[back_], nullptr);
+    lv_display_set_render_mode(display_, LV_DISPLAY_RENDER_MODE_DIRECT);
+    lv_display_set_user_data(display_, this);
+    lv_display_set_flush_cb(display_, [](lv_display_t* disp, const lv_area_t* area, uint8_t* px_map) {
+        static_cast<LcdDirectRenderer*>(lv_display_get_user_data(disp))->Flush(area);
+        lv_display_flush_ready(disp);
+    });
+    lvgl_port_unlock();
+
+    ESP_LOGI(TAG, "Direct rendering into the %s frame buffers %p and %p", type_ == kPanelRgb ? "RGB" : "DPI",
+        fbs_[0], fbs_[1]);
+    return true;
+}
+
+void IRAM_ATTR LcdDirectRenderer::SignalFromIsr(bool* need_yield) {
+    BaseType_t woken = pdFALSE;
+    xSemaphoreGiveFromISR(vsync_, &woken);
+    *need_yield = woken == pdTRUE;
+}
+
+#if SOC_LCD_RGB_SUPPORTED
+bool IRAM_ATTR LcdDirectRenderer::OnRgbVsync(esp_lcd_panel_handle_t panel, const esp_lcd_rgb_panel_event_data_t* edata,
+                                             void* user_ctx) {
+    auto renderer = static_cast<LcdDirectRenderer*>(user_ctx);
+    bool need_yield = false;
+    if (!renderer->bounce_seen_.load(std::memory_order_relaxed)) {
+        renderer->SignalFromIsr(&need_yield);
+    }
+    return need_yield;
+}
+
+// With bounce buffers the frame buffer is read ahead of the vsync, the end of the bounce frame is
+// when the previous buffer is done with
+bool IRAM_ATTR LcdDirectRenderer::OnRgbBounceFrameFinish(esp_lcd_panel_handle_t panel,
+                                                         const esp_lcd_rgb_panel_event_data_t* edata, void* user_ctx) {
+    auto renderer = static_cast<LcdDirectRenderer*>(user_ctx);
+    renderer->bounce_seen_.store(true, std::memory_order_relaxed);
+    bool need_yield = false;
+    renderer->SignalFromIsr(&need_yield);
+    return need_yield;
+}
+#endif
+
+#if SOC_MIPI_DSI_SUPPORTED
+bool IRAM_ATTR LcdDirectRenderer::OnDpiRefreshDone(esp_lcd_panel_handle_t panel, esp_lcd_dpi_panel_event_data_t* edata,
+                                                   void* user_ctx) {
+    bool need_yield = false;
+    static_cast<LcdDirectRenderer*>(user_ctx)->SignalFromIsr(&need_yield);
+    return need_yield;
+}
+#endif
+
+void LcdDirectRenderer::AddArea(const lv_area_t* area) {
+    if (area_count_ < LCD_DIRECT_RENDERER_MAX_AREAS) {
+        areas_[area_count_++] = *area;
+        return;
+    }
+    // Out of slots, the last one grows to cover the rest
+    lv_area_t& last = areas_[LCD_DIRECT_RENDERER_MAX_AREAS - 1];
+    last.x1 = std::min(last.x1, area->x1);
+    last.y1 = std::min(last.y1, area->y1);
+    last.x2 = std::max(last.x2, area->x2);
+    last.y2 = std::max(last.y2, area->y2);
+}
+
+void LcdDirectRenderer::Flush(const lv_area_t* area) {
+    AddArea(area);
+    if (lv_display_flush_is_last(display_)) {
+        Present();
+        area_count_ = 0;
+    }
+}
+
+void LcdDirectRenderer::Present() {
+    auto front = static_cast<uint8_t*>(fbs_[back_]);
+    auto back = static_cast<uint8_t*>(fbs_[1 - back_]);
+
+    // The panel writes back the cache of the dirty rows and switches to this buffer
+    int y1 = height_, y2 = -1;
+    for (int i = 0; i < area_count_; i++) {
+        y1 = std::min<int>(y1, areas_[i].y1);
+        y2 = std::max<int>(y2, areas_[i].y2);
+    }
+    if (y2 < y1) {
+        return;
+    }
+    xSemaphoreTake(vsync_, 0);
+    esp_lcd_panel_draw_bitmap(panel_, 0, y1, width_, y2 + 1, front + y1 * width_ * pixel_size_);
+    if (xSemaphoreTake(vsync_, pdMS_TO_TICKS(VSYNC_TIMEOUT_MS)) != pdTRUE) {
+        missed_vsyncs_++;
+    }
+    frames_++;
+
+    // The previous buffer is off the screen, it catches up the areas of this frame and is the next one drawn
+    for (int i = 0; i < area_count_; i++) {
+        SyncArea(areas_[i], front, back);
+    }
+    back_ = 1 - back_;
+    lv_display_set_draw_buffers(display_, &draw_bufs_[back_], nullptr);
+}
+
+void LcdDirectRenderer::SyncArea(const lv_area_t& area, uint8_t* front, uint8_t* back) {
+    int x1 = std::max<int>(area.x1, 0);
+    int y1 = std::max<int>(area.y1, 0);
+    int x2 = std::min<int>(area.x2, width_ - 1);
+    int y2 = std::min<int>(area.y2, height_ - 1);
+    if (x2 < x1 || y2 < y1) {
+        return;
+    }
+    int width = x2 - x1 + 1;
+    int height = y2 - y1 + 1;
+    size_t stride = width_ * pixel_size_;
+
+#if SOC_PPA_SUPPORTED
+    if (ppa_ != nullptr && pixel_size_ == 2 && width * height >= PPA_MIN_PIXELS) {
+        // A block copy without scaling or rotation, the driver syncs the cache of both buffers
+        ppa_srm_oper_config_t config = {};
+        config.in.buffer = front;
+        config.in.pic_w = width_;
+        config.in.pic_h = height_;
+        config.in.block_w = width;
+        config.in.block_h = height;
+        config.in.block_offset_x = x1;
+        config.in.block_offset_y = y1;
+        config.in.srm_cm = PPA_SRM_COLOR_MODE_RGB565;
+        config.out.buffer = back;
+        config.out.buffer_size = stride * height_;
+        config.out.pic_w = width_;
+        config.out.pic_h = height_;
+        config.out.block_offset_x = x1;
+        config.out.block_offset_y = y1;
+        config.out.srm_cm = PPA_SRM_COLOR_MODE_RGB565;
+        config.rotation_angle = PPA_SRM_ROTATION_ANGLE_0;
+        config.scale_x = 1;
+        config.scale_y = 1;
+        config.mode = PPA_TRANS_MODE_BLOCKING;
+        if (ppa_do_scale_rotate_mirror(ppa_, &config) == ESP_OK) {
+            return;
+        }
+    }
+#endif
+
+    size_t offset = x1 * pixel_size_;
+    size_t length = width * pixel_size_;
+    for (int y = y1; y <= y2; y++) {
+        memcpy(back + y * stride + offset, front + y * stride + offset, length);
+    }
+    // The panel scans the memory, not the cache
+    esp_cache_msync(back + y1 * stride + offset, (height - 1) * stride + length,
+        ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_UNALIGNED);
+}
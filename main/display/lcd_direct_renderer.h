@@ -0,0 +1,100 @@
+#ifndef LCD_DIRECT_RENDERER_H
+#define LCD_DIRECT_RENDERER_H
+
+#include <sdkconfig.h>
+#include <soc/soc_caps.h>
+#include <esp_lcd_panel_ops.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <lvgl.h>
+
+#include <atomic>
+
+#if SOC_LCD_RGB_SUPPORTED
+#include <esp_lcd_panel_rgb.h>
+#endif
+#if SOC_MIPI_DSI_SUPPORTED
+#include <esp_lcd_mipi_dsi.h>
+#endif
+#if SOC_PPA_SUPPORTED
+#include <driver/ppa.h>
+#endif
+
+#define LCD_DIRECT_RENDERER_MAX_AREAS 16
+
+/*
+ * Direct-mode rendering into the two frame buffers of an RGB or MIPI DPI panel.
+ *
+ * LVGL draws only the dirty areas, in place, into the back frame buffer. On the last area of a
+ * frame the buffer is handed to the panel, which scans it out from the next frame on, and the
+ * LVGL task sleeps until the panel is done with the previous buffer (the vsync of the RGB
+ * panel, or the end of its bounce buffer frame; the refresh done of the DPI panel). So a buffer
+ * is never written while it is on the screen and there is no tearing. The dirty areas are then
+ * copied into the previous buffer, which becomes the back buffer of the next frame, so both
+ * stay the same without redrawing the whole frame. The copy goes through the PPA where there is
+ * one (ESP32-P4), through the CPU for the small areas and the other targets.
+ *
+ * The panel must be created with two frame buffers (num_fbs = 2), and without rotation: the
+ * frame buffers are in the layout of the panel. Create() returns nullptr otherwise, the caller
+ * falls back to the lvgl_port display.
+ *
+ * The renderer owns the callbacks of the panel events, the display is created without the port
+ * but refreshed by its task, under its lock. Like the displays of the port it is never deleted.
+ */
+class LcdDirectRenderer {
+public:
+    enum PanelType {
+        kPanelRgb,
+        kPanelDpi,
+    };
+
+    static LcdDirectRenderer* Create(PanelType type, esp_lcd_panel_handle_t panel, int width, int height);
+    LcdDirectRenderer(const LcdDirectRenderer&) = delete;
+    LcdDirectRenderer& operator=(const LcdDirectRenderer&) = delete;
+
+    lv_display_t* display() const { return display_; }
+    // Frames presented, and those that did not see the panel switch buffers in time
+    uint32_t frames() const { return frames_; }
+    uint32_t missed_vsyncs() const { return missed_vsyncs_; }
+
+private:
+    PanelType type_;
+    esp_lcd_panel_handle_t panel_;
+    int width_;
+    int height_;
+    size_t pixel_size_;
+    void* fbs_[2] = {};
+    lv_draw_buf_t draw_bufs_[2];
+    int back_ = 0;
+    lv_display_t* display_ = nullptr;
+    SemaphoreHandle_t vsync_ = nullptr;
+    // Set by the first bounce frame event, from then on it is the buffer switch of the RGB panel
+    std::atomic<bool> bounce_seen_ = false;
+    // The dirty areas of the frame being flushed
+    lv_area_t areas_[LCD_DIRECT_RENDERER_MAX_AREAS];
+    int area_count_ = 0;
+    uint32_t frames_ = 0;
+    uint32_t missed_vsyncs_ = 0;
+#if SOC_PPA_SUPPORTED
+    ppa_client_handle_t ppa_ = nullptr;
+#endif
+
+    LcdDirectRenderer(PanelType type, esp_lcd_panel_handle_t panel, int width, int height);
+    bool Initialize();
+    void AddArea(const lv_area_t* area);
+    void Flush(const lv_area_t* area);
+    void Present();
+    // Copies an area of the front buffer into the back buffer
+    void SyncArea(const lv_area_t& area, uint8_t* front, uint8_t* back);
+    // The panel is done with the previous buffer
+    void SignalFromIsr(bool* need_yield);
+#if SOC_LCD_RGB_SUPPORTED
+    static bool OnRgbVsync(esp_lcd_panel_handle_t panel, const esp_lcd_rgb_panel_event_data_t* edata, void* user_ctx);
+    static bool OnRgbBounceFrameFinish(esp_lcd_panel_handle_t panel, const esp_lcd_rgb_panel_event_data_t* edata, void* user_ctx);
+#endif
+#if SOC_MIPI_DSI_SUPPORTED
+    static bool OnDpiRefreshDone(esp_lcd_panel_handle_t panel, esp_lcd_dpi_panel_event_data_t* edata, void* user_ctx);
+#endif
+};
+
+#endif // LCD_DIRECT_RENDERER_H
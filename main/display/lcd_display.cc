@@ -2,6 +2,7 @@
 #include "gif/lvgl_gif.h"
 #include "settings.h"
 #include "lvgl_theme.h"
+#include "lvgl_indexed_image.h"
 #include "assets/lang_config.h"
 
 #include <vector>
@@ -11,12 +12,60 @@
 #include <esp_err.h>
 #include <esp_lvgl_port.h>
 #include <esp_psram.h>
+#include <esp_heap_caps.h>
 #include <cstring>
 
 #include "board.h"
 
 #define TAG "LcdDisplay"
 
+// Lines of a band buffer, and the internal DMA memory a double band must leave for the audio
+// and network buffers allocated after the display
+#define LCD_BAND_LINES 20
+#define LCD_DOUBLE_BAND_RESERVE (96 * 1024)
+
+namespace {
+
+struct SpiLcdBuffer {
+    const char* name;
+    uint32_t size;          // In pixels
+    bool double_buffer;
+    bool in_psram;
+    uint32_t trans_size;    // The internal DMA chunk a PSRAM buffer is flushed through
+};
+
+// With two buffers LVGL renders into one while the SPI DMA sends the other
+SpiLcdBuffer ChooseSpiLcdBuffer(int width, int height) {
+    uint32_t band = width * LCD_BAND_LINES;
+    SpiLcdBuffer single_band = { "single band", band, false, false, 0 };
+    SpiLcdBuffer double_band = { "double band", band, true, false, 0 };
+#if CONFIG_SPIRAM
+    SpiLcdBuffer psram_frame = { "PSRAM frame", static_cast<uint32_t>(width * height), true, true, band };
+#endif
+
+#if CONFIG_LCD_BUFFER_SINGLE_BAND
+    return single_band;
+#elif CONFIG_LCD_BUFFER_DOUBLE_BAND
+    return double_band;
+#elif CONFIG_LCD_BUFFER_PSRAM_FRAME
+    return psram_frame;
+#elif CONFIG_SPIRAM
+    // The big buffers of these boards go to PSRAM, so the bands fit in internal RAM unless it is short
+    size_t band_bytes = band * sizeof(uint16_t);
+    size_t free_size = heap_caps_get_free_size(MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+    size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+    if (largest >= band_bytes && free_size >= 2 * band_bytes + LCD_DOUBLE_BAND_RESERVE) {
+        return double_band;
+    }
+    return psram_frame;
+#else
+    // Internal RAM is all there is, the second band goes to the audio and the network instead
+    return single_band;
+#endif
+}
+
+} // namespace
+
 LV_FONT_DECLARE(BUILTIN_TEXT_FONT);
 LV_FONT_DECLARE(BUILTIN_ICON_FONT);
 LV_FONT_DECLARE(font_awesome_30_4);
@@ -111,6 +160,7 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
 
     ESP_LOGI(TAG, "Initialize LVGL library");
     lv_init();
+    LvglIndexedImage::RegisterDecoder();
 
 #if CONFIG_SPIRAM
     // lv image cache, currently only PNG is supported
@@ -126,20 +176,18 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
 
     ESP_LOGI(TAG, "Initialize LVGL port");
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
-    port_cfg.task_priority = 1;
-#if CONFIG_SOC_CPU_CORES_NUM > 1
-    port_cfg.task_affinity = 1;
-#endif
+    PlaceLvglTask(port_cfg);
     lvgl_port_init(&port_cfg);
 
-    ESP_LOGI(TAG, "Adding LCD display");
+    auto buffer = ChooseSpiLcdBuffer(width_, height_);
+    ESP_LOGI(TAG, "Adding LCD display, %s buffer of %lu pixels", buffer.name, buffer.size);
     const lvgl_port_display_cfg_t display_cfg = {
         .io_handle = panel_io_,
         .panel_handle = panel_,
         .control_handle = nullptr,
-        .buffer_size = static_cast<uint32_t>(width_ * 20),
-        .double_buffer = false,
-        .trans_size = 0,
+        .buffer_size = buffer.size,
+        .double_buffer = buffer.double_buffer,
+        .trans_size = buffer.trans_size,
         .hres = static_cast<uint32_t>(width_),
         .vres = static_cast<uint32_t>(height_),
         .monochrome = false,
@@ -150,8 +198,8 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
         },
         .color_format = LV_COLOR_FORMAT_RGB565,
         .flags = {
-            .buff_dma = 1,
-            .buff_spiram = 0,
+            .buff_dma = !buffer.in_psram,
+            .buff_spiram = buffer.in_psram,
             .sw_rotate = 0,
             .swap_bytes = 1,
             .full_refresh = 0,
@@ -164,6 +212,7 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
         ESP_LOGE(TAG, "Failed to add display");
         return;
     }
+    EnableRenderStats(buffer.name);
 
     if (offset_x != 0 || offset_y != 0) {
         lv_display_set_offset(display_, offset_x, offset_y);
@@ -187,45 +236,51 @@ RgbLcdDisplay::RgbLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
 
     ESP_LOGI(TAG, "Initialize LVGL library");
     lv_init();
+    LvglIndexedImage::RegisterDecoder();
 
     ESP_LOGI(TAG, "Initialize LVGL port");
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
-    port_cfg.task_priority = 1;
+    PlaceLvglTask(port_cfg);
     port_cfg.timer_period_ms = 50;
     lvgl_port_init(&port_cfg);
 
     ESP_LOGI(TAG, "Adding LCD display");
-    const lvgl_port_display_cfg_t display_cfg = {
-        .io_handle = panel_io_,
-        .panel_handle = panel_,
-        .buffer_size = static_cast<uint32_t>(width_ * 20),
-        .double_buffer = true,
-        .hres = static_cast<uint32_t>(width_),
-        .vres = static_cast<uint32_t>(height_),
-        .rotation = {
-            .swap_xy = swap_xy,
-            .mirror_x = mirror_x,
-            .mirror_y = mirror_y,
-        },
-        .flags = {
-            .buff_dma = 1,
-            .swap_bytes = 0,
-            .full_refresh = 1,
-            .direct_mode = 1,
-        },
-    };
-
-    const lvgl_port_display_rgb_cfg_t rgb_cfg = {
-        .flags = {
-            .bb_mode = true,
-            .avoid_tearing = true,
-        }
-    };
+    if (AddDirectDisplay(LcdDirectRenderer::kPanelRgb, mirror_x, mirror_y, swap_xy)) {
+        EnableRenderStats("RGB direct");
+    } else {
+        const lvgl_port_display_cfg_t display_cfg = {
+            .io_handle = panel_io_,
+            .panel_handle = panel_,
+            .buffer_size = static_cast<uint32_t>(width_ * 20),
+            .double_buffer = true,
+            .hres = static_cast<uint32_t>(width_),
+            .vres = static_cast<uint32_t>(height_),
+            .rotation = {
+                .swap_xy = swap_xy,
+                .mirror_x = mirror_x,
+                .mirror_y = mirror_y,
+            },
+            .flags = {
+                .buff_dma = 1,
+                .swap_bytes = 0,
+                .full_refresh = 1,
+                .direct_mode = 1,
+            },
+        };
+
+        const lvgl_port_display_rgb_cfg_t rgb_cfg = {
+            .flags = {
+                .bb_mode = true,
+                .avoid_tearing = true,
+            }
+        };
     
-    display_ = lvgl_port_add_disp_rgb(&display_cfg, &rgb_cfg);
-    if (display_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to add RGB display");
-        return;
+        display_ = lvgl_port_add_disp_rgb(&display_cfg, &rgb_cfg);
+        if (display_ == nullptr) {
+            ESP_LOGE(TAG, "Failed to add RGB display");
+            return;
+        }
+        EnableRenderStats("RGB double frame");
     }
     
     if (offset_x != 0 || offset_y != 0) {
@@ -242,43 +297,50 @@ MipiLcdDisplay::MipiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel
 
     ESP_LOGI(TAG, "Initialize LVGL library");
     lv_init();
+    LvglIndexedImage::RegisterDecoder();
 
     ESP_LOGI(TAG, "Initialize LVGL port");
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
+    PlaceLvglTask(port_cfg);
     lvgl_port_init(&port_cfg);
 
     ESP_LOGI(TAG, "Adding LCD display");
-    const lvgl_port_display_cfg_t disp_cfg = {
-        .io_handle = panel_io,
-        .panel_handle = panel,
-        .control_handle = nullptr,
-        .buffer_size = static_cast<uint32_t>(width_ * 50),
-        .double_buffer = false,
-        .hres = static_cast<uint32_t>(width_),
-        .vres = static_cast<uint32_t>(height_),
-        .monochrome = false,
-        /* Rotation values must be same as used in esp_lcd for initial settings of the screen */
-        .rotation = {
-            .swap_xy = swap_xy,
-            .mirror_x = mirror_x,
-            .mirror_y = mirror_y,
-        },
-        .flags = {
-            .buff_dma = true,
-            .buff_spiram =false,
-            .sw_rotate = true,
-        },
-    };
-
-    const lvgl_port_display_dsi_cfg_t dpi_cfg = {
-        .flags = {
-            .avoid_tearing = false,
+    if (AddDirectDisplay(LcdDirectRenderer::kPanelDpi, mirror_x, mirror_y, swap_xy)) {
+        EnableRenderStats("DSI direct");
+    } else {
+        const lvgl_port_display_cfg_t disp_cfg = {
+            .io_handle = panel_io,
+            .panel_handle = panel,
+            .control_handle = nullptr,
+            .buffer_size = static_cast<uint32_t>(width_ * 50),
+            .double_buffer = false,
+            .hres = static_cast<uint32_t>(width_),
+            .vres = static_cast<uint32_t>(height_),
+            .monochrome = false,
+            /* Rotation values must be same as used in esp_lcd for initial settings of the screen */
+            .rotation = {
+                .swap_xy = swap_xy,
+                .mirror_x = mirror_x,
+                .mirror_y = mirror_y,
+            },
+            .flags = {
+                .buff_dma = true,
+                .buff_spiram =false,
+                .sw_rotate = true,
+            },
+        };
+
+        const lvgl_port_display_dsi_cfg_t dpi_cfg = {
+            .flags = {
+                .avoid_tearing = false,
+            }
+        };
+        display_ = lvgl_port_add_disp_dsi(&disp_cfg, &dpi_cfg);
+        if (display_ == nullptr) {
+            ESP_LOGE(TAG, "Failed to add display");
+            return;
         }
-    };
-    display_ = lvgl_port_add_disp_dsi(&disp_cfg, &dpi_cfg);
-    if (display_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to add display");
-        return;
+        EnableRenderStats("DSI band");
     }
 
     if (offset_x != 0 || offset_y != 0) {
@@ -288,6 +350,23 @@ MipiLcdDisplay::MipiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel
     SetupUI();
 }
 
+bool LcdDisplay::AddDirectDisplay(LcdDirectRenderer::PanelType type, bool mirror_x, bool mirror_y, bool swap_xy) {
+#if CONFIG_LCD_DIRECT_RENDER
+    // LVGL draws into the frame buffers in the layout of the panel
+    if (mirror_x || mirror_y || swap_xy) {
+        return false;
+    }
+    auto renderer = LcdDirectRenderer::Create(type, panel_, width_, height_);
+    if (renderer == nullptr) {
+        return false;
+    }
+    display_ = renderer->display();
+    return true;
+#else
+    return false;
+#endif
+}
+
 LcdDisplay::~LcdDisplay() {
     SetPreviewImage(nullptr);
     
@@ -302,6 +381,10 @@ LcdDisplay::~LcdDisplay() {
         esp_timer_delete(preview_timer_);
     }
 
+    if (emoji_preload_timer_ != nullptr) {
+        lv_timer_delete(emoji_preload_timer_);
+    }
+
     if (preview_image_ != nullptr) {
         lv_obj_del(preview_image_);
     }
@@ -320,6 +403,12 @@ LcdDisplay::~LcdDisplay() {
     if (content_ != nullptr) {
         lv_obj_del(content_);
     }
+    if (chat_styles_initialized_) {
+        lv_style_reset(&bubble_style_);
+        lv_style_reset(&user_bubble_style_);
+        lv_style_reset(&assistant_bubble_style_);
+        lv_style_reset(&system_bubble_style_);
+    }
     if (status_bar_ != nullptr) {
         lv_obj_del(status_bar_);
     }
@@ -362,6 +451,7 @@ void LcdDisplay::SetupUI() {
     lv_obj_set_style_text_font(screen, text_font, 0);
     lv_obj_set_style_text_color(screen, lvgl_theme->text_color(), 0);
     lv_obj_set_style_bg_color(screen, lvgl_theme->background_color(), 0);
+    UpdateChatStyles(lvgl_theme);
 
     /* Container */
     container_ = lv_obj_create(screen);
@@ -399,8 +489,14 @@ void LcdDisplay::SetupUI() {
     lv_obj_set_flex_align(content_, LV_FLEX_ALIGN_START, LV_FLEX_ALIGN_START, LV_FLEX_ALIGN_START);
     lv_obj_set_style_pad_row(content_, lvgl_theme->spacing(4), 0); // Space between messages
 
-    // We'll create chat messages dynamically in SetChatMessage
+    // The chat message rows are created by SetChatMessage and then reused
     chat_message_label_ = nullptr;
+    lv_obj_add_event_cb(content_, [](lv_event_t* e) {
+        auto self = static_cast<LcdDisplay*>(lv_event_get_user_data(e));
+        if (lv_obj_get_scroll_top(self->content_) <= 0) {
+            self->ShowEarlierChatMessage();
+        }
+    }, LV_EVENT_SCROLL_END, this);
 
     /* Status bar */
     lv_obj_set_flex_flow(status_bar_, LV_FLEX_FLOW_ROW);
@@ -472,198 +568,273 @@ void LcdDisplay::SetupUI() {
 #else
 #define  MAX_MESSAGES 20
 #endif
-void LcdDisplay::SetChatMessage(const char* role, const char* content) {
-    DisplayLockGuard lock(this);
-    if (content_ == nullptr) {
-        return;
-    }
-    
-    // 检查消息数量是否超过限制
-    uint32_t child_count = lv_obj_get_child_cnt(content_);
-    if (child_count >= MAX_MESSAGES) {
-        // 删除最早的消息（第一个子对象）
-        lv_obj_t* first_child = lv_obj_get_child(content_, 0);
-        lv_obj_t* last_child = lv_obj_get_child(content_, child_count - 1);
-        if (first_child != nullptr) {
-            lv_obj_del(first_child);
-        }
-        // Scroll to the last message immediately
-        if (last_child != nullptr) {
-            lv_obj_scroll_to_view_recursive(last_child, LV_ANIM_OFF);
-        }
+
+// Marks the row containers of the chat messages among the children of content_
+static const char kChatRowTag[] = "chat_row";
+
+// Creates the shared bubble styles or updates them for the theme. The objects using a style that
+// changed get one refresh per style, not a local style write each.
+void LcdDisplay::UpdateChatStyles(LvglTheme* lvgl_theme) {
+    if (!chat_styles_initialized_) {
+        lv_style_init(&bubble_style_);
+        lv_style_init(&user_bubble_style_);
+        lv_style_init(&assistant_bubble_style_);
+        lv_style_init(&system_bubble_style_);
+        lv_style_set_radius(&bubble_style_, 8);
+        lv_style_set_border_width(&bubble_style_, 0);
+        lv_style_set_bg_opa(&bubble_style_, LV_OPA_70);
+        chat_styles_initialized_ = true;
     }
-    
-    // 折叠系统消息（如果是系统消息，检查最后一个消息是否也是系统消息）
-    if (strcmp(role, "system") == 0) {
-        if (child_count > 0) {
-            // 获取最后一个消息容器
-            lv_obj_t* last_container = lv_obj_get_child(content_, child_count - 1);
-            if (last_container != nullptr && lv_obj_get_child_cnt(last_container) > 0) {
-                // 获取容器内的气泡
-                lv_obj_t* last_bubble = lv_obj_get_child(last_container, 0);
-                if (last_bubble != nullptr) {
-                    // 检查气泡类型是否为系统消息
-                    void* bubble_type_ptr = lv_obj_get_user_data(last_bubble);
-                    if (bubble_type_ptr != nullptr && strcmp((const char*)bubble_type_ptr, "system") == 0) {
-                        // 如果最后一个消息也是系统消息，则删除它
-                        lv_obj_del(last_container);
-                    }
-                }
-            }
-        }
-    } else {
-        // 隐藏居中显示的 AI logo
-        lv_obj_add_flag(emoji_label_, LV_OBJ_FLAG_HIDDEN);
+
+    lv_style_set_pad_all(&bubble_style_, lvgl_theme->spacing(4));
+    lv_style_set_border_color(&bubble_style_, lvgl_theme->border_color());
+    // The message labels inherit the text color of their bubble
+    lv_style_set_bg_color(&user_bubble_style_, lvgl_theme->user_bubble_color());
+    lv_style_set_text_color(&user_bubble_style_, lvgl_theme->text_color());
+    lv_style_set_bg_color(&assistant_bubble_style_, lvgl_theme->assistant_bubble_color());
+    lv_style_set_text_color(&assistant_bubble_style_, lvgl_theme->text_color());
+    lv_style_set_bg_color(&system_bubble_style_, lvgl_theme->system_bubble_color());
+    lv_style_set_text_color(&system_bubble_style_, lvgl_theme->system_text_color());
+
+    lv_obj_report_style_change(&bubble_style_);
+    lv_obj_report_style_change(&user_bubble_style_);
+    lv_obj_report_style_change(&assistant_bubble_style_);
+    lv_obj_report_style_change(&system_bubble_style_);
+}
+
+lv_style_t* LcdDisplay::ChatBubbleStyle(const char* role) {
+    if (role[0] == 'u') {
+        return &user_bubble_style_;
+    } else if (role[0] == 's') {
+        return &system_bubble_style_;
     }
+    return &assistant_bubble_style_;
+}
 
-    //避免出现空的消息框
-    if(strlen(content) == 0) {
-        return;
+static const char* ChatRole(const char* role) {
+    if (strcmp(role, "user") == 0) {
+        return "user";
+    } else if (strcmp(role, "system") == 0) {
+        return "system";
     }
+    return "assistant";
+}
 
+// A screenful of rows, so every bubble on the screen has an object: the smallest bubble is one
+// line of text with its padding
+size_t LcdDisplay::ChatRowPoolSize() {
     auto lvgl_theme = static_cast<LvglTheme*>(current_theme_);
-    auto text_font = lvgl_theme->text_font()->font();
+    int row_height = lvgl_theme->text_font()->font()->line_height + lvgl_theme->spacing(8) + lvgl_theme->spacing(4);
+    return std::min<size_t>(LV_VER_RES / row_height + 2, MAX_MESSAGES);
+}
 
-    // Create a message bubble
-    lv_obj_t* msg_bubble = lv_obj_create(content_);
-    lv_obj_set_style_radius(msg_bubble, 8, 0);
+lv_obj_t* LcdDisplay::CreateChatRow() {
+    // A full-width transparent row, so the bubble can be aligned to either side or the center
+    lv_obj_t* row = lv_obj_create(content_);
+    lv_obj_set_width(row, LV_HOR_RES);
+    lv_obj_set_height(row, LV_SIZE_CONTENT);
+    lv_obj_set_style_bg_opa(row, LV_OPA_TRANSP, 0);
+    lv_obj_set_style_border_width(row, 0, 0);
+    lv_obj_set_style_pad_all(row, 0, 0);
+    lv_obj_set_user_data(row, (void*)kChatRowTag);
+
+    lv_obj_t* msg_bubble = lv_obj_create(row);
+    lv_obj_add_style(msg_bubble, &bubble_style_, 0);
     lv_obj_set_scrollbar_mode(msg_bubble, LV_SCROLLBAR_MODE_OFF);
-    lv_obj_set_style_border_width(msg_bubble, 0, 0);
-    lv_obj_set_style_pad_all(msg_bubble, lvgl_theme->spacing(4), 0);
+    lv_obj_set_width(msg_bubble, LV_SIZE_CONTENT);
+    lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
+    lv_obj_set_style_flex_grow(msg_bubble, 0, 0);
 
-    // Create the message text
     lv_obj_t* msg_text = lv_label_create(msg_bubble);
-    lv_label_set_text(msg_text, content);
-    
-    // 计算文本实际宽度
-    lv_coord_t text_width = lv_txt_get_width(content, strlen(content), text_font, 0);
+    lv_label_set_long_mode(msg_text, LV_LABEL_LONG_WRAP);
+    return row;
+}
 
-    // 计算气泡宽度
-    lv_coord_t max_width = LV_HOR_RES * 85 / 100 - 16;  // 屏幕宽度的85%
-    lv_coord_t min_width = 20;  
-    lv_coord_t bubble_width;
-    
-    // 确保文本宽度不小于最小宽度
-    if (text_width < min_width) {
-        text_width = min_width;
+void LcdDisplay::SetChatRowWidth(lv_obj_t* msg_text, const std::string& text) {
+    auto lvgl_theme = static_cast<LvglTheme*>(current_theme_);
+    auto text_font = lvgl_theme->text_font()->font();
+    // 计算文本实际宽度，气泡最宽为屏幕宽度的85%
+    lv_coord_t max_width = LV_HOR_RES * 85 / 100 - 16;
+    lv_coord_t text_width = text_measure_.GetWidth(text_font, text.c_str(), text.size(), max_width);
+    lv_coord_t min_width = 20;
+    text_width = std::max(text_width, min_width);
+    if (lv_obj_get_style_width(msg_text, 0) != text_width) {
+        lv_obj_set_width(msg_text, text_width);
     }
+}
 
-    // 如果文本宽度小于最大宽度，使用文本宽度
-    if (text_width < max_width) {
-        bubble_width = text_width; 
-    } else {
-        bubble_width = max_width;
-    }
-    
-    // 设置消息文本的宽度
-    lv_obj_set_width(msg_text, bubble_width);  // 减去padding
-    lv_label_set_long_mode(msg_text, LV_LABEL_LONG_WRAP);
+// Sets the text and the style of a row in place, the objects are reused
+void LcdDisplay::FillChatRow(lv_obj_t* row, const ChatEntry& entry) {
+    lv_obj_t* msg_bubble = lv_obj_get_child(row, 0);
+    lv_obj_t* msg_text = lv_obj_get_child(msg_bubble, 0);
 
-    // 设置气泡宽度
-    lv_obj_set_width(msg_bubble, bubble_width);
-    lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
+    lv_label_set_text(msg_text, entry.text.c_str());
+    SetChatRowWidth(msg_text, entry.text);
 
-    // Set alignment and style based on message role
-    if (strcmp(role, "user") == 0) {
-        // User messages are right-aligned with green background
-        lv_obj_set_style_bg_color(msg_bubble, lvgl_theme->user_bubble_color(), 0);
-        lv_obj_set_style_bg_opa(msg_bubble, LV_OPA_70, 0);
-        // Set text color for contrast
-        lv_obj_set_style_text_color(msg_text, lvgl_theme->text_color(), 0);
-        
-        // 设置自定义属性标记气泡类型
-        lv_obj_set_user_data(msg_bubble, (void*)"user");
-        
-        // Set appropriate width for content
-        lv_obj_set_width(msg_bubble, LV_SIZE_CONTENT);
-        lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
-        
-        // Don't grow
-        lv_obj_set_style_flex_grow(msg_bubble, 0, 0);
-    } else if (strcmp(role, "assistant") == 0) {
-        // Assistant messages are left-aligned with white background
-        lv_obj_set_style_bg_color(msg_bubble, lvgl_theme->assistant_bubble_color(), 0);
-        lv_obj_set_style_bg_opa(msg_bubble, LV_OPA_70, 0);
-        // Set text color for contrast
-        lv_obj_set_style_text_color(msg_text, lvgl_theme->text_color(), 0);
-        
-        // 设置自定义属性标记气泡类型
-        lv_obj_set_user_data(msg_bubble, (void*)"assistant");
-        
-        // Set appropriate width for content
-        lv_obj_set_width(msg_bubble, LV_SIZE_CONTENT);
-        lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
-        
-        // Don't grow
-        lv_obj_set_style_flex_grow(msg_bubble, 0, 0);
-    } else if (strcmp(role, "system") == 0) {
-        // System messages are center-aligned with light gray background
-        lv_obj_set_style_bg_color(msg_bubble, lvgl_theme->system_bubble_color(), 0);
-        lv_obj_set_style_bg_opa(msg_bubble, LV_OPA_70, 0);
-        // Set text color for contrast
-        lv_obj_set_style_text_color(msg_text, lvgl_theme->system_text_color(), 0);
-        
-        // 设置自定义属性标记气泡类型
-        lv_obj_set_user_data(msg_bubble, (void*)"system");
-        
-        // Set appropriate width for content
-        lv_obj_set_width(msg_bubble, LV_SIZE_CONTENT);
-        lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
-        
-        // Don't grow
-        lv_obj_set_style_flex_grow(msg_bubble, 0, 0);
+    // 设置自定义属性标记气泡类型，角色不变时样式和位置也不变
+    auto previous_role = static_cast<const char*>(lv_obj_get_user_data(msg_bubble));
+    if (previous_role == entry.role) {
+        return;
     }
-    
-    // Create a full-width container for user messages to ensure right alignment
-    if (strcmp(role, "user") == 0) {
-        // Create a full-width container
-        lv_obj_t* container = lv_obj_create(content_);
-        lv_obj_set_width(container, LV_HOR_RES);
-        lv_obj_set_height(container, LV_SIZE_CONTENT);
-        
-        // Make container transparent and borderless
-        lv_obj_set_style_bg_opa(container, LV_OPA_TRANSP, 0);
-        lv_obj_set_style_border_width(container, 0, 0);
-        lv_obj_set_style_pad_all(container, 0, 0);
-        
-        // Move the message bubble into this container
-        lv_obj_set_parent(msg_bubble, container);
-        
-        // Right align the bubble in the container
+    if (previous_role != nullptr) {
+        lv_obj_remove_style(msg_bubble, ChatBubbleStyle(previous_role), 0);
+    }
+    lv_obj_add_style(msg_bubble, ChatBubbleStyle(entry.role), 0);
+    lv_obj_set_user_data(msg_bubble, (void*)entry.role);
+    if (entry.role[0] == 'u') {
+        // User messages are right-aligned with green background
         lv_obj_align(msg_bubble, LV_ALIGN_RIGHT_MID, -25, 0);
-        
-        // Auto-scroll to this container
-        lv_obj_scroll_to_view_recursive(container, LV_ANIM_ON);
-    } else if (strcmp(role, "system") == 0) {
-        // 为系统消息创建全宽容器以确保居中对齐
-        lv_obj_t* container = lv_obj_create(content_);
-        lv_obj_set_width(container, LV_HOR_RES);
-        lv_obj_set_height(container, LV_SIZE_CONTENT);
-        
-        // 使容器透明且无边框
-        lv_obj_set_style_bg_opa(container, LV_OPA_TRANSP, 0);
-        lv_obj_set_style_border_width(container, 0, 0);
-        lv_obj_set_style_pad_all(container, 0, 0);
-        
-        // 将消息气泡移入此容器
-        lv_obj_set_parent(msg_bubble, container);
-        
-        // 将气泡居中对齐在容器中
+    } else if (entry.role[0] == 's') {
+        // System messages are center-aligned with light gray background
         lv_obj_align(msg_bubble, LV_ALIGN_CENTER, 0, 0);
-        
-        // 自动滚动底部
-        lv_obj_scroll_to_view_recursive(container, LV_ANIM_ON);
     } else {
-        // For assistant messages
-        // Left align assistant messages
+        // Assistant messages are left-aligned with white background
         lv_obj_align(msg_bubble, LV_ALIGN_LEFT_MID, 0, 0);
+    }
+}
 
-        // Auto-scroll to the message bubble
-        lv_obj_scroll_to_view_recursive(msg_bubble, LV_ANIM_ON);
+// The user scrolled back in the history, the rows show the latest messages again
+void LcdDisplay::ShowLatestChatMessages() {
+    size_t first = chat_history_.size() - std::min(chat_rows_.size(), chat_history_.size());
+    if (chat_first_shown_ == first) {
+        return;
     }
-    
+    chat_first_shown_ = first;
+    for (size_t i = 0; i < chat_rows_.size(); i++) {
+        FillChatRow(chat_rows_[i], chat_history_[first + i]);
+    }
+}
+
+// Scrolled to the top: the newest row is recycled for the message before the first one
+void LcdDisplay::ShowEarlierChatMessage() {
+    if (chat_first_shown_ == 0 || chat_rows_.size() < 2) {
+        return;
+    }
+    lv_obj_t* first_row = chat_rows_.front();
+    lv_obj_t* row = chat_rows_.back();
+    chat_rows_.pop_back();
+    chat_rows_.push_front(row);
+    chat_first_shown_--;
+    FillChatRow(row, chat_history_[chat_first_shown_]);
+    lv_obj_move_to_index(row, lv_obj_get_index(first_row));
+    // Keep the view where it was, above the message that was on top
+    lv_obj_update_layout(content_);
+    lv_obj_scroll_to_y(content_, lv_obj_get_y(first_row) - lv_obj_get_style_pad_top(content_, 0), LV_ANIM_OFF);
+}
+
+void LcdDisplay::SetChatMessage(const char* role, const char* content) {
+    DisplayLockGuard lock(this);
+    if (content_ == nullptr) {
+        return;
+    }
+
+    role = ChatRole(role);
+    bool system = role[0] == 's';
+    if (!system) {
+        // 隐藏居中显示的 AI logo
+        lv_obj_add_flag(emoji_label_, LV_OBJ_FLAG_HIDDEN);
+    }
+    ShowLatestChatMessages();
+
+    // 折叠系统消息：上一条也是系统消息时，原地替换它
+    if (system && !chat_history_.empty() && chat_history_.back().role == role) {
+        if (strlen(content) == 0) {
+            chat_history_.pop_back();
+            if (chat_first_shown_ + chat_rows_.size() > chat_history_.size()) {
+                lv_obj_t* row = chat_rows_.back();
+                chat_rows_.pop_back();
+                lv_obj_add_flag(row, LV_OBJ_FLAG_HIDDEN);
+                free_chat_rows_.push_back(row);
+            }
+            return;
+        }
+        chat_history_.back().text = content;
+        FillChatRow(chat_rows_.back(), chat_history_.back());
+        lv_obj_scroll_to_view_recursive(chat_rows_.back(), LV_ANIM_ON);
+        chat_message_label_ = lv_obj_get_child(lv_obj_get_child(chat_rows_.back(), 0), 0);
+        return;
+    }
+
+    //避免出现空的消息框
+    if (strlen(content) == 0) {
+        return;
+    }
+
+    chat_history_.push_back({role, content});
+    if (chat_history_.size() > MAX_MESSAGES) {
+        chat_history_.pop_front();
+        if (chat_first_shown_ > 0) {
+            chat_first_shown_--;
+        }
+    }
+
+    lv_obj_t* row;
+    if (chat_rows_.size() < ChatRowPoolSize()) {
+        if (!free_chat_rows_.empty()) {
+            row = free_chat_rows_.back();
+            free_chat_rows_.pop_back();
+            lv_obj_remove_flag(row, LV_OBJ_FLAG_HIDDEN);
+        } else {
+            row = CreateChatRow();
+        }
+    } else {
+        // Recycle the oldest row, along with the preview images shown before it
+        row = chat_rows_.front();
+        chat_rows_.pop_front();
+        chat_first_shown_++;
+        lv_obj_t* child;
+        while ((child = lv_obj_get_child(content_, 0)) != nullptr && child != row &&
+                lv_obj_get_user_data(child) != kChatRowTag) {
+            lv_obj_del(child);
+        }
+    }
+    chat_rows_.push_back(row);
+    lv_obj_move_to_index(row, -1);
+    FillChatRow(row, chat_history_.back());
+
+    // Auto-scroll to the new message
+    lv_obj_scroll_to_view_recursive(row, LV_ANIM_ON);
+
     // Store reference to the latest message label
-    chat_message_label_ = msg_text;
+    chat_message_label_ = lv_obj_get_child(lv_obj_get_child(row, 0), 0);
+}
+
+// The streamed text goes into the label of the last bubble, no new row and no new measure of the
+// text before it. Once the bubble is at its widest only its height changes.
+void LcdDisplay::UpdateChatMessage(const char* role, const char* content, bool append) {
+    DisplayLockGuard lock(this);
+    if (content_ == nullptr) {
+        return;
+    }
+
+    role = ChatRole(role);
+    if (role[0] == 's' || chat_history_.empty() || chat_rows_.empty() || chat_history_.back().role != role) {
+        SetChatMessage(role, content);
+        return;
+    }
+    ShowLatestChatMessages();
+
+    auto& entry = chat_history_.back();
+    lv_obj_t* row = chat_rows_.back();
+    lv_obj_t* msg_text = lv_obj_get_child(lv_obj_get_child(row, 0), 0);
+    if (append) {
+        if (content[0] == '\0') {
+            return;
+        }
+        entry.text += content;
+        lv_label_ins_text(msg_text, LV_LABEL_POS_LAST, content);
+    } else {
+        if (entry.text == content) {
+            return;
+        }
+        entry.text = content;
+        lv_label_set_text(msg_text, content);
+    }
+    SetChatRowWidth(msg_text, entry.text);
+
+    // Keep the end of the message in view, a long one is taller than the screen
+    lv_obj_update_layout(content_);
+    lv_obj_scroll_by_bounded(content_, 0, -lv_obj_get_scroll_bottom(content_), LV_ANIM_ON);
 }
 
 void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
@@ -676,17 +847,11 @@ void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
         return;
     }
     
-    auto lvgl_theme = static_cast<LvglTheme*>(current_theme_);
-    // Create a message bubble for image preview
+    // Create a message bubble for image preview, styled as an assistant message
     lv_obj_t* img_bubble = lv_obj_create(content_);
-    lv_obj_set_style_radius(img_bubble, 8, 0);
+    lv_obj_add_style(img_bubble, &bubble_style_, 0);
+    lv_obj_add_style(img_bubble, &assistant_bubble_style_, 0);
     lv_obj_set_scrollbar_mode(img_bubble, LV_SCROLLBAR_MODE_OFF);
-    lv_obj_set_style_border_width(img_bubble, 0, 0);
-    lv_obj_set_style_pad_all(img_bubble, lvgl_theme->spacing(4), 0);
-    
-    // Set image bubble background color (similar to system message)
-    lv_obj_set_style_bg_color(img_bubble, lvgl_theme->assistant_bubble_color(), 0);
-    lv_obj_set_style_bg_opa(img_bubble, LV_OPA_70, 0);
     
     // 设置自定义属性标记气泡类型
     lv_obj_set_user_data(img_bubble, (void*)"image");
@@ -915,6 +1080,10 @@ void LcdDisplay::SetChatMessage(const char* role, const char* content) {
     }
     lv_label_set_text(chat_message_label_, content);
 }
+
+void LcdDisplay::UpdateChatMessage(const char* role, const char* content, bool append) {
+    Display::UpdateChatMessage(role, content, append);
+}
 #endif
 
 void LcdDisplay::SetEmotion(const char* emotion) {
@@ -946,6 +1115,7 @@ void LcdDisplay::SetEmotion(const char* emotion) {
     if (image->IsGif()) {
         // Create new GIF controller
         gif_controller_ = std::make_unique<LvglGif>(image->image_dsc());
+        gif_controller_->SetTimerPeriod(gif_timer_period_ms_);
         
         if (gif_controller_->IsLoaded()) {
             // Set up frame update callback
@@ -968,6 +1138,9 @@ void LcdDisplay::SetEmotion(const char* emotion) {
         lv_image_set_src(emoji_image_, image->image_dsc());
         lv_obj_add_flag(emoji_label_, LV_OBJ_FLAG_HIDDEN);
         lv_obj_remove_flag(emoji_image_, LV_OBJ_FLAG_HIDDEN);
+#if CONFIG_SPIRAM
+        emoji_collection->Retain(image);
+#endif
     }
 
 #if CONFIG_USE_WECHAT_MESSAGE_STYLE
@@ -986,8 +1159,43 @@ void LcdDisplay::SetEmotion(const char* emotion) {
 #endif
 }
 
+void LcdDisplay::OnRefreshPeriodChanged(uint32_t period_ms) {
+    // The GIF frames wait for the next refresh anyway, at the default rate they keep their 10 ms timing
+    if (period_ms == 0) {
+        gif_timer_period_ms_ = 1000;
+    } else {
+        gif_timer_period_ms_ = period_ms > LV_DEF_REFR_PERIOD ? period_ms : 10;
+    }
+    if (gif_controller_) {
+        gif_controller_->SetTimerPeriod(gif_timer_period_ms_);
+    }
+}
+
+void LcdDisplay::PreloadEmojis(std::shared_ptr<EmojiCollection> emoji_collection) {
+#if CONFIG_SPIRAM
+    // Called with the display locked. The LVGL timers run between the screen refreshes, so the
+    // decoding never delays a frame, and only one emoji per run keeps the UI responsive.
+    preload_emoji_collection_ = emoji_collection;
+    if (preload_emoji_collection_ == nullptr) {
+        return;
+    }
+    if (emoji_preload_timer_ == nullptr) {
+        emoji_preload_timer_ = lv_timer_create([](lv_timer_t* timer) {
+            auto self = static_cast<LcdDisplay*>(lv_timer_get_user_data(timer));
+            if (!self->preload_emoji_collection_->PreloadNext()) {
+                ESP_LOGI(TAG, "Emojis decoded into the image cache");
+                self->preload_emoji_collection_.reset();
+                self->emoji_preload_timer_ = nullptr;
+                lv_timer_delete(timer);
+            }
+        }, 100, this);
+    }
+#endif
+}
+
 void LcdDisplay::SetTheme(Theme* theme) {
     DisplayLockGuard lock(this);
+    text_measure_.Clear();
     
     auto lvgl_theme = static_cast<LvglTheme*>(theme);
     
@@ -1036,72 +1244,9 @@ void LcdDisplay::SetTheme(Theme* theme) {
     // Set content background opacity
     lv_obj_set_style_bg_opa(content_, LV_OPA_TRANSP, 0);
 
-    // If we have the chat message style, update all message bubbles
+    // The message bubbles share the styles of their role
 #if CONFIG_USE_WECHAT_MESSAGE_STYLE
-    // Iterate through all children of content (message containers or bubbles)
-    uint32_t child_count = lv_obj_get_child_cnt(content_);
-    for (uint32_t i = 0; i < child_count; i++) {
-        lv_obj_t* obj = lv_obj_get_child(content_, i);
-        if (obj == nullptr) continue;
-        
-        lv_obj_t* bubble = nullptr;
-        
-        // 检查这个对象是容器还是气泡
-        // 如果是容器（用户或系统消息），则获取其子对象作为气泡
-        // 如果是气泡（助手消息），则直接使用
-        if (lv_obj_get_child_cnt(obj) > 0) {
-            // 可能是容器，检查它是否为用户或系统消息容器
-            // 用户和系统消息容器是透明的
-            lv_opa_t bg_opa = lv_obj_get_style_bg_opa(obj, 0);
-            if (bg_opa == LV_OPA_TRANSP) {
-                // 这是用户或系统消息的容器
-                bubble = lv_obj_get_child(obj, 0);
-            } else {
-                // 这可能是助手消息的气泡自身
-                bubble = obj;
-            }
-        } else {
-            // 没有子元素，可能是其他UI元素，跳过
-            continue;
-        }
-        
-        if (bubble == nullptr) continue;
-        
-        // 使用保存的用户数据来识别气泡类型
-        void* bubble_type_ptr = lv_obj_get_user_data(bubble);
-        if (bubble_type_ptr != nullptr) {
-            const char* bubble_type = static_cast<const char*>(bubble_type_ptr);
-            
-            // 根据气泡类型应用正确的颜色
-            if (strcmp(bubble_type, "user") == 0) {
-                lv_obj_set_style_bg_color(bubble, lvgl_theme->user_bubble_color(), 0);
-            } else if (strcmp(bubble_type, "assistant") == 0) {
-                lv_obj_set_style_bg_color(bubble, lvgl_theme->assistant_bubble_color(), 0); 
-            } else if (strcmp(bubble_type, "system") == 0) {
-                lv_obj_set_style_bg_color(bubble, lvgl_theme->system_bubble_color(), 0);
-            } else if (strcmp(bubble_type, "image") == 0) {
-                lv_obj_set_style_bg_color(bubble, lvgl_theme->system_bubble_color(), 0);
-            }
-            
-            // Update border color
-            lv_obj_set_style_border_color(bubble, lvgl_theme->border_color(), 0);
-            
-            // Update text color for the message
-            if (lv_obj_get_child_cnt(bubble) > 0) {
-                lv_obj_t* text = lv_obj_get_child(bubble, 0);
-                if (text != nullptr) {
-                    // 根据气泡类型设置文本颜色
-                    if (strcmp(bubble_type, "system") == 0) {
-                        lv_obj_set_style_text_color(text, lvgl_theme->system_text_color(), 0);
-                    } else {
-                        lv_obj_set_style_text_color(text, lvgl_theme->text_color(), 0);
-                    }
-                }
-            }
-        } else {
-            ESP_LOGW(TAG, "child[%lu] Bubble type is not found", i);
-        }
-    }
+    UpdateChatStyles(lvgl_theme);
 #else
     // Simple UI mode - just update the main chat message
     if (chat_message_label_ != nullptr) {
@@ -1116,6 +1261,8 @@ void LcdDisplay::SetTheme(Theme* theme) {
     // Update low battery popup
     lv_obj_set_style_bg_color(low_battery_popup_, lvgl_theme->low_battery_color(), 0);
 
+    PreloadEmojis(lvgl_theme->emoji_collection());
+
     // No errors occurred. Save theme to settings
     Display::SetTheme(lvgl_theme);
 }
@@ -3,6 +3,8 @@
 
 #include "lvgl_display.h"
 #include "gif/lvgl_gif.h"
+#include "lvgl_text_measure.h"
+#include "lcd_direct_renderer.h"
 
 #include <esp_lcd_panel_io.h>
 #include <esp_lcd_panel_ops.h>
@@ -10,6 +12,9 @@
 
 #include <atomic>
 #include <memory>
+#include <deque>
+#include <vector>
+#include <string>
 
 #define PREVIEW_IMAGE_DURATION_MS 5000
 
@@ -28,11 +33,46 @@ protected:
     lv_obj_t* emoji_label_ = nullptr;
     lv_obj_t* emoji_image_ = nullptr;
     std::unique_ptr<LvglGif> gif_controller_ = nullptr;
+    uint32_t gif_timer_period_ms_ = 10;     // Slower with the LVGL refresh when idle
     lv_obj_t* emoji_box_ = nullptr;
     lv_obj_t* chat_message_label_ = nullptr;
     esp_timer_handle_t preview_timer_ = nullptr;
     std::unique_ptr<LvglImage> preview_image_cached_ = nullptr;
+    // Decodes the emojis of the theme into the image cache, one per LVGL timer run
+    lv_timer_t* emoji_preload_timer_ = nullptr;
+    std::shared_ptr<EmojiCollection> preload_emoji_collection_;
 
+    // The chat history of the WeChat message style. Only a screenful of it has LVGL objects, the
+    // message rows are recycled as the messages come and as the user scrolls back.
+    struct ChatEntry {
+        const char* role;
+        std::string text;
+    };
+    std::deque<ChatEntry> chat_history_;
+    std::deque<lv_obj_t*> chat_rows_;           // The rows in content_, oldest first
+    std::vector<lv_obj_t*> free_chat_rows_;     // Hidden rows for the next messages
+    size_t chat_first_shown_ = 0;               // Index in chat_history_ of the first row
+    LvglTextMeasure text_measure_;
+
+    // The bubbles share these styles by role, a theme switch only updates the styles
+    bool chat_styles_initialized_ = false;
+    lv_style_t bubble_style_;
+    lv_style_t user_bubble_style_;
+    lv_style_t assistant_bubble_style_;
+    lv_style_t system_bubble_style_;
+
+    void UpdateChatStyles(LvglTheme* lvgl_theme);
+    lv_style_t* ChatBubbleStyle(const char* role);
+
+    size_t ChatRowPoolSize();
+    lv_obj_t* CreateChatRow();
+    void FillChatRow(lv_obj_t* row, const ChatEntry& entry);
+    void SetChatRowWidth(lv_obj_t* msg_text, const std::string& text);
+    void ShowLatestChatMessages();
+    void ShowEarlierChatMessage();
+
+    void PreloadEmojis(std::shared_ptr<EmojiCollection> emoji_collection);
+    virtual void OnRefreshPeriodChanged(uint32_t period_ms) override;
     void InitializeLcdThemes();
     void SetupUI();
     virtual bool Lock(int timeout_ms = 0) override;
@@ -41,11 +81,15 @@ protected:
 protected:
     // 添加protected构造函数
     LcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel, int width, int height);
+    // With CONFIG_LCD_DIRECT_RENDER, draws into the frame buffers of an RGB or DPI panel, see
+    // LcdDirectRenderer. False when the panel or the rotation does not allow it
+    bool AddDirectDisplay(LcdDirectRenderer::PanelType type, bool mirror_x, bool mirror_y, bool swap_xy);
     
 public:
     ~LcdDisplay();
     virtual void SetEmotion(const char* emotion) override;
     virtual void SetChatMessage(const char* role, const char* content) override; 
+    virtual void UpdateChatMessage(const char* role, const char* content, bool append) override;
     virtual void SetPreviewImage(std::unique_ptr<LvglImage> image) override;
 
     // Add theme switching function
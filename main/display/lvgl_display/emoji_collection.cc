@@ -20,7 +20,54 @@ const LvglImage* EmojiCollection::GetEmojiImage(const char* name) {
     return nullptr;
 }
 
+bool EmojiCollection::PreloadNext() {
+    while (preload_index_ < emoji_collection_.size()) {
+        auto image = std::next(emoji_collection_.begin(), preload_index_++)->second;
+        if (image->IsGif()) {
+            // Played by LvglGif, not decoded by LVGL
+            continue;
+        }
+        lv_image_decoder_dsc_t decoder_dsc;
+        if (lv_image_decoder_open(&decoder_dsc, image->image_dsc(), nullptr) == LV_RESULT_OK) {
+            lv_image_decoder_close(&decoder_dsc);
+        }
+        return true;
+    }
+    return false;
+}
+
+void EmojiCollection::Retain(const LvglImage* image) {
+    for (auto it = retained_.begin(); it != retained_.end(); ++it) {
+        if (it->image == image) {
+            retained_.splice(retained_.begin(), retained_, it);
+            return;
+        }
+    }
+    if (image->IsGif()) {
+        return;
+    }
+
+    RetainedEmoji retained = { image };
+    if (lv_image_decoder_open(&retained.decoder_dsc, image->image_dsc(), nullptr) != LV_RESULT_OK) {
+        return;
+    }
+    if (retained.decoder_dsc.cache_entry == nullptr) {
+        // Drawn straight from its data, nothing to keep
+        lv_image_decoder_close(&retained.decoder_dsc);
+        return;
+    }
+    retained_.push_front(retained);
+    if (retained_.size() > kRetainedEmojis) {
+        lv_image_decoder_close(&retained_.back().decoder_dsc);
+        retained_.pop_back();
+    }
+}
+
 EmojiCollection::~EmojiCollection() {
+    for (auto& retained : retained_) {
+        lv_image_decoder_close(&retained.decoder_dsc);
+    }
+    retained_.clear();
     for (auto it = emoji_collection_.begin(); it != emoji_collection_.end(); ++it) {
         delete it->second;
     }
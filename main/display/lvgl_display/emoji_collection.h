@@ -6,6 +6,7 @@
 #include <lvgl.h>
 
 #include <map>
+#include <list>
 #include <string>
 #include <memory>
 
@@ -17,8 +18,29 @@ public:
     virtual const LvglImage* GetEmojiImage(const char* name);
     virtual ~EmojiCollection();
 
+    /*
+     * The decoded PNG emojis live in the LVGL image cache. These are called under the display lock.
+     *
+     * PreloadNext() decodes the next emoji of the collection into the cache, false once all are.
+     * Retain() keeps the cache entry of a shown emoji open, so the last kRetainedEmojis shown
+     * are never evicted by the other images.
+     */
+    bool PreloadNext();
+    void Retain(const LvglImage* image);
+
 private:
-    std::map<std::string, LvglImage*> emoji_collection_;
+    static constexpr size_t kRetainedEmojis = 3;
+
+    struct RetainedEmoji {
+        const LvglImage* image;
+        lv_image_decoder_dsc_t decoder_dsc;
+    };
+
+    // Looked up by the const char* name, without making a std::string
+    std::map<std::string, LvglImage*, std::less<>> emoji_collection_;
+    size_t preload_index_ = 0;
+    // Most recently shown first
+    std::list<RetainedEmoji> retained_;
 };
 
 class Twemoji32 : public EmojiCollection {
@@ -1,15 +1,103 @@
 #include "lvgl_gif.h"
+#include "heap_accounting.h"
+#include "audio_pressure.h"
 #include <esp_log.h>
 #include <cstring>
+#include <list>
+#include <vector>
 
 #define TAG "LvglGif"
 
+#if CONFIG_SPIRAM && CONFIG_LVGL_GIF_FRAME_CACHE_KB > 0
+#define GIF_FRAME_CACHE_SIZE (CONFIG_LVGL_GIF_FRAME_CACHE_KB * 1024)
+#else
+#define GIF_FRAME_CACHE_SIZE 0
+#endif
+
+struct GifFrames {
+    struct Frame {
+        uint8_t* pixels;    // ARGB8888 in PSRAM
+        uint16_t delay;     // In 10 ms units
+    };
+
+    uint16_t width = 0;
+    uint16_t height = 0;
+    int32_t loop_count = -1;    // As gifdec keeps it: 0 forever, below 2 once, otherwise passes + 1
+    size_t bytes = 0;
+    std::vector<Frame> frames;
+
+    ~GifFrames() {
+        for (auto& frame : frames) {
+            HeapAccounting::Free(kHeapTagDisplay, frame.pixels);
+        }
+    }
+};
+
+namespace {
+
+/*
+ * The GIFs whose decoded frames fit in CONFIG_LVGL_GIF_FRAME_CACHE_KB, keyed by the GIF data of
+ * the assets and the most recently shown first. The GIFs are created and played under the display
+ * lock, so is the cache. An evicted entry is freed by the last player still holding it.
+ */
+struct CacheEntry {
+    const uint8_t* data;
+    std::shared_ptr<GifFrames> frames;
+};
+
+std::list<CacheEntry> cache_;
+size_t cache_bytes_ = 0;
+
+std::shared_ptr<GifFrames> FindCachedFrames(const uint8_t* data) {
+    for (auto it = cache_.begin(); it != cache_.end(); ++it) {
+        if (it->data == data) {
+            cache_.splice(cache_.begin(), cache_, it);
+            return it->frames;
+        }
+    }
+    return nullptr;
+}
+
+// Drops the least recently shown GIFs until the size is free
+void ReserveCache(size_t size) {
+    while (!cache_.empty() && cache_bytes_ + size > GIF_FRAME_CACHE_SIZE) {
+        cache_bytes_ -= cache_.back().frames->bytes;
+        cache_.pop_back();
+    }
+    cache_bytes_ += size;
+}
+
+void ReleaseCache(size_t size) {
+    cache_bytes_ -= size;
+}
+
+} // namespace
+
 LvglGif::LvglGif(const lv_img_dsc_t* img_dsc)
     : gif_(nullptr), timer_(nullptr), last_call_(0), playing_(false), loaded_(false) {
+    memset(&img_dsc_, 0, sizeof(img_dsc_));
     if (!img_dsc || !img_dsc->data) {
         ESP_LOGE(TAG, "Invalid image descriptor");
         return;
     }
+    data_ = img_dsc->data;
+
+    frames_ = FindCachedFrames(data_);
+    if (frames_) {
+        // The frames are shared by the players of this GIF, LVGL is not to modify them
+        img_dsc_.header.magic = LV_IMAGE_HEADER_MAGIC;
+        img_dsc_.header.cf = LV_COLOR_FORMAT_ARGB8888;
+        img_dsc_.header.w = frames_->width;
+        img_dsc_.header.h = frames_->height;
+        img_dsc_.header.stride = frames_->width * 4;
+        img_dsc_.data = frames_->frames[0].pixels;
+        img_dsc_.data_size = frames_->width * frames_->height * 4;
+        loops_left_ = frames_->loop_count;
+        loaded_ = true;
+        ESP_LOGD(TAG, "GIF played from the frame cache: %dx%d, %u frames", frames_->width, frames_->height,
+            (unsigned)frames_->frames.size());
+        return;
+    }
 
     gif_ = gd_open_gif_data(img_dsc->data);
     if (!gif_) {
@@ -18,7 +106,6 @@ LvglGif::LvglGif(const lv_img_dsc_t* img_dsc)
     }
 
     // Setup LVGL image descriptor
-    memset(&img_dsc_, 0, sizeof(img_dsc_));
     img_dsc_.header.magic = LV_IMAGE_HEADER_MAGIC;
     img_dsc_.header.flags = LV_IMAGE_FLAGS_MODIFIABLE;
     img_dsc_.header.cf = LV_COLOR_FORMAT_ARGB8888;
@@ -33,6 +120,13 @@ LvglGif::LvglGif(const lv_img_dsc_t* img_dsc)
         gd_render_frame(gif_, gif_->canvas);
     }
 
+    // Keep the frames of the first loop when a single frame fits in the cache
+    if (gif_->canvas && img_dsc_.data_size <= GIF_FRAME_CACHE_SIZE) {
+        recording_ = std::make_shared<GifFrames>();
+        recording_->width = gif_->width;
+        recording_->height = gif_->height;
+    }
+
     loaded_ = true;
     ESP_LOGD(TAG, "GIF loaded from image descriptor: %dx%d", gif_->width, gif_->height);
 }
@@ -52,7 +146,7 @@ const lv_img_dsc_t* LvglGif::image_dsc() const {
 
 // Animation control methods
 void LvglGif::Start() {
-    if (!loaded_ || !gif_) {
+    if (!loaded_) {
         ESP_LOGW(TAG, "GIF not loaded, cannot start");
         return;
     }
@@ -61,7 +155,7 @@ void LvglGif::Start() {
         timer_ = lv_timer_create([](lv_timer_t* timer) {
             LvglGif* gif_obj = static_cast<LvglGif*>(lv_timer_get_user_data(timer));
             gif_obj->NextFrame();
-        }, 10, this);
+        }, timer_period_ms_, this);
     }
 
     if (timer_) {
@@ -71,7 +165,11 @@ void LvglGif::Start() {
         lv_timer_reset(timer_);
         
         // Render first frame
-        NextFrame();
+        if (frames_) {
+            ShowCachedFrame();
+        } else {
+            NextFrame();
+        }
         
         ESP_LOGD(TAG, "GIF animation started");
     }
@@ -86,7 +184,7 @@ void LvglGif::Pause() {
 }
 
 void LvglGif::Resume() {
-    if (!loaded_ || !gif_) {
+    if (!loaded_) {
         ESP_LOGW(TAG, "GIF not loaded, cannot resume");
         return;
     }
@@ -104,8 +202,20 @@ void LvglGif::Stop() {
         lv_timer_pause(timer_);
     }
 
-    if (gif_) {
+    if (frames_) {
+        frame_index_ = 0;
+        loops_left_ = frames_->loop_count;
+        ESP_LOGD(TAG, "GIF animation stopped and rewound");
+    } else if (gif_) {
         gd_rewind(gif_);
+        // Record again from the first frame
+        if (recording_) {
+            ReleaseCache(recording_->bytes);
+            auto frames = std::make_shared<GifFrames>();
+            frames->width = recording_->width;
+            frames->height = recording_->height;
+            recording_ = std::move(frames);
+        }
         NextFrame();
         ESP_LOGD(TAG, "GIF animation stopped and rewound");
     }
@@ -120,40 +230,60 @@ bool LvglGif::IsLoaded() const {
 }
 
 int32_t LvglGif::GetLoopCount() const {
-    if (!loaded_ || !gif_) {
+    if (!loaded_) {
         return -1;
     }
-    return gif_->loop_count;
+    return frames_ ? loops_left_ : gif_->loop_count;
 }
 
 void LvglGif::SetLoopCount(int32_t count) {
-    if (!loaded_ || !gif_) {
+    if (!loaded_) {
         ESP_LOGW(TAG, "GIF not loaded, cannot set loop count");
         return;
     }
-    gif_->loop_count = count;
+    if (frames_) {
+        loops_left_ = count;
+    } else {
+        gif_->loop_count = count;
+    }
 }
 
 uint16_t LvglGif::width() const {
-    if (!loaded_ || !gif_) {
+    if (!loaded_) {
         return 0;
     }
-    return gif_->width;
+    return img_dsc_.header.w;
 }
 
 uint16_t LvglGif::height() const {
-    if (!loaded_ || !gif_) {
+    if (!loaded_) {
         return 0;
     }
-    return gif_->height;
+    return img_dsc_.header.h;
 }
 
 void LvglGif::SetFrameCallback(std::function<void()> callback) {
     frame_callback_ = callback;
 }
 
+void LvglGif::SetTimerPeriod(uint32_t period_ms) {
+    timer_period_ms_ = period_ms;
+    if (timer_) {
+        lv_timer_set_period(timer_, period_ms);
+    }
+}
+
 void LvglGif::NextFrame() {
-    if (!loaded_ || !gif_ || !playing_) {
+    if (!loaded_ || !playing_) {
+        return;
+    }
+    // The frame on screen stays while the audio pipeline is at risk: a new frame is a decode, or
+    // a copy from the cache, and a redraw of the image. The delay runs on, it shows once over
+    if (AudioPressure::GetInstance().IsActive()) {
+        return;
+    }
+    if (frames_) {
+        NextCachedFrame();
         return;
     }
 
@@ -166,6 +296,8 @@ void LvglGif::NextFrame() {
     last_call_ = lv_tick_get();
 
     // Get next frame
+    uint32_t position = gif_->f_rw_p;
+    int32_t loop_count = gif_->loop_count;
     int has_next = gd_get_frame(gif_);
     if (has_next == 0) {
         // Animation finished, pause timer
@@ -174,11 +306,33 @@ void LvglGif::NextFrame() {
             lv_timer_pause(timer_);
         }
         ESP_LOGD(TAG, "GIF animation completed");
+        if (recording_) {
+            FinishRecording(loop_count);
+            if (frames_) {
+                frame_index_ = frames_->frames.size() - 1;
+                ShowCachedFrame();
+                return;
+            }
+        }
+    } else if (has_next < 0) {
+        recording_.reset();
+    } else if (recording_ && gif_->f_rw_p <= position) {
+        // Back at the first frame, the next loops play from the cache
+        FinishRecording(loop_count);
+        if (frames_) {
+            frame_index_ = 0;
+            loops_left_ = loop_count > 1 ? loop_count - 1 : loop_count;
+            ShowCachedFrame();
+            return;
+        }
     }
 
     // Render current frame
     if (gif_->canvas) {
         gd_render_frame(gif_, gif_->canvas);
+        if (has_next > 0 && recording_) {
+            RecordFrame();
+        }
         
         // Call frame callback if set
         if (frame_callback_) {
@@ -187,6 +341,81 @@ void LvglGif::NextFrame() {
     }
 }
 
+void LvglGif::NextCachedFrame() {
+    // Same timing and loops as the decoder
+    uint32_t elapsed = lv_tick_elaps(last_call_);
+    if (elapsed < frames_->frames[frame_index_].delay * 10) {
+        return;
+    }
+
+    if (frame_index_ + 1 < frames_->frames.size()) {
+        frame_index_++;
+    } else {
+        if (loops_left_ == 1 || loops_left_ < 0) {
+            playing_ = false;
+            if (timer_) {
+                lv_timer_pause(timer_);
+            }
+            ESP_LOGD(TAG, "GIF animation completed");
+            return;
+        }
+        if (loops_left_ > 1) {
+            loops_left_--;
+        }
+        frame_index_ = 0;
+    }
+    ShowCachedFrame();
+}
+
+void LvglGif::ShowCachedFrame() {
+    last_call_ = lv_tick_get();
+    img_dsc_.data = frames_->frames[frame_index_].pixels;
+    // The descriptor stays the same with new pixels, forget what LVGL cached for it
+    lv_image_cache_drop(&img_dsc_);
+    if (frame_callback_) {
+        frame_callback_();
+    }
+}
+
+void LvglGif::RecordFrame() {
+    size_t size = img_dsc_.data_size;
+    if (recording_->bytes + size > GIF_FRAME_CACHE_SIZE) {
+        ESP_LOGD(TAG, "GIF frames over the cache size, not cached");
+        ReleaseCache(recording_->bytes);
+        recording_.reset();
+        return;
+    }
+
+    ReserveCache(size);
+    auto pixels = static_cast<uint8_t*>(HeapAccounting::Malloc(kHeapTagDisplay, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));
+    if (pixels == nullptr) {
+        ESP_LOGW(TAG, "No PSRAM for the GIF frame cache");
+        ReleaseCache(recording_->bytes + size);
+        recording_.reset();
+        return;
+    }
+    memcpy(pixels, gif_->canvas, size);
+    recording_->frames.push_back({pixels, gif_->gce.delay});
+    recording_->bytes += size;
+}
+
+void LvglGif::FinishRecording(int32_t loop_count) {
+    auto frames = std::move(recording_);
+    if (frames->frames.empty()) {
+        return;
+    }
+    frames->loop_count = loop_count;
+    cache_.push_front({data_, frames});
+    ESP_LOGI(TAG, "Cached %u GIF frames, %u KB, cache %u KB", (unsigned)frames->frames.size(),
+        (unsigned)(frames->bytes / 1024), (unsigned)(cache_bytes_ / 1024));
+
+    // Play from the cache and free the decoder
+    frames_ = std::move(frames);
+    img_dsc_.header.flags = 0;
+    gd_close_gif(gif_);
+    gif_ = nullptr;
+}
+
 void LvglGif::Cleanup() {
     // Stop and delete timer
     if (timer_) {
@@ -200,6 +429,13 @@ void LvglGif::Cleanup() {
         gif_ = nullptr;
     }
 
+    // A recording not finished gives its room in the cache back
+    if (recording_) {
+        ReleaseCache(recording_->bytes);
+        recording_.reset();
+    }
+    frames_.reset();
+
     playing_ = false;
     loaded_ = false;
     
@@ -6,6 +6,9 @@
 #include <memory>
 #include <functional>
 
+// The decoded frames of one GIF, shared with the frame cache
+struct GifFrames;
+
 /**
  * C++ implementation of LVGL GIF widget
  * Provides GIF animation functionality using gifdec library
@@ -69,6 +72,11 @@ public:
      */
     void SetFrameCallback(std::function<void()> callback);
 
+    /**
+     * Set how often the frame timing is checked, 10 ms by default
+     */
+    void SetTimerPeriod(uint32_t period_ms);
+
 private:
     // GIF decoder instance
     gd_GIF* gif_;
@@ -78,6 +86,7 @@ private:
     
     // Animation timer
     lv_timer_t* timer_;
+    uint32_t timer_period_ms_ = 10;
     
     // Last frame update time
     uint32_t last_call_;
@@ -88,11 +97,30 @@ private:
     
     // Frame update callback
     std::function<void()> frame_callback_;
-    
+
+    // GIF data, the key of the frame cache
+    const uint8_t* data_ = nullptr;
+
+    // Playing from the frame cache: the frames, the one shown and the loops left
+    std::shared_ptr<GifFrames> frames_;
+    size_t frame_index_ = 0;
+    int32_t loops_left_ = -1;
+
+    // The frames copied while decoding the first loop, null once over the cache size
+    std::shared_ptr<GifFrames> recording_;
+
     /**
      * Update to next frame
      */
     void NextFrame();
+    void NextCachedFrame();
+    void ShowCachedFrame();
+
+    /**
+     * Frame cache recording while decoding
+     */
+    void RecordFrame();
+    void FinishRecording(int32_t loop_count);
     
     /**
      * Cleanup resources
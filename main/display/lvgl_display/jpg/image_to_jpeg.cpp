@@ -1,6 +1,7 @@
 #include <esp_attr.h>
 #include <esp_heap_caps.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <stddef.h>
 #include <string.h>
 
@@ -8,6 +9,9 @@
 #include "esp_jpeg_enc.h"
 #if CONFIG_XIAOZHI_ENABLE_HARDWARE_JPEG_ENCODER
 #include "driver/jpeg_encode.h"
+#include "esp_cache.h"
+#include "esp_memory_utils.h"
+#include <mutex>
 #endif
 #include "image_to_jpeg.h"
 
@@ -24,6 +28,49 @@ static void* malloc_psram(size_t size) {
 #endif
 }
 
+static __always_inline uint32_t swap_bytes16x2(uint32_t v) {
+    return ((v & 0x00FF00FF) << 8) | ((v >> 8) & 0x00FF00FF);
+}
+
+void image_swap_bytes16(uint8_t* dst, const uint8_t* src, size_t len) {
+    size_t i = 0;
+    if ((((uintptr_t)dst | (uintptr_t)src) & 3) == 0) {
+        const uint32_t* s = (const uint32_t*)src;
+        uint32_t* d = (uint32_t*)dst;
+        size_t words = len / 4;
+        size_t w = 0;
+        // 先读完8个字再写，PSRAM 的读写各自成块
+        for (; w + 8 <= words; w += 8) {
+            uint32_t v0 = s[w], v1 = s[w + 1], v2 = s[w + 2], v3 = s[w + 3];
+            uint32_t v4 = s[w + 4], v5 = s[w + 5], v6 = s[w + 6], v7 = s[w + 7];
+            d[w] = swap_bytes16x2(v0);
+            d[w + 1] = swap_bytes16x2(v1);
+            d[w + 2] = swap_bytes16x2(v2);
+            d[w + 3] = swap_bytes16x2(v3);
+            d[w + 4] = swap_bytes16x2(v4);
+            d[w + 5] = swap_bytes16x2(v5);
+            d[w + 6] = swap_bytes16x2(v6);
+            d[w + 7] = swap_bytes16x2(v7);
+        }
+        for (; w < words; w++) {
+            d[w] = swap_bytes16x2(s[w]);
+        }
+        i = words * 4;
+    } else {
+        for (; i + 4 <= len; i += 4) {
+            uint32_t v;
+            memcpy(&v, src + i, 4);
+            v = swap_bytes16x2(v);
+            memcpy(dst + i, &v, 4);
+        }
+    }
+    for (; i + 2 <= len; i += 2) {
+        uint8_t b = src[i];
+        dst[i] = src[i + 1];
+        dst[i + 1] = b;
+    }
+}
+
 static __always_inline uint8_t expand_5_to_8(uint8_t v) {
     return (uint8_t)((v << 3) | (v >> 2));
 }
@@ -69,16 +116,8 @@ static uint8_t* convert_input_to_encoder_buf(const uint8_t* src, uint16_t width,
         uint8_t* buf = (uint8_t*)jpeg_calloc_align(sz, 16);
         if (!buf)
             return NULL;
-        uint8_t* d = buf;
-        for (int i = 0; i < sz; i += 4) {
-            // src: Cb, Y0, Cr, Y1 -> dst: Y0, Cb, Y1, Cr
-            d[0] = s[1];
-            d[1] = s[0];
-            d[2] = s[3];
-            d[3] = s[2];
-            s += 4;
-            d += 4;
-        }
+        // src: Cb, Y0, Cr, Y1 -> dst: Y0, Cb, Y1, Cr
+        image_swap_bytes16(buf, s, sz);
         if (out_fmt)
             *out_fmt = JPEG_PIXEL_FORMAT_YCbYCr;
         if (out_size)
@@ -128,14 +167,15 @@ static uint8_t* convert_input_to_encoder_buf(const uint8_t* src, uint16_t width,
     if (format == V4L2_PIX_FMT_RGB24) {
         // V4L2_RGB24 即 RGB888
         memcpy(rgb, src, rgb_size);
-    } else if (format == V4L2_PIX_FMT_RGB565) {
-        // RGB565 小端，需要转换为 RGB888
+    } else if (format == V4L2_PIX_FMT_RGB565 || format == V4L2_PIX_FMT_RGB565X) {
+        // RGB565 小端 / RGB565X 大端，转换为 RGB888 时顺便处理字节序
         const uint8_t* p = src;
         uint8_t* d = rgb;
         int pixels = (int)width * (int)height;
+        int lo_index = format == V4L2_PIX_FMT_RGB565 ? 0 : 1;
         for (int i = 0; i < pixels; i++) {
-            uint8_t lo = p[0];  // 低字节（LSB）
-            uint8_t hi = p[1];  // 高字节（MSB）
+            uint8_t lo = p[lo_index];       // 低字节（LSB）
+            uint8_t hi = p[lo_index ^ 1];   // 高字节（MSB）
             p += 2;
 
             uint8_t r5 = (hi >> 3) & 0x1F;
@@ -161,8 +201,11 @@ static uint8_t* convert_input_to_encoder_buf(const uint8_t* src, uint16_t width,
 
 #if CONFIG_XIAOZHI_ENABLE_HARDWARE_JPEG_ENCODER
 static jpeg_encoder_handle_t s_hw_jpeg_handle = NULL;
+static std::mutex s_hw_jpeg_mutex;
 
+// The camera and the screen snapshot may encode at the same time
 static bool hw_jpeg_ensure_inited(void) {
+    std::lock_guard<std::mutex> lock(s_hw_jpeg_mutex);
     if (s_hw_jpeg_handle) {
         return true;
     }
@@ -179,11 +222,31 @@ static bool hw_jpeg_ensure_inited(void) {
     return true;
 }
 
+// 硬件编码器的输入需要 DMA 可访问、按 cache line 对齐的缓冲区
+static uint8_t* hw_alloc_input(size_t size) {
+    jpeg_encode_memory_alloc_cfg_t mem_cfg = { .buffer_direction = JPEG_ENC_ALLOC_INPUT_BUFFER };
+    size_t allocated = 0;
+    return (uint8_t*)jpeg_alloc_encoder_mem(size, &mem_cfg, &allocated);
+}
+
+// A source the DMA can read as it is, aligned in address and size to the cache line
+static bool hw_can_read_directly(const uint8_t* src, size_t size) {
+    uint32_t caps = esp_ptr_external_ram(src) ? MALLOC_CAP_SPIRAM | MALLOC_CAP_DMA : MALLOC_CAP_DMA;
+    if (!esp_ptr_dma_ext_capable(src) && !esp_ptr_dma_capable(src)) {
+        return false;
+    }
+    size_t alignment = 0;
+    if (esp_cache_get_alignment(caps, &alignment) != ESP_OK || alignment == 0) {
+        alignment = 4;
+    }
+    return ((uintptr_t)src % alignment) == 0 && (size % alignment) == 0;
+}
+
 static uint8_t* convert_input_to_hw_encoder_buf(const uint8_t* src, uint16_t width, uint16_t height, v4l2_pix_fmt_t format,
                                                 jpeg_enc_input_format_t* out_fmt, int* out_size) {
     if (format == V4L2_PIX_FMT_GREY) {
         int sz = (int)width * (int)height;
-        uint8_t* buf = (uint8_t*)malloc_psram(sz);
+        uint8_t* buf = (uint8_t*)hw_alloc_input(sz);
         if (!buf)
             return NULL;
         memcpy(buf, src, sz);
@@ -196,9 +259,9 @@ static uint8_t* convert_input_to_hw_encoder_buf(const uint8_t* src, uint16_t wid
 
     if (format == V4L2_PIX_FMT_RGB24) {
         int sz = (int)width * (int)height * 3;
-        uint8_t* buf = (uint8_t*)malloc_psram(sz);
+        uint8_t* buf = (uint8_t*)hw_alloc_input(sz);
         if (!buf) {
-            ESP_LOGE(TAG, "malloc_psram failed");
+            ESP_LOGE(TAG, "hw_alloc_input failed");
             return NULL;
         }
         memcpy(buf, src, sz);
@@ -211,7 +274,7 @@ static uint8_t* convert_input_to_hw_encoder_buf(const uint8_t* src, uint16_t wid
 
     if (format == V4L2_PIX_FMT_RGB565) {
         int sz = (int)width * (int)height * 2;
-        uint8_t* buf = (uint8_t*)malloc_psram(sz);
+        uint8_t* buf = (uint8_t*)hw_alloc_input(sz);
         if (!buf)
             return NULL;
         memcpy(buf, src, sz);
@@ -222,16 +285,27 @@ static uint8_t* convert_input_to_hw_encoder_buf(const uint8_t* src, uint16_t wid
         return buf;
     }
 
+    if (format == V4L2_PIX_FMT_RGB565X) {
+        // 复制时交换字节序，每次处理两个像素
+        int sz = (int)width * (int)height * 2;
+        uint8_t* buf = (uint8_t*)hw_alloc_input(sz);
+        if (!buf)
+            return NULL;
+        image_swap_bytes16(buf, src, sz);
+        if (out_fmt)
+            *out_fmt = JPEG_ENCODE_IN_FORMAT_RGB565;
+        if (out_size)
+            *out_size = sz;
+        return buf;
+    }
+
     if (format == V4L2_PIX_FMT_YUYV) {
         // 硬件需要 | Y1 V Y0 U | 的“大端”格式，因此需要 bswap16
         int sz = (int)width * (int)height * 2;
-        uint16_t* buf = (uint16_t*)malloc_psram(sz);
+        uint16_t* buf = (uint16_t*)hw_alloc_input(sz);
         if (!buf)
             return NULL;
-        const uint16_t* bsrc = (const uint16_t*)src;
-        for (int i = 0; i < sz / 2; i++) {
-            buf[i] = __builtin_bswap16(bsrc[i]);
-        }
+        image_swap_bytes16((uint8_t*)buf, src, sz);
         if (out_fmt)
             *out_fmt = JPEG_ENCODE_IN_FORMAT_YUV422;
         if (out_size)
@@ -252,14 +326,33 @@ static bool encode_with_hw_jpeg(const uint8_t* src, size_t src_len, uint16_t wid
 
     jpeg_enc_input_format_t enc_src_type = JPEG_ENCODE_IN_FORMAT_RGB888;
     int enc_in_size = 0;
-    uint8_t* enc_in = convert_input_to_hw_encoder_buf(src, width, height, format, &enc_src_type, &enc_in_size);
+    uint8_t* enc_in = NULL;
+    bool enc_in_owned = true;
+
+    // 无需转换的格式，源缓冲区可被 DMA 直接读取时不复制（如 V4L2 的 mmap 缓冲区）
+    int bytes_per_pixel = format == V4L2_PIX_FMT_GREY ? 1 : format == V4L2_PIX_FMT_RGB24 ? 3 :
+                          format == V4L2_PIX_FMT_RGB565 ? 2 : 0;
+    if (bytes_per_pixel > 0) {
+        size_t sz = (size_t)width * (size_t)height * bytes_per_pixel;
+        if (src_len >= sz && hw_can_read_directly(src, sz)) {
+            enc_in = (uint8_t*)src;
+            enc_in_size = (int)sz;
+            enc_in_owned = false;
+            enc_src_type = format == V4L2_PIX_FMT_GREY ? JPEG_ENCODE_IN_FORMAT_GRAY :
+                           format == V4L2_PIX_FMT_RGB24 ? JPEG_ENCODE_IN_FORMAT_RGB888 : JPEG_ENCODE_IN_FORMAT_RGB565;
+        }
+    }
+    if (!enc_in) {
+        enc_in = convert_input_to_hw_encoder_buf(src, width, height, format, &enc_src_type, &enc_in_size);
+    }
     if (!enc_in) {
         ESP_LOGW(TAG, "hw jpeg: unsupported format, fallback to sw");
         return false;
     }
 
     if (!hw_jpeg_ensure_inited()) {
-        free(enc_in);
+        if (enc_in_owned)
+            free(enc_in);
         return false;
     }
 
@@ -277,14 +370,19 @@ static bool encode_with_hw_jpeg(const uint8_t* src, size_t src_len, uint16_t wid
     size_t out_cap_aligned = 0;
     uint8_t* outbuf = (uint8_t*)jpeg_alloc_encoder_mem(out_cap, &jpeg_enc_output_mem_cfg, &out_cap_aligned);
     if (!outbuf) {
-        free(enc_in);
+        if (enc_in_owned)
+            free(enc_in);
         ESP_LOGE(TAG, "alloc out buffer failed");
         return false;
     }
 
     uint32_t out_len = 0;
+    int64_t start_us = esp_timer_get_time();
     esp_err_t er = jpeg_encoder_process(s_hw_jpeg_handle, &enc_cfg, enc_in, (uint32_t)enc_in_size, outbuf, (uint32_t)out_cap_aligned, &out_len);
-    free(enc_in);
+    if (enc_in_owned)
+        free(enc_in);
+    ESP_LOGD(TAG, "hw jpeg: %ux%u %s, %lu bytes in %lld us", width, height, enc_in_owned ? "copied" : "in place",
+             (unsigned long)out_len, esp_timer_get_time() - start_us);
 
     if (er != ESP_OK) {
         free(outbuf);
@@ -63,6 +63,18 @@ bool image_to_jpeg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height
 bool image_to_jpeg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, 
                       v4l2_pix_fmt_t format, uint8_t quality, jpg_out_cb cb, void *arg);
 
+/**
+ * @brief 交换每个16位像素的字节序（RGB565 与 RGB565X 互转，YUYV 的字节序）
+ *
+ * 对齐时每次读写一个32位字（两个像素），连续读写整块以利用PSRAM的突发传输。
+ * dst 与 src 可以相同。
+ *
+ * @param dst  目标数据
+ * @param src  源数据
+ * @param len  字节数，奇数时忽略最后一个字节
+ */
+void image_swap_bytes16(uint8_t *dst, const uint8_t *src, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
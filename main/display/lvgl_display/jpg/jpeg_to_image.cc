@@ -0,0 +1,107 @@
+#include "jpeg_to_image.h"
+
+#include <sdkconfig.h>
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#include "esp_jpeg_common.h"
+#include "esp_jpeg_dec.h"
+#include "heap_accounting.h"
+
+#define TAG "jpeg_to_image"
+
+bool IsJpeg(const uint8_t* data, size_t size) {
+    return size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF;
+}
+
+// The largest divisor that still covers the fitted size, the display only scales down from it.
+// The decoder scales to a multiple of 8 pixels only.
+static int ChooseScaleDivisor(int width, int height, int max_width, int max_height) {
+    int divisor = 1;
+    while (divisor < 8) {
+        int next = divisor * 2;
+        if (width % (next * 8) != 0 || height % (next * 8) != 0) {
+            break;
+        }
+        if (width / next < max_width && height / next < max_height) {
+            break;
+        }
+        divisor = next;
+    }
+    return divisor;
+}
+
+std::unique_ptr<LvglImage> DecodeJpegToFit(const uint8_t* data, size_t size, int max_width, int max_height) {
+    if (!IsJpeg(data, size)) {
+        return nullptr;
+    }
+
+    jpeg_dec_config_t config = DEFAULT_JPEG_DEC_CONFIG();
+    config.output_type = JPEG_PIXEL_FORMAT_RGB565_LE;
+    config.rotate = JPEG_ROTATE_0D;
+
+    // The header is parsed once to choose the scale, the decoder is then opened with it
+    jpeg_dec_handle_t decoder = nullptr;
+    if (jpeg_dec_open(&config, &decoder) != JPEG_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to open the JPEG decoder");
+        return nullptr;
+    }
+    jpeg_dec_io_t io = {};
+    jpeg_dec_header_info_t header = {};
+    io.inbuf = const_cast<uint8_t*>(data);
+    io.inbuf_len = size;
+    if (jpeg_dec_parse_header(decoder, &io, &header) != JPEG_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to parse the JPEG header");
+        jpeg_dec_close(decoder);
+        return nullptr;
+    }
+    jpeg_dec_close(decoder);
+
+    int divisor = ChooseScaleDivisor(header.width, header.height, max_width, max_height);
+    int width = header.width / divisor;
+    int height = header.height / divisor;
+    if (divisor > 1) {
+        config.scale.width = width;
+        config.scale.height = height;
+    }
+    if (jpeg_dec_open(&config, &decoder) != JPEG_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to open the JPEG decoder");
+        return nullptr;
+    }
+    io = {};
+    io.inbuf = const_cast<uint8_t*>(data);
+    io.inbuf_len = size;
+    if (jpeg_dec_parse_header(decoder, &io, &header) != JPEG_ERR_OK) {
+        jpeg_dec_close(decoder);
+        return nullptr;
+    }
+
+    size_t stride = width * 2;
+    size_t image_size = stride * height;
+#if CONFIG_SPIRAM
+    uint32_t caps = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+#else
+    uint32_t caps = MALLOC_CAP_8BIT;
+#endif
+    // The output buffer of the decoder must be 16-byte aligned
+    auto pixels = static_cast<uint8_t*>(HeapAccounting::AlignedAlloc(kHeapTagDisplay, 16, image_size, caps));
+    if (pixels == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes for the %dx%d image", image_size, width, height);
+        jpeg_dec_close(decoder);
+        return nullptr;
+    }
+    io.outbuf = pixels;
+    int consumed = io.inbuf_len - io.inbuf_remain;
+    io.inbuf = const_cast<uint8_t*>(data) + consumed;
+    io.inbuf_len = io.inbuf_remain;
+    jpeg_error_t ret = jpeg_dec_process(decoder, &io);
+    jpeg_dec_close(decoder);
+    if (ret != JPEG_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to decode the JPEG, ret: %d", ret);
+        HeapAccounting::Free(kHeapTagDisplay, pixels);
+        return nullptr;
+    }
+
+    ESP_LOGI(TAG, "Decoded %dx%d JPEG at 1/%d: %dx%d", header.width, header.height, divisor, width, height);
+    return std::make_unique<LvglAllocatedImage>(pixels, image_size, width, height, stride, LV_COLOR_FORMAT_RGB565);
+}
@@ -0,0 +1,22 @@
+// jpeg_to_image.h - 按目标尺寸解码JPEG，用于预览图片
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+#include "lvgl_image.h"
+
+// True when the data starts with the JPEG SOI marker
+bool IsJpeg(const uint8_t* data, size_t size);
+
+/**
+ * @brief Decodes a JPEG to RGB565 no larger than needed for max_width x max_height
+ *
+ * The decoder scales in the DCT domain by 1/2, 1/4 or 1/8, the largest of these scales that
+ * fits is used, so a large photo is never decoded at full resolution. Runs on the calling task,
+ * call it off the LVGL task.
+ *
+ * @return The decoded image, nullptr when the JPEG cannot be decoded or the memory is short
+ */
+std::unique_ptr<LvglImage> DecodeJpegToFit(const uint8_t* data, size_t size, int max_width, int max_height);
@@ -10,6 +10,9 @@
 #include "application.h"
 #include "audio_codec.h"
 #include "settings.h"
+#include "task_placement.h"
+#include "device_state_event.h"
+#include "audio_pressure.h"
 #include "assets/lang_config.h"
 #include "jpg/image_to_jpeg.h"
 
@@ -38,6 +41,13 @@ LvglDisplay::LvglDisplay() {
     } else {
         ESP_ERROR_CHECK(ret);
     }
+
+#if CONFIG_LVGL_REFRESH_GOVERNOR
+    DeviceStateEventManager::GetInstance().RegisterStateChangeCallback([this](DeviceState, DeviceState current_state) {
+        device_state_ = current_state;
+        OnUpdatePosted();
+    });
+#endif
 }
 
 LvglDisplay::~LvglDisplay() {
@@ -46,6 +56,10 @@ LvglDisplay::~LvglDisplay() {
         esp_timer_delete(notification_timer_);
     }
 
+    if (posted_updates_timer_ != nullptr) {
+        lv_timer_delete(posted_updates_timer_);
+    }
+
     if (network_label_ != nullptr) {
         lv_obj_del(network_label_);
     }
@@ -69,6 +83,96 @@ LvglDisplay::~LvglDisplay() {
     }
 }
 
+void LvglDisplay::OnUpdatePosted() {
+    if (display_ == nullptr) {
+        // LVGL is not set up, nothing to wait for
+        ApplyPostedUpdates();
+        return;
+    }
+
+    // Only the first post waits for the display lock
+    std::call_once(posted_updates_once_, [this]() {
+        DisplayLockGuard lock(this);
+        posted_updates_timer_ = lv_timer_create([](lv_timer_t* timer) {
+            auto self = static_cast<LvglDisplay*>(lv_timer_get_user_data(timer));
+            if (self->update_posted_.exchange(false)) {
+                self->ApplyPostedUpdatesPaced();
+            }
+            self->UpdateRefreshPeriod();
+        }, 20, this);
+    });
+    update_posted_ = true;
+}
+
+void LvglDisplay::ApplyPostedUpdatesPaced() {
+#if CONFIG_USE_AUDIO_PRESSURE_QOS
+    // A chat message is the expensive update, the text is laid out again and a large part of the
+    // screen redrawn. While the audio pipeline is at risk it waits, up to AUDIO_PRESSURE_MAX_DEFER_MS
+    int64_t now_us = esp_timer_get_time();
+    bool hold = AudioPressure::GetInstance().IsActive() &&
+        (chat_held_since_us_ == 0 || now_us - chat_held_since_us_ < CONFIG_AUDIO_PRESSURE_MAX_DEFER_MS * 1000LL);
+    if (ApplyPostedUpdates(hold)) {
+        if (chat_held_since_us_ == 0) {
+            chat_held_since_us_ = now_us;
+        }
+        update_posted_ = true;
+    } else {
+        chat_held_since_us_ = 0;
+    }
+#else
+    ApplyPostedUpdates();
+#endif
+}
+
+void LvglDisplay::UpdateRefreshPeriod() {
+#if CONFIG_LVGL_REFRESH_GOVERNOR
+    uint32_t period_ms = LV_DEF_REFR_PERIOD;
+    if (power_save_) {
+        period_ms = CONFIG_LVGL_POWER_SAVE_REFRESH_PERIOD_MS;
+    } else if (device_state_ == kDeviceStateIdle) {
+        period_ms = CONFIG_LVGL_IDLE_REFRESH_PERIOD_MS;
+    }
+#if CONFIG_USE_AUDIO_PRESSURE_QOS
+    // Fewer frames while the audio pipeline is at risk, the widgets still change at their pace
+    bool pressure = AudioPressure::GetInstance().IsActive();
+    if (pressure && period_ms < CONFIG_AUDIO_PRESSURE_REFRESH_PERIOD_MS) {
+        period_ms = CONFIG_AUDIO_PRESSURE_REFRESH_PERIOD_MS;
+    }
+#else
+    bool pressure = false;
+#endif
+    // Nothing to refresh for once the backlight has faded out
+    auto backlight = Board::GetInstance().GetBacklight();
+    bool paused = backlight != nullptr && backlight->brightness() == 0 && backlight->target_brightness() == 0;
+    if (period_ms == refresh_period_ms_ && paused == refresh_paused_) {
+        return;
+    }
+
+    auto refresh_timer = lv_display_get_refr_timer(display_);
+    if (refresh_timer != nullptr) {
+        lv_timer_set_period(refresh_timer, period_ms);
+        if (paused && !refresh_paused_) {
+            lv_timer_pause(refresh_timer);
+        } else if (!paused && refresh_paused_) {
+            lv_timer_resume(refresh_timer);
+            lv_obj_invalidate(lv_screen_active());
+        }
+    }
+    // Also the pace of this timer, which keeps the posted updates quick while active
+    uint32_t posted_period_ms = paused ? CONFIG_LVGL_POWER_SAVE_REFRESH_PERIOD_MS : period_ms;
+    lv_timer_set_period(posted_updates_timer_, posted_period_ms > 20 ? posted_period_ms : 20);
+
+    // The pressure comes and goes with the audio, its changes are not worth a log line each
+    if (!pressure && !refresh_pressure_) {
+        ESP_LOGI(TAG, "Refresh period %lu ms%s", (unsigned long)period_ms, paused ? ", stopped with the backlight off" : "");
+    }
+    refresh_pressure_ = pressure;
+    refresh_period_ms_ = period_ms;
+    refresh_paused_ = paused;
+    OnRefreshPeriodChanged(paused ? 0 : period_ms);
+#endif
+}
+
 void LvglDisplay::SetStatus(const char* status) {
     DisplayLockGuard lock(this);
     if (status_label_ == nullptr) {
@@ -79,6 +183,7 @@ void LvglDisplay::SetStatus(const char* status) {
     lv_obj_add_flag(notification_label_, LV_OBJ_FLAG_HIDDEN);
 
     last_status_update_time_ = std::chrono::system_clock::now();
+    clock_minute_ = -1;
 }
 
 void LvglDisplay::ShowNotification(const std::string &notification, int duration_ms) {
@@ -103,21 +208,17 @@ void LvglDisplay::UpdateStatusBar(bool update_all) {
     auto& board = Board::GetInstance();
     auto codec = board.GetAudioCodec();
 
-    // Update mute icon
-    {
-        DisplayLockGuard lock(this);
-        if (mute_label_ == nullptr) {
-            return;
-        }
+    // The UI is not set up yet
+    if (mute_label_ == nullptr) {
+        return;
+    }
 
-        // 如果静音状态改变，则更新图标
-        if (codec->output_volume() == 0 && !muted_) {
-            muted_ = true;
-            lv_label_set_text(mute_label_, FONT_AWESOME_VOLUME_XMARK);
-        } else if (codec->output_volume() > 0 && muted_) {
-            muted_ = false;
-            lv_label_set_text(mute_label_, "");
-        }
+    // 如果静音状态改变，则更新图标
+    bool muted = codec->output_volume() == 0;
+    if (muted != muted_) {
+        DisplayLockGuard lock(this);
+        muted_ = muted;
+        lv_label_set_text(mute_label_, muted_ ? FONT_AWESOME_VOLUME_XMARK : "");
     }
 
     // Update time
@@ -128,9 +229,13 @@ void LvglDisplay::UpdateStatusBar(bool update_all) {
             struct tm* tm = localtime(&now);
             // Check if the we have already set the time
             if (tm->tm_year >= 2025 - 1900) {
-                char time_str[16];
-                strftime(time_str, sizeof(time_str), "%H:%M  ", tm);
-                SetStatus(time_str);
+                int minute = tm->tm_hour * 60 + tm->tm_min;
+                if (update_all || minute != clock_minute_) {
+                    char time_str[16];
+                    strftime(time_str, sizeof(time_str), "%H:%M  ", tm);
+                    SetStatus(time_str);
+                    clock_minute_ = minute;
+                }
             } else {
                 ESP_LOGW(TAG, "System time is not set, tm_year: %d", tm->tm_year);
             }
@@ -156,24 +261,24 @@ void LvglDisplay::UpdateStatusBar(bool update_all) {
             };
             icon = levels[battery_level / 20];
         }
-        DisplayLockGuard lock(this);
-        if (battery_label_ != nullptr && battery_icon_ != icon) {
+        bool low_battery = strcmp(icon, FONT_AWESOME_BATTERY_EMPTY) == 0 && discharging;
+        if (battery_icon_ != icon || low_battery_shown_ != low_battery) {
+            DisplayLockGuard lock(this);
+            if (battery_label_ != nullptr && battery_icon_ != icon) {
+                lv_label_set_text(battery_label_, icon);
+            }
             battery_icon_ = icon;
-            lv_label_set_text(battery_label_, battery_icon_);
-        }
 
-        if (low_battery_popup_ != nullptr) {
-            if (strcmp(icon, FONT_AWESOME_BATTERY_EMPTY) == 0 && discharging) {
-                if (lv_obj_has_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN)) { // 如果低电量提示框隐藏，则显示
+            if (low_battery_popup_ != nullptr && low_battery_shown_ != low_battery) {
+                if (low_battery) { // 如果低电量提示框隐藏，则显示
                     lv_obj_remove_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
                     app.PlaySound(Lang::Sounds::OGG_LOW_BATTERY);
-                }
-            } else {
-                // Hide the low battery popup when the battery is not empty
-                if (!lv_obj_has_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN)) { // 如果低电量提示框显示，则隐藏
+                } else {
+                    // Hide the low battery popup when the battery is not empty
                     lv_obj_add_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
                 }
             }
+            low_battery_shown_ = low_battery;
         }
     }
 
@@ -206,6 +311,10 @@ void LvglDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
 }
 
 void LvglDisplay::SetPowerSaveMode(bool on) {
+#if CONFIG_LVGL_REFRESH_GOVERNOR
+    power_save_ = on;
+    OnUpdatePosted();
+#endif
     if (on) {
         SetChatMessage("system", "");
         SetEmotion("sleepy");
@@ -216,39 +325,39 @@ void LvglDisplay::SetPowerSaveMode(bool on) {
 }
 
 bool LvglDisplay::SnapshotToJpeg(std::string& jpeg_data, int quality) {
-#if CONFIG_LV_USE_SNAPSHOT
-    DisplayLockGuard lock(this);
+    jpeg_data.clear();
+    return SnapshotToJpeg([&jpeg_data](const char* data, size_t length) {
+        jpeg_data.append(data, length);
+    }, quality);
+}
 
-    lv_obj_t* screen = lv_screen_active();
-    lv_draw_buf_t* draw_buffer = lv_snapshot_take(screen, LV_COLOR_FORMAT_RGB565);
+bool LvglDisplay::SnapshotToJpeg(std::function<void(const char* data, size_t length)> write, int quality) {
+#if CONFIG_LV_USE_SNAPSHOT
+    lv_draw_buf_t* draw_buffer;
+    {
+        DisplayLockGuard lock(this);
+        draw_buffer = lv_snapshot_take(lv_screen_active(), LV_COLOR_FORMAT_RGB565);
+    }
     if (draw_buffer == nullptr) {
         ESP_LOGE(TAG, "Failed to take snapshot, draw_buffer is nullptr");
         return false;
     }
 
-    // swap bytes
-    uint16_t* data = (uint16_t*)draw_buffer->data;
-    size_t pixel_count = draw_buffer->data_size / 2;
-    for (size_t i = 0; i < pixel_count; i++) {
-        data[i] = __builtin_bswap16(data[i]);
-    }
-
-    // 清空输出字符串并使用回调版本，避免预分配大内存块
-    jpeg_data.clear();
-
-    // 🚀 使用回调版本的JPEG编码器，进一步节省内存
-    bool ret = image_to_jpeg_cb((uint8_t*)draw_buffer->data, draw_buffer->data_size, draw_buffer->header.w, draw_buffer->header.h, V4L2_PIX_FMT_RGB565, quality,
+    // The snapshot is ours, encode it without holding up the UI. The byte swap is done by the
+    // encoder while it converts its input (RGB565X), not in a pass of its own.
+    bool ret = image_to_jpeg_cb((uint8_t*)draw_buffer->data, draw_buffer->data_size, draw_buffer->header.w, draw_buffer->header.h, V4L2_PIX_FMT_RGB565X, quality,
         [](void *arg, size_t index, const void *data, size_t len) -> size_t {
-        std::string* output = static_cast<std::string*>(arg);
+        auto& write = *static_cast<std::function<void(const char*, size_t)>*>(arg);
         if (data && len > 0) {
-            output->append(static_cast<const char*>(data), len);
+            write(static_cast<const char*>(data), len);
         }
         return len;
-    }, &jpeg_data);
+    }, &write);
     if (!ret) {
         ESP_LOGE(TAG, "Failed to convert image to JPEG");
     }
 
+    DisplayLockGuard lock(this);
     lv_draw_buf_destroy(draw_buffer);
     return ret;
 #else
@@ -256,3 +365,60 @@ bool LvglDisplay::SnapshotToJpeg(std::string& jpeg_data, int quality) {
     return false;
 #endif
 }
+
+void LvglDisplay::EnableRenderStats(const char* buffer_name) {
+#if CONFIG_LVGL_RENDER_STATS
+    render_stats_ = RenderStats();
+    render_stats_.buffer_name = buffer_name;
+    // The events come from the LVGL task with the display lock held
+    lv_display_add_event_cb(display_, [](lv_event_t* e) {
+        auto& stats = static_cast<LvglDisplay*>(lv_event_get_user_data(e))->render_stats_;
+        int64_t now = esp_timer_get_time();
+        switch (lv_event_get_code(e)) {
+        case LV_EVENT_RENDER_START:
+            stats.render_start_us = now;
+            if (stats.period_start_us == 0) {
+                stats.period_start_us = now;
+            }
+            break;
+        case LV_EVENT_REFR_READY:
+            if (stats.render_start_us == 0) {
+                break;
+            }
+            stats.frames++;
+            stats.render_us += now - stats.render_start_us;
+            stats.render_start_us = 0;
+            if (now - stats.period_start_us >= 30 * 1000 * 1000) {
+                ESP_LOGI(TAG, "%s: %.1f fps, %lld us per frame, %lld us of it waiting for the flush",
+                    stats.buffer_name, stats.frames * 1e6f / (now - stats.period_start_us),
+                    stats.render_us / stats.frames, stats.wait_us / stats.frames);
+                stats.period_start_us = 0;
+                stats.frames = 0;
+                stats.render_us = 0;
+                stats.wait_us = 0;
+            }
+            break;
+        case LV_EVENT_FLUSH_WAIT_START:
+            stats.wait_start_us = now;
+            break;
+        case LV_EVENT_FLUSH_WAIT_FINISH:
+            stats.wait_us += now - stats.wait_start_us;
+            break;
+        default:
+            break;
+        }
+    }, LV_EVENT_ALL, this);
+#endif
+}
+
+void LvglDisplay::PlaceLvglTask(lvgl_port_cfg_t& port_cfg) {
+    auto& placement = TaskPlacements::Get(kTaskLvgl);
+    port_cfg.task_priority = placement.priority;
+    port_cfg.task_affinity = placement.core == tskNO_AFFINITY ? -1 : placement.core;
+    if (placement.stack_size > 0) {
+        port_cfg.task_stack = placement.stack_size;
+    }
+    if (placement.stack_in_psram) {
+        port_cfg.task_stack_caps = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+    }
+}
@@ -3,14 +3,19 @@
 
 #include "display.h"
 #include "lvgl_image.h"
+#include "device_state.h"
 
 #include <lvgl.h>
+#include <esp_lvgl_port.h>
 #include <esp_timer.h>
 #include <esp_log.h>
 #include <esp_pm.h>
 
 #include <string>
 #include <chrono>
+#include <functional>
+#include <atomic>
+#include <mutex>
 
 class LvglDisplay : public Display {
 public:
@@ -24,6 +29,8 @@ public:
     virtual void UpdateStatusBar(bool update_all = false);
     virtual void SetPowerSaveMode(bool on);
     virtual bool SnapshotToJpeg(std::string& jpeg_data, int quality = 80);
+    // Hands the JPEG to write as the encoder outputs it, the display is unlocked while encoding
+    virtual bool SnapshotToJpeg(std::function<void(const char* data, size_t length)> write, int quality = 80);
 
 protected:
     esp_pm_lock_handle_t pm_lock_ = nullptr;
@@ -37,14 +44,58 @@ protected:
     lv_obj_t* low_battery_popup_ = nullptr;
     lv_obj_t* low_battery_label_ = nullptr;
     
+    // What the status bar shows, so UpdateStatusBar() only touches LVGL on a change
     const char* battery_icon_ = nullptr;
     const char* network_icon_ = nullptr;
     bool muted_ = false;
+    bool low_battery_shown_ = false;
+    int clock_minute_ = -1;         // Minute of the day on the status label, -1 for another status
 
     std::chrono::system_clock::time_point last_status_update_time_;
     esp_timer_handle_t notification_timer_ = nullptr;
 
+    // The posted updates are applied by an LVGL timer, created with the first post
+    std::once_flag posted_updates_once_;
+    lv_timer_t* posted_updates_timer_ = nullptr;
+    std::atomic<bool> update_posted_ = false;
+    virtual void OnUpdatePosted() override;
+    // With CONFIG_USE_AUDIO_PRESSURE_QOS the chat messages wait while the audio pipeline is at
+    // risk. Run by the posted updates timer, the time the waiting started or 0
+    int64_t chat_held_since_us_ = 0;
+    void ApplyPostedUpdatesPaced();
+
+    // With CONFIG_LVGL_REFRESH_GOVERNOR, the period of the LVGL refresh follows the device state,
+    // the power save mode and the backlight. Run by the posted updates timer.
+    std::atomic<DeviceState> device_state_ = kDeviceStateUnknown;
+    std::atomic<bool> power_save_ = false;
+    uint32_t refresh_period_ms_ = LV_DEF_REFR_PERIOD;
+    bool refresh_paused_ = false;
+    bool refresh_pressure_ = false;
+    void UpdateRefreshPeriod();
+    // The refresh period changed, 0 while the refresh is stopped
+    virtual void OnRefreshPeriodChanged(uint32_t period_ms) {}
+
+    // Priority, core and stack of the LVGL task from the kTaskLvgl placement
+    static void PlaceLvglTask(lvgl_port_cfg_t& port_cfg);
+    // With CONFIG_LVGL_RENDER_STATS, logs the frame rate and the time spent rendering and
+    // waiting for the flush every 30 s of refreshing, under the name of the buffer setup
+    void EnableRenderStats(const char* buffer_name);
+
+#if CONFIG_LVGL_RENDER_STATS
+    struct RenderStats {
+        const char* buffer_name;
+        int64_t period_start_us = 0;
+        int64_t render_start_us = 0;
+        int64_t wait_start_us = 0;
+        int frames = 0;
+        int64_t render_us = 0;
+        int64_t wait_us = 0;
+    };
+    RenderStats render_stats_;
+#endif
+
     friend class DisplayLockGuard;
+    friend class DisplayBenchmark;
     virtual bool Lock(int timeout_ms = 0) = 0;
     virtual void Unlock() = 0;
 };
@@ -1,13 +1,166 @@
 #include "lvgl_font.h"
+#include "heap_accounting.h"
 #include <cbin_font.h>
+#include <esp_log.h>
+#include <cstring>
+#include <vector>
 
+#define TAG "LvglFont"
+
+#if CONFIG_LVGL_FONT_GLYPH_CACHE_KB > 0
+#define GLYPH_CACHE_SIZE (CONFIG_LVGL_FONT_GLYPH_CACHE_KB * 1024)
+// Hit and miss counts are logged every this many misses
+#define GLYPH_CACHE_STATS_MISSES 1000
+
+namespace {
+
+// The fonts with a glyph cache, to find the cache from the lv_font_t
+std::mutex fonts_mutex_;
+std::vector<std::pair<const lv_font_t*, LvglCBinFont*>> fonts_;
+
+} // namespace
+#endif
 
 LvglCBinFont::LvglCBinFont(void* data) {
     font_ = cbin_font_create(static_cast<uint8_t*>(data));
+#if CONFIG_LVGL_FONT_GLYPH_CACHE_KB > 0
+    if (font_ != nullptr && font_->get_glyph_bitmap != nullptr) {
+        get_glyph_bitmap_ = font_->get_glyph_bitmap;
+        font_->get_glyph_bitmap = GetGlyphBitmap;
+        std::lock_guard<std::mutex> lock(fonts_mutex_);
+        fonts_.emplace_back(font_, this);
+    }
+#endif
 }
 
 LvglCBinFont::~LvglCBinFont() {
+#if CONFIG_LVGL_FONT_GLYPH_CACHE_KB > 0
+    {
+        std::lock_guard<std::mutex> lock(fonts_mutex_);
+        for (auto it = fonts_.begin(); it != fonts_.end(); ++it) {
+            if (it->second == this) {
+                fonts_.erase(it);
+                break;
+            }
+        }
+    }
+    for (auto& glyph : glyphs_) {
+        HeapAccounting::Free(kHeapTagDisplay, glyph.bitmap);
+    }
+    if (font_ != nullptr && get_glyph_bitmap_ != nullptr) {
+        font_->get_glyph_bitmap = get_glyph_bitmap_;
+    }
+#endif
     if (font_ != nullptr) {
         cbin_font_delete(font_);
     }
-}
\ No newline at end of file
+}
+
+void LvglCBinFont::WarmGlyphCache(const char* text) {
+#if CONFIG_LVGL_FONT_GLYPH_CACHE_KB > 0
+    if (font_ == nullptr || get_glyph_bitmap_ == nullptr) {
+        return;
+    }
+    uint32_t i = 0;
+    size_t length = strlen(text);
+    while (i < length) {
+        uint32_t letter = lv_text_encoded_next(text, &i);
+        lv_font_glyph_dsc_t glyph_dsc = {};
+        if (!lv_font_get_glyph_dsc(font_, &glyph_dsc, letter, 0) || glyph_dsc.resolved_font != font_ ||
+                glyph_dsc.box_w == 0 || glyph_dsc.box_h == 0) {
+            continue;
+        }
+        lv_draw_buf_t* draw_buf = lv_draw_buf_create(glyph_dsc.box_w, glyph_dsc.box_h, LV_COLOR_FORMAT_A8, LV_STRIDE_AUTO);
+        if (draw_buf == nullptr) {
+            return;
+        }
+        GetCachedGlyphBitmap(&glyph_dsc, draw_buf);
+        lv_draw_buf_destroy(draw_buf);
+    }
+    ESP_LOGI(TAG, "Glyph cache warmed, %u glyphs, %u bytes", (unsigned)glyphs_.size(), (unsigned)glyph_bytes_);
+#endif
+}
+
+#if CONFIG_LVGL_FONT_GLYPH_CACHE_KB > 0
+const void* LvglCBinFont::GetGlyphBitmap(lv_font_glyph_dsc_t* glyph_dsc, lv_draw_buf_t* draw_buf) {
+    LvglCBinFont* self = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(fonts_mutex_);
+        for (auto& font : fonts_) {
+            if (font.first == glyph_dsc->resolved_font) {
+                self = font.second;
+                break;
+            }
+        }
+    }
+    if (self == nullptr) {
+        return nullptr;
+    }
+    return self->GetCachedGlyphBitmap(glyph_dsc, draw_buf);
+}
+
+const void* LvglCBinFont::GetCachedGlyphBitmap(lv_font_glyph_dsc_t* glyph_dsc, lv_draw_buf_t* draw_buf) {
+    // The raw bitmap is in the font itself, nothing to keep
+    if (glyph_dsc->req_raw_bitmap || draw_buf == nullptr) {
+        return get_glyph_bitmap_(glyph_dsc, draw_buf);
+    }
+
+    std::lock_guard<std::mutex> lock(glyph_mutex_);
+    auto it = glyph_index_.find(glyph_dsc->gid.index);
+    if (it != glyph_index_.end() && it->second->size <= draw_buf->data_size) {
+        glyph_hits_++;
+        glyphs_.splice(glyphs_.begin(), glyphs_, it->second);
+        memcpy(draw_buf->data, it->second->bitmap, it->second->size);
+        return bitmap_result_ == kBitmapResultDrawBuf ? static_cast<const void*>(draw_buf) : draw_buf->data;
+    }
+
+    glyph_misses_++;
+    if (glyph_misses_ % GLYPH_CACHE_STATS_MISSES == 0) {
+        ESP_LOGI(TAG, "Glyph cache: %lu hits, %lu misses, %u glyphs, %u bytes", (unsigned long)glyph_hits_,
+            (unsigned long)glyph_misses_, (unsigned)glyphs_.size(), (unsigned)glyph_bytes_);
+    }
+
+    auto result = get_glyph_bitmap_(glyph_dsc, draw_buf);
+    BitmapResult kind = kBitmapResultUnknown;
+    if (result != nullptr && result == draw_buf) {
+        kind = kBitmapResultDrawBuf;
+    } else if (result != nullptr && result == draw_buf->data) {
+        kind = kBitmapResultData;
+    }
+    if (kind == kBitmapResultUnknown || (bitmap_result_ != kBitmapResultUnknown && kind != bitmap_result_)) {
+        // A bitmap outside the draw buffer, left uncached
+        return result;
+    }
+    bitmap_result_ = kind;
+
+    // The glyph is at the start of the draw buffer, in A8 rows of the box width
+    size_t size = (size_t)lv_draw_buf_width_to_stride(glyph_dsc->box_w, LV_COLOR_FORMAT_A8) * glyph_dsc->box_h;
+    if (size == 0 || size > draw_buf->data_size || size > GLYPH_CACHE_SIZE / 4) {
+        return result;
+    }
+    if (it != glyph_index_.end()) {
+        // Cached for a smaller draw buffer, replaced below
+        HeapAccounting::Free(kHeapTagDisplay, it->second->bitmap);
+        glyph_bytes_ -= it->second->size;
+        glyphs_.erase(it->second);
+        glyph_index_.erase(it);
+    }
+    while (!glyphs_.empty() && glyph_bytes_ + size > GLYPH_CACHE_SIZE) {
+        auto& oldest = glyphs_.back();
+        HeapAccounting::Free(kHeapTagDisplay, oldest.bitmap);
+        glyph_bytes_ -= oldest.size;
+        glyph_index_.erase(oldest.index);
+        glyphs_.pop_back();
+    }
+
+    auto bitmap = static_cast<uint8_t*>(HeapAccounting::Place(kHeapTagDisplay, size, kHeapPlacementInternal));
+    if (bitmap == nullptr) {
+        return result;
+    }
+    memcpy(bitmap, draw_buf->data, size);
+    glyphs_.push_front({glyph_dsc->gid.index, bitmap, size});
+    glyph_index_[glyph_dsc->gid.index] = glyphs_.begin();
+    glyph_bytes_ += size;
+    return result;
+}
+#endif
@@ -1,6 +1,11 @@
 #pragma once
 
 #include <lvgl.h>
+#include <sdkconfig.h>
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
 
 
 class LvglFont {
@@ -20,12 +25,49 @@ private:
 };
 
 
+/*
+ * A font of the assets partition, read through the flash cache.
+ *
+ * With CONFIG_LVGL_FONT_GLYPH_CACHE_KB, the glyph bitmaps LVGL decodes from it are kept in
+ * internal RAM (PSRAM once that is short), the least recently drawn are dropped over the size.
+ * A drawn glyph then comes from the cache instead of the memory mapped flash.
+ */
 class LvglCBinFont : public LvglFont {
 public:
     LvglCBinFont(void* data);
     virtual ~LvglCBinFont();
     virtual const lv_font_t* font() const override { return font_; }
 
+    // Decodes the glyphs of the text into the cache, with the display locked
+    void WarmGlyphCache(const char* text);
+
 private:
     lv_font_t* font_;
+
+#if CONFIG_LVGL_FONT_GLYPH_CACHE_KB > 0
+    struct CachedGlyph {
+        uint32_t index;
+        uint8_t* bitmap;
+        size_t size;
+    };
+
+    // The result kind of the font's get_glyph_bitmap, learned with the first glyph
+    enum BitmapResult {
+        kBitmapResultUnknown,
+        kBitmapResultDrawBuf,       // Returns the draw buffer
+        kBitmapResultData,          // Returns the data of the draw buffer
+    };
+
+    std::mutex glyph_mutex_;
+    std::list<CachedGlyph> glyphs_;     // Most recently drawn first
+    std::unordered_map<uint32_t, std::list<CachedGlyph>::iterator> glyph_index_;
+    size_t glyph_bytes_ = 0;
+    uint32_t glyph_hits_ = 0;
+    uint32_t glyph_misses_ = 0;
+    BitmapResult bitmap_result_ = kBitmapResultUnknown;
+    const void* (*get_glyph_bitmap_)(lv_font_glyph_dsc_t*, lv_draw_buf_t*) = nullptr;
+
+    static const void* GetGlyphBitmap(lv_font_glyph_dsc_t* glyph_dsc, lv_draw_buf_t* draw_buf);
+    const void* GetCachedGlyphBitmap(lv_font_glyph_dsc_t* glyph_dsc, lv_draw_buf_t* draw_buf);
+#endif
 };
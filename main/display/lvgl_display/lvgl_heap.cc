@@ -0,0 +1,243 @@
+#include "lvgl_heap.h"
+
+#if CONFIG_LV_USE_CUSTOM_MALLOC
+
+#include "heap_accounting.h"
+
+#include <lvgl.h>
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <multi_heap.h>
+#include <freertos/FreeRTOS.h>
+
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "LvglHeap"
+
+namespace {
+
+struct Pool {
+    uint8_t* memory = nullptr;
+    size_t size = 0;
+    multi_heap_handle_t heap = nullptr;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+    bool Contains(const void* ptr) const {
+        return memory != nullptr && (const uint8_t*)ptr >= memory && (const uint8_t*)ptr < memory + size;
+    }
+};
+
+Pool internal_pool;
+Pool psram_pool;
+std::atomic<uint32_t> overflows = 0;
+std::atomic<uint32_t> failures = 0;
+
+void CreatePool(Pool& pool, size_t size, uint32_t caps, const char* name) {
+    if (size == 0) {
+        return;
+    }
+    pool.memory = (uint8_t*)HeapAccounting::Malloc(kHeapTagDisplay, size, caps);
+    if (pool.memory == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the %s pool of %u bytes", name, (unsigned)size);
+        return;
+    }
+    pool.heap = multi_heap_register(pool.memory, size);
+    if (pool.heap == nullptr) {
+        HeapAccounting::Free(kHeapTagDisplay, pool.memory);
+        pool.memory = nullptr;
+        return;
+    }
+    // LVGL runs under the display lock, the GIF decoder and the image loaders may not
+    multi_heap_set_lock(pool.heap, &pool.lock);
+    pool.size = size;
+    ESP_LOGI(TAG, "%s pool: %u bytes", name, (unsigned)size);
+}
+
+void* PoolMalloc(Pool& pool, size_t size) {
+    return pool.heap != nullptr ? multi_heap_malloc(pool.heap, size) : nullptr;
+}
+
+void* Allocate(size_t size) {
+    void* ptr = nullptr;
+    if (size <= CONFIG_LVGL_HEAP_SMALL_BYTES || psram_pool.heap == nullptr) {
+        ptr = PoolMalloc(internal_pool, size);
+    }
+    if (ptr == nullptr) {
+        ptr = PoolMalloc(psram_pool, size);
+    }
+#if CONFIG_SPIRAM
+    if (ptr == nullptr && size > CONFIG_LVGL_HEAP_SMALL_BYTES) {
+        ptr = HeapAccounting::Malloc(kHeapTagDisplay, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (ptr != nullptr) {
+            overflows.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+#endif
+    if (ptr == nullptr) {
+        failures.fetch_add(1, std::memory_order_relaxed);
+    }
+    return ptr;
+}
+
+void Release(void* ptr) {
+    if (internal_pool.Contains(ptr)) {
+        multi_heap_free(internal_pool.heap, ptr);
+    } else if (psram_pool.Contains(ptr)) {
+        multi_heap_free(psram_pool.heap, ptr);
+    } else {
+        HeapAccounting::Free(kHeapTagDisplay, ptr);
+    }
+}
+
+size_t AllocatedSize(void* ptr) {
+    if (internal_pool.Contains(ptr)) {
+        return multi_heap_get_allocated_size(internal_pool.heap, ptr);
+    }
+    if (psram_pool.Contains(ptr)) {
+        return multi_heap_get_allocated_size(psram_pool.heap, ptr);
+    }
+    return heap_caps_get_allocated_size(ptr);
+}
+
+LvglHeap::PoolStats GetPoolStats(const Pool& pool) {
+    LvglHeap::PoolStats stats;
+    if (pool.heap == nullptr) {
+        return stats;
+    }
+    multi_heap_info_t info;
+    multi_heap_get_info(pool.heap, &info);
+    stats.total = pool.size;
+    stats.free = info.total_free_bytes;
+    stats.minimum_free = info.minimum_free_bytes;
+    stats.largest_free_block = info.largest_free_block;
+    stats.blocks = info.allocated_blocks;
+    return stats;
+}
+
+int Fragmentation(const LvglHeap::PoolStats& stats) {
+    return stats.free > 0 ? 100 - (int)(stats.largest_free_block * 100 / stats.free) : 0;
+}
+
+cJSON* PoolStatsJson(const LvglHeap::PoolStats& stats) {
+    auto json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "total", stats.total);
+    cJSON_AddNumberToObject(json, "free", stats.free);
+    cJSON_AddNumberToObject(json, "minimum_free", stats.minimum_free);
+    cJSON_AddNumberToObject(json, "largest_free_block", stats.largest_free_block);
+    cJSON_AddNumberToObject(json, "blocks", stats.blocks);
+    cJSON_AddNumberToObject(json, "fragmentation", Fragmentation(stats));
+    return json;
+}
+
+} // namespace
+
+namespace LvglHeap {
+
+Stats GetStats() {
+    Stats stats;
+    stats.internal = GetPoolStats(internal_pool);
+    stats.psram = GetPoolStats(psram_pool);
+    stats.overflows = overflows.load(std::memory_order_relaxed);
+    stats.failures = failures.load(std::memory_order_relaxed);
+    return stats;
+}
+
+cJSON* GetStatsJson() {
+    auto stats = GetStats();
+    auto json = cJSON_CreateObject();
+    cJSON_AddItemToObject(json, "internal", PoolStatsJson(stats.internal));
+    cJSON_AddItemToObject(json, "psram", PoolStatsJson(stats.psram));
+    cJSON_AddNumberToObject(json, "overflows", stats.overflows);
+    cJSON_AddNumberToObject(json, "failures", stats.failures);
+    return json;
+}
+
+} // namespace LvglHeap
+
+// The core of lv_malloc() and friends, LVGL calls these in place of its own allocator
+extern "C" {
+
+void lv_mem_init(void) {
+    if (internal_pool.heap != nullptr || psram_pool.heap != nullptr) {
+        return;
+    }
+    CreatePool(internal_pool, CONFIG_LVGL_HEAP_INTERNAL_KB * 1024, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT, "Internal");
+#if CONFIG_SPIRAM
+    CreatePool(psram_pool, CONFIG_LVGL_HEAP_PSRAM_KB * 1024, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, "PSRAM");
+#endif
+}
+
+void lv_mem_deinit(void) {
+    // The pools stay, lv_deinit() is not called by the firmware
+}
+
+lv_mem_pool_t lv_mem_add_pool(void* mem, size_t bytes) {
+    return nullptr;
+}
+
+void lv_mem_remove_pool(lv_mem_pool_t pool) {
+}
+
+void* lv_malloc_core(size_t size) {
+    return Allocate(size);
+}
+
+void* lv_realloc_core(void* p, size_t new_size) {
+    if (p == nullptr) {
+        return Allocate(new_size);
+    }
+    // Grown or shrunk in place when it stays in its pool and the small / large split allows
+    bool small = new_size <= CONFIG_LVGL_HEAP_SMALL_BYTES;
+    if (internal_pool.Contains(p) && small) {
+        void* ptr = multi_heap_realloc(internal_pool.heap, p, new_size);
+        if (ptr != nullptr) {
+            return ptr;
+        }
+    } else if (psram_pool.Contains(p)) {
+        void* ptr = multi_heap_realloc(psram_pool.heap, p, new_size);
+        if (ptr != nullptr) {
+            return ptr;
+        }
+    }
+    void* ptr = Allocate(new_size);
+    if (ptr == nullptr) {
+        return nullptr;
+    }
+    memcpy(ptr, p, std::min(AllocatedSize(p), new_size));
+    Release(p);
+    return ptr;
+}
+
+void lv_free_core(void* p) {
+    Release(p);
+}
+
+void lv_mem_monitor_core(lv_mem_monitor_t* mon_p) {
+    auto stats = LvglHeap::GetStats();
+    memset(mon_p, 0, sizeof(*mon_p));
+    mon_p->total_size = stats.internal.total + stats.psram.total;
+    mon_p->free_size = stats.internal.free + stats.psram.free;
+    mon_p->free_biggest_size = std::max(stats.internal.largest_free_block, stats.psram.largest_free_block);
+    mon_p->used_cnt = stats.internal.blocks + stats.psram.blocks;
+    mon_p->max_used = mon_p->total_size - (stats.internal.minimum_free + stats.psram.minimum_free);
+    if (mon_p->total_size > 0) {
+        mon_p->used_pct = (mon_p->total_size - mon_p->free_size) * 100 / mon_p->total_size;
+    }
+    mon_p->frag_pct = std::max(Fragmentation(stats.internal), Fragmentation(stats.psram));
+}
+
+lv_result_t lv_mem_test_core(void) {
+    if (internal_pool.heap != nullptr && !multi_heap_check(internal_pool.heap, true)) {
+        return LV_RESULT_INVALID;
+    }
+    if (psram_pool.heap != nullptr && !multi_heap_check(psram_pool.heap, true)) {
+        return LV_RESULT_INVALID;
+    }
+    return LV_RESULT_OK;
+}
+
+} // extern "C"
+
+#endif // CONFIG_LV_USE_CUSTOM_MALLOC
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <sdkconfig.h>
+#include <cJSON.h>
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * The heap of LVGL, with CONFIG_LV_USE_CUSTOM_MALLOC.
+ *
+ * LVGL allocates every object, style, label text and decoded image through lv_malloc(). With the
+ * C library allocator a long chat history ends up in the internal RAM the audio and the Wi-Fi
+ * need. Here lv_malloc() takes from two fixed pools instead, TLSF heaps of their own
+ * (multi_heap) carved out once at lv_init():
+ * - an internal pool of CONFIG_LVGL_HEAP_INTERNAL_KB for the small, hot blocks up to
+ *   CONFIG_LVGL_HEAP_SMALL_BYTES (object headers, styles, short texts)
+ * - a PSRAM pool of CONFIG_LVGL_HEAP_PSRAM_KB for the rest (image data, GIF frames, long texts)
+ * A small block goes to the PSRAM pool once the internal one is full. A large block that does not
+ * fit the PSRAM pool overflows to the system PSRAM, never to the internal RAM. Without PSRAM the
+ * internal pool takes everything and nothing overflows, the UI is capped at its size.
+ *
+ * The draw buffers of esp_lvgl_port are allocated by the port, they are not in the pools.
+ */
+namespace LvglHeap {
+
+struct PoolStats {
+    size_t total = 0;
+    size_t free = 0;
+    size_t minimum_free = 0;
+    size_t largest_free_block = 0;
+    size_t blocks = 0;
+};
+
+struct Stats {
+    PoolStats internal;
+    PoolStats psram;
+    uint32_t overflows = 0;     // Blocks that went to the system PSRAM
+    uint32_t failures = 0;      // lv_malloc() calls that returned nullptr
+};
+
+#if CONFIG_LV_USE_CUSTOM_MALLOC
+Stats GetStats();
+// {"internal": {...}, "psram": {...}, "overflows", "failures"}, each pool with "total", "free",
+// "minimum_free", "largest_free_block", "blocks" and "fragmentation" (percent)
+cJSON* GetStatsJson();
+#else
+inline Stats GetStats() { return Stats(); }
+inline cJSON* GetStatsJson() { return nullptr; }
+#endif
+
+} // namespace LvglHeap
@@ -6,6 +6,8 @@
 #include <cstring>
 #include <esp_heap_caps.h>
 
+#include "heap_accounting.h"
+
 #define TAG "LvglImage"
 
 
@@ -58,7 +60,7 @@ LvglAllocatedImage::LvglAllocatedImage(void* data, size_t size, int width, int h
 
 LvglAllocatedImage::~LvglAllocatedImage() {
     if (image_dsc_.data) {
-        heap_caps_free((void*)image_dsc_.data);
+        HeapAccounting::Free(kHeapTagDisplay, (void*)image_dsc_.data);
         image_dsc_.data = nullptr;
     }
 }
\ No newline at end of file
@@ -41,6 +41,7 @@ private:
     const lv_img_dsc_t* image_dsc_;
 };
 
+// Takes over data, which must come from HeapAccounting::Malloc(kHeapTagDisplay, ...)
 class LvglAllocatedImage : public LvglImage {
 public:
     LvglAllocatedImage(void* data, size_t size);
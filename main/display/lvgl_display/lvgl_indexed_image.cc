@@ -0,0 +1,233 @@
+#include "lvgl_indexed_image.h"
+
+#include <esp_log.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "LvglIndexedImage"
+
+// The strip the rows are decoded into, a few KB whatever the size of the image
+#define INDEXED_STRIP_BYTES 4096
+
+struct IndexedImageInfo {
+    uint16_t palette_size;
+    uint16_t width;
+    uint16_t height;
+    const uint8_t* palette;
+    const uint8_t* row_offsets;
+    const uint8_t* rows;
+    size_t rows_size;
+};
+
+struct IndexedDecoderContext {
+    IndexedImageInfo info;
+    uint32_t palette[256];      // A corrupt index reads a transparent color
+    lv_draw_buf_t* strip;
+};
+
+static inline uint16_t ReadU16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t ReadU32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool ParseIndexedImage(const void* data, size_t size, IndexedImageInfo& info) {
+    auto p = static_cast<const uint8_t*>(data);
+    if (p == nullptr || size < LVGL_INDEXED_IMAGE_HEADER_SIZE || memcmp(p, LVGL_INDEXED_IMAGE_MAGIC, 4) != 0 ||
+        p[4] != LVGL_INDEXED_IMAGE_VERSION) {
+        return false;
+    }
+    info.palette_size = ReadU16(p + 6);
+    info.width = ReadU16(p + 8);
+    info.height = ReadU16(p + 10);
+    size_t tables = (size_t)info.palette_size * 4 + (size_t)info.height * 4;
+    if (info.palette_size == 0 || info.palette_size > 256 || info.width == 0 || info.height == 0 ||
+        size < LVGL_INDEXED_IMAGE_HEADER_SIZE + tables) {
+        return false;
+    }
+    info.palette = p + LVGL_INDEXED_IMAGE_HEADER_SIZE;
+    info.row_offsets = info.palette + info.palette_size * 4;
+    info.rows = info.row_offsets + info.height * 4;
+    info.rows_size = size - LVGL_INDEXED_IMAGE_HEADER_SIZE - tables;
+    return true;
+}
+
+// Pixels x1 to x2 of a row, the packets before x1 are only skipped
+static void DecodeRow(const IndexedDecoderContext* context, int32_t y, int32_t x1, int32_t x2, uint32_t* out) {
+    auto& info = context->info;
+    size_t offset = ReadU32(info.row_offsets + y * 4);
+    const uint8_t* p = info.rows + std::min(offset, info.rows_size);
+    const uint8_t* end = info.rows + info.rows_size;
+    int32_t x = 0;
+    while (x <= x2 && p < end) {
+        uint8_t control = *p++;
+        if (control & 0x80) {
+            int32_t count = (control & 0x7F) + 1;
+            if (p >= end) {
+                break;
+            }
+            uint32_t color = context->palette[*p++];
+            for (int32_t i = std::max(x, x1); i <= std::min(x + count - 1, x2); i++) {
+                out[i - x1] = color;
+            }
+            x += count;
+        } else {
+            int32_t count = std::min<int32_t>(control + 1, end - p);
+            for (int32_t i = std::max(x, x1); i <= std::min(x + count - 1, x2); i++) {
+                out[i - x1] = context->palette[p[i - x]];
+            }
+            p += count;
+            x += count;
+        }
+    }
+    // A short row, the rest is transparent
+    for (int32_t i = std::max(x, x1); i <= x2; i++) {
+        out[i - x1] = 0;
+    }
+}
+
+static bool GetSourceData(lv_image_decoder_dsc_t* dsc, const void*& data, size_t& size) {
+    if (dsc->src_type != LV_IMAGE_SRC_VARIABLE) {
+        return false;
+    }
+    auto image_dsc = static_cast<const lv_image_dsc_t*>(dsc->src);
+    data = image_dsc->data;
+    size = image_dsc->data_size;
+    return true;
+}
+
+static lv_result_t IndexedDecoderInfo(lv_image_decoder_t* decoder, lv_image_decoder_dsc_t* dsc, lv_image_header_t* header) {
+    const void* data;
+    size_t size;
+    IndexedImageInfo info;
+    if (!GetSourceData(dsc, data, size) || !ParseIndexedImage(data, size, info)) {
+        return LV_RESULT_INVALID;
+    }
+    memset(header, 0, sizeof(*header));
+    header->magic = LV_IMAGE_HEADER_MAGIC;
+    header->cf = LV_COLOR_FORMAT_ARGB8888;
+    header->w = info.width;
+    header->h = info.height;
+    header->stride = info.width * 4;
+    return LV_RESULT_OK;
+}
+
+static lv_result_t IndexedDecoderOpen(lv_image_decoder_t* decoder, lv_image_decoder_dsc_t* dsc) {
+    const void* data;
+    size_t size;
+    IndexedImageInfo info;
+    if (!GetSourceData(dsc, data, size) || !ParseIndexedImage(data, size, info)) {
+        return LV_RESULT_INVALID;
+    }
+    auto context = static_cast<IndexedDecoderContext*>(lv_malloc(sizeof(IndexedDecoderContext)));
+    if (context == nullptr) {
+        return LV_RESULT_INVALID;
+    }
+    context->info = info;
+    memset(context->palette, 0, sizeof(context->palette));
+    for (int i = 0; i < info.palette_size; i++) {
+        context->palette[i] = ReadU32(info.palette + i * 4);
+    }
+    context->strip = nullptr;
+    dsc->user_data = context;
+    // Nothing decoded, the draw asks for the rows through get_area
+    dsc->decoded = nullptr;
+    return LV_RESULT_OK;
+}
+
+static lv_result_t IndexedDecoderGetArea(lv_image_decoder_t* decoder, lv_image_decoder_dsc_t* dsc,
+    const lv_area_t* full_area, lv_area_t* decoded_area) {
+    auto context = static_cast<IndexedDecoderContext*>(dsc->user_data);
+    int32_t width = lv_area_get_width(full_area);
+    int32_t strip_rows = std::max<int32_t>(1, INDEXED_STRIP_BYTES / (width * 4));
+
+    if (decoded_area->y1 == LV_COORD_MIN) {
+        decoded_area->x1 = full_area->x1;
+        decoded_area->x2 = full_area->x2;
+        decoded_area->y1 = full_area->y1;
+    } else {
+        decoded_area->y1 = decoded_area->y2 + 1;
+    }
+    if (decoded_area->y1 > full_area->y2 || decoded_area->y1 >= context->info.height) {
+        return LV_RESULT_INVALID;
+    }
+    decoded_area->y2 = std::min<int32_t>({decoded_area->y1 + strip_rows - 1, full_area->y2, context->info.height - 1});
+    int32_t rows = lv_area_get_height(decoded_area);
+
+    if (context->strip != nullptr &&
+        lv_draw_buf_reshape(context->strip, LV_COLOR_FORMAT_ARGB8888, width, rows, LV_STRIDE_AUTO) == nullptr) {
+        lv_draw_buf_destroy(context->strip);
+        context->strip = nullptr;
+    }
+    if (context->strip == nullptr) {
+        context->strip = lv_draw_buf_create(width, strip_rows, LV_COLOR_FORMAT_ARGB8888, LV_STRIDE_AUTO);
+        if (context->strip == nullptr) {
+            return LV_RESULT_INVALID;
+        }
+        lv_draw_buf_reshape(context->strip, LV_COLOR_FORMAT_ARGB8888, width, rows, LV_STRIDE_AUTO);
+    }
+
+    int32_t x2 = std::min<int32_t>(decoded_area->x2, context->info.width - 1);
+    for (int32_t y = decoded_area->y1; y <= decoded_area->y2; y++) {
+        uint8_t* line = context->strip->data + (y - decoded_area->y1) * context->strip->header.stride;
+        if (decoded_area->x1 <= x2) {
+            DecodeRow(context, y, decoded_area->x1, x2, reinterpret_cast<uint32_t*>(line));
+        }
+        if (x2 < decoded_area->x2) {
+            memset(line + (x2 - decoded_area->x1 + 1) * 4, 0, (decoded_area->x2 - x2) * 4);
+        }
+    }
+    dsc->decoded = context->strip;
+    return LV_RESULT_OK;
+}
+
+static void IndexedDecoderClose(lv_image_decoder_t* decoder, lv_image_decoder_dsc_t* dsc) {
+    auto context = static_cast<IndexedDecoderContext*>(dsc->user_data);
+    if (context == nullptr) {
+        return;
+    }
+    if (context->strip != nullptr) {
+        lv_draw_buf_destroy(context->strip);
+    }
+    lv_free(context);
+    dsc->user_data = nullptr;
+    dsc->decoded = nullptr;
+}
+
+LvglIndexedImage::LvglIndexedImage(const void* data, size_t size) {
+    RegisterDecoder();
+    memset(&image_dsc_, 0, sizeof(image_dsc_));
+    image_dsc_.data_size = size;
+    image_dsc_.data = static_cast<const uint8_t*>(data);
+    image_dsc_.header.magic = LV_IMAGE_HEADER_MAGIC;
+    image_dsc_.header.cf = LV_COLOR_FORMAT_RAW_ALPHA;
+    IndexedImageInfo info;
+    if (ParseIndexedImage(data, size, info)) {
+        image_dsc_.header.w = info.width;
+        image_dsc_.header.h = info.height;
+    } else {
+        ESP_LOGE(TAG, "Not an indexed image, data: %p size: %u", data, size);
+    }
+}
+
+bool LvglIndexedImage::IsIndexedImage(const void* data, size_t size) {
+    IndexedImageInfo info;
+    return ParseIndexedImage(data, size, info);
+}
+
+void LvglIndexedImage::RegisterDecoder() {
+    static lv_image_decoder_t* decoder = nullptr;
+    if (decoder != nullptr) {
+        return;
+    }
+    // New decoders go first in the list, ahead of the binary decoder the RAW_ALPHA header would pass
+    decoder = lv_image_decoder_create();
+    lv_image_decoder_set_info_cb(decoder, IndexedDecoderInfo);
+    lv_image_decoder_set_open_cb(decoder, IndexedDecoderOpen);
+    lv_image_decoder_set_get_area_cb(decoder, IndexedDecoderGetArea);
+    lv_image_decoder_set_close_cb(decoder, IndexedDecoderClose);
+    decoder->name = "IRLE";
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "lvgl_image.h"
+
+#include <cstddef>
+#include <cstdint>
+
+
+/*
+ * A palette-indexed, run-length coded image for the emojis and the icons, drawn by an LVGL image
+ * decoder of its own without a full decode: the rows the draw asks for go through a strip of a
+ * few ARGB8888 rows that LVGL blends into the draw buffer. Opening one only reads its header,
+ * nothing lands in the image cache.
+ *
+ * Little endian:
+ *   char     magic[4]            "IRLE"
+ *   uint8_t  version             1
+ *   uint8_t  flags               Bit 0: some colors are not opaque
+ *   uint16_t palette_size        1 to 256
+ *   uint16_t width, height
+ *   uint32_t palette[palette_size]   ARGB8888, in the byte order of lv_color32_t
+ *   uint32_t row_offsets[height]     Into the row data, a row decodes on its own
+ *   row data, per row packets of one control byte:
+ *     0x00 - 0x7F: (c + 1) palette indices follow
+ *     0x80 - 0xFF: (c - 0x7F) pixels of the one palette index that follows
+ *
+ * The images are written by scripts/Image_Converter/indexed_rle.py, the default assets build uses
+ * it with CONFIG_XIAOZHI_ASSETS_INDEXED_EMOJI. As a C array the image is an lv_image_dsc_t of
+ * LV_COLOR_FORMAT_RAW_ALPHA with this data, the decoder knows it by the magic.
+ */
+#define LVGL_INDEXED_IMAGE_MAGIC "IRLE"
+#define LVGL_INDEXED_IMAGE_VERSION 1
+#define LVGL_INDEXED_IMAGE_HEADER_SIZE 12
+
+class LvglIndexedImage : public LvglImage {
+public:
+    // The data stays with the caller, an asset in the mapped partition
+    LvglIndexedImage(const void* data, size_t size);
+    virtual const lv_img_dsc_t* image_dsc() const override { return &image_dsc_; }
+
+    // Whether the data is an image of this format
+    static bool IsIndexedImage(const void* data, size_t size);
+    // Adds the decoder to LVGL after lv_init(), once. Called with the display lock held
+    static void RegisterDecoder();
+
+private:
+    lv_img_dsc_t image_dsc_;
+};
@@ -0,0 +1,61 @@
+#include "lvgl_text_measure.h"
+
+#include <cstring>
+
+
+static uint32_t HashText(const char* text, size_t length) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+lv_coord_t LvglTextMeasure::GetWidth(const lv_font_t* font, const char* text, size_t length, lv_coord_t max_width) {
+    lv_coord_t width;
+    bool appended = font == last_font_ && max_width == last_max_width_ && length > last_text_.size() &&
+        memcmp(text, last_text_.data(), last_text_.size()) == 0;
+    if (appended) {
+        // Once it wraps it stays wrapped. The kerning of the first appended glyph is left out.
+        width = last_width_;
+        if (width < max_width) {
+            width += lv_txt_get_width(text + last_text_.size(), length - last_text_.size(), font, 0);
+        }
+    } else {
+        uint32_t hash = HashText(text, length);
+        Entry* found = nullptr;
+        for (auto& entry : entries_) {
+            if (entry.font == font && entry.hash == hash && entry.length == length && entry.max_width == max_width) {
+                found = &entry;
+                break;
+            }
+        }
+        if (found != nullptr) {
+            width = found->width;
+        } else {
+            width = lv_txt_get_width(text, length, font, 0);
+            if (width > max_width) {
+                width = max_width;
+            }
+            entries_[next_entry_] = {font, hash, length, max_width, width};
+            next_entry_ = (next_entry_ + 1) % entries_.size();
+        }
+    }
+    if (width > max_width) {
+        width = max_width;
+    }
+
+    last_text_.assign(text, length);
+    last_font_ = font;
+    last_max_width_ = max_width;
+    last_width_ = width;
+    return width;
+}
+
+void LvglTextMeasure::Clear() {
+    entries_.fill(Entry());
+    next_entry_ = 0;
+    last_text_.clear();
+    last_font_ = nullptr;
+}
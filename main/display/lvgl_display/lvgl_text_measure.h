@@ -0,0 +1,35 @@
+#pragma once
+
+#include <lvgl.h>
+
+#include <array>
+#include <string>
+#include <cstdint>
+
+
+// Caches the text widths the chat bubbles are sized with, the glyph lookups of the large
+// fonts from the assets are the expensive part. Used with the display lock held.
+class LvglTextMeasure {
+public:
+    // The one-line width of the text, or max_width when the label has to wrap it
+    lv_coord_t GetWidth(const lv_font_t* font, const char* text, size_t length, lv_coord_t max_width);
+    // A reloaded font may get the address of the old one
+    void Clear();
+
+private:
+    struct Entry {
+        const lv_font_t* font = nullptr;
+        uint32_t hash = 0;
+        size_t length = 0;
+        lv_coord_t max_width = 0;
+        lv_coord_t width = 0;
+    };
+    std::array<Entry, 16> entries_;
+    size_t next_entry_ = 0;
+
+    // The last text measured, a streaming text only measures what was appended to it
+    std::string last_text_;
+    const lv_font_t* last_font_ = nullptr;
+    lv_coord_t last_max_width_ = 0;
+    lv_coord_t last_width_ = 0;
+};
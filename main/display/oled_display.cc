@@ -5,6 +5,7 @@
 
 #include <string>
 #include <algorithm>
+#include <cstring>
 
 #include <esp_log.h>
 #include <esp_err.h>
@@ -38,11 +39,9 @@ OledDisplay::OledDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handl
 
     ESP_LOGI(TAG, "Initialize LVGL");
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
-    port_cfg.task_priority = 1;
+    // The monochrome UI needs less than the port default
     port_cfg.task_stack = 6144;
-#if CONFIG_SOC_CPU_CORES_NUM > 1
-    port_cfg.task_affinity = 1;
-#endif
+    PlaceLvglTask(port_cfg);
     lvgl_port_init(&port_cfg);
 
     ESP_LOGI(TAG, "Adding OLED display");
@@ -70,6 +69,18 @@ OledDisplay::OledDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handl
         },
     };
 
+    // The port flushes the area LVGL invalidated, a label redrawn with the same text or a
+    // status icon blinking back sends its whole box. Over I2C a full 128x64 frame is about
+    // 23 ms of bus time at 400 kHz, the codec on the same bus waits all of it. So the flushes
+    // are compared with what the panel holds, and only the changed columns go out, one page
+    // per transfer so that the bus is released between the pages
+    if (panel_ != nullptr && height_ <= 32 * 8 && height_ % 8 == 0) {
+        gram_.assign(width_ * height_ / 8, 0);
+        draw_bitmap_ = panel_->draw_bitmap;
+        panel_->user_data = this;
+        panel_->draw_bitmap = &OledDisplay::DrawChangedColumns;
+    }
+
     display_ = lvgl_port_add_disp(&display_cfg);
     if (display_ == nullptr) {
         ESP_LOGE(TAG, "Failed to add display");
@@ -106,6 +117,55 @@ OledDisplay::~OledDisplay() {
     lvgl_port_deinit();
 }
 
+esp_err_t OledDisplay::DrawChangedColumns(esp_lcd_panel_t* panel, int x_start, int y_start, int x_end,
+    int y_end, const void* color_data) {
+    auto self = static_cast<OledDisplay*>(panel->user_data);
+    int width = x_end - x_start;
+    // The port rounds the areas to whole pages, anything else is passed on as it is
+    if (x_start < 0 || x_end > self->width_ || width <= 0 || y_start < 0 || y_end > self->height_ ||
+        y_start % 8 != 0 || y_end % 8 != 0 || y_end <= y_start) {
+        return self->draw_bitmap_(panel, x_start, y_start, x_end, y_end, color_data);
+    }
+
+    auto data = static_cast<const uint8_t*>(color_data);
+    bool sent = false;
+    esp_err_t ret = ESP_OK;
+    for (int page = y_start / 8; page < y_end / 8; page++) {
+        const uint8_t* row = data + (page - y_start / 8) * width;
+        uint8_t* shadow = self->gram_.data() + page * self->width_ + x_start;
+        int first = 0;
+        int last = width - 1;
+        if (self->gram_valid_pages_ & (1u << page)) {
+            while (first < width && row[first] == shadow[first]) {
+                first++;
+            }
+            if (first == width) {
+                continue;
+            }
+            while (row[last] == shadow[last]) {
+                last--;
+            }
+        }
+        esp_err_t err = self->draw_bitmap_(panel, x_start + first, page * 8, x_start + last + 1, page * 8 + 8,
+            row + first);
+        if (err != ESP_OK) {
+            ret = err;
+            continue;
+        }
+        memcpy(shadow + first, row + first, last - first + 1);
+        // A page counts as known once a flush covered all of its columns
+        if (x_start == 0 && x_end == self->width_) {
+            self->gram_valid_pages_ |= 1u << page;
+        }
+        sent = true;
+    }
+    // The port completes the flush in the callback of the color transfer, none was made
+    if (!sent && self->display_ != nullptr) {
+        lv_display_flush_ready(self->display_);
+    }
+    return ret;
+}
+
 bool OledDisplay::Lock(int timeout_ms) {
     return lvgl_port_lock(timeout_ms);
 }
@@ -5,7 +5,9 @@
 
 #include <esp_lcd_panel_io.h>
 #include <esp_lcd_panel_ops.h>
+#include <esp_lcd_panel_interface.h>
 
+#include <vector>
 
 class OledDisplay : public LvglDisplay {
 private:
@@ -21,6 +23,17 @@ private:
     lv_obj_t *emotion_label_ = nullptr;
     lv_obj_t* chat_message_label_ = nullptr;
 
+    // The panel RAM as last written, in the page format of the controller: a byte is 8 rows
+    // of a column. A page is only compared once it was written whole
+    std::vector<uint8_t> gram_;
+    uint32_t gram_valid_pages_ = 0;
+    esp_err_t (*draw_bitmap_)(esp_lcd_panel_t* panel, int x_start, int y_start, int x_end, int y_end,
+        const void* color_data) = nullptr;
+
+    // Takes the place of the draw_bitmap of the panel, sends only the changed columns of a page
+    static esp_err_t DrawChangedColumns(esp_lcd_panel_t* panel, int x_start, int y_start, int x_end,
+        int y_end, const void* color_data);
+
     virtual bool Lock(int timeout_ms = 0) override;
     virtual void Unlock() override;
 
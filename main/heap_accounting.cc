@@ -0,0 +1,197 @@
+#include "heap_accounting.h"
+
+#if CONFIG_USE_HEAP_ACCOUNTING
+
+#include <esp_log.h>
+#include <esp_memory_utils.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <algorithm>
+
+#define TAG "HeapAccounting"
+
+namespace {
+
+enum HeapRegion {
+    kHeapRegionInternal,
+    kHeapRegionPsram,
+    kHeapRegionCount,
+};
+
+const char* const kTagNames[kHeapTagCount] = { "audio", "display", "protocol", "camera", "json" };
+
+struct HeapInfo {
+    const char* name;
+    uint32_t caps;
+};
+
+const HeapInfo kHeaps[] = {
+    { "internal", MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT },
+    { "psram", MALLOC_CAP_SPIRAM },
+    { "dma", MALLOC_CAP_DMA },
+};
+constexpr size_t kHeapCount = sizeof(kHeaps) / sizeof(kHeaps[0]);
+
+std::atomic<int32_t> live_[kHeapTagCount][kHeapRegionCount];
+std::atomic<int32_t> peak_[kHeapTagCount][kHeapRegionCount];
+std::atomic<int32_t> blocks_[kHeapTagCount];
+std::atomic<int32_t> fallbacks_[kHeapTagCount];
+
+// Guards the samples
+std::mutex mutex_;
+uint32_t largest_[kHeapCount][HEAP_ACCOUNTING_HISTORY];
+uint32_t lowest_largest_[kHeapCount] = { UINT32_MAX, UINT32_MAX, UINT32_MAX };
+size_t head_ = 0;       // The next sample
+size_t samples_ = 0;
+
+void Charge(HeapTag tag, void* ptr, bool allocated) {
+    if (ptr == nullptr) {
+        return;
+    }
+    int32_t size = heap_caps_get_allocated_size(ptr);
+    int region = esp_ptr_external_ram(ptr) ? kHeapRegionPsram : kHeapRegionInternal;
+    if (!allocated) {
+        live_[tag][region].fetch_sub(size, std::memory_order_relaxed);
+        blocks_[tag].fetch_sub(1, std::memory_order_relaxed);
+        return;
+    }
+    int32_t live = live_[tag][region].fetch_add(size, std::memory_order_relaxed) + size;
+    blocks_[tag].fetch_add(1, std::memory_order_relaxed);
+    int32_t peak = peak_[tag][region].load(std::memory_order_relaxed);
+    while (live > peak && !peak_[tag][region].compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+}
+
+} // namespace
+
+void* HeapAccounting::Malloc(HeapTag tag, size_t size, uint32_t caps) {
+    void* ptr = heap_caps_malloc(size, caps);
+    Charge(tag, ptr, true);
+    return ptr;
+}
+
+void* HeapAccounting::Malloc(HeapTag tag, size_t size) {
+    void* ptr = malloc(size);
+    Charge(tag, ptr, true);
+    return ptr;
+}
+
+void* HeapAccounting::AlignedAlloc(HeapTag tag, size_t alignment, size_t size, uint32_t caps) {
+    void* ptr = heap_caps_aligned_alloc(alignment, size, caps);
+    Charge(tag, ptr, true);
+    return ptr;
+}
+
+void* HeapAccounting::Realloc(HeapTag tag, void* ptr, size_t size) {
+    // Charged again afterwards, the block may move between internal RAM and PSRAM
+    Charge(tag, ptr, false);
+    void* result = realloc(ptr, size);
+    if (result == nullptr && size > 0) {
+        // The old block is still there
+        Charge(tag, ptr, true);
+        return nullptr;
+    }
+    Charge(tag, result, true);
+    return result;
+}
+
+void HeapAccounting::Free(HeapTag tag, void* ptr) {
+    Charge(tag, ptr, false);
+    heap_caps_free(ptr);
+}
+
+void* HeapAccounting::Place(HeapTag tag, size_t size, HeapPlacement placement) {
+    uint32_t fallback = 0;
+    uint32_t caps = GetPlacementCaps(placement, &fallback);
+    if (caps == 0) {
+        return Malloc(tag, size);
+    }
+    void* ptr = heap_caps_malloc(size, caps);
+    if (ptr == nullptr && fallback != 0) {
+        ptr = heap_caps_malloc(size, fallback);
+        if (ptr != nullptr) {
+            fallbacks_[tag].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    Charge(tag, ptr, true);
+    return ptr;
+}
+
+void HeapAccounting::Sample() {
+    uint32_t largest[kHeapCount];
+    for (size_t i = 0; i < kHeapCount; i++) {
+        largest[i] = heap_caps_get_largest_free_block(kHeaps[i].caps);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < kHeapCount; i++) {
+        largest_[i][head_] = largest[i];
+        lowest_largest_[i] = std::min(lowest_largest_[i], largest[i]);
+    }
+    head_ = (head_ + 1) % HEAP_ACCOUNTING_HISTORY;
+    samples_ = std::min<size_t>(samples_ + 1, HEAP_ACCOUNTING_HISTORY);
+}
+
+cJSON* HeapAccounting::GetStatsJson() {
+    cJSON* json = cJSON_CreateObject();
+
+    cJSON* tags = cJSON_CreateArray();
+    for (int tag = 0; tag < kHeapTagCount; tag++) {
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "tag", kTagNames[tag]);
+        cJSON_AddNumberToObject(item, "internal", live_[tag][kHeapRegionInternal].load());
+        cJSON_AddNumberToObject(item, "internal_peak", peak_[tag][kHeapRegionInternal].load());
+        cJSON_AddNumberToObject(item, "psram", live_[tag][kHeapRegionPsram].load());
+        cJSON_AddNumberToObject(item, "psram_peak", peak_[tag][kHeapRegionPsram].load());
+        cJSON_AddNumberToObject(item, "blocks", blocks_[tag].load());
+        cJSON_AddNumberToObject(item, "fallbacks", fallbacks_[tag].load());
+        cJSON_AddItemToArray(tags, item);
+    }
+    cJSON_AddItemToObject(json, "tags", tags);
+
+    cJSON* heaps = cJSON_CreateArray();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < kHeapCount; i++) {
+        if (heap_caps_get_total_size(kHeaps[i].caps) == 0) {
+            // No PSRAM on this board
+            continue;
+        }
+        size_t free_size = heap_caps_get_free_size(kHeaps[i].caps);
+        size_t largest = heap_caps_get_largest_free_block(kHeaps[i].caps);
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "heap", kHeaps[i].name);
+        cJSON_AddNumberToObject(item, "free", free_size);
+        cJSON_AddNumberToObject(item, "minimum_free", heap_caps_get_minimum_free_size(kHeaps[i].caps));
+        cJSON_AddNumberToObject(item, "largest_free_block", largest);
+        cJSON_AddNumberToObject(item, "lowest_largest_free_block", std::min<size_t>(lowest_largest_[i], largest));
+        // Percent of the free memory that is not in the largest block
+        cJSON_AddNumberToObject(item, "fragmentation", free_size > 0 ? 100 - largest * 100 / free_size : 0);
+        cJSON* history = cJSON_CreateArray();
+        for (size_t j = samples_; j > 0; j--) {
+            size_t index = (head_ + HEAP_ACCOUNTING_HISTORY - j) % HEAP_ACCOUNTING_HISTORY;
+            cJSON_AddItemToArray(history, cJSON_CreateNumber(largest_[i][index]));
+        }
+        cJSON_AddItemToObject(item, "history", history);
+        cJSON_AddItemToArray(heaps, item);
+    }
+    cJSON_AddItemToObject(json, "heaps", heaps);
+    return json;
+}
+
+void HeapAccounting::PrintStats() {
+    std::string line;
+    for (int tag = 0; tag < kHeapTagCount; tag++) {
+        line += " ";
+        line += kTagNames[tag];
+        line += " " + std::to_string(live_[tag][kHeapRegionInternal].load() / 1024) + "/" +
+            std::to_string(live_[tag][kHeapRegionPsram].load() / 1024);
+    }
+    int32_t fallbacks = 0;
+    for (int tag = 0; tag < kHeapTagCount; tag++) {
+        fallbacks += fallbacks_[tag].load();
+    }
+    ESP_LOGI(TAG, "Live KB (internal/psram):%s, placement fallbacks %ld", line.c_str(), (long)fallbacks);
+}
+
+#endif // CONFIG_USE_HEAP_ACCOUNTING
@@ -0,0 +1,161 @@
+#ifndef HEAP_ACCOUNTING_H
+#define HEAP_ACCOUNTING_H
+
+#include <sdkconfig.h>
+#include <esp_heap_caps.h>
+#include <cJSON.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// Heap samples kept for the fragmentation history, five minutes at one sample per 10 seconds
+#define HEAP_ACCOUNTING_HISTORY 30
+
+// The subsystem an allocation is charged to
+enum HeapTag {
+    kHeapTagAudio,      // Task stacks and sample buffers of the audio service
+    kHeapTagDisplay,    // LVGL and the images handed to the display
+    kHeapTagProtocol,   // Framing buffers of the protocols
+    kHeapTagCamera,     // Frame copies, rotation and JPEG buffers
+    kHeapTagJson,       // cJSON trees and strings: control messages, MCP requests and replies
+    kHeapTagCount,
+};
+
+// Where an allocation should land, Place() falls back when the preferred region is exhausted or absent
+enum HeapPlacement {
+    kHeapPlacementDefault,  // Wherever malloc() puts it
+    kHeapPlacementInternal, // Hot buffers touched every frame, falls back to PSRAM
+    kHeapPlacementPsram,    // Bulk data that is touched rarely or streamed once, falls back to internal RAM
+    kHeapPlacementDma,      // Buffers handed to a peripheral DMA, no fallback
+};
+
+/*
+ * Tagged heap accounting.
+ *
+ * The major allocation sites go through Malloc()/Free() with the tag of their subsystem, which
+ * keeps the live and peak bytes per tag, apart for internal RAM and PSRAM by where the block
+ * landed. Sizes are the real block sizes from heap_caps_get_allocated_size(), so a block must be
+ * freed with the tag it was allocated with: a buffer handed over to another subsystem, like the
+ * image data LvglAllocatedImage frees, is allocated with the tag of the one freeing it.
+ *
+ * Sample() records the free size and the largest free block of the internal, PSRAM and DMA
+ * capable heaps, the shrinking of the largest block against the free size shows fragmentation.
+ *
+ * Place() allocates by placement instead of raw caps. An allocation that could not get its
+ * preferred region is counted as a fallback of its tag, a steady state with fallbacks means the
+ * placement policy does not fit the board.
+ *
+ * Without CONFIG_USE_HEAP_ACCOUNTING the calls go straight to heap_caps.
+ */
+class HeapAccounting {
+public:
+#if CONFIG_USE_HEAP_ACCOUNTING
+    static void* Malloc(HeapTag tag, size_t size, uint32_t caps);
+    // Same placement as malloc(), for the allocations that used it
+    static void* Malloc(HeapTag tag, size_t size);
+    static void* AlignedAlloc(HeapTag tag, size_t alignment, size_t size, uint32_t caps);
+    static void* Realloc(HeapTag tag, void* ptr, size_t size);
+    static void Free(HeapTag tag, void* ptr);
+    static void* Place(HeapTag tag, size_t size, HeapPlacement placement);
+
+    // Called by the clock tick, every 10 seconds
+    static void Sample();
+    // {"tags": [{"tag", "internal", "internal_peak", "psram", "psram_peak", "blocks", "fallbacks"}, ...],
+    //  "heaps": [{"heap", "free", "minimum_free", "largest_free_block", "lowest_largest_free_block",
+    //  "fragmentation", "history": [largest free block, oldest first]}, ...]}
+    static cJSON* GetStatsJson();
+    // One log line with the live bytes per tag
+    static void PrintStats();
+#else
+    static void* Malloc(HeapTag tag, size_t size, uint32_t caps) { return heap_caps_malloc(size, caps); }
+    static void* Malloc(HeapTag tag, size_t size) { return malloc(size); }
+    static void* AlignedAlloc(HeapTag tag, size_t alignment, size_t size, uint32_t caps) {
+        return heap_caps_aligned_alloc(alignment, size, caps);
+    }
+    static void* Realloc(HeapTag tag, void* ptr, size_t size) { return realloc(ptr, size); }
+    static void Free(HeapTag tag, void* ptr) { heap_caps_free(ptr); }
+    static void* Place(HeapTag tag, size_t size, HeapPlacement placement) {
+        uint32_t fallback = 0;
+        uint32_t caps = GetPlacementCaps(placement, &fallback);
+        if (caps == 0) {
+            return malloc(size);
+        }
+        void* ptr = heap_caps_malloc(size, caps);
+        if (ptr == nullptr && fallback != 0) {
+            ptr = heap_caps_malloc(size, fallback);
+        }
+        return ptr;
+    }
+    static void Sample() {}
+    static cJSON* GetStatsJson() { return cJSON_CreateObject(); }
+    static void PrintStats() {}
+#endif
+
+    // The caps of the preferred region, 0 for the default placement, and of the fallback region
+    static uint32_t GetPlacementCaps(HeapPlacement placement, uint32_t* fallback) {
+        switch (placement) {
+#if !CONFIG_SPIRAM
+        // Everything is internal RAM, not worth counting as a fallback
+        case kHeapPlacementInternal:
+        case kHeapPlacementPsram:
+            *fallback = 0;
+            return MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+#else
+        case kHeapPlacementInternal:
+            *fallback = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+            return MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+        case kHeapPlacementPsram:
+            *fallback = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+            return MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+#endif
+        case kHeapPlacementDma:
+            *fallback = 0;
+            return MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL;
+        default:
+            *fallback = 0;
+            return 0;
+        }
+    }
+};
+
+// For the containers of a subsystem, e.g. std::vector<int16_t, InternalAllocator<int16_t, kHeapTagAudio>>
+template <typename T, HeapTag Tag, HeapPlacement Placement>
+class HeapPlacedAllocator {
+public:
+    using value_type = T;
+
+    HeapPlacedAllocator() = default;
+    template <typename U>
+    HeapPlacedAllocator(const HeapPlacedAllocator<U, Tag, Placement>&) {}
+    template <typename U>
+    struct rebind {
+        using other = HeapPlacedAllocator<U, Tag, Placement>;
+    };
+
+    T* allocate(size_t n) {
+        void* ptr = HeapAccounting::Place(Tag, n * sizeof(T), Placement);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+    void deallocate(T* ptr, size_t) { HeapAccounting::Free(Tag, ptr); }
+
+    template <typename U>
+    bool operator==(const HeapPlacedAllocator<U, Tag, Placement>&) const { return true; }
+    template <typename U>
+    bool operator!=(const HeapPlacedAllocator<U, Tag, Placement>&) const { return false; }
+};
+
+template <typename T, HeapTag Tag>
+using HeapTaggedAllocator = HeapPlacedAllocator<T, Tag, kHeapPlacementDefault>;
+template <typename T, HeapTag Tag>
+using InternalAllocator = HeapPlacedAllocator<T, Tag, kHeapPlacementInternal>;
+template <typename T, HeapTag Tag>
+using PsramAllocator = HeapPlacedAllocator<T, Tag, kHeapPlacementPsram>;
+template <typename T, HeapTag Tag>
+using DmaAllocator = HeapPlacedAllocator<T, Tag, kHeapPlacementDma>;
+
+#endif // HEAP_ACCOUNTING_H
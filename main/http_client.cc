@@ -0,0 +1,280 @@
+#include "http_client.h"
+#include "board.h"
+#include "task_placement.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+#include <algorithm>
+
+#define TAG "HttpClient"
+
+const char* HttpResultName(HttpResult result) {
+    switch (result) {
+        case kHttpOk: return "ok";
+        case kHttpOpenFailed: return "open_failed";
+        case kHttpReadFailed: return "read_failed";
+        case kHttpAborted: return "aborted";
+        case kHttpCancelled: return "cancelled";
+    }
+    return "unknown";
+}
+
+void HttpBodyWriter::Write(const char* data, size_t size) {
+    if (size > 0) {
+        http_->Write(data, size);
+    }
+}
+
+HttpWriteBatcher::HttpWriteBatcher(Http* http, size_t chunk_size) : http_(http), chunk_size_(chunk_size) {
+    buffer_.reserve(chunk_size);
+}
+
+void HttpWriteBatcher::Write(const char* data, size_t size) {
+    while (size > 0) {
+        // A whole chunk of new data skips the copy
+        if (buffer_.empty() && size >= chunk_size_) {
+            http_->Write(data, chunk_size_);
+            writes_++;
+            data += chunk_size_;
+            size -= chunk_size_;
+            continue;
+        }
+        size_t count = std::min(size, chunk_size_ - buffer_.size());
+        buffer_.insert(buffer_.end(), data, data + count);
+        data += count;
+        size -= count;
+        if (buffer_.size() == chunk_size_) {
+            Flush();
+        }
+    }
+}
+
+void HttpWriteBatcher::Finish() {
+    Flush();
+    http_->Write("", 0);
+}
+
+void HttpWriteBatcher::Flush() {
+    if (!buffer_.empty()) {
+        http_->Write(buffer_.data(), buffer_.size());
+        writes_++;
+        buffer_.clear();
+    }
+}
+
+int HttpClient::Submit(HttpRequest&& request, uint32_t delay_ms) {
+    auto transfer = std::make_unique<Transfer>();
+    transfer->start_us = esp_timer_get_time() + static_cast<int64_t>(delay_ms) * 1000;
+    transfer->request = std::move(request);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (task_ == nullptr) {
+        TaskPlacements::Create(kTaskHttpClient, [](void* arg) {
+            static_cast<HttpClient*>(arg)->ClientTask();
+            vTaskDelete(NULL);
+        }, this, &task_);
+    }
+    int id = next_id_++;
+    transfer->id = id;
+    live_.push_back(id);
+    queued_.push_back(std::move(transfer));
+    if (task_ != nullptr) {
+        xTaskNotifyGive(task_);
+    }
+    return id;
+}
+
+bool HttpClient::Cancel(int id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (std::find(live_.begin(), live_.end(), id) == live_.end()) {
+        return false;
+    }
+    if (std::find(cancelled_.begin(), cancelled_.end(), id) == cancelled_.end()) {
+        cancelled_.push_back(id);
+    }
+    if (task_ != nullptr) {
+        xTaskNotifyGive(task_);
+    }
+    return true;
+}
+
+HttpResult HttpClient::Run(HttpRequest&& request, int* status, std::string* body) {
+    if (InClientTask()) {
+        ESP_LOGE(TAG, "Run() on the client task would wait for itself");
+        return kHttpOpenFailed;
+    }
+    struct Completion {
+        SemaphoreHandle_t done;
+        HttpResult result = kHttpOpenFailed;
+        int status = 0;
+        std::string body;
+    } completion;
+    completion.done = xSemaphoreCreateBinary();
+    auto on_done = std::move(request.on_done);
+    request.on_done = [&completion, &on_done](HttpResult result, int status, std::string&& body) {
+        completion.result = result;
+        completion.status = status;
+        if (on_done) {
+            on_done(result, status, std::move(body));
+        } else {
+            completion.body = std::move(body);
+        }
+        xSemaphoreGive(completion.done);
+    };
+    Submit(std::move(request));
+    xSemaphoreTake(completion.done, portMAX_DELAY);
+    vSemaphoreDelete(completion.done);
+    if (status != nullptr) {
+        *status = completion.status;
+    }
+    if (body != nullptr) {
+        *body = std::move(completion.body);
+    }
+    return completion.result;
+}
+
+bool HttpClient::TakeCancelled(int id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find(cancelled_.begin(), cancelled_.end(), id);
+    if (it == cancelled_.end()) {
+        return false;
+    }
+    cancelled_.erase(it);
+    return true;
+}
+
+TickType_t HttpClient::Admit() {
+    std::vector<std::unique_ptr<Transfer>> cancelled;
+    TickType_t wait = portMAX_DELAY;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        int64_t now = esp_timer_get_time();
+        for (auto it = queued_.begin(); it != queued_.end();) {
+            auto& transfer = *it;
+            if (std::find(cancelled_.begin(), cancelled_.end(), transfer->id) != cancelled_.end()) {
+                cancelled.push_back(std::move(transfer));
+                it = queued_.erase(it);
+            } else if (transfer->start_us <= now && active_.size() < HTTP_CLIENT_MAX_ACTIVE) {
+                active_.push_back(std::move(transfer));
+                it = queued_.erase(it);
+            } else {
+                if (transfer->start_us > now) {
+                    wait = std::min<TickType_t>(wait, pdMS_TO_TICKS((transfer->start_us - now) / 1000) + 1);
+                }
+                ++it;
+            }
+        }
+    }
+    // Outside of the lock, on_done may submit the next transfer
+    for (auto& transfer : cancelled) {
+        TakeCancelled(transfer->id);
+        Finish(*transfer, kHttpCancelled);
+    }
+    return wait;
+}
+
+void HttpClient::ClientTask() {
+    buffer_.resize(HTTP_CLIENT_CHUNK_SIZE);
+    while (true) {
+        TickType_t wait = Admit();
+        if (active_.empty()) {
+            ulTaskNotifyTake(pdTRUE, wait);
+            continue;
+        }
+        // One step each, the finished transfers leave the turn
+        for (size_t i = 0; i < active_.size();) {
+            if (TakeCancelled(active_[i]->id)) {
+                Finish(*active_[i], kHttpCancelled);
+            } else if (Step(*active_[i])) {
+                ++i;
+                continue;
+            }
+            active_.erase(active_.begin() + i);
+        }
+    }
+}
+
+bool HttpClient::Step(Transfer& transfer) {
+    auto& request = transfer.request;
+    switch (transfer.state) {
+    case kStateOpen: {
+        transfer.http = Board::GetInstance().GetNetwork()->CreateHttp(request.connect_id);
+        for (auto& header : request.headers) {
+            transfer.http->SetHeader(header.first, header.second);
+        }
+        if (!request.content.empty()) {
+            transfer.http->SetContent(std::move(request.content));
+        }
+        if (!transfer.http->Open(request.method, request.url)) {
+            ESP_LOGE(TAG, "Failed to open %s %s", request.method.c_str(), request.url.c_str());
+            Finish(transfer, kHttpOpenFailed);
+            return false;
+        }
+        transfer.state = request.body ? kStateBody : kStateResponse;
+        return true;
+    }
+    case kStateBody: {
+        HttpBodyWriter writer(transfer.http.get());
+        if (!request.body(writer)) {
+            // The end of the chunked body
+            transfer.http->Write("", 0);
+            transfer.state = kStateResponse;
+        }
+        return true;
+    }
+    case kStateResponse: {
+        transfer.status = transfer.http->GetStatusCode();
+        if (transfer.status <= 0) {
+            Finish(transfer, kHttpOpenFailed);
+            return false;
+        }
+        if (request.on_response && !request.on_response(transfer.status, transfer.http->GetBodyLength())) {
+            Finish(transfer, kHttpAborted);
+            return false;
+        }
+        transfer.state = kStateRead;
+        return true;
+    }
+    case kStateRead: {
+        int ret = transfer.http->Read(buffer_.data(), buffer_.size());
+        if (ret < 0) {
+            Finish(transfer, kHttpReadFailed);
+            return false;
+        }
+        if (ret == 0) {
+            Finish(transfer, kHttpOk);
+            return false;
+        }
+        if (request.on_data) {
+            if (!request.on_data(buffer_.data(), ret)) {
+                Finish(transfer, kHttpAborted);
+                return false;
+            }
+        } else {
+            transfer.body.append(buffer_.data(), ret);
+        }
+        return true;
+    }
+    }
+    return false;
+}
+
+void HttpClient::Finish(Transfer& transfer, HttpResult result) {
+    if (transfer.http != nullptr) {
+        transfer.http->Close();
+        transfer.http.reset();
+    }
+    if (result != kHttpOk) {
+        ESP_LOGW(TAG, "%s %s: %s, status %d", transfer.request.method.c_str(), transfer.request.url.c_str(),
+            HttpResultName(result), transfer.status);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        live_.erase(std::remove(live_.begin(), live_.end(), transfer.id), live_.end());
+        cancelled_.erase(std::remove(cancelled_.begin(), cancelled_.end(), transfer.id), cancelled_.end());
+    }
+    if (transfer.request.on_done) {
+        transfer.request.on_done(result, transfer.status, std::move(transfer.body));
+    }
+}
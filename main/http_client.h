@@ -0,0 +1,161 @@
+#ifndef HTTP_CLIENT_H
+#define HTTP_CLIENT_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+
+class Http;
+
+// At most this many transfers step at the same time, the others wait their turn
+#define HTTP_CLIENT_MAX_ACTIVE 3
+// The response body is read this much at a time, the transfers take turns at this granularity
+#define HTTP_CLIENT_CHUNK_SIZE 2048
+
+enum HttpResult {
+    kHttpOk,            // The whole response was read
+    kHttpOpenFailed,    // No connection, or no response head
+    kHttpReadFailed,    // The connection broke in the body
+    kHttpAborted,       // A callback returned false
+    kHttpCancelled,     // Cancel()
+};
+
+const char* HttpResultName(HttpResult result);
+
+// Writes the chunks of an upload body, in the body callback of a request
+class HttpBodyWriter {
+public:
+    explicit HttpBodyWriter(Http* http) : http_(http) {}
+    void Write(const char* data, size_t size);
+    void Write(const std::string& data) { Write(data.data(), data.size()); }
+
+private:
+    Http* http_;
+};
+
+/*
+ * Gathers the writes of a chunked upload into chunks of a fixed size. Every Http::Write() is a
+ * chunk on the wire and, on the 4G boards, AT transactions with the modem that each wait for
+ * their answer. So the small parts of a multipart body (the boundaries, the field headers, the
+ * pieces of an encoder) are not sent on their own. A memcpy is cheap next to a modem round trip.
+ */
+class HttpWriteBatcher {
+public:
+    HttpWriteBatcher(Http* http, size_t chunk_size = HTTP_CLIENT_CHUNK_SIZE);
+    void Write(const char* data, size_t size);
+    void Write(const std::string& data) { Write(data.data(), data.size()); }
+    // Writes out the rest and ends the chunked body
+    void Finish();
+    // The Http::Write() calls so far, one per chunk
+    int writes() const { return writes_; }
+
+private:
+    Http* http_;
+    std::vector<char> buffer_;
+    size_t chunk_size_;
+    int writes_ = 0;
+
+    void Flush();
+};
+
+struct HttpRequest {
+    std::string method = "GET";
+    std::string url;
+    std::vector<std::pair<std::string, std::string>> headers;
+    // The connect id of Network::CreateHttp()
+    int connect_id = 0;
+    // A body sent with the request, or the body callback for a chunked upload
+    std::string content;
+    // Called on every turn until it returns false, it writes the next part of the body
+    std::function<bool(HttpBodyWriter& writer)> body;
+    // The response head, false stops the transfer with kHttpAborted
+    std::function<bool(int status, size_t body_length)> on_response;
+    // The next chunk of the body, false stops the transfer with kHttpAborted. Without it the
+    // body is collected and passed to on_done
+    std::function<bool(const char* data, size_t size)> on_data;
+    // Always called once, last. The status is 0 when there was no response
+    std::function<void(HttpResult result, int status, std::string&& body)> on_done;
+};
+
+/*
+ * Runs the HTTP transfers of the firmware on one shared task.
+ *
+ * A transfer is submitted with its callbacks and the caller goes on, the completion comes back
+ * through on_done on the client task (schedule it to the main loop to touch the device state).
+ * The active transfers take turns, one step each: the connection, one part of the upload body,
+ * or one chunk of the response. So a small request is not stuck behind a download of the
+ * assets, and every transfer runs on the stack of this task instead of a task of its own.
+ *
+ * The Http interface of the network boards blocks, a step waits for its connection or chunk
+ * with the timeouts of the board. Http::Open() is the long step, it includes the TLS handshake.
+ *
+ * The callbacks run on the client task: they must not wait for another transfer, and Run()
+ * must not be called from them.
+ */
+class HttpClient {
+public:
+    static HttpClient& GetInstance() {
+        static HttpClient instance;
+        return instance;
+    }
+
+    // Returns the id of the transfer, it starts after delay_ms (a retry of the caller)
+    int Submit(HttpRequest&& request, uint32_t delay_ms = 0);
+    // The transfer ends with kHttpCancelled at its next step, false if it is not known
+    bool Cancel(int id);
+    // Submits and waits for the completion, for the callers that need the response to go on
+    HttpResult Run(HttpRequest&& request, int* status = nullptr, std::string* body = nullptr);
+    // Whether the calling task is the client task
+    bool InClientTask() const { return xTaskGetCurrentTaskHandle() == task_; }
+
+private:
+    HttpClient() = default;
+    HttpClient(const HttpClient&) = delete;
+    HttpClient& operator=(const HttpClient&) = delete;
+
+    enum State {
+        kStateOpen,
+        kStateBody,
+        kStateResponse,
+        kStateRead,
+    };
+
+    struct Transfer {
+        int id;
+        int64_t start_us;
+        HttpRequest request;
+        State state = kStateOpen;
+        std::unique_ptr<Http> http;
+        int status = 0;
+        std::string body;
+    };
+
+    std::mutex mutex_;
+    std::deque<std::unique_ptr<Transfer>> queued_;
+    // The ids of the queued and active transfers, and of those to cancel
+    std::vector<int> live_;
+    std::vector<int> cancelled_;
+    int next_id_ = 1;
+    TaskHandle_t task_ = nullptr;
+
+    // Client task only
+    std::vector<std::unique_ptr<Transfer>> active_;
+    std::vector<char> buffer_;
+
+    void ClientTask();
+    // Moves the due queued transfers to the active ones, returns the ticks until the next one is due
+    TickType_t Admit();
+    // One step of the transfer, false when it is done
+    bool Step(Transfer& transfer);
+    void Finish(Transfer& transfer, HttpResult result);
+    bool TakeCancelled(int id);
+};
+
+#endif // HTTP_CLIENT_H
@@ -0,0 +1,145 @@
+#include "json_arena.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cJSON.h>
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "heap_accounting.h"
+#include "memory_budget.h"
+
+#define TAG "JsonArena"
+
+#if CONFIG_USE_JSON_ARENA
+
+namespace {
+
+uint8_t* arena_ = nullptr;
+size_t arena_size_ = 0;
+std::atomic<TaskHandle_t> owner_ = nullptr;
+// Only used by the owner task
+size_t offset_ = 0;
+int depth_ = 0;
+size_t overflow_ = 0;
+#if MEMORY_BUDGET_STATIC_JSON_ARENA
+// Taken at link time, it lives as long as the firmware anyway
+alignas(8) uint8_t static_arena_[CONFIG_JSON_ARENA_SIZE];
+#endif
+
+void* ArenaMalloc(size_t size) {
+    if (owner_.load() == xTaskGetCurrentTaskHandle()) {
+        size_t aligned = (size + 7) & ~static_cast<size_t>(7);
+        if (arena_size_ - offset_ >= aligned) {
+            void* ptr = arena_ + offset_;
+            offset_ += aligned;
+            return ptr;
+        }
+        overflow_ += size;
+    }
+    return HeapAccounting::Malloc(kHeapTagJson, size);
+}
+
+void ArenaFree(void* ptr) {
+    auto p = static_cast<uint8_t*>(ptr);
+    if (p >= arena_ && p < arena_ + arena_size_) {
+        // Reclaimed when the scope ends
+        return;
+    }
+    HeapAccounting::Free(kHeapTagJson, ptr);
+}
+
+} // namespace
+
+void JsonArena::Install() {
+    if (arena_ != nullptr) {
+        return;
+    }
+    arena_size_ = CONFIG_JSON_ARENA_SIZE;
+#if MEMORY_BUDGET_STATIC_JSON_ARENA
+    arena_ = static_arena_;
+#else
+    arena_ = (uint8_t*)HeapAccounting::Malloc(kHeapTagJson, arena_size_, MALLOC_CAP_SPIRAM);
+#endif
+    if (arena_ == nullptr) {
+        arena_ = (uint8_t*)HeapAccounting::Malloc(kHeapTagJson, arena_size_, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+    if (arena_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the JSON arena");
+        arena_size_ = 0;
+        return;
+    }
+    cJSON_Hooks hooks = {
+        .malloc_fn = ArenaMalloc,
+        .free_fn = ArenaFree,
+    };
+    cJSON_InitHooks(&hooks);
+    ESP_LOGI(TAG, "JSON arena of %u bytes installed", arena_size_);
+}
+
+JsonArena::Scope::Scope() {
+    if (arena_ == nullptr) {
+        return;
+    }
+    auto task = xTaskGetCurrentTaskHandle();
+    if (owner_.load() == task) {
+        depth_++;
+        active_ = true;
+        return;
+    }
+    TaskHandle_t expected = nullptr;
+    if (owner_.compare_exchange_strong(expected, task)) {
+        depth_ = 1;
+        active_ = true;
+    }
+}
+
+JsonArena::Scope::~Scope() {
+    if (!active_ || --depth_ > 0) {
+        return;
+    }
+    if (overflow_ > 0) {
+        ESP_LOGW(TAG, "Arena full, %u bytes of the message came from the heap", overflow_);
+        overflow_ = 0;
+    }
+    offset_ = 0;
+    owner_.store(nullptr);
+}
+
+#else
+
+#if CONFIG_USE_HEAP_ACCOUNTING
+namespace {
+
+void* AccountedMalloc(size_t size) {
+    return HeapAccounting::Malloc(kHeapTagJson, size);
+}
+
+void AccountedFree(void* ptr) {
+    HeapAccounting::Free(kHeapTagJson, ptr);
+}
+
+} // namespace
+#endif
+
+void JsonArena::Install() {
+#if CONFIG_USE_HEAP_ACCOUNTING
+    // No arena, the hooks only charge the cJSON allocations to the json tag
+    cJSON_Hooks hooks = {
+        .malloc_fn = AccountedMalloc,
+        .free_fn = AccountedFree,
+    };
+    cJSON_InitHooks(&hooks);
+#endif
+}
+
+JsonArena::Scope::Scope() {
+}
+
+JsonArena::Scope::~Scope() {
+}
+
+#endif // CONFIG_USE_JSON_ARENA
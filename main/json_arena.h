@@ -0,0 +1,36 @@
+#ifndef JSON_ARENA_H
+#define JSON_ARENA_H
+
+#include <sdkconfig.h>
+
+/*
+ * Bump allocator for the cJSON trees of incoming control messages.
+ *
+ * Install() sets cJSON hooks that route the allocations of the task holding a Scope to a
+ * preallocated arena, and the arena is reset when the outermost Scope of that task ends.
+ * Freeing an arena node is a no-op, other tasks and the allocations that do not fit keep
+ * using the heap. Only one task holds the arena at a time, a Scope opened by another task
+ * meanwhile just uses the heap.
+ *
+ * Nothing allocated by cJSON inside a Scope may outlive it: handlers copy the strings they
+ * keep (as the Schedule() lambdas already do) and never store a cJSON pointer.
+ */
+class JsonArena {
+public:
+    // Installs the cJSON hooks. Without CONFIG_USE_JSON_ARENA they only do the heap accounting,
+    // and nothing is installed without CONFIG_USE_HEAP_ACCOUNTING either
+    static void Install();
+
+    class Scope {
+    public:
+        Scope();
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        bool active_ = false;
+    };
+};
+
+#endif // JSON_ARENA_H
@@ -0,0 +1,118 @@
+#include "json_writer.h"
+
+#include <cinttypes>
+#include <cstdio>
+
+void JsonWriter::Separator() {
+    if (!out_.empty()) {
+        char last = out_.back();
+        if (last != '{' && last != '[' && last != ':') {
+            out_.push_back(',');
+        }
+    }
+}
+
+void JsonWriter::Escaped(std::string_view value) {
+    out_.push_back('"');
+    for (char c : value) {
+        switch (c) {
+        case '"':
+            out_ += "\\\"";
+            break;
+        case '\\':
+            out_ += "\\\\";
+            break;
+        case '\n':
+            out_ += "\\n";
+            break;
+        case '\r':
+            out_ += "\\r";
+            break;
+        case '\t':
+            out_ += "\\t";
+            break;
+        default:
+            if ((unsigned char)c < 0x20) {
+                char code[7];
+                snprintf(code, sizeof(code), "\\u%04x", (unsigned char)c);
+                out_ += code;
+            } else {
+                out_.push_back(c);
+            }
+            break;
+        }
+    }
+    out_.push_back('"');
+}
+
+void JsonWriter::Key(const char* key) {
+    Separator();
+    out_.push_back('"');
+    out_ += key;
+    out_ += "\":";
+}
+
+void JsonWriter::String(const char* key, std::string_view value) {
+    Key(key);
+    Escaped(value);
+}
+
+void JsonWriter::Int(const char* key, int64_t value) {
+    char number[24];
+    snprintf(number, sizeof(number), "%" PRId64, value);
+    Key(key);
+    out_ += number;
+}
+
+void JsonWriter::Number(const char* key, double value) {
+    // The precision cJSON prints the same values with
+    char number[32];
+    snprintf(number, sizeof(number), "%.15g", value);
+    Key(key);
+    out_ += number;
+}
+
+void JsonWriter::Bool(const char* key, bool value) {
+    Key(key);
+    out_ += value ? "true" : "false";
+}
+
+void JsonWriter::Raw(const char* key, std::string_view json) {
+    Key(key);
+    out_ += json;
+}
+
+void JsonWriter::Json(const char* key, cJSON* item) {
+    if (item == nullptr) {
+        return;
+    }
+    auto json = cJSON_PrintUnformatted(item);
+    if (json != nullptr) {
+        Raw(key, json);
+        cJSON_free(json);
+    }
+    cJSON_Delete(item);
+}
+
+void JsonWriter::Fragment(std::string_view json) {
+    if (json.empty()) {
+        return;
+    }
+    Separator();
+    out_ += json;
+}
+
+JsonCache::Key& JsonCache::Key::Add(int64_t value) {
+    for (int i = 0; i < 8; i++) {
+        hash_ = (hash_ ^ ((uint64_t)value >> (i * 8) & 0xff)) * 16777619u;
+    }
+    return *this;
+}
+
+JsonCache::Key& JsonCache::Key::Add(std::string_view value) {
+    for (char c : value) {
+        hash_ = (hash_ ^ (uint8_t)c) * 16777619u;
+    }
+    // The length separates consecutive strings ("ab", "c" from "a", "bc")
+    return Add((int64_t)value.size());
+}
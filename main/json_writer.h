@@ -0,0 +1,95 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <cJSON.h>
+#include <string>
+#include <string_view>
+#include <mutex>
+#include <cstdint>
+
+/*
+ * Appends JSON to a caller owned string, so a document is built in one buffer instead of by
+ * concatenating temporaries.
+ *
+ * The separators follow from the last character written, so a writer can resume any partly
+ * written buffer, and a cached fragment of members can be spliced in with Fragment().
+ * Strings written with String() are escaped, keys and Raw() values are trusted.
+ */
+class JsonWriter {
+public:
+    explicit JsonWriter(std::string& out) : out_(out) {}
+
+    void Object() { Separator(); out_.push_back('{'); }
+    void Object(const char* key) { Key(key); out_.push_back('{'); }
+    void EndObject() { out_.push_back('}'); }
+    void Array(const char* key) { Key(key); out_.push_back('['); }
+    void EndArray() { out_.push_back(']'); }
+
+    void Key(const char* key);
+    void String(const char* key, std::string_view value);
+    void Int(const char* key, int64_t value);
+    void Number(const char* key, double value);
+    void Bool(const char* key, bool value);
+    // An already serialized value
+    void Raw(const char* key, std::string_view json);
+    // Prints the item unformatted and deletes it, for the parts still built as cJSON trees
+    void Json(const char* key, cJSON* item);
+    // Members (or array items) serialized elsewhere, joined with a comma when needed
+    void Fragment(std::string_view json);
+
+    std::string& buffer() { return out_; }
+
+private:
+    std::string& out_;
+
+    void Separator();
+    void Escaped(std::string_view value);
+};
+
+/*
+ * A JSON fragment rebuilt only when the inputs it was built from change.
+ *
+ * The caller folds the inputs that matter into a Key, values it wants in buckets (RSSI, CSQ)
+ * are bucketed before they are added. Write() rebuilds the fragment when the key differs from
+ * the cached one and splices it into the writer, under a lock so any task can call it.
+ */
+class JsonCache {
+public:
+    // FNV-1a over the inputs, 0 is only the key of an empty cache
+    class Key {
+    public:
+        Key& Add(int64_t value);
+        Key& Add(std::string_view value);
+        uint32_t value() const { return hash_ == 0 ? 1 : hash_; }
+
+    private:
+        uint32_t hash_ = 2166136261u;
+    };
+
+    template <typename Build>
+    void Write(JsonWriter& writer, const Key& key, Build&& build) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (key.value() != key_) {
+            json_.clear();
+            JsonWriter fragment(json_);
+            build(fragment);
+            key_ = key.value();
+            rebuilds_++;
+        }
+        writer.Fragment(json_);
+    }
+
+    void Invalidate() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        key_ = 0;
+    }
+    uint32_t rebuilds() const { return rebuilds_; }
+
+private:
+    std::mutex mutex_;
+    std::string json_;
+    uint32_t key_ = 0;
+    uint32_t rebuilds_ = 0;
+};
+
+#endif // JSON_WRITER_H
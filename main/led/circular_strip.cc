@@ -1,16 +1,25 @@
 #include "circular_strip.h"
 #include "application.h"
 #include <esp_log.h>
+#include <soc/soc_caps.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 
 #define TAG "CircularStrip"
 
-#define BLINK_INFINITE -1
+#define PULSE_INTERVAL_MS 30
+// The RMS levels mapped to the low and the high color
+#define PULSE_FLOOR_DB (-48.0f)
+#define PULSE_CEILING_DB (-12.0f)
+#define PULSE_RELEASE_STEP 12
 
 CircularStrip::CircularStrip(gpio_num_t gpio, uint8_t max_leds) : max_leds_(max_leds) {
     // If the gpio is not connected, you should use NoLed class
     assert(gpio != GPIO_NUM_NC);
 
     colors_.resize(max_leds_);
+    pushed_.resize(max_leds_);
 
     led_strip_config_t strip_config = {};
     strip_config.strip_gpio_num = gpio;
@@ -20,70 +29,76 @@ CircularStrip::CircularStrip(gpio_num_t gpio, uint8_t max_leds) : max_leds_(max_
 
     led_strip_rmt_config_t rmt_config = {};
     rmt_config.resolution_hz = 10 * 1000 * 1000; // 10MHz
+#if SOC_RMT_SUPPORT_DMA
+    // 一帧超过 RMT 通道内存时，不用 DMA 每几个 LED 就要进一次 RMT 中断填充数据
+    rmt_config.flags.with_dma = max_leds_ * 24 > SOC_RMT_MEM_WORDS_PER_CHANNEL;
+#endif
 
-    ESP_ERROR_CHECK(led_strip_new_rmt_device(&strip_config, &rmt_config, &led_strip_));
+    esp_err_t err = led_strip_new_rmt_device(&strip_config, &rmt_config, &led_strip_);
+    if (err != ESP_OK && rmt_config.flags.with_dma) {
+        ESP_LOGW(TAG, "No DMA channel for the strip, using the RMT memory");
+        rmt_config.flags.with_dma = false;
+        err = led_strip_new_rmt_device(&strip_config, &rmt_config, &led_strip_);
+    }
+    ESP_ERROR_CHECK(err);
     led_strip_clear(led_strip_);
-
-    esp_timer_create_args_t strip_timer_args = {
-        .callback = [](void *arg) {
-            auto strip = static_cast<CircularStrip*>(arg);
-            std::lock_guard<std::mutex> lock(strip->mutex_);
-            if (strip->strip_callback_ != nullptr) {
-                strip->strip_callback_();
-            }
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "strip_timer",
-        .skip_unhandled_events = false,
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&strip_timer_args, &strip_timer_));
 }
 
 CircularStrip::~CircularStrip() {
-    esp_timer_stop(strip_timer_);
+    StopStripTask();
     if (led_strip_ != nullptr) {
         led_strip_del(led_strip_);
     }
 }
 
+// Sends the composed frame in one refresh, nothing when the strip already shows it
+void CircularStrip::PushFrame() {
+    bool changed = false;
+    for (int i = 0; i < max_leds_; i++) {
+        auto& color = colors_[i];
+        auto& pushed = pushed_[i];
+        if (color.red != pushed.red || color.green != pushed.green || color.blue != pushed.blue) {
+            changed = true;
+            break;
+        }
+    }
+    if (!changed) {
+        return;
+    }
+    for (int i = 0; i < max_leds_; i++) {
+        led_strip_set_pixel(led_strip_, i, colors_[i].red, colors_[i].green, colors_[i].blue);
+    }
+    led_strip_refresh(led_strip_);
+    pushed_ = colors_;
+}
 
 void CircularStrip::SetAllColor(StripColor color) {
+    StopStripTask();
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(strip_timer_);
     for (int i = 0; i < max_leds_; i++) {
         colors_[i] = color;
-        led_strip_set_pixel(led_strip_, i, color.red, color.green, color.blue);
     }
-    led_strip_refresh(led_strip_);
+    PushFrame();
 }
 
 void CircularStrip::SetSingleColor(uint8_t index, StripColor color) {
+    StopStripTask();
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(strip_timer_);
     colors_[index] = color;
-    led_strip_set_pixel(led_strip_, index, color.red, color.green, color.blue);
-    led_strip_refresh(led_strip_);
+    PushFrame();
 }
 
 void CircularStrip::Blink(StripColor color, int interval_ms) {
-    for (int i = 0; i < max_leds_; i++) {
-        colors_[i] = color;
-    }
-    StartStripTask(interval_ms, [this]() {
-        static bool on = true;
-        if (on) {
-            for (int i = 0; i < max_leds_; i++) {
-                led_strip_set_pixel(led_strip_, i, colors_[i].red, colors_[i].green, colors_[i].blue);
-            }
-            led_strip_refresh(led_strip_);
-        } else {
-            led_strip_clear(led_strip_);
+    StartStripTask(interval_ms, [this, color]() {
+        bool on = (tick_ & 1) == 0;
+        for (int i = 0; i < max_leds_; i++) {
+            colors_[i] = on ? color : StripColor{};
         }
-        on = !on;
+        return true;
     });
 }
 
+// Halves the frame on the strip until it is dark
 void CircularStrip::FadeOut(int interval_ms) {
     StartStripTask(interval_ms, [this]() {
         bool all_off = true;
@@ -94,61 +109,34 @@ void CircularStrip::FadeOut(int interval_ms) {
             if (colors_[i].red != 0 || colors_[i].green != 0 || colors_[i].blue != 0) {
                 all_off = false;
             }
-            led_strip_set_pixel(led_strip_, i, colors_[i].red, colors_[i].green, colors_[i].blue);
-        }
-        if (all_off) {
-            led_strip_clear(led_strip_);
-            esp_timer_stop(strip_timer_);
-        } else {
-            led_strip_refresh(led_strip_);
         }
+        return !all_off;
     });
 }
 
+// As many frames from low to high as the widest channel steps, eased and gamma corrected
 void CircularStrip::Breathe(StripColor low, StripColor high, int interval_ms) {
-    StartStripTask(interval_ms, [this, low, high]() {
-        static bool increase = true;
-        static StripColor color = low;
-        if (increase) {
-            if (color.red < high.red) {
-                color.red++;
-            }
-            if (color.green < high.green) {
-                color.green++;
-            }
-            if (color.blue < high.blue) {
-                color.blue++;
-            }
-            if (color.red == high.red && color.green == high.green && color.blue == high.blue) {
-                increase = false;
-            }
-        } else {
-            if (color.red > low.red) {
-                color.red--;
-            }
-            if (color.green > low.green) {
-                color.green--;
-            }
-            if (color.blue > low.blue) {
-                color.blue--;
-            }
-            if (color.red == low.red && color.green == low.green && color.blue == low.blue) {
-                increase = true;
-            }
-        }
+    int span = std::max({ std::abs(high.red - low.red), std::abs(high.green - low.green),
+        std::abs(high.blue - low.blue), 1 });
+    StartStripTask(interval_ms, [this, low, high, span]() {
+        int pos = tick_ % (span * 2);
+        int rise = pos <= span ? pos : span * 2 - pos;
+        uint8_t amount = LedAnimator::Gamma(LedAnimator::Ease(rise * 255 / span));
+        StripColor color = {
+            LedAnimator::Mix(low.red, high.red, amount),
+            LedAnimator::Mix(low.green, high.green, amount),
+            LedAnimator::Mix(low.blue, high.blue, amount),
+        };
         for (int i = 0; i < max_leds_; i++) {
-            led_strip_set_pixel(led_strip_, i, color.red, color.green, color.blue);
+            colors_[i] = color;
         }
-        led_strip_refresh(led_strip_);
+        return true;
     });
 }
 
 void CircularStrip::Scroll(StripColor low, StripColor high, int length, int interval_ms) {
-    for (int i = 0; i < max_leds_; i++) {
-        colors_[i] = low;
-    }
     StartStripTask(interval_ms, [this, low, high, length]() {
-        static int offset = 0;
+        int offset = tick_ % max_leds_;
         for (int i = 0; i < max_leds_; i++) {
             colors_[i] = low;
         }
@@ -156,24 +144,80 @@ void CircularStrip::Scroll(StripColor low, StripColor high, int length, int inte
             int i = (offset + j) % max_leds_;
             colors_[i] = high;
         }
+        return true;
+    });
+}
+
+void CircularStrip::Pulse(StripColor low, StripColor high, bool microphone) {
+    StartStripTask(PULSE_INTERVAL_MS, [this, low, high, microphone]() {
+        auto& audio_service = Application::GetInstance().GetAudioService();
+        auto level = microphone ? audio_service.GetInputLevel() : audio_service.GetOutputLevel();
+        int target = 0;
+        if (level.rms > 0) {
+            float db = 20.0f * log10f(level.rms / 32767.0f);
+            target = std::clamp((int)((db - PULSE_FLOOR_DB) * 255.0f / (PULSE_CEILING_DB - PULSE_FLOOR_DB)), 0, 255);
+        }
+        // Quick to rise, slow to fall, so the ring does not flicker between syllables
+        if (target > pulse_amount_) {
+            pulse_amount_ += (target - pulse_amount_ + 1) / 2;
+        } else {
+            pulse_amount_ = std::max(target, pulse_amount_ - PULSE_RELEASE_STEP);
+        }
+        uint8_t amount = LedAnimator::Gamma(pulse_amount_);
+        StripColor color = {
+            LedAnimator::Mix(low.red, high.red, amount),
+            LedAnimator::Mix(low.green, high.green, amount),
+            LedAnimator::Mix(low.blue, high.blue, amount),
+        };
         for (int i = 0; i < max_leds_; i++) {
-            led_strip_set_pixel(led_strip_, i, colors_[i].red, colors_[i].green, colors_[i].blue);
+            colors_[i] = color;
         }
-        led_strip_refresh(led_strip_);
-        offset = (offset + 1) % max_leds_;
-    });
+        return true;
+    }, true);
+}
+
+bool CircularStrip::OnAnimationTick() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (strip_callback_ == nullptr) {
+        return false;
+    }
+    bool running = strip_callback_();
+    PushFrame();
+    tick_++;
+    if (!running) {
+        strip_callback_ = nullptr;
+    }
+    return running;
 }
 
-void CircularStrip::StartStripTask(int interval_ms, std::function<void()> cb) {
+// The animator calls back with its lock held, so it is never called with mutex_ held
+void CircularStrip::StartStripTask(int interval_ms, std::function<bool()> cb, bool level_meter) {
     if (led_strip_ == nullptr) {
         return;
     }
 
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        strip_callback_ = cb;
+        tick_ = 0;
+        pulse_amount_ = 0;
+        UseLevelMeter(level_meter);
+    }
+    LedAnimator::GetInstance().Start(this, interval_ms);
+}
+
+void CircularStrip::StopStripTask() {
+    LedAnimator::GetInstance().Stop(this);
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(strip_timer_);
-    
-    strip_callback_ = cb;
-    esp_timer_start_periodic(strip_timer_, interval_ms * 1000);
+    strip_callback_ = nullptr;
+    UseLevelMeter(false);
+}
+
+void CircularStrip::UseLevelMeter(bool use) {
+    if (use != level_meter_) {
+        level_meter_ = use;
+        Application::GetInstance().GetAudioService().EnableLevelMeters(use);
+    }
 }
 
 void CircularStrip::SetBrightness(uint8_t default_brightness, uint8_t low_brightness) {
@@ -208,12 +252,20 @@ void CircularStrip::OnStateChanged() {
         case kDeviceStateListening:
         case kDeviceStateAudioTesting: {
             StripColor color = { default_brightness_, low_brightness_, low_brightness_ };
+#if CONFIG_LED_STRIP_AUDIO_REACTIVE
+            Pulse({ low_brightness_, 0, 0 }, color, true);
+#else
             SetAllColor(color);
+#endif
             break;
         }
         case kDeviceStateSpeaking: {
             StripColor color = { low_brightness_, default_brightness_, low_brightness_ };
+#if CONFIG_LED_STRIP_AUDIO_REACTIVE
+            Pulse({ 0, low_brightness_, 0 }, color, false);
+#else
             SetAllColor(color);
+#endif
             break;
         }
         case kDeviceStateUpgrading: {
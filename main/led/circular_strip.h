@@ -2,10 +2,11 @@
 #define _CIRCULAR_STRIP_H_
 
 #include "led.h"
+#include "led_animator.h"
 #include <driver/gpio.h>
 #include <led_strip.h>
-#include <esp_timer.h>
 #include <atomic>
+#include <functional>
 #include <mutex>
 #include <vector>
 
@@ -16,7 +17,7 @@ struct StripColor {
     uint8_t red = 0, green = 0, blue = 0;
 };
 
-class CircularStrip : public Led {
+class CircularStrip : public Led, public LedAnimation {
 public:
     CircularStrip(gpio_num_t gpio, uint8_t max_leds);
     virtual ~CircularStrip();
@@ -28,22 +29,30 @@ public:
     void Blink(StripColor color, int interval_ms);
     void Breathe(StripColor low, StripColor high, int interval_ms);
     void Scroll(StripColor low, StripColor high, int length, int interval_ms);
+    // Follows the loudness of the speaker, or of the microphone, between low and high
+    void Pulse(StripColor low, StripColor high, bool microphone);
+
+    bool OnAnimationTick() override;
 
 private:
     std::mutex mutex_;
     TaskHandle_t blink_task_ = nullptr;
     led_strip_handle_t led_strip_ = nullptr;
     int max_leds_ = 0;
-    std::vector<StripColor> colors_;
-    int blink_counter_ = 0;
-    int blink_interval_ms_ = 0;
-    esp_timer_handle_t strip_timer_ = nullptr;
-    std::function<void()> strip_callback_ = nullptr;
+    std::vector<StripColor> colors_;    // The frame being composed
+    std::vector<StripColor> pushed_;    // The frame on the strip
+    int tick_ = 0;                      // Frames since the effect started
+    int pulse_amount_ = 0;
+    bool level_meter_ = false;          // Holds the audio level meters enabled
+    std::function<bool()> strip_callback_ = nullptr;
 
     uint8_t default_brightness_ = DEFAULT_BRIGHTNESS;
     uint8_t low_brightness_ = LOW_BRIGHTNESS;
 
-    void StartStripTask(int interval_ms, std::function<void()> cb);
+    void StartStripTask(int interval_ms, std::function<bool()> cb, bool level_meter = false);
+    void StopStripTask();
+    void UseLevelMeter(bool use);
+    void PushFrame();
     void Rainbow(StripColor low, StripColor high, int interval_ms);
     void FadeOut(int interval_ms);
 };
@@ -2,6 +2,7 @@
 #include "application.h"
 #include "device_state.h"
 #include <esp_log.h>
+#include <soc/soc_caps.h>
 
 #define TAG "GpioLed"
 
@@ -23,8 +24,26 @@
 
 #define LEDC_DUTY              (8191)
 #define LEDC_FADE_TIME    (1000)
+#define LEDC_FADE_INTERVAL (20)
 // GPIO_LED
 
+// A fade in flight must be stopped before the duty is set, the chips without it keep the software steps
+#if CONFIG_GPIO_LED_HARDWARE_FADE && SOC_LEDC_SUPPORT_FADE_STOP
+#define GPIO_LED_HARDWARE_FADE 1
+// The breath is this many linear hardware fades each way along the eased gamma curve, the
+// animator only wakes up between two of them instead of every LEDC_FADE_INTERVAL
+#define LEDC_FADE_SEGMENTS 8
+#else
+#define GPIO_LED_HARDWARE_FADE 0
+#endif
+
+// The duty of step of a breath of steps * 2, off at 0 and full at steps
+static uint32_t BreathDuty(int step, int steps) {
+    int rise = step <= steps ? step : steps * 2 - step;
+    uint16_t level = LedAnimator::Gamma16(LedAnimator::Ease(rise * 255 / steps));
+    return (uint32_t)level * LEDC_DUTY / 65535;
+}
+
 GpioLed::GpioLed(gpio_num_t gpio)
         : GpioLed(gpio, 0, LEDC_LS_TIMER, LEDC_LS_CH0_CHANNEL) {
 }
@@ -48,7 +67,19 @@ GpioLed::GpioLed(gpio_num_t gpio, int output_invert, ledc_timer_t timer_num, led
     ledc_timer.timer_num = timer_num;               // timer index
     ledc_timer.clk_cfg = LEDC_AUTO_CLK;              // Auto select the source clock
 
+#if CONFIG_GPIO_LED_SLEEP_CLOCK
+    // RC_FAST keeps running in light sleep, at about 17.5 MHz it reaches 2 kHz at 13 bits
+    ledc_timer.freq_hz = 1000;
+    ledc_timer.clk_cfg = LEDC_USE_RC_FAST_CLK;
+    if (ledc_timer_config(&ledc_timer) != ESP_OK) {
+        ESP_LOGW(TAG, "No RC_FAST clock for the LED, it stops in light sleep");
+        ledc_timer.freq_hz = 4000;
+        ledc_timer.clk_cfg = LEDC_AUTO_CLK;
+        ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer));
+    }
+#else
     ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer));
+#endif
 
     ledc_channel_.channel    = channel,
     ledc_channel_.duty       = 0,
@@ -61,39 +92,33 @@ GpioLed::GpioLed(gpio_num_t gpio, int output_invert, ledc_timer_t timer_num, led
     // Set LED Controller with previously prepared configuration
     ledc_channel_config(&ledc_channel_);
 
-    // Initialize fade service.
-    ledc_fade_func_install(0);
-
-    // When the callback registered by ledc_cb_degister is called, run led ->OnFadeEnd()
-    ledc_cbs_t ledc_callbacks = {
-        .fade_cb = FadeCallback
-    };
-    ledc_cb_register(ledc_channel_.speed_mode, ledc_channel_.channel, &ledc_callbacks, this);
-
-    esp_timer_create_args_t blink_timer_args = {
-        .callback = [](void *arg) {
-            auto led = static_cast<GpioLed*>(arg);
-            led->OnBlinkTimer();
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "Blink Timer",
-        .skip_unhandled_events = false,
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&blink_timer_args, &blink_timer_));
+#if GPIO_LED_HARDWARE_FADE
+    // One fade service for all the channels, another LED may have installed it
+    static bool fade_installed = false;
+    if (!fade_installed) {
+        esp_err_t err = ledc_fade_func_install(0);
+        fade_installed = err == ESP_OK || err == ESP_ERR_INVALID_STATE;
+        if (!fade_installed) {
+            ESP_LOGW(TAG, "No LEDC fade service: %s", esp_err_to_name(err));
+        }
+    }
+    hardware_fade_ = fade_installed;
+#endif
 
     ledc_initialized_ = true;
 }
 
 GpioLed::~GpioLed() {
-    esp_timer_stop(blink_timer_);
-    if (ledc_initialized_) {
-        ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
-        ledc_fade_func_uninstall();
-    }
+    LedAnimator::GetInstance().Stop(this);
 }
 
 
+void GpioLed::SetPowerSaving(bool saving) {
+    if (power_saving_.exchange(saving) != saving) {
+        OnStateChanged();
+    }
+}
+
 void GpioLed::SetBrightness(uint8_t brightness) {
     if (brightness == 100) {
         duty_ = LEDC_DUTY;
@@ -107,11 +132,9 @@ void GpioLed::TurnOn() {
         return;
     }
 
+    LedAnimator::GetInstance().Stop(this);
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
-    ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
-    ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, duty_);
-    ledc_update_duty(ledc_channel_.speed_mode, ledc_channel_.channel);
+    SetDuty(duty_);
 }
 
 void GpioLed::TurnOff() {
@@ -119,11 +142,9 @@ void GpioLed::TurnOff() {
         return;
     }
 
+    LedAnimator::GetInstance().Stop(this);
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
-    ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
-    ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, 0);
-    ledc_update_duty(ledc_channel_.speed_mode, ledc_channel_.channel);
+    SetDuty(0);
 }
 
 void GpioLed::BlinkOnce() {
@@ -143,60 +164,82 @@ void GpioLed::StartBlinkTask(int times, int interval_ms) {
         return;
     }
 
-    std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
-    ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
-
-    blink_counter_ = times * 2;
-    blink_interval_ms_ = interval_ms;
-    esp_timer_start_periodic(blink_timer_, interval_ms * 1000);
-}
-
-void GpioLed::OnBlinkTimer() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    blink_counter_--;
-    if (blink_counter_ & 1) {
-        ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, duty_);
-    } else {
-        ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, 0);
-
-        if (blink_counter_ == 0) {
-            esp_timer_stop(blink_timer_);
-        }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fading_ = false;
+        blink_counter_ = times * 2;
+        blink_interval_ms_ = interval_ms;
     }
-    ledc_update_duty(ledc_channel_.speed_mode, ledc_channel_.channel);
+    // The animator ticks with its lock held, so it is not called with mutex_ held
+    LedAnimator::GetInstance().Start(this, interval_ms);
 }
 
+// Breathes between off and full duty, LEDC_FADE_TIME each way
 void GpioLed::StartFadeTask() {
     if (!ledc_initialized_) {
         return;
     }
 
-    std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fading_ = true;
+        fade_tick_ = 0;
+#if GPIO_LED_HARDWARE_FADE
+        if (hardware_fade_) {
+            // The first segment starts from off now, the animator starts the next ones
+            SetDuty(0);
+            StartFadeSegment();
+        }
+#endif
+    }
+#if GPIO_LED_HARDWARE_FADE
+    if (hardware_fade_) {
+        LedAnimator::GetInstance().Start(this, LEDC_FADE_TIME / LEDC_FADE_SEGMENTS);
+        return;
+    }
+#endif
+    LedAnimator::GetInstance().Start(this, LEDC_FADE_INTERVAL);
+}
+
+// From the duty of fade_tick_ to the next one, mutex_ held
+void GpioLed::StartFadeSegment() {
+#if GPIO_LED_HARDWARE_FADE
     ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
-    fade_up_ = true;
-    ledc_set_fade_with_time(ledc_channel_.speed_mode,
-                            ledc_channel_.channel, LEDC_DUTY, LEDC_FADE_TIME);
-    ledc_fade_start(ledc_channel_.speed_mode,
-                    ledc_channel_.channel, LEDC_FADE_NO_WAIT);
+    ledc_set_fade_time_and_start(ledc_channel_.speed_mode, ledc_channel_.channel,
+        BreathDuty(fade_tick_ + 1, LEDC_FADE_SEGMENTS), LEDC_FADE_TIME / LEDC_FADE_SEGMENTS, LEDC_FADE_NO_WAIT);
+#endif
 }
 
-void GpioLed::OnFadeEnd() {
+bool GpioLed::OnAnimationTick() {
     std::lock_guard<std::mutex> lock(mutex_);
-    fade_up_ = !fade_up_;
-    ledc_set_fade_with_time(ledc_channel_.speed_mode,
-                            ledc_channel_.channel, fade_up_ ? LEDC_DUTY : 0, LEDC_FADE_TIME);
-    ledc_fade_start(ledc_channel_.speed_mode,
-                    ledc_channel_.channel, LEDC_FADE_NO_WAIT);
+    if (fading_) {
+#if GPIO_LED_HARDWARE_FADE
+        if (hardware_fade_) {
+            fade_tick_ = (fade_tick_ + 1) % (LEDC_FADE_SEGMENTS * 2);
+            StartFadeSegment();
+            return true;
+        }
+#endif
+        const int steps = LEDC_FADE_TIME / LEDC_FADE_INTERVAL;
+        fade_tick_ = (fade_tick_ + 1) % (steps * 2);
+        SetDuty(BreathDuty(fade_tick_, steps));
+        return true;
+    }
+
+    blink_counter_--;
+    SetDuty((blink_counter_ & 1) ? duty_ : 0);
+    return blink_counter_ != 0;
 }
 
-bool IRAM_ATTR GpioLed::FadeCallback(const ledc_cb_param_t *param, void *user_arg) {
-    if (param->event == LEDC_FADE_END_EVT) {
-        auto led = static_cast<GpioLed*>(user_arg);
-        led->OnFadeEnd();
+void GpioLed::SetDuty(uint32_t duty) {
+#if GPIO_LED_HARDWARE_FADE
+    if (hardware_fade_) {
+        // Otherwise the fade in flight goes on from the new duty
+        ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
     }
-    return true;
+#endif
+    ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, duty);
+    ledc_update_duty(ledc_channel_.speed_mode, ledc_channel_.channel);
 }
 
 void GpioLed::OnStateChanged() {
@@ -212,9 +255,12 @@ void GpioLed::OnStateChanged() {
             StartContinuousBlink(500);
             break;
         case kDeviceStateIdle:
-            SetBrightness(IDLE_BRIGHTNESS);
-            TurnOn();
-            // TurnOff();
+            if (power_saving_) {
+                TurnOff();
+            } else {
+                SetBrightness(IDLE_BRIGHTNESS);
+                TurnOn();
+            }
             break;
         case kDeviceStateConnecting:
             SetBrightness(DEFAULT_BRIGHTNESS);
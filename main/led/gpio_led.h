@@ -4,13 +4,13 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include "led.h"
+#include "led_animator.h"
 #include <driver/gpio.h>
 #include <driver/ledc.h>
-#include <esp_timer.h>
 #include <atomic>
 #include <mutex>
 
-class GpioLed : public Led {
+class GpioLed : public Led, public LedAnimation {
  public:
     GpioLed(gpio_num_t gpio);
     GpioLed(gpio_num_t gpio, int output_invert);
@@ -21,27 +21,31 @@ class GpioLed : public Led {
     void TurnOn();
     void TurnOff();
     void SetBrightness(uint8_t brightness);
+    void SetPowerSaving(bool saving) override;
+    bool OnAnimationTick() override;
 
  private:
     std::mutex mutex_;
     TaskHandle_t blink_task_ = nullptr;
     ledc_channel_config_t ledc_channel_ = {0};
     bool ledc_initialized_ = false;
+    // The breathing runs as LEDC hardware fades, see CONFIG_GPIO_LED_HARDWARE_FADE
+    bool hardware_fade_ = false;
     uint32_t duty_ = 0;
     int blink_counter_ = 0;
     int blink_interval_ms_ = 0;
-    esp_timer_handle_t blink_timer_ = nullptr;
-    bool fade_up_ = true;
+    bool fading_ = false;
+    int fade_tick_ = 0;
+    std::atomic<bool> power_saving_ = false;
 
     void StartBlinkTask(int times, int interval_ms);
-    void OnBlinkTimer();
+    void SetDuty(uint32_t duty);
+    void StartFadeSegment();
 
     void BlinkOnce();
     void Blink(int times, int interval_ms);
     void StartContinuousBlink(int interval_ms);
     void StartFadeTask();
-    void OnFadeEnd();
-    static bool IRAM_ATTR FadeCallback(const ledc_cb_param_t *param, void *user_arg);
 };
 
 #endif  // _GPIO_LED_H_
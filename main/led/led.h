@@ -6,6 +6,8 @@ public:
     virtual ~Led() = default;
     // Set the led state based on the device state
     virtual void OnStateChanged() = 0;
+    // The saver performance profile, the led stays off where it only shows the idle state
+    virtual void SetPowerSaving(bool saving) {}
 };
 
 
@@ -0,0 +1,114 @@
+#include "led_animator.h"
+
+#include <esp_log.h>
+#include "audio_pressure.h"
+#include <algorithm>
+#include <cmath>
+
+#define TAG "LedAnimator"
+
+#define LED_GAMMA 2.2f
+
+uint16_t LedAnimator::gamma_[256];
+uint8_t LedAnimator::ease_[256];
+// Filled before app_main, so the lookups are valid before the animator exists
+const bool LedAnimator::tables_ready_ = LedAnimator::BuildTables();
+
+bool LedAnimator::BuildTables() {
+    for (int i = 0; i < 256; i++) {
+        float x = i / 255.0f;
+        gamma_[i] = (uint16_t)lroundf(powf(x, LED_GAMMA) * 65535.0f);
+        ease_[i] = (uint8_t)lroundf((1.0f - cosf(x * (float)M_PI)) * 0.5f * 255.0f);
+    }
+    return true;
+}
+
+LedAnimator::LedAnimator() {
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void *arg) {
+            static_cast<LedAnimator*>(arg)->OnTimer();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "led_animator",
+        .skip_unhandled_events = false,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer_));
+}
+
+LedAnimator::~LedAnimator() {
+    esp_timer_stop(timer_);
+    esp_timer_delete(timer_);
+}
+
+void LedAnimator::Start(LedAnimation* animation, int interval_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t interval_us = std::max(interval_ms, 1) * 1000LL;
+    int64_t due_us = esp_timer_get_time() + interval_us;
+    auto it = std::find_if(entries_.begin(), entries_.end(), [animation](const Entry& entry) {
+        return entry.animation == animation;
+    });
+    if (it != entries_.end()) {
+        it->interval_us = interval_us;
+        it->due_us = due_us;
+    } else {
+        entries_.push_back({animation, interval_us, due_us});
+    }
+    ScheduleLocked();
+}
+
+void LedAnimator::Stop(LedAnimation* animation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find_if(entries_.begin(), entries_.end(), [animation](const Entry& entry) {
+        return entry.animation == animation;
+    });
+    if (it == entries_.end()) {
+        return;
+    }
+    entries_.erase(it);
+    ScheduleLocked();
+}
+
+void LedAnimator::OnTimer() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    // The timer task runs above the audio tasks, the frames are skipped while the audio pipeline
+    // is at risk and the LEDs hold what they show
+    bool skip = AudioPressure::GetInstance().IsActive();
+    for (size_t i = 0; i < entries_.size();) {
+        auto& entry = entries_[i];
+        if (entry.due_us > now) {
+            i++;
+            continue;
+        }
+        if (skip) {
+            entry.due_us = now + entry.interval_us;
+            i++;
+            continue;
+        }
+        if (!entry.animation->OnAnimationTick()) {
+            entries_.erase(entries_.begin() + i);
+            continue;
+        }
+        // Keep the cadence, but don't catch up on the frames missed by a busy timer task
+        entry.due_us += entry.interval_us;
+        if (entry.due_us <= now) {
+            entry.due_us = now + entry.interval_us;
+        }
+        i++;
+    }
+    ScheduleLocked();
+}
+
+void LedAnimator::ScheduleLocked() {
+    esp_timer_stop(timer_);
+    if (entries_.empty()) {
+        return;
+    }
+    int64_t due_us = entries_[0].due_us;
+    for (auto& entry : entries_) {
+        due_us = std::min(due_us, entry.due_us);
+    }
+    int64_t delay_us = std::max<int64_t>(due_us - esp_timer_get_time(), 0);
+    esp_timer_start_once(timer_, delay_us);
+}
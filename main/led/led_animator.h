@@ -0,0 +1,71 @@
+#ifndef _LED_ANIMATOR_H_
+#define _LED_ANIMATOR_H_
+
+#include <esp_timer.h>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// An LED effect driven by the animator
+class LedAnimation {
+public:
+    virtual ~LedAnimation() = default;
+    // Renders the next frame, false ends the animation
+    virtual bool OnAnimationTick() = 0;
+};
+
+/*
+ * The one animation clock of all the LEDs.
+ *
+ * A single one-shot esp_timer is armed for the earliest due animation, so the timer task
+ * wakes up only when a frame is due and never while no LED animates. The ticks run with
+ * the animator locked: once Stop() returns, the animation is not running and won't run.
+ * An animation must not call Start() or Stop() from its tick, it returns false instead.
+ */
+class LedAnimator {
+public:
+    static LedAnimator& GetInstance() {
+        static LedAnimator instance;
+        return instance;
+    }
+
+    // Restarts the animation, the first tick comes after interval_ms
+    void Start(LedAnimation* animation, int interval_ms);
+    void Stop(LedAnimation* animation);
+
+    // Gamma 2.2 correction of a 0-255 level, to 16 bits for the PWM of the GPIO LEDs
+    static uint16_t Gamma16(uint8_t level) { return gamma_[level]; }
+    static uint8_t Gamma(uint8_t level) { return gamma_[level] >> 8; }
+    // Sine ease-in-out of a 0-255 phase
+    static uint8_t Ease(uint8_t phase) { return ease_[phase]; }
+    // low + (high - low) * amount / 255
+    static uint8_t Mix(uint8_t low, uint8_t high, uint8_t amount) {
+        return low + (((int)high - (int)low) * amount + 127) / 255;
+    }
+
+private:
+    struct Entry {
+        LedAnimation* animation;
+        int64_t interval_us;
+        int64_t due_us;
+    };
+
+    static uint16_t gamma_[256];
+    static uint8_t ease_[256];
+    static const bool tables_ready_;
+
+    std::mutex mutex_;
+    std::vector<Entry> entries_;
+    esp_timer_handle_t timer_ = nullptr;
+
+    LedAnimator();
+    ~LedAnimator();
+    LedAnimator(const LedAnimator&) = delete;
+    LedAnimator& operator=(const LedAnimator&) = delete;
+
+    static bool BuildTables();
+    void OnTimer();
+    void ScheduleLocked();
+};
+
+#endif // _LED_ANIMATOR_H_
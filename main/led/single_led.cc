@@ -26,22 +26,10 @@ SingleLed::SingleLed(gpio_num_t gpio) {
 
     ESP_ERROR_CHECK(led_strip_new_rmt_device(&strip_config, &rmt_config, &led_strip_));
     led_strip_clear(led_strip_);
-
-    esp_timer_create_args_t blink_timer_args = {
-        .callback = [](void *arg) {
-            auto led = static_cast<SingleLed*>(arg);
-            led->OnBlinkTimer();
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "blink_timer",
-        .skip_unhandled_events = false,
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&blink_timer_args, &blink_timer_));
 }
 
 SingleLed::~SingleLed() {
-    esp_timer_stop(blink_timer_);
+    LedAnimator::GetInstance().Stop(this);
     if (led_strip_ != nullptr) {
         led_strip_del(led_strip_);
     }
@@ -58,9 +46,9 @@ void SingleLed::TurnOn() {
     if (led_strip_ == nullptr) {
         return;
     }
-    
+
+    LedAnimator::GetInstance().Stop(this);
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
     led_strip_set_pixel(led_strip_, 0, r_, g_, b_);
     led_strip_refresh(led_strip_);
 }
@@ -70,8 +58,8 @@ void SingleLed::TurnOff() {
         return;
     }
 
+    LedAnimator::GetInstance().Stop(this);
     std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
     led_strip_clear(led_strip_);
 }
 
@@ -92,15 +80,16 @@ void SingleLed::StartBlinkTask(int times, int interval_ms) {
         return;
     }
 
-    std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
-    
-    blink_counter_ = times * 2;
-    blink_interval_ms_ = interval_ms;
-    esp_timer_start_periodic(blink_timer_, interval_ms * 1000);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        blink_counter_ = times * 2;
+        blink_interval_ms_ = interval_ms;
+    }
+    // The animator ticks with its lock held, so it is not called with mutex_ held
+    LedAnimator::GetInstance().Start(this, interval_ms);
 }
 
-void SingleLed::OnBlinkTimer() {
+bool SingleLed::OnAnimationTick() {
     std::lock_guard<std::mutex> lock(mutex_);
     blink_counter_--;
     if (blink_counter_ & 1) {
@@ -108,11 +97,8 @@ void SingleLed::OnBlinkTimer() {
         led_strip_refresh(led_strip_);
     } else {
         led_strip_clear(led_strip_);
-
-        if (blink_counter_ == 0) {
-            esp_timer_stop(blink_timer_);
-        }
     }
+    return blink_counter_ != 0;
 }
 
 
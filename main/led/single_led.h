@@ -2,18 +2,19 @@
 #define _SINGLE_LED_H_
 
 #include "led.h"
+#include "led_animator.h"
 #include <driver/gpio.h>
 #include <led_strip.h>
-#include <esp_timer.h>
 #include <atomic>
 #include <mutex>
 
-class SingleLed : public Led {
+class SingleLed : public Led, public LedAnimation {
 public:
     SingleLed(gpio_num_t gpio);
     virtual ~SingleLed();
 
     void OnStateChanged() override;
+    bool OnAnimationTick() override;
 
 private:
     std::mutex mutex_;
@@ -22,10 +23,8 @@ private:
     uint8_t r_ = 0, g_ = 0, b_ = 0;
     int blink_counter_ = 0;
     int blink_interval_ms_ = 0;
-    esp_timer_handle_t blink_timer_ = nullptr;
 
     void StartBlinkTask(int times, int interval_ms);
-    void OnBlinkTimer();
 
     void BlinkOnce();
     void Blink(int times, int interval_ms);
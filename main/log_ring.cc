@@ -0,0 +1,156 @@
+#include "log_ring.h"
+
+#if CONFIG_USE_LOG_RING
+
+#include <esp_heap_caps.h>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <algorithm>
+
+#include "task_placement.h"
+
+void LogRing::Install() {
+    auto& ring = GetInstance();
+    if (ring.task_ != nullptr) {
+        return;
+    }
+    // Written by every logging task, so in internal RAM
+    void* slots = heap_caps_malloc(sizeof(Slot) * CONFIG_LOG_RING_SLOTS, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (slots == nullptr) {
+        return;
+    }
+    ring.slots_ = static_cast<Slot*>(slots);
+    for (int i = 0; i < CONFIG_LOG_RING_SLOTS; i++) {
+        new (&ring.slots_[i]) Slot();
+        ring.slots_[i].sequence.store(0, std::memory_order_relaxed);
+    }
+    if (TaskPlacements::Create(kTaskLogRing, [](void* arg) {
+            ((LogRing*)arg)->DrainTask();
+        }, &ring, &ring.task_) != pdPASS) {
+        heap_caps_free(slots);
+        ring.slots_ = nullptr;
+        ring.task_ = nullptr;
+        return;
+    }
+    ring.uart_vprintf_ = esp_log_set_vprintf(&LogRing::VPrintf);
+}
+
+int LogRing::VPrintf(const char* format, va_list args) {
+    auto& ring = GetInstance();
+    // The lines of an interrupt or of the code running before the scheduler cannot wait for the
+    // drain task, neither can those of the drain task itself
+    if (xPortInIsrContext() || xTaskGetSchedulerState() != taskSCHEDULER_RUNNING ||
+        xTaskGetCurrentTaskHandle() == ring.task_) {
+        return ring.uart_vprintf_(format, args);
+    }
+    char line[LOG_RING_LINE_SIZE];
+    int length = vsnprintf(line, sizeof(line), format, args);
+    if (length <= 0) {
+        return length;
+    }
+    if (length >= (int)sizeof(line)) {
+        length = sizeof(line) - 1;
+        line[length - 1] = '\n';
+    }
+    ring.Write(line, length);
+    return length;
+}
+
+void LogRing::Write(const char* line, size_t length) {
+    uint32_t count = (length + LOG_RING_SLOT_TEXT - 1) / LOG_RING_SLOT_TEXT;
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    do {
+        if (head + count - tail_.load(std::memory_order_acquire) > CONFIG_LOG_RING_SLOTS) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    } while (!head_.compare_exchange_weak(head, head + count, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    for (uint32_t i = 0; i < count; i++) {
+        Slot& slot = slots_[(head + i) % CONFIG_LOG_RING_SLOTS];
+        // Invalidated first, GetRecent() may be reading the line this slot held
+        slot.sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        size_t offset = i * LOG_RING_SLOT_TEXT;
+        size_t size = std::min<size_t>(length - offset, LOG_RING_SLOT_TEXT);
+        memcpy(slot.text, line + offset, size);
+        slot.length = size;
+        slot.sequence.store(head + i + 1, std::memory_order_release);
+    }
+    xTaskNotifyGive(task_);
+}
+
+void LogRing::DrainTask() {
+    uint32_t reported_drops = 0;
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        bool written = false;
+        while (true) {
+            Slot& slot = slots_[tail % CONFIG_LOG_RING_SLOTS];
+            // A slot still being written stops the drain, its writer wakes the task again
+            if (slot.sequence.load(std::memory_order_acquire) != tail + 1) {
+                break;
+            }
+            fwrite(slot.text, 1, slot.length, stdout);
+            tail_.store(++tail, std::memory_order_release);
+            written = true;
+        }
+        uint32_t dropped = dropped_.load(std::memory_order_relaxed);
+        if (dropped != reported_drops) {
+            printf("W (%lu) LogRing: %lu log lines dropped, raise LOG_RING_SLOTS\n",
+                esp_log_timestamp(), dropped - reported_drops);
+            reported_drops = dropped;
+            written = true;
+        }
+        if (written) {
+            fflush(stdout);
+        }
+    }
+}
+
+std::string LogRing::GetRecent(size_t max_bytes) {
+    std::string out;
+    if (slots_ == nullptr) {
+        return out;
+    }
+    // The slots before the tail were written out and stay until a writer reuses them
+    uint32_t tail = tail_.load(std::memory_order_acquire);
+    uint32_t start = tail > CONFIG_LOG_RING_SLOTS ? tail - CONFIG_LOG_RING_SLOTS : 0;
+    out.reserve(std::min<size_t>((tail - start) * LOG_RING_SLOT_TEXT, max_bytes + LOG_RING_SLOT_TEXT));
+    // Whether the oldest line may be cut
+    bool partial = start > 0;
+    char text[LOG_RING_SLOT_TEXT];
+    for (uint32_t index = start; index < tail; index++) {
+        Slot& slot = slots_[index % CONFIG_LOG_RING_SLOTS];
+        if (slot.sequence.load(std::memory_order_acquire) != index + 1) {
+            continue;
+        }
+        size_t length = std::min<size_t>(slot.length, LOG_RING_SLOT_TEXT);
+        memcpy(text, slot.text, length);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // Reused while it was copied
+        if (slot.sequence.load(std::memory_order_relaxed) != index + 1) {
+            continue;
+        }
+        out.append(text, length);
+        if (out.size() > max_bytes + LOG_RING_SLOT_TEXT) {
+            // Only the newest lines are kept
+            out.erase(0, out.size() - max_bytes);
+            partial = true;
+        }
+    }
+    if (out.size() > max_bytes) {
+        out.erase(0, out.size() - max_bytes);
+        partial = true;
+    }
+    // Starts at a whole line
+    size_t newline = out.find('\n');
+    if (partial && newline != std::string::npos) {
+        out.erase(0, newline + 1);
+    }
+    return out;
+}
+
+#endif // CONFIG_USE_LOG_RING
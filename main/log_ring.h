@@ -0,0 +1,117 @@
+#ifndef LOG_RING_H
+#define LOG_RING_H
+
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
+#include <string>
+
+// A log line is formatted into this much stack, the rest of a longer line is cut
+#define LOG_RING_LINE_SIZE 256
+// The text of one slot, a line takes as many consecutive slots as it needs
+#define LOG_RING_SLOT_TEXT 120
+
+/*
+ * RAM log backend.
+ *
+ * Install() routes esp_log through a vprintf hook that formats the line on the calling task and
+ * copies it into a ring of slots, reserved with a compare-and-swap like the rings of
+ * TraceRecorder. So a log call costs the formatting and a memcpy, and the task never waits for
+ * the UART: a low priority task is woken to write the lines out. With the ring full the line
+ * is dropped and counted, the drops are reported once the UART caught up.
+ *
+ * The written lines stay in the ring until their slots are reused, GetRecent() returns them for
+ * the self.get_recent_logs MCP tool, so the last logs can be read over the network.
+ *
+ * The early boot logs, the logs of interrupts and those written before Install() go straight
+ * to the UART. Without CONFIG_USE_LOG_RING Install() does nothing.
+ */
+class LogRing {
+public:
+    static LogRing& GetInstance() {
+        static LogRing instance;
+        return instance;
+    }
+    LogRing(const LogRing&) = delete;
+    LogRing& operator=(const LogRing&) = delete;
+
+#if CONFIG_USE_LOG_RING
+    static void Install();
+    // The last written lines, up to max_bytes, oldest first
+    std::string GetRecent(size_t max_bytes);
+    uint32_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+#else
+    static void Install() {}
+    std::string GetRecent(size_t max_bytes) { return std::string(); }
+    uint32_t dropped() const { return 0; }
+#endif
+
+private:
+    LogRing() = default;
+
+#if CONFIG_USE_LOG_RING
+    struct Slot {
+        std::atomic<uint32_t> sequence;     // Index + 1 once the slot is written, 0 while it is
+        uint16_t length;
+        char text[LOG_RING_SLOT_TEXT];
+    };
+
+    Slot* slots_ = nullptr;
+    std::atomic<uint32_t> head_ = 0;        // The next slot to reserve
+    std::atomic<uint32_t> tail_ = 0;        // The next slot to write out, only moved by the drain task
+    std::atomic<uint32_t> dropped_ = 0;
+    TaskHandle_t task_ = nullptr;
+    vprintf_like_t uart_vprintf_ = nullptr;
+
+    static int VPrintf(const char* format, va_list args);
+    void Write(const char* line, size_t length);
+    void DrainTask();
+#endif
+};
+
+/*
+ * Suppresses the repeats of a log call site within an interval, see LOG_RATE_LIMITED. Any task
+ * may hit the same site, the state is atomic.
+ */
+class LogRateLimit {
+public:
+    // Whether to log now, with the count of the calls suppressed since the last logged one
+    bool Allow(uint32_t interval_ms, uint32_t* suppressed) {
+        int64_t now_us = esp_timer_get_time();
+        int64_t last_us = last_us_.load(std::memory_order_relaxed);
+        if ((last_us != 0 && now_us - last_us < (int64_t)interval_ms * 1000) ||
+            !last_us_.compare_exchange_strong(last_us, now_us, std::memory_order_relaxed)) {
+            suppressed_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        *suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+
+private:
+    std::atomic<int64_t> last_us_ = 0;
+    std::atomic<uint32_t> suppressed_ = 0;
+};
+
+// Logs at most once per interval_ms from this call site, e.g.
+// LOG_RATE_LIMITED(1000, ESP_LOGW, TAG, "Late packet %lu", sequence);
+// The logged line tells how many were suppressed before it.
+#define LOG_RATE_LIMITED(interval_ms, log_macro, tag, format, ...) do { \
+        static LogRateLimit log_rate_limit_; \
+        uint32_t log_suppressed_; \
+        if (log_rate_limit_.Allow((interval_ms), &log_suppressed_)) { \
+            if (log_suppressed_ > 0) { \
+                log_macro(tag, format " (%lu more suppressed)", ##__VA_ARGS__, (unsigned long)log_suppressed_); \
+            } else { \
+                log_macro(tag, format, ##__VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+#endif // LOG_RING_H
@@ -0,0 +1,168 @@
+#include "loop_profiler.h"
+
+#if CONFIG_USE_MAIN_LOOP_PROFILER
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#define TAG "LoopProfiler"
+
+// "application.cc:271", or the handler name for line 0
+static void FormatSite(const CallSite& site, char* buffer, size_t size) {
+    if (site.file == nullptr) {
+        snprintf(buffer, size, "unknown");
+        return;
+    }
+    const char* name = strrchr(site.file, '/');
+    name = name != nullptr ? name + 1 : site.file;
+    if (site.line > 0) {
+        snprintf(buffer, size, "%s:%d", name, site.line);
+    } else {
+        snprintf(buffer, size, "%s", name);
+    }
+}
+
+static bool SameSite(const CallSite& a, const CallSite& b) {
+    // The file names are literals, the same pointer within one translation unit
+    return a.line == b.line && (a.file == b.file || (a.file && b.file && strcmp(a.file, b.file) == 0));
+}
+
+LoopProfiler::~LoopProfiler() {
+    if (watchdog_timer_ != nullptr) {
+        esp_timer_stop(watchdog_timer_);
+        esp_timer_delete(watchdog_timer_);
+    }
+}
+
+void LoopProfiler::Start() {
+    esp_timer_create_args_t watchdog_timer_args = {
+        .callback = [](void* arg) {
+            ((LoopProfiler*)arg)->CheckStall();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "loop_watchdog",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&watchdog_timer_args, &watchdog_timer_);
+    esp_timer_start_periodic(watchdog_timer_, CONFIG_MAIN_LOOP_STALL_MS * 1000 / 2);
+}
+
+void LoopProfiler::Begin(const CallSite& site) {
+    portENTER_CRITICAL(&lock_);
+    running_ = site;
+    start_us_ = esp_timer_get_time();
+    stall_reported_ = false;
+    portEXIT_CRITICAL(&lock_);
+}
+
+void LoopProfiler::End() {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&lock_);
+    CallSite site = running_;
+    int64_t duration_us = now - start_us_;
+    bool stalled = stall_reported_;
+    start_us_ = 0;
+    Add(site, duration_us);
+    portEXIT_CRITICAL(&lock_);
+
+    if (duration_us >= CONFIG_MAIN_LOOP_SLOW_CALLBACK_MS * 1000LL) {
+        char name[48];
+        FormatSite(site, name, sizeof(name));
+        if (stalled) {
+            ESP_LOGW(TAG, "Main loop resumed after %lld ms in %s", duration_us / 1000, name);
+        } else {
+            ESP_LOGW(TAG, "Slow main loop callback: %s took %lld ms", name, duration_us / 1000);
+        }
+    }
+}
+
+// Called with the lock held
+void LoopProfiler::Add(const CallSite& site, int64_t duration_us) {
+    callbacks_++;
+    if (duration_us >= CONFIG_MAIN_LOOP_SLOW_CALLBACK_MS * 1000LL) {
+        slow_++;
+    }
+
+    SiteStats* stats = nullptr;
+    for (size_t i = 0; i < site_count_; i++) {
+        if (SameSite(sites_[i].site, site)) {
+            stats = &sites_[i];
+            break;
+        }
+    }
+    if (stats == nullptr) {
+        if (site_count_ < LOOP_PROFILER_SITES) {
+            stats = &sites_[site_count_++];
+        } else {
+            // Keep the slowest sites, the fastest one makes room if this call beats it
+            stats = std::min_element(sites_, sites_ + site_count_, [](const SiteStats& a, const SiteStats& b) {
+                return a.max_us < b.max_us;
+            });
+            if (stats->max_us >= duration_us) {
+                return;
+            }
+        }
+        *stats = SiteStats();
+        stats->site = site;
+    }
+    stats->count++;
+    stats->total_us += duration_us;
+    stats->max_us = std::max(stats->max_us, duration_us);
+}
+
+void LoopProfiler::CheckStall() {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&lock_);
+    CallSite site = running_;
+    int64_t elapsed_us = start_us_ != 0 ? now - start_us_ : 0;
+    bool report = !stall_reported_ && elapsed_us >= CONFIG_MAIN_LOOP_STALL_MS * 1000LL;
+    if (report) {
+        stall_reported_ = true;
+        stalls_++;
+    }
+    portEXIT_CRITICAL(&lock_);
+
+    if (report) {
+        char name[48];
+        FormatSite(site, name, sizeof(name));
+        ESP_LOGE(TAG, "Main loop stalled for %lld ms in %s", elapsed_us / 1000, name);
+    }
+}
+
+cJSON* LoopProfiler::GetStatsJson() {
+    SiteStats sites[LOOP_PROFILER_SITES];
+    portENTER_CRITICAL(&lock_);
+    size_t count = site_count_;
+    std::copy(sites_, sites_ + count, sites);
+    uint32_t callbacks = callbacks_;
+    uint32_t slow = slow_;
+    uint32_t stalls = stalls_;
+    portEXIT_CRITICAL(&lock_);
+
+    std::sort(sites, sites + count, [](const SiteStats& a, const SiteStats& b) {
+        return a.max_us > b.max_us;
+    });
+
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "callbacks", callbacks);
+    cJSON_AddNumberToObject(json, "slow", slow);
+    cJSON_AddNumberToObject(json, "stalls", stalls);
+    cJSON* slowest = cJSON_CreateArray();
+    for (size_t i = 0; i < std::min<size_t>(count, LOOP_PROFILER_TOP); i++) {
+        char name[48];
+        FormatSite(sites[i].site, name, sizeof(name));
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "site", name);
+        cJSON_AddNumberToObject(item, "count", sites[i].count);
+        cJSON_AddNumberToObject(item, "average_us", sites[i].total_us / sites[i].count);
+        cJSON_AddNumberToObject(item, "max_us", sites[i].max_us);
+        cJSON_AddItemToArray(slowest, item);
+    }
+    cJSON_AddItemToObject(json, "slowest", slowest);
+    return json;
+}
+
+#endif // CONFIG_USE_MAIN_LOOP_PROFILER
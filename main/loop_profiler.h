@@ -0,0 +1,96 @@
+#ifndef LOOP_PROFILER_H
+#define LOOP_PROFILER_H
+
+#include "scheduled_task.h"
+#include "trace_recorder.h"
+#include "black_box.h"
+
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <esp_timer.h>
+#include <cJSON.h>
+#include <cstdint>
+
+// Call sites tracked at once, a new site replaces the fastest one when the table is full
+#define LOOP_PROFILER_SITES 32
+// Length of the slowest list reported over MCP
+#define LOOP_PROFILER_TOP 8
+
+/*
+ * Durations of the main event loop callbacks: the scheduled tasks, the timers and the event
+ * bit handlers, attributed to the file and line that scheduled them.
+ *
+ * A callback longer than CONFIG_MAIN_LOOP_SLOW_CALLBACK_MS is logged when it returns. The
+ * watchdog timer also checks the running callback every half CONFIG_MAIN_LOOP_STALL_MS, so
+ * a callback that never returns is named while it still blocks the loop.
+ *
+ * Begin() and End() are only called by the main loop, GetStatsJson() from any task. Without
+ * CONFIG_USE_MAIN_LOOP_PROFILER every method is an empty inline.
+ */
+class LoopProfiler {
+public:
+#if CONFIG_USE_MAIN_LOOP_PROFILER
+    ~LoopProfiler();
+    // Starts the stall watchdog
+    void Start();
+    void Begin(const CallSite& site);
+    void End();
+
+    // {"callbacks", "slow", "stalls", "slowest": [{"site", "count", "average_us", "max_us"}, ...]}
+    cJSON* GetStatsJson();
+#else
+    void Start() {}
+    void Begin(const CallSite& site) {}
+    void End() {}
+    cJSON* GetStatsJson() { return cJSON_CreateObject(); }
+#endif
+
+    // Times the enclosing block, marks it on the trace timeline under the file name and in the black box
+    class Scope {
+    public:
+        Scope(LoopProfiler& profiler, const CallSite& site) : profiler_(profiler), file_(site.file) {
+            profiler_.Begin(site);
+            BlackBox::GetInstance().EnterCallback(site);
+            TraceRecorder::GetInstance().Begin(file_);
+        }
+        ~Scope() {
+            TraceRecorder::GetInstance().End(file_);
+            BlackBox::GetInstance().LeaveCallback();
+            profiler_.End();
+        }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        LoopProfiler& profiler_;
+        const char* file_;
+    };
+
+private:
+#if CONFIG_USE_MAIN_LOOP_PROFILER
+    struct SiteStats {
+        CallSite site;
+        uint32_t count = 0;
+        int64_t total_us = 0;
+        int64_t max_us = 0;
+    };
+
+    // Guards everything below, the watchdog runs in the esp_timer task
+    portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+    SiteStats sites_[LOOP_PROFILER_SITES];
+    size_t site_count_ = 0;
+    uint32_t callbacks_ = 0;
+    uint32_t slow_ = 0;
+    uint32_t stalls_ = 0;
+    // The callback running now, start_us_ is 0 between callbacks
+    CallSite running_;
+    int64_t start_us_ = 0;
+    bool stall_reported_ = false;
+    esp_timer_handle_t watchdog_timer_ = nullptr;
+
+    void Add(const CallSite& site, int64_t duration_us);
+    void CheckStall();
+#endif
+};
+
+#endif // LOOP_PROFILER_H
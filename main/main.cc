@@ -9,11 +9,19 @@
 
 #include "application.h"
 #include "system_info.h"
+#include "log_ring.h"
+#include "audio_benchmark.h"
+#include "display_benchmark.h"
+#include "opus_benchmark.h"
+#include "mcp_benchmark.h"
 
 #define TAG "main"
 
 extern "C" void app_main(void)
 {
+    // First, so the logs of the tasks started below no longer wait for the UART
+    LogRing::Install();
+
     // Initialize the default event loop
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
@@ -26,7 +34,21 @@ extern "C" void app_main(void)
     }
     ESP_ERROR_CHECK(ret);
 
+#if CONFIG_AUDIO_PIPELINE_BENCHMARK
+    // The benchmark firmware only runs the audio pipeline
+    AudioBenchmark::Run();
+#elif CONFIG_DISPLAY_BENCHMARK
+    // The benchmark firmware only replays a workload on the display
+    DisplayBenchmark::Run();
+#elif CONFIG_OPUS_BENCHMARK
+    // The benchmark firmware only sweeps the Opus settings
+    OpusBenchmark::Run();
+#elif CONFIG_MCP_BENCHMARK
+    // The benchmark firmware only fires recorded JSON-RPC requests at the MCP server
+    McpBenchmark::Run();
+#else
     // Launch the application
     auto& app = Application::GetInstance();
     app.Start();
+#endif
 }
@@ -0,0 +1,415 @@
+#include "mcp_benchmark.h"
+
+#if CONFIG_MCP_BENCHMARK
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <esp_attr.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <cJSON.h>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+#include "mcp_server.h"
+#include "json_arena.h"
+#include "shared_buffer.h"
+
+#define TAG "McpBenchmark"
+
+#define MCP_BENCHMARK_STACK_SIZE (16 * 1024)
+#define MCP_BENCHMARK_FIRST_STEP 10
+// The tool schemas, tool i has the schema i % MCP_BENCHMARK_SCHEMAS
+#define MCP_BENCHMARK_SCHEMAS 4
+// The blocks of one call kept for the live bytes, a power of two
+#define MCP_BENCHMARK_TRACKED_BLOCKS 1024
+
+namespace {
+
+#if CONFIG_HEAP_USE_HOOKS
+/*
+ * Counts the allocations of the benchmark task while a call runs. The free hook gets no size,
+ * so the blocks of the call are kept in an open addressing table for the live bytes: a block
+ * allocated before the call and freed in it is not known and not counted.
+ */
+struct AllocationCounter {
+    std::atomic<TaskHandle_t> task = nullptr;
+    uint32_t allocations = 0;
+    uint32_t untracked = 0;
+    size_t live_bytes = 0;
+    size_t peak_bytes = 0;
+    void* blocks[MCP_BENCHMARK_TRACKED_BLOCKS];
+    size_t sizes[MCP_BENCHMARK_TRACKED_BLOCKS];
+
+    void Start() {
+        allocations = 0;
+        untracked = 0;
+        live_bytes = 0;
+        peak_bytes = 0;
+        memset(blocks, 0, sizeof(blocks));
+        task.store(xTaskGetCurrentTaskHandle(), std::memory_order_release);
+    }
+
+    void Stop() {
+        task.store(nullptr, std::memory_order_release);
+    }
+};
+
+DRAM_ATTR AllocationCounter counter;
+
+// A freed slot, the probes go on past it
+void* const kFreedBlock = reinterpret_cast<void*>(1);
+
+FORCE_INLINE_ATTR bool Counting() {
+    TaskHandle_t task = counter.task.load(std::memory_order_acquire);
+    return task != nullptr && task == xTaskGetCurrentTaskHandle();
+}
+
+FORCE_INLINE_ATTR size_t Slot(void* ptr) {
+    return (reinterpret_cast<uintptr_t>(ptr) >> 3) & (MCP_BENCHMARK_TRACKED_BLOCKS - 1);
+}
+#endif
+
+struct PhaseResult {
+    std::vector<int32_t> latencies_us;
+    int64_t elapsed_us = 0;
+    uint64_t reply_bytes = 0;
+    uint32_t errors = 0;
+    uint64_t allocations = 0;
+    size_t peak_bytes = 0;
+    uint32_t untracked = 0;
+};
+
+void Print(cJSON* root) {
+    auto json = cJSON_PrintUnformatted(root);
+    printf(MCP_BENCHMARK_PREFIX "%s\n", json);
+    cJSON_free(json);
+    cJSON_Delete(root);
+}
+
+int32_t Percentile(const std::vector<int32_t>& sorted, int percent) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = std::min(sorted.size() - 1, sorted.size() * percent / 100);
+    return sorted[index];
+}
+
+void PrintPhase(const char* phase, int tools, PhaseResult& result) {
+    auto& latencies = result.latencies_us;
+    std::sort(latencies.begin(), latencies.end());
+    int64_t total_us = 0;
+    for (auto us : latencies) {
+        total_us += us;
+    }
+    size_t calls = latencies.size();
+
+    auto root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "type", "phase");
+    cJSON_AddStringToObject(root, "phase", phase);
+    cJSON_AddNumberToObject(root, "tools", tools);
+    cJSON_AddNumberToObject(root, "calls", calls);
+    cJSON_AddNumberToObject(root, "errors", result.errors);
+    cJSON_AddNumberToObject(root, "calls_per_sec", result.elapsed_us > 0 ? calls * 1000000.0 / result.elapsed_us : 0);
+    cJSON_AddNumberToObject(root, "avg_us", calls > 0 ? total_us / (int64_t)calls : 0);
+    cJSON_AddNumberToObject(root, "p50_us", Percentile(latencies, 50));
+    cJSON_AddNumberToObject(root, "p99_us", Percentile(latencies, 99));
+    cJSON_AddNumberToObject(root, "max_us", latencies.empty() ? 0 : latencies.back());
+    cJSON_AddNumberToObject(root, "reply_bytes", calls > 0 ? result.reply_bytes / calls : 0);
+#if CONFIG_HEAP_USE_HOOKS
+    cJSON_AddNumberToObject(root, "allocs_per_call", calls > 0 ? (double)result.allocations / calls : 0);
+    cJSON_AddNumberToObject(root, "peak_bytes", result.peak_bytes);
+    if (result.untracked > 0) {
+        cJSON_AddNumberToObject(root, "untracked_blocks", result.untracked);
+    }
+#endif
+    cJSON_AddNumberToObject(root, "heap_internal_free", heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    cJSON_AddNumberToObject(root, "heap_internal_min", heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL));
+    Print(root);
+}
+
+std::string ToolName(int index) {
+    char name[32];
+    snprintf(name, sizeof(name), "bench.tool_%03d", index);
+    return name;
+}
+
+// A tool of each schema, the descriptions grow with the index like the real ones vary
+void AddSyntheticTool(McpServer& server, int index) {
+    std::string description = "Synthetic tool " + std::to_string(index) + " of the MCP benchmark.";
+    for (int i = 0; i < index % 5; i++) {
+        description += " It does nothing useful, the schema and this text are what is measured.";
+    }
+    switch (index % MCP_BENCHMARK_SCHEMAS) {
+    case 0:
+        server.AddTool(ToolName(index), description, PropertyList(),
+            [](const PropertyList& properties) -> ReturnValue {
+                return true;
+            });
+        break;
+    case 1:
+        server.AddTool(ToolName(index), description,
+            PropertyList({
+                Property("volume", kPropertyTypeInteger, 0, 100),
+                Property("delay_ms", kPropertyTypeInteger, 0, 0, 60000)
+            }),
+            [](const PropertyList& properties) -> ReturnValue {
+                return properties["volume"].value<int>() + properties["delay_ms"].value<int>();
+            });
+        break;
+    case 2:
+        server.AddTool(ToolName(index), description,
+            PropertyList({
+                Property("text", kPropertyTypeString)
+            }),
+            [](const PropertyList& properties) -> ReturnValue {
+                // Echoed, the result string is escaped into the reply
+                return properties["text"].value<std::string>();
+            });
+        break;
+    default:
+        server.AddTool(ToolName(index), description,
+            PropertyList({
+                Property("enabled", kPropertyTypeBoolean),
+                Property("level", kPropertyTypeInteger, 5, 0, 10),
+                Property("label", kPropertyTypeString, std::string(""))
+            }),
+            [](const PropertyList& properties) -> ReturnValue {
+                auto json = cJSON_CreateObject();
+                cJSON_AddBoolToObject(json, "enabled", properties["enabled"].value<bool>());
+                cJSON_AddNumberToObject(json, "level", properties["level"].value<int>());
+                cJSON_AddStringToObject(json, "label", properties["label"].value<std::string>().c_str());
+                return json;
+            });
+        break;
+    }
+}
+
+// The recorded tools/call requests, of the tools of one schema in turn
+std::vector<std::string> CallRequests(int schema, int tools) {
+    std::string text(CONFIG_MCP_BENCHMARK_STRING_BYTES, 'x');
+    for (size_t i = 0; i < text.size(); i += 16) {
+        // Some characters to escape
+        text[i] = i % 32 == 0 ? '"' : '\n';
+    }
+    cJSON* escaped = cJSON_CreateString(text.c_str());
+    char* escaped_text = cJSON_PrintUnformatted(escaped);
+    std::string quoted_text = escaped_text;
+    cJSON_free(escaped_text);
+    cJSON_Delete(escaped);
+
+    std::vector<std::string> requests;
+    for (int index = schema; index < tools; index += MCP_BENCHMARK_SCHEMAS) {
+        std::string arguments;
+        switch (schema) {
+        case 0:
+            arguments = "{}";
+            break;
+        case 1:
+            arguments = "{\"volume\":" + std::to_string(index % 100) + ",\"delay_ms\":250}";
+            break;
+        case 2:
+            arguments = "{\"text\":" + quoted_text + "}";
+            break;
+        default:
+            arguments = "{\"enabled\":true,\"level\":7,\"label\":\"kitchen\"}";
+            break;
+        }
+        requests.push_back("{\"jsonrpc\":\"2.0\",\"id\":" + std::to_string(index + 1) +
+            ",\"method\":\"tools/call\",\"params\":{\"name\":\"" + ToolName(index) + "\",\"arguments\":" + arguments + "}}");
+    }
+    return requests;
+}
+
+std::string ListRequest(const std::string& cursor) {
+    return "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"tools/list\",\"params\":{\"cursor\":\"" + cursor + "\"}}";
+}
+
+// The nextCursor of a tools/list reply, empty on the last page
+std::string NextCursor(const std::string& reply) {
+    static const char key[] = "\"nextCursor\":\"";
+    auto start = reply.find(key);
+    if (start == std::string::npos) {
+        return "";
+    }
+    start += strlen(key);
+    auto end = reply.find('"', start);
+    return end == std::string::npos ? "" : reply.substr(start, end - start);
+}
+
+} // namespace
+
+#if CONFIG_HEAP_USE_HOOKS
+extern "C" IRAM_ATTR void esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps) {
+    if (ptr == nullptr || !Counting()) {
+        return;
+    }
+    counter.allocations++;
+    size_t slot = Slot(ptr);
+    for (int probe = 0; probe < MCP_BENCHMARK_TRACKED_BLOCKS; probe++) {
+        void* block = counter.blocks[slot];
+        if (block == nullptr || block == kFreedBlock) {
+            counter.blocks[slot] = ptr;
+            counter.sizes[slot] = size;
+            counter.live_bytes += size;
+            if (counter.live_bytes > counter.peak_bytes) {
+                counter.peak_bytes = counter.live_bytes;
+            }
+            return;
+        }
+        slot = (slot + 1) & (MCP_BENCHMARK_TRACKED_BLOCKS - 1);
+    }
+    counter.untracked++;
+}
+
+extern "C" IRAM_ATTR void esp_heap_trace_free_hook(void* ptr) {
+    if (ptr == nullptr || !Counting()) {
+        return;
+    }
+    size_t slot = Slot(ptr);
+    for (int probe = 0; probe < MCP_BENCHMARK_TRACKED_BLOCKS; probe++) {
+        void* block = counter.blocks[slot];
+        if (block == nullptr) {
+            return;
+        }
+        if (block == ptr) {
+            counter.blocks[slot] = kFreedBlock;
+            counter.live_bytes -= counter.sizes[slot];
+            return;
+        }
+        slot = (slot + 1) & (MCP_BENCHMARK_TRACKED_BLOCKS - 1);
+    }
+}
+#endif
+
+std::string McpBenchmark::Request(McpServer& server, const std::string& message) {
+    // A batch of one takes the replies, the calls for the main thread are queued in it
+    auto batch = std::make_shared<McpServer::Batch>();
+    {
+        McpServer::BatchScope scope(batch);
+        server.ParseMessage(message);
+    }
+    auto calls = std::move(batch->main_thread_calls);
+    for (auto& call : calls) {
+        call();
+    }
+    calls.clear();
+
+    std::string replies;
+    std::lock_guard<std::mutex> lock(batch->mutex);
+    // Taken before the batch goes, it sends nothing then
+    replies.swap(batch->replies);
+    return replies;
+}
+
+void McpBenchmark::Run() {
+    JsonArena::Install();
+
+    xTaskCreate([](void* arg) {
+        auto& server = McpServer::GetInstance();
+        ESP_LOGI(TAG, "MCP benchmark on %s, up to %d tools, %d requests per phase", CONFIG_IDF_TARGET,
+            CONFIG_MCP_BENCHMARK_MAX_TOOLS, CONFIG_MCP_BENCHMARK_ITERATIONS);
+        int64_t start_us = esp_timer_get_time();
+
+        // Shared by the calls, the image tool only measures the encoding into the reply
+        auto image = SharedBuffer::Allocate(kHeapTagJson, CONFIG_MCP_BENCHMARK_IMAGE_KB * 1024, kHeapPlacementPsram);
+        if (!image) {
+            ESP_LOGE(TAG, "No memory for the image");
+        } else {
+            for (size_t i = 0; i < image.capacity(); i++) {
+                image.data()[i] = static_cast<uint8_t>(i * 31);
+            }
+            server.AddTool("bench.image", "Synthetic tool of the MCP benchmark returning a JPEG image",
+                PropertyList(),
+                [image](const PropertyList& properties) -> ReturnValue {
+                    return new ImageContent("image/jpeg", BufferSlice(image, 0, image.capacity()));
+                });
+        }
+
+        auto run_phase = [&server](const char* phase, int tools, const std::vector<std::string>& requests) {
+            if (requests.empty()) {
+                return;
+            }
+            PhaseResult result;
+            result.latencies_us.reserve(CONFIG_MCP_BENCHMARK_ITERATIONS);
+            // One round first, the first calls of a tool fill its caches
+            for (auto& request : requests) {
+                Request(server, request);
+            }
+            int64_t phase_start_us = esp_timer_get_time();
+            for (int i = 0; i < CONFIG_MCP_BENCHMARK_ITERATIONS; i++) {
+                auto& request = requests[i % requests.size()];
+#if CONFIG_HEAP_USE_HOOKS
+                counter.Start();
+#endif
+                int64_t call_start_us = esp_timer_get_time();
+                auto reply = Request(server, request);
+                int64_t call_us = esp_timer_get_time() - call_start_us;
+#if CONFIG_HEAP_USE_HOOKS
+                counter.Stop();
+                result.allocations += counter.allocations;
+                result.peak_bytes = std::max(result.peak_bytes, counter.peak_bytes);
+                result.untracked += counter.untracked;
+#endif
+                result.latencies_us.push_back(static_cast<int32_t>(call_us));
+                result.reply_bytes += reply.size();
+                if (reply.empty() || reply.find("\"error\":") != std::string::npos) {
+                    result.errors++;
+                }
+            }
+            result.elapsed_us = esp_timer_get_time() - phase_start_us;
+            PrintPhase(phase, tools, result);
+        };
+
+        int tools = 0;
+        int step = MCP_BENCHMARK_FIRST_STEP;
+        while (true) {
+            for (; tools < step; tools++) {
+                AddSyntheticTool(server, tools);
+            }
+
+            // The pages of tools/list, as a client walks them
+            std::vector<std::string> list_requests;
+            std::string cursor;
+            do {
+                list_requests.push_back(ListRequest(cursor));
+                cursor = NextCursor(Request(server, list_requests.back()));
+            } while (!cursor.empty());
+            run_phase("tools_list", tools, list_requests);
+
+            run_phase("call_no_args", tools, CallRequests(0, tools));
+            run_phase("call_int", tools, CallRequests(1, tools));
+            run_phase("call_string", tools, CallRequests(2, tools));
+            run_phase("call_mixed", tools, CallRequests(3, tools));
+            if (image) {
+                run_phase("call_image", tools,
+                    {"{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"tools/call\",\"params\":{\"name\":\"bench.image\"}}"});
+            }
+
+            if (step >= CONFIG_MCP_BENCHMARK_MAX_TOOLS) {
+                break;
+            }
+            step = std::min(step * 2, CONFIG_MCP_BENCHMARK_MAX_TOOLS);
+        }
+
+        auto root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "type", "summary");
+        cJSON_AddStringToObject(root, "target", CONFIG_IDF_TARGET);
+        cJSON_AddNumberToObject(root, "tools", tools);
+        cJSON_AddNumberToObject(root, "seconds", (esp_timer_get_time() - start_us) / 1000000);
+        cJSON_AddNumberToObject(root, "stack_free", uxTaskGetStackHighWaterMark(nullptr));
+        Print(root);
+        ESP_LOGI(TAG, "MCP benchmark done");
+        vTaskDelete(nullptr);
+    }, "mcp_bench", MCP_BENCHMARK_STACK_SIZE, nullptr, 5, nullptr);
+
+    while (true) {
+        vTaskDelay(portMAX_DELAY);
+    }
+}
+
+#endif // CONFIG_MCP_BENCHMARK
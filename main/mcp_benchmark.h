@@ -0,0 +1,46 @@
+#ifndef MCP_BENCHMARK_H
+#define MCP_BENCHMARK_H
+
+#include <sdkconfig.h>
+
+#if CONFIG_MCP_BENCHMARK
+
+#include <string>
+
+/*
+ * MCP JSON-RPC benchmark firmware.
+ *
+ * Replaces the application: synthetic tools of varied schemas (no arguments, integers with a
+ * range, a string, a boolean with an integer and a string) are registered on the McpServer in
+ * steps up to CONFIG_MCP_BENCHMARK_MAX_TOOLS, and at every step recorded requests are fired at
+ * it: every page of tools/list, and tools/call of each schema and of a tool returning an image
+ * of CONFIG_MCP_BENCHMARK_IMAGE_KB.
+ *
+ * A request goes through McpServer::ParseMessage() like one from the protocol: the parse, the
+ * argument binding, the call, the result serialization and ReplyResult(). The replies are taken
+ * from a batch of one instead of being sent, and the main thread calls run on the benchmark task,
+ * there is no main loop.
+ *
+ * Every phase prints a JSON line prefixed with MCP_BENCHMARK_PREFIX: the tool count, the calls
+ * per second, the average, p50, p99 and max latency, the reply size and, with
+ * CONFIG_HEAP_USE_HOOKS, the heap allocations per call and the peak bytes a call held. The
+ * allocation hooks add a little to the latencies.
+ */
+
+#define MCP_BENCHMARK_PREFIX "MCP_BENCH "
+
+class McpServer;
+
+class McpBenchmark {
+public:
+    // Runs the steps, prints the results and never returns
+    static void Run();
+
+private:
+    // A friend of McpServer: handles one message and returns its replies
+    static std::string Request(McpServer& server, const std::string& message);
+};
+
+#endif // CONFIG_MCP_BENCHMARK
+
+#endif // MCP_BENCHMARK_H
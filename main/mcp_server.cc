@@ -9,18 +9,148 @@
 #include <algorithm>
 #include <cstring>
 #include <esp_pthread.h>
+#include <esp_timer.h>
 
 #include "application.h"
 #include "display.h"
 #include "oled_display.h"
+#include "emote_display.h"
 #include "board.h"
 #include "settings.h"
+#include "device_state_event.h"
+#include "json_arena.h"
+#include "json_writer.h"
+#include "cpu_sampler.h"
+#include "heap_accounting.h"
+#include "http_client.h"
+#include "memory_budget.h"
+#include "task_placement.h"
+#include "log_ring.h"
+#include "black_box.h"
+#include "session_capture.h"
+#include "network_benchmark.h"
 #include "lvgl_theme.h"
 #include "lvgl_display.h"
+#include "lvgl_heap.h"
+#include "jpeg_to_image.h"
+#include "performance_profile.h"
 
 #define TAG "MCP"
 
+thread_local McpServer::PendingCall* McpServer::current_call_ = nullptr;
+thread_local McpServer::Batch* McpServer::current_batch_ = nullptr;
+
+void PropertyList::BuildIndex() {
+    auto index = std::make_shared<std::unordered_map<std::string, size_t>>();
+    index->reserve(properties_.size());
+    for (size_t i = 0; i < properties_.size(); i++) {
+        index->emplace(properties_[i].name(), i);
+    }
+    index_ = std::move(index);
+}
+
+const Property* PropertyList::Bind(const cJSON* arguments) {
+    if (cJSON_IsObject(arguments)) {
+        for (const cJSON* item = arguments->child; item != nullptr; item = item->next) {
+            Property* found = nullptr;
+            if (index_) {
+                auto it = index_->find(item->string);
+                found = it != index_->end() ? &properties_[it->second] : nullptr;
+            } else {
+                for (auto& property : properties_) {
+                    if (property.name() == item->string) {
+                        found = &property;
+                        break;
+                    }
+                }
+            }
+            if (found == nullptr) {
+                continue;
+            }
+            auto& property = *found;
+            if (property.type() == kPropertyTypeBoolean && cJSON_IsBool(item)) {
+                property.set_value<bool>(cJSON_IsTrue(item));
+                property.bound_ = true;
+            } else if (property.type() == kPropertyTypeInteger && cJSON_IsNumber(item)) {
+                property.set_value<int>(item->valueint);
+                property.bound_ = true;
+            } else if (property.type() == kPropertyTypeString && cJSON_IsString(item)) {
+                property.set_value<std::string>(item->valuestring);
+                property.bound_ = true;
+            }
+        }
+    }
+    for (const auto& property : properties_) {
+        if (!property.has_default_value() && !property.bound_) {
+            return &property;
+        }
+    }
+    return nullptr;
+}
+
+void McpTool::AppendSpecJson(std::string& out) const {
+    JsonWriter writer(out);
+    writer.Object();
+    writer.String("name", spec_->name);
+    writer.String("description", spec_->description);
+
+    writer.Object("inputSchema");
+    writer.String("type", "object");
+    writer.Object("properties");
+    bool has_required = false;
+    for (size_t i = 0; i < spec_->property_count; i++) {
+        auto& property = spec_->properties[i];
+        has_required |= !property.has_default_value;
+        writer.Object(property.name);
+        if (property.type == kPropertyTypeBoolean) {
+            writer.String("type", "boolean");
+            if (property.has_default_value) {
+                writer.Bool("default", property.default_int != 0);
+            }
+        } else if (property.type == kPropertyTypeInteger) {
+            writer.String("type", "integer");
+            if (property.has_default_value) {
+                writer.Int("default", property.default_int);
+            }
+            if (property.has_range) {
+                writer.Int("minimum", property.min_value);
+                writer.Int("maximum", property.max_value);
+            }
+        } else if (property.type == kPropertyTypeString) {
+            writer.String("type", "string");
+            if (property.has_default_value) {
+                writer.String("default", property.default_string);
+            }
+        }
+        writer.EndObject();
+    }
+    writer.EndObject();
+    if (has_required) {
+        writer.Array("required");
+        for (size_t i = 0; i < spec_->property_count; i++) {
+            if (!spec_->properties[i].has_default_value) {
+                // The property names are identifiers, written like the keys
+                writer.Fragment("\"" + std::string(spec_->properties[i].name) + "\"");
+            }
+        }
+        writer.EndArray();
+    }
+    writer.EndObject();
+
+    if (user_only_) {
+        writer.Object("annotations");
+        writer.Array("audience");
+        writer.Fragment("\"user\"");
+        writer.EndArray();
+        writer.EndObject();
+    }
+    writer.EndObject();
+}
+
 McpServer::McpServer() {
+    DeviceStateEventManager::GetInstance().RegisterStateChangeCallback([this](DeviceState, DeviceState) {
+        cache_generation_++;
+    });
 }
 
 McpServer::~McpServer() {
@@ -28,6 +158,7 @@ McpServer::~McpServer() {
         delete tool;
     }
     tools_.clear();
+    tool_index_.clear();
 }
 
 void McpServer::AddCommonTools() {
@@ -36,27 +167,36 @@ void McpServer::AddCommonTools() {
     // **重要** 为了提升响应速度，我们把常用的工具放在前面，利用 prompt cache 的特性。
 
     // Backup the original tools list and restore it after adding the common tools.
-    auto original_tools = std::move(tools_);
+    std::vector<McpTool*> original_tools;
+    {
+        std::lock_guard<std::mutex> lock(tools_mutex_);
+        original_tools = std::move(tools_);
+        tools_.clear();
+    }
     auto& board = Board::GetInstance();
 
     // Do not add custom tools here.
     // Custom tools must be added in the board's InitializeTools function.
 
-    AddTool("self.get_device_status",
+    // The common tools are in every build and described to the AI at length, their specs stay in flash
+    static constexpr auto kGetDeviceStatus = McpToolSpecOf("self.get_device_status",
         "Provides the real-time information of the device, including the current status of the audio speaker, screen, battery, network, etc.\n"
         "Use this tool for: \n"
         "1. Answering questions about current condition (e.g. what is the current volume of the audio speaker?)\n"
-        "2. As the first step to control the device (e.g. turn up / down the volume of the audio speaker, etc.)",
-        PropertyList(),
+        "2. As the first step to control the device (e.g. turn up / down the volume of the audio speaker, etc.)");
+    AddTool(kGetDeviceStatus,
         [&board](const PropertyList& properties) -> ReturnValue {
             return board.GetDeviceStatusJson();
         });
+    SetToolCacheTtl("self.get_device_status", CONFIG_MCP_STATUS_CACHE_TTL_MS);
 
-    AddTool("self.audio_speaker.set_volume", 
+    static constexpr McpPropertySpec kSetVolumeProperties[] = {
+        McpProperty("volume", kPropertyTypeInteger, 0, 100),
+    };
+    static constexpr auto kSetVolume = McpToolSpecOf("self.audio_speaker.set_volume",
         "Set the volume of the audio speaker. If the current volume is unknown, you must call `self.get_device_status` tool first and then call this tool.",
-        PropertyList({
-            Property("volume", kPropertyTypeInteger, 0, 100)
-        }), 
+        kSetVolumeProperties);
+    AddTool(kSetVolume,
         [&board](const PropertyList& properties) -> ReturnValue {
             auto codec = board.GetAudioCodec();
             codec->SetOutputVolume(properties["volume"].value<int>());
@@ -65,11 +205,12 @@ void McpServer::AddCommonTools() {
     
     auto backlight = board.GetBacklight();
     if (backlight) {
-        AddTool("self.screen.set_brightness",
-            "Set the brightness of the screen.",
-            PropertyList({
-                Property("brightness", kPropertyTypeInteger, 0, 100)
-            }),
+        static constexpr McpPropertySpec kSetBrightnessProperties[] = {
+            McpProperty("brightness", kPropertyTypeInteger, 0, 100),
+        };
+        static constexpr auto kSetBrightness = McpToolSpecOf("self.screen.set_brightness",
+            "Set the brightness of the screen.", kSetBrightnessProperties);
+        AddTool(kSetBrightness,
             [backlight](const PropertyList& properties) -> ReturnValue {
                 uint8_t brightness = static_cast<uint8_t>(properties["brightness"].value<int>());
                 backlight->SetBrightness(brightness, true);
@@ -80,11 +221,12 @@ void McpServer::AddCommonTools() {
 #ifdef HAVE_LVGL
     auto display = board.GetDisplay();
     if (display && display->GetTheme() != nullptr) {
-        AddTool("self.screen.set_theme",
-            "Set the theme of the screen. The theme can be `light` or `dark`.",
-            PropertyList({
-                Property("theme", kPropertyTypeString)
-            }),
+        static constexpr McpPropertySpec kSetThemeProperties[] = {
+            McpProperty("theme", kPropertyTypeString),
+        };
+        static constexpr auto kSetTheme = McpToolSpecOf("self.screen.set_theme",
+            "Set the theme of the screen. The theme can be `light` or `dark`.", kSetThemeProperties);
+        AddTool(kSetTheme,
             [display](const PropertyList& properties) -> ReturnValue {
                 auto theme_name = properties["theme"].value<std::string>();
                 auto& theme_manager = LvglThemeManager::GetInstance();
@@ -99,15 +241,27 @@ void McpServer::AddCommonTools() {
 
     auto camera = board.GetCamera();
     if (camera) {
-        AddTool("self.camera.take_photo",
+        static constexpr McpPropertySpec kTakePhotoProperties[] = {
+            McpProperty("question", kPropertyTypeString),
+            McpProperty("max_width", kPropertyTypeInteger, 0, 0, 4096),
+            McpProperty("max_height", kPropertyTypeInteger, 0, 0, 4096),
+            McpProperty("roi_x", kPropertyTypeInteger, 0, 0, 99),
+            McpProperty("roi_y", kPropertyTypeInteger, 0, 0, 99),
+            McpProperty("roi_width", kPropertyTypeInteger, 100, 1, 100),
+            McpProperty("roi_height", kPropertyTypeInteger, 100, 1, 100),
+            McpProperty("quality", kPropertyTypeInteger, 80, 1, 100),
+        };
+        static constexpr auto kTakePhoto = McpToolSpecOf("self.camera.take_photo",
             "Take a photo and explain it. Use this tool after the user asks you to see something.\n"
             "Args:\n"
             "  `question`: The question that you want to ask about the photo.\n"
+            "  `max_width`, `max_height`: Scale the photo down to fit, 0 keeps the sensor resolution.\n"
+            "  `roi_x`, `roi_y`, `roi_width`, `roi_height`: The region to send, in percent of the photo.\n"
+            "  `quality`: The JPEG quality, lower sends less data.\n"
             "Return:\n"
             "  A JSON object that provides the photo information.",
-            PropertyList({
-                Property("question", kPropertyTypeString)
-            }),
+            kTakePhotoProperties);
+        AddTool(kTakePhoto,
             [camera](const PropertyList& properties) -> ReturnValue {
                 // Lower the priority to do the camera capture
                 TaskPriorityReset priority_reset(1);
@@ -116,13 +270,60 @@ void McpServer::AddCommonTools() {
                     throw std::runtime_error("Failed to capture photo");
                 }
                 auto question = properties["question"].value<std::string>();
-                return camera->Explain(question);
+                ExplainOptions options;
+                options.max_width = properties["max_width"].value<int>();
+                options.max_height = properties["max_height"].value<int>();
+                options.roi_x = properties["roi_x"].value<int>();
+                options.roi_y = properties["roi_y"].value<int>();
+                options.roi_width = properties["roi_width"].value<int>();
+                options.roi_height = properties["roi_height"].value<int>();
+                options.quality = properties["quality"].value<int>();
+                return camera->Explain(question, options);
+            });
+        SetToolExecution("self.camera.take_photo", kMcpToolWorker);
+
+        static constexpr McpPropertySpec kStartStreamProperties[] = {
+            McpProperty("fps", kPropertyTypeInteger, 1, 1, 10),
+            McpProperty("bitrate_kbps", kPropertyTypeInteger, 256, 16, 4096),
+            McpProperty("max_width", kPropertyTypeInteger, 320, 64, 1920),
+            McpProperty("max_height", kPropertyTypeInteger, 240, 64, 1080),
+            McpProperty("quality", kPropertyTypeInteger, 60, 10, 100),
+        };
+        static constexpr auto kStartStream = McpToolSpecOf("self.camera.start_stream",
+            "Start streaming the camera to the server as JPEG frames, e.g. to watch a scene. The frames are "
+            "rarer while the conversation goes on.\n"
+            "Args:\n"
+            "  `fps`: Frames per second.\n"
+            "  `bitrate_kbps`: The upper bound of the stream, the JPEG quality drops to stay below it.\n"
+            "  `max_width`, `max_height`: The frames are scaled down to fit.\n"
+            "  `quality`: The highest JPEG quality of the frames.",
+            kStartStreamProperties);
+        AddTool(kStartStream,
+            [camera](const PropertyList& properties) -> ReturnValue {
+                StreamOptions options;
+                options.fps = properties["fps"].value<int>();
+                options.bitrate_kbps = properties["bitrate_kbps"].value<int>();
+                options.max_width = properties["max_width"].value<int>();
+                options.max_height = properties["max_height"].value<int>();
+                options.quality = properties["quality"].value<int>();
+                return camera->StartStreaming(options);
+            });
+
+        static constexpr auto kStopStream = McpToolSpecOf("self.camera.stop_stream", "Stop streaming the camera.");
+        AddTool(kStopStream,
+            [camera](const PropertyList& properties) -> ReturnValue {
+                camera->StopStreaming();
+                return true;
             });
+        // Waits for the frame being encoded
+        SetToolExecution("self.camera.stop_stream", kMcpToolWorker);
     }
 #endif
 
     // Restore the original tools list to the end of the tools list
+    std::lock_guard<std::mutex> lock(tools_mutex_);
     tools_.insert(tools_.end(), original_tools.begin(), original_tools.end());
+    UpdateToolsVersion();
 }
 
 void McpServer::AddUserOnlyTools() {
@@ -134,15 +335,344 @@ void McpServer::AddUserOnlyTools() {
             auto& board = Board::GetInstance();
             return board.GetSystemInfoJson();
         });
+    SetToolCacheTtl("self.get_system_info", CONFIG_MCP_STATUS_CACHE_TTL_MS);
+
+#if CONFIG_USE_AUDIO_LATENCY_TRACE
+    AddUserOnlyTool("self.audio.get_latency_stats",
+        "Get the rolling p50 / p95 / p99 latency of each audio pipeline stage, in microseconds",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& app = Application::GetInstance();
+            return app.GetAudioService().GetLatencyTracer().GetStatsJson();
+        });
+#endif
+
+    AddUserOnlyTool("self.audio.get_glitch_stats",
+        "Get the I2S underruns (the speaker DMA ran dry in a stream) and overruns (microphone samples lost) "
+        "since boot, with the DMA buffers missed and the last glitches: their age and duration in ms. "
+        "With the trace recorder on they show as i2s_underrun / i2s_overrun in the trace.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto stats = Board::GetInstance().GetAudioCodec()->GetGlitchStats();
+            int64_t now = esp_timer_get_time();
+            auto root = cJSON_CreateObject();
+            cJSON_AddNumberToObject(root, "underruns", stats.underruns);
+            cJSON_AddNumberToObject(root, "underrun_buffers", stats.underrun_buffers);
+            cJSON_AddNumberToObject(root, "overruns", stats.overruns);
+            cJSON_AddNumberToObject(root, "overrun_buffers", stats.overrun_buffers);
+            auto recent = cJSON_CreateArray();
+            for (auto& glitch : stats.recent) {
+                auto item = cJSON_CreateObject();
+                cJSON_AddStringToObject(item, "type", glitch.type == kAudioGlitchUnderrun ? "underrun" : "overrun");
+                cJSON_AddNumberToObject(item, "age_ms", (now - glitch.time_us) / 1000);
+                cJSON_AddNumberToObject(item, "buffers", glitch.buffers);
+                cJSON_AddNumberToObject(item, "duration_ms", glitch.duration_ms);
+                cJSON_AddItemToArray(recent, item);
+            }
+            cJSON_AddItemToObject(root, "recent", recent);
+            return root;
+        });
+
+#if CONFIG_USE_LOOPBACK_TEST
+    AddUserOnlyTool("self.audio.run_loopback_test",
+        "Play a chirp and measure when it comes back on the microphone: the output pipeline latency, "
+        "the speaker to microphone loop latency, the reference channel latency and its offset to the "
+        "microphone, in microseconds. A valid result calibrates the server AEC timestamps.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& audio_service = Application::GetInstance().GetAudioService();
+            LoopbackResult result;
+            audio_service.RunLoopbackTest(result);
+            auto root = cJSON_CreateObject();
+            cJSON_AddBoolToObject(root, "valid", result.valid);
+            cJSON_AddNumberToObject(root, "confidence", result.confidence);
+            // The stored calibration, the previous one after a failed run
+            auto calibration = audio_service.GetLoopbackCalibration();
+            cJSON_AddNumberToObject(root, "output_latency_us", calibration.output_latency_us);
+            cJSON_AddNumberToObject(root, "loop_us", calibration.loop_us);
+            cJSON_AddNumberToObject(root, "electrical_us", calibration.electrical_us);
+            cJSON_AddNumberToObject(root, "reference_offset_us", calibration.reference_offset_us);
+            return root;
+        });
+    SetToolExecution("self.audio.run_loopback_test", kMcpToolWorker);
+#endif
+
+    AddUserOnlyTool("self.audio.get_wake_word_stats",
+        "Get the wake word detections since boot: their count, the average and lowest confidence (MultiNet only), "
+        "the average and max time from the speech onset to the detection, the last detection, and how often the "
+        "energy gate in front of the engine let the audio through",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& app = Application::GetInstance();
+            auto stats = app.GetAudioService().GetWakeWordStats();
+            auto json = cJSON_CreateObject();
+            cJSON_AddNumberToObject(json, "detections", stats.detections);
+            if (stats.confidence_count > 0) {
+                cJSON_AddNumberToObject(json, "confidence_avg", stats.confidence_sum / stats.confidence_count);
+                cJSON_AddNumberToObject(json, "confidence_min", stats.confidence_min);
+            }
+            if (stats.onset_count > 0) {
+                cJSON_AddNumberToObject(json, "onset_ms_avg", (double)stats.onset_sum_ms / stats.onset_count);
+                cJSON_AddNumberToObject(json, "onset_ms_max", stats.onset_max_ms);
+            }
+            if (stats.detections > 0) {
+                auto last = cJSON_CreateObject();
+                cJSON_AddStringToObject(last, "wake_word", stats.last.wake_word.c_str());
+                cJSON_AddNumberToObject(last, "confidence", stats.last.confidence);
+                cJSON_AddNumberToObject(last, "onset_ms", stats.last.onset_ms);
+                cJSON_AddNumberToObject(last, "age_s", (esp_timer_get_time() - stats.last.time_us) / 1000000);
+                cJSON_AddItemToObject(json, "last", last);
+            }
+            if (stats.gate_chunks > 0) {
+                // The share of the idle audio the engine had to run on
+                auto gate = cJSON_CreateObject();
+                cJSON_AddNumberToObject(gate, "opened", stats.gate_opened);
+                cJSON_AddNumberToObject(gate, "duty_percent", 100.0 * std::min(stats.gate_fed_chunks, stats.gate_chunks) / stats.gate_chunks);
+                cJSON_AddItemToObject(json, "gate", gate);
+            }
+            return json;
+        });
+
+#if CONFIG_USE_AUDIO_PROCESSOR
+    // The profiles of the listening modes and the CPU each one took per chunk so far
+    auto get_afe_profiles = []() -> cJSON* {
+        auto& audio_service = Application::GetInstance().GetAudioService();
+        auto json = cJSON_CreateObject();
+        cJSON_AddStringToObject(json, "profile", AfeProfileName(audio_service.GetAfeProfile(false)));
+        cJSON_AddStringToObject(json, "realtime_profile", AfeProfileName(audio_service.GetAfeProfile(true)));
+        cJSON_AddStringToObject(json, "active", AfeProfileName(audio_service.GetActiveAfeProfile()));
+        auto costs = cJSON_CreateArray();
+        for (int i = 0; i < kAfeProfileCount; i++) {
+            auto cost = audio_service.GetAfeProfileCost((AfeProfile)i);
+            if (cost.chunks == 0) {
+                continue;
+            }
+            auto item = cJSON_CreateObject();
+            cJSON_AddStringToObject(item, "profile", AfeProfileName((AfeProfile)i));
+            cJSON_AddNumberToObject(item, "chunks", cost.chunks);
+            cJSON_AddNumberToObject(item, "chunk_ms", cost.chunk_ms);
+            cJSON_AddNumberToObject(item, "cpu_us_avg", (double)(cost.total_us / cost.chunks));
+            cJSON_AddNumberToObject(item, "cpu_us_max", cost.max_us);
+            if (cost.chunk_ms > 0) {
+                // Of one core
+                cJSON_AddNumberToObject(item, "cpu_percent", (double)(cost.total_us / cost.chunks) / (cost.chunk_ms * 10));
+            }
+            cJSON_AddItemToArray(costs, item);
+        }
+        cJSON_AddItemToObject(json, "costs", costs);
+        return json;
+    };
+
+    AddUserOnlyTool("self.audio.get_afe_profile",
+        "Get the AFE processing profile of the listening modes, the one running, and the measured CPU time "
+        "per processed chunk of each profile that ran since boot",
+        PropertyList(),
+        [get_afe_profiles](const PropertyList& properties) -> ReturnValue {
+            return get_afe_profiles();
+        });
+
+    AddUserOnlyTool("self.audio.set_afe_profile",
+        "Set the AFE processing profile, kept across reboots and applied at the next listening start.\n"
+        "Args:\n"
+        "  `profile`: \"low-power\", \"balanced\" or \"high-quality\", for the auto and manual stop modes. Empty keeps it.\n"
+        "  `realtime_profile`: The same for the realtime mode. Empty keeps it.",
+        PropertyList({
+            Property("profile", kPropertyTypeString, std::string("")),
+            Property("realtime_profile", kPropertyTypeString, std::string(""))
+        }),
+        [get_afe_profiles](const PropertyList& properties) -> ReturnValue {
+            auto& audio_service = Application::GetInstance().GetAudioService();
+            AfeProfile profiles[2] = {audio_service.GetAfeProfile(false), audio_service.GetAfeProfile(true)};
+            const char* keys[2] = {"profile", "realtime_profile"};
+            for (int i = 0; i < 2; i++) {
+                auto name = properties[keys[i]].value<std::string>();
+                if (name.empty()) {
+                    continue;
+                }
+                profiles[i] = AfeProfileFromName(name.c_str());
+                if (profiles[i] == kAfeProfileCount) {
+                    throw std::runtime_error("Unknown profile: " + name);
+                }
+            }
+            audio_service.SetAfeProfiles(profiles[0], profiles[1]);
+            return get_afe_profiles();
+        });
+#endif
+
+#if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
+    AddUserOnlyTool("self.audio.add_local_command",
+        "Add or replace a local command phrase of the MultiNet wake word, kept across reboots.\n"
+        "Args:\n"
+        "  `command`: The phrase as the model spells it (pinyin for Chinese models, e.g. \"ni hao xiao zhi\").\n"
+        "  `text`: The text reported when it is detected.\n"
+        "  `action`: \"wake\" makes the phrase a wake word, \"tool:<name>\" calls that tool on the device.\n"
+        "  `arguments`: The arguments of the tool, a JSON object.",
+        PropertyList({
+            Property("command", kPropertyTypeString),
+            Property("text", kPropertyTypeString),
+            Property("action", kPropertyTypeString, std::string("wake")),
+            Property("arguments", kPropertyTypeString, std::string("{}"))
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& app = Application::GetInstance();
+            if (!app.GetAudioService().AddWakeWordCommand(properties["command"].value<std::string>(),
+                    properties["text"].value<std::string>(), properties["action"].value<std::string>(),
+                    properties["arguments"].value<std::string>())) {
+                throw std::runtime_error("No MultiNet wake word, or the model rejected the phrase");
+            }
+            return true;
+        });
+
+    AddUserOnlyTool("self.audio.remove_local_command",
+        "Remove a local command phrase of the MultiNet wake word",
+        PropertyList({
+            Property("command", kPropertyTypeString)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& app = Application::GetInstance();
+            if (!app.GetAudioService().RemoveWakeWordCommand(properties["command"].value<std::string>())) {
+                throw std::runtime_error("No such command");
+            }
+            return true;
+        });
+#endif
+
+#if CONFIG_USE_MAIN_LOOP_PROFILER
+    AddUserOnlyTool("self.get_main_loop_stats",
+        "Get the number of slow and stalled main loop callbacks, and the slowest call sites with their average and max duration in microseconds",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& app = Application::GetInstance();
+            return app.GetLoopProfiler().GetStatsJson();
+        });
+#endif
+
+#if CONFIG_USE_TASK_CPU_SAMPLER
+    AddUserOnlyTool("self.get_task_cpu_usage",
+        "Get the load of each CPU core over the last minute, and the percentage of one core each task used: last sample, average and max",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return CpuSampler::GetInstance().GetStatsJson();
+        });
+#endif
+
+#if CONFIG_USE_HEAP_ACCOUNTING
+    AddUserOnlyTool("self.get_heap_stats",
+        "Get the live and peak heap bytes of each subsystem in internal RAM and PSRAM, and the free size, "
+        "largest free block and fragmentation of each heap with the largest free block over the last five minutes, "
+        "the internal RAM headroom against the memory budget, and the size, lowest free bytes and memory of each task stack",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto json = HeapAccounting::GetStatsJson();
+            cJSON_AddItemToObject(json, "budget", MemoryBudget::GetStatsJson());
+            cJSON_AddItemToObject(json, "stacks", TaskPlacements::GetStackStatsJson());
+            return json;
+        });
+#endif
+
+#if CONFIG_USE_LOG_RING
+    AddUserOnlyTool("self.get_recent_logs",
+        "Get the last log lines of the device, oldest first, and how many lines were dropped since boot",
+        PropertyList({
+            Property("max_bytes", kPropertyTypeInteger, 4096, 256, 16384)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& log_ring = LogRing::GetInstance();
+            auto json = cJSON_CreateObject();
+            cJSON_AddStringToObject(json, "logs", log_ring.GetRecent(properties["max_bytes"].value<int>()).c_str());
+            cJSON_AddNumberToObject(json, "dropped", log_ring.dropped());
+            return json;
+        });
+#endif
+
+#if CONFIG_USE_BLACK_BOX
+    AddUserOnlyTool("self.get_black_box",
+        "Get the performance record of the last abnormal reset (panic, watchdog, brownout) and of this boot: "
+        "samples of the heap, core load, busiest tasks, audio queues and glitches, the last state transitions, "
+        "the main loop callback running and the last failed allocation. `clear` erases the saved record.",
+        PropertyList({
+            Property("clear", kPropertyTypeBoolean, false)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& black_box = BlackBox::GetInstance();
+            std::string json;
+            JsonWriter writer(json);
+            writer.Object();
+            black_box.WriteSavedJson(writer, "saved");
+            black_box.WriteCurrentJson(writer, "current");
+            writer.EndObject();
+            if (properties["clear"].value<bool>()) {
+                black_box.ClearSaved();
+            }
+            return json;
+        });
+#endif
+
+#if CONFIG_USE_SESSION_CAPTURE
+    AddUserOnlyTool("self.get_session_stats",
+        "Get the counters of a session replay: the audio decode and playback queue depths with their "
+        "peaks, the jitter buffer, the playback starvation, the audio stage latencies, the UI update "
+        "latency and the capture records. With reset the peaks and the UI latency start again",
+        PropertyList({
+            Property("reset", kPropertyTypeBoolean, false)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            return SessionCapture::GetInstance().GetStatsJson(properties["reset"].value<bool>());
+        });
+#endif
+
+#if CONFIG_USE_NETWORK_BENCHMARK
+    AddUserOnlyTool("self.network.run_benchmark",
+        "Measure the network of the device against a URL: the connect time, the download throughput of the URL, "
+        "the round trip of the next requests on the kept connection (use a small resource), and with upload_kb "
+        "the throughput of a POST of that many KB",
+        PropertyList({
+            Property("url", kPropertyTypeString),
+            Property("rounds", kPropertyTypeInteger, 10, 1, 100),
+            Property("upload_kb", kPropertyTypeInteger, 0, 0, 1024)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            return NetworkBenchmark::Run(properties["url"].value<std::string>(),
+                properties["rounds"].value<int>(), properties["upload_kb"].value<int>());
+        });
+    SetToolExecution("self.network.run_benchmark", kMcpToolWorker, 120000);
+#endif
+
+#if CONFIG_USE_PERFORMANCE_PROFILES
+    AddUserOnlyTool("self.power.get_performance_profile",
+        "Get the performance profile (performance, balanced or saver), whether it is pinned, and the "
+        "power source and battery level it was chosen from",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return PerformanceProfileManager::GetInstance().GetStatusJson();
+        });
+
+    AddUserOnlyTool("self.power.set_performance_profile",
+        "Pin the performance profile, kept across reboots.\n"
+        "Args:\n"
+        "  `profile`: \"performance\", \"balanced\", \"saver\", or \"auto\" to follow the power source again",
+        PropertyList({
+            Property("profile", kPropertyTypeString)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto name = properties["profile"].value<std::string>();
+            auto profile = PerformanceProfileFromName(name.c_str());
+            if (profile == kPerformanceProfileCount && name != "auto") {
+                throw std::runtime_error("Unknown profile: " + name);
+            }
+            auto& manager = PerformanceProfileManager::GetInstance();
+            manager.SetOverride(profile);
+            return manager.GetStatusJson();
+        });
+#endif
 
     AddUserOnlyTool("self.reboot", "Reboot the system",
         PropertyList(),
         [this](const PropertyList& properties) -> ReturnValue {
             auto& app = Application::GetInstance();
-            app.Schedule([&app]() {
-                ESP_LOGW(TAG, "User requested reboot");
-                vTaskDelay(pdMS_TO_TICKS(1000));
-
+            ESP_LOGW(TAG, "User requested reboot");
+            // Leaves a second for the reply to go out, without blocking the main loop
+            app.ScheduleAfter(1000, [&app]() {
                 app.Reboot();
             });
             return true;
@@ -157,18 +687,14 @@ void McpServer::AddUserOnlyTools() {
             auto url = properties["url"].value<std::string>();
             ESP_LOGI(TAG, "User requested firmware upgrade from URL: %s", url.c_str());
             
-            auto& app = Application::GetInstance();
-            app.Schedule([url, &app]() {
-                auto ota = std::make_unique<Ota>();
-                
-                bool success = app.UpgradeFirmware(*ota, url);
-                if (!success) {
-                    ESP_LOGE(TAG, "Firmware upgrade failed");
-                }
-            });
-            
+            // Runs on its own task, the device reboots without a reply when it succeeds
+            Ota ota;
+            if (!Application::GetInstance().UpgradeFirmware(ota, url)) {
+                throw std::runtime_error("Firmware upgrade failed");
+            }
             return true;
         });
+    SetToolExecution("self.upgrade_firmware", kMcpToolLongRunning);
 
     // Display control
 #ifdef HAVE_LVGL
@@ -185,6 +711,10 @@ void McpServer::AddUserOnlyTools() {
                 } else {
                     cJSON_AddBoolToObject(json, "monochrome", false);
                 }
+                auto heap = LvglHeap::GetStatsJson();
+                if (heap != nullptr) {
+                    cJSON_AddItemToObject(json, "lvgl_heap", heap);
+                }
                 return json;
             });
 
@@ -198,21 +728,17 @@ void McpServer::AddUserOnlyTools() {
                 auto url = properties["url"].value<std::string>();
                 auto quality = properties["quality"].value<int>();
 
-                std::string jpeg_data;
-                if (!display->SnapshotToJpeg(jpeg_data, quality)) {
-                    throw std::runtime_error("Failed to snapshot screen");
-                }
-
-                ESP_LOGI(TAG, "Upload snapshot %u bytes to %s", jpeg_data.size(), url.c_str());
-                
-                // 构造multipart/form-data请求体
+                // 构造multipart/form-data请求体，JPEG边编码边以分块传输上传
                 std::string boundary = "----ESP32_SCREEN_SNAPSHOT_BOUNDARY";
                 
                 auto http = Board::GetInstance().GetNetwork()->CreateHttp(3);
                 http->SetHeader("Content-Type", "multipart/form-data; boundary=" + boundary);
+                http->SetHeader("Transfer-Encoding", "chunked");
                 if (!http->Open("POST", url)) {
                     throw std::runtime_error("Failed to open URL: " + url);
                 }
+                // The encoder hands over small pieces, they go out in full chunks
+                HttpWriteBatcher body(http.get());
                 {
                     // 文件字段头部
                     std::string file_header;
@@ -220,19 +746,28 @@ void McpServer::AddUserOnlyTools() {
                     file_header += "Content-Disposition: form-data; name=\"file\"; filename=\"screenshot.jpg\"\r\n";
                     file_header += "Content-Type: image/jpeg\r\n";
                     file_header += "\r\n";
-                    http->Write(file_header.c_str(), file_header.size());
+                    body.Write(file_header);
                 }
 
                 // JPEG数据
-                http->Write((const char*)jpeg_data.data(), jpeg_data.size());
+                size_t total_sent = 0;
+                bool encoded = display->SnapshotToJpeg([&body, &total_sent](const char* data, size_t length) {
+                    body.Write(data, length);
+                    total_sent += length;
+                }, quality);
+                if (!encoded) {
+                    http->Close();
+                    throw std::runtime_error("Failed to snapshot screen");
+                }
+                ESP_LOGI(TAG, "Uploaded snapshot %u bytes to %s", total_sent, url.c_str());
 
                 {
                     // multipart尾部
                     std::string multipart_footer;
                     multipart_footer += "\r\n--" + boundary + "--\r\n";
-                    http->Write(multipart_footer.c_str(), multipart_footer.size());
+                    body.Write(multipart_footer);
                 }
-                http->Write("", 0);
+                body.Finish();
 
                 if (http->GetStatusCode() != 200) {
                     throw std::runtime_error("Unexpected status code: " + std::to_string(http->GetStatusCode()));
@@ -242,6 +777,7 @@ void McpServer::AddUserOnlyTools() {
                 ESP_LOGI(TAG, "Snapshot screen result: %s", result.c_str());
                 return true;
             });
+        SetToolExecution("self.screen.snapshot", kMcpToolWorker);
         
         AddUserOnlyTool("self.screen.preview_image", "Preview an image on the screen",
             PropertyList({
@@ -260,7 +796,7 @@ void McpServer::AddUserOnlyTools() {
                 }
 
                 size_t content_length = http->GetBodyLength();
-                char* data = (char*)heap_caps_malloc(content_length, MALLOC_CAP_8BIT);
+                char* data = (char*)HeapAccounting::Place(kHeapTagDisplay, content_length, kHeapPlacementPsram);
                 if (data == nullptr) {
                     throw std::runtime_error("Failed to allocate memory for image: " + url);
                 }
@@ -268,7 +804,7 @@ void McpServer::AddUserOnlyTools() {
                 while (total_read < content_length) {
                     int ret = http->Read(data + total_read, content_length - total_read);
                     if (ret < 0) {
-                        heap_caps_free(data);
+                        HeapAccounting::Free(kHeapTagDisplay, data);
                         throw std::runtime_error("Failed to download image: " + url);
                     }
                     if (ret == 0) {
@@ -278,12 +814,44 @@ void McpServer::AddUserOnlyTools() {
                 }
                 http->Close();
 
-                auto image = std::make_unique<LvglAllocatedImage>(data, content_length);
+                // A JPEG is decoded here at about the preview size, the rest is left to the LVGL decoders
+                std::unique_ptr<LvglImage> image;
+                if (IsJpeg(reinterpret_cast<const uint8_t*>(data), total_read)) {
+                    image = DecodeJpegToFit(reinterpret_cast<const uint8_t*>(data), total_read,
+                        display->width() * 70 / 100, display->height() * 50 / 100);
+                }
+                if (image != nullptr) {
+                    HeapAccounting::Free(kHeapTagDisplay, data);
+                } else {
+                    image = std::make_unique<LvglAllocatedImage>(data, total_read);
+                }
                 display->SetPreviewImage(std::move(image));
                 return true;
             });
+        SetToolExecution("self.screen.preview_image", kMcpToolWorker);
 #endif // CONFIG_LV_USE_SNAPSHOT
     }
+#else
+    auto emote_display = dynamic_cast<emote::EmoteDisplay*>(Board::GetInstance().GetDisplay());
+    if (emote_display) {
+        AddUserOnlyTool("self.screen.get_info", "Information about the screen, including width, height, "
+            "and the rendered and skipped frames of the animation",
+            PropertyList(),
+            [emote_display](const PropertyList& properties) -> ReturnValue {
+                cJSON *json = cJSON_CreateObject();
+                cJSON_AddNumberToObject(json, "width", emote_display->width());
+                cJSON_AddNumberToObject(json, "height", emote_display->height());
+                cJSON_AddBoolToObject(json, "monochrome", false);
+                auto stats = emote_display->GetFrameStats();
+                cJSON *frames = cJSON_CreateObject();
+                cJSON_AddNumberToObject(frames, "rendered", stats.rendered);
+                cJSON_AddNumberToObject(frames, "late", stats.late);
+                cJSON_AddNumberToObject(frames, "throttled", stats.throttled);
+                cJSON_AddNumberToObject(frames, "fps_divider", stats.fps_divider);
+                cJSON_AddItemToObject(json, "frames", frames);
+                return json;
+            });
+    }
 #endif // HAVE_LVGL
 
     // Assets download url
@@ -303,14 +871,71 @@ void McpServer::AddUserOnlyTools() {
 }
 
 void McpServer::AddTool(McpTool* tool) {
-    // Prevent adding duplicate tools
-    if (std::find_if(tools_.begin(), tools_.end(), [tool](const McpTool* t) { return t->name() == tool->name(); }) != tools_.end()) {
-        ESP_LOGW(TAG, "Tool %s already added", tool->name().c_str());
-        return;
+    {
+        std::lock_guard<std::mutex> lock(tools_mutex_);
+        // Prevent adding duplicate tools
+        if (!tool_index_.emplace(tool->name(), tool).second) {
+            ESP_LOGW(TAG, "Tool %s already added", tool->name());
+            return;
+        }
+
+        ESP_LOGI(TAG, "Add tool: %s%s", tool->name(), tool->user_only() ? " [user]" : "");
+        tools_.push_back(tool);
+        UpdateToolsVersion();
+    }
+    NotifyToolsChanged();
+}
+
+bool McpServer::SetToolEnabled(const std::string& name, bool enabled) {
+    {
+        std::lock_guard<std::mutex> lock(tools_mutex_);
+        auto it = tool_index_.find(name);
+        if (it == tool_index_.end()) {
+            ESP_LOGW(TAG, "Tool %s not found", name.c_str());
+            return false;
+        }
+        if (it->second->enabled() == enabled) {
+            return true;
+        }
+        ESP_LOGI(TAG, "%s tool: %s", enabled ? "Enable" : "Disable", name.c_str());
+        it->second->set_enabled(enabled);
+        UpdateToolsVersion();
     }
+    NotifyToolsChanged();
+    return true;
+}
+
+McpTool* McpServer::FindTool(const std::string& name) {
+    std::lock_guard<std::mutex> lock(tools_mutex_);
+    auto it = tool_index_.find(name);
+    return it == tool_index_.end() ? nullptr : it->second;
+}
+
+void McpServer::UpdateToolsVersion() {
+    // Order sensitive, the order of tools/list matters to the prompt cache of the server
+    uint32_t version = 2166136261u;
+    for (auto tool : tools_) {
+        if (tool->enabled()) {
+            version = (version ^ tool->json_hash()) * 16777619u;
+        }
+    }
+    tools_version_.store(version, std::memory_order_relaxed);
+}
 
-    ESP_LOGI(TAG, "Add tool: %s%s", tool->name().c_str(), tool->user_only() ? " [user]" : "");
-    tools_.push_back(tool);
+void McpServer::NotifyToolsChanged() {
+    if (!tools_listed_) {
+        return;
+    }
+    // A burst of changes, like a board adding its tools one by one, is one notification
+    if (tools_notify_pending_.exchange(true)) {
+        return;
+    }
+    Application::GetInstance().Schedule([this]() {
+        tools_notify_pending_ = false;
+        std::string payload = "{\"jsonrpc\":\"2.0\",\"method\":\"notifications/tools/list_changed\","
+            "\"params\":{\"_meta\":{\"toolsVersion\":" + std::to_string(GetToolsVersion()) + "}}}";
+        Application::GetInstance().SendMcpNotification(std::move(payload));
+    });
 }
 
 void McpServer::AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
@@ -323,7 +948,12 @@ void McpServer::AddUserOnlyTool(const std::string& name, const std::string& desc
     AddTool(tool);
 }
 
+void McpServer::AddTool(const McpToolSpec& spec, std::function<ReturnValue(const PropertyList&)> callback) {
+    AddTool(new McpTool(spec, std::move(callback)));
+}
+
 void McpServer::ParseMessage(const std::string& message) {
+    JsonArena::Scope arena;
     cJSON* json = cJSON_Parse(message.c_str());
     if (json == nullptr) {
         ESP_LOGE(TAG, "Failed to parse MCP message: %s", message.c_str());
@@ -353,6 +983,11 @@ void McpServer::ParseCapabilities(const cJSON* capabilities) {
 }
 
 void McpServer::ParseMessage(const cJSON* json) {
+    if (cJSON_IsArray(json)) {
+        ParseBatch(json);
+        return;
+    }
+
     // Check JSONRPC version
     auto version = cJSON_GetObjectItem(json, "jsonrpc");
     if (version == nullptr || !cJSON_IsString(version) || strcmp(version->valuestring, "2.0") != 0) {
@@ -368,9 +1003,6 @@ void McpServer::ParseMessage(const cJSON* json) {
     }
     
     auto method_str = std::string(method->valuestring);
-    if (method_str.find("notifications") == 0) {
-        return;
-    }
     
     // Check params
     auto params = cJSON_GetObjectItem(json, "params");
@@ -379,6 +1011,13 @@ void McpServer::ParseMessage(const cJSON* json) {
         return;
     }
 
+    if (method_str.find("notifications") == 0) {
+        if (method_str == "notifications/cancelled" && params != nullptr) {
+            CancelCall(params);
+        }
+        return;
+    }
+
     auto id = cJSON_GetObjectItem(json, "id");
     if (id == nullptr || !cJSON_IsNumber(id)) {
         ESP_LOGE(TAG, "Invalid id for method: %s", method_str.c_str());
@@ -394,10 +1033,12 @@ void McpServer::ParseMessage(const cJSON* json) {
             }
         }
         auto app_desc = esp_app_get_description();
-        std::string message = "{\"protocolVersion\":\"2024-11-05\",\"capabilities\":{\"tools\":{}},\"serverInfo\":{\"name\":\"" BOARD_NAME "\",\"version\":\"";
+        std::string message = "{\"protocolVersion\":\"2024-11-05\",\"capabilities\":{\"tools\":{\"listChanged\":true}},\"serverInfo\":{\"name\":\"" BOARD_NAME "\",\"version\":\"";
         message += app_desc->version;
-        message += "\"}}";
-        ReplyResult(id_int, message);
+        message += "\"},\"_meta\":{\"toolsVersion\":";
+        message += std::to_string(GetToolsVersion());
+        message += "}}";
+        ReplyResult(id_int, std::move(message));
     } else if (method_str == "tools/list") {
         std::string cursor_str = "";
         bool list_user_only_tools = false;
@@ -437,12 +1078,10 @@ void McpServer::ParseMessage(const cJSON* json) {
     }
 }
 
-void McpServer::ReplyResult(int id, const std::string& result) {
-    std::string payload = "{\"jsonrpc\":\"2.0\",\"id\":";
-    payload += std::to_string(id) + ",\"result\":";
-    payload += result;
-    payload += "}";
-    Application::GetInstance().SendMcpMessage(payload);
+void McpServer::ReplyResult(int id, std::string result) {
+    result.insert(0, "{\"jsonrpc\":\"2.0\",\"id\":" + std::to_string(id) + ",\"result\":");
+    result += "}";
+    SendReply(std::move(result));
 }
 
 void McpServer::ReplyError(int id, const std::string& message) {
@@ -451,100 +1090,132 @@ void McpServer::ReplyError(int id, const std::string& message) {
     payload += ",\"error\":{\"message\":\"";
     payload += message;
     payload += "\"}}";
-    Application::GetInstance().SendMcpMessage(payload);
+    SendReply(std::move(payload));
+}
+
+void McpServer::SendReply(std::string payload) {
+    if (current_batch_ == nullptr) {
+        Application::GetInstance().SendMcpMessage(std::move(payload));
+        return;
+    }
+    std::lock_guard<std::mutex> lock(current_batch_->mutex);
+    current_batch_->replies += current_batch_->replies.empty() ? "[" : ",";
+    current_batch_->replies += payload;
+}
+
+McpServer::Batch::~Batch() {
+    // A batch of notifications gets no reply
+    if (!replies.empty()) {
+        replies += "]";
+        Application::GetInstance().SendMcpMessage(std::move(replies));
+    }
+}
+
+McpServer::BatchScope::BatchScope(std::shared_ptr<Batch> batch) : batch_(std::move(batch)), previous_(current_batch_) {
+    current_batch_ = batch_.get();
+}
+
+McpServer::BatchScope::~BatchScope() {
+    current_batch_ = previous_;
+}
+
+void McpServer::ParseBatch(const cJSON* json) {
+    if (cJSON_GetArraySize(json) == 0) {
+        ESP_LOGE(TAG, "Empty batch");
+        Application::GetInstance().SendMcpMessage("{\"jsonrpc\":\"2.0\",\"id\":null,\"error\":{\"message\":\"Empty batch\"}}");
+        return;
+    }
+
+    // The requests run in order, the calls that finish later keep the batch until they reply
+    auto batch = std::make_shared<Batch>();
+    {
+        BatchScope scope(batch);
+        const cJSON* item;
+        cJSON_ArrayForEach(item, json) {
+            if (!cJSON_IsObject(item)) {
+                ESP_LOGE(TAG, "Invalid batch item");
+                continue;
+            }
+            ParseMessage(item);
+        }
+    }
+
+    if (!batch->main_thread_calls.empty()) {
+        Application::GetInstance().Schedule([calls = std::move(batch->main_thread_calls)]() mutable {
+            for (auto& call : calls) {
+                call();
+            }
+        });
+    }
 }
 
 void McpServer::GetToolsList(int id, const std::string& cursor, bool list_user_only_tools) {
     const int max_payload_size = 8000;
     std::string json = "{\"tools\":[";
+    json.reserve(max_payload_size);
+    tools_listed_ = true;
+    std::unique_lock<std::mutex> lock(tools_mutex_);
     
-    bool found_cursor = cursor.empty();
+    // The page starts at the cursor tool, an unknown cursor gives an empty page
     auto it = tools_.begin();
+    if (!cursor.empty()) {
+        auto cursor_iter = tool_index_.find(cursor);
+        it = cursor_iter == tool_index_.end() ? tools_.end() : std::find(tools_.begin(), tools_.end(), cursor_iter->second);
+    }
     std::string next_cursor = "";
     
-    while (it != tools_.end()) {
-        // 如果我们还没有找到起始位置，继续搜索
-        if (!found_cursor) {
-            if ((*it)->name() == cursor) {
-                found_cursor = true;
-            } else {
-                ++it;
-                continue;
-            }
-        }
-
-        if (!list_user_only_tools && (*it)->user_only()) {
-            ++it;
+    for (; it != tools_.end(); ++it) {
+        if ((!list_user_only_tools && (*it)->user_only()) || !(*it)->enabled()) {
             continue;
         }
         
-        // 添加tool前检查大小
-        std::string tool_json = (*it)->to_json() + ",";
-        if (json.length() + tool_json.length() + 30 > max_payload_size) {
+        // 添加tool后检查大小, the entries of the spec tools are written from flash here
+        size_t length = json.length();
+        (*it)->AppendJson(json);
+        if (json.length() + 31 > max_payload_size) {
             // 如果添加这个tool会超出大小限制，设置next_cursor并退出循环
+            json.resize(length);
             next_cursor = (*it)->name();
             break;
         }
-        
-        json += tool_json;
-        ++it;
     }
     
-    if (json.back() == ',') {
-        json.pop_back();
-    }
-    
-    if (json.back() == '[' && !tools_.empty()) {
+    // Not even the first tool of the page fits
+    bool empty_page = json.back() == '[' && !next_cursor.empty();
+    lock.unlock();
+    if (empty_page) {
         // 如果没有添加任何tool，返回错误
         ESP_LOGE(TAG, "tools/list: Failed to add tool %s because of payload size limit", next_cursor.c_str());
         ReplyError(id, "Failed to add tool " + next_cursor + " because of payload size limit");
         return;
     }
 
+    json += "],\"_meta\":{\"toolsVersion\":" + std::to_string(GetToolsVersion()) + "}";
     if (next_cursor.empty()) {
-        json += "]}";
+        json += "}";
     } else {
-        json += "],\"nextCursor\":\"" + next_cursor + "\"}";
+        json += ",\"nextCursor\":\"" + next_cursor + "\"}";
     }
     
-    ReplyResult(id, json);
+    ReplyResult(id, std::move(json));
 }
 
 void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments) {
-    auto tool_iter = std::find_if(tools_.begin(), tools_.end(), 
-                                 [&tool_name](const McpTool* tool) { 
-                                     return tool->name() == tool_name; 
-                                 });
-    
-    if (tool_iter == tools_.end()) {
+    McpTool* tool = FindTool(tool_name);
+    if (tool == nullptr || !tool->enabled()) {
         ESP_LOGE(TAG, "tools/call: Unknown tool: %s", tool_name.c_str());
         ReplyError(id, "Unknown tool: " + tool_name);
         return;
     }
 
-    PropertyList arguments = (*tool_iter)->properties();
+    // Only the values are per call
+    PropertyList arguments = tool->arguments();
     try {
-        for (auto& argument : arguments) {
-            bool found = false;
-            if (cJSON_IsObject(tool_arguments)) {
-                auto value = cJSON_GetObjectItem(tool_arguments, argument.name().c_str());
-                if (argument.type() == kPropertyTypeBoolean && cJSON_IsBool(value)) {
-                    argument.set_value<bool>(value->valueint == 1);
-                    found = true;
-                } else if (argument.type() == kPropertyTypeInteger && cJSON_IsNumber(value)) {
-                    argument.set_value<int>(value->valueint);
-                    found = true;
-                } else if (argument.type() == kPropertyTypeString && cJSON_IsString(value)) {
-                    argument.set_value<std::string>(value->valuestring);
-                    found = true;
-                }
-            }
-
-            if (!argument.has_default_value() && !found) {
-                ESP_LOGE(TAG, "tools/call: Missing valid argument: %s", argument.name().c_str());
-                ReplyError(id, "Missing valid argument: " + argument.name());
-                return;
-            }
+        auto missing = arguments.Bind(tool_arguments);
+        if (missing != nullptr) {
+            ESP_LOGE(TAG, "tools/call: Missing valid argument: %s", missing->name().c_str());
+            ReplyError(id, "Missing valid argument: " + missing->name());
+            return;
         }
     } catch (const std::exception& e) {
         ESP_LOGE(TAG, "tools/call: %s", e.what());
@@ -552,14 +1223,232 @@ void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* to
         return;
     }
 
-    // Use main thread to call the tool
     auto& app = Application::GetInstance();
-    app.Schedule([this, id, tool_iter, arguments = std::move(arguments)]() {
+    auto batch = current_batch_ != nullptr ? current_batch_->shared_from_this() : nullptr;
+    if (tool->execution() == kMcpToolMainThread) {
+        // Use main thread to call the tool
+        ScheduledTask task([this, id, tool, arguments = std::move(arguments), batch]() {
+            BatchScope scope(batch);
+            try {
+                ReplyResult(id, CallTool(tool, arguments));
+            } catch (const std::exception& e) {
+                ESP_LOGE(TAG, "tools/call: %s", e.what());
+                ReplyError(id, e.what());
+            }
+        });
+        task.set_site(CallSite::Here());
+        if (batch) {
+            batch->main_thread_calls.push_back(std::move(task));
+        } else {
+            app.Schedule(std::move(task));
+        }
+        return;
+    }
+
+    auto call = std::make_shared<PendingCall>();
+    call->id = id;
+    call->batch = batch;
+    {
+        std::lock_guard<std::mutex> lock(calls_mutex_);
+        pending_calls_[id] = call;
+    }
+    // Armed before the submit, a fast job finds the timer to cancel when it finishes
+    if (tool->execution() == kMcpToolWorker && tool->timeout_ms() > 0) {
+        call->timer = app.ScheduleAfter(tool->timeout_ms(), [this, call, tool]() {
+            if (!call->finished.exchange(true)) {
+                ESP_LOGW(TAG, "tools/call: %s timed out", tool->name());
+                BatchScope scope(std::move(call->batch));
+                ReplyError(call->id, std::string("Tool call timed out: ") + tool->name());
+            }
+        });
+    }
+    auto job = [this, call, tool, arguments = std::move(arguments)]() {
+        RunPendingCall(call, tool, arguments);
+    };
+    bool started = tool->execution() == kMcpToolWorker ? pool_.Submit(std::move(job)) : pool_.RunLongRunning(std::move(job));
+    if (!started) {
+        call->finished = true;
+        call->batch.reset();
+        FinishPendingCall(*call);
+        ESP_LOGE(TAG, "tools/call: %s is busy", tool_name.c_str());
+        ReplyError(id, "Too many tool calls in progress: " + tool_name);
+        return;
+    }
+}
+
+void McpServer::RunPendingCall(std::shared_ptr<PendingCall> call, McpTool* tool, const PropertyList& arguments) {
+    // Cancelled or timed out while it was queued
+    if (!call->finished) {
+        std::string result;
+        std::string error;
+        current_call_ = call.get();
         try {
-            ReplyResult(id, (*tool_iter)->Call(arguments));
+            result = CallTool(tool, arguments);
         } catch (const std::exception& e) {
-            ESP_LOGE(TAG, "tools/call: %s", e.what());
-            ReplyError(id, e.what());
+            error = e.what();
         }
-    });
+        current_call_ = nullptr;
+
+        if (call->finished.exchange(true)) {
+            ESP_LOGW(TAG, "tools/call: %s finished after it was cancelled or timed out", tool->name());
+        } else {
+            BatchScope scope(std::move(call->batch));
+            if (error.empty()) {
+                ReplyResult(call->id, std::move(result));
+            } else {
+                ESP_LOGE(TAG, "tools/call: %s", error.c_str());
+                ReplyError(call->id, error);
+            }
+        }
+    }
+    FinishPendingCall(*call);
+}
+
+void McpServer::FinishPendingCall(PendingCall& call) {
+    uint32_t timer = call.timer.exchange(0);
+    if (timer != 0) {
+        Application::GetInstance().CancelTimer(timer);
+    }
+    std::lock_guard<std::mutex> lock(calls_mutex_);
+    auto it = pending_calls_.find(call.id);
+    if (it != pending_calls_.end() && it->second.get() == &call) {
+        pending_calls_.erase(it);
+    }
+}
+
+void McpServer::CancelCall(const cJSON* params) {
+    auto request_id = cJSON_GetObjectItem(params, "requestId");
+    if (!cJSON_IsNumber(request_id)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(calls_mutex_);
+    auto it = pending_calls_.find(request_id->valueint);
+    if (it == pending_calls_.end()) {
+        return;
+    }
+    // A cancelled request gets no reply, a running tool may stop early through IsCallCancelled()
+    if (!it->second->finished.exchange(true)) {
+        it->second->batch.reset();
+    }
+    ESP_LOGI(TAG, "tools/call %d cancelled", request_id->valueint);
+}
+
+void McpServer::SetToolExecution(const std::string& name, McpToolExecution execution, int timeout_ms) {
+    McpTool* tool = FindTool(name);
+    if (tool == nullptr) {
+        ESP_LOGW(TAG, "Tool %s not found", name.c_str());
+        return;
+    }
+    tool->set_execution(execution, execution == kMcpToolWorker ? timeout_ms : 0);
+}
+
+void McpServer::SetToolCacheTtl(const std::string& name, int ttl_ms) {
+    McpTool* tool = FindTool(name);
+    if (tool == nullptr) {
+        ESP_LOGW(TAG, "Tool %s not found", name.c_str());
+        return;
+    }
+    if (tool->has_properties()) {
+        ESP_LOGW(TAG, "Tool %s takes arguments, not cached", name.c_str());
+        return;
+    }
+    tool->set_cache_ttl(ttl_ms);
+}
+
+std::string McpServer::CallTool(McpTool* tool, const PropertyList& arguments) {
+    if (tool->cache_ttl_ms() <= 0) {
+        // Whatever the tool changed may show in the cached results
+        cache_generation_++;
+        return tool->Call(arguments);
+    }
+
+    uint32_t generation = cache_generation_ + Settings::generation();
+    int64_t now_us = esp_timer_get_time();
+    std::string result;
+    if (tool->GetCachedResult(generation, now_us, result)) {
+        return result;
+    }
+    result = tool->Call(arguments);
+    tool->CacheResult(generation, now_us, result);
+    return result;
+}
+
+void McpServer::CallLocalTool(const std::string& name, const std::string& arguments, const std::string& text) {
+    McpTool* tool = FindTool(name);
+    if (tool == nullptr || !tool->enabled()) {
+        ESP_LOGE(TAG, "Local command %s: Unknown tool: %s", text.c_str(), name.c_str());
+        return;
+    }
+
+    PropertyList bound = tool->arguments();
+    cJSON* json = cJSON_Parse(arguments.c_str());
+    const Property* missing = nullptr;
+    try {
+        missing = bound.Bind(json);
+    } catch (const std::exception& e) {
+        ESP_LOGE(TAG, "Local command %s: %s", text.c_str(), e.what());
+        cJSON_Delete(json);
+        return;
+    }
+    cJSON_Delete(json);
+    if (missing != nullptr) {
+        ESP_LOGE(TAG, "Local command %s: Missing valid argument: %s", text.c_str(), missing->name().c_str());
+        return;
+    }
+
+    auto job = [this, tool, bound = std::move(bound), arguments, text]() {
+        int64_t start_us = esp_timer_get_time();
+        bool success = true;
+        std::string result;
+        try {
+            result = CallTool(tool, bound);
+        } catch (const std::exception& e) {
+            success = false;
+            result = e.what();
+        }
+        int64_t duration_us = esp_timer_get_time() - start_us;
+        ESP_LOGI(TAG, "Local command %s: %s %s in %lld us", text.c_str(), tool->name(),
+            success ? "done" : "failed", duration_us);
+        NotifyLocalToolCall(text, tool->name(), arguments, success, result, duration_us);
+    };
+    if (tool->execution() == kMcpToolMainThread) {
+        job();
+        return;
+    }
+    bool started = tool->execution() == kMcpToolWorker ? pool_.Submit(std::move(job)) : pool_.RunLongRunning(std::move(job));
+    if (!started) {
+        ESP_LOGE(TAG, "Local command %s: No worker for %s", text.c_str(), name.c_str());
+    }
+}
+
+// A log message of the MCP spec, so a server that does not know about local commands ignores it
+void McpServer::NotifyLocalToolCall(const std::string& text, const std::string& name, const std::string& arguments,
+        bool success, const std::string& result, int64_t duration_us) {
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "jsonrpc", "2.0");
+    cJSON_AddStringToObject(root, "method", "notifications/message");
+    cJSON* params = cJSON_AddObjectToObject(root, "params");
+    cJSON_AddStringToObject(params, "level", success ? "info" : "error");
+    cJSON_AddStringToObject(params, "logger", "local_command");
+    cJSON* data = cJSON_AddObjectToObject(params, "data");
+    cJSON_AddStringToObject(data, "text", text.c_str());
+    cJSON_AddStringToObject(data, "tool", name.c_str());
+    cJSON* args = cJSON_Parse(arguments.c_str());
+    cJSON_AddItemToObject(data, "arguments", args != nullptr ? args : cJSON_CreateObject());
+    cJSON* parsed = success ? cJSON_Parse(result.c_str()) : nullptr;
+    if (parsed != nullptr) {
+        cJSON_AddItemToObject(data, "result", parsed);
+    } else {
+        cJSON_AddStringToObject(data, "error", result.c_str());
+    }
+    cJSON_AddNumberToObject(data, "duration_us", duration_us);
+    char* json = cJSON_PrintUnformatted(root);
+    std::string payload(json);
+    cJSON_free(json);
+    cJSON_Delete(root);
+    Application::GetInstance().SendMcpNotification(std::move(payload));
+}
+
+bool McpServer::IsCallCancelled() {
+    return current_call_ != nullptr && current_call_->finished;
 }
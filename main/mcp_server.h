@@ -2,47 +2,69 @@
 #define MCP_SERVER_H
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <memory>
 #include <functional>
 #include <variant>
 #include <optional>
 #include <stdexcept>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <cstring>
 #include <mbedtls/base64.h>
 
 #include <cJSON.h>
 
+#include "mcp_tool_pool.h"
+#include "scheduled_task.h"
+#include "shared_buffer.h"
+
+// Spare capacity for the JSON-RPC and protocol envelopes, inserted around a large reply in place
+constexpr size_t kMcpMessageHeadroom = 256;
+
 class ImageContent {
 private:
-    std::string encoded_data_;
     std::string mime_type_;
+    // Shared with the producer of the image, e.g. the chunks of a photo, and not copied again
+    BufferSlice data_;
 
-    static std::string Base64Encode(const std::string& data) {
-        size_t dlen = 0, olen = 0;
-        mbedtls_base64_encode((unsigned char*)nullptr, 0, &dlen, (const unsigned char*)data.data(), data.size());
-        std::string result(dlen, 0);
-        mbedtls_base64_encode((unsigned char*)result.data(), result.size(), &olen, (const unsigned char*)data.data(), data.size());
-        return result;
-    }
+    // The image JSON is a string value in the tool result, so its quotes are escaped
+    static constexpr const char* kJsonHead = "{\\\"type\\\":\\\"image\\\",\\\"mimeType\\\":\\\"";
+    static constexpr const char* kJsonData = "\\\",\\\"data\\\":\\\"";
+    static constexpr const char* kJsonTail = "\\\"}";
 
 public:
-    ImageContent(const std::string& mime_type, const std::string& data) {
-        mime_type_ = mime_type;
-        // base64 encode data
-        encoded_data_ = Base64Encode(data);
+    ImageContent(const std::string& mime_type, BufferSlice data)
+        : mime_type_(mime_type), data_(std::move(data)) {}
+    ImageContent(const std::string& mime_type, const std::string& data) : mime_type_(mime_type) {
+        auto buffer = SharedBuffer::Allocate(kHeapTagJson, data.size(), kHeapPlacementPsram);
+        if (!buffer) {
+            throw std::bad_alloc();
+        }
+        memcpy(buffer.data(), data.data(), data.size());
+        data_ = BufferSlice(std::move(buffer), 0, data.size());
     }
 
-    std::string to_json() const {
-        cJSON *json = cJSON_CreateObject();
-        cJSON_AddStringToObject(json, "type", "image");
-        cJSON_AddStringToObject(json, "mimeType", mime_type_.c_str());
-        cJSON_AddStringToObject(json, "data", encoded_data_.c_str());
-        char* json_str = cJSON_PrintUnformatted(json);
-        std::string result(json_str);
-        cJSON_free(json_str);
-        cJSON_Delete(json);
-        return result;
+    size_t json_size() const {
+        return strlen(kJsonHead) + mime_type_.size() + strlen(kJsonData) + 4 * ((data_.size() + 2) / 3) + strlen(kJsonTail);
+    }
+
+    // Base64 encodes the image straight into out, there is no other copy of the encoded data
+    void AppendJson(std::string& out) const {
+        out += kJsonHead;
+        out += mime_type_;
+        out += kJsonData;
+        size_t offset = out.size();
+        size_t olen = 0;
+        out.resize(offset + 4 * ((data_.size() + 2) / 3));
+        // The encoder ends with a NUL, which lands on the terminator of out
+        mbedtls_base64_encode((unsigned char*)out.data() + offset, out.size() - offset + 1, &olen,
+            (const unsigned char*)data_.data(), data_.size());
+        out += kJsonTail;
     }
 };
 
@@ -63,6 +85,9 @@ private:
     bool has_default_value_;
     std::optional<int> min_value_;  // 新增：整数最小值
     std::optional<int> max_value_;  // 新增：整数最大值
+    bool bound_ = false;            // Set by PropertyList::Bind() from the call arguments
+
+    friend class PropertyList;
 
 public:
     // Required field constructor
@@ -120,7 +145,7 @@ public:
         value_ = value;
     }
 
-    std::string to_json() const {
+    cJSON* to_json_object() const {
         cJSON *json = cJSON_CreateObject();
         
         if (type_ == kPropertyTypeBoolean) {
@@ -145,38 +170,51 @@ public:
                 cJSON_AddStringToObject(json, "default", value<std::string>().c_str());
             }
         }
-        
-        char *json_str = cJSON_PrintUnformatted(json);
-        std::string result(json_str);
-        cJSON_free(json_str);
-        cJSON_Delete(json);
-        
-        return result;
+        return json;
     }
 };
 
 class PropertyList {
 private:
     std::vector<Property> properties_;
+    // Position of each property by name, built once when the tool is registered and shared by
+    // the argument lists copied from it
+    std::shared_ptr<const std::unordered_map<std::string, size_t>> index_;
 
 public:
     PropertyList() = default;
     PropertyList(const std::vector<Property>& properties) : properties_(properties) {}
     void AddProperty(const Property& property) {
         properties_.push_back(property);
+        index_.reset();
     }
 
     const Property& operator[](const std::string& name) const {
-        for (const auto& property : properties_) {
-            if (property.name() == name) {
-                return property;
+        if (index_) {
+            auto it = index_->find(name);
+            if (it != index_->end()) {
+                return properties_[it->second];
+            }
+        } else {
+            for (const auto& property : properties_) {
+                if (property.name() == name) {
+                    return property;
+                }
             }
         }
         throw std::runtime_error("Property not found: " + name);
     }
 
+    void BuildIndex();
+    // Sets the values from the arguments object of a tools/call, in one pass over its members.
+    // Returns the first required property left without a valid value, nullptr when none is.
+    // Throws when an integer is out of range. A list without an index looks the names up one by
+    // one, like the short lists built for a call of a static tool.
+    const Property* Bind(const cJSON* arguments);
+
     auto begin() { return properties_.begin(); }
     auto end() { return properties_.end(); }
+    bool empty() const { return properties_.empty(); }
 
     std::vector<std::string> GetRequired() const {
         std::vector<std::string> required;
@@ -188,48 +226,137 @@ public:
         return required;
     }
 
-    std::string to_json() const {
+    cJSON* to_json_object() const {
         cJSON *json = cJSON_CreateObject();
-        
         for (const auto& property : properties_) {
-            cJSON *prop_json = cJSON_Parse(property.to_json().c_str());
-            cJSON_AddItemToObject(json, property.name().c_str(), prop_json);
+            cJSON_AddItemToObject(json, property.name().c_str(), property.to_json_object());
         }
-        
-        char *json_str = cJSON_PrintUnformatted(json);
-        std::string result(json_str);
-        cJSON_free(json_str);
-        cJSON_Delete(json);
-        
-        return result;
+        return json;
     }
 };
 
+/*
+ * The constant description of a tool, for McpServer::AddTool(const McpToolSpec&, ...).
+ *
+ * It is declared static constexpr, so the name, the description and the schema stay in flash
+ * and the server only keeps a pointer to them: the tools/list entry is written from the spec
+ * when the tools are listed, and the argument list is built for each call. Only the callback
+ * is in RAM. A spec renders the same entry as the McpTool of the same name, description and
+ * properties, so moving a tool to a spec does not change the tools version.
+ *
+ *     static constexpr McpPropertySpec kVolumeProperties[] = {
+ *         McpProperty("volume", kPropertyTypeInteger, 0, 100),
+ *     };
+ *     static constexpr auto kSetVolume = McpToolSpecOf("self.audio_speaker.set_volume",
+ *         "Set the volume of the audio speaker.", kVolumeProperties);
+ *     AddTool(kSetVolume, [](const PropertyList& properties) -> ReturnValue { ... });
+ */
+struct McpPropertySpec {
+    const char* name;
+    PropertyType type;
+    bool has_default_value;
+    int default_int;                // The default of an integer or a boolean
+    const char* default_string;
+    bool has_range;
+    int min_value;
+    int max_value;
+
+    // The same arguments as the constructors of Property
+    Property ToProperty() const {
+        if (type == kPropertyTypeString && has_default_value) {
+            return Property(name, type, std::string(default_string));
+        }
+        if (type == kPropertyTypeBoolean && has_default_value) {
+            return Property(name, type, default_int != 0);
+        }
+        if (has_range) {
+            return has_default_value ? Property(name, type, default_int, min_value, max_value)
+                : Property(name, type, min_value, max_value);
+        }
+        return has_default_value ? Property(name, type, default_int) : Property(name, type);
+    }
+};
+
+constexpr McpPropertySpec McpProperty(const char* name, PropertyType type) {
+    return {name, type, false, 0, nullptr, false, 0, 0};
+}
+constexpr McpPropertySpec McpProperty(const char* name, PropertyType type, bool default_value) {
+    return {name, type, true, default_value ? 1 : 0, nullptr, false, 0, 0};
+}
+constexpr McpPropertySpec McpProperty(const char* name, PropertyType type, int default_value) {
+    return {name, type, true, default_value, nullptr, false, 0, 0};
+}
+constexpr McpPropertySpec McpProperty(const char* name, PropertyType type, const char* default_value) {
+    return {name, type, true, 0, default_value, false, 0, 0};
+}
+constexpr McpPropertySpec McpProperty(const char* name, PropertyType type, int min_value, int max_value) {
+    return {name, type, false, 0, nullptr, true, min_value, max_value};
+}
+constexpr McpPropertySpec McpProperty(const char* name, PropertyType type, int default_value, int min_value, int max_value) {
+    return {name, type, true, default_value, nullptr, true, min_value, max_value};
+}
+
+struct McpToolSpec {
+    const char* name;
+    const char* description;
+    const McpPropertySpec* properties;
+    size_t property_count;
+    bool user_only;
+};
+
+constexpr McpToolSpec McpToolSpecOf(const char* name, const char* description, bool user_only = false) {
+    return {name, description, nullptr, 0, user_only};
+}
+template <size_t N>
+constexpr McpToolSpec McpToolSpecOf(const char* name, const char* description,
+        const McpPropertySpec (&properties)[N], bool user_only = false) {
+    return {name, description, properties, N, user_only};
+}
+
+// Where a tools/call runs
+enum McpToolExecution {
+    kMcpToolMainThread,     // On the main event loop, the default: most tools touch the device state
+    kMcpToolWorker,         // On the tool worker pool, for the slow tools that are safe off the main loop
+    kMcpToolLongRunning,    // On a task of its own and without a timeout, like the firmware upgrade
+};
+
 class McpTool {
 private:
+    // A tool added from a spec keeps its metadata there, name_ to properties_ stay empty
+    const McpToolSpec* spec_ = nullptr;
     std::string name_;
     std::string description_;
     PropertyList properties_;
     std::function<ReturnValue(const PropertyList&)> callback_;
     bool user_only_ = false;
+    McpToolExecution execution_ = kMcpToolMainThread;
+    int timeout_ms_ = 0;
+    // The last result, reused within the TTL while the device state and settings stay the same
+    int cache_ttl_ms_ = 0;
+    std::mutex cache_mutex_;
+    std::string cached_result_;
+    int64_t cached_at_us_ = 0;
+    uint32_t cached_generation_ = 0;
+    // The tools/list entry, the tool does not change once it is added
+    std::string json_;
+    uint32_t json_hash_ = 0;
+    // A disabled tool is left out of tools/list and refused by tools/call, see SetToolEnabled()
+    std::atomic<bool> enabled_ = true;
+
+    void SetJson(std::string json) {
+        json_ = std::move(json);
+        // FNV-1a, folded into the version of the tools list
+        uint32_t hash = 2166136261u;
+        for (unsigned char c : json_) {
+            hash = (hash ^ c) * 16777619u;
+        }
+        json_hash_ = hash;
+    }
 
-public:
-    McpTool(const std::string& name, 
-            const std::string& description, 
-            const PropertyList& properties, 
-            std::function<ReturnValue(const PropertyList&)> callback)
-        : name_(name), 
-        description_(description), 
-        properties_(properties), 
-        callback_(callback) {}
-
-    void set_user_only(bool user_only) { user_only_ = user_only; }
-    inline const std::string& name() const { return name_; }
-    inline const std::string& description() const { return description_; }
-    inline const PropertyList& properties() const { return properties_; }
-    inline bool user_only() const { return user_only_; }
+    // The entry of a spec tool, the same members in the same order as BuildJson()
+    void AppendSpecJson(std::string& out) const;
 
-    std::string to_json() const {
+    std::string BuildJson() const {
         std::vector<std::string> required = properties_.GetRequired();
         
         cJSON *json = cJSON_CreateObject();
@@ -238,9 +365,7 @@ public:
         
         cJSON *input_schema = cJSON_CreateObject();
         cJSON_AddStringToObject(input_schema, "type", "object");
-        
-        cJSON *properties = cJSON_Parse(properties_.to_json().c_str());
-        cJSON_AddItemToObject(input_schema, "properties", properties);
+        cJSON_AddItemToObject(input_schema, "properties", properties_.to_json_object());
         
         if (!required.empty()) {
             cJSON *required_array = cJSON_CreateArray();
@@ -269,37 +394,123 @@ public:
         return result;
     }
 
+public:
+    McpTool(const std::string& name, 
+            const std::string& description, 
+            const PropertyList& properties, 
+            std::function<ReturnValue(const PropertyList&)> callback)
+        : name_(name), 
+        description_(description), 
+        properties_(properties), 
+        callback_(callback) {
+        properties_.BuildIndex();
+        SetJson(BuildJson());
+    }
+
+    // The spec must outlive the tool, it is meant to be static constexpr
+    McpTool(const McpToolSpec& spec, std::function<ReturnValue(const PropertyList&)> callback)
+        : spec_(&spec), callback_(std::move(callback)), user_only_(spec.user_only) {
+        // Only the hash is kept, the entry is written again when the tools are listed
+        std::string json;
+        AppendSpecJson(json);
+        SetJson(std::move(json));
+        json_.clear();
+        json_.shrink_to_fit();
+    }
+
+    void set_user_only(bool user_only) {
+        user_only_ = user_only;
+        SetJson(BuildJson());
+    }
+    inline const char* name() const { return spec_ != nullptr ? spec_->name : name_.c_str(); }
+    inline const char* description() const { return spec_ != nullptr ? spec_->description : description_.c_str(); }
+    inline bool has_properties() const { return spec_ != nullptr ? spec_->property_count > 0 : !properties_.empty(); }
+    // The properties to bind the arguments of a call to. The copy of a list shares the name index
+    // of the tool, the list of a spec is built and looked up without one
+    PropertyList arguments() const {
+        if (spec_ == nullptr) {
+            return properties_;
+        }
+        std::vector<Property> properties;
+        properties.reserve(spec_->property_count);
+        for (size_t i = 0; i < spec_->property_count; i++) {
+            properties.push_back(spec_->properties[i].ToProperty());
+        }
+        return PropertyList(properties);
+    }
+    inline bool user_only() const { return user_only_; }
+    inline McpToolExecution execution() const { return execution_; }
+    // The error reply goes out after this long, 0 waits for the tool
+    inline int timeout_ms() const { return timeout_ms_; }
+    void set_execution(McpToolExecution execution, int timeout_ms) {
+        execution_ = execution;
+        timeout_ms_ = timeout_ms;
+    }
+
+    inline int cache_ttl_ms() const { return cache_ttl_ms_; }
+    void set_cache_ttl(int ttl_ms) { cache_ttl_ms_ = ttl_ms; }
+    bool GetCachedResult(uint32_t generation, int64_t now_us, std::string& result) {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        if (cached_result_.empty() || generation != cached_generation_ || now_us - cached_at_us_ >= cache_ttl_ms_ * 1000LL) {
+            return false;
+        }
+        result = cached_result_;
+        return true;
+    }
+    void CacheResult(uint32_t generation, int64_t now_us, const std::string& result) {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        cached_result_ = result;
+        cached_at_us_ = now_us;
+        cached_generation_ = generation;
+    }
+
+    // Appends the tools/list entry, after a comma unless out ends with '['
+    void AppendJson(std::string& out) const {
+        if (spec_ != nullptr) {
+            AppendSpecJson(out);
+            return;
+        }
+        if (!out.empty() && out.back() != '[') {
+            out.push_back(',');
+        }
+        out += json_;
+    }
+    inline uint32_t json_hash() const { return json_hash_; }
+    inline bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+    void set_enabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+
     std::string Call(const PropertyList& properties) {
         ReturnValue return_value = callback_(properties);
+        if (std::holds_alternative<ImageContent*>(return_value)) {
+            // Written out by hand, the reply is the only buffer holding the encoded image
+            std::unique_ptr<ImageContent> image_content(std::get<ImageContent*>(return_value));
+            std::string result_str;
+            result_str.reserve(image_content->json_size() + kMcpMessageHeadroom);
+            result_str += "{\"content\":[{\"type\":\"image\",\"image\":\"";
+            image_content->AppendJson(result_str);
+            result_str += "\"}],\"isError\":false}";
+            return result_str;
+        }
+
         // 返回结果
         cJSON* result = cJSON_CreateObject();
         cJSON* content = cJSON_CreateArray();
-
-        if (std::holds_alternative<ImageContent*>(return_value)) {
-            auto image_content = std::get<ImageContent*>(return_value);
-            cJSON* image = cJSON_CreateObject();
-            cJSON_AddStringToObject(image, "type", "image");
-            cJSON_AddStringToObject(image, "image", image_content->to_json().c_str());
-            cJSON_AddItemToArray(content, image);
-            delete image_content;
-        } else {
-            cJSON* text = cJSON_CreateObject();
-            cJSON_AddStringToObject(text, "type", "text");
-            if (std::holds_alternative<std::string>(return_value)) {
-                cJSON_AddStringToObject(text, "text", std::get<std::string>(return_value).c_str());
-            } else if (std::holds_alternative<bool>(return_value)) {
-                cJSON_AddStringToObject(text, "text", std::get<bool>(return_value) ? "true" : "false");
-            } else if (std::holds_alternative<int>(return_value)) {
-                cJSON_AddStringToObject(text, "text", std::to_string(std::get<int>(return_value)).c_str());
-            } else if (std::holds_alternative<cJSON*>(return_value)) {
-                cJSON* json = std::get<cJSON*>(return_value);
-                char* json_str = cJSON_PrintUnformatted(json);
-                cJSON_AddStringToObject(text, "text", json_str);
-                cJSON_free(json_str);
-                cJSON_Delete(json);
-            }
-            cJSON_AddItemToArray(content, text);
+        cJSON* text = cJSON_CreateObject();
+        cJSON_AddStringToObject(text, "type", "text");
+        if (std::holds_alternative<std::string>(return_value)) {
+            cJSON_AddStringToObject(text, "text", std::get<std::string>(return_value).c_str());
+        } else if (std::holds_alternative<bool>(return_value)) {
+            cJSON_AddStringToObject(text, "text", std::get<bool>(return_value) ? "true" : "false");
+        } else if (std::holds_alternative<int>(return_value)) {
+            cJSON_AddStringToObject(text, "text", std::to_string(std::get<int>(return_value)).c_str());
+        } else if (std::holds_alternative<cJSON*>(return_value)) {
+            cJSON* json = std::get<cJSON*>(return_value);
+            char* json_str = cJSON_PrintUnformatted(json);
+            cJSON_AddStringToObject(text, "text", json_str);
+            cJSON_free(json_str);
+            cJSON_Delete(json);
         }
+        cJSON_AddItemToArray(content, text);
         cJSON_AddItemToObject(result, "content", content);
         cJSON_AddBoolToObject(result, "isError", false);
 
@@ -323,22 +534,110 @@ public:
     void AddTool(McpTool* tool);
     void AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
     void AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
+    // A tool described by a static constexpr spec, only the callback is copied to RAM
+    void AddTool(const McpToolSpec& spec, std::function<ReturnValue(const PropertyList&)> callback);
+    // Takes a tool out of tools/list and refuses its calls, or puts it back, e.g. for the camera
+    // or a mode of a robot coming and going. The tool and its schema stay registered: a call of
+    // it may still run on the pool, and putting it back costs nothing. False if it is not known
+    bool SetToolEnabled(const std::string& name, bool enabled);
+    // A hash of the tools as tools/list returns them, the same for the same tools across boots.
+    // It comes with the initialize and tools/list results, and a client that listed the tools
+    // gets a notifications/tools/list_changed when it changes, so it only lists them again then
+    uint32_t GetToolsVersion() const { return tools_version_.load(std::memory_order_relaxed); }
     void ParseMessage(const cJSON* json);
     void ParseMessage(const std::string& message);
 
+    // Moves a tool off the main loop. A worker tool gets an error reply after timeout_ms, its
+    // result is dropped when it finishes later. Call it after the tool is added.
+    void SetToolExecution(const std::string& name, McpToolExecution execution, int timeout_ms = CONFIG_MCP_TOOL_TIMEOUT_MS);
+    // For the worker and long-running tools: the client cancelled the call or it timed out, so
+    // nobody is waiting for the result any more
+    static bool IsCallCancelled();
+    // Lets a tool without arguments answer from its last result for ttl_ms. Any device state
+    // change, settings commit or call of an uncached tool drops the cached results.
+    void SetToolCacheTtl(const std::string& name, int ttl_ms);
+    // Runs a tool for a command recognized on the device, without a client. Called on the main
+    // loop, the tool runs there or on the pool as its execution says. The server learns about it
+    // from a notifications/message once the audio channel is open
+    void CallLocalTool(const std::string& name, const std::string& arguments, const std::string& text);
+
 private:
+#if CONFIG_MCP_BENCHMARK
+    // Sends requests through a batch of its own and takes the replies
+    friend class McpBenchmark;
+#endif
+
+    // The replies to a JSON-RPC batch, sent as one array once the last reference is gone
+    struct Batch : std::enable_shared_from_this<Batch> {
+        std::mutex mutex;
+        std::string replies;
+        // The main thread calls of the batch, run in order by one scheduled task
+        std::vector<ScheduledTask> main_thread_calls;
+        ~Batch();
+    };
+
+    // Routes the replies made on this task into the batch while it lives
+    class BatchScope {
+    public:
+        explicit BatchScope(std::shared_ptr<Batch> batch);
+        ~BatchScope();
+
+    private:
+        std::shared_ptr<Batch> batch_;
+        Batch* previous_;
+    };
+
+    // A tools/call running on the pool
+    struct PendingCall {
+        int id;
+        std::atomic<bool> finished = false;     // Replied, cancelled or timed out
+        std::atomic<uint32_t> timer = 0;        // The timeout
+        std::shared_ptr<Batch> batch;           // Only touched by whoever sets finished
+    };
+
     McpServer();
     ~McpServer();
 
     void ParseCapabilities(const cJSON* capabilities);
 
-    void ReplyResult(int id, const std::string& result);
+    // Wraps the result in place, a large one should leave kMcpMessageHeadroom of spare capacity
+    void ReplyResult(int id, std::string result);
     void ReplyError(int id, const std::string& message);
+    void SendReply(std::string payload);
 
     void GetToolsList(int id, const std::string& cursor, bool list_user_only_tools);
     void DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments);
-
+    void ParseBatch(const cJSON* json);
+    void RunPendingCall(std::shared_ptr<PendingCall> call, McpTool* tool, const PropertyList& arguments);
+    void FinishPendingCall(PendingCall& call);
+    void CancelCall(const cJSON* params);
+    std::string CallTool(McpTool* tool, const PropertyList& arguments);
+    void NotifyLocalToolCall(const std::string& text, const std::string& name, const std::string& arguments,
+        bool success, const std::string& result, int64_t duration_us);
+
+    // In the order of tools/list, the index is for tools/call. The tools are added and enabled
+    // at runtime by the boards, a tool is never deleted before the server, so the index keys
+    // are the names of the tools themselves
+    std::mutex tools_mutex_;
     std::vector<McpTool*> tools_;
+    std::unordered_map<std::string_view, McpTool*> tool_index_;
+    std::atomic<uint32_t> tools_version_ = 0;
+    // Set once a client listed the tools, it is told about the changes from then on
+    std::atomic<bool> tools_listed_ = false;
+    std::atomic<bool> tools_notify_pending_ = false;
+
+    McpTool* FindTool(const std::string& name);
+    // Recomputes the version after a change of the tools, tools_mutex_ held
+    void UpdateToolsVersion();
+    void NotifyToolsChanged();
+
+    static thread_local PendingCall* current_call_;
+    static thread_local Batch* current_batch_;
+    McpToolPool pool_;
+    std::mutex calls_mutex_;
+    std::unordered_map<int, std::shared_ptr<PendingCall>> pending_calls_;
+    // Moves on when the cached tool results may be stale
+    std::atomic<uint32_t> cache_generation_ = 0;
 };
 
 #endif // MCP_SERVER_H
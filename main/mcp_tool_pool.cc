@@ -0,0 +1,72 @@
+#include "mcp_tool_pool.h"
+#include "task_placement.h"
+
+#include <esp_log.h>
+
+#define TAG "McpToolPool"
+
+bool McpToolPool::Submit(std::function<void()> job) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (jobs_.size() >= CONFIG_MCP_TOOL_QUEUE_SIZE) {
+        return false;
+    }
+    jobs_.push_back(std::move(job));
+    if (idle_workers_ < static_cast<int>(jobs_.size()) && workers_ < CONFIG_MCP_TOOL_WORKERS) {
+        // With its handle, so the stack stats cover every worker
+        TaskHandle_t handle = nullptr;
+        auto ret = TaskPlacements::Create(kTaskMcpWorker, [](void* arg) {
+            ((McpToolPool*)arg)->WorkerLoop();
+        }, this, &handle);
+        if (ret == pdPASS) {
+            workers_++;
+            idle_workers_++;
+        }
+    }
+    if (workers_ == 0) {
+        // Not even one worker, the job would wait forever
+        jobs_.pop_back();
+        return false;
+    }
+    condition_.notify_one();
+    return true;
+}
+
+void McpToolPool::WorkerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        condition_.wait(lock, [this]() { return !jobs_.empty(); });
+        auto job = std::move(jobs_.front());
+        jobs_.pop_front();
+        idle_workers_--;
+        lock.unlock();
+        job();
+        // Whatever the job captured goes before the worker waits again
+        job = nullptr;
+        lock.lock();
+        idle_workers_++;
+    }
+}
+
+bool McpToolPool::RunLongRunning(std::function<void()> job) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (long_running_) {
+        return false;
+    }
+    long_running_job_ = std::move(job);
+    auto ret = TaskPlacements::Create(kTaskMcpLongRunning, [](void* arg) {
+        auto pool = (McpToolPool*)arg;
+        pool->long_running_job_();
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex_);
+            pool->long_running_job_ = nullptr;
+            pool->long_running_ = false;
+        }
+        TaskPlacements::Delete(kTaskMcpLongRunning);
+    }, this);
+    if (ret != pdPASS) {
+        long_running_job_ = nullptr;
+        return false;
+    }
+    long_running_ = true;
+    return true;
+}
@@ -0,0 +1,37 @@
+#ifndef MCP_TOOL_POOL_H
+#define MCP_TOOL_POOL_H
+
+#include <sdkconfig.h>
+
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+/*
+ * The tasks running the MCP tools that are slow but safe off the main event loop.
+ *
+ * Up to CONFIG_MCP_TOOL_WORKERS workers are created on demand and then wait for the next job.
+ * Their stacks are in PSRAM when there is some, so the jobs must not write to flash (NVS, OTA).
+ * A long-running job gets a task of its own with an internal RAM stack instead, one at a time.
+ */
+class McpToolPool {
+public:
+    // Queues the job for a worker, false when CONFIG_MCP_TOOL_QUEUE_SIZE jobs already wait
+    bool Submit(std::function<void()> job);
+    // Starts the job on a task of its own, false while another long-running job runs
+    bool RunLongRunning(std::function<void()> job);
+
+private:
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::deque<std::function<void()>> jobs_;
+    int workers_ = 0;
+    int idle_workers_ = 0;
+    bool long_running_ = false;
+    std::function<void()> long_running_job_;
+
+    void WorkerLoop();
+};
+
+#endif // MCP_TOOL_POOL_H
@@ -0,0 +1,55 @@
+#include "memory_budget.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#include <atomic>
+
+#define TAG "MemoryBudget"
+
+namespace {
+
+constexpr int64_t kHeadroomTarget = CONFIG_MEMORY_BUDGET_HEADROOM_KB * 1024;
+
+// The lowest headroom a check saw, and where
+std::atomic<int64_t> lowest_headroom_ = INT64_MAX;
+std::atomic<const char*> lowest_stage_ = "";
+
+int64_t Headroom() {
+    return (int64_t)heap_caps_get_free_size(MALLOC_CAP_INTERNAL) - kHeadroomTarget;
+}
+
+} // namespace
+
+bool MemoryBudget::Check(const char* stage) {
+    size_t free_size = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL);
+    int64_t headroom = (int64_t)free_size - kHeadroomTarget;
+    if (headroom < lowest_headroom_) {
+        lowest_headroom_ = headroom;
+        lowest_stage_ = stage;
+    }
+
+    if (headroom < 0) {
+        ESP_LOGW(TAG, "%s: internal RAM %u free (largest block %u), %lld bytes short of the %s budget headroom",
+            stage, free_size, largest, -headroom, MEMORY_BUDGET_PROFILE);
+        return false;
+    }
+    ESP_LOGI(TAG, "%s: internal RAM %u free (largest block %u), headroom %lld bytes over the %s budget",
+        stage, free_size, largest, headroom, MEMORY_BUDGET_PROFILE);
+    return true;
+}
+
+cJSON* MemoryBudget::GetStatsJson() {
+    auto json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "profile", MEMORY_BUDGET_PROFILE);
+    cJSON_AddNumberToObject(json, "headroom_target", kHeadroomTarget);
+    cJSON_AddNumberToObject(json, "internal_free", heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    cJSON_AddNumberToObject(json, "internal_largest_free_block", heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL));
+    cJSON_AddNumberToObject(json, "headroom", Headroom());
+    if (lowest_headroom_ != INT64_MAX) {
+        cJSON_AddNumberToObject(json, "lowest_headroom", lowest_headroom_);
+        cJSON_AddStringToObject(json, "lowest_stage", lowest_stage_);
+    }
+    return json;
+}
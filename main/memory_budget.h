@@ -0,0 +1,67 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <sdkconfig.h>
+#include <cJSON.h>
+
+#include <cstdint>
+
+/*
+ * The sizes of the queues, pools, caches and task stacks that compete for internal RAM, for the
+ * memory budget of the target (CONFIG_MEMORY_BUDGET_*).
+ *
+ * The default profile is for the boards with PSRAM or a roomy internal RAM. The small profile is
+ * for the single core chips without PSRAM (ESP32-C3, C5, C6), which run the whole firmware from
+ * about 300 KB of SRAM: the audio queues hold half the audio, fewer Opus decoders stay cached, and
+ * the buffers allocated for the lifetime of the firmware are static, so they are taken at link
+ * time instead of fragmenting the heap, and the decoded sounds are not cached. Everything sized here is taken at boot, a conversation
+ * only uses what the pools hold.
+ *
+ * The stacks are the same in both profiles for now, their high-water marks leave no room on the
+ * Opus and network tasks, but they are set here so a board measuring more can tune them in one place.
+ */
+#if CONFIG_MEMORY_BUDGET_SMALL
+#define MEMORY_BUDGET_PROFILE                   "small"
+// Per direction, the decode and send queues hold this much audio whatever the frame duration is
+#define MEMORY_BUDGET_AUDIO_QUEUE_MS            1200
+#define MEMORY_BUDGET_DECODER_CACHE_SIZE        2
+#define MEMORY_BUDGET_PENDING_MCP_NOTIFICATIONS 4
+#define MEMORY_BUDGET_STATIC_JSON_ARENA         1
+#define MEMORY_BUDGET_SOUND_CACHE_KB            0
+#else
+#define MEMORY_BUDGET_PROFILE                   "default"
+#define MEMORY_BUDGET_AUDIO_QUEUE_MS            2400
+#define MEMORY_BUDGET_DECODER_CACHE_SIZE        3
+#define MEMORY_BUDGET_PENDING_MCP_NOTIFICATIONS 8
+#define MEMORY_BUDGET_STATIC_JSON_ARENA         0
+#if CONFIG_SPIRAM
+#define MEMORY_BUDGET_SOUND_CACHE_KB            128
+#else
+#define MEMORY_BUDGET_SOUND_CACHE_KB            32
+#endif
+#endif
+
+#define MEMORY_BUDGET_STACK_MAIN_EVENT_LOOP     (2048 * 4)
+#define MEMORY_BUDGET_STACK_OPUS_ENCODE         (2048 * 13)
+#define MEMORY_BUDGET_STACK_OPUS_DECODE         (2048 * 6)
+// The encoder is the deepest of the steps run by the single audio task
+#define MEMORY_BUDGET_STACK_AUDIO_PIPELINE      (MEMORY_BUDGET_STACK_OPUS_ENCODE + 2048 * 2)
+#define MEMORY_BUDGET_STACK_AUDIO_SEND          (2048 * 3)
+#define MEMORY_BUDGET_STACK_MCP_WORKER          (4096 * 2)
+#define MEMORY_BUDGET_STACK_MCP_LONG_RUNNING    (4096 * 2)
+
+/*
+ * Headroom reports: what is left of internal RAM against CONFIG_MEMORY_BUDGET_HEADROOM_KB, the
+ * free memory a conversation must still find (TLS records, socket buffers, the cJSON trees that
+ * do not fit the arena).
+ */
+class MemoryBudget {
+public:
+    // Logs the headroom at a stage (boot, conversation), a warning when it is below the target
+    static bool Check(const char* stage);
+    // {"profile", "headroom_target", "internal_free", "internal_largest_free_block", "headroom",
+    //  "lowest_headroom", "lowest_stage"}
+    static cJSON* GetStatsJson();
+};
+
+#endif // MEMORY_BUDGET_H
@@ -0,0 +1,165 @@
+#include "network_benchmark.h"
+
+#if CONFIG_USE_NETWORK_BENCHMARK
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "board.h"
+#include "http_client.h"
+
+#define TAG "NetworkBenchmark"
+
+namespace {
+
+struct Timing {
+    int count = 0;
+    int64_t total_us = 0;
+    int64_t min_us = 0;
+    int64_t max_us = 0;
+
+    void Add(int64_t us) {
+        min_us = count == 0 ? us : std::min(min_us, us);
+        max_us = std::max(max_us, us);
+        total_us += us;
+        count++;
+    }
+
+    cJSON* ToJson() const {
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "count", count);
+        if (count > 0) {
+            cJSON_AddNumberToObject(item, "min_ms", min_us / 1000.0);
+            cJSON_AddNumberToObject(item, "avg_ms", total_us / 1000.0 / count);
+            cJSON_AddNumberToObject(item, "max_ms", max_us / 1000.0);
+        }
+        return item;
+    }
+};
+
+int KbitPerSecond(size_t bytes, int64_t us) {
+    return us > 0 ? (int)(bytes * 8000 / us) : 0;
+}
+
+// Reads the body to its end, returns the bytes read or -1. first_byte_us is when the first chunk came
+int ReadBody(Http* http, std::vector<char>& buffer, int64_t* first_byte_us) {
+    int total = 0;
+    while (true) {
+        int ret = http->Read(buffer.data(), buffer.size());
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 0) {
+            return total;
+        }
+        if (total == 0 && first_byte_us != nullptr) {
+            *first_byte_us = esp_timer_get_time();
+        }
+        total += ret;
+    }
+}
+
+} // namespace
+
+cJSON* NetworkBenchmark::Run(const std::string& url, int rounds, int upload_kb) {
+    auto& board = Board::GetInstance();
+    auto network = board.GetNetwork();
+    auto root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "network", board.GetBoardType().c_str());
+    std::vector<char> buffer(HTTP_CLIENT_CHUNK_SIZE);
+
+    // Connect and download
+    std::unique_ptr<Http> http = network->CreateHttp(0);
+    http->SetHeader("Connection", "keep-alive");
+    int64_t start_us = esp_timer_get_time();
+    if (!http->Open("GET", url) || http->GetStatusCode() <= 0) {
+        cJSON_AddStringToObject(root, "error", "connect failed");
+        return root;
+    }
+    int64_t head_us = esp_timer_get_time();
+    int64_t first_byte_us = head_us;
+    int bytes = ReadBody(http.get(), buffer, &first_byte_us);
+    int64_t end_us = esp_timer_get_time();
+    if (bytes < 0) {
+        http->Close();
+        cJSON_AddStringToObject(root, "error", "download failed");
+        return root;
+    }
+    cJSON_AddNumberToObject(root, "status", http->GetStatusCode());
+    cJSON_AddNumberToObject(root, "connect_ms", (head_us - start_us) / 1000.0);
+    auto download = cJSON_CreateObject();
+    cJSON_AddNumberToObject(download, "bytes", bytes);
+    cJSON_AddNumberToObject(download, "first_byte_ms", (first_byte_us - start_us) / 1000.0);
+    cJSON_AddNumberToObject(download, "ms", (end_us - start_us) / 1000.0);
+    cJSON_AddNumberToObject(download, "kbps", KbitPerSecond(bytes, end_us - first_byte_us));
+    cJSON_AddItemToObject(root, "download", download);
+
+    // Request round trips on the kept connection
+    Timing rtt;
+    int reconnects = 0;
+    for (int i = 1; i < rounds; i++) {
+        int64_t request_us = esp_timer_get_time();
+        bool reused = http->Open("GET", url);
+        if (!reused) {
+            // The server closed the kept connection
+            reconnects++;
+            http = network->CreateHttp(0);
+            http->SetHeader("Connection", "keep-alive");
+            if (!http->Open("GET", url)) {
+                break;
+            }
+        }
+        if (ReadBody(http.get(), buffer, nullptr) < 0) {
+            break;
+        }
+        // The round trip of a new connection is not the one of a request
+        if (reused) {
+            rtt.Add(esp_timer_get_time() - request_us);
+        }
+    }
+    http->Close();
+    cJSON_AddItemToObject(root, "rtt", rtt.ToJson());
+    cJSON_AddNumberToObject(root, "reconnects", reconnects);
+
+    if (upload_kb > 0) {
+        auto upload = cJSON_CreateObject();
+        http = network->CreateHttp(0);
+        http->SetHeader("Content-Type", "application/octet-stream");
+        http->SetHeader("Transfer-Encoding", "chunked");
+        start_us = esp_timer_get_time();
+        if (!http->Open("POST", url)) {
+            cJSON_AddStringToObject(upload, "error", "connect failed");
+        } else {
+            int64_t body_start_us = esp_timer_get_time();
+            HttpWriteBatcher body(http.get());
+            std::fill(buffer.begin(), buffer.end(), 'x');
+            // Odd sized writes, like the pieces of an encoder
+            size_t remaining = (size_t)upload_kb * 1024;
+            while (remaining > 0) {
+                size_t size = std::min<size_t>(remaining, 700);
+                body.Write(buffer.data(), size);
+                remaining -= size;
+            }
+            body.Finish();
+            int status = http->GetStatusCode();
+            end_us = esp_timer_get_time();
+            cJSON_AddNumberToObject(upload, "status", status);
+            cJSON_AddNumberToObject(upload, "bytes", upload_kb * 1024);
+            cJSON_AddNumberToObject(upload, "writes", body.writes());
+            cJSON_AddNumberToObject(upload, "ms", (end_us - start_us) / 1000.0);
+            cJSON_AddNumberToObject(upload, "kbps", KbitPerSecond((size_t)upload_kb * 1024, end_us - body_start_us));
+        }
+        http->Close();
+        cJSON_AddItemToObject(root, "upload", upload);
+    }
+
+    auto text = cJSON_PrintUnformatted(root);
+    ESP_LOGI(TAG, "%s", text);
+    cJSON_free(text);
+    return root;
+}
+
+#endif // CONFIG_USE_NETWORK_BENCHMARK
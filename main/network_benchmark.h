@@ -0,0 +1,31 @@
+#ifndef NETWORK_BENCHMARK_H
+#define NETWORK_BENCHMARK_H
+
+#include <sdkconfig.h>
+
+#if CONFIG_USE_NETWORK_BENCHMARK
+
+#include <cJSON.h>
+#include <string>
+
+/*
+ * Request round trips and throughput over the network of the board.
+ *
+ * Runs through Board::GetNetwork(), so on the 4G boards everything goes through the AT channel
+ * of the modem and the numbers include its round trips: run the same URLs on a Wi-Fi board to
+ * tell the modem from the server.
+ *
+ * The first request connects and reads the whole body, that is the connect time and the
+ * download throughput. The next ones are sent on the kept connection and time the request
+ * round trip, so the URL should be a small resource. An upload POSTs generated bytes to it in
+ * HttpWriteBatcher chunks.
+ */
+class NetworkBenchmark {
+public:
+    // Blocks for the whole run, returns the results (with an "error" on a failure)
+    static cJSON* Run(const std::string& url, int rounds, int upload_kb);
+};
+
+#endif // CONFIG_USE_NETWORK_BENCHMARK
+
+#endif // NETWORK_BENCHMARK_H
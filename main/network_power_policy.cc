@@ -0,0 +1,128 @@
+#include "network_power_policy.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "trace_recorder.h"
+
+#define TAG "NetworkPower"
+
+const char* NetworkPowerPolicy::GetLevelName(NetworkPowerLevel level) {
+    switch (level) {
+    case kNetworkPowerActive:
+        return "active";
+    case kNetworkPowerIdle:
+        return "idle";
+    case kNetworkPowerSleep:
+        return "sleep";
+    default:
+        return "unknown";
+    }
+}
+
+void NetworkPowerPolicy::OnStateChanged(DeviceState state) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    state_ = state;
+    ApplyLocked();
+}
+
+void NetworkPowerPolicy::OnAudioChannel(bool opened) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    channel_opened_ = opened;
+    ApplyLocked();
+}
+
+void NetworkPowerPolicy::SetTransferring(bool transferring) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    transferring_ = transferring;
+    ApplyLocked();
+}
+
+void NetworkPowerPolicy::OnWakeWord() {
+#if CONFIG_USE_STATE_NETWORK_POWER_SAVE
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    wake_until_us_ = esp_timer_get_time() + NETWORK_POWER_WAKE_HOLD_MS * 1000;
+    ApplyLocked();
+#endif
+}
+
+void NetworkPowerPolicy::SetDeviceSleeping(bool sleeping) {
+#if CONFIG_USE_STATE_NETWORK_POWER_SAVE
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    sleeping_ = sleeping;
+    ApplyLocked();
+#endif
+}
+
+void NetworkPowerPolicy::OnClockTick() {
+#if CONFIG_USE_STATE_NETWORK_POWER_SAVE
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    if (wake_until_us_ != 0 && esp_timer_get_time() >= wake_until_us_) {
+        wake_until_us_ = 0;
+        ApplyLocked();
+    }
+#endif
+}
+
+void NetworkPowerPolicy::SetPowerSaveAllowed(bool allowed) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    power_save_allowed_ = allowed;
+    ApplyLocked();
+}
+
+bool NetworkPowerPolicy::ComputeLocked(NetworkPowerLevel& level) {
+#if CONFIG_USE_STATE_NETWORK_POWER_SAVE
+    switch (state_) {
+    case kDeviceStateUnknown:
+    case kDeviceStateStarting:
+    case kDeviceStateWifiConfiguring:
+    case kDeviceStateFatalError:
+        // The network is not up, or not the station, the level stays
+        level = applied_;
+        return applied_once_;
+    case kDeviceStateIdle:
+        break;
+    default:
+        level = kNetworkPowerActive;
+        return true;
+    }
+    if (channel_opened_ || transferring_ || wake_until_us_ != 0 || !power_save_allowed_) {
+        level = kNetworkPowerActive;
+#if CONFIG_NETWORK_POWER_SAVE_DEEP_SLEEP
+    } else if (sleeping_) {
+        level = kNetworkPowerSleep;
+#endif
+    } else {
+        level = kNetworkPowerIdle;
+    }
+    return true;
+#else
+    // The power save mode goes on at the first close of the audio channel, as it always did
+    if (!applied_once_ && !channel_opened_ && !transferring_ && power_save_allowed_) {
+        return false;
+    }
+    level = channel_opened_ || transferring_ || !power_save_allowed_ ? kNetworkPowerActive : kNetworkPowerIdle;
+    return true;
+#endif
+}
+
+void NetworkPowerPolicy::ApplyLocked() {
+    NetworkPowerLevel level;
+    if (!ComputeLocked(level) || (applied_once_ && level == applied_)) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    if (applied_once_) {
+        ESP_LOGI(TAG, "%s -> %s after %lld ms", GetLevelName(applied_), GetLevelName(level),
+            (now - applied_since_us_) / 1000);
+    } else {
+        ESP_LOGI(TAG, "Level %s", GetLevelName(level));
+    }
+    // Set before the board is called, a call back from the board finds it current
+    applied_once_ = true;
+    applied_ = level;
+    applied_since_us_ = now;
+    static const char* const trace_names[] = {"net_active", "net_idle", "net_sleep"};
+    TraceRecorder::GetInstance().Instant(trace_names[level]);
+    Board::GetInstance().SetNetworkPowerLevel(level);
+}
@@ -0,0 +1,79 @@
+#ifndef NETWORK_POWER_POLICY_H
+#define NETWORK_POWER_POLICY_H
+
+#include <sdkconfig.h>
+
+#include <mutex>
+#include <cstdint>
+
+#include "board.h"
+#include "device_state.h"
+
+// How long the wake word keeps the link awake before the state or the audio channel does
+#define NETWORK_POWER_WAKE_HOLD_MS 3000
+
+/*
+ * Picks the network power level of the board, Board::SetNetworkPowerLevel().
+ *
+ * Without CONFIG_USE_STATE_NETWORK_POWER_SAVE it is the power save mode of before: off while
+ * the audio channel is open or a download runs, on otherwise.
+ *
+ * With it the level follows the device state. The states that move audio or data (activating,
+ * connecting, listening, speaking, upgrading...) keep the modem awake: in modem sleep the
+ * access point buffers the downlink until the next beacon, 100 ms and more for every packet of
+ * a reply. In idle the modem sleeps and wakes at every DTIM beacon, and with
+ * CONFIG_NETWORK_POWER_SAVE_DEEP_SLEEP every listen interval once the PowerSaveTimer of the
+ * board put the device to sleep. A wake word candidate wakes the modem at once, before the
+ * audio channel opens, so the handshake of the channel does not wait for the beacons either.
+ * Nothing is applied before the first idle, the network may not be started.
+ *
+ * The inputs come from the main task, the protocol callbacks and the power save timer. The
+ * board is called with the lock held, a board that wakes its power save timer from
+ * SetPowerSaveMode() calls back in, the level it applies is already the current one then.
+ */
+class NetworkPowerPolicy {
+public:
+    static NetworkPowerPolicy& GetInstance() {
+        static NetworkPowerPolicy instance;
+        return instance;
+    }
+    NetworkPowerPolicy(const NetworkPowerPolicy&) = delete;
+    NetworkPowerPolicy& operator=(const NetworkPowerPolicy&) = delete;
+
+    // Called by Application::SetDeviceState
+    void OnStateChanged(DeviceState state);
+    void OnAudioChannel(bool opened);
+    // Around the downloads of the assets and of the firmware
+    void SetTransferring(bool transferring);
+    // A wake word candidate or a detection
+    void OnWakeWord();
+    // Called by the PowerSaveTimer of the board
+    void SetDeviceSleeping(bool sleeping);
+    // Main loop, every second, ends the hold of the wake word
+    void OnClockTick();
+    // False keeps the modem awake in idle too, the performance profile on external power
+    void SetPowerSaveAllowed(bool allowed);
+
+    NetworkPowerLevel level() const { return applied_; }
+    static const char* GetLevelName(NetworkPowerLevel level);
+
+private:
+    NetworkPowerPolicy() = default;
+
+    std::recursive_mutex mutex_;
+    DeviceState state_ = kDeviceStateUnknown;
+    bool channel_opened_ = false;
+    bool transferring_ = false;
+    bool sleeping_ = false;
+    bool power_save_allowed_ = true;
+    int64_t wake_until_us_ = 0;
+    bool applied_once_ = false;
+    NetworkPowerLevel applied_ = kNetworkPowerActive;
+    int64_t applied_since_us_ = 0;
+
+    // Called with the lock held, returns false while there is nothing to apply yet
+    bool ComputeLocked(NetworkPowerLevel& level);
+    void ApplyLocked();
+};
+
+#endif // NETWORK_POWER_POLICY_H
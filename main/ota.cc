@@ -2,6 +2,9 @@
 #include "system_info.h"
 #include "settings.h"
 #include "assets/lang_config.h"
+#include "task_placement.h"
+#include "telemetry.h"
+#include "black_box.h"
 
 #include <cJSON.h>
 #include <esp_log.h>
@@ -10,17 +13,36 @@
 #include <esp_app_format.h>
 #include <esp_efuse.h>
 #include <esp_efuse_table.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
 #ifdef SOC_HMAC_SUPPORTED
 #include <esp_hmac.h>
 #endif
+#if CONFIG_OTA_DELTA_UPDATE
+#include <esp_delta_ota.h>
+#include <mbedtls/sha256.h>
+#endif
 
+#include <cctype>
 #include <cstring>
+#include <functional>
 #include <vector>
 #include <sstream>
 #include <algorithm>
+#include <atomic>
+#include <memory>
 
 #define TAG "Ota"
 
+// Receive chunks in PSRAM between the download and the flash writes
+#define OTA_CHUNK_SIZE (32 * 1024)
+#define OTA_CHUNK_COUNT 4
+// With a rate limit the chunks go to flash in pieces, the tasks of the conversation run between
+#define OTA_PACED_WRITE_SIZE 4096
+
 
 Ota::Ota() {
 #ifdef ESP_EFUSE_BLOCK_USR_DATA
@@ -38,6 +60,7 @@ Ota::Ota() {
 }
 
 Ota::~Ota() {
+    ReleaseHttp();
 }
 
 std::string Ota::GetCheckVersionUrl() {
@@ -49,10 +72,15 @@ std::string Ota::GetCheckVersionUrl() {
     return url;
 }
 
-std::unique_ptr<Http> Ota::SetupHttp() {
+Http* Ota::SetupHttp() {
     auto& board = Board::GetInstance();
-    auto network = board.GetNetwork();
-    auto http = network->CreateHttp(0);
+    if (http_ == nullptr) {
+        http_ = board.GetNetwork()->CreateHttp(0);
+        http_reused_ = false;
+    } else {
+        http_reused_ = true;
+    }
+    auto http = http_.get();
     auto user_agent = SystemInfo::GetUserAgent();
     http->SetHeader("Activation-Version", has_serial_number_ ? "2" : "1");
     http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
@@ -64,10 +92,149 @@ std::unique_ptr<Http> Ota::SetupHttp() {
     http->SetHeader("User-Agent", user_agent);
     http->SetHeader("Accept-Language", Lang::CODE);
     http->SetHeader("Content-Type", "application/json");
+    // The version check and the activation polls go to the same host, one after the other
+    http->SetHeader("Connection", "keep-alive");
+    if (!telemetry_header_.empty()) {
+        http->SetHeader("Telemetry", telemetry_header_);
+    }
+#if CONFIG_OTA_DELTA_UPDATE
+    // The server may answer with a patch against the image that runs
+    http->SetHeader("Ota-Delta-Base", GetRunningImageSha256());
+#endif
 
     return http;
 }
 
+Http* Ota::OpenHttp(const std::string& method, const std::string& url, const std::string& content) {
+    auto http = SetupHttp();
+    http->SetContent(std::string(content));
+    if (http->Open(method, url)) {
+        return http;
+    }
+    if (http_reused_) {
+        // The server closed the kept connection meanwhile, reconnect once
+        ESP_LOGW(TAG, "The kept OTA connection failed, reconnecting");
+        ReleaseHttp();
+        http = SetupHttp();
+        http->SetContent(std::string(content));
+        if (http->Open(method, url)) {
+            return http;
+        }
+    }
+    ReleaseHttp();
+    return nullptr;
+}
+
+void Ota::ReleaseHttp() {
+    if (http_ != nullptr) {
+        http_->Close();
+        http_.reset();
+    }
+}
+
+namespace {
+
+/*
+ * Splits a JSON object into its members as the text arrives, so the response is handled one
+ * section at a time instead of holding the whole body and its whole cJSON tree.
+ */
+class JsonMemberSplitter {
+public:
+    explicit JsonMemberSplitter(std::function<void(cJSON* member)> on_member) : on_member_(std::move(on_member)) {}
+
+    // False when the text is not a JSON object
+    bool Feed(const char* data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            char c = data[i];
+            if (in_string_) {
+                member_.push_back(c);
+                if (escape_) {
+                    escape_ = false;
+                } else if (c == '\\') {
+                    escape_ = true;
+                } else if (c == '"') {
+                    in_string_ = false;
+                }
+                continue;
+            }
+            if (depth_ == 0) {
+                if (c == '{' && !done_) {
+                    depth_ = 1;
+                    member_ = "{";
+                } else if (!isspace((unsigned char)c)) {
+                    return false;
+                }
+                continue;
+            }
+            if (depth_ == 1 && (c == ',' || c == '}')) {
+                if (!Emit()) {
+                    return false;
+                }
+                if (c == '}') {
+                    depth_ = 0;
+                    done_ = true;
+                }
+                continue;
+            }
+            if (c == '"') {
+                in_string_ = true;
+            } else if (c == '{' || c == '[') {
+                depth_++;
+            } else if (c == '}' || c == ']') {
+                depth_--;
+            }
+            member_.push_back(c);
+        }
+        return true;
+    }
+
+    // Whether the object was closed
+    bool done() const { return done_; }
+
+private:
+    std::function<void(cJSON* member)> on_member_;
+    std::string member_;
+    int depth_ = 0;
+    bool in_string_ = false;
+    bool escape_ = false;
+    bool done_ = false;
+
+    bool Emit() {
+        if (member_.find_first_not_of(" \t\r\n", 1) == std::string::npos) {
+            return true;  // An empty object
+        }
+        member_.push_back('}');
+        cJSON* root = cJSON_ParseWithLength(member_.data(), member_.size());
+        member_ = "{";
+        if (root == nullptr || root->child == nullptr) {
+            cJSON_Delete(root);
+            return false;
+        }
+        on_member_(root->child);
+        cJSON_Delete(root);
+        return true;
+    }
+};
+
+// Writes the members of an mqtt or websocket section to the settings that differ
+void StoreSettings(const char* ns, cJSON* section) {
+    Settings settings(ns, true);
+    cJSON *item = NULL;
+    cJSON_ArrayForEach(item, section) {
+        if (cJSON_IsString(item)) {
+            if (settings.GetString(item->string) != item->valuestring) {
+                settings.SetString(item->string, item->valuestring);
+            }
+        } else if (cJSON_IsNumber(item)) {
+            if (settings.GetInt(item->string) != item->valueint) {
+                settings.SetInt(item->string, item->valueint);
+            }
+        }
+    }
+}
+
+} // namespace
+
 /* 
  * Specification: https://ccnphfhqs21z.feishu.cn/wiki/FjW6wZmisimNBBkov6OcmfvknVd
  */
@@ -85,13 +252,15 @@ bool Ota::CheckVersion() {
         return false;
     }
 
-    auto http = SetupHttp();
-
     std::string data = board.GetSystemInfoJson();
     std::string method = data.length() > 0 ? "POST" : "GET";
-    http->SetContent(std::move(data));
-
-    if (!http->Open(method, url)) {
+#if CONFIG_USE_TELEMETRY
+    // For the transports without a telemetry channel, and for the devices that never connect
+    telemetry_header_ = Telemetry::GetInstance().BuildHeaderValue();
+#endif
+    auto http = OpenHttp(method, url, data);
+    telemetry_header_.clear();
+    if (http == nullptr) {
         ESP_LOGE(TAG, "Failed to open HTTP connection");
         return false;
     }
@@ -99,93 +268,93 @@ bool Ota::CheckVersion() {
     auto status_code = http->GetStatusCode();
     if (status_code != 200) {
         ESP_LOGE(TAG, "Failed to check version, status code: %d", status_code);
+        ReleaseHttp();
         return false;
     }
 
-    data = http->ReadAll();
-    http->Close();
-
     // Response: { "firmware": { "version": "1.0.0", "url": "http://" } }
-    // Parse the JSON response and check if the version is newer
-    // If it is, set has_new_version_ to true and store the new version and URL
-    
-    cJSON *root = cJSON_Parse(data.c_str());
-    if (root == NULL) {
+    // Each section is handled as soon as it is received, if the firmware version is newer
+    // has_new_version_ is set and the new version and URL are stored
+    has_activation_code_ = false;
+    has_activation_challenge_ = false;
+    has_mqtt_config_ = false;
+    has_websocket_config_ = false;
+    has_server_time_ = false;
+    has_new_version_ = false;
+    bool has_firmware = false;
+    JsonMemberSplitter splitter([this, &has_firmware](cJSON* member) {
+        has_firmware |= strcmp(member->string, "firmware") == 0 && cJSON_IsObject(member);
+        HandleCheckVersionSection(member);
+    });
+    char buffer[512];
+    bool parsed = true;
+    while (true) {
+        int ret = http->Read(buffer, sizeof(buffer));
+        if (ret < 0) {
+            ESP_LOGE(TAG, "Failed to read the version response");
+            ReleaseHttp();
+            return false;
+        }
+        if (ret == 0) {
+            break;
+        }
+        if (parsed && !splitter.Feed(buffer, ret)) {
+            // The rest of the body is still read, so the connection can be reused
+            parsed = false;
+        }
+    }
+    if (!parsed || !splitter.done()) {
         ESP_LOGE(TAG, "Failed to parse JSON response");
         return false;
     }
+    // The server has the black box record of the system info now
+    BlackBox::GetInstance().OnUploaded();
 
-    has_activation_code_ = false;
-    has_activation_challenge_ = false;
-    cJSON *activation = cJSON_GetObjectItem(root, "activation");
-    if (cJSON_IsObject(activation)) {
-        cJSON* message = cJSON_GetObjectItem(activation, "message");
+    if (!has_mqtt_config_) {
+        ESP_LOGI(TAG, "No mqtt section found !");
+    }
+    if (!has_websocket_config_) {
+        ESP_LOGI(TAG, "No websocket section found!");
+    }
+    if (!has_server_time_) {
+        ESP_LOGW(TAG, "No server_time section found!");
+    }
+    if (!has_firmware) {
+        ESP_LOGW(TAG, "No firmware section found!");
+    }
+    return true;
+}
+
+void Ota::HandleCheckVersionSection(cJSON* section) {
+    const char* name = section->string;
+    if (strcmp(name, "activation") == 0 && cJSON_IsObject(section)) {
+        cJSON* message = cJSON_GetObjectItem(section, "message");
         if (cJSON_IsString(message)) {
             activation_message_ = message->valuestring;
         }
-        cJSON* code = cJSON_GetObjectItem(activation, "code");
+        cJSON* code = cJSON_GetObjectItem(section, "code");
         if (cJSON_IsString(code)) {
             activation_code_ = code->valuestring;
             has_activation_code_ = true;
         }
-        cJSON* challenge = cJSON_GetObjectItem(activation, "challenge");
+        cJSON* challenge = cJSON_GetObjectItem(section, "challenge");
         if (cJSON_IsString(challenge)) {
             activation_challenge_ = challenge->valuestring;
             has_activation_challenge_ = true;
         }
-        cJSON* timeout_ms = cJSON_GetObjectItem(activation, "timeout_ms");
+        cJSON* timeout_ms = cJSON_GetObjectItem(section, "timeout_ms");
         if (cJSON_IsNumber(timeout_ms)) {
             activation_timeout_ms_ = timeout_ms->valueint;
         }
-    }
-
-    has_mqtt_config_ = false;
-    cJSON *mqtt = cJSON_GetObjectItem(root, "mqtt");
-    if (cJSON_IsObject(mqtt)) {
-        Settings settings("mqtt", true);
-        cJSON *item = NULL;
-        cJSON_ArrayForEach(item, mqtt) {
-            if (cJSON_IsString(item)) {
-                if (settings.GetString(item->string) != item->valuestring) {
-                    settings.SetString(item->string, item->valuestring);
-                }
-            } else if (cJSON_IsNumber(item)) {
-                if (settings.GetInt(item->string) != item->valueint) {
-                    settings.SetInt(item->string, item->valueint);
-                }
-            }
-        }
+    } else if (strcmp(name, "mqtt") == 0 && cJSON_IsObject(section)) {
+        StoreSettings("mqtt", section);
         has_mqtt_config_ = true;
-    } else {
-        ESP_LOGI(TAG, "No mqtt section found !");
-    }
-
-    has_websocket_config_ = false;
-    cJSON *websocket = cJSON_GetObjectItem(root, "websocket");
-    if (cJSON_IsObject(websocket)) {
-        Settings settings("websocket", true);
-        cJSON *item = NULL;
-        cJSON_ArrayForEach(item, websocket) {
-            if (cJSON_IsString(item)) {
-                if (settings.GetString(item->string) != item->valuestring) {
-                    settings.SetString(item->string, item->valuestring);
-                }
-            } else if (cJSON_IsNumber(item)) {
-                if (settings.GetInt(item->string) != item->valueint) {
-                    settings.SetInt(item->string, item->valueint);
-                }
-            }
-        }
+    } else if (strcmp(name, "websocket") == 0 && cJSON_IsObject(section)) {
+        StoreSettings("websocket", section);
         has_websocket_config_ = true;
-    } else {
-        ESP_LOGI(TAG, "No websocket section found!");
-    }
-
-    has_server_time_ = false;
-    cJSON *server_time = cJSON_GetObjectItem(root, "server_time");
-    if (cJSON_IsObject(server_time)) {
-        cJSON *timestamp = cJSON_GetObjectItem(server_time, "timestamp");
-        cJSON *timezone_offset = cJSON_GetObjectItem(server_time, "timezone_offset");
+    } else if (strcmp(name, "server_time") == 0 && cJSON_IsObject(section)) {
+        cJSON *timestamp = cJSON_GetObjectItem(section, "timestamp");
+        cJSON *timezone_offset = cJSON_GetObjectItem(section, "timezone_offset");
         
         if (cJSON_IsNumber(timestamp)) {
             // 设置系统时间
@@ -202,21 +371,32 @@ bool Ota::CheckVersion() {
             settimeofday(&tv, NULL);
             has_server_time_ = true;
         }
-    } else {
-        ESP_LOGW(TAG, "No server_time section found!");
-    }
-
-    has_new_version_ = false;
-    cJSON *firmware = cJSON_GetObjectItem(root, "firmware");
-    if (cJSON_IsObject(firmware)) {
-        cJSON *version = cJSON_GetObjectItem(firmware, "version");
+    } else if (strcmp(name, "firmware") == 0 && cJSON_IsObject(section)) {
+        cJSON *version = cJSON_GetObjectItem(section, "version");
         if (cJSON_IsString(version)) {
             firmware_version_ = version->valuestring;
         }
-        cJSON *url = cJSON_GetObjectItem(firmware, "url");
+        cJSON *url = cJSON_GetObjectItem(section, "url");
         if (cJSON_IsString(url)) {
             firmware_url_ = url->valuestring;
         }
+        // "delta": { "url": "http://", "base": "<sha256 of the running image>", "sha256": "<of the new image>" }
+        delta_url_.clear();
+        delta_sha256_.clear();
+#if CONFIG_OTA_DELTA_UPDATE
+        cJSON *delta = cJSON_GetObjectItem(section, "delta");
+        if (cJSON_IsObject(delta)) {
+            cJSON *delta_url = cJSON_GetObjectItem(delta, "url");
+            cJSON *base = cJSON_GetObjectItem(delta, "base");
+            cJSON *sha256 = cJSON_GetObjectItem(delta, "sha256");
+            if (cJSON_IsString(delta_url) && cJSON_IsString(base) && cJSON_IsString(sha256) &&
+                base->valuestring == GetRunningImageSha256()) {
+                delta_url_ = delta_url->valuestring;
+                delta_sha256_ = sha256->valuestring;
+                ESP_LOGI(TAG, "Delta update available: %s", delta_url_.c_str());
+            }
+        }
+#endif
 
         if (cJSON_IsString(version) && cJSON_IsString(url)) {
             // Check if the version is newer, for example, 0.1.0 is newer than 0.0.1
@@ -227,39 +407,156 @@ bool Ota::CheckVersion() {
                 ESP_LOGI(TAG, "Current is the latest version");
             }
             // If the force flag is set to 1, the given version is forced to be installed
-            cJSON *force = cJSON_GetObjectItem(firmware, "force");
+            cJSON *force = cJSON_GetObjectItem(section, "force");
             if (cJSON_IsNumber(force) && force->valueint == 1) {
                 has_new_version_ = true;
             }
         }
-    } else {
-        ESP_LOGW(TAG, "No firmware section found!");
     }
-
-    cJSON_Delete(root);
-    return true;
 }
 
-void Ota::MarkCurrentVersionValid() {
+bool Ota::IsPendingVerify() {
     auto partition = esp_ota_get_running_partition();
     if (strcmp(partition->label, "factory") == 0) {
-        ESP_LOGI(TAG, "Running from factory partition, skipping");
-        return;
+        return false;
     }
-
-    ESP_LOGI(TAG, "Running partition: %s", partition->label);
     esp_ota_img_states_t state;
     if (esp_ota_get_state_partition(partition, &state) != ESP_OK) {
         ESP_LOGE(TAG, "Failed to get state of partition");
+        return false;
+    }
+    return state == ESP_OTA_IMG_PENDING_VERIFY;
+}
+
+void Ota::MarkCurrentVersionValid() {
+    auto partition = esp_ota_get_running_partition();
+    if (strcmp(partition->label, "factory") == 0) {
+        ESP_LOGI(TAG, "Running from factory partition, skipping");
         return;
     }
 
-    if (state == ESP_OTA_IMG_PENDING_VERIFY) {
+    ESP_LOGI(TAG, "Running partition: %s", partition->label);
+    if (IsPendingVerify()) {
         ESP_LOGI(TAG, "Marking firmware as valid");
         esp_ota_mark_app_valid_cancel_rollback();
     }
 }
 
+namespace {
+
+struct OtaChunk {
+    char* data;         // nullptr ends the image
+    size_t fill;
+};
+
+/*
+ * Writes the received chunks of the image with esp_ota_write() on a task of its own, so the
+ * flash erase and write overlap the network receive.
+ */
+class OtaWriter {
+public:
+    OtaWriter(esp_ota_handle_t handle, size_t chunk_size, int chunks, const std::atomic<size_t>& rate_limit)
+        : handle_(handle), rate_limit_(rate_limit) {
+        free_chunks_ = xQueueCreate(chunks, sizeof(char*));
+        filled_ = xQueueCreate(chunks + 1, sizeof(OtaChunk));
+        done_ = xSemaphoreCreateBinary();
+        for (int i = 0; i < chunks; i++) {
+            auto chunk = (char*)heap_caps_malloc(chunk_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+            if (chunk == nullptr) {
+                chunk = (char*)heap_caps_malloc(chunk_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+            }
+            if (chunk != nullptr) {
+                chunks_.push_back(chunk);
+                xQueueSend(free_chunks_, &chunk, 0);
+            }
+        }
+        if (chunks_.empty() || TaskPlacements::Create(kTaskOtaWriter, [](void* arg) {
+                auto self = static_cast<OtaWriter*>(arg);
+                self->Loop();
+                xSemaphoreGive(self->done_);
+                TaskPlacements::Delete(kTaskOtaWriter);
+            }, this) != pdPASS) {
+            failed_ = true;
+            xSemaphoreGive(done_);
+        }
+    }
+
+    ~OtaWriter() {
+        for (auto chunk : chunks_) {
+            heap_caps_free(chunk);
+        }
+        vQueueDelete(free_chunks_);
+        vQueueDelete(filled_);
+        vSemaphoreDelete(done_);
+    }
+
+    char* Acquire() {
+        char* chunk;
+        xQueueReceive(free_chunks_, &chunk, portMAX_DELAY);
+        return chunk;
+    }
+
+    void Submit(const OtaChunk& chunk) {
+        xQueueSend(filled_, &chunk, portMAX_DELAY);
+    }
+
+    // Waits for the queued chunks, false if one of them failed
+    bool Finish() {
+        // Also after a failure, the task only recycles the chunks then and still waits for the end
+        OtaChunk end = {nullptr, 0};
+        Submit(end);
+        xSemaphoreTake(done_, portMAX_DELAY);
+        return !failed_;
+    }
+
+    bool failed() const { return failed_; }
+    size_t written() const { return written_; }
+    int64_t write_time_us() const { return write_time_us_; }
+
+private:
+    esp_ota_handle_t handle_;
+    const std::atomic<size_t>& rate_limit_;
+    QueueHandle_t free_chunks_;
+    QueueHandle_t filled_;
+    SemaphoreHandle_t done_;
+    std::vector<char*> chunks_;
+    std::atomic<bool> failed_ = false;
+    std::atomic<size_t> written_ = 0;
+    int64_t write_time_us_ = 0;
+
+    void Loop() {
+        while (true) {
+            OtaChunk chunk;
+            xQueueReceive(filled_, &chunk, portMAX_DELAY);
+            if (chunk.data == nullptr) {
+                break;
+            }
+            for (size_t offset = 0; offset < chunk.fill && !failed_;) {
+                size_t size = chunk.fill - offset;
+                if (rate_limit_ > 0) {
+                    size = std::min<size_t>(size, OTA_PACED_WRITE_SIZE);
+                }
+                auto start_time = esp_timer_get_time();
+                auto err = esp_ota_write(handle_, chunk.data + offset, size);
+                write_time_us_ += esp_timer_get_time() - start_time;
+                if (err != ESP_OK) {
+                    ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
+                    failed_ = true;
+                    break;
+                }
+                written_ += size;
+                offset += size;
+                if (rate_limit_ > 0 && offset < chunk.fill) {
+                    vTaskDelay(1);
+                }
+            }
+            xQueueSend(free_chunks_, &chunk.data, portMAX_DELAY);
+        }
+    }
+};
+
+} // namespace
+
 bool Ota::Upgrade(const std::string& firmware_url) {
     ESP_LOGI(TAG, "Upgrading firmware from %s", firmware_url.c_str());
     esp_ota_handle_t update_handle = 0;
@@ -270,8 +567,6 @@ bool Ota::Upgrade(const std::string& firmware_url) {
     }
 
     ESP_LOGI(TAG, "Writing to partition %s at offset 0x%lx", update_partition->label, update_partition->address);
-    bool image_header_checked = false;
-    std::string image_header;
 
     auto network = Board::GetInstance().GetNetwork();
     auto http = network->CreateHttp(0);
@@ -291,20 +586,14 @@ bool Ota::Upgrade(const std::string& firmware_url) {
         return false;
     }
 
-    char buffer[512];
     size_t total_read = 0, recent_read = 0;
-    auto last_calc_time = esp_timer_get_time();
-    while (true) {
-        int ret = http->Read(buffer, sizeof(buffer));
-        if (ret < 0) {
-            ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
-            return false;
-        }
-
-        // Calculate speed and progress every second
+    auto start_time = esp_timer_get_time();
+    auto last_calc_time = start_time;
+    auto count_read = [&](int ret) {
         recent_read += ret;
         total_read += ret;
-        if (esp_timer_get_time() - last_calc_time >= 1000000 || ret == 0) {
+        // Calculate speed and progress every second
+        if (esp_timer_get_time() - last_calc_time >= 1000000) {
             size_t progress = total_read * 100 / content_length;
             ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %uB/s", progress, total_read, content_length, recent_read);
             if (upgrade_callback_) {
@@ -313,39 +602,87 @@ bool Ota::Upgrade(const std::string& firmware_url) {
             last_calc_time = esp_timer_get_time();
             recent_read = 0;
         }
+    };
 
-        if (ret == 0) {
-            break;
+    // The app description is checked before the OTA begins
+    std::string image_header;
+    const size_t header_size = sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t);
+    char buffer[512];
+    while (image_header.size() < header_size) {
+        int ret = http->Read(buffer, sizeof(buffer));
+        if (ret <= 0) {
+            ESP_LOGE(TAG, "Failed to read the firmware header: %s", esp_err_to_name(ret));
+            return false;
         }
+        image_header.append(buffer, ret);
+        count_read(ret);
+    }
+    esp_app_desc_t new_app_info;
+    memcpy(&new_app_info, image_header.data() + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(esp_app_desc_t));
 
-        if (!image_header_checked) {
-            image_header.append(buffer, ret);
-            if (image_header.size() >= sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
-                esp_app_desc_t new_app_info;
-                memcpy(&new_app_info, image_header.data() + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(esp_app_desc_t));
-                
-                auto current_version = esp_app_get_description()->version;
-                ESP_LOGI(TAG, "Current version: %s, New version: %s", current_version, new_app_info.version);
+    auto current_version = esp_app_get_description()->version;
+    ESP_LOGI(TAG, "Current version: %s, New version: %s", current_version, new_app_info.version);
 
-                if (esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle)) {
-                    esp_ota_abort(update_handle);
-                    ESP_LOGE(TAG, "Failed to begin OTA");
-                    return false;
-                }
+    if (esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle)) {
+        esp_ota_abort(update_handle);
+        ESP_LOGE(TAG, "Failed to begin OTA");
+        return false;
+    }
 
-                image_header_checked = true;
-                std::string().swap(image_header);
+    // The image is received into one chunk while the others are written
+#if CONFIG_SPIRAM
+    const size_t chunk_size = OTA_CHUNK_SIZE;
+    const int chunks = OTA_CHUNK_COUNT;
+#else
+    const size_t chunk_size = 4096;
+    const int chunks = 2;
+#endif
+    auto writer = std::make_unique<OtaWriter>(update_handle, chunk_size, chunks, rate_limit_);
+    bool read_failed = false;
+    bool end = false;
+    while (!end && !writer->failed()) {
+        OtaChunk chunk = {writer->Acquire(), 0};
+        if (!image_header.empty()) {
+            chunk.fill = std::min(image_header.size(), chunk_size);
+            memcpy(chunk.data, image_header.data(), chunk.fill);
+            std::string().swap(image_header);
+        }
+        while (chunk.fill < chunk_size) {
+            int ret = http->Read(chunk.data + chunk.fill, chunk_size - chunk.fill);
+            if (ret < 0) {
+                ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
+                read_failed = true;
+            }
+            if (ret <= 0) {
+                end = true;
+                break;
             }
+            chunk.fill += ret;
+            count_read(ret);
+            Throttle(ret);
         }
-        auto err = esp_ota_write(update_handle, buffer, ret);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
-            esp_ota_abort(update_handle);
-            return false;
+        if (read_failed) {
+            break;
+        }
+        if (chunk.fill > 0) {
+            writer->Submit(chunk);
         }
     }
     http->Close();
 
+    bool written = writer->Finish();
+    if (read_failed || !written) {
+        esp_ota_abort(update_handle);
+        return false;
+    }
+    auto elapsed_us = esp_timer_get_time() - start_time;
+    size_t speed = elapsed_us > 0 ? total_read * 1000000LL / elapsed_us : 0;
+    ESP_LOGI(TAG, "Downloaded %u bytes in %d ms (%uB/s), flash writes took %d ms", total_read,
+        int(elapsed_us / 1000), speed, int(writer->write_time_us() / 1000));
+    if (upgrade_callback_) {
+        upgrade_callback_(total_read * 100 / content_length, speed);
+    }
+
     esp_err_t err = esp_ota_end(update_handle);
     if (err != ESP_OK) {
         if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
@@ -356,21 +693,254 @@ bool Ota::Upgrade(const std::string& firmware_url) {
         return false;
     }
 
-    err = esp_ota_set_boot_partition(update_partition);
+    return SetBootPartition(update_partition);
+}
+
+// The background download switches at ActivateUpgrade() instead
+bool Ota::SetBootPartition(const esp_partition_t* partition) {
+    if (defer_boot_switch_) {
+        upgraded_partition_ = partition;
+        ESP_LOGI(TAG, "Firmware downloaded to %s, it boots once activated", partition->label);
+        return true;
+    }
+    esp_err_t err = esp_ota_set_boot_partition(partition);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to set boot partition: %s", esp_err_to_name(err));
         return false;
     }
-
     ESP_LOGI(TAG, "Firmware upgrade successful");
     return true;
 }
 
+// Holds the download to the rate limit, counting again from the moment the limit changed
+void Ota::Throttle(size_t received) {
+    size_t limit = rate_limit_;
+    int64_t now = esp_timer_get_time();
+    if (limit != throttle_limit_) {
+        throttle_limit_ = limit;
+        throttle_start_us_ = now;
+        throttle_bytes_ = 0;
+    }
+    if (limit == 0) {
+        return;
+    }
+    throttle_bytes_ += received;
+    int64_t due_us = throttle_start_us_ + (int64_t)throttle_bytes_ * 1000000 / limit;
+    if (due_us > now) {
+        // The socket is not read meanwhile, the TCP window holds the server back
+        vTaskDelay(std::max<TickType_t>(1, pdMS_TO_TICKS((due_us - now) / 1000)));
+    }
+}
+
+bool Ota::StartBackgroundUpgrade(std::function<void(bool success)> done) {
+    upgrade_done_ = std::move(done);
+    defer_boot_switch_ = true;
+    upgraded_partition_ = nullptr;
+    auto ret = TaskPlacements::Create(kTaskOtaDownload, [](void* arg) {
+        auto self = static_cast<Ota*>(arg);
+        bool success = self->StartUpgrade(nullptr);
+        // The object may be gone once done returns
+        auto done = std::move(self->upgrade_done_);
+        done(success);
+        TaskPlacements::Delete(kTaskOtaDownload);
+    }, this);
+    if (ret != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the background download task");
+        upgrade_done_ = nullptr;
+        return false;
+    }
+    return true;
+}
+
+bool Ota::ActivateUpgrade() {
+    if (upgraded_partition_ == nullptr) {
+        return false;
+    }
+    defer_boot_switch_ = false;
+    return SetBootPartition(upgraded_partition_);
+}
+
+std::unique_ptr<Ota> Ota::CloneUpgrade() const {
+    auto ota = std::make_unique<Ota>();
+    ota->has_new_version_ = has_new_version_;
+    ota->current_version_ = current_version_;
+    ota->firmware_version_ = firmware_version_;
+    ota->firmware_url_ = firmware_url_;
+    ota->delta_url_ = delta_url_;
+    ota->delta_sha256_ = delta_sha256_;
+    ota->running_image_sha256_ = running_image_sha256_;
+    return ota;
+}
+
 bool Ota::StartUpgrade(std::function<void(int progress, size_t speed)> callback) {
     upgrade_callback_ = callback;
+#if CONFIG_OTA_DELTA_UPDATE
+    if (!delta_url_.empty()) {
+        if (UpgradeDelta(delta_url_, delta_sha256_)) {
+            return true;
+        }
+        ESP_LOGW(TAG, "Delta update failed, downloading the full image");
+    }
+#endif
     return Upgrade(firmware_url_);
 }
 
+#if CONFIG_OTA_DELTA_UPDATE
+namespace {
+
+struct DeltaOutput {
+    esp_ota_handle_t handle;
+    mbedtls_sha256_context sha;
+    size_t written;
+};
+
+const esp_partition_t* g_delta_source = nullptr;
+
+// The patch reads the old image from the running partition
+esp_err_t ReadDeltaSource(uint8_t* buf, size_t size, int offset) {
+    return esp_partition_read(g_delta_source, offset, buf, size);
+}
+
+esp_err_t WriteDeltaOutput(const uint8_t* buf, size_t size, void* user_data) {
+    auto output = static_cast<DeltaOutput*>(user_data);
+    mbedtls_sha256_update(&output->sha, buf, size);
+    output->written += size;
+    return esp_ota_write(output->handle, buf, size);
+}
+
+std::string HexString(const uint8_t* data, size_t length) {
+    std::string hex;
+    char byte[3];
+    for (size_t i = 0; i < length; i++) {
+        snprintf(byte, sizeof(byte), "%02x", data[i]);
+        hex += byte;
+    }
+    return hex;
+}
+
+} // namespace
+
+std::string Ota::GetRunningImageSha256() {
+    if (running_image_sha256_.empty()) {
+        uint8_t sha[32];
+        if (esp_partition_get_sha256(esp_ota_get_running_partition(), sha) == ESP_OK) {
+            running_image_sha256_ = HexString(sha, sizeof(sha));
+        }
+    }
+    return running_image_sha256_;
+}
+
+/*
+ * Applies a detools patch (heatshrink compressed) against the running image while it downloads,
+ * writing the new image into the next OTA partition. The SHA-256 of the result must match the
+ * one announced with the patch before the boot partition is switched.
+ */
+bool Ota::UpgradeDelta(const std::string& patch_url, const std::string& image_sha256) {
+    ESP_LOGI(TAG, "Upgrading firmware with the patch %s", patch_url.c_str());
+    auto update_partition = esp_ota_get_next_update_partition(NULL);
+    if (update_partition == NULL) {
+        ESP_LOGE(TAG, "Failed to get update partition");
+        return false;
+    }
+
+    auto network = Board::GetInstance().GetNetwork();
+    auto http = network->CreateHttp(0);
+    if (!http->Open("GET", patch_url)) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection");
+        return false;
+    }
+    if (http->GetStatusCode() != 200) {
+        ESP_LOGE(TAG, "Failed to get the patch, status code: %d", http->GetStatusCode());
+        return false;
+    }
+    size_t content_length = http->GetBodyLength();
+    if (content_length == 0) {
+        ESP_LOGE(TAG, "Failed to get content length");
+        return false;
+    }
+
+    DeltaOutput output = {};
+    if (esp_ota_begin(update_partition, OTA_SIZE_UNKNOWN, &output.handle) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to begin OTA");
+        return false;
+    }
+    mbedtls_sha256_init(&output.sha);
+    mbedtls_sha256_starts(&output.sha, 0);
+
+    g_delta_source = esp_ota_get_running_partition();
+    esp_delta_ota_cfg_t cfg = {};
+    cfg.user_data = &output;
+    cfg.read_cb = ReadDeltaSource;
+    cfg.write_cb = WriteDeltaOutput;
+    auto delta = esp_delta_ota_init(&cfg);
+    if (delta == nullptr) {
+        ESP_LOGE(TAG, "Failed to initialize the delta update");
+        mbedtls_sha256_free(&output.sha);
+        esp_ota_abort(output.handle);
+        return false;
+    }
+
+    std::vector<uint8_t> buffer(4096);
+    size_t total_read = 0, recent_read = 0;
+    auto last_calc_time = esp_timer_get_time();
+    bool ok = true;
+    while (true) {
+        int ret = http->Read((char*)buffer.data(), buffer.size());
+        if (ret < 0) {
+            ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
+            ok = false;
+            break;
+        }
+        if (ret == 0) {
+            break;
+        }
+        if (esp_delta_ota_feed_patch(delta, buffer.data(), ret) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to apply the patch at %u", total_read);
+            ok = false;
+            break;
+        }
+        recent_read += ret;
+        total_read += ret;
+        Throttle(ret);
+        if (esp_timer_get_time() - last_calc_time >= 1000000) {
+            size_t progress = total_read * 100 / content_length;
+            ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %uB/s", progress, total_read, content_length, recent_read);
+            if (upgrade_callback_) {
+                upgrade_callback_(progress, recent_read);
+            }
+            last_calc_time = esp_timer_get_time();
+            recent_read = 0;
+        }
+    }
+    http->Close();
+    if (ok && esp_delta_ota_finalize(delta) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to finalize the patch");
+        ok = false;
+    }
+    esp_delta_ota_deinit(delta);
+
+    uint8_t sha[32];
+    mbedtls_sha256_finish(&output.sha, sha);
+    mbedtls_sha256_free(&output.sha);
+    if (ok && HexString(sha, sizeof(sha)) != image_sha256) {
+        ESP_LOGE(TAG, "The patched image does not match its SHA-256");
+        ok = false;
+    }
+    if (!ok) {
+        esp_ota_abort(output.handle);
+        return false;
+    }
+    ESP_LOGI(TAG, "Patched %u bytes into an image of %u bytes", total_read, output.written);
+
+    esp_err_t err = esp_ota_end(output.handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to end OTA: %s", esp_err_to_name(err));
+        return false;
+    }
+    return SetBootPartition(update_partition);
+}
+#endif
+
 bool Ota::StartUpgradeFromUrl(const std::string& url, std::function<void(int progress, size_t speed)> callback) {
     upgrade_callback_ = callback;
     return Upgrade(url);
@@ -453,22 +1023,21 @@ esp_err_t Ota::Activate() {
         url += "activate";
     }
 
-    auto http = SetupHttp();
-
-    std::string data = GetActivationPayload();
-    http->SetContent(std::move(data));
-
-    if (!http->Open("POST", url)) {
+    // Polled on the connection of the version check
+    auto http = OpenHttp("POST", url, GetActivationPayload());
+    if (http == nullptr) {
         ESP_LOGE(TAG, "Failed to open HTTP connection");
         return ESP_FAIL;
     }
     
     auto status_code = http->GetStatusCode();
+    // The body is read to the end, the next request goes on the same connection
+    std::string body = http->ReadAll();
     if (status_code == 202) {
         return ESP_ERR_TIMEOUT;
     }
     if (status_code != 200) {
-        ESP_LOGE(TAG, "Failed to activate, code: %d, body: %s", status_code, http->ReadAll().c_str());
+        ESP_LOGE(TAG, "Failed to activate, code: %d, body: %s", status_code, body.c_str());
         return ESP_FAIL;
     }
 
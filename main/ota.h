@@ -1,10 +1,15 @@
 #ifndef _OTA_H
 #define _OTA_H
 
+#include <atomic>
 #include <functional>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <esp_err.h>
+#include <esp_partition.h>
+#include <cJSON.h>
 #include "board.h"
 
 class Ota {
@@ -22,7 +27,20 @@ public:
     bool HasServerTime() { return has_server_time_; }
     bool StartUpgrade(std::function<void(int progress, size_t speed)> callback);
     bool StartUpgradeFromUrl(const std::string& url, std::function<void(int progress, size_t speed)> callback);
+    // Downloads the offered version on a task of its own and leaves the boot partition alone,
+    // done is called on that task. The object must stay until then
+    bool StartBackgroundUpgrade(std::function<void(bool success)> done);
+    // Bytes per second of the background download, 0 for no limit. Any task
+    void SetRateLimit(size_t bytes_per_second) { rate_limit_ = bytes_per_second; }
+    // Switches the boot partition to the image of the background download
+    bool ActivateUpgrade();
+    // The offered version in an object of its own, the background download outlives the check
+    std::unique_ptr<Ota> CloneUpgrade() const;
     void MarkCurrentVersionValid();
+    // The first boot of an upgraded image, its rollback is not cancelled yet
+    bool IsPendingVerify();
+    // Closes the connection kept by CheckVersion() and Activate(), once the boot is done with them
+    void ReleaseHttp();
 
     const std::string& GetFirmwareVersion() const { return firmware_version_; }
     const std::string& GetCurrentVersion() const { return current_version_; }
@@ -44,16 +62,41 @@ private:
     std::string current_version_;
     std::string firmware_version_;
     std::string firmware_url_;
+    // A patch against the running image offered with the new version, empty if there is none
+    std::string delta_url_;
+    std::string delta_sha256_;
+    std::string running_image_sha256_;
     std::string activation_challenge_;
     std::string serial_number_;
     int activation_timeout_ms_ = 30000;
+    // The keep-alive connection to the OTA host
+    std::unique_ptr<Http> http_;
+    bool http_reused_ = false;
+    // Sent with the version check only, see Telemetry
+    std::string telemetry_header_;
 
     bool Upgrade(const std::string& firmware_url);
+    bool UpgradeDelta(const std::string& patch_url, const std::string& image_sha256);
+    std::string GetRunningImageSha256();
     std::function<void(int progress, size_t speed)> upgrade_callback_;
+    // The background download, the image boots only after ActivateUpgrade()
+    std::function<void(bool success)> upgrade_done_;
+    bool defer_boot_switch_ = false;
+    const esp_partition_t* upgraded_partition_ = nullptr;
+    std::atomic<size_t> rate_limit_ = 0;
+    size_t throttle_limit_ = 0;
+    int64_t throttle_start_us_ = 0;
+    size_t throttle_bytes_ = 0;
+    void Throttle(size_t received);
+    bool SetBootPartition(const esp_partition_t* partition);
     std::vector<int> ParseVersion(const std::string& version);
     bool IsNewVersionAvailable(const std::string& currentVersion, const std::string& newVersion);
     std::string GetActivationPayload();
-    std::unique_ptr<Http> SetupHttp();
+    Http* SetupHttp();
+    // Sends the request on the kept connection, reconnecting once if the server closed it.
+    // nullptr when it could not be sent, the connection is released then
+    Http* OpenHttp(const std::string& method, const std::string& url, const std::string& content);
+    void HandleCheckVersionSection(cJSON* section);
 };
 
 #endif // _OTA_H
@@ -0,0 +1,148 @@
+#include "performance_profile.h"
+
+#include <esp_log.h>
+
+#include <cstring>
+
+#define TAG "PerfProfile"
+
+static const char* const PROFILE_NAMES[kPerformanceProfileCount] = {"performance", "balanced", "saver"};
+
+const char* PerformanceProfileName(PerformanceProfile profile) {
+    return profile < kPerformanceProfileCount ? PROFILE_NAMES[profile] : "auto";
+}
+
+PerformanceProfile PerformanceProfileFromName(const char* name) {
+    for (int i = 0; i < kPerformanceProfileCount; i++) {
+        if (strcmp(name, PROFILE_NAMES[i]) == 0) {
+            return static_cast<PerformanceProfile>(i);
+        }
+    }
+    return kPerformanceProfileCount;
+}
+
+#if CONFIG_USE_PERFORMANCE_PROFILES
+
+#include "application.h"
+#include "board.h"
+#include "backlight.h"
+#include "led/led.h"
+#include "settings.h"
+#include "power_policy.h"
+#include "network_power_policy.h"
+
+struct PerformanceProfileSettings {
+    AfeProfile afe_profile_limit;
+    int encoder_complexity_limit;
+    uint8_t brightness_limit;
+    bool led_power_saving;
+    bool network_power_save;
+    bool idle_cpu_boost;
+};
+
+static const PerformanceProfileSettings PROFILE_SETTINGS[kPerformanceProfileCount] = {
+    // performance
+    {kAfeProfileHighQuality, ENCODER_MAX_COMPLEXITY, 100, false, false, true},
+    // balanced
+    {kAfeProfileHighQuality, ENCODER_MAX_COMPLEXITY, 100, false, true, false},
+    // saver
+    {kAfeProfileLowPower, 0, CONFIG_PERFORMANCE_PROFILE_SAVER_BRIGHTNESS, true, true, false},
+};
+
+PerformanceProfileManager::PerformanceProfileManager() {
+    Settings settings("power", false);
+    override_ = PerformanceProfileFromName(settings.GetString("perf_profile", "auto").c_str());
+}
+
+void PerformanceProfileManager::OnClockTick() {
+    if (!applied_once_) {
+        // The network and the display are up from the first idle on
+        if (Application::GetInstance().GetDeviceState() != kDeviceStateIdle) {
+            return;
+        }
+    } else if (++ticks_ < PERFORMANCE_PROFILE_POLL_SECONDS) {
+        return;
+    }
+    ticks_ = 0;
+    Update();
+}
+
+void PerformanceProfileManager::SetOverride(PerformanceProfile profile) {
+    override_ = profile;
+    {
+        Settings settings("power", true);
+        settings.SetString("perf_profile", PerformanceProfileName(profile));
+    }
+    Update();
+}
+
+void PerformanceProfileManager::Update() {
+    bool charging, discharging;
+    int level;
+    has_battery_ = Board::GetInstance().GetBatteryLevel(level, charging, discharging);
+    if (has_battery_) {
+        battery_level_ = level;
+        external_power_ = !discharging;
+    } else {
+        battery_level_ = -1;
+        external_power_ = false;
+    }
+
+    auto profile = Choose();
+    if (applied_once_ && profile == active_) {
+        return;
+    }
+    ESP_LOGI(TAG, "Profile %s -> %s (%s, battery %d%%, %s)", PerformanceProfileName(active_),
+        PerformanceProfileName(profile), override_ != kPerformanceProfileCount ? "override" : "auto",
+        battery_level_, external_power_ ? "external power" : "no external power");
+    active_ = profile;
+    applied_once_ = true;
+    Apply(profile);
+}
+
+PerformanceProfile PerformanceProfileManager::Choose() const {
+    if (override_ != kPerformanceProfileCount) {
+        return override_;
+    }
+    if (!has_battery_) {
+        // Nothing tells the power source
+        return kPerformanceProfileBalanced;
+    }
+    if (external_power_) {
+        return kPerformanceProfilePerformance;
+    }
+    int saver_level = CONFIG_PERFORMANCE_PROFILE_SAVER_BATTERY_LEVEL;
+    if (applied_once_ && active_ == kPerformanceProfileSaver) {
+        saver_level += PERFORMANCE_PROFILE_HYSTERESIS;
+    }
+    return battery_level_ <= saver_level ? kPerformanceProfileSaver : kPerformanceProfileBalanced;
+}
+
+void PerformanceProfileManager::Apply(PerformanceProfile profile) {
+    auto& settings = PROFILE_SETTINGS[profile];
+    auto& board = Board::GetInstance();
+    auto& audio_service = Application::GetInstance().GetAudioService();
+    audio_service.SetAfeProfileLimit(settings.afe_profile_limit);
+    audio_service.SetEncoderComplexityLimit(settings.encoder_complexity_limit);
+    auto backlight = board.GetBacklight();
+    if (backlight != nullptr) {
+        backlight->SetBrightnessLimit(settings.brightness_limit);
+    }
+    board.GetLed()->SetPowerSaving(settings.led_power_saving);
+    NetworkPowerPolicy::GetInstance().SetPowerSaveAllowed(settings.network_power_save);
+    PowerPolicy::GetInstance().SetIdleCpuBoost(settings.idle_cpu_boost);
+}
+
+cJSON* PerformanceProfileManager::GetStatusJson() {
+    auto json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "active", PerformanceProfileName(active_));
+    cJSON_AddStringToObject(json, "override", PerformanceProfileName(override_));
+    cJSON_AddBoolToObject(json, "has_battery", has_battery_);
+    if (has_battery_) {
+        cJSON_AddBoolToObject(json, "external_power", external_power_);
+        cJSON_AddNumberToObject(json, "battery_level", battery_level_);
+    }
+    return json;
+}
+
+#endif
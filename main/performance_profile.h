@@ -0,0 +1,84 @@
+#ifndef PERFORMANCE_PROFILE_H
+#define PERFORMANCE_PROFILE_H
+
+#include <sdkconfig.h>
+#include <cJSON.h>
+
+// How often the power source and the battery level are read
+#define PERFORMANCE_PROFILE_POLL_SECONDS 10
+// The battery leaves the saver profile this many percent above the level it entered it
+#define PERFORMANCE_PROFILE_HYSTERESIS 5
+
+enum PerformanceProfile {
+    kPerformanceProfilePerformance,
+    kPerformanceProfileBalanced,
+    kPerformanceProfileSaver,
+    kPerformanceProfileCount,   // Also the automatic choice
+};
+
+const char* PerformanceProfileName(PerformanceProfile profile);
+// kPerformanceProfileCount for the unknown names
+PerformanceProfile PerformanceProfileFromName(const char* name);
+
+/*
+ * One set of the power related knobs, picked from the power source of the board.
+ *
+ *   performance  External power (USB): the idle CPU frequency stays at the maximum and the
+ *                modem does not sleep, so the first words after the wake word are not late.
+ *   balanced     On battery, or a board without one: the behaviour of before.
+ *   saver        Battery at or below CONFIG_PERFORMANCE_PROFILE_SAVER_BATTERY_LEVEL: the AFE
+ *                is held at the low-power profile, the Opus complexity at 0, the backlight at
+ *                CONFIG_PERFORMANCE_PROFILE_SAVER_BRIGHTNESS and the idle LED is off.
+ *
+ * The settings of each knob stay as they are: the profile only caps the AFE profile, the
+ * encoder complexity and the brightness, and only allows more wake time to the CPU and the
+ * modem policies. The server, or the user, can pin a profile with
+ * self.power.set_performance_profile, kept across reboots, "auto" goes back to the choice.
+ *
+ * Main loop only, nothing is applied before the first idle state.
+ */
+#if CONFIG_USE_PERFORMANCE_PROFILES
+class PerformanceProfileManager {
+public:
+    static PerformanceProfileManager& GetInstance() {
+        static PerformanceProfileManager instance;
+        return instance;
+    }
+    PerformanceProfileManager(const PerformanceProfileManager&) = delete;
+    PerformanceProfileManager& operator=(const PerformanceProfileManager&) = delete;
+
+    // Called by Application::OnClockTick
+    void OnClockTick();
+    // kPerformanceProfileCount goes back to the automatic choice
+    void SetOverride(PerformanceProfile profile);
+    PerformanceProfile active() const { return active_; }
+    // The active profile, the override and the inputs of the choice
+    cJSON* GetStatusJson();
+
+private:
+    PerformanceProfileManager();
+
+    bool applied_once_ = false;
+    int ticks_ = 0;
+    PerformanceProfile active_ = kPerformanceProfileBalanced;
+    PerformanceProfile override_ = kPerformanceProfileCount;
+    bool has_battery_ = false;
+    bool external_power_ = false;
+    int battery_level_ = -1;
+
+    void Update();
+    PerformanceProfile Choose() const;
+    void Apply(PerformanceProfile profile);
+};
+#else
+class PerformanceProfileManager {
+public:
+    static PerformanceProfileManager& GetInstance() {
+        static PerformanceProfileManager instance;
+        return instance;
+    }
+    void OnClockTick() {}
+};
+#endif
+
+#endif // PERFORMANCE_PROFILE_H
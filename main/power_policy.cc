@@ -0,0 +1,186 @@
+#include "power_policy.h"
+
+#if CONFIG_USE_STATE_POWER_POLICY
+
+#include <esp_log.h>
+#include <cstdio>
+
+#define TAG "PowerPolicy"
+
+#define POWER_POLICY_REPORT_INTERVAL_MS 60000
+
+#if CONFIG_POWER_POLICY_MEASUREMENT
+static const char* const STATE_NAMES[POWER_POLICY_STATES] = {
+    "unknown",
+    "starting",
+    "configuring",
+    "idle",
+    "connecting",
+    "listening",
+    "speaking",
+    "upgrading",
+    "activating",
+    "audio_testing",
+    "fatal_error",
+};
+#endif
+
+PowerPolicy::~PowerPolicy() {
+#if CONFIG_POWER_POLICY_MEASUREMENT
+    if (report_timer_ != nullptr) {
+        esp_timer_stop(report_timer_);
+        esp_timer_delete(report_timer_);
+    }
+#endif
+    if (cpu_lock_ != nullptr) {
+        if (cpu_locked_) {
+            esp_pm_lock_release(cpu_lock_);
+        }
+        esp_pm_lock_delete(cpu_lock_);
+    }
+    if (sleep_lock_ != nullptr) {
+        if (sleep_locked_) {
+            esp_pm_lock_release(sleep_lock_);
+        }
+        esp_pm_lock_delete(sleep_lock_);
+    }
+}
+
+void PowerPolicy::Initialize() {
+    initialized_ = true;
+    // The locks come first, the frequency must not drop before the current state holds them
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "device_state", &cpu_lock_));
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "device_state", &sleep_lock_));
+    esp_pm_lock_acquire(cpu_lock_);
+    esp_pm_lock_acquire(sleep_lock_);
+    cpu_locked_ = true;
+    sleep_locked_ = true;
+
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_POWER_POLICY_IDLE_CPU_FREQ_MHZ,
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+        .light_sleep_enable = true,
+#else
+        .light_sleep_enable = false,
+#endif
+    };
+    esp_err_t ret = esp_pm_configure(&pm_config);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure power management: %s", esp_err_to_name(ret));
+    } else {
+        ESP_LOGI(TAG, "CPU %d-%d MHz, light sleep %s", pm_config.min_freq_mhz, pm_config.max_freq_mhz,
+            pm_config.light_sleep_enable ? "on" : "off");
+    }
+
+#if CONFIG_POWER_POLICY_MEASUREMENT
+    state_since_us_ = esp_timer_get_time();
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            ((PowerPolicy*)arg)->Report();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "power_policy",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&timer_args, &report_timer_);
+    esp_timer_start_periodic(report_timer_, POWER_POLICY_REPORT_INTERVAL_MS * 1000);
+#endif
+}
+
+void PowerPolicy::OnStateChanged(DeviceState state) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!initialized_) {
+        Initialize();
+    }
+#if CONFIG_POWER_POLICY_MEASUREMENT
+    int64_t now = esp_timer_get_time();
+    if (state_ < POWER_POLICY_STATES) {
+        residency_us_[state_] += now - state_since_us_;
+    }
+    state_since_us_ = now;
+    // Marks the trace of a power analyzer, the timestamp is the time since boot
+    ESP_LOGI(TAG, "MEASURE %lld ms: %s", now / 1000, state < POWER_POLICY_STATES ? STATE_NAMES[state] : "invalid");
+#endif
+    state_ = state;
+    ApplyLocked();
+}
+
+void PowerPolicy::SetModemSleep(bool enabled) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    modem_sleep_ = enabled;
+    if (initialized_) {
+        ApplyLocked();
+    }
+}
+
+void PowerPolicy::SetIdleCpuBoost(bool boost) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_cpu_boost_ = boost;
+    if (initialized_) {
+        ApplyLocked();
+    }
+}
+
+void PowerPolicy::ApplyLocked() {
+    bool active;
+    switch (state_) {
+        case kDeviceStateUnknown:
+        case kDeviceStateIdle:
+        case kDeviceStateFatalError:
+            active = false;
+            break;
+        default:
+            active = true;
+            break;
+    }
+    bool cpu_lock = active || idle_cpu_boost_;
+    // Without the modem sleep the station has to stay awake for every beacon
+    bool sleep_lock = active || !modem_sleep_;
+
+    if (cpu_lock != cpu_locked_) {
+        cpu_lock ? esp_pm_lock_acquire(cpu_lock_) : esp_pm_lock_release(cpu_lock_);
+        cpu_locked_ = cpu_lock;
+    }
+    if (sleep_lock != sleep_locked_) {
+        sleep_lock ? esp_pm_lock_acquire(sleep_lock_) : esp_pm_lock_release(sleep_lock_);
+        sleep_locked_ = sleep_lock;
+    }
+    ESP_LOGD(TAG, "Max frequency %s, light sleep %s", cpu_locked_ ? "locked" : "released",
+        sleep_locked_ ? "locked" : "allowed");
+}
+
+#if CONFIG_POWER_POLICY_MEASUREMENT
+void PowerPolicy::Report() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    int64_t residency_us[POWER_POLICY_STATES];
+    int64_t total_us = 0;
+    for (int i = 0; i < POWER_POLICY_STATES; i++) {
+        residency_us[i] = residency_us_[i];
+        if (i == state_) {
+            residency_us[i] += now - state_since_us_;
+        }
+        total_us += residency_us[i];
+    }
+    if (total_us == 0) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "Time per state since boot (max frequency %s, light sleep %s):",
+        cpu_locked_ ? "locked" : "released", sleep_locked_ ? "locked" : "allowed");
+    for (int i = 0; i < POWER_POLICY_STATES; i++) {
+        if (residency_us[i] > 0) {
+            ESP_LOGI(TAG, "  %-14s %8lld s %3d%%", STATE_NAMES[i], residency_us[i] / 1000000,
+                (int)(residency_us[i] * 100 / total_us));
+        }
+    }
+#if CONFIG_PM_PROFILING
+    // Time spent in each frequency mode and light sleep, and who held the locks
+    esp_pm_dump_locks(stdout);
+#endif
+}
+#endif
+
+#endif // CONFIG_USE_STATE_POWER_POLICY
@@ -0,0 +1,86 @@
+#ifndef POWER_POLICY_H
+#define POWER_POLICY_H
+
+#include <sdkconfig.h>
+#include <esp_pm.h>
+#include <esp_timer.h>
+
+#include <mutex>
+#include <cstdint>
+
+#include "device_state.h"
+
+// The states the residency is counted for, the same order as DeviceState
+#define POWER_POLICY_STATES (kDeviceStateFatalError + 1)
+
+/*
+ * CPU frequency and light sleep follow the device state.
+ *
+ * esp_pm runs between CONFIG_POWER_POLICY_IDLE_CPU_FREQ_MHZ and the default CPU frequency, with
+ * automatic light sleep when tickless idle is enabled. The states that move audio or data
+ * (starting, connecting, listening, speaking, upgrading...) hold a CPU_FREQ_MAX and a
+ * NO_LIGHT_SLEEP lock. In idle the frequency lock is released, so waiting for the wake word
+ * runs at the lower frequency whenever the CPU is not busy. The light sleep lock is only
+ * released while the network allows it, i.e. the board turned on the Wi-Fi modem sleep,
+ * otherwise the station would miss the beacons. The I2S driver keeps its own lock while the
+ * microphone is on, so the chip really sleeps once the PowerSaveTimer turns the input off.
+ *
+ * With CONFIG_POWER_POLICY_MEASUREMENT every state change is logged with a timestamp, so a
+ * current trace from a power analyzer can be cut per state, and the time spent in each state
+ * is logged every minute.
+ *
+ * Without CONFIG_USE_STATE_POWER_POLICY every method is an empty inline.
+ */
+class PowerPolicy {
+public:
+    static PowerPolicy& GetInstance() {
+        static PowerPolicy instance;
+        return instance;
+    }
+    PowerPolicy(const PowerPolicy&) = delete;
+    PowerPolicy& operator=(const PowerPolicy&) = delete;
+
+#if CONFIG_USE_STATE_POWER_POLICY
+    // Called by Application::SetDeviceState
+    void OnStateChanged(DeviceState state);
+    // Called by the board when the Wi-Fi modem sleep is turned on or off
+    void SetModemSleep(bool enabled);
+    // Holds the maximum frequency in idle too, the performance profile on external power
+    void SetIdleCpuBoost(bool boost);
+#else
+    void OnStateChanged(DeviceState state) {}
+    void SetModemSleep(bool enabled) {}
+    void SetIdleCpuBoost(bool boost) {}
+#endif
+
+private:
+    PowerPolicy() = default;
+
+#if CONFIG_USE_STATE_POWER_POLICY
+    ~PowerPolicy();
+
+    std::mutex mutex_;
+    bool initialized_ = false;
+    esp_pm_lock_handle_t cpu_lock_ = nullptr;
+    esp_pm_lock_handle_t sleep_lock_ = nullptr;
+    bool cpu_locked_ = false;
+    bool sleep_locked_ = false;
+    bool modem_sleep_ = false;
+    bool idle_cpu_boost_ = false;
+    DeviceState state_ = kDeviceStateUnknown;
+
+#if CONFIG_POWER_POLICY_MEASUREMENT
+    esp_timer_handle_t report_timer_ = nullptr;
+    int64_t state_since_us_ = 0;
+    int64_t residency_us_[POWER_POLICY_STATES] = {};
+
+    void Report();
+#endif
+
+    // Called with the lock held
+    void Initialize();
+    void ApplyLocked();
+#endif
+};
+
+#endif // POWER_POLICY_H
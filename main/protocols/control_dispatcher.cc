@@ -0,0 +1,123 @@
+#include "control_dispatcher.h"
+#include "msgpack.h"
+#include "json_arena.h"
+#include "task_placement.h"
+
+#include <esp_log.h>
+
+#define TAG "ControlDispatcher"
+
+ControlDispatcher::ControlDispatcher(Handler handler) : handler_(std::move(handler)) {
+#if CONFIG_USE_CONTROL_DISPATCH_TASK
+    done_ = xSemaphoreCreateBinary();
+    if (TaskPlacements::Create(kTaskControlDispatch, [](void* arg) {
+            auto self = static_cast<ControlDispatcher*>(arg);
+            self->Loop();
+            xSemaphoreGive(self->done_);
+            TaskPlacements::Delete(kTaskControlDispatch);
+        }, this, &task_) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the control dispatch task, the messages are handled in place");
+        task_ = nullptr;
+    }
+#endif
+}
+
+ControlDispatcher::~ControlDispatcher() {
+    Stop();
+#if CONFIG_USE_CONTROL_DISPATCH_TASK
+    vSemaphoreDelete(done_);
+#endif
+}
+
+void ControlDispatcher::Post(const char* data, size_t size, bool msgpack) {
+#if CONFIG_USE_CONTROL_DISPATCH_TASK
+    if (task_ != nullptr) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        // Only a backlog waits, a message larger than the bound still goes in alone
+        space_.wait(lock, [this, size]() {
+            return stopped_ || pending_.empty() || pending_bytes_ + size <= CONTROL_DISPATCH_MAX_PENDING_BYTES;
+        });
+        if (stopped_) {
+            return;
+        }
+        pending_.push_back({std::string(data, size), msgpack});
+        pending_bytes_ += size;
+        lock.unlock();
+        xTaskNotifyGive(task_);
+        return;
+    }
+#endif
+    Handle(data, size, msgpack);
+}
+
+void ControlDispatcher::Stop() {
+#if CONFIG_USE_CONTROL_DISPATCH_TASK
+    size_t dropped;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopped_) {
+            return;
+        }
+        stopped_ = true;
+        dropped = pending_.size();
+        pending_.clear();
+        pending_bytes_ = 0;
+    }
+    space_.notify_all();
+    if (task_ != nullptr) {
+        xTaskNotifyGive(task_);
+        xSemaphoreTake(done_, portMAX_DELAY);
+        task_ = nullptr;
+    }
+    if (dropped > 0) {
+        ESP_LOGW(TAG, "%u control messages dropped", dropped);
+    }
+#endif
+}
+
+#if CONFIG_USE_CONTROL_DISPATCH_TASK
+void ControlDispatcher::Loop() {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (true) {
+            Message message;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stopped_) {
+                    return;
+                }
+                if (pending_.empty()) {
+                    break;
+                }
+                message = std::move(pending_.front());
+                pending_.pop_front();
+                pending_bytes_ -= message.data.size();
+            }
+            space_.notify_one();
+            Handle(message.data.data(), message.data.size(), message.msgpack);
+        }
+    }
+}
+#endif
+
+void ControlDispatcher::Handle(const char* data, size_t size, bool msgpack) {
+    JsonArena::Scope arena;
+    // Bounded by the message length rather than by a terminator
+    cJSON* root = msgpack ? Msgpack::Decode((const uint8_t*)data, size) : cJSON_ParseWithLength(data, size);
+    if (root == nullptr) {
+        if (msgpack) {
+            ESP_LOGE(TAG, "Failed to parse msgpack message, size: %u", size);
+        } else {
+            ESP_LOGE(TAG, "Failed to parse json message %.*s", (int)size, data);
+        }
+        return;
+    }
+    if (!handler_(root)) {
+        if (msgpack) {
+            ESP_LOGE(TAG, "Missing message type in msgpack control message");
+        } else {
+            ESP_LOGE(TAG, "Missing message type, data: %.*s", (int)size, data);
+        }
+    }
+    cJSON_Delete(root);
+}
@@ -0,0 +1,68 @@
+#ifndef CONTROL_DISPATCHER_H
+#define CONTROL_DISPATCHER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <cJSON.h>
+#include <sdkconfig.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+
+// Received control messages not handled yet, a larger backlog holds the network task back
+#define CONTROL_DISPATCH_MAX_PENDING_BYTES (32 * 1024)
+
+/*
+ * The receive stage of the control messages of a transport.
+ *
+ * The network task of the WebSocket or the MQTT client only copies the JSON or MessagePack text
+ * here and goes back to the connection, the binary audio frames keep their direct path to the
+ * jitter buffer. The messages are parsed and handled in the order they arrived on a task of their
+ * own (CONFIG_USE_CONTROL_DISPATCH_TASK), so a burst of large messages or an MCP request that
+ * takes long to parse no longer holds back the audio frames behind it. Without the option, or
+ * when the task cannot be created, Post() handles the message in place.
+ */
+class ControlDispatcher {
+public:
+    // Called with the parsed message, false if it has no type
+    using Handler = std::function<bool(const cJSON* root)>;
+
+    explicit ControlDispatcher(Handler handler);
+    ~ControlDispatcher();
+    ControlDispatcher(const ControlDispatcher&) = delete;
+    ControlDispatcher& operator=(const ControlDispatcher&) = delete;
+
+    // The network task, the data is copied
+    void Post(const char* data, size_t size, bool msgpack);
+    // Drops the messages not handled yet and waits for the one being handled, the later posts
+    // are dropped. Called first by the destructor of the transport, before its state goes
+    void Stop();
+
+private:
+    struct Message {
+        std::string data;
+        bool msgpack = false;
+    };
+
+    Handler handler_;
+#if CONFIG_USE_CONTROL_DISPATCH_TASK
+    std::mutex mutex_;
+    std::condition_variable space_;
+    std::deque<Message> pending_;
+    size_t pending_bytes_ = 0;
+    bool stopped_ = false;
+    TaskHandle_t task_ = nullptr;
+    SemaphoreHandle_t done_ = nullptr;
+
+    void Loop();
+#endif
+
+    void Handle(const char* data, size_t size, bool msgpack);
+};
+
+#endif // CONTROL_DISPATCHER_H
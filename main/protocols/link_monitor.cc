@@ -0,0 +1,204 @@
+#include "link_monitor.h"
+
+#include <esp_timer.h>
+#include <algorithm>
+#include <cstdlib>
+
+void LinkMonitor::StartSession() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int rtt_ms = metrics_.rtt_ms;
+    metrics_ = {};
+    metrics_.rtt_ms = rtt_ms;
+    metrics_.jitter_ms = jitter_us_ / 1000;
+    hello_sent_us_ = 0;
+    ping_sent_ms_ = 0;
+    report_sent_ = 0;
+    report_received_ = 0;
+    window_start_us_ = esp_timer_get_time();
+    window_uplink_bytes_ = 0;
+    window_downlink_bytes_ = 0;
+    window_downlink_packets_ = 0;
+    window_downlink_lost_ = 0;
+    arrival_sequence_ = 0;
+    last_arrival_us_ = 0;
+}
+
+void LinkMonitor::OnHelloSent() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    hello_sent_us_ = esp_timer_get_time();
+}
+
+void LinkMonitor::OnHelloAnswer() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (hello_sent_us_ != 0) {
+        AddRoundTrip(esp_timer_get_time() - hello_sent_us_);
+        hello_sent_us_ = 0;
+    }
+}
+
+int64_t LinkMonitor::StartPing() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ping_sent_ms_ = esp_timer_get_time() / 1000;
+    ping_uplink_packets_ = metrics_.uplink_packets;
+    return ping_sent_ms_;
+}
+
+void LinkMonitor::OnPong(int64_t timestamp_ms, int64_t received) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    if (timestamp_ms <= 0 || timestamp_ms > now_ms) {
+        return;
+    }
+    AddRoundTrip((now_ms - timestamp_ms) * 1000);
+
+    /* The count is compared with the packets sent before the ping, the later ones may still be in flight */
+    if (received < 0 || timestamp_ms != ping_sent_ms_) {
+        return;
+    }
+    uint32_t sent = ping_uplink_packets_ - report_sent_;
+    uint32_t arrived = std::min<uint32_t>(received - report_received_, sent);
+    if (sent > 0) {
+        metrics_.uplink_loss_permille = (sent - arrived) * 1000 / sent;
+    }
+    report_sent_ = ping_uplink_packets_;
+    report_received_ = received;
+}
+
+void LinkMonitor::AddRoundTrip(int64_t rtt_us) {
+    // Smoothed as the TCP SRTT, alpha 1/8
+    srtt_us_ = srtt_us_ < 0 ? rtt_us : srtt_us_ + (rtt_us - srtt_us_) / 8;
+    metrics_.rtt_ms = srtt_us_ / 1000;
+}
+
+void LinkMonitor::RollWindow(int64_t now_us) {
+    int64_t elapsed_us = now_us - window_start_us_;
+    if (elapsed_us < LINK_MONITOR_WINDOW_MS * 1000) {
+        return;
+    }
+    metrics_.uplink_bytes_per_second = static_cast<int64_t>(window_uplink_bytes_) * 1000000 / elapsed_us;
+    metrics_.downlink_bytes_per_second = static_cast<int64_t>(window_downlink_bytes_) * 1000000 / elapsed_us;
+    // The loss is kept over windows without downlink audio
+    uint32_t expected = window_downlink_packets_ + window_downlink_lost_;
+    if (expected > 0) {
+        metrics_.downlink_loss_permille = window_downlink_lost_ * 1000 / expected;
+    }
+    window_start_us_ = now_us;
+    window_uplink_bytes_ = 0;
+    window_downlink_bytes_ = 0;
+    window_downlink_packets_ = 0;
+    window_downlink_lost_ = 0;
+}
+
+void LinkMonitor::AddUplink(size_t bytes, uint32_t audio_packets) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    RollWindow(esp_timer_get_time());
+    window_uplink_bytes_ += bytes;
+    metrics_.uplink_bytes += bytes;
+    metrics_.uplink_packets += audio_packets;
+}
+
+void LinkMonitor::AddDownlink(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    RollWindow(esp_timer_get_time());
+    window_downlink_bytes_ += bytes;
+    metrics_.downlink_bytes += bytes;
+}
+
+void LinkMonitor::AddDownlinkPacket(uint32_t sequence, int frame_duration_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    RollWindow(now);
+    window_downlink_packets_++;
+    metrics_.downlink_packets++;
+    if (sequence == 0) {
+        sequence = ++arrival_sequence_;
+    }
+
+    /* Interarrival jitter as in RFC 3550, the sequence number times the frame duration is the send time */
+    int32_t advance = static_cast<int32_t>(sequence - last_arrival_sequence_);
+    if (last_arrival_us_ != 0 && advance <= 0) {
+        // Reordered or duplicated, the reference stays on the newest packet
+        return;
+    }
+    int64_t interval = now - last_arrival_us_;
+    if (last_arrival_us_ != 0 && frame_duration_ms > 0 && interval < LINK_MONITOR_BURST_GAP_MS * 1000) {
+        int64_t expected = static_cast<int64_t>(advance) * frame_duration_ms * 1000;
+        int64_t deviation = std::llabs(interval - expected);
+        jitter_us_ += (deviation - jitter_us_) / 16;
+        metrics_.jitter_ms = jitter_us_ / 1000;
+    }
+    last_arrival_us_ = now;
+    last_arrival_sequence_ = sequence;
+}
+
+void LinkMonitor::AddDownlinkLost(int32_t count) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    window_downlink_lost_ = std::max<int64_t>(static_cast<int64_t>(window_downlink_lost_) + count, 0);
+    metrics_.downlink_lost = std::max<int64_t>(static_cast<int64_t>(metrics_.downlink_lost) + count, 0);
+}
+
+LinkMetrics LinkMonitor::GetMetrics() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    RollWindow(esp_timer_get_time());
+    return metrics_;
+}
+
+void LinkMonitor::OnDisconnected() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (disconnected_us_ != 0) {
+        return;
+    }
+    disconnected_us_ = esp_timer_get_time();
+    reconnect_.disconnects++;
+    reconnect_.attempts = 0;
+}
+
+void LinkMonitor::OnReconnectFailed() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    reconnect_.attempts++;
+}
+
+int LinkMonitor::OnReconnected() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (disconnected_us_ == 0) {
+        return -1;
+    }
+    reconnect_.last_latency_ms = (esp_timer_get_time() - disconnected_us_) / 1000;
+    reconnect_.max_latency_ms = std::max(reconnect_.max_latency_ms, reconnect_.last_latency_ms);
+    reconnect_.reconnects++;
+    disconnected_us_ = 0;
+    return reconnect_.last_latency_ms;
+}
+
+ReconnectMetrics LinkMonitor::GetReconnectMetrics() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return reconnect_;
+}
+
+cJSON* LinkMetricsToJson(const LinkMetrics& metrics) {
+    auto root = cJSON_CreateObject();
+    if (metrics.rtt_ms >= 0) {
+        cJSON_AddNumberToObject(root, "rtt_ms", metrics.rtt_ms);
+    }
+    cJSON_AddNumberToObject(root, "jitter_ms", metrics.jitter_ms);
+    cJSON_AddNumberToObject(root, "uplink_loss_permille", metrics.uplink_loss_permille);
+    cJSON_AddNumberToObject(root, "downlink_loss_permille", metrics.downlink_loss_permille);
+    cJSON_AddNumberToObject(root, "uplink_bytes_per_second", metrics.uplink_bytes_per_second);
+    cJSON_AddNumberToObject(root, "downlink_bytes_per_second", metrics.downlink_bytes_per_second);
+    cJSON_AddNumberToObject(root, "uplink_packets", metrics.uplink_packets);
+    cJSON_AddNumberToObject(root, "downlink_packets", metrics.downlink_packets);
+    cJSON_AddNumberToObject(root, "downlink_lost", metrics.downlink_lost);
+    return root;
+}
+
+cJSON* ReconnectMetricsToJson(const ReconnectMetrics& metrics) {
+    auto root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "disconnects", metrics.disconnects);
+    cJSON_AddNumberToObject(root, "reconnects", metrics.reconnects);
+    cJSON_AddNumberToObject(root, "attempts", metrics.attempts);
+    if (metrics.last_latency_ms >= 0) {
+        cJSON_AddNumberToObject(root, "last_latency_ms", metrics.last_latency_ms);
+        cJSON_AddNumberToObject(root, "max_latency_ms", metrics.max_latency_ms);
+    }
+    return root;
+}
@@ -0,0 +1,107 @@
+#ifndef LINK_MONITOR_H
+#define LINK_MONITOR_H
+
+#include <cJSON.h>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+
+// Throughput and loss are measured over windows of this length
+#define LINK_MONITOR_WINDOW_MS 2000
+// A longer pause between downlink packets starts a new burst, it is not counted as jitter
+#define LINK_MONITOR_BURST_GAP_MS 500
+
+struct LinkMetrics {
+    int rtt_ms = -1;                        // Smoothed round-trip time, -1 until measured
+    int jitter_ms = 0;                      // Downlink audio interarrival jitter
+    uint32_t uplink_loss_permille = 0;      // From the server reports, 0 without them
+    uint32_t downlink_loss_permille = 0;    // From the sequence numbers, 0 on WebSocket
+    uint32_t uplink_bytes_per_second = 0;
+    uint32_t downlink_bytes_per_second = 0;
+    // Totals of the session
+    uint32_t uplink_bytes = 0;
+    uint32_t downlink_bytes = 0;
+    uint32_t uplink_packets = 0;
+    uint32_t downlink_packets = 0;
+    uint32_t downlink_lost = 0;
+};
+
+// Reconnections of the control connection, kept over the audio sessions
+struct ReconnectMetrics {
+    uint32_t disconnects = 0;
+    uint32_t reconnects = 0;
+    uint32_t attempts = 0;                  // Failed attempts since the last disconnect
+    int last_latency_ms = -1;               // From the disconnect to the reconnect, -1 until one happened
+    int max_latency_ms = -1;
+};
+
+/*
+ * Rolling link quality of the audio session, shared by the transports.
+ *
+ * The transports report every message sent and received, the downlink audio sequence numbers
+ * and the round trips (the hello exchange, then the ping/pong echoes when the server supports
+ * them). RTT and jitter are smoothed as in RFC 6298 and RFC 3550 and survive a new session,
+ * throughput and loss are computed per window.
+ *
+ * The methods may be called from the send, the receive and the main task.
+ */
+class LinkMonitor {
+public:
+    // A new audio session, the counters restart and the RTT and jitter estimates are kept
+    void StartSession();
+    void OnHelloSent();
+    void OnHelloAnswer();
+    // Returns the timestamp to send in the ping, the server echoes it in the pong
+    int64_t StartPing();
+    // received: uplink audio packets the server counted in the session, -1 if not reported
+    void OnPong(int64_t timestamp_ms, int64_t received);
+
+    void AddUplink(size_t bytes, uint32_t audio_packets = 0);
+    void AddDownlink(size_t bytes);
+    // One downlink audio packet, sequence is 0 when the transport has none
+    void AddDownlinkPacket(uint32_t sequence, int frame_duration_ms);
+    // Negative when a packet already counted as lost arrives late
+    void AddDownlinkLost(int32_t count);
+
+    LinkMetrics GetMetrics();
+
+    void OnDisconnected();
+    void OnReconnectFailed();
+    // Returns the time since the disconnect, -1 for the first connection
+    int OnReconnected();
+    ReconnectMetrics GetReconnectMetrics();
+
+private:
+    std::mutex mutex_;
+    LinkMetrics metrics_;
+    int64_t srtt_us_ = -1;
+    int64_t hello_sent_us_ = 0;
+    int64_t ping_sent_ms_ = 0;
+    uint32_t ping_uplink_packets_ = 0;
+    // Uplink packets sent and received at the last pong that carried a count
+    uint32_t report_sent_ = 0;
+    uint32_t report_received_ = 0;
+
+    int64_t window_start_us_ = 0;
+    uint32_t window_uplink_bytes_ = 0;
+    uint32_t window_downlink_bytes_ = 0;
+    uint32_t window_downlink_packets_ = 0;
+    uint32_t window_downlink_lost_ = 0;
+
+    uint32_t arrival_sequence_ = 0;
+    uint32_t last_arrival_sequence_ = 0;
+    int64_t last_arrival_us_ = 0;
+    int64_t jitter_us_ = 0;
+
+    ReconnectMetrics reconnect_;
+    int64_t disconnected_us_ = 0;
+
+    void AddRoundTrip(int64_t rtt_us);
+    void RollWindow(int64_t now_us);
+};
+
+// The metrics as reported in the device status
+cJSON* LinkMetricsToJson(const LinkMetrics& metrics);
+cJSON* ReconnectMetricsToJson(const ReconnectMetrics& metrics);
+
+#endif // LINK_MONITOR_H
@@ -3,9 +3,14 @@
 #include "application.h"
 #include "device_registry.h"
 #include "settings.h"
+#include "msgpack.h"
+#include "log_ring.h"
+#include "transport_profile.h"
+#include "udp_audio.h"
 
 #include <algorithm>
 #include <esp_log.h>
+#include <esp_random.h>
 #include <cstring>
 #include <arpa/inet.h>
 #include "assets/lang_config.h"
@@ -30,32 +35,16 @@ DeviceRegistry::SessionInfo ToSessionInfo(const MqttProtocol::SessionDescriptor&
 
 MqttProtocol::MqttProtocol() {
     event_group_handle_ = xEventGroupCreate();
-
-    // Initialize reconnect timer
-    esp_timer_create_args_t reconnect_timer_args = {
-        .callback = [](void* arg) {
-            MqttProtocol* protocol = (MqttProtocol*)arg;
-            auto& app = Application::GetInstance();
-            if (app.GetDeviceState() == kDeviceStateIdle) {
-                ESP_LOGI(TAG, "Reconnecting to MQTT server");
-                app.Schedule([protocol]() {
-                    protocol->StartMqttClient(false);
-                });
-            }
-        },
-        .arg = this,
-    };
-    esp_timer_create(&reconnect_timer_args, &reconnect_timer_);
 }
 
 MqttProtocol::~MqttProtocol() {
     ESP_LOGI(TAG, "MqttProtocol deinit");
-    if (reconnect_timer_ != nullptr) {
-        esp_timer_stop(reconnect_timer_);
-        esp_timer_delete(reconnect_timer_);
-    }
+    control_dispatcher_.Stop();
+    Application::GetInstance().CancelTimer(reconnect_timer_.exchange(0));
 
-    udp_.reset();
+    receiving_udp_ = nullptr;
+    active_udp_.reset();
+    udp_sessions_.clear();
     mqtt_.reset();
     
     if (event_group_handle_ != nullptr) {
@@ -64,7 +53,72 @@ MqttProtocol::~MqttProtocol() {
 }
 
 bool MqttProtocol::Start() {
-    return StartMqttClient(false);
+    if (StartMqttClient(false)) {
+        return true;
+    }
+    if (mqtt_ != nullptr) {
+        // The endpoint is configured but not reachable yet
+        SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+        ScheduleReconnect();
+    }
+    return false;
+}
+
+void MqttProtocol::ScheduleReconnect() {
+    /*
+     * Exponential backoff with equal jitter: a blip reconnects within a second or two, an outage
+     * settles at MQTT_RECONNECT_MAX_MS, and the devices behind one access point do not retry in
+     * lockstep when it comes back.
+     */
+    int attempts = std::min<int>(reconnect_attempts_, 16);
+    int64_t delay_ms = std::min<int64_t>(static_cast<int64_t>(MQTT_RECONNECT_INITIAL_MS) << attempts, MQTT_RECONNECT_MAX_MS);
+    delay_ms = delay_ms / 2 + esp_random() % (delay_ms / 2 + 1);
+    ESP_LOGI(TAG, "Reconnecting to MQTT server in %lld ms", delay_ms);
+    StartReconnectTimer(delay_ms);
+}
+
+void MqttProtocol::StartReconnectTimer(uint32_t delay_ms, bool force) {
+    auto& app = Application::GetInstance();
+    app.CancelTimer(reconnect_timer_.exchange(0));
+    reconnect_timer_ = app.ScheduleAfter(delay_ms, [this, force]() {
+        if (Application::GetInstance().GetDeviceState() != kDeviceStateIdle) {
+            // OpenAudioChannel() connects when a conversation starts meanwhile
+            if (force) {
+                StartReconnectTimer(MQTT_RECONNECT_INITIAL_MS, true);
+            } else {
+                ScheduleReconnect();
+            }
+            return;
+        }
+        if (!force && mqtt_ != nullptr && mqtt_->IsConnected()) {
+            return;
+        }
+        ESP_LOGI(TAG, "Reconnecting to MQTT server, attempt %d", reconnect_attempts_.load() + 1);
+        if (!StartMqttClient(false)) {
+            link_monitor_.OnReconnectFailed();
+            reconnect_attempts_++;
+            ScheduleReconnect();
+        }
+    });
+}
+
+void MqttProtocol::NotifyNetworkUp() {
+    reconnect_attempts_ = 0;
+    if (mqtt_ == nullptr || mqtt_->IsConnected()) {
+        return;
+    }
+    ESP_LOGI(TAG, "Network is up, reconnecting to MQTT server");
+    StartReconnectTimer(MQTT_RECONNECT_NETWORK_UP_MS);
+}
+
+void MqttProtocol::NotifyNetworkChanged() {
+    reconnect_attempts_ = 0;
+    if (mqtt_ == nullptr) {
+        return;
+    }
+    // The client on the old interface may not notice it is gone until the keepalive times out
+    ESP_LOGI(TAG, "Network changed, reconnecting to MQTT server");
+    StartReconnectTimer(MQTT_RECONNECT_NETWORK_UP_MS, true);
 }
 
 bool MqttProtocol::StartMqttClient(bool report_error) {
@@ -78,8 +132,9 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     auto client_id = settings.GetString("client_id");
     auto username = settings.GetString("username");
     auto password = settings.GetString("password");
-    int keepalive_interval = settings.GetInt("keepalive", 240);
+    int keepalive_interval = settings.GetInt("keepalive", GetTransportProfile().mqtt_keepalive_seconds);
     publish_topic_ = settings.GetString("publish_topic");
+    telemetry_topic_ = settings.GetString("telemetry_topic");
 
     if (endpoint.empty()) {
         ESP_LOGW(TAG, "MQTT endpoint is not specified");
@@ -97,47 +152,27 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
         if (on_disconnected_ != nullptr) {
             on_disconnected_();
         }
-        ESP_LOGI(TAG, "MQTT disconnected, schedule reconnect in %d seconds", MQTT_RECONNECT_INTERVAL_MS / 1000);
-        esp_timer_start_once(reconnect_timer_, MQTT_RECONNECT_INTERVAL_MS * 1000);
+        link_monitor_.OnDisconnected();
+        ScheduleReconnect();
     });
 
     mqtt_->OnConnected([this]() {
         if (on_connected_ != nullptr) {
             on_connected_();
         }
-        esp_timer_stop(reconnect_timer_);
+        Application::GetInstance().CancelTimer(reconnect_timer_.exchange(0));
+        reconnect_attempts_ = 0;
+        int latency_ms = link_monitor_.OnReconnected();
+        if (latency_ms >= 0) {
+            ESP_LOGI(TAG, "MQTT reconnected after %d ms", latency_ms);
+        }
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
-        cJSON* root = cJSON_Parse(payload.c_str());
-        if (root == nullptr) {
-            ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
-            return;
-        }
-        cJSON* type = cJSON_GetObjectItem(root, "type");
-        if (!cJSON_IsString(type)) {
-            ESP_LOGE(TAG, "Message type is invalid");
-            cJSON_Delete(root);
-            return;
-        }
-
-        if (strcmp(type->valuestring, "hello") == 0) {
-            ParseServerHello(root);
-        } else if (strcmp(type->valuestring, "goodbye") == 0) {
-            auto session_id = cJSON_GetObjectItem(root, "session_id");
-            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", session_id ? session_id->valuestring : "null");
-            if (session_id != nullptr && cJSON_IsString(session_id)) {
-                RemoveSessionDescriptor(session_id->valuestring);
-            }
-            if (session_id == nullptr || session_id_ == (session_id ? session_id->valuestring : "")) {
-                Application::GetInstance().Schedule([this]() {
-                    CloseAudioChannel();
-                });
-            }
-        } else if (on_incoming_json_ != nullptr) {
-            on_incoming_json_(root);
-        }
-        cJSON_Delete(root);
+        link_monitor_.AddDownlink(payload.size());
+        // A MessagePack control message is a map, a JSON one starts with '{'
+        bool msgpack = binary_control_ && !payload.empty() && Msgpack::IsMap(payload[0]);
+        control_dispatcher_.Post(payload.data(), payload.size(), msgpack);
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
@@ -153,7 +188,10 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     }
     if (!mqtt_->Connect(broker_address, broker_port, client_id, username, password)) {
         ESP_LOGE(TAG, "Failed to connect to endpoint");
-        SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+        // The background reconnects stay quiet, the backoff retries them
+        if (report_error) {
+            SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+        }
         return false;
     }
 
@@ -170,39 +208,170 @@ bool MqttProtocol::SendText(const std::string& text) {
         SetError(Lang::Strings::SERVER_ERROR);
         return false;
     }
+    link_monitor_.AddUplink(text.size());
+    return true;
+}
+
+bool MqttProtocol::SendTelemetry(const std::string& snapshot) {
+    if (telemetry_topic_.empty() || mqtt_ == nullptr || !mqtt_->IsConnected()) {
+        return false;
+    }
+    if (!mqtt_->Publish(telemetry_topic_, snapshot)) {
+        ESP_LOGW(TAG, "Failed to publish telemetry, size: %u", snapshot.size());
+        return false;
+    }
+    link_monitor_.AddUplink(snapshot.size());
+    return true;
+}
+
+bool MqttProtocol::SendBinaryControl(const std::string& data) {
+    if (publish_topic_.empty()) {
+        return false;
+    }
+    if (!mqtt_->Publish(publish_topic_, data)) {
+        ESP_LOGE(TAG, "Failed to publish msgpack message, size: %u", data.size());
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+    link_monitor_.AddUplink(data.size());
     return true;
 }
 
-bool MqttProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
+bool MqttProtocol::SendAudio(AudioStreamPacket& packet) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (active_udp_ == nullptr || active_udp_->udp == nullptr) {
+        return false;
+    }
+    return SendAudioLocked(packet);
+}
+
+bool MqttProtocol::SendAudioBatch(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) {
     std::lock_guard<std::mutex> lock(channel_mutex_);
-    if (udp_ == nullptr) {
+    if (active_udp_ == nullptr || active_udp_->udp == nullptr) {
         return false;
     }
+    for (auto& packet : packets) {
+        if (!SendAudioLocked(*packet)) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    std::string nonce(aes_nonce_);
-    *(uint16_t*)&nonce[2] = htons(packet->payload.size());
-    *(uint32_t*)&nonce[8] = htonl(packet->timestamp);
-    *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
+bool MqttProtocol::SendAudioLocked(AudioStreamPacket& packet) {
+    /*
+     * With MQTT_UDP_FLAG_REDUNDANT the payload also carries the previous frame, so the server can
+     * recover it when the previous packet is lost:
+     * |primary_len 2u|previous_timestamp 4u|primary primary_len|previous|
+     */
+    auto& payload = packet.payload;
+    bool redundant = udp_redundancy_active_ && !payload.empty() && !previous_payload_.empty();
+    if (redundant) {
+        size_t primary_size = payload.size();
+        payload.resize(6 + primary_size + previous_payload_.size());
+        memmove(payload.data() + 6, payload.data(), primary_size);
+        // The payload is a byte buffer, the timestamp at offset 2 is not aligned
+        uint16_t primary_len = htons(primary_size);
+        uint32_t previous_timestamp = htonl(previous_timestamp_);
+        memcpy(payload.data(), &primary_len, sizeof(primary_len));
+        memcpy(payload.data() + 2, &previous_timestamp, sizeof(previous_timestamp));
+        memcpy(payload.data() + 6 + primary_size, previous_payload_.data(), previous_payload_.size());
+        // Keep the primary frame for the next packet
+        previous_payload_.assign(payload.begin() + 6, payload.begin() + 6 + primary_size);
+    } else if (udp_redundancy_active_) {
+        previous_payload_ = payload;
+    } else {
+        previous_payload_.clear();
+    }
+    previous_timestamp_ = packet.timestamp;
 
-    std::string encrypted;
-    encrypted.resize(aes_nonce_.size() + packet->payload.size());
-    memcpy(encrypted.data(), nonce.data(), nonce.size());
+    auto& session = *active_udp_;
+    if (!UdpAudio::Seal(session.aes_ctx, session.nonce, redundant ? MQTT_UDP_FLAG_REDUNDANT : 0, packet.timestamp,
+        ++session.local_sequence, payload.data(), payload.size(), udp_buffer_)) {
+        return false;
+    }
 
-    size_t nc_off = 0;
-    uint8_t stream_block[16] = {0};
-    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet->payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
-        (uint8_t*)packet->payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
-        ESP_LOGE(TAG, "Failed to encrypt audio data");
+    if (session.udp->Send(udp_buffer_) <= 0) {
         return false;
     }
+    link_monitor_.AddUplink(udp_buffer_.size(), 1);
+    return true;
+}
 
-    return udp_->Send(encrypted) > 0;
+bool MqttProtocol::AcceptSequence(uint32_t sequence) {
+    /*
+     * Late packets within the reorder window still go to the jitter buffer, which orders them by
+     * sequence number. receive_window_ tells the reordered packets from the duplicates.
+     */
+    if (remote_sequence_ != 0 && sequence <= remote_sequence_) {
+        uint32_t age = remote_sequence_ - sequence;
+        if (age >= CONFIG_MQTT_UDP_REORDER_WINDOW_PACKETS) {
+            LOG_RATE_LIMITED(1000, ESP_LOGW, TAG, "Received audio packet with old sequence: %lu, newest: %lu",
+                sequence, remote_sequence_);
+            receive_stats_.late++;
+            return false;
+        }
+        if (receive_window_ & (1u << age)) {
+            receive_stats_.duplicate++;
+            return false;
+        }
+        receive_window_ |= 1u << age;
+        receive_stats_.reordered++;
+        // Counted as lost when the newer packet arrived
+        if (receive_stats_.lost > 0) {
+            receive_stats_.lost--;
+        }
+        link_monitor_.AddDownlinkLost(-1);
+        receive_stats_.received++;
+        return true;
+    }
+
+    if (remote_sequence_ != 0 && sequence > remote_sequence_ + 1) {
+        LOG_RATE_LIMITED(1000, ESP_LOGW, TAG, "Received audio packet with wrong sequence: %lu, expected: %lu",
+            sequence, remote_sequence_ + 1);
+        link_monitor_.AddDownlinkLost(sequence - remote_sequence_ - 1);
+        receive_stats_.lost += sequence - remote_sequence_ - 1;
+    }
+    uint32_t shift = sequence - remote_sequence_;
+    receive_window_ = (remote_sequence_ == 0 || shift >= 32) ? 1 : (receive_window_ << shift) | 1;
+    remote_sequence_ = sequence;
+    receive_stats_.received++;
+    return true;
+}
+
+void MqttProtocol::UpdateExpectedLoss(int loss_percent) {
+#if CONFIG_USE_MQTT_UDP_REDUNDANCY
+    if (!udp_redundancy_supported_) {
+        return;
+    }
+    bool active = udp_redundancy_active_;
+    if (!active && loss_percent >= CONFIG_MQTT_UDP_REDUNDANCY_LOSS_PERCENT) {
+        active = true;
+    } else if (active && loss_percent * 2 < CONFIG_MQTT_UDP_REDUNDANCY_LOSS_PERCENT) {
+        active = false;
+    }
+    if (active != udp_redundancy_active_) {
+        ESP_LOGI(TAG, "%s redundant frames, expected loss %d%%", active ? "Enable" : "Disable", loss_percent);
+        udp_redundancy_active_ = active;
+    }
+#endif
 }
 
 void MqttProtocol::CloseAudioChannel() {
     {
         std::lock_guard<std::mutex> lock(channel_mutex_);
-        udp_.reset();
+        receiving_udp_ = nullptr;
+        for (auto& [id, session] : udp_sessions_) {
+            session->udp.reset();
+        }
+        if (active_udp_ != nullptr) {
+            active_udp_->udp.reset();
+        }
+    }
+    if (receive_stats_.received > 0) {
+        ESP_LOGI(TAG, "UDP audio: received %lu, reordered %lu, late %lu, duplicate %lu, lost %lu",
+            receive_stats_.received, receive_stats_.reordered, receive_stats_.late,
+            receive_stats_.duplicate, receive_stats_.lost);
     }
 
     std::string message = "{";
@@ -228,13 +397,19 @@ bool MqttProtocol::OpenAudioChannel() {
     session_id_ = "";
     xEventGroupClearBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 
+    // The cached answer is applied before the hello is sent, so the real one always follows it
+    link_monitor_.StartSession();
+    bool optimistic = ApplyCachedServerHello("mqtt");
     auto message = GetHelloMessage();
+    link_monitor_.OnHelloSent();
     if (!SendText(message)) {
+        server_hello_pending_ = false;
         return false;
     }
 
     // 等待服务器响应
-    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
+    EventBits_t bits = optimistic ? MQTT_PROTOCOL_SERVER_HELLO_EVENT :
+        xEventGroupWaitBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
     if (!(bits & MQTT_PROTOCOL_SERVER_HELLO_EVENT)) {
         ESP_LOGE(TAG, "Failed to receive server hello");
         SetError(Lang::Strings::SERVER_TIMEOUT);
@@ -242,59 +417,109 @@ bool MqttProtocol::OpenAudioChannel() {
     }
 
     std::lock_guard<std::mutex> lock(channel_mutex_);
-    auto network = Board::GetInstance().GetNetwork();
-    udp_ = network->CreateUdp(2);
-    udp_->OnMessage([this](const std::string& data) {
-        /*
-         * UDP Encrypted OPUS Packet Format:
-         * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
-         * |payload payload_len|
-         */
-        if (data.size() < sizeof(aes_nonce_)) {
-            ESP_LOGE(TAG, "Invalid audio packet size: %u", data.size());
-            return;
+    if (active_udp_ == nullptr) {
+        ESP_LOGE(TAG, "No UDP endpoint in the server hello");
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+    max_audio_batch_frames_ = std::min<size_t>(GetTransportProfile().max_batch_frames, MQTT_UDP_MAX_BATCH_FRAMES);
+    ResetUdpReceiveState();
+    active_udp_->socket_id = MQTT_UDP_SOCKET_ID;
+    OpenUdpSocket(*active_udp_);
+    receiving_udp_ = active_udp_.get();
+
+#if CONFIG_MQTT_UDP_PARALLEL_SESSIONS > 1
+    /* The other sessions keep a socket open too, so switching to one of them is only a pointer swap */
+    int socket_id = MQTT_UDP_SOCKET_ID + 1;
+    for (auto& [id, session] : udp_sessions_) {
+        if (session == active_udp_ || socket_id >= MQTT_UDP_SOCKET_ID + CONFIG_MQTT_UDP_PARALLEL_SESSIONS) {
+            continue;
         }
-        if (data[0] != 0x01) {
-            ESP_LOGE(TAG, "Invalid audio packet type: %x", data[0]);
+        session->socket_id = socket_id++;
+        OpenUdpSocket(*session);
+    }
+#endif
+
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
+    return true;
+}
+
+void MqttProtocol::OpenUdpSocket(MqttUdpSession& session) {
+    auto network = Board::GetInstance().GetNetwork();
+    session.udp = network->CreateUdp(session.socket_id);
+    auto session_ptr = &session;
+    session.udp->OnMessage([this, session_ptr](const std::string& data) {
+        // The parallel sockets stay open to keep their path warm, only the active session is played
+        if (session_ptr != receiving_udp_.load()) {
             return;
         }
-        uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
-        uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
+        uint32_t timestamp;
+        uint32_t sequence;
+        if (!UdpAudio::ParseHeader(data, timestamp, sequence) || !AcceptSequence(sequence)) {
             return;
         }
-        if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
+
+        link_monitor_.AddDownlink(data.size());
+        link_monitor_.AddDownlinkPacket(sequence, server_frame_duration_);
+        if (++downlink_received_ >= MQTT_UDP_LOSS_WINDOW_PACKETS) {
+            /* The uplink loss reported in the pongs, without it the downlink loss is the estimate */
+            auto link = link_monitor_.GetMetrics();
+            UpdateExpectedLoss(std::max(link.uplink_loss_permille, link.downlink_loss_permille) / 10);
+            downlink_received_ = 0;
         }
 
-        size_t decrypted_size = data.size() - aes_nonce_.size();
-        size_t nc_off = 0;
-        uint8_t stream_block[16] = {0};
-        auto nonce = (uint8_t*)data.data();
-        auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
-        auto packet = std::make_unique<AudioStreamPacket>();
+        // Decrypted straight into a pooled packet
+        auto packet = AllocateAudioPacket();
         packet->sample_rate = server_sample_rate_;
         packet->frame_duration = server_frame_duration_;
         packet->timestamp = timestamp;
-        packet->payload.resize(decrypted_size);
-        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)packet->payload.data());
-        if (ret != 0) {
-            ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
+        packet->sequence = sequence;
+        packet->trace_origin_us = 0;
+        if (!UdpAudio::Open(session_ptr->aes_ctx, data, packet->payload)) {
             return;
         }
         if (on_incoming_audio_ != nullptr) {
             on_incoming_audio_(std::move(packet));
         }
-        remote_sequence_ = sequence;
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
+    session.udp->Connect(session.server, session.port);
+}
 
-    udp_->Connect(udp_server_, udp_port_);
+void MqttProtocol::ResetUdpReceiveState() {
+    remote_sequence_ = 0;
+    receive_window_ = 0;
+    downlink_received_ = 0;
+    previous_payload_.clear();
+}
 
-    if (on_audio_channel_opened_ != nullptr) {
-        on_audio_channel_opened_();
+bool MqttProtocol::SwitchUdpSession(const std::string& session_id) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (active_udp_ == nullptr || active_udp_->udp == nullptr) {
+        // No audio channel, the next one opens with the new session
+        return true;
     }
+    auto it = udp_sessions_.find(session_id);
+    if (it == udp_sessions_.end()) {
+        return false;
+    }
+    auto next = it->second;
+    if (next == active_udp_) {
+        return true;
+    }
+    if (next->udp == nullptr) {
+        // Without a parallel socket, the socket of the previous session is reused
+        next->socket_id = active_udp_->socket_id;
+        receiving_udp_ = nullptr;
+        active_udp_->udp.reset();
+        OpenUdpSocket(*next);
+    }
+    ResetUdpReceiveState();
+    active_udp_ = next;
+    receiving_udp_ = next.get();
+    ESP_LOGI(TAG, "Audio switched to session %s", session_id.c_str());
     return true;
 }
 
@@ -309,12 +534,25 @@ std::string MqttProtocol::GetHelloMessage() {
     cJSON_AddBoolToObject(features, "aec", true);
 #endif
     cJSON_AddBoolToObject(features, "mcp", true);
+#if CONFIG_USE_TTS_CACHE
+    cJSON_AddBoolToObject(features, "tts_cache", true);
+#endif
+#if CONFIG_LINK_PING_INTERVAL_SECONDS > 0
+    cJSON_AddBoolToObject(features, "ping", true);
+#endif
+#if CONFIG_USE_MQTT_UDP_REDUNDANCY
+    cJSON_AddBoolToObject(features, "udp_redundancy", true);
+#endif
+#if CONFIG_USE_MSGPACK_CONTROL
+    cJSON_AddBoolToObject(features, "msgpack", true);
+#endif
     cJSON_AddItemToObject(root, "features", features);
     cJSON* audio_params = cJSON_CreateObject();
     cJSON_AddStringToObject(audio_params, "format", "opus");
     cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
     cJSON_AddNumberToObject(audio_params, "channels", 1);
     cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
+    cJSON_AddStringToObject(audio_params, "silence_suppression", SilenceSuppressionName(DEFAULT_SILENCE_SUPPRESSION));
     cJSON_AddItemToObject(root, "audio_params", audio_params);
     auto json_str = cJSON_PrintUnformatted(root);
     std::string message(json_str);
@@ -323,13 +561,7 @@ std::string MqttProtocol::GetHelloMessage() {
     return message;
 }
 
-void MqttProtocol::ParseServerHello(const cJSON* root) {
-    auto transport = cJSON_GetObjectItem(root, "transport");
-    if (transport == nullptr || strcmp(transport->valuestring, "udp") != 0) {
-        ESP_LOGE(TAG, "Unsupported transport: %s", transport->valuestring);
-        return;
-    }
-
+void MqttProtocol::ParseServerHelloSession(const cJSON* root) {
     auto session_id = cJSON_GetObjectItem(root, "session_id");
     if (cJSON_IsString(session_id)) {
         RegisterOrUpdateSession(session_id->valuestring);
@@ -337,6 +569,55 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
     }
 
     RegisterSessionsFromHello(root);
+    ParseControlEncoding(root);
+    ParsePingFeature(root);
+}
+
+bool MqttProtocol::HandleControlMessage(const cJSON* root) {
+    cJSON* type = cJSON_GetObjectItem(root, "type");
+    if (!cJSON_IsString(type)) {
+        return false;
+    }
+
+    if (strcmp(type->valuestring, "hello") == 0) {
+        bool pending = server_hello_pending_;
+        if (!CheckServerHello(root, "mqtt")) {
+            // The UDP key or endpoint may have changed under the stream, start over with the new cache
+            ESP_LOGW(TAG, "Server hello differs from the cached one, closing the audio channel");
+            Application::GetInstance().Schedule([this]() {
+                CloseAudioChannel();
+            }, kSchedulePriorityHigh);
+        } else if (pending) {
+            // The channel already runs with these parameters, only the session is new
+            ParseServerHelloSession(root);
+        } else {
+            ParseServerHello(root);
+        }
+    } else if (strcmp(type->valuestring, "pong") == 0) {
+        ParsePong(root);
+    } else if (strcmp(type->valuestring, "goodbye") == 0) {
+        auto session_id = cJSON_GetObjectItem(root, "session_id");
+        ESP_LOGI(TAG, "Received goodbye message, session_id: %s", session_id ? session_id->valuestring : "null");
+        if (session_id != nullptr && cJSON_IsString(session_id)) {
+            RemoveSessionDescriptor(session_id->valuestring);
+        }
+        if (session_id == nullptr || session_id_ == (session_id ? session_id->valuestring : "")) {
+            Application::GetInstance().Schedule([this]() {
+                CloseAudioChannel();
+            }, kSchedulePriorityHigh);
+        }
+    } else if (on_incoming_json_ != nullptr) {
+        on_incoming_json_(root);
+    }
+    return true;
+}
+
+void MqttProtocol::ParseServerHello(const cJSON* root) {
+    auto transport = cJSON_GetObjectItem(root, "transport");
+    if (transport == nullptr || strcmp(transport->valuestring, "udp") != 0) {
+        ESP_LOGE(TAG, "Unsupported transport: %s", transport->valuestring);
+        return;
+    }
 
     // Get sample rate from hello message
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
@@ -349,30 +630,51 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
         if (cJSON_IsNumber(frame_duration)) {
             server_frame_duration_ = frame_duration->valueint;
         }
+        ParseSilenceSuppression(audio_params);
     }
 
     auto udp = cJSON_GetObjectItem(root, "udp");
-    if (!cJSON_IsObject(udp)) {
+    auto session = ParseUdpSession(udp);
+    {
+        // Every hello brings new keys, the endpoints of the previous one are dropped
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        receiving_udp_ = nullptr;
+        udp_sessions_.clear();
+        active_udp_ = session;
+        receive_stats_ = {};
+        ResetUdpReceiveState();
+    }
+    if (session == nullptr) {
+        // The session is still the server's, only the audio cannot open
+        ParseServerHelloSession(root);
         ESP_LOGE(TAG, "UDP is not specified");
         return;
     }
-    udp_server_ = cJSON_GetObjectItem(udp, "server")->valuestring;
-    udp_port_ = cJSON_GetObjectItem(udp, "port")->valueint;
-    auto key = cJSON_GetObjectItem(udp, "key")->valuestring;
-    auto nonce = cJSON_GetObjectItem(udp, "nonce")->valuestring;
-
-    // auto encryption = cJSON_GetObjectItem(udp, "encryption")->valuestring;
-    // ESP_LOGI(TAG, "UDP server: %s, port: %d, encryption: %s", udp_server_.c_str(), udp_port_, encryption);
-    aes_nonce_ = DecodeHexString(nonce);
-    mbedtls_aes_init(&aes_ctx_);
-    mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
-    local_sequence_ = 0;
-    remote_sequence_ = 0;
+
+    udp_redundancy_active_ = false;
+    auto redundancy = cJSON_GetObjectItem(udp, "redundancy");
+    udp_redundancy_supported_ = cJSON_IsTrue(redundancy);
+    auto packet_loss = cJSON_GetObjectItem(udp, "packet_loss");
+    if (cJSON_IsNumber(packet_loss)) {
+        UpdateExpectedLoss(packet_loss->valueint);
+    }
+
+    // After the UDP endpoint, so it is registered for the session
+    ParseServerHelloSession(root);
     xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 }
 
+std::shared_ptr<MqttUdpSession> MqttProtocol::ParseUdpSession(const cJSON* udp) {
+    auto session = std::make_shared<MqttUdpSession>();
+    if (!UdpAudio::ParseEndpoint(udp, session->server, session->port, session->nonce, session->aes_ctx)) {
+        return nullptr;
+    }
+    return session;
+}
+
 void MqttProtocol::RegisterSessionsFromHello(const cJSON* root) {
     std::vector<SessionDescriptor> descriptors;
+    std::vector<std::pair<std::string, std::shared_ptr<MqttUdpSession>>> udp_sessions;
 
     auto add_descriptor = [&descriptors](const SessionDescriptor& descriptor) {
         if (descriptor.session_id.empty()) {
@@ -448,6 +750,11 @@ void MqttProtocol::RegisterSessionsFromHello(const cJSON* root) {
             }
             descriptor.is_active = (descriptor.session_id == base_descriptor.session_id);
             add_descriptor(descriptor);
+            // The endpoint of another session, so it can be switched to without a new hello
+            auto udp = ParseUdpSession(cJSON_GetObjectItem(item, "udp"));
+            if (udp != nullptr && !descriptor.session_id.empty()) {
+                udp_sessions.emplace_back(descriptor.session_id, udp);
+            }
         }
     }
 
@@ -464,6 +771,19 @@ void MqttProtocol::RegisterSessionsFromHello(const cJSON* root) {
     ReplaceSessionList(session_ids, active_session);
     SyncActiveDescriptor(session_id_);
 
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        for (auto& [id, udp] : udp_sessions) {
+            if (udp_sessions_.find(id) == udp_sessions_.end()) {
+                udp_sessions_[id] = udp;
+            }
+        }
+        // The top level endpoint is the one of the active session
+        if (active_udp_ != nullptr && !session_id_.empty()) {
+            udp_sessions_[session_id_] = active_udp_;
+        }
+    }
+
     DeviceRegistry::GetInstance().UpdateSessions(session_infos);
 }
 
@@ -541,6 +861,9 @@ bool MqttProtocol::ActivateSessionById(const std::string& session_id) {
         }
     }
     if (activated) {
+        if (!SwitchUdpSession(session_id)) {
+            ESP_LOGW(TAG, "No UDP endpoint cached for session %s, it is used from the next audio channel", session_id.c_str());
+        }
         std::vector<DeviceRegistry::SessionInfo> session_infos;
         session_infos.reserve(snapshot.size());
         for (auto& descriptor : snapshot) {
@@ -558,25 +881,6 @@ void MqttProtocol::SyncActiveDescriptor(const std::string& session_id) {
     }
 }
 
-static const char hex_chars[] = "0123456789ABCDEF";
-// 辅助函数，将单个十六进制字符转换为对应的数值
-static inline uint8_t CharToHex(char c) {
-    if (c >= '0' && c <= '9') return c - '0';
-    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
-    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
-    return 0;  // 对于无效输入，返回0
-}
-
-std::string MqttProtocol::DecodeHexString(const std::string& hex_string) {
-    std::string decoded;
-    decoded.reserve(hex_string.size() / 2);
-    for (size_t i = 0; i < hex_string.size(); i += 2) {
-        char byte = (CharToHex(hex_string[i]) << 4) | CharToHex(hex_string[i + 1]);
-        decoded.push_back(byte);
-    }
-    return decoded;
-}
-
 bool MqttProtocol::IsAudioChannelOpened() const {
-    return udp_ != nullptr && !error_occurred_ && !IsTimeout();
+    return receiving_udp_.load() != nullptr && !error_occurred_ && !IsTimeout();
 }
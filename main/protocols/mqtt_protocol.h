@@ -17,12 +17,53 @@
 #include <unordered_map>
 #include <vector>
 #include <mutex>
+#include <atomic>
 
-#define MQTT_PING_INTERVAL_SECONDS 90
-#define MQTT_RECONNECT_INTERVAL_MS 60000
+// Reconnect backoff, doubled after each failed attempt and randomized to 50..100% of the value
+#define MQTT_RECONNECT_INITIAL_MS 1000
+#define MQTT_RECONNECT_MAX_MS 60000
+// Delay of the reconnect after the board network comes back, for DHCP and DNS to settle
+#define MQTT_RECONNECT_NETWORK_UP_MS 500
 
 #define MQTT_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
 
+// Flags byte of the UDP audio packet header
+#define MQTT_UDP_FLAG_REDUNDANT 0x01
+// Downlink packets per loss measurement window
+#define MQTT_UDP_LOSS_WINDOW_PACKETS 50
+// Upper bound of the queued frames encrypted and sent per SendAudioBatch() call, one datagram each,
+// the transport profile picks the batch size below it
+#define MQTT_UDP_MAX_BATCH_FRAMES 4
+
+// Socket id of the first UDP socket, the parallel session sockets follow it
+#define MQTT_UDP_SOCKET_ID 2
+
+// UDP endpoint and cipher of one session, kept from the hello so switching sessions needs no new one
+struct MqttUdpSession {
+    std::string server;
+    int port = 0;
+    std::string nonce;
+    mbedtls_aes_context aes_ctx;
+    uint32_t local_sequence = 0;
+    int socket_id = MQTT_UDP_SOCKET_ID;
+    // Open while the audio channel is, for the active session and the parallel ones
+    std::unique_ptr<Udp> udp;
+
+    MqttUdpSession() { mbedtls_aes_init(&aes_ctx); }
+    ~MqttUdpSession() { udp.reset(); mbedtls_aes_free(&aes_ctx); }
+    MqttUdpSession(const MqttUdpSession&) = delete;
+    MqttUdpSession& operator=(const MqttUdpSession&) = delete;
+};
+
+// Downlink receive counters of the current audio channel
+struct MqttUdpReceiveStats {
+    uint32_t received = 0;
+    uint32_t reordered = 0;     // Arrived after a newer packet, within the reorder window
+    uint32_t late = 0;          // Older than the reorder window, dropped
+    uint32_t duplicate = 0;     // Already received, dropped
+    uint32_t lost = 0;          // Sequence numbers skipped and not received later
+};
+
 class MqttProtocol : public Protocol {
 public:
     struct SessionDescriptor {
@@ -39,38 +80,74 @@ public:
     ~MqttProtocol();
 
     bool Start() override;
-    bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
+    bool SendAudio(AudioStreamPacket& packet) override;
+    bool SendAudioBatch(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
+    void NotifyNetworkUp() override;
+    void NotifyNetworkChanged() override;
+    bool SendTelemetry(const std::string& snapshot) override;
 
     std::vector<SessionDescriptor> GetSessionDescriptors() const;
+    MqttUdpReceiveStats GetUdpReceiveStats() const { return receive_stats_; }
     bool ActivateSessionById(const std::string& session_id);
 
 private:
     EventGroupHandle_t event_group_handle_;
 
     std::string publish_topic_;
+    // From the mqtt settings of the OTA check, no telemetry without it
+    std::string telemetry_topic_;
 
     std::mutex channel_mutex_;
     mutable std::mutex session_mutex_;
     std::unique_ptr<Mqtt> mqtt_;
-    std::unique_ptr<Udp> udp_;
-    mbedtls_aes_context aes_ctx_;
-    std::string aes_nonce_;
-    std::string udp_server_;
-    int udp_port_;
-    uint32_t local_sequence_;
+    // Endpoints of the sessions known from the hello, guarded by channel_mutex_. active_udp_
+    // sends the audio, the receive callbacks only deliver the packets of receiving_udp_.
+    std::unordered_map<std::string, std::shared_ptr<MqttUdpSession>> udp_sessions_;
+    std::shared_ptr<MqttUdpSession> active_udp_;
+    std::atomic<MqttUdpSession*> receiving_udp_ = nullptr;
+    // Reused datagram buffer of SendAudio(), header followed by the encrypted payload
+    std::string udp_buffer_;
     uint32_t remote_sequence_;
-    esp_timer_handle_t reconnect_timer_;
+    // Bit n is set when remote_sequence_ - n was received
+    uint32_t receive_window_ = 0;
+    MqttUdpReceiveStats receive_stats_;
+    // Previous frame redundancy, only used when the server accepted it in the hello
+    bool udp_redundancy_supported_ = false;
+    std::atomic<bool> udp_redundancy_active_ = false;
+    uint32_t downlink_received_ = 0;
+    std::vector<uint8_t> previous_payload_;
+    uint32_t previous_timestamp_ = 0;
+    // Main loop timer of the next reconnect, 0 when not armed
+    std::atomic<uint32_t> reconnect_timer_ = 0;
+    // Failed reconnects since the last connection, drives the backoff
+    std::atomic<int> reconnect_attempts_ = 0;
 
     bool StartMqttClient(bool report_error=false);
-    void ParseServerHello(const cJSON* root);
+    void ScheduleReconnect();
+    // force reconnects even if the client still looks connected
+    void StartReconnectTimer(uint32_t delay_ms, bool force = false);
+    bool SendBinaryControl(const std::string& data) override;
+    bool SendAudioLocked(AudioStreamPacket& packet);
+    // Parses one udp object of the hello, nullptr if it is incomplete
+    std::shared_ptr<MqttUdpSession> ParseUdpSession(const cJSON* udp);
+    void OpenUdpSocket(MqttUdpSession& session);
+    // Moves the audio to the cached endpoint of another session, false if the session has none
+    bool SwitchUdpSession(const std::string& session_id);
+    // Drops the decoder state of the previous stream, the caller holds channel_mutex_
+    void ResetUdpReceiveState();
+    // Updates the receive window and counters, false if the packet is dropped
+    bool AcceptSequence(uint32_t sequence);
+    void ParseServerHello(const cJSON* root) override;
+    bool HandleControlMessage(const cJSON* root) override;
+    void ParseServerHelloSession(const cJSON* root);
     void RegisterSessionsFromHello(const cJSON* root);
     void RegisterSessionDescriptor(const SessionDescriptor& descriptor);
     void RemoveSessionDescriptor(const std::string& session_id);
     void SyncActiveDescriptor(const std::string& session_id);
-    std::string DecodeHexString(const std::string& hex_string);
+    void UpdateExpectedLoss(int loss_percent);
 
     bool SendText(const std::string& text) override;
     std::string GetHelloMessage();
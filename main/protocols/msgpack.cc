@@ -0,0 +1,312 @@
+#include "msgpack.h"
+
+#include <cstring>
+
+// Nesting of the decoded messages, MCP payloads stay far below it
+#define MSGPACK_MAX_DEPTH 16
+
+namespace Msgpack {
+
+void Writer::BigEndian(uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out_.push_back(static_cast<char>((value >> (i * 8)) & 0xff));
+    }
+}
+
+void Writer::Header(uint8_t fix_base, size_t fix_max, uint8_t code16, size_t count) {
+    // The 32 bit code always follows the 16 bit one
+    if (count <= fix_max) {
+        out_.push_back(static_cast<char>(fix_base | count));
+    } else if (count <= 0xffff) {
+        out_.push_back(static_cast<char>(code16));
+        BigEndian(count, 2);
+    } else {
+        out_.push_back(static_cast<char>(code16 + 1));
+        BigEndian(count, 4);
+    }
+}
+
+void Writer::Map(size_t count) {
+    Header(0x80, 15, 0xde, count);
+}
+
+void Writer::Array(size_t count) {
+    Header(0x90, 15, 0xdc, count);
+}
+
+void Writer::String(std::string_view value) {
+    size_t size = value.size();
+    if (size <= 31) {
+        out_.push_back(static_cast<char>(0xa0 | size));
+    } else if (size <= 0xff) {
+        out_.push_back(static_cast<char>(0xd9));
+        BigEndian(size, 1);
+    } else {
+        Header(0, 0, 0xda, size);
+    }
+    out_.append(value.data(), size);
+}
+
+void Writer::Int(int64_t value) {
+    if (value >= 0) {
+        if (value <= 0x7f) {
+            out_.push_back(static_cast<char>(value));
+        } else if (value <= 0xff) {
+            out_.push_back(static_cast<char>(0xcc));
+            BigEndian(value, 1);
+        } else if (value <= 0xffff) {
+            out_.push_back(static_cast<char>(0xcd));
+            BigEndian(value, 2);
+        } else if (value <= 0xffffffffLL) {
+            out_.push_back(static_cast<char>(0xce));
+            BigEndian(value, 4);
+        } else {
+            out_.push_back(static_cast<char>(0xcf));
+            BigEndian(value, 8);
+        }
+    } else if (value >= -32) {
+        out_.push_back(static_cast<char>(value));
+    } else if (value >= INT8_MIN) {
+        out_.push_back(static_cast<char>(0xd0));
+        BigEndian(static_cast<uint64_t>(value), 1);
+    } else if (value >= INT16_MIN) {
+        out_.push_back(static_cast<char>(0xd1));
+        BigEndian(static_cast<uint64_t>(value), 2);
+    } else if (value >= INT32_MIN) {
+        out_.push_back(static_cast<char>(0xd2));
+        BigEndian(static_cast<uint64_t>(value), 4);
+    } else {
+        out_.push_back(static_cast<char>(0xd3));
+        BigEndian(static_cast<uint64_t>(value), 8);
+    }
+}
+
+void Writer::Double(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    out_.push_back(static_cast<char>(0xcb));
+    BigEndian(bits, 8);
+}
+
+void Writer::Bool(bool value) {
+    out_.push_back(static_cast<char>(value ? 0xc3 : 0xc2));
+}
+
+void Writer::Nil() {
+    out_.push_back(static_cast<char>(0xc0));
+}
+
+void Writer::Json(const cJSON* item) {
+    if (cJSON_IsObject(item) || cJSON_IsArray(item)) {
+        size_t count = cJSON_GetArraySize(item);
+        if (cJSON_IsObject(item)) {
+            Map(count);
+        } else {
+            Array(count);
+        }
+        const cJSON* child;
+        cJSON_ArrayForEach(child, item) {
+            if (cJSON_IsObject(item)) {
+                String(child->string);
+            }
+            Json(child);
+        }
+    } else if (cJSON_IsString(item)) {
+        String(item->valuestring);
+    } else if (cJSON_IsNumber(item)) {
+        double value = item->valuedouble;
+        if (value >= -9.0e18 && value <= 9.0e18 && value == (double)(int64_t)value) {
+            Int((int64_t)value);
+        } else {
+            Double(value);
+        }
+    } else if (cJSON_IsBool(item)) {
+        Bool(cJSON_IsTrue(item));
+    } else {
+        Nil();
+    }
+}
+
+namespace {
+
+class Reader {
+public:
+    Reader(const uint8_t* data, size_t size) : data_(data), end_(data + size) {}
+
+    cJSON* Value(int depth);
+    bool done() const { return data_ == end_; }
+
+private:
+    const uint8_t* data_;
+    const uint8_t* end_;
+
+    bool Read(uint64_t& value, int bytes) {
+        if (end_ - data_ < bytes) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < bytes; i++) {
+            value = (value << 8) | *data_++;
+        }
+        return true;
+    }
+
+    // A big-endian value of the given size, sign extended
+    bool ReadSigned(int64_t& value, int bytes) {
+        uint64_t raw;
+        if (!Read(raw, bytes)) {
+            return false;
+        }
+        int shift = 64 - bytes * 8;
+        value = static_cast<int64_t>(raw << shift) >> shift;
+        return true;
+    }
+
+    cJSON* String(size_t size);
+    cJSON* Array(size_t count, int depth);
+    cJSON* Map(size_t count, int depth);
+};
+
+cJSON* Reader::String(size_t size) {
+    if (static_cast<size_t>(end_ - data_) < size) {
+        return nullptr;
+    }
+    std::string value(reinterpret_cast<const char*>(data_), size);
+    data_ += size;
+    return cJSON_CreateString(value.c_str());
+}
+
+cJSON* Reader::Array(size_t count, int depth) {
+    // Every item takes at least one byte, so a bogus count fails before allocating
+    if (static_cast<size_t>(end_ - data_) < count) {
+        return nullptr;
+    }
+    auto array = cJSON_CreateArray();
+    for (size_t i = 0; i < count; i++) {
+        auto item = Value(depth + 1);
+        if (item == nullptr) {
+            cJSON_Delete(array);
+            return nullptr;
+        }
+        cJSON_AddItemToArray(array, item);
+    }
+    return array;
+}
+
+cJSON* Reader::Map(size_t count, int depth) {
+    if (static_cast<size_t>(end_ - data_) < count * 2) {
+        return nullptr;
+    }
+    auto object = cJSON_CreateObject();
+    for (size_t i = 0; i < count; i++) {
+        auto key = Value(depth + 1);
+        if (!cJSON_IsString(key)) {
+            cJSON_Delete(key);
+            cJSON_Delete(object);
+            return nullptr;
+        }
+        auto item = Value(depth + 1);
+        if (item == nullptr) {
+            cJSON_Delete(key);
+            cJSON_Delete(object);
+            return nullptr;
+        }
+        cJSON_AddItemToObject(object, key->valuestring, item);
+        cJSON_Delete(key);
+    }
+    return object;
+}
+
+cJSON* Reader::Value(int depth) {
+    if (depth > MSGPACK_MAX_DEPTH || data_ == end_) {
+        return nullptr;
+    }
+    uint8_t code = *data_++;
+    uint64_t size;
+    int64_t value;
+
+    if (code <= 0x7f) {
+        return cJSON_CreateNumber(code);
+    } else if (code >= 0xe0) {
+        return cJSON_CreateNumber(static_cast<int8_t>(code));
+    } else if ((code & 0xf0) == 0x80) {
+        return Map(code & 0x0f, depth);
+    } else if ((code & 0xf0) == 0x90) {
+        return Array(code & 0x0f, depth);
+    } else if ((code & 0xe0) == 0xa0) {
+        return String(code & 0x1f);
+    }
+
+    switch (code) {
+    case 0xc0:
+        return cJSON_CreateNull();
+    case 0xc2:
+        return cJSON_CreateFalse();
+    case 0xc3:
+        return cJSON_CreateTrue();
+    case 0xc4: case 0xd9:
+        return Read(size, 1) ? String(size) : nullptr;
+    case 0xc5: case 0xda:
+        return Read(size, 2) ? String(size) : nullptr;
+    case 0xc6: case 0xdb:
+        return Read(size, 4) ? String(size) : nullptr;
+    case 0xca: {
+        if (!Read(size, 4)) {
+            return nullptr;
+        }
+        uint32_t bits = size;
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return cJSON_CreateNumber(f);
+    }
+    case 0xcb: {
+        if (!Read(size, 8)) {
+            return nullptr;
+        }
+        double d;
+        memcpy(&d, &size, sizeof(d));
+        return cJSON_CreateNumber(d);
+    }
+    case 0xcc:
+        return Read(size, 1) ? cJSON_CreateNumber(size) : nullptr;
+    case 0xcd:
+        return Read(size, 2) ? cJSON_CreateNumber(size) : nullptr;
+    case 0xce:
+        return Read(size, 4) ? cJSON_CreateNumber(size) : nullptr;
+    case 0xcf:
+        return Read(size, 8) ? cJSON_CreateNumber(size) : nullptr;
+    case 0xd0:
+        return ReadSigned(value, 1) ? cJSON_CreateNumber(value) : nullptr;
+    case 0xd1:
+        return ReadSigned(value, 2) ? cJSON_CreateNumber(value) : nullptr;
+    case 0xd2:
+        return ReadSigned(value, 4) ? cJSON_CreateNumber(value) : nullptr;
+    case 0xd3:
+        return ReadSigned(value, 8) ? cJSON_CreateNumber(value) : nullptr;
+    case 0xdc:
+        return Read(size, 2) ? Array(size, depth) : nullptr;
+    case 0xdd:
+        return Read(size, 4) ? Array(size, depth) : nullptr;
+    case 0xde:
+        return Read(size, 2) ? Map(size, depth) : nullptr;
+    case 0xdf:
+        return Read(size, 4) ? Map(size, depth) : nullptr;
+    default:
+        // Extension types are not used by the control messages
+        return nullptr;
+    }
+}
+
+} // namespace
+
+cJSON* Decode(const uint8_t* data, size_t size) {
+    Reader reader(data, size);
+    auto root = reader.Value(0);
+    if (root != nullptr && !reader.done()) {
+        cJSON_Delete(root);
+        return nullptr;
+    }
+    return root;
+}
+
+} // namespace Msgpack
@@ -0,0 +1,49 @@
+#ifndef MSGPACK_H
+#define MSGPACK_H
+
+#include <cJSON.h>
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+/*
+ * Minimal MessagePack codec for the binary control messages.
+ *
+ * Writer appends the encoded values to a string, maps and arrays are written as a header
+ * followed by their items. Decode() turns a received message into a cJSON tree, so the
+ * message handlers are the same for both encodings.
+ */
+namespace Msgpack {
+
+class Writer {
+public:
+    explicit Writer(std::string& out) : out_(out) {}
+
+    void Map(size_t count);
+    void Array(size_t count);
+    void String(std::string_view value);
+    void Int(int64_t value);
+    void Double(double value);
+    void Bool(bool value);
+    void Nil();
+    // A cJSON tree, the integral numbers as integers
+    void Json(const cJSON* item);
+
+private:
+    std::string& out_;
+
+    void Header(uint8_t fix_base, size_t fix_max, uint8_t code16, size_t count);
+    void BigEndian(uint64_t value, int bytes);
+};
+
+// Whether a message is a MessagePack map rather than a JSON text, by its first byte
+inline bool IsMap(uint8_t first_byte) {
+    return (first_byte & 0xf0) == 0x80 || first_byte == 0xde || first_byte == 0xdf;
+}
+
+// Decodes one value, nullptr if the message is malformed or nested too deeply
+cJSON* Decode(const uint8_t* data, size_t size);
+
+} // namespace Msgpack
+
+#endif // MSGPACK_H
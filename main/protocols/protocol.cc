@@ -1,11 +1,21 @@
 #include "protocol.h"
 
 #include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
 
 #include <esp_log.h>
 
+#include "settings.h"
+#include "msgpack.h"
+#include "session_capture.h"
+
 #define TAG "Protocol"
 
+// Time the answer to an optimistic open may take before the channel times out
+#define SERVER_HELLO_PENDING_TIMEOUT_SECONDS 10
+
 bool Protocol::ActivateSession(const std::string& session_id) {
     if (session_id.empty()) {
         return false;
@@ -59,20 +69,89 @@ void Protocol::RemoveSession(const std::string& session_id) {
     }
 }
 
+const char* Protocol::SilenceSuppressionName(SilenceSuppression mode) {
+    switch (mode) {
+        case kSilenceSuppressionDtx:
+            return "dtx";
+        case kSilenceSuppressionOmit:
+            return "omit";
+        default:
+            return "off";
+    }
+}
+
+void Protocol::ParseSilenceSuppression(const cJSON* audio_params) {
+    // The server may only pick a mode, older servers do not answer and the default is kept
+    auto silence_suppression = cJSON_GetObjectItem(audio_params, "silence_suppression");
+    if (!cJSON_IsString(silence_suppression)) {
+        return;
+    }
+    if (strcmp(silence_suppression->valuestring, "dtx") == 0) {
+        server_silence_suppression_ = kSilenceSuppressionDtx;
+    } else if (strcmp(silence_suppression->valuestring, "omit") == 0) {
+        server_silence_suppression_ = kSilenceSuppressionOmit;
+    } else if (strcmp(silence_suppression->valuestring, "off") == 0) {
+        server_silence_suppression_ = kSilenceSuppressionOff;
+    } else {
+        ESP_LOGW(TAG, "Unknown silence suppression mode: %s", silence_suppression->valuestring);
+        return;
+    }
+    ESP_LOGI(TAG, "Silence suppression: %s", SilenceSuppressionName(server_silence_suppression_));
+}
+
 void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
+#if CONFIG_USE_SESSION_CAPTURE
+    on_incoming_json_ = [callback](const cJSON* root) {
+        SessionCapture::GetInstance().RecordJson(root);
+        callback(root);
+    };
+#else
     on_incoming_json_ = callback;
+#endif
 }
 
 void Protocol::OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback) {
+#if CONFIG_USE_SESSION_CAPTURE
+    on_incoming_audio_ = [callback](std::unique_ptr<AudioStreamPacket> packet) {
+        SessionCapture::GetInstance().RecordAudio(*packet);
+        callback(std::move(packet));
+    };
+#else
     on_incoming_audio_ = callback;
+#endif
+}
+
+void Protocol::OnAllocateAudioPacket(std::function<std::unique_ptr<AudioStreamPacket>()> callback) {
+    on_allocate_audio_packet_ = callback;
+}
+
+std::unique_ptr<AudioStreamPacket> Protocol::AllocateAudioPacket() {
+    if (on_allocate_audio_packet_ != nullptr) {
+        return on_allocate_audio_packet_();
+    }
+    return std::make_unique<AudioStreamPacket>();
 }
 
 void Protocol::OnAudioChannelOpened(std::function<void()> callback) {
+#if CONFIG_USE_SESSION_CAPTURE
+    on_audio_channel_opened_ = [callback]() {
+        SessionCapture::GetInstance().RecordEvent(kSessionCaptureChannelOpened);
+        callback();
+    };
+#else
     on_audio_channel_opened_ = callback;
+#endif
 }
 
 void Protocol::OnAudioChannelClosed(std::function<void()> callback) {
+#if CONFIG_USE_SESSION_CAPTURE
+    on_audio_channel_closed_ = [callback]() {
+        SessionCapture::GetInstance().RecordEvent(kSessionCaptureChannelClosed);
+        callback();
+    };
+#else
     on_audio_channel_closed_ = callback;
+#endif
 }
 
 void Protocol::OnNetworkError(std::function<void(const std::string& message)> callback) {
@@ -95,47 +174,129 @@ void Protocol::SetError(const std::string& message) {
 }
 
 void Protocol::SendAbortSpeaking(AbortReason reason) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"abort\"";
     if (reason == kAbortReasonWakeWordDetected) {
-        message += ",\"reason\":\"wake_word_detected\"";
+        SendControlMessage({{"session_id", session_id_}, {"type", "abort"}, {"reason", "wake_word_detected"}});
+    } else if (reason == kAbortReasonBargeIn) {
+        SendControlMessage({{"session_id", session_id_}, {"type", "abort"}, {"reason", "barge_in"}});
+    } else {
+        SendControlMessage({{"session_id", session_id_}, {"type", "abort"}});
     }
-    message += "}";
-    SendText(message);
+}
+
+void Protocol::SendTtsCacheMiss(const std::string& hash) {
+    SendControlMessage({{"session_id", session_id_}, {"type", "tts"}, {"state", "cache_miss"}, {"cache_hash", hash}});
+}
+
+bool Protocol::SendAudioBatch(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) {
+    for (auto& packet : packets) {
+        if (!SendAudio(*packet)) {
+            return false;
+        }
+    }
+    return true;
 }
 
 void Protocol::SendWakeWordDetected(const std::string& wake_word) {
-    std::string json = "{\"session_id\":\"" + session_id_ + 
-                      "\",\"type\":\"listen\",\"state\":\"detect\",\"text\":\"" + wake_word + "\"}";
-    SendText(json);
+    SendControlMessage({{"session_id", session_id_}, {"type", "listen"}, {"state", "detect"}, {"text", wake_word}});
 }
 
 void Protocol::SendStartListening(ListeningMode mode) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\"";
-    message += ",\"type\":\"listen\",\"state\":\"start\"";
+    const char* mode_name = "manual";
     if (mode == kListeningModeRealtime) {
-        message += ",\"mode\":\"realtime\"";
+        mode_name = "realtime";
     } else if (mode == kListeningModeAutoStop) {
-        message += ",\"mode\":\"auto\"";
-    } else {
-        message += ",\"mode\":\"manual\"";
+        mode_name = "auto";
     }
-    message += "}";
-    SendText(message);
+    SendControlMessage({{"session_id", session_id_}, {"type", "listen"}, {"state", "start"}, {"mode", mode_name}});
 }
 
 void Protocol::SendStopListening() {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"listen\",\"state\":\"stop\"}";
-    SendText(message);
+    SendControlMessage({{"session_id", session_id_}, {"type", "listen"}, {"state", "stop"}});
 }
 
-void Protocol::SendMcpMessage(const std::string& payload) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"mcp\",\"payload\":" + payload + "}";
-    SendText(message);
+void Protocol::SendEndpoint(float confidence) {
+    char value[8];
+    snprintf(value, sizeof(value), "%.2f", confidence);
+    SendControlMessage({{"session_id", session_id_}, {"type", "listen"}, {"state", "stop"},
+        {"reason", "endpoint"}, {"endpoint_confidence", value}});
+}
+
+bool Protocol::SendControlMessage(std::initializer_list<std::pair<const char*, std::string_view>> fields) {
+    std::string message;
+    if (binary_control_) {
+        Msgpack::Writer writer(message);
+        writer.Map(fields.size());
+        for (auto& [key, value] : fields) {
+            writer.String(key);
+            writer.String(value);
+        }
+        return SendBinaryControl(message);
+    }
+
+    message = "{";
+    for (auto& [key, value] : fields) {
+        if (message.size() > 1) {
+            message += ",";
+        }
+        message += "\"";
+        message += key;
+        message += "\":\"";
+        message += value;
+        message += "\"";
+    }
+    message += "}";
+    return SendText(message);
+}
+
+void Protocol::ParseControlEncoding(const cJSON* root) {
+#if CONFIG_USE_MSGPACK_CONTROL
+    auto features = cJSON_GetObjectItem(root, "features");
+    binary_control_ = cJSON_IsObject(features) && cJSON_IsTrue(cJSON_GetObjectItem(features, "msgpack"));
+    ESP_LOGI(TAG, "Control messages: %s", binary_control_ ? "msgpack" : "json");
+#endif
+}
+
+void Protocol::ParsePingFeature(const cJSON* root) {
+#if CONFIG_LINK_PING_INTERVAL_SECONDS > 0
+    auto features = cJSON_GetObjectItem(root, "features");
+    ping_supported_ = cJSON_IsObject(features) && cJSON_IsTrue(cJSON_GetObjectItem(features, "ping"));
+#endif
+}
+
+void Protocol::SendPing() {
+    if (!ping_supported_) {
+        return;
+    }
+    auto timestamp = std::to_string(link_monitor_.StartPing());
+    SendControlMessage({{"session_id", session_id_}, {"type", "ping"}, {"timestamp", timestamp}});
+}
+
+void Protocol::ParsePong(const cJSON* root) {
+    // The timestamp comes back as it was sent, a string, but a number is accepted too
+    auto timestamp = cJSON_GetObjectItem(root, "timestamp");
+    int64_t sent_ms = 0;
+    if (cJSON_IsString(timestamp)) {
+        sent_ms = strtoll(timestamp->valuestring, nullptr, 10);
+    } else if (cJSON_IsNumber(timestamp)) {
+        sent_ms = timestamp->valuedouble;
+    }
+    auto received = cJSON_GetObjectItem(root, "received");
+    link_monitor_.OnPong(sent_ms, cJSON_IsNumber(received) ? static_cast<int64_t>(received->valuedouble) : -1);
+}
+
+void Protocol::SendMcpMessage(std::string payload) {
+    payload.insert(0, "{\"session_id\":\"" + session_id_ + "\",\"type\":\"mcp\",\"payload\":");
+    payload += "}";
+    SendText(payload);
 }
 
 bool Protocol::IsTimeout() const {
     const int kTimeoutSeconds = 120;
     auto now = std::chrono::steady_clock::now();
+    if (server_hello_pending_ && now - hello_sent_time_ > std::chrono::seconds(SERVER_HELLO_PENDING_TIMEOUT_SECONDS)) {
+        ESP_LOGE(TAG, "No server hello after opening with the cached one");
+        return true;
+    }
     auto duration = std::chrono::duration_cast<std::chrono::seconds>(now - last_incoming_time_);
     bool timeout = duration.count() > kTimeoutSeconds;
     if (timeout) {
@@ -143,3 +304,76 @@ bool Protocol::IsTimeout() const {
     }
     return timeout;
 }
+
+void Protocol::StoreServerHelloCache(const std::string& hello, const char* settings_ns) {
+    if (hello == cached_server_hello_) {
+        return;
+    }
+    cached_server_hello_ = hello;
+#if CONFIG_SERVER_HELLO_CACHE_NVS
+    Settings settings(settings_ns, true);
+    if (hello.empty()) {
+        settings.EraseKey("hello_cache");
+    } else {
+        settings.SetString("hello_cache", hello);
+    }
+#endif
+}
+
+bool Protocol::ApplyCachedServerHello(const char* settings_ns) {
+#if CONFIG_USE_SERVER_HELLO_CACHE
+    if (server_hello_pending_) {
+        ESP_LOGW(TAG, "The server did not answer the last optimistic hello, dropping the cache");
+        server_hello_pending_ = false;
+        StoreServerHelloCache("", settings_ns);
+    }
+#if CONFIG_SERVER_HELLO_CACHE_NVS
+    if (cached_server_hello_.empty()) {
+        Settings settings(settings_ns, false);
+        cached_server_hello_ = settings.GetString("hello_cache");
+    }
+#endif
+    if (cached_server_hello_.empty()) {
+        return false;
+    }
+    auto root = cJSON_Parse(cached_server_hello_.c_str());
+    if (root == nullptr) {
+        StoreServerHelloCache("", settings_ns);
+        return false;
+    }
+    ESP_LOGI(TAG, "Opening with the cached server hello");
+    session_id_.clear();
+    ParseServerHello(root);
+    cJSON_Delete(root);
+    server_hello_pending_ = true;
+    hello_sent_time_ = std::chrono::steady_clock::now();
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Protocol::CheckServerHello(const cJSON* root, const char* settings_ns) {
+    link_monitor_.OnHelloAnswer();
+    // The hello and the other control messages do not reach on_incoming_json_, the replay needs it
+    SessionCapture::GetInstance().RecordJson(root);
+#if CONFIG_USE_SERVER_HELLO_CACHE
+    /* The session is never reused, only the transport and audio parameters are cached */
+    std::string hello;
+    if (cJSON_IsTrue(cJSON_GetObjectItem(root, "cacheable"))) {
+        auto copy = cJSON_Duplicate(root, true);
+        cJSON_DeleteItemFromObject(copy, "session_id");
+        cJSON_DeleteItemFromObject(copy, "sessions");
+        auto json_str = cJSON_PrintUnformatted(copy);
+        hello = json_str;
+        cJSON_free(json_str);
+        cJSON_Delete(copy);
+    }
+    bool matches = !server_hello_pending_ || hello == cached_server_hello_;
+    server_hello_pending_ = false;
+    StoreServerHelloCache(hello, settings_ns);
+    return matches;
+#else
+    return true;
+#endif
+}
@@ -6,11 +6,25 @@
 #include <functional>
 #include <chrono>
 #include <vector>
+#include <memory>
+#include <string_view>
+#include <initializer_list>
+#include <sdkconfig.h>
+
+#include "link_monitor.h"
+#include "control_dispatcher.h"
+
+// Largest transport header written in front of an uplink payload (BinaryProtocol2, the MQTT UDP nonce)
+#define AUDIO_PACKET_HEADROOM 16
 
 struct AudioStreamPacket {
     int sample_rate = 0;
     int frame_duration = 0;
     uint32_t timestamp = 0;
+    uint32_t sequence = 0;  // 0 if the transport has no sequence number
+    // Latency tracing timestamps (esp_timer), 0 if the packet is not traced
+    int64_t trace_origin_us = 0;
+    int64_t trace_stage_us = 0;
     std::vector<uint8_t> payload;
 };
 
@@ -30,9 +44,34 @@ struct BinaryProtocol3 {
     uint8_t payload[];
 } __attribute__((packed));
 
+// Several Opus frames in one message, the payload is frame_count BinaryProtocol4Frame
+struct BinaryProtocol4 {
+    uint8_t type;           // Message type (0: OPUS)
+    uint8_t frame_count;
+    uint16_t payload_size;  // Size of all the frames
+    uint8_t payload[];
+} __attribute__((packed));
+
+struct BinaryProtocol4Frame {
+    uint32_t timestamp;
+    uint16_t size;
+    uint8_t data[];
+} __attribute__((packed));
+
+/*
+ * Moves the payload back to make room for a transport header, and returns the header. Packets
+ * are recycled, so once the payload has grown to its steady size this never allocates and the
+ * whole message can be sent from payload.data().
+ */
+inline uint8_t* PrependHeader(std::vector<uint8_t>& payload, size_t header_size) {
+    payload.insert(payload.begin(), header_size, 0);
+    return payload.data();
+}
+
 enum AbortReason {
     kAbortReasonNone,
-    kAbortReasonWakeWordDetected
+    kAbortReasonWakeWordDetected,
+    kAbortReasonBargeIn
 };
 
 enum ListeningMode {
@@ -41,6 +80,21 @@ enum ListeningMode {
     kListeningModeRealtime // 需要 AEC 支持
 };
 
+// What the uplink sends while the VAD reports silence, negotiated in the hello exchange
+enum SilenceSuppression {
+    kSilenceSuppressionOff,     // Every frame is encoded and sent
+    kSilenceSuppressionDtx,     // Silent frames are encoded with Opus DTX
+    kSilenceSuppressionOmit     // Silent frames are dropped, an empty packet keeps the timestamps going
+};
+
+#if CONFIG_AUDIO_SILENCE_SUPPRESSION_DTX
+#define DEFAULT_SILENCE_SUPPRESSION kSilenceSuppressionDtx
+#elif CONFIG_AUDIO_SILENCE_SUPPRESSION_OMIT
+#define DEFAULT_SILENCE_SUPPRESSION kSilenceSuppressionOmit
+#else
+#define DEFAULT_SILENCE_SUPPRESSION kSilenceSuppressionOff
+#endif
+
 class Protocol {
 public:
     virtual ~Protocol() = default;
@@ -51,6 +105,13 @@ public:
     inline int server_frame_duration() const {
         return server_frame_duration_;
     }
+    inline SilenceSuppression server_silence_suppression() const {
+        return server_silence_suppression_;
+    }
+    // Frames SendAudioBatch() takes at once, 1 if the transport does not batch
+    inline size_t max_audio_batch_frames() const {
+        return max_audio_batch_frames_;
+    }
     inline const std::string& session_id() const {
         return session_id_;
     }
@@ -61,8 +122,19 @@ public:
 
     bool ActivateSession(const std::string& session_id);
 
+    // Link quality of the current audio session, or of the last one once it is closed
+    LinkMetrics GetLinkMetrics() { return link_monitor_.GetMetrics(); }
+    ReconnectMetrics GetReconnectMetrics() { return link_monitor_.GetReconnectMetrics(); }
+    // The board network came back, a disconnected transport reconnects without waiting for its backoff
+    virtual void NotifyNetworkUp() {}
+    // The board moved to another network interface, a connection on the old one is dropped and
+    // made again on the new one
+    virtual void NotifyNetworkChanged() { NotifyNetworkUp(); }
+
     void OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback);
     void OnIncomingJson(std::function<void(const cJSON* root)> callback);
+    // Source of the incoming audio packets, so they come from the audio service pool
+    void OnAllocateAudioPacket(std::function<std::unique_ptr<AudioStreamPacket>()> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
@@ -73,16 +145,32 @@ public:
     virtual bool OpenAudioChannel() = 0;
     virtual void CloseAudioChannel() = 0;
     virtual bool IsAudioChannelOpened() const = 0;
-    virtual bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) = 0;
+    // The payload is used as the send buffer, the caller recycles the packet afterwards
+    virtual bool SendAudio(AudioStreamPacket& packet) = 0;
+    // Sends the packets in order, the default sends them one by one
+    virtual bool SendAudioBatch(std::vector<std::unique_ptr<AudioStreamPacket>>& packets);
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
+    // Stop sent on the local end of utterance detection, with its confidence (0-1)
+    virtual void SendEndpoint(float confidence);
     virtual void SendAbortSpeaking(AbortReason reason);
-    virtual void SendMcpMessage(const std::string& message);
+    // The utterance of a sentence_cached is not in the TTS cache, the server streams it instead
+    virtual void SendTtsCacheMiss(const std::string& hash);
+    // The payload is wrapped in place, without a copy when it has some spare capacity
+    virtual void SendMcpMessage(std::string payload);
+    // A JPEG frame of the camera stream, used as the send buffer like the audio payloads.
+    // False when the transport has no video messages or is busy with the audio.
+    virtual bool SendVideoFrame(std::vector<uint8_t>& jpeg, uint32_t timestamp) { return false; }
+    // Echoed timestamp for the RTT, only sent when the server accepted features.ping
+    void SendPing();
+    // A telemetry snapshot on a channel of its own, false when the transport has none
+    virtual bool SendTelemetry(const std::string& snapshot) { return false; }
 
 protected:
     std::function<void(const cJSON* root)> on_incoming_json_;
     std::function<void(std::unique_ptr<AudioStreamPacket> packet)> on_incoming_audio_;
+    std::function<std::unique_ptr<AudioStreamPacket>()> on_allocate_audio_packet_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
     std::function<void(const std::string& message)> on_network_error_;
@@ -90,21 +178,62 @@ protected:
     std::function<void()> on_disconnected_;
 
     int server_sample_rate_ = 24000;
-    int server_frame_duration_ = 60;
+    // The proposed duration is kept when the server hello does not carry one
+    int server_frame_duration_ = CONFIG_AUDIO_OPUS_FRAME_DURATION_MS;
+    SilenceSuppression server_silence_suppression_ = DEFAULT_SILENCE_SUPPRESSION;
+    size_t max_audio_batch_frames_ = 1;
     bool error_occurred_ = false;
+    // The server accepted MessagePack control messages in the hello exchange
+    bool binary_control_ = false;
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
+    // Fed by the transports with every message, see link_monitor.h
+    LinkMonitor link_monitor_;
+    bool ping_supported_ = false;
+    // The received JSON and MessagePack messages go through it to HandleControlMessage()
+    ControlDispatcher control_dispatcher_{[this](const cJSON* root) { return HandleControlMessage(root); }};
 
     void ReplaceSessionList(const std::vector<std::string>& sessions, const std::string& active_session_id);
     void RegisterOrUpdateSession(const std::string& session_id);
     void RemoveSession(const std::string& session_id);
 
     virtual bool SendText(const std::string& text) = 0;
+    // Sends an encoded MessagePack control message, only called once binary_control_ is set
+    virtual bool SendBinaryControl(const std::string& data) { return false; }
+    // The listen and abort messages, as MessagePack when negotiated and JSON otherwise
+    bool SendControlMessage(std::initializer_list<std::pair<const char*, std::string_view>> fields);
+    // Shared hello handling of features.msgpack
+    void ParseControlEncoding(const cJSON* root);
+    // Shared hello handling of features.ping, and the answers to SendPing()
+    void ParsePingFeature(const cJSON* root);
+    void ParsePong(const cJSON* root);
+    virtual void ParseServerHello(const cJSON* root) = 0;
+    // A received control message of either encoding on the control dispatch task, false if it has no type
+    virtual bool HandleControlMessage(const cJSON* root) = 0;
+    std::unique_ptr<AudioStreamPacket> AllocateAudioPacket();
+    // Shared hello handling of the silence suppression mode
+    void ParseSilenceSuppression(const cJSON* audio_params);
+    static const char* SilenceSuppressionName(SilenceSuppression mode);
+
+    /*
+     * Server hello cache (CONFIG_USE_SERVER_HELLO_CACHE). ApplyCachedServerHello() parses the
+     * cached answer right after the hello is sent, so the channel opens without the round-trip.
+     * Every hello answer goes through CheckServerHello(), which refreshes the cache and returns
+     * false when the channel was opened with a cached answer that does not match it.
+     */
+    bool server_hello_pending_ = false;
+    bool ApplyCachedServerHello(const char* settings_ns);
+    bool CheckServerHello(const cJSON* root, const char* settings_ns);
+
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
 
 private:
     std::vector<std::string> session_ids_;
+    std::string cached_server_hello_;
+    std::chrono::time_point<std::chrono::steady_clock> hello_sent_time_;
+
+    void StoreServerHelloCache(const std::string& hello, const char* settings_ns);
 };
 
 #endif // PROTOCOL_H
@@ -0,0 +1,45 @@
+#include "transport_profile.h"
+#include "board.h"
+
+#include <esp_log.h>
+
+#define TAG "TransportProfile"
+
+namespace {
+
+const TransportProfile kWifiProfile = {
+    .name = "wifi",
+    .max_batch_frames = 2,
+    .mqtt_keepalive_seconds = 240,
+    .websocket_keepalive_ms = 30000,
+    .jitter_min_frames = 1,
+    .congestion_rtt_ms = 400,
+};
+
+const TransportProfile kCellularProfile = {
+    .name = "cellular",
+    .max_batch_frames = 4,
+    .mqtt_keepalive_seconds = 90,
+    .websocket_keepalive_ms = 60000,
+    .jitter_min_frames = 3,
+    .congestion_rtt_ms = 1000,
+};
+
+} // namespace
+
+const TransportProfile& GetTransportProfile() {
+#if CONFIG_TRANSPORT_PROFILE_WIFI
+    const TransportProfile& profile = kWifiProfile;
+#elif CONFIG_TRANSPORT_PROFILE_CELLULAR
+    const TransportProfile& profile = kCellularProfile;
+#else
+    // DualNetworkBoard reports the type of the board it currently runs
+    const TransportProfile& profile = Board::GetInstance().GetBoardType() == "ml307" ? kCellularProfile : kWifiProfile;
+#endif
+    static const TransportProfile* last_profile = nullptr;
+    if (last_profile != &profile) {
+        ESP_LOGI(TAG, "Transport profile: %s", profile.name);
+        last_profile = &profile;
+    }
+    return profile;
+}
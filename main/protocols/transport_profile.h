@@ -0,0 +1,34 @@
+#ifndef TRANSPORT_PROFILE_H
+#define TRANSPORT_PROFILE_H
+
+#include <cstddef>
+
+#include <sdkconfig.h>
+
+/*
+ * Transport settings tuned for the network the board is on.
+ *
+ * Cellular links pay a lot per packet and have a high, variable RTT: more frames per batch, a
+ * deeper jitter buffer, fewer keepalives and a higher RTT before the encoder backs off. Wi-Fi has
+ * a low RTT but bursty loss, it keeps small batches and lets the jitter buffer adapt from a
+ * single frame.
+ *
+ * The profile is looked up from the board type whenever an audio channel opens, so a dual
+ * network board picks up the interface it is on. The codec side of the profile is the RTT at
+ * which the encoder controller backs off.
+ */
+// The congestion RTT before the first audio channel has picked a profile
+#define TRANSPORT_DEFAULT_CONGESTION_RTT_MS 600
+
+struct TransportProfile {
+    const char* name;
+    size_t max_batch_frames;        // Uplink frames per protocol call (MQTT UDP, WebSocket version 4)
+    int mqtt_keepalive_seconds;     // Used when the MQTT settings have no keepalive
+    int websocket_keepalive_ms;     // Ping interval of an idle persistent WebSocket
+    size_t jitter_min_frames;       // Jitter buffer depth before the playback starts
+    int congestion_rtt_ms;          // Link RTT above which the encoder controller backs off
+};
+
+const TransportProfile& GetTransportProfile();
+
+#endif // TRANSPORT_PROFILE_H
@@ -0,0 +1,105 @@
+#include "udp_audio.h"
+#include "log_ring.h"
+
+#include <esp_log.h>
+#include <cstring>
+#include <arpa/inet.h>
+
+#define TAG "UdpAudio"
+
+namespace UdpAudio {
+
+bool Seal(mbedtls_aes_context& aes_ctx, const std::string& nonce, uint8_t flags, uint32_t timestamp,
+    uint32_t sequence, const uint8_t* payload, size_t size, std::string& datagram) {
+    uint8_t counter[kHeaderSize];
+    uint8_t stream_block[kHeaderSize];
+    memcpy(counter, nonce.data(), kHeaderSize);
+    counter[1] = flags;
+    *(uint16_t*)&counter[2] = htons(size);
+    *(uint32_t*)&counter[8] = htonl(timestamp);
+    *(uint32_t*)&counter[12] = htonl(sequence);
+
+    datagram.resize(kHeaderSize + size);
+    memcpy(datagram.data(), counter, kHeaderSize);
+
+    // The counter is incremented in place by the cipher, the header copy above keeps the sent value
+    size_t nc_off = 0;
+    if (mbedtls_aes_crypt_ctr(&aes_ctx, size, &nc_off, counter, stream_block, payload,
+        (uint8_t*)&datagram[kHeaderSize]) != 0) {
+        ESP_LOGE(TAG, "Failed to encrypt audio data");
+        return false;
+    }
+    return true;
+}
+
+bool ParseHeader(const std::string& datagram, uint32_t& timestamp, uint32_t& sequence) {
+    if (datagram.size() < kHeaderSize) {
+        LOG_RATE_LIMITED(1000, ESP_LOGE, TAG, "Invalid audio packet size: %u", datagram.size());
+        return false;
+    }
+    if (datagram[0] != kPacketType) {
+        LOG_RATE_LIMITED(1000, ESP_LOGE, TAG, "Invalid audio packet type: %x", datagram[0]);
+        return false;
+    }
+    timestamp = ntohl(*(uint32_t*)&datagram[8]);
+    sequence = ntohl(*(uint32_t*)&datagram[12]);
+    return true;
+}
+
+bool Open(mbedtls_aes_context& aes_ctx, const std::string& datagram, std::vector<uint8_t>& payload) {
+    uint8_t counter[kHeaderSize];
+    uint8_t stream_block[kHeaderSize];
+    memcpy(counter, datagram.data(), kHeaderSize);
+    size_t size = datagram.size() - kHeaderSize;
+    payload.resize(size);
+    size_t nc_off = 0;
+    int ret = mbedtls_aes_crypt_ctr(&aes_ctx, size, &nc_off, counter, stream_block,
+        (const uint8_t*)datagram.data() + kHeaderSize, payload.data());
+    if (ret != 0) {
+        LOG_RATE_LIMITED(1000, ESP_LOGE, TAG, "Failed to decrypt audio data, ret: %d", ret);
+        return false;
+    }
+    return true;
+}
+
+bool ParseEndpoint(const cJSON* udp, std::string& server, int& port, std::string& nonce, mbedtls_aes_context& aes_ctx) {
+    if (!cJSON_IsObject(udp)) {
+        return false;
+    }
+    auto server_item = cJSON_GetObjectItem(udp, "server");
+    auto port_item = cJSON_GetObjectItem(udp, "port");
+    auto key_item = cJSON_GetObjectItem(udp, "key");
+    auto nonce_item = cJSON_GetObjectItem(udp, "nonce");
+    if (!cJSON_IsString(server_item) || !cJSON_IsNumber(port_item) || !cJSON_IsString(key_item) || !cJSON_IsString(nonce_item)) {
+        return false;
+    }
+    nonce = DecodeHexString(nonce_item->valuestring);
+    if (nonce.size() != kHeaderSize) {
+        ESP_LOGE(TAG, "Invalid UDP nonce size: %u", nonce.size());
+        return false;
+    }
+    server = server_item->valuestring;
+    port = port_item->valueint;
+    mbedtls_aes_setkey_enc(&aes_ctx, (const unsigned char*)DecodeHexString(key_item->valuestring).c_str(), 128);
+    return true;
+}
+
+// 辅助函数，将单个十六进制字符转换为对应的数值
+static inline uint8_t CharToHex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return 0;  // 对于无效输入，返回0
+}
+
+std::string DecodeHexString(const std::string& hex_string) {
+    std::string decoded;
+    decoded.reserve(hex_string.size() / 2);
+    for (size_t i = 0; i + 1 < hex_string.size(); i += 2) {
+        char byte = (CharToHex(hex_string[i]) << 4) | CharToHex(hex_string[i + 1]);
+        decoded.push_back(byte);
+    }
+    return decoded;
+}
+
+} // namespace UdpAudio
@@ -0,0 +1,39 @@
+#ifndef UDP_AUDIO_H
+#define UDP_AUDIO_H
+
+#include <cJSON.h>
+#include <mbedtls/aes.h>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Encrypted UDP audio packets, shared by the MQTT and the WebSocket UDP audio channels.
+ *
+ * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
+ * |payload payload_len|
+ *
+ * The payload is AES-128-CTR encrypted, the 16 byte header is the initial counter block. The
+ * hello nonce gives the type and ssrc bytes, the other fields are filled per packet.
+ */
+namespace UdpAudio {
+
+constexpr size_t kHeaderSize = 16;
+constexpr uint8_t kPacketType = 0x01;
+
+// Builds the header and appends the encrypted payload, datagram is reused between calls
+bool Seal(mbedtls_aes_context& aes_ctx, const std::string& nonce, uint8_t flags, uint32_t timestamp,
+    uint32_t sequence, const uint8_t* payload, size_t size, std::string& datagram);
+// Header fields of a received datagram, false if it is not an audio packet
+bool ParseHeader(const std::string& datagram, uint32_t& timestamp, uint32_t& sequence);
+// Decrypts the payload of a datagram accepted by ParseHeader()
+bool Open(mbedtls_aes_context& aes_ctx, const std::string& datagram, std::vector<uint8_t>& payload);
+
+// The server, port, key and nonce of a hello udp object, the key is loaded into aes_ctx
+bool ParseEndpoint(const cJSON* udp, std::string& server, int& port, std::string& nonce, mbedtls_aes_context& aes_ctx);
+std::string DecodeHexString(const std::string& hex_string);
+
+} // namespace UdpAudio
+
+#endif // UDP_AUDIO_H
@@ -3,8 +3,13 @@
 #include "system_info.h"
 #include "application.h"
 #include "settings.h"
+#include "msgpack.h"
+#include "transport_profile.h"
+#include "udp_audio.h"
+#include "task_placement.h"
 
 #include <cstring>
+#include <algorithm>
 #include <cJSON.h>
 #include <esp_log.h>
 #include <arpa/inet.h>
@@ -14,50 +19,326 @@
 
 WebsocketProtocol::WebsocketProtocol() {
     event_group_handle_ = xEventGroupCreate();
+    xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_RECONNECT_DONE_EVENT);
+    mbedtls_aes_init(&udp_aes_ctx_);
 }
 
 WebsocketProtocol::~WebsocketProtocol() {
+    control_dispatcher_.Stop();
+    StopKeepalive();
+    Application::GetInstance().CancelTimer(reconnect_timer_.exchange(0));
+    // A reconnect task still in flight uses this object until it sets the bit
+    xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_RECONNECT_DONE_EVENT, pdFALSE, pdTRUE, portMAX_DELAY);
+    CloseUdpChannel();
+    {
+        std::lock_guard<std::mutex> lock(send_mutex_);
+        websocket_.reset();
+    }
+    mbedtls_aes_free(&udp_aes_ctx_);
     vEventGroupDelete(event_group_handle_);
 }
 
 bool WebsocketProtocol::Start() {
-    // Only connect to server when audio channel is needed
+#if CONFIG_WEBSOCKET_PERSISTENT_CONNECTION
+    // Connect in the background once idle, so the first conversation already finds a warm connection
+    ScheduleReconnect(1000);
+#endif
+    // Without a persistent connection, only connect to server when audio channel is needed
     return true;
 }
 
-bool WebsocketProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
+void WebsocketProtocol::ScheduleReconnect(uint32_t delay_ms, bool force) {
+    auto& app = Application::GetInstance();
+    app.CancelTimer(reconnect_timer_.exchange(0));
+    reconnect_timer_ = app.ScheduleAfter(delay_ms, [this, force]() {
+        if (Application::GetInstance().GetDeviceState() != kDeviceStateIdle) {
+            // OpenAudioChannel() connects when a conversation starts meanwhile
+            ScheduleReconnect(WEBSOCKET_RECONNECT_INTERVAL_MS, force);
+            return;
+        }
+        if (!force && IsConnected()) {
+            return;
+        }
+        if (reconnecting_.exchange(true)) {
+            return;
+        }
+        // The hello wait takes up to 10 s, the main loop goes on meanwhile
+        reconnect_force_ = force;
+        xEventGroupClearBits(event_group_handle_, WEBSOCKET_PROTOCOL_RECONNECT_DONE_EVENT);
+        if (TaskPlacements::Create(kTaskWebsocketReconnect, [](void* arg) {
+                auto self = static_cast<WebsocketProtocol*>(arg);
+                self->Reconnect(self->reconnect_force_);
+                self->reconnecting_ = false;
+                xEventGroupSetBits(self->event_group_handle_, WEBSOCKET_PROTOCOL_RECONNECT_DONE_EVENT);
+                TaskPlacements::Delete(kTaskWebsocketReconnect);
+            }, this) != pdPASS) {
+            reconnecting_ = false;
+            xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_RECONNECT_DONE_EVENT);
+            ScheduleReconnect(WEBSOCKET_RECONNECT_INTERVAL_MS, force);
+        }
+    });
+}
+
+void WebsocketProtocol::Reconnect(bool force) {
+    std::lock_guard<std::mutex> lock(connect_mutex_);
+    // A conversation may have connected meanwhile
+    if (channel_opened_ || (!force && IsConnected())) {
+        return;
+    }
+    ESP_LOGI(TAG, "Reconnecting to websocket server");
+    if (!Connect(false)) {
+        ScheduleReconnect(WEBSOCKET_RECONNECT_INTERVAL_MS);
+    }
+}
+
+void WebsocketProtocol::NotifyNetworkChanged() {
+#if CONFIG_WEBSOCKET_PERSISTENT_CONNECTION
+    // The warm connection is on the old interface, the next channel opens on the new one anyway
+    ScheduleReconnect(1000, true);
+#endif
+}
+
+void WebsocketProtocol::StartKeepalive() {
+    StopKeepalive();
+    keepalive_timer_ = Application::GetInstance().ScheduleEvery(GetTransportProfile().websocket_keepalive_ms, [this]() {
+        std::lock_guard<std::mutex> lock(send_mutex_);
+        if (persistent_ && !channel_opened_ && websocket_ != nullptr && websocket_->IsConnected()) {
+            websocket_->Ping();
+        }
+    });
+}
+
+void WebsocketProtocol::StopKeepalive() {
+    Application::GetInstance().CancelTimer(keepalive_timer_.exchange(0));
+}
+
+bool WebsocketProtocol::SendAudio(AudioStreamPacket& packet) {
+    std::lock_guard<std::mutex> lock(send_mutex_);
     if (websocket_ == nullptr || !websocket_->IsConnected()) {
         return false;
     }
+#if CONFIG_USE_WEBSOCKET_UDP_AUDIO
+    if (SendUdpAudio(packet)) {
+        return true;
+    }
+#endif
 
+    /* The header is written in front of the payload, so the message goes out without a copy */
+    auto& payload = packet.payload;
+    size_t payload_size = payload.size();
     if (version_ == 2) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol2) + packet->payload.size());
-        auto bp2 = (BinaryProtocol2*)serialized.data();
+        auto bp2 = (BinaryProtocol2*)PrependHeader(payload, sizeof(BinaryProtocol2));
         bp2->version = htons(version_);
         bp2->type = 0;
         bp2->reserved = 0;
-        bp2->timestamp = htonl(packet->timestamp);
-        bp2->payload_size = htonl(packet->payload.size());
-        memcpy(bp2->payload, packet->payload.data(), packet->payload.size());
-
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+        bp2->timestamp = htonl(packet.timestamp);
+        bp2->payload_size = htonl(payload_size);
     } else if (version_ == 3) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol3) + packet->payload.size());
-        auto bp3 = (BinaryProtocol3*)serialized.data();
+        auto bp3 = (BinaryProtocol3*)PrependHeader(payload, sizeof(BinaryProtocol3));
         bp3->type = 0;
         bp3->reserved = 0;
-        bp3->payload_size = htons(packet->payload.size());
-        memcpy(bp3->payload, packet->payload.data(), packet->payload.size());
+        bp3->payload_size = htons(payload_size);
+    } else if (version_ == 4) {
+        auto bp4 = (BinaryProtocol4*)PrependHeader(payload, sizeof(BinaryProtocol4) + sizeof(BinaryProtocol4Frame));
+        bp4->type = 0;
+        bp4->frame_count = 1;
+        bp4->payload_size = htons(sizeof(BinaryProtocol4Frame) + payload_size);
+        auto frame = (BinaryProtocol4Frame*)bp4->payload;
+        frame->timestamp = htonl(packet.timestamp);
+        frame->size = htons(payload_size);
+    }
+    if (!websocket_->Send(payload.data(), payload.size(), true)) {
+        return false;
+    }
+    link_monitor_.AddUplink(payload.size(), 1);
+    return true;
+}
+
+bool WebsocketProtocol::SendAudioBatch(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) {
+    if (version_ != 4 || packets.size() == 1 || udp_active_) {
+        return Protocol::SendAudioBatch(packets);
+    }
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+        return false;
+    }
+
+    /*
+     * One message for the whole batch, so a backed up queue does not cost a WebSocket frame
+     * and a TLS record per Opus frame. The buffer is reused, it only grows to the largest batch.
+     */
+    size_t size = sizeof(BinaryProtocol4);
+    for (auto& packet : packets) {
+        size += sizeof(BinaryProtocol4Frame) + packet->payload.size();
+    }
+    batch_buffer_.resize(size);
+    auto bp4 = (BinaryProtocol4*)batch_buffer_.data();
+    bp4->type = 0;
+    bp4->frame_count = packets.size();
+    bp4->payload_size = htons(size - sizeof(BinaryProtocol4));
+    auto frame_data = bp4->payload;
+    for (auto& packet : packets) {
+        auto frame = (BinaryProtocol4Frame*)frame_data;
+        frame->timestamp = htonl(packet->timestamp);
+        frame->size = htons(packet->payload.size());
+        memcpy(frame->data, packet->payload.data(), packet->payload.size());
+        frame_data += sizeof(BinaryProtocol4Frame) + packet->payload.size();
+    }
+
+    if (!websocket_->Send(batch_buffer_.data(), batch_buffer_.size(), true)) {
+        return false;
+    }
+    link_monitor_.AddUplink(batch_buffer_.size(), packets.size());
+    return true;
+}
+
+bool WebsocketProtocol::SendVideoFrame(std::vector<uint8_t>& jpeg, uint32_t timestamp) {
+    if (version_ == 1 || (version_ != 2 && jpeg.size() > UINT16_MAX)) {
+        return false;
+    }
+    // The audio goes first, a frame that would wait for the socket is dropped
+    std::unique_lock<std::mutex> lock(send_mutex_, std::try_to_lock);
+    if (!lock.owns_lock() || websocket_ == nullptr || !websocket_->IsConnected()) {
+        return false;
+    }
 
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+    size_t payload_size = jpeg.size();
+    if (version_ == 2) {
+        auto bp2 = (BinaryProtocol2*)PrependHeader(jpeg, sizeof(BinaryProtocol2));
+        bp2->version = htons(version_);
+        bp2->type = htons(WEBSOCKET_BINARY_TYPE_JPEG);
+        bp2->reserved = 0;
+        bp2->timestamp = htonl(timestamp);
+        bp2->payload_size = htonl(payload_size);
     } else {
-        return websocket_->Send(packet->payload.data(), packet->payload.size(), true);
+        auto bp3 = (BinaryProtocol3*)PrependHeader(jpeg, sizeof(BinaryProtocol3));
+        bp3->type = WEBSOCKET_BINARY_TYPE_JPEG;
+        bp3->reserved = 0;
+        bp3->payload_size = htons(payload_size);
     }
+    if (!websocket_->Send(jpeg.data(), jpeg.size(), true)) {
+        return false;
+    }
+    link_monitor_.AddUplink(jpeg.size());
+    return true;
+}
+
+bool WebsocketProtocol::SendUdpAudio(AudioStreamPacket& packet) {
+    std::lock_guard<std::mutex> lock(udp_mutex_);
+    if (udp_ == nullptr) {
+        return false;
+    }
+    if (!udp_active_) {
+        ProbeUdpChannel();
+        return false;
+    }
+    if (UdpAudio::Seal(udp_aes_ctx_, udp_nonce_, 0, packet.timestamp, ++udp_local_sequence_,
+        packet.payload.data(), packet.payload.size(), udp_buffer_) && udp_->Send(udp_buffer_) > 0) {
+        link_monitor_.AddUplink(udp_buffer_.size(), 1);
+        return true;
+    }
+    // No more probes, the rest of the conversation goes in-band
+    ESP_LOGW(TAG, "Failed to send UDP audio, falling back to the websocket");
+    udp_probes_sent_ = WEBSOCKET_UDP_PROBE_ATTEMPTS + 1;
+    udp_active_ = false;
+    return false;
+}
+
+void WebsocketProtocol::ProbeUdpChannel() {
+    /*
+     * A probe is an audio packet with an empty payload, the server answers it with one, so the
+     * path works both ways before the audio moves. The socket stays open when the probes go
+     * unanswered, the server may still send the downlink over UDP if only its answer was lost.
+     */
+    int probes = udp_probes_sent_;
+    if (probes > WEBSOCKET_UDP_PROBE_ATTEMPTS) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    if (probes > 0 && now - udp_probe_time_us_ < WEBSOCKET_UDP_PROBE_INTERVAL_MS * 1000) {
+        return;
+    }
+    if (probes == WEBSOCKET_UDP_PROBE_ATTEMPTS) {
+        ESP_LOGW(TAG, "No answer to the UDP probes, the audio stays on the websocket");
+        udp_probes_sent_ = probes + 1;
+        return;
+    }
+    if (UdpAudio::Seal(udp_aes_ctx_, udp_nonce_, 0, 0, ++udp_local_sequence_, nullptr, 0, udp_buffer_) &&
+        udp_->Send(udp_buffer_) > 0) {
+        link_monitor_.AddUplink(udp_buffer_.size());
+    }
+    udp_probes_sent_ = probes + 1;
+    udp_probe_time_us_ = now;
+}
+
+void WebsocketProtocol::OpenUdpChannel() {
+    std::lock_guard<std::mutex> lock(udp_mutex_);
+    udp_active_ = false;
+    udp_.reset();
+    if (udp_server_.empty()) {
+        return;
+    }
+    udp_remote_sequence_ = 0;
+    udp_probes_sent_ = 0;
+
+    auto network = Board::GetInstance().GetNetwork();
+    udp_ = network->CreateUdp(WEBSOCKET_UDP_SOCKET_ID);
+    if (udp_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create the UDP audio socket");
+        return;
+    }
+    udp_->OnMessage([this](const std::string& data) {
+        uint32_t timestamp;
+        uint32_t sequence;
+        if (!UdpAudio::ParseHeader(data, timestamp, sequence)) {
+            return;
+        }
+        link_monitor_.AddDownlink(data.size());
+        if (udp_probes_sent_ <= WEBSOCKET_UDP_PROBE_ATTEMPTS && !udp_active_.exchange(true)) {
+            ESP_LOGI(TAG, "UDP audio channel confirmed by the server");
+        }
+        if (data.size() == UdpAudio::kHeaderSize) {
+            // Probe answer
+            return;
+        }
+
+        // Late and duplicated packets are dropped, the gaps are counted as lost
+        if (udp_remote_sequence_ != 0 && sequence <= udp_remote_sequence_) {
+            return;
+        }
+        if (udp_remote_sequence_ != 0 && sequence > udp_remote_sequence_ + 1) {
+            link_monitor_.AddDownlinkLost(sequence - udp_remote_sequence_ - 1);
+        }
+        udp_remote_sequence_ = sequence;
+        link_monitor_.AddDownlinkPacket(sequence, server_frame_duration_);
+
+        auto packet = AllocateAudioPacket();
+        packet->sample_rate = server_sample_rate_;
+        packet->frame_duration = server_frame_duration_;
+        packet->timestamp = timestamp;
+        packet->sequence = sequence;
+        packet->trace_origin_us = 0;
+        if (!UdpAudio::Open(udp_aes_ctx_, data, packet->payload)) {
+            return;
+        }
+        if (on_incoming_audio_ != nullptr) {
+            on_incoming_audio_(std::move(packet));
+        }
+        last_incoming_time_ = std::chrono::steady_clock::now();
+    });
+    udp_->Connect(udp_server_, udp_port_);
+    ESP_LOGI(TAG, "UDP audio channel to %s:%d, probing", udp_server_.c_str(), udp_port_);
+    ProbeUdpChannel();
+}
+
+void WebsocketProtocol::CloseUdpChannel() {
+    std::lock_guard<std::mutex> lock(udp_mutex_);
+    udp_active_ = false;
+    udp_.reset();
 }
 
 bool WebsocketProtocol::SendText(const std::string& text) {
+    std::lock_guard<std::mutex> lock(send_mutex_);
     if (websocket_ == nullptr || !websocket_->IsConnected()) {
         return false;
     }
@@ -67,19 +348,231 @@ bool WebsocketProtocol::SendText(const std::string& text) {
         SetError(Lang::Strings::SERVER_ERROR);
         return false;
     }
+    link_monitor_.AddUplink(text.size());
+    return true;
+}
+
+bool WebsocketProtocol::HandleControlMessage(const cJSON* root) {
+    auto type = cJSON_GetObjectItem(root, "type");
+    if (!cJSON_IsString(type)) {
+        return false;
+    }
+    if (strcmp(type->valuestring, "hello") == 0) {
+        bool matches = CheckServerHello(root, "websocket");
+        ParseServerHello(root);
+        if (!matches) {
+            // Opened with a stale cached hello, the new parameters are applied again
+            ESP_LOGW(TAG, "Server hello differs from the cached one");
+            Application::GetInstance().Schedule([this]() {
+                if (on_audio_channel_opened_ != nullptr && IsAudioChannelOpened()) {
+                    on_audio_channel_opened_();
+                }
+            }, kSchedulePriorityHigh);
+        }
+    } else if (strcmp(type->valuestring, "pong") == 0) {
+        ParsePong(root);
+    } else if (persistent_ && strcmp(type->valuestring, "goodbye") == 0) {
+        // The server ended the conversation, the connection stays open
+        Application::GetInstance().Schedule([this]() {
+            if (channel_opened_) {
+                CloseAudioChannel();
+            }
+        }, kSchedulePriorityHigh);
+    } else if (on_incoming_json_ != nullptr) {
+        on_incoming_json_(root);
+    }
+    return true;
+}
 
+bool WebsocketProtocol::HandleBinaryControl(const char* data, size_t len) {
+    /*
+     * MessagePack control messages reuse the binary header with type 2:
+     * BinaryProtocol2 for version 2, and the 4 byte header of version 3 for versions 3 and 4.
+     */
+    const uint8_t* payload = nullptr;
+    size_t payload_size = 0;
+    if (version_ == 2 && len >= sizeof(BinaryProtocol2)) {
+        auto bp2 = (const BinaryProtocol2*)data;
+        if (ntohs(bp2->type) != WEBSOCKET_BINARY_TYPE_MSGPACK) {
+            return false;
+        }
+        payload = bp2->payload;
+        payload_size = std::min<size_t>(ntohl(bp2->payload_size), len - sizeof(BinaryProtocol2));
+    } else if ((version_ == 3 || version_ == 4) && len >= sizeof(BinaryProtocol3)) {
+        auto bp3 = (const BinaryProtocol3*)data;
+        if (bp3->type != WEBSOCKET_BINARY_TYPE_MSGPACK) {
+            return false;
+        }
+        payload = bp3->payload;
+        payload_size = std::min<size_t>(ntohs(bp3->payload_size), len - sizeof(BinaryProtocol3));
+    } else {
+        return false;
+    }
+
+    control_dispatcher_.Post((const char*)payload, payload_size, true);
     return true;
 }
 
+void WebsocketProtocol::HandleBinaryAudio(const uint8_t* data, size_t len) {
+    // The headers are read in place and never rewritten, the payloads are copied once, into
+    // pooled packets that go on to the jitter buffer and the decoder as they are
+    auto end = data + len;
+    if (version_ == 2) {
+        if (len < sizeof(BinaryProtocol2)) {
+            ESP_LOGE(TAG, "Invalid audio message size: %u", len);
+            return;
+        }
+        auto bp2 = (const BinaryProtocol2*)data;
+        size_t payload_size = ntohl(bp2->payload_size);
+        if (bp2->payload + payload_size > end) {
+            ESP_LOGE(TAG, "Truncated audio message");
+            return;
+        }
+        DeliverAudio(ntohl(bp2->timestamp), bp2->payload, payload_size);
+    } else if (version_ == 3) {
+        if (len < sizeof(BinaryProtocol3)) {
+            ESP_LOGE(TAG, "Invalid audio message size: %u", len);
+            return;
+        }
+        auto bp3 = (const BinaryProtocol3*)data;
+        size_t payload_size = ntohs(bp3->payload_size);
+        if (bp3->payload + payload_size > end) {
+            ESP_LOGE(TAG, "Truncated audio message");
+            return;
+        }
+        DeliverAudio(0, bp3->payload, payload_size);
+    } else if (version_ == 4) {
+        if (len < sizeof(BinaryProtocol4)) {
+            ESP_LOGE(TAG, "Invalid audio message size: %u", len);
+            return;
+        }
+        auto bp4 = (const BinaryProtocol4*)data;
+        auto frame_data = bp4->payload;
+        for (int i = 0; i < bp4->frame_count; i++) {
+            if (frame_data + sizeof(BinaryProtocol4Frame) > end) {
+                ESP_LOGE(TAG, "Truncated audio batch");
+                break;
+            }
+            auto frame = (const BinaryProtocol4Frame*)frame_data;
+            size_t frame_size = ntohs(frame->size);
+            if (frame->data + frame_size > end) {
+                ESP_LOGE(TAG, "Truncated audio batch");
+                break;
+            }
+            DeliverAudio(ntohl(frame->timestamp), frame->data, frame_size);
+            frame_data = frame->data + frame_size;
+        }
+    } else {
+        DeliverAudio(0, data, len);
+    }
+}
+
+void WebsocketProtocol::DeliverAudio(uint32_t timestamp, const uint8_t* payload, size_t size) {
+    auto packet = AllocateAudioPacket();
+    packet->sample_rate = server_sample_rate_;
+    packet->frame_duration = server_frame_duration_;
+    packet->timestamp = timestamp;
+    packet->sequence = 0;
+    packet->trace_origin_us = 0;
+    // A pooled packet keeps the capacity of its payload, so this does not allocate
+    packet->payload.assign(payload, payload + size);
+    link_monitor_.AddDownlinkPacket(0, server_frame_duration_);
+    on_incoming_audio_(std::move(packet));
+}
+
+bool WebsocketProtocol::SendBinaryControl(const std::string& data) {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+        return false;
+    }
+
+    size_t header_size = version_ == 2 ? sizeof(BinaryProtocol2) : sizeof(BinaryProtocol3);
+    control_buffer_.resize(header_size + data.size());
+    if (version_ == 2) {
+        auto bp2 = (BinaryProtocol2*)control_buffer_.data();
+        bp2->version = htons(version_);
+        bp2->type = htons(WEBSOCKET_BINARY_TYPE_MSGPACK);
+        bp2->reserved = 0;
+        bp2->timestamp = 0;
+        bp2->payload_size = htonl(data.size());
+    } else {
+        auto bp3 = (BinaryProtocol3*)control_buffer_.data();
+        bp3->type = WEBSOCKET_BINARY_TYPE_MSGPACK;
+        bp3->reserved = 0;
+        bp3->payload_size = htons(data.size());
+    }
+    memcpy(&control_buffer_[header_size], data.data(), data.size());
+
+    if (!websocket_->Send(control_buffer_.data(), control_buffer_.size(), true)) {
+        ESP_LOGE(TAG, "Failed to send msgpack control message");
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+    link_monitor_.AddUplink(control_buffer_.size());
+    return true;
+}
+
+bool WebsocketProtocol::IsConnected() const {
+    // Connect() replaces the websocket on the reconnect task
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    return websocket_ != nullptr && websocket_->IsConnected();
+}
+
 bool WebsocketProtocol::IsAudioChannelOpened() const {
-    return websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
+    // Opened only after the server hello, not while a connection waits for it
+    if (!channel_opened_) {
+        return false;
+    }
+    return IsConnected() && !error_occurred_ && !IsTimeout();
 }
 
 void WebsocketProtocol::CloseAudioChannel() {
-    websocket_.reset();
+    CloseUdpChannel();
+    if (!persistent_ || !IsConnected()) {
+        channel_opened_ = false;
+        std::lock_guard<std::mutex> lock(send_mutex_);
+        websocket_.reset();
+        return;
+    }
+
+    /* Only the conversation ends, the connection stays warm for the next one */
+    std::string message = "{";
+    message += "\"session_id\":\"" + session_id_ + "\",";
+    message += "\"type\":\"goodbye\"";
+    message += "}";
+    SendText(message);
+    if (channel_opened_) {
+        channel_opened_ = false;
+        if (on_audio_channel_closed_ != nullptr) {
+            on_audio_channel_closed_();
+        }
+    }
 }
 
 bool WebsocketProtocol::OpenAudioChannel() {
+    // After a reconnect in flight, its connection is reused
+    std::lock_guard<std::mutex> lock(connect_mutex_);
+    link_monitor_.StartSession();
+    if (persistent_ && IsConnected()) {
+        // The hello exchange of the warm connection is still valid, the conversation starts with listen
+        ESP_LOGI(TAG, "Reusing the websocket connection");
+        error_occurred_ = false;
+        last_incoming_time_ = std::chrono::steady_clock::now();
+    } else if (!Connect(true)) {
+        return false;
+    }
+
+    channel_opened_ = true;
+#if CONFIG_USE_WEBSOCKET_UDP_AUDIO
+    OpenUdpChannel();
+#endif
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
+    return true;
+}
+
+bool WebsocketProtocol::Connect(bool report_error) {
     Settings settings("websocket", false);
     std::string url = settings.GetString("url");
     std::string token = settings.GetString("token");
@@ -89,9 +582,17 @@ bool WebsocketProtocol::OpenAudioChannel() {
     }
 
     error_occurred_ = false;
-
+    max_audio_batch_frames_ = 1;
+    // The old connection, if any, closes as a plain one
+    persistent_ = false;
+    channel_opened_ = false;
+    StopKeepalive();
     auto network = Board::GetInstance().GetNetwork();
-    websocket_ = network->CreateWebSocket(1);
+    {
+        std::lock_guard<std::mutex> lock(send_mutex_);
+        websocket_.reset();
+        websocket_ = network->CreateWebSocket(1);
+    }
     if (websocket_ == nullptr) {
         ESP_LOGE(TAG, "Failed to create websocket");
         return false;
@@ -109,64 +610,30 @@ bool WebsocketProtocol::OpenAudioChannel() {
     websocket_->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
 
     websocket_->OnData([this](const char* data, size_t len, bool binary) {
+        link_monitor_.AddDownlink(len);
         if (binary) {
-            if (on_incoming_audio_ != nullptr) {
-                if (version_ == 2) {
-                    BinaryProtocol2* bp2 = (BinaryProtocol2*)data;
-                    bp2->version = ntohs(bp2->version);
-                    bp2->type = ntohs(bp2->type);
-                    bp2->timestamp = ntohl(bp2->timestamp);
-                    bp2->payload_size = ntohl(bp2->payload_size);
-                    auto payload = (uint8_t*)bp2->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = bp2->timestamp,
-                        .payload = std::vector<uint8_t>(payload, payload + bp2->payload_size)
-                    }));
-                } else if (version_ == 3) {
-                    BinaryProtocol3* bp3 = (BinaryProtocol3*)data;
-                    bp3->type = bp3->type;
-                    bp3->payload_size = ntohs(bp3->payload_size);
-                    auto payload = (uint8_t*)bp3->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>(payload, payload + bp3->payload_size)
-                    }));
-                } else {
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len)
-                    }));
-                }
+            bool control = binary_control_ && HandleBinaryControl(data, len);
+            if (!control && on_incoming_audio_ != nullptr) {
+                HandleBinaryAudio((const uint8_t*)data, len);
             }
         } else {
-            // Parse JSON data
-            auto root = cJSON_Parse(data);
-            auto type = cJSON_GetObjectItem(root, "type");
-            if (cJSON_IsString(type)) {
-                if (strcmp(type->valuestring, "hello") == 0) {
-                    ParseServerHello(root);
-                } else {
-                    if (on_incoming_json_ != nullptr) {
-                        on_incoming_json_(root);
-                    }
-                }
-            } else {
-                ESP_LOGE(TAG, "Missing message type, data: %s", data);
-            }
-            cJSON_Delete(root);
+            // Parsed on the control dispatch task, the next audio frame does not wait for it
+            control_dispatcher_.Post(data, len, false);
         }
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
     websocket_->OnDisconnected([this]() {
         ESP_LOGI(TAG, "Websocket disconnected");
-        if (on_audio_channel_closed_ != nullptr) {
+        bool was_opened = channel_opened_;
+        channel_opened_ = false;
+        CloseUdpChannel();
+        if (persistent_) {
+            // Idle drops are not reported, the connection is reopened in the background
+            StopKeepalive();
+            ScheduleReconnect(WEBSOCKET_RECONNECT_INTERVAL_MS);
+        }
+        if ((!persistent_ || was_opened) && on_audio_channel_closed_ != nullptr) {
             on_audio_channel_closed_();
         }
     });
@@ -174,28 +641,37 @@ bool WebsocketProtocol::OpenAudioChannel() {
     ESP_LOGI(TAG, "Connecting to websocket server: %s with version: %d", url.c_str(), version_);
     if (!websocket_->Connect(url.c_str())) {
         ESP_LOGE(TAG, "Failed to connect to websocket server");
-        SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+        if (report_error) {
+            SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+        }
         return false;
     }
 
-    // Send hello message to describe the client
+    // Send hello message to describe the client, the cached answer is applied first so the real one always follows it
+    xEventGroupClearBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
+    bool optimistic = ApplyCachedServerHello("websocket");
     auto message = GetHelloMessage();
+    link_monitor_.OnHelloSent();
     if (!SendText(message)) {
+        server_hello_pending_ = false;
         return false;
     }
 
-    // Wait for server hello
-    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
+    // Wait for server hello, unless the cached one is used
+    EventBits_t bits = optimistic ? WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT :
+        xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
     if (!(bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
         ESP_LOGE(TAG, "Failed to receive server hello");
-        SetError(Lang::Strings::SERVER_TIMEOUT);
+        if (report_error) {
+            SetError(Lang::Strings::SERVER_TIMEOUT);
+        }
         return false;
     }
 
-    if (on_audio_channel_opened_ != nullptr) {
-        on_audio_channel_opened_();
+    if (persistent_) {
+        ESP_LOGI(TAG, "Persistent connection accepted by the server");
+        StartKeepalive();
     }
-
     return true;
 }
 
@@ -209,6 +685,23 @@ std::string WebsocketProtocol::GetHelloMessage() {
     cJSON_AddBoolToObject(features, "aec", true);
 #endif
     cJSON_AddBoolToObject(features, "mcp", true);
+#if CONFIG_USE_TTS_CACHE
+    cJSON_AddBoolToObject(features, "tts_cache", true);
+#endif
+#if CONFIG_LINK_PING_INTERVAL_SECONDS > 0
+    cJSON_AddBoolToObject(features, "ping", true);
+#endif
+#if CONFIG_WEBSOCKET_PERSISTENT_CONNECTION
+    cJSON_AddBoolToObject(features, "persistent", true);
+#endif
+#if CONFIG_USE_WEBSOCKET_UDP_AUDIO
+    cJSON_AddBoolToObject(features, "udp", true);
+#endif
+#if CONFIG_USE_MSGPACK_CONTROL
+    if (version_ >= 2) {
+        cJSON_AddBoolToObject(features, "msgpack", true);
+    }
+#endif
     cJSON_AddItemToObject(root, "features", features);
     cJSON_AddStringToObject(root, "transport", "websocket");
     cJSON* audio_params = cJSON_CreateObject();
@@ -216,6 +709,11 @@ std::string WebsocketProtocol::GetHelloMessage() {
     cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
     cJSON_AddNumberToObject(audio_params, "channels", 1);
     cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
+    cJSON_AddStringToObject(audio_params, "silence_suppression", SilenceSuppressionName(DEFAULT_SILENCE_SUPPRESSION));
+    if (version_ == 4) {
+        cJSON_AddNumberToObject(audio_params, "max_batch_frames",
+            std::min<int>(GetTransportProfile().max_batch_frames, WEBSOCKET_MAX_BATCH_FRAMES));
+    }
     cJSON_AddItemToObject(root, "audio_params", audio_params);
     auto json_str = cJSON_PrintUnformatted(root);
     std::string message(json_str);
@@ -247,7 +745,47 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
         if (cJSON_IsNumber(frame_duration)) {
             server_frame_duration_ = frame_duration->valueint;
         }
+        ParseSilenceSuppression(audio_params);
+        auto max_batch_frames = cJSON_GetObjectItem(audio_params, "max_batch_frames");
+        if (version_ == 4 && cJSON_IsNumber(max_batch_frames)) {
+            int proposed = std::min<int>(GetTransportProfile().max_batch_frames, WEBSOCKET_MAX_BATCH_FRAMES);
+            max_audio_batch_frames_ = std::clamp(max_batch_frames->valueint, 1, proposed);
+        }
+    }
+
+    // Version 1 has no binary header to tell the control messages from the audio
+    binary_control_ = false;
+    if (version_ >= 2) {
+        ParseControlEncoding(root);
+    }
+
+    ParsePingFeature(root);
+
+#if CONFIG_USE_WEBSOCKET_UDP_AUDIO
+    {
+        // The socket of the previous endpoint is closed first, its receive task uses the cipher
+        std::lock_guard<std::mutex> lock(udp_mutex_);
+        bool reopen = udp_ != nullptr;
+        udp_active_ = false;
+        udp_.reset();
+        if (!UdpAudio::ParseEndpoint(cJSON_GetObjectItem(root, "udp"), udp_server_, udp_port_, udp_nonce_, udp_aes_ctx_)) {
+            udp_server_.clear();
+        }
+        if (reopen) {
+            // The channel was opened with a cached hello
+            Application::GetInstance().Schedule([this]() {
+                if (channel_opened_) {
+                    OpenUdpChannel();
+                }
+            }, kSchedulePriorityHigh);
+        }
     }
+#endif
+
+#if CONFIG_WEBSOCKET_PERSISTENT_CONNECTION
+    auto features = cJSON_GetObjectItem(root, "features");
+    persistent_ = cJSON_IsObject(features) && cJSON_IsTrue(cJSON_GetObjectItem(features, "persistent"));
+#endif
 
     xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
 }
@@ -3,12 +3,35 @@
 
 
 #include "protocol.h"
+#include "heap_accounting.h"
 
 #include <web_socket.h>
+#include <udp.h>
+#include <mbedtls/aes.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <esp_timer.h>
+
+#include <mutex>
+#include <atomic>
+#include <vector>
 
 #define WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
+#define WEBSOCKET_PROTOCOL_RECONNECT_DONE_EVENT (1 << 1)
+// Upper bound of the frames per BinaryProtocol4 message, the hello proposes the transport profile
+// batch size and the server may answer less
+#define WEBSOCKET_MAX_BATCH_FRAMES 8
+// Binary message type of the MessagePack control messages, next to 0 (OPUS) and 1 (JSON)
+#define WEBSOCKET_BINARY_TYPE_MSGPACK 2
+// Binary message type of the camera stream JPEG frames, not sent with protocol version 1
+#define WEBSOCKET_BINARY_TYPE_JPEG 3
+// Retry interval of the persistent connection after a drop, the idle keepalive comes from the transport profile
+#define WEBSOCKET_RECONNECT_INTERVAL_MS 10000
+// Socket id of the UDP audio side channel, the websocket uses 1
+#define WEBSOCKET_UDP_SOCKET_ID 2
+// Empty UDP packets sent until the server echoes one, the audio stays in-band without an answer
+#define WEBSOCKET_UDP_PROBE_INTERVAL_MS 500
+#define WEBSOCKET_UDP_PROBE_ATTEMPTS 6
 
 class WebsocketProtocol : public Protocol {
 public:
@@ -16,19 +39,79 @@ public:
     ~WebsocketProtocol();
 
     bool Start() override;
-    bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
+    void NotifyNetworkChanged() override;
+    bool SendAudio(AudioStreamPacket& packet) override;
+    bool SendAudioBatch(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
+    bool SendVideoFrame(std::vector<uint8_t>& jpeg, uint32_t timestamp) override;
 
 private:
     EventGroupHandle_t event_group_handle_;
+    // Guards websocket_ against the audio send task, the sends and the socket replacement take it
+    mutable std::mutex send_mutex_;
     std::unique_ptr<WebSocket> websocket_;
     int version_ = 1;
+    // Framing buffers, kept across sends so they are only allocated once. The audio batches go out
+    // every frame, the control messages are rare and may be large
+    std::vector<char, InternalAllocator<char, kHeapTagProtocol>> batch_buffer_;
+    std::vector<char, PsramAllocator<char, kHeapTagProtocol>> control_buffer_;
+    // The server accepted to keep the connection open between conversations
+    bool persistent_ = false;
+    std::atomic<bool> channel_opened_ = false;
+    // Main loop timers of the persistent connection, 0 when not armed
+    std::atomic<uint32_t> keepalive_timer_ = 0;
+    std::atomic<uint32_t> reconnect_timer_ = 0;
+    // The reconnect task runs, and it replaces the connection even if it is up
+    std::atomic<bool> reconnecting_ = false;
+    bool reconnect_force_ = false;
+    // Held for a whole Connect(), the reconnect task and OpenAudioChannel() may connect at once
+    std::mutex connect_mutex_;
+
+    /*
+     * UDP audio side channel (CONFIG_USE_WEBSOCKET_UDP_AUDIO), the endpoint comes from the hello.
+     * udp_mutex_ guards the socket and the send state. The receive task takes no lock, the
+     * socket is closed before the cipher or the receive state change.
+     */
+    std::mutex udp_mutex_;
+    std::unique_ptr<Udp> udp_;
+    std::string udp_server_;
+    int udp_port_ = 0;
+    std::string udp_nonce_;
+    mbedtls_aes_context udp_aes_ctx_;
+    // Never restarts, so a cached hello with the same key does not repeat a counter block
+    uint32_t udp_local_sequence_ = 0;
+    uint32_t udp_remote_sequence_ = 0;
+    std::string udp_buffer_;
+    // The server answered a probe, the audio goes over UDP
+    std::atomic<bool> udp_active_ = false;
+    std::atomic<int> udp_probes_sent_ = 0;
+    int64_t udp_probe_time_us_ = 0;
 
-    void ParseServerHello(const cJSON* root);
+    bool Connect(bool report_error);
+    bool IsConnected() const;
+    void ScheduleReconnect(uint32_t delay_ms, bool force = false);
+    // On the reconnect task
+    void Reconnect(bool force);
+    void StartKeepalive();
+    void StopKeepalive();
+    void ParseServerHello(const cJSON* root) override;
     bool SendText(const std::string& text) override;
+    bool SendBinaryControl(const std::string& data) override;
+    bool HandleControlMessage(const cJSON* root) override;
+    // Posts the message to the control dispatcher, false if the binary message is not a control message
+    bool HandleBinaryControl(const char* data, size_t len);
+    // Splits a binary audio message of the negotiated version into packets
+    void HandleBinaryAudio(const uint8_t* data, size_t len);
+    void DeliverAudio(uint32_t timestamp, const uint8_t* payload, size_t size);
     std::string GetHelloMessage();
+    void OpenUdpChannel();
+    void CloseUdpChannel();
+    // Sends the next probe when it is due, the caller holds udp_mutex_
+    void ProbeUdpChannel();
+    // False when the packet has to go in-band
+    bool SendUdpAudio(AudioStreamPacket& packet);
 };
 
 #endif
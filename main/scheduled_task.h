@@ -0,0 +1,223 @@
+#ifndef SCHEDULED_TASK_H
+#define SCHEDULED_TASK_H
+
+#include <sdkconfig.h>
+
+#include <deque>
+#include <new>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Captures up to this size are stored in the task itself, larger ones are boxed on the heap
+#define SCHEDULED_TASK_INLINE_SIZE 40
+
+// Where a task was scheduled, filled by the default arguments of the Schedule() callers.
+// Tasks of the main loop itself use a name and line 0.
+struct CallSite {
+    const char* file = nullptr;
+    int line = 0;
+
+    static constexpr CallSite Here(const char* file = __builtin_FILE(), int line = __builtin_LINE()) {
+        return CallSite{file, line};
+    }
+};
+
+enum SchedulePriority {
+    kSchedulePriorityHigh,      // Device state and audio channel control
+    kSchedulePriorityNormal,    // Display, telemetry and MCP replies
+};
+
+/*
+ * Move-only void() callable with inline storage, the allocation-free counterpart of
+ * std::function for Application::Schedule().
+ *
+ * The lambdas passed to Schedule() capture a few pointers and at most a string, which fits
+ * SCHEDULED_TASK_INLINE_SIZE. A larger callable still works, it is moved into one heap block
+ * and IsBoxed() reports it.
+ */
+class ScheduledTask {
+public:
+    ScheduledTask() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, ScheduledTask>>>
+    ScheduledTask(F&& callable) {
+        using Callable = std::decay_t<F>;
+        if constexpr (sizeof(Callable) <= SCHEDULED_TASK_INLINE_SIZE &&
+                alignof(Callable) <= alignof(std::max_align_t) &&
+                std::is_nothrow_move_constructible_v<Callable>) {
+            new (storage_) Callable(std::forward<F>(callable));
+            ops_ = &InlineOps<Callable>::kOps;
+        } else {
+            *reinterpret_cast<Callable**>(storage_) = new Callable(std::forward<F>(callable));
+            ops_ = &BoxedOps<Callable>::kOps;
+        }
+    }
+
+    ScheduledTask(ScheduledTask&& other) noexcept { MoveFrom(other); }
+    ScheduledTask& operator=(ScheduledTask&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+    ScheduledTask(const ScheduledTask&) = delete;
+    ScheduledTask& operator=(const ScheduledTask&) = delete;
+    ~ScheduledTask() { Reset(); }
+
+    const CallSite& site() const { return site_; }
+    void set_site(const CallSite& site) { site_ = site; }
+
+    explicit operator bool() const { return ops_ != nullptr; }
+    bool IsBoxed() const { return ops_ != nullptr && ops_->boxed; }
+    void operator()() { ops_->invoke(storage_); }
+
+    void Reset() {
+        if (ops_ != nullptr) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        // Moves the callable of src into the empty dst and leaves src empty
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* storage);
+        bool boxed;
+    };
+
+    template <typename Callable>
+    struct InlineOps {
+        static constexpr Ops kOps = {
+            [](void* storage) { (*static_cast<Callable*>(storage))(); },
+            [](void* dst, void* src) {
+                new (dst) Callable(std::move(*static_cast<Callable*>(src)));
+                static_cast<Callable*>(src)->~Callable();
+            },
+            [](void* storage) { static_cast<Callable*>(storage)->~Callable(); },
+            false,
+        };
+    };
+
+    template <typename Callable>
+    struct BoxedOps {
+        static constexpr Ops kOps = {
+            [](void* storage) { (**static_cast<Callable**>(storage))(); },
+            [](void* dst, void* src) { *static_cast<Callable**>(dst) = *static_cast<Callable**>(src); },
+            [](void* storage) { delete *static_cast<Callable**>(storage); },
+            true,
+        };
+    };
+
+    void MoveFrom(ScheduledTask& other) {
+        if (other.ops_ != nullptr) {
+            other.ops_->move(storage_, other.storage_);
+            ops_ = other.ops_;
+            other.ops_ = nullptr;
+        }
+        site_ = other.site_;
+    }
+
+    alignas(std::max_align_t) uint8_t storage_[SCHEDULED_TASK_INLINE_SIZE];
+    const Ops* ops_ = nullptr;
+    CallSite site_;
+};
+
+struct ScheduleStats {
+    uint32_t scheduled = 0;
+    uint32_t high_water = 0;        // Deepest backlog of both lanes together
+    uint32_t overflowed = 0;        // Tasks that found their lane full and went to the heap
+    uint32_t boxed = 0;             // Captures too large for the inline storage
+};
+
+/*
+ * The main loop tasks, one fixed ring per priority lane.
+ *
+ * Pop() serves the high lane first. A full lane never drops a task, since a lost state change
+ * would hang the device: the task is kept in a heap overflow list behind the ring and counted.
+ * Push() reports when the backlog reaches 3/4 of a lane, and again only after it fell below
+ * half, so the caller can warn once per burst.
+ *
+ * Not thread-safe, the application guards it with its mutex.
+ */
+class ScheduleQueue {
+public:
+    static constexpr size_t kCapacity = CONFIG_SCHEDULE_QUEUE_CAPACITY;
+
+    // Returns true when this task makes the queue fall behind
+    bool Push(ScheduledTask&& task, SchedulePriority priority) {
+        auto& lane = lanes_[priority];
+        stats_.scheduled++;
+        if (task.IsBoxed()) {
+            stats_.boxed++;
+        }
+        if (lane.count < kCapacity && lane.overflow.empty()) {
+            lane.slots[(lane.head + lane.count) % kCapacity] = std::move(task);
+            lane.count++;
+        } else {
+            lane.overflow.push_back(std::move(task));
+            stats_.overflowed++;
+        }
+
+        size_t depth = Size();
+        if (depth > stats_.high_water) {
+            stats_.high_water = depth;
+        }
+        if (!backlogged_ && lane.count + lane.overflow.size() >= kCapacity * 3 / 4) {
+            backlogged_ = true;
+            return true;
+        }
+        return false;
+    }
+
+    // Returns an empty task if nothing is queued
+    ScheduledTask Pop() {
+        ScheduledTask task;
+        for (auto& lane : lanes_) {
+            if (lane.count > 0) {
+                task = std::move(lane.slots[lane.head]);
+                lane.head = (lane.head + 1) % kCapacity;
+                lane.count--;
+                // Keep the order, the overflow list refills the ring from its tail
+                if (!lane.overflow.empty()) {
+                    lane.slots[(lane.head + lane.count) % kCapacity] = std::move(lane.overflow.front());
+                    lane.overflow.pop_front();
+                    lane.count++;
+                }
+                break;
+            }
+        }
+        if (backlogged_ && Size() < kCapacity / 2) {
+            backlogged_ = false;
+        }
+        return task;
+    }
+
+    size_t Size() const {
+        size_t size = 0;
+        for (auto& lane : lanes_) {
+            size += lane.count + lane.overflow.size();
+        }
+        return size;
+    }
+
+    const ScheduleStats& GetStats() const { return stats_; }
+
+private:
+    struct Lane {
+        ScheduledTask slots[kCapacity];
+        size_t head = 0;
+        size_t count = 0;
+        std::deque<ScheduledTask> overflow;
+    };
+
+    Lane lanes_[2];
+    ScheduleStats stats_;
+    bool backlogged_ = false;
+};
+
+#endif // SCHEDULED_TASK_H
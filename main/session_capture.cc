@@ -0,0 +1,245 @@
+#include "session_capture.h"
+
+#if CONFIG_USE_SESSION_CAPTURE
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <string>
+#include <algorithm>
+
+#include "application.h"
+#include "audio_pressure.h"
+#include "board.h"
+#include "display.h"
+#include "protocols/protocol.h"
+#include "task_placement.h"
+
+#define TAG "SessionCapture"
+
+namespace {
+
+struct __attribute__((packed)) DatagramHeader {
+    char magic[4];
+    uint32_t datagram_sequence;
+    uint32_t record_sequence;
+    uint16_t fragment;
+    uint16_t fragments;
+};
+
+// Raises the peak to value, the sender task and a reset may race, a lost peak is harmless
+void RaisePeak(std::atomic<uint32_t>& peak, uint32_t value) {
+    uint32_t current = peak.load(std::memory_order_relaxed);
+    while (value > current && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+} // namespace
+
+void SessionCapture::Start() {
+    if (task_ != nullptr) {
+        return;
+    }
+
+    std::string server_addr = CONFIG_SESSION_CAPTURE_UDP_SERVER;
+    size_t colon_pos = server_addr.find(':');
+    if (colon_pos == std::string::npos) {
+        ESP_LOGW(TAG, "Invalid server address: %s, should be IP:PORT", CONFIG_SESSION_CAPTURE_UDP_SERVER);
+        return;
+    }
+    memset(&udp_server_addr_, 0, sizeof(udp_server_addr_));
+    udp_server_addr_.sin_family = AF_INET;
+    udp_server_addr_.sin_port = htons(std::stoi(server_addr.substr(colon_pos + 1)));
+    inet_pton(AF_INET, server_addr.substr(0, colon_pos).c_str(), &udp_server_addr_.sin_addr);
+    udp_sockfd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_sockfd_ < 0) {
+        ESP_LOGW(TAG, "Failed to create UDP socket: %d", errno);
+        return;
+    }
+
+    // The records are written by the protocol tasks and read once by the sender, PSRAM will do
+#if CONFIG_SPIRAM
+    ring_ = xRingbufferCreateWithCaps(CONFIG_SESSION_CAPTURE_BUFFER_KB * 1024, RINGBUF_TYPE_NOSPLIT, MALLOC_CAP_SPIRAM);
+#else
+    ring_ = xRingbufferCreate(CONFIG_SESSION_CAPTURE_BUFFER_KB * 1024, RINGBUF_TYPE_NOSPLIT);
+#endif
+    if (ring_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate a ring of %d KB", CONFIG_SESSION_CAPTURE_BUFFER_KB);
+        close(udp_sockfd_);
+        udp_sockfd_ = -1;
+        return;
+    }
+
+    datagram_.reserve(SESSION_CAPTURE_DATAGRAM_SIZE);
+    TaskPlacements::Create(kTaskSessionCapture, [](void* arg) {
+        ((SessionCapture*)arg)->SenderTask();
+    }, this, &task_);
+    ESP_LOGI(TAG, "Sending the server sessions to %s", CONFIG_SESSION_CAPTURE_UDP_SERVER);
+}
+
+void SessionCapture::RecordJson(const cJSON* root) {
+    if (task_ == nullptr) {
+        return;
+    }
+    char* text = cJSON_PrintUnformatted(root);
+    if (text == nullptr) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    Record(kSessionCaptureJson, text, strlen(text));
+    cJSON_free(text);
+}
+
+void SessionCapture::RecordAudio(const AudioStreamPacket& packet) {
+    Record(kSessionCaptureAudio, packet.payload.data(), packet.payload.size(),
+           packet.sample_rate, packet.frame_duration, packet.timestamp);
+}
+
+void SessionCapture::RecordEvent(SessionCaptureKind kind) {
+    Record(kind, nullptr, 0);
+}
+
+void SessionCapture::Record(SessionCaptureKind kind, const void* data, size_t size, int sample_rate,
+                            int frame_duration, uint32_t timestamp) {
+    // The ring is published by the sender task creation, nothing is recorded before Start()
+    if (task_ == nullptr) {
+        return;
+    }
+    // Never waits, the protocol task must not stall for the capture
+    void* item = nullptr;
+    if (xRingbufferSendAcquire(ring_, &item, sizeof(RecordHeader) + size, 0) != pdTRUE) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    RecordHeader header = {
+        .time_ms = (uint32_t)(esp_timer_get_time() / 1000),
+        .kind = kind,
+        .frame_duration = (uint8_t)frame_duration,
+        .sample_rate = (uint16_t)sample_rate,
+        .timestamp = timestamp,
+        .size = (uint32_t)size,
+    };
+    memcpy(item, &header, sizeof(header));
+    if (size > 0) {
+        memcpy((uint8_t*)item + sizeof(header), data, size);
+    }
+    xRingbufferSendComplete(ring_, item);
+    records_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SessionCapture::SenderTask() {
+    uint32_t reported_drops = 0;
+    while (true) {
+        size_t size = 0;
+        auto record = (uint8_t*)xRingbufferReceive(ring_, &size, pdMS_TO_TICKS(SESSION_CAPTURE_SAMPLE_INTERVAL_MS));
+        SampleQueues();
+        if (record == nullptr) {
+            continue;
+        }
+        Send(record, size);
+        vRingbufferReturnItem(ring_, record);
+
+        uint32_t dropped = dropped_.load(std::memory_order_relaxed);
+        if (dropped != reported_drops) {
+            ESP_LOGW(TAG, "%lu records dropped, raise SESSION_CAPTURE_BUFFER_KB", dropped - reported_drops);
+            reported_drops = dropped;
+        }
+    }
+}
+
+void SessionCapture::Send(const uint8_t* record, size_t size) {
+    const size_t fragment_size = SESSION_CAPTURE_DATAGRAM_SIZE - sizeof(DatagramHeader);
+    uint16_t fragments = (size + fragment_size - 1) / fragment_size;
+    uint32_t record_sequence = record_sequence_++;
+    for (uint16_t i = 0; i < fragments; i++) {
+        size_t offset = i * fragment_size;
+        size_t length = std::min(size - offset, fragment_size);
+        DatagramHeader header = {
+            .magic = {'S', 'C', 'A', 'P'},
+            .datagram_sequence = datagram_sequence_++,
+            .record_sequence = record_sequence,
+            .fragment = i,
+            .fragments = fragments,
+        };
+        datagram_.assign((uint8_t*)&header, (uint8_t*)&header + sizeof(header));
+        datagram_.insert(datagram_.end(), record + offset, record + offset + length);
+        ssize_t sent = sendto(udp_sockfd_, datagram_.data(), datagram_.size(), 0,
+                             (struct sockaddr*)&udp_server_addr_, sizeof(udp_server_addr_));
+        if (sent < 0) {
+            ESP_LOGW(TAG, "Failed to send the capture to %s: %d", CONFIG_SESSION_CAPTURE_UDP_SERVER, errno);
+            return;
+        }
+    }
+}
+
+void SessionCapture::SampleQueues() {
+    auto depths = Application::GetInstance().GetAudioService().GetQueueDepths();
+    RaisePeak(decode_peak_, depths.decode);
+    RaisePeak(playback_peak_, depths.playback);
+}
+
+cJSON* SessionCapture::GetStatsJson(bool reset) {
+    auto& audio_service = Application::GetInstance().GetAudioService();
+    cJSON* root = cJSON_CreateObject();
+
+    auto depths = audio_service.GetQueueDepths();
+    cJSON* queues = cJSON_CreateObject();
+    cJSON_AddNumberToObject(queues, "decode", depths.decode);
+    cJSON_AddNumberToObject(queues, "playback", depths.playback);
+    cJSON_AddNumberToObject(queues, "decode_peak", decode_peak_.load(std::memory_order_relaxed));
+    cJSON_AddNumberToObject(queues, "playback_peak", playback_peak_.load(std::memory_order_relaxed));
+    cJSON_AddItemToObject(root, "queues", queues);
+
+    auto jitter = audio_service.GetJitterBufferStats();
+    cJSON* jitter_buffer = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jitter_buffer, "depth", jitter.depth);
+    cJSON_AddNumberToObject(jitter_buffer, "target_depth", jitter.target_depth);
+    cJSON_AddNumberToObject(jitter_buffer, "jitter_ms", jitter.jitter_ms);
+    cJSON_AddNumberToObject(jitter_buffer, "received", jitter.received);
+    cJSON_AddNumberToObject(jitter_buffer, "late", jitter.late);
+    cJSON_AddNumberToObject(jitter_buffer, "lost", jitter.lost);
+    cJSON_AddNumberToObject(jitter_buffer, "underruns", jitter.underruns);
+    cJSON_AddNumberToObject(jitter_buffer, "rebuffer_ms", jitter.rebuffer_ms);
+    cJSON_AddNumberToObject(jitter_buffer, "first_audio_ms", jitter.first_audio_ms);
+    cJSON_AddItemToObject(root, "jitter_buffer", jitter_buffer);
+
+    cJSON_AddNumberToObject(root, "playback_starved", audio_service.GetPlaybackStarved());
+    auto glitches = Board::GetInstance().GetAudioCodec()->GetGlitchStats();
+    cJSON* i2s = cJSON_CreateObject();
+    cJSON_AddNumberToObject(i2s, "underruns", glitches.underruns);
+    cJSON_AddNumberToObject(i2s, "overruns", glitches.overruns);
+    cJSON_AddItemToObject(root, "i2s", i2s);
+    auto& pressure = AudioPressure::GetInstance();
+    cJSON* audio_pressure = cJSON_CreateObject();
+    cJSON_AddNumberToObject(audio_pressure, "playback", pressure.raised(kAudioPressurePlayback));
+    cJSON_AddNumberToObject(audio_pressure, "encode", pressure.raised(kAudioPressureEncode));
+    cJSON_AddNumberToObject(audio_pressure, "input", pressure.raised(kAudioPressureInput));
+    cJSON_AddItemToObject(root, "audio_pressure", audio_pressure);
+    // The received to decoded stage is the decode lag
+    cJSON_AddItemToObject(root, "latency", audio_service.GetLatencyTracer().GetStatsJson());
+
+    auto display = Board::GetInstance().GetDisplay();
+    if (display != nullptr) {
+        auto latency = display->GetUpdateLatency(reset);
+        cJSON* ui = cJSON_CreateObject();
+        cJSON_AddNumberToObject(ui, "updates", latency.count);
+        cJSON_AddNumberToObject(ui, "avg_ms", latency.count > 0 ? latency.total_us / latency.count / 1000.0 : 0);
+        cJSON_AddNumberToObject(ui, "max_ms", latency.max_us / 1000.0);
+        cJSON_AddItemToObject(root, "ui_update", ui);
+    }
+
+    cJSON_AddNumberToObject(root, "records", records_.load(std::memory_order_relaxed));
+    cJSON_AddNumberToObject(root, "dropped", dropped_.load(std::memory_order_relaxed));
+
+    if (reset) {
+        decode_peak_.store(0, std::memory_order_relaxed);
+        playback_peak_.store(0, std::memory_order_relaxed);
+    }
+    return root;
+}
+
+#endif // CONFIG_USE_SESSION_CAPTURE
@@ -0,0 +1,120 @@
+#ifndef SESSION_CAPTURE_H
+#define SESSION_CAPTURE_H
+
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <cJSON.h>
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#if CONFIG_USE_SESSION_CAPTURE
+#include <freertos/ringbuf.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+struct AudioStreamPacket;
+
+#define SESSION_CAPTURE_MAGIC "SCAP"
+// Datagrams stay below the Wi-Fi MTU, a longer record is split into fragments
+#define SESSION_CAPTURE_DATAGRAM_SIZE 1400
+// How often the sender task samples the audio queue depths when there is nothing to send
+#define SESSION_CAPTURE_SAMPLE_INTERVAL_MS 20
+
+enum SessionCaptureKind : uint8_t {
+    kSessionCaptureJson = 0,        // A JSON message of the server, the text
+    kSessionCaptureAudio,           // An audio packet of the server, the Opus frame
+    kSessionCaptureChannelOpened,   // The audio channel opened, after the server hello
+    kSessionCaptureChannelClosed,
+};
+
+/*
+ * Records the server side of the sessions for scripts/session_replay.py.
+ *
+ * The protocol hands every JSON message and audio packet of the server to the capture before
+ * the application sees them, with the audio channel opening and closing, whatever the
+ * transport (WebSocket or MQTT + UDP). The records are copied into a ring buffer, and a low
+ * priority task sends them to CONFIG_SESSION_CAPTURE_UDP_SERVER, where the script writes them
+ * to a capture file. Later the script replays the file as a WebSocket server, at the recorded
+ * pace or scaled, without an LLM server: the hello, the STT / LLM / TTS messages, the TTS audio
+ * and the MCP calls. With a full ring a record is dropped and counted.
+ *
+ * The sender task also samples the audio queue depths, GetStatsJson() reports their peaks with
+ * the rest of the replay counters (jitter buffer, decode lag, UI update latency) for the
+ * self.get_session_stats MCP tool, which the script calls at the end of a replay.
+ *
+ * Datagram: "SCAP", uint32 datagram sequence, uint32 record sequence, uint16 fragment index,
+ * uint16 fragment count, then a part of the record:
+ *   uint32 time_ms (since boot), uint8 kind, uint8 frame_duration, uint16 sample_rate,
+ *   uint32 audio timestamp, uint32 data size, data
+ * all little endian. The uplink audio is not recorded.
+ *
+ * Without CONFIG_USE_SESSION_CAPTURE every method is an empty inline.
+ */
+class SessionCapture {
+public:
+    static SessionCapture& GetInstance() {
+        static SessionCapture instance;
+        return instance;
+    }
+    SessionCapture(const SessionCapture&) = delete;
+    SessionCapture& operator=(const SessionCapture&) = delete;
+
+#if CONFIG_USE_SESSION_CAPTURE
+    // Called once the network is up
+    void Start();
+
+    void RecordJson(const cJSON* root);
+    void RecordAudio(const AudioStreamPacket& packet);
+    void RecordEvent(SessionCaptureKind kind);
+
+    // The replay counters, the peaks and the UI latency start again with reset
+    cJSON* GetStatsJson(bool reset);
+#else
+    void Start() {}
+    void RecordJson(const cJSON* root) {}
+    void RecordAudio(const AudioStreamPacket& packet) {}
+    void RecordEvent(SessionCaptureKind kind) {}
+    cJSON* GetStatsJson(bool reset) { return cJSON_CreateObject(); }
+#endif
+
+private:
+    SessionCapture() = default;
+
+#if CONFIG_USE_SESSION_CAPTURE
+    struct __attribute__((packed)) RecordHeader {
+        uint32_t time_ms;
+        uint8_t kind;
+        uint8_t frame_duration;
+        uint16_t sample_rate;
+        uint32_t timestamp;
+        uint32_t size;
+    };
+
+    RingbufHandle_t ring_ = nullptr;
+    int udp_sockfd_ = -1;
+    struct sockaddr_in udp_server_addr_;
+    TaskHandle_t task_ = nullptr;
+    std::atomic<uint32_t> records_ = 0;
+    std::atomic<uint32_t> dropped_ = 0;
+    // The highest audio queue depths sampled since the last reset
+    std::atomic<uint32_t> decode_peak_ = 0;
+    std::atomic<uint32_t> playback_peak_ = 0;
+
+    // Only touched by the sender task
+    std::vector<uint8_t> datagram_;
+    uint32_t datagram_sequence_ = 0;
+    uint32_t record_sequence_ = 0;
+
+    void Record(SessionCaptureKind kind, const void* data, size_t size, int sample_rate = 0,
+                int frame_duration = 0, uint32_t timestamp = 0);
+    void SenderTask();
+    void Send(const uint8_t* record, size_t size);
+    void SampleQueues();
+#endif
+};
+
+#endif // SESSION_CAPTURE_H
@@ -1,24 +1,311 @@
 #include "settings.h"
+#include "task_placement.h"
 
 #include <esp_log.h>
+#include <esp_system.h>
 #include <nvs_flash.h>
 
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <vector>
+
 #define TAG "Settings"
 
-Settings::Settings(const std::string& ns, bool read_write) : ns_(ns), read_write_(read_write) {
-    nvs_open(ns.c_str(), read_write_ ? NVS_READWRITE : NVS_READONLY, &nvs_handle_);
+static std::atomic<uint32_t> generation_ = 0;
+
+namespace {
+
+// In front of the bytes of a blob
+struct BlobHeader {
+    uint16_t version;
+    uint16_t size;
+};
+
+std::string MakeBlobRecord(const void* data, size_t size, uint16_t version) {
+    BlobHeader header = {version, static_cast<uint16_t>(size)};
+    std::string record(sizeof(header) + size, '\0');
+    memcpy(record.data(), &header, sizeof(header));
+    memcpy(record.data() + sizeof(header), data, size);
+    return record;
+}
+
+bool ReadBlobRecord(const std::string& record, void* data, size_t size, uint16_t version) {
+    BlobHeader header;
+    if (record.size() != sizeof(header) + size) {
+        return false;
+    }
+    memcpy(&header, record.data(), sizeof(header));
+    if (header.version != version || header.size != size) {
+        return false;
+    }
+    memcpy(data, record.data() + sizeof(header), size);
+    return true;
+}
+
+// Written outside Settings, read and written in NVS directly
+bool IsCached(const std::string& ns) {
+    return ns != "wifi";
+}
+
+enum ValueType : uint8_t {
+    kValueString,
+    kValueInt,
+    kValueBool,
+    kValueBlob,         // The text holds the record, header included
+    kValueMissing,
+};
+
+struct CachedValue {
+    ValueType type;
+    // The type that was looked up for a missing value, the others may still be in NVS
+    ValueType missing_type;
+    bool dirty;
+    int32_t number;
+    std::string text;
+};
+
+class SettingsCache {
+public:
+    static SettingsCache& GetInstance() {
+        static SettingsCache instance;
+        return instance;
+    }
+
+    // Returns false if the value of the type is not in NVS
+    bool Get(const std::string& ns, const std::string& key, ValueType type, int32_t& number, std::string& text) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& values = namespaces_[ns];
+        auto it = values.find(key);
+        if (it == values.end() || (it->second.type == kValueMissing && !it->second.dirty &&
+                it->second.missing_type != type)) {
+            it = values.insert_or_assign(key, Load(ns, key, type)).first;
+        }
+        auto& value = it->second;
+        if (value.type != type) {
+            return false;
+        }
+        number = value.number;
+        text = value.text;
+        return true;
+    }
+
+    void Set(const std::string& ns, const std::string& key, CachedValue value) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto& values = namespaces_[ns];
+            auto it = values.find(key);
+            // An erase always goes to NVS, the key may be there with another type
+            if (value.type != kValueMissing && it != values.end() && it->second.type == value.type &&
+                it->second.number == value.number && it->second.text == value.text) {
+                return;
+            }
+            value.dirty = true;
+            values.insert_or_assign(key, std::move(value));
+            generation_++;
+        }
+        ScheduleCommit();
+    }
+
+    void EraseAll(const std::string& ns) {
+        std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+        std::lock_guard<std::mutex> lock(mutex_);
+        namespaces_.erase(ns);
+        nvs_handle_t handle;
+        if (nvs_open(ns.c_str(), NVS_READWRITE, &handle) == ESP_OK) {
+            ESP_ERROR_CHECK(nvs_erase_all(handle));
+            ESP_ERROR_CHECK(nvs_commit(handle));
+            nvs_close(handle);
+        }
+        generation_++;
+    }
+
+    void Flush() {
+        std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+        // The changes are taken under the lock and written without it, so the reads go on
+        std::vector<std::pair<std::string, std::vector<std::pair<std::string, CachedValue>>>> changes;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto& [ns, values] : namespaces_) {
+                std::vector<std::pair<std::string, CachedValue>> dirty;
+                for (auto& [key, value] : values) {
+                    if (value.dirty) {
+                        dirty.emplace_back(key, value);
+                        value.dirty = false;
+                    }
+                }
+                if (!dirty.empty()) {
+                    changes.emplace_back(ns, std::move(dirty));
+                }
+            }
+        }
+
+        for (auto& [ns, values] : changes) {
+            nvs_handle_t handle;
+            esp_err_t err = nvs_open(ns.c_str(), NVS_READWRITE, &handle);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to open namespace %s: %s", ns.c_str(), esp_err_to_name(err));
+                MarkDirty(ns, values);
+                continue;
+            }
+            std::vector<std::pair<std::string, CachedValue>> failed;
+            for (auto& [key, value] : values) {
+                switch (value.type) {
+                case kValueString:
+                    err = nvs_set_str(handle, key.c_str(), value.text.c_str());
+                    break;
+                case kValueInt:
+                    err = nvs_set_i32(handle, key.c_str(), value.number);
+                    break;
+                case kValueBool:
+                    err = nvs_set_u8(handle, key.c_str(), value.number ? 1 : 0);
+                    break;
+                case kValueBlob:
+                    err = nvs_set_blob(handle, key.c_str(), value.text.data(), value.text.size());
+                    break;
+                default:
+                    err = nvs_erase_key(handle, key.c_str());
+                    if (err == ESP_ERR_NVS_NOT_FOUND) {
+                        err = ESP_OK;
+                    }
+                    break;
+                }
+                if (err != ESP_OK) {
+                    ESP_LOGE(TAG, "Failed to write %s.%s: %s", ns.c_str(), key.c_str(), esp_err_to_name(err));
+                    failed.emplace_back(key, value);
+                }
+            }
+            err = nvs_commit(handle);
+            nvs_close(handle);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to commit %s: %s", ns.c_str(), esp_err_to_name(err));
+                MarkDirty(ns, values);
+                continue;
+            }
+            MarkDirty(ns, failed);
+            ESP_LOGD(TAG, "Committed %u changes of %s", values.size() - failed.size(), ns.c_str());
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    // Serializes the commits, the task and Flush() may run at once
+    std::mutex flush_mutex_;
+    std::map<std::string, std::map<std::string, CachedValue>> namespaces_;
+    TaskHandle_t commit_task_ = nullptr;
+
+    SettingsCache() {
+        esp_register_shutdown_handler([]() {
+            SettingsCache::GetInstance().Flush();
+        });
+    }
+
+    // The values that did not reach NVS go with the next commit, a newer value is dirty already
+    void MarkDirty(const std::string& ns, const std::vector<std::pair<std::string, CachedValue>>& values) {
+        if (values.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& cached = namespaces_[ns];
+        for (auto& [key, value] : values) {
+            auto it = cached.find(key);
+            if (it != cached.end()) {
+                it->second.dirty = true;
+            }
+        }
+    }
+
+    static CachedValue Load(const std::string& ns, const std::string& key, ValueType type) {
+        CachedValue value = {kValueMissing, type, false, 0, {}};
+        nvs_handle_t handle;
+        if (nvs_open(ns.c_str(), NVS_READONLY, &handle) != ESP_OK) {
+            return value;
+        }
+        if (type == kValueString) {
+            size_t length = 0;
+            if (nvs_get_str(handle, key.c_str(), nullptr, &length) == ESP_OK) {
+                value.text.resize(length);
+                ESP_ERROR_CHECK(nvs_get_str(handle, key.c_str(), value.text.data(), &length));
+                while (!value.text.empty() && value.text.back() == '\0') {
+                    value.text.pop_back();
+                }
+                value.type = kValueString;
+            }
+        } else if (type == kValueInt) {
+            if (nvs_get_i32(handle, key.c_str(), &value.number) == ESP_OK) {
+                value.type = kValueInt;
+            }
+        } else if (type == kValueBool) {
+            uint8_t flag;
+            if (nvs_get_u8(handle, key.c_str(), &flag) == ESP_OK) {
+                value.number = flag != 0;
+                value.type = kValueBool;
+            }
+        } else if (type == kValueBlob) {
+            size_t length = 0;
+            if (nvs_get_blob(handle, key.c_str(), nullptr, &length) == ESP_OK) {
+                value.text.resize(length);
+                if (nvs_get_blob(handle, key.c_str(), value.text.data(), &length) == ESP_OK) {
+                    value.type = kValueBlob;
+                }
+            }
+        }
+        nvs_close(handle);
+        return value;
+    }
+
+    // Commits from the background task, or right away without a delay
+    void ScheduleCommit() {
+#if CONFIG_SETTINGS_COMMIT_DELAY_MS > 0
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (commit_task_ == nullptr) {
+                TaskPlacements::Create(kTaskSettingsCommit, [](void* arg) {
+                    auto self = static_cast<SettingsCache*>(arg);
+                    while (true) {
+                        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                        // The changes of the next moments go with this commit
+                        vTaskDelay(pdMS_TO_TICKS(CONFIG_SETTINGS_COMMIT_DELAY_MS));
+                        ulTaskNotifyTake(pdTRUE, 0);
+                        self->Flush();
+                    }
+                }, this, &commit_task_);
+            }
+            if (commit_task_ != nullptr) {
+                xTaskNotifyGive(commit_task_);
+                return;
+            }
+        }
+#endif
+        Flush();
+    }
+};
+
+} // namespace
+
+Settings::Settings(const std::string& ns, bool read_write) : ns_(ns), read_write_(read_write), cached_(IsCached(ns)) {
+    if (!cached_) {
+        nvs_open(ns.c_str(), read_write_ ? NVS_READWRITE : NVS_READONLY, &nvs_handle_);
+    }
 }
 
 Settings::~Settings() {
     if (nvs_handle_ != 0) {
         if (read_write_ && dirty_) {
             ESP_ERROR_CHECK(nvs_commit(nvs_handle_));
+            generation_++;
         }
         nvs_close(nvs_handle_);
     }
 }
 
 std::string Settings::GetString(const std::string& key, const std::string& default_value) {
+    if (cached_) {
+        int32_t number;
+        std::string value;
+        return SettingsCache::GetInstance().Get(ns_, key, kValueString, number, value) ? value : default_value;
+    }
     if (nvs_handle_ == 0) {
         return default_value;
     }
@@ -38,15 +325,22 @@ std::string Settings::GetString(const std::string& key, const std::string& defau
 }
 
 void Settings::SetString(const std::string& key, const std::string& value) {
-    if (read_write_) {
+    if (!read_write_) {
+        ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
+    } else if (cached_) {
+        SettingsCache::GetInstance().Set(ns_, key, {kValueString, kValueString, true, 0, value});
+    } else {
         ESP_ERROR_CHECK(nvs_set_str(nvs_handle_, key.c_str(), value.c_str()));
         dirty_ = true;
-    } else {
-        ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
 }
 
 int32_t Settings::GetInt(const std::string& key, int32_t default_value) {
+    if (cached_) {
+        int32_t value;
+        std::string text;
+        return SettingsCache::GetInstance().Get(ns_, key, kValueInt, value, text) ? value : default_value;
+    }
     if (nvs_handle_ == 0) {
         return default_value;
     }
@@ -59,15 +353,22 @@ int32_t Settings::GetInt(const std::string& key, int32_t default_value) {
 }
 
 void Settings::SetInt(const std::string& key, int32_t value) {
-    if (read_write_) {
+    if (!read_write_) {
+        ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
+    } else if (cached_) {
+        SettingsCache::GetInstance().Set(ns_, key, {kValueInt, kValueInt, true, value, {}});
+    } else {
         ESP_ERROR_CHECK(nvs_set_i32(nvs_handle_, key.c_str(), value));
         dirty_ = true;
-    } else {
-        ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
 }
 
 bool Settings::GetBool(const std::string& key, bool default_value) {
+    if (cached_) {
+        int32_t value;
+        std::string text;
+        return SettingsCache::GetInstance().Get(ns_, key, kValueBool, value, text) ? value != 0 : default_value;
+    }
     if (nvs_handle_ == 0) {
         return default_value;
     }
@@ -80,29 +381,78 @@ bool Settings::GetBool(const std::string& key, bool default_value) {
 }
 
 void Settings::SetBool(const std::string& key, bool value) {
-    if (read_write_) {
+    if (!read_write_) {
+        ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
+    } else if (cached_) {
+        SettingsCache::GetInstance().Set(ns_, key, {kValueBool, kValueBool, true, value ? 1 : 0, {}});
+    } else {
         ESP_ERROR_CHECK(nvs_set_u8(nvs_handle_, key.c_str(), value ? 1 : 0));
         dirty_ = true;
+    }
+}
+
+bool Settings::GetBlob(const std::string& key, void* data, size_t size, uint16_t version) {
+    std::string record;
+    if (cached_) {
+        int32_t number;
+        if (!SettingsCache::GetInstance().Get(ns_, key, kValueBlob, number, record)) {
+            return false;
+        }
     } else {
+        size_t length = 0;
+        if (nvs_handle_ == 0 || nvs_get_blob(nvs_handle_, key.c_str(), nullptr, &length) != ESP_OK) {
+            return false;
+        }
+        record.resize(length);
+        if (nvs_get_blob(nvs_handle_, key.c_str(), record.data(), &length) != ESP_OK) {
+            return false;
+        }
+    }
+    return ReadBlobRecord(record, data, size, version);
+}
+
+void Settings::SetBlob(const std::string& key, const void* data, size_t size, uint16_t version) {
+    if (!read_write_) {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
+    } else if (cached_) {
+        SettingsCache::GetInstance().Set(ns_, key, {kValueBlob, kValueBlob, true, 0, MakeBlobRecord(data, size, version)});
+    } else {
+        auto record = MakeBlobRecord(data, size, version);
+        ESP_ERROR_CHECK(nvs_set_blob(nvs_handle_, key.c_str(), record.data(), record.size()));
+        dirty_ = true;
     }
 }
 
 void Settings::EraseKey(const std::string& key) {
-    if (read_write_) {
+    if (!read_write_) {
+        ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
+    } else if (cached_) {
+        // Missing for every type once erased
+        SettingsCache::GetInstance().Set(ns_, key, {kValueMissing, kValueMissing, true, 0, {}});
+    } else {
         auto ret = nvs_erase_key(nvs_handle_, key.c_str());
         if (ret != ESP_ERR_NVS_NOT_FOUND) {
             ESP_ERROR_CHECK(ret);
         }
-    } else {
-        ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
+        dirty_ = true;
     }
 }
 
 void Settings::EraseAll() {
-    if (read_write_) {
-        ESP_ERROR_CHECK(nvs_erase_all(nvs_handle_));
-    } else {
+    if (!read_write_) {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
+    } else if (cached_) {
+        SettingsCache::GetInstance().EraseAll(ns_);
+    } else {
+        ESP_ERROR_CHECK(nvs_erase_all(nvs_handle_));
+        dirty_ = true;
     }
 }
+
+uint32_t Settings::generation() {
+    return generation_;
+}
+
+void Settings::Flush() {
+    SettingsCache::GetInstance().Flush();
+}
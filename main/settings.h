@@ -2,8 +2,18 @@
 #define SETTINGS_H
 
 #include <string>
+#include <cstdint>
+#include <type_traits>
 #include <nvs_flash.h>
 
+/*
+ * A namespace of the settings in NVS.
+ *
+ * The values are kept in a process wide cache, read from NVS the first time. The changes go to
+ * the cache and are committed by a background task CONFIG_SETTINGS_COMMIT_DELAY_MS after the
+ * first of them, Flush() writes them at once. The "wifi" namespace is also written by
+ * esp-wifi-connect, it is not cached and its changes are committed when the object goes away.
+ */
 class Settings {
 public:
     Settings(const std::string& ns, bool read_write = false);
@@ -15,13 +25,33 @@ public:
     void SetInt(const std::string& key, int32_t value);
     bool GetBool(const std::string& key, bool default_value = false);
     void SetBool(const std::string& key, bool value);
+    // A blob is stored with its version and size, a record of another version or size reads as missing
+    bool GetBlob(const std::string& key, void* data, size_t size, uint16_t version);
+    void SetBlob(const std::string& key, const void* data, size_t size, uint16_t version);
+    // A whole struct of plain values in one NVS record, bump the version when its layout changes
+    template <typename T>
+    bool GetStruct(const std::string& key, T& value, uint16_t version) {
+        static_assert(std::is_trivially_copyable_v<T>, "The struct is stored as its bytes");
+        return GetBlob(key, &value, sizeof(T), version);
+    }
+    template <typename T>
+    void SetStruct(const std::string& key, const T& value, uint16_t version) {
+        static_assert(std::is_trivially_copyable_v<T>, "The struct is stored as its bytes");
+        SetBlob(key, &value, sizeof(T), version);
+    }
     void EraseKey(const std::string& key);
     void EraseAll();
 
+    // Moves on with every change, so a cache of values read from settings can tell it is stale
+    static uint32_t generation();
+    // Commits the pending changes of every namespace, before a restart or a firmware upgrade
+    static void Flush();
+
 private:
     std::string ns_;
     nvs_handle_t nvs_handle_ = 0;
     bool read_write_ = false;
+    bool cached_ = false;
     bool dirty_ = false;
 };
 
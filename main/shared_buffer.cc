@@ -0,0 +1,110 @@
+#include "shared_buffer.h"
+
+#include <esp_log.h>
+
+#include <new>
+
+#define TAG "SharedBuffer"
+
+SharedBuffer::SharedBuffer(const SharedBuffer& other) : block_(other.block_) {
+    if (block_ != nullptr) {
+        block_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+SharedBuffer& SharedBuffer::operator=(SharedBuffer other) noexcept {
+    std::swap(block_, other.block_);
+    return *this;
+}
+
+SharedBuffer SharedBuffer::Allocate(HeapTag tag, size_t capacity, HeapPlacement placement) {
+    auto block = (Block*)HeapAccounting::Place(tag, sizeof(Block) + capacity, placement);
+    if (block == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate a buffer of %u bytes", (unsigned)capacity);
+        return SharedBuffer();
+    }
+    new (&block->refs) std::atomic<int>(1);
+    block->pool = nullptr;
+    block->tag = tag;
+    block->capacity = capacity;
+    return SharedBuffer(block);
+}
+
+void SharedBuffer::Reset() {
+    Block* block = block_;
+    block_ = nullptr;
+    if (block == nullptr || block->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+    if (block->pool != nullptr) {
+        block->pool->Return(block);
+    } else {
+        HeapAccounting::Free(block->tag, block);
+    }
+}
+
+void* SharedBuffer::Release() {
+    Block* block = block_;
+    block_ = nullptr;
+    return block;
+}
+
+SharedBuffer SharedBuffer::Adopt(void* handle) {
+    return SharedBuffer((Block*)handle);
+}
+
+BufferPool::BufferPool(HeapTag tag, size_t block_size, int count, HeapPlacement placement)
+    : tag_(tag), block_size_(block_size), count_(count) {
+    size_t stride = BlockStride(block_size);
+    memory_ = (uint8_t*)HeapAccounting::Place(tag, stride * count, placement);
+    available_ = xSemaphoreCreateCounting(count, 0);
+    if (memory_ == nullptr || available_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate a pool of %d x %u bytes", count, (unsigned)block_size);
+        if (memory_ != nullptr) {
+            HeapAccounting::Free(tag, memory_);
+            memory_ = nullptr;
+        }
+        return;
+    }
+    free_.reserve(count);
+    for (int i = 0; i < count; i++) {
+        auto block = (SharedBuffer::Block*)(memory_ + i * stride);
+        new (&block->refs) std::atomic<int>(0);
+        block->pool = this;
+        block->tag = tag;
+        block->capacity = block_size;
+        free_.push_back(block);
+        xSemaphoreGive(available_);
+    }
+}
+
+BufferPool::~BufferPool() {
+    if (memory_ != nullptr) {
+        if ((int)free_.size() != count_) {
+            ESP_LOGE(TAG, "Pool deleted with %d buffers in use", count_ - (int)free_.size());
+        }
+        HeapAccounting::Free(tag_, memory_);
+    }
+    if (available_ != nullptr) {
+        vSemaphoreDelete(available_);
+    }
+}
+
+SharedBuffer BufferPool::Acquire(TickType_t timeout) {
+    if (memory_ == nullptr || xSemaphoreTake(available_, timeout) != pdTRUE) {
+        return SharedBuffer();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto block = free_.back();
+    free_.pop_back();
+    block->refs.store(1, std::memory_order_relaxed);
+    return SharedBuffer(block);
+}
+
+void BufferPool::Return(SharedBuffer::Block* block) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(block);
+    }
+    xSemaphoreGive(available_);
+}
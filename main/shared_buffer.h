@@ -0,0 +1,145 @@
+#ifndef SHARED_BUFFER_H
+#define SHARED_BUFFER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "heap_accounting.h"
+
+class BufferPool;
+
+/*
+ * A reference counted block of bytes.
+ *
+ * Copies share the block, it goes back to its pool (or to the heap, for one from Allocate())
+ * when the last reference is dropped. This lets a producer fill a buffer and hand it on to a
+ * consumer on another task without a copy and without agreeing on who frees it: the encoder of
+ * a photo fills a chunk, the upload writes it and drops it, and the chunk is free again.
+ *
+ * The block is charged to the heap tag it was allocated with and lands where its placement
+ * says, like the other allocations of HeapAccounting.
+ *
+ * The FreeRTOS queues copy their items as bytes, so a buffer crosses one as the raw handle of
+ * Release() and is taken back with Adopt() on the other side.
+ */
+class SharedBuffer {
+public:
+    SharedBuffer() = default;
+    SharedBuffer(const SharedBuffer& other);
+    SharedBuffer(SharedBuffer&& other) noexcept : block_(other.block_) { other.block_ = nullptr; }
+    SharedBuffer& operator=(SharedBuffer other) noexcept;
+    ~SharedBuffer() { Reset(); }
+
+    // A buffer of its own, empty when the heap is exhausted
+    static SharedBuffer Allocate(HeapTag tag, size_t capacity, HeapPlacement placement);
+
+    uint8_t* data() const { return block_ != nullptr ? (uint8_t*)(block_ + 1) : nullptr; }
+    size_t capacity() const { return block_ != nullptr ? block_->capacity : 0; }
+    // The references to the block, including this one
+    int use_count() const { return block_ != nullptr ? block_->refs.load(std::memory_order_relaxed) : 0; }
+    explicit operator bool() const { return block_ != nullptr; }
+    void Reset();
+
+    // Hands the reference over as a raw handle, the buffer is empty after it
+    void* Release();
+    // Takes back the reference of a Release() handle
+    static SharedBuffer Adopt(void* handle);
+
+private:
+    friend class BufferPool;
+
+    struct alignas(8) Block {
+        std::atomic<int> refs;
+        BufferPool* pool;   // nullptr for Allocate()
+        HeapTag tag;
+        size_t capacity;
+    };
+
+    Block* block_ = nullptr;
+
+    explicit SharedBuffer(Block* block) : block_(block) {}
+};
+
+// A range of a shared buffer, what is passed on once the buffer is filled
+class BufferSlice {
+public:
+    // For a queue of slices, like the raw handle of SharedBuffer. A nullptr handle is an empty slice
+    struct Raw {
+        void* handle;
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    BufferSlice() = default;
+    BufferSlice(SharedBuffer buffer, size_t offset, size_t size)
+        : buffer_(std::move(buffer)), offset_(offset), size_(size) {}
+
+    const uint8_t* data() const { return buffer_.data() + offset_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const SharedBuffer& buffer() const { return buffer_; }
+    // A part of this slice, sharing the buffer
+    BufferSlice Sub(size_t offset, size_t size) const {
+        return BufferSlice(buffer_, offset_ + offset, size);
+    }
+
+    Raw Release() {
+        Raw raw = {buffer_.Release(), (uint32_t)offset_, (uint32_t)size_};
+        offset_ = size_ = 0;
+        return raw;
+    }
+    static BufferSlice Adopt(const Raw& raw) {
+        return BufferSlice(SharedBuffer::Adopt(raw.handle), raw.offset, raw.size);
+    }
+
+private:
+    SharedBuffer buffer_;
+    size_t offset_ = 0;
+    size_t size_ = 0;
+};
+
+/*
+ * A fixed set of equally sized shared buffers, allocated at once.
+ *
+ * Acquire() waits for a free buffer, so the pool also paces a producer to its consumer: the
+ * producer stalls once every buffer is in flight. The pool must outlive its buffers.
+ */
+class BufferPool {
+public:
+    BufferPool(HeapTag tag, size_t block_size, int count, HeapPlacement placement);
+    ~BufferPool();
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // False when the buffers could not be allocated
+    bool ok() const { return memory_ != nullptr; }
+    size_t block_size() const { return block_size_; }
+    // An empty buffer when none came free within the timeout
+    SharedBuffer Acquire(TickType_t timeout = portMAX_DELAY);
+
+private:
+    friend class SharedBuffer;
+
+    HeapTag tag_;
+    size_t block_size_;
+    int count_;
+    uint8_t* memory_ = nullptr;
+    SemaphoreHandle_t available_ = nullptr;
+    std::mutex mutex_;
+    std::vector<SharedBuffer::Block*> free_;
+
+    // Blocks are laid out one after another in the memory of the pool, each with its header
+    static size_t BlockStride(size_t block_size) {
+        return (sizeof(SharedBuffer::Block) + block_size + 7) & ~(size_t)7;
+    }
+    void Return(SharedBuffer::Block* block);
+};
+
+#endif // SHARED_BUFFER_H
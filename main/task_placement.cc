@@ -0,0 +1,254 @@
+#include "task_placement.h"
+#include "memory_budget.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+#define TAG "TaskPlacement"
+
+#if CONFIG_SOC_CPU_CORES_NUM > 1
+#define CORE_AUDIO 0
+#define CORE_UI 1
+#else
+#define CORE_AUDIO tskNO_AFFINITY
+#define CORE_UI tskNO_AFFINITY
+#endif
+
+// Kconfig uses -1 for "no affinity"
+#define KCONFIG_CORE(core) ((core) < 0 ? tskNO_AFFINITY : (core))
+
+#if CONFIG_AUDIO_OPUS_TASK_STACK_IN_PSRAM
+#define OPUS_STACK_IN_PSRAM true
+#else
+#define OPUS_STACK_IN_PSRAM false
+#endif
+
+// The tasks that move data in bulk and never run with the cache disabled (no flash writes, no
+// NVS), their stacks can go to PSRAM
+#if CONFIG_TASK_STACKS_IN_PSRAM
+#define BULK_STACK_IN_PSRAM true
+#else
+#define BULK_STACK_IN_PSRAM false
+#endif
+
+// Below this many free bytes PrintStackUsage() warns
+#define STACK_LOW_WATER_BYTES 512
+
+namespace {
+
+// In the order of TaskId
+TaskPlacement placements_[kTaskCount] = {
+    { "main_event_loop", MEMORY_BUDGET_STACK_MAIN_EVENT_LOOP, 3, tskNO_AFFINITY, false },
+#if CONFIG_USE_AUDIO_PROCESSOR
+    { "audio_input", 2048 * 3, 8, CORE_AUDIO, false },
+    { "audio_output", 2048 * 2, 4, tskNO_AFFINITY, false },
+#else
+    { "audio_input", 2048 * 2, 8, tskNO_AFFINITY, false },
+    { "audio_output", 2048, 4, tskNO_AFFINITY, false },
+#endif
+    { "opus_encode", MEMORY_BUDGET_STACK_OPUS_ENCODE, CONFIG_AUDIO_OPUS_ENCODE_TASK_PRIORITY,
+        KCONFIG_CORE(CONFIG_AUDIO_OPUS_ENCODE_TASK_CORE), OPUS_STACK_IN_PSRAM },
+    { "opus_decode", MEMORY_BUDGET_STACK_OPUS_DECODE, CONFIG_AUDIO_OPUS_DECODE_TASK_PRIORITY,
+        KCONFIG_CORE(CONFIG_AUDIO_OPUS_DECODE_TASK_CORE), OPUS_STACK_IN_PSRAM },
+    // The priority of the audio input, it serves the I2S DMA
+    { "audio_pipeline", MEMORY_BUDGET_STACK_AUDIO_PIPELINE, 8, tskNO_AFFINITY, OPUS_STACK_IN_PSRAM },
+    { "audio_send", MEMORY_BUDGET_STACK_AUDIO_SEND, CONFIG_AUDIO_SEND_TASK_PRIORITY, tskNO_AFFINITY, BULK_STACK_IN_PSRAM },
+    { "audio_communication", 4096, 3, tskNO_AFFINITY, BULK_STACK_IN_PSRAM },
+    { "audio_detection", 4096, 3, tskNO_AFFINITY, BULK_STACK_IN_PSRAM },
+#if CONFIG_SPIRAM
+    { "encode_wake_word", 4096 * 7, 1, tskNO_AFFINITY, true },
+#else
+    { "encode_wake_word", 4096 * 7, 1, tskNO_AFFINITY, false },
+#endif
+    { "afe_wake_word", 0, 1, CORE_UI, false },
+    { "taskLVGL", 0, 1, CORE_UI, false },
+    { "camera_jpeg", CONFIG_PTHREAD_TASK_STACK_SIZE_DEFAULT, CONFIG_PTHREAD_TASK_PRIO_DEFAULT, tskNO_AFFINITY, BULK_STACK_IN_PSRAM },
+    { "camera_stream", 4096, 2, tskNO_AFFINITY, BULK_STACK_IN_PSRAM },
+    { "camera_video", 4096 * 2, 1, tskNO_AFFINITY, BULK_STACK_IN_PSRAM },
+    // Internal RAM, it writes to flash
+    { "assets_writer", 4096, 4, tskNO_AFFINITY, false },
+    // Internal RAM, the assets download saves its resume point to NVS
+    { "http_client", 4096 * 2, 2, tskNO_AFFINITY, false },
+    // Internal RAM, it writes to flash
+    { "ota_writer", 4096, 4, tskNO_AFFINITY, false },
+    // Below the audio tasks, the download yields to the conversation
+    { "ota_download", MEMORY_BUDGET_STACK_MCP_LONG_RUNNING, 1, tskNO_AFFINITY, false },
+    // Internal RAM, it writes to flash
+    { "settings_commit", 4096, 2, tskNO_AFFINITY, false },
+    { "boot_worker", 4096 * 2, 1, tskNO_AFFINITY, false },
+#if CONFIG_SPIRAM
+    { "mcp_worker", MEMORY_BUDGET_STACK_MCP_WORKER, 2, tskNO_AFFINITY, true },
+#else
+    { "mcp_worker", MEMORY_BUDGET_STACK_MCP_WORKER, 2, tskNO_AFFINITY, false },
+#endif
+    // Internal RAM, the firmware upgrade writes to flash
+    { "mcp_long_running", MEMORY_BUDGET_STACK_MCP_LONG_RUNNING, 2, tskNO_AFFINITY, false },
+    { "network_standby", 4096, 3, tskNO_AFFINITY, false },
+    { "input_events", 3072, 5, tskNO_AFFINITY, false },
+    { "i2c_async", 3072, 2, tskNO_AFFINITY, false },
+    { "servo_scheduler", 3072, 9, CORE_UI, false },
+    { "audio_debugger", 3072, 1, tskNO_AFFINITY, BULK_STACK_IN_PSRAM },
+    { "trace_recorder", 3072, 1, tskNO_AFFINITY, BULK_STACK_IN_PSRAM },
+    { "state_events", 4096, 2, tskNO_AFFINITY, false },
+    // Below the network tasks, which only hand the messages over. Internal RAM, the hello is cached to NVS
+    { "control_dispatch", 4096 * 2, 3, tskNO_AFFINITY, false },
+    { "log_ring", 3072, 1, tskNO_AFFINITY, false },
+    { "session_capture", 3072, 1, tskNO_AFFINITY, BULK_STACK_IN_PSRAM },
+    // The stack the connect had on the main loop. Internal RAM, it reads the settings
+    { "ws_reconnect", MEMORY_BUDGET_STACK_MAIN_EVENT_LOOP, 2, tskNO_AFFINITY, false },
+    // The stack the open had on the main loop. Internal RAM, it reads the settings
+    { "channel_prewarm", MEMORY_BUDGET_STACK_MAIN_EVENT_LOOP, 3, tskNO_AFFINITY, false },
+};
+
+// The live tasks of every entry, several for the MCP workers, and the lowest free stack seen of
+// all of them, in bytes
+std::mutex stacks_mutex_;
+std::vector<TaskHandle_t> handles_[kTaskCount];
+uint32_t lowest_free_[kTaskCount] = {};
+bool seen_[kTaskCount] = {};
+
+uint32_t StackCaps(const TaskPlacement& placement) {
+    return placement.stack_in_psram ? MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT : MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+}
+
+void RecordFreeStack(TaskId id, TaskHandle_t handle) {
+    uint32_t free_bytes = uxTaskGetStackHighWaterMark(handle);
+    if (!seen_[id] || free_bytes < lowest_free_[id]) {
+        lowest_free_[id] = free_bytes;
+    }
+    seen_[id] = true;
+}
+
+// Records the free stack of the live tasks of the entry, also of one created by a component,
+// which is found by name. Returns how many there are
+int RecordLiveTasks(TaskId id) {
+    if (handles_[id].empty()) {
+        auto task = xTaskGetHandle(placements_[id].name);
+        if (task == nullptr) {
+            return 0;
+        }
+        RecordFreeStack(id, task);
+        return 1;
+    }
+    for (auto task : handles_[id]) {
+        RecordFreeStack(id, task);
+    }
+    return handles_[id].size();
+}
+
+} // namespace
+
+const TaskPlacement& TaskPlacements::Get(TaskId id) {
+    return placements_[id];
+}
+
+void TaskPlacements::Set(TaskId id, const TaskPlacement& placement) {
+    placements_[id] = placement;
+    if (placement.core != tskNO_AFFINITY && placement.core >= portNUM_PROCESSORS) {
+        ESP_LOGW(TAG, "%s: no core %d, left unpinned", placement.name, (int)placement.core);
+        placements_[id].core = tskNO_AFFINITY;
+    }
+}
+
+BaseType_t TaskPlacements::Create(TaskId id, TaskFunction_t entry, void* arg, TaskHandle_t* handle) {
+    auto& placement = placements_[id];
+    BaseType_t ret;
+    if (placement.stack_in_psram) {
+        ret = xTaskCreatePinnedToCoreWithCaps(entry, placement.name, placement.stack_size, arg,
+            placement.priority, handle, placement.core, StackCaps(placement));
+    } else {
+        ret = xTaskCreatePinnedToCore(entry, placement.name, placement.stack_size, arg,
+            placement.priority, handle, placement.core);
+    }
+    if (ret != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create task %s", placement.name);
+    } else if (handle != nullptr) {
+        std::lock_guard<std::mutex> lock(stacks_mutex_);
+        handles_[id].push_back(*handle);
+    }
+    return ret;
+}
+
+void TaskPlacements::Delete(TaskId id, TaskHandle_t handle) {
+    if (handle == nullptr) {
+        handle = xTaskGetCurrentTaskHandle();
+    }
+    {
+        std::lock_guard<std::mutex> lock(stacks_mutex_);
+        RecordFreeStack(id, handle);
+        auto& handles = handles_[id];
+        handles.erase(std::remove(handles.begin(), handles.end(), handle), handles.end());
+    }
+    if (placements_[id].stack_in_psram) {
+        vTaskDeleteWithCaps(handle);
+    } else {
+        vTaskDelete(handle);
+    }
+}
+
+cJSON* TaskPlacements::GetStackStatsJson() {
+    std::lock_guard<std::mutex> lock(stacks_mutex_);
+    auto json = cJSON_CreateArray();
+    for (int id = 0; id < kTaskCount; id++) {
+        int live = RecordLiveTasks((TaskId)id);
+        if (!seen_[id]) {
+            continue;
+        }
+        auto& placement = placements_[id];
+        auto item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "task", placement.name);
+        cJSON_AddNumberToObject(item, "stack", placement.stack_size);
+        cJSON_AddNumberToObject(item, "min_free", lowest_free_[id]);
+        cJSON_AddBoolToObject(item, "psram", placement.stack_in_psram);
+        cJSON_AddBoolToObject(item, "running", live > 0);
+        if (live > 1) {
+            cJSON_AddNumberToObject(item, "instances", live);
+        }
+        cJSON_AddItemToArray(json, item);
+    }
+    return json;
+}
+
+void TaskPlacements::PrintStackUsage() {
+    std::lock_guard<std::mutex> lock(stacks_mutex_);
+    uint32_t internal = 0;
+    uint32_t psram = 0;
+    for (int id = 0; id < kTaskCount; id++) {
+        int live = RecordLiveTasks((TaskId)id);
+        if (live == 0) {
+            continue;
+        }
+        auto& placement = placements_[id];
+        (placement.stack_in_psram ? psram : internal) += placement.stack_size * live;
+        if (placement.stack_size > 0 && lowest_free_[id] < STACK_LOW_WATER_BYTES) {
+            ESP_LOGW(TAG, "%s: only %lu of %lu stack bytes were left free", placement.name,
+                lowest_free_[id], placement.stack_size);
+        }
+    }
+    ESP_LOGI(TAG, "Task stacks: %lu bytes in internal RAM, %lu bytes in PSRAM", internal, psram);
+}
+
+TaskPlacements::ThreadScope::ThreadScope(TaskId id) {
+    restore_ = esp_pthread_get_cfg(&previous_) == ESP_OK;
+    auto& placement = placements_[id];
+    esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+    cfg.stack_size = placement.stack_size;
+    cfg.prio = placement.priority;
+    cfg.thread_name = placement.name;
+    cfg.pin_to_core = placement.core;
+    cfg.stack_alloc_caps = StackCaps(placement);
+    esp_pthread_set_cfg(&cfg);
+}
+
+TaskPlacements::ThreadScope::~ThreadScope() {
+    if (restore_) {
+        esp_pthread_set_cfg(&previous_);
+    } else {
+        esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+        esp_pthread_set_cfg(&cfg);
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef TASK_PLACEMENT_H
+#define TASK_PLACEMENT_H
+
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_pthread.h>
+#include <cJSON.h>
+
+#include <cstdint>
+
+// The long running tasks of the firmware
+enum TaskId {
+    kTaskMainEventLoop,
+    kTaskAudioInput,
+    kTaskAudioOutput,
+    kTaskOpusEncode,
+    kTaskOpusDecode,
+    kTaskAudioPipeline,     // Replaces the four tasks above with CONFIG_AUDIO_SINGLE_TASK
+    kTaskAudioSend,
+    kTaskAudioProcessor,    // Reads the AFE output of the conversation audio
+    kTaskWakeWord,          // Reads the AFE output of the wake word detection
+    kTaskWakeWordPreroll,   // Encodes the audio kept before the wake word
+    kTaskWakeWordAfe,       // Created by esp-sr, only the core and the priority apply
+    kTaskLvgl,              // Created by esp_lvgl_port, a stack size of 0 keeps the port default
+    kTaskCameraEncoder,     // The std::thread encoding camera frames to JPEG
+    kTaskCameraStream,      // Keeps the latest camera frame with CONFIG_XIAOZHI_CAMERA_CONTINUOUS_CAPTURE
+    kTaskCameraVideo,       // Encodes and sends the frames of the camera stream, lowest priority
+    kTaskAssetsWriter,      // Erases and writes the assets partition while the download goes on
+    kTaskHttpClient,        // Runs the HttpClient transfers, e.g. the assets download into the slot not in use
+    kTaskOtaWriter,         // Writes the firmware image while the download goes on
+    kTaskOtaDownload,       // Downloads the firmware image with CONFIG_OTA_BACKGROUND_DOWNLOAD
+    kTaskSettingsCommit,    // Commits the settings changes to NVS a moment after they are made
+    kTaskBootWorker,
+    kTaskMcpWorker,         // Runs the worker MCP tools, must not write to flash with its stack in PSRAM
+    kTaskMcpLongRunning,    // Runs one long-running MCP tool, e.g. the firmware upgrade
+    kTaskNetworkStandby,    // Brings up the standby link of DualNetworkBoard, the modem detection blocks
+    kTaskInput,             // Debounces the button and knob interrupts, the callbacks run on the main loop
+    kTaskI2cAsync,          // Sends the I2cDevice::WriteRegAsync() writes of every device
+    kTaskServo,             // Plays the servo keyframes of the robot boards, woken by a periodic timer
+    kTaskAudioDebugger,     // Sends the tapped audio of CONFIG_USE_AUDIO_DEBUGGER, lowest priority
+    kTaskTraceRecorder,     // Sends the trace events of CONFIG_USE_TRACE_RECORDER, lowest priority
+    kTaskStateEvents,       // Runs the state change callbacks with CONFIG_STATE_EVENT_DELIVERY_TASK
+    kTaskControlDispatch,   // Parses and handles the received control messages, CONFIG_USE_CONTROL_DISPATCH_TASK
+    kTaskLogRing,           // Writes the lines of CONFIG_USE_LOG_RING to the UART, lowest priority
+    kTaskSessionCapture,    // Sends the server sessions of CONFIG_USE_SESSION_CAPTURE, lowest priority
+    kTaskWebsocketReconnect, // Reopens the persistent WebSocket, the hello wait blocks it for seconds
+    kTaskAudioChannelPrewarm, // Opens the audio channel on a voice onset in idle, CONFIG_USE_AUDIO_CHANNEL_PREWARM
+    kTaskCount,
+};
+
+struct TaskPlacement {
+    const char* name;
+    uint32_t stack_size;
+    UBaseType_t priority;
+    BaseType_t core;        // tskNO_AFFINITY to let the scheduler choose
+    bool stack_in_psram;
+};
+
+/*
+ * Where every long running task goes: core, priority, stack size and stack memory.
+ *
+ * The defaults depend on the target. On the dual core chips (ESP32, S3, P4) the audio capture
+ * is pinned to core 0 and the UI and the wake word AFE to core 1. The single core chips (C3, C5,
+ * C6) leave every task unpinned. The Opus and audio send entries come from their Kconfig options.
+ *
+ * The stacks that go to PSRAM: the Opus tasks with CONFIG_AUDIO_OPUS_TASK_STACK_IN_PSRAM, the
+ * AFE fetch, audio send, camera and debug senders with CONFIG_TASK_STACKS_IN_PSRAM, and the MCP
+ * worker and wake word encoder with PSRAM. A task that writes to flash or NVS keeps its stack in
+ * internal RAM, the cache is disabled meanwhile.
+ *
+ * Create() keeps the handle it is given, so GetStackStatsJson() and PrintStackUsage() report the
+ * lowest free stack of every task, Delete() records it before the task goes. Several tasks may
+ * share an entry, e.g. the MCP workers, each one is created with a handle.
+ *
+ * A board tunes the placement of its product with Set() in its constructor, which runs before
+ * any of these tasks is created. The creation sites go through Create() and Delete(), or read
+ * the entry for the tasks created by a component.
+ */
+class TaskPlacements {
+public:
+    static const TaskPlacement& Get(TaskId id);
+    static void Set(TaskId id, const TaskPlacement& placement);
+
+    static BaseType_t Create(TaskId id, TaskFunction_t entry, void* arg, TaskHandle_t* handle = nullptr);
+    // A task with its stack in PSRAM must be deleted this way, nullptr deletes the calling task
+    static void Delete(TaskId id, TaskHandle_t handle = nullptr);
+
+    // [{"task", "stack", "min_free", "psram", "running", "instances"}, ...] of the tasks created so
+    // far, min_free is the lowest free stack in bytes over all the instances of the task, instances
+    // is only there when more than one runs
+    static cJSON* GetStackStatsJson();
+    // The stack bytes of the live tasks in internal RAM and PSRAM, warns about the nearly full ones
+    static void PrintStackUsage();
+
+    // Places the std::thread created by the calling task while the scope lives
+    class ThreadScope {
+    public:
+        explicit ThreadScope(TaskId id);
+        ~ThreadScope();
+
+    private:
+        esp_pthread_cfg_t previous_;
+        bool restore_ = false;
+    };
+};
+
+#endif // TASK_PLACEMENT_H
@@ -0,0 +1,99 @@
+#include "telemetry.h"
+
+#if CONFIG_USE_TELEMETRY
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_system.h>
+#include <esp_heap_caps.h>
+#include <mbedtls/base64.h>
+#include <cJSON.h>
+
+#include <utility>
+#include <vector>
+
+#include "application.h"
+#include "cpu_sampler.h"
+#include "heap_accounting.h"
+#include "task_placement.h"
+#include "msgpack.h"
+
+#define TAG "Telemetry"
+
+void Telemetry::OnClockTick(Protocol* protocol, bool idle) {
+    if (++ticks_ < CONFIG_TELEMETRY_INTERVAL_SECONDS * backoff_ || !idle || protocol == nullptr) {
+        return;
+    }
+    ticks_ = 0;
+    auto snapshot = BuildSnapshot(CONFIG_TELEMETRY_MAX_BYTES);
+    if (protocol->SendTelemetry(snapshot)) {
+        backoff_ = 1;
+        ESP_LOGD(TAG, "Published %u bytes", snapshot.size());
+    } else if (backoff_ < TELEMETRY_MAX_BACKOFF) {
+        backoff_ *= 2;
+    }
+}
+
+std::string Telemetry::BuildSnapshot(size_t max_bytes) {
+    auto& app = Application::GetInstance();
+    snapshots_++;
+
+    // Most important first, each section is encoded alone to know its size
+    std::vector<std::pair<const char*, cJSON*>> sections;
+
+    auto sys = cJSON_CreateObject();
+    cJSON_AddNumberToObject(sys, "up", esp_timer_get_time() / 1000000);
+    cJSON_AddNumberToObject(sys, "rst", esp_reset_reason());
+    cJSON_AddNumberToObject(sys, "seq", snapshots_);
+    cJSON_AddNumberToObject(sys, "free", heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    cJSON_AddNumberToObject(sys, "min", heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL));
+    cJSON_AddNumberToObject(sys, "psram", heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+    sections.emplace_back("sys", sys);
+
+    auto net = cJSON_CreateObject();
+    cJSON_AddItemToObject(net, "link", LinkMetricsToJson(app.GetLinkMetrics()));
+    cJSON_AddItemToObject(net, "reconnect", ReconnectMetricsToJson(app.GetReconnectMetrics()));
+    sections.emplace_back("net", net);
+
+    sections.emplace_back("cpu", CpuSampler::GetInstance().GetSummaryJson());
+#if CONFIG_USE_AUDIO_LATENCY_TRACE
+    sections.emplace_back("lat", app.GetAudioService().GetLatencyTracer().GetStatsJson());
+#endif
+    sections.emplace_back("heap", HeapAccounting::GetStatsJson());
+    sections.emplace_back("stk", TaskPlacements::GetStackStatsJson());
+
+    std::string body;
+    size_t count = 0;
+    for (auto& [name, json] : sections) {
+        std::string section;
+        Msgpack::Writer writer(section);
+        writer.String(name);
+        writer.Json(json);
+        cJSON_Delete(json);
+        // The map header takes 3 bytes at most
+        if (body.size() + section.size() + 3 <= max_bytes) {
+            body += section;
+            count++;
+        }
+    }
+
+    std::string snapshot;
+    Msgpack::Writer writer(snapshot);
+    writer.Map(count);
+    snapshot += body;
+    return snapshot;
+}
+
+std::string Telemetry::BuildHeaderValue() {
+    auto snapshot = BuildSnapshot(TELEMETRY_HEADER_MAX_BYTES);
+    size_t length = 0;
+    std::string value((snapshot.size() + 2) / 3 * 4 + 1, '\0');
+    if (mbedtls_base64_encode((unsigned char*)value.data(), value.size(), &length,
+            (const unsigned char*)snapshot.data(), snapshot.size()) != 0) {
+        return std::string();
+    }
+    value.resize(length);
+    return value;
+}
+
+#endif // CONFIG_USE_TELEMETRY
@@ -0,0 +1,63 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <sdkconfig.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class Protocol;
+
+// The snapshot sent with the OTA check, base64 in a request header
+#define TELEMETRY_HEADER_MAX_BYTES 384
+// The backoff after failed publishes, in multiples of the interval
+#define TELEMETRY_MAX_BACKOFF 8
+
+/*
+ * Fleet telemetry, the metrics of the device in one compact snapshot.
+ *
+ * The snapshot is a MessagePack map of sections, each the same tree as the stats of the
+ * matching MCP tool: "sys" (uptime, reset reason, heap, snapshot count), "net" (link quality
+ * and reconnections), "cpu" (load and busiest tasks), "lat" (audio stage latencies), "heap"
+ * (per tag accounting) and "stk" (task stacks). Sections are added in that order while they
+ * fit in the size budget, so a small budget keeps the important ones.
+ *
+ * It is published every CONFIG_TELEMETRY_INTERVAL_SECONDS through Protocol::SendTelemetry(),
+ * only while the device is idle so a conversation never shares the link with it. A failed
+ * publish doubles the interval, up to TELEMETRY_MAX_BACKOFF times. A transport without a
+ * telemetry channel leaves the snapshot to the OTA check, which sends one in its header.
+ */
+class Telemetry {
+public:
+    static Telemetry& GetInstance() {
+        static Telemetry instance;
+        return instance;
+    }
+    Telemetry(const Telemetry&) = delete;
+    Telemetry& operator=(const Telemetry&) = delete;
+
+#if CONFIG_USE_TELEMETRY
+    // Main loop, every second
+    void OnClockTick(Protocol* protocol, bool idle);
+    // The sections that fit in max_bytes
+    std::string BuildSnapshot(size_t max_bytes);
+    // A snapshot for the OTA check header, base64
+    std::string BuildHeaderValue();
+#else
+    void OnClockTick(Protocol* protocol, bool idle) {}
+    std::string BuildSnapshot(size_t max_bytes) { return std::string(); }
+    std::string BuildHeaderValue() { return std::string(); }
+#endif
+
+private:
+    Telemetry() = default;
+
+#if CONFIG_USE_TELEMETRY
+    uint32_t ticks_ = 0;
+    uint32_t backoff_ = 1;
+    uint32_t snapshots_ = 0;
+#endif
+};
+
+#endif // TELEMETRY_H
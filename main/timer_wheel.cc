@@ -0,0 +1,170 @@
+#include "timer_wheel.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "TimerWheel"
+
+// The low half of an id is the index of its entry, the high half tells the reuses apart
+static inline uint16_t IndexOf(uint32_t id) {
+    return id & 0xFFFF;
+}
+
+uint32_t TimerWheel::Add(int64_t now_ms, uint32_t delay_ms, uint32_t period_ms, ScheduledTask&& callback) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t now_tick = now_ms / TIMER_WHEEL_TICK_MS;
+    if (active_ == 0) {
+        // Nothing to cascade, catch up with the clock at once
+        current_tick_ = std::max(current_tick_, now_tick);
+    }
+
+    uint16_t index;
+    if (!free_.empty()) {
+        index = free_.back();
+        free_.pop_back();
+    } else {
+        if (timers_.size() > 0xFFFF) {
+            ESP_LOGE(TAG, "Too many timers");
+            return 0;
+        }
+        index = timers_.size();
+        timers_.emplace_back();
+    }
+
+    if (++next_serial_ == 0) {
+        next_serial_ = 1;
+    }
+    auto& timer = timers_[index];
+    timer.callback = std::move(callback);
+    timer.id = (static_cast<uint32_t>(next_serial_) << 16) | index;
+    // Rounded up so a timer never runs early
+    timer.expires = std::max<uint64_t>((now_ms + delay_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS,
+        current_tick_ + 1);
+    timer.period = period_ms == 0 ? 0 : std::max<uint32_t>(period_ms / TIMER_WHEEL_TICK_MS, 1);
+    active_++;
+    File(index);
+    return timer.id;
+}
+
+bool TimerWheel::Cancel(uint32_t id) {
+    if (id == 0) {
+        return false;
+    }
+    ScheduledTask callback;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint16_t index = IndexOf(id);
+        if (index >= timers_.size() || timers_[index].id != id) {
+            return false;
+        }
+        // Destroyed without the lock, its captures may cancel other timers
+        callback = std::move(timers_[index].callback);
+        Release(index);
+    }
+    return true;
+}
+
+void TimerWheel::Run(int64_t now_ms, const std::function<void(ScheduledTask&)>& invoke) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    uint64_t now_tick = now_ms / TIMER_WHEEL_TICK_MS;
+    if (active_ == 0) {
+        current_tick_ = std::max(current_tick_, now_tick);
+        return;
+    }
+
+    while (current_tick_ < now_tick) {
+        uint64_t tick = ++current_tick_;
+        if ((tick & (kSlots - 1)) == 0) {
+            if (((tick >> kSlotBits) & (kSlots - 1)) == 0) {
+                Cascade(2, (tick >> (2 * kSlotBits)) & (kSlots - 1));
+            }
+            Cascade(1, (tick >> kSlotBits) & (kSlots - 1));
+        }
+        auto& slot = slots_[0][tick & (kSlots - 1)];
+        due_.insert(due_.end(), slot.begin(), slot.end());
+        slot.clear();
+    }
+
+    for (size_t i = 0; i < due_.size(); i++) {
+        auto entry = due_[i];
+        if (timers_[entry.index].id != entry.id) {
+            continue;
+        }
+        auto callback = std::move(timers_[entry.index].callback);
+        lock.unlock();
+        invoke(callback);
+        lock.lock();
+
+        // The entries may have moved while the callback added timers
+        auto& timer = timers_[entry.index];
+        if (timer.id != entry.id) {
+            // Cancelled while it ran
+            continue;
+        }
+        if (timer.period == 0) {
+            Release(entry.index);
+            continue;
+        }
+        timer.callback = std::move(callback);
+        timer.expires += timer.period;
+        if (timer.expires <= current_tick_) {
+            timer.expires += ((current_tick_ - timer.expires) / timer.period + 1) * timer.period;
+        }
+        File(entry.index);
+    }
+    due_.clear();
+}
+
+int64_t TimerWheel::NextDelayMs(int64_t now_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (active_ == 0) {
+        return -1;
+    }
+    uint64_t expires = UINT64_MAX;
+    for (auto& timer : timers_) {
+        if (timer.id != 0) {
+            expires = std::min(expires, timer.expires);
+        }
+    }
+    return std::max<int64_t>(static_cast<int64_t>(expires * TIMER_WHEEL_TICK_MS) - now_ms, 0);
+}
+
+size_t TimerWheel::Size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return active_;
+}
+
+void TimerWheel::File(uint16_t index) {
+    auto& timer = timers_[index];
+    uint64_t delta = timer.expires - current_tick_;
+    SlotEntry entry = { index, timer.id };
+    if (delta < kSlots) {
+        slots_[0][timer.expires & (kSlots - 1)].push_back(entry);
+    } else if (delta < (1 << (2 * kSlotBits))) {
+        slots_[1][(timer.expires >> kSlotBits) & (kSlots - 1)].push_back(entry);
+    } else if (delta < (1 << (3 * kSlotBits))) {
+        slots_[2][(timer.expires >> (2 * kSlotBits)) & (kSlots - 1)].push_back(entry);
+    } else {
+        // Beyond the wheel, the slot cascaded last files it again
+        slots_[2][(current_tick_ >> (2 * kSlotBits)) & (kSlots - 1)].push_back(entry);
+    }
+}
+
+void TimerWheel::Cascade(int level, uint32_t slot) {
+    // Swapped out first, File() may put an entry back into the same slot
+    cascade_.swap(slots_[level][slot]);
+    for (auto& entry : cascade_) {
+        if (timers_[entry.index].id == entry.id) {
+            File(entry.index);
+        }
+    }
+    cascade_.clear();
+}
+
+void TimerWheel::Release(uint16_t index) {
+    auto& timer = timers_[index];
+    timer.callback.Reset();
+    timer.id = 0;
+    free_.push_back(index);
+    active_--;
+}
@@ -0,0 +1,74 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include "scheduled_task.h"
+
+#include <mutex>
+#include <functional>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Resolution of the wheel, timers due in the same tick run in one main loop wakeup
+#define TIMER_WHEEL_TICK_MS 10
+
+/*
+ * Hierarchical timer wheel of the main event loop.
+ *
+ * Three levels of 64 slots cover 640 ms, 41 s and 43 min at TIMER_WHEEL_TICK_MS; a timer is
+ * filed in the coarsest level its delay needs and cascades to the finer ones as its deadline
+ * approaches, so adding, cancelling and expiring are O(1). Longer delays wait in the last slot
+ * and are filed again when it cascades.
+ *
+ * Add() and Cancel() may be called from any task. Run() and NextDelayMs() are only called by
+ * the main event loop, which runs the callbacks without holding the lock, so a callback may
+ * add or cancel timers, including its own. A periodic timer keeps its phase, the periods it
+ * missed while the loop was busy are skipped.
+ */
+class TimerWheel {
+public:
+    // Returns the timer id, never 0
+    uint32_t Add(int64_t now_ms, uint32_t delay_ms, uint32_t period_ms, ScheduledTask&& callback);
+    // Returns false if the timer already ran, or was cancelled, 0 is ignored
+    bool Cancel(uint32_t id);
+
+    // Runs the callbacks due at now_ms through invoke
+    void Run(int64_t now_ms, const std::function<void(ScheduledTask&)>& invoke);
+    // Time until the next timer is due, -1 without timers
+    int64_t NextDelayMs(int64_t now_ms);
+    size_t Size();
+
+private:
+    static constexpr int kLevels = 3;
+    static constexpr int kSlotBits = 6;
+    static constexpr uint32_t kSlots = 1 << kSlotBits;
+
+    struct Timer {
+        ScheduledTask callback;
+        uint64_t expires = 0;       // In ticks
+        uint32_t period = 0;        // In ticks, 0 for a one-shot timer
+        uint32_t id = 0;            // 0 when the entry is free
+    };
+
+    // A timer filed in a slot, stale once the timer is cancelled and its entry reused
+    struct SlotEntry {
+        uint16_t index;
+        uint32_t id;
+    };
+
+    std::mutex mutex_;
+    std::vector<Timer> timers_;
+    std::vector<uint16_t> free_;
+    std::vector<SlotEntry> slots_[kLevels][kSlots];
+    std::vector<SlotEntry> due_;
+    std::vector<SlotEntry> cascade_;
+    uint64_t current_tick_ = 0;
+    uint16_t next_serial_ = 0;
+    size_t active_ = 0;
+
+    void File(uint16_t index);
+    void Cascade(int level, uint32_t slot);
+    void Release(uint16_t index);
+};
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,228 @@
+#include "trace_recorder.h"
+
+#if CONFIG_USE_TRACE_RECORDER
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_cpu.h>
+#include <esp_heap_caps.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <string>
+#include <new>
+#include <algorithm>
+
+#include "task_placement.h"
+
+#define TAG "TraceRecorder"
+
+namespace {
+
+struct __attribute__((packed)) WireEvent {
+    uint8_t type;
+    uint8_t core;
+    uint16_t name;
+    uint16_t task;
+    uint16_t dropped;
+    uint32_t timestamp_us;
+    int32_t value;
+};
+
+struct __attribute__((packed)) WireName {
+    uint8_t type;
+    uint8_t length;
+    uint16_t id;
+};
+
+} // namespace
+
+TraceRecorder::~TraceRecorder() {
+    if (task_ != nullptr) {
+        TaskPlacements::Delete(kTaskTraceRecorder, task_);
+    }
+    for (auto& ring : rings_) {
+        if (ring.events != nullptr) {
+            heap_caps_free(ring.events);
+        }
+    }
+    if (udp_sockfd_ >= 0) {
+        close(udp_sockfd_);
+    }
+}
+
+void TraceRecorder::Start() {
+    if (task_ != nullptr) {
+        return;
+    }
+
+    std::string server_addr = CONFIG_TRACE_UDP_SERVER;
+    size_t colon_pos = server_addr.find(':');
+    if (colon_pos == std::string::npos) {
+        ESP_LOGW(TAG, "Invalid server address: %s, should be IP:PORT", CONFIG_TRACE_UDP_SERVER);
+        return;
+    }
+    memset(&udp_server_addr_, 0, sizeof(udp_server_addr_));
+    udp_server_addr_.sin_family = AF_INET;
+    udp_server_addr_.sin_port = htons(std::stoi(server_addr.substr(colon_pos + 1)));
+    inet_pton(AF_INET, server_addr.substr(0, colon_pos).c_str(), &udp_server_addr_.sin_addr);
+    udp_sockfd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_sockfd_ < 0) {
+        ESP_LOGW(TAG, "Failed to create UDP socket: %d", errno);
+        return;
+    }
+
+    // Written by every traced task, so in internal RAM
+    for (auto& ring : rings_) {
+        void* events = heap_caps_malloc(sizeof(Event) * CONFIG_TRACE_RING_EVENTS, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        if (events == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate %d events", CONFIG_TRACE_RING_EVENTS);
+            return;
+        }
+        Event* ring_events = static_cast<Event*>(events);
+        for (int i = 0; i < CONFIG_TRACE_RING_EVENTS; i++) {
+            new (&ring_events[i]) Event();
+            ring_events[i].sequence.store(0, std::memory_order_relaxed);
+        }
+        ring.events = ring_events;
+    }
+
+    datagram_.reserve(TRACE_DATAGRAM_SIZE);
+    TaskPlacements::Create(kTaskTraceRecorder, [](void* arg) {
+        ((TraceRecorder*)arg)->SenderTask();
+    }, this, &task_);
+    ESP_LOGI(TAG, "Sending the trace to %s", CONFIG_TRACE_UDP_SERVER);
+}
+
+void TraceRecorder::Record(TraceEventType type, const char* name, int32_t value) {
+    // The rings are published by the sender task creation, nothing is recorded before Start()
+    if (task_ == nullptr) {
+        return;
+    }
+    // The task may move to the other core meanwhile, the ring stays consistent either way
+    int core = esp_cpu_get_core_id();
+    Ring& ring = rings_[core];
+    uint32_t head = ring.head.load(std::memory_order_relaxed);
+    do {
+        if (head - ring.tail.load(std::memory_order_acquire) >= CONFIG_TRACE_RING_EVENTS) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    } while (!ring.head.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    Event& event = ring.events[head % CONFIG_TRACE_RING_EVENTS];
+    event.type = type;
+    event.core = core;
+    event.name = name;
+    event.task = xTaskGetCurrentTaskHandle();
+    event.timestamp_us = (uint32_t)esp_timer_get_time();
+    event.value = value;
+    event.sequence.store(head + 1, std::memory_order_release);
+}
+
+void TraceRecorder::SenderTask() {
+    uint32_t reported_drops = 0;
+    int64_t reported_us = 0;
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(TRACE_FLUSH_INTERVAL_MS));
+        for (auto& ring : rings_) {
+            Drain(ring);
+        }
+        if (!datagram_.empty()) {
+            Send();
+        }
+
+        uint32_t dropped = dropped_.load(std::memory_order_relaxed);
+        int64_t now_us = esp_timer_get_time();
+        if (dropped != reported_drops && now_us - reported_us >= 1000000) {
+            ESP_LOGW(TAG, "%lu events dropped, raise TRACE_RING_EVENTS", dropped - reported_drops);
+            reported_drops = dropped;
+            reported_us = now_us;
+        }
+    }
+}
+
+void TraceRecorder::Drain(Ring& ring) {
+    uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+    while (true) {
+        Event& event = ring.events[tail % CONFIG_TRACE_RING_EVENTS];
+        // A slot still being written stops the drain, the rest goes with the next flush
+        if (event.sequence.load(std::memory_order_acquire) != tail + 1) {
+            break;
+        }
+        WireEvent wire = {
+            .type = event.type,
+            .core = event.core,
+            .name = GetNameId(event.name),
+            .task = GetTaskId(event.task),
+            .dropped = (uint16_t)dropped_.load(std::memory_order_relaxed),
+            .timestamp_us = event.timestamp_us,
+            .value = event.value,
+        };
+        ring.tail.store(++tail, std::memory_order_release);
+        Append(&wire, sizeof(wire));
+    }
+}
+
+uint16_t TraceRecorder::GetNameId(const char* name) {
+    auto it = std::find(names_.begin(), names_.end(), name);
+    if (it != names_.end()) {
+        return it - names_.begin();
+    }
+    uint16_t id = names_.size();
+    names_.push_back(name);
+    size_t length = std::min<size_t>(strlen(name), UINT8_MAX);
+    WireName wire = { .type = kTraceEventName, .length = (uint8_t)length, .id = id };
+    Append(&wire, sizeof(wire));
+    Append(name, length);
+    return id;
+}
+
+uint16_t TraceRecorder::GetTaskId(TaskHandle_t task) {
+    auto it = std::find(tasks_.begin(), tasks_.end(), task);
+    if (it != tasks_.end()) {
+        return it - tasks_.begin();
+    }
+    uint16_t id = tasks_.size();
+    tasks_.push_back(task);
+
+    // The task may be gone by now, its name is only looked up among the live ones
+    std::string name = "task" + std::to_string(id);
+    UBaseType_t count = uxTaskGetNumberOfTasks();
+    std::vector<TaskStatus_t> status(count + 4);
+    count = uxTaskGetSystemState(status.data(), status.size(), nullptr);
+    for (UBaseType_t i = 0; i < count; i++) {
+        if (status[i].xHandle == task) {
+            name = status[i].pcTaskName;
+            break;
+        }
+    }
+    WireName wire = { .type = kTraceEventTaskName, .length = (uint8_t)name.size(), .id = id };
+    Append(&wire, sizeof(wire));
+    Append(name.data(), name.size());
+    return id;
+}
+
+void TraceRecorder::Append(const void* data, size_t size) {
+    if (!datagram_.empty() && datagram_.size() + size > TRACE_DATAGRAM_SIZE) {
+        Send();
+    }
+    if (datagram_.empty()) {
+        uint32_t sequence = datagram_sequence_++;
+        datagram_.insert(datagram_.end(), TRACE_MAGIC, TRACE_MAGIC + 4);
+        datagram_.insert(datagram_.end(), (uint8_t*)&sequence, (uint8_t*)&sequence + sizeof(sequence));
+    }
+    datagram_.insert(datagram_.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+}
+
+void TraceRecorder::Send() {
+    ssize_t sent = sendto(udp_sockfd_, datagram_.data(), datagram_.size(), 0,
+                         (struct sockaddr*)&udp_server_addr_, sizeof(udp_server_addr_));
+    if (sent < 0) {
+        ESP_LOGW(TAG, "Failed to send the trace to %s: %d", CONFIG_TRACE_UDP_SERVER, errno);
+    }
+    datagram_.clear();
+}
+
+#endif // CONFIG_USE_TRACE_RECORDER
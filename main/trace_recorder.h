@@ -0,0 +1,134 @@
+#ifndef TRACE_RECORDER_H
+#define TRACE_RECORDER_H
+
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+#if CONFIG_USE_TRACE_RECORDER
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+// Datagrams stay below the Wi-Fi MTU, like the audio debugger's
+#define TRACE_DATAGRAM_SIZE 1400
+#define TRACE_MAGIC "TRCE"
+// How often the sender task drains the rings
+#define TRACE_FLUSH_INTERVAL_MS 50
+
+enum TraceEventType : uint8_t {
+    kTraceEventBegin = 0,
+    kTraceEventEnd,
+    kTraceEventCounter,
+    kTraceEventInstant,
+    // Only on the wire, the names of the event and task ids
+    kTraceEventName,
+    kTraceEventTaskName,
+};
+
+/*
+ * Timeline of the tasks, see scripts/trace_server.py which turns it into a Chrome / Perfetto
+ * JSON trace.
+ *
+ * Begin()/End(), Counter() and Instant() write a 24 byte event into the ring of the calling
+ * core. The writers reserve their slot with a compare-and-swap and commit it with a sequence
+ * number, so recording takes no lock and never waits: with the ring full the event is dropped
+ * and counted. The names must be string literals, only the pointer is recorded.
+ *
+ * A low priority task drains the rings every TRACE_FLUSH_INTERVAL_MS and sends the events to
+ * CONFIG_TRACE_UDP_SERVER, with the name of an event or a task sent ahead of its first use.
+ *
+ * Datagram: "TRCE", uint32 datagram sequence, then records of
+ *   uint8 type, uint8 core, uint16 name id, uint16 task id, uint16 dropped so far,
+ *   uint32 timestamp (us since boot, wraps), int32 counter value
+ * or, for kTraceEventName / kTraceEventTaskName, uint8 type, uint8 length, uint16 id, chars[length]
+ * all little endian.
+ *
+ * Without CONFIG_USE_TRACE_RECORDER every method is an empty inline.
+ */
+class TraceRecorder {
+public:
+    static TraceRecorder& GetInstance() {
+        static TraceRecorder instance;
+        return instance;
+    }
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+#if CONFIG_USE_TRACE_RECORDER
+    // Called once the network is up
+    void Start();
+
+    void Begin(const char* name) { Record(kTraceEventBegin, name, 0); }
+    void End(const char* name) { Record(kTraceEventEnd, name, 0); }
+    void Counter(const char* name, int32_t value) { Record(kTraceEventCounter, name, value); }
+    void Instant(const char* name) { Record(kTraceEventInstant, name, 0); }
+#else
+    void Start() {}
+    void Begin(const char* name) {}
+    void End(const char* name) {}
+    void Counter(const char* name, int32_t value) {}
+    void Instant(const char* name) {}
+#endif
+
+private:
+    TraceRecorder() = default;
+
+#if CONFIG_USE_TRACE_RECORDER
+    ~TraceRecorder();
+
+    struct Event {
+        std::atomic<uint32_t> sequence;     // Index + 1 once the slot is written
+        uint8_t type;
+        uint8_t core;
+        const char* name;
+        TaskHandle_t task;
+        uint32_t timestamp_us;
+        int32_t value;
+    };
+
+    struct Ring {
+        Event* events = nullptr;
+        std::atomic<uint32_t> head = 0;     // The next slot to reserve
+        std::atomic<uint32_t> tail = 0;     // The next slot to send, only moved by the sender task
+    };
+
+    Ring rings_[portNUM_PROCESSORS];
+    std::atomic<uint32_t> dropped_ = 0;
+    int udp_sockfd_ = -1;
+    struct sockaddr_in udp_server_addr_;
+    TaskHandle_t task_ = nullptr;
+
+    // Only touched by the sender task
+    std::vector<uint8_t> datagram_;
+    uint32_t datagram_sequence_ = 0;
+    std::vector<const char*> names_;
+    std::vector<TaskHandle_t> tasks_;
+
+    void Record(TraceEventType type, const char* name, int32_t value);
+    void SenderTask();
+    void Drain(Ring& ring);
+    uint16_t GetNameId(const char* name);
+    uint16_t GetTaskId(TaskHandle_t task);
+    void Append(const void* data, size_t size);
+    void Send();
+#endif
+};
+
+// Begin and End of a block, e.g. TraceScope trace("opus_decode");
+class TraceScope {
+public:
+    explicit TraceScope(const char* name) : name_(name) { TraceRecorder::GetInstance().Begin(name_); }
+    ~TraceScope() { TraceRecorder::GetInstance().End(name_); }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* name_;
+};
+
+#endif // TRACE_RECORDER_H
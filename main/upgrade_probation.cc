@@ -0,0 +1,125 @@
+#include "upgrade_probation.h"
+
+#if CONFIG_USE_OTA_PROBATION
+
+#include "application.h"
+
+#include <esp_log.h>
+#include <esp_ota_ops.h>
+#include <esp_heap_caps.h>
+
+#include <algorithm>
+#include <cstdio>
+
+#define TAG "UpgradeProbation"
+
+// Interval of the main loop latency probes
+#define OTA_PROBATION_PROBE_MS 500
+
+UpgradeProbation::~UpgradeProbation() {
+    if (timer_ != nullptr) {
+        esp_timer_stop(timer_);
+        esp_timer_delete(timer_);
+    }
+}
+
+void UpgradeProbation::Start(int64_t boot_ms) {
+    if (timer_ != nullptr) {
+        return;
+    }
+    start_us_ = esp_timer_get_time();
+    boot_ms_ = boot_ms;
+    starved_start_ = Application::GetInstance().GetAudioService().GetPlaybackStarved();
+    max_loop_delay_ms_ = 0;
+
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            auto self = (UpgradeProbation*)arg;
+            // A probe still waiting means the loop is blocked, its delay already grows
+            if (self->probe_pending_.exchange(true)) {
+                return;
+            }
+            // Opening the channel and the main thread tools block the loop by design, only the
+            // idle latency tells about the image
+            bool idle = Application::GetInstance().GetDeviceState() == kDeviceStateIdle;
+            int64_t posted_us = idle ? esp_timer_get_time() : 0;
+            Application::GetInstance().Schedule([self, posted_us]() {
+                self->Probe(posted_us);
+            });
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "upgrade_probation",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer_));
+    esp_timer_start_periodic(timer_, OTA_PROBATION_PROBE_MS * 1000);
+    ESP_LOGI(TAG, "New image on probation for %d s, boot took %lld ms", CONFIG_OTA_PROBATION_SECONDS, boot_ms);
+}
+
+void UpgradeProbation::Probe(int64_t posted_us) {
+    probe_pending_ = false;
+    if (timer_ == nullptr) {
+        return;
+    }
+    // Also a conversation started meanwhile may have held it
+    if (posted_us != 0 && Application::GetInstance().GetDeviceState() == kDeviceStateIdle) {
+        int delay_ms = (esp_timer_get_time() - posted_us) / 1000;
+        max_loop_delay_ms_ = std::max(max_loop_delay_ms_, delay_ms);
+    }
+    if (esp_timer_get_time() - start_us_ >= (int64_t)CONFIG_OTA_PROBATION_SECONDS * 1000000) {
+        Finish();
+    }
+}
+
+const char* UpgradeProbation::Check(char* detail, size_t size) {
+    if (boot_ms_ > CONFIG_OTA_PROBATION_MAX_BOOT_MS) {
+        snprintf(detail, size, "%lld ms > %d ms", boot_ms_, CONFIG_OTA_PROBATION_MAX_BOOT_MS);
+        return "boot time";
+    }
+    size_t min_free = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+    if (min_free < CONFIG_OTA_PROBATION_MIN_FREE_INTERNAL) {
+        snprintf(detail, size, "%u < %d bytes", (unsigned)min_free, CONFIG_OTA_PROBATION_MIN_FREE_INTERNAL);
+        return "internal heap";
+    }
+    if (max_loop_delay_ms_ > CONFIG_OTA_PROBATION_MAX_LOOP_DELAY_MS) {
+        snprintf(detail, size, "%d ms > %d ms", max_loop_delay_ms_, CONFIG_OTA_PROBATION_MAX_LOOP_DELAY_MS);
+        return "idle main loop latency";
+    }
+    uint32_t starved = Application::GetInstance().GetAudioService().GetPlaybackStarved() - starved_start_;
+    if (starved > CONFIG_OTA_PROBATION_MAX_PLAYBACK_STARVED) {
+        snprintf(detail, size, "%lu > %d", (unsigned long)starved, CONFIG_OTA_PROBATION_MAX_PLAYBACK_STARVED);
+        return "playback starved";
+    }
+    snprintf(detail, size, "boot %lld ms, internal heap min %u bytes, idle loop delay max %d ms, playback starved %lu",
+        boot_ms_, (unsigned)min_free, max_loop_delay_ms_, (unsigned long)starved);
+    return nullptr;
+}
+
+// Main loop
+void UpgradeProbation::Finish() {
+    char detail[128];
+    const char* failed = Check(detail, sizeof(detail));
+    if (failed == nullptr) {
+        esp_timer_stop(timer_);
+        esp_timer_delete(timer_);
+        timer_ = nullptr;
+        ESP_LOGI(TAG, "Probation passed: %s", detail);
+        esp_ota_mark_app_valid_cancel_rollback();
+        return;
+    }
+    // The probes go on meanwhile, the rollback waits for the conversation to end
+    if (Application::GetInstance().GetDeviceState() != kDeviceStateIdle) {
+        return;
+    }
+    ESP_LOGE(TAG, "Probation failed on the %s (%s), rolling back", failed, detail);
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+    // Only returns when there is no image to go back to
+    ESP_LOGE(TAG, "No image to roll back to, keeping this one");
+    esp_timer_stop(timer_);
+    esp_timer_delete(timer_);
+    timer_ = nullptr;
+    esp_ota_mark_app_valid_cancel_rollback();
+}
+
+#endif // CONFIG_USE_OTA_PROBATION
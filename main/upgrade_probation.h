@@ -0,0 +1,62 @@
+#ifndef UPGRADE_PROBATION_H
+#define UPGRADE_PROBATION_H
+
+#include <sdkconfig.h>
+#include <esp_timer.h>
+
+#include <atomic>
+#include <cstdint>
+
+/*
+ * The probation of a freshly upgraded image, before its rollback is cancelled.
+ *
+ * An image that boots and reaches the server is not necessarily a good one, a build can run
+ * short of CPU or memory and stutter. So with CONFIG_USE_OTA_PROBATION the first boot of a new
+ * image (ESP_OTA_IMG_PENDING_VERIFY) does not mark it valid after the version check. It runs
+ * for CONFIG_OTA_PROBATION_SECONDS first and checks:
+ * - the boot time, from power-on to the end of the boot sequence
+ * - the lowest free internal heap since boot
+ * - the main loop latency while idle, a probe is scheduled every OTA_PROBATION_PROBE_MS and
+ *   timed, the probes of the other states only keep the window going
+ * - the playback starving while the decoder still had frames, over the success sound played at
+ *   the end of the boot and whatever else plays in the window
+ * A pass marks the image valid, a failure rolls back to the previous image and reboots once
+ * the device is idle. A reset during the window rolls back too, the bootloader does it.
+ *
+ * Start() is called by the main task, the probes run on the main loop. Without
+ * CONFIG_USE_OTA_PROBATION every method is an empty inline.
+ */
+class UpgradeProbation {
+public:
+    UpgradeProbation() = default;
+    UpgradeProbation(const UpgradeProbation&) = delete;
+    UpgradeProbation& operator=(const UpgradeProbation&) = delete;
+
+#if CONFIG_USE_OTA_PROBATION
+    ~UpgradeProbation();
+    void Start(int64_t boot_ms);
+    bool IsRunning() const { return timer_ != nullptr; }
+#else
+    void Start(int64_t boot_ms) {}
+    bool IsRunning() const { return false; }
+#endif
+
+private:
+#if CONFIG_USE_OTA_PROBATION
+    esp_timer_handle_t timer_ = nullptr;
+    // Set by the timer when it schedules a probe, cleared by the probe
+    std::atomic<bool> probe_pending_ = false;
+    // Only touched by the main loop after Start(), the loop delay is the idle one
+    int64_t start_us_ = 0;
+    int64_t boot_ms_ = 0;
+    uint32_t starved_start_ = 0;
+    int max_loop_delay_ms_ = 0;
+
+    void Probe(int64_t posted_us);
+    // The first threshold missed, nullptr when all pass
+    const char* Check(char* detail, size_t size);
+    void Finish();
+#endif
+};
+
+#endif // UPGRADE_PROBATION_H
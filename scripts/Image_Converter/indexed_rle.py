@@ -0,0 +1,168 @@
+#!/usr/bin/env python3
+'''
+  Palette-indexed, run-length coded images (IRLE) for the emojis and the icons, drawn by the
+  LvglIndexedImage decoder of the firmware (main/display/lvgl_display/lvgl_indexed_image.h)
+  without a full decode.
+
+  Little endian:
+    "IRLE", uint8 version 1, uint8 flags (bit 0: some colors are not opaque),
+    uint16 palette size, uint16 width, uint16 height,
+    palette: uint32 ARGB8888 per color, in the byte order of lv_color32_t (B, G, R, A)
+    uint32 offset of each row into the row data
+    row data, per row packets of one control byte:
+      0x00 - 0x7F: (c + 1) palette indices follow
+      0x80 - 0xFF: (c - 0x7F) pixels of the one palette index that follows
+
+  python indexed_rle.py happy.png sad.png -o output            # output/happy.irle ...
+  python indexed_rle.py happy.png -o output --c-array          # output/happy.c, an lv_image_dsc_t
+'''
+import argparse
+import os
+import struct
+
+from PIL import Image
+
+MAGIC = b"IRLE"
+VERSION = 1
+FLAG_ALPHA = 0x01
+MAX_COLORS = 256
+
+
+def _quantize(img, colors):
+    img = img.convert("RGBA")
+    # The fully transparent pixels are one color, the edges do not spend the palette on them
+    pixels = [p if p[3] else (0, 0, 0, 0) for p in img.getdata()]
+    unique = {}
+    for p in pixels:
+        if p not in unique:
+            unique[p] = len(unique)
+            if len(unique) > colors:
+                break
+    if len(unique) <= colors:
+        return list(unique), bytes(unique[p] for p in pixels)
+
+    clean = Image.new("RGBA", img.size)
+    clean.putdata(pixels)
+    quantized = clean.quantize(colors=colors, method=Image.Quantize.FASTOCTREE)
+    indices = quantized.tobytes()
+    rgba = quantized.getpalette("RGBA")
+    used = max(indices) + 1
+    palette = [tuple(rgba[i * 4:i * 4 + 4]) for i in range(used)]
+    return palette, indices
+
+
+def _encode_row(row):
+    out = bytearray()
+    literal = bytearray()
+
+    def flush_literal():
+        while literal:
+            chunk = literal[:128]
+            out.append(len(chunk) - 1)
+            out.extend(chunk)
+            del literal[:128]
+
+    i = 0
+    while i < len(row):
+        run = 1
+        while i + run < len(row) and row[i + run] == row[i] and run < 128:
+            run += 1
+        # A run of two costs as much as two literals
+        if run >= 3:
+            flush_literal()
+            out.append(0x80 | (run - 1))
+            out.append(row[i])
+            i += run
+        else:
+            literal.append(row[i])
+            i += 1
+    flush_literal()
+    return out
+
+
+def encode(img, colors=MAX_COLORS):
+    """The IRLE data of a PIL image"""
+    colors = max(1, min(colors, MAX_COLORS))
+    width, height = img.size
+    if width > 0xFFFF or height > 0xFFFF:
+        raise ValueError(f"Image too large: {width}x{height}")
+    palette, indices = _quantize(img, colors)
+    flags = FLAG_ALPHA if any(a != 255 for _, _, _, a in palette) else 0
+
+    rows = bytearray()
+    offsets = []
+    for y in range(height):
+        offsets.append(len(rows))
+        rows.extend(_encode_row(indices[y * width:(y + 1) * width]))
+
+    data = bytearray(MAGIC)
+    data += struct.pack("<BBHHH", VERSION, flags, len(palette), width, height)
+    for r, g, b, a in palette:
+        data += bytes((b, g, r, a))
+    for offset in offsets:
+        data += struct.pack("<I", offset)
+    data += rows
+    return bytes(data)
+
+
+def encode_file(filename, colors=MAX_COLORS):
+    with Image.open(filename) as img:
+        return encode(img, colors), img.size
+
+
+def write_c_array(data, size, name, filename):
+    width, height = size
+    lines = []
+    for i in range(0, len(data), 16):
+        lines.append("    " + ", ".join(f"0x{b:02x}" for b in data[i:i + 16]) + ",")
+    body = "\n".join(lines)
+    with open(filename, "w") as f:
+        f.write(f'''#include "lvgl.h"
+
+// IRLE image, drawn by the LvglIndexedImage decoder of the firmware
+
+#ifndef LV_ATTRIBUTE_MEM_ALIGN
+#define LV_ATTRIBUTE_MEM_ALIGN
+#endif
+
+static const LV_ATTRIBUTE_MEM_ALIGN uint8_t {name}_map[] = {{
+{body}
+}};
+
+const lv_image_dsc_t {name} = {{
+    .header = {{
+        .magic = LV_IMAGE_HEADER_MAGIC,
+        .cf = LV_COLOR_FORMAT_RAW_ALPHA,
+        .w = {width},
+        .h = {height},
+    }},
+    .data_size = sizeof({name}_map),
+    .data = {name}_map,
+}};
+''')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='将图片转换为调色板索引 + RLE 压缩的 IRLE 格式')
+    parser.add_argument('images', nargs='+', help='输入图片')
+    parser.add_argument('--output', '-o', default='output', help='输出目录 (默认: output)')
+    parser.add_argument('--colors', type=int, default=MAX_COLORS, help='调色板颜色数 (默认: 256)')
+    parser.add_argument('--c-array', action='store_true', help='输出 C 数组 (lv_image_dsc_t) 而不是 .irle 文件')
+    args = parser.parse_args()
+
+    os.makedirs(args.output, exist_ok=True)
+    for filename in args.images:
+        data, size = encode_file(filename, args.colors)
+        name = os.path.splitext(os.path.basename(filename))[0]
+        if args.c_array:
+            output = os.path.join(args.output, name + ".c")
+            write_c_array(data, size, name.replace("-", "_"), output)
+        else:
+            output = os.path.join(args.output, name + ".irle")
+            with open(output, "wb") as f:
+                f.write(data)
+        print(f"{filename}: {size[0]}x{size[1]}, {os.path.getsize(filename)} -> {len(data)} bytes, {output}")
+
+
+if __name__ == "__main__":
+    main()
@@ -5,6 +5,7 @@ import os
 import tempfile
 import sys
 from LVGLImage import LVGLImage, ColorFormat, CompressMethod
+import indexed_rle
 
 HELP_TEXT = """LVGL图片转换工具使用说明：
 
@@ -17,6 +18,7 @@ HELP_TEXT = """LVGL图片转换工具使用说明：
 
 4. 颜色格式：选择“自动识别”会根据图片是否透明自动选择，或手动指定
    除非你了解这个选项，否则建议使用自动识别，不然可能会出现一些意想不到的问题……
+   IRLE 为调色板索引 + RLE 压缩格式，由固件的 LvglIndexedImage 解码器直接绘制，不占用图片缓存
 
 5. 压缩方式：选择NONE或RLE压缩
    除非你了解这个选项，否则建议保持默认NONE不压缩
@@ -56,7 +58,7 @@ class ImageConverterApp:
         # 颜色格式
         ttk.Label(settings_frame, text="颜色格式:").grid(row=0, column=2, padx=2)
         ttk.Combobox(settings_frame, textvariable=self.color_format,
-                    values=["自动识别", "RGB565", "RGB565A8"], width=10).grid(row=0, column=3, padx=2)
+                    values=["自动识别", "RGB565", "RGB565A8", "IRLE"], width=10).grid(row=0, column=3, padx=2)
 
         # 压缩方式
         ttk.Label(settings_frame, text="压缩方式:").grid(row=0, column=4, padx=2)
@@ -206,6 +208,14 @@ class ImageConverterApp:
                     
                     # 处理颜色格式
                     color_format_str = self.color_format.get()
+                    base_name = os.path.splitext(os.path.basename(file_path))[0]
+                    if color_format_str == "IRLE":
+                        data = indexed_rle.encode(img)
+                        output_c_path = os.path.join(self.output_dir.get(), f"{base_name}.c")
+                        indexed_rle.write_c_array(data, img.size, base_name.replace("-", "_"), output_c_path)
+                        success_count += 1
+                        print(f"成功转换: {base_name}.c, {len(data)} 字节\n")
+                        continue
                     if color_format_str == "自动识别":
                         # 检测透明通道
                         has_alpha = img.mode in ('RGBA', 'LA') or (img.mode == 'P' and 'transparency' in img.info)
@@ -224,7 +234,6 @@ class ImageConverterApp:
                             cf = ColorFormat.RGB565
 
                     # 保存调整后的图片
-                    base_name = os.path.splitext(os.path.basename(file_path))[0]
                     output_image_path = os.path.join(self.output_dir.get(), f"{base_name}_{width}x{height}.png")
                     img.save(output_image_path, 'PNG')
 
@@ -0,0 +1,258 @@
+#!/usr/bin/env python3
+"""
+声波配网解调基准测试
+
+对比固件的两种 AFSK 解调: 旧的浮点 Goertzel (每比特重置窗口) 与现在的定点滑动窗口 + 比特相位同步。
+定点模型与 main/boards/common/afsk_demod.cc 的整数运算逐步一致, 旧模型对应改动前的实现。
+
+录音可以是 sonic_wifi_config.html 生成的 wav (44.1kHz), 也可以是 graphic.py 保存的设备录音
+(received_audio.wav, 16kHz), 先转换到设备读取的 16kHz。不给录音时按 sonic_wifi_config.html 的方式合成。
+每段录音在不同信噪比下加白噪声, 随机起始偏移, 统计完整解出文本的比例:
+
+    python3 benchmark.py                                  # 合成 "MyWifi\\npassword"
+    python3 benchmark.py wifi.wav received_audio.wav --text "MyWifi\\npassword" --snr none 6 0 -6
+
+只用标准库, 不依赖 numpy。
+"""
+import argparse
+import math
+import random
+import struct
+import sys
+import time
+import wave
+
+MARK = 1800
+SPACE = 1500
+BIT_RATE = 100
+INPUT_RATE = 16000      # ReadAudioData(audio_data, 16000, ...)
+SAMPLE_RATE = 6400      # kAudioSampleRate
+WINDOW_SIZE = 64        # kWindowSize
+TIMING_PHASES = 8       # AudioSignalProcessor::kTimingPhases
+READ_SAMPLES = 480      # 30ms per read
+
+START_BITS = [0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 1, 0]
+END_BITS = [0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 1, 0, 0]
+
+
+def resample(samples, rate, target):
+    if rate == target:
+        return list(samples)
+    step = rate / target
+    out = []
+    p = 0.0
+    while p + 1 < len(samples):
+        k = int(p)
+        fr = p - k
+        out.append(samples[k] * (1 - fr) + samples[k + 1] * fr)
+        p += step
+    return out
+
+
+def load_wav(path):
+    with wave.open(path, "rb") as wf:
+        if wf.getsampwidth() != 2:
+            raise ValueError(f"{path}: only 16-bit PCM is supported")
+        channels = wf.getnchannels()
+        rate = wf.getframerate()
+        frames = wf.readframes(wf.getnframes())
+    samples = struct.unpack(f"<{len(frames) // 2}h", frames)[::channels]
+    return resample([s / 32768.0 for s in samples], rate, INPUT_RATE)
+
+
+def synthesize(text, rate=44100):
+    """与 sonic_wifi_config.html 的 afskModulate() 相同"""
+    data = list(text.encode("utf-8"))
+    full = [0x01, 0x02] + data + [sum(data) & 0xFF, 0x03, 0x04]
+    bits = [(b >> i) & 1 for b in full for i in range(7, -1, -1)]
+    per_bit = rate // BIT_RATE
+    samples = []
+    for i, bit in enumerate(bits):
+        freq = MARK if bit else SPACE
+        for j in range(per_bit):
+            samples.append(math.sin(2 * math.pi * freq * (i * per_bit + j) / rate))
+    return resample(samples, rate, INPUT_RATE)
+
+
+def prepare(samples, snr_db, rng, gain=0.3):
+    """随机起始偏移, 两遍发送 (页面循环播放), 按信噪比加白噪声, 转成 int16"""
+    signal = [0.0] * rng.randrange(2000) + samples + samples + [0.0] * 3200
+    rms = math.sqrt(sum(s * s for s in samples) / max(len(samples), 1)) * gain
+    noise = 0.0 if snr_db is None else rms / (10 ** (snr_db / 20))
+    out = []
+    for s in signal:
+        v = s * gain + (rng.gauss(0, noise) if noise else 0.0)
+        out.append(int(max(-1.0, min(1.0, v)) * 32767))
+    return out
+
+
+class FrameDecoder:
+    """AudioDataBuffer: 起始/结束标识, 校验和"""
+
+    def __init__(self):
+        self.state = "inactive"
+        self.window = []
+        self.bits = []
+        self.text = None
+
+    def feed(self, probability):
+        bit = 1 if probability > 0.5 else 0
+        self.window = (self.window + [bit])[-len(START_BITS):]
+        if self.state == "inactive":
+            if len(self.window) >= len(START_BITS):
+                self.state = "waiting"
+        elif self.state == "waiting":
+            if self.window == START_BITS:
+                self.window, self.bits = [], []
+                self.state = "receiving"
+        else:
+            self.bits.append(bit)
+            if self.window == END_BITS:
+                self.state = "inactive"
+                data = bytes(int("".join(map(str, self.bits[i:i + 8])), 2) for i in range(0, len(self.bits) // 8 * 8, 8))
+                self.window, self.bits = [], []
+                trailer = len(END_BITS) // 8
+                if len(data) >= trailer + 1 and sum(data[:-trailer - 1]) & 0xFF == data[-trailer - 1]:
+                    self.text = data[:-trailer - 1].decode("utf-8", errors="replace")
+            elif len(self.bits) >= 776:
+                self.window, self.bits = [], []
+                self.state = "inactive"
+
+
+def legacy_demod(pcm):
+    """旧实现: 16k 抽点到 6400, 浮点 Goertzel, 窗口满后每 64 个采样点判决一次并重置"""
+    step = INPUT_RATE / SAMPLE_RATE
+    coefficients = []
+    for freq in (MARK, SPACE):
+        w = 2 * math.pi * freq / SAMPLE_RATE
+        coefficients.append((math.cos(w), math.sin(w), 2 * math.cos(w)))
+    window = []
+    count = 0
+    for start in range(0, len(pcm) - READ_SAMPLES + 1, READ_SAMPLES):
+        last = 0
+        for k in range(READ_SAMPLES):
+            index = int(k / step)
+            if index + 1 <= last:
+                continue
+            last = index + 1
+            sample = float(pcm[start + k])
+            if len(window) < WINDOW_SIZE:
+                window.append(sample)
+                continue
+            window.pop(0)
+            window.append(sample)
+            count += 1
+            if count < SAMPLE_RATE // BIT_RATE:
+                continue
+            count = 0
+            amplitudes = []
+            for cos_w, sin_w, coef in coefficients:
+                s1 = s2 = 0.0
+                for x in window:
+                    s1, s2 = x + coef * s1 - s2, s1
+                amplitudes.append(math.hypot(cos_w * s1 - s2, sin_w * s1))
+            yield amplitudes[0] / (amplitudes[0] + amplitudes[1] + 1e-7)
+
+
+def firmware_demod(pcm):
+    """现在的实现: 平均降采样, Q14 定点 Goertzel, 滑动窗口, 比特相位同步"""
+    coefficients = [round(2 * math.cos(2 * math.pi * f / SAMPLE_RATE) * 16384) for f in (MARK, SPACE)]
+    samples_per_phase = SAMPLE_RATE // BIT_RATE // TIMING_PHASES
+    window = [0] * WINDOW_SIZE
+    position = filled = phase_count = phase = since_bit = best = 0
+    contrast_sum = [0] * TIMING_PHASES
+    decimation_phase = decimation_sum = decimation_count = 0
+    for x in pcm:
+        decimation_sum += x
+        decimation_count += 1
+        decimation_phase += SAMPLE_RATE
+        if decimation_phase < INPUT_RATE:
+            continue
+        decimation_phase -= INPUT_RATE
+        sample = int(decimation_sum / decimation_count)  # C++ 整数除法向零取整
+        decimation_sum = decimation_count = 0
+
+        window[position] = sample
+        position = (position + 1) % WINDOW_SIZE
+        filled = min(filled + 1, WINDOW_SIZE)
+        phase_count += 1
+        if phase_count < samples_per_phase:
+            continue
+        phase_count = 0
+        if filled < WINDOW_SIZE:
+            continue
+
+        powers = []
+        ordered = window[position:] + window[:position]
+        for coef in coefficients:
+            s1 = s2 = 0
+            for v in ordered:
+                s1, s2 = v + ((coef * s1) >> 14) - s2, s1
+            powers.append(max(s1 * s1 + s2 * s2 - ((coef * s1 * s2) >> 14), 0))
+        mark, space = powers
+        total = mark + space
+        contrast = (abs(mark - space) << 8) // total if total else 0
+        contrast_sum[phase] = contrast_sum[phase] - (contrast_sum[phase] >> 3) + contrast
+        if contrast_sum[phase] > contrast_sum[best]:
+            best = phase
+        since_bit += 1
+        aligned = phase == best and since_bit >= TIMING_PHASES // 2
+        if aligned or since_bit >= TIMING_PHASES + TIMING_PHASES // 2:
+            mark_amplitude, space_amplitude = math.sqrt(mark), math.sqrt(space)
+            yield mark_amplitude / (mark_amplitude + space_amplitude + 1.2e-7)
+            since_bit = 0
+        phase = (phase + 1) % TIMING_PHASES
+
+
+def decodes(demod, pcm, text):
+    decoder = FrameDecoder()
+    for probability in demod(pcm):
+        decoder.feed(probability)
+        if decoder.text is not None:
+            if text is None or decoder.text == text:
+                return True
+            decoder.text = None
+    return False
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark the acoustic WiFi provisioning demodulator")
+    parser.add_argument("recordings", nargs="*", help="wav recordings, synthesized when omitted")
+    parser.add_argument("--text", help="expected text, any decoded frame counts when omitted with recordings")
+    parser.add_argument("--snr", nargs="+", default=["none", "10", "6", "3", "0", "-3", "-6"],
+                        help="SNR of the added white noise in dB, none keeps the recording as it is")
+    parser.add_argument("--trials", type=int, default=10, help="trials per recording and SNR")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    text = args.text.encode().decode("unicode_escape") if args.text else None
+    if args.recordings:
+        sources = [(path, load_wav(path)) for path in args.recordings]
+    else:
+        text = text or "MyWifi\npassword"
+        sources = [("synthesized", synthesize(text))]
+
+    rng = random.Random(args.seed)
+    print(f"{'recording':<24} {'SNR':>6} {'legacy':>8} {'firmware':>9}")
+    cost = {"legacy": 0.0, "firmware": 0.0}
+    audio_seconds = 0.0
+    for name, samples in sources:
+        for snr in args.snr:
+            snr_db = None if snr == "none" else float(snr)
+            results = {"legacy": 0, "firmware": 0}
+            for _ in range(args.trials):
+                pcm = prepare(samples, snr_db, rng)
+                audio_seconds += len(pcm) / INPUT_RATE
+                for label, demod in (("legacy", legacy_demod), ("firmware", firmware_demod)):
+                    t0 = time.perf_counter()
+                    results[label] += decodes(demod, pcm, text)
+                    cost[label] += time.perf_counter() - t0
+            print(f"{name[-24:]:<24} {snr:>6} {results['legacy']:>5}/{args.trials:<2} {results['firmware']:>6}/{args.trials:<2}")
+            sys.stdout.flush()
+    # Python 的耗时只反映运算量的相对大小, 设备上定点模型省掉的是软件浮点运算
+    for label, seconds in cost.items():
+        print(f"{label}: {seconds / max(audio_seconds, 1e-9) * 1000:.1f} ms per second of audio (Python)")
+
+
+if __name__ == "__main__":
+    main()
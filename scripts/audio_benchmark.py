@@ -0,0 +1,82 @@
+#! /usr/bin/env python3
+"""
+Collects the results of the audio pipeline benchmark firmware (CONFIG_AUDIO_PIPELINE_BENCHMARK).
+
+Reads a serial log from a file or stdin, e.g.
+    idf.py monitor | tee bench.log
+    python scripts/audio_benchmark.py bench.log -o bench.json --commit $(git rev-parse --short HEAD)
+
+The report holds the summary, the per-second samples and their queue depth peaks, so it can be
+stored per commit and compared. With CONFIG_AUDIO_PIPELINE_BENCHMARK_WAKE_WORD it holds the
+summary and the list of detections instead.
+"""
+import argparse
+import json
+import sys
+
+PREFIX = "AUDIO_BENCH "
+
+
+def parse(lines):
+    samples = []
+    detections = []
+    summary = None
+    for line in lines:
+        index = line.find(PREFIX)
+        if index < 0:
+            continue
+        try:
+            record = json.loads(line[index + len(PREFIX):].strip())
+        except json.JSONDecodeError:
+            continue
+        if record.get("type") == "sample":
+            samples.append(record)
+        elif record.get("type") == "detection":
+            detections.append(record)
+        elif record.get("type") == "summary":
+            summary = record
+    return samples, detections, summary
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Collect the audio pipeline benchmark results")
+    parser.add_argument("log", nargs="?", help="serial log, stdin if omitted")
+    parser.add_argument("-o", "--output", help="JSON report, stdout if omitted")
+    parser.add_argument("--commit", help="commit the firmware was built from")
+    args = parser.parse_args()
+
+    if args.log:
+        with open(args.log, encoding="utf-8", errors="replace") as f:
+            samples, detections, summary = parse(f)
+    else:
+        samples, detections, summary = parse(sys.stdin)
+
+    if summary is None:
+        print("No benchmark summary found in the log", file=sys.stderr)
+        return 1
+
+    if summary.get("mode") == "wake_word":
+        report = {
+            "commit": args.commit,
+            "summary": summary,
+            "detections": detections,
+        }
+    else:
+        queues = ["encode_queue", "send_queue", "decode_queue", "playback_queue"]
+        report = {
+            "commit": args.commit,
+            "summary": summary,
+            "queue_peaks": {q: max((s.get(q, 0) for s in samples), default=0) for q in queues},
+            "samples": samples,
+        }
+    text = json.dumps(report, indent=2)
+    if args.output:
+        with open(args.output, "w", encoding="utf-8") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
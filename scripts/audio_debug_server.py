@@ -1,54 +1,108 @@
 import socket
+import struct
 import wave
 import argparse
 
 
 '''
-  Create a UDP socket and bind it to the server's IP:8000.
-  Listen for incoming messages and print them to the console.
-  Save the audio to a WAV file.
+  Receive the audio debugger datagrams (CONFIG_USE_AUDIO_DEBUGGER) on 0.0.0.0:PORT and save
+  every tapped stream (mic, reference, processed, playback) to its own WAV file.
+
+  Datagram: "ADBG", uint32 datagram sequence, then chunks of
+    uint8 stream, uint8 channels, uint16 samples, uint32 sample rate,
+    uint32 chunk sequence, uint32 timestamp_ms, int16 samples[]
+  Chunks lost on the link or dropped by the device show as gaps in the chunk sequence, they are
+  filled with silence so the streams stay aligned.
 '''
-def main(samplerate, channels):
-    # Create a UDP socket
-    server_socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
-    server_socket.bind(('0.0.0.0', 8000))
+MAGIC = b"ADBG"
+DATAGRAM_HEADER = struct.Struct("<4sI")
+CHUNK_HEADER = struct.Struct("<BBHIII")
+STREAM_NAMES = ["mic", "reference", "processed", "playback"]
+
+
+class StreamWriter:
+    def __init__(self, prefix, stream, channels, sample_rate):
+        name = STREAM_NAMES[stream] if stream < len(STREAM_NAMES) else f"stream{stream}"
+        self.filename = f"{prefix}{name}_{sample_rate}_{channels}.wav"
+        self.channels = channels
+        self.sample_rate = sample_rate
+        self.wav = wave.open(self.filename, "wb")
+        self.wav.setnchannels(channels)
+        self.wav.setsampwidth(2)
+        self.wav.setframerate(sample_rate)
+        self.next_sequence = None
+        self.last_samples = 0
+        self.lost = 0
+        self.chunks = 0
+
+    def write(self, sequence, samples, pcm):
+        if self.next_sequence is not None and sequence != self.next_sequence:
+            gap = (sequence - self.next_sequence) & 0xFFFFFFFF
+            if gap < 0x80000000:
+                self.lost += gap
+                self.wav.writeframes(b"\x00" * (gap * self.last_samples * 2))
+            else:
+                # Reordered, too late to be written
+                return
+        self.next_sequence = (sequence + 1) & 0xFFFFFFFF
+        self.last_samples = samples
+        self.chunks += 1
+        self.wav.writeframes(pcm)
+
+    def close(self):
+        self.wav.close()
+        print(f"{self.filename}: {self.chunks} chunks, {self.lost} lost")
 
-    # Create WAV file with parameters
-    filename = f"{samplerate}_{channels}.wav"
-    wav_file = wave.open(filename, "wb")
-    wav_file.setnchannels(channels)     # channels parameter
-    wav_file.setsampwidth(2)            # 2 bytes per sample (16-bit)
-    wav_file.setframerate(samplerate)   # samplerate parameter
 
-    print(f"Start saving audio from 0.0.0.0:8000 to {filename}...")
+def parse_datagram(message, writers, prefix):
+    if len(message) < DATAGRAM_HEADER.size:
+        return
+    magic, _ = DATAGRAM_HEADER.unpack_from(message, 0)
+    if magic != MAGIC:
+        print(f"Ignored {len(message)} bytes without the {MAGIC} header")
+        return
+    offset = DATAGRAM_HEADER.size
+    while offset + CHUNK_HEADER.size <= len(message):
+        stream, channels, samples, sample_rate, sequence, _ = CHUNK_HEADER.unpack_from(message, offset)
+        offset += CHUNK_HEADER.size
+        pcm = message[offset:offset + samples * 2]
+        offset += samples * 2
+        writer = writers.get(stream)
+        if writer is None or writer.channels != channels or writer.sample_rate != sample_rate:
+            if writer is not None:
+                writer.close()
+            writer = StreamWriter(prefix, stream, channels, sample_rate)
+            writers[stream] = writer
+            print(f"Saving {writer.filename}")
+        writer.write(sequence, samples, pcm)
+
+
+def main(port, prefix):
+    server_socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    server_socket.bind(('0.0.0.0', port))
+    writers = {}
+    print(f"Start saving audio from 0.0.0.0:{port}...")
 
     try:
         while True:
-            # Receive a message from the client
-            message, address = server_socket.recvfrom(8000)
-            
-            # Write PCM data to WAV file
-            wav_file.writeframes(message)
-
-            # Print length of the message
-            print(f"Received {len(message)} bytes from {address}")
-    
+            message, _ = server_socket.recvfrom(2048)
+            parse_datagram(message, writers, prefix)
+
     except KeyboardInterrupt:
         print("\nStopping recording...")
-    
+
     finally:
-        # Close files and socket
-        wav_file.close()
+        for writer in writers.values():
+            writer.close()
         server_socket.close()
-        print(f"WAV file '{filename}' saved successfully")
 
 
 if __name__ == "__main__":
-    parser = argparse.ArgumentParser(description='UDP音频数据接收器，保存为WAV文件')
-    parser.add_argument('--samplerate', '-s', type=int, default=16000, 
-                        help='采样率 (默认: 16000)')
-    parser.add_argument('--channels', '-c', type=int, default=2, 
-                        help='声道数 (默认: 2)')
-    
+    parser = argparse.ArgumentParser(description='UDP音频调试数据接收器，每个数据流保存为一个WAV文件')
+    parser.add_argument('--port', '-p', type=int, default=8000,
+                        help='UDP端口 (默认: 8000)')
+    parser.add_argument('--prefix', default='',
+                        help='WAV文件名前缀')
+
     args = parser.parse_args()
-    main(args.samplerate, args.channels)
+    main(args.port, args.prefix)
@@ -7,7 +7,8 @@ for the current board configuration.
 
 Usage:
     ./build_default_assets.py --sdkconfig <path> --builtin_text_font <font_name> \
-        --default_emoji_collection <collection_name> --output <output_path>
+        --default_emoji_collection <collection_name> --output <output_path> \
+        [--locale_dir <main/assets/locales/zh-CN>]
 """
 
 import argparse
@@ -17,8 +18,11 @@ import shutil
 import sys
 import json
 import struct
+import zlib
 from datetime import datetime
 
+import font_subset
+
 
 # =============================================================================
 # Pack model functions (from pack_model.py)
@@ -202,30 +206,99 @@ def process_sr_models(wakenet_model_dirs, multinet_model_dirs, build_dir, assets
         return None
 
 
-def process_text_font(text_font_file, assets_dir):
-    """Process text_font parameter"""
+def process_text_font(text_font_file, assets_dir, subset_options=None):
+    """
+    Process text_font parameter
+    With subset_options (locale_dir, charset, report) the font is cut down to the characters of the
+    locale and of the charset, the sizes go into the report dict
+    """
     if not text_font_file:
         return None
     
-    # Copy input file to build/assets directory
     font_filename = os.path.basename(text_font_file)
     font_dst = os.path.join(assets_dir, font_filename)
+    if subset_options and subset_text_font(text_font_file, font_dst, *subset_options):
+        return font_filename
+    
+    # Copy input file to build/assets directory
     if copy_file(text_font_file, font_dst):
         return font_filename
     return None
 
 
-def process_emoji_collection(emoji_collection_dir, assets_dir):
+def subset_text_font(text_font_file, font_dst, locale_dir, charset_file, report):
+    """Write the subset font to font_dst, False when the font has to be packed whole"""
+    with open(text_font_file, "rb") as f:
+        data = f.read()
+    order, warm = font_subset.build_char_order(locale_dir, charset_file)
+    report.update({
+        "font": os.path.basename(text_font_file),
+        "locale": os.path.basename(os.path.normpath(locale_dir)),
+        "charset": os.path.basename(charset_file) if charset_file else None,
+        "size_before": len(data),
+        "size_after": len(data),
+        "characters": len(order),
+    })
+    try:
+        output, stats = font_subset.subset_font(data, order, warm)
+    except (font_subset.FontFormatError, struct.error) as e:
+        print(f"  Note: {os.path.basename(text_font_file)} is not in the binfont layout ({e}), packed whole")
+        report["subset"] = False
+        return False
+
+    with open(font_dst, "wb") as f:
+        f.write(output)
+    report.update(stats)
+    report["subset"] = True
+    report["size_after"] = len(output)
+    report["missing"] = font_subset.format_missing(stats["missing"])
+    print(f"Subset text font: {len(data)} -> {len(output)} bytes, "
+          f"{stats['glyphs_before']} -> {stats['glyphs_after']} glyphs for {report['locale']}")
+    if stats["missing"]:
+        print(f"  Warning: {len(stats['missing'])} characters not in the font: {report['missing']}")
+    if stats["kerning_dropped"]:
+        print("  Note: the kerning table is dropped from the subset font")
+    return True
+
+
+def load_indexed_rle():
+    """The IRLE encoder of scripts/Image_Converter, None when Pillow is missing"""
+    sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "Image_Converter"))
+    try:
+        import indexed_rle
+        return indexed_rle
+    except ImportError as e:
+        print(f"Warning: CONFIG_XIAOZHI_ASSETS_INDEXED_EMOJI needs Pillow ({e}), the emojis stay PNG")
+        return None
+
+
+def process_emoji_collection(emoji_collection_dir, assets_dir, indexed=False):
     """Process emoji_collection parameter"""
     if not emoji_collection_dir:
         return []
     
     emoji_list = []
+    indexed_rle = load_indexed_rle() if indexed else None
+    png_size = 0
+    irle_size = 0
     
     # Copy each image from input directory to build/assets directory
     for root, dirs, files in os.walk(emoji_collection_dir):
         for file in files:
-            if file.lower().endswith(('.png', '.gif')):
+            if indexed_rle and file.lower().endswith('.png'):
+                # Drawn by the IRLE decoder of the firmware, no PNG decode into the image cache
+                src_file = os.path.join(root, file)
+                data, _ = indexed_rle.encode_file(src_file)
+                file = os.path.splitext(file)[0] + ".irle"
+                with open(os.path.join(assets_dir, file), "wb") as f:
+                    f.write(data)
+                png_size += os.path.getsize(src_file)
+                irle_size += len(data)
+                emoji_list.append({
+                    "name": os.path.splitext(file)[0],
+                    "file": file
+                })
+            elif file.lower().endswith(('.png', '.gif')):
                 # Copy file
                 src_file = os.path.join(root, file)
                 dst_file = os.path.join(assets_dir, file)
@@ -239,6 +312,8 @@ def process_emoji_collection(emoji_collection_dir, assets_dir):
                         "file": file
                     })
     
+    if png_size:
+        print(f"  emojis: {png_size} bytes of PNG -> {irle_size} bytes of IRLE")
     return emoji_list
 
 
@@ -340,13 +415,28 @@ def compute_checksum(data):
 
 
 def sort_key(filename):
-    basename, extension = os.path.splitext(filename)
-    return extension, basename
+    # The firmware searches the asset table in place, it must be sorted by the name bytes
+    return filename.encode('utf-8')
+
+
+def compress_asset(data):
+    """
+    Raw deflate of an asset, None when it does not save at least an eighth of its size.
+    A compressed entry is 'ZC', the decompressed size (u32), then the deflate stream.
+    """
+    compressor = zlib.compressobj(9, zlib.DEFLATED, -15)
+    packed = compressor.compress(data) + compressor.flush()
+    if len(packed) + 4 > len(data) - len(data) // 8:
+        return None
+    return len(data).to_bytes(4, byteorder='little') + packed
 
 
-def pack_assets_simple(target_path, include_path, out_file, assets_path, max_name_len=32):
+def pack_assets_simple(target_path, include_path, out_file, assets_path, max_name_len=32, compress=False, keep_raw=()):
     """
     Simplified version of pack_assets that handles basic file packing
+
+    With compress, the entries that shrink are stored deflated, except those in keep_raw
+    (SR models and fonts, used in place in the mapped partition).
     """
     merged_data = bytearray()
     file_info_list = []
@@ -368,13 +458,21 @@ def pack_assets_simple(target_path, include_path, out_file, assets_path, max_nam
         file_name = os.path.basename(file_path)
         file_size = os.path.getsize(file_path)
 
+        with open(file_path, 'rb') as bin_file:
+            bin_data = bin_file.read()
+
+        packed = compress_asset(bin_data) if compress and file_name not in keep_raw else None
+        if packed is not None:
+            print(f'Compressed {file_name}: {file_size} -> {len(packed)} bytes')
+            file_info_list.append((file_name, len(merged_data), len(packed), 0, 0))
+            merged_data.extend(b'ZC')
+            merged_data.extend(packed)
+            continue
+
         file_info_list.append((file_name, len(merged_data), file_size, 0, 0))
         # Add 0x5A5A prefix to merged_data
         merged_data.extend(b'\x5A' * 2)
 
-        with open(file_path, 'rb') as bin_file:
-            bin_data = bin_file.read()
-
         merged_data.extend(bin_data)
 
     total_files = len(file_info_list)
@@ -547,6 +645,85 @@ def read_wake_word_type_from_sdkconfig(sdkconfig_path):
     return config_values
 
 
+def read_assets_compression_from_sdkconfig(sdkconfig_path):
+    """
+    Whether the assets entries are stored compressed (CONFIG_XIAOZHI_ASSETS_COMPRESSION)
+    """
+    if not os.path.exists(sdkconfig_path):
+        return False
+
+    with io.open(sdkconfig_path, "r") as f:
+        for line in f:
+            if line.strip() == 'CONFIG_XIAOZHI_ASSETS_COMPRESSION=y':
+                return True
+    return False
+
+
+def read_indexed_emoji_from_sdkconfig(sdkconfig_path):
+    """
+    Whether the PNG emojis are packed as IRLE images (CONFIG_XIAOZHI_ASSETS_INDEXED_EMOJI)
+    """
+    if not os.path.exists(sdkconfig_path):
+        return False
+
+    with io.open(sdkconfig_path, "r") as f:
+        for line in f:
+            if line.strip() == 'CONFIG_XIAOZHI_ASSETS_INDEXED_EMOJI=y':
+                return True
+    return False
+
+
+def read_font_subset_from_sdkconfig(sdkconfig_path):
+    """
+    The font subset settings (CONFIG_XIAOZHI_ASSETS_FONT_SUBSET, CONFIG_XIAOZHI_ASSETS_FONT_CHARSET)
+    Returns the charset file path ('' for none) or None when the subset is off
+    """
+    if not os.path.exists(sdkconfig_path):
+        return None
+
+    enabled = False
+    charset = ''
+    with io.open(sdkconfig_path, "r") as f:
+        for line in f:
+            line = line.strip()
+            if line == 'CONFIG_XIAOZHI_ASSETS_FONT_SUBSET=y':
+                enabled = True
+            elif line.startswith('CONFIG_XIAOZHI_ASSETS_FONT_CHARSET='):
+                charset = line.split('=', 1)[1].strip('"')
+    return charset if enabled else None
+
+
+def read_board_type_from_sdkconfig(sdkconfig_path):
+    """The selected CONFIG_BOARD_TYPE_*, for the reports"""
+    if not os.path.exists(sdkconfig_path):
+        return None
+
+    with io.open(sdkconfig_path, "r") as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith('CONFIG_BOARD_TYPE_') and line.endswith('=y'):
+                return line[len('CONFIG_BOARD_TYPE_'):-2].lower()
+    return None
+
+
+def write_font_report(report, board, output_path):
+    """Print the subset sizes and write them next to assets.bin, one report per board build"""
+    if not report:
+        return
+    report["board"] = board
+    saved = report["size_before"] - report["size_after"]
+    print(f"Text font report for {board or 'unknown board'}:")
+    print(f"  {report['font']} for {report['locale']}: {report['size_before']} -> {report['size_after']} bytes "
+          f"({saved / 1024:.1f}K less to flash, download and map)")
+    if report.get("subset"):
+        print(f"  glyphs: {report['glyphs_before']} -> {report['glyphs_after']}, "
+              f"status bar glyphs span {report['warm_span_before']} -> {report['warm_span_after']} bytes")
+    report_path = os.path.splitext(output_path)[0] + "_font_report.json"
+    with open(report_path, 'w', encoding='utf-8') as f:
+        json.dump(report, f, indent=4, ensure_ascii=False)
+    print(f"Generated: {report_path}")
+
+
 def read_custom_wake_word_from_sdkconfig(sdkconfig_path):
     """
     Read custom wake word configuration from sdkconfig
@@ -698,7 +875,7 @@ def get_emoji_collection_path(default_emoji_collection, xiaozhi_fonts_path):
         return None
 
 
-def build_assets_integrated(wakenet_model_paths, multinet_model_paths, text_font_path, emoji_collection_path, extra_files_path, output_path, multinet_model_info=None):
+def build_assets_integrated(wakenet_model_paths, multinet_model_paths, text_font_path, emoji_collection_path, extra_files_path, output_path, multinet_model_info=None, compress=False, subset_options=None, indexed_emoji=False):
     """
     Build assets using integrated functions (no external dependencies)
     """
@@ -717,8 +894,8 @@ def build_assets_integrated(wakenet_model_paths, multinet_model_paths, text_font
         
         # Process each component
         srmodels = process_sr_models(wakenet_model_paths, multinet_model_paths, temp_build_dir, assets_dir) if (wakenet_model_paths or multinet_model_paths) else None
-        text_font = process_text_font(text_font_path, assets_dir) if text_font_path else None
-        emoji_collection = process_emoji_collection(emoji_collection_path, assets_dir) if emoji_collection_path else None
+        text_font = process_text_font(text_font_path, assets_dir, subset_options) if text_font_path else None
+        emoji_collection = process_emoji_collection(emoji_collection_path, assets_dir, indexed_emoji) if emoji_collection_path else None
         extra_files = process_extra_files(extra_files_path, assets_dir) if extra_files_path else None
         
         # Generate index.json
@@ -734,7 +911,9 @@ def build_assets_integrated(wakenet_model_paths, multinet_model_paths, text_font
         # Use simplified packing function
         include_path = config_data['include_path']
         image_file = config_data['image_file']
-        pack_assets_simple(assets_dir, include_path, image_file, "assets", int(config_data['name_length']))
+        keep_raw = [name for name in (srmodels, text_font) if name]
+        pack_assets_simple(assets_dir, include_path, image_file, "assets", int(config_data['name_length']),
+                           compress, keep_raw)
         
         # Copy final assets.bin to output location
         if os.path.exists(image_file):
@@ -768,6 +947,7 @@ def main():
     parser.add_argument('--esp_sr_model_path', help='Path to ESP-SR model directory')
     parser.add_argument('--xiaozhi_fonts_path', help='Path to xiaozhi-fonts component directory')
     parser.add_argument('--extra_files', help='Path to extra files directory to be included in assets')
+    parser.add_argument('--locale_dir', help='Locale directory of the firmware language, for the text font subset')
     
     args = parser.parse_args()
     
@@ -869,11 +1049,39 @@ def main():
         return
     
     # Build the assets
+    compress = read_assets_compression_from_sdkconfig(args.sdkconfig)
+    if compress:
+        print("  compression: enabled")
+    indexed_emoji = read_indexed_emoji_from_sdkconfig(args.sdkconfig)
+    if indexed_emoji:
+        print("  emoji format: IRLE")
+
+    # Subset the text font to the firmware language and the common characters
+    subset_options = None
+    font_report = {}
+    charset = read_font_subset_from_sdkconfig(args.sdkconfig)
+    if charset is not None and text_font_path:
+        if not args.locale_dir:
+            print("Warning: CONFIG_XIAOZHI_ASSETS_FONT_SUBSET is enabled but no --locale_dir, the font is packed whole")
+        else:
+            if charset and not os.path.isabs(charset):
+                # Relative to the project directory, like CUSTOM_ASSETS_FILE
+                charset = os.path.join(os.path.dirname(os.path.dirname(os.path.abspath(__file__))), charset)
+            if charset and not os.path.exists(charset):
+                print(f"Error: Font charset file not found: {charset}")
+                sys.exit(1)
+            print(f"  font subset: {os.path.basename(os.path.normpath(args.locale_dir))}"
+                  f"{' + ' + os.path.basename(charset) if charset else ''}")
+            subset_options = (args.locale_dir, charset or None, font_report)
+
     success = build_assets_integrated(wakenet_model_paths, multinet_model_paths, text_font_path, emoji_collection_path, 
-                                     extra_files_path, args.output, multinet_model_info)
+                                     extra_files_path, args.output, multinet_model_info, compress, subset_options,
+                                     indexed_emoji)
     
     if not success:
         sys.exit(1)
+
+    write_font_report(font_report, read_board_type_from_sdkconfig(args.sdkconfig), args.output)
     
     print("Build completed successfully!")
 
@@ -0,0 +1,309 @@
+#!/usr/bin/env python3
+"""
+Subset a text font for the strings of one locale and a common character set
+
+The characters come, most frequent first, from:
+  1. the status bar strings, drawn all the time (the device warms its glyph cache with them)
+  2. printable ASCII
+  3. the other strings of the locale and of the en-US fallback, by number of occurrences
+  4. the common character set file, in its own order (one or more characters per line)
+
+The kept glyphs are renumbered in that order, so the glyphs that are drawn together sit
+together in the glyf table and share the flash cache lines.
+
+The font has to be in the LVGL binfont table layout (head, cmap, loca, glyf, optional kern),
+a font in any other layout is packed whole by the assets build. The kerning
+table is dropped from a subset font.
+
+Usage:
+    ./font_subset.py --font <font.bin> --locale_dir <main/assets/locales/zh-CN> \
+        [--charset <common.txt>] --output <subset.bin>
+"""
+
+import argparse
+import json
+import os
+import struct
+import sys
+
+
+# The status bar strings, the same as Assets::Apply warms the glyph cache with
+WARM_STRING_KEYS = ["STANDBY", "CONNECTING", "LISTENING", "SPEAKING"]
+WARM_EXTRA_TEXT = "0123456789:%"
+ASCII_TEXT = "".join(chr(c) for c in range(0x20, 0x7F))
+
+TABLE_HEADER = struct.Struct("<I4s")
+CMAP_SUBTABLE = struct.Struct("<IIHHHBB")
+
+CMAP_FORMAT0_FULL = 0
+CMAP_SPARSE_FULL = 1
+CMAP_FORMAT0_TINY = 2
+CMAP_SPARSE_TINY = 3
+
+# Offsets in the head table, after the table header
+HEAD_TABLES_COUNT = 4
+HEAD_INDEX_TO_LOC_FORMAT = 26
+
+
+class FontFormatError(Exception):
+    pass
+
+
+def load_locale_strings(locale_dir):
+    """The strings of language.json of the locale, {} when there is none"""
+    path = os.path.join(locale_dir, "language.json")
+    if not os.path.exists(path):
+        return {}
+    with open(path, "r", encoding="utf-8") as f:
+        return json.load(f).get("strings", {})
+
+
+def load_charset(charset_file):
+    """The characters of the charset file in file order, line breaks and spaces ignored"""
+    if not charset_file:
+        return ""
+    with open(charset_file, "r", encoding="utf-8") as f:
+        return "".join(ch for ch in f.read() if not ch.isspace())
+
+
+def build_char_order(locale_dir, charset_file=None):
+    """
+    The code points to keep, most frequent first, and the code points of the status bar
+    """
+    strings = load_locale_strings(locale_dir)
+    # Missing keys fall back to en-US on the device, their glyphs are needed too
+    fallback_dir = os.path.join(os.path.dirname(os.path.abspath(locale_dir)), "en-US")
+    if os.path.abspath(fallback_dir) != os.path.abspath(locale_dir):
+        for key, value in load_locale_strings(fallback_dir).items():
+            strings.setdefault(key, value)
+
+    order = []
+    seen = set()
+
+    def add(text):
+        for ch in text:
+            cp = ord(ch)
+            if cp not in seen and not (ch.isspace() and ch != " "):
+                seen.add(cp)
+                order.append(cp)
+
+    warm_text = "".join(strings.get(key, "") for key in WARM_STRING_KEYS) + WARM_EXTRA_TEXT
+    add(warm_text)
+    warm = list(order)
+    add(ASCII_TEXT)
+
+    counts = {}
+    for value in strings.values():
+        if isinstance(value, str):
+            for ch in value:
+                counts[ch] = counts.get(ch, 0) + 1
+    # Most used first, ties by code point so the order is stable from build to build
+    add(ch for ch, _ in sorted(counts.items(), key=lambda item: (-item[1], ord(item[0]))))
+
+    add(load_charset(charset_file))
+    return order, warm
+
+
+def read_table(data, offset, tag):
+    if offset + TABLE_HEADER.size > len(data):
+        raise FontFormatError(f"no {tag} table at {offset}")
+    length, label = TABLE_HEADER.unpack_from(data, offset)
+    if label != tag.encode() or length < TABLE_HEADER.size or offset + length > len(data):
+        raise FontFormatError(f"no {tag} table at {offset}")
+    return length
+
+
+class BinFont:
+    """The tables of an LVGL binfont, enough to map code points to the raw glyph records"""
+
+    def __init__(self, data):
+        self.data = data
+        self.head_length = read_table(data, 0, "head")
+        head = data[TABLE_HEADER.size:self.head_length]
+        if len(head) < HEAD_INDEX_TO_LOC_FORMAT + 1:
+            raise FontFormatError("short head table")
+        self.tables_count = struct.unpack_from("<H", head, HEAD_TABLES_COUNT)[0]
+        index_to_loc_format = head[HEAD_INDEX_TO_LOC_FORMAT]
+
+        self.cmap_start = self.head_length
+        cmap_length = read_table(data, self.cmap_start, "cmap")
+        self.glyph_ids = self._read_cmap(self.cmap_start, cmap_length)
+
+        loca_start = self.cmap_start + cmap_length
+        loca_length = read_table(data, loca_start, "loca")
+        self.glyf_start = loca_start + loca_length
+        glyf_length = read_table(data, self.glyf_start, "glyf")
+
+        count = struct.unpack_from("<I", data, loca_start + TABLE_HEADER.size)[0]
+        fmt = "<H" if index_to_loc_format == 0 else "<I"
+        size = struct.calcsize(fmt)
+        base = loca_start + TABLE_HEADER.size + 4
+        if base + count * size > loca_start + loca_length:
+            raise FontFormatError("short loca table")
+        offsets = [struct.unpack_from(fmt, data, base + i * size)[0] for i in range(count)]
+        offsets.append(glyf_length)
+        self.glyphs = []
+        for i in range(count):
+            start, end = offsets[i], offsets[i + 1]
+            if start > end or end > glyf_length:
+                raise FontFormatError(f"glyph {i} is out of the glyf table")
+            self.glyphs.append((start, end))
+
+    def _read_cmap(self, start, length):
+        glyph_ids = {}
+        base = start + TABLE_HEADER.size
+        subtables = struct.unpack_from("<I", self.data, base)[0]
+        for i in range(subtables):
+            (data_offset, range_start, range_length, glyph_id_start, entries,
+             format_type, _) = CMAP_SUBTABLE.unpack_from(self.data, base + 4 + i * CMAP_SUBTABLE.size)
+            table = start + data_offset
+            if format_type == CMAP_FORMAT0_TINY:
+                for rcp in range(range_length):
+                    glyph_ids[range_start + rcp] = glyph_id_start + rcp
+            elif format_type == CMAP_FORMAT0_FULL:
+                for rcp in range(entries):
+                    ofs = self.data[table + rcp]
+                    if ofs != 0 or rcp == 0:
+                        glyph_ids[range_start + rcp] = glyph_id_start + ofs
+            elif format_type in (CMAP_SPARSE_FULL, CMAP_SPARSE_TINY):
+                codes = struct.unpack_from(f"<{entries}H", self.data, table)
+                if format_type == CMAP_SPARSE_FULL:
+                    ofs = struct.unpack_from(f"<{entries}H", self.data, table + entries * 2)
+                else:
+                    ofs = range(entries)
+                for code, glyph_ofs in zip(codes, ofs):
+                    glyph_ids[range_start + code] = glyph_id_start + glyph_ofs
+            else:
+                raise FontFormatError(f"unknown cmap format {format_type}")
+        if base + 4 + subtables * CMAP_SUBTABLE.size > start + length:
+            raise FontFormatError("short cmap table")
+        return glyph_ids
+
+    def glyph_record(self, glyph_id):
+        start, end = self.glyphs[glyph_id]
+        return self.data[self.glyf_start + start:self.glyf_start + end]
+
+
+def pad4(data):
+    return data + b"\x00" * (-len(data) % 4)
+
+
+def build_cmap(code_points):
+    """Sparse full subtables over the (code point, glyph id) pairs sorted by code point"""
+    pairs = sorted(code_points.items())
+    groups = []
+    for cp, glyph_id in pairs:
+        # The code points of a subtable are u16 offsets from its range start
+        if not groups or cp - groups[-1][0][0] > 0xFFFF or len(groups[-1]) == 0xFFFF:
+            groups.append([])
+        groups[-1].append((cp, glyph_id))
+
+    headers = b""
+    payload = b""
+    data_offset = TABLE_HEADER.size + 4 + len(groups) * CMAP_SUBTABLE.size
+    for group in groups:
+        range_start = group[0][0]
+        glyph_id_start = min(glyph_id for _, glyph_id in group)
+        if max(glyph_id for _, glyph_id in group) - glyph_id_start > 0xFFFF:
+            raise FontFormatError("glyph ids of a cmap subtable span more than 16 bits")
+        body = struct.pack(f"<{len(group)}H", *(cp - range_start for cp, _ in group))
+        body += struct.pack(f"<{len(group)}H", *(glyph_id - glyph_id_start for _, glyph_id in group))
+        headers += CMAP_SUBTABLE.pack(data_offset + len(payload), range_start, group[-1][0] - range_start + 1,
+                                      glyph_id_start, len(group), CMAP_SPARSE_FULL, 0)
+        payload += pad4(body)
+
+    body = struct.pack("<I", len(groups)) + headers + payload
+    return TABLE_HEADER.pack(TABLE_HEADER.size + len(body), b"cmap") + body
+
+
+def glyph_span(font, glyph_ids):
+    """Bytes of the glyf table from the first to the last byte of the given glyphs"""
+    ranges = [font.glyphs[glyph_id] for glyph_id in glyph_ids if glyph_id < len(font.glyphs)]
+    if not ranges:
+        return 0
+    return max(end for _, end in ranges) - min(start for start, _ in ranges)
+
+
+def subset_font(data, order, warm):
+    """
+    The subset font and its statistics, glyphs renumbered in the order of the code points
+    Raises FontFormatError when the font is not in the binfont layout
+    """
+    font = BinFont(data)
+    kept = [cp for cp in order if cp in font.glyph_ids]
+
+    # Glyph 0 stays the reserved empty glyph, code points sharing a glyph share the new one too
+    new_ids = {}
+    records = [font.glyph_record(0)]
+    code_points = {}
+    for cp in kept:
+        old_id = font.glyph_ids[cp]
+        if old_id not in new_ids:
+            new_ids[old_id] = len(records)
+            records.append(font.glyph_record(old_id))
+        code_points[cp] = new_ids[old_id]
+
+    glyf_body = b"".join(records)
+    glyf_length = TABLE_HEADER.size + len(glyf_body)
+    long_offsets = glyf_length > 0xFFFF
+    offsets = []
+    position = TABLE_HEADER.size
+    for record in records:
+        offsets.append(position)
+        position += len(record)
+    loca_body = struct.pack("<I", len(records)) + struct.pack(f"<{len(records)}{'I' if long_offsets else 'H'}", *offsets)
+    loca_body = pad4(loca_body)
+
+    head = bytearray(data[:font.head_length])
+    struct.pack_into("<H", head, TABLE_HEADER.size + HEAD_TABLES_COUNT, min(font.tables_count, 4))
+    head[TABLE_HEADER.size + HEAD_INDEX_TO_LOC_FORMAT] = 1 if long_offsets else 0
+
+    output = (bytes(head) + build_cmap(code_points)
+              + TABLE_HEADER.pack(TABLE_HEADER.size + len(loca_body), b"loca") + loca_body
+              + TABLE_HEADER.pack(glyf_length, b"glyf") + glyf_body)
+
+    warm_old = {font.glyph_ids[cp] for cp in warm if cp in font.glyph_ids}
+    warm_new = {new_ids[glyph_id] for glyph_id in warm_old}
+    subset = BinFont(output)
+    stats = {
+        "glyphs_before": len(font.glyphs),
+        "glyphs_after": len(records),
+        "missing": [cp for cp in order if cp not in font.glyph_ids],
+        "warm_span_before": glyph_span(font, warm_old),
+        "warm_span_after": glyph_span(subset, warm_new),
+        "kerning_dropped": font.tables_count > 4,
+    }
+    return output, stats
+
+
+def format_missing(missing, limit=32):
+    text = "".join(chr(cp) for cp in missing[:limit])
+    return text + ("..." if len(missing) > limit else "")
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Subset a text font for one locale')
+    parser.add_argument('--font', required=True, help='The text font, in the LVGL binfont layout')
+    parser.add_argument('--locale_dir', required=True, help='The locale directory with language.json')
+    parser.add_argument('--charset', help='Common characters to keep, in frequency order')
+    parser.add_argument('--output', required=True, help='The subset font')
+    args = parser.parse_args()
+
+    with open(args.font, "rb") as f:
+        data = f.read()
+    order, warm = build_char_order(args.locale_dir, args.charset)
+    try:
+        output, stats = subset_font(data, order, warm)
+    except (FontFormatError, struct.error) as e:
+        print(f"Error: {args.font} can not be subset: {e}")
+        sys.exit(1)
+    with open(args.output, "wb") as f:
+        f.write(output)
+    print(f"{args.output}: {len(data)} -> {len(output)} bytes, "
+          f"{stats['glyphs_before']} -> {stats['glyphs_after']} glyphs")
+    if stats["missing"]:
+        print(f"  {len(stats['missing'])} characters not in the font: {format_missing(stats['missing'])}")
+
+
+if __name__ == "__main__":
+    main()
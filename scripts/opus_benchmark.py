@@ -0,0 +1,98 @@
+#! /usr/bin/env python3
+"""
+Collects the results of the Opus parameter sweep firmware (CONFIG_OPUS_BENCHMARK).
+
+Reads a serial log from a file or stdin, e.g.
+    idf.py monitor | tee opus-s3.log
+    python scripts/opus_benchmark.py opus-s3.log opus-c3.log -o opus.json
+
+Prints a Markdown table per target, one row per setting and placement, and optionally writes
+all the results as a JSON report. Logs of several chips can be passed at once.
+"""
+import argparse
+import json
+import sys
+
+PREFIX = "OPUS_BENCH "
+
+COLUMNS = [
+    ("placement", lambda r: r["placement"]),
+    ("rate", lambda r: r["sample_rate"]),
+    ("frame ms", lambda r: r["frame_ms"]),
+    ("cx", lambda r: r["complexity"]),
+    ("bitrate", lambda r: r["bitrate"]),
+    ("fec", lambda r: "y" if r["fec"] else ""),
+    ("dtx", lambda r: "y" if r["dtx"] else ""),
+    ("enc cycles", lambda r: r["encode"]["cycles_avg"]),
+    ("enc max us", lambda r: r["encode"]["us_max"]),
+    ("enc load %", lambda r: f'{r["encode_load_pct"]:.1f}'),
+    ("dec cycles", lambda r: r["decode"]["cycles_avg"]),
+    ("conceal cycles", lambda r: r["conceal"]["cycles_avg"]),
+    ("kbps", lambda r: f'{r["actual_bitrate"] / 1000:.1f}'),
+    ("dtx frames", lambda r: r["dtx_frames"]),
+    ("stack", lambda r: r["stack_used"]),
+    ("heap int", lambda r: r["heap_internal"]),
+    ("heap psram", lambda r: r["heap_psram"]),
+]
+
+
+def parse(lines):
+    results = []
+    for line in lines:
+        index = line.find(PREFIX)
+        if index < 0:
+            continue
+        try:
+            record = json.loads(line[index + len(PREFIX):].strip())
+        except json.JSONDecodeError:
+            continue
+        if record.get("type") == "result":
+            results.append(record)
+    return results
+
+
+def print_table(target, results):
+    print(f"## {target} ({results[0]['cpu_mhz']} MHz)\n")
+    print("| " + " | ".join(name for name, _ in COLUMNS) + " |")
+    print("|" + "---|" * len(COLUMNS))
+    for record in results:
+        cells = [str(value(record)) for _, value in COLUMNS]
+        if not record.get("ok", True):
+            cells[0] += " (failed)"
+        print("| " + " | ".join(cells) + " |")
+    print()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Collect the Opus parameter sweep results")
+    parser.add_argument("logs", nargs="*", help="serial logs, stdin if omitted")
+    parser.add_argument("-o", "--output", help="JSON report of all the results")
+    args = parser.parse_args()
+
+    results = []
+    if args.logs:
+        for path in args.logs:
+            with open(path, encoding="utf-8", errors="replace") as f:
+                results.extend(parse(f))
+    else:
+        results.extend(parse(sys.stdin))
+
+    if not results:
+        print("No Opus benchmark results found in the log", file=sys.stderr)
+        return 1
+
+    targets = {}
+    for record in results:
+        targets.setdefault(record["target"], []).append(record)
+    for target, records in targets.items():
+        print_table(target, records)
+
+    if args.output:
+        with open(args.output, "w", encoding="utf-8") as f:
+            json.dump({"results": results}, f, indent=2)
+            f.write("\n")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
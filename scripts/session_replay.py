@@ -0,0 +1,229 @@
+import argparse
+import asyncio
+import base64
+import json
+import socket
+import struct
+import time
+
+
+'''
+  Record the server sessions of a device (CONFIG_USE_SESSION_CAPTURE) and replay them to it.
+
+  record: receive the capture datagrams on 0.0.0.0:PORT and write one JSON line per record,
+    {"t_ms", "kind": "json" | "audio" | "channel_opened" | "channel_closed", and "text" for json,
+     "data" (base64 Opus), "sample_rate", "frame_duration", "timestamp" for audio}
+  The sessions of both transports are captured, WebSocket and MQTT + UDP.
+
+  replay: serve a recorded session as a WebSocket server. Point the websocket url of the device to
+    ws://HOST:PORT/ (the "websocket" section of the OTA answer or the websocket settings). On the
+    hello of the device the recorded server hello is sent back, rewritten for the WebSocket
+    transport, then the recorded JSON messages and audio frames follow at their recorded pace,
+    divided by --speed. The audio is framed in the binary protocol version of the device hello.
+    The audio of the device is read and dropped. With --stats the device is asked for
+    self.get_session_stats at the end, its decode lag, audio queues and UI update latency.
+
+  Datagram: "SCAP", uint32 datagram sequence, uint32 record sequence, uint16 fragment index,
+    uint16 fragment count, then a part of the record:
+    uint32 time_ms, uint8 kind, uint8 frame_duration, uint16 sample_rate, uint32 timestamp,
+    uint32 data size, data
+'''
+MAGIC = b"SCAP"
+DATAGRAM_HEADER = struct.Struct("<4sIIHH")
+RECORD_HEADER = struct.Struct("<IBBHII")
+KINDS = ["json", "audio", "channel_opened", "channel_closed"]
+STATS_REQUEST_ID = 0x5E55
+
+
+def record(port, output):
+    server_socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    server_socket.bind(('0.0.0.0', port))
+    fragments = {}
+    next_sequence = None
+    lost_datagrams = 0
+    records = 0
+    print(f"Start recording the sessions from 0.0.0.0:{port}, Ctrl-C to stop...")
+
+    with open(output, "w") as f:
+        try:
+            while True:
+                message, _ = server_socket.recvfrom(2048)
+                if len(message) < DATAGRAM_HEADER.size:
+                    continue
+                magic, sequence, record_sequence, index, count = DATAGRAM_HEADER.unpack_from(message, 0)
+                if magic != MAGIC:
+                    print(f"Ignored {len(message)} bytes without the {MAGIC} header")
+                    continue
+                if next_sequence is not None and sequence != next_sequence:
+                    lost_datagrams += (sequence - next_sequence) & 0xFFFFFFFF
+                next_sequence = (sequence + 1) & 0xFFFFFFFF
+
+                parts = fragments.setdefault(record_sequence, {})
+                parts[index] = message[DATAGRAM_HEADER.size:]
+                if len(parts) < count:
+                    continue
+                # The incomplete records before this one lost a fragment
+                for stale in [s for s in fragments if s < record_sequence]:
+                    del fragments[stale]
+                data = b"".join(parts[i] for i in range(count))
+                del fragments[record_sequence]
+
+                time_ms, kind, frame_duration, sample_rate, timestamp, size = RECORD_HEADER.unpack_from(data, 0)
+                payload = data[RECORD_HEADER.size:RECORD_HEADER.size + size]
+                line = {"t_ms": time_ms, "kind": KINDS[kind] if kind < len(KINDS) else str(kind)}
+                if kind == 0:
+                    line["text"] = payload.decode("utf-8", "replace")
+                elif kind == 1:
+                    line.update(data=base64.b64encode(payload).decode(), sample_rate=sample_rate,
+                                frame_duration=frame_duration, timestamp=timestamp)
+                f.write(json.dumps(line, ensure_ascii=False) + "\n")
+                f.flush()
+                records += 1
+
+        except KeyboardInterrupt:
+            print("\nStopping recording...")
+
+        finally:
+            server_socket.close()
+            print(f"{output}: {records} records, {lost_datagrams} datagrams lost")
+
+
+def load_sessions(capture):
+    # A session starts with a server hello and ends when the audio channel closes
+    sessions = []
+    current = None
+    with open(capture) as f:
+        for line in f:
+            item = json.loads(line)
+            if item["kind"] == "json":
+                item["message"] = json.loads(item["text"])
+                if item["message"].get("type") == "hello":
+                    current = [item]
+                    sessions.append(current)
+                    continue
+            if current is None:
+                continue
+            current.append(item)
+            if item["kind"] == "channel_closed":
+                current = None
+    return sessions
+
+
+def websocket_hello(hello, device_hello):
+    hello = dict(hello)
+    hello["transport"] = "websocket"
+    hello.pop("udp", None)
+    hello.pop("cacheable", None)
+    if "session_id" in device_hello:
+        hello["session_id"] = device_hello["session_id"]
+    return hello
+
+
+def audio_frame(version, item):
+    payload = base64.b64decode(item["data"])
+    if version == 2:
+        return struct.pack(">HHIII", 2, 0, 0, item["timestamp"], len(payload)) + payload
+    if version == 3:
+        return struct.pack(">BBH", 0, 0, len(payload)) + payload
+    if version == 4:
+        frame = struct.pack(">IH", item["timestamp"], len(payload)) + payload
+        return struct.pack(">BBH", 0, 1, len(frame)) + frame
+    return payload
+
+
+async def replay(capture, port, session_index, speed, stats):
+    import websockets
+
+    sessions = load_sessions(capture)
+    if not sessions:
+        print(f"{capture}: no session with a server hello")
+        return
+    for i, session in enumerate(sessions):
+        duration = (session[-1]["t_ms"] - session[0]["t_ms"]) / 1000
+        audio = sum(1 for item in session if item["kind"] == "audio")
+        print(f"Session {i}: {len(session)} records, {audio} audio frames, {duration:.1f} s")
+    session = sessions[session_index]
+    done = asyncio.Event()
+
+    async def handler(websocket, *args):
+        stats_reply = asyncio.get_running_loop().create_future()
+
+        async def read_device():
+            # The device hello first, then its audio and its answers
+            async for message in websocket:
+                if isinstance(message, bytes):
+                    continue
+                item = json.loads(message)
+                payload = item.get("payload", {})
+                if item.get("type") == "mcp" and payload.get("id") == STATS_REQUEST_ID and not stats_reply.done():
+                    stats_reply.set_result(payload.get("result", payload.get("error")))
+
+        device_hello = json.loads(await websocket.recv())
+        version = device_hello.get("version", 1)
+        print(f"Device hello, protocol version {version}, replaying session {session_index} at {speed}x")
+        reader = asyncio.create_task(read_device())
+
+        loop = asyncio.get_running_loop()
+        start = loop.time()
+        t0 = session[0]["t_ms"]
+        late_ms = 0
+        for item in session:
+            delay = start + (item["t_ms"] - t0) / 1000 / speed - loop.time()
+            if delay > 0:
+                await asyncio.sleep(delay)
+            else:
+                late_ms = max(late_ms, -delay * 1000)
+            if item["kind"] == "json":
+                message = item["message"]
+                if message.get("type") == "hello":
+                    message = websocket_hello(message, device_hello)
+                await websocket.send(json.dumps(message, ensure_ascii=False))
+            elif item["kind"] == "audio":
+                await websocket.send(audio_frame(version, item))
+        print(f"Replayed {len(session)} records in {loop.time() - start:.1f} s, at most {late_ms:.0f} ms late")
+
+        if stats:
+            request = {"jsonrpc": "2.0", "id": STATS_REQUEST_ID, "method": "tools/call",
+                       "params": {"name": "self.get_session_stats", "arguments": {"reset": True}}}
+            await websocket.send(json.dumps({"session_id": device_hello.get("session_id", ""),
+                                             "type": "mcp", "payload": request}))
+            try:
+                result = await asyncio.wait_for(stats_reply, 10)
+                # The tool result is a text content holding the JSON of the counters
+                for content in result.get("content", []):
+                    print(json.dumps(json.loads(content["text"]), indent=2))
+            except asyncio.TimeoutError:
+                print("No answer to self.get_session_stats, is CONFIG_USE_SESSION_CAPTURE set?")
+        reader.cancel()
+        await websocket.close()
+        done.set()
+
+    async with websockets.serve(handler, "0.0.0.0", port, max_size=None):
+        print(f"Waiting for the device on ws://0.0.0.0:{port}/ ...")
+        await done.wait()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description='录制设备的服务器会话，并以WebSocket服务器回放')
+    subparsers = parser.add_subparsers(dest="command", required=True)
+    record_parser = subparsers.add_parser("record", help="接收UDP会话数据并保存")
+    record_parser.add_argument('--port', '-p', type=int, default=8003,
+                               help='UDP端口 (默认: 8003)')
+    record_parser.add_argument('--output', '-o', default=f"session_{time.strftime('%Y%m%d_%H%M%S')}.jsonl",
+                               help='输出文件')
+    replay_parser = subparsers.add_parser("replay", help="回放录制的会话")
+    replay_parser.add_argument('capture', help='录制的会话文件')
+    replay_parser.add_argument('--port', '-p', type=int, default=8000,
+                               help='WebSocket端口 (默认: 8000)')
+    replay_parser.add_argument('--session', type=int, default=0,
+                               help='回放第几个会话 (默认: 0)')
+    replay_parser.add_argument('--speed', type=float, default=1.0,
+                               help='回放速度倍数 (默认: 1.0)')
+    replay_parser.add_argument('--stats', action='store_true',
+                               help='回放结束后读取设备的 self.get_session_stats')
+
+    args = parser.parse_args()
+    if args.command == "record":
+        record(args.port, args.output)
+    else:
+        asyncio.run(replay(args.capture, args.port, args.session, args.speed, args.stats))
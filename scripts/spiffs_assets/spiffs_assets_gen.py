@@ -57,8 +57,8 @@ def compute_checksum(data):
     return checksum
 
 def sort_key(filename):
-    basename, extension = os.path.splitext(filename)
-    return extension, basename
+    # The firmware searches the asset table in place, it must be sorted by the name bytes
+    return filename.encode('utf-8')
 
 def download_v8_script(convert_path):
     """
@@ -0,0 +1,127 @@
+import socket
+import struct
+import json
+import os
+import argparse
+
+
+'''
+  Receive the trace datagrams (CONFIG_USE_TRACE_RECORDER) on 0.0.0.0:PORT and write them as a
+  Chrome / Perfetto JSON trace when stopped with Ctrl-C. Open it in https://ui.perfetto.dev or
+  chrome://tracing.
+
+  Datagram: "TRCE", uint32 datagram sequence, then records of
+    uint8 type, uint8 core, uint16 name id, uint16 task id, uint16 dropped so far,
+    uint32 timestamp_us, int32 value
+  or, for the names (type 4 event, 5 task), uint8 type, uint8 length, uint16 id, chars[length]
+'''
+MAGIC = b"TRCE"
+DATAGRAM_HEADER = struct.Struct("<4sI")
+EVENT = struct.Struct("<BBHHHIi")
+NAME = struct.Struct("<BBH")
+BEGIN, END, COUNTER, INSTANT, EVENT_NAME, TASK_NAME = range(6)
+PHASES = {BEGIN: "B", END: "E", INSTANT: "i"}
+
+
+class TraceWriter:
+    def __init__(self):
+        self.names = {}
+        self.tasks = {}
+        self.events = []
+        self.last_timestamp = None
+        self.wraps = 0
+        self.next_sequence = None
+        self.lost_datagrams = 0
+        self.dropped = 0
+
+    def timestamp(self, timestamp_us):
+        # The device sends 32 bits of microseconds, they wrap every 71 minutes
+        if self.last_timestamp is not None and timestamp_us < self.last_timestamp and \
+                self.last_timestamp - timestamp_us > 0x80000000:
+            self.wraps += 1
+        self.last_timestamp = timestamp_us
+        return timestamp_us + self.wraps * 0x100000000
+
+    def parse(self, message):
+        if len(message) < DATAGRAM_HEADER.size:
+            return
+        magic, sequence = DATAGRAM_HEADER.unpack_from(message, 0)
+        if magic != MAGIC:
+            print(f"Ignored {len(message)} bytes without the {MAGIC} header")
+            return
+        if self.next_sequence is not None and sequence != self.next_sequence:
+            self.lost_datagrams += (sequence - self.next_sequence) & 0xFFFFFFFF
+        self.next_sequence = (sequence + 1) & 0xFFFFFFFF
+
+        offset = DATAGRAM_HEADER.size
+        while offset < len(message):
+            record_type = message[offset]
+            if record_type in (EVENT_NAME, TASK_NAME):
+                _, length, record_id = NAME.unpack_from(message, offset)
+                offset += NAME.size
+                name = message[offset:offset + length].decode("utf-8", "replace")
+                offset += length
+                if record_type == EVENT_NAME:
+                    self.names[record_id] = os.path.basename(name)
+                else:
+                    self.tasks[record_id] = name
+                continue
+            if offset + EVENT.size > len(message):
+                break
+            record_type, core, name_id, task_id, dropped, timestamp_us, value = EVENT.unpack_from(message, offset)
+            offset += EVENT.size
+            self.dropped = dropped
+            self.events.append((record_type, core, name_id, task_id, self.timestamp(timestamp_us), value))
+
+    def write(self, filename):
+        trace = []
+        for task_id, name in self.tasks.items():
+            trace.append({"ph": "M", "name": "thread_name", "pid": 0, "tid": task_id, "args": {"name": name}})
+        for record_type, core, name_id, task_id, timestamp_us, value in self.events:
+            name = self.names.get(name_id, f"name{name_id}")
+            event = {"name": name, "pid": 0, "tid": task_id, "ts": timestamp_us}
+            if record_type == COUNTER:
+                event["ph"] = "C"
+                event["args"] = {name: value}
+            elif record_type in PHASES:
+                event["ph"] = PHASES[record_type]
+                event["args"] = {"core": core}
+                if record_type == INSTANT:
+                    event["s"] = "t"
+            else:
+                continue
+            trace.append(event)
+        with open(filename, "w") as f:
+            json.dump({"traceEvents": trace, "displayTimeUnit": "ms"}, f)
+        print(f"{filename}: {len(self.events)} events of {len(self.tasks)} tasks, "
+              f"{self.lost_datagrams} datagrams lost, {self.dropped} events dropped on the device")
+
+
+def main(port, output):
+    server_socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    server_socket.bind(('0.0.0.0', port))
+    writer = TraceWriter()
+    print(f"Start recording the trace from 0.0.0.0:{port}, Ctrl-C to stop...")
+
+    try:
+        while True:
+            message, _ = server_socket.recvfrom(2048)
+            writer.parse(message)
+
+    except KeyboardInterrupt:
+        print("\nStopping recording...")
+
+    finally:
+        writer.write(output)
+        server_socket.close()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description='UDP跟踪数据接收器，保存为Chrome / Perfetto JSON跟踪文件')
+    parser.add_argument('--port', '-p', type=int, default=8001,
+                        help='UDP端口 (默认: 8001)')
+    parser.add_argument('--output', '-o', default='trace.json',
+                        help='输出文件 (默认: trace.json)')
+
+    args = parser.parse_args()
+    main(args.port, args.output)